@@ -98,12 +98,21 @@ struct
      upon this timeout value.  */
   unsigned long pinentry_timeout;
 
+  /* If not 0 a pinentry is kept running for this many seconds after
+     use so that it can be reused for the next prompt.  */
+  unsigned long pinentry_keep_alive;
+
   /* The default and maximum TTL of cache entries. */
   unsigned long def_cache_ttl;     /* Default. */
   unsigned long def_cache_ttl_ssh; /* for SSH. */
   unsigned long max_cache_ttl;     /* Default. */
   unsigned long max_cache_ttl_ssh; /* for SSH. */
 
+  /* The maximum lifetime and number of items of the cache of
+     unprotected keys.  A TTL of 0 disables that cache.  */
+  unsigned long key_cache_ttl;
+  unsigned int key_cache_max;
+
   /* Flag disallowing bypassing of the warning.  */
   int enforce_passphrase_constraints;
 
@@ -190,6 +199,7 @@ struct
 #define DBG_MEMSTAT_VALUE 128	/* show memory statistics */
 #define DBG_HASHING_VALUE 512	/* debug hashing operations */
 #define DBG_IPC_VALUE     1024  /* Enable Assuan debugging.  */
+#define DBG_TIMING_VALUE  32768 /* print startup timings */
 
 /* Test macros for the debug option.  */
 #define DBG_CRYPTO  (opt.debug & DBG_CRYPTO_VALUE)
@@ -197,6 +207,7 @@ struct
 #define DBG_CACHE   (opt.debug & DBG_CACHE_VALUE)
 #define DBG_HASHING (opt.debug & DBG_HASHING_VALUE)
 #define DBG_IPC     (opt.debug & DBG_IPC_VALUE)
+#define DBG_TIMING  (opt.debug & DBG_TIMING_VALUE)
 
 /* Forward reference for local definitions in command.c.  */
 struct server_local_s;
@@ -326,6 +337,28 @@ typedef enum
   }
 cache_mode_t;
 
+/* The counters and timers maintained by metrics.c.  */
+typedef enum
+  {
+    METRICS_CACHE_HIT,
+    METRICS_CACHE_MISS,
+    METRICS_KEY_CACHE_HIT,
+    METRICS_KEY_CACHE_MISS,
+    METRICS_BAD_PASSPHRASE,
+    METRICS_N_COUNTERS
+  }
+metrics_counter_t;
+
+typedef enum
+  {
+    METRICS_TIME_KEY_FILE_READ,
+    METRICS_TIME_UNPROTECT,
+    METRICS_TIME_PINENTRY,
+    METRICS_TIME_SCD,
+    METRICS_N_TIMERS
+  }
+metrics_timer_t;
+
 /* The TTL is seconds used for adding a new nonce mode cache item.  */
 #define CACHE_TTL_NONCE 120
 
@@ -385,6 +418,8 @@ void *get_agent_scd_notify_event (void);
 #endif
 void agent_sighup_action (void);
 int map_pk_openpgp_to_gcry (int openpgp_algo);
+int agent_begin_compute (void);
+void agent_end_compute (int started);
 
 /*-- command.c --*/
 gpg_error_t agent_inq_pinentry_launched (ctrl_t ctrl, unsigned long pid,
@@ -396,6 +431,8 @@ gpg_error_t agent_print_status (ctrl_t ctrl, const char *keyword,
      GPGRT_ATTR_PRINTF(3,4);
 void bump_key_eventcounter (void);
 void bump_card_eventcounter (void);
+unsigned int get_key_eventcounter (void);
+unsigned int get_card_eventcounter (void);
 void start_command_handler (ctrl_t, gnupg_fd_t, gnupg_fd_t);
 gpg_error_t pinentry_loopback (ctrl_t, const char *keyword,
                                unsigned char **buffer, size_t *size,
@@ -456,6 +493,7 @@ gpg_error_t agent_delete_key (ctrl_t ctrl, const char *desc_text,
 void initialize_module_call_pinentry (void);
 void agent_query_dump_state (void);
 void agent_reset_query (ctrl_t ctrl);
+void agent_release_idle_pinentry (int force);
 int pinentry_active_p (ctrl_t ctrl, int waitseconds);
 gpg_error_t agent_askpin (ctrl_t ctrl,
                           const char *desc_text, const char *prompt_text,
@@ -484,6 +522,20 @@ int agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode);
 void agent_store_cache_hit (const char *key);
+void agent_flush_key_cache (void);
+void agent_put_key_cache (ctrl_t ctrl, const unsigned char *grip,
+                          const struct stat *st,
+                          const unsigned char *key, size_t keylen);
+unsigned char *agent_get_key_cache (ctrl_t ctrl, const unsigned char *grip,
+                                    const struct stat *st, size_t *r_keylen);
+
+
+/*-- metrics.c --*/
+unsigned long long metrics_start (void);
+void metrics_count (metrics_counter_t what);
+void metrics_time (metrics_timer_t what, unsigned long long start);
+void metrics_time_command (const char *name, unsigned long long start);
+char *metrics_format (void);
 
 
 /*-- pksign.c --*/
@@ -515,6 +567,8 @@ gpg_error_t agent_protect_and_store (ctrl_t ctrl, gcry_sexp_t s_skey,
 
 /*-- protect.c --*/
 void set_s2k_calibration_time (unsigned int milliseconds);
+void set_s2k_calibration_file (const char *fname);
+void benchmark_s2k (estream_t fp);
 unsigned long get_calibrated_s2k_count (void);
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
@@ -23,9 +23,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <npth.h>
 
 #include "agent.h"
+#include "../common/tracepoint.h"
 
 /* The default TTL for DATA items.  This has no configure
  * option because it is expected that clients provide a TTL.  */
@@ -34,8 +37,16 @@
 /* The size of the encryption key in bytes.  */
 #define ENCRYPTION_KEYSIZE (128/8)
 
-/* A mutex used to serialize access to the cache.  */
-static npth_mutex_t cache_lock;
+/* The number of shards of the cache.  Each shard has its own lock so
+ * that requests for different keys do not contend.  */
+#define CACHE_SHARDS  16
+
+/* The number of hash buckets of a shard.  */
+#define CACHE_BUCKETS 64
+
+/* A mutex used to serialize the initialization of the encryption
+ * context.  */
+static npth_mutex_t encryption_lock;
 /* The encryption context.  This is the only place where the
    encryption key for all cached entries is available.  It would be nice
    to keep this (or just the key) in some hardware device, for example
@@ -66,21 +77,63 @@ struct cache_item_s {
   char key[1];
 };
 
-/* The cache himself.  */
-static ITEM thecache;
+/* The cache himself.  An item is put into the shard and bucket given
+ * by the hash of its key and its restricted flag; the cache mode is
+ * not part of the hash because CACHE_MODE_ANY matches several
+ * modes.  */
+struct cache_shard_s
+{
+  npth_mutex_t lock;
+  ITEM buckets[CACHE_BUCKETS];
+  /* No item of the shard needs to be expired before this time.  A
+   * value of 0 requests a scan and (time_t)(-1) means that no item
+   * will ever expire.  */
+  time_t next_expiry;
+  /* The values of the options used to compute NEXT_EXPIRY.  */
+  unsigned long max_cache_ttl;
+  unsigned long max_cache_ttl_ssh;
+};
+static struct cache_shard_s thecache[CACHE_SHARDS];
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
 
 
+/* An item of the cache of unprotected private keys.  The item is only
+ * valid as long as the key file has not been changed.  */
+typedef struct key_cache_item_s *KEYITEM;
+struct key_cache_item_s {
+  KEYITEM next;
+  unsigned char grip[KEYGRIP_LEN];
+  int restricted;
+  time_t created;
+  /* The stat values of the key file.  */
+  time_t file_mtime;
+  off_t file_size;
+  ino_t file_ino;
+  /* The encrypted canonical S-expression of the key.  */
+  struct secret_data_s *key;
+};
+
+/* The cache of unprotected keys, the most recently stored first.  */
+static KEYITEM thekeycache;
+
+/* The mutex used to serialize access to THEKEYCACHE.  */
+static npth_mutex_t key_cache_lock;
+
+
 /* This function must be called once to initialize this module. It
    has to be done before a second thread is spawned.  */
 void
 initialize_module_cache (void)
 {
-  int err;
+  int err, i;
 
-  err = npth_mutex_init (&cache_lock, NULL);
+  err = npth_mutex_init (&encryption_lock, NULL);
+  if (!err)
+    err = npth_mutex_init (&key_cache_lock, NULL);
+  for (i=0; !err && i < CACHE_SHARDS; i++)
+    err = npth_mutex_init (&thecache[i].lock, NULL);
 
   if (err)
     log_fatal ("error initializing cache module: %s\n", strerror (err));
@@ -105,12 +158,25 @@ static gpg_error_t
 init_encryption (void)
 {
   gpg_error_t err;
+  gcry_cipher_hd_t hd;
   void *key;
+  int res;
 
   if (encryption_handle)
     return 0; /* Shortcut - Already initialized.  */
 
-  err = gcry_cipher_open (&encryption_handle, GCRY_CIPHER_AES128,
+  /* The shard locks don't protect us here; the random number
+   * generator may switch threads.  */
+  res = npth_mutex_lock (&encryption_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+  if (encryption_handle)
+    {
+      err = 0; /* Initialized by another thread.  */
+      goto leave;
+    }
+
+  err = gcry_cipher_open (&hd, GCRY_CIPHER_AES128,
                           GCRY_CIPHER_MODE_AESWRAP, GCRY_CIPHER_SECURE);
   if (!err)
     {
@@ -119,19 +185,22 @@ init_encryption (void)
         err = gpg_error_from_syserror ();
       else
         {
-          err = gcry_cipher_setkey (encryption_handle, key, ENCRYPTION_KEYSIZE);
+          err = gcry_cipher_setkey (hd, key, ENCRYPTION_KEYSIZE);
           xfree (key);
         }
       if (err)
-        {
-          gcry_cipher_close (encryption_handle);
-          encryption_handle = NULL;
-        }
+        gcry_cipher_close (hd);
+      else
+        encryption_handle = hd;
     }
   if (err)
     log_error ("error initializing cache encryption context: %s\n",
                gpg_strerror (err));
 
+ leave:
+  res = npth_mutex_unlock (&encryption_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
   return err? gpg_error (GPG_ERR_NOT_INITIALIZED) : 0;
 }
 
@@ -143,12 +212,13 @@ release_data (struct secret_data_s *data)
    xfree (data);
 }
 
+/* Encrypt the LENGTH bytes at BUFFER into a new data object.  */
 static gpg_error_t
-new_data (const char *string, struct secret_data_s **r_data)
+new_data_buffer (const void *buffer, size_t length,
+                 struct secret_data_s **r_data)
 {
   gpg_error_t err;
   struct secret_data_s *d, *d_enc;
-  size_t length;
   int total;
 
   *r_data = NULL;
@@ -157,8 +227,6 @@ new_data (const char *string, struct secret_data_s **r_data)
   if (err)
     return err;
 
-  length = strlen (string) + 1;
-
   /* We pad the data to 32 bytes so that it get more complicated
      finding something out by watching allocation patterns.  This is
      usually not possible but we better assume nothing about our secure
@@ -169,7 +237,8 @@ new_data (const char *string, struct secret_data_s **r_data)
   d = xtrymalloc_secure (sizeof *d + total - 1);
   if (!d)
     return gpg_error_from_syserror ();
-  memcpy (d->data, string, length);
+  memcpy (d->data, buffer, length);
+  memset (d->data + length, 0, total - length);
 
   d_enc = xtrymalloc (sizeof *d_enc + total - 1);
   if (!d_enc)
@@ -193,128 +262,407 @@ new_data (const char *string, struct secret_data_s **r_data)
 }
 
 
+static gpg_error_t
+new_data (const char *string, struct secret_data_s **r_data)
+{
+  return new_data_buffer (string, strlen (string) + 1, r_data);
+}
+
+
+/* Decrypt DATA into a new buffer in secure memory.  On success the
+ * buffer is stored at R_BUFFER and its length, which includes the
+ * padding, at R_LENGTH.  */
+static gpg_error_t
+decrypt_data (struct secret_data_s *data, char **r_buffer, size_t *r_length)
+{
+  gpg_error_t err;
+  char *value;
+
+  *r_buffer = NULL;
+  if (data->totallen < 32)
+    return gpg_error (GPG_ERR_INV_LENGTH);
+  err = init_encryption ();
+  if (err)
+    return err;
+  value = xtrymalloc_secure (data->totallen - 8);
+  if (!value)
+    return gpg_error_from_syserror ();
+  err = gcry_cipher_decrypt (encryption_handle,
+                             value, data->totallen - 8,
+                             data->data, data->totallen);
+  if (err)
+    {
+      xfree (value);
+      return err;
+    }
+  *r_buffer = value;
+  *r_length = data->totallen - 8;
+  return 0;
+}
+
+
+
+static void
+lock_key_cache (void)
+{
+  int res = npth_mutex_lock (&key_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+}
+
+
+static void
+unlock_key_cache (void)
+{
+  int res = npth_mutex_unlock (&key_cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
 
-/* Check whether there are items to expire.  */
 static void
-housekeeping (void)
+release_key_item (KEYITEM r)
 {
-  ITEM r, rprev;
+  release_data (r->key);
+  xfree (r);
+}
+
+
+/* Remove expired items and, if NEEDED is set, more items so that one
+ * more fits into the cache.  */
+static void
+key_cache_housekeeping (int needed)
+{
+  KEYITEM r, *rp;
   time_t current = gnupg_get_time ();
+  unsigned int n = 0;
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+  for (rp = &thekeycache; (r = *rp); )
     {
-      if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+      if (r->created + opt.key_cache_ttl < current
+          || n + !!needed >= opt.key_cache_max)
         {
           if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%ds after last access)\n",
-                       r->key, r->restricted, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+            log_debug ("  removed key from key cache\n");
+          *rp = r->next;
+          release_key_item (r);
+          continue;
         }
+      n++;
+      rp = &r->next;
     }
+}
 
-  /* Second, make sure that we also remove them based on the created
-   * stamp so that the user has to enter it from time to time.  We
-   * don't do this for data items which are used to storage secrets in
-   * meory and are not user entered passphrases etc.  */
-  for (r=thecache; r; r = r->next)
-    {
-      unsigned long maxttl;
 
-      switch (r->cache_mode)
-        {
-        case CACHE_MODE_DATA:
-          continue;  /* No MAX TTL here.  */
-        case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
-        default: maxttl = opt.max_cache_ttl; break;
-        }
-      if (r->pw && r->created + maxttl < current)
-        {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%lus after creation)\n",
-                       r->key, r->restricted, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
-        }
-    }
+/* Remove all items from the cache of unprotected keys.  */
+void
+agent_flush_key_cache (void)
+{
+  KEYITEM r;
 
-  /* Third, make sure that we don't have too many items in the list.
-   * Expire old and unused entries after 30 minutes.  */
-  for (rprev=NULL, r=thecache; r; )
+  lock_key_cache ();
+  while ((r = thekeycache))
     {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
-        {
-          ITEM r2 = r->next;
-          if (DBG_CACHE)
-            log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
-                       r->key, r->restricted, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
-          else
-            rprev->next = r2;
-          r = r2;
-        }
-      else
-        {
-          rprev = r;
-          r = r->next;
-        }
+      thekeycache = r->next;
+      release_key_item (r);
     }
+  unlock_key_cache ();
 }
 
 
+/* Store the unprotected key GRIP given as the canonical S-expression
+ * KEY of length KEYLEN in the cache.  ST are the stat values of the
+ * key file read to get this key.  This function does nothing unless
+ * enabled by --key-cache-ttl.  */
 void
-agent_cache_housekeeping (void)
+agent_put_key_cache (ctrl_t ctrl, const unsigned char *grip,
+                     const struct stat *st,
+                     const unsigned char *key, size_t keylen)
 {
-  int res;
+  gpg_error_t err;
+  KEYITEM r, *rp;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (!opt.key_cache_ttl || !opt.key_cache_max)
+    return;
+
+  r = xtrycalloc (1, sizeof *r);
+  if (!r)
+    return;
+  memcpy (r->grip, grip, KEYGRIP_LEN);
+  r->restricted = restricted;
+  r->created = gnupg_get_time ();
+  r->file_mtime = st->st_mtime;
+  r->file_size = st->st_size;
+  r->file_ino = st->st_ino;
+  err = new_data_buffer (key, keylen, &r->key);
+  if (err)
+    {
+      log_error ("error inserting key cache item: %s\n", gpg_strerror (err));
+      xfree (r);
+      return;
+    }
+
+  lock_key_cache ();
+  for (rp = &thekeycache; *rp; rp = &(*rp)->next)
+    if ((*rp)->restricted == restricted
+        && !memcmp ((*rp)->grip, grip, KEYGRIP_LEN))
+      {
+        KEYITEM old = *rp;
+        *rp = old->next;
+        release_key_item (old);
+        break;
+      }
+  key_cache_housekeeping (1);
+  r->next = thekeycache;
+  thekeycache = r;
+  unlock_key_cache ();
+}
+
+
+/* Return the unprotected key GRIP from the cache as a canonical
+ * S-expression in secure memory if it was stored from a key file
+ * with the stat values ST.  The length of the returned buffer is
+ * stored at R_KEYLEN; the buffer may be longer than the
+ * S-expression.  */
+unsigned char *
+agent_get_key_cache (ctrl_t ctrl, const unsigned char *grip,
+                     const struct stat *st, size_t *r_keylen)
+{
+  gpg_error_t err;
+  KEYITEM r;
+  char *value = NULL;
+  int restricted = ctrl? ctrl->restricted : -1;
 
+  if (!opt.key_cache_ttl || !opt.key_cache_max)
+    return NULL;
+
+  lock_key_cache ();
+  key_cache_housekeeping (0);
+  for (r = thekeycache; r; r = r->next)
+    if (r->restricted == restricted
+        && !memcmp (r->grip, grip, KEYGRIP_LEN))
+      break;
+  if (r && (r->file_mtime != st->st_mtime || r->file_size != st->st_size
+            || r->file_ino != st->st_ino))
+    r = NULL; /* The key file has been changed.  */
+  if (r)
+    {
+      err = decrypt_data (r->key, &value, r_keylen);
+      if (err)
+        log_error ("retrieving key cache entry failed: %s\n",
+                   gpg_strerror (err));
+    }
   if (DBG_CACHE)
-    log_debug ("agent_cache_housekeeping\n");
+    log_debug ("agent_get_key_cache ... %s\n", value? "hit":"miss");
+  metrics_count (value? METRICS_KEY_CACHE_HIT : METRICS_KEY_CACHE_MISS);
+  unlock_key_cache ();
+
+  return (unsigned char *)value;
+}
+
 
-  res = npth_mutex_lock (&cache_lock);
+/* Return the hash value for KEY and RESTRICTED.  */
+static unsigned int
+cache_hash (const char *key, int restricted)
+{
+  const unsigned char *s = (const unsigned char *)key;
+  unsigned int hash = restricted;
+
+  for (; *s; s++)
+    hash = hash * 31 + *s;
+  return hash;
+}
+
+
+/* Return the shard for KEY and RESTRICTED and store the bucket at
+ * R_BUCKET.  */
+static struct cache_shard_s *
+cache_shard (const char *key, int restricted, ITEM **r_bucket)
+{
+  unsigned int hash = cache_hash (key, restricted);
+  struct cache_shard_s *shard = thecache + (hash % CACHE_SHARDS);
+
+  *r_bucket = shard->buckets + ((hash / CACHE_SHARDS) % CACHE_BUCKETS);
+  return shard;
+}
+
+
+static void
+lock_shard (struct cache_shard_s *shard)
+{
+  int res = npth_mutex_lock (&shard->lock);
   if (res)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+}
 
-  housekeeping ();
 
-  res = npth_mutex_unlock (&cache_lock);
+static void
+unlock_shard (struct cache_shard_s *shard)
+{
+  int res = npth_mutex_unlock (&shard->lock);
   if (res)
     log_fatal ("failed to release cache mutex: %s\n", strerror (res));
 }
 
 
+/* Return the maximum lifetime of item R since its creation or 0 if
+ * there is none.  */
+static unsigned long
+item_maxttl (ITEM r)
+{
+  switch (r->cache_mode)
+    {
+    case CACHE_MODE_DATA: return 0; /* No MAX TTL here.  */
+    case CACHE_MODE_SSH: return opt.max_cache_ttl_ssh;
+    default: return opt.max_cache_ttl;
+    }
+}
+
+
+/* Lower the time of the next expiry in SHARD to the time item R needs
+ * to be looked at by housekeeping.  */
+static void
+note_expiry (struct cache_shard_s *shard, ITEM r)
+{
+  unsigned long maxttl;
+  time_t t;
+
+  if (r->ttl < 0)
+    return;  /* Infinite lifetime.  */
+
+  /* The test in housekeeping is for "less than".  */
+  if (r->pw)
+    {
+      t = r->accessed + r->ttl + 1;
+      maxttl = item_maxttl (r);
+      if (maxttl && r->created + maxttl + 1 < t)
+        t = r->created + maxttl + 1;
+    }
+  else
+    t = r->accessed + 60*30 + 1;
+
+  if (shard->next_expiry == (time_t)(-1) || t < shard->next_expiry)
+    shard->next_expiry = t;
+}
+
+
+/* Check whether there are items to expire in SHARD.  The items are
+ * only looked at if one of them is due.  */
+static void
+housekeeping (struct cache_shard_s *shard)
+{
+  ITEM r, *rp;
+  time_t current = gnupg_get_time ();
+  unsigned long maxttl;
+  int i;
+
+  if (shard->max_cache_ttl == opt.max_cache_ttl
+      && shard->max_cache_ttl_ssh == opt.max_cache_ttl_ssh
+      && (shard->next_expiry == (time_t)(-1) || current < shard->next_expiry))
+    return;
+
+  shard->max_cache_ttl = opt.max_cache_ttl;
+  shard->max_cache_ttl_ssh = opt.max_cache_ttl_ssh;
+  shard->next_expiry = (time_t)(-1);
+  for (i=0; i < CACHE_BUCKETS; i++)
+    for (rp = shard->buckets + i; (r = *rp); )
+      {
+        /* First expire the actual data */
+        if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+          {
+            if (DBG_CACHE)
+              log_debug ("  expired '%s'.%d (%ds after last access)\n",
+                         r->key, r->restricted, r->ttl);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = current;
+          }
+
+        /* Second, make sure that we also remove them based on the
+         * created stamp so that the user has to enter it from time to
+         * time.  We don't do this for data items which are used to
+         * storage secrets in meory and are not user entered
+         * passphrases etc.  */
+        maxttl = item_maxttl (r);
+        if (r->pw && maxttl && r->created + maxttl < current)
+          {
+            if (DBG_CACHE)
+              log_debug ("  expired '%s'.%d (%lus after creation)\n",
+                         r->key, r->restricted, maxttl);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = current;
+          }
+
+        /* Third, make sure that we don't have too many items in the
+         * list.  Expire old and unused entries after 30 minutes.  */
+        if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+          {
+            if (DBG_CACHE)
+              log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
+                         r->key, r->restricted, r->cache_mode);
+            *rp = r->next;
+            xfree (r);
+            continue;
+          }
+
+        note_expiry (shard, r);
+        rp = &r->next;
+      }
+}
+
+
+void
+agent_cache_housekeeping (void)
+{
+  int i;
+
+  if (DBG_CACHE)
+    log_debug ("agent_cache_housekeeping\n");
+
+  for (i=0; i < CACHE_SHARDS; i++)
+    {
+      lock_shard (thecache + i);
+      housekeeping (thecache + i);
+      unlock_shard (thecache + i);
+    }
+
+  lock_key_cache ();
+  key_cache_housekeeping (0);
+  unlock_key_cache ();
+}
+
+
 void
 agent_flush_cache (void)
 {
   ITEM r;
-  int res;
+  int i, j;
 
   if (DBG_CACHE)
     log_debug ("agent_flush_cache\n");
 
-  res = npth_mutex_lock (&cache_lock);
-  if (res)
-    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
-
-  for (r=thecache; r; r = r->next)
+  for (i=0; i < CACHE_SHARDS; i++)
     {
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
+      lock_shard (thecache + i);
+      for (j=0; j < CACHE_BUCKETS; j++)
+        for (r = thecache[i].buckets[j]; r; r = r->next)
+          {
+            if (r->pw)
+              {
+                if (DBG_CACHE)
+                  log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
+                release_data (r->pw);
+                r->pw = NULL;
+                r->accessed = 0;
+              }
+          }
+      thecache[i].next_expiry = 0;
+      unlock_shard (thecache + i);
     }
 
-  res = npth_mutex_unlock (&cache_lock);
-  if (res)
-    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+  agent_flush_key_cache ();
 }
 
 
@@ -342,18 +690,17 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                  const char *data, int ttl)
 {
   gpg_error_t err = 0;
-  ITEM r;
-  int res;
+  ITEM r, *bucket;
+  struct cache_shard_s *shard;
   int restricted = ctrl? ctrl->restricted : -1;
 
-  res = npth_mutex_lock (&cache_lock);
-  if (res)
-    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+  shard = cache_shard (key, restricted, &bucket);
+  lock_shard (shard);
 
   if (DBG_CACHE)
     log_debug ("agent_put_cache '%s'.%d (mode %d) requested ttl=%d\n",
                key, restricted, cache_mode, ttl);
-  housekeeping ();
+  housekeeping (shard);
 
   if (!ttl)
     {
@@ -367,7 +714,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     goto out;
 
-  for (r=thecache; r; r = r->next)
+  for (r=*bucket; r; r = r->next)
     {
       if (((cache_mode != CACHE_MODE_USER
             && cache_mode != CACHE_MODE_NONCE)
@@ -392,6 +739,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      note_expiry (shard, r);
     }
   else if (data) /* Insert.  */
     {
@@ -410,8 +758,9 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
             xfree (r);
           else
             {
-              r->next = thecache;
-              thecache = r;
+              r->next = *bucket;
+              *bucket = r;
+              note_expiry (shard, r);
             }
         }
       if (err)
@@ -419,10 +768,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
     }
 
  out:
-  res = npth_mutex_unlock (&cache_lock);
-  if (res)
-    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
-
+  unlock_shard (shard);
   return err;
 }
 
@@ -432,34 +778,37 @@ char *
 agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
 {
   gpg_error_t err;
-  ITEM r;
+  ITEM r, *bucket;
+  struct cache_shard_s *shard;
   char *value = NULL;
-  int res;
+  char *keybuf = NULL;
   int last_stored = 0;
   int restricted = ctrl? ctrl->restricted : -1;
 
   if (cache_mode == CACHE_MODE_IGNORE)
     return NULL;
 
-  res = npth_mutex_lock (&cache_lock);
-  if (res)
-    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
-
   if (!key)
     {
+      /* Taking the lock may switch threads and another thread may
+       * then replace the stored key; thus we use a copy.  */
       key = last_stored_cache_key;
-      if (!key)
-        goto out;
+      if (!key || !(keybuf = xtrystrdup (key)))
+        return NULL;
+      key = keybuf;
       last_stored = 1;
     }
 
+  shard = cache_shard (key, restricted, &bucket);
+  lock_shard (shard);
+
   if (DBG_CACHE)
     log_debug ("agent_get_cache '%s'.%d (mode %d)%s ...\n",
                key, ctrl->restricted, cache_mode,
                last_stored? " (stored cache key)":"");
-  housekeeping ();
+  housekeeping (shard);
 
-  for (r=thecache; r; r = r->next)
+  for (r=*bucket; r; r = r->next)
     {
       if (r->pw
           && ((cache_mode != CACHE_MODE_USER
@@ -473,20 +822,11 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
            * for data items.  */
           if (r->cache_mode != CACHE_MODE_DATA)
             r->accessed = gnupg_get_time ();
+          size_t dummy;
+
           if (DBG_CACHE)
             log_debug ("... hit\n");
-          if (r->pw->totallen < 32)
-            err = gpg_error (GPG_ERR_INV_LENGTH);
-          else if ((err = init_encryption ()))
-            ;
-          else if (!(value = xtrymalloc_secure (r->pw->totallen - 8)))
-            err = gpg_error_from_syserror ();
-          else
-            {
-              err = gcry_cipher_decrypt (encryption_handle,
-                                         value, r->pw->totallen - 8,
-                                         r->pw->data, r->pw->totallen);
-            }
+          err = decrypt_data (r->pw, &value, &dummy);
           if (err)
             {
               xfree (value);
@@ -499,12 +839,11 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
     }
   if (DBG_CACHE && value == NULL)
     log_debug ("... miss\n");
+  metrics_count (value? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+  TRACEPOINT2 (agent_cache_lookup, cache_mode, !!value);
 
- out:
-  res = npth_mutex_unlock (&cache_lock);
-  if (res)
-    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
-
+  unlock_shard (shard);
+  xfree (keybuf);
   return value;
 }
 
@@ -541,3 +880,4 @@ agent_store_cache_hit (const char *key)
 
   xfree (old);
 }
+
@@ -55,6 +55,26 @@
 /* The assuan context of the current pinentry. */
 static assuan_context_t entry_ctx;
 
+/* The time the current pinentry has been started.  */
+static unsigned long long entry_started;
+
+/* The flavor and version string of the current pinentry.  */
+static char *entry_flavor_version;
+
+/* A description of the session the current pinentry has been started
+ * for; see make_entry_session.  */
+static char *entry_session;
+
+/* Set if the current pinentry may be kept for reuse after it has
+ * been used.  */
+static int entry_reusable;
+
+/* With --pinentry-keep-alive the assuan context of an idle pinentry
+ * kept for the next prompt and the time it has been used last.  This
+ * is protected by ENTRY_LOCK.  */
+static assuan_context_t entry_idle_ctx;
+static time_t entry_idle_since;
+
 /* A list of features of the current pinentry.  */
 static struct
 {
@@ -177,7 +197,19 @@ unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
 
   if (--ctrl->pinentry_active == 0)
     {
+      metrics_time (METRICS_TIME_PINENTRY, entry_started);
+      /* Keep the pinentry for the next prompt if it is still usable.  */
+      if (opt.pinentry_keep_alive && entry_reusable
+          && (!rc
+              || gpg_err_code (rc) == GPG_ERR_CANCELED
+              || gpg_err_code (rc) == GPG_ERR_NOT_CONFIRMED))
+        {
+          entry_idle_ctx = ctx;
+          entry_idle_since = gnupg_get_time ();
+          ctx = NULL;
+        }
       entry_ctx = NULL;
+      entry_reusable = 0;
       err = npth_mutex_unlock (&entry_lock);
       if (err)
         {
@@ -268,6 +300,121 @@ getinfo_pid_cb (void *opaque, const void *buffer, size_t length)
 }
 
 
+/* Return a malloced string describing the session of CTRL as far as
+ * it is conveyed to a pinentry at startup.  A pinentry started for
+ * one session may only be reused for a session with the same
+ * description.  Returns NULL on error.  */
+static char *
+make_entry_session (ctrl_t ctrl)
+{
+  membuf_t mb;
+  int iterator = 0;
+  const char *name, *value;
+
+  init_membuf (&mb, 256);
+  while ((name = session_env_list_stdenvnames (&iterator, NULL)))
+    {
+      value = session_env_getenv (ctrl->session_env, name);
+      if (value)
+        put_membuf_printf (&mb, "%s=%s\n", name, value);
+    }
+  put_membuf_printf (&mb, "lc-ctype=%s\nlc-messages=%s\n",
+                     ctrl->lc_ctype? ctrl->lc_ctype : "",
+                     ctrl->lc_messages? ctrl->lc_messages : "");
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
+/* Tell the pinentry about the client CTRL and the client about the
+ * pinentry.  This is done for each use of a pinentry.  */
+static gpg_error_t
+announce_pinentry (ctrl_t ctrl)
+{
+  gpg_error_t rc;
+  unsigned long pinentry_pid;
+
+  /* Tell Pinentry about our client.  */
+  if (ctrl->client_pid)
+    {
+      char *optstr;
+      const char *nodename = "";
+
+#ifndef HAVE_W32_SYSTEM
+      struct utsname utsbuf;
+      if (!uname (&utsbuf))
+        nodename = utsbuf.nodename;
+#endif /*!HAVE_W32_SYSTEM*/
+
+      if ((optstr = xtryasprintf ("OPTION owner=%lu/%d %s",
+                                  ctrl->client_pid, ctrl->client_uid,
+                                  nodename)))
+        {
+          assuan_transact (entry_ctx, optstr, NULL, NULL, NULL, NULL, NULL,
+                           NULL);
+          /* We ignore errors because this is just a fancy thing and
+             older pinentries do not support this feature.  */
+          xfree (optstr);
+        }
+    }
+
+  /* Now ask the Pinentry for its PID.  If the Pinentry is new enough
+     it will send the pid back and we will use an inquire to notify
+     our client.  The client may answer the inquiry either with END or
+     with CAN to cancel the pinentry. */
+  rc = assuan_transact (entry_ctx, "GETINFO pid",
+                        getinfo_pid_cb, &pinentry_pid,
+                        NULL, NULL, NULL, NULL);
+  if (rc)
+    {
+      log_info ("You may want to update to a newer pinentry\n");
+      rc = 0;
+    }
+  else if (!rc && (pid_t)pinentry_pid == (pid_t)(-1))
+    log_error ("pinentry did not return a PID\n");
+  else
+    {
+      rc = agent_inq_pinentry_launched (ctrl, pinentry_pid,
+                                        entry_flavor_version);
+      if (gpg_err_code (rc) == GPG_ERR_CANCELED
+          || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+        return unlock_pinentry (ctrl, gpg_err_make (GPG_ERR_SOURCE_DEFAULT,
+                                                    gpg_err_code (rc)));
+      rc = 0;
+    }
+
+  return rc;
+}
+
+
+/* Release the idle pinentry kept by --pinentry-keep-alive if it has
+ * not been used for the configured time or if FORCE is set.  This is
+ * called from the housekeeping code and on reload.  */
+void
+agent_release_idle_pinentry (int force)
+{
+  assuan_context_t ctx;
+
+  if (!entry_idle_ctx)
+    return;
+  if (!force && opt.pinentry_keep_alive
+      && entry_idle_since + opt.pinentry_keep_alive > gnupg_get_time ())
+    return;
+  if (npth_mutex_trylock (&entry_lock))
+    return;  /* In use - try again later.  */
+  ctx = entry_idle_ctx;
+  entry_idle_ctx = NULL;
+  npth_mutex_unlock (&entry_lock);
+
+  if (ctx)
+    {
+      if (opt.verbose)
+        log_info ("closing the idle PIN Entry\n");
+      assuan_release (ctx);
+    }
+}
+
+
 /* Fork off the pin entry if this has not already been done.  Note,
    that this function must always be used to acquire the lock for the
    pinentry - we will serialize _all_ pinentry calls.
@@ -283,10 +430,8 @@ start_pinentry (ctrl_t ctrl)
   assuan_fd_t no_close_list[3];
   int i;
   const char *tmpstr;
-  unsigned long pinentry_pid;
   const char *value;
   struct timespec abstime;
-  char *flavor_version;
   int err;
 
   if (ctrl->pinentry_active)
@@ -314,6 +459,32 @@ start_pinentry (ctrl_t ctrl)
   if (entry_ctx)
     return 0;
 
+  /* Reuse an idle pinentry if it has been started for the same
+   * session.  The RESET clears the texts of the previous prompt and
+   * tells us that the pinentry is still alive.  */
+  if (entry_idle_ctx)
+    {
+      char *session = make_entry_session (ctrl);
+
+      ctx = entry_idle_ctx;
+      entry_idle_ctx = NULL;
+      if (session && entry_session && !strcmp (session, entry_session)
+          && !assuan_transact (ctx, "RESET",
+                               NULL, NULL, NULL, NULL, NULL, NULL))
+        {
+          xfree (session);
+          if (opt.verbose)
+            log_info ("reusing the PIN Entry\n");
+          ctrl->pinentry_active = 1;
+          entry_ctx = ctx;
+          entry_started = metrics_start ();
+          entry_reusable = 1;
+          return announce_pinentry (ctrl);
+        }
+      xfree (session);
+      assuan_release (ctx);
+    }
+
   if (opt.verbose)
     log_info ("starting a new PIN Entry\n");
 
@@ -381,6 +552,9 @@ start_pinentry (ctrl_t ctrl)
 
   ctrl->pinentry_active = 1;
   entry_ctx = ctx;
+  entry_started = metrics_start ();
+  xfree (entry_session);
+  entry_session = make_entry_session (ctrl);
 
   /* We don't want to log the pinentry communication to make the logs
      easier to read.  We might want to add a new debug option to enable
@@ -602,31 +776,6 @@ start_pinentry (ctrl_t ctrl)
         }
     }
 
-  /* Tell Pinentry about our client.  */
-  if (ctrl->client_pid)
-    {
-      char *optstr;
-      const char *nodename = "";
-
-#ifndef HAVE_W32_SYSTEM
-      struct utsname utsbuf;
-      if (!uname (&utsbuf))
-        nodename = utsbuf.nodename;
-#endif /*!HAVE_W32_SYSTEM*/
-
-      if ((optstr = xtryasprintf ("OPTION owner=%lu/%d %s",
-                                  ctrl->client_pid, ctrl->client_uid,
-                                  nodename)))
-        {
-          assuan_transact (entry_ctx, optstr, NULL, NULL, NULL, NULL, NULL,
-                           NULL);
-          /* We ignore errors because this is just a fancy thing and
-             older pinentries do not support this feature.  */
-          xfree (optstr);
-        }
-    }
-
-
   /* Ask the pinentry for its version and flavor and store that as a
    * string in MB.  This information is useful for helping users to
    * figure out Pinentry problems.  Note that "flavor" may also return
@@ -650,37 +799,12 @@ start_pinentry (ctrl_t ctrl)
                          put_membuf_cb, &mb, NULL, NULL, NULL, NULL))
       put_membuf_str (&mb, "? ? ?");
     put_membuf (&mb, "", 1);
-    flavor_version = get_membuf (&mb, NULL);
+    xfree (entry_flavor_version);
+    entry_flavor_version = get_membuf (&mb, NULL);
   }
 
-
-  /* Now ask the Pinentry for its PID.  If the Pinentry is new enough
-     it will send the pid back and we will use an inquire to notify
-     our client.  The client may answer the inquiry either with END or
-     with CAN to cancel the pinentry. */
-  rc = assuan_transact (entry_ctx, "GETINFO pid",
-                        getinfo_pid_cb, &pinentry_pid,
-                        NULL, NULL, NULL, NULL);
-  if (rc)
-    {
-      log_info ("You may want to update to a newer pinentry\n");
-      rc = 0;
-    }
-  else if (!rc && (pid_t)pinentry_pid == (pid_t)(-1))
-    log_error ("pinentry did not return a PID\n");
-  else
-    {
-      rc = agent_inq_pinentry_launched (ctrl, pinentry_pid, flavor_version);
-      if (gpg_err_code (rc) == GPG_ERR_CANCELED
-          || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
-        return unlock_pinentry (ctrl, gpg_err_make (GPG_ERR_SOURCE_DEFAULT,
-                                                    gpg_err_code (rc)));
-      rc = 0;
-    }
-
-  xfree (flavor_version);
-
-  return rc;
+  entry_reusable = !!entry_session;
+  return announce_pinentry (ctrl);
 }
 
 
@@ -987,6 +1111,9 @@ watch_sock (void *arg)
         break;
     }
 
+  /* The pinentry is terminated and thus can't be reused.  */
+  entry_reusable = 0;
+
   if (pid == (pid_t)(-1))
     ; /* No pid available can't send a kill. */
 #ifdef HAVE_W32_SYSTEM
@@ -1627,6 +1754,10 @@ agent_popup_message_stop (ctrl_t ctrl)
     kill (pid, SIGINT);
 #endif
 
+  /* The pinentry has been terminated or may be terminated by the
+     user closing the popup; thus we can't reuse it.  */
+  entry_reusable = 0;
+
   /* Now wait for the thread to terminate. */
   rc = npth_join (popup_tid, NULL);
   if (rc)
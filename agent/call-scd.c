@@ -57,6 +57,7 @@ struct scd_local_s
                              used with this connection. */
   unsigned int in_use: 1; /* CTX is in use.  */
   unsigned int invalid:1; /* CTX is invalid, should be released.  */
+  unsigned long long started;  /* Time the CTX was taken into use.  */
 };
 
 
@@ -168,6 +169,8 @@ unlock_scd (ctrl_t ctrl, int rc)
       if (!rc)
         rc = gpg_error (GPG_ERR_INTERNAL);
     }
+  else
+    metrics_time (METRICS_TIME_SCD, ctrl->scd_local->started);
   err = npth_mutex_lock (&start_scd_lock);
   if (err)
     {
@@ -305,6 +308,7 @@ start_scd (ctrl_t ctrl)
   if (ctrl->scd_local && ctrl->scd_local->ctx)
     {
       ctrl->scd_local->in_use = 1;
+      ctrl->scd_local->started = metrics_start ();
       return 0; /* Okay, the context is fine.  */
     }
 
@@ -341,6 +345,7 @@ start_scd (ctrl_t ctrl)
     }
 
   ctrl->scd_local->in_use = 1;
+  ctrl->scd_local->started = metrics_start ();
 
   /* Check whether the pipe server has already been started and in
      this case either reuse a lingering pipe connection or establish a
@@ -227,6 +227,76 @@ struct ssh_control_file_s
 };
 
 
+/* An in-memory copy of the valid items of the sshcontrol file.  It
+ * is used for the frequent lookups done for each ssh request and
+ * is reloaded if the stat values of the file change.  */
+struct control_index_item_s
+{
+  char hexgrip[40+1];
+  unsigned int disabled:1;
+  unsigned int confirm:1;
+  int ttl;
+};
+
+struct control_index_s
+{
+  time_t file_mtime;   /* The stat values of the file.  */
+  off_t file_size;
+  ino_t file_ino;
+  unsigned int seqno;  /* Incremented with each load.  */
+  int nitems;
+  struct control_index_item_s items[1];
+};
+
+/* The current index or NULL if not yet loaded.  */
+static struct control_index_s *control_index;
+
+/* The counter used to assign a SEQNO to a new index.  */
+static unsigned int control_index_seqno;
+
+
+/* A cache for the key blobs returned by REQUEST_IDENTITIES.  An
+ * entry is valid as long as its counter matches the current one.  */
+struct identity_cache_s
+{
+  int valid;
+  unsigned int counter;  /* Card event counter or index seqno.  */
+  unsigned int keycounter;  /* Key event counter.  */
+  u32 nkeys;             /* Number of keys in BLOBS.  */
+  void *blobs;           /* The concatenated ssh key blobs.  */
+  size_t bloblen;
+};
+
+/* Identities from the cards; valid until a card event.  */
+static struct identity_cache_s card_identity_cache;
+
+/* Identities from sshcontrol; valid until sshcontrol is reloaded or
+ * a key is added or removed.  */
+static struct identity_cache_s control_identity_cache;
+
+
+/* The number of entries in the key blob index.  */
+#define BLOB_INDEX_SIZE 256
+
+/* An entry of the key blob index.  It maps the SHA-256 hash of an
+ * ssh public key blob to the keygrip and the key type of that key so
+ * that a SIGN_REQUEST does not need to parse the blob and compute
+ * the keygrip again.  The mapping depends only on the public key and
+ * thus an entry never gets stale.  */
+struct blob_index_s
+{
+  int used;
+  unsigned char blobhash[32];
+  unsigned char grip[20];
+  ssh_key_type_spec_t spec;
+};
+
+/* The index, direct-mapped by the first byte of the hash.  The
+ * entries are accessed without a yield point in between and thus
+ * need no lock with nPth.  */
+static struct blob_index_s blob_index[BLOB_INDEX_SIZE];
+
+
 /* Prototypes.  */
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
@@ -1060,6 +1130,114 @@ search_control_file (ssh_control_file_t cf, const char *hexgrip,
 
 
 
+/* Return the index of the sshcontrol file or NULL on error.  The
+   file is only read again if its stat values changed.  The returned
+   object is valid until the next call of this function; there must
+   be no yield point while it is in use.  */
+static struct control_index_s *
+get_control_index (void)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf;
+  struct control_index_s *idx;
+  struct stat st;
+  char *fname;
+  int n, nalloced;
+
+  fname = make_filename_try (gnupg_homedir (), SSH_CONTROL_FILE_NAME, NULL);
+  if (!fname)
+    return NULL;
+  if (control_index && !stat (fname, &st)
+      && st.st_mtime == control_index->file_mtime
+      && st.st_size == control_index->file_size
+      && st.st_ino == control_index->file_ino)
+    {
+      xfree (fname);
+      return control_index;
+    }
+  xfree (fname);
+
+  if (open_control_file (&cf, 0))
+    return NULL;
+  if (fstat (fileno (cf->fp), &st))
+    {
+      close_control_file (cf);
+      return NULL;
+    }
+
+  nalloced = 16;
+  idx = xtrymalloc (sizeof *idx + (nalloced - 1) * sizeof *idx->items);
+  if (!idx)
+    {
+      close_control_file (cf);
+      return NULL;
+    }
+  n = 0;
+  /* As with a sequential scan we stop at the first bad item.  */
+  while (!(err = read_control_file_item (cf)))
+    {
+      if (!cf->item.valid)
+        continue; /* Should not happen.  */
+      if (n == nalloced)
+        {
+          struct control_index_s *tmp;
+
+          nalloced += 64;
+          tmp = xtryrealloc (idx, (sizeof *idx
+                                   + (nalloced - 1) * sizeof *idx->items));
+          if (!tmp)
+            {
+              xfree (idx);
+              close_control_file (cf);
+              return NULL;
+            }
+          idx = tmp;
+        }
+      strcpy (idx->items[n].hexgrip, cf->item.hexgrip);
+      idx->items[n].disabled = !!cf->item.disabled;
+      idx->items[n].confirm = !!cf->item.confirm;
+      idx->items[n].ttl = cf->item.ttl;
+      n++;
+    }
+  close_control_file (cf);
+
+  idx->nitems = n;
+  idx->file_mtime = st.st_mtime;
+  idx->file_size = st.st_size;
+  idx->file_ino = st.st_ino;
+  idx->seqno = ++control_index_seqno;
+  xfree (control_index);
+  control_index = idx;
+  return idx;
+}
+
+
+/* Drop the index of the sshcontrol file so that it will be read
+   again on next use.  */
+static void
+flush_control_index (void)
+{
+  xfree (control_index);
+  control_index = NULL;
+}
+
+
+/* Search the sshcontrol index for HEXGRIP and return the item or
+   NULL if not found.  The semantics are the same as with
+   search_control_file.  */
+static struct control_index_item_s *
+search_control_index (struct control_index_s *idx, const char *hexgrip)
+{
+  int i;
+
+  for (i=0; i < idx->nitems; i++)
+    if (!strcmp (hexgrip, idx->items[i].hexgrip))
+      return idx->items + i;
+  return NULL;
+}
+
+
+
 /* Add an entry to the control file to mark the key with the keygrip
    HEXGRIP as usable for SSH; i.e. it will be returned when ssh asks
    for it.  FMTFPR is the fingerprint string.  This function is in
@@ -1108,7 +1286,7 @@ add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
                1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
                tp->tm_hour, tp->tm_min, tp->tm_sec,
                fpr_md5, fpr_sha256, hexgrip, ttl, confirm? " confirm":"");
-
+      flush_control_index ();
     }
  out:
   xfree (fpr_md5);
@@ -1122,22 +1300,21 @@ add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
 static int
 ttl_from_sshcontrol (const char *hexgrip)
 {
-  ssh_control_file_t cf;
-  int disabled, ttl;
+  struct control_index_s *idx;
+  struct control_index_item_s *item;
 
   if (!hexgrip || strlen (hexgrip) != 40)
     return 0;  /* Wrong input: Use global default.  */
 
-  if (open_control_file (&cf, 0))
+  idx = get_control_index ();
+  if (!idx)
     return 0; /* Error: Use the global default TTL.  */
 
-  if (search_control_file (cf, hexgrip, &disabled, &ttl, NULL)
-      || disabled)
-    ttl = 0;  /* Use the global default if not found or disabled.  */
-
-  close_control_file (cf);
+  item = search_control_index (idx, hexgrip);
+  if (!item || item->disabled)
+    return 0;  /* Use the global default if not found or disabled.  */
 
-  return ttl;
+  return item->ttl;
 }
 
 
@@ -1145,23 +1322,22 @@ ttl_from_sshcontrol (const char *hexgrip)
 static int
 confirm_flag_from_sshcontrol (const char *hexgrip)
 {
-  ssh_control_file_t cf;
-  int disabled, confirm;
+  struct control_index_s *idx;
+  struct control_index_item_s *item;
 
   if (!hexgrip || strlen (hexgrip) != 40)
     return 1;  /* Wrong input: Better ask for confirmation.  */
 
-  if (open_control_file (&cf, 0))
+  idx = get_control_index ();
+  if (!idx)
     return 1; /* Error: Better ask for confirmation.  */
 
-  if (search_control_file (cf, hexgrip, &disabled, NULL, &confirm)
-      || disabled)
-    confirm = 0;  /* If not found or disabled, there is no reason to
-                     ask for confirmation.  */
-
-  close_control_file (cf);
+  item = search_control_index (idx, hexgrip);
+  if (!item || item->disabled)
+    return 0;  /* If not found or disabled, there is no reason to
+                  ask for confirmation.  */
 
-  return confirm;
+  return item->confirm;
 }
 
 
@@ -2358,6 +2534,38 @@ ssh_read_key_public_from_blob (unsigned char *blob, size_t blob_size,
 
 
 
+/* Look up the key blob with the SHA-256 hash BLOBHASH in the blob
+   index.  On success the keygrip is stored at GRIP, the key type at
+   SPEC and true is returned.  */
+static int
+blob_index_get (const unsigned char *blobhash,
+                unsigned char *grip, ssh_key_type_spec_t *spec)
+{
+  struct blob_index_s *entry = blob_index + blobhash[0] % BLOB_INDEX_SIZE;
+
+  if (!entry->used || memcmp (entry->blobhash, blobhash, 32))
+    return 0;
+  memcpy (grip, entry->grip, 20);
+  *spec = entry->spec;
+  return 1;
+}
+
+
+/* Store the keygrip GRIP and the key type SPEC for the key blob with
+   the SHA-256 hash BLOBHASH in the blob index.  */
+static void
+blob_index_put (const unsigned char *blobhash,
+                const unsigned char *grip, const ssh_key_type_spec_t *spec)
+{
+  struct blob_index_s *entry = blob_index + blobhash[0] % BLOB_INDEX_SIZE;
+
+  memcpy (entry->blobhash, blobhash, 32);
+  memcpy (entry->grip, grip, 20);
+  entry->spec = *spec;
+  entry->used = 1;
+}
+
+
 /* This function calculates the key grip for the key contained in the
    S-Expression KEY and writes it to BUFFER, which must be large
    enough to hold it.  Returns usual error code.  */
@@ -2548,124 +2756,259 @@ card_key_available (ctrl_t ctrl, gcry_sexp_t *r_pk, char **cardsn)
 */
 
 
-/* Handler for the "request_identities" command.  */
+/* Store the key blobs from the memory stream STREAM in CACHE and
+   mark it as valid for COUNTER and KEYCOUNTER.  STREAM is closed in
+   all cases.  */
 static gpg_error_t
-ssh_handler_request_identities (ctrl_t ctrl,
-                                estream_t request, estream_t response)
+identity_cache_put (struct identity_cache_s *cache,
+                    unsigned int counter, unsigned int keycounter,
+                    estream_t stream, u32 nkeys)
 {
-  u32 key_counter;
-  estream_t key_blobs;
-  gcry_sexp_t key_public;
-  gpg_error_t err;
-  int ret;
-  ssh_control_file_t cf = NULL;
-  gpg_error_t ret_err;
+  void *blobs;
+  size_t bloblen;
 
-  (void)request;
+  if (es_fclose_snatch (stream, &blobs, &bloblen))
+    {
+      cache->valid = 0;
+      return gpg_error_from_syserror ();
+    }
+  es_free (cache->blobs);
+  cache->blobs = blobs;
+  cache->bloblen = bloblen;
+  cache->nkeys = nkeys;
+  cache->counter = counter;
+  cache->keycounter = keycounter;
+  cache->valid = 1;
+  return 0;
+}
 
-  /* Prepare buffer stream.  */
 
-  key_public = NULL;
-  key_counter = 0;
+/* Write the keys available on the cards to the stream KEY_BLOBS and
+   add their number to R_COUNTER.  The result is cached until the
+   next card event.  */
+static gpg_error_t
+card_identities (ctrl_t ctrl, estream_t key_blobs, u32 *r_counter)
+{
+  gpg_error_t err;
+  unsigned int cardcounter;
+  estream_t blobs;
+  u32 nkeys = 0;
+  gcry_sexp_t key_public = NULL;
+  char *serialno;
+  strlist_t card_list, sl;
+
+  cardcounter = get_card_eventcounter ();
+  if (card_identity_cache.valid && card_identity_cache.counter == cardcounter)
+    {
+      if (card_identity_cache.bloblen
+          && es_write (key_blobs, card_identity_cache.blobs,
+                       card_identity_cache.bloblen, NULL))
+        return gpg_error_from_syserror ();
+      *r_counter += card_identity_cache.nkeys;
+      return 0;
+    }
 
-  key_blobs = es_fopenmem (0, "r+b");
-  if (! key_blobs)
+  err = card_key_list (ctrl, &serialno, &card_list);
+  if (err)
     {
-      err = gpg_error_from_syserror ();
-      goto out;
+      if (opt.verbose)
+        log_info (_("error getting list of cards: %s\n"),
+                  gpg_strerror (err));
+      return 0;
     }
 
-  /* First check whether a key is currently available in the card
-     reader - this should be allowed even without being listed in
-     sshcontrol. */
+  blobs = es_fopenmem (0, "r+b");
+  if (!blobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
 
-  if (!opt.disable_scdaemon)
+  for (sl = card_list; sl; sl = sl->next)
     {
-      char *serialno;
-      strlist_t card_list, sl;
+      char *serialno0;
+      char *cardsn;
 
-      err = card_key_list (ctrl, &serialno, &card_list);
+      err = agent_card_serialno (ctrl, &serialno0, sl->d);
       if (err)
         {
           if (opt.verbose)
-            log_info (_("error getting list of cards: %s\n"),
+            log_info (_("error getting serial number of card: %s\n"),
                       gpg_strerror (err));
-          goto scd_out;
+          continue;
         }
 
-      for (sl = card_list; sl; sl = sl->next)
-        {
-          char *serialno0;
-          char *cardsn;
+      xfree (serialno0);
+      if (card_key_available (ctrl, &key_public, &cardsn))
+        continue;
 
-          err = agent_card_serialno (ctrl, &serialno0, sl->d);
-          if (err)
-            {
-              if (opt.verbose)
-                log_info (_("error getting serial number of card: %s\n"),
-                          gpg_strerror (err));
-              continue;
-            }
+      err = ssh_send_key_public (blobs, key_public, cardsn);
+      if (err && opt.verbose)
+        gcry_log_debugsxp ("pubkey", key_public);
+      gcry_sexp_release (key_public);
+      key_public = NULL;
+      xfree (cardsn);
+      if (err)
+        goto leave;
 
-          xfree (serialno0);
-          if (card_key_available (ctrl, &key_public, &cardsn))
-            continue;
+      nkeys++;
+    }
 
-          err = ssh_send_key_public (key_blobs, key_public, cardsn);
-          if (err && opt.verbose)
-            gcry_log_debugsxp ("pubkey", key_public);
-          gcry_sexp_release (key_public);
-          key_public = NULL;
-          xfree (cardsn);
-          if (err)
-            {
-              xfree (serialno);
-              free_strlist (card_list);
-              goto out;
-            }
+  err = identity_cache_put (&card_identity_cache, cardcounter, 0,
+                            blobs, nkeys);
+  blobs = NULL;
+  if (err)
+    goto leave;
+  if (card_identity_cache.bloblen
+      && es_write (key_blobs, card_identity_cache.blobs,
+                   card_identity_cache.bloblen, NULL))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  *r_counter += nkeys;
 
-          key_counter++;
-        }
+ leave:
+  es_fclose (blobs);
+  xfree (serialno);
+  free_strlist (card_list);
+  return err;
+}
 
-      xfree (serialno);
-      free_strlist (card_list);
+
+/* Write the keys registered in sshcontrol to the stream KEY_BLOBS
+   and add their number to R_COUNTER.  The result is cached until
+   sshcontrol changes or a key is added or removed.  */
+static gpg_error_t
+control_identities (ctrl_t ctrl, estream_t key_blobs, u32 *r_counter)
+{
+  gpg_error_t err;
+  struct control_index_s *idx;
+  unsigned int seqno, keycounter;
+  unsigned char *grips = NULL;
+  int i, ngrips;
+  estream_t blobs = NULL;
+  u32 nkeys = 0;
+  gcry_sexp_t key_public = NULL;
+
+  idx = get_control_index ();
+  if (!idx)
+    return gpg_error (GPG_ERR_GENERAL);
+  seqno = idx->seqno;
+  keycounter = get_key_eventcounter ();
+  if (control_identity_cache.valid
+      && control_identity_cache.counter == seqno
+      && control_identity_cache.keycounter == keycounter)
+    {
+      if (control_identity_cache.bloblen
+          && es_write (key_blobs, control_identity_cache.blobs,
+                       control_identity_cache.bloblen, NULL))
+        return gpg_error_from_syserror ();
+      *r_counter += control_identity_cache.nkeys;
+      return 0;
     }
 
- scd_out:
-  /* Then look at all the registered and non-disabled keys. */
-  err = open_control_file (&cf, 0);
-  if (err)
-    goto out;
+  /* Take a copy of the enabled keygrips because reading the keys may
+     yield and another thread may then reload the index.  */
+  grips = xtrymalloc (idx->nitems * 20 + 1);
+  if (!grips)
+    return gpg_error_from_syserror ();
+  for (ngrips=i=0; i < idx->nitems; i++)
+    if (!idx->items[i].disabled)
+      {
+        log_assert (strlen (idx->items[i].hexgrip) == 40);
+        hex2bin (idx->items[i].hexgrip, grips + 20 * ngrips++, 20);
+      }
 
-  while (!read_control_file_item (cf))
+  blobs = es_fopenmem (0, "r+b");
+  if (!blobs)
     {
-      unsigned char grip[20];
-
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (cf->item.disabled)
-        continue;
-      log_assert (strlen (cf->item.hexgrip) == 40);
-      hex2bin (cf->item.hexgrip, grip, sizeof (grip));
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
 
-      err = agent_public_key_from_file (ctrl, grip, &key_public);
+  for (i=0; i < ngrips; i++)
+    {
+      err = agent_public_key_from_file (ctrl, grips + 20 * i, &key_public);
       if (err)
         {
-          log_error ("%s:%d: key '%s' skipped: %s\n",
-                     cf->fname, cf->lnr, cf->item.hexgrip,
-                     gpg_strerror (err));
+          char hexgrip[40+1];
+
+          bin2hex (grips + 20 * i, 20, hexgrip);
+          log_error ("%s: key '%s' skipped: %s\n",
+                     SSH_CONTROL_FILE_NAME, hexgrip, gpg_strerror (err));
           continue;
         }
 
-      err = ssh_send_key_public (key_blobs, key_public, NULL);
-      if (err)
-        goto out;
+      err = ssh_send_key_public (blobs, key_public, NULL);
       gcry_sexp_release (key_public);
       key_public = NULL;
+      if (err)
+        goto leave;
 
-      key_counter++;
+      nkeys++;
     }
-  err = 0;
+
+  err = identity_cache_put (&control_identity_cache, seqno, keycounter,
+                            blobs, nkeys);
+  blobs = NULL;
+  if (err)
+    goto leave;
+  if (control_identity_cache.bloblen
+      && es_write (key_blobs, control_identity_cache.blobs,
+                   control_identity_cache.bloblen, NULL))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  *r_counter += nkeys;
+
+ leave:
+  es_fclose (blobs);
+  xfree (grips);
+  return err;
+}
+
+
+/* Handler for the "request_identities" command.  */
+static gpg_error_t
+ssh_handler_request_identities (ctrl_t ctrl,
+                                estream_t request, estream_t response)
+{
+  u32 key_counter;
+  estream_t key_blobs;
+  gpg_error_t err;
+  int ret;
+  gpg_error_t ret_err;
+
+  (void)request;
+
+  /* Prepare buffer stream.  */
+
+  key_counter = 0;
+
+  key_blobs = es_fopenmem (0, "r+b");
+  if (! key_blobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+
+  /* First check whether a key is currently available in the card
+     reader - this should be allowed even without being listed in
+     sshcontrol. */
+
+  if (!opt.disable_scdaemon)
+    {
+      err = card_identities (ctrl, key_blobs, &key_counter);
+      if (err)
+        goto out;
+    }
+
+  /* Then look at all the registered and non-disabled keys. */
+  err = control_identities (ctrl, key_blobs, &key_counter);
+  if (err)
+    goto out;
 
   ret = es_fseek (key_blobs, 0, SEEK_SET);
   if (ret)
@@ -2677,8 +3020,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
  out:
   /* Send response.  */
 
-  gcry_sexp_release (key_public);
-
   if (!err)
     {
       ret_err = stream_write_byte (response, SSH_RESPONSE_IDENTITIES_ANSWER);
@@ -2695,7 +3036,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
     }
 
   es_fclose (key_blobs);
-  close_control_file (cf);
 
   return ret_err;
 }
@@ -2832,6 +3172,7 @@ ssh_handler_sign_request (ctrl_t ctrl, estream_t request, estream_t response)
   unsigned char hash[MAX_DIGEST_LEN];
   unsigned int hash_n;
   unsigned char key_grip[20];
+  unsigned char blobhash[32];
   unsigned char *key_blob = NULL;
   u32 key_blob_size;
   unsigned char *data = NULL;
@@ -2848,9 +3189,20 @@ ssh_handler_sign_request (ctrl_t ctrl, estream_t request, estream_t response)
   if (err)
     goto out;
 
-  err = ssh_read_key_public_from_blob (key_blob, key_blob_size, &key, &spec);
-  if (err)
-    goto out;
+  /* Parse the key and compute the keygrip only if the blob is not yet
+     known.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA256, blobhash, key_blob, key_blob_size);
+  if (!blob_index_get (blobhash, key_grip, &spec))
+    {
+      err = ssh_read_key_public_from_blob (key_blob, key_blob_size,
+                                           &key, &spec);
+      if (err)
+        goto out;
+      err = ssh_key_grip (key, key_grip);
+      if (err)
+        goto out;
+      blob_index_put (blobhash, key_grip, &spec);
+    }
 
   /* Receive data to sign.  */
   err = stream_read_string (request, 0, &data, &data_size);
@@ -2900,10 +3252,6 @@ ssh_handler_sign_request (ctrl_t ctrl, estream_t request, estream_t response)
   else
     ctrl->digest.raw_value = 1;
 
-  /* Calculate key grip.  */
-  err = ssh_key_grip (key, key_grip);
-  if (err)
-    goto out;
   ctrl->have_keygrip = 1;
   memcpy (ctrl->keygrip, key_grip, 20);
 
@@ -41,6 +41,7 @@
 #include "../common/ssh-utils.h"
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/tracepoint.h"
 
 
 /* Maximum allowed size of the inquired ciphertext.  */
@@ -94,6 +95,10 @@ struct server_local_s
   /* Flag indicating whether pinentry notifications shall be done. */
   unsigned int allow_pinentry_notify : 1;
 
+  /* Flag indicating that the client may pass bulk data using the
+   * INPUT and OUTPUT fds instead of inquiries and data lines.  */
+  unsigned int bulk_data_fd : 1;
+
   /* An allocated description for the next key operation.  This is
      used if a pinnetry needs to be popped up.  */
   char *keydesc;
@@ -112,6 +117,9 @@ struct server_local_s
 
   /* Last PASSWD_NONCE sent as status (malloced). */
   char *last_passwd_nonce;
+
+  /* The time the current command has been started.  */
+  unsigned long long cmd_started;
 };
 
 
@@ -478,6 +486,24 @@ bump_card_eventcounter (void)
 }
 
 
+/* Return the current value of the key event counter.  This may be
+   used to detect changes to the private key database.  */
+unsigned int
+get_key_eventcounter (void)
+{
+  return eventcounter.key;
+}
+
+
+/* Return the current value of the card event counter.  This may be
+   used to detect changes of the card readers stati.  */
+unsigned int
+get_card_eventcounter (void)
+{
+  return eventcounter.card;
+}
+
+
 
 
 static const char hlp_istrusted[] =
@@ -635,6 +661,34 @@ cmd_sigkey (assuan_context_t ctx, char *line)
 }
 
 
+/* Set the plus and percent escaped description DESC for the next
+ * operation.  DESC is modified.  */
+static gpg_error_t
+set_keydesc (ctrl_t ctrl, char *desc)
+{
+  /* Note, that we only need to replace the + characters and should
+     leave the other escaping in place because the escaped string is
+     send verbatim to the pinentry which does the unescaping (but not
+     the + replacing) */
+  plus_to_blank (desc);
+
+  xfree (ctrl->server_local->keydesc);
+
+  if (ctrl->restricted)
+    {
+      ctrl->server_local->keydesc = strconcat
+        ((ctrl->restricted == 2
+         ? _("Note: Request from the web browser.")
+         : _("Note: Request from a remote site.")  ), "%0A%0A", desc, NULL);
+    }
+  else
+    ctrl->server_local->keydesc = xtrystrdup (desc);
+  if (!ctrl->server_local->keydesc)
+    return out_of_core ();
+  return 0;
+}
+
+
 static const char hlp_setkeydesc[] =
   "SETKEYDESC plus_percent_escaped_string\n"
   "\n"
@@ -665,25 +719,45 @@ cmd_setkeydesc (assuan_context_t ctx, char *line)
   if (!*desc)
     return set_error (GPG_ERR_ASS_PARAMETER, "no description given");
 
-  /* Note, that we only need to replace the + characters and should
-     leave the other escaping in place because the escaped string is
-     send verbatim to the pinentry which does the unescaping (but not
-     the + replacing) */
-  plus_to_blank (desc);
+  return set_keydesc (ctrl, desc);
+}
 
-  xfree (ctrl->server_local->keydesc);
 
-  if (ctrl->restricted)
-    {
-      ctrl->server_local->keydesc = strconcat
-        ((ctrl->restricted == 2
-         ? _("Note: Request from the web browser.")
-         : _("Note: Request from a remote site.")  ), "%0A%0A", desc, NULL);
-    }
-  else
-    ctrl->server_local->keydesc = xtrystrdup (desc);
-  if (!ctrl->server_local->keydesc)
-    return out_of_core ();
+/* Set the hash value given as hex string at LINE for the hash
+ * algorithm ALGO.  */
+static gpg_error_t
+set_hash (assuan_context_t ctx, int algo, const char *line)
+{
+  int rc;
+  size_t n;
+  const char *p;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  unsigned char *buf;
+
+  ctrl->digest.algo = algo;
+  ctrl->digest.raw_value = 0;
+
+  /* Parse the hash value. */
+  n = 0;
+  rc = parse_hexstring (ctx, line, &n);
+  if (rc)
+    return rc;
+  n /= 2;
+  if (algo == MD_USER_TLS_MD5SHA1 && n == 36)
+    ;
+  else if (n != 16 && n != 20 && n != 24
+           && n != 28 && n != 32 && n != 48 && n != 64)
+    return set_error (GPG_ERR_ASS_PARAMETER, "unsupported length of hash");
+
+  if (n > MAX_DIGEST_LEN)
+    return set_error (GPG_ERR_ASS_PARAMETER, "hash value to long");
+
+  buf = ctrl->digest.value;
+  ctrl->digest.valuelen = n;
+  for (p=line, n=0; n < ctrl->digest.valuelen; p += 2, n++)
+    buf[n] = xtoi_2 (p);
+  for (; n < ctrl->digest.valuelen; n++)
+    buf[n] = 0;
   return 0;
 }
 
@@ -696,11 +770,6 @@ static const char hlp_sethash[] =
 static gpg_error_t
 cmd_sethash (assuan_context_t ctx, char *line)
 {
-  int rc;
-  size_t n;
-  char *p;
-  ctrl_t ctrl = assuan_get_pointer (ctx);
-  unsigned char *buf;
   char *endp;
   int algo;
 
@@ -741,31 +810,8 @@ cmd_sethash (assuan_context_t ctx, char *line)
       if (!algo || gcry_md_test_algo (algo))
         return set_error (GPG_ERR_UNSUPPORTED_ALGORITHM, NULL);
     }
-  ctrl->digest.algo = algo;
-  ctrl->digest.raw_value = 0;
 
-  /* Parse the hash value. */
-  n = 0;
-  rc = parse_hexstring (ctx, line, &n);
-  if (rc)
-    return rc;
-  n /= 2;
-  if (algo == MD_USER_TLS_MD5SHA1 && n == 36)
-    ;
-  else if (n != 16 && n != 20 && n != 24
-           && n != 28 && n != 32 && n != 48 && n != 64)
-    return set_error (GPG_ERR_ASS_PARAMETER, "unsupported length of hash");
-
-  if (n > MAX_DIGEST_LEN)
-    return set_error (GPG_ERR_ASS_PARAMETER, "hash value to long");
-
-  buf = ctrl->digest.value;
-  ctrl->digest.valuelen = n;
-  for (p=line, n=0; n < ctrl->digest.valuelen; p += 2, n++)
-    buf[n] = xtoi_2 (p);
-  for (; n < ctrl->digest.valuelen; n++)
-    buf[n] = 0;
-  return 0;
+  return set_hash (ctx, algo, line);
 }
 
 
@@ -773,7 +819,11 @@ static const char hlp_pksign[] =
   "PKSIGN [<options>] [<cache_nonce>]\n"
   "\n"
   "Perform the actual sign operation.  Neither input nor output are\n"
-  "sensitive to eavesdropping.";
+  "sensitive to eavesdropping.\n"
+  "\n"
+  "The options --keygrip=<hexgrip>, --desc=<plus_percent_escaped_string>\n"
+  "and --hash-algo=<algonumber> with --digest=<hexstring> may be used\n"
+  "instead of the commands SIGKEY, SETKEYDESC and SETHASH.";
 static gpg_error_t
 cmd_pksign (assuan_context_t ctx, char *line)
 {
@@ -782,7 +832,49 @@ cmd_pksign (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   membuf_t outbuf;
   char *cache_nonce = NULL;
+  char *value = NULL;
+  char *digest = NULL;
   char *p;
+  int algo;
+
+  err = get_option_value (line, "--keygrip", &value);
+  if (!err && value)
+    {
+      err = parse_keygrip (ctx, value, ctrl->keygrip);
+      if (!err)
+        ctrl->have_keygrip = 1;
+      xfree (value);
+      value = NULL;
+    }
+  if (!err)
+    err = get_option_value (line, "--digest", &digest);
+  if (!err)
+    err = get_option_value (line, "--hash-algo", &value);
+  if (!err && (!value != !digest))
+    err = set_error (GPG_ERR_ASS_PARAMETER,
+                     "--hash-algo and --digest must be used together");
+  else if (!err && value)
+    {
+      algo = (int)strtoul (value, NULL, 10);
+      if (!algo || gcry_md_test_algo (algo))
+        err = set_error (GPG_ERR_UNSUPPORTED_ALGORITHM, NULL);
+      else
+        err = set_hash (ctx, algo, digest);
+    }
+  xfree (value);
+  value = NULL;
+  xfree (digest);
+  if (!err)
+    err = get_option_value (line, "--desc", &value);
+  if (!err && value)
+    err = set_keydesc (ctrl, value);
+  xfree (value);
+  if (err)
+    {
+      xfree (ctrl->server_local->keydesc);
+      ctrl->server_local->keydesc = NULL;
+      return leave_cmd (ctx, err);
+    }
 
   line = skip_options (line);
 
@@ -2103,6 +2195,75 @@ cmd_keywrap_key (assuan_context_t ctx, char *line)
 
 
 
+/* Read up to MAXLEN bytes of bulk data from the INPUT fd of CTX and
+ * store them at R_BUF and R_BUFLEN.  The fd is closed.  */
+static gpg_error_t
+read_bulk_input (assuan_context_t ctx, size_t maxlen,
+                 unsigned char **r_buf, size_t *r_buflen)
+{
+  gpg_error_t err = 0;
+  int fd = FD2INT (assuan_get_input_fd (ctx));
+  unsigned char *buf;
+  size_t len = 0;
+  ssize_t n;
+
+  *r_buf = NULL;
+  *r_buflen = 0;
+  buf = xtrymalloc (maxlen + 1);
+  if (!buf)
+    err = gpg_error_from_syserror ();
+  while (!err)
+    {
+      n = read (fd, buf + len, maxlen + 1 - len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        err = gpg_error_from_syserror ();
+      else if (!n)
+        break;
+      else if ((len += n) > maxlen)
+        err = gpg_error (GPG_ERR_TOO_LARGE);
+    }
+  assuan_close_input_fd (ctx);
+  if (err)
+    {
+      xfree (buf);
+      return err;
+    }
+  *r_buf = buf;
+  *r_buflen = len;
+  return 0;
+}
+
+
+/* Write the bulk data BUF of length BUFLEN to the OUTPUT fd of CTX.
+ * The fd is closed.  */
+static gpg_error_t
+write_bulk_output (assuan_context_t ctx, const void *buf, size_t buflen)
+{
+  gpg_error_t err = 0;
+  int fd = FD2INT (assuan_get_output_fd (ctx));
+  const unsigned char *p = buf;
+  ssize_t n;
+
+  while (!err && buflen)
+    {
+      n = write (fd, p, buflen);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          p += n;
+          buflen -= n;
+        }
+    }
+  assuan_close_output_fd (ctx);
+  return err;
+}
+
+
 static const char hlp_import_key[] =
   "IMPORT_KEY [--unattended] [--force] [<cache_nonce>]\n"
   "\n"
@@ -2110,7 +2271,9 @@ static const char hlp_import_key[] =
   "encrypted using the current session's key wrapping key (cf. command\n"
   "KEYWRAP_KEY) using the AESWRAP-128 algorithm.  This function takes\n"
   "no arguments but uses the inquiry \"KEYDATA\" to ask for the actual\n"
-  "key data.  The unwrapped key must be a canonical S-expression.  The\n"
+  "key data.  If the option \"bulk-data-fd\" is set and an INPUT fd\n"
+  "has been given, the key data is read from that fd instead.  The\n"
+  "unwrapped key must be a canonical S-expression.  The\n"
   "option --unattended tries to import the key as-is without any\n"
   "re-encryption.  Existing key can be overwritten with --force.";
 static gpg_error_t
@@ -2152,10 +2315,16 @@ cmd_import_key (assuan_context_t ctx, char *line)
   if (*line)
     cache_nonce = xtrystrdup (line);
 
-  assuan_begin_confidential (ctx);
-  err = assuan_inquire (ctx, "KEYDATA",
-                        &wrappedkey, &wrappedkeylen, MAXLEN_KEYDATA);
-  assuan_end_confidential (ctx);
+  if (ctrl->server_local->bulk_data_fd
+      && assuan_get_input_fd (ctx) != ASSUAN_INVALID_FD)
+    err = read_bulk_input (ctx, MAXLEN_KEYDATA, &wrappedkey, &wrappedkeylen);
+  else
+    {
+      assuan_begin_confidential (ctx);
+      err = assuan_inquire (ctx, "KEYDATA",
+                            &wrappedkey, &wrappedkeylen, MAXLEN_KEYDATA);
+      assuan_end_confidential (ctx);
+    }
   if (err)
     goto leave;
   if (wrappedkeylen < 24)
@@ -2295,6 +2464,8 @@ cmd_import_key (assuan_context_t ctx, char *line)
   xfree (cache_nonce);
   xfree (ctrl->server_local->keydesc);
   ctrl->server_local->keydesc = NULL;
+  if (ctrl->server_local->bulk_data_fd)
+    assuan_close_input_fd (ctx);
   return leave_cmd (ctx, err);
 }
 
@@ -2311,7 +2482,11 @@ static const char hlp_export_key[] =
   "If --openpgp is used, the secret key material will be exported in RFC 4880\n"
   "compatible passphrase-protected form.  Without --openpgp, the secret key\n"
   "material will be exported in the clear (after prompting the user to unlock\n"
-  "it, if needed).\n";
+  "it, if needed).\n"
+  "\n"
+  "If the option \"bulk-data-fd\" is set and an OUTPUT fd has been\n"
+  "given, the wrapped key is written to that fd instead of being\n"
+  "returned in data lines.\n";
 static gpg_error_t
 cmd_export_key (assuan_context_t ctx, char *line)
 {
@@ -2452,9 +2627,15 @@ cmd_export_key (assuan_context_t ctx, char *line)
   gcry_cipher_close (cipherhd);
   cipherhd = NULL;
 
-  assuan_begin_confidential (ctx);
-  err = assuan_send_data (ctx, wrappedkey, wrappedkeylen);
-  assuan_end_confidential (ctx);
+  if (ctrl->server_local->bulk_data_fd
+      && assuan_get_output_fd (ctx) != ASSUAN_INVALID_FD)
+    err = write_bulk_output (ctx, wrappedkey, wrappedkeylen);
+  else
+    {
+      assuan_begin_confidential (ctx);
+      err = assuan_send_data (ctx, wrappedkey, wrappedkeylen);
+      assuan_end_confidential (ctx);
+    }
 
 
  leave:
@@ -2467,6 +2648,8 @@ cmd_export_key (assuan_context_t ctx, char *line)
   xfree (ctrl->server_local->keydesc);
   ctrl->server_local->keydesc = NULL;
   xfree (shadow_info);
+  if (ctrl->server_local->bulk_data_fd)
+    assuan_close_output_fd (ctx);
 
   return leave_cmd (ctx, err);
 }
@@ -3070,6 +3253,7 @@ static const char hlp_getinfo[] =
   "  connections     - Return number of active connections.\n"
   "  jent_active     - Returns OK if Libgcrypt's JENT is active.\n"
   "  restricted      - Returns OK if the connection is in restricted mode.\n"
+  "  metrics         - Return counters and latency histograms.\n"
   "  cmd_has_option CMD OPT\n"
   "                  - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
@@ -3156,6 +3340,16 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       else
         rc = gpg_error (GPG_ERR_NO_DATA);
     }
+  else if (!strcmp (line, "metrics"))
+    {
+      char *string = metrics_format ();
+
+      if (!string)
+        rc = gpg_error_from_syserror ();
+      else
+        rc = assuan_send_data (ctx, string, strlen (string));
+      xfree (string);
+    }
   else if (!strcmp (line, "scd_running"))
     {
       rc = agent_scd_check_running ()? 0 : gpg_error (GPG_ERR_FALSE);
@@ -3339,6 +3533,14 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
     ctrl->server_local->use_cache_for_signing = *value? !!atoi (value) : 0;
   else if (!strcmp (key, "allow-pinentry-notify"))
     ctrl->server_local->allow_pinentry_notify = 1;
+  else if (!strcmp (key, "bulk-data-fd"))
+    {
+#ifdef HAVE_W32_SYSTEM
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+#else
+      ctrl->server_local->bulk_data_fd = *value? !!atoi (value) : 0;
+#endif
+    }
   else if (!strcmp (key, "pinentry-mode"))
     {
       int tmp = parse_pinentry_mode (value);
@@ -3385,6 +3587,20 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 
+/* Called by libassuan before all commands.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  (void)cmd;
+
+  TRACEPOINT1 (agent_command_begin, cmd);
+  ctrl->server_local->cmd_started = metrics_start ();
+  return 0;
+}
+
+
 /* Called by libassuan after all commands. ERR is the error from the
    last assuan operation and not the one returned from the command. */
 static void
@@ -3394,6 +3610,10 @@ post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
 
   (void)err;
 
+  TRACEPOINT1 (agent_command_end, err);
+  metrics_time_command (assuan_get_command_name (ctx),
+                        ctrl->server_local->cmd_started);
+
   /* Switch off any I/O monitor controlled logging pausing. */
   ctrl->server_local->pause_io_logging = 0;
 }
@@ -3458,6 +3678,11 @@ command_has_option (const char *cmd, const char *cmdopt)
       if (!strcmp (cmdopt, "repeat"))
           return 1;
     }
+  else if (!strcmp (cmd, "PKSIGN"))
+    {
+      if (!strcmp (cmdopt, "keygrip"))
+          return 1;
+    }
 
   return 0;
 }
@@ -3520,6 +3745,7 @@ register_commands (assuan_context_t ctx)
       if (rc)
         return rc;
     }
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
   assuan_register_post_cmd_notify (ctx, post_cmd_notify);
   assuan_register_reset_notify (ctx, reset_notify);
   assuan_register_option_handler (ctx, option_handler);
@@ -3566,7 +3792,13 @@ start_command_handler (ctrl_t ctrl, gnupg_fd_t listen_fd, gnupg_fd_t fd)
     }
   else
     {
+#ifdef HAVE_W32_SYSTEM
       rc = assuan_init_socket_server (ctx, fd, ASSUAN_SOCKET_SERVER_ACCEPTED);
+#else
+      rc = assuan_init_socket_server (ctx, fd,
+                                      (ASSUAN_SOCKET_SERVER_ACCEPTED
+                                       |ASSUAN_SOCKET_SERVER_FDPASSING));
+#endif
     }
   if (rc)
     {
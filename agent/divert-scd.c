@@ -32,6 +32,13 @@
 #include "../common/sexp-parse.h"
 
 
+/* The keygrip of the last key which ask_for_card found on a card.
+ * Signing with that key again skips the SERIALNO and KEYINFO round
+ * trips and directly asks the scdaemon to sign.  */
+static unsigned char last_card_grip[20];
+static int last_card_grip_valid;
+
+
 static gpg_error_t
 ask_for_card (ctrl_t ctrl, const unsigned char *shadow_info,
               const unsigned char *grip, char **r_kid)
@@ -83,6 +90,8 @@ ask_for_card (ctrl_t ctrl, const unsigned char *shadow_info,
               /* Key for GRIP found, use it directly.  */
               agent_card_free_keyinfo (keyinfo);
               xfree (want_sn);
+              memcpy (last_card_grip, grip, 20);
+              last_card_grip_valid = 1;
               if ((*r_kid = xtrystrdup (hexgrip)))
                 return 0;
               else
@@ -403,34 +412,21 @@ getpin_cb (void *opaque, const char *desc_text, const char *info,
 
 
 
-/* This function is used when a sign operation has been diverted to a
- * smartcard.  DESC_TEXT is the original text for a prompt has send by
- * gpg to gpg-agent.
- *
- * FIXME: Explain the other args.  */
-int
-divert_pksign (ctrl_t ctrl, const char *desc_text, const unsigned char *grip,
-               const unsigned char *digest, size_t digestlen, int algo,
-               const unsigned char *shadow_info, unsigned char **r_sig,
-               size_t *r_siglen)
+/* Ask the scdaemon to sign DIGEST using the key KID.  On success the
+ * signature is stored at R_SIG and R_SIGLEN.  */
+static int
+card_pksign (ctrl_t ctrl, const char *kid,
+             const unsigned char *digest, size_t digestlen, int algo,
+             unsigned char **r_sig, size_t *r_siglen)
 {
   int rc;
-  char *kid;
-  size_t siglen;
-  unsigned char *sigval = NULL;
-
-  (void)desc_text;
-
-  rc = ask_for_card (ctrl, shadow_info, grip, &kid);
-  if (rc)
-    return rc;
 
   if (algo == MD_USER_TLS_MD5SHA1)
     {
       int save = ctrl->use_auth_call;
       ctrl->use_auth_call = 1;
       rc = agent_card_pksign (ctrl, kid, getpin_cb, ctrl, NULL,
-                              algo, digest, digestlen, &sigval, &siglen);
+                              algo, digest, digestlen, r_sig, r_siglen);
       ctrl->use_auth_call = save;
     }
   else
@@ -442,19 +438,71 @@ divert_pksign (ctrl_t ctrl, const char *desc_text, const unsigned char *grip,
       if (!rc)
         {
           rc = agent_card_pksign (ctrl, kid, getpin_cb, ctrl, NULL,
-                                  algo, data, ndata, &sigval, &siglen);
+                                  algo, data, ndata, r_sig, r_siglen);
           xfree (data);
         }
     }
 
+  return rc;
+}
+
+
+/* This function is used when a sign operation has been diverted to a
+ * smartcard.  DESC_TEXT is the original text for a prompt has send by
+ * gpg to gpg-agent.
+ *
+ * FIXME: Explain the other args.  */
+int
+divert_pksign (ctrl_t ctrl, const char *desc_text, const unsigned char *grip,
+               const unsigned char *digest, size_t digestlen, int algo,
+               const unsigned char *shadow_info, unsigned char **r_sig,
+               size_t *r_siglen)
+{
+  int rc;
+  char *kid;
+  char hexgrip[41];
+  size_t siglen;
+  unsigned char *sigval = NULL;
+
+  (void)desc_text;
+
+  /* If the key was found on a card the last time, try to sign right
+   * away.  Only if the card or the key is not available anymore we
+   * fall back to the full card lookup.  */
+  if (last_card_grip_valid && !memcmp (last_card_grip, grip, 20))
+    {
+      bin2hex (grip, 20, hexgrip);
+      rc = card_pksign (ctrl, hexgrip, digest, digestlen, algo,
+                        &sigval, &siglen);
+      switch (gpg_err_code (rc))
+        {
+        case GPG_ERR_CARD_NOT_PRESENT:
+        case GPG_ERR_CARD_REMOVED:
+        case GPG_ERR_NO_SECKEY:
+        case GPG_ERR_NOT_FOUND:
+        case GPG_ERR_WRONG_CARD:
+        case GPG_ERR_ENODEV:
+          last_card_grip_valid = 0;
+          break;
+        default:
+          goto leave;
+        }
+    }
+
+  rc = ask_for_card (ctrl, shadow_info, grip, &kid);
+  if (rc)
+    return rc;
+
+  rc = card_pksign (ctrl, kid, digest, digestlen, algo, &sigval, &siglen);
+  xfree (kid);
+
+ leave:
   if (!rc)
     {
       *r_sig = sigval;
       *r_siglen = siglen;
     }
 
-  xfree (kid);
-
   return rc;
 }
 
@@ -34,6 +34,7 @@
 #include "../common/i18n.h"
 #include "../common/ssh-utils.h"
 #include "../common/name-value.h"
+#include "../common/sexp-parse.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -50,6 +51,33 @@ struct try_unprotect_arg_s
 };
 
 
+/* The number of entries in the key info cache.  */
+#define KEYINFO_CACHE_SIZE 256
+
+/* An entry of the key info cache.  The cache holds information
+ * derived from a key file which is often requested (e.g. by KEYINFO
+ * --list or READKEY) and thus saves us from reading and parsing the
+ * file again.  An entry is only valid as long as the stat values of
+ * the file match the stored ones.  */
+struct keyinfo_cache_s
+{
+  int used;
+  unsigned char grip[20];
+  time_t file_mtime;       /* The stat values of the key file.  */
+  off_t file_size;
+  ino_t file_ino;
+  int keytype;             /* PRIVATE_KEY_UNKNOWN if not yet known.  */
+  unsigned char *shadow_info;  /* Canonical S-expression or NULL.  */
+  unsigned char *pubkey;   /* The canonical public key or NULL.  */
+  size_t pubkeylen;
+};
+
+/* The cache indexed by the first two bytes of the keygrip.  The
+ * entries are accessed without a yield point in between and thus
+ * need no lock with nPth.  */
+static struct keyinfo_cache_s keyinfo_cache[KEYINFO_CACHE_SIZE];
+
+
 /* Repalce all linefeeds in STRING by "%0A" and return a new malloced
  * string.  May return NULL on memory error.  */
 static char *
@@ -80,6 +108,76 @@ linefeed_to_percent0A (const char *string)
 }
 
 
+/* Return the slot of the key info cache for GRIP.  */
+static struct keyinfo_cache_s *
+keyinfo_cache_slot (const unsigned char *grip)
+{
+  return keyinfo_cache + ((grip[0] << 8 | grip[1]) % KEYINFO_CACHE_SIZE);
+}
+
+
+/* Release the data of the key info cache entry R.  */
+static void
+keyinfo_cache_clear (struct keyinfo_cache_s *r)
+{
+  xfree (r->shadow_info);
+  xfree (r->pubkey);
+  memset (r, 0, sizeof *r);
+}
+
+
+/* Remove the key info cache entry for GRIP.  */
+static void
+keyinfo_cache_invalidate (const unsigned char *grip)
+{
+  struct keyinfo_cache_s *r = keyinfo_cache_slot (grip);
+
+  if (r->used && !memcmp (r->grip, grip, 20))
+    keyinfo_cache_clear (r);
+}
+
+
+/* Return the key info cache entry for GRIP if it matches the stat
+ * values ST of the key file.  A stale entry is removed.  */
+static struct keyinfo_cache_s *
+keyinfo_cache_get (const unsigned char *grip, const struct stat *st)
+{
+  struct keyinfo_cache_s *r = keyinfo_cache_slot (grip);
+
+  if (!r->used || memcmp (r->grip, grip, 20))
+    return NULL;
+  if (r->file_mtime != st->st_mtime || r->file_size != st->st_size
+      || r->file_ino != st->st_ino)
+    {
+      keyinfo_cache_clear (r);
+      return NULL;
+    }
+  return r;
+}
+
+
+/* Return the key info cache entry for GRIP and the stat values ST.
+ * An existing entry for another key or with other stat values is
+ * replaced by an empty one.  */
+static struct keyinfo_cache_s *
+keyinfo_cache_new (const unsigned char *grip, const struct stat *st)
+{
+  struct keyinfo_cache_s *r;
+
+  r = keyinfo_cache_get (grip, st);
+  if (r)
+    return r;
+  r = keyinfo_cache_slot (grip);
+  keyinfo_cache_clear (r);
+  r->used = 1;
+  memcpy (r->grip, grip, 20);
+  r->file_mtime = st->st_mtime;
+  r->file_size = st->st_size;
+  r->file_ino = st->st_ino;
+  return r;
+}
+
+
 /* Note: Ownership of FNAME and FP are moved to this function.  */
 static gpg_error_t
 write_extended_private_key (char *fname, estream_t fp, int update,
@@ -216,6 +314,9 @@ agent_write_private_key (const unsigned char *grip,
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
                          hexgrip, NULL);
 
+  /* An in-place update may keep the stat values of the file.  */
+  keyinfo_cache_invalidate (grip);
+
   /* FIXME: Write to a temp file first so that write failures during
      key updates won't lead to a key loss.  */
 
@@ -322,6 +423,24 @@ agent_write_private_key (const unsigned char *grip,
 }
 
 
+/* Wrapper around agent_unprotect to record the time it takes.  */
+static gpg_error_t
+unprotect_key (ctrl_t ctrl, const unsigned char *protectedkey,
+               const char *passphrase, gnupg_isotime_t protected_at,
+               unsigned char **result, size_t *resultlen)
+{
+  unsigned long long start = metrics_start ();
+  gpg_error_t err;
+
+  err = agent_unprotect (ctrl, protectedkey, passphrase, protected_at,
+                         result, resultlen);
+  metrics_time (METRICS_TIME_UNPROTECT, start);
+  if (gpg_err_code (err) == GPG_ERR_BAD_PASSPHRASE)
+    metrics_count (METRICS_BAD_PASSPHRASE);
+  return err;
+}
+
+
 /* Callback function to try the unprotection from the passphrase query
    code. */
 static gpg_error_t
@@ -337,8 +456,8 @@ try_unprotect_cb (struct pin_entry_info_s *pi)
   log_assert (!arg->unprotected_key);
 
   arg->change_required = 0;
-  err = agent_unprotect (ctrl, arg->protected_key, pi->pin, protected_at,
-                         &arg->unprotected_key, &dummy);
+  err = unprotect_key (ctrl, arg->protected_key, pi->pin, protected_at,
+                       &arg->unprotected_key, &dummy);
   if (err)
     return err;
   if (!opt.max_passphrase_days || ctrl->in_passwd)
@@ -608,7 +727,7 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
       pw = agent_get_cache (ctrl, cache_nonce, CACHE_MODE_NONCE);
       if (pw)
         {
-          rc = agent_unprotect (ctrl, *keybuf, pw, NULL, &result, &resultlen);
+          rc = unprotect_key (ctrl, *keybuf, pw, NULL, &result, &resultlen);
           if (!rc)
             {
               if (r_passphrase)
@@ -633,7 +752,7 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
       pw = agent_get_cache (ctrl, hexgrip, cache_mode);
       if (pw)
         {
-          rc = agent_unprotect (ctrl, *keybuf, pw, NULL, &result, &resultlen);
+          rc = unprotect_key (ctrl, *keybuf, pw, NULL, &result, &resultlen);
           if (!rc)
             {
               if (cache_mode == CACHE_MODE_NORMAL)
@@ -671,8 +790,8 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
           pw = agent_get_cache (ctrl, NULL, cache_mode);
           if (pw)
             {
-              rc = agent_unprotect (ctrl, *keybuf, pw, NULL,
-                                    &result, &resultlen);
+              rc = unprotect_key (ctrl, *keybuf, pw, NULL,
+                                  &result, &resultlen);
               if (!rc)
                 {
                   if (r_passphrase)
@@ -793,9 +912,15 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
  * is not NULl and the extended key format is used, the meta data
  * items are stored there.  However the "Key:" item is removed from
  * it.  On failure returns an error code and stores NULL at RESULT and
- * R_KEYMETA. */
+ * R_KEYMETA.  If R_CANON is not NULL, RESULT is not used and the key
+ * is instead returned as a malloced canonical S-expression at R_CANON
+ * and its length at R_CANONLEN.  A key file which is already in
+ * canonical format is then returned as read without parsing it into
+ * an S-expression object.  */
 static gpg_error_t
-read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
+do_read_key_file (const unsigned char *grip, gcry_sexp_t *result,
+                  unsigned char **r_canon, size_t *r_canonlen,
+                  nvc_t *r_keymeta)
 {
   gpg_error_t err;
   char *fname;
@@ -807,6 +932,12 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
   char hexgrip[40+4+1];
   char first;
 
+  if (r_canon)
+    {
+      *r_canon = NULL;
+      *r_canonlen = 0;
+      result = &s_skey;
+    }
   *result = NULL;
   if (r_keymeta)
     *r_keymeta = NULL;
@@ -867,6 +998,12 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
             nvc_delete_named (pk, "Key:");
         }
 
+      if (!err && r_canon)
+        {
+          err = make_canon_sexp (s_skey, r_canon, r_canonlen);
+          gcry_sexp_release (s_skey);
+        }
+
       if (!err && r_keymeta)
         *r_keymeta = pk;
       else
@@ -909,10 +1046,19 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
       return err;
     }
 
-  /* Convert the file into a gcrypt S-expression object.  */
-  err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   xfree (fname);
   es_fclose (fp);
+
+  /* A canonical key file can be used directly.  */
+  if (r_canon && (*r_canonlen = gcry_sexp_canon_len (buf, buflen,
+                                                       NULL, NULL)))
+    {
+      *r_canon = buf;
+      return 0;
+    }
+
+  /* Convert the file into a gcrypt S-expression object.  */
+  err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   xfree (buf);
   if (err)
     {
@@ -920,11 +1066,122 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
                  (unsigned int)erroff, gpg_strerror (err));
       return err;
     }
+  if (r_canon)
+    {
+      err = make_canon_sexp (s_skey, r_canon, r_canonlen);
+      gcry_sexp_release (s_skey);
+      return err;
+    }
   *result = s_skey;
   return 0;
 }
 
 
+/* Wrapper around do_read_key_file to record the time it takes.  */
+static gpg_error_t
+read_key_file (const unsigned char *grip, gcry_sexp_t *result, nvc_t *r_keymeta)
+{
+  unsigned long long start = metrics_start ();
+  gpg_error_t err;
+
+  err = do_read_key_file (grip, result, NULL, NULL, r_keymeta);
+  metrics_time (METRICS_TIME_KEY_FILE_READ, start);
+  return err;
+}
+
+
+/* Same as read_key_file but return the key as a malloced canonical
+ * S-expression at R_BUF and its length at R_BUFLEN.  */
+static gpg_error_t
+read_key_file_canon (const unsigned char *grip,
+                     unsigned char **r_buf, size_t *r_buflen,
+                     nvc_t *r_keymeta)
+{
+  unsigned long long start = metrics_start ();
+  gpg_error_t err;
+
+  err = do_read_key_file (grip, NULL, r_buf, r_buflen, r_keymeta);
+  metrics_time (METRICS_TIME_KEY_FILE_READ, start);
+  return err;
+}
+
+
+/* Return the comment of the canonical encoded key BUF as a malloced
+ * string or NULL if there is none.  Note, that we take the comment as
+ * a C string for display purposes; i.e. all stuff beyond a Nul
+ * character is ignored.  */
+static char *
+comment_from_canon_key (const unsigned char *buf)
+{
+  const unsigned char *s = buf;
+  size_t n;
+  char *comment;
+
+  if (!sfind_token (&s, "comment") || !(n = snext (&s)))
+    return NULL;
+  comment = xtrymalloc (n+1);
+  if (comment)
+    {
+      memcpy (comment, s, n);
+      comment[n] = 0;
+    }
+  return comment;
+}
+
+
+/* Store the stat values of the key file for GRIP at ST.  Returns
+ * true on success.  */
+static int
+stat_key_file (const unsigned char *grip, struct stat *st)
+{
+  char *fname;
+  char hexgrip[40+4+1];
+  int rc;
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                         hexgrip, NULL);
+  rc = stat (fname, st);
+  xfree (fname);
+  return !rc;
+}
+
+
+/* Return the unprotected key GRIP from the key cache.  The key is
+ * only returned if its passphrase is still in the passphrase cache so
+ * that the key cache never extends the lifetime of a passphrase.  ST
+ * are the current stat values of the key file.  */
+static gcry_sexp_t
+key_from_key_cache (ctrl_t ctrl, const unsigned char *grip,
+                    cache_mode_t cache_mode, const struct stat *st)
+{
+  char hexgrip[40+1];
+  char *pw;
+  unsigned char *buf;
+  size_t buflen, len, erroff;
+  gcry_sexp_t s_skey = NULL;
+
+  bin2hex (grip, 20, hexgrip);
+  pw = agent_get_cache (ctrl, hexgrip, cache_mode);
+  if (!pw)
+    return NULL;
+  xfree (pw);
+
+  buf = agent_get_key_cache (ctrl, grip, st, &buflen);
+  if (!buf)
+    return NULL;
+  len = gcry_sexp_canon_len (buf, buflen, NULL, NULL);
+  if (!len || gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, len))
+    s_skey = NULL;
+  else if (cache_mode == CACHE_MODE_NORMAL)
+    agent_store_cache_hit (hexgrip);
+  wipememory (buf, buflen);
+  xfree (buf);
+  return s_skey;
+}
+
+
 /* Remove the key identified by GRIP from the private key directory.  */
 static gpg_error_t
 remove_key_file (const unsigned char *grip)
@@ -937,6 +1194,7 @@ remove_key_file (const unsigned char *grip)
   strcpy (hexgrip+40, ".key");
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
                          hexgrip, NULL);
+  keyinfo_cache_invalidate (grip);
   if (gnupg_remove (fname))
     err = gpg_error_from_syserror ();
   xfree (fname);
@@ -972,6 +1230,9 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   gcry_sexp_t s_skey;
   nvc_t keymeta = NULL;
   char *desc_text_buffer = NULL;  /* Used in case we extend DESC_TEXT.  */
+  struct stat keyfile_st;
+  int use_key_cache;
+  int put_key_cache = 0;
 
   *result = NULL;
   if (shadow_info)
@@ -979,24 +1240,30 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
-  err = read_key_file (grip, &s_skey, &keymeta);
-  if (err)
+  /* Try the cache of unprotected keys to avoid reading the file and
+   * running the KDF again.  This is not done if a cache nonce or the
+   * passphrase is involved.  */
+  use_key_cache = (opt.key_cache_ttl && cache_mode != CACHE_MODE_IGNORE
+                   && !cache_nonce && !r_passphrase
+                   && stat_key_file (grip, &keyfile_st));
+  if (use_key_cache
+      && (s_skey = key_from_key_cache (ctrl, grip, cache_mode, &keyfile_st)))
     {
-      if (gpg_err_code (err) == GPG_ERR_ENOENT)
-        err = gpg_error (GPG_ERR_NO_SECKEY);
-      return err;
+      *result = s_skey;
+      return 0;
     }
 
-  /* For use with the protection functions we also need the key as an
-     canonical encoded S-expression in a buffer.  Create this buffer
-     now.  */
-  err = make_canon_sexp (s_skey, &buf, &len);
+  /* The protection functions work on the key as a canonical encoded
+     S-expression in a buffer.  An S-expression object is only created
+     when needed.  */
+  err = read_key_file_canon (grip, &buf, &len, &keymeta);
   if (err)
     {
-      nvc_release (keymeta);
-      xfree (desc_text_buffer);
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        err = gpg_error (GPG_ERR_NO_SECKEY);
       return err;
     }
+  s_skey = NULL;
 
   switch (agent_private_key_type (buf))
     {
@@ -1043,20 +1310,16 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
               }
           }
         else
-          {
-            gcry_sexp_t comment_sexp;
-
-            comment_sexp = gcry_sexp_find_token (s_skey, "comment", 0);
-            if (comment_sexp)
-              comment_buffer = gcry_sexp_nth_string (comment_sexp, 1);
-            gcry_sexp_release (comment_sexp);
-            comment = comment_buffer;
-          }
+          comment = comment_buffer = comment_from_canon_key (buf);
 
         desc_text_final = NULL;
 	if (desc_text)
-          err = agent_modify_description (desc_text, comment, s_skey,
-                                          &desc_text_final);
+          {
+            err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, len);
+            if (!err)
+              err = agent_modify_description (desc_text, comment, s_skey,
+                                              &desc_text_final);
+          }
         gcry_free (comment_buffer);
 
 	if (!err)
@@ -1066,6 +1329,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 	    if (err)
 	      log_error ("failed to unprotect the secret key: %s\n",
 			 gpg_strerror (err));
+            else
+              put_key_cache = use_key_cache;
 	  }
 
 	xfree (desc_text_final);
@@ -1119,6 +1384,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 
   buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
   err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
+  if (!err && put_key_cache)
+    agent_put_key_cache (ctrl, grip, &keyfile_st, buf, buflen);
   wipememory (buf, buflen);
   xfree (buf);
   if (err)
@@ -1371,11 +1638,22 @@ agent_public_key_from_file (ctrl_t ctrl,
   int argidx;
   gcry_sexp_t list = NULL;
   const char *s;
+  struct stat st;
+  int have_st;
+  struct keyinfo_cache_s *r;
 
   (void)ctrl;
 
   *result = NULL;
 
+  /* Stat the file before reading it so that a concurrent update
+   * can't leave a cache entry for the old key with the new stat
+   * values.  */
+  have_st = stat_key_file (grip, &st);
+  if (have_st && (r = keyinfo_cache_get (grip, &st)) && r->pubkey
+      && !gcry_sexp_sscan (result, NULL, (char*)r->pubkey, r->pubkeylen))
+    return 0;
+
   err = read_key_file (grip, &s_skey, NULL);
   if (err)
     return err;
@@ -1473,7 +1751,22 @@ agent_public_key_from_file (ctrl_t ctrl,
   gcry_sexp_release (comment_sexp);
 
   if (!err)
-    *result = list;
+    {
+      *result = list;
+      if (have_st)
+        {
+          unsigned char *buf;
+          size_t len;
+
+          if (!make_canon_sexp (list, &buf, &len))
+            {
+              r = keyinfo_cache_new (grip, &st);
+              xfree (r->pubkey);
+              r->pubkey = buf;
+              r->pubkeylen = len;
+            }
+        }
+    }
   return err;
 }
 
@@ -1512,6 +1805,11 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   unsigned char *buf;
   size_t len;
   int keytype;
+  unsigned char *shadow_info = NULL;
+  size_t shadow_len = 0;
+  struct stat st;
+  int have_st;
+  struct keyinfo_cache_s *r;
 
   (void)ctrl;
 
@@ -1520,22 +1818,31 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (r_shadow_info)
     *r_shadow_info = NULL;
 
-  {
-    gcry_sexp_t sexp;
+  have_st = stat_key_file (grip, &st);
+  if (have_st && (r = keyinfo_cache_get (grip, &st))
+      && r->keytype != PRIVATE_KEY_UNKNOWN)
+    {
+      if (r_shadow_info && r->shadow_info)
+        {
+          len = gcry_sexp_canon_len (r->shadow_info, 0, NULL, NULL);
+          *r_shadow_info = xtrymalloc (len);
+          if (!*r_shadow_info)
+            return gpg_error_from_syserror ();
+          memcpy (*r_shadow_info, r->shadow_info, len);
+        }
+      if (r_keytype)
+        *r_keytype = r->keytype;
+      return 0;
+    }
 
-    err = read_key_file (grip, &sexp, NULL);
-    if (err)
-      {
-        if (gpg_err_code (err) == GPG_ERR_ENOENT)
-          return gpg_error (GPG_ERR_NOT_FOUND);
-        else
-          return err;
-      }
-    err = make_canon_sexp (sexp, &buf, &len);
-    gcry_sexp_release (sexp);
-    if (err)
-      return err;
-  }
+  err = read_key_file_canon (grip, &buf, &len, NULL);
+  if (err)
+    {
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        return gpg_error (GPG_ERR_NOT_FOUND);
+      else
+        return err;
+    }
 
   keytype = agent_private_key_type (buf);
   switch (keytype)
@@ -1548,31 +1855,52 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
          from such a key. */
       break;
     case PRIVATE_KEY_SHADOWED:
-      if (r_shadow_info)
-        {
-          const unsigned char *s;
-          size_t n;
+      {
+        const unsigned char *s;
+        size_t n;
 
-          err = agent_get_shadow_info (buf, &s);
-          if (!err)
-            {
-              n = gcry_sexp_canon_len (s, 0, NULL, NULL);
-              log_assert (n);
-              *r_shadow_info = xtrymalloc (n);
-              if (!*r_shadow_info)
-                err = gpg_error_from_syserror ();
-              else
-                memcpy (*r_shadow_info, s, n);
-            }
-        }
+        err = agent_get_shadow_info (buf, &s);
+        if (!err)
+          {
+            n = gcry_sexp_canon_len (s, 0, NULL, NULL);
+            log_assert (n);
+            shadow_info = xtrymalloc (n);
+            if (!shadow_info)
+              err = gpg_error_from_syserror ();
+            else
+              {
+                memcpy (shadow_info, s, n);
+                shadow_len = n;
+              }
+          }
+      }
       break;
     default:
       err = gpg_error (GPG_ERR_BAD_SECKEY);
       break;
     }
 
+  if (!err && r_shadow_info && shadow_info)
+    {
+      *r_shadow_info = xtrymalloc (shadow_len);
+      if (!*r_shadow_info)
+        err = gpg_error_from_syserror ();
+      else
+        memcpy (*r_shadow_info, shadow_info, shadow_len);
+    }
+
+  if (!err && have_st)
+    {
+      r = keyinfo_cache_new (grip, &st);
+      r->keytype = keytype;
+      xfree (r->shadow_info);
+      r->shadow_info = shadow_info;
+      shadow_info = NULL;
+    }
+
   if (!err && r_keytype)
     *r_keytype = keytype;
+  xfree (shadow_info);
 
   xfree (buf);
   return err;
@@ -1607,16 +1935,12 @@ agent_delete_key (ctrl_t ctrl, const char *desc_text,
   char *default_desc = NULL;
   int key_type;
 
-  err = read_key_file (grip, &s_skey, NULL);
+  err = read_key_file_canon (grip, &buf, &len, NULL);
   if (gpg_err_code (err) == GPG_ERR_ENOENT)
     err = gpg_error (GPG_ERR_NO_SECKEY);
   if (err)
     goto leave;
 
-  err = make_canon_sexp (s_skey, &buf, &len);
-  if (err)
-    goto leave;
-
   key_type = agent_private_key_type (buf);
   if (only_stubs && key_type != PRIVATE_KEY_SHADOWED)
     {
@@ -1640,21 +1964,15 @@ agent_delete_key (ctrl_t ctrl, const char *desc_text,
               desc_text = default_desc;
             }
 
-          /* Note, that we will take the comment as a C string for
-             display purposes; i.e. all stuff beyond a Nul character is
-             ignored.  */
-          {
-            gcry_sexp_t comment_sexp;
-
-            comment_sexp = gcry_sexp_find_token (s_skey, "comment", 0);
-            if (comment_sexp)
-              comment = gcry_sexp_nth_string (comment_sexp, 1);
-            gcry_sexp_release (comment_sexp);
-          }
+          comment = comment_from_canon_key (buf);
 
           if (desc_text)
-            err = agent_modify_description (desc_text, comment, s_skey,
-                                            &desc_text_final);
+            {
+              err = gcry_sexp_sscan (&s_skey, NULL, (char*)buf, len);
+              if (!err)
+                err = agent_modify_description (desc_text, comment, s_skey,
+                                                &desc_text_final);
+            }
           if (err)
             goto leave;
 
@@ -435,6 +435,7 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
   int rc;
   size_t len;
   char *buf;
+  int computing;
 
   rc = gcry_sexp_sscan (&s_keyparam, NULL, keyparam, keyparamlen);
   if (rc)
@@ -467,7 +468,9 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
       passphrase = passphrase_buffer;
     }
 
+  computing = agent_begin_compute ();
   rc = gcry_pk_genkey (&s_key, s_keyparam );
+  agent_end_compute (computing);
   gcry_sexp_release (s_keyparam);
   if (rc)
     {
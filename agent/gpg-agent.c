@@ -58,6 +58,7 @@
 #include "../common/exechelp.h"
 #include "../common/asshelp.h"
 #include "../common/init.h"
+#include "../common/asynclog.h"
 
 
 enum cmd_and_opt_values
@@ -71,6 +72,7 @@ enum cmd_and_opt_values
   aGPGConfList,
   aGPGConfTest,
   aUseStandardSocketP,
+  aBenchmarkS2K,
   oOptions,
   oDebug,
   oDebugAll,
@@ -94,6 +96,7 @@ enum cmd_and_opt_values
   oPinentryTouchFile,
   oPinentryInvisibleChar,
   oPinentryTimeout,
+  oPinentryKeepAlive,
   oDisplay,
   oTTYname,
   oTTYtype,
@@ -105,6 +108,8 @@ enum cmd_and_opt_values
   oDefCacheTTLSSH,
   oMaxCacheTTL,
   oMaxCacheTTLSSH,
+  oKeyCacheTTL,
+  oKeyCacheMax,
   oEnforcePassphraseConstraints,
   oMinPassphraseLen,
   oMinPassphraseNonalpha,
@@ -155,6 +160,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_c (aGPGConfList, "gpgconf-list", "@"),
   ARGPARSE_c (aGPGConfTest, "gpgconf-test", "@"),
   ARGPARSE_c (aUseStandardSocketP, "use-standard-socket-p", "@"),
+  ARGPARSE_c (aBenchmarkS2K, "benchmark-s2k",
+              N_("print the S2K throughput and exit")),
 
   ARGPARSE_group (301, N_("@Options:\n ")),
 
@@ -187,6 +194,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oPinentryTouchFile, "pinentry-touch-file", "@"),
   ARGPARSE_s_s (oPinentryInvisibleChar, "pinentry-invisible-char", "@"),
   ARGPARSE_s_u (oPinentryTimeout, "pinentry-timeout", "@"),
+  ARGPARSE_s_u (oPinentryKeepAlive, "pinentry-keep-alive", "@"),
   ARGPARSE_s_s (oScdaemonProgram, "scdaemon-program",
                 /* */             N_("|PGM|use PGM as the SCdaemon program") ),
   ARGPARSE_s_n (oDisableScdaemon, "disable-scdaemon",
@@ -219,6 +227,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_u (oDefCacheTTLSSH, "default-cache-ttl-ssh", "@" ),
   ARGPARSE_s_u (oMaxCacheTTL,    "max-cache-ttl",         "@" ),
   ARGPARSE_s_u (oMaxCacheTTLSSH, "max-cache-ttl-ssh",     "@" ),
+  ARGPARSE_s_u (oKeyCacheTTL,    "key-cache-ttl",         "@" ),
+  ARGPARSE_s_u (oKeyCacheMax,    "key-cache-max",         "@" ),
 
   ARGPARSE_s_n (oEnforcePassphraseConstraints, "enforce-passphrase-constraints",
                 /* */                          "@"),
@@ -285,6 +295,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_MEMSTAT_VALUE, "memstat" },
     { DBG_HASHING_VALUE, "hashing" },
     { DBG_IPC_VALUE    , "ipc"     },
+    { DBG_TIMING_VALUE , "timing"  },
     { 77, NULL } /* 77 := Do not exit on "help" or "?".  */
   };
 
@@ -294,6 +305,7 @@ static struct debug_flags_s debug_flags [] =
 #define DEFAULT_CACHE_TTL_SSH (30*60)  /* 30 minutes */
 #define MAX_CACHE_TTL         (120*60) /* 2 hours */
 #define MAX_CACHE_TTL_SSH     (120*60) /* 2 hours */
+#define KEY_CACHE_MAX         (32)
 #define MIN_PASSPHRASE_LEN    (8)
 #define MIN_PASSPHRASE_NONALPHA (1)
 #define MAX_PASSPHRASE_DAYS   (0)
@@ -447,6 +459,11 @@ struct progress_dispatch_s
 };
 struct progress_dispatch_s *progress_dispatch_list;
 
+/* The key marking a thread which runs a computation outside of the
+ * nPth protected state; see agent_begin_compute.  */
+static npth_key_t compute_key;
+static int compute_key_valid;
+
 
 
 
@@ -820,11 +837,14 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       xfree (opt.pinentry_invisible_char);
       opt.pinentry_invisible_char = NULL;
       opt.pinentry_timeout = 0;
+      opt.pinentry_keep_alive = 0;
       opt.scdaemon_program = NULL;
       opt.def_cache_ttl = DEFAULT_CACHE_TTL;
       opt.def_cache_ttl_ssh = DEFAULT_CACHE_TTL_SSH;
       opt.max_cache_ttl = MAX_CACHE_TTL;
       opt.max_cache_ttl_ssh = MAX_CACHE_TTL_SSH;
+      opt.key_cache_ttl = 0;
+      opt.key_cache_max = KEY_CACHE_MAX;
       opt.enforce_passphrase_constraints = 0;
       opt.min_passphrase_len = MIN_PASSPHRASE_LEN;
       opt.min_passphrase_nonalpha = MIN_PASSPHRASE_NONALPHA;
@@ -864,7 +884,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          asynclog_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -880,6 +900,9 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.pinentry_invisible_char = xtrystrdup (pargs->r.ret_str); break;
       break;
     case oPinentryTimeout: opt.pinentry_timeout = pargs->r.ret_ulong; break;
+    case oPinentryKeepAlive:
+      opt.pinentry_keep_alive = pargs->r.ret_ulong;
+      break;
     case oScdaemonProgram: opt.scdaemon_program = pargs->r.ret_str; break;
     case oDisableScdaemon: opt.disable_scdaemon = 1; break;
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
@@ -888,6 +911,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
     case oDefCacheTTLSSH: opt.def_cache_ttl_ssh = pargs->r.ret_ulong; break;
     case oMaxCacheTTL: opt.max_cache_ttl = pargs->r.ret_ulong; break;
     case oMaxCacheTTLSSH: opt.max_cache_ttl_ssh = pargs->r.ret_ulong; break;
+    case oKeyCacheTTL: opt.key_cache_ttl = pargs->r.ret_ulong; break;
+    case oKeyCacheMax: opt.key_cache_max = pargs->r.ret_ulong; break;
 
     case oEnforcePassphraseConstraints:
       opt.enforce_passphrase_constraints=1;
@@ -966,6 +991,62 @@ finalize_rereadable_options (void)
 }
 
 
+/* Return true if the current thread is in a computation started by
+ * agent_begin_compute.  */
+static int
+in_compute (void)
+{
+  return compute_key_valid && npth_getspecific (compute_key);
+}
+
+
+/* The system call clamp.  A thread in a computation has already left
+ * the protected state and must not do so again.  */
+static void
+agent_syscall_pre (void)
+{
+  if (!in_compute ())
+    npth_unprotect ();
+}
+
+static void
+agent_syscall_post (void)
+{
+  if (!in_compute ())
+    npth_protect ();
+}
+
+
+/* Leave the nPth protected state for a CPU intensive Libgcrypt
+ * operation so that other connections are served meanwhile and the
+ * operations of several connections run in parallel.  Until the
+ * matching agent_end_compute only Libgcrypt may be called on objects
+ * owned by the caller.  Returns a value to be passed to
+ * agent_end_compute.  With debugging enabled nothing is done so that
+ * the log output of Libgcrypt is not mixed up.  */
+int
+agent_begin_compute (void)
+{
+  if (!compute_key_valid || opt.debug || in_compute ())
+    return 0;
+  npth_setspecific (compute_key, &compute_key);
+  npth_unprotect ();
+  return 1;
+}
+
+
+/* Return to the protected state after agent_begin_compute returned
+ * STARTED.  */
+void
+agent_end_compute (int started)
+{
+  if (!started)
+    return;
+  npth_protect ();
+  npth_setspecific (compute_key, NULL);
+}
+
+
 static void
 thread_init_once (void)
 {
@@ -975,8 +1056,10 @@ thread_init_once (void)
     {
       npth_initialized++;
       npth_init ();
+      if (!npth_key_create (&compute_key, NULL))
+        compute_key_valid = 1;
     }
-  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+  gpgrt_set_syscall_clamp (agent_syscall_pre, agent_syscall_post);
   /* Now that we have set the syscall clamp we need to tell Libgcrypt
    * that it should get them from libgpg-error.  Note that Libgcrypt
    * has already been initialized but at that point nPth was not
@@ -1020,10 +1103,12 @@ main (int argc, char **argv )
   char *logfile = NULL;
   int debug_wait = 0;
   int gpgconf_list = 0;
+  int benchmark = 0;
   gpg_error_t err;
   struct assuan_malloc_hooks malloc_hooks;
 
   early_system_init ();
+  gnupg_timing_mark ("start");
 
   /* Before we do anything else we save the list of currently open
      file descriptors and the signal mask.  This info is required to
@@ -1047,6 +1132,7 @@ main (int argc, char **argv )
   /* Make sure that our subsystems are ready.  */
   i18n_init ();
   init_common_subsystems (&argc, &argv);
+  gnupg_timing_mark ("init");
 
   malloc_hooks.malloc = gcry_malloc;
   malloc_hooks.realloc = gcry_realloc;
@@ -1192,6 +1278,7 @@ main (int argc, char **argv )
         case aGPGConfList: gpgconf_list = 1; break;
         case aGPGConfTest: gpgconf_list = 2; break;
         case aUseStandardSocketP: gpgconf_list = 3; break;
+        case aBenchmarkS2K: benchmark = 1; break;
         case oBatch: opt.batch=1; break;
 
         case oDebugWait: debug_wait = pargs.r.ret_int; break;
@@ -1328,7 +1415,8 @@ main (int argc, char **argv )
     bind_textdomain_codeset (PACKAGE_GT, "UTF-8");
 #endif
 
-  if (!pipe_server && !is_daemon && !gpgconf_list && !is_supervised)
+  if (!pipe_server && !is_daemon && !gpgconf_list && !is_supervised
+      && !benchmark)
     {
      /* We have been called without any command and thus we merely
         check whether an agent is already running.  We do this right
@@ -1367,6 +1455,7 @@ main (int argc, char **argv )
     }
 
   set_debug ();
+  gnupg_timing_mark ("options");
 
   if (atexit (cleanup))
     {
@@ -1378,6 +1467,20 @@ main (int argc, char **argv )
   /* Try to create missing directories. */
   create_directories ();
 
+  /* Store the calibrated S2K count so that a new agent on the same
+     host does not need to calibrate again.  */
+  {
+    char *fname = make_filename (gnupg_homedir (), "s2k-calibration", NULL);
+    set_s2k_calibration_file (fname);
+    xfree (fname);
+  }
+
+  if (benchmark)
+    {
+      benchmark_s2k (es_stdout);
+      agent_exit (0);
+    }
+
   if (debug_wait && pipe_server)
     {
       thread_init_once ();
@@ -1463,6 +1566,8 @@ main (int argc, char **argv )
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
       es_printf ("pinentry-timeout:%lu:0:\n",
                  GC_OPT_FLAG_DEFAULT|GC_OPT_FLAG_RUNTIME);
+      es_printf ("pinentry-keep-alive:%lu:0:\n",
+                 GC_OPT_FLAG_DEFAULT|GC_OPT_FLAG_RUNTIME);
       es_printf ("grab:%lu:\n",
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
 
@@ -1554,6 +1659,8 @@ main (int argc, char **argv )
 
       log_info ("listening on: std=%d extra=%d browser=%d ssh=%d\n",
                 fd, fd_extra, fd_browser, fd_ssh);
+      if (DBG_TIMING)
+        gnupg_timing_dump ();
       handle_connections (fd, fd_extra, fd_browser, fd_ssh);
 #endif /*!HAVE_W32_SYSTEM*/
     }
@@ -1808,6 +1915,8 @@ main (int argc, char **argv )
         }
 
       log_info ("%s %s started\n", strusage(11), strusage(13) );
+      if (DBG_TIMING)
+        gnupg_timing_dump ();
       handle_connections (fd, fd_extra, fd_browser, fd_ssh);
       assuan_sock_close (fd);
     }
@@ -1853,15 +1962,31 @@ agent_libgcrypt_progress_cb (void *data, const char *what, int printchar,
 {
   struct progress_dispatch_s *dispatch;
   npth_t mytid = npth_self ();
+  int computing;
 
   (void)data;
 
+  /* The callback may be called during a computation; it needs the
+   * protected state to access the connection.  */
+  computing = in_compute ();
+  if (computing)
+    {
+      npth_protect ();
+      npth_setspecific (compute_key, NULL);
+    }
+
   for (dispatch = progress_dispatch_list; dispatch; dispatch = dispatch->next)
     if (dispatch->ctrl && dispatch->tid == mytid)
       break;
   if (dispatch && dispatch->cb)
     dispatch->cb (dispatch->ctrl, what, printchar, current, total);
 
+  if (computing)
+    {
+      npth_setspecific (compute_key, &compute_key);
+      npth_unprotect ();
+    }
+
   /* Libgcrypt < 1.8 does not know about nPth and thus when it reads
    * from /dev/random this will block the process.  To mitigate this
    * problem we yield the thread when Libgcrypt tells us that it needs
@@ -2415,6 +2540,9 @@ handle_tick (void)
   /* Need to check for expired cache entries.  */
   agent_cache_housekeeping ();
 
+  /* Close an idle pinentry after its keep alive time.  */
+  agent_release_idle_pinentry (0);
+
   /* Check whether the homedir is still available.  */
   if (!shutdown_pending
       && (!have_homedir_inotify || !reliable_homedir_inotify)
@@ -2437,6 +2565,8 @@ agent_sighup_action (void)
   agent_flush_cache ();
   reread_configuration ();
   agent_reload_trustlist ();
+  /* The pinentry program or its options may have changed.  */
+  agent_release_idle_pinentry (1);
   /* We flush the module name cache so that after installing a
      "pinentry" binary that one can be used in case the
      "pinentry-basic" fallback was in use.  */
@@ -2478,6 +2608,7 @@ handle_signal (int signo)
       /* pth_ctrl (PTH_CTRL_DUMPSTATE, log_get_stream ()); */
       agent_query_dump_state ();
       agent_scd_dump_state ();
+      gcry_control (GCRYCTL_DUMP_SECMEM_STATS);
       break;
 
     case SIGUSR2:
@@ -2866,6 +2997,10 @@ handle_connections (gnupg_fd_t listen_fd,
 	       strerror (ret));
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  /* Write the log from now on by a separate thread so that a slow
+   * log consumer does not block the connections.  */
+  asynclog_start (current_logfile);
+
 #ifndef HAVE_W32_SYSTEM
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
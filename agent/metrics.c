@@ -0,0 +1,206 @@
+/* metrics.c - Runtime counters and latency histograms
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The counters and timers are updated without any yield point in
+ * between and thus need no lock with nPth.  They are never reset;
+ * a monitoring system is expected to compute the rates itself.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agent.h"
+#include "../common/membuf.h"
+
+
+/* The upper bounds in microseconds of the histogram buckets.  A last
+ * bucket takes all larger values.  */
+static const unsigned long bucket_bounds[] =
+  { 100, 1000, 10000, 100000, 1000000, 10000000 };
+#define N_BUCKETS (DIM (bucket_bounds) + 1)
+
+/* A latency histogram.  */
+struct timer_s
+{
+  unsigned long count;
+  unsigned long long sum;  /* Sum of all durations in microseconds.  */
+  unsigned long long max;  /* The largest duration.  */
+  unsigned long buckets[N_BUCKETS];
+};
+
+/* The names of the counters as used for the output.  */
+static const char *counter_names[METRICS_N_COUNTERS] =
+  {
+    "cache_hit",
+    "cache_miss",
+    "key_cache_hit",
+    "key_cache_miss",
+    "bad_passphrase"
+  };
+
+/* The names of the timers as used for the output.  */
+static const char *timer_names[METRICS_N_TIMERS] =
+  {
+    "key_file_read",
+    "unprotect",
+    "pinentry",
+    "scd"
+  };
+
+static unsigned long counters[METRICS_N_COUNTERS];
+static struct timer_s timers[METRICS_N_TIMERS];
+
+/* The per-command timers.  The table is filled on demand; commands
+ * are only registered by us and thus the table can't overflow unless
+ * the number of commands grows much.  */
+#define MAX_COMMAND_TIMERS 64
+static struct {
+  char name[24];
+  struct timer_s timer;
+} command_timers[MAX_COMMAND_TIMERS];
+static int n_command_timers;
+
+
+
+/* Return a monotonic time stamp in microseconds.  The value is used
+ * as the start time for metrics_time.  */
+unsigned long long
+metrics_start (void)
+{
+  return gnupg_timing_now ();
+}
+
+
+/* Add the time elapsed since START to the histogram TIMER.  */
+static void
+update_timer (struct timer_s *timer, unsigned long long start)
+{
+  unsigned long long now = metrics_start ();
+  unsigned long long duration = now > start? now - start : 0;
+  int i;
+
+  for (i=0; i < DIM (bucket_bounds); i++)
+    if (duration <= bucket_bounds[i])
+      break;
+  timer->buckets[i]++;
+  timer->count++;
+  timer->sum += duration;
+  if (duration > timer->max)
+    timer->max = duration;
+}
+
+
+/* Increment the counter WHAT.  */
+void
+metrics_count (metrics_counter_t what)
+{
+  if (what >= 0 && what < METRICS_N_COUNTERS)
+    counters[what]++;
+}
+
+
+/* Record the time elapsed since START for the timer WHAT.  START is
+ * the value returned by metrics_start.  */
+void
+metrics_time (metrics_timer_t what, unsigned long long start)
+{
+  if (what >= 0 && what < METRICS_N_TIMERS)
+    update_timer (timers + what, start);
+}
+
+
+/* Record the time elapsed since START for the Assuan command NAME.  */
+void
+metrics_time_command (const char *name, unsigned long long start)
+{
+  int i;
+
+  if (!name || !*name)
+    return;
+  for (i=0; i < n_command_timers; i++)
+    if (!strcmp (command_timers[i].name, name))
+      break;
+  if (i == n_command_timers)
+    {
+      if (n_command_timers == MAX_COMMAND_TIMERS
+          || strlen (name) >= sizeof command_timers[0].name)
+        return;
+      strcpy (command_timers[i].name, name);
+      n_command_timers++;
+    }
+  update_timer (&command_timers[i].timer, start);
+}
+
+
+/* Append a line for TIMER to MB.  */
+static void
+format_timer (membuf_t *mb, const char *type, const char *name,
+              struct timer_s *timer)
+{
+  int i;
+
+  put_membuf_printf (mb, "%s:%s:%lu:%llu:%llu",
+                     type, name, timer->count, timer->sum, timer->max);
+  for (i=0; i < N_BUCKETS; i++)
+    put_membuf_printf (mb, ":%lu", timer->buckets[i]);
+  put_membuf_str (mb, "\n");
+}
+
+
+/* Return a malloced string with all metrics.  Each line has
+ * colon separated fields:
+ *
+ *   buckets:<bound1>:...:<boundN>
+ *   counter:<name>:<value>
+ *   timer:<name>:<count>:<sum>:<max>:<bucket1>:...:<bucketN+1>
+ *   command:<name>:<count>:<sum>:<max>:<bucket1>:...:<bucketN+1>
+ *
+ * All times are given in microseconds.  A bucket counts the
+ * durations up to and including its bound and larger than the bound
+ * of the previous bucket; the last bucket has no bound.  Returns NULL
+ * on error.  */
+char *
+metrics_format (void)
+{
+  membuf_t mb;
+  int i;
+
+  init_membuf (&mb, 1024);
+
+  put_membuf_str (&mb, "buckets");
+  for (i=0; i < DIM (bucket_bounds); i++)
+    put_membuf_printf (&mb, ":%lu", bucket_bounds[i]);
+  put_membuf_str (&mb, "\n");
+
+  for (i=0; i < METRICS_N_COUNTERS; i++)
+    put_membuf_printf (&mb, "counter:%s:%lu\n",
+                       counter_names[i], counters[i]);
+
+  for (i=0; i < METRICS_N_TIMERS; i++)
+    format_timer (&mb, "timer", timer_names[i], timers + i);
+
+  for (i=0; i < n_command_timers; i++)
+    format_timer (&mb, "command", command_timers[i].name,
+                  &command_timers[i].timer);
+
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
@@ -43,6 +43,7 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
   int rc;
   char *buf = NULL;
   size_t len;
+  int computing;
 
   *r_padding = -1;
 
@@ -105,7 +106,9 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
 /*           gcry_sexp_dump (s_skey); */
 /*         } */
 
+      computing = agent_begin_compute ();
       rc = gcry_pk_decrypt (&s_plain, s_cipher, s_skey);
+      agent_end_compute (computing);
       if (rc)
         {
           log_error ("decryption failed: %s\n", gpg_strerror (rc));
@@ -297,6 +297,7 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
   const unsigned char *data;
   int datalen;
   int check_signature = 0;
+  int computing;
 
   if (overridedata)
     {
@@ -480,7 +481,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       /* sign */
+      computing = agent_begin_compute ();
       err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+      agent_end_compute (computing);
       if (err)
         {
           log_error ("signing failed: %s\n", gpg_strerror (err));
@@ -510,7 +513,11 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       if (!err)
-        err = gcry_pk_verify (s_sig, s_hash, sexp_key);
+        {
+          computing = agent_begin_compute ();
+          err = gcry_pk_verify (s_sig, s_hash, sexp_key);
+          agent_end_compute (computing);
+        }
 
       if (err)
         {
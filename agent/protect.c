@@ -35,6 +35,7 @@
 # include <windows.h>
 #else
 # include <sys/times.h>
+# include <sys/utsname.h>
 #endif
 
 #include "agent.h"
@@ -75,6 +76,10 @@ static const struct {
 static unsigned int s2k_calibration_time = AGENT_S2K_CALIBRATION;
 static unsigned long s2k_calibrated_count;
 
+/* The name of the file used to store the calibrated count or NULL if
+ * the count shall not be stored.  */
+static char *s2k_calibration_file;
+
 
 /* A helper object for time measurement.  */
 struct calibrate_time_s
@@ -149,17 +154,17 @@ calibrate_elapsed_time (struct calibrate_time_s *starttime)
 }
 
 
-/* Run a test hashing for COUNT and return the time required in
-   milliseconds.  */
+/* Run a test hashing with the hash algorithm ALGO for COUNT and
+   return the time required in milliseconds.  */
 static unsigned long
-calibrate_s2k_count_one (unsigned long count)
+calibrate_s2k_count_algo (int algo, unsigned long count)
 {
   int rc;
   char keybuf[PROT_CIPHER_KEYLEN];
   struct calibrate_time_s starttime;
 
   calibrate_get_time (&starttime);
-  rc = hash_passphrase ("123456789abcdef0", GCRY_MD_SHA1,
+  rc = hash_passphrase ("123456789abcdef0", algo,
                         3, "saltsalt", count, keybuf, sizeof keybuf);
   if (rc)
     BUG ();
@@ -167,29 +172,52 @@ calibrate_s2k_count_one (unsigned long count)
 }
 
 
-/* Measure the time we need to do the hash operations and deduce an
-   S2K count which requires roughly some targeted amount of time.  */
+/* Run a test hashing for COUNT and return the time required in
+   milliseconds.  */
 static unsigned long
-calibrate_s2k_count (void)
+calibrate_s2k_count_one (unsigned long count)
+{
+  return calibrate_s2k_count_algo (GCRY_MD_SHA1, count);
+}
+
+
+/* Measure the time we need to do the hash operations with ALGO and
+   deduce an S2K count which requires roughly TARGET milliseconds.  */
+static unsigned long
+calibrate_s2k_count_for (int algo, unsigned int target)
 {
   unsigned long count;
   unsigned long ms;
 
   for (count = 65536; count; count *= 2)
     {
-      ms = calibrate_s2k_count_one (count);
+      ms = calibrate_s2k_count_algo (algo, count);
       if (opt.verbose > 1)
         log_info ("S2K calibration: %lu -> %lums\n", count, ms);
-      if (ms > s2k_calibration_time)
+      if (ms > target)
         break;
     }
 
-  count = (unsigned long)(((double)count / ms) * s2k_calibration_time);
+  count = (unsigned long)(((double)count / ms) * target);
   count /= 1024;
   count *= 1024;
   if (count < 65536)
     count = 65536;
 
+  return count;
+}
+
+
+/* Measure the time we need to do the hash operations and deduce an
+   S2K count which requires roughly some targeted amount of time.  */
+static unsigned long
+calibrate_s2k_count (void)
+{
+  unsigned long count;
+  unsigned long ms;
+
+  count = calibrate_s2k_count_for (GCRY_MD_SHA1, s2k_calibration_time);
+
   if (opt.verbose)
     {
       ms = calibrate_s2k_count_one (count);
@@ -200,6 +228,176 @@ calibrate_s2k_count (void)
 }
 
 
+/* Return the name of this host for use with the calibration file.  */
+static const char *
+calibration_hostname (void)
+{
+  static char name[64];
+  char *p;
+
+  if (!*name)
+    {
+#ifdef HAVE_W32_SYSTEM
+      const char *s = getenv ("COMPUTERNAME");
+#else
+      struct utsname utsbuf;
+      const char *s = uname (&utsbuf)? NULL : utsbuf.nodename;
+#endif
+      if (!s || !*s)
+        s = "unknown";
+      /* The name is used as a space delimited field.  */
+      mem2str (name, s, sizeof name);
+      for (p = name; *p; p++)
+        if (spacep (p))
+          *p = '_';
+    }
+  return name;
+}
+
+
+/* Read the calibrated count for this host, the used Libgcrypt
+ * version and the current calibration time from the calibration
+ * file.  The file has lines of the form
+ *
+ *   <hostname> <libgcrypt-version> <milliseconds> <count>
+ *
+ * Returns the count or 0 if not found.  */
+static unsigned long
+read_s2k_calibration_file (void)
+{
+  estream_t fp;
+  char line[256];
+  char host[64], version[64];
+  unsigned int ms;
+  unsigned long count, result = 0;
+
+  if (!s2k_calibration_file)
+    return 0;
+  fp = es_fopen (s2k_calibration_file, "r");
+  if (!fp)
+    return 0;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      if (*line == '#')
+        continue;
+      if (sscanf (line, "%63s %63s %u %lu", host, version, &ms, &count) != 4)
+        continue;
+      if (!strcmp (host, calibration_hostname ())
+          && !strcmp (version, gcry_check_version (NULL))
+          && ms == s2k_calibration_time
+          && count >= 65536)
+        result = count;
+    }
+  es_fclose (fp);
+  if (result && opt.verbose)
+    log_info ("S2K calibration: using stored count %lu\n", result);
+  return result;
+}
+
+
+/* Store COUNT as the calibrated count for this host, the used
+ * Libgcrypt version and the current calibration time.  Entries for
+ * other hosts are kept so that the file may be shared on a network
+ * file system.  Errors are only logged because the calibration will
+ * simply be done again.  */
+static void
+write_s2k_calibration_file (unsigned long count)
+{
+  gpg_error_t err;
+  estream_t fp, tmpfp = NULL;
+  char *tmpfname = NULL;
+  char line[256];
+  char host[64];
+
+  if (!s2k_calibration_file)
+    return;
+
+  tmpfname = strconcat (s2k_calibration_file, EXTSEP_S "tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  tmpfp = es_fopen (tmpfname, "w,mode=-rw-r");
+  if (!tmpfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fputs ("# S2K calibration cache created by gpg-agent."
+            "  Do not edit.\n", tmpfp);
+
+  /* Copy the entries of other hosts.  */
+  fp = es_fopen (s2k_calibration_file, "r");
+  if (fp)
+    {
+      while (es_fgets (line, sizeof line, fp))
+        {
+          if (*line == '#')
+            continue;
+          if (sscanf (line, "%63s", host) == 1
+              && strcmp (host, calibration_hostname ()))
+            es_fputs (line, tmpfp);
+        }
+      es_fclose (fp);
+    }
+
+  es_fprintf (tmpfp, "%s %s %u %lu\n", calibration_hostname (),
+              gcry_check_version (NULL), s2k_calibration_time, count);
+  if (es_fclose (tmpfp))
+    {
+      tmpfp = NULL;
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  tmpfp = NULL;
+  err = gnupg_rename_file (tmpfname, s2k_calibration_file, NULL);
+
+ leave:
+  if (err && opt.verbose)
+    log_info ("error writing '%s': %s\n",
+              s2k_calibration_file, gpg_strerror (err));
+  es_fclose (tmpfp);
+  if (err && tmpfname)
+    gnupg_remove (tmpfname);
+  xfree (tmpfname);
+}
+
+
+/* Set the name of the file used to store the calibrated S2K count to
+ * FNAME.  NULL disables storing.  */
+void
+set_s2k_calibration_file (const char *fname)
+{
+  xfree (s2k_calibration_file);
+  s2k_calibration_file = fname? xstrdup (fname) : NULL;
+  s2k_calibrated_count = 0;
+}
+
+
+/* Print the S2K throughput for the hash algorithms used with the
+ * OpenPGP S2K to FP.  This is used by --benchmark-s2k.  */
+void
+benchmark_s2k (estream_t fp)
+{
+  static int algos[] = { GCRY_MD_SHA1, GCRY_MD_SHA256, GCRY_MD_SHA512 };
+  unsigned long count, ms;
+  int i;
+
+  es_fprintf (fp, "# algo:iterations-per-second:count-for-%ums\n",
+              s2k_calibration_time);
+  for (i=0; i < DIM (algos); i++)
+    {
+      count = calibrate_s2k_count_for (algos[i], s2k_calibration_time);
+      ms = calibrate_s2k_count_algo (algos[i], count);
+      es_fprintf (fp, "%s:%lu:%lu\n",
+                  gcry_md_algo_name (algos[i]),
+                  ms? (unsigned long)((double)count * 1000 / ms) : 0,
+                  count);
+    }
+}
+
+
 /* Set the calibration time.  This may be called early at startup or
  * at any time.  Thus it should one set variables.  */
 void
@@ -220,7 +418,14 @@ unsigned long
 get_calibrated_s2k_count (void)
 {
   if (!s2k_calibrated_count)
-    s2k_calibrated_count = calibrate_s2k_count ();
+    {
+      s2k_calibrated_count = read_s2k_calibration_file ();
+      if (!s2k_calibrated_count)
+        {
+          s2k_calibrated_count = calibrate_s2k_count ();
+          write_s2k_calibration_file (s2k_calibrated_count);
+        }
+    }
 
   /* Enforce a lower limit.  */
   return s2k_calibrated_count < 65536 ? 65536 : s2k_calibrated_count;
@@ -52,6 +52,11 @@ typedef struct trustitem_s trustitem_t;
 /* Malloced table and its allocated size with all trust items. */
 static trustitem_t *trusttable;
 static size_t trusttablesize;
+/* Malloced hash index into TRUSTTABLE.  Each slot holds the index of
+   an item plus one or 0 for an empty slot.  TRUSTHASHSIZE is a power
+   of two.  */
+static size_t *trusthash;
+static size_t trusthashsize;
 /* A mutex used to protect the table. */
 static npth_mutex_t trusttable_lock;
 
@@ -124,6 +129,68 @@ clear_trusttable (void)
   xfree (trusttable);
   trusttable = NULL;
   trusttablesize = 0;
+  xfree (trusthash);
+  trusthash = NULL;
+  trusthashsize = 0;
+}
+
+
+/* Return the hash slot for the binary fingerprint FPR in a hash
+   index of HASHSIZE slots.  The fingerprint is a SHA-1 hash and thus
+   its first bytes are good enough.  */
+static inline size_t
+trusthash_slot (const unsigned char *fpr, size_t hashsize)
+{
+  return (((size_t)fpr[0] << 24 | (size_t)fpr[1] << 16
+           | (size_t)fpr[2] << 8 | (size_t)fpr[3]) & (hashsize - 1));
+}
+
+
+/* Build a hash index for the NITEMS items of TABLE and store it at
+   R_HASH and its size at R_HASHSIZE.  For duplicate fingerprints only
+   the first item is indexed, as a linear scan would find it first.  */
+static gpg_error_t
+build_trusthash (trustitem_t *table, size_t nitems,
+                 size_t **r_hash, size_t *r_hashsize)
+{
+  size_t *hash, hashsize, idx, n;
+
+  for (hashsize = 16; hashsize < 2 * nitems; hashsize *= 2)
+    ;
+  hash = xtrycalloc (hashsize, sizeof *hash);
+  if (!hash)
+    return gpg_error_from_syserror ();
+
+  for (n=0; n < nitems; n++)
+    {
+      for (idx = trusthash_slot (table[n].fpr, hashsize); hash[idx];
+           idx = (idx + 1) & (hashsize - 1))
+        if (!memcmp (table[hash[idx]-1].fpr, table[n].fpr, 20))
+          break;
+      if (!hash[idx])
+        hash[idx] = n + 1;
+    }
+
+  *r_hash = hash;
+  *r_hashsize = hashsize;
+  return 0;
+}
+
+
+/* Return the trust item for the binary fingerprint FPR or NULL if it
+   is not in the table.  The trusttable must be locked.  */
+static trustitem_t *
+find_trustitem (const unsigned char *fpr)
+{
+  size_t idx;
+
+  if (!trusthash)
+    return NULL;
+  for (idx = trusthash_slot (fpr, trusthashsize); trusthash[idx];
+       idx = (idx + 1) & (trusthashsize - 1))
+    if (!memcmp (trusttable[trusthash[idx]-1].fpr, fpr, 20))
+      return trusttable + trusthash[idx] - 1;
+  return NULL;
 }
 
 
@@ -334,6 +401,7 @@ read_trustfiles (void)
   trustitem_t *table, *ti;
   int tableidx;
   size_t tablesize;
+  size_t *hash, hashsize;
   char *fname;
   int allow_include = 1;
 
@@ -380,7 +448,6 @@ read_trustfiles (void)
       return err;
     }
 
-  /* Fixme: we should drop duplicates and sort the table. */
   ti = xtryrealloc (table, (tableidx?tableidx:1) * sizeof *table);
   if (!ti)
     {
@@ -389,10 +456,19 @@ read_trustfiles (void)
       return err;
     }
 
+  err = build_trusthash (ti, tableidx, &hash, &hashsize);
+  if (err)
+    {
+      xfree (ti);
+      return err;
+    }
+
   /* Replace the trusttable.  */
-  xfree (trusttable);
+  clear_trusttable ();
   trusttable = ti;
   trusttablesize = tableidx;
+  trusthash = hash;
+  trusthashsize = hashsize;
   return 0;
 }
 
@@ -407,7 +483,6 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
   gpg_error_t err = 0;
   int locked = already_locked;
   trustitem_t *ti;
-  size_t len;
   unsigned char fprbin[20];
 
   if (r_disabled)
@@ -435,35 +510,34 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
         }
     }
 
-  if (trusttable)
+  ti = find_trustitem (fprbin);
+  if (ti)
     {
-      for (ti=trusttable, len = trusttablesize; len; ti++, len--)
-        if (!memcmp (ti->fpr, fprbin, 20))
-          {
-            if (ti->flags.disabled && r_disabled)
-              *r_disabled = 1;
-
-            /* Print status messages only if we have not been called
-               in a locked state.  */
-            if (already_locked)
-              ;
-            else if (ti->flags.relax)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
-              }
-            else if (ti->flags.cm)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
-              }
-
-            if (!err)
-              err = ti->flags.disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
-            goto leave;
-          }
+      int disabled = ti->flags.disabled;
+
+      if (disabled && r_disabled)
+        *r_disabled = 1;
+
+      /* Print status messages only if we have not been called in a
+         locked state.  */
+      if (already_locked)
+        ;
+      else if (ti->flags.relax)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
+        }
+      else if (ti->flags.cm)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
+        }
+
+      if (!err)
+        err = disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
+      goto leave;
     }
   err = gpg_error (GPG_ERR_NOT_TRUSTED);
 
@@ -815,10 +889,13 @@ agent_marktrusted (ctrl_t ctrl, const char *name, const char *fpr, int flag)
 void
 agent_reload_trustlist (void)
 {
-  /* All we need to do is to delete the trusttable.  At the next
-     access it will get re-read. */
+  /* Read the trustlist right away so that the next request does not
+     need to do this.  The old table stays in use until the new one
+     is complete.  On error we delete the trusttable so that it will
+     be re-read at the next access.  */
   lock_trusttable ();
-  clear_trusttable ();
+  if (read_trustfiles ())
+    clear_trusttable ();
   unlock_trusttable ();
   bump_key_eventcounter ();
 }
@@ -333,8 +333,28 @@ wait_for_sock (int secs, int module_name_id, const char *sockname,
   int lastalert = secs+1;
   int secsleft;
 
-  while (elapsed_us < target_us)
+  /* On POSIX systems the daemons create and listen on their socket
+   * before the launching process exits; thus we first try to connect
+   * right away and only then fall back to polling.  */
+  for (;;)
     {
+      err = assuan_socket_connect (ctx, sockname, 0, connect_flags);
+      if (!err)
+        {
+          if (verbose)
+            {
+              log_info (module_name_id == GNUPG_MODULE_NAME_DIRMNGR?
+                        _("connection to the dirmngr established\n"):
+                        module_name_id == GNUPG_MODULE_NAME_KEYBOXD?
+                        _("connection to the keyboxd established\n"):
+                        _("connection to the agent established\n"));
+              *did_success_msg = 1;
+            }
+          break;
+        }
+      if (elapsed_us >= target_us)
+        break;
+
       if (verbose)
         {
           secsleft = (target_us - elapsed_us + 999999)/1000000;
@@ -354,20 +374,6 @@ wait_for_sock (int secs, int module_name_id, const char *sockname,
         }
       gnupg_usleep (next_sleep_us);
       elapsed_us += next_sleep_us;
-      err = assuan_socket_connect (ctx, sockname, 0, connect_flags);
-      if (!err)
-        {
-          if (verbose)
-            {
-              log_info (module_name_id == GNUPG_MODULE_NAME_DIRMNGR?
-                        _("connection to the dirmngr established\n"):
-                        module_name_id == GNUPG_MODULE_NAME_KEYBOXD?
-                        _("connection to the keyboxd established\n"):
-                        _("connection to the agent established\n"));
-              *did_success_msg = 1;
-            }
-          break;
-        }
       next_sleep_us *= 2;
       if (next_sleep_us > 1000000)
         next_sleep_us = 1000000;
@@ -425,6 +431,9 @@ start_new_service (assuan_context_t *r_ctx,
       status_start_line = "starting_agent ? 0 0";
       no_service_err = GPG_ERR_NO_AGENT;
       seconds_to_wait = SECS_TO_WAIT_FOR_AGENT;
+#ifndef HAVE_W32_SYSTEM
+      connect_flags |= ASSUAN_SOCKET_CONNECT_FDPASSING;
+#endif
       break;
     case GNUPG_MODULE_NAME_DIRMNGR:
       sockname = make_filename (gnupg_socketdir (), DIRMNGR_SOCK_NAME, NULL);
@@ -595,6 +604,10 @@ start_new_service (assuan_context_t *r_ctx,
       return err;
     }
 
+  gnupg_timing_mark (module_name_id == GNUPG_MODULE_NAME_AGENT
+                     ? "connect-agent"
+                     : module_name_id == GNUPG_MODULE_NAME_KEYBOXD
+                     ? "connect-keyboxd" : "connect-dirmngr");
   *r_ctx = ctx;
   return 0;
 }
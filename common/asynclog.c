@@ -0,0 +1,405 @@
+/* asynclog.c - Write the log output from a separate thread
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The daemons log to a file or to a socket watched by watchgnupg.
+ * Writing there may block if the disk or the log consumer is slow.
+ * Because all nPth threads run under one global lock a blocking
+ * write in the logging code stalls every connection.  The functions
+ * here let the logging code write into a ring buffer instead which
+ * is drained by a dedicated writer thread.  If the ring buffer is
+ * full the log output is dropped and a note with the number of
+ * dropped bytes is logged as soon as there is room again.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+#include <npth.h>
+
+#include "util.h"
+#include "asynclog.h"
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* The size of the ring buffer.  */
+#define RINGBUFFER_SIZE (256 * 1024)
+
+/* The state of the log queue.  All fields but FD are protected by
+ * LOCK.  FD is only used by the writer thread and at exit.  */
+static struct
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  int started;            /* The writer thread is running.  */
+  estream_t stream;       /* The stream registered with the logger.  */
+  char *target;           /* The name of the log file or socket.  */
+  int target_changed;     /* TARGET needs to be (re-)opened.  */
+  char *buffer;           /* The ring buffer.  */
+  size_t head;            /* Offset of the first byte to write.  */
+  size_t used;            /* Number of bytes in the ring buffer.  */
+  size_t inflight;        /* Number of bytes the writer is writing.  */
+  unsigned long dropped;  /* Bytes dropped since the last note.  */
+  unsigned long total_dropped;  /* Bytes dropped since the start.  */
+  int fd;                 /* The file descriptor of TARGET or -1.  */
+} alog;
+
+
+
+/* Open the log file or connect to the log socket NAME.  Returns the
+ * file descriptor or -1 on error.  */
+static int
+open_target (const char *name)
+{
+  int fd;
+
+  if (!strncmp (name, "socket://", 9))
+    {
+      struct sockaddr_un addr;
+      char *fname = NULL;
+
+      name += 9;
+      if (!*name)
+        name = fname = make_filename_try (gnupg_socketdir (), "S.log", NULL);
+      if (!name || strlen (name) >= sizeof addr.sun_path)
+        {
+          xfree (fname);
+          return -1;
+        }
+      memset (&addr, 0, sizeof addr);
+      addr.sun_family = AF_LOCAL;
+      strcpy (addr.sun_path, name);
+      xfree (fname);
+
+      fd = socket (PF_LOCAL, SOCK_STREAM, 0);
+      if (fd == -1)
+        return -1;
+      if (npth_connect (fd, (struct sockaddr *)&addr, SUN_LEN (&addr)) == -1)
+        {
+          close (fd);
+          return -1;
+        }
+    }
+  else
+    {
+      fd = open (name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+      if (fd == -1)
+        return -1;
+    }
+
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+
+/* Write all LENGTH bytes from BUFFER to FD.  Returns -1 on error.  */
+static int
+write_all (int fd, const char *buffer, size_t length, int use_npth)
+{
+  ssize_t n;
+
+  while (length)
+    {
+      if (use_npth)
+        n = npth_write (fd, buffer, length);
+      else
+        n = write (fd, buffer, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      buffer += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* The write function of the stream used by the logger.  This only
+ * copies the data into the ring buffer.  */
+static gpgrt_ssize_t
+queue_writer (void *cookie, const void *buffer, size_t size)
+{
+  size_t tail, n;
+
+  (void)cookie;
+
+  if (!buffer && !size)
+    return 0;  /* Flush request.  */
+
+  npth_mutex_lock (&alog.lock);
+  if (size > RINGBUFFER_SIZE - alog.used)
+    {
+      alog.dropped += size;
+      alog.total_dropped += size;
+    }
+  else
+    {
+      tail = (alog.head + alog.used) % RINGBUFFER_SIZE;
+      n = RINGBUFFER_SIZE - tail;
+      if (n > size)
+        n = size;
+      memcpy (alog.buffer + tail, buffer, n);
+      memcpy (alog.buffer, (const char *)buffer + n, size - n);
+      alog.used += size;
+      npth_cond_signal (&alog.cond);
+    }
+  npth_mutex_unlock (&alog.lock);
+
+  return size;
+}
+
+
+/* The close function of the stream used by the logger.  This is
+ * called if the logger switches to another sink.  The writer thread
+ * still writes out what is in the ring buffer.  */
+static int
+queue_closer (void *cookie)
+{
+  (void)cookie;
+
+  npth_mutex_lock (&alog.lock);
+  alog.stream = NULL;
+  npth_mutex_unlock (&alog.lock);
+  return 0;
+}
+
+
+/* The writer thread.  Note that this thread may not log anything
+ * while holding the lock because the logger calls queue_writer with
+ * its own lock held.  */
+static void *
+writer_thread (void *arg)
+{
+  char *name;
+  const char *data;
+  size_t n;
+  unsigned long dropped, total_dropped;
+
+  (void)arg;
+
+  for (;;)
+    {
+      npth_mutex_lock (&alog.lock);
+      while (!alog.used)
+        npth_cond_wait (&alog.cond, &alog.lock);
+      name = NULL;
+      if (alog.target_changed)
+        {
+          name = xtrystrdup (alog.target);
+          if (name)
+            alog.target_changed = 0;
+        }
+      else if (alog.fd == -1 && alog.target)
+        name = xtrystrdup (alog.target); /* Try to reconnect.  */
+      data = alog.buffer + alog.head;
+      n = RINGBUFFER_SIZE - alog.head;
+      if (n > alog.used)
+        n = alog.used;
+      alog.inflight = n;
+      dropped = alog.dropped;
+      alog.dropped = 0;
+      total_dropped = alog.total_dropped;
+      npth_mutex_unlock (&alog.lock);
+
+      if (name)
+        {
+          if (alog.fd != -1)
+            close (alog.fd);
+          alog.fd = open_target (name);
+          xfree (name);
+        }
+
+      if (alog.fd != -1 && write_all (alog.fd, data, n, 1))
+        {
+          /* The socket has been closed by the log consumer or the
+           * disk is full; the data is lost.  The next batch tries to
+           * reopen the target.  */
+          close (alog.fd);
+          alog.fd = -1;
+        }
+
+      npth_mutex_lock (&alog.lock);
+      alog.head = (alog.head + n) % RINGBUFFER_SIZE;
+      alog.used -= n;
+      alog.inflight = 0;
+      npth_mutex_unlock (&alog.lock);
+
+      if (dropped)
+        log_info ("log queue full - %lu bytes dropped (%lu total)\n",
+                  dropped, total_dropped);
+    }
+
+  return NULL;
+}
+
+
+/* Write out what is left in the ring buffer.  This is called at
+ * process termination and thus runs without taking the lock.  */
+static void
+flush_at_exit (void)
+{
+  size_t off, pos, n;
+
+  if (alog.target_changed && alog.target)
+    {
+      if (alog.fd != -1)
+        close (alog.fd);
+      alog.fd = open_target (alog.target);
+    }
+  if (alog.fd == -1)
+    return;
+
+  for (off = alog.inflight; off < alog.used; off += n)
+    {
+      pos = (alog.head + off) % RINGBUFFER_SIZE;
+      n = RINGBUFFER_SIZE - pos;
+      if (n > alog.used - off)
+        n = alog.used - off;
+      if (write_all (alog.fd, alog.buffer + pos, n, 0))
+        break;
+    }
+}
+
+
+/* Start the log writer thread.  If NAME is not NULL the log output
+ * is then sent to the file or socket NAME by means of that thread.
+ * This needs to be called after npth_init and after the process has
+ * been detached.  On error the logging continues synchronously.  */
+void
+asynclog_start (const char *name)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  int ret;
+
+  if (alog.started)
+    return;
+
+  alog.buffer = xtrymalloc (RINGBUFFER_SIZE);
+  if (!alog.buffer)
+    {
+      log_error ("error allocating the log queue: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+  alog.fd = -1;
+  npth_mutex_init (&alog.lock, NULL);
+  npth_cond_init (&alog.cond, NULL);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  ret = npth_create (&thread, &tattr, writer_thread, NULL);
+  npth_attr_destroy (&tattr);
+  if (ret)
+    {
+      log_error ("error spawning the log writer: %s\n", strerror (ret));
+      xfree (alog.buffer);
+      alog.buffer = NULL;
+      return;
+    }
+  npth_setname_np (thread, "log-writer");
+
+  alog.started = 1;
+  atexit (flush_at_exit);
+
+  if (name)
+    asynclog_set_file (name);
+}
+
+
+/* Replacement for log_set_file.  Once asynclog_start has been called
+ * log files and log sockets are written by the writer thread.  */
+void
+asynclog_set_file (const char *name)
+{
+  es_cookie_io_functions_t io = { NULL };
+  estream_t stream;
+  char *copy;
+  int active;
+
+  if (!alog.started || !name || !strcmp (name, "-"))
+    {
+      log_set_file (name);
+      return;
+    }
+
+  copy = xtrystrdup (name);
+  if (!copy)
+    {
+      log_set_file (name);
+      return;
+    }
+
+  npth_mutex_lock (&alog.lock);
+  active = !!alog.stream;
+  npth_mutex_unlock (&alog.lock);
+
+  stream = NULL;
+  if (!active)
+    {
+      io.func_write = queue_writer;
+      io.func_close = queue_closer;
+      stream = es_fopencookie (NULL, "w", io);
+      if (!stream)
+        {
+          xfree (copy);
+          log_set_file (name);
+          return;
+        }
+      es_setvbuf (stream, NULL, _IOLBF, 0);
+    }
+
+  npth_mutex_lock (&alog.lock);
+  xfree (alog.target);
+  alog.target = copy;
+  alog.target_changed = 1;
+  if (stream)
+    alog.stream = stream;
+  npth_mutex_unlock (&alog.lock);
+
+  /* This closes the previous sink.  We may not hold our lock here
+   * because that sink may be our stream.  */
+  if (stream)
+    log_set_stream (stream);
+}
+
+
+#else /*HAVE_W32_SYSTEM*/
+
+void
+asynclog_start (const char *name)
+{
+  (void)name;
+}
+
+void
+asynclog_set_file (const char *name)
+{
+  log_set_file (name);
+}
+
+#endif /*HAVE_W32_SYSTEM*/
@@ -106,6 +106,25 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
 
   for (s=d=buffer; length && !state->stop_seen; length--, s++)
     {
+      /* Fast path for groups of four valid characters.  At least one
+         character is left for the code below.  */
+      while (ds == s_b64_0 && length > 4
+             && !((s[0] | s[1] | s[2] | s[3]) & 0x80))
+        {
+          unsigned char c0 = asctobin[((unsigned char *)s)[0]];
+          unsigned char c1 = asctobin[((unsigned char *)s)[1]];
+          unsigned char c2 = asctobin[((unsigned char *)s)[2]];
+          unsigned char c3 = asctobin[((unsigned char *)s)[3]];
+
+          if ((c0 | c1 | c2 | c3) & 0xc0)
+            break;
+          *d++ = (c0 << 2) | (c1 >> 4);
+          *d++ = (c1 << 4) | (c2 >> 2);
+          *d++ = (c2 << 6) | c3;
+          s += 4;
+          length -= 4;
+        }
+
     again:
       switch (ds)
         {
@@ -35,7 +35,47 @@
 #include "util.h"
 
 
-#define tohex(n) ((n) < 10 ? ((n) + '0') : (((n) - 10) + 'A'))
+/* Map a nibble to its hex digit and a character to its nibble value
+ * or 0xff if it is not a hex digit.  */
+static const char hexdigits[16] = "0123456789ABCDEF";
+static const unsigned char hexvalues[256] =
+  {
+#define XX 0xff
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,XX,XX,XX,XX,XX,XX,
+    XX,10,11,12,13,14,15,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,10,11,12,13,14,15,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX
+#undef XX
+  };
+
+
+/* Return the value of the two hex digits at S or -1 if S does not
+ * start with two hex digits.  */
+static inline int
+hexpair (const char *s)
+{
+  unsigned int hi, lo;
+
+  hi = hexvalues[*(const unsigned char *)s];
+  if (hi == 0xff)
+    return -1;
+  lo = hexvalues[((const unsigned char *)s)[1]];
+  if (lo == 0xff)
+    return -1;
+  return (hi << 4) | lo;
+}
 
 
 /* Convert STRING consisting of hex characters into its binary
@@ -47,14 +87,14 @@
 int
 hex2bin (const char *string, void *buffer, size_t length)
 {
-  int i;
+  int i, c;
   const char *s = string;
 
   for (i=0; i < length; )
     {
-      if (!hexdigitp (s) || !hexdigitp (s+1))
+      if ((c = hexpair (s)) == -1)
         return -1;           /* Invalid hex digits. */
-      ((unsigned char*)buffer)[i++] = xtoi_2 (s);
+      ((unsigned char*)buffer)[i++] = c;
       s += 2;
     }
   if (*s && (!isascii (*s) || !isspace (*s)) )
@@ -137,8 +177,8 @@ do_bin2hex (const void *buffer, size_t length, char *stringbuf, int with_colon)
     {
       if (with_colon && s != buffer)
         *p++ = ':';
-      *p++ = tohex ((*s>>4)&15);
-      *p++ = tohex (*s&15);
+      *p++ = hexdigits[*s >> 4];
+      *p++ = hexdigits[*s & 15];
     }
   *p = 0;
 
@@ -199,13 +239,13 @@ const char *
 hex2str (const char *hexstring, char *buffer, size_t bufsize, size_t *buflen)
 {
   const char *s = hexstring;
-  int idx, count;
+  int idx, count, c;
   int need_nul = 0;
 
   if (buflen)
     *buflen = 0;
 
-  for (s=hexstring, count=0; hexdigitp (s) && hexdigitp (s+1); s += 2, count++)
+  for (s=hexstring, count=0; hexpair (s) != -1; s += 2, count++)
     ;
   if (*s && (!isascii (*s) || !isspace (*s)) )
     {
@@ -226,8 +266,8 @@ hex2str (const char *hexstring, char *buffer, size_t bufsize, size_t *buflen)
           return NULL; /* Too long.  */
         }
 
-      for (s=hexstring, idx=0; hexdigitp (s) && hexdigitp (s+1); s += 2)
-        ((unsigned char*)buffer)[idx++] = xtoi_2 (s);
+      for (s=hexstring, idx=0; (c = hexpair (s)) != -1; s += 2)
+        ((unsigned char*)buffer)[idx++] = c;
       if (need_nul)
         buffer[idx] = 0;
     }
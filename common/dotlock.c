@@ -171,6 +171,17 @@
 
    If nothing has been stored dotlock_get_fd returns -1.
 
+   With the flag DOTLOCK_WAIT_QUEUE for dotlock_create, a file with
+   the suffix ".lock-wait" is created along with the lock file.  On
+   systems with open file description locks (F_OFD_SETLKW) this file
+   is locked while the lock is held or being waited for.  Processes
+   waiting with a timeout of -1 then block on that lock instead of
+   polling the lock file and are woken up as soon as the lock is
+   released.  The link(2) based lock file still decides who holds the
+   lock; thus this works along with processes not using this flag and
+   it falls back to polling if the file system does not support
+   these locks.  The ".lock-wait" file is not removed.
+
 
 
    How to build:
@@ -401,6 +412,9 @@ struct dotlock_handle
 
   int extra_fd;              /* A place for the caller to store an FD.  */
 
+  int waitfd;                 /* The fd of the wait file or -1.         */
+  unsigned int waitlocked:1;  /* The wait file is locked by us.         */
+
 #ifdef HAVE_DOSISH_SYSTEM
   HANDLE lockhd;       /* The W32 handle of the lock file.      */
 #else /*!HAVE_DOSISH_SYSTEM */
@@ -638,11 +652,60 @@ use_hardlinks_p (const char *tname)
 
 
 
+#if defined(HAVE_POSIX_SYSTEM) && defined(F_OFD_SETLKW)
+/* Open the wait file for the lock H.  On error the wait file is
+   silently not used.  */
+static void
+waitfile_open (dotlock_t h)
+{
+  char *fname;
+
+  fname = xtrymalloc (strlen (h->lockname) + 5 + 1);
+  if (!fname)
+    return;
+  strcpy (stpcpy (fname, h->lockname), "-wait");
+  do
+    {
+#ifdef O_CLOEXEC
+      h->waitfd = open (fname, O_RDWR|O_CREAT|O_CLOEXEC,
+                        S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR);
+#else
+      h->waitfd = open (fname, O_RDWR|O_CREAT,
+                        S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR);
+#endif
+    }
+  while (h->waitfd == -1 && errno == EINTR);
+  xfree (fname);
+}
+
+
+/* Lock the wait file of H or with TYPE F_UNLCK unlock it.  With WAIT
+   set block until the lock can be taken.  Returns 0 on success.  */
+static int
+waitfile_lock (dotlock_t h, int type, int wait)
+{
+  struct flock fl;
+  int rc;
+
+  memset (&fl, 0, sizeof fl);
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  do
+    rc = fcntl (h->waitfd, wait? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+  while (rc == -1 && errno == EINTR);
+  if (!rc)
+    h->waitlocked = (type != F_UNLCK);
+  return rc;
+}
+#endif /*HAVE_POSIX_SYSTEM && F_OFD_SETLKW*/
+
+
 #ifdef  HAVE_POSIX_SYSTEM
 /* Locking core for Unix.  It used a temporary file and the link
    system call to make locking an atomic operation. */
 static dotlock_t
-dotlock_create_unix (dotlock_t h, const char *file_to_lock)
+dotlock_create_unix (dotlock_t h, const char *file_to_lock,
+                     unsigned int flags)
 {
   int  fd = -1;
   char pidstr[16];
@@ -757,6 +820,12 @@ dotlock_create_unix (dotlock_t h, const char *file_to_lock)
       return NULL;
     }
   strcpy (stpcpy (h->lockname, file_to_lock), EXTSEP_S "lock");
+#ifdef F_OFD_SETLKW
+  if ((flags & DOTLOCK_WAIT_QUEUE))
+    waitfile_open (h);
+#else
+  (void)flags;
+#endif
   UNLOCK_all_lockfiles ();
   if (h->use_o_excl)
     my_debug_1 ("locking for '%s' done via O_EXCL\n", h->lockname);
@@ -861,7 +930,7 @@ dotlock_create_w32 (dotlock_t h, const char *file_to_lock)
    POSIX systems a temporary file ".#lk.<hostname>.pid[.threadid] is
    used.
 
-   FLAGS must be 0.
+   FLAGS must be 0 or DOTLOCK_WAIT_QUEUE.
 
    The function returns an new handle which needs to be released using
    destroy_dotlock but gets also released at the termination of the
@@ -883,7 +952,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
   if ( !file_to_lock )
     return NULL;  /* Only initialization was requested.  */
 
-  if (flags)
+  if ((flags & ~DOTLOCK_WAIT_QUEUE))
     {
       my_set_errno (EINVAL);
       return NULL;
@@ -893,6 +962,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
   if (!h)
     return NULL;
   h->extra_fd = -1;
+  h->waitfd = -1;
 
   if (never_lock)
     {
@@ -907,7 +977,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
 #ifdef HAVE_DOSISH_SYSTEM
   return dotlock_create_w32 (h, file_to_lock);
 #else /*!HAVE_DOSISH_SYSTEM */
-  return dotlock_create_unix (h, file_to_lock);
+  return dotlock_create_unix (h, file_to_lock, flags);
 #endif /*!HAVE_DOSISH_SYSTEM*/
 }
 
@@ -941,6 +1011,8 @@ dotlock_destroy_unix (dotlock_t h)
   if (h->tname && !h->use_o_excl)
     unlink (h->tname);
   xfree (h->tname);
+  if (h->waitfd != -1)
+    close (h->waitfd);  /* This also releases the wait lock.  */
 }
 #endif /*HAVE_POSIX_SYSTEM*/
 
@@ -1015,6 +1087,23 @@ dotlock_take_unix (dotlock_t h, long timeout)
   int same_node;
   int saveerrno;
 
+#ifdef F_OFD_SETLKW
+  /* Queue up behind other processes using the wait file.  Only if we
+     shall wait forever we block here; the holder of the wait lock
+     releases it right after removing the lock file.  */
+  if (h->waitfd != -1 && !h->waitlocked)
+    {
+      if (!waitfile_lock (h, F_WRLCK, 0))
+        ;
+      else if ((errno == EAGAIN || errno == EACCES)
+               && timeout == -1 && !maybe_deadlock (h))
+        {
+          my_info_1 (_("waiting for lock %s...\n"), h->lockname);
+          waitfile_lock (h, F_WRLCK, 1);
+        }
+    }
+#endif /*F_OFD_SETLKW*/
+
  again:
   if (h->use_o_excl)
     {
@@ -1249,6 +1338,14 @@ dotlock_take (dotlock_t h, long timeout)
   ret = dotlock_take_w32 (h, timeout);
 #else /*!HAVE_DOSISH_SYSTEM*/
   ret = dotlock_take_unix (h, timeout);
+# ifdef F_OFD_SETLKW
+  if (ret && h->waitlocked)
+    {
+      int saveerrno = errno;
+      waitfile_lock (h, F_UNLCK, 0);
+      my_set_errno (saveerrno);
+    }
+# endif
 #endif /*!HAVE_DOSISH_SYSTEM*/
 
   return ret;
@@ -1289,6 +1386,11 @@ dotlock_release_unix (dotlock_t h)
     }
   /* Fixme: As an extra check we could check whether the link count is
      now really at 1. */
+#ifdef F_OFD_SETLKW
+  /* Wake up the next waiter.  */
+  if (h->waitlocked)
+    waitfile_lock (h, F_UNLCK, 0);
+#endif
   return 0;
 }
 #endif /*HAVE_POSIX_SYSTEM */
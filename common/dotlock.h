@@ -94,6 +94,9 @@ extern "C"
 #endif
 
 
+/* Flags for dotlock_create.  */
+#define DOTLOCK_WAIT_QUEUE 1  /* Use a kernel lock to wait for the lock.  */
+
 struct dotlock_handle;
 typedef struct dotlock_handle *dotlock_t;
 
@@ -190,9 +190,47 @@ get_max_fds (void)
 void
 close_all_fds (int first, int *except)
 {
-  int max_fd = get_max_fds ();
+  int max_fd;
   int fd, i, except_start;
 
+#if defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM)
+  /* If the system has a call to close a range of descriptors we use
+   * it for the ranges between the exceptions.  This avoids one close
+   * call per possible descriptor.  close_range may fail with ENOSYS
+   * on older kernels; we then fall back to the loop below.  */
+  {
+    int start = first;
+    int failed = 0;
+
+# ifdef HAVE_CLOSE_RANGE
+    for (i=0; except && except[i] != -1 && !failed; i++)
+      {
+        if (except[i] < start)
+          continue;
+        if (except[i] > start
+            && close_range (start, except[i] - 1, 0))
+          failed = 1;
+        start = except[i] + 1;
+      }
+    if (!failed && !close_range (start, ~0U, 0))
+      {
+        gpg_err_set_errno (0);
+        return;
+      }
+# else /*HAVE_CLOSEFROM*/
+    if (!except || except[0] == -1)
+      {
+        closefrom (start);
+        gpg_err_set_errno (0);
+        return;
+      }
+# endif
+    (void)failed;
+  }
+#endif /*HAVE_CLOSE_RANGE || HAVE_CLOSEFROM*/
+
+  max_fd = get_max_fds ();
+
   if (except)
     {
       except_start = 0;
@@ -195,10 +195,14 @@ read_and_log_stderr (read_and_log_buffer_t *state, es_poll_t *fderr)
 
 
 
-/* A buffer to copy from one stream to another.  */
+/* A buffer to copy from one stream to another.  The size matches
+ * the default pipe capacity on Linux so that a bulk transfer, like
+ * gpgtar feeding an archive to gpg, fills the pipe in one go instead
+ * of needing a poll round for each 4k block.  */
+#define COPY_BUFFER_SIZE 65536
 struct copy_buffer
 {
-  char buffer[4096];
+  char buffer[COPY_BUFFER_SIZE];
   char *writep;
   size_t nread;
 };
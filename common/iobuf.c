@@ -56,6 +56,7 @@
 #include "util.h"
 #include "sysutils.h"
 #include "iobuf.h"
+#include "tracepoint.h"
 
 /*-- Begin configurable part.  --*/
 
@@ -66,6 +67,10 @@
    the number of filters in a chain.  */
 #define MAX_NESTING_FILTER 64
 
+/* The number of buffers we ask the system to read ahead when reading
+ * a regular file.  */
+#define READAHEAD_BUFFERS 4
+
 /*-- End configurable part.  --*/
 
 /* The size of the iobuffers.  This can be changed using the
@@ -96,6 +101,7 @@ typedef struct
   int eof_seen;
   int delayed_rc;
   int print_only_name; /* Flags indicating that fname is not a real file.  */
+  int readahead;       /* Give read-ahead hints to the system.  */
   char fname[1];       /* Name of the file.  */
 } file_filter_ctx_t;
 
@@ -442,6 +448,41 @@ fd_cache_open (const char *fname, const char *mode)
 }
 
 
+#ifndef HAVE_W32_SYSTEM
+/* Ask the system to read the next buffers of the file of context A
+ * in the background so that the I/O overlaps with the processing of
+ * the current buffer.  BUFSIZE is the size of our buffers.  Only the
+ * buffer READAHEAD_BUFFERS ahead is requested except for the first
+ * call which requests all of them.  */
+static void
+file_filter_readahead (file_filter_ctx_t *a, size_t bufsize)
+{
+#ifdef HAVE_POSIX_FADVISE
+  off_t off;
+
+  off = lseek (a->fp, 0, SEEK_CUR);
+  if (off == (off_t)(-1))
+    {
+      a->readahead = 0;
+      return;
+    }
+  if (a->readahead == 1)
+    {
+      posix_fadvise (a->fp, off, READAHEAD_BUFFERS * bufsize,
+                     POSIX_FADV_WILLNEED);
+      a->readahead = 2;
+    }
+  else
+    posix_fadvise (a->fp, off + (READAHEAD_BUFFERS - 1) * bufsize, bufsize,
+                   POSIX_FADV_WILLNEED);
+#else
+  (void)bufsize;
+  a->readahead = 0;
+#endif
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 static int
 file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 	     size_t * ret_len)
@@ -514,6 +555,7 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
             }
           else if (!n) /* eof */
             {
+              a->readahead = 0;
               if (nbytes)
                 a->delayed_rc = -1;
               else
@@ -533,6 +575,8 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
                   rc = 0;
                 }
             }
+          if (a->readahead)
+            file_filter_readahead (a, size);
 #endif
 	  *ret_len = nbytes;
 	}
@@ -595,6 +639,7 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
       a->delayed_rc = 0;
       a->keep_open = 0;
       a->no_cache = 0;
+      a->readahead = 0;
     }
   else if (control == IOBUFCTRL_DESC)
     {
@@ -1374,6 +1419,19 @@ do_open (const char *fname, int special_filenames,
   a->filter = file_filter;
   a->filter_ov = fcx;
   file_filter (fcx, IOBUFCTRL_INIT, NULL, NULL, &len);
+#if !defined(HAVE_W32_SYSTEM) && defined(HAVE_POSIX_FADVISE)
+  /* We read regular files sequentially; tell the system so that it
+   * uses a larger read-ahead window.  Pipes and devices don't
+   * benefit.  */
+  if (use == IOBUF_INPUT && !print_only)
+    {
+      struct stat st;
+
+      if (!fstat (fp, &st) && S_ISREG (st.st_mode)
+          && !posix_fadvise (fp, 0, 0, POSIX_FADV_SEQUENTIAL))
+        fcx->readahead = 1;
+    }
+#endif
   if (DBG_IOBUF)
     log_debug ("iobuf-%d.%d: open '%s' desc=%s fd=%d\n",
 	       a->no, a->subno, fname, iobuf_desc (a, desc), FD2INT (fcx->fp));
@@ -1830,6 +1888,29 @@ underflow (iobuf_t a, int clear_pending_eof)
 }
 
 
+/* The filter of the input pipeline A returned EOF.  Tell the filter
+   to free itself and free everything except for the internal buffer.
+   The filter is then marked as being at EOF.  */
+static void
+release_filter_at_eof (iobuf_t a)
+{
+  size_t dummy_len = 0;
+  int rc;
+
+  /* Tell the filter to free itself */
+  if ((rc = a->filter (a->filter_ov, IOBUFCTRL_FREE, a->chain,
+		       NULL, &dummy_len)))
+    log_error ("IOBUFCTRL_FREE failed: %s\n", gpg_strerror (rc));
+
+  /* Free everything except for the internal buffer.  */
+  if (a->filter_ov && a->filter_ov_owner)
+    xfree (a->filter_ov);
+  a->filter_ov = NULL;
+  a->filter = NULL;
+  a->filter_eof = 1;
+}
+
+
 /****************
  * read underflow: read TARGET bytes into the buffer and return
  * the first byte or -1 on EOF.
@@ -1917,8 +1998,12 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	   A->FILTER.  */
 	rc = 0;
       else
-	rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
-			&a->d.buf[a->d.len], &len);
+        {
+          TRACEPOINT3 (iobuf_filter_begin, a->no, IOBUFCTRL_UNDERFLOW, len);
+          rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
+                          &a->d.buf[a->d.len], &len);
+          TRACEPOINT3 (iobuf_filter_end, a->no, rc, len);
+        }
       a->d.len += len;
 
       if (DBG_IOBUF)
@@ -1932,19 +2017,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
       if (rc == -1)
 	/* EOF.  */
 	{
-	  size_t dummy_len = 0;
-
-	  /* Tell the filter to free itself */
-	  if ((rc = a->filter (a->filter_ov, IOBUFCTRL_FREE, a->chain,
-			       NULL, &dummy_len)))
-	    log_error ("IOBUFCTRL_FREE failed: %s\n", gpg_strerror (rc));
-
-	  /* Free everything except for the internal buffer.  */
-	  if (a->filter_ov && a->filter_ov_owner)
-	    xfree (a->filter_ov);
-	  a->filter_ov = NULL;
-	  a->filter = NULL;
-	  a->filter_eof = 1;
+	  release_filter_at_eof (a);
 
 	  if (clear_pending_eof && a->d.len == 0 && a->chain)
 	    /* We don't need to keep this filter around at all:
@@ -1993,12 +2066,75 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 }
 
 
+/* Read directly from the filter of the input pipeline A into BUF,
+   bypassing A's internal buffer, which must be empty.  At most
+   A->D.SIZE bytes are requested so that the filter sees the same
+   request sizes as with underflow().  Returns the number of bytes
+   stored at BUF.  An EOF or an error returned by the filter is
+   recorded in A just like underflow() does; thus the next call to
+   underflow() returns it.  */
+static size_t
+underflow_direct (iobuf_t a, byte *buf, size_t buflen)
+{
+  size_t len;
+  int rc;
+
+  assert (a->use == IOBUF_INPUT);
+  assert (a->d.start == a->d.len);
+  assert (a->filter && ! a->filter_eof && ! a->error);
+
+  a->d.start = a->d.len = 0;
+  len = buflen < a->d.size ? buflen : a->d.size;
+  if (DBG_IOBUF)
+    log_debug ("iobuf-%d.%d: underflow: A->FILTER (%lu bytes, direct)\n",
+	       a->no, a->subno, (ulong) len);
+  TRACEPOINT3 (iobuf_filter_begin, a->no, IOBUFCTRL_UNDERFLOW, len);
+  rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain, buf, &len);
+  TRACEPOINT3 (iobuf_filter_end, a->no, rc, len);
+  if (DBG_IOBUF)
+    log_debug ("iobuf-%d.%d: A->FILTER() returned rc=%d (%s), read %lu bytes\n",
+	       a->no, a->subno,
+	       rc, rc == 0 ? "ok" : rc == -1 ? "EOF" : gpg_strerror (rc),
+	       (ulong) len);
+
+  if (rc == -1)
+    release_filter_at_eof (a);
+  else if (rc)
+    a->error = rc;
+
+  return len;
+}
+
+
+/* Pass the LEN bytes at BUF to the filter of the output pipeline A.
+   The filter may modify BUF in place.  */
 static int
-filter_flush (iobuf_t a)
+filter_flush_buffer (iobuf_t a, byte *buf, size_t buflen)
 {
   size_t len;
   int rc;
 
+  len = buflen;
+  TRACEPOINT3 (iobuf_filter_begin, a->no, IOBUFCTRL_FLUSH, len);
+  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, buf, &len);
+  TRACEPOINT3 (iobuf_filter_end, a->no, rc, len);
+  if (!rc && len != buflen)
+    {
+      log_info ("filter_flush did not write all!\n");
+      rc = GPG_ERR_INTERNAL;
+    }
+  else if (rc)
+    a->error = rc;
+
+  return rc;
+}
+
+
+static int
+filter_flush (iobuf_t a)
+{
+  int rc;
+
   if (a->use == IOBUF_OUTPUT_TEMP)
     {				/* increase the temp buffer */
       size_t newsize = a->d.size + iobuf_buffer_size;
@@ -2015,15 +2151,7 @@ filter_flush (iobuf_t a)
     log_bug ("flush on non-output iobuf\n");
   else if (!a->filter)
     log_bug ("filter_flush: no filter\n");
-  len = a->d.len;
-  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, a->d.buf, &len);
-  if (!rc && len != a->d.len)
-    {
-      log_info ("filter_flush did not write all!\n");
-      rc = GPG_ERR_INTERNAL;
-    }
-  else if (rc)
-    a->error = rc;
+  rc = filter_flush_buffer (a, a->d.buf, a->d.len);
   a->d.len = 0;
 
   return rc;
@@ -2112,7 +2240,25 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
 	  if (buf)
 	    buf += size;
 	}
-      if (n < buflen)
+      if (n < buflen && buf && buflen - n >= a->d.size
+	  && a->use == IOBUF_INPUT
+	  && a->filter && ! a->filter_eof && ! a->error)
+	/* The internal buffer is empty and the remaining request is
+	   at least as large as it.  Let the filter write directly
+	   into BUFFER to save a copy.  */
+	{
+	  size_t size = underflow_direct (a, buf, buflen - n);
+	  n += size;
+	  buf += size;
+	  if (!size && ! a->filter_eof && ! a->error)
+	    /* The filter returned nothing but no EOF either.
+	       underflow() treats this as EOF, so do we.  */
+	    {
+	      a->nbytes += n;
+	      return n ? n : -1 /*EOF*/;
+	    }
+	}
+      else if (n < buflen)
 	/* Draining the internal buffer didn't fill BUFFER.  Call
 	   underflow to read more data into the filter's internal
 	   buffer.  */
@@ -2235,6 +2381,52 @@ iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
 }
 
 
+/* Same as iobuf_write but the filters are allowed to modify BUFFER;
+   thus its content is undefined on return.  This allows to hand
+   BUFFER over to the filter as long as A's internal buffer is empty,
+   which saves a copy.  The data is passed to the filter in chunks of
+   the same size as with iobuf_write and thus the output is
+   identical.  */
+int
+iobuf_write_inplace (iobuf_t a, void *buffer, unsigned int buflen)
+{
+  unsigned char *buf = buffer;
+  int rc;
+
+  if (a->use != IOBUF_OUTPUT || !a->filter)
+    return iobuf_write (a, buffer, buflen);
+
+  if (a->d.len)
+    {
+      /* First complete the already buffered chunk.  */
+      unsigned size = a->d.size - a->d.len;
+      if (size > buflen)
+	size = buflen;
+      rc = iobuf_write (a, buf, size);
+      if (rc)
+	return rc;
+      buflen -= size;
+      buf += size;
+      if (buflen && (rc = filter_flush (a)))
+	return rc;
+    }
+
+  while (buflen > a->d.size)
+    {
+      /* Note that we keep the last full chunk in the internal buffer
+         because iobuf_write flushes only if more data is to be
+         written.  */
+      rc = filter_flush_buffer (a, buf, a->d.size);
+      if (rc)
+	return rc;
+      buflen -= a->d.size;
+      buf += a->d.size;
+    }
+
+  return buflen? iobuf_write (a, buf, buflen) : 0;
+}
+
+
 int
 iobuf_writestr (iobuf_t a, const char *buf)
 {
@@ -2315,7 +2507,7 @@ iobuf_copy (iobuf_t dest, iobuf_t source)
       if (nread > max_read)
         max_read = nread;
 
-      err = iobuf_write (dest, temp, nread);
+      err = iobuf_write_inplace (dest, temp, nread);
       if (err)
         break;
       nwrote += nread;
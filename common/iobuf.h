@@ -538,6 +538,11 @@ int iobuf_writebyte (iobuf_t a, unsigned c);
    and an error code otherwise.  */
 int iobuf_write (iobuf_t a, const void *buf, unsigned buflen);
 
+/* Same as iobuf_write but the filters may modify BUF in place, which
+   avoids copying it into the pipeline's internal buffer.  The content
+   of BUF is undefined on return.  */
+int iobuf_write_inplace (iobuf_t a, void *buf, unsigned buflen);
+
 /* Write a string (not including the NUL terminator) to the pipeline.
    Returns 0 on success and an error code otherwise.  */
 int iobuf_writestr (iobuf_t a, const char *buf);
@@ -96,8 +96,14 @@ put_membuf (membuf_t *mb, const void *buf, size_t len)
   if (mb->len + len >= mb->size)
     {
       char *p;
-
-      mb->size += len + 1024;
+      size_t newsize;
+
+      /* Grow geometrically so that appending many small pieces
+         needs only a logarithmic number of reallocs.  */
+      newsize = mb->size + len + 1024;
+      if (newsize < 2 * mb->size)
+        newsize = 2 * mb->size;
+      mb->size = newsize;
       p = xtryrealloc (mb->buf, mb->size);
       if (!p)
         {
@@ -60,8 +60,10 @@ struct name_value_entry
   char *name;
 
   /* The value as stored in the file.  We store it when we parse
-     a file so that we can reproduce it.  */
-  strlist_t raw_value;
+     a file so that we can reproduce it.  All lines of the value are
+     kept in this one string; each but possibly the last line is
+     terminated by a LF.  */
+  char *raw_value;
 
   /* The decoded value.  */
   char *value;
@@ -116,14 +118,59 @@ nve_release (nve_t entry, int private_key_mode)
   if (entry->value && private_key_mode)
     wipememory (entry->value, strlen (entry->value));
   xfree (entry->value);
-  if (private_key_mode)
-    free_strlist_wipe (entry->raw_value);
-  else
-    free_strlist (entry->raw_value);
+  if (entry->raw_value && private_key_mode)
+    wipememory (entry->raw_value, strlen (entry->raw_value));
+  xfree (entry->raw_value);
   xfree (entry);
 }
 
 
+/* Append the string LINE to the malloced string at R_STRING which
+ * currently has a length of *R_LEN and space for *R_SIZE bytes.  If
+ * the buffer needs to grow and WIPE is set the old buffer is wiped
+ * before it is released.  */
+static gpg_error_t
+append_line (char **r_string, size_t *r_len, size_t *r_size,
+             const char *line, int wipe)
+{
+  size_t n = strlen (line);
+
+  if (*r_len + n + 1 > *r_size)
+    {
+      size_t newsize = *r_size? *r_size : 128;
+      char *p;
+
+      while (*r_len + n + 1 > newsize)
+        newsize *= 2;
+      p = xtrymalloc (newsize);
+      if (!p)
+        return my_error_from_syserror ();
+      if (*r_string)
+        {
+          memcpy (p, *r_string, *r_len);
+          if (wipe)
+            wipememory (*r_string, *r_len);
+          xfree (*r_string);
+        }
+      *r_string = p;
+      *r_size = newsize;
+    }
+  memcpy (*r_string + *r_len, line, n + 1);
+  *r_len += n;
+  return 0;
+}
+
+
+/* Return the length of the line starting at S including its LF.  */
+static size_t
+raw_line_length (const char *s)
+{
+  const char *e = strchr (s, '\n');
+
+  return e? (e - s + 1) : strlen (s);
+}
+
+
 /* Release a private key container structure.  */
 void
 nvc_release (nvc_t pk)
@@ -171,6 +218,7 @@ assert_raw_value (nve_t entry)
 {
   gpg_error_t err = 0;
   size_t len, offset;
+  size_t rawlen = 0, rawsize = 0;
 #define LINELEN	70
   char buf[LINELEN+3];
 
@@ -184,7 +232,7 @@ assert_raw_value (nve_t entry)
       size_t amount, linelen = LINELEN;
 
       /* On the first line we need to subtract space for the name.  */
-      if (entry->raw_value == NULL && strlen (entry->name) < linelen)
+      if (!offset && strlen (entry->name) < linelen)
 	linelen -= strlen (entry->name);
 
       /* See if the rest of the value fits in this line.  */
@@ -213,20 +261,19 @@ assert_raw_value (nve_t entry)
 
       snprintf (buf, sizeof buf, " %.*s\n", (int) amount,
 		&entry->value[offset]);
-      if (append_to_strlist_try (&entry->raw_value, buf) == NULL)
-	{
-	  err = my_error_from_syserror ();
-	  goto leave;
-	}
+      err = append_line (&entry->raw_value, &rawlen, &rawsize, buf, 1);
+      if (err)
+        goto leave;
 
       offset += amount;
       len -= amount;
     }
 
  leave:
-  if (err)
+  if (err && entry->raw_value)
     {
-      free_strlist_wipe (entry->raw_value);
+      wipememory (entry->raw_value, rawlen);
+      xfree (entry->raw_value);
       entry->raw_value = NULL;
     }
 
@@ -235,32 +282,34 @@ assert_raw_value (nve_t entry)
 }
 
 
-/* Computes the length of the value encoded as continuation.  If
-   *SWALLOW_WS is set, all whitespace at the beginning of S is
-   swallowed.  If START is given, a pointer to the beginning of the
-   value is stored there.  */
+/* Computes the length of the value encoded as continuation in the
+   line S of length LINELEN.  If *SWALLOW_WS is set, all whitespace at
+   the beginning of S is swallowed.  If START is given, a pointer to
+   the beginning of the value is stored there.  */
 static size_t
-continuation_length (const char *s, int *swallow_ws, const char **start)
+continuation_length (const char *s, size_t linelen, int *swallow_ws,
+                     const char **start)
 {
+  const char *end = s + linelen;
   size_t len;
 
   if (*swallow_ws)
     {
       /* The previous line was a blank line and we inserted a newline.
 	 Swallow all whitespace at the beginning of this line.  */
-      while (ascii_isspace (*s))
+      while (s < end && ascii_isspace (*s))
 	s++;
     }
   else
     {
       /* Iff a continuation starts with more than one space, it
 	 encodes a space.  */
-      if (ascii_isspace (*s))
+      if (s < end && ascii_isspace (*s))
 	s++;
     }
 
   /* Strip whitespace at the end.  */
-  len = strlen (s);
+  len = end - s;
   while (len > 0 && ascii_isspace (s[len-1]))
     len--;
 
@@ -285,9 +334,9 @@ continuation_length (const char *s, int *swallow_ws, const char **start)
 static gpg_error_t
 assert_value (nve_t entry)
 {
-  size_t len;
+  size_t len, n;
   int swallow_ws;
-  strlist_t s;
+  const char *s;
   char *p;
 
   if (entry->value)
@@ -295,8 +344,14 @@ assert_value (nve_t entry)
 
   len = 0;
   swallow_ws = 0;
-  for (s = entry->raw_value; s; s = s->next)
-    len += continuation_length (s->d, &swallow_ws, NULL);
+  s = entry->raw_value;
+  do
+    {
+      n = raw_line_length (s);
+      len += continuation_length (s, n, &swallow_ws, NULL);
+      s += n;
+    }
+  while (*s);
 
   /* Add one for the terminating zero.  */
   len += 1;
@@ -306,14 +361,20 @@ assert_value (nve_t entry)
     return my_error_from_syserror ();
 
   swallow_ws = 0;
-  for (s = entry->raw_value; s; s = s->next)
+  s = entry->raw_value;
+  do
     {
       const char *start;
-      size_t l = continuation_length (s->d, &swallow_ws, &start);
+      size_t l;
+
+      n = raw_line_length (s);
+      l = continuation_length (s, n, &swallow_ws, &start);
+      s += n;
 
       memcpy (p, start, l);
       p += l;
     }
+  while (*s);
 
   *p++ = 0;
   assert (p - entry->value == len);
@@ -348,7 +409,7 @@ nve_value (nve_t pke)
    given.  If PRESERVE_ORDER is not given, entries with the same name
    are grouped.  NAME, VALUE and RAW_VALUE is consumed.  */
 static gpg_error_t
-_nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
+_nvc_add (nvc_t pk, char *name, char *value, char *raw_value,
 	  int preserve_order)
 {
   gpg_error_t err = 0;
@@ -434,7 +495,9 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
       if (value)
 	wipememory (value, strlen (value));
       xfree (value);
-      free_strlist_wipe (raw_value);
+      if (raw_value)
+	wipememory (raw_value, strlen (raw_value));
+      xfree (raw_value);
     }
 
   return err;
@@ -483,7 +546,9 @@ nvc_set (nvc_t pk, const char *name, const char *value)
       if (v == NULL)
 	return my_error_from_syserror ();
 
-      free_strlist_wipe (e->raw_value);
+      if (e->raw_value)
+	wipememory (e->raw_value, strlen (e->raw_value));
+      xfree (e->raw_value);
       e->raw_value = NULL;
       if (e->value)
 	wipememory (e->value, strlen (e->value));
@@ -691,7 +756,8 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
   char *buf = NULL;
   size_t buf_len = 0;
   char *name = NULL;
-  strlist_t raw_value = NULL;
+  char *raw_value = NULL;
+  size_t raw_len = 0, raw_size = 0;
 
   *result = for_private_key? nvc_new_private_key () : nvc_new ();
   if (*result == NULL)
@@ -712,11 +778,10 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
       if (name && (spacep (buf) || *p == 0))
 	{
 	  /* A continuation.  */
-	  if (append_to_strlist_try (&raw_value, buf) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
+	  err = append_line (&raw_value, &raw_len, &raw_size, buf,
+                             for_private_key);
+	  if (err)
+	    goto leave;
 	  continue;
 	}
 
@@ -724,6 +789,8 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
       if (raw_value)
 	{
 	  err = _nvc_add (*result, name, NULL, raw_value, 1);
+	  name = NULL;
+	  raw_value = NULL;
 	  if (err)
 	    goto leave;
 	}
@@ -731,6 +798,7 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
       /* And prepare for the next one.  */
       name = NULL;
       raw_value = NULL;
+      raw_len = raw_size = 0;
 
       if (*p != 0 && *p != '#')
 	{
@@ -755,19 +823,17 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 	      goto leave;
 	    }
 
-	  if (append_to_strlist_try (&raw_value, value) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
+	  err = append_line (&raw_value, &raw_len, &raw_size, value,
+                             for_private_key);
+	  if (err)
+	    goto leave;
 	  continue;
 	}
 
-      if (append_to_strlist_try (&raw_value, buf) == NULL)
-	{
-	  err = my_error_from_syserror ();
-	  goto leave;
-	}
+      err = append_line (&raw_value, &raw_len, &raw_size, buf,
+                         for_private_key);
+      if (err)
+        goto leave;
     }
   if (len < 0)
     {
@@ -777,10 +843,20 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 
   /* Add the final entry.  */
   if (raw_value)
-    err = _nvc_add (*result, name, NULL, raw_value, 1);
+    {
+      err = _nvc_add (*result, name, NULL, raw_value, 1);
+      name = NULL;
+      raw_value = NULL;
+    }
 
  leave:
   gpgrt_free (buf);
+  xfree (name);
+  if (raw_value)
+    {
+      wipememory (raw_value, raw_len);
+      xfree (raw_value);
+    }
   if (err)
     {
       nvc_release (*result);
@@ -817,7 +893,6 @@ static gpg_error_t
 write_one_entry (nve_t entry, estream_t stream)
 {
   gpg_error_t err;
-  strlist_t sl;
 
   if (entry->name)
     es_fputs (entry->name, stream);
@@ -826,8 +901,8 @@ write_one_entry (nve_t entry, estream_t stream)
   if (err)
     return err;
 
-  for (sl = entry->raw_value; sl; sl = sl->next)
-    es_fputs (sl->d, stream);
+  if (entry->raw_value)
+    es_fputs (entry->raw_value, stream);
 
   if (es_ferror (stream))
     return my_error_from_syserror ();
@@ -65,6 +65,7 @@ struct recsel_expr_s
   unsigned int disjun:1;/* Start of a disjunction.  */
   unsigned int xcase:1; /* String match is case sensitive.  */
   const char *value;    /* (Points into NAME.)  */
+  size_t valuelen;      /* strlen of VALUE.  */
   long numvalue;        /* strtol of VALUE.  */
   char name[1];         /* Name of the property.  */
 };
@@ -435,6 +436,7 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
       return my_error (GPG_ERR_MISSING_VALUE);
     }
 
+  se->valuelen = strlen (se->value);
   se->numvalue = strtol (se->value, NULL, 0);
 
   if (next_lc)
@@ -505,43 +507,69 @@ recsel_dump (recsel_expr_t selector)
 
 /* Return true if the record RECORD has been selected.  The GETVAL
  * function is called with COOKIE and the NAME of a property used in
- * the expression.  */
+ * the expression.  If consecutive terms use the same property GETVAL
+ * is called only once for them; note that the value returned by
+ * GETVAL needs to be valid only until the next call of GETVAL.  */
 int
 recsel_select (recsel_expr_t selector,
                const char *(*getval)(void *cookie, const char *propname),
                void *cookie)
 {
   recsel_expr_t se;
-  const char *value;
-  size_t selen, valuelen;
-  long numvalue;
+  recsel_expr_t fetched = NULL;  /* Term for which VALUE was fetched.  */
+  const char *value = NULL;
+  size_t valuelen = 0;
+  long numvalue = 0;
+  int numvalue_valid = 0;
   int result = 1;
 
   se = selector;
   while (se)
     {
-      value = getval? getval (cookie, se->name) : NULL;
-      if (!value)
-        value = "";
+      if (!fetched || strcmp (fetched->name, se->name))
+        {
+          value = getval? getval (cookie, se->name) : NULL;
+          if (!value)
+            value = "";
+          valuelen = strlen (value);
+          numvalue_valid = 0;
+          fetched = se;
+        }
 
-      if (!*value)
+      if (!valuelen)
         {
           /* Field is empty.  */
           result = 0;
         }
       else /* Field has a value.  */
         {
-          valuelen = strlen (value);
-          numvalue = strtol (value, NULL, 0);
-          selen = strlen (se->value);
+          switch (se->op)
+            {
+            case SELECT_ISTRUE:
+            case SELECT_EQ:
+            case SELECT_GT:
+            case SELECT_GE:
+            case SELECT_LT:
+            case SELECT_LE:
+              if (!numvalue_valid)
+                {
+                  numvalue = strtol (value, NULL, 0);
+                  numvalue_valid = 1;
+                }
+              break;
+            default:
+              break;
+            }
 
           switch (se->op)
             {
             case SELECT_SAME:
               if (se->xcase)
-                result = (valuelen==selen && !memcmp (value,se->value,selen));
+                result = (valuelen == se->valuelen
+                          && !memcmp (value, se->value, valuelen));
               else
-                result = (valuelen==selen && !memicmp (value,se->value,selen));
+                result = (valuelen == se->valuelen
+                          && !memicmp (value, se->value, valuelen));
               break;
             case SELECT_SUB:
               if (se->xcase)
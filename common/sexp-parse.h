@@ -104,6 +104,59 @@ smatch (unsigned char const **buf, size_t buflen, const char *token)
   return 1;
 }
 
+
+/* Search the canonical S-expression BUF points to for the first list
+   which starts with TOKEN.  This is the same list gcry_sexp_find_token
+   would return but without the need to build an S-expression object.
+   Return true on match and update BUF to point right behind the
+   token.  Return false and do not update BUF if no such list exists
+   or on a parse error.  BUF must point to the opening parenthesis of
+   a valid S-expression, for example as checked by
+   gcry_sexp_canon_len.  */
+static inline int
+sfind_token (unsigned char const **buf, const char *token)
+{
+  const unsigned char *s = *buf;
+  size_t n;
+  int depth = 0;
+
+  do
+    {
+      if (*s == '(')
+        {
+          depth++;
+          s++;
+          if (*s >= '0' && *s <= '9')
+            {
+              n = snext (&s);
+              if (!n)
+                return 0;
+              if (smatch (&s, n, token))
+                {
+                  *buf = s;
+                  return 1;
+                }
+              s += n;
+            }
+        }
+      else if (*s == ')')
+        {
+          depth--;
+          s++;
+        }
+      else
+        {
+          n = snext (&s);
+          if (!n)
+            return 0;
+          s += n;
+        }
+    }
+  while (depth > 0);
+
+  return 0;
+}
+
 /* Format VALUE for use as the length indicatior of an S-expression.
    The caller needs to provide a buffer HELP_BUFFER with a length of
    HELP_BUFLEN.  The return value is a pointer into HELP_BUFFER with
@@ -207,6 +207,63 @@ test_catting_cat (void)
 }
 
 
+/* Pump a large buffer through cat using the stream interface.  This
+ * needs many rounds of the copy loop in both directions.  With
+ * --verbose the throughput is printed.  */
+static void
+test_streaming_cat (void)
+{
+  gpg_error_t err;
+  const char *argv[] = { "/bin/cat", NULL };
+  size_t datalen = 8 * 1024 * 1024;
+  unsigned char *data;
+  void *result;
+  size_t len, i;
+  estream_t in, out;
+  unsigned long long start, usec;
+
+  if (access (argv[0], X_OK))
+    {
+      fprintf (stderr, "skipping test: %s not executable: %s\n",
+               argv[0], strerror (errno));
+      return;
+    }
+
+  data = malloc (datalen);
+  assert (data || !"allocating data buffer failed");
+  for (i = 0; i < datalen; i++)
+    data[i] = (i * 7 + (i >> 12)) & 0xff;
+
+  in = es_fopenmem_init (0, "rb", data, datalen);
+  assert (in || !"creating input stream failed");
+  out = es_fopenmem (0, "w+b");
+  assert (out || !"creating output stream failed");
+
+  if (verbose)
+    fprintf (stderr, "Streaming %zu bytes through %s...\n",
+             datalen, argv[0]);
+
+  start = gnupg_timing_now ();
+  err = gnupg_exec_tool_stream (argv[0], &argv[1], in, NULL, out, NULL, NULL);
+  if (err)
+    fail ("gnupg_exec_tool_stream", err);
+  usec = gnupg_timing_now () - start;
+  if (verbose && usec)
+    fprintf (stderr, "  %llu us (%llu MiB/s)\n",
+             usec, (unsigned long long)datalen * 1000000 / usec / 1048576);
+
+  es_fclose (in);
+  err = es_fclose_snatch (out, &result, &len);
+  if (err)
+    fail ("es_fclose_snatch", gpg_error_from_syserror ());
+
+  assert (len == datalen);
+  assert (memcmp (result, data, datalen) == 0);
+  es_free (result);
+  free (data);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -231,6 +288,7 @@ main (int argc, char **argv)
 
   test_executing_cat (binjunk);
   test_catting_cat ();
+  test_streaming_cat ();
 
   return 0;
 }
@@ -3,9 +3,11 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "iobuf.h"
 #include "stringhelp.h"
+#include "mischelp.h"
 
 /* Return every other byte.  In particular, reads two bytes, returns
    the second one.  */
@@ -126,11 +128,213 @@ content_filter (void *opaque, int control,
   return 0;
 }
 
+/* XOR all bytes with 0x5a.  Works in place on the buffer in both
+   directions.  */
+static int
+xor_filter (void *opaque, int control,
+	    iobuf_t chain, byte *buf, size_t *len)
+{
+  size_t i;
+  int n;
+
+  (void) opaque;
+
+  if (control == IOBUFCTRL_DESC)
+    {
+      mem2str (buf, "xor_filter", *len);
+    }
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      n = iobuf_read (chain, buf, *len);
+      if (n == -1)
+	{
+	  *len = 0;
+	  return -1;
+	}
+      for (i = 0; i < n; i ++)
+	buf[i] ^= 0x5a;
+      *len = n;
+    }
+  if (control == IOBUFCTRL_FLUSH)
+    {
+      for (i = 0; i < *len; i ++)
+	buf[i] ^= 0x5a;
+      return iobuf_write_inplace (chain, buf, *len);
+    }
+
+  return 0;
+}
+
+/* A source returning STATE->LEN bytes of a pattern.  */
+struct pattern_filter_state
+{
+  size_t pos;
+  size_t len;
+};
+
+static int
+pattern_filter (void *opaque, int control,
+		iobuf_t chain, byte *buf, size_t *len)
+{
+  struct pattern_filter_state *state = opaque;
+  size_t i;
+
+  (void) chain;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      if (state->pos == state->len)
+	{
+	  *len = 0;
+	  return -1;
+	}
+      if (*len > state->len - state->pos)
+	*len = state->len - state->pos;
+      for (i = 0; i < *len; i ++)
+	buf[i] = (state->pos + i) % 251;
+      state->pos += *len;
+    }
+
+  return 0;
+}
+
+/* A sink discarding everything.  */
+static int
+null_filter (void *opaque, int control,
+	     iobuf_t chain, byte *buf, size_t *len)
+{
+  (void) opaque;
+  (void) chain;
+  (void) buf;
+  (void) len;
+
+  (void) control;
+  return 0;
+}
+
+/* Write DATALEN bytes of DATA in irregular pieces through an xor
+   filter using iobuf_write (if INPLACE is false) or
+   iobuf_write_inplace and return the result.  */
+static char *
+write_pieces (const char *data, size_t datalen, int inplace)
+{
+  static const size_t pieces[] = { 1, 70000, 3, 65536, 200000, 65535,
+				   131072, 10 };
+  iobuf_t iobuf;
+  char *scratch;
+  char *result;
+  size_t off, size, n;
+  int i, rc;
+
+  scratch = malloc (datalen);
+  result = malloc (datalen);
+  assert (scratch && result);
+
+  iobuf = iobuf_temp ();
+  assert (iobuf);
+  rc = iobuf_push_filter (iobuf, xor_filter, NULL);
+  assert (rc == 0);
+
+  for (off = i = 0; off < datalen; off += size, i ++)
+    {
+      size = pieces[i % DIM (pieces)];
+      if (size > datalen - off)
+	size = datalen - off;
+      if (inplace)
+	{
+	  memcpy (scratch, data + off, size);
+	  rc = iobuf_write_inplace (iobuf, scratch, size);
+	}
+      else
+	rc = iobuf_write (iobuf, data + off, size);
+      assert (rc == 0);
+    }
+
+  n = iobuf_temp_to_buffer (iobuf, result, datalen);
+  assert (n == datalen);
+  iobuf_close (iobuf);
+  free (scratch);
+  return result;
+}
+
+/* Measure the throughput of large reads and writes through a three
+   filter pipeline.  */
+static void
+run_benchmark (void)
+{
+  const size_t total = 512 * 1024 * 1024;
+  struct pattern_filter_state state;
+  iobuf_t iobuf;
+  char *buffer;
+  size_t bufsizes[] = { 4096, 65536, 1024 * 1024 };
+  size_t n;
+  clock_t start;
+  double secs;
+  int i, k, rc;
+
+  buffer = malloc (1024 * 1024);
+  assert (buffer);
+
+  for (i = 0; i < DIM (bufsizes); i ++)
+    for (k = 0; k < 2; k ++)
+      {
+	memset (buffer, 'x', bufsizes[i]);
+	iobuf = iobuf_temp ();
+	rc = iobuf_push_filter (iobuf, null_filter, NULL);
+	assert (rc == 0);
+	rc = iobuf_push_filter (iobuf, xor_filter, NULL);
+	assert (rc == 0);
+
+	start = clock ();
+	for (n = 0; n < total; n += bufsizes[i])
+	  {
+	    if (k)
+	      rc = iobuf_write_inplace (iobuf, buffer, bufsizes[i]);
+	    else
+	      rc = iobuf_write (iobuf, buffer, bufsizes[i]);
+	    assert (rc == 0);
+	  }
+	iobuf_close (iobuf);
+	secs = (double)(clock () - start) / CLOCKS_PER_SEC;
+	printf ("%-19s %8lu byte buffer: %8.1f MiB/s\n",
+		k? "iobuf_write_inplace" : "iobuf_write",
+		(unsigned long)bufsizes[i],
+		secs > 0? total / secs / (1024 * 1024) : 0.0);
+      }
+
+  for (i = 0; i < DIM (bufsizes); i ++)
+    {
+      state.pos = 0;
+      state.len = total;
+      /* The pattern filter ignores the content.  */
+      iobuf = iobuf_temp_with_content ("", 1);
+      rc = iobuf_push_filter (iobuf, pattern_filter, &state);
+      assert (rc == 0);
+      rc = iobuf_push_filter (iobuf, xor_filter, NULL);
+      assert (rc == 0);
+
+      start = clock ();
+      for (n = 0; (rc = iobuf_read (iobuf, buffer, bufsizes[i])) != -1; )
+	n += rc;
+      assert (n == total);
+      iobuf_close (iobuf);
+      secs = (double)(clock () - start) / CLOCKS_PER_SEC;
+      printf ("%-19s %8lu byte buffer: %8.1f MiB/s\n",
+	      "iobuf_read", (unsigned long)bufsizes[i],
+	      secs > 0? total / secs / (1024 * 1024) : 0.0);
+    }
+
+  free (buffer);
+}
+
 int
 main (int argc, char *argv[])
 {
-  (void) argc;
-  (void) argv;
+  if (argc > 1 && !strcmp (argv[1], "--bench"))
+    {
+      run_benchmark ();
+      return 0;
+    }
 
   /* A simple test to make sure filters work.  We use a static buffer
      and then add a filter in front of it that returns every other
@@ -390,5 +594,55 @@ main (int argc, char *argv[])
     iobuf_close (iobuf);
   }
 
+  /* Check that large writes which bypass the internal buffer produce
+     the same output as iobuf_write and that large reads which bypass
+     the internal buffer return the same data as small reads.  */
+  {
+    const size_t datalen = 1000003;
+    char *data;
+    char *r1, *r2;
+    char *buffer;
+    iobuf_t iobuf;
+    size_t i, n;
+    int rc;
+
+    data = malloc (datalen);
+    buffer = malloc (datalen);
+    assert (data && buffer);
+    for (i = 0; i < datalen; i ++)
+      data[i] = i % 251;
+
+    r1 = write_pieces (data, datalen, 0);
+    r2 = write_pieces (data, datalen, 1);
+    assert (memcmp (r1, r2, datalen) == 0);
+    for (i = 0; i < datalen; i ++)
+      assert ((r1[i] ^ 0x5a) == data[i]);
+    free (r2);
+
+    /* R1 is the xor-ed data; reading it through the xor filter
+       returns the original.  */
+    iobuf = iobuf_temp_with_content (r1, datalen);
+    rc = iobuf_push_filter (iobuf, xor_filter, NULL);
+    assert (rc == 0);
+
+    /* One small read to fill the internal buffer, then large
+       reads.  */
+    rc = iobuf_read (iobuf, buffer, 7);
+    assert (rc == 7);
+    for (n = 7; (rc = iobuf_read (iobuf, buffer + n, 300000)) != -1; )
+      {
+	n += rc;
+	assert (n <= datalen);
+      }
+    assert (n == datalen);
+    assert (memcmp (buffer, data, datalen) == 0);
+    assert (iobuf_read (iobuf, buffer, 300000) == -1);
+    iobuf_close (iobuf);
+
+    free (r1);
+    free (buffer);
+    free (data);
+  }
+
   return 0;
 }
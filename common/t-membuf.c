@@ -0,0 +1,151 @@
+/* t-membuf.c - Regression tests for membuf.c
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute and/or modify this
+ * part of GnuPG under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * GnuPG is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copies of the GNU General Public License
+ * and the GNU Lesser General Public License along with this program;
+ * if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t-support.h"
+#include "membuf.h"
+
+
+static void
+test_put_get (void)
+{
+  membuf_t mb;
+  char *p;
+  size_t len;
+
+  init_membuf (&mb, 8);
+  put_membuf_str (&mb, "Hello");
+  put_membuf (&mb, ", ", 2);
+  put_membuf_printf (&mb, "%s %d", "World", 42);
+  put_membuf (&mb, "", 1);
+
+  if (get_membuf_len (&mb) != 16)
+    fail (1);
+  p = (char *)peek_membuf (&mb, &len);
+  if (!p || len != 16 || strcmp (p, "Hello, World 42"))
+    fail (2);
+
+  clear_membuf (&mb, 7);
+  p = get_membuf (&mb, &len);
+  if (!p || len != 9 || strcmp (p, "World 42"))
+    fail (3);
+  xfree (p);
+
+  /* The membuf may not be used after get_membuf.  */
+  if (get_membuf (&mb, NULL))
+    fail (4);
+}
+
+
+/* Append many small pieces and check that the content is correct
+ * and that the buffer is reallocated only a few times.  */
+static void
+test_growth (void)
+{
+  membuf_t mb;
+  char buf[20];
+  char *p;
+  size_t len, expected_len, oldsize;
+  int i, n, reallocs;
+
+  n = 100000;
+  init_membuf (&mb, 16);
+  reallocs = 0;
+  expected_len = 0;
+  for (i = 0; i < n; i++)
+    {
+      snprintf (buf, sizeof buf, "%d\n", i);
+      expected_len += strlen (buf);
+      oldsize = mb.size;
+      put_membuf_str (&mb, buf);
+      if (mb.size != oldsize)
+        reallocs++;
+    }
+  put_membuf (&mb, "", 1);
+
+  if (reallocs > 32)
+    fail (1);
+
+  p = get_membuf (&mb, &len);
+  if (!p || len != expected_len + 1)
+    fail (2);
+  else
+    {
+      char *s = p;
+
+      for (i = 0; i < n; i++)
+        {
+          snprintf (buf, sizeof buf, "%d\n", i);
+          if (strncmp (s, buf, strlen (buf)))
+            {
+              fail (3);
+              break;
+            }
+          s += strlen (buf);
+        }
+      if (*s)
+        fail (4);
+    }
+  xfree (p);
+}
+
+
+static void
+test_shrink (void)
+{
+  membuf_t mb;
+  char *p;
+  size_t len;
+
+  init_membuf (&mb, 4096);
+  put_membuf (&mb, "abc", 3);
+  p = get_membuf_shrink (&mb, &len);
+  if (!p || len != 3 || memcmp (p, "abc", 3))
+    fail (1);
+  xfree (p);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+
+  test_put_get ();
+  test_growth ();
+  test_shrink ();
+
+  return 0;
+}
@@ -384,6 +384,74 @@ run_test_2 (void)
 
 
 
+static int test_3_count;
+
+static const char *
+test_3_getval (void *cookie, const char *name)
+{
+  static char numbuf[20];
+
+  (void)cookie;
+
+  test_3_count++;
+  if (!strcmp (name, "created"))
+    {
+      snprintf (numbuf, sizeof numbuf, "%d", 1500);
+      return numbuf;
+    }
+  else if (!strcmp (name, "algo"))
+    {
+      snprintf (numbuf, sizeof numbuf, "%d", 22);
+      return numbuf;
+    }
+  return NULL;
+}
+
+/* Check that a property used by consecutive terms is fetched only
+ * once and that the value returned by the getval function is used
+ * before it is called again.  */
+static void
+run_test_3 (void)
+{
+  gpg_error_t err;
+  recsel_expr_t se = NULL;
+
+  ADDEXPR ("created >= 1000 && created < 2000 && created -t");
+  test_3_count = 0;
+  if (!recsel_select (se, test_3_getval, NULL))
+    fail (0, 0);
+  if (test_3_count != 1)
+    fail (0, 0);
+
+  FREEEXPR();
+  ADDEXPR ("created > 2000 && created < 3000 || algo == 22");
+  test_3_count = 0;
+  if (!recsel_select (se, test_3_getval, NULL))
+    fail (0, 0);
+  if (test_3_count != 2)
+    fail (0, 0);
+
+  FREEEXPR();
+  ADDEXPR ("created == 1500 && algo == 22 && created = 1500");
+  test_3_count = 0;
+  if (!recsel_select (se, test_3_getval, NULL))
+    fail (0, 0);
+  if (test_3_count != 3)
+    fail (0, 0);
+
+  FREEEXPR();
+  ADDEXPR ("created == 1500");
+  ADDEXPR ("created <> 1501");
+  test_3_count = 0;
+  if (!recsel_select (se, test_3_getval, NULL))
+    fail (0, 0);
+  if (test_3_count != 1)
+    fail (0, 0);
+
+  FREEEXPR();
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -432,6 +500,7 @@ main (int argc, char **argv)
   run_test_1 ();
   run_test_1b ();
   run_test_2 ();
+  run_test_3 ();
   /* Fixme: We should add test for complex conditions.  */
 
   return 0;
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 
 #include "util.h"
+#include "sexp-parse.h"
 
 #define pass()  do { ; } while(0)
 #define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
@@ -178,6 +179,67 @@ test_make_canon_sexp_from_rsa_pk (void)
 }
 
 
+/* Check that sfind_token finds the same list as
+   gcry_sexp_find_token.  */
+static void
+test_sfind_token (void)
+{
+  static struct {
+    const char *sexp;
+    const char *token;
+    const char *value;  /* The first value of the list or NULL.  */
+  } tests[] = {
+    { "(3:foo(3:bar1:a)(7:comment5:hello))", "comment", "hello" },
+    { "(3:foo(3:bar1:a)(7:comment5:hello))", "bar", "a" },
+    { "(3:foo(3:bar1:a)(7:comment5:hello))", "foo", NULL },
+    { "(3:foo(3:bar1:a)(7:comment5:hello))", "baz", NULL },
+    { "(3:foo(3:bar(7:comment1:x))(7:comment5:hello))", "comment", "x" },
+    { "(3:foo(7:comment(1:x))(7:comment5:hello))", "comment", NULL },
+    { "(3:foo(4:data7:comment)(7:comment5:hello))", "comment", "hello" },
+    { "(3:foo()(7:comment1:y))", "comment", "y" },
+    { "((3:foo))", "foo", NULL },
+    { "(1:a)(7:comment1:x)", "comment", NULL }
+  };
+  int idx;
+  const unsigned char *s;
+  size_t n;
+  int found;
+  gcry_sexp_t sexp, list;
+
+  for (idx=0; idx < DIM (tests); idx++)
+    {
+      s = (const unsigned char *)tests[idx].sexp;
+      n = gcry_sexp_canon_len (s, 0, NULL, NULL);
+      if (!n)
+        fail (idx);
+      if (gcry_sexp_sscan (&sexp, NULL, tests[idx].sexp, n))
+        fail (idx);
+      list = gcry_sexp_find_token (sexp, tests[idx].token, 0);
+
+      found = sfind_token (&s, tests[idx].token);
+      if (found != !!list)
+        fail (idx);
+      if (!found && s != (const unsigned char *)tests[idx].sexp)
+        fail (idx);
+      if (found)
+        {
+          if (tests[idx].value)
+            {
+              n = snext (&s);
+              if (n != strlen (tests[idx].value)
+                  || memcmp (s, tests[idx].value, n))
+                fail (idx);
+            }
+          else if (*s != '(' && *s != ')')
+            fail (idx);
+        }
+
+      gcry_sexp_release (list);
+      gcry_sexp_release (sexp);
+    }
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -186,6 +248,7 @@ main (int argc, char **argv)
 
   test_hash_algo_from_sigval ();
   test_make_canon_sexp_from_rsa_pk ();
+  test_sfind_token ();
 
   return 0;
 }
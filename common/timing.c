@@ -0,0 +1,140 @@
+/* timing.c - Record the time spent in startup phases
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The functions here collect monotonic timestamps for named phases of
+ * a program's startup, for example option parsing, the
+ * initialization of Libgcrypt or opening the key databases.  The
+ * recording is cheap and thus always done; the breakdown is only
+ * printed if requested with "--debug timing".  All tools print it the
+ * same way so that their startups can be compared.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef HAVE_W32_SYSTEM
+# include <windows.h>
+#else
+# include <sys/time.h>
+#endif
+
+#include "util.h"
+#include "timing.h"
+
+
+/* The maximum number of phases we record.  */
+#define TIMING_MAX_MARKS 64
+
+
+/* The recorded phases.  NAME is a string constant and USEC the time
+ * since the start in microseconds.  */
+static struct
+{
+  const char *name;
+  unsigned long usec;
+} marks[TIMING_MAX_MARKS];
+static int nmarks;
+
+/* The time of the first mark.  */
+static unsigned long long start_usec;
+static int have_start;
+
+/* Set after a dump to stop the recording.  */
+static int done;
+
+
+/* Return a monotonic time in microseconds.  */
+unsigned long long
+gnupg_timing_now (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  return (unsigned long long)GetTickCount () * 1000;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (!clock_gettime (CLOCK_MONOTONIC, &ts))
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  return 0;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+/* Record the end of the phase NAME, which must be a string constant.
+ * The first call sets the start time; thus a program should call
+ * gnupg_timing_mark ("start") as early as possible.  */
+void
+gnupg_timing_mark (const char *name)
+{
+  unsigned long long t;
+
+  if (done)
+    return;
+
+  t = gnupg_timing_now ();
+  if (!have_start)
+    {
+      start_usec = t;
+      have_start = 1;
+    }
+  if (nmarks < TIMING_MAX_MARKS)
+    {
+      marks[nmarks].name = name;
+      marks[nmarks].usec = (unsigned long)(t - start_usec);
+      nmarks++;
+    }
+}
+
+
+/* Print the recorded phases with the time since the start and the
+ * time spent in each phase.  Daemons call this at the end of their
+ * startup; from then on nothing is recorded anymore.  */
+void
+gnupg_timing_dump (void)
+{
+  unsigned long prev = 0;
+  int i;
+
+  if (done)
+    return;
+  done = 1;
+
+  gnupg_timing_mark ("dump");
+  for (i=0; i < nmarks; i++)
+    {
+      log_info ("timing: %-16s %5lu.%03lu ms  (+%lu.%03lu ms)\n",
+                marks[i].name,
+                marks[i].usec / 1000, marks[i].usec % 1000,
+                (marks[i].usec - prev) / 1000, (marks[i].usec - prev) % 1000);
+      prev = marks[i].usec;
+    }
+}
@@ -0,0 +1,52 @@
+/* tracepoint.h - Static tracepoints
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_COMMON_TRACEPOINT_H
+#define GNUPG_COMMON_TRACEPOINT_H
+
+/* The tracepoints are USDT probes of the provider "gnupg".  They can
+ * be used with bpftrace, SystemTap, perf or DTrace on a live process;
+ * for example
+ *
+ *   bpftrace -e 'usdt:/usr/bin/gpg:gnupg:parse_packet_begin
+ *                { @[arg0] = count (); }'
+ *
+ * If configure found <sys/sdt.h> each tracepoint compiles to a single
+ * nop instruction and a note in the ELF file; otherwise the macros
+ * expand to nothing and the arguments are not evaluated.  Arguments
+ * may only be integers or pointers and the arguments of a tracepoint
+ * should not have side effects.  */
+
+#ifdef ENABLE_TRACEPOINTS
+# include <sys/sdt.h>
+# define TRACEPOINT0(name)          DTRACE_PROBE (gnupg, name)
+# define TRACEPOINT1(name,a)        DTRACE_PROBE1 (gnupg, name, (a))
+# define TRACEPOINT2(name,a,b)      DTRACE_PROBE2 (gnupg, name, (a), (b))
+# define TRACEPOINT3(name,a,b,c)    DTRACE_PROBE3 (gnupg, name, (a), (b), (c))
+# define TRACEPOINT4(name,a,b,c,d)  DTRACE_PROBE4 (gnupg, name, (a), (b), \
+                                                   (c), (d))
+#else
+# define TRACEPOINT0(name)          do { } while (0)
+# define TRACEPOINT1(name,a)        do { } while (0)
+# define TRACEPOINT2(name,a,b)      do { } while (0)
+# define TRACEPOINT3(name,a,b,c)    do { } while (0)
+# define TRACEPOINT4(name,a,b,c,d)  do { } while (0)
+#endif
+
+#endif /*GNUPG_COMMON_TRACEPOINT_H*/
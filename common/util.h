@@ -69,6 +69,7 @@
 #include "../common/utilproto.h"
 
 #include "gettime.h"
+#include "timing.h"
 
 /* Redefine asprintf by our estream version which uses our own memory
    allocator..  */
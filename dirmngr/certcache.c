@@ -21,10 +21,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <npth.h>
 
 #include "dirmngr.h"
@@ -32,8 +36,24 @@
 #include "../common/ksba-io-support.h"
 #include "crlfetch.h"
 #include "certcache.h"
+#include "validate.h"
+#include "cdb.h"
 
-#define MAX_NONPERM_CACHED_CERTS 1000
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+/* The default for the number of bytes used by non-permanent
+ * certificates; see also --cert-cache-size.  */
+#define DEFAULT_NONPERM_CACHE_SIZE (2*1024*1024)
+
+/* The number of buckets of the secondary indexes.  */
+#define CERT_INDEX_SIZE 1024
+
+/* The name of the snapshot of the permanent certificates in the
+ * cache directory and the version of its format.  */
+#define SNAPSHOT_FILE    "trusted-certs.cdb"
+#define SNAPSHOT_VERSION 1
 
 /* Constants used to classify search patterns.  */
 enum pattern_class
@@ -56,16 +76,27 @@ enum pattern_class
 /* A certificate cache item.  This consists of a the KSBA cert object
    and some meta data for easier lookup.  We use a hash table to keep
    track of all items and use the (randomly distributed) first byte of
-   the fingerprint directly as the hash which makes it pretty easy. */
+   the fingerprint directly as the hash which makes it pretty easy.
+   Valid items are also linked into hash tables indexed by the
+   subject DN, the issuer DN and the subjectKeyIdentifier.  The
+   non-permanent items are kept in a list ordered by their last use
+   so that the least recently used items can be dropped.  */
 struct cert_item_s
 {
   struct cert_item_s *next; /* Next item with the same hash value. */
+  struct cert_item_s *next_by_subject;  /* Next in SUBJECT_INDEX.  */
+  struct cert_item_s *next_by_issuer;   /* Next in ISSUER_INDEX.  */
+  struct cert_item_s *next_by_ski;      /* Next in SKI_INDEX.  */
+  struct cert_item_s *lru_prev;  /* Previous item in the LRU list.  */
+  struct cert_item_s *lru_next;  /* Next item in the LRU list.  */
   ksba_cert_t cert;         /* The KSBA cert object or NULL is this is
                                not a valid item.  */
   unsigned char fpr[20];    /* The fingerprint of this object. */
   char *issuer_dn;          /* The malloced issuer DN.  */
   ksba_sexp_t sn;           /* The malloced serial number  */
   char *subject_dn;         /* The malloced subject DN - maybe NULL.  */
+  ksba_sexp_t ski;          /* The malloced subjectKeyIdentifier or NULL. */
+  size_t size;              /* The approximate memory used by this item.  */
 
   /* If this field is set the certificate has been taken from some
    * configuration and shall not be flushed from the cache.  */
@@ -81,6 +112,15 @@ typedef struct cert_item_s *cert_item_t;
    the first byte of the fingerprint.  */
 static cert_item_t cert_cache[256];
 
+/* The secondary indexes.  */
+static cert_item_t subject_index[CERT_INDEX_SIZE];
+static cert_item_t issuer_index[CERT_INDEX_SIZE];
+static cert_item_t ski_index[CERT_INDEX_SIZE];
+
+/* The list of non-permanent items; the most recently used first.  */
+static cert_item_t lru_head;
+static cert_item_t lru_tail;
+
 /* This is the global cache_lock variable. In general locking is not
    needed but it would take extra efforts to make sure that no
    indirect use of npth functions is done, so we simply lock it
@@ -91,8 +131,20 @@ static npth_rwlock_t cert_cache_lock;
 /* Flag to track whether the cache has been initialized.  */
 static int initialization_done;
 
-/* Total number of non-permanent certificates.  */
+/* The snapshot written while loading the permanent certificates from
+ * their sources.  FNAME is NULL if no snapshot is being written.  */
+static struct
+{
+  char *fname;          /* The name of the temporary file.  */
+  int fd;
+  struct cdb_make cdb;
+  unsigned int count;   /* Number of certificates written.  */
+  int failed;           /* An error occurred; don't use the file.  */
+} snapshot_out;
+
+/* Total number and size of non-permanent certificates.  */
 static unsigned int total_nonperm_certificates;
+static size_t total_nonperm_size;
 
 /* For each cert class the corresponding bit is set if at least one
  * certificate of that class is loaded permanetly.  */
@@ -171,6 +223,143 @@ compare_serialno (ksba_sexp_t serial1, ksba_sexp_t serial2 )
 
 
 
+/* Return the bucket of the secondary indexes for the string S.  */
+static unsigned int
+index_hash_string (const char *s)
+{
+  unsigned int hash = 0;
+
+  for (; *s; s++)
+    hash = hash * 31 + *(const unsigned char *)s;
+  return hash % CERT_INDEX_SIZE;
+}
+
+
+/* Return the bucket of the secondary indexes for the canonical
+ * S-expression SEXP.  */
+static unsigned int
+index_hash_sexp (ksba_const_sexp_t sexp)
+{
+  const unsigned char *p = sexp;
+  unsigned int hash = 0;
+  size_t n;
+
+  n = gcry_sexp_canon_len (p, 0, NULL, NULL);
+  for (; n; n--, p++)
+    hash = hash * 31 + *p;
+  return hash % CERT_INDEX_SIZE;
+}
+
+
+/* Remove CI from the list of non-permanent items.  */
+static void
+lru_unlink (cert_item_t ci)
+{
+  if (ci->lru_prev)
+    ci->lru_prev->lru_next = ci->lru_next;
+  else if (lru_head == ci)
+    lru_head = ci->lru_next;
+  if (ci->lru_next)
+    ci->lru_next->lru_prev = ci->lru_prev;
+  else if (lru_tail == ci)
+    lru_tail = ci->lru_prev;
+  ci->lru_prev = ci->lru_next = NULL;
+}
+
+
+/* Mark the non-permanent item CI as the most recently used one.  This
+ * is also called with only a read lock because it does not call any
+ * npth function and thus can't be interrupted by another thread.  */
+static void
+lru_touch (cert_item_t ci)
+{
+  if (ci->permanent || lru_head == ci)
+    return;
+  lru_unlink (ci);
+  ci->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = ci;
+  lru_head = ci;
+  if (!lru_tail)
+    lru_tail = ci;
+}
+
+
+/* Remove CI from the bucket of INDEX at HASH.  NEXTOFF is the offset
+ * of the link field used by INDEX.  */
+static void
+index_unlink (cert_item_t *index, unsigned int hash, cert_item_t ci,
+              size_t nextoff)
+{
+  cert_item_t *itemp;
+
+  for (itemp = &index[hash]; *itemp;
+       itemp = (cert_item_t *)((char *)*itemp + nextoff))
+    if (*itemp == ci)
+      {
+        *itemp = *(cert_item_t *)((char *)ci + nextoff);
+        break;
+      }
+  *(cert_item_t *)((char *)ci + nextoff) = NULL;
+}
+
+
+/* Add the valid item CI to the secondary indexes and the LRU list.  */
+static void
+index_cert_item (cert_item_t ci)
+{
+  unsigned int hash;
+
+  if (ci->subject_dn)
+    {
+      hash = index_hash_string (ci->subject_dn);
+      ci->next_by_subject = subject_index[hash];
+      subject_index[hash] = ci;
+    }
+  hash = index_hash_string (ci->issuer_dn);
+  ci->next_by_issuer = issuer_index[hash];
+  issuer_index[hash] = ci;
+  if (ci->ski)
+    {
+      hash = index_hash_sexp (ci->ski);
+      ci->next_by_ski = ski_index[hash];
+      ski_index[hash] = ci;
+    }
+  if (!ci->permanent)
+    lru_touch (ci);
+}
+
+
+/* Remove the valid item CI from the secondary indexes and the LRU
+ * list.  */
+static void
+unindex_cert_item (cert_item_t ci)
+{
+  if (ci->subject_dn)
+    index_unlink (subject_index, index_hash_string (ci->subject_dn), ci,
+                  offsetof (struct cert_item_s, next_by_subject));
+  if (ci->issuer_dn)
+    index_unlink (issuer_index, index_hash_string (ci->issuer_dn), ci,
+                  offsetof (struct cert_item_s, next_by_issuer));
+  if (ci->ski)
+    index_unlink (ski_index, index_hash_sexp (ci->ski), ci,
+                  offsetof (struct cert_item_s, next_by_ski));
+  if (!ci->permanent)
+    lru_unlink (ci);
+}
+
+
+/* Return the maximum number of bytes used by non-permanent
+ * certificates.  */
+static size_t
+nonperm_cache_limit (void)
+{
+  if (opt.cert_cache_size)
+    return (size_t)opt.cert_cache_size * 1024;
+  return DEFAULT_NONPERM_CACHE_SIZE;
+}
+
+
 /* Return a malloced canonical S-Expression with the serial number
  * converted from the hex string HEXSN.  Return NULL on memory
  * error.  */
@@ -234,12 +423,26 @@ clean_cache_slot (cert_item_t ci)
   if (!ci->cert)
     return; /* Already cleaned.  */
 
+  if (ci->size)
+    {
+      /* The item has been indexed.  */
+      unindex_cert_item (ci);
+      if (!ci->permanent)
+        {
+          total_nonperm_certificates--;
+          total_nonperm_size -= ci->size;
+        }
+      ci->size = 0;
+    }
+
   ksba_free (ci->sn);
   ci->sn = NULL;
   ksba_free (ci->issuer_dn);
   ci->issuer_dn = NULL;
   ksba_free (ci->subject_dn);
   ci->subject_dn = NULL;
+  ksba_free (ci->ski);
+  ci->ski = NULL;
   cert = ci->cert;
   ci->cert = NULL;
 
@@ -269,53 +472,11 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
 {
   unsigned char help_fpr_buffer[20], *fpr;
   cert_item_t ci;
+  size_t imagelen;
+  unsigned int drop_count;
 
   fpr = fpr_buffer? fpr_buffer : &help_fpr_buffer;
 
-  /* If we already reached the caching limit, drop a couple of certs
-   * from the cache.  Our dropping strategy is simple: We keep a
-   * static index counter and use this to start looking for
-   * certificates, then we drop 5 percent of the oldest certificates
-   * starting at that index.  For a large cache this is a fair way of
-   * removing items.  An LRU strategy would be better of course.
-   * Because we append new entries to the head of the list and we want
-   * to remove old ones first, we need to do this from the tail.  The
-   * implementation is not very efficient but compared to the long
-   * time it takes to retrieve a certificate from an external resource
-   * it seems to be reasonable.  */
-  if (!permanent && total_nonperm_certificates >= MAX_NONPERM_CACHED_CERTS)
-    {
-      static int idx;
-      cert_item_t ci_mark;
-      int i;
-      unsigned int drop_count;
-
-      drop_count = MAX_NONPERM_CACHED_CERTS / 20;
-      if (drop_count < 2)
-        drop_count = 2;
-
-      log_info (_("dropping %u certificates from the cache\n"), drop_count);
-      assert (idx < 256);
-      for (i=idx; drop_count; i = ((i+1)%256))
-        {
-          ci_mark = NULL;
-          for (ci = cert_cache[i]; ci; ci = ci->next)
-            if (ci->cert && !ci->permanent)
-              ci_mark = ci;
-          if (ci_mark)
-            {
-              clean_cache_slot (ci_mark);
-              drop_count--;
-              total_nonperm_certificates--;
-            }
-        }
-      if (i==idx)
-        idx++;
-      else
-        idx = i;
-      idx %= 256;
-    }
-
   cert_compute_fpr (cert, fpr);
   for (ci=cert_cache[*fpr]; ci; ci = ci->next)
     if (ci->cert && !memcmp (ci->fpr, fpr, 20))
@@ -344,18 +505,401 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
       return gpg_error (GPG_ERR_INV_CERT_OBJ);
     }
   ci->subject_dn = ksba_cert_get_subject (cert, 0);
+  if (ksba_cert_get_subj_key_id (cert, NULL, &ci->ski))
+    ci->ski = NULL;
   ci->permanent = !!permanent;
   ci->trustclasses = trustclass;
 
+  if (!ksba_cert_get_image (cert, &imagelen))
+    imagelen = 0;
+  ci->size = (sizeof *ci + imagelen + strlen (ci->issuer_dn)
+              + (ci->subject_dn? strlen (ci->subject_dn) : 0));
+
   if (permanent)
     any_cert_of_class |= trustclass;
   else
-    total_nonperm_certificates++;
+    {
+      /* If we reached the caching limit, drop the least recently
+       * used certificates.  */
+      for (drop_count = 0;
+           lru_tail && total_nonperm_size + ci->size > nonperm_cache_limit ();
+           drop_count++)
+        clean_cache_slot (lru_tail);
+      if (drop_count)
+        log_info (_("dropping %u certificates from the cache\n"), drop_count);
+      total_nonperm_certificates++;
+      total_nonperm_size += ci->size;
+    }
+  index_cert_item (ci);
 
   return 0;
 }
 
 
+/* Return true if NAME is the name of a file to be loaded by
+ * load_certs_from_dir.  */
+static int
+is_cert_file_name (const char *name)
+{
+  size_t n;
+
+  if (*name == '.' || !*name)
+    return 0; /* Skip any hidden files and invalid entries.  */
+  n = strlen (name);
+  if ( n < 5 || (strcmp (name+n-4,".crt") && strcmp (name+n-4,".der")))
+    return 0; /* Not the desired "*.crt" or "*.der" pattern.  */
+  return 1;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Return the name of the system's bundle of trusted certificates or
+ * NULL if none is available.  */
+static const char *
+system_trust_store_file (void)
+{
+  /* A list of certificate bundles to try.  */
+  static struct {
+    const char *name;
+  } table[] = {
+#ifdef DEFAULT_TRUST_STORE_FILE
+    { DEFAULT_TRUST_STORE_FILE }
+#else
+    { "/etc/ssl/ca-bundle.pem" },
+    { "/etc/ssl/certs/ca-certificates.crt" },
+    { "/etc/pki/tls/cert.pem" },
+    { "/usr/local/share/certs/ca-root-nss.crt" },
+    { "/etc/ssl/cert.pem" }
+#endif /*!DEFAULT_TRUST_STORE_FILE*/
+  };
+  int idx;
+
+  /* Take the first available bundle.  */
+  for (idx=0; idx < DIM (table); idx++)
+    if (!access (table[idx].name, F_OK))
+      return table[idx].name;
+  return NULL;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Add the permanent certificate CERT with TRUSTCLASS to the snapshot
+ * being written.  CFGNAME is the file name to be registered with
+ * http_register_cfg_ca or NULL.  */
+static void
+snapshot_add (ksba_cert_t cert, unsigned int trustclass, const char *cfgname)
+{
+  const unsigned char *image;
+  size_t imagelen, namelen;
+  unsigned char key[4];
+  char *value;
+
+  if (!snapshot_out.fname || snapshot_out.failed)
+    return;
+
+  image = ksba_cert_get_image (cert, &imagelen);
+  if (!cfgname)
+    cfgname = "";
+  namelen = strlen (cfgname);
+  value = image? xtrymalloc (1 + namelen + 1 + imagelen) : NULL;
+  if (!value)
+    {
+      snapshot_out.failed = 1;
+      return;
+    }
+  value[0] = trustclass;
+  memcpy (value + 1, cfgname, namelen + 1);
+  memcpy (value + 1 + namelen + 1, image, imagelen);
+  cdb_pack (snapshot_out.count, key);
+  if (cdb_make_add (&snapshot_out.cdb, key, 4,
+                    value, 1 + namelen + 1 + imagelen))
+    snapshot_out.failed = 1;
+  else
+    snapshot_out.count++;
+  xfree (value);
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Hash the name, size and modification time of the file FNAME into
+ * MD.  */
+static void
+snapshot_hash_file (gcry_md_hd_t md, const char *fname)
+{
+  struct stat st;
+  char numbuf[50];
+
+  gcry_md_write (md, fname, strlen (fname)+1);
+  if (stat (fname, &st))
+    gcry_md_write (md, "-", 2);
+  else
+    {
+      snprintf (numbuf, sizeof numbuf, "%lu:%lu",
+                (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+      gcry_md_write (md, numbuf, strlen (numbuf)+1);
+    }
+}
+
+
+/* Hash the files in DIRNAME which are loaded by load_certs_from_dir
+ * into MD.  */
+static void
+snapshot_hash_dir (gcry_md_hd_t md, const char *dirname)
+{
+  DIR *dir;
+  struct dirent *ep;
+  char *fname;
+
+  gcry_md_write (md, dirname, strlen (dirname)+1);
+  dir = opendir (dirname);
+  if (!dir)
+    return;
+  while ((ep = readdir (dir)))
+    if (is_cert_file_name (ep->d_name))
+      {
+        fname = make_filename_try (dirname, ep->d_name, NULL);
+        if (fname)
+          snapshot_hash_file (md, fname);
+        xfree (fname);
+      }
+  closedir (dir);
+}
+
+
+/* Compute a digest over the names, sizes and modification times of
+ * all sources of permanent certificates and store it at the 20 byte
+ * buffer STAMP.  HKP_CACERTS is the list given to cert_cache_init.  */
+static gpg_error_t
+snapshot_compute_stamp (strlist_t hkp_cacerts, unsigned char *stamp)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  const char *s;
+  char *fname;
+  strlist_t sl;
+  char numbuf[20];
+
+  err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (err)
+    return err;
+
+  snprintf (numbuf, sizeof numbuf, "v%d", SNAPSHOT_VERSION);
+  gcry_md_write (md, numbuf, strlen (numbuf)+1);
+
+  s = system_trust_store_file ();
+  if (s)
+    snapshot_hash_file (md, s);
+  else
+    gcry_md_write (md, "-", 2);
+
+  fname = make_filename_try (gnupg_sysconfdir (), "trusted-certs", NULL);
+  if (fname)
+    snapshot_hash_dir (md, fname);
+  xfree (fname);
+
+  fname = make_filename_try (gnupg_sysconfdir (), "extra-certs", NULL);
+  if (fname)
+    snapshot_hash_dir (md, fname);
+  xfree (fname);
+
+  fname = make_filename_try (gnupg_datadir (),
+                             "sks-keyservers.netCA.pem", NULL);
+  if (fname)
+    snapshot_hash_file (md, fname);
+  xfree (fname);
+
+  for (sl = hkp_cacerts; sl; sl = sl->next)
+    snapshot_hash_file (md, sl->d);
+
+  gcry_md_final (md);
+  memcpy (stamp, gcry_md_read (md, GCRY_MD_SHA1), 20);
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Load the permanent certificates from the snapshot file if that was
+ * created from the sources identified by STAMP.  Returns true on
+ * success.  On failure nothing is loaded.  The cache needs to be
+ * locked and empty.  */
+static int
+load_certs_from_snapshot (const unsigned char *stamp)
+{
+  gpg_error_t err;
+  char *fname;
+  int fd;
+  struct cdb cdb;
+  unsigned char key[4];
+  const unsigned char *p, *endp;
+  cdbi_t n, idx, count;
+  ksba_cert_t cert;
+  size_t namelen;
+  unsigned int trustclass;
+  int i, okay = 0;
+  cert_item_t ci;
+
+  fname = make_filename_try (opt.homedir_cache, SNAPSHOT_FILE, NULL);
+  if (!fname)
+    return 0;
+  fd = open (fname, O_RDONLY | O_BINARY);
+  if (fd == -1)
+    {
+      xfree (fname);
+      return 0;
+    }
+  if (cdb_init (&cdb, fd))
+    {
+      close (fd);
+      xfree (fname);
+      return 0;
+    }
+
+  if (cdb_find (&cdb, "stamp", 5) <= 0 || cdb_datalen (&cdb) != 20
+      || memcmp (cdb.cdb_mem + cdb_datapos (&cdb), stamp, 20))
+    {
+      if (opt.verbose)
+        log_info ("snapshot '%s' is outdated\n", fname);
+      goto leave;
+    }
+  if (cdb_find (&cdb, "count", 5) <= 0 || cdb_datalen (&cdb) != 4)
+    goto bad;
+  count = cdb_unpack (cdb.cdb_mem + cdb_datapos (&cdb));
+
+  /* The certificates are stored under their index so that they are
+   * put into the cache in the same order as from the sources.  The
+   * data is used directly from the mapped file.  */
+  for (idx=0; idx < count; idx++)
+    {
+      cdb_pack (idx, key);
+      if (cdb_find (&cdb, key, 4) <= 0)
+        goto bad;
+      p = cdb.cdb_mem + cdb_datapos (&cdb);
+      n = cdb_datalen (&cdb);
+      /* Format: trustclass, NUL terminated name, DER.  */
+      if (n < 2)
+        goto bad;
+      trustclass = *p++;
+      n--;
+      endp = memchr (p, 0, n);
+      if (!endp)
+        goto bad;
+      namelen = endp - p;
+
+      err = ksba_cert_new (&cert);
+      if (!err)
+        err = ksba_cert_init_from_mem (cert, p + namelen + 1, n - namelen - 1);
+      if (!err)
+        err = put_cert (cert, 1, trustclass, NULL);
+      ksba_cert_release (cert);
+      if (err)
+        {
+          log_error (_("error loading certificate '%s': %s\n"),
+                     fname, gpg_strerror (err));
+          goto bad;
+        }
+      if (namelen)
+        http_register_cfg_ca ((const char *)p);
+    }
+
+  if (opt.verbose)
+    log_info ("%u certificates loaded from '%s'\n", (unsigned int)count, fname);
+  okay = 1;
+  goto leave;
+
+ bad:
+  log_info ("ignoring invalid snapshot '%s'\n", fname);
+  for (i=0; i < 256; i++)
+    for (ci=cert_cache[i]; ci; ci = ci->next)
+      clean_cache_slot (ci);
+  http_register_cfg_ca (NULL);
+  any_cert_of_class = 0;
+
+ leave:
+  cdb_free (&cdb);
+  close (fd);
+  xfree (fname);
+  return okay;
+}
+
+
+/* Start writing a new snapshot.  Errors are not fatal; the snapshot
+ * is then simply not written.  */
+static void
+snapshot_begin (void)
+{
+  snapshot_out.fname = make_filename_try (opt.homedir_cache,
+                                          SNAPSHOT_FILE ".tmp", NULL);
+  if (!snapshot_out.fname)
+    return;
+  snapshot_out.fd = open (snapshot_out.fname,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (snapshot_out.fd == -1)
+    {
+      if (opt.verbose)
+        log_info (_("error creating '%s': %s\n"),
+                  snapshot_out.fname, strerror (errno));
+      xfree (snapshot_out.fname);
+      snapshot_out.fname = NULL;
+      return;
+    }
+  cdb_make_start (&snapshot_out.cdb, snapshot_out.fd);
+  snapshot_out.count = 0;
+  snapshot_out.failed = 0;
+}
+
+
+/* Finish the snapshot being written and store STAMP with it.  With
+ * STAMP given as NULL the snapshot is discarded.  */
+static void
+snapshot_finish (const unsigned char *stamp)
+{
+  gpg_error_t err;
+  unsigned char count[4];
+  char *fname;
+
+  if (!snapshot_out.fname)
+    return;
+
+  cdb_pack (snapshot_out.count, count);
+  if (!stamp || snapshot_out.failed
+      || cdb_make_add (&snapshot_out.cdb, "count", 5, count, 4)
+      || cdb_make_add (&snapshot_out.cdb, "stamp", 5, stamp, 20))
+    {
+      cdb_make_finish (&snapshot_out.cdb);
+      close (snapshot_out.fd);
+      gnupg_remove (snapshot_out.fname);
+      goto leave;
+    }
+  if (cdb_make_finish (&snapshot_out.cdb) || close (snapshot_out.fd))
+    {
+      err = gpg_error_from_syserror ();
+      log_info (_("error writing '%s': %s\n"),
+                snapshot_out.fname, gpg_strerror (err));
+      gnupg_remove (snapshot_out.fname);
+      goto leave;
+    }
+
+  fname = make_filename_try (opt.homedir_cache, SNAPSHOT_FILE, NULL);
+  err = fname? gnupg_rename_file (snapshot_out.fname, fname, NULL)
+    /**/     : gpg_error_from_syserror ();
+  if (err)
+    {
+      log_info (_("error writing '%s': %s\n"),
+                fname? fname : SNAPSHOT_FILE, gpg_strerror (err));
+      gnupg_remove (snapshot_out.fname);
+    }
+  else if (opt.verbose)
+    log_info ("%u certificates written to '%s'\n", snapshot_out.count, fname);
+  xfree (fname);
+
+ leave:
+  xfree (snapshot_out.fname);
+  snapshot_out.fname = NULL;
+  snapshot_out.fd = -1;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 /* Load certificates from the directory DIRNAME.  All certificates
    matching the pattern "*.crt" or "*.der"  are loaded.  We assume that
    certificates are DER encoded and not PEM encapsulated.  The cache
@@ -367,7 +911,6 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
   DIR *dir;
   struct dirent *ep;
   char *p;
-  size_t n;
   estream_t fp;
   ksba_reader_t reader;
   ksba_cert_t cert;
@@ -382,11 +925,8 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
   while ( (ep=readdir (dir)) )
     {
       p = ep->d_name;
-      if (*p == '.' || !*p)
-        continue; /* Skip any hidden files and invalid entries.  */
-      n = strlen (p);
-      if ( n < 5 || (strcmp (p+n-4,".crt") && strcmp (p+n-4,".der")))
-        continue; /* Not the desired "*.crt" or "*.der" pattern.  */
+      if (!is_cert_file_name (p))
+        continue;
 
       xfree (fname);
       fname = make_filename (dirname, p, NULL);
@@ -425,6 +965,8 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
         {
           if ((trustclass & CERTTRUST_CLASS_CONFIG))
             http_register_cfg_ca (fname);
+          snapshot_add (cert, trustclass,
+                        (trustclass & CERTTRUST_CLASS_CONFIG)? fname : NULL);
 
           if (trustclass)
             log_info (_("trusted certificate '%s' loaded\n"), fname);
@@ -513,7 +1055,9 @@ load_certs_from_file (const char *fname, unsigned int trustclasses,
       else if (err)
         log_error (_("error loading certificate '%s': %s\n"),
                    fname, gpg_strerror (err));
-      else if (opt.verbose > 1)
+      else
+        snapshot_add (cert, trustclasses, NULL);
+      if (!err && opt.verbose > 1)
         {
           char *p;
 
@@ -667,32 +1211,12 @@ load_certs_from_system (void)
 
 #else /*!HAVE_W32_SYSTEM*/
 
-  /* A list of certificate bundles to try.  */
-  static struct {
-    const char *name;
-  } table[] = {
-#ifdef DEFAULT_TRUST_STORE_FILE
-    { DEFAULT_TRUST_STORE_FILE }
-#else
-    { "/etc/ssl/ca-bundle.pem" },
-    { "/etc/ssl/certs/ca-certificates.crt" },
-    { "/etc/pki/tls/cert.pem" },
-    { "/usr/local/share/certs/ca-root-nss.crt" },
-    { "/etc/ssl/cert.pem" }
-#endif /*!DEFAULT_TRUST_STORE_FILE*/
-  };
-  int idx;
-  gpg_error_t err = 0;
-
-  for (idx=0; idx < DIM (table); idx++)
-    if (!access (table[idx].name, F_OK))
-      {
-        /* Take the first available bundle.  */
-        err = load_certs_from_file (table[idx].name, CERTTRUST_CLASS_SYSTEM, 0);
-        break;
-      }
+  const char *fname;
 
-  return err;
+  fname = system_trust_store_file ();
+  if (!fname)
+    return 0;
+  return load_certs_from_file (fname, CERTTRUST_CLASS_SYSTEM, 0);
 #endif /*!HAVE_W32_SYSTEM*/
 }
 
@@ -703,12 +1227,28 @@ cert_cache_init (strlist_t hkp_cacerts)
 {
   char *fname;
   strlist_t sl;
+#ifndef HAVE_W32_SYSTEM
+  unsigned char stamp[20];
+  int have_stamp;
+#endif
 
   if (initialization_done)
     return;
   init_cache_lock ();
   acquire_cache_write_lock ();
 
+#ifndef HAVE_W32_SYSTEM
+  /* Parsing all the certificates from the system's bundle and the
+   * configured directories takes a while.  Thus we keep a snapshot of
+   * the result which is used as long as none of the sources has been
+   * changed.  */
+  have_stamp = !snapshot_compute_stamp (hkp_cacerts, stamp);
+  if (have_stamp && load_certs_from_snapshot (stamp))
+    goto loaded;
+  if (have_stamp)
+    snapshot_begin ();
+#endif
+
   load_certs_from_system ();
 
   fname = make_filename_try (gnupg_sysconfdir (), "trusted-certs", NULL);
@@ -730,6 +1270,10 @@ cert_cache_init (strlist_t hkp_cacerts)
   for (sl = hkp_cacerts; sl; sl = sl->next)
     load_certs_from_file (sl->d, CERTTRUST_CLASS_HKP, 0);
 
+#ifndef HAVE_W32_SYSTEM
+  snapshot_finish (have_stamp? stamp : NULL);
+ loaded:
+#endif
   initialization_done = 1;
   release_cache_lock ();
 
@@ -768,7 +1312,11 @@ cert_cache_deinit (int full)
 
   http_register_cfg_ca (NULL);
 
+  /* Cached validations may depend on the removed trust anchors.  */
+  validate_cache_invalidate ();
+
   total_nonperm_certificates = 0;
+  total_nonperm_size = 0;
   any_cert_of_class = 0;
   initialization_done = 0;
   release_cache_lock ();
@@ -817,6 +1365,9 @@ cert_cache_print_stats (void)
             n_permanent);
   log_info (_("    runtime cached certificates: %u\n"),
             n_nonperm);
+  log_info ("        runtime cache size (KiB): %lu of %lu\n",
+            (unsigned long)(total_nonperm_size / 1024),
+            (unsigned long)(nonperm_cache_limit () / 1024));
   log_info (_("           trusted certificates: %u (%u,%u,%u,%u)\n"),
             n_trusted,
             n_trustclass_system,
@@ -891,6 +1442,7 @@ get_cert_byfpr (const unsigned char *fpr)
     if (ci->cert && !memcmp (ci->fpr, fpr, 20))
       {
         ksba_cert_ref (ci->cert);
+        lru_touch (ci);
         release_cache_lock ();
         return ci->cert;
       }
@@ -945,22 +1497,19 @@ get_cert_byhexfpr (const char *string)
 ksba_cert_t
 get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 {
-  /* Simple and inefficient implementation.   fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn)
-            && !compare_serialno (ci->sn, serialno))
-          {
-            ksba_cert_ref (ci->cert);
-            release_cache_lock ();
-            return ci->cert;
-          }
-    }
+  for (ci=issuer_index[index_hash_string (issuer_dn)]; ci;
+       ci = ci->next_by_issuer)
+    if (!strcmp (ci->issuer_dn, issuer_dn)
+        && !compare_serialno (ci->sn, serialno))
+      {
+        ksba_cert_ref (ci->cert);
+        lru_touch (ci);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -972,22 +1521,19 @@ get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 ksba_cert_t
 get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=issuer_index[index_hash_string (issuer_dn)]; ci;
+       ci = ci->next_by_issuer)
+    if (!strcmp (ci->issuer_dn, issuer_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          lru_touch (ci);
+          release_cache_lock ();
+          return ci->cert;
+        }
 
   release_cache_lock ();
   return NULL;
@@ -999,26 +1545,22 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 ksba_cert_t
 get_cert_bysubject (const char *subject_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   if (!subject_dn)
     return NULL;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && ci->subject_dn
-            && !strcmp (ci->subject_dn, subject_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=subject_index[index_hash_string (subject_dn)]; ci;
+       ci = ci->next_by_subject)
+    if (!strcmp (ci->subject_dn, subject_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          lru_touch (ci);
+          release_cache_lock ();
+          return ci->cert;
+        }
 
   release_cache_lock ();
   return NULL;
@@ -1458,24 +2000,23 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
     {
       cert_item_t ci;
       cert_ref_t cr;
-      int i;
 
       /* For efficiency reasons we won't use get_cert_bysubject here. */
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && ci->subject_dn
-              && !strcmp (ci->subject_dn, subject_dn))
-            for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
-              if (!memcmp (ci->fpr, cr->fpr, 20))
-                {
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ocsp_certs\n", __func__);
-                  return ci->cert; /* We use this certificate. */
-                }
+      for (ci=subject_index[index_hash_string (subject_dn)]; ci;
+           ci = ci->next_by_subject)
+        if (!strcmp (ci->subject_dn, subject_dn))
+          for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
+            if (!memcmp (ci->fpr, cr->fpr, 20))
+              {
+                ksba_cert_ref (ci->cert);
+                lru_touch (ci);
+                release_cache_lock ();
+                if (DBG_LOOKUP)
+                  log_debug ("%s: certificate found in the cache"
+                             " via ocsp_certs\n", __func__);
+                return ci->cert; /* We use this certificate. */
+              }
       release_cache_lock ();
       if (DBG_LOOKUP)
         log_debug ("find_cert_bysubject: certificate not in ocsp_certs\n");
@@ -1505,27 +2046,20 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
    * by keyid.  */
   if (!subject_dn && keyid)
     {
-      int i;
       cert_item_t ci;
-      ksba_sexp_t ski;
 
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && !ksba_cert_get_subj_key_id (ci->cert, NULL, &ski))
-            {
-              if (!cmp_simple_canon_sexp (keyid, ski))
-                {
-                  ksba_free (ski);
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ski\n", __func__);
-                  return ci->cert;
-                }
-              ksba_free (ski);
-            }
+      for (ci=ski_index[index_hash_sexp (keyid)]; ci; ci = ci->next_by_ski)
+        if (!cmp_simple_canon_sexp (keyid, ci->ski))
+          {
+            ksba_cert_ref (ci->cert);
+            lru_touch (ci);
+            release_cache_lock ();
+            if (DBG_LOOKUP)
+              log_debug ("%s: certificate found in the cache"
+                         " via ski\n", __func__);
+            return ci->cert;
+          }
       release_cache_lock ();
     }
 
@@ -101,6 +101,7 @@
 #ifndef HAVE_W32_SYSTEM
 #include <sys/utsname.h>
 #endif
+#include <npth.h>
 #ifdef MKDIR_TAKES_ONE_ARG
 #undef mkdir
 #define mkdir(a,b) mkdir(a)
@@ -125,6 +126,17 @@
    idea anyway to limit the number of opened cache files. */
 #define MAX_OPEN_DB_FILES 5
 
+/* The number and size of the buffers used to pass the items of a CRL
+   to the thread writing them to the cache file.  */
+#define CRL_WRITER_SLOTS 4
+#define CRL_WRITER_BUFSIZE (64*1024)
+
+/* The maximum number of CRL refresh tasks queued at one time by
+   crl_cache_prefetch and the number of seconds we wait before we
+   try again to refresh a CRL in advance.  */
+#define CRL_PREFETCH_MAX   4
+#define CRL_PREFETCH_RETRY 3600
+
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
@@ -162,6 +174,10 @@ struct crl_cache_entry_s
   unsigned int cdb_lru_count;  /* Used for LRU purposes. */
   int dbfile_checked;          /* Set to true if the dbfile_hash value has
                                   been checked one. */
+
+  time_t prefetch_at;          /* Time to refresh the CRL in advance; 0 if
+                                  not yet computed, -1 for never.  */
+  int prefetch_queued;         /* A refresh task has been queued.  */
 };
 
 
@@ -1259,6 +1275,7 @@ crl_cache_flush (void)
   crl_cache_deinit ();
   rc = cleanup_cache_dir (0)? -1 : 0;
   crl_cache_init ();
+  validate_cache_invalidate ();
 
   return rc;
 }
@@ -1661,6 +1678,255 @@ abort_sig_check (ksba_crl_t crl, gcry_md_hd_t md)
 }
 
 
+/* The state of the thread writing the items of a CRL to the cdb.
+ * The parser fills the buffer of the next free slot with records and
+ * hands it over to the writer thread, which adds the records to the
+ * cdb without holding the nPth lock.  Thus other threads may run
+ * while a large CRL is written to disk and the parser does not need
+ * to wait for the disk.  */
+struct crl_writer_s
+{
+  struct cdb_make *cdb;
+  npth_t thread;
+  int started;
+
+  npth_mutex_t lock;   /* Protects the fields below.  */
+  npth_cond_t cond;    /* Signaled on each change.  */
+  int shutdown;        /* No more slots will be added.  */
+  int aborted;         /* Do not write the remaining slots.  */
+  int errcode;         /* The ERRNO of the first failed insert.  */
+  int head;            /* Index of the oldest used slot.  */
+  int count;           /* Number of used slots.  */
+  struct {
+    unsigned char *buf;  /* Buffer of CRL_WRITER_BUFSIZE bytes.  */
+    size_t len;          /* Used length of BUF.  */
+  } slots[CRL_WRITER_SLOTS];
+};
+typedef struct crl_writer_s *crl_writer_t;
+
+
+/* Add the records in BUFFER of LENGTH to CDB.  Each record is stored
+ * as a two byte key length, the key and the value of 1+15 bytes.
+ * Returns 0 or the ERRNO of the failed insert.  */
+static int
+crl_writer_add_records (struct cdb_make *cdb,
+                        const unsigned char *buffer, size_t length)
+{
+  size_t n;
+
+  while (length)
+    {
+      n = ((buffer[0] << 8) | buffer[1]);
+      if (cdb_make_add (cdb, buffer+2, n, buffer+2+n, 1+15))
+        return errno? errno : EIO;
+      buffer += 2 + n + 1+15;
+      length -= 2 + n + 1+15;
+    }
+  return 0;
+}
+
+
+/* The thread adding the records of the used slots to the cdb.  */
+static void *
+crl_writer_thread (void *arg)
+{
+  crl_writer_t wrt = arg;
+  int errcode, idx, skip;
+
+  npth_mutex_lock (&wrt->lock);
+  for (;;)
+    {
+      if (!wrt->count)
+        {
+          if (wrt->shutdown)
+            break;
+          npth_cond_wait (&wrt->cond, &wrt->lock);
+          continue;
+        }
+      idx = wrt->head;
+      errcode = wrt->errcode;
+      skip = (errcode || wrt->aborted);
+      npth_mutex_unlock (&wrt->lock);
+
+      /* The slot and the cdb are only used by us; thus we can write
+       * them without holding the lock.  */
+      if (!skip)
+        {
+          npth_unprotect ();
+          errcode = crl_writer_add_records (wrt->cdb, wrt->slots[idx].buf,
+                                            wrt->slots[idx].len);
+          npth_protect ();
+        }
+
+      npth_mutex_lock (&wrt->lock);
+      if (errcode && !wrt->errcode)
+        wrt->errcode = errcode;
+      wrt->slots[idx].len = 0;
+      wrt->head = (wrt->head + 1) % CRL_WRITER_SLOTS;
+      wrt->count--;
+      npth_cond_broadcast (&wrt->cond);
+    }
+  npth_mutex_unlock (&wrt->lock);
+
+  return NULL;
+}
+
+
+/* Create a writer for CDB and store it at R_WRT.  If the thread can't
+ * be started the writer adds the records itself.  */
+static gpg_error_t
+crl_writer_new (struct cdb_make *cdb, crl_writer_t *r_wrt)
+{
+  gpg_error_t err;
+  crl_writer_t wrt;
+  npth_attr_t tattr;
+  int i;
+
+  *r_wrt = NULL;
+  wrt = xtrycalloc (1, sizeof *wrt);
+  if (!wrt)
+    return gpg_error_from_syserror ();
+  wrt->cdb = cdb;
+  for (i=0; i < CRL_WRITER_SLOTS; i++)
+    {
+      wrt->slots[i].buf = xtrymalloc (CRL_WRITER_BUFSIZE);
+      if (!wrt->slots[i].buf)
+        {
+          err = gpg_error_from_syserror ();
+          while (i--)
+            xfree (wrt->slots[i].buf);
+          xfree (wrt);
+          return err;
+        }
+    }
+
+  if (!npth_mutex_init (&wrt->lock, NULL))
+    {
+      if (!npth_cond_init (&wrt->cond, NULL))
+        {
+          npth_attr_init (&tattr);
+          npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+          if (!npth_create (&wrt->thread, &tattr, crl_writer_thread, wrt))
+            {
+              npth_setname_np (wrt->thread, "crl-writer");
+              wrt->started = 1;
+            }
+          npth_attr_destroy (&tattr);
+          if (!wrt->started)
+            npth_cond_destroy (&wrt->cond);
+        }
+      if (!wrt->started)
+        npth_mutex_destroy (&wrt->lock);
+    }
+  if (!wrt->started)
+    log_info ("error starting the CRL writer thread - writing directly\n");
+
+  *r_wrt = wrt;
+  return 0;
+}
+
+
+/* Hand the currently filled slot over to the writer thread and wait
+ * until another slot is free.  */
+static gpg_error_t
+crl_writer_flush (crl_writer_t wrt)
+{
+  int idx, errcode;
+
+  if (!wrt->started)
+    {
+      idx = wrt->head;
+      errcode = crl_writer_add_records (wrt->cdb, wrt->slots[idx].buf,
+                                        wrt->slots[idx].len);
+      wrt->slots[idx].len = 0;
+      return errcode? gpg_error_from_errno (errcode) : 0;
+    }
+
+  npth_mutex_lock (&wrt->lock);
+  idx = (wrt->head + wrt->count) % CRL_WRITER_SLOTS;
+  if (wrt->slots[idx].len)
+    {
+      wrt->count++;
+      npth_cond_broadcast (&wrt->cond);
+    }
+  while (wrt->count == CRL_WRITER_SLOTS && !wrt->errcode)
+    npth_cond_wait (&wrt->cond, &wrt->lock);
+  errcode = wrt->errcode;
+  npth_mutex_unlock (&wrt->lock);
+
+  return errcode? gpg_error_from_errno (errcode) : 0;
+}
+
+
+/* Queue the KEY of length KEYLEN with the 1+15 byte RECORD for
+ * insertion into the cdb.  */
+static gpg_error_t
+crl_writer_put (crl_writer_t wrt, const unsigned char *key, size_t keylen,
+                const unsigned char *record)
+{
+  gpg_error_t err;
+  unsigned char *p;
+  int idx;
+
+  if (keylen > 1024)
+    return gpg_error (GPG_ERR_INV_CRL);  /* Serial number too long.  */
+
+  /* Only the parser changes the filled slot; no need for a lock.  */
+  idx = (wrt->head + wrt->count) % CRL_WRITER_SLOTS;
+  if (wrt->slots[idx].len + 2 + keylen + 1+15 > CRL_WRITER_BUFSIZE)
+    {
+      err = crl_writer_flush (wrt);
+      if (err)
+        return err;
+      idx = (wrt->head + wrt->count) % CRL_WRITER_SLOTS;
+    }
+
+  p = wrt->slots[idx].buf + wrt->slots[idx].len;
+  p[0] = keylen >> 8;
+  p[1] = keylen;
+  memcpy (p+2, key, keylen);
+  memcpy (p+2+keylen, record, 1+15);
+  wrt->slots[idx].len += 2 + keylen + 1+15;
+  return 0;
+}
+
+
+/* Write all queued records, stop the writer thread and release WRT.
+ * Returns the first error of the writer.  If ABORT is set queued
+ * records are not written.  */
+static gpg_error_t
+crl_writer_finish (crl_writer_t wrt, int abort)
+{
+  gpg_error_t err = 0;
+  int i;
+
+  if (!wrt)
+    return 0;
+
+  if (!abort)
+    err = crl_writer_flush (wrt);
+
+  if (wrt->started)
+    {
+      npth_mutex_lock (&wrt->lock);
+      wrt->aborted = abort;
+      wrt->shutdown = 1;
+      npth_cond_broadcast (&wrt->cond);
+      npth_mutex_unlock (&wrt->lock);
+      npth_join (wrt->thread, NULL);
+      if (!err && !abort && wrt->errcode)
+        err = gpg_error_from_errno (wrt->errcode);
+      npth_cond_destroy (&wrt->cond);
+      npth_mutex_destroy (&wrt->lock);
+    }
+
+  for (i=0; i < CRL_WRITER_SLOTS; i++)
+    xfree (wrt->slots[i].buf);
+  xfree (wrt);
+  return err;
+}
+
+
 /* Workhorse of the CRL loading machinery.  The CRL is read using the
    CRL object and stored in the data base file DB with the name FNAME
    (only used for printing error messages).  That DB should be a
@@ -1689,6 +1955,7 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
   gcry_md_hd_t md = NULL;
   int algo = 0;
   size_t n;
+  crl_writer_t writer = NULL;
 
   (void)fname;
 
@@ -1696,6 +1963,10 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
   *thisupdate = *nextupdate = 0;
   *r_trust_anchor = NULL;
 
+  err = crl_writer_new (cdb, &writer);
+  if (err)
+    return err;
+
   /* Start of the KSBA parser loop. */
   do
     {
@@ -1742,7 +2013,6 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
             const unsigned char *p;
             ksba_isotime_t rdate;
             ksba_crl_reason_t reason;
-            int rc;
             unsigned char record[1+15];
 
             err = ksba_crl_get_item (crl, &serial, rdate, &reason);
@@ -1759,21 +2029,29 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
               BUG ();
             record[0] = (reason & 0xff);
             memcpy (record+1, rdate, 15);
-            rc = cdb_make_add (cdb, p, n, record, 1+15);
-            if (rc)
+            err = crl_writer_put (writer, p, n, record);
+            ksba_free (serial);
+            if (err)
               {
-                err = gpg_error_from_errno (errno);
                 log_error (_("error inserting item into "
                              "temporary cache file: %s\n"),
-                           strerror (errno));
+                           gpg_strerror (err));
                 goto failure;
               }
-
-            ksba_free (serial);
           }
           break;
 
         case KSBA_SR_END_ITEMS:
+          /* The signature check may now run while the writer thread
+           * adds the remaining items.  */
+          err = crl_writer_flush (writer);
+          if (err)
+            {
+              log_error (_("error inserting item into "
+                           "temporary cache file: %s\n"),
+                         gpg_strerror (err));
+              goto failure;
+            }
           break;
 
         case KSBA_SR_READY:
@@ -1881,8 +2159,15 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
   while (stopreason != KSBA_SR_READY);
   assert (!err);
 
+  err = crl_writer_finish (writer, 0);
+  writer = NULL;
+  if (err)
+    log_error (_("error inserting item into "
+                 "temporary cache file: %s\n"),
+               gpg_strerror (err));
 
  failure:
+  crl_writer_finish (writer, 1);
   abort_sig_check (crl, md);
   ksba_cert_release (crlissuer_cert);
   return err;
@@ -2076,12 +2361,15 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
       goto leave;
     }
 
-  /* Finish the database. */
-  if (cdb_make_finish (&cdb))
+  /* Finish the database.  This writes the hash tables; the cdb is
+     only used by us and thus we do it without holding the lock.  */
+  npth_unprotect ();
+  err = cdb_make_finish (&cdb)? gpg_error_from_syserror () : 0;
+  npth_protect ();
+  if (err)
     {
-      err = gpg_error_from_errno (errno);
       log_error (_("error finishing temporary cache file '%s': %s\n"),
-                 fname, strerror (errno));
+                 fname, gpg_strerror (err));
       goto leave;
     }
   if (close (fd_cdb))
@@ -2236,6 +2524,9 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   cache->entries = entry;
   entry = NULL;
 
+  /* The new CRL may revoke certificates of cached validations.  */
+  validate_cache_invalidate ();
+
   err = update_dir (cache);
   if (err)
     {
@@ -2589,3 +2880,135 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   ksba_free (issuer);
   return err;
 }
+
+
+/* A workqueue task to refresh the cached CRL of the issuer with
+ * ISSUER_HASH before it expires.  */
+static const char *
+task_prefetch_crl (ctrl_t ctrl, const char *issuer_hash)
+{
+  gpg_error_t err;
+  crl_cache_t cache;
+  crl_cache_entry_t entry;
+  ksba_reader_t reader;
+  char *url;
+
+  if (!ctrl || !issuer_hash)
+    return "prefetch_crl";
+
+  cache = get_current_cache ();
+  entry = find_entry (cache->entries, issuer_hash);
+  if (!entry || !entry->prefetch_queued)
+    return NULL;  /* Meanwhile replaced by a new CRL.  */
+  entry->prefetch_queued = 0;
+
+  url = xtrystrdup (entry->url);
+  if (!url)
+    {
+      log_error ("%s: %s\n", __func__,
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return NULL;
+    }
+
+  if (opt.verbose)
+    log_info ("refreshing CRL for issuer id %s from '%s'\n", issuer_hash, url);
+  err = crl_fetch (ctrl, url, &reader);
+  if (!err)
+    {
+      err = crl_cache_insert (ctrl, url, reader);
+      crl_close_reader (reader);
+    }
+  if (err)
+    {
+      log_info ("refreshing CRL for issuer id %s failed: %s\n",
+                issuer_hash, gpg_strerror (err));
+      entry = find_entry (cache->entries, issuer_hash);
+      if (entry)
+        entry->prefetch_at = gnupg_get_time () + CRL_PREFETCH_RETRY;
+    }
+
+  xfree (url);
+  return NULL;
+}
+
+
+/* Queue tasks to refresh the cached CRLs which expire within the
+ * next --crl-prefetch-window seconds so that a validation does not
+ * need to wait for the download.  The time of the refresh is chosen
+ * randomly in the first half of the window so that not all clients
+ * of a CA fetch its CRL at the same time.  This is called by the
+ * housekeeping thread with the current time CURTIME.  */
+void
+crl_cache_prefetch (time_t curtime)
+{
+  crl_cache_t cache;
+  crl_cache_entry_t entry;
+  unsigned int window, rnd;
+  time_t nextupdate, lastrefresh;
+  int nqueued;
+
+  window = opt.crl_prefetch_window;
+  if (!window || !current_cache)
+    return;
+  cache = get_current_cache ();
+
+  nqueued = 0;
+  for (entry = cache->entries; entry; entry = entry->next)
+    if (entry->prefetch_queued)
+      nqueued++;
+
+  for (entry = cache->entries;
+       entry && nqueued < CRL_PREFETCH_MAX; entry = entry->next)
+    {
+      if (entry->deleted || entry->invalid || entry->prefetch_queued)
+        continue;
+
+      if (!entry->prefetch_at)
+        {
+          /* Only CRLs loaded from a distribution point can be
+           * refreshed.  */
+          entry->prefetch_at = -1;
+          if (!strncmp (entry->url, "http:", 5)
+              || !strncmp (entry->url, "https:", 6))
+            {
+              if (opt.disable_http || opt.ignore_http_dp)
+                continue;
+            }
+          else if (!strncmp (entry->url, "ldap:", 5)
+                   || !strncmp (entry->url, "ldaps:", 6))
+            {
+              if (opt.disable_ldap || opt.ignore_ldap_dp)
+                continue;
+            }
+          else
+            continue;
+
+          nextupdate = isotime2epoch (entry->next_update);
+          if (nextupdate == (time_t)(-1))
+            continue;
+          gcry_create_nonce (&rnd, sizeof rnd);
+          entry->prefetch_at = nextupdate - window + rnd % (window/2 + 1);
+
+          /* Don't refresh a CRL again right after it has been loaded;
+           * the CA might not yet have published a new one.  */
+          lastrefresh = (*entry->last_refresh
+                         ? isotime2epoch (entry->last_refresh) : -1);
+          if (lastrefresh != (time_t)(-1)
+              && entry->prefetch_at < lastrefresh + CRL_PREFETCH_RETRY)
+            entry->prefetch_at = lastrefresh + CRL_PREFETCH_RETRY;
+        }
+
+      if (entry->prefetch_at == (time_t)(-1) || entry->prefetch_at > curtime)
+        continue;
+
+      if (workqueue_add_task (task_prefetch_crl, entry->issuer_hash, 0, 1,
+                              WQ_PRIO_PREFETCH))
+        log_error ("error queuing the CRL refresh: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+      else
+        {
+          entry->prefetch_queued = 1;
+          nqueued++;
+        }
+    }
+}
@@ -63,6 +63,7 @@
 #include "certcache.h"
 #include "crlcache.h"
 #include "crlfetch.h"
+#include "ocsp.h"
 #include "misc.h"
 #if USE_LDAP
 # include "ldapserver.h"
@@ -72,6 +73,7 @@
 # include "ldap-wrapper.h"
 #endif
 #include "../common/init.h"
+#include "../common/asynclog.h"
 #include "../common/gc-opt-flags.h"
 #include "dns-stuff.h"
 #include "http-common.h"
@@ -119,6 +121,8 @@ enum cmd_and_opt_values {
   oIgnoreLDAPDP,
   oIgnoreHTTPDP,
   oIgnoreOCSPSvcUrl,
+  oCRLPrefetchWindow,
+  oCertCacheSize,
   oHonorHTTPProxy,
   oHTTPProxy,
   oLDAPProxy,
@@ -199,6 +203,8 @@ static ARGPARSE_OPTS opts[] = {
                 N_("ignore LDAP CRL distribution points")),
   ARGPARSE_s_n (oIgnoreOCSPSvcUrl, "ignore-ocsp-service-url",
                 N_("ignore certificate contained OCSP service URLs")),
+  ARGPARSE_s_i (oCRLPrefetchWindow, "crl-prefetch-window", "@"),
+  ARGPARSE_s_i (oCertCacheSize, "cert-cache-size", "@"),
 
   ARGPARSE_s_s (oHTTPProxy,  "http-proxy",
                 N_("|URL|redirect all HTTP requests to URL")),
@@ -279,6 +285,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_NETWORK_VALUE, "network" },
     { DBG_LOOKUP_VALUE , "lookup"  },
     { DBG_EXTPROG_VALUE, "extprog" },
+    { DBG_TIMING_VALUE , "timing"  },
     { 77, NULL } /* 77 := Do not exit on "help" or "?".  */
   };
 
@@ -605,6 +612,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.ignore_http_dp = 0;
       opt.ignore_ldap_dp = 0;
       opt.ignore_ocsp_service_url = 0;
+      opt.crl_prefetch_window = 0;
+      opt.cert_cache_size = 0;
       opt.allow_ocsp = 0;
       opt.allow_version_check = 0;
       opt.ocsp_responder = NULL;
@@ -650,7 +659,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          asynclog_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -676,6 +685,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
     case oIgnoreHTTPDP: opt.ignore_http_dp = 1; break;
     case oIgnoreLDAPDP: opt.ignore_ldap_dp = 1; break;
     case oIgnoreOCSPSvcUrl: opt.ignore_ocsp_service_url = 1; break;
+    case oCRLPrefetchWindow: opt.crl_prefetch_window = pargs->r.ret_int; break;
+    case oCertCacheSize: opt.cert_cache_size = pargs->r.ret_int; break;
 
     case oAllowOCSP: opt.allow_ocsp = 1; break;
     case oAllowVersionCheck: opt.allow_version_check = 1; break;
@@ -841,12 +852,14 @@ main (int argc, char **argv)
   struct assuan_malloc_hooks malloc_hooks;
 
   early_system_init ();
+  gnupg_timing_mark ("start");
   set_strusage (my_strusage);
   log_set_prefix (DIRMNGR_NAME, GPGRT_LOG_WITH_PREFIX | GPGRT_LOG_WITH_PID);
 
   /* Make sure that our subsystems are ready.  */
   i18n_init ();
   init_common_subsystems (&argc, &argv);
+  gnupg_timing_mark ("init");
 
   gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
 
@@ -1093,6 +1106,7 @@ main (int argc, char **argv)
    * because it will attempt to connect to the tor client and that can
    * be time consuming.  */
   post_option_parsing ();
+  gnupg_timing_mark ("options");
   if (cmd != aGPGConfTest && cmd != aGPGConfList)
     set_tor_mode ();
 
@@ -1185,6 +1199,8 @@ main (int argc, char **argv)
       crl_cache_init ();
       ks_hkp_init ();
       http_register_netactivity_cb (netactivity_action);
+      if (DBG_TIMING)
+        gnupg_timing_dump ();
       handle_connections (3);
       shutdown_reaper ();
     }
@@ -1407,6 +1423,8 @@ main (int argc, char **argv)
       crl_cache_init ();
       ks_hkp_init ();
       http_register_netactivity_cb (netactivity_action);
+      if (DBG_TIMING)
+        gnupg_timing_dump ();
       handle_connections (fd);
       shutdown_reaper ();
     }
@@ -1560,6 +1578,8 @@ static void
 cleanup (void)
 {
   crl_cache_deinit ();
+  ocsp_cache_deinit ();
+  domaininfo_housekeeping ();
   cert_cache_deinit (1);
   reload_dns_stuff (1);
 
@@ -1871,10 +1891,12 @@ dirmngr_sighup_action (void)
   set_tor_mode ();
   cert_cache_deinit (0);
   crl_cache_deinit ();
+  ocsp_cache_deinit ();
   cert_cache_init (hkp_cacert_filenames);
   crl_cache_init ();
   reload_dns_stuff (0);
   ks_hkp_reload ();
+  http_pool_housekeeping (1);
 }
 
 
@@ -1903,6 +1925,9 @@ handle_signal (int signo)
     case SIGUSR1:
       cert_cache_print_stats ();
       domaininfo_print_stats ();
+#if USE_LDAP
+      ks_ldap_print_stats ();
+#endif /*USE_LDAP*/
       break;
 
     case SIGUSR2:
@@ -1963,7 +1988,15 @@ housekeeping_thread (void *arg)
   dirmngr_init_default_ctrl (&ctrlbuf);
 
   dns_stuff_housekeeping ();
-  ks_hkp_housekeeping (curtime);
+  ks_hkp_housekeeping (&ctrlbuf, curtime);
+#if USE_LDAP
+  ks_ldap_housekeeping (curtime);
+#endif /*USE_LDAP*/
+  http_pool_housekeeping (0);
+  http_cache_housekeeping ();
+  crl_cache_prefetch (curtime);
+  ocsp_cache_housekeeping ();
+  domaininfo_housekeeping ();
   if (network_activity_seen)
     {
       network_activity_seen = 0;
@@ -2161,6 +2194,10 @@ handle_connections (assuan_fd_t listen_fd)
   npth_attr_init (&tattr);
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  /* Write the log from now on by a separate thread so that a slow
+   * log consumer does not block the connections.  */
+  asynclog_start (current_logfile);
+
 #ifndef HAVE_W32_SYSTEM /* FIXME */
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
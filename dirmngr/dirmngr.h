@@ -113,6 +113,10 @@ struct
   int only_ldap_proxy;    /* Only use the LDAP proxy; no fallback.  */
   int ignore_http_dp;     /* Ignore HTTP CRL distribution points.  */
   int ignore_ldap_dp;     /* Ignore LDAP CRL distribution points.  */
+  unsigned int crl_prefetch_window; /* Seconds before nextUpdate to
+                                       refresh a cached CRL; 0 = never. */
+  unsigned int cert_cache_size;  /* Max. KiB used by cached certificates
+                                    or 0 for the default.  */
   int ignore_ocsp_service_url; /* Ignore OCSP service URLs as given in
                                   the certificate.  */
 
@@ -154,6 +158,7 @@ struct
 #define DBG_NETWORK_VALUE 2048  /* debug network I/O.  */
 #define DBG_LOOKUP_VALUE  8192  /* debug lookup details */
 #define DBG_EXTPROG_VALUE 16384 /* debug external program calls */
+#define DBG_TIMING_VALUE  32768 /* print startup timings */
 
 #define DBG_X509    (opt.debug & DBG_X509_VALUE)
 #define DBG_CRYPTO  (opt.debug & DBG_CRYPTO_VALUE)
@@ -165,6 +170,7 @@ struct
 #define DBG_NETWORK (opt.debug & DBG_NETWORK_VALUE)
 #define DBG_LOOKUP  (opt.debug & DBG_LOOKUP_VALUE)
 #define DBG_EXTPROG (opt.debug & DBG_EXTPROG_VALUE)
+#define DBG_TIMING  (opt.debug & DBG_TIMING_VALUE)
 
 /* A simple list of certificate references.  FIXME: Better use
    certlist_t also for references (Store NULL at .cert) */
@@ -217,9 +223,11 @@ const char* dirmngr_get_current_socket_name (void);
 int dirmngr_use_tor (void);
 
 /*-- Various housekeeping functions.  --*/
-void ks_hkp_housekeeping (time_t curtime);
+void ks_hkp_housekeeping (ctrl_t ctrl, time_t curtime);
 void ks_hkp_reload (void);
 void ks_hkp_init (void);
+void ks_ldap_housekeeping (time_t curtime);
+void ks_ldap_print_stats (void);
 
 /*-- server.c --*/
 ldap_server_t get_ldapservers_from_ctrl (ctrl_t ctrl);
@@ -254,13 +262,36 @@ void domaininfo_set_no_name (const char *domain);
 void domaininfo_set_wkd_supported (const char *domain);
 void domaininfo_set_wkd_not_supported (const char *domain);
 void domaininfo_set_wkd_not_found (const char *domain);
+void domaininfo_housekeeping (void);
+
+/*-- http-cache.c --*/
+typedef struct http_cache_s *http_cache_t;
+
+gpg_error_t http_cache_open (const char *key, int heuristic,
+                             http_cache_t *r_cache, estream_t *r_fp);
+const char *http_cache_etag (http_cache_t cache);
+gpg_error_t http_cache_update (http_cache_t cache, http_t http,
+                               estream_t *r_fp);
+void http_cache_release (http_cache_t cache);
+void http_cache_housekeeping (void);
+char *http_cache_info (void);
 
 /*-- workqueue.c --*/
 typedef const char *(*wqtask_t)(ctrl_t ctrl, const char *args);
 
+/* Priority classes for workqueue tasks.  Tasks of a lower class are
+ * run first.  */
+enum wq_priority
+  {
+    WQ_PRIO_INTERACTIVE = 0,  /* A user is waiting for the result.  */
+    WQ_PRIO_PREFETCH = 1,     /* Fetch data before it is needed.  */
+    WQ_PRIO_HOUSEKEEPING = 2  /* Maintenance tasks.  */
+  };
+
 void workqueue_dump_queue (ctrl_t ctrl);
 gpg_error_t workqueue_add_task (wqtask_t func, const char *args,
-                                unsigned int session_id, int need_network);
+                                unsigned int session_id, int need_network,
+                                enum wq_priority prio);
 void workqueue_run_global_tasks (ctrl_t ctrl, int with_network);
 void workqueue_run_post_session_tasks (unsigned int session_id);
 
@@ -75,6 +75,7 @@
 #include "../common/host2net.h"
 #include "dirmngr-status.h"
 #include "dns-stuff.h"
+#include "../common/tracepoint.h"
 
 #ifdef USE_NPTH
 # define my_unprotect()        npth_unprotect ()
@@ -114,6 +115,10 @@
 /* The default timeout in seconds for libdns requests.  */
 #define DEFAULT_TIMEOUT 30
 
+/* The time in milliseconds to wait for the AAAA or A answer after
+ * the answer for the other family arrived.  */
+#define RESOLUTION_DELAY 50
+
 
 #define RESOLV_CONF_NAME "/etc/resolv.conf"
 
@@ -158,6 +163,51 @@ static struct
 } cached_inet_support;
 
 
+/* Parameters for the DNS answer cache.  TTLs are capped at
+ * DNS_CACHE_MAX_TTL seconds.  Answers without a known TTL are kept
+ * for DNS_CACHE_DEF_TTL and negative answers for DNS_CACHE_NEG_TTL
+ * seconds.  */
+#define DNS_CACHE_SIZE     256
+#define DNS_CACHE_BUCKETS   64
+#define DNS_CACHE_DEF_TTL   60
+#define DNS_CACHE_MAX_TTL 3600
+#define DNS_CACHE_NEG_TTL   30
+
+/* An item of the DNS answer cache.  Depending on the type of the
+ * query only some of the answer fields are used.  The cache is only
+ * accessed without a yield point in between and thus needs no lock
+ * with nPth.  */
+struct dns_cache_item_s
+{
+  struct dns_cache_item_s *next;
+  time_t expires;
+  gpg_error_t err;           /* The error code of a negative answer.  */
+  dns_addrinfo_t dai;        /* resolve_dns_name  */
+  char *canonname;
+  char *name;                /* resolve_dns_addr  */
+  struct srventry *srvlist;  /* get_dns_srv  */
+  unsigned int srvcount;
+  void *key;                 /* get_dns_cert  */
+  size_t keylen;
+  unsigned char *fpr;
+  size_t fprlen;
+  char *url;
+  char lookup[1];            /* The query as a string.  */
+};
+typedef struct dns_cache_item_s *dns_cache_item_t;
+
+static dns_cache_item_t dns_cache[DNS_CACHE_BUCKETS];
+static unsigned int dns_cache_count;
+
+/* Statistics for the DNS answer cache.  */
+static struct
+{
+  unsigned long hits;
+  unsigned long neg_hits;
+  unsigned long misses;
+} dns_cache_stats;
+
+
 
 #ifdef USE_LIBDNS
 /* Libdns global data.  */
@@ -176,9 +226,259 @@ static int libdns_reinit_pending;
 /* The Tor port to be used.  */
 static int libdns_tor_port;
 
+/* The maximum number of resolvers we keep for reuse, how often and
+ * for how many seconds a resolver is reused.  The limits make sure
+ * that the UDP source port changes from time to time.  */
+#define LIBDNS_POOL_SIZE      8
+#define LIBDNS_POOL_MAX_USES 32
+#define LIBDNS_POOL_MAX_AGE  60
+
+/* The resolvers created by libdns_res_open.  An entry with IDLE set
+ * may be handed out again; the others are in use.  Resolvers of an
+ * older GENERATION use a stale configuration and are closed when
+ * released.  */
+static struct
+{
+  struct dns_resolver *res;
+  unsigned int generation;
+  unsigned int uses;
+  time_t created;
+  int idle;
+} libdns_pool[LIBDNS_POOL_SIZE];
+
+/* The current generation of the libdns configuration.  */
+static unsigned int libdns_generation;
+
 #endif /*USE_LIBDNS*/
 
 
+
+/* Release the DNS cache item ITEM.  */
+static void
+release_dns_cache_item (dns_cache_item_t item)
+{
+  if (!item)
+    return;
+  free_dns_addrinfo (item->dai);
+  xfree (item->canonname);
+  xfree (item->name);
+  xfree (item->srvlist);
+  xfree (item->key);
+  xfree (item->fpr);
+  xfree (item->url);
+  xfree (item);
+}
+
+
+/* Remove all items from the DNS cache.  */
+static void
+flush_dns_cache (void)
+{
+  dns_cache_item_t item, next;
+  int i;
+
+  for (i=0; i < DNS_CACHE_BUCKETS; i++)
+    {
+      for (item = dns_cache[i]; item; item = next)
+        {
+          next = item->next;
+          release_dns_cache_item (item);
+        }
+      dns_cache[i] = NULL;
+    }
+  dns_cache_count = 0;
+}
+
+
+/* Remove all expired items from the DNS cache.  If FORCE is set and
+ * no item has expired, the item which would expire first is
+ * removed.  */
+static void
+purge_dns_cache (int force)
+{
+  dns_cache_item_t item, *itemp, *first = NULL;
+  time_t now = time (NULL);
+  int i, any = 0;
+
+  for (i=0; i < DNS_CACHE_BUCKETS; i++)
+    for (itemp = &dns_cache[i]; (item = *itemp); )
+      {
+        if (item->expires <= now)
+          {
+            *itemp = item->next;
+            release_dns_cache_item (item);
+            dns_cache_count--;
+            any = 1;
+          }
+        else
+          {
+            if (!first || item->expires < (*first)->expires)
+              first = itemp;
+            itemp = &item->next;
+          }
+      }
+
+  if (force && !any && first)
+    {
+      item = *first;
+      *first = item->next;
+      release_dns_cache_item (item);
+      dns_cache_count--;
+    }
+}
+
+
+/* Return the bucket index for the query string LOOKUP.  */
+static unsigned int
+dns_cache_hash (const char *lookup)
+{
+  unsigned int hash = 0;
+
+  for (; *lookup; lookup++)
+    hash = hash * 31 + ascii_tolower (*(const unsigned char *)lookup);
+  return hash % DNS_CACHE_BUCKETS;
+}
+
+
+/* Return the unexpired cache item for the query string LOOKUP or
+ * NULL if there is none.  */
+static dns_cache_item_t
+find_dns_cache_item (const char *lookup)
+{
+  dns_cache_item_t item, *itemp;
+
+  for (itemp = &dns_cache[dns_cache_hash (lookup)]; (item = *itemp);
+       itemp = &item->next)
+    if (!ascii_strcasecmp (item->lookup, lookup))
+      {
+        if (item->expires <= time (NULL))
+          {
+            *itemp = item->next;
+            release_dns_cache_item (item);
+            dns_cache_count--;
+            break;
+          }
+        if (item->err)
+          dns_cache_stats.neg_hits++;
+        else
+          dns_cache_stats.hits++;
+        return item;
+      }
+
+  dns_cache_stats.misses++;
+  return NULL;
+}
+
+
+/* Return a new and empty cache item for the query string LOOKUP or
+ * NULL on memory error.  The item still needs to be stored using
+ * put_dns_cache_item.  */
+static dns_cache_item_t
+new_dns_cache_item (const char *lookup)
+{
+  dns_cache_item_t item;
+
+  item = xtrycalloc (1, sizeof *item + strlen (lookup));
+  if (item)
+    strcpy (item->lookup, lookup);
+  return item;
+}
+
+
+/* Store ITEM in the DNS cache with a lifetime of TTL seconds.  An
+ * item for the same query is replaced.  ITEM is released if TTL is
+ * 0.  */
+static void
+put_dns_cache_item (dns_cache_item_t item, unsigned int ttl)
+{
+  dns_cache_item_t old, *oldp;
+  unsigned int hash;
+
+  if (!ttl)
+    {
+      release_dns_cache_item (item);
+      return;
+    }
+  if (ttl > DNS_CACHE_MAX_TTL)
+    ttl = DNS_CACHE_MAX_TTL;
+
+  hash = dns_cache_hash (item->lookup);
+  for (oldp = &dns_cache[hash]; (old = *oldp); oldp = &old->next)
+    if (!ascii_strcasecmp (old->lookup, item->lookup))
+      {
+        *oldp = old->next;
+        release_dns_cache_item (old);
+        dns_cache_count--;
+        break;
+      }
+
+  if (dns_cache_count >= DNS_CACHE_SIZE)
+    purge_dns_cache (1);
+
+  item->expires = time (NULL) + ttl;
+  item->next = dns_cache[hash];
+  dns_cache[hash] = item;
+  dns_cache_count++;
+}
+
+
+/* Return true if ERR is a negative answer which may be cached.  */
+static int
+dns_cache_negative_p (gpg_error_t err)
+{
+  switch (gpg_err_code (err))
+    {
+    case GPG_ERR_NO_NAME:
+    case GPG_ERR_NOT_FOUND:
+    case GPG_ERR_NO_DATA:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Return a copy of the address list AI or NULL on memory error.  */
+static dns_addrinfo_t
+copy_dns_addrinfo (dns_addrinfo_t ai)
+{
+  dns_addrinfo_t list = NULL;
+  dns_addrinfo_t *tail = &list;
+  dns_addrinfo_t dai;
+
+  for (; ai; ai = ai->next)
+    {
+      dai = xtrymalloc (sizeof *dai);
+      if (!dai)
+        {
+          free_dns_addrinfo (list);
+          return NULL;
+        }
+      memcpy (dai, ai, sizeof *dai);
+      dai->next = NULL;
+      *tail = dai;
+      tail = &dai->next;
+    }
+  return list;
+}
+
+
+/* Return a malloced string with statistics of the DNS cache.  The
+ * string has the space separated fields
+ *
+ *   <entries> <hits> <negative_hits> <misses>
+ *
+ * Returns NULL on memory error.  */
+char *
+get_dns_cache_info (void)
+{
+  return xtryasprintf ("%u %lu %lu %lu", dns_cache_count,
+                       dns_cache_stats.hits, dns_cache_stats.neg_hits,
+                       dns_cache_stats.misses);
+}
+
+
+
 /* Calling this function with YES set to True forces the use of the
  * standard resolver even if dirmngr has been built with support for
  * an alternative resolver.  */
@@ -186,6 +486,7 @@ void
 enable_standard_resolver (int yes)
 {
   standard_resolver = yes;
+  flush_dns_cache ();
 }
 
 
@@ -237,6 +538,7 @@ enable_dns_tormode (int new_circuit)
       counter++;
     }
   tor_mode = 1;
+  flush_dns_cache ();
 }
 
 
@@ -245,6 +547,7 @@ void
 disable_dns_tormode (void)
 {
   tor_mode = 0;
+  flush_dns_cache ();
 }
 
 
@@ -263,6 +566,7 @@ void
 set_dns_disable_ipv4 (int yes)
 {
   opt_disable_ipv4 = !!yes;
+  flush_dns_cache ();
 }
 
 
@@ -272,6 +576,7 @@ void
 set_dns_disable_ipv6 (int yes)
 {
   opt_disable_ipv6 = !!yes;
+  flush_dns_cache ();
 }
 
 
@@ -304,6 +609,7 @@ set_dns_nameserver (const char *ipaddr)
   libdns_reinit_pending = 1;
   libdns_tor_port = 0;  /* Start again with the default port.  */
 #endif
+  flush_dns_cache ();
 }
 
 
@@ -663,6 +969,17 @@ static void
 libdns_deinit (void)
 {
   struct libdns_s ld;
+  int i;
+
+  /* Drop the pooled resolvers; those in use are closed when they are
+   * released.  */
+  libdns_generation++;
+  for (i=0; i < LIBDNS_POOL_SIZE; i++)
+    if (libdns_pool[i].res && libdns_pool[i].idle)
+      {
+        dns_res_close (libdns_pool[i].res);
+        libdns_pool[i].res = NULL;
+      }
 
   if (!libdns.resolv_conf)
     return; /* Not initialized.  */
@@ -696,8 +1013,10 @@ reload_dns_stuff (int force)
   (void)force;
 #endif
 
-  /* We also flush the IPv4/v6 support flag cache.  */
+  /* We also flush the IPv4/v6 support flag cache and all cached
+   * answers.  */
   cached_inet_support.valid = 0;
+  flush_dns_cache ();
 }
 
 
@@ -710,6 +1029,8 @@ dns_stuff_housekeeping (void)
    * later than 10 minutes after it changed.  This way the user does
    * not need a reload.  */
   cached_inet_support.valid = 0;
+
+  purge_dns_cache (0);
 }
 
 
@@ -717,14 +1038,17 @@ dns_stuff_housekeeping (void)
 /*
  * Initialize libdns if needed and open a dns_resolver context.
  * Returns 0 on success and stores the new context at R_RES.  On
- * failure an error code is returned and NULL stored at R_RES.
+ * failure an error code is returned and NULL stored at R_RES.  A
+ * resolver released with libdns_res_close may be reused; this saves
+ * setting up a new resolver and its UDP socket for each query.
  */
 static gpg_error_t
 libdns_res_open (ctrl_t ctrl, struct dns_resolver **r_res)
 {
   gpg_error_t err;
   struct dns_resolver *res;
-  int derr;
+  int derr, i;
+  time_t now;
   struct dns_options opts = { 0 };
 
   opts.socks_host     = &libdns.socks_host;
@@ -754,17 +1078,80 @@ libdns_res_open (ctrl_t ctrl, struct dns_resolver **r_res)
   if (!opt_timeout)
     set_dns_timeout (0);
 
+  now = time (NULL);
+  for (i=0; i < LIBDNS_POOL_SIZE; i++)
+    if (libdns_pool[i].res && libdns_pool[i].idle
+        && libdns_pool[i].created + LIBDNS_POOL_MAX_AGE > now)
+      {
+        libdns_pool[i].idle = 0;
+        libdns_pool[i].uses++;
+        *r_res = libdns_pool[i].res;
+        return 0;
+      }
+
   res = dns_res_open (libdns.resolv_conf, libdns.hosts, libdns.hints, NULL,
                       &opts, &derr);
   if (!res)
     return libdns_error_to_gpg_error (derr);
 
+  /* Track the resolver for reuse if there is room.  */
+  for (i=0; i < LIBDNS_POOL_SIZE; i++)
+    if (!libdns_pool[i].res
+        || (libdns_pool[i].idle
+            && libdns_pool[i].created + LIBDNS_POOL_MAX_AGE <= now))
+      {
+        dns_res_close (libdns_pool[i].res);
+        libdns_pool[i].res = res;
+        libdns_pool[i].generation = libdns_generation;
+        libdns_pool[i].uses = 1;
+        libdns_pool[i].created = now;
+        libdns_pool[i].idle = 0;
+        break;
+      }
+
   *r_res = res;
   return 0;
 }
 #endif /*USE_LIBDNS*/
 
 
+#ifdef USE_LIBDNS
+/* Release the resolver RES obtained by libdns_res_open.  If REUSE is
+ * set, the last query of RES has been completed and RES may thus be
+ * used again for another query.  */
+static void
+libdns_res_close (struct dns_resolver *res, int reuse)
+{
+  int i;
+
+  if (!res)
+    return;
+
+  for (i=0; i < LIBDNS_POOL_SIZE; i++)
+    if (libdns_pool[i].res == res)
+      break;
+  if (!(i < LIBDNS_POOL_SIZE))
+    {
+      dns_res_close (res);  /* Not tracked.  */
+      return;
+    }
+
+  if (!reuse
+      || libdns_pool[i].generation != libdns_generation
+      || libdns_pool[i].uses >= LIBDNS_POOL_MAX_USES
+      || libdns_pool[i].created + LIBDNS_POOL_MAX_AGE <= time (NULL))
+    {
+      libdns_pool[i].res = NULL;
+      dns_res_close (res);
+      return;
+    }
+
+  dns_res_reset (res);
+  libdns_pool[i].idle = 1;
+}
+#endif /*USE_LIBDNS*/
+
+
 #ifdef USE_LIBDNS
 /* Helper to test whether we need to try again after having switched
  * the Tor port.  */
@@ -824,6 +1211,103 @@ libdns_res_wait (struct dns_resolver *res)
 #endif /*USE_LIBDNS*/
 
 
+#ifdef USE_LIBDNS
+/* Fetch all results available from AI and prepend them to the list
+ * at R_DAIHEAD.  If R_CANONNAME is not NULL and no canonical name has
+ * yet been stored there the canonical name is stored.  Returns
+ * GPG_ERR_EAGAIN if more results are expected, GPG_ERR_ENOENT if AI
+ * is finished, or another error code.  */
+static gpg_error_t
+libdns_ai_fetch (struct dns_addrinfo *ai, dns_addrinfo_t *r_daihead,
+                 char **r_canonname)
+{
+  gpg_error_t err;
+  dns_addrinfo_t dai;
+  struct addrinfo *ent;
+
+  for (;;)
+    {
+      err = libdns_error_to_gpg_error (dns_ai_nextent (&ent, ai));
+      if (err)
+        return err;
+
+      if (r_canonname && ! *r_canonname && ent && ent->ai_canonname)
+        {
+          *r_canonname = xtrystrdup (ent->ai_canonname);
+          if (!*r_canonname)
+            {
+              err = gpg_error_from_syserror ();
+              xfree (ent);
+              return err;
+            }
+          /* Libdns appends the root zone part which is problematic
+           * for most other functions - strip it.  */
+          if (**r_canonname && (*r_canonname)[strlen (*r_canonname)-1] == '.')
+            (*r_canonname)[strlen (*r_canonname)-1] = 0;
+        }
+
+      dai = xtrymalloc (sizeof *dai);
+      if (dai == NULL)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (ent);
+          return err;
+        }
+
+      dai->family = ent->ai_family;
+      dai->socktype = ent->ai_socktype;
+      dai->protocol = ent->ai_protocol;
+      dai->addrlen = ent->ai_addrlen;
+      memcpy (dai->addr, ent->ai_addr, ent->ai_addrlen);
+      dai->next = *r_daihead;
+      *r_daihead = dai;
+
+      xfree (ent);
+    }
+}
+#endif /*USE_LIBDNS*/
+
+
+#ifdef USE_LIBDNS
+/* Wait up to TIMEOUT milliseconds until one of the N lookups in AI
+ * which are still in progress as indicated by DONE can make
+ * progress.  */
+static void
+libdns_ai_wait (struct dns_addrinfo **ai, const int *done, int n,
+                unsigned int timeout)
+{
+  fd_set rset, wset;
+  struct timeval tv;
+  int i, fd, events, maxfd;
+
+  FD_ZERO (&rset);
+  FD_ZERO (&wset);
+  maxfd = -1;
+  for (i=0; i < n; i++)
+    {
+      if (done[i])
+        continue;
+      fd = dns_ai_pollfd (ai[i]);
+      events = dns_ai_events (ai[i]);
+      if (fd < 0 || fd >= FD_SETSIZE || !events)
+        continue;
+      if ((events & DNS_POLLIN))
+        FD_SET (fd, &rset);
+      if ((events & DNS_POLLOUT))
+        FD_SET (fd, &wset);
+      if (fd > maxfd)
+        maxfd = fd;
+    }
+
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  my_unprotect ();
+  select (maxfd + 1, &rset, &wset, NULL, &tv);
+  my_protect ();
+}
+#endif /*USE_LIBDNS*/
+
+
 #ifdef USE_LIBDNS
 static gpg_error_t
 resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
@@ -832,11 +1316,13 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
 {
   gpg_error_t err;
   dns_addrinfo_t daihead = NULL;
-  dns_addrinfo_t dai;
-  struct dns_resolver *res = NULL;
-  struct dns_addrinfo *ai = NULL;
+  struct dns_resolver *res[2] = { NULL, NULL };
+  struct dns_addrinfo *ai[2] = { NULL, NULL };
+  gpg_error_t aierr[2];
+  int done[2] = { 0, 0 };
+  int nai, i, pending;
+  int delayed = 0;
   struct addrinfo hints;
-  struct addrinfo *ent;
   char portstr_[21];
   char *portstr = NULL;
   char *namebuf = NULL;
@@ -859,11 +1345,6 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
       portstr = portstr_;
     }
 
-  err = libdns_res_open (ctrl, &res);
-  if (err)
-    goto leave;
-
-
   if (is_ip_address (name))
     {
       hints.ai_flags |= AI_NUMERICHOST;
@@ -882,74 +1363,82 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
         }
     }
 
-  ai = dns_ai_open (name, portstr, 0, &hints, res, &derr);
-  if (!ai)
+  /* If any family is requested we send the AAAA and the A query in
+   * parallel using two resolvers.  Thus a non-responding server for
+   * one of the families does not delay the other one.  */
+  nai = (!want_family && !(hints.ai_flags & AI_NUMERICHOST))? 2 : 1;
+  for (i=0; i < nai; i++)
     {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
+      err = libdns_res_open (ctrl, &res[i]);
+      if (err)
+        goto leave;
+
+      if (nai == 2)
+        hints.ai_family = i? AF_INET : AF_INET6;
+      ai[i] = dns_ai_open (name, portstr, 0, &hints, res[i], &derr);
+      if (!ai[i])
+        {
+          err = libdns_error_to_gpg_error (derr);
+          goto leave;
+        }
     }
 
   /* Loop over all records.  */
   for (;;)
     {
-      err = libdns_error_to_gpg_error (dns_ai_nextent (&ent, ai));
-      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+      pending = 0;
+      for (i=0; i < nai; i++)
         {
-          if (daihead)
-            err = 0; /* We got some results, we're good.  */
-          break; /* Ready.  */
+          if (done[i])
+            continue;
+          aierr[i] = libdns_ai_fetch (ai[i], &daihead, r_canonname);
+          if (gpg_err_code (aierr[i]) == GPG_ERR_EAGAIN)
+            pending++;
+          else
+            done[i] = 1;
         }
-      if (gpg_err_code (err) == GPG_ERR_EAGAIN)
-        {
-          if (dns_ai_elapsed (ai) > opt_timeout)
-            {
-              err = gpg_error (GPG_ERR_DNS_TIMEOUT);
-              goto leave;
-            }
+      if (!pending)
+        break;
 
-          my_unprotect ();
-          dns_ai_poll (ai, 1);
-          my_protect ();
-          continue;
-        }
-      if (err)
-        goto leave;
-
-      if (r_canonname && ! *r_canonname && ent && ent->ai_canonname)
-        {
-          *r_canonname = xtrystrdup (ent->ai_canonname);
-          if (!*r_canonname)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          /* Libdns appends the root zone part which is problematic
-           * for most other functions - strip it.  */
-          if (**r_canonname && (*r_canonname)[strlen (*r_canonname)-1] == '.')
-            (*r_canonname)[strlen (*r_canonname)-1] = 0;
-        }
+      /* With results for one family we wait only a short time for
+       * the other one (RFC-8305, Resolution Delay).  */
+      if (daihead && delayed)
+        break;
 
-      dai = xtrymalloc (sizeof *dai);
-      if (dai == NULL)
+      if (dns_ai_elapsed (ai[0]) > opt_timeout)
         {
-          err = gpg_error_from_syserror ();
+          /* If we already got results we do not need to wait for
+           * the other family.  */
+          if (daihead)
+            break;
+          err = gpg_error (GPG_ERR_DNS_TIMEOUT);
           goto leave;
         }
 
-      dai->family = ent->ai_family;
-      dai->socktype = ent->ai_socktype;
-      dai->protocol = ent->ai_protocol;
-      dai->addrlen = ent->ai_addrlen;
-      memcpy (dai->addr, ent->ai_addr, ent->ai_addrlen);
-      dai->next = daihead;
-      daihead = dai;
+      libdns_ai_wait (ai, done, nai, daihead? RESOLUTION_DELAY : 1000);
+      if (daihead)
+        delayed = 1;
+    }
 
-      xfree (ent);
-  }
+  /* If we got some results, we're good.  Otherwise return the error
+   * of the first lookup unless it merely found nothing.  */
+  err = 0;
+  if (!daihead)
+    {
+      err = aierr[0];
+      if (nai == 2 && gpg_err_code (aierr[0]) == GPG_ERR_ENOENT)
+        err = aierr[1];
+    }
 
  leave:
-  dns_ai_close (ai);
-  dns_res_close (res);
+  for (i=0; i < 2; i++)
+    {
+      dns_ai_close (ai[i]);
+      libdns_res_close (res[i],
+                        (done[i] && (!aierr[i]
+                                     || gpg_err_code (aierr[i])
+                                     == GPG_ERR_ENOENT)));
+    }
 
   if (err)
     {
@@ -1099,7 +1588,37 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                   dns_addrinfo_t *r_ai, char **r_canonname)
 {
   gpg_error_t err;
+  char *lookup = NULL;
+  dns_cache_item_t item;
 
+  /* Numerical addresses are not looked up and thus not cached.  */
+  if (!is_ip_address (name))
+    lookup = xtryasprintf ("N:%hu:%d:%d:%d:%s", port, want_family,
+                           want_socktype, !!r_canonname, name);
+  if (lookup && (item = find_dns_cache_item (lookup)))
+    {
+      *r_ai = NULL;
+      if (r_canonname)
+        *r_canonname = NULL;
+      err = item->err;
+      if (!err && !(*r_ai = copy_dns_addrinfo (item->dai)))
+        err = gpg_error_from_syserror ();
+      if (!err && r_canonname && item->canonname
+          && !(*r_canonname = xtrystrdup (item->canonname)))
+        {
+          err = gpg_error_from_syserror ();
+          free_dns_addrinfo (*r_ai);
+          *r_ai = NULL;
+        }
+      xfree (lookup);
+      if (opt_debug)
+        log_debug ("dns: resolve_dns_name(%s): %s (cached)\n",
+                   name, gpg_strerror (err));
+      TRACEPOINT2 (dns_resolve_cached, name, err);
+      return err;
+    }
+
+  TRACEPOINT1 (dns_resolve_begin, name);
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
@@ -1113,6 +1632,26 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
 #endif /*USE_LIBDNS*/
     err = resolve_name_standard (ctrl, name, port, want_family, want_socktype,
                                  r_ai, r_canonname);
+  TRACEPOINT2 (dns_resolve_end, name, err);
+
+  /* The address lookups don't return a TTL and thus we use a
+   * default.  */
+  if (lookup && (!err || dns_cache_negative_p (err))
+      && (item = new_dns_cache_item (lookup)))
+    {
+      item->err = err;
+      if (!err)
+        item->dai = copy_dns_addrinfo (*r_ai);
+      if (!err && r_canonname && *r_canonname)
+        item->canonname = xtrystrdup (*r_canonname);
+      if (!err && (!item->dai
+                   || (r_canonname && *r_canonname && !item->canonname)))
+        release_dns_cache_item (item);
+      else
+        put_dns_cache_item (item, err? DNS_CACHE_NEG_TTL : DNS_CACHE_DEF_TTL);
+    }
+  xfree (lookup);
+
   if (opt_debug)
     log_debug ("dns: resolve_dns_name(%s): %s\n", name, gpg_strerror (err));
   return err;
@@ -1248,8 +1787,8 @@ resolve_addr_libdns (ctrl_t ctrl,
     }
 
  leave:
+  libdns_res_close (res, !!ans);
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -1324,6 +1863,36 @@ resolve_dns_addr (ctrl_t ctrl,
                   unsigned int flags, char **r_name)
 {
   gpg_error_t err;
+  char *lookup = NULL;
+  char *hexaddr = NULL;
+  dns_cache_item_t item;
+
+  /* Only real lookups are cached.  The key is the plain address so
+   * that the port and padding bytes don't matter.  */
+  if (!(flags & DNS_NUMERICHOST))
+    {
+      if (addr->ss_family == AF_INET)
+        hexaddr = bin2hex (&((const struct sockaddr_in *)addr)->sin_addr,
+                           sizeof (struct in_addr), NULL);
+      else if (addr->ss_family == AF_INET6)
+        hexaddr = bin2hex (&((const struct sockaddr_in6 *)addr)->sin6_addr,
+                           sizeof (struct in6_addr), NULL);
+      if (hexaddr)
+        lookup = xtryasprintf ("A:%u:%s", flags, hexaddr);
+      xfree (hexaddr);
+    }
+  if (lookup && (item = find_dns_cache_item (lookup)))
+    {
+      *r_name = NULL;
+      err = item->err;
+      if (!err && !(*r_name = xtrystrdup (item->name)))
+        err = gpg_error_from_syserror ();
+      xfree (lookup);
+      if (opt_debug)
+        log_debug ("dns: resolve_dns_addr(): %s (cached)\n",
+                   gpg_strerror (err));
+      return err;
+    }
 
 #ifdef USE_LIBDNS
   /* Note that we divert to the standard resolver for NUMERICHOST.  */
@@ -1337,6 +1906,19 @@ resolve_dns_addr (ctrl_t ctrl,
 #endif /*USE_LIBDNS*/
     err = resolve_addr_standard (addr, addrlen, flags, r_name);
 
+  if (lookup && (!err || dns_cache_negative_p (err))
+      && (item = new_dns_cache_item (lookup)))
+    {
+      item->err = err;
+      if (!err)
+        item->name = xtrystrdup (*r_name);
+      if (!err && !item->name)
+        release_dns_cache_item (item);
+      else
+        put_dns_cache_item (item, err? DNS_CACHE_NEG_TTL : DNS_CACHE_DEF_TTL);
+    }
+  xfree (lookup);
+
   if (opt_debug)
     log_debug ("dns: resolve_dns_addr(): %s\n", gpg_strerror (err));
   return err;
@@ -1426,12 +2008,14 @@ is_onion_address (const char *name)
 }
 
 
-/* libdns version of get_dns_cert.  */
+/* libdns version of get_dns_cert.  The lowest TTL of the inspected
+ * records is stored at R_TTL.  */
 #ifdef USE_LIBDNS
 static gpg_error_t
 get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
                      void **r_key, size_t *r_keylen,
-                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
+                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                     unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1442,6 +2026,8 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
   int derr;
   int qtype;
 
+  *r_ttl = DNS_CACHE_MAX_TTL;
+
   /* Get the query type from WANT_CERTTYPE (which in general indicates
    * the subtype we want). */
   qtype = (want_certtype < DNS_CERTTYPE_RRBASE
@@ -1497,6 +2083,9 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
       unsigned short len = rr.rd.len;
       u16 subtype;
 
+      if (rr.ttl < *r_ttl)
+        *r_ttl = rr.ttl;
+
        if (!len)
         {
           /* Definitely too short - skip.  */
@@ -1594,24 +2183,29 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
     }
 
  leave:
+  libdns_res_close (res, !!ans);
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
 
 
-/* Standard resolver version of get_dns_cert.  */
+/* Standard resolver version of get_dns_cert.  The lowest TTL of the
+ * inspected records is stored at R_TTL.  */
 static gpg_error_t
 get_dns_cert_standard (const char *name, int want_certtype,
                        void **r_key, size_t *r_keylen,
-                       unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
+                       unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                       unsigned int *r_ttl)
 {
 #ifdef HAVE_SYSTEM_RESOLVER
   gpg_error_t err;
   unsigned char *answer;
   int r;
   u16 count;
+  u32 ttl;
+
+  *r_ttl = DNS_CACHE_MAX_TTL;
 
   /* Allocate a 64k buffer which is the limit for an DNS response.  */
   answer = xtrymalloc (65536);
@@ -1679,7 +2273,9 @@ get_dns_cert_standard (const char *name, int want_certtype,
           if (class != C_IN)
             break;
 
-          /* ttl */
+          ttl = buf32_to_u32 (pt);
+          if (ttl < *r_ttl)
+            *r_ttl = ttl;
           pt += 4;
 
           /* data length */
@@ -1798,6 +2394,7 @@ get_dns_cert_standard (const char *name, int want_certtype,
   (void)r_fpr;
   (void)r_fprlen;
   (void)r_url;
+  *r_ttl = 0;
   return gpg_error (GPG_ERR_NOT_SUPPORTED);
 
 #endif /*!HAVE_SYSTEM_RESOLVER*/
@@ -1820,6 +2417,9 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
               unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
 {
   gpg_error_t err;
+  char *lookup;
+  dns_cache_item_t item;
+  unsigned int ttl;
 
   if (r_key)
     *r_key = NULL;
@@ -1829,19 +2429,99 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
   *r_fprlen = 0;
   *r_url = NULL;
 
+  /* Without R_KEY PGP records are skipped and thus the answer
+   * depends on it.  */
+  lookup = xtryasprintf ("C:%d:%d:%s", want_certtype, !!r_key, name);
+  if (lookup && (item = find_dns_cache_item (lookup)))
+    {
+      err = item->err;
+      if (!err && item->key && r_key)
+        {
+          *r_key = xtrymalloc (item->keylen);
+          if (!*r_key)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*r_key, item->key, item->keylen);
+              if (r_keylen)
+                *r_keylen = item->keylen;
+            }
+        }
+      if (!err && item->fpr)
+        {
+          *r_fpr = xtrymalloc (item->fprlen);
+          if (!*r_fpr)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*r_fpr, item->fpr, item->fprlen);
+              *r_fprlen = item->fprlen;
+            }
+        }
+      if (!err && item->url && !(*r_url = xtrystrdup (item->url)))
+        err = gpg_error_from_syserror ();
+      if (err && !item->err)
+        {
+          if (r_key)
+            {
+              xfree (*r_key);
+              *r_key = NULL;
+            }
+          if (r_keylen)
+            *r_keylen = 0;
+          xfree (*r_fpr);
+          *r_fpr = NULL;
+          *r_fprlen = 0;
+        }
+      xfree (lookup);
+      if (opt_debug)
+        log_debug ("dns: get_dns_cert(%s): %s (cached)\n",
+                   name, gpg_strerror (err));
+      return err;
+    }
+
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
       err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                 r_fpr, r_fprlen, r_url);
+                                 r_fpr, r_fprlen, r_url, &ttl);
       if (err && libdns_switch_port_p (err))
         err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                   r_fpr, r_fprlen, r_url);
+                                   r_fpr, r_fprlen, r_url, &ttl);
     }
   else
 #endif /*USE_LIBDNS*/
     err = get_dns_cert_standard (name, want_certtype, r_key, r_keylen,
-                                 r_fpr, r_fprlen, r_url);
+                                 r_fpr, r_fprlen, r_url, &ttl);
+
+  if (lookup && (!err || dns_cache_negative_p (err))
+      && (item = new_dns_cache_item (lookup)))
+    {
+      item->err = err;
+      if (!err && r_key && *r_key)
+        {
+          item->keylen = r_keylen? *r_keylen : 0;
+          item->key = xtrymalloc (item->keylen? item->keylen : 1);
+          if (item->key)
+            memcpy (item->key, *r_key, item->keylen);
+        }
+      if (!err && *r_fpr)
+        {
+          item->fprlen = *r_fprlen;
+          item->fpr = xtrymalloc (item->fprlen);
+          if (item->fpr)
+            memcpy (item->fpr, *r_fpr, item->fprlen);
+        }
+      if (!err && *r_url)
+        item->url = xtrystrdup (*r_url);
+      if ((r_key && *r_key && !item->key)
+          || (*r_fpr && !item->fpr)
+          || (*r_url && !item->url))
+        release_dns_cache_item (item);  /* Out of core.  */
+      else
+        put_dns_cache_item (item, err? DNS_CACHE_NEG_TTL : ttl);
+    }
+  xfree (lookup);
 
   if (opt_debug)
     log_debug ("dns: get_dns_cert(%s): %s\n", name, gpg_strerror (err));
@@ -1864,11 +2544,12 @@ priosort(const void *a,const void *b)
 
 /* Libdns based helper for getsrv.  Note that it is expected that NULL
  * is stored at the address of LIST and 0 is stored at the address of
- * R_COUNT.  */
+ * R_COUNT.  The lowest TTL of the records is stored at R_TTL.  */
 #ifdef USE_LIBDNS
 static gpg_error_t
 getsrv_libdns (ctrl_t ctrl,
-               const char *name, struct srventry **list, unsigned int *r_count)
+               const char *name, struct srventry **list, unsigned int *r_count,
+               unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1879,6 +2560,8 @@ getsrv_libdns (ctrl_t ctrl,
   int derr;
   unsigned int srvcount = 0;
 
+  *r_ttl = DNS_CACHE_MAX_TTL;
+
   err = libdns_res_open (ctrl, &res);
   if (err)
     goto leave;
@@ -1929,6 +2612,8 @@ getsrv_libdns (ctrl_t ctrl,
       err = libdns_error_to_gpg_error (dns_srv_parse(&dsrv, &rr, ans));
       if (err)
         goto leave;
+      if (rr.ttl < *r_ttl)
+        *r_ttl = rr.ttl;
 
       newlist = xtryrealloc (*list, (srvcount+1)*sizeof(struct srventry));
       if (!newlist)
@@ -1958,8 +2643,8 @@ getsrv_libdns (ctrl_t ctrl,
       xfree (*list);
       *list = NULL;
     }
+  libdns_res_close (res, !!ans);
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -1967,10 +2652,12 @@ getsrv_libdns (ctrl_t ctrl,
 
 /* Standard resolver based helper for getsrv.  Note that it is
  * expected that NULL is stored at the address of LIST and 0 is stored
- * at the address of R_COUNT.  */
+ * at the address of R_COUNT.  The lowest TTL of the records is stored
+ * at R_TTL.  */
 static gpg_error_t
 getsrv_standard (const char *name,
-                 struct srventry **list, unsigned int *r_count)
+                 struct srventry **list, unsigned int *r_count,
+                 unsigned int *r_ttl)
 {
 #ifdef HAVE_SYSTEM_RESOLVER
   union {
@@ -1984,6 +2671,9 @@ getsrv_standard (const char *name,
   u16 dlen;
   unsigned int srvcount = 0;
   u16 count;
+  u32 ttl;
+
+  *r_ttl = DNS_CACHE_MAX_TTL;
 
   /* Do not allow a query using the standard resolver in Tor mode.  */
   if (tor_mode)
@@ -2046,7 +2736,10 @@ getsrv_standard (const char *name,
       if (class != C_IN)
         goto fail;
 
-      pt += 4; /* ttl */
+      ttl = buf32_to_u32 (pt);
+      if (ttl < *r_ttl)
+        *r_ttl = ttl;
+      pt += 4;
       dlen = buf16_to_u16 (pt);
       pt += 2;
 
@@ -2087,6 +2780,7 @@ getsrv_standard (const char *name,
   (void)name;
   (void)list;
   (void)r_count;
+  *r_ttl = 0;
   return gpg_error (GPG_ERR_NOT_SUPPORTED);
 
 #endif /*!HAVE_SYSTEM_RESOLVER*/
@@ -2104,7 +2798,10 @@ get_dns_srv (ctrl_t ctrl,
 {
   gpg_error_t err;
   char *namebuffer = NULL;
+  char *lookup = NULL;
+  dns_cache_item_t item;
   unsigned int srvcount;
+  unsigned int ttl;
   int i;
 
   *list = NULL;
@@ -2125,16 +2822,56 @@ get_dns_srv (ctrl_t ctrl,
     }
 
 
-#ifdef USE_LIBDNS
-  if (!standard_resolver)
+  /* The cache holds the records in the order received; the
+   * weighting below is done for each request.  */
+  lookup = xtryasprintf ("S:%s", name);
+  if (lookup && (item = find_dns_cache_item (lookup)))
     {
-      err = getsrv_libdns (ctrl, name, list, &srvcount);
-      if (err && libdns_switch_port_p (err))
-        err = getsrv_libdns (ctrl, name, list, &srvcount);
+      err = item->err;
+      if (!err && item->srvcount)
+        {
+          *list = xtrymalloc (item->srvcount * sizeof **list);
+          if (!*list)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*list, item->srvlist, item->srvcount * sizeof **list);
+              srvcount = item->srvcount;
+            }
+        }
     }
   else
+    {
+#ifdef USE_LIBDNS
+      if (!standard_resolver)
+        {
+          err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+          if (err && libdns_switch_port_p (err))
+            err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+        }
+      else
 #endif /*USE_LIBDNS*/
-    err = getsrv_standard (name, list, &srvcount);
+        err = getsrv_standard (name, list, &srvcount, &ttl);
+
+      if (lookup && (!err || dns_cache_negative_p (err))
+          && (item = new_dns_cache_item (lookup)))
+        {
+          item->err = err;
+          if (!err && srvcount)
+            {
+              item->srvlist = xtrymalloc (srvcount * sizeof **list);
+              if (item->srvlist)
+                {
+                  memcpy (item->srvlist, *list, srvcount * sizeof **list);
+                  item->srvcount = srvcount;
+                }
+            }
+          if (!err && srvcount && !item->srvlist)
+            release_dns_cache_item (item);  /* Out of core.  */
+          else
+            put_dns_cache_item (item, err? DNS_CACHE_NEG_TTL : ttl);
+        }
+    }
 
   if (err)
     {
@@ -2226,6 +2963,7 @@ get_dns_srv (ctrl_t ctrl,
     }
   if (!err)
     *r_count = srvcount;
+  xfree (lookup);
   xfree (namebuffer);
   return err;
 }
@@ -2296,8 +3034,8 @@ get_dns_cname_libdns (ctrl_t ctrl, const char *name, char **r_cname)
     }
 
  leave:
+  libdns_res_close (res, !!ans);
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -22,8 +22,10 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "dirmngr.h"
+#include "../common/i18n.h"
 
 
 /* Number of bucket for the hash array and limit for the length of a
@@ -38,6 +40,17 @@
 #define NO_OF_DOMAINBUCKETS  103
 #define MAX_DOMAINBUCKET_LEN  20
 
+/* The name of the file in the cache directory used to keep the
+ * domain information across restarts and its version.  */
+#define DOMAININFO_FILE     "domaininfo.txt"
+#define DOMAININFO_VERSION  1
+
+/* The time in seconds we trust the information about a domain.  A
+ * missing domain is checked again after a day and the WKD support
+ * after a week.  */
+#define DOMAININFO_TTL          (7 * 86400)
+#define DOMAININFO_NO_NAME_TTL  (86400)
+
 
 /* Object to keep track of a domain name.  */
 struct domaininfo_s
@@ -48,6 +61,7 @@ struct domaininfo_s
   unsigned int wkd_supported:1;      /* One WKD entry was found.          */
   unsigned int wkd_not_supported:1;  /* Definitely does not support WKD.  */
   unsigned int keepmark:1;           /* Private to insert_or_update().    */
+  time_t updated;                    /* Time of the last update.          */
   char name[1];
 };
 typedef struct domaininfo_s *domaininfo_t;
@@ -55,6 +69,18 @@ typedef struct domaininfo_s *domaininfo_t;
 /* And the hashed array.  */
 static domaininfo_t domainbuckets[NO_OF_DOMAINBUCKETS];
 
+/* Set if the table has been loaded from the file.  */
+static int domaininfo_loaded;
+
+/* Set if the table needs to be written to the file.  */
+static int domaininfo_dirty;
+
+/* Set while the table is being written to the file.  */
+static int domaininfo_saving;
+
+
+static void domaininfo_load (void);
+
 
 /* The hash function we use.  Must not call a system function.  */
 static inline u32
@@ -80,6 +106,16 @@ hash_domain (const char *domain)
 }
 
 
+/* Return true if the information in DI is too old to be used.  */
+static int
+is_expired (domaininfo_t di, time_t now)
+{
+  time_t ttl = di->no_name? DOMAININFO_NO_NAME_TTL : DOMAININFO_TTL;
+
+  return di->updated + ttl < now;
+}
+
+
 void
 domaininfo_print_stats (void)
 {
@@ -126,21 +162,29 @@ int
 domaininfo_is_wkd_not_supported (const char *domain)
 {
   domaininfo_t di;
+  time_t now;
+
+  if (!domaininfo_loaded)
+    domaininfo_load ();
 
+  now = gnupg_get_time ();
   for (di = domainbuckets[hash_domain (domain)]; di; di = di->next)
     if (!strcmp (di->name, domain))
-      return !!di->wkd_not_supported;
+      return di->wkd_not_supported && !is_expired (di, now);
 
   return 0;  /* We don't know.  */
 }
 
 
 /* Core update function.  DOMAIN is expected to be lowercase.
- * CALLBACK is called to update the existing or the newly inserted
- * item.  */
+ * CALLBACK is called with OPAQUE to update the existing or the newly
+ * inserted item.  UPDATED is the time of this information; it is
+ * stored unless the item has more recent information.  */
 static void
-insert_or_update (const char *domain,
-                  void (*callback)(domaininfo_t di, int insert_mode))
+insert_or_update (const char *domain, time_t updated,
+                  void (*callback)(domaininfo_t di, int insert_mode,
+                                   void *opaque),
+                  void *opaque)
 {
   domaininfo_t di;
   domaininfo_t di_new;
@@ -155,7 +199,10 @@ insert_or_update (const char *domain,
   for (di = domainbuckets[hash]; di; di = di->next)
     if (!strcmp (di->name, domain))
       {
-        callback (di, 0);  /* Update */
+        callback (di, 0, opaque);  /* Update */
+        if (updated > di->updated)
+          di->updated = updated;
+        domaininfo_dirty = 1;
         return;
       }
 
@@ -169,7 +216,10 @@ insert_or_update (const char *domain,
   for (count=0, di = domainbuckets[hash]; di; di = di->next, count++)
     if (!strcmp (di->name, domain))
       {
-        callback (di, 0);  /* Update */
+        callback (di, 0, opaque);  /* Update */
+        if (updated > di->updated)
+          di->updated = updated;
+        domaininfo_dirty = 1;
         xfree (di_new);
         return;
       }
@@ -261,7 +311,9 @@ insert_or_update (const char *domain,
     }
 
   /* Insert */
-  callback (di_new, 1);
+  callback (di_new, 1, opaque);
+  di_new->updated = updated;
+  domaininfo_dirty = 1;
   di = di_new;
   di->next = domainbuckets[hash];
   domainbuckets[hash] = di;
@@ -289,9 +341,10 @@ insert_or_update (const char *domain,
 
 /* Helper for domaininfo_set_no_name.  May not do any syscalls. */
 static void
-set_no_name_cb (domaininfo_t di, int insert_mode)
+set_no_name_cb (domaininfo_t di, int insert_mode, void *opaque)
 {
   (void)insert_mode;
+  (void)opaque;
 
   di->no_name = 1;
   /* Obviously the domain is in this case also not supported.  */
@@ -307,15 +360,16 @@ set_no_name_cb (domaininfo_t di, int insert_mode)
 void
 domaininfo_set_no_name (const char *domain)
 {
-  insert_or_update (domain, set_no_name_cb);
+  insert_or_update (domain, gnupg_get_time (), set_no_name_cb, NULL);
 }
 
 
 /* Helper for domaininfo_set_wkd_supported.  May not do any syscalls. */
 static void
-set_wkd_supported_cb (domaininfo_t di, int insert_mode)
+set_wkd_supported_cb (domaininfo_t di, int insert_mode, void *opaque)
 {
   (void)insert_mode;
+  (void)opaque;
 
   di->wkd_supported = 1;
   /* The next will already be set unless the domain enabled WKD in the
@@ -328,15 +382,16 @@ set_wkd_supported_cb (domaininfo_t di, int insert_mode)
 void
 domaininfo_set_wkd_supported (const char *domain)
 {
-  insert_or_update (domain, set_wkd_supported_cb);
+  insert_or_update (domain, gnupg_get_time (), set_wkd_supported_cb, NULL);
 }
 
 
 /* Helper for domaininfo_set_wkd_not_supported.  May not do any syscalls. */
 static void
-set_wkd_not_supported_cb (domaininfo_t di, int insert_mode)
+set_wkd_not_supported_cb (domaininfo_t di, int insert_mode, void *opaque)
 {
   (void)insert_mode;
+  (void)opaque;
 
   di->wkd_not_supported = 1;
   di->wkd_supported = 0;
@@ -347,15 +402,17 @@ set_wkd_not_supported_cb (domaininfo_t di, int insert_mode)
 void
 domaininfo_set_wkd_not_supported (const char *domain)
 {
-  insert_or_update (domain, set_wkd_not_supported_cb);
+  insert_or_update (domain, gnupg_get_time (), set_wkd_not_supported_cb, NULL);
 }
 
 
 
 /* Helper for domaininfo_set_wkd_not_found.  May not do any syscalls. */
 static void
-set_wkd_not_found_cb (domaininfo_t di, int insert_mode)
+set_wkd_not_found_cb (domaininfo_t di, int insert_mode, void *opaque)
 {
+  (void)opaque;
+
   /* Set the not found flag but there is no need to do this if we
    * already know that the domain either does not support WKD or we
    * know that it supports WKD.  */
@@ -374,5 +431,209 @@ set_wkd_not_found_cb (domaininfo_t di, int insert_mode)
 void
 domaininfo_set_wkd_not_found (const char *domain)
 {
-  insert_or_update (domain, set_wkd_not_found_cb);
+  insert_or_update (domain, gnupg_get_time (), set_wkd_not_found_cb, NULL);
+}
+
+
+
+/* Helper for domaininfo_load.  May not do any syscalls.  */
+static void
+set_loaded_cb (domaininfo_t di, int insert_mode, void *opaque)
+{
+  domaininfo_t item = opaque;
+
+  if (!insert_mode)
+    return;  /* We already have more recent information.  */
+
+  di->no_name = item->no_name;
+  di->wkd_not_found = item->wkd_not_found;
+  di->wkd_supported = item->wkd_supported;
+  di->wkd_not_supported = item->wkd_not_supported;
+}
+
+
+/* Read the domain information from the cache file.  Each line of
+ * that file is either a version line "v:1:" or a record
+ *
+ *   d:<domain>:<flags>:<updated>:
+ *
+ * where FLAGS is a string with the letters 'n' for no_name, 'f' for
+ * wkd_not_found, 's' for wkd_supported and 'u' for wkd_not_supported
+ * and UPDATED the time of the last update in seconds since Epoch.
+ * Expired records are ignored.  */
+static void
+domaininfo_load (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[512];
+  char *field[6];
+  char *p, *endp;
+  int nfields, lineno, any_version;
+  struct domaininfo_s item;
+  time_t now;
+
+  domaininfo_loaded = 1;
+
+  fname = make_filename_try (opt.homedir_cache, DOMAININFO_FILE, NULL);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("error opening '%s': %s\n"),
+                  fname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (fname);
+      return;
+    }
+
+  now = gnupg_get_time ();
+  any_version = 0;
+  lineno = 0;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      lineno++;
+      if (!*line || line[strlen (line)-1] != '\n')
+        break;  /* Too long or incomplete line.  */
+      if (*line == '#')
+        continue;
+
+      for (nfields=0, p=line;
+           nfields < DIM (field) && (endp = strchr (p, ':')); p = endp+1)
+        {
+          *endp = 0;
+          field[nfields++] = p;
+        }
+
+      if (nfields >= 2 && !strcmp (field[0], "v"))
+        {
+          if (atoi (field[1]) != DOMAININFO_VERSION)
+            break;
+          any_version = 1;
+        }
+      else if (any_version && nfields == 4 && !strcmp (field[0], "d")
+               && *field[1])
+        {
+          memset (&item, 0, sizeof item);
+          item.no_name = !!strchr (field[2], 'n');
+          item.wkd_not_found = !!strchr (field[2], 'f');
+          item.wkd_supported = !!strchr (field[2], 's');
+          item.wkd_not_supported = !!strchr (field[2], 'u');
+          item.updated = (time_t)strtoul (field[3], NULL, 10);
+          if (!is_expired (&item, now) && item.updated <= now)
+            insert_or_update (field[1], item.updated, set_loaded_cb, &item);
+        }
+      else
+        {
+          log_info ("%s:%d: invalid line in domaininfo file\n",
+                    fname, lineno);
+          break;
+        }
+    }
+  es_fclose (fp);
+  xfree (fname);
+
+  domaininfo_dirty = 0;
+}
+
+
+/* Write the domain information to the cache file if it has been
+ * changed.  */
+static void
+domaininfo_save (void)
+{
+  gpg_error_t err;
+  domaininfo_t di;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  estream_t memfp = NULL;
+  estream_t fp = NULL;
+  void *buffer = NULL;
+  size_t buflen, nwritten;
+  time_t now;
+  int bidx;
+
+  if (!domaininfo_loaded || !domaininfo_dirty || domaininfo_saving)
+    return;
+  domaininfo_saving = 1;
+
+  /* First print to a memory stream so that other threads can't modify
+   * the table while we are writing it.  */
+  memfp = es_fopenmem (0, "w+b");
+  if (!memfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  now = gnupg_get_time ();
+  es_fprintf (memfp, "# Domain info cache file - do not edit\nv:%d:\n",
+              DOMAININFO_VERSION);
+  for (bidx = 0; bidx < NO_OF_DOMAINBUCKETS; bidx++)
+    for (di = domainbuckets[bidx]; di; di = di->next)
+      if (!is_expired (di, now) && !strpbrk (di->name, ":\n"))
+        es_fprintf (memfp, "d:%s:%s%s%s%s:%lu:\n",
+                    di->name,
+                    di->no_name? "n":"",
+                    di->wkd_not_found? "f":"",
+                    di->wkd_supported? "s":"",
+                    di->wkd_not_supported? "u":"",
+                    (unsigned long)di->updated);
+  if (es_fclose_snatch (memfp, &buffer, &buflen))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memfp = NULL;
+  domaininfo_dirty = 0;
+
+  fname = make_filename_try (opt.homedir_cache, DOMAININFO_FILE, NULL);
+  tmpfname = fname? strconcat (fname, ".tmp", NULL) : NULL;
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_write (fp, buffer, buflen, &nwritten))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      fp = NULL;
+      goto leave;
+    }
+  fp = NULL;
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    {
+      log_error (_("error writing '%s': %s\n"),
+                 tmpfname? tmpfname : DOMAININFO_FILE, gpg_strerror (err));
+      domaininfo_dirty = 1;
+    }
+  es_fclose (fp);
+  es_fclose (memfp);
+  es_free (buffer);
+  xfree (tmpfname);
+  xfree (fname);
+  domaininfo_saving = 0;
+}
+
+
+/* Write the domain information to disk.  This is called by the
+ * housekeeping thread and on shutdown.  */
+void
+domaininfo_housekeeping (void)
+{
+  domaininfo_save ();
 }
@@ -0,0 +1,632 @@
+/* http-cache.c - On-disk cache for HTTP responses
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* This cache is used for WKD lookups and HKP gets so that repeated
+ * lookups of the same address do not always go to the network.  Each
+ * response is stored in a file named after the SHA-256 hash of the
+ * cache key in the directory HTTP_CACHE_DIR below the cache
+ * directory.  A file starts with header lines
+ *
+ *   GnuPG-HTTP-Cache 1
+ *   status <http_status>
+ *   expires <seconds_since_epoch>
+ *   etag <etag>
+ *
+ * followed by an empty line and the body of the response.  The etag
+ * line is optional.  The status is either 200 or 404; the latter is
+ * a negative entry without a body.  The modification time of a file
+ * is updated on each hit and used to prune the least recently used
+ * files.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef HAVE_W32_SYSTEM
+# include <sys/utime.h>
+#else
+# include <utime.h>
+#endif
+
+#include "dirmngr.h"
+#include "misc.h"
+
+
+/* The name of the directory below the cache directory.  */
+#define HTTP_CACHE_DIR "http-cache.d"
+
+/* The maximum size of all cached files and of one response.  */
+#define HTTP_CACHE_MAX_SIZE   (8 * 1024 * 1024)
+#define HTTP_CACHE_MAX_ENTRY  (256 * 1024)
+
+/* The time in seconds a response without an explicit lifetime is
+ * considered fresh if heuristics are allowed, the time a "404" is
+ * cached in that case, and the upper limit for any lifetime.  */
+#define HTTP_CACHE_DEF_TTL  3600
+#define HTTP_CACHE_NEG_TTL  900
+#define HTTP_CACHE_MAX_TTL  (7*86400)
+
+/* Stale files are removed after this many seconds.  */
+#define HTTP_CACHE_KEEP_STALE  86400
+
+/* The maximum length of an etag we store.  */
+#define HTTP_CACHE_MAX_ETAG  200
+
+
+/* The object used for one lookup.  */
+struct http_cache_s
+{
+  char *fname;          /* The name of the cache file.  */
+  unsigned int heuristic:1; /* Use a default lifetime.  */
+  unsigned int stale:1; /* A stale positive entry exists.  */
+  char *etag;           /* The etag of the stale entry or NULL.  */
+};
+
+
+/* Counters for GETINFO.  */
+static struct {
+  unsigned long hits;
+  unsigned long neg_hits;
+  unsigned long revalidated;
+  unsigned long stored;
+  unsigned long misses;
+} cache_stats;
+
+
+
+/* Return the malloced name of the cache directory and create that
+ * directory if needed.  Returns NULL on error.  */
+static char *
+get_cache_dir (void)
+{
+  char *dname;
+  struct stat sb;
+
+  dname = make_filename_try (opt.homedir_cache, HTTP_CACHE_DIR, NULL);
+  if (!dname)
+    return NULL;
+  if (stat (dname, &sb) && gnupg_mkdir (dname, "-rwx"))
+    {
+      log_error (_("error creating directory '%s': %s\n"),
+                 dname, strerror (errno));
+      xfree (dname);
+      return NULL;
+    }
+  return dname;
+}
+
+
+/* Read the header of the cache file FP.  On success the status, the
+ * expiration time and a malloced etag or NULL are stored at the
+ * provided addresses and FP is positioned at the body.  */
+static gpg_error_t
+read_header (estream_t fp, unsigned int *r_status, time_t *r_expires,
+             char **r_etag)
+{
+  char line[HTTP_CACHE_MAX_ETAG + 20];
+  size_t n;
+  int lnr = 0;
+
+  *r_status = 0;
+  *r_expires = 0;
+  *r_etag = NULL;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      n = strlen (line);
+      if (!n || line[n-1] != '\n')
+        break;  /* Line too long.  */
+      line[--n] = 0;
+      if (!lnr++)
+        {
+          if (strcmp (line, "GnuPG-HTTP-Cache 1"))
+            break;
+        }
+      else if (!n)
+        {
+          if (*r_status)
+            return 0;
+          break;
+        }
+      else if (!strncmp (line, "status ", 7))
+        *r_status = strtoul (line + 7, NULL, 10);
+      else if (!strncmp (line, "expires ", 8))
+        *r_expires = (time_t)strtoul (line + 8, NULL, 10);
+      else if (!strncmp (line, "etag ", 5) && !*r_etag)
+        {
+          *r_etag = xtrystrdup (line + 5);
+          if (!*r_etag)
+            return gpg_error_from_syserror ();
+        }
+    }
+
+  xfree (*r_etag);
+  *r_etag = NULL;
+  return gpg_error (GPG_ERR_INV_DATA);
+}
+
+
+/* Compute the expiration time for the response in HTTP.  Returns 0 if
+ * the response shall not be stored.  Stores true at R_REVALIDATE if
+ * an entry without a lifetime shall be stored for revalidation.  */
+static time_t
+compute_expires (http_cache_t cache, http_t http, unsigned int status,
+                 int *r_revalidate)
+{
+  const char *s;
+  long ttl = -1;
+
+  *r_revalidate = 0;
+  s = http_get_header (http, "Cache-Control");
+  if (s)
+    {
+      const char *p;
+
+      if (ascii_memistr (s, strlen (s), "no-store"))
+        return 0;
+      if ((p = ascii_memistr (s, strlen (s), "max-age=")))
+        ttl = atol (p + 8);
+      else if (ascii_memistr (s, strlen (s), "no-cache"))
+        ttl = 0;
+    }
+  if (ttl < 0)
+    {
+      if (!cache->heuristic)
+        ttl = 0;
+      else
+        ttl = status == 200? HTTP_CACHE_DEF_TTL : HTTP_CACHE_NEG_TTL;
+    }
+  if (ttl > HTTP_CACHE_MAX_TTL)
+    ttl = HTTP_CACHE_MAX_TTL;
+
+  if (!ttl)
+    {
+      /* Without a lifetime the entry is only useful for conditional
+       * requests.  */
+      if (status != 200 || !http_get_header (http, "ETag"))
+        return 0;
+      *r_revalidate = 1;
+    }
+  return gnupg_get_time () + ttl;
+}
+
+
+/* Write a cache file for CACHE with STATUS, EXPIRES, ETAG and the
+ * body {BODY,BODYLEN}.  */
+static gpg_error_t
+write_entry (http_cache_t cache, unsigned int status, time_t expires,
+             const char *etag, const void *body, size_t bodylen)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  estream_t fp;
+
+  tmpfname = strconcat (cache->fname, ".tmp", NULL);
+  if (!tmpfname)
+    return gpg_error_from_syserror ();
+
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error creating '%s': %s\n"), tmpfname, gpg_strerror (err));
+      xfree (tmpfname);
+      return err;
+    }
+  es_fprintf (fp, "GnuPG-HTTP-Cache 1\nstatus %u\nexpires %lu\n",
+              status, (unsigned long)expires);
+  if (etag && strlen (etag) <= HTTP_CACHE_MAX_ETAG && !strchr (etag, '\n'))
+    es_fprintf (fp, "etag %s\n", etag);
+  es_putc ('\n', fp);
+  if (bodylen)
+    es_write (fp, body, bodylen, NULL);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      xfree (tmpfname);
+      return err;
+    }
+
+  err = gnupg_rename_file (tmpfname, cache->fname, NULL);
+  if (err)
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, cache->fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  xfree (tmpfname);
+  return err;
+}
+
+
+/* Return a memory stream with the body of the cache file FNAME.  */
+static gpg_error_t
+open_body (const char *fname, estream_t *r_fp)
+{
+  gpg_error_t err;
+  estream_t fp, memfp;
+  unsigned int status;
+  time_t expires;
+  char *etag;
+
+  *r_fp = NULL;
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  err = read_header (fp, &status, &expires, &etag);
+  xfree (etag);
+  if (!err)
+    {
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        err = gpg_error_from_syserror ();
+      else if ((err = copy_stream (fp, memfp)))
+        es_fclose (memfp);
+      else
+        {
+          es_rewind (memfp);
+          *r_fp = memfp;
+        }
+    }
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Start a cached request for KEY which is usually the URL.  If
+ * HEURISTIC is set, responses without an explicit lifetime are cached
+ * for some time.  On a cache hit a stream with the cached response is
+ * stored at R_FP; GPG_ERR_NO_DATA is returned for a cached "404".
+ * Otherwise an object is stored at R_CACHE which needs to be passed
+ * to http_cache_update after the request and released with
+ * http_cache_release.  R_CACHE may receive NULL if the cache can't be
+ * used; the caller should then proceed without it.  */
+gpg_error_t
+http_cache_open (const char *key, int heuristic,
+                 http_cache_t *r_cache, estream_t *r_fp)
+{
+  gpg_error_t err;
+  http_cache_t cache;
+  unsigned char hash[32];
+  char hexhash[2*32+1];
+  char *dname;
+  estream_t fp;
+  unsigned int status;
+  time_t expires;
+  char *etag;
+
+  *r_cache = NULL;
+  *r_fp = NULL;
+
+  dname = get_cache_dir ();
+  if (!dname)
+    return 0;
+  gcry_md_hash_buffer (GCRY_MD_SHA256, hash, key, strlen (key));
+  bin2hex (hash, 32, hexhash);
+
+  cache = xtrycalloc (1, sizeof *cache);
+  if (!cache)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (dname);
+      return err;
+    }
+  cache->heuristic = !!heuristic;
+  cache->fname = make_filename_try (dname, hexhash, NULL);
+  xfree (dname);
+  if (!cache->fname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (cache);
+      return err;
+    }
+
+  fp = es_fopen (cache->fname, "rb");
+  if (fp && !read_header (fp, &status, &expires, &etag))
+    {
+      es_fclose (fp);
+      fp = NULL;
+      if (expires > gnupg_get_time ())
+        {
+          if (status == 200 && !open_body (cache->fname, r_fp))
+            {
+              cache_stats.hits++;
+              utime (cache->fname, NULL);
+              xfree (etag);
+              http_cache_release (cache);
+              return 0;
+            }
+          else if (status != 200)
+            {
+              cache_stats.neg_hits++;
+              utime (cache->fname, NULL);
+              xfree (etag);
+              http_cache_release (cache);
+              return gpg_error (GPG_ERR_NO_DATA);
+            }
+        }
+      if (status == 200)
+        {
+          cache->stale = 1;
+          cache->etag = etag;
+          etag = NULL;
+        }
+      xfree (etag);
+    }
+  es_fclose (fp);
+
+  cache_stats.misses++;
+  *r_cache = cache;
+  return 0;
+}
+
+
+/* Return the etag to be used for a conditional request or NULL.  */
+const char *
+http_cache_etag (http_cache_t cache)
+{
+  return cache && cache->stale? cache->etag : NULL;
+}
+
+
+/* Update the cache with the response of HTTP.  For a "200" the body
+ * is read and stored; a stream with the body is then stored at R_FP.
+ * For a "304" a stream with the cached body is stored at R_FP.  For a
+ * "404" a negative entry is stored.  If nothing is stored at R_FP
+ * the caller needs to process the response itself.  */
+gpg_error_t
+http_cache_update (http_cache_t cache, http_t http, estream_t *r_fp)
+{
+  gpg_error_t err = 0;
+  unsigned int status;
+  time_t expires;
+  int revalidate;
+  estream_t memfp = NULL;
+  void *body = NULL;
+  size_t bodylen;
+
+  *r_fp = NULL;
+  if (!cache)
+    return 0;
+
+  status = http_get_status_code (http);
+  switch (status)
+    {
+    case 200:
+      expires = compute_expires (cache, http, status, &revalidate);
+      if (!expires)
+        break;
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      err = copy_stream (http_get_read_ptr (http), memfp);
+      if (err)
+        break;
+      if (es_fclose_snatch (memfp, &body, &bodylen))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      memfp = NULL;
+      if (bodylen <= HTTP_CACHE_MAX_ENTRY
+          && !write_entry (cache, status, revalidate? 0 : expires,
+                           http_get_header (http, "ETag"), body, bodylen))
+        cache_stats.stored++;
+      *r_fp = es_fopenmem_init (0, "rb", body, bodylen);
+      if (!*r_fp)
+        err = gpg_error_from_syserror ();
+      break;
+
+    case 304:
+      if (!cache->stale)
+        break;
+      expires = compute_expires (cache, http, 200, &revalidate);
+      err = open_body (cache->fname, &memfp);
+      if (err)
+        break;
+      if (es_fclose_snatch (memfp, &body, &bodylen))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      memfp = NULL;
+      cache_stats.revalidated++;
+      if (expires)
+        write_entry (cache, 200, revalidate? 0 : expires,
+                     cache->etag, body, bodylen);
+      *r_fp = es_fopenmem_init (0, "rb", body, bodylen);
+      if (!*r_fp)
+        err = gpg_error_from_syserror ();
+      break;
+
+    case 404:
+      expires = compute_expires (cache, http, status, &revalidate);
+      if (expires && !revalidate
+          && !write_entry (cache, status, expires, NULL, NULL, 0))
+        cache_stats.stored++;
+      break;
+
+    default:
+      break;
+    }
+
+  es_fclose (memfp);
+  es_free (body);
+  return err;
+}
+
+
+/* Release the object CACHE.  */
+void
+http_cache_release (http_cache_t cache)
+{
+  if (!cache)
+    return;
+  xfree (cache->fname);
+  xfree (cache->etag);
+  xfree (cache);
+}
+
+
+
+/* Helper for http_cache_housekeeping.  */
+struct cache_file_s
+{
+  char *fname;
+  time_t mtime;
+  off_t size;
+};
+
+static int
+compare_cache_files (const void *a_arg, const void *b_arg)
+{
+  const struct cache_file_s *a = a_arg;
+  const struct cache_file_s *b = b_arg;
+
+  return a->mtime < b->mtime? -1 : a->mtime > b->mtime;
+}
+
+
+/* Remove stale files and, if the cache is too large, the least
+ * recently used files.  Called by the housekeeping thread.  */
+void
+http_cache_housekeeping (void)
+{
+  char *dname;
+  DIR *dir;
+  struct dirent *de;
+  struct stat sb;
+  struct cache_file_s *files = NULL;
+  size_t nfiles = 0;
+  size_t allocated = 0;
+  unsigned long long total = 0;
+  time_t curtime = gnupg_get_time ();
+  char *fname;
+  estream_t fp;
+  unsigned int status;
+  time_t expires;
+  char *etag;
+  size_t i;
+  int remove_it;
+
+  dname = make_filename_try (opt.homedir_cache, HTTP_CACHE_DIR, NULL);
+  if (!dname)
+    return;
+  dir = opendir (dname);
+  if (!dir)
+    {
+      xfree (dname);
+      return;
+    }
+
+  while ((de = readdir (dir)))
+    {
+      if (strlen (de->d_name) < 64 || *de->d_name == '.')
+        continue;
+      fname = make_filename_try (dname, de->d_name, NULL);
+      if (!fname)
+        break;
+      if (stat (fname, &sb))
+        {
+          xfree (fname);
+          continue;
+        }
+
+      /* Remove left over temporary files and broken or long expired
+       * entries.  */
+      remove_it = !!strchr (de->d_name, '.');
+      if (!remove_it)
+        {
+          fp = es_fopen (fname, "rb");
+          if (!fp || read_header (fp, &status, &expires, &etag))
+            remove_it = 1;
+          else
+            {
+              if (expires + HTTP_CACHE_KEEP_STALE < curtime && !etag)
+                remove_it = 1;
+              xfree (etag);
+            }
+          es_fclose (fp);
+        }
+      if (remove_it)
+        {
+          gnupg_remove (fname);
+          xfree (fname);
+          continue;
+        }
+
+      if (nfiles == allocated)
+        {
+          struct cache_file_s *tmp;
+
+          tmp = xtryrealloc (files, (allocated + 64) * sizeof *files);
+          if (!tmp)
+            {
+              xfree (fname);
+              break;
+            }
+          files = tmp;
+          allocated += 64;
+        }
+      files[nfiles].fname = fname;
+      files[nfiles].mtime = sb.st_mtime;
+      files[nfiles].size = sb.st_size;
+      total += sb.st_size;
+      nfiles++;
+    }
+  closedir (dir);
+  xfree (dname);
+
+  if (total > HTTP_CACHE_MAX_SIZE)
+    {
+      qsort (files, nfiles, sizeof *files, compare_cache_files);
+      for (i=0; i < nfiles && total > HTTP_CACHE_MAX_SIZE; i++)
+        {
+          if (!gnupg_remove (files[i].fname))
+            total -= files[i].size;
+        }
+    }
+
+  for (i=0; i < nfiles; i++)
+    xfree (files[i].fname);
+  xfree (files);
+}
+
+
+/* Return a malloced string with statistics for GETINFO.  The fields
+ * are "hits neg_hits revalidated stored misses".  */
+char *
+http_cache_info (void)
+{
+  return xtryasprintf ("%lu %lu %lu %lu %lu",
+                       cache_stats.hits, cache_stats.neg_hits,
+                       cache_stats.revalidated, cache_stats.stored,
+                       cache_stats.misses);
+}
@@ -100,6 +100,7 @@
 #include "../common/util.h"
 #include "../common/i18n.h"
 #include "../common/sysutils.h" /* (gnupg_fd_t) */
+#include "../common/timing.h"   /* (gnupg_timing_now) */
 #include "dns-stuff.h"
 #include "dirmngr-status.h"    /* (dirmngr_status_printf)  */
 #include "http.h"
@@ -129,6 +130,10 @@
 
 #define HTTP_PROXY_ENV           "http_proxy"
 #define MAX_LINELEN 20000  /* Max. length of a HTTP header line. */
+#define CONNECTION_ATTEMPT_DELAY 250  /* See RFC-8305 (in milliseconds). */
+#define CONN_POOL_SIZE 16          /* Max. number of idle connections.  */
+#define CONN_POOL_IDLE_TIMEOUT 15  /* Seconds to keep an idle connection. */
+#define READ_BUFFER_SIZE 32768     /* Buffer size of the response stream. */
 #define VALID_URI_CHARS "abcdefghijklmnopqrstuvwxyz"   \
                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"   \
                         "01234567890@"                 \
@@ -212,6 +217,13 @@ struct cookie_s
      the content length.  */
   uint64_t content_length;
   unsigned int content_length_valid:1;
+
+  /* Set if the server agreed to keep the connection open.  */
+  unsigned int keep_alive:1;
+
+  /* The key for the connection pool or NULL if the connection may
+   * not be reused.  Only used for the read cookie.  */
+  char *pool_key;
 };
 typedef struct cookie_s *cookie_t;
 
@@ -242,7 +254,8 @@ struct http_session_s
 
   int refcount;    /* Number of references to this object.  */
 #ifdef HTTP_USE_GNUTLS
-  gnutls_certificate_credentials_t certcred;
+  struct certcred_s *certcred;  /* Shared CA certificates.  */
+  char *resume_key;             /* Key for the TLS resumption cache.  */
 #endif /*HTTP_USE_GNUTLS*/
 #ifdef USE_TLS
   tls_session_t tls_session;
@@ -305,7 +318,30 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  char *pool_key;        /* Key for the connection pool or NULL.  */
+};
+
+
+/* An idle connection kept for reuse.  The key identifies the scheme,
+ * server, port, and the parameters of the session; SESSION holds the
+ * TLS state of the connection.  */
+struct conn_pool_item_s
+{
+  char *key;              /* Malloced key or NULL if the item is unused. */
+  my_socket_t sock;
+  http_session_t session;
+  time_t last_used;
 };
+static struct conn_pool_item_s conn_pool[CONN_POOL_SIZE];
+
+/* Statistics for the connection pool.  */
+static struct
+{
+  unsigned long created;  /* New connections eligible for the pool.  */
+  unsigned long reused;   /* Requests using a pooled connection.  */
+  unsigned long stale;    /* Pooled connections closed by the server.  */
+  unsigned long evicted;  /* Pooled connections closed by us.  */
+} conn_pool_stats;
 
 
 /* Two flags to enable verbose and debug mode.  Although currently not
@@ -326,6 +362,35 @@ static strlist_t cfg_ca_certlist;
 /* The global callback for net activity.  */
 static void (*netactivity_cb)(void);
 
+#ifdef HTTP_USE_GNUTLS
+/* Loading the CA certificates is expensive and thus the credentials
+ * are shared by all sessions with the same trust flags.  The list
+ * holds one reference to each object.  */
+#define CERTCRED_HKPS_POOL 0x80000000  /* Flag for the KEY field.  */
+struct certcred_s
+{
+  struct certcred_s *next;
+  unsigned int key;      /* The trust flags and CERTCRED_HKPS_POOL.  */
+  int refcount;
+  gnutls_certificate_credentials_t cred;
+};
+static struct certcred_s *certcred_list;
+
+/* A cache with the data to resume TLS sessions.  The key is the
+ * server name and port.  */
+#define TLS_RESUME_CACHE_SIZE 32
+#define TLS_RESUME_LIFETIME 3600  /* Seconds.  */
+struct tls_resume_item_s
+{
+  char *key;            /* Malloced key or NULL if the item is unused.  */
+  gnutls_datum_t data;  /* Allocated by gnutls.  */
+  time_t stored;
+};
+static struct tls_resume_item_s tls_resume_cache[TLS_RESUME_CACHE_SIZE];
+
+static void release_tls_resume_item (struct tls_resume_item_s *item);
+#endif /*HTTP_USE_GNUTLS*/
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -554,6 +619,264 @@ make_header_line (const char *prefix, const char *suffix,
 
 
 
+#ifdef HTTP_USE_GNUTLS
+/* Release a reference to the credentials CC.  */
+static void
+certcred_unref (struct certcred_s *cc)
+{
+  if (!cc || --cc->refcount)
+    return;
+  gnutls_certificate_free_credentials (cc->cred);
+  xfree (cc);
+}
+
+
+/* Drop all cached credentials so that they are loaded again for the
+ * next session.  Credentials still in use are released with their
+ * last session.  Also flush the TLS resumption cache.  */
+static void
+flush_certcreds (void)
+{
+  struct certcred_s *cc;
+  int i;
+
+  while ((cc = certcred_list))
+    {
+      certcred_list = cc->next;
+      certcred_unref (cc);
+    }
+
+  for (i=0; i < TLS_RESUME_CACHE_SIZE; i++)
+    release_tls_resume_item (tls_resume_cache + i);
+}
+
+
+/* Store a reference to the credentials for a session with FLAGS and
+ * INTENDED_HOSTNAME at R_CC.  The credentials are loaded only once
+ * for each combination of trust flags.  */
+static gpg_error_t
+get_certcred (unsigned int flags, const char *intended_hostname,
+              struct certcred_s **r_cc)
+{
+  gpg_error_t err;
+  struct certcred_s *cc;
+  unsigned int key;
+  int rc;
+  strlist_t sl;
+  int add_system_cas = !!(flags & HTTP_FLAG_TRUST_SYS);
+  int is_hkps_pool;
+
+  *r_cc = NULL;
+
+  is_hkps_pool = (intended_hostname
+                  && !ascii_strcasecmp (intended_hostname,
+                                        get_default_keyserver (1)));
+  key = (flags & (HTTP_FLAG_TRUST_DEF|HTTP_FLAG_TRUST_SYS|HTTP_FLAG_TRUST_CFG));
+  if (is_hkps_pool)
+    key |= CERTCRED_HKPS_POOL;
+
+  for (cc = certcred_list; cc; cc = cc->next)
+    if (cc->key == key)
+      {
+        cc->refcount++;
+        *r_cc = cc;
+        return 0;
+      }
+
+  cc = xtrycalloc (1, sizeof *cc);
+  if (!cc)
+    return gpg_error_from_syserror ();
+  cc->key = key;
+
+  rc = gnutls_certificate_allocate_credentials (&cc->cred);
+  if (rc < 0)
+    {
+      log_error ("gnutls_certificate_allocate_credentials failed: %s\n",
+                 gnutls_strerror (rc));
+      xfree (cc);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  /* If the user has not specified a CA list, and they are looking
+   * for the hkps pool from sks-keyservers.net, then default to
+   * Kristian's certificate authority:  */
+  if (!tls_ca_certlist && is_hkps_pool)
+    {
+      char *pemname = make_filename_try (gnupg_datadir (),
+                                         "sks-keyservers.netCA.pem", NULL);
+      if (!pemname)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("setting CA from file '%s' failed: %s\n",
+                     pemname, gpg_strerror (err));
+        }
+      else
+        {
+          rc = gnutls_certificate_set_x509_trust_file
+            (cc->cred, pemname, GNUTLS_X509_FMT_PEM);
+          if (rc < 0)
+            log_info ("setting CA from file '%s' failed: %s\n",
+                      pemname, gnutls_strerror (rc));
+          xfree (pemname);
+        }
+
+      add_system_cas = 0;
+    }
+
+  /* Add configured certificates to the session.  */
+  if ((flags & HTTP_FLAG_TRUST_DEF))
+    {
+      for (sl = tls_ca_certlist; sl; sl = sl->next)
+        {
+          rc = gnutls_certificate_set_x509_trust_file
+            (cc->cred, sl->d,
+             (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
+          if (rc < 0)
+            log_info ("setting CA from file '%s' failed: %s\n",
+                      sl->d, gnutls_strerror (rc));
+        }
+      if (!tls_ca_certlist && !is_hkps_pool)
+        add_system_cas = 1;
+    }
+
+  /* Add system certificates to the session.  */
+  if (add_system_cas)
+    {
+#if GNUTLS_VERSION_NUMBER >= 0x030014
+      static int shown;
+
+      rc = gnutls_certificate_set_x509_system_trust (cc->cred);
+      if (rc < 0)
+        log_info ("setting system CAs failed: %s\n", gnutls_strerror (rc));
+      else if (!shown)
+        {
+          shown = 1;
+          log_info ("number of system provided CAs: %d\n", rc);
+        }
+#endif /* gnutls >= 3.0.20 */
+    }
+
+  /* Add other configured certificates to the session.  */
+  if ((flags & HTTP_FLAG_TRUST_CFG))
+    {
+      for (sl = cfg_ca_certlist; sl; sl = sl->next)
+        {
+          rc = gnutls_certificate_set_x509_trust_file
+            (cc->cred, sl->d,
+             (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
+          if (rc < 0)
+            log_info ("setting extra CA from file '%s' failed: %s\n",
+                      sl->d, gnutls_strerror (rc));
+        }
+    }
+
+  /* One reference for the list and one for the caller.  */
+  cc->refcount = 2;
+  cc->next = certcred_list;
+  certcred_list = cc;
+  *r_cc = cc;
+  return 0;
+}
+
+
+/* Release the resumption data of ITEM.  */
+static void
+release_tls_resume_item (struct tls_resume_item_s *item)
+{
+  if (!item->key)
+    return;
+  xfree (item->key);
+  item->key = NULL;
+  gnutls_free (item->data.data);
+  item->data.data = NULL;
+  item->data.size = 0;
+}
+
+
+/* Prepare SESS so that the TLS session for KEY is resumed if
+ * resumption data is available.  KEY is stored in SESS so that the
+ * data can later be updated using tls_resume_store.  */
+static void
+tls_resume_prepare (http_session_t sess, const char *key)
+{
+  struct tls_resume_item_s *item;
+  int i, rc;
+
+  xfree (sess->resume_key);
+  sess->resume_key = xtrystrdup (key);
+  if (!sess->resume_key)
+    return;
+
+  for (i=0; i < TLS_RESUME_CACHE_SIZE; i++)
+    {
+      item = tls_resume_cache + i;
+      if (!item->key || strcmp (item->key, key))
+        continue;
+      if (time (NULL) - item->stored > TLS_RESUME_LIFETIME)
+        {
+          release_tls_resume_item (item);
+          break;
+        }
+      rc = gnutls_session_set_data (sess->tls_session,
+                                    item->data.data, item->data.size);
+      if (rc < 0)
+        log_info ("gnutls_session_set_data failed: %s\n",
+                  gnutls_strerror (rc));
+      break;
+    }
+}
+
+
+/* Store the current resumption data of the TLS session SESS.  */
+static void
+tls_resume_store (http_session_t sess)
+{
+  struct tls_resume_item_s *item = NULL;
+  gnutls_datum_t data;
+  int i, rc;
+
+  if (!sess->resume_key || !sess->tls_session)
+    return;
+
+  rc = gnutls_session_get_data2 (sess->tls_session, &data);
+  if (rc < 0)
+    return;
+
+  for (i=0; i < TLS_RESUME_CACHE_SIZE; i++)
+    if (tls_resume_cache[i].key
+        && !strcmp (tls_resume_cache[i].key, sess->resume_key))
+      {
+        item = tls_resume_cache + i;
+        break;
+      }
+  if (!item)
+    for (i=0; i < TLS_RESUME_CACHE_SIZE; i++)
+      if (!tls_resume_cache[i].key)
+        {
+          item = tls_resume_cache + i;
+          break;
+        }
+  if (!item)
+    {
+      item = tls_resume_cache;
+      for (i=1; i < TLS_RESUME_CACHE_SIZE; i++)
+        if (tls_resume_cache[i].stored < item->stored)
+          item = tls_resume_cache + i;
+    }
+  release_tls_resume_item (item);
+
+  item->key = xtrystrdup (sess->resume_key);
+  if (!item->key)
+    {
+      gnutls_free (data.data);
+      return;
+    }
+  item->data = data;
+  item->stored = time (NULL);
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
 /* Set verbosity and debug mode for this module. */
 void
 http_set_verbose (int verbose, int debug)
@@ -582,6 +905,9 @@ http_register_tls_ca (const char *fname)
 {
   strlist_t sl;
 
+#ifdef HTTP_USE_GNUTLS
+  flush_certcreds ();
+#endif
   if (!fname)
     {
       free_strlist (tls_ca_certlist);
@@ -611,6 +937,9 @@ http_register_cfg_ca (const char *fname)
 {
   strlist_t sl;
 
+#ifdef HTTP_USE_GNUTLS
+  flush_certcreds ();
+#endif
   if (!fname)
     {
       free_strlist (cfg_ca_certlist);
@@ -666,8 +995,6 @@ close_tls_session (http_session_t sess)
       my_socket_t sock = gnutls_transport_get_ptr (sess->tls_session);
       my_socket_unref (sock, NULL, NULL);
       gnutls_deinit (sess->tls_session);
-      if (sess->certcred)
-        gnutls_certificate_free_credentials (sess->certcred);
 # endif /*HTTP_USE_GNUTLS*/
       xfree (sess->servername);
       sess->tls_session = NULL;
@@ -696,6 +1023,10 @@ session_unref (int lnr, http_session_t sess)
 #ifdef USE_TLS
   close_tls_session (sess);
 #endif /*USE_TLS*/
+#ifdef HTTP_USE_GNUTLS
+  certcred_unref (sess->certcred);
+  xfree (sess->resume_key);
+#endif /*HTTP_USE_GNUTLS*/
 
   sess->magic = 0xdeadbeef;
   xfree (sess);
@@ -754,96 +1085,10 @@ http_session_new (http_session_t *r_session,
   {
     const char *errpos;
     int rc;
-    strlist_t sl;
-    int add_system_cas = !!(flags & HTTP_FLAG_TRUST_SYS);
-    int is_hkps_pool;
-
-    rc = gnutls_certificate_allocate_credentials (&sess->certcred);
-    if (rc < 0)
-      {
-        log_error ("gnutls_certificate_allocate_credentials failed: %s\n",
-                   gnutls_strerror (rc));
-        err = gpg_error (GPG_ERR_GENERAL);
-        goto leave;
-      }
-
-    is_hkps_pool = (intended_hostname
-                    && !ascii_strcasecmp (intended_hostname,
-                                          get_default_keyserver (1)));
-
-    /* If the user has not specified a CA list, and they are looking
-     * for the hkps pool from sks-keyservers.net, then default to
-     * Kristian's certificate authority:  */
-    if (!tls_ca_certlist && is_hkps_pool)
-      {
-        char *pemname = make_filename_try (gnupg_datadir (),
-                                           "sks-keyservers.netCA.pem", NULL);
-        if (!pemname)
-          {
-            err = gpg_error_from_syserror ();
-            log_error ("setting CA from file '%s' failed: %s\n",
-                       pemname, gpg_strerror (err));
-          }
-        else
-          {
-            rc = gnutls_certificate_set_x509_trust_file
-              (sess->certcred, pemname, GNUTLS_X509_FMT_PEM);
-            if (rc < 0)
-              log_info ("setting CA from file '%s' failed: %s\n",
-                        pemname, gnutls_strerror (rc));
-            xfree (pemname);
-          }
-
-        add_system_cas = 0;
-      }
-
-    /* Add configured certificates to the session.  */
-    if ((flags & HTTP_FLAG_TRUST_DEF))
-      {
-        for (sl = tls_ca_certlist; sl; sl = sl->next)
-          {
-            rc = gnutls_certificate_set_x509_trust_file
-              (sess->certcred, sl->d,
-               (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
-            if (rc < 0)
-              log_info ("setting CA from file '%s' failed: %s\n",
-                        sl->d, gnutls_strerror (rc));
-          }
-        if (!tls_ca_certlist && !is_hkps_pool)
-          add_system_cas = 1;
-      }
-
-    /* Add system certificates to the session.  */
-    if (add_system_cas)
-      {
-#if GNUTLS_VERSION_NUMBER >= 0x030014
-        static int shown;
-
-        rc = gnutls_certificate_set_x509_system_trust (sess->certcred);
-        if (rc < 0)
-          log_info ("setting system CAs failed: %s\n", gnutls_strerror (rc));
-        else if (!shown)
-          {
-            shown = 1;
-            log_info ("number of system provided CAs: %d\n", rc);
-          }
-#endif /* gnutls >= 3.0.20 */
-      }
-
-    /* Add other configured certificates to the session.  */
-    if ((flags & HTTP_FLAG_TRUST_CFG))
-      {
-        for (sl = cfg_ca_certlist; sl; sl = sl->next)
-          {
-            rc = gnutls_certificate_set_x509_trust_file
-              (sess->certcred, sl->d,
-               (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
-            if (rc < 0)
-              log_info ("setting extra CA from file '%s' failed: %s\n",
-                        sl->d, gnutls_strerror (rc));
-          }
-      }
 
+    err = get_certcred (flags, intended_hostname, &sess->certcred);
+    if (err)
+      goto leave;
 
     rc = gnutls_init (&sess->tls_session, GNUTLS_CLIENT);
     if (rc < 0)
@@ -868,7 +1113,7 @@ http_session_new (http_session_t *r_session,
       }
 
     rc = gnutls_credentials_set (sess->tls_session,
-                                 GNUTLS_CRD_CERTIFICATE, sess->certcred);
+                                 GNUTLS_CRD_CERTIFICATE, sess->certcred->cred);
     if (rc < 0)
       {
         log_error ("gnutls_credentials_set failed: %s\n", gnutls_strerror (rc));
@@ -935,6 +1180,185 @@ http_session_set_timeout (http_session_t sess, unsigned int timeout)
 
 
 
+/* Close the pooled connection ITEM and mark the item as unused.  */
+static void
+release_pool_item (struct conn_pool_item_s *item)
+{
+  if (!item->key)
+    return;
+  xfree (item->key);
+  item->key = NULL;
+  http_session_unref (item->session);
+  item->session = NULL;
+  my_socket_unref (item->sock, NULL, NULL);
+  item->sock = NULL;
+}
+
+
+/* Return true if the idle socket SOCK may not be used anymore
+ * because the server closed it or sent unexpected data.  */
+static int
+pool_socket_stale_p (my_socket_t sock)
+{
+  fd_set rset;
+  struct timeval tv;
+
+  if (FD2INT (sock->fd) >= FD_SETSIZE)
+    return 1;
+  FD_ZERO (&rset);
+  FD_SET (FD2INT (sock->fd), &rset);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  /* A plain select is sufficient because it does not block.  */
+  return !!select (FD2INT (sock->fd) + 1, &rset, NULL, NULL, &tv);
+}
+
+
+/* Return a malloced key for the connection pool or NULL if the
+ * request HD to SERVER and PORT may not use a pooled connection.  */
+static char *
+make_pool_key (http_t hd, const char *server, unsigned short port,
+               const char *httphost, const char *srvtag)
+{
+  if ((hd->req_type != HTTP_REQ_GET && hd->req_type != HTTP_REQ_POST)
+      || (hd->flags & (HTTP_FLAG_SHUTDOWN | HTTP_FLAG_FORCE_TOR
+                       | HTTP_FLAG_IGNORE_CL)))
+    return NULL;
+
+  return xtryasprintf ("%s://%s:%hu %s %s %u",
+                       hd->uri->use_tls? "https" : "http",
+                       server, port,
+                       httphost? httphost : "-",
+                       srvtag? srvtag : "-",
+                       hd->session? hd->session->flags : 0);
+}
+
+
+/* Take an idle connection for KEY from the pool.  On success true is
+ * returned and the caller owns the references to the socket and the
+ * session stored at R_SOCK and R_SESSION.  */
+static int
+conn_pool_get (const char *key, my_socket_t *r_sock,
+               http_session_t *r_session)
+{
+  struct conn_pool_item_s *item;
+  time_t now = time (NULL);
+  int i;
+
+  for (i=0; i < CONN_POOL_SIZE; i++)
+    {
+      item = conn_pool + i;
+      if (!item->key || strcmp (item->key, key))
+        continue;
+      if (now - item->last_used > CONN_POOL_IDLE_TIMEOUT)
+        {
+          conn_pool_stats.evicted++;
+          release_pool_item (item);
+          continue;
+        }
+      if (pool_socket_stale_p (item->sock))
+        {
+          conn_pool_stats.stale++;
+          release_pool_item (item);
+          continue;
+        }
+
+      xfree (item->key);
+      item->key = NULL;
+      *r_sock = item->sock;
+      item->sock = NULL;
+      *r_session = item->session;
+      item->session = NULL;
+      conn_pool_stats.reused++;
+      if (opt_debug)
+        log_debug ("http.c:conn_pool: reusing connection for '%s'\n", key);
+      return 1;
+    }
+
+  return 0;
+}
+
+
+/* Put the connection SOCK using SESSION into the pool under KEY.
+ * The pool takes its own references.  If the pool is full the least
+ * recently used connection is closed.  */
+static void
+conn_pool_put (const char *key, my_socket_t sock, http_session_t session)
+{
+  struct conn_pool_item_s *item = NULL;
+  char *keycopy;
+  int i;
+
+  keycopy = xtrystrdup (key);
+  if (!keycopy)
+    return;
+
+  for (i=0; i < CONN_POOL_SIZE; i++)
+    if (!conn_pool[i].key)
+      {
+        item = conn_pool + i;
+        break;
+      }
+  if (!item)
+    {
+      item = conn_pool;
+      for (i=1; i < CONN_POOL_SIZE; i++)
+        if (conn_pool[i].last_used < item->last_used)
+          item = conn_pool + i;
+      conn_pool_stats.evicted++;
+      release_pool_item (item);
+    }
+
+  item->key = keycopy;
+  item->sock = my_socket_ref (sock);
+  item->session = http_session_ref (session);
+  item->last_used = time (NULL);
+}
+
+
+/* Close all idle connections which are not anymore usable.  With
+ * FLUSH set all idle connections are closed.  This is called from
+ * the housekeeping thread and on reload.  */
+void
+http_pool_housekeeping (int flush)
+{
+  time_t now = time (NULL);
+  int i;
+
+  for (i=0; i < CONN_POOL_SIZE; i++)
+    if (conn_pool[i].key
+        && (flush
+            || now - conn_pool[i].last_used > CONN_POOL_IDLE_TIMEOUT
+            || pool_socket_stale_p (conn_pool[i].sock)))
+      {
+        conn_pool_stats.evicted++;
+        release_pool_item (conn_pool + i);
+      }
+}
+
+
+/* Return a malloced string with statistics of the connection pool.
+ * The string has the space separated fields
+ *
+ *   <idle> <created> <reused> <stale> <evicted>
+ *
+ * Returns NULL on memory error.  */
+char *
+http_pool_info (void)
+{
+  int i, idle;
+
+  for (idle=i=0; i < CONN_POOL_SIZE; i++)
+    if (conn_pool[i].key)
+      idle++;
+
+  return xtryasprintf ("%d %lu %lu %lu %lu", idle,
+                       conn_pool_stats.created, conn_pool_stats.reused,
+                       conn_pool_stats.stale, conn_pool_stats.evicted);
+}
+
+
+
 
 /* Start a HTTP retrieval and on success store at R_HD a context
    pointer for completing the request and to wait for the response.
@@ -977,6 +1401,7 @@ http_open (ctrl_t ctrl, http_t *r_hd, http_req_t reqtype, const char *url,
       if (hd->fp_write)
         es_fclose (hd->fp_write);
       http_session_unref (hd->session);
+      xfree (hd->pool_key);
       xfree (hd);
     }
   else
@@ -1153,6 +1578,8 @@ http_wait_response (http_t hd)
   cookie->sock = my_socket_ref (hd->sock);
   cookie->session = http_session_ref (hd->session);
   cookie->use_tls = use_tls;
+  cookie->pool_key = hd->pool_key;
+  hd->pool_key = NULL;
 
   hd->read_cookie = cookie;
   hd->fp_read = es_fopencookie (cookie, "r", cookie_functions);
@@ -1161,11 +1588,18 @@ http_wait_response (http_t hd)
       err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
       my_socket_unref (cookie->sock, NULL, NULL);
       http_session_unref (cookie->session);
+      xfree (cookie->pool_key);
       xfree (cookie);
       hd->read_cookie = NULL;
       return err;
     }
 
+  /* The default buffer of the stream is small; with a larger buffer
+   * each call of cookie_read moves a full TLS record or as much as
+   * the socket has and large bodies need far fewer calls.  A failure
+   * to enlarge the buffer is not an error.  */
+  es_setvbuf (hd->fp_read, NULL, _IOFBF, READ_BUFFER_SIZE);
+
   err = parse_response (hd);
 
   if (!err)
@@ -1231,6 +1665,7 @@ http_close (http_t hd, int keep_read_stream)
       hd->headers = tmp;
     }
   xfree (hd->buffer);
+  xfree (hd->pool_key);
   xfree (hd);
 }
 
@@ -1752,6 +2187,9 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
   char *proxy_authstr = NULL;
   char *authstr = NULL;
   assuan_fd_t sock;
+  my_socket_t pooled_sock;
+  http_session_t pooled_session;
+  int reused = 0;
 #ifdef USE_TLS
   int have_http_proxy = 0;
 #endif
@@ -1895,8 +2333,26 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
     }
   else
     {
-      err = connect_server (ctrl,
-                            server, port, hd->flags, srvtag, timeout, &sock);
+      /* Without a proxy we may reuse an idle connection.  The
+       * session of the pooled connection replaces the provided
+       * session because it holds the TLS state.  */
+      hd->pool_key = make_pool_key (hd, server, port, httphost, srvtag);
+      if (hd->pool_key
+          && conn_pool_get (hd->pool_key, &pooled_sock, &pooled_session))
+        {
+          http_session_unref (hd->session);
+          hd->session = pooled_session;
+          hd->sock = pooled_sock;
+          reused = 1;
+          err = 0;
+        }
+      else
+        {
+          err = connect_server (ctrl, server, port, hd->flags, srvtag,
+                                timeout, &sock);
+          if (!err && hd->pool_key)
+            conn_pool_stats.created++;
+        }
     }
 
   if (err)
@@ -1904,11 +2360,15 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       xfree (proxy_authstr);
       return err;
     }
-  hd->sock = my_socket_new (sock);
-  if (!hd->sock)
+  if (!reused)
     {
-      xfree (proxy_authstr);
-      return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      hd->sock = my_socket_new (sock);
+      if (!hd->sock)
+        {
+          xfree (proxy_authstr);
+          return gpg_err_make (default_errsource,
+                               gpg_err_code_from_syserror ());
+        }
     }
 
 #if USE_TLS
@@ -2001,7 +2461,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 #endif	/* USE_TLS */
 
 #if HTTP_USE_NTBTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       estream_t in, out;
 
@@ -2110,7 +2570,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 
     }
 #elif HTTP_USE_GNUTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       int rc;
 
@@ -2121,6 +2581,21 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_gnutls_write);
 
+      /* Try to resume a former session with this server.  This saves
+       * the expensive public key operations of a full handshake.  */
+      if (hd->session->servername)
+        {
+          char *resume_key;
+
+          resume_key = xtryasprintf ("%s:%hu:%x", hd->session->servername,
+                                     port, hd->session->flags);
+          if (resume_key)
+            {
+              tls_resume_prepare (hd->session, resume_key);
+              xfree (resume_key);
+            }
+        }
+
     handshake_again:
       do
         {
@@ -2152,6 +2627,8 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
           xfree (proxy_authstr);
           return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
         }
+      if (opt_debug && gnutls_session_is_resumed (hd->session->tls_session))
+        log_debug ("http.c:send_request: TLS session resumed\n");
 
       hd->session->verify.done = 0;
       if (tls_callback)
@@ -2228,13 +2705,14 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
+         hd->pool_key? "Connection: keep-alive\r\n" : "",
          authstr? authstr:"");
     }
   xfree (p);
@@ -2601,6 +3079,12 @@ parse_response (http_t hd)
         }
     }
 
+  /* The connection can only be reused if the server agreed to keep
+   * it open and we know where the body ends.  */
+  s = http_get_header (hd, "Connection");
+  cookie->keep_alive = (cookie->content_length_valid
+                        && s && ascii_memistr (s, strlen (s), "keep-alive"));
+
   return 0;
 }
 
@@ -2893,12 +3377,201 @@ connect_with_timeout (assuan_fd_t sock,
 }
 
 
+/* Connect to one of the N addresses in ADDRS which are expected to be
+ * sorted by preference.  This is the "Happy Eyeballs" algorithm from
+ * RFC-8305: A new connection attempt is started whenever the previous
+ * one did not succeed within CONNECTION_ATTEMPT_DELAY milliseconds
+ * and the first connection to succeed is used.  Each attempt has at
+ * least TIMEOUT milliseconds to succeed; 0 means no timeout.  On
+ * success the connected socket is stored at R_SOCK.  This may not be
+ * used with a SOCKS proxy because the proxy handshake is done in
+ * blocking mode.  */
+#ifndef HAVE_W32_SYSTEM
+static gpg_error_t
+connect_race (dns_addrinfo_t *addrs, int n, unsigned int timeout,
+              assuan_fd_t *r_sock)
+{
+  gpg_error_t err;
+  gpg_error_t last_err = 0;
+  assuan_fd_t *socks;
+  int *oflags;
+  int started, active, winner, i, maxfd, syserr, use_tval;
+  unsigned long long now, next_attempt, deadline, wait;
+  fd_set rset, wset;
+  struct timeval tval;
+  socklen_t slen;
+
+  *r_sock = ASSUAN_INVALID_FD;
+
+  socks = xtrycalloc (n, sizeof *socks);
+  oflags = xtrycalloc (n, sizeof *oflags);
+  if (!socks || !oflags)
+    {
+      err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      xfree (socks);
+      xfree (oflags);
+      return err;
+    }
+  for (i=0; i < n; i++)
+    socks[i] = ASSUAN_INVALID_FD;
+
+  started = active = 0;
+  winner = -1;
+  next_attempt = deadline = 0;
+  while (winner == -1)
+    {
+      now = gnupg_timing_now ();
+
+      /* Start the next attempt if it is due.  */
+      if (started < n && (!active || now >= next_attempt))
+        {
+          i = started++;
+          socks[i] = my_sock_new_for_addr (addrs[i]->addr, addrs[i]->socktype,
+                                           addrs[i]->protocol);
+          if (socks[i] == ASSUAN_INVALID_FD)
+            {
+              last_err = gpg_err_make (default_errsource,
+                                       gpg_err_code_from_syserror ());
+              log_error ("error creating socket: %s\n",
+                         gpg_strerror (last_err));
+              continue;
+            }
+          oflags[i] = fcntl (socks[i], F_GETFL, 0);
+          if (fcntl (socks[i], F_SETFL, oflags[i] | O_NONBLOCK))
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_syserror ());
+          else if (!assuan_sock_connect (socks[i],
+                                         (struct sockaddr *)addrs[i]->addr,
+                                         addrs[i]->addrlen))
+            {
+              winner = i;  /* Immediate connect.  */
+              break;
+            }
+          else
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_syserror ());
+          if (gpg_err_code (err) != GPG_ERR_EINPROGRESS)
+            {
+              last_err = err;
+              assuan_sock_close (socks[i]);
+              socks[i] = ASSUAN_INVALID_FD;
+              continue;
+            }
+          active++;
+          next_attempt = now + CONNECTION_ATTEMPT_DELAY * 1000ULL;
+          if (timeout)
+            deadline = now + timeout * 1000ULL;
+        }
+
+      if (!active)
+        {
+          if (started < n)
+            continue;
+          break;  /* All attempts failed.  */
+        }
+
+      if (deadline && now >= deadline)
+        {
+          last_err = gpg_err_make (default_errsource, GPG_ERR_ETIMEDOUT);
+          break;
+        }
+
+      /* Wait until an attempt finishes, the next attempt is due, or
+       * the timeout expires.  */
+      wait = 0;
+      use_tval = 0;
+      if (started < n)
+        {
+          wait = next_attempt > now? next_attempt - now : 0;
+          use_tval = 1;
+        }
+      if (deadline && (!use_tval || deadline - now < wait))
+        {
+          wait = deadline - now;
+          use_tval = 1;
+        }
+
+      FD_ZERO (&rset);
+      maxfd = -1;
+      for (i=0; i < started; i++)
+        if (socks[i] != ASSUAN_INVALID_FD)
+          {
+            FD_SET (FD2INT (socks[i]), &rset);
+            if (FD2INT (socks[i]) > maxfd)
+              maxfd = FD2INT (socks[i]);
+          }
+      wset = rset;
+      tval.tv_sec = wait / 1000000;
+      tval.tv_usec = wait % 1000000;
+
+      if (my_select (maxfd+1, &rset, &wset, NULL, use_tval? &tval : NULL) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          last_err = gpg_err_make (default_errsource,
+                                   gpg_err_code_from_syserror ());
+          break;
+        }
+
+      for (i=0; i < started && winner == -1; i++)
+        {
+          if (socks[i] == ASSUAN_INVALID_FD
+              || (!FD_ISSET (FD2INT (socks[i]), &rset)
+                  && !FD_ISSET (FD2INT (socks[i]), &wset)))
+            continue;
+
+          slen = sizeof (syserr);
+          if (getsockopt (FD2INT (socks[i]), SOL_SOCKET, SO_ERROR,
+                          (void*)&syserr, &slen) < 0)
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_syserror ());
+          else if (syserr)
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_errno (syserr));
+          else
+            err = 0;
+
+          if (!err)
+            winner = i;
+          else
+            {
+              last_err = err;
+              assuan_sock_close (socks[i]);
+              socks[i] = ASSUAN_INVALID_FD;
+              active--;
+            }
+        }
+    }
+
+  /* Close all sockets but the winner's.  */
+  for (i=0; i < started; i++)
+    if (i != winner && socks[i] != ASSUAN_INVALID_FD)
+      assuan_sock_close (socks[i]);
+
+  if (winner != -1)
+    {
+      fcntl (socks[winner], F_SETFL, oflags[winner]);
+      *r_sock = socks[winner];
+      err = 0;
+    }
+  else
+    err = last_err? last_err : gpg_err_make (default_errsource,
+                                             GPG_ERR_UNKNOWN_HOST);
+
+  xfree (socks);
+  xfree (oflags);
+  return err;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 /* Actually connect to a server.  On success 0 is returned and the
  * file descriptor for the socket is stored at R_SOCK; on error an
  * error code is returned and ASSUAN_INVALID_FD is stored at R_SOCK.
  * TIMEOUT is the connect timeout in milliseconds.  Note that the
  * function tries to connect to all known addresses and the timeout is
- * for each one. */
+ * for each one.  If possible the addresses of a host are tried in
+ * parallel using connect_race. */
 static gpg_error_t
 connect_server (ctrl_t ctrl, const char *server, unsigned short port,
                 unsigned int flags, const char *srvtag, unsigned int timeout,
@@ -2912,6 +3585,8 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
   int srv, connected, v4_valid, v6_valid;
   gpg_error_t last_err = 0;
   struct srventry *serverlist = NULL;
+  dns_addrinfo_t *addrs;
+  int naddrs, i;
 
   *r_sock = ASSUAN_INVALID_FD;
 
@@ -2997,41 +3672,98 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
         }
       hostfound = 1;
 
-      for (ai = aibuf; ai && !connected; ai = ai->next)
+      /* Collect the usable addresses.  As suggested by RFC-8305 we
+       * alternate between IPv6 and IPv4 addresses starting with
+       * IPv6.  */
+      naddrs = 0;
+      for (ai = aibuf; ai; ai = ai->next)
+        naddrs++;
+      addrs = xtrycalloc (naddrs? naddrs : 1, sizeof *addrs);
+      if (!addrs)
         {
-          if (ai->family == AF_INET
-              && ((flags & HTTP_FLAG_IGNORE_IPv4) || !v4_valid))
-            continue;
-          if (ai->family == AF_INET6
-              && ((flags & HTTP_FLAG_IGNORE_IPv6) || !v6_valid))
-            continue;
+          err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+          free_dns_addrinfo (aibuf);
+          xfree (serverlist);
+          return err;
+        }
+      naddrs = 0;
+      {
+        dns_addrinfo_t ai6 = aibuf;
+        dns_addrinfo_t ai4 = aibuf;
 
-          if (sock != ASSUAN_INVALID_FD)
-            assuan_sock_close (sock);
-          sock = my_sock_new_for_addr (ai->addr, ai->socktype, ai->protocol);
-          if (sock == ASSUAN_INVALID_FD)
-            {
-              err = gpg_err_make (default_errsource,
-                                  gpg_err_code_from_syserror ());
-              log_error ("error creating socket: %s\n", gpg_strerror (err));
-              free_dns_addrinfo (aibuf);
-              xfree (serverlist);
-              return err;
-            }
+        for (;;)
+          {
+            while (ai6 && (ai6->family != AF_INET6
+                           || (flags & HTTP_FLAG_IGNORE_IPv6) || !v6_valid))
+              ai6 = ai6->next;
+            while (ai4 && (ai4->family != AF_INET
+                           || (flags & HTTP_FLAG_IGNORE_IPv4) || !v4_valid))
+              ai4 = ai4->next;
+            if (!ai6 && !ai4)
+              break;
+            if (ai6)
+              {
+                addrs[naddrs++] = ai6;
+                ai6 = ai6->next;
+              }
+            if (ai4)
+              {
+                addrs[naddrs++] = ai4;
+                ai4 = ai4->next;
+              }
+          }
+      }
+      if (naddrs)
+        anyhostaddr = 1;
 
-          anyhostaddr = 1;
-          err = connect_with_timeout (sock, (struct sockaddr *)ai->addr,
-                                      ai->addrlen, timeout);
+#ifndef HAVE_W32_SYSTEM
+      if (naddrs > 1 && !use_socks (addrs[0]->addr))
+        {
+          err = connect_race (addrs, naddrs, timeout, &sock);
           if (err)
-            {
-              last_err = err;
-            }
+            last_err = err;
           else
             {
               connected = 1;
               notify_netactivity ();
             }
         }
+      else
+#endif /*!HAVE_W32_SYSTEM*/
+        {
+          for (i=0; i < naddrs && !connected; i++)
+            {
+              ai = addrs[i];
+              if (sock != ASSUAN_INVALID_FD)
+                assuan_sock_close (sock);
+              sock = my_sock_new_for_addr (ai->addr, ai->socktype,
+                                           ai->protocol);
+              if (sock == ASSUAN_INVALID_FD)
+                {
+                  err = gpg_err_make (default_errsource,
+                                      gpg_err_code_from_syserror ());
+                  log_error ("error creating socket: %s\n",
+                             gpg_strerror (err));
+                  xfree (addrs);
+                  free_dns_addrinfo (aibuf);
+                  xfree (serverlist);
+                  return err;
+                }
+
+              err = connect_with_timeout (sock, (struct sockaddr *)ai->addr,
+                                          ai->addrlen, timeout);
+              if (err)
+                {
+                  last_err = err;
+                }
+              else
+                {
+                  connected = 1;
+                  notify_netactivity ();
+                }
+            }
+        }
+      xfree (addrs);
       free_dns_addrinfo (aibuf);
     }
 
@@ -3360,6 +4092,15 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* Keep the connection if the body has been read completely.  */
+  if (c->pool_key && c->keep_alive && c->sock && !c->content_length
+#ifdef USE_TLS
+      && (!c->use_tls || (c->session && c->session->tls_session))
+#endif
+      )
+    conn_pool_put (c->pool_key, c->sock, c->session);
+  xfree (c->pool_key);
+
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -3370,7 +4111,13 @@ cookie_close (void *cookie)
   else
 #elif HTTP_USE_GNUTLS
   if (c->use_tls && c->session && c->session->tls_session)
-    my_socket_unref (c->sock, send_gnutls_bye, c->session->tls_session);
+    {
+      /* With TLS 1.3 the ticket is sent after the handshake and thus
+       * we take the resumption data only now.  */
+      if (c->session->verify.done && !c->session->verify.rc)
+        tls_resume_store (c->session);
+      my_socket_unref (c->sock, send_gnutls_bye, c->session->tls_session);
+    }
   else
 #endif /*HTTP_USE_GNUTLS*/
     if (c->sock)
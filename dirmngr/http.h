@@ -148,6 +148,9 @@ void http_session_set_log_cb (http_session_t sess,
                                          const void **, size_t *));
 void http_session_set_timeout (http_session_t sess, unsigned int timeout);
 
+void http_pool_housekeeping (int flush);
+char *http_pool_info (void);
+
 
 gpg_error_t http_parse_uri (parsed_uri_t *ret_uri, const char *uri,
                             int no_scheme_check);
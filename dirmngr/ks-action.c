@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -136,11 +137,42 @@ ks_action_resolve (ctrl_t ctrl, uri_item_t keyservers)
 }
 
 
+/* Copy the machine readable search result from IN to OUT but stop
+ * after LIMIT keys.  */
+static gpg_error_t
+copy_search_result (estream_t in, estream_t out, unsigned int limit)
+{
+  gpg_error_t err = 0;
+  char *line = NULL;
+  size_t linesize = 0;
+  unsigned int nkeys = 0;
+  ssize_t n;
+
+  while ((n = es_read_line (in, &line, &linesize, NULL)) > 0)
+    {
+      if (!ascii_strncasecmp (line, "pub:", 4) && ++nkeys > limit)
+        {
+          log_info ("search result truncated after %u keys\n", limit);
+          break;
+        }
+      if (es_write (out, line, n, NULL))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+    }
+  if (n < 0)
+    err = gpg_error_from_syserror ();
+  es_free (line);
+  return err;
+}
+
+
 /* Search all configured keyservers for keys matching PATTERNS and
    write the result to the provided output stream.  */
 gpg_error_t
 ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
-		  strlist_t patterns, estream_t outfp)
+		  strlist_t patterns, unsigned int limit, estream_t outfp)
 {
   gpg_error_t err = 0;
   int any_server = 0;
@@ -191,7 +223,12 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
 
           if (!err)
             {
-              err = copy_stream (infp, outfp);
+              /* With a limit we close the connection to the keyserver
+               * as soon as we have enough keys.  */
+              if (limit)
+                err = copy_search_result (infp, outfp, limit);
+              else
+                err = copy_stream (infp, outfp);
               es_fclose (infp);
               any_results = 1;
               break;
@@ -207,6 +244,146 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
 }
 
 
+/* The maximum number of concurrent fetches from one keyserver.  */
+#define MAX_CONCURRENT_GETS 4
+
+/* The state shared by the threads of get_concurrently.  */
+struct get_job_s
+{
+  ctrl_t ctrl;
+  parsed_uri_t uri;
+  int is_hkp_s;            /* Use HKP instead of a plain HTTP fetch.  */
+  strlist_t next_pattern;  /* The next pattern to process.  */
+  estream_t outfp;
+  npth_mutex_t out_lock;   /* Serializes the writes to OUTFP.  */
+  gpg_error_t err;         /* A fatal error.  */
+  gpg_error_t first_err;   /* An error from fetching a key.  */
+  int any_data;
+};
+
+
+/* Worker for get_concurrently.  Takes patterns from the job ARG
+ * until all are processed and writes the keys to its output stream.
+ * Each key is buffered so that the output of the workers does not
+ * get interleaved.  */
+static void *
+get_worker (void *arg)
+{
+  struct get_job_s *job = arg;
+  gpg_error_t err;
+  strlist_t sl;
+  estream_t infp, memfp;
+  void *buffer;
+  size_t buflen;
+
+  while (!job->err && (sl = job->next_pattern))
+    {
+      /* There is no yield point since the test and thus no lock is
+       * required to take the pattern.  */
+      job->next_pattern = sl->next;
+
+      if (job->is_hkp_s)
+        err = ks_hkp_get (job->ctrl, job->uri, sl->d, &infp);
+      else
+        err = ks_http_fetch (job->ctrl, job->uri->original,
+                             KS_HTTP_FETCH_NOCACHE, &infp);
+      if (err)
+        {
+          /* See ks_action_get.  */
+          job->first_err = err;
+          continue;
+        }
+
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        err = gpg_error_from_syserror ();
+      else
+        err = copy_stream (infp, memfp);
+      es_fclose (infp);
+      if (!err)
+        {
+          /* Take the buffer of the memory stream and write it in one
+           * go instead of copying it again through the stream.  */
+          if (es_fclose_snatch (memfp, &buffer, &buflen))
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memfp = NULL;
+              npth_mutex_lock (&job->out_lock);
+              if (!job->err && buflen
+                  && es_write (job->outfp, buffer, buflen, NULL))
+                err = gpg_error_from_syserror ();
+              npth_mutex_unlock (&job->out_lock);
+              es_free (buffer);
+              if (!err)
+                job->any_data = 1;
+            }
+        }
+      es_fclose (memfp);
+      if (err && !job->err)
+        job->err = err;
+    }
+
+  return NULL;
+}
+
+
+/* Get the keys matching PATTERNS from the HKP or HTTP server URI
+ * using up to MAX_CONCURRENT_GETS concurrent requests.  The keys are
+ * written to OUTFP in the order they arrive.  The return value and
+ * R_FIRST_ERR and R_ANY_DATA are as in the sequential loop of
+ * ks_action_get.  */
+static gpg_error_t
+get_concurrently (ctrl_t ctrl, parsed_uri_t uri, int is_hkp_s,
+                  strlist_t patterns, estream_t outfp,
+                  gpg_error_t *r_first_err, int *r_any_data)
+{
+  struct get_job_s job;
+  npth_t threads[MAX_CONCURRENT_GETS - 1];
+  int nthreads, n, rc;
+
+  memset (&job, 0, sizeof job);
+  job.ctrl = ctrl;
+  job.uri = uri;
+  job.is_hkp_s = is_hkp_s;
+  job.next_pattern = patterns;
+  job.outfp = outfp;
+  rc = npth_mutex_init (&job.out_lock, NULL);
+  if (rc)
+    return gpg_error_from_errno (rc);
+
+  /* The calling thread does its share of the work; thus we need one
+   * thread less than the number of patterns.  If a thread can't be
+   * created we simply do with fewer threads.  */
+  n = strlist_length (patterns);
+  if (n > MAX_CONCURRENT_GETS)
+    n = MAX_CONCURRENT_GETS;
+  for (nthreads = 0; nthreads < n - 1; nthreads++)
+    {
+      rc = npth_create (threads + nthreads, NULL, get_worker, &job);
+      if (rc)
+        {
+          log_info ("error spawning fetch thread: %s\n", strerror (rc));
+          break;
+        }
+    }
+  if (opt.verbose && nthreads)
+    log_info ("fetching %d keys using %d concurrent requests\n",
+              strlist_length (patterns), nthreads + 1);
+
+  get_worker (&job);
+  while (nthreads--)
+    npth_join (threads[nthreads], NULL);
+
+  npth_mutex_destroy (&job.out_lock);
+  if (job.first_err)
+    *r_first_err = job.first_err;
+  if (job.any_data)
+    *r_any_data = 1;
+  return job.err;
+}
+
+
 /* Get the requested keys (matching PATTERNS) using all configured
    keyservers and write the result to the provided output stream.  */
 gpg_error_t
@@ -244,7 +421,33 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
 		 || strcmp (uri->parsed_uri->scheme, "ldapi") == 0);
 #endif
 
-      if (is_hkp_s || is_http_s || is_ldap)
+      if ((is_hkp_s || is_http_s) && patterns->next)
+        {
+          any_server = 1;
+          /* Try to get all keys with one request.  */
+          if (is_hkp_s)
+            err = ks_hkp_get_many (ctrl, uri->parsed_uri, patterns, &infp);
+          else
+            err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          if (!err)
+            {
+              err = copy_stream (infp, outfp);
+              if (!err)
+                any_data = 1;
+              es_fclose (infp);
+              infp = NULL;
+            }
+          else if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+            err = get_concurrently (ctrl, uri->parsed_uri, is_hkp_s,
+                                    patterns, outfp, &first_err, &any_data);
+          else
+            {
+              /* See below.  */
+              first_err = err;
+              err = 0;
+            }
+        }
+      else if (is_hkp_s || is_http_s || is_ldap)
         {
           any_server = 1;
           for (sl = patterns; !err && sl; sl = sl->next)
@@ -299,9 +502,10 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
 
 /* Retrieve keys from URL and write the result to the provided output
  * stream OUTFP.  If OUTFP is NULL the data is written to the bit
- * bucket. */
+ * bucket.  FLAGS are KS_HTTP_FETCH_* flags used for http URLs.  */
 gpg_error_t
-ks_action_fetch (ctrl_t ctrl, const char *url, estream_t outfp)
+ks_action_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
+                 estream_t outfp)
 {
   gpg_error_t err = 0;
   estream_t infp;
@@ -316,7 +520,7 @@ ks_action_fetch (ctrl_t ctrl, const char *url, estream_t outfp)
 
   if (parsed_uri->is_http)
     {
-      err = ks_http_fetch (ctrl, url, KS_HTTP_FETCH_NOCACHE, &infp);
+      err = ks_http_fetch (ctrl, url, KS_HTTP_FETCH_NOCACHE | flags, &infp);
       if (!err)
         {
           err = copy_stream (infp, outfp);
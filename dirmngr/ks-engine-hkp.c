@@ -39,6 +39,8 @@
 #include "dirmngr.h"
 #include "misc.h"
 #include "../common/userids.h"
+#include "../common/host2net.h"
+#include "../common/timing.h"
 #include "dns-stuff.h"
 #include "ks-engine.h"
 
@@ -58,6 +60,16 @@
 /* Number of seconds after a host is marked as resurrected.  */
 #define RESURRECT_INTERVAL  (3600+1800)  /* 1.5 hours */
 
+/* Number of seconds after which a dead host is probed.  */
+#define PROBE_INTERVAL  (600)
+
+/* Timeout in milliseconds for probing a dead host.  */
+#define PROBE_TIMEOUT  (5000)
+
+/* The weight of a new sample for the moving averages of the host
+   statistics is 1/HOST_STATS_WEIGHT.  */
+#define HOST_STATS_WEIGHT 4
+
 /* To match the behaviour of our old gpgkeys helper code we escape
    more characters than actually needed. */
 #define EXTRA_ESCAPE_CHARS "@!\"#$%&'()*+,-./:;<=>?[\\]^_{|}~"
@@ -71,6 +83,18 @@
 /* Number of retries done in case of transient errors.  */
 #define SEND_REQUEST_EXTRA_RETRIES 5
 
+/* The maximum number of keys requested with one batched get.  */
+#define MAX_MULTIGET_KEYS 50
+
+/* Number of inconclusive probes before we assume that a host does not
+ * support the batched get.  */
+#define MULTIGET_PROBES 3
+
+/* Values for the MULTIGET field of hostinfo_s.  */
+#define MULTIGET_UNKNOWN 0
+#define MULTIGET_YES     1
+#define MULTIGET_NO      2
+
 
 enum ks_protocol { KS_PROTOCOL_HKP, KS_PROTOCOL_HKPS, KS_PROTOCOL_MAX };
 
@@ -97,6 +121,14 @@ struct hostinfo_s
   unsigned int did_srv_lookup:2;  /* One bit per protocol indicating
                                      whether we already did a SRV
                                      lookup.  */
+  unsigned int multiget:2;        /* One of the MULTIGET_ values.  */
+  unsigned int multiget_probes:2; /* Number of inconclusive probes.  */
+  unsigned int rtt;       /* Moving average of the response time in
+                             milliseconds; 0 if not known.  */
+  unsigned int failrate;  /* Moving average of the failure rate in
+                             1/1000.  */
+  unsigned int nrequests; /* Number of requests sent to this host.  */
+  unsigned short lastport;/* Port of the last request or 0.  */
   time_t died_at;    /* The time the host was marked dead.  If this is
                         0 the host has been manually marked dead.  */
   char *cname;       /* Canonical name of the host.  Only set if this
@@ -146,6 +178,12 @@ create_new_hostinfo (const char *name)
   hi->dead = 0;
   hi->did_a_lookup = 0;
   hi->did_srv_lookup = 0;
+  hi->multiget = MULTIGET_UNKNOWN;
+  hi->multiget_probes = 0;
+  hi->rtt = 0;
+  hi->failrate = 0;
+  hi->nrequests = 0;
+  hi->lastport = 0;
   hi->iporname_valid = 0;
   hi->died_at = 0;
   hi->cname = NULL;
@@ -222,9 +260,22 @@ host_in_pool_p (hostinfo_t hi, int tblidx)
 }
 
 
-/* Select a random host.  Consult HI->pool which indices into the global
-   hosttable.  Returns index into HI->pool or -1 if no host could be
-   selected.  */
+/* Return a score for the host HI used to compare hosts; lower is
+   better.  Hosts without statistics get the best score so that they
+   are tried.  */
+static unsigned long
+host_score (hostinfo_t hi)
+{
+  /* Each percent of failures counts like a 4% longer response.  */
+  return (unsigned long)hi->rtt * (1000 + 4 * hi->failrate) / 1000;
+}
+
+
+/* Select a host.  Consult HI->pool which indices into the global
+   hosttable.  Two alive hosts are picked at random and the one with
+   the better score is used.  This prefers fast and healthy hosts
+   without sending all requests to the same host.  Returns index into
+   HI->pool or -1 if no host could be selected.  */
 static int
 select_random_host (hostinfo_t hi)
 {
@@ -254,7 +305,19 @@ select_random_host (hostinfo_t hi)
   if (tblsize == 1)  /* Save a get_uint_nonce.  */
     pidx = tbl[0];
   else
-    pidx = tbl[get_uint_nonce () % tblsize];
+    {
+      unsigned int r = get_uint_nonce ();
+      size_t a, b;
+
+      /* Pick two different entries.  */
+      a = r % tblsize;
+      b = (r / tblsize) % (tblsize - 1);
+      if (b >= a)
+        b++;
+      a = tbl[a];
+      b = tbl[b];
+      pidx = host_score (hosttable[b]) < host_score (hosttable[a])? b : a;
+    }
 
   xfree (tbl);
   return pidx;
@@ -700,24 +763,29 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
 }
 
 
-/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
-   true if a host was really marked as dead or was already marked dead
-   (e.g. by a concurrent session).  */
+/* Return the index into the hosttable for the host NAME or -1 if
+   not found.  NAME may be given as an URL.  "localhost" is never
+   found.  If R_PORT is not NULL the port of the URL or 0 is stored
+   there.  */
 static int
-mark_host_dead (const char *name)
+find_hostinfo_by_url (const char *name, unsigned short *r_port)
 {
   const char *host;
   char *host_buffer = NULL;
   parsed_uri_t parsed_uri = NULL;
-  int done = 0;
+  int idx = -1;
 
+  if (r_port)
+    *r_port = 0;
   if (name && *name && !http_parse_uri (&parsed_uri, name, 1))
     {
+      if (r_port)
+        *r_port = parsed_uri->port;
       if (parsed_uri->v6lit)
         {
           host_buffer = strconcat ("[", parsed_uri->host, "]", NULL);
           if (!host_buffer)
-            log_error ("out of core in mark_host_dead");
+            log_error ("out of core in find_hostinfo_by_url");
           host = host_buffer;
         }
       else
@@ -727,27 +795,63 @@ mark_host_dead (const char *name)
     host = name;
 
   if (host && *host && strcmp (host, "localhost"))
-    {
-      hostinfo_t hi;
-      int idx;
-
-      idx = find_hostinfo (host);
-      if (idx != -1)
-        {
-          hi = hosttable[idx];
-          log_info ("marking host '%s' as dead%s\n",
-                    hi->name, hi->dead? " (again)":"");
-          hi->dead = 1;
-          hi->died_at = gnupg_get_time ();
-          if (!hi->died_at)
-            hi->died_at = 1;
-          done = 1;
-        }
-    }
+    idx = find_hostinfo (host);
 
   http_release_parsed_uri (parsed_uri);
   xfree (host_buffer);
-  return done;
+  return idx;
+}
+
+
+/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
+   true if a host was really marked as dead or was already marked dead
+   (e.g. by a concurrent session).  */
+static int
+mark_host_dead (const char *name)
+{
+  hostinfo_t hi;
+  int idx;
+
+  idx = find_hostinfo_by_url (name, NULL);
+  if (idx == -1)
+    return 0;
+
+  hi = hosttable[idx];
+  log_info ("marking host '%s' as dead%s\n",
+            hi->name, hi->dead? " (again)":"");
+  hi->dead = 1;
+  hi->died_at = gnupg_get_time ();
+  if (!hi->died_at)
+    hi->died_at = 1;
+  return 1;
+}
+
+
+/* Update the statistics of the host used for REQUEST.  FAILED is
+   true if the host did not respond properly.  RTT is the response
+   time in milliseconds; it is ignored for failed requests.  */
+static void
+update_host_stats (const char *request, int failed, unsigned int rtt)
+{
+  hostinfo_t hi;
+  unsigned short port;
+  int idx;
+
+  idx = find_hostinfo_by_url (request, &port);
+  if (idx == -1)
+    return;
+
+  hi = hosttable[idx];
+  hi->nrequests++;
+  hi->lastport = port;
+  hi->failrate = ((HOST_STATS_WEIGHT - 1) * hi->failrate
+                  + (failed? 1000 : 0)) / HOST_STATS_WEIGHT;
+  if (failed)
+    ;
+  else if (!hi->rtt)
+    hi->rtt = rtt? rtt : 1;
+  else
+    hi->rtt = ((HOST_STATS_WEIGHT - 1) * hi->rtt + rtt) / HOST_STATS_WEIGHT;
 }
 
 
@@ -850,7 +954,8 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
   char *p, *died;
   const char *diedstr;
 
-  err = ks_print_help (ctrl, "hosttable (idx, ipv6, ipv4, dead, name, time):");
+  err = ks_print_help (ctrl, "hosttable (idx, ipv6, ipv4, dead, name, time,"
+                       " rtt, failures, requests):");
   if (err)
     return err;
 
@@ -956,6 +1061,13 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
         if (err)
 	  goto leave;
 
+        if (hi->nrequests)
+          err = ks_printf_help (ctrl, "  .       rtt=%ums fail=%u.%u%% n=%u",
+                                hi->rtt, hi->failrate / 10,
+                                hi->failrate % 10, hi->nrequests);
+        if (err)
+	  goto leave;
+
         if (hi->pool)
           {
             init_membuf (&mb, 256);
@@ -1126,14 +1238,54 @@ ks_hkp_resolve (ctrl_t ctrl, parsed_uri_t uri)
 }
 
 
+/* Try to connect to the dead host NAME at PORT.  Returns true if the
+   host accepted the connection.  */
+static int
+probe_host (ctrl_t ctrl, const char *name, unsigned short port)
+{
+  gpg_error_t err;
+  http_t http;
+  char *buffer = NULL;
+  size_t n;
+
+  /* Strip the brackets from an IPv6 address.  */
+  n = strlen (name);
+  if (*name == '[' && n > 2 && name[n-1] == ']')
+    {
+      buffer = xtrystrdup (name + 1);
+      if (!buffer)
+        return 0;
+      buffer[n-2] = 0;
+      name = buffer;
+    }
+
+  err = http_raw_connect (ctrl, &http, name, port,
+                          ((opt.disable_ipv4? HTTP_FLAG_IGNORE_IPv4 : 0)
+                           | (opt.disable_ipv6? HTTP_FLAG_IGNORE_IPv6 : 0)),
+                          NULL, PROBE_TIMEOUT);
+  if (!err)
+    http_close (http, 0);
+  else if (opt.verbose)
+    log_info ("probing host '%s' failed: %s\n", name, gpg_strerror (err));
+  xfree (buffer);
+  return !err;
+}
+
+
 /* Housekeeping function called from the housekeeping thread.  It is
    used to mark dead hosts alive so that they may be tried again after
-   some time.  */
+   some time.  Dead hosts for which we know the port are probed
+   instead of waiting for the full resurrect interval.  Pools are
+   forced to select a host again to take the updated statistics into
+   account.  */
 void
-ks_hkp_housekeeping (time_t curtime)
+ks_hkp_housekeeping (ctrl_t ctrl, time_t curtime)
 {
   int idx;
   hostinfo_t hi;
+  strlist_t probes = NULL;
+  strlist_t sl;
+  int alive;
 
   if (npth_mutex_lock (&hosttable_lock))
     log_fatal ("failed to acquire mutex\n");
@@ -1143,6 +1295,8 @@ ks_hkp_housekeeping (time_t curtime)
       hi = hosttable[idx];
       if (!hi)
         continue;
+      if (hi->pool)
+        hi->poolidx = -1;
       if (!hi->dead)
         continue;
       if (!hi->died_at)
@@ -1153,10 +1307,41 @@ ks_hkp_housekeeping (time_t curtime)
           hi->dead = 0;
           log_info ("resurrected host '%s'", hi->name);
         }
+      else if (hi->lastport && !hi->onion && !dirmngr_use_tor ()
+               && hi->died_at + PROBE_INTERVAL <= curtime)
+        {
+          /* We can't probe while holding the lock; thus we only
+           * collect the hosts.  */
+          sl = add_to_strlist_try (&probes, hi->name);
+          if (sl)
+            sl->flags = hi->lastport;
+        }
     }
 
   if (npth_mutex_unlock (&hosttable_lock))
     log_fatal ("failed to release mutex\n");
+
+  for (sl = probes; sl; sl = sl->next)
+    {
+      alive = probe_host (ctrl, sl->d, sl->flags);
+
+      if (npth_mutex_lock (&hosttable_lock))
+        log_fatal ("failed to acquire mutex\n");
+      idx = find_hostinfo (sl->d);
+      if (idx != -1 && (hi = hosttable[idx]) && hi->dead && hi->died_at)
+        {
+          if (alive)
+            {
+              hi->dead = 0;
+              log_info ("resurrected host '%s' after probing", hi->name);
+            }
+          else
+            hi->died_at = curtime;
+        }
+      if (npth_mutex_unlock (&hosttable_lock))
+        log_fatal ("failed to release mutex\n");
+    }
+  free_strlist (probes);
 }
 
 
@@ -1194,12 +1379,15 @@ ks_hkp_reload (void)
    R_FP.  HOSTPORTSTR is only used for diagnostics.  If HTTPHOST is
    not NULL it will be used as HTTP "Host" header.  If POST_CB is not
    NULL a post request is used and that callback is called to allow
-   writing the post data.  If R_HTTP_STATUS is not NULL, the http
-   status code will be stored there.  */
+   writing the post data.  If CACHE is not NULL the response is
+   revalidated against and stored in that cache object.  If
+   R_HTTP_STATUS is not NULL, the http status code will be stored
+   there.  */
 static gpg_error_t
 send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
               const char *httphost, unsigned int httpflags,
               gpg_error_t (*post_cb)(void *, http_t), void *post_cb_value,
+              http_cache_t cache,
               estream_t *r_fp, unsigned int *r_http_status)
 {
   gpg_error_t err;
@@ -1209,6 +1397,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   estream_t fp = NULL;
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
+  unsigned long long start;
 
   *r_fp = NULL;
 
@@ -1223,6 +1412,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
    * Needs at least an explanation here..  */
 
  once_more:
+  start = gnupg_timing_now ();
   err = http_session_new (&session, httphost,
                           ((ctrl->http_no_crl? HTTP_FLAG_NO_CRL : 0)
                            | HTTP_FLAG_TRUST_DEF),
@@ -1254,6 +1444,8 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
          we're good with both HTTP 1.0 and 1.1.  */
       es_fputs ("Pragma: no-cache\r\n"
                 "Cache-Control: no-cache\r\n", fp);
+      if (http_cache_etag (cache))
+        es_fprintf (fp, "If-None-Match: %s\r\n", http_cache_etag (cache));
       if (post_cb)
         err = post_cb (post_cb_value, http);
       if (!err)
@@ -1268,6 +1460,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
       /* Fixme: After a redirection we show the old host name.  */
       log_error (_("error connecting to '%s': %s\n"),
                  hostportstr, gpg_strerror (err));
+      update_host_stats (request, 1, 0);
       goto leave;
     }
 
@@ -1278,8 +1471,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
     {
       log_error (_("error reading HTTP response for '%s': %s\n"),
                  hostportstr, gpg_strerror (err));
+      update_host_stats (request, 1, 0);
       goto leave;
     }
+  update_host_stats (request, http_get_status_code (http) >= 500,
+                     (gnupg_timing_now () - start) / 1000);
 
   if (http_get_tls_info (http, NULL))
     {
@@ -1291,6 +1487,10 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   if (r_http_status)
     *r_http_status = http_get_status_code (http);
 
+  err = http_cache_update (cache, http, r_fp);
+  if (err || *r_fp)
+    goto leave;
+
   switch (http_get_status_code (http))
     {
     case 200:
@@ -1545,7 +1745,7 @@ ks_hkp_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
   /* Send the request.  */
   err = send_request (ctrl, request, hostport, httphost, httpflags,
-                      NULL, NULL, &fp, &http_status);
+                      NULL, NULL, NULL, &fp, &http_status);
   if (handle_send_request_error (ctrl, err, request, http_status,
                                  &tries, &extra_tries))
     {
@@ -1614,6 +1814,8 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   estream_t fp = NULL;
   int reselect;
   char *httphost = NULL;
+  char *cachekey = NULL;
+  http_cache_t cache = NULL;
   unsigned int httpflags;
   unsigned int http_status;
   unsigned int tries = SEND_REQUEST_RETRIES;
@@ -1665,6 +1867,17 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
       goto leave;
     }
 
+  /* Keys are only taken from the cache if the server told us how
+   * long they are valid.  */
+  cachekey = strconcat (uri->original, " ", searchkey,
+                        exactname? " exact" : "", NULL);
+  if (cachekey)
+    {
+      err = http_cache_open (cachekey, 0, &cache, r_fp);
+      if (err || *r_fp)
+        goto leave;
+    }
+
   reselect = 0;
  again:
   /* Build the request string.  */
@@ -1690,7 +1903,7 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
 
   /* Send the request.  */
   err = send_request (ctrl, request, hostport, httphost, httpflags,
-                      NULL, NULL, &fp, &http_status);
+                      NULL, NULL, cache, &fp, &http_status);
   if (handle_send_request_error (ctrl, err, request, http_status,
                                  &tries, &extra_tries))
     {
@@ -1718,10 +1931,282 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   xfree (hostport);
   xfree (httphost);
   xfree (searchkey);
+  xfree (cachekey);
+  http_cache_release (cache);
   return err;
 }
 
 
+/* Return the number of OpenPGP keys in the armored data
+   {BUFFER,LENGTH}.  This is only an estimation used to probe a
+   server: Only the first armor block is parsed but if the data has
+   more armor blocks than keys in the first block their number is
+   returned.  */
+static int
+count_armored_keys (const char *buffer, size_t length)
+{
+  struct b64state state;
+  unsigned char *data, *p;
+  size_t datalen, pktlen;
+  int c, tag, nblocks, nkeys;
+  const char *s;
+
+  for (nblocks = 0, s = buffer;
+       (s = memistr (s, length - (s - buffer), "-----BEGIN PGP PUBLIC KEY"));
+       s++)
+    nblocks++;
+
+  data = xtrymalloc (length);
+  if (!data)
+    return nblocks;
+  memcpy (data, buffer, length);
+  if (b64dec_start (&state, "PGP PUBLIC KEY BLOCK")
+      || b64dec_proc (&state, data, length, &datalen))
+    datalen = 0;
+  b64dec_finish (&state);
+
+  /* Count the public key packets.  */
+  for (nkeys = 0, p = data; datalen; )
+    {
+      c = *p++;
+      datalen--;
+      if (!(c & 0x80))
+        break;  /* Invalid packet.  */
+      if ((c & 0x40))
+        {
+          tag = (c & 0x3f);
+          if (!datalen)
+            break;
+          c = *p++;
+          datalen--;
+          if (c < 192)
+            pktlen = c;
+          else if (c < 224)
+            {
+              if (!datalen)
+                break;
+              pktlen = ((c - 192) << 8) + *p++ + 192;
+              datalen--;
+            }
+          else if (c == 255 && datalen >= 4)
+            {
+              pktlen = buf32_to_size_t (p);
+              p += 4;
+              datalen -= 4;
+            }
+          else
+            break;  /* Partial length - not used with keys.  */
+        }
+      else
+        {
+          tag = ((c >> 2) & 0xf);
+          switch ((c & 3))
+            {
+            case 0: c = 1; break;
+            case 1: c = 2; break;
+            case 2: c = 4; break;
+            default: c = 0; break;  /* Indeterminate length.  */
+            }
+          if (!c || datalen < c)
+            break;
+          for (pktlen = 0; c; c--, datalen--)
+            pktlen = (pktlen << 8) | *p++;
+        }
+      if (tag == 6)
+        nkeys++;
+      if (pktlen > datalen)
+        break;
+      p += pktlen;
+      datalen -= pktlen;
+    }
+
+  xfree (data);
+  return nkeys > nblocks? nkeys : nblocks;
+}
+
+
+/* Get the keys with the fingerprints given in PATTERNS with one
+   request from the keyserver identified by URI.  On success R_FP has
+   an open stream to read the data.  Not all keyservers support this;
+   thus the first requests to a host are used to probe for it.
+   GPG_ERR_NOT_SUPPORTED is returned if the host does not support it
+   or if not all PATTERNS are fingerprints; the caller should then
+   fall back to ks_hkp_get.  */
+gpg_error_t
+ks_hkp_get_many (ctrl_t ctrl, parsed_uri_t uri, strlist_t patterns,
+                 estream_t *r_fp)
+{
+  gpg_error_t err;
+  KEYDB_SEARCH_DESC desc;
+  char kidbuf[2+64+1];
+  strlist_t sl;
+  membuf_t mb;
+  char *searchpart;
+  char *hostport = NULL;
+  char *request = NULL;
+  char *httphost = NULL;
+  estream_t fp = NULL;
+  estream_t memfp = NULL;
+  unsigned int httpflags;
+  unsigned int http_status;
+  unsigned int tries = SEND_REQUEST_RETRIES;
+  unsigned int extra_tries = SEND_REQUEST_EXTRA_RETRIES;
+  int npatterns, reselect, idx, probing;
+  hostinfo_t hi;
+  void *buffer;
+  size_t buflen;
+
+  *r_fp = NULL;
+
+  /* Build the search part of the request.  */
+  init_membuf (&mb, 1024);
+  for (npatterns = 0, sl = patterns; sl; sl = sl->next, npatterns++)
+    {
+      if (npatterns == MAX_MULTIGET_KEYS
+          || classify_user_id (sl->d, &desc, 1)
+          || desc.mode != KEYDB_SEARCH_MODE_FPR
+          || desc.fprlen < 20)
+        {
+          xfree (get_membuf (&mb, NULL));
+          return gpg_error (GPG_ERR_NOT_SUPPORTED);
+        }
+      log_assert (desc.fprlen <= 64);
+      kidbuf[0] = '0';
+      kidbuf[1] = 'x';
+      bin2hex (desc.u.fpr, desc.fprlen, kidbuf+2);
+      put_membuf_str (&mb, "&search=");
+      put_membuf_str (&mb, kidbuf);
+    }
+  put_membuf (&mb, "", 1);
+  searchpart = get_membuf (&mb, NULL);
+  if (!searchpart)
+    return gpg_error_from_syserror ();
+  if (npatterns < 2)
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  reselect = 0;
+ again:
+  /* Build the request string.  */
+  xfree (hostport); hostport = NULL;
+  xfree (httphost); httphost = NULL;
+  err = make_host_part (ctrl, uri->scheme, uri->host, uri->port,
+                        reselect, uri->explicit_port,
+                        &hostport, &httpflags, &httphost);
+  if (err)
+    goto leave;
+
+  idx = find_hostinfo_by_url (hostport, NULL);
+  hi = idx == -1? NULL : hosttable[idx];
+  if (!hi || hi->multiget == MULTIGET_NO)
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+  probing = (hi->multiget == MULTIGET_UNKNOWN);
+
+  xfree (request);
+  request = strconcat (hostport,
+                       "/pks/lookup?op=get&options=mr",
+                       searchpart,
+                       NULL);
+  if (!request)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Send the request.  */
+  err = send_request (ctrl, request, hostport, httphost, httpflags,
+                      NULL, NULL, NULL, &fp, &http_status);
+  if (handle_send_request_error (ctrl, err, request, http_status,
+                                 &tries, &extra_tries))
+    {
+      reselect = 1;
+      goto again;
+    }
+  if (probing
+      && (gpg_err_code (err) == GPG_ERR_NOT_IMPLEMENTED
+          || gpg_err_code (err) == GPG_ERR_TOO_LARGE
+          || (gpg_err_code (err) == GPG_ERR_NO_DATA && http_status == 400)))
+    {
+      if (opt.verbose)
+        log_info ("host '%s' does not support batched gets\n", hi->name);
+      hi->multiget = MULTIGET_NO;
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+  if (err)
+    {
+      if (probing && gpg_err_code (err) == GPG_ERR_NO_DATA)
+        err = gpg_error (GPG_ERR_NOT_SUPPORTED);  /* Inconclusive.  */
+      else if (gpg_err_code (err) == GPG_ERR_NO_DATA)
+        dirmngr_status (ctrl, "SOURCE", hostport, NULL);
+      goto leave;
+    }
+
+  if (probing)
+    {
+      /* A server which ignores all but one search term returns at
+       * most one key.  Thus we need to look at the data to decide
+       * whether the server supports batched gets.  */
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = copy_stream (fp, memfp);
+      if (err)
+        goto leave;
+      es_fclose (fp);
+      fp = NULL;
+      if (es_fclose_snatch (memfp, &buffer, &buflen))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      memfp = NULL;
+      if (count_armored_keys (buffer, buflen) < 2)
+        {
+          if (++hi->multiget_probes >= MULTIGET_PROBES)
+            hi->multiget = MULTIGET_NO;
+          es_free (buffer);
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);  /* Inconclusive.  */
+          goto leave;
+        }
+      if (opt.verbose)
+        log_info ("host '%s' supports batched gets\n", hi->name);
+      hi->multiget = MULTIGET_YES;
+      fp = es_fopenmem_init (0, "rb", buffer, buflen);
+      es_free (buffer);
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  err = dirmngr_status (ctrl, "SOURCE", hostport, NULL);
+  if (err)
+    goto leave;
+
+  /* Return the read stream and close the HTTP context.  */
+  *r_fp = fp;
+  fp = NULL;
+
+ leave:
+  es_fclose (memfp);
+  es_fclose (fp);
+  xfree (request);
+  xfree (hostport);
+  xfree (httphost);
+  xfree (searchpart);
+  return err;
+}
+
 
 
 /* Callback parameters for put_post_cb.  */
@@ -1806,7 +2291,7 @@ ks_hkp_put (ctrl_t ctrl, parsed_uri_t uri, const void *data, size_t datalen)
 
   /* Send the request.  */
   err = send_request (ctrl, request, hostport, httphost, 0,
-                      put_post_cb, &parm, &fp, &http_status);
+                      put_post_cb, &parm, NULL, &fp, &http_status);
   if (handle_send_request_error (ctrl, err, request, http_status,
                                  &tries, &extra_tries))
     {
@@ -64,7 +64,8 @@ ks_http_help (ctrl_t ctrl, parsed_uri_t uri)
 /* Get the key from URL which is expected to specify a http style
  * scheme.  On success R_FP has an open stream to read the data.
  * Despite its name this function is also used to retrieve arbitrary
- * data via https or http.
+ * data via https or http.  With KS_HTTP_FETCH_CACHE in FLAGS the
+ * response may be taken from or stored in the local cache.
  */
 gpg_error_t
 ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
@@ -79,10 +80,22 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
   parsed_uri_t helpuri = NULL;
+  http_cache_t cache = NULL;
+  estream_t cachefp;
+  const char *etag;
 
+  *r_fp = NULL;
   err = http_parse_uri (&uri, url, 0);
   if (err)
     goto leave;
+
+  if ((flags & KS_HTTP_FETCH_CACHE))
+    {
+      err = http_cache_open (url, 1, &cache, r_fp);
+      if (err || *r_fp)
+        goto leave;
+    }
+
   redirinfo.ctrl       = ctrl;
   redirinfo.orig_url   = url;
   redirinfo.orig_onion = uri->onion;
@@ -129,6 +142,8 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
       if ((flags & KS_HTTP_FETCH_NOCACHE))
         es_fputs ("Pragma: no-cache\r\n"
                   "Cache-Control: no-cache\r\n", fp);
+      if ((etag = http_cache_etag (cache)))
+        es_fprintf (fp, "If-None-Match: %s\r\n", etag);
       http_start_data (http);
       if (es_ferror (fp))
         err = gpg_error_from_syserror ();
@@ -167,6 +182,17 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
       goto leave;
     }
 
+  /* Let the cache handle a successful, unmodified or not found
+   * response.  */
+  err = http_cache_update (cache, http, &cachefp);
+  if (err)
+    goto leave;
+  if (cachefp)
+    {
+      *r_fp = cachefp;
+      goto leave;
+    }
+
   switch (http_get_status_code (http))
     {
     case 200:
@@ -218,6 +244,7 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
  leave:
   http_close (http, 0);
   http_session_release (session);
+  http_cache_release (cache);
   xfree (request_buffer);
   http_release_parsed_uri (uri);
   http_release_parsed_uri (helpuri);
@@ -52,6 +52,49 @@
 #ifndef HAVE_TIMEGM
 time_t timegm(struct tm *tm);
 #endif
+
+/* The paged results control (RFC 2696) is used with OpenLDAP 2.4 or
+   later which provides the functions to parse the response.  */
+#if defined(LDAP_CONTROL_PAGEDRESULTS) && defined(LDAP_VENDOR_VERSION) \
+    && LDAP_VENDOR_VERSION >= 20400 && !defined(HAVE_W32_SYSTEM)
+# define USE_LDAP_PAGED_RESULTS 1
+#endif
+
+/* The number of entries requested per page and the maximum number of
+   pages read for one search.  */
+#define LDAP_PAGE_SIZE  100
+#define LDAP_MAX_PAGES  50
+
+/* The maximum number of idle connections kept open and the number of
+   seconds after which an idle connection is closed.  */
+#define LDAP_POOL_MAX   8
+#define LDAP_POOL_IDLE  60
+
+/* An open connection to an LDAP keyserver along with the information
+   retrieved from the server by my_ldap_connect_1.  */
+struct ldap_pool_item_s
+{
+  struct ldap_pool_item_s *next;
+  char *key;            /* See ldap_pool_key.  */
+  LDAP *ldap_conn;
+  char *basedn;         /* The base DN or NULL.  */
+  char *pgpkeyattr;     /* The key attribute or NULL.  */
+  int real_ldap;
+  int in_use;           /* The connection is used by a request.  */
+  time_t last_used;     /* Time the connection was put back.  */
+};
+typedef struct ldap_pool_item_s *ldap_pool_item_t;
+
+/* The list of pooled connections and the number of idle ones.  */
+static ldap_pool_item_t ldap_pool;
+static unsigned int ldap_pool_idle;
+
+/* Some counters for ks_ldap_print_stats.  */
+static struct
+{
+  unsigned int connects;
+  unsigned int reuses;
+} ldap_stats;
 
 /* Convert an LDAP error to a GPG error.  */
 static int
@@ -439,8 +482,8 @@ keyspec_to_ldap_filter (const char *keyspec, char **filter, int only_exact)
    OpenPGP Keyserver.  In this case, you also do not need to xfree
    *pgpkeyattrp.  */
 static int
-my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
-                 char **basednp, char **pgpkeyattrp, int *real_ldapp)
+my_ldap_connect_1 (parsed_uri_t uri, LDAP **ldap_connp,
+                   char **basednp, char **pgpkeyattrp, int *real_ldapp)
 {
   int err = 0;
 
@@ -746,6 +789,374 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
   return err;
 }
 
+
+/* Return a malloced string identifying the server and credentials
+   given by URI.  Connections are only shared for identical keys.  */
+static char *
+ldap_pool_key (parsed_uri_t uri)
+{
+  struct uri_tuple_s *password_param = uri_query_lookup (uri, "password");
+
+  return xtryasprintf ("%s\x01%d\x01%d\x01%s\x01%s\x01%s",
+                       uri->host? uri->host : "", uri->port, !!uri->use_tls,
+                       uri->auth? uri->auth : "",
+                       password_param? password_param->value : "",
+                       uri->path? uri->path : "");
+}
+
+
+/* Unlink ITEM from the pool, close its connection and release it.  */
+static void
+ldap_pool_drop (ldap_pool_item_t item)
+{
+  ldap_pool_item_t *itemp;
+
+  for (itemp = &ldap_pool; *itemp; itemp = &(*itemp)->next)
+    if (*itemp == item)
+      {
+        *itemp = item->next;
+        break;
+      }
+  if (!item->in_use)
+    ldap_pool_idle--;
+  ldap_unbind (item->ldap_conn);
+  xfree (item->basedn);
+  xfree (item->pgpkeyattr);
+  wipememory (item->key, strlen (item->key));
+  xfree (item->key);
+  xfree (item);
+}
+
+
+/* Return true if the pooled connection LDAP_CONN is still usable.
+   We do a cheap search of the root DSE asking for no attributes.  */
+static int
+ldap_pool_check (LDAP *ldap_conn)
+{
+  char *attr[] = { "1.1", NULL };
+  LDAPMessage *res = NULL;
+  int err;
+
+  err = ldap_search_s (ldap_conn, "", LDAP_SCOPE_BASE,
+                       "(objectClass=*)", attr, 0, &res);
+  ldap_msgfree (res);
+  return err == LDAP_SUCCESS;
+}
+
+
+/* Connect to an LDAP server and interrogate it.  This is a wrapper
+   around my_ldap_connect_1 with the same semantics, which reuses an
+   idle connection to the same server with the same credentials.  The
+   returned connection must be released with my_ldap_release.  */
+static int
+my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
+                 char **basednp, char **pgpkeyattrp, int *real_ldapp)
+{
+  int err;
+  char *key;
+  ldap_pool_item_t item;
+  LDAP *ldap_conn;
+  char *basedn, *pgpkeyattr;
+  int real_ldap;
+
+  key = ldap_pool_key (uri);
+  if (key)
+    {
+    again:
+      for (item = ldap_pool; item; item = item->next)
+        if (!item->in_use && !strcmp (item->key, key))
+          break;
+      if (item)
+        {
+          if (!ldap_pool_check (item->ldap_conn))
+            {
+              log_debug ("ldap: pooled connection %p is stale\n",
+                         item->ldap_conn);
+              ldap_pool_drop (item);
+              goto again;
+            }
+
+          item->in_use = 1;
+          ldap_pool_idle--;
+          ldap_stats.reuses++;
+          log_debug ("ldap: reusing connection %p\n", item->ldap_conn);
+          wipememory (key, strlen (key));
+          xfree (key);
+          goto leave;
+        }
+    }
+
+  err = my_ldap_connect_1 (uri, &ldap_conn, &basedn, &pgpkeyattr, &real_ldap);
+  if (err)
+    {
+      if (key)
+        wipememory (key, strlen (key));
+      xfree (key);
+      return err;
+    }
+  ldap_stats.connects++;
+
+  item = key? xtrycalloc (1, sizeof *item) : NULL;
+  if (!item)
+    {
+      /* Can't pool it; my_ldap_release will close the connection.  */
+      if (key)
+        wipememory (key, strlen (key));
+      xfree (key);
+      *ldap_connp = ldap_conn;
+      if (real_ldapp)
+        *real_ldapp = real_ldap;
+      if (basednp)
+        *basednp = basedn;
+      else
+        xfree (basedn);
+      if (pgpkeyattrp)
+        *pgpkeyattrp = pgpkeyattr;
+      else
+        xfree (pgpkeyattr);
+      return 0;
+    }
+  item->key = key;
+  item->ldap_conn = ldap_conn;
+  item->basedn = basedn;
+  item->pgpkeyattr = pgpkeyattr;
+  item->real_ldap = real_ldap;
+  item->in_use = 1;
+  item->next = ldap_pool;
+  ldap_pool = item;
+
+ leave:
+  /* Return copies of the server information.  */
+  *ldap_connp = item->ldap_conn;
+  if (real_ldapp)
+    *real_ldapp = item->real_ldap;
+  if (basednp)
+    *basednp = item->basedn? xstrdup (item->basedn) : NULL;
+  if (pgpkeyattrp)
+    *pgpkeyattrp = item->pgpkeyattr? xstrdup (item->pgpkeyattr) : NULL;
+  return 0;
+}
+
+
+/* Release the connection LDAP_CONN returned by my_ldap_connect.  If
+   KEEP is set and the connection is not needed anymore it is put
+   back into the pool; otherwise it is closed.  NULL for LDAP_CONN is
+   allowed.  */
+static void
+my_ldap_release (LDAP *ldap_conn, int keep)
+{
+  ldap_pool_item_t item, oldest;
+
+  if (!ldap_conn)
+    return;
+
+  for (item = ldap_pool; item; item = item->next)
+    if (item->ldap_conn == ldap_conn)
+      break;
+  if (!item)
+    {
+      ldap_unbind (ldap_conn);
+      return;
+    }
+  if (!keep)
+    {
+      ldap_pool_drop (item);
+      return;
+    }
+
+  item->in_use = 0;
+  item->last_used = gnupg_get_time ();
+  ldap_pool_idle++;
+
+  /* Limit the number of idle connections.  */
+  while (ldap_pool_idle > LDAP_POOL_MAX)
+    {
+      oldest = NULL;
+      for (item = ldap_pool; item; item = item->next)
+        if (!item->in_use && (!oldest || item->last_used < oldest->last_used))
+          oldest = item;
+      if (!oldest)
+        break;
+      ldap_pool_drop (oldest);
+    }
+}
+
+
+/* Close all idle connections which have not been used for some time.
+   This is called from the housekeeping thread.  */
+void
+ks_ldap_housekeeping (time_t curtime)
+{
+  ldap_pool_item_t item, next;
+
+  for (item = ldap_pool; item; item = next)
+    {
+      next = item->next;
+      if (!item->in_use && item->last_used + LDAP_POOL_IDLE < curtime)
+        ldap_pool_drop (item);
+    }
+}
+
+
+/* Print statistics about the LDAP connections.  */
+void
+ks_ldap_print_stats (void)
+{
+  log_info ("ldap keyserver connections: %u new, %u reused, %u idle\n",
+            ldap_stats.connects, ldap_stats.reuses, ldap_pool_idle);
+}
+
+
+/* Search for FILTER below BASEDN and store the result messages at
+   R_MSGS and their number at R_NMSGS.  If the LDAP library supports
+   it the entries are requested in pages so that a large result is not
+   cut off by the per-request size limit of the server.  Returns an
+   LDAP error code; LDAP_SIZELIMIT_EXCEEDED is returned along with
+   the results received so far.  The caller needs to release the
+   messages with ldap_msgfree and the array with xfree.  */
+static int
+my_ldap_search (LDAP *ldap_conn, const char *basedn, const char *filter,
+                char **attrs, LDAPMessage ***r_msgs, int *r_nmsgs)
+{
+  LDAPMessage **msgs;
+  LDAPMessage *res = NULL;
+  int err;
+
+  *r_msgs = NULL;
+  *r_nmsgs = 0;
+
+#ifdef USE_LDAP_PAGED_RESULTS
+  {
+    struct berval cookie = { 0, NULL };
+    LDAPControl *pagectrl, *ctrls[2], **resctrls, *found;
+    ber_int_t total;
+    LDAPMessage **tmp;
+    int nmsgs = 0;
+    int rc;
+
+    msgs = NULL;
+    do
+      {
+        err = ldap_create_page_control (ldap_conn, LDAP_PAGE_SIZE,
+                                        &cookie, 0, &pagectrl);
+        if (cookie.bv_val)
+          ber_memfree (cookie.bv_val);
+        cookie.bv_val = NULL;
+        cookie.bv_len = 0;
+        if (err != LDAP_SUCCESS)
+          break;
+        ctrls[0] = pagectrl;
+        ctrls[1] = NULL;
+
+        res = NULL;
+        err = ldap_search_ext_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
+                                 filter, attrs, 0, ctrls, NULL, NULL, 0, &res);
+        ldap_control_free (pagectrl);
+        if (err != LDAP_SUCCESS && err != LDAP_SIZELIMIT_EXCEEDED)
+          {
+            ldap_msgfree (res);
+            break;
+          }
+
+        tmp = xtryrealloc (msgs, (nmsgs + 1) * sizeof *msgs);
+        if (!tmp)
+          {
+            ldap_msgfree (res);
+            err = LDAP_NO_MEMORY;
+            break;
+          }
+        msgs = tmp;
+        msgs[nmsgs++] = res;
+
+        /* Get the cookie for the next page.  A server which does not
+           support paging returns all entries and no control.  */
+        resctrls = NULL;
+        rc = ldap_parse_result (ldap_conn, res, NULL, NULL, NULL, NULL,
+                                &resctrls, 0);
+        found = (rc == LDAP_SUCCESS && resctrls
+                 ? ldap_control_find (LDAP_CONTROL_PAGEDRESULTS,
+                                      resctrls, NULL) : NULL);
+        if (found
+            && ldap_parse_pageresponse_control (ldap_conn, found,
+                                                &total, &cookie))
+          {
+            cookie.bv_val = NULL;
+            cookie.bv_len = 0;
+          }
+        ldap_controls_free (resctrls);
+      }
+    while (err == LDAP_SUCCESS && cookie.bv_len && nmsgs < LDAP_MAX_PAGES);
+
+    if (cookie.bv_val)
+      ber_memfree (cookie.bv_val);
+    if (err == LDAP_SUCCESS && cookie.bv_len)
+      err = LDAP_SIZELIMIT_EXCEEDED;  /* Too many pages.  */
+
+    if (nmsgs && (err == LDAP_SUCCESS || err == LDAP_SIZELIMIT_EXCEEDED))
+      {
+        *r_msgs = msgs;
+        *r_nmsgs = nmsgs;
+        return err;
+      }
+    while (nmsgs)
+      ldap_msgfree (msgs[--nmsgs]);
+    xfree (msgs);
+    if (err != LDAP_NOT_SUPPORTED && err != LDAP_UNAVAILABLE_CRITICAL_EXTENSION)
+      return err;
+    /* Fall back to a plain search.  */
+    res = NULL;
+  }
+#endif /*USE_LDAP_PAGED_RESULTS*/
+
+  err = ldap_search_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
+                       filter, attrs, 0, &res);
+  if (err != LDAP_SUCCESS && err != LDAP_SIZELIMIT_EXCEEDED)
+    {
+      ldap_msgfree (res);
+      return err;
+    }
+  msgs = xtrymalloc (sizeof *msgs);
+  if (!msgs)
+    {
+      ldap_msgfree (res);
+      return LDAP_NO_MEMORY;
+    }
+  msgs[0] = res;
+  *r_msgs = msgs;
+  *r_nmsgs = 1;
+  return err;
+}
+
+
+/* Return the first entry of the search result MSGS with NMSGS pages
+   as returned by my_ldap_search.  The current page is stored at
+   R_PAGE.  */
+static LDAPMessage *
+my_ldap_first_entry (LDAP *ldap_conn, LDAPMessage **msgs, int nmsgs,
+                     int *r_page)
+{
+  LDAPMessage *each;
+
+  for (*r_page = 0; *r_page < nmsgs; (*r_page)++)
+    if ((each = ldap_first_entry (ldap_conn, msgs[*r_page])))
+      return each;
+  return NULL;
+}
+
+
+/* Return the entry following EACH in the search result MSGS with
+   NMSGS pages.  R_PAGE is the current page as set by
+   my_ldap_first_entry.  */
+static LDAPMessage *
+my_ldap_next_entry (LDAP *ldap_conn, LDAPMessage **msgs, int nmsgs,
+                    int *r_page, LDAPMessage *each)
+{
+  each = ldap_next_entry (ldap_conn, each);
+  while (!each && ++(*r_page) < nmsgs)
+    each = ldap_first_entry (ldap_conn, msgs[*r_page]);
+  return each;
+}
+
 /* Extract keys from an LDAP reply and write them out to the output
    stream OUTPUT in a format GnuPG can import (either the OpenPGP
    binary format or armored format).  */
@@ -1004,8 +1415,8 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
   xfree (pgpkeyattr);
   xfree (basedn);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (ldap_conn, (!err
+                               || gpg_err_code (err) == GPG_ERR_NO_DATA));
 
   xfree (filter);
 
@@ -1069,7 +1480,8 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
   {
     char **vals;
-    LDAPMessage *res, *each;
+    LDAPMessage **res, *each;
+    int nres, page, uidpage;
     int count = 0;
     strlist_t dupelist = NULL;
 
@@ -1084,8 +1496,7 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
     log_debug ("SEARCH '%s' => '%s' BEGIN\n", pattern, filter);
 
-    ldap_err = ldap_search_s (ldap_conn, basedn,
-			      LDAP_SCOPE_SUBTREE, filter, attrs, 0, &res);
+    ldap_err = my_ldap_search (ldap_conn, basedn, filter, attrs, &res, &nres);
 
     xfree (filter);
     filter = NULL;
@@ -1102,9 +1513,9 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
     /* The LDAP server doesn't return a real count of unique keys, so we
        can't use ldap_count_entries here. */
-    for (each = ldap_first_entry (ldap_conn, res);
+    for (each = my_ldap_first_entry (ldap_conn, res, nres, &page);
 	 each;
-	 each = ldap_next_entry (ldap_conn, each))
+	 each = my_ldap_next_entry (ldap_conn, res, nres, &page, each))
       {
 	char **certid = ldap_get_values (ldap_conn, each, "pgpcertid");
 	if (certid && certid[0] && ! strlist_find (dupelist, certid[0]))
@@ -1133,9 +1544,9 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
       {
 	es_fprintf (fp, "info:1:%d\n", count);
 
-	for (each = ldap_first_entry (ldap_conn, res);
+	for (each = my_ldap_first_entry (ldap_conn, res, nres, &page);
 	     each;
-	     each = ldap_next_entry (ldap_conn, each))
+	     each = my_ldap_next_entry (ldap_conn, res, nres, &page, each))
 	  {
 	    char **certid;
 	    LDAPMessage *uids;
@@ -1232,9 +1643,11 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 		es_fprintf (fp, "\n");
 
 		/* Now print all the uids that have this certid */
-		for (uids = ldap_first_entry (ldap_conn, res);
+		for (uids = my_ldap_first_entry (ldap_conn, res, nres,
+                                                 &uidpage);
 		     uids;
-		     uids = ldap_next_entry (ldap_conn, uids))
+		     uids = my_ldap_next_entry (ldap_conn, res, nres,
+                                                &uidpage, uids))
 		  {
 		    vals = ldap_get_values (ldap_conn, uids, "pgpcertid");
 		    if (! vals)
@@ -1268,7 +1681,9 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 	  }
       }
 
-    ldap_msgfree (res);
+    while (nres)
+      ldap_msgfree (res[--nres]);
+    xfree (res);
     free_strlist (dupelist);
   }
 
@@ -1291,8 +1706,7 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
   xfree (basedn);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (ldap_conn, !err);
 
   xfree (filter);
 
@@ -2071,8 +2485,7 @@ ks_ldap_put (ctrl_t ctrl, parsed_uri_t uri,
   if (dump)
     es_fclose (dump);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (ldap_conn, !err);
 
   xfree (basedn);
   xfree (pgpkeyattr);
@@ -30,6 +30,9 @@
 #include "../common/util.h"
 #include "misc.h"
 
+/* The size of the buffer used by copy_stream.  */
+#define COPY_STREAM_BUFSIZE 32768
+
 
 /* Convert the hex encoded STRING back into binary and store the
    result into the provided buffer RESULT.  The actual size of that
@@ -642,15 +645,35 @@ armor_data (char **r_string, const void *data, size_t datalen)
 gpg_error_t
 copy_stream (estream_t in, estream_t out)
 {
-  char buffer[512];
+  gpg_error_t err;
+  char *buffer;
   size_t nread;
 
-  while (!es_read (in, buffer, sizeof buffer, &nread))
+  /* Use a buffer matching the one of HTTP streams so that each read
+   * takes all buffered data of such a stream.  */
+  buffer = xtrymalloc (COPY_STREAM_BUFSIZE);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+
+  for (;;)
     {
+      if (es_read (in, buffer, COPY_STREAM_BUFSIZE, &nread))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
       if (!nread)
-        return 0; /* EOF */
+        {
+          err = 0; /* EOF */
+          break;
+        }
       if (out && es_write (out, buffer, nread, NULL))
-        break;
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
     }
-  return gpg_error_from_syserror ();
+
+  xfree (buffer);
+  return err;
 }
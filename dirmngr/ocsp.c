@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -34,6 +35,17 @@
 /* The maximum size we allow as a response from an OCSP reponder. */
 #define MAX_RESPONSE_SIZE 65536
 
+/* The name of the OCSP cache file in the cache directory, its
+   version, the maximum number of cached responses and the size of
+   the hash table.  */
+#define OCSP_CACHE_FILE     "ocsp-cache.txt"
+#define OCSP_CACHE_VERSION  1
+#define OCSP_CACHE_MAX      10000
+#define OCSP_CACHE_BUCKETS  1021
+
+/* The maximum number of certificates checked with one request.  */
+#define OCSP_MAX_TARGETS 10
+
 
 static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 
@@ -114,15 +126,15 @@ read_response (estream_t fp, unsigned char **r_buffer, size_t *r_buflen)
 }
 
 
-/* Construct an OCSP request, send it to the configured OCSP responder
-   and parse the response. On success the OCSP context may be used to
-   further process the response.  The signature value and the
-   production date are returned at R_SIGVAL and R_PRODUCED_AT; they
-   may be NULL or an empty string if not available.  A new hash
-   context is returned at R_MD.  */
+/* Construct an OCSP request for the targets already added to OCSP,
+   send it to the configured OCSP responder and parse the response.
+   On success the OCSP context may be used to further process the
+   response.  The signature value and the production date are
+   returned at R_SIGVAL and R_PRODUCED_AT; they may be NULL or an
+   empty string if not available.  A new hash context is returned at
+   R_MD.  */
 static gpg_error_t
-do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp,
-                 const char *url, ksba_cert_t cert, ksba_cert_t issuer_cert,
+do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp, const char *url,
                  ksba_sexp_t *r_sigval, ksba_isotime_t r_produced_at,
                  gcry_md_hd_t *r_md)
 {
@@ -155,13 +167,6 @@ do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp,
       return gpg_error (GPG_ERR_NOT_SUPPORTED);
     }
 
-  err = ksba_ocsp_add_target (ocsp, cert, issuer_cert);
-  if (err)
-    {
-      log_error (_("error setting OCSP target: %s\n"), gpg_strerror (err));
-      return err;
-    }
-
   {
     size_t n;
     unsigned char nonce[32];
@@ -586,10 +591,532 @@ check_signature (ctrl_t ctrl,
 }
 
 
+/* The OCSP cache.  Verified responses are kept until their nextUpdate
+ * time so that repeated checks of the same certificate do not need a
+ * new request and signature check.  The cache is kept in memory and
+ * written to OCSP_CACHE_FILE in the cache directory by the
+ * housekeeping and on shutdown.  Each line of that file is either a
+ * version line "v:1:" or a record
+ *
+ *   r:<issuer_hash>:<serialno>:<flags>:<errcode>:<this_update>:<next_update>:
+ *
+ * where ISSUER_HASH is the hex encoded SHA-1 hash of the issuer's DN
+ * and SERIALNO the hex encoded serial number of the certificate.
+ * FLAGS is "d" if the status was returned by the default responder.
+ * ERRCODE is 0 for a good certificate or GPG_ERR_CERT_REVOKED.  */
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  unsigned int use_default:1;   /* Returned by the default responder.  */
+  gpg_err_code_t ec;            /* The status as error code.  */
+  ksba_isotime_t this_update;
+  ksba_isotime_t next_update;
+  char key[1];                  /* "<issuer_hash>:<serialno>" */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+/* The hash table with the cached items.  */
+static ocsp_cache_item_t ocsp_cache[OCSP_CACHE_BUCKETS];
+
+/* The number of items in the cache.  */
+static unsigned int ocsp_cache_count;
+
+/* Set if the cache has been loaded from the file.  */
+static int ocsp_cache_loaded;
+
+/* Set if the cache needs to be written to the file.  */
+static int ocsp_cache_dirty;
+
+/* Set while the cache is being written to the file.  */
+static int ocsp_cache_saving;
+
+
+/* Return the bucket for KEY.  */
+static unsigned int
+ocsp_cache_bucket (const char *key)
+{
+  unsigned int hash = 0;
+
+  for (; *key; key++)
+    hash = hash * 31 + *(const unsigned char *)key;
+  return hash % OCSP_CACHE_BUCKETS;
+}
+
+
+/* Return the cache key for CERT or NULL on error.  */
+static char *
+ocsp_cache_key (ksba_cert_t cert)
+{
+  unsigned char issuerhash[20];
+  char issuerhash_hex[41];
+  char *issuer, *serial, *key;
+  ksba_sexp_t sn;
+
+  issuer = ksba_cert_get_issuer (cert, 0);
+  if (!issuer)
+    return NULL;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, issuerhash, issuer, strlen (issuer));
+  ksba_free (issuer);
+  bin2hex (issuerhash, 20, issuerhash_hex);
+
+  sn = ksba_cert_get_serial (cert);
+  if (!sn)
+    return NULL;
+  serial = serial_hex (sn);
+  ksba_free (sn);
+  if (!serial)
+    return NULL;
+
+  key = strconcat (issuerhash_hex, ":", serial, NULL);
+  xfree (serial);
+  return key;
+}
+
+
+/* Remove all expired items from the cache.  */
+static void
+ocsp_cache_purge (void)
+{
+  ksba_isotime_t current_time;
+  ocsp_cache_item_t item, *itemp;
+  int i;
+
+  gnupg_get_isotime (current_time);
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (itemp = &ocsp_cache[i]; (item = *itemp); )
+      {
+        if (strcmp (item->next_update, current_time) <= 0)
+          {
+            *itemp = item->next;
+            xfree (item);
+            ocsp_cache_count--;
+            ocsp_cache_dirty = 1;
+          }
+        else
+          itemp = &item->next;
+      }
+}
+
+
+/* Store the status EC of the certificate identified by KEY.  */
+static void
+ocsp_cache_put (const char *key, int use_default, gpg_err_code_t ec,
+                const ksba_isotime_t this_update,
+                const ksba_isotime_t next_update)
+{
+  ocsp_cache_item_t item, *itemp;
+  unsigned int bucket;
+
+  bucket = ocsp_cache_bucket (key);
+  for (itemp = &ocsp_cache[bucket]; (item = *itemp); itemp = &item->next)
+    if (!strcmp (item->key, key))
+      {
+        *itemp = item->next;
+        xfree (item);
+        ocsp_cache_count--;
+        break;
+      }
+
+  if (ocsp_cache_count >= OCSP_CACHE_MAX)
+    ocsp_cache_purge ();
+  if (ocsp_cache_count >= OCSP_CACHE_MAX)
+    return;
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    return;
+  strcpy (item->key, key);
+  item->use_default = !!use_default;
+  item->ec = ec;
+  gnupg_copy_time (item->this_update, this_update);
+  gnupg_copy_time (item->next_update, next_update);
+  item->next = ocsp_cache[bucket];
+  ocsp_cache[bucket] = item;
+  ocsp_cache_count++;
+  ocsp_cache_dirty = 1;
+
+  /* A revocation needs to be noticed by cached chain validations.  */
+  if (ec == GPG_ERR_CERT_REVOKED)
+    validate_cache_invalidate ();
+}
+
+
+/* Read the cache file.  */
+static void
+ocsp_cache_load (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[512];
+  char *field[8];
+  char *p, *endp;
+  int nfields, lineno, any_version;
+
+  ocsp_cache_loaded = 1;
+
+  fname = make_filename_try (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("error opening '%s': %s\n"),
+                  fname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (fname);
+      return;
+    }
+
+  any_version = 0;
+  lineno = 0;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      lineno++;
+      if (!*line || line[strlen (line)-1] != '\n')
+        break;  /* Too long or incomplete line.  */
+      if (*line == '#')
+        continue;
+
+      for (nfields=0, p=line;
+           nfields < DIM (field) && (endp = strchr (p, ':')); p = endp+1)
+        {
+          *endp = 0;
+          field[nfields++] = p;
+        }
+
+      if (nfields >= 2 && !strcmp (field[0], "v"))
+        {
+          if (atoi (field[1]) != OCSP_CACHE_VERSION)
+            break;
+          any_version = 1;
+        }
+      else if (any_version && nfields == 7 && !strcmp (field[0], "r")
+               && strlen (field[1]) == 40 && *field[2]
+               && strlen (field[2]) < 128
+               && !check_isotime (field[5]) && !check_isotime (field[6]))
+        {
+          char key[41+128];
+
+          strcpy (stpcpy (stpcpy (key, field[1]), ":"), field[2]);
+          ocsp_cache_put (key, !!strchr (field[3], 'd'), atoi (field[4]),
+                          field[5], field[6]);
+        }
+      else
+        {
+          log_info ("%s:%d: invalid line in OCSP cache file\n",
+                    fname, lineno);
+          break;
+        }
+    }
+  es_fclose (fp);
+  xfree (fname);
+
+  ocsp_cache_purge ();
+  ocsp_cache_dirty = 0;
+}
+
+
+/* Write the cache file if it has been changed.  */
+static void
+ocsp_cache_save (void)
+{
+  gpg_error_t err;
+  ocsp_cache_item_t item;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  estream_t memfp = NULL;
+  estream_t fp = NULL;
+  void *buffer = NULL;
+  size_t buflen, nwritten;
+  int i;
+
+  if (!ocsp_cache_loaded || !ocsp_cache_dirty || ocsp_cache_saving)
+    return;
+  ocsp_cache_saving = 1;
+
+  /* First print to a memory stream so that other threads can't modify
+   * the cache while we are writing it.  */
+  memfp = es_fopenmem (0, "w+b");
+  if (!memfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fprintf (memfp, "# OCSP cache file - do not edit\nv:%d:\n",
+              OCSP_CACHE_VERSION);
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (item = ocsp_cache[i]; item; item = item->next)
+      es_fprintf (memfp, "r:%s:%s:%u:%s:%s:\n",
+                  item->key, item->use_default? "d":"",
+                  (unsigned int)item->ec,
+                  item->this_update, item->next_update);
+  if (es_fclose_snatch (memfp, &buffer, &buflen))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memfp = NULL;
+  ocsp_cache_dirty = 0;
+
+  fname = make_filename_try (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  tmpfname = fname? strconcat (fname, ".tmp", NULL) : NULL;
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_write (fp, buffer, buflen, &nwritten))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      fp = NULL;
+      goto leave;
+    }
+  fp = NULL;
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    {
+      log_error (_("error writing '%s': %s\n"),
+                 tmpfname? tmpfname : OCSP_CACHE_FILE, gpg_strerror (err));
+      ocsp_cache_dirty = 1;
+    }
+  es_fclose (fp);
+  es_fclose (memfp);
+  es_free (buffer);
+  xfree (tmpfname);
+  xfree (fname);
+  ocsp_cache_saving = 0;
+}
+
+
+/* Look up the status of the certificate identified by KEY in the
+ * cache.  If NEED_DEFAULT is set only status returned by the default
+ * responder is considered.  Returns GPG_ERR_NO_DATA if there is no
+ * current status in the cache.  */
+static gpg_error_t
+ocsp_cache_get (const char *key, int need_default)
+{
+  ksba_isotime_t current_time;
+  ocsp_cache_item_t item;
+
+  if (!ocsp_cache_loaded)
+    ocsp_cache_load ();
+
+  for (item = ocsp_cache[ocsp_cache_bucket (key)]; item; item = item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (!item || (need_default && !item->use_default))
+    return gpg_error (GPG_ERR_NO_DATA);
+
+  gnupg_get_isotime (current_time);
+  if (strcmp (item->next_update, current_time) <= 0)
+    return gpg_error (GPG_ERR_NO_DATA);  /* Expired.  */
+
+  return item->ec? gpg_error (item->ec) : 0;
+}
+
+
+/* Return the cached OCSP status of CERT: 0 if the certificate is
+ * good, GPG_ERR_CERT_REVOKED if it is revoked, or GPG_ERR_NO_DATA if
+ * no current status is available.  */
+gpg_error_t
+ocsp_cache_cert_isvalid (ksba_cert_t cert)
+{
+  gpg_error_t err;
+  char *key;
+
+  key = ocsp_cache_key (cert);
+  if (!key)
+    return gpg_error (GPG_ERR_NO_DATA);
+  err = ocsp_cache_get (key, 0);
+  xfree (key);
+  return err;
+}
+
+
+/* Remove expired items from the OCSP cache and write it to disk.
+ * This is called by the housekeeping thread.  */
+void
+ocsp_cache_housekeeping (void)
+{
+  if (!ocsp_cache_loaded)
+    return;
+  ocsp_cache_purge ();
+  ocsp_cache_save ();
+}
+
+
+/* Write the OCSP cache to disk and release it.  */
+void
+ocsp_cache_deinit (void)
+{
+  ocsp_cache_item_t item;
+  int i;
+
+  ocsp_cache_save ();
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    while ((item = ocsp_cache[i]))
+      {
+        ocsp_cache[i] = item->next;
+        xfree (item);
+      }
+  ocsp_cache_count = 0;
+  ocsp_cache_loaded = 0;
+  ocsp_cache_dirty = 0;
+}
+
+
+/* Figure out the OCSP responder to use for CERT.
+   1. Try to get the reponder from the certificate.
+      We do only take http and https style URIs into account.
+   2. If this fails use the default responder, if any.
+   On success the URL is stored at R_URL; if it needs to be released
+   it is also stored at R_URL_BUFFER.  If the default responder is
+   used its list of signers is stored at R_DEFAULT_SIGNER.  With
+   QUIET set a missing default responder is not logged.  */
+static gpg_error_t
+get_responder_url (ksba_cert_t cert, int force_default_responder, int quiet,
+                   char **r_url_buffer, const char **r_url,
+                   fingerprint_list_t *r_default_signer)
+{
+  gpg_error_t err = 0;
+  const char *url;
+  int i, idx;
+  char *oid;
+  ksba_name_t name;
+
+  *r_url_buffer = NULL;
+  *r_url = NULL;
+  *r_default_signer = NULL;
+
+  url = NULL;
+  for (idx=0; !url && !opt.ignore_ocsp_service_url && !force_default_responder
+         && !(err=ksba_cert_get_authority_info_access (cert, idx,
+                                                       &oid, &name)); idx++)
+    {
+      if ( !strcmp (oid, oidstr_ocsp) )
+        {
+          for (i=0; !url && ksba_name_enum (name, i); i++)
+            {
+              char *p = ksba_name_get_uri (name, i);
+              if (p && (!ascii_strncasecmp (p, "http:", 5)
+                        || !ascii_strncasecmp (p, "https:", 6)))
+                url = *r_url_buffer = p;
+              else
+                xfree (p);
+            }
+        }
+      ksba_name_release (name);
+      ksba_free (oid);
+    }
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      log_error (_("can't get authorityInfoAccess: %s\n"), gpg_strerror (err));
+      xfree (*r_url_buffer);
+      *r_url_buffer = NULL;
+      return err;
+    }
+  if (!url)
+    {
+      if (!opt.ocsp_responder || !*opt.ocsp_responder)
+        {
+          if (!quiet)
+            log_info (_("no default OCSP responder defined\n"));
+          return gpg_error (GPG_ERR_CONFIGURATION);
+        }
+      if (!opt.ocsp_signer)
+        {
+          if (!quiet)
+            log_info (_("no default OCSP signer defined\n"));
+          return gpg_error (GPG_ERR_CONFIGURATION);
+        }
+      url = opt.ocsp_responder;
+      *r_default_signer = opt.ocsp_signer;
+      if (opt.verbose)
+        log_info (_("using default OCSP responder '%s'\n"), url);
+    }
+  else
+    {
+      if (opt.verbose)
+        log_info (_("using OCSP responder '%s'\n"), url);
+    }
+
+  *r_url = url;
+  return 0;
+}
+
+
+/* Check that the times of an OCSP status are acceptable.  */
+static gpg_error_t
+check_status_times (const ksba_isotime_t this_update,
+                    const ksba_isotime_t next_update)
+{
+  gpg_error_t err = 0;
+  ksba_isotime_t current_time;
+  ksba_isotime_t tmp_time;
+
+  /* Allow for some clock skew. */
+  gnupg_get_isotime (current_time);
+  add_seconds_to_isotime (current_time, opt.ocsp_max_clock_skew);
+
+  if (strcmp (this_update, current_time) > 0 )
+    {
+      log_error (_("OCSP responder returned a status in the future\n"));
+      log_info ("used now: %s  this_update: %s\n", current_time, this_update);
+      if (!err)
+        err = gpg_error (GPG_ERR_TIME_CONFLICT);
+    }
+
+  /* Check that THIS_UPDATE is not too far back in the past. */
+  gnupg_copy_time (tmp_time, this_update);
+  add_seconds_to_isotime (tmp_time,
+                          opt.ocsp_max_period+opt.ocsp_max_clock_skew);
+  if (!*tmp_time || strcmp (tmp_time, current_time) < 0 )
+    {
+      log_error (_("OCSP responder returned a non-current status\n"));
+      log_info ("used now: %s  this_update: %s\n",
+                current_time, this_update);
+      if (!err)
+        err = gpg_error (GPG_ERR_TIME_CONFLICT);
+    }
+
+  /* Check that we are not beyond NEXT_UPDATE  (plus some extra time). */
+  if (*next_update)
+    {
+      gnupg_copy_time (tmp_time, next_update);
+      add_seconds_to_isotime (tmp_time,
+                              opt.ocsp_current_period+opt.ocsp_max_clock_skew);
+      if (!*tmp_time && strcmp (tmp_time, current_time) < 0 )
+        {
+          log_error (_("OCSP responder returned an too old status\n"));
+          log_info ("used now: %s  next_update: %s\n",
+                    current_time, next_update);
+          if (!err)
+            err = gpg_error (GPG_ERR_TIME_CONFLICT);
+        }
+    }
+
+  return err;
+}
+
+
 /* Check whether the certificate either given by fingerprint CERT_FPR
    or directly through the CERT object is valid by running an OCSP
    transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
-   default responder is used. */
+   default responder is used.  A cached status is used as long as it
+   is current. */
 gpg_error_t
 ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
               int force_default_responder)
@@ -599,18 +1126,15 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   ksba_cert_t issuer_cert = NULL;
   ksba_sexp_t sigval = NULL;
   gcry_sexp_t s_sig = NULL;
-  ksba_isotime_t current_time;
   ksba_isotime_t this_update, next_update, revocation_time, produced_at;
-  ksba_isotime_t tmp_time;
   ksba_status_t status;
   ksba_crl_reason_t reason;
   char *url_buffer = NULL;
   const char *url;
   gcry_md_hd_t md = NULL;
-  int i, idx;
-  char *oid;
-  ksba_name_t name;
   fingerprint_list_t default_signer = NULL;
+  char *cache_key = NULL;
+  gpg_error_t time_err;
 
   /* Get the certificate.  */
   if (cert)
@@ -643,6 +1167,21 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         }
     }
 
+  /* Use a cached status if possible.  */
+  cache_key = ocsp_cache_key (cert);
+  if (cache_key)
+    {
+      err = ocsp_cache_get (cache_key, force_default_responder);
+      if (gpg_err_code (err) != GPG_ERR_NO_DATA)
+        {
+          if (opt.verbose)
+            log_info (_("using cached OCSP status\n"));
+          if (gpg_err_code (err) == GPG_ERR_CERT_REVOKED)
+            validate_cache_invalidate ();
+          goto leave;
+        }
+    }
+
   /* Create an OCSP instance.  */
   err = ksba_ocsp_new (&ocsp);
   if (err)
@@ -652,64 +1191,20 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       goto leave;
     }
 
-  /* Figure out the OCSP responder to use.
-     1. Try to get the reponder from the certificate.
-        We do only take http and https style URIs into account.
-     2. If this fails use the default responder, if any.
-   */
-  url = NULL;
-  for (idx=0; !url && !opt.ignore_ocsp_service_url && !force_default_responder
-         && !(err=ksba_cert_get_authority_info_access (cert, idx,
-                                                       &oid, &name)); idx++)
-    {
-      if ( !strcmp (oid, oidstr_ocsp) )
-        {
-          for (i=0; !url && ksba_name_enum (name, i); i++)
-            {
-              char *p = ksba_name_get_uri (name, i);
-              if (p && (!ascii_strncasecmp (p, "http:", 5)
-                        || !ascii_strncasecmp (p, "https:", 6)))
-                url = url_buffer = p;
-              else
-                xfree (p);
-            }
-        }
-      ksba_name_release (name);
-      ksba_free (oid);
-    }
-  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+  err = get_responder_url (cert, force_default_responder, 0,
+                           &url_buffer, &url, &default_signer);
+  if (err)
+    goto leave;
+
+  err = ksba_ocsp_add_target (ocsp, cert, issuer_cert);
+  if (err)
     {
-      log_error (_("can't get authorityInfoAccess: %s\n"), gpg_strerror (err));
+      log_error (_("error setting OCSP target: %s\n"), gpg_strerror (err));
       goto leave;
     }
-  if (!url)
-    {
-      if (!opt.ocsp_responder || !*opt.ocsp_responder)
-        {
-          log_info (_("no default OCSP responder defined\n"));
-          err = gpg_error (GPG_ERR_CONFIGURATION);
-          goto leave;
-        }
-      if (!opt.ocsp_signer)
-        {
-          log_info (_("no default OCSP signer defined\n"));
-          err = gpg_error (GPG_ERR_CONFIGURATION);
-          goto leave;
-        }
-      url = opt.ocsp_responder;
-      default_signer = opt.ocsp_signer;
-      if (opt.verbose)
-        log_info (_("using default OCSP responder '%s'\n"), url);
-    }
-  else
-    {
-      if (opt.verbose)
-        log_info (_("using OCSP responder '%s'\n"), url);
-    }
 
   /* Ask the OCSP responder. */
-  err = do_ocsp_request (ctrl, ocsp, url, cert, issuer_cert,
-                         &sigval, produced_at, &md);
+  err = do_ocsp_request (ctrl, ocsp, url, &sigval, produced_at, &md);
   if (err)
     goto leave;
 
@@ -769,19 +1264,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   /* In case the certificate has been revoked, we better invalidate
      our cached validation status. */
   if (status == KSBA_STATUS_REVOKED)
-    {
-      time_t validated_at = 0; /* That is: No cached validation available. */
-      err = ksba_cert_set_user_data (cert, "validated_at",
-                                     &validated_at, sizeof (validated_at));
-      if (err)
-        {
-          log_error ("set_user_data(validated_at) failed: %s\n",
-                     gpg_strerror (err));
-          err = 0; /* The certificate is anyway revoked, and that is a
-                      more important message than the failure of our
-                      cache. */
-        }
-    }
+    validate_cache_invalidate ();
 
 
   if (opt.verbose)
@@ -822,49 +1305,19 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   else if (status != KSBA_STATUS_GOOD)
     err = gpg_error (GPG_ERR_GENERAL);
 
-  /* Allow for some clock skew. */
-  gnupg_get_isotime (current_time);
-  add_seconds_to_isotime (current_time, opt.ocsp_max_clock_skew);
-
-  if (strcmp (this_update, current_time) > 0 )
-    {
-      log_error (_("OCSP responder returned a status in the future\n"));
-      log_info ("used now: %s  this_update: %s\n", current_time, this_update);
-      if (!err)
-        err = gpg_error (GPG_ERR_TIME_CONFLICT);
-    }
-
-  /* Check that THIS_UPDATE is not too far back in the past. */
-  gnupg_copy_time (tmp_time, this_update);
-  add_seconds_to_isotime (tmp_time,
-                          opt.ocsp_max_period+opt.ocsp_max_clock_skew);
-  if (!*tmp_time || strcmp (tmp_time, current_time) < 0 )
-    {
-      log_error (_("OCSP responder returned a non-current status\n"));
-      log_info ("used now: %s  this_update: %s\n",
-                current_time, this_update);
-      if (!err)
-        err = gpg_error (GPG_ERR_TIME_CONFLICT);
-    }
+  time_err = check_status_times (this_update, next_update);
+  if (!err)
+    err = time_err;
 
-  /* Check that we are not beyond NEXT_UPDATE  (plus some extra time). */
-  if (*next_update)
-    {
-      gnupg_copy_time (tmp_time, next_update);
-      add_seconds_to_isotime (tmp_time,
-                              opt.ocsp_current_period+opt.ocsp_max_clock_skew);
-      if (!*tmp_time && strcmp (tmp_time, current_time) < 0 )
-        {
-          log_error (_("OCSP responder returned an too old status\n"));
-          log_info ("used now: %s  next_update: %s\n",
-                    current_time, next_update);
-          if (!err)
-            err = gpg_error (GPG_ERR_TIME_CONFLICT);
-        }
-    }
+  /* Cache the status until NEXT_UPDATE.  */
+  if (cache_key && *next_update && !time_err
+      && (!err || gpg_err_code (err) == GPG_ERR_CERT_REVOKED))
+    ocsp_cache_put (cache_key, !!default_signer, gpg_err_code (err),
+                    this_update, next_update);
 
 
  leave:
+  xfree (cache_key);
   gcry_md_close (md);
   gcry_sexp_release (s_sig);
   xfree (sigval);
@@ -876,6 +1329,154 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
 }
 
 
+/* Ask the OCSP responders for the status of the NCERTS certificates
+   in CERTS and store the results in the OCSP cache.  Certificates
+   with the same responder are checked with one request.  Errors are
+   only logged; the caller should look at the cache afterwards and
+   fall back to other methods if it has no status.  */
+void
+ocsp_prefetch (ctrl_t ctrl, ksba_cert_t *certs, int ncerts)
+{
+  gpg_error_t err;
+  struct {
+    ksba_cert_t issuer_cert;
+    char *cache_key;
+    char *url_buffer;
+    const char *url;
+    fingerprint_list_t default_signer;
+    int done;   /* No request needed or already added to a request.  */
+    int batch;  /* Index+1 of the item which started the request.  */
+  } *items;
+  ksba_ocsp_t ocsp;
+  ksba_sexp_t sigval;
+  gcry_sexp_t s_sig;
+  gcry_md_hd_t md;
+  ksba_isotime_t this_update, next_update, revocation_time, produced_at;
+  ksba_status_t status;
+  ksba_crl_reason_t reason;
+  int i, j, ntargets;
+
+  if (ncerts < 2)
+    return;  /* Nothing to batch.  */
+
+  items = xtrycalloc (ncerts, sizeof *items);
+  if (!items)
+    return;
+
+  /* Figure out which certificates need a request.  */
+  for (i=0; i < ncerts; i++)
+    {
+      items[i].done = 1;
+      items[i].cache_key = ocsp_cache_key (certs[i]);
+      if (!items[i].cache_key
+          || gpg_err_code (ocsp_cache_get (items[i].cache_key, 0))
+             != GPG_ERR_NO_DATA)
+        continue;
+      if (find_issuing_cert (ctrl, certs[i], &items[i].issuer_cert))
+        continue;
+      if (get_responder_url (certs[i], 0, 1, &items[i].url_buffer,
+                             &items[i].url, &items[i].default_signer))
+        continue;
+      items[i].done = 0;
+    }
+
+  /* Send one request per responder.  */
+  for (i=0; i < ncerts; i++)
+    {
+      if (items[i].done)
+        continue;
+
+      ocsp = NULL;
+      sigval = NULL;
+      s_sig = NULL;
+      md = NULL;
+
+      err = ksba_ocsp_new (&ocsp);
+      if (err)
+        {
+          log_error (_("failed to allocate OCSP context: %s\n"),
+                     gpg_strerror (err));
+          break;
+        }
+      for (ntargets=0, j=i; j < ncerts && ntargets < OCSP_MAX_TARGETS; j++)
+        {
+          if (items[j].done
+              || items[j].default_signer != items[i].default_signer
+              || strcmp (items[j].url, items[i].url))
+            continue;
+          items[j].done = 1;
+          items[j].batch = i + 1;
+          err = ksba_ocsp_add_target (ocsp, certs[j], items[j].issuer_cert);
+          if (err)
+            {
+              log_error (_("error setting OCSP target: %s\n"),
+                         gpg_strerror (err));
+              goto next;
+            }
+          ntargets++;
+        }
+      if (opt.verbose)
+        log_info ("checking %d certificates with one OCSP request\n",
+                  ntargets);
+
+      err = do_ocsp_request (ctrl, ocsp, items[i].url,
+                             &sigval, produced_at, &md);
+      if (err)
+        goto next;
+      if (!sigval || !*produced_at || !md)
+        {
+          err = gpg_error (GPG_ERR_INV_OBJ);
+          goto next;
+        }
+      err = canon_sexp_to_gcry (sigval, &s_sig);
+      if (err)
+        goto next;
+      err = check_signature (ctrl, ocsp, s_sig, md, items[i].default_signer);
+      if (err)
+        goto next;
+
+      /* Store the status of each target in the cache.  */
+      for (j=i; j < ncerts; j++)
+        {
+          if (items[j].batch != i + 1)
+            continue;
+          err = ksba_ocsp_get_status (ocsp, certs[j],
+                                      &status, this_update, next_update,
+                                      revocation_time, &reason);
+          if (err)
+            {
+              log_error (_("error getting OCSP status for target"
+                           " certificate: %s\n"), gpg_strerror (err));
+              continue;
+            }
+          if (status == KSBA_STATUS_GOOD)
+            err = 0;
+          else if (status == KSBA_STATUS_REVOKED)
+            err = gpg_error (GPG_ERR_CERT_REVOKED);
+          else
+            continue;
+          if (*next_update && !check_status_times (this_update, next_update))
+            ocsp_cache_put (items[j].cache_key, !!items[i].default_signer,
+                            gpg_err_code (err), this_update, next_update);
+        }
+
+    next:
+      gcry_md_close (md);
+      gcry_sexp_release (s_sig);
+      xfree (sigval);
+      ksba_ocsp_release (ocsp);
+    }
+
+  for (i=0; i < ncerts; i++)
+    {
+      ksba_cert_release (items[i].issuer_cert);
+      xfree (items[i].cache_key);
+      xfree (items[i].url_buffer);
+    }
+  xfree (items);
+}
+
+
 /* Release the list of OCSP certificates hold in the CTRL object. */
 void
 release_ctrl_ocsp_certs (ctrl_t ctrl)
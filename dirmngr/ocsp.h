@@ -24,8 +24,13 @@
 
 gpg_error_t ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
                           int force_default_responder);
+void ocsp_prefetch (ctrl_t ctrl, ksba_cert_t *certs, int ncerts);
 
 /* Release the list of OCSP certificates hold in the CTRL object. */
 void release_ctrl_ocsp_certs (ctrl_t ctrl);
 
+gpg_error_t ocsp_cache_cert_isvalid (ksba_cert_t cert);
+void ocsp_cache_housekeeping (void);
+void ocsp_cache_deinit (void);
+
 #endif /*OCSP_H*/
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include <assuan.h>
@@ -85,6 +86,11 @@
 
 
 
+/* An object to coalesce identical requests.  */
+struct inflight_s;
+typedef struct inflight_s *inflight_t;
+
+
 /* Control structure per connection. */
 struct server_local_s
 {
@@ -113,6 +119,9 @@ struct server_local_s
   size_t inhibit_data_logging_count;
   unsigned int inhibit_data_logging : 1;
   unsigned int inhibit_data_logging_now : 1;
+
+  /* The request this session is currently leading or NULL.  */
+  inflight_t inflight;
 };
 
 
@@ -290,6 +299,171 @@ data_line_cookie_close (void *cookie)
 }
 
 
+/* Request coalescing.  If several sessions ask for the same thing at
+ * the same time (e.g. right after a mail has been sent to many
+ * recipients) only the first session, the leader, does the actual
+ * work.  The other sessions, the followers, wait for the leader and
+ * then return its result.  A request is identified by a string with
+ * the command name and all arguments which affect the result.  */
+struct inflight_s
+{
+  struct inflight_s *next;
+  unsigned int refcount;  /* Number of sessions using this object.  */
+  unsigned int done:1;    /* The leader has stored its result.  */
+  npth_cond_t cond;       /* Signaled when DONE is set.  */
+  gpg_error_t err;        /* The leader's return code.  */
+  void *data;             /* The data returned by the leader or NULL.  */
+  size_t datalen;         /* The length of DATA.  */
+  char *source;           /* The leader's SOURCE status or NULL.  */
+  char key[1];            /* The string identifying the request.  */
+};
+
+/* The list of requests in progress.  */
+static inflight_t inflight_list;
+
+/* The mutex used to wait for the leaders.  */
+static npth_mutex_t inflight_lock = NPTH_MUTEX_INITIALIZER;
+
+
+/* Start the request KEY.  On success R_ITEM receives an object which
+ * must be passed to inflight_end.  If an identical request is already
+ * in progress this function waits until it has finished and sets
+ * R_LEADER to false; the caller shall then not do anything else
+ * before calling inflight_end.  Otherwise R_LEADER is set to true and
+ * the caller is expected to do the work.  */
+static gpg_error_t
+inflight_begin (ctrl_t ctrl, const char *key,
+                inflight_t *r_item, int *r_leader)
+{
+  inflight_t item;
+  int rc;
+
+  *r_item = NULL;
+  *r_leader = 0;
+
+  npth_mutex_lock (&inflight_lock);
+  for (item = inflight_list; item; item = item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (item)
+    {
+      if (DBG_IPC)
+        log_debug ("waiting for a concurrent %.*s request\n",
+                   (int)strcspn (key, " "), key);
+      item->refcount++;
+      while (!item->done)
+        npth_cond_wait (&item->cond, &inflight_lock);
+      npth_mutex_unlock (&inflight_lock);
+      *r_item = item;
+      return 0;
+    }
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    {
+      npth_mutex_unlock (&inflight_lock);
+      return gpg_error_from_syserror ();
+    }
+  rc = npth_cond_init (&item->cond, NULL);
+  if (rc)
+    {
+      npth_mutex_unlock (&inflight_lock);
+      xfree (item);
+      return gpg_error_from_errno (rc);
+    }
+  strcpy (item->key, key);
+  item->refcount = 1;
+  item->next = inflight_list;
+  inflight_list = item;
+  npth_mutex_unlock (&inflight_lock);
+
+  if (ctrl->server_local)
+    ctrl->server_local->inflight = item;
+  *r_item = item;
+  *r_leader = 1;
+  return 0;
+}
+
+
+/* Record the SOURCE status SOURCE of the leader's request ITEM.  */
+static void
+inflight_note_source (inflight_t item, const char *source)
+{
+  if (!source)
+    return;
+  xfree (item->source);
+  item->source = xtrystrdup (source);
+}
+
+
+/* Finish the request ITEM as returned by inflight_begin and release
+ * it.  ITEM may be NULL in which case ERR is returned.  The leader
+ * passes its return code ERR and a memory stream MEMFP with its data
+ * or NULL; MEMFP is closed by this function.  Both are then handed
+ * to the followers; the leader's SOURCE status is repeated for them.
+ * If OUTFP is not NULL the data is written to it.  Returns the
+ * result of the request.  */
+static gpg_error_t
+inflight_end (ctrl_t ctrl, inflight_t item, gpg_error_t err,
+              estream_t memfp, estream_t outfp)
+{
+  inflight_t *prevp;
+
+  if (!item)
+    {
+      es_fclose (memfp);
+      return err;
+    }
+
+  if (!item->done)  /* We are the leader.  */
+    {
+      if (ctrl->server_local)
+        ctrl->server_local->inflight = NULL;
+      if (memfp && es_fclose_snatch (memfp, &item->data, &item->datalen))
+        {
+          if (!err)
+            err = gpg_error_from_syserror ();
+          es_fclose (memfp);
+        }
+      item->err = err;
+
+      npth_mutex_lock (&inflight_lock);
+      for (prevp = &inflight_list; *prevp; prevp = &(*prevp)->next)
+        if (*prevp == item)
+          {
+            *prevp = item->next;
+            break;
+          }
+      item->done = 1;
+      npth_cond_broadcast (&item->cond);
+      npth_mutex_unlock (&inflight_lock);
+    }
+  else
+    {
+      log_assert (!memfp);
+      err = item->err;
+      if (item->source)
+        dirmngr_status (ctrl, "SOURCE", item->source, NULL);
+    }
+
+  if (outfp && item->datalen
+      && es_write (outfp, item->data, item->datalen, NULL) && !err)
+    err = gpg_error_from_syserror ();
+
+  npth_mutex_lock (&inflight_lock);
+  if (!--item->refcount)
+    {
+      npth_cond_destroy (&item->cond);
+      es_free (item->data);
+      xfree (item->source);
+      xfree (item);
+    }
+  npth_mutex_unlock (&inflight_lock);
+
+  return err;
+}
+
+
 /* Copy the % and + escaped string S into the buffer D and replace the
    escape sequences.  Note, that it is sufficient to allocate the
    target string D as long as the source string S, i.e.: strlen(s)+1.
@@ -829,10 +1003,11 @@ cmd_dns_cert (assuan_context_t ctx, char *line)
 
 
 
-/* Core of cmd_wkd_get and task_check_wkd_support.  If CTX is NULL
- * this function will not write anything to the assuan output.  */
+/* Core of cmd_wkd_get and task_check_wkd_support.  The data is
+ * written to OUTFP; if OUTFP is NULL the data is not returned.  CTX
+ * is only used for error messages and may be NULL.  */
 static gpg_error_t
-proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
+proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line, estream_t outfp)
 {
   gpg_error_t err = 0;
   char *mbox = NULL;
@@ -848,7 +1023,6 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
   int opt_submission_addr;
   int opt_policy_flags;
   int is_wkd_query;   /* True if this is a real WKD query.  */
-  int no_log = 0;
   char portstr[20] = { 0 };
   int subdomain_mode = 0;
 
@@ -1019,7 +1193,6 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
                            escapedmbox,
                            NULL);
           xfree (escapedmbox);
-          no_log = 1;
           if (uri)
             {
               err = dirmngr_status_printf (ctrl, "SOURCE", "https://%s%s",
@@ -1035,58 +1208,38 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
       goto leave;
     }
 
-  /* Setup an output stream and perform the get.  */
-  {
-    estream_t outfp;
-
-    outfp = ctx? es_fopencookie (ctx, "w", data_line_cookie_functions) : NULL;
-    if (!outfp && ctx)
-      err = set_error (GPG_ERR_ASS_GENERAL,
-                       "error setting up a data stream");
-    else
-      {
-        if (ctrl->server_local)
-          {
-            if (no_log)
-              ctrl->server_local->inhibit_data_logging = 1;
-            ctrl->server_local->inhibit_data_logging_now = 0;
-            ctrl->server_local->inhibit_data_logging_count = 0;
-          }
-        err = ks_action_fetch (ctrl, uri, outfp);
-        es_fclose (outfp);
-        if (ctrl->server_local)
-          ctrl->server_local->inhibit_data_logging = 0;
+  /* Perform the get.  */
+  err = ks_action_fetch (ctrl, uri, KS_HTTP_FETCH_CACHE, outfp);
 
-        /* Register the result under the domain name of MBOX. */
-        switch (gpg_err_code (err))
-          {
-          case 0:
-            domaininfo_set_wkd_supported (domain_orig);
-            break;
+  /* Register the result under the domain name of MBOX. */
+  switch (gpg_err_code (err))
+    {
+    case 0:
+      domaininfo_set_wkd_supported (domain_orig);
+      break;
 
-          case GPG_ERR_NO_NAME:
-            /* There is no such domain.  */
-            domaininfo_set_no_name (domain_orig);
-            break;
+    case GPG_ERR_NO_NAME:
+      /* There is no such domain.  */
+      domaininfo_set_no_name (domain_orig);
+      break;
 
-          case GPG_ERR_NO_DATA:
-            if (is_wkd_query && ctrl->server_local)
-              {
-                /* Mark that and schedule a check.  */
-                domaininfo_set_wkd_not_found (domain_orig);
-                workqueue_add_task (task_check_wkd_support, domain_orig,
-                                    ctrl->server_local->session_id, 1);
-              }
-            else if (opt_policy_flags) /* No policy file - no support.  */
-              domaininfo_set_wkd_not_supported (domain_orig);
-            break;
+    case GPG_ERR_NO_DATA:
+      if (is_wkd_query && ctrl->server_local)
+        {
+          /* Mark that and schedule a check.  */
+          domaininfo_set_wkd_not_found (domain_orig);
+          workqueue_add_task (task_check_wkd_support, domain_orig,
+                              ctrl->server_local->session_id, 1,
+                              WQ_PRIO_INTERACTIVE);
+        }
+      else if (opt_policy_flags) /* No policy file - no support.  */
+        domaininfo_set_wkd_not_supported (domain_orig);
+      break;
 
-          default:
-            /* Don't register other errors.  */
-            break;
-          }
-      }
-  }
+    default:
+      /* Don't register other errors.  */
+      break;
+    }
 
  leave:
   xfree (uri);
@@ -1107,9 +1260,53 @@ cmd_wkd_get (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
+  char *key;
+  inflight_t inflight;
+  int leader;
+  estream_t memfp = NULL;
+  estream_t outfp;
 
-  err = proc_wkd_get (ctrl, ctx, line);
+  key = strconcat ("WKD_GET ", line, NULL);
+  if (!key)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = inflight_begin (ctrl, key, &inflight, &leader);
+  if (err)
+    goto leave;
+
+  if (leader)
+    {
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        err = gpg_error_from_syserror ();
+      else
+        err = proc_wkd_get (ctrl, ctx, line, memfp);
+    }
 
+  /* Setup an output stream and return the data.  We do not log the
+   * data of a real WKD query.  */
+  outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+  if (!outfp)
+    {
+      inflight_end (ctrl, inflight, err, memfp, NULL);
+      err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
+    }
+  else
+    {
+      if (!has_option (line, "--submission-address")
+          && !has_option (line, "--policy-flags"))
+        ctrl->server_local->inhibit_data_logging = 1;
+      ctrl->server_local->inhibit_data_logging_now = 0;
+      ctrl->server_local->inhibit_data_logging_count = 0;
+      err = inflight_end (ctrl, inflight, err, memfp, outfp);
+      es_fclose (outfp);
+      ctrl->server_local->inhibit_data_logging = 0;
+    }
+
+ leave:
+  xfree (key);
   return leave_cmd (ctx, err);
 }
 
@@ -1129,7 +1326,7 @@ task_check_wkd_support (ctrl_t ctrl, const char *domain)
     log_error ("%s: %s\n", __func__, gpg_strerror (gpg_error_from_syserror ()));
   else
     {
-      proc_wkd_get (ctrl, NULL, string);
+      proc_wkd_get (ctrl, NULL, string, NULL);
       xfree (string);
     }
 
@@ -1206,6 +1403,15 @@ cmd_isvalid (assuan_context_t ctx, char *line)
   int ocsp_mode = 0;
   int only_ocsp;
   int force_default_responder;
+  char *key;
+  inflight_t inflight = NULL;
+  int leader;
+
+  key = strconcat ("ISVALID ",
+                   ctrl->force_crl_refresh? "--force-crl-refresh ":"",
+                   line, NULL);
+  if (!key)
+    return leave_cmd (ctx, gpg_error_from_syserror ());
 
   only_ocsp = has_option (line, "--only-ocsp");
   force_default_responder = has_option (line, "--force-default-responder");
@@ -1220,12 +1426,14 @@ cmd_isvalid (assuan_context_t ctx, char *line)
   if (!serialno)
     {
       xfree (issuerhash);
+      xfree (key);
       return leave_cmd (ctx, PARM_ERROR (_("serialno missing in cert ID")));
     }
   *serialno++ = 0;
   if (strlen (issuerhash) != 40)
     {
       xfree (issuerhash);
+      xfree (key);
       return leave_cmd (ctx, PARM_ERROR ("cert ID is too short"));
     }
 
@@ -1240,11 +1448,17 @@ cmd_isvalid (assuan_context_t ctx, char *line)
       if (strlen (fpr) != 40)
         {
           xfree (issuerhash);
+          xfree (key);
           return leave_cmd (ctx, PARM_ERROR ("fingerprint too short"));
         }
       ocsp_mode = 1;
     }
 
+  /* If the same certificate is being checked by another session we
+   * wait for its result.  */
+  err = inflight_begin (ctrl, key, &inflight, &leader);
+  if (err || !leader)
+    goto leave;
 
  again:
   if (ocsp_mode)
@@ -1299,7 +1513,147 @@ cmd_isvalid (assuan_context_t ctx, char *line)
         }
     }
 
+ leave:
+  err = inflight_end (ctrl, inflight, err, NULL, NULL);
   xfree (issuerhash);
+  xfree (key);
+  return leave_cmd (ctx, err);
+}
+
+
+/* Helper for cmd_isvalidchain to check the single certificate CERT
+ * the same way cmd_isvalid does.  All required certificates are
+ * expected to be in the cache; thus no inquiries are needed.  */
+static gpg_error_t
+isvalid_one_cert (ctrl_t ctrl, ksba_cert_t cert, int ocsp_mode,
+                  int only_ocsp, int force_default_responder)
+{
+  gpg_error_t err;
+
+  if (ocsp_mode)
+    {
+      if (!opt.allow_ocsp)
+        err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      else
+        err = ocsp_isvalid (ctrl, cert, NULL, force_default_responder);
+
+      if (gpg_err_code (err) != GPG_ERR_CONFIGURATION
+          || gpg_err_source (err) != GPG_ERR_SOURCE_DIRMNGR)
+        return err;
+
+      /* No default responder configured - fallback to CRL.  */
+      if (!only_ocsp)
+        log_info ("falling back to CRL check\n");
+    }
+
+  if (only_ocsp)
+    return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+
+  err = crl_cache_cert_isvalid (ctrl, cert, ctrl->force_crl_refresh);
+  if (gpg_err_code (err) == GPG_ERR_NO_CRL_KNOWN)
+    {
+      err = crl_cache_reload_crl (ctrl, cert);
+      if (!err)
+        err = crl_cache_cert_isvalid (ctrl, cert, 0);
+    }
+  return err;
+}
+
+
+static const char hlp_isvalidchain[] =
+  "ISVALIDCHAIN [--ocsp] [--only-ocsp] [--force-default-responder] <n>\n"
+  "\n"
+  "Check the first N certificates of a chain in one go.  The chain is\n"
+  "inquired using\n"
+  "\n"
+  "  INQUIRE CERTLIST\n"
+  "\n"
+  "and the caller is expected to return the PEM encoded certificates\n"
+  "starting with the target certificate; each following certificate\n"
+  "is the issuer of the preceding one.  Each of the N certificates is\n"
+  "checked as with ISVALID and its result is returned by the status\n"
+  "line\n"
+  "\n"
+  "  ISVALID <idx> <errorcode>\n"
+  "\n"
+  "with IDX being the 0-based index into the list.  An\n"
+  "ONLY_VALID_IF_CERT_VALID status for a certificate is emitted\n"
+  "before its ISVALID line.  The option --ocsp requests an OCSP check\n"
+  "before consulting the CRL; the other options are as with ISVALID.\n"
+  "The command itself fails only if the list could not be processed.";
+static gpg_error_t
+cmd_isvalidchain (assuan_context_t ctx, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  certlist_t certlist = NULL;
+  certlist_t cl;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  int ocsp_mode, only_ocsp, force_default_responder;
+  int idx, ncheck;
+
+  ocsp_mode = has_option (line, "--ocsp");
+  only_ocsp = has_option (line, "--only-ocsp");
+  force_default_responder = has_option (line, "--force-default-responder");
+  line = skip_options (line);
+
+  ncheck = atoi (line);
+  if (ncheck < 1)
+    return leave_cmd (ctx, PARM_ERROR ("number of certificates missing"));
+
+  err = assuan_inquire (ctrl->server_local->assuan_ctx, "CERTLIST",
+                        &value, &valuelen, MAX_CERTLIST_LENGTH);
+  if (err)
+    {
+      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+      goto leave;
+    }
+
+  if (!valuelen) /* No data returned; return a comprehensible error. */
+    err = gpg_error (GPG_ERR_MISSING_CERT);
+  else
+    {
+      estream_t fp;
+
+      fp = es_fopenmem_init (0, "rb", value, valuelen);
+      if (!fp)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = read_certlist_from_stream (&certlist, fp);
+          es_fclose (fp);
+        }
+    }
+  xfree (value);
+  if (err)
+    goto leave;
+
+  for (idx=0, cl=certlist; cl; cl = cl->next)
+    idx++;
+  if (idx < ncheck)
+    {
+      err = gpg_error (GPG_ERR_MISSING_CERT);
+      goto leave;
+    }
+
+  /* Put the certificates into the cache so that the CRL and OCSP
+   * code finds the issuers without inquiring them one by one.  */
+  for (cl = certlist; cl; cl = cl->next)
+    cache_cert (cl->cert);
+
+  for (idx=0, cl=certlist; idx < ncheck; cl = cl->next, idx++)
+    {
+      err = dirmngr_status_printf (ctrl, "ISVALID", "%d %u", idx,
+                                   isvalid_one_cert (ctrl, cl->cert,
+                                                     ocsp_mode, only_ocsp,
+                                                     force_default_responder));
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  release_certlist (certlist);
   return leave_cmd (ctx, err);
 }
 
@@ -1811,6 +2165,17 @@ cmd_loadcrl (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err = 0;
   int use_url = has_leading_option (line, "--url");
+  char *key;
+  inflight_t inflight = NULL;
+  int leader;
+
+  key = strconcat ("LOADCRL ", line, NULL);
+  if (!key)
+    return leave_cmd (ctx, gpg_error_from_syserror ());
+  err = inflight_begin (ctrl, key, &inflight, &leader);
+  xfree (key);
+  if (err || !leader)
+    goto leave;
 
   line = skip_options (line);
 
@@ -1846,6 +2211,8 @@ cmd_loadcrl (assuan_context_t ctx, char *line)
         }
     }
 
+ leave:
+  err = inflight_end (ctrl, inflight, err, NULL, NULL);
   return leave_cmd (ctx, err);
 }
 
@@ -2338,26 +2705,36 @@ cmd_keyserver (assuan_context_t ctx, char *line)
 
 
 static const char hlp_ks_search[] =
-  "KS_SEARCH {<pattern>}\n"
+  "KS_SEARCH [--quick] [--limit=N] {<pattern>}\n"
   "\n"
   "Search the configured OpenPGP keyservers (see command KEYSERVER)\n"
-  "for keys matching PATTERN";
+  "for keys matching PATTERN.  With --limit the result is truncated\n"
+  "after N keys and the download from the keyserver is stopped.";
 static gpg_error_t
 cmd_ks_search (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
-  strlist_t list, sl;
-  char *p;
+  strlist_t list = NULL;
+  strlist_t sl;
+  char *p, *value;
   estream_t outfp;
+  unsigned int limit = 0;
 
   if (has_option (line, "--quick"))
     ctrl->timeout = opt.connect_quick_timeout;
+  err = get_option_value (line, "--limit", &value);
+  if (err)
+    goto leave;
+  if (value)
+    {
+      limit = strtoul (value, NULL, 10);
+      xfree (value);
+    }
   line = skip_options (line);
 
   /* Break the line down into an strlist.  Each pattern is
      percent-plus escaped. */
-  list = NULL;
   for (p=line; *p; line = p)
     {
       while (*p && *p != ' ')
@@ -2390,7 +2767,7 @@ cmd_ks_search (assuan_context_t ctx, char *line)
   else
     {
       err = ks_action_search (ctrl, ctrl->server_local->keyservers,
-			      list, outfp);
+			      list, limit, outfp);
       es_fclose (outfp);
     }
 
@@ -2413,7 +2790,13 @@ cmd_ks_get (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
   strlist_t list, sl;
+  uri_item_t ks;
   char *p;
+  membuf_t mb;
+  char *key = NULL;
+  inflight_t inflight;
+  int leader;
+  estream_t memfp = NULL;
   estream_t outfp;
 
   if (has_option (line, "--quick"))
@@ -2450,21 +2833,60 @@ cmd_ks_get (assuan_context_t ctx, char *line)
   if (err)
     goto leave;
 
-  /* Setup an output stream and perform the get.  */
+  /* The request is identified by the keyservers and the patterns.  */
+  init_membuf (&mb, 256);
+  put_membuf_str (&mb, "KS_GET");
+  for (ks = ctrl->server_local->keyservers; ks; ks = ks->next)
+    {
+      put_membuf_str (&mb, " ks=");
+      put_membuf_str (&mb, ks->uri);
+    }
+  for (sl = list; sl; sl = sl->next)
+    {
+      put_membuf_str (&mb, " ");
+      put_membuf_str (&mb, sl->d);
+    }
+  put_membuf (&mb, "", 1);
+  key = get_membuf (&mb, NULL);
+  if (!key)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = inflight_begin (ctrl, key, &inflight, &leader);
+  if (err)
+    goto leave;
+
+  /* Perform the get unless another session is already doing it.  */
+  if (leader)
+    {
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        err = gpg_error_from_syserror ();
+      else
+        err = ks_action_get (ctrl, ctrl->server_local->keyservers,
+                             list, memfp);
+    }
+
+  /* Setup an output stream and return the data.  */
   outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
   if (!outfp)
-    err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
+    {
+      inflight_end (ctrl, inflight, err, memfp, NULL);
+      err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
+    }
   else
     {
       ctrl->server_local->inhibit_data_logging = 1;
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
-      err = ks_action_get (ctrl, ctrl->server_local->keyservers, list, outfp);
+      err = inflight_end (ctrl, inflight, err, memfp, outfp);
       es_fclose (outfp);
       ctrl->server_local->inhibit_data_logging = 0;
     }
 
  leave:
+  xfree (key);
   free_strlist (list);
   return leave_cmd (ctx, err);
 }
@@ -2498,7 +2920,7 @@ cmd_ks_fetch (assuan_context_t ctx, char *line)
       ctrl->server_local->inhibit_data_logging = 1;
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
-      err = ks_action_fetch (ctrl, line, outfp);
+      err = ks_action_fetch (ctrl, line, 0, outfp);
       es_fclose (outfp);
       ctrl->server_local->inhibit_data_logging = 0;
     }
@@ -2607,6 +3029,12 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "tor         - Return OK if running in Tor mode\n"
   "dnsinfo     - Return info about the DNS resolver\n"
+  "dnscache    - Return entries, hits, negative hits and misses\n"
+  "              of the DNS cache\n"
+  "httppool    - Return idle, created, reused, stale and evicted\n"
+  "              connections of the HTTP connection pool\n"
+  "httpcache   - Return hits, negative hits, revalidated, stored\n"
+  "              and missed responses of the HTTP response cache\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "workqueue   - Inspect the work queue\n"
@@ -2673,6 +3101,36 @@ cmd_getinfo (assuan_context_t ctx, char *line)
         }
       err = 0;
     }
+  else if (!strcmp (line, "dnscache"))
+    {
+      char *info = get_dns_cache_info ();
+
+      if (!info)
+        err = gpg_error_from_syserror ();
+      else
+        err = assuan_send_data (ctx, info, strlen (info));
+      xfree (info);
+    }
+  else if (!strcmp (line, "httppool"))
+    {
+      char *info = http_pool_info ();
+
+      if (!info)
+        err = gpg_error_from_syserror ();
+      else
+        err = assuan_send_data (ctx, info, strlen (info));
+      xfree (info);
+    }
+  else if (!strcmp (line, "httpcache"))
+    {
+      char *info = http_cache_info ();
+
+      if (!info)
+        err = gpg_error_from_syserror ();
+      else
+        err = assuan_send_data (ctx, info, strlen (info));
+      xfree (info);
+    }
   else if (!strcmp (line, "workqueue"))
     {
       workqueue_dump_queue (ctrl);
@@ -2765,6 +3223,7 @@ register_commands (assuan_context_t ctx)
     { "WKD_GET",    cmd_wkd_get,    hlp_wkd_get },
     { "LDAPSERVER", cmd_ldapserver, hlp_ldapserver },
     { "ISVALID",    cmd_isvalid,    hlp_isvalid },
+    { "ISVALIDCHAIN", cmd_isvalidchain, hlp_isvalidchain },
     { "CHECKCRL",   cmd_checkcrl,   hlp_checkcrl },
     { "CHECKOCSP",  cmd_checkocsp,  hlp_checkocsp },
     { "LOOKUP",     cmd_lookup,     hlp_lookup },
@@ -2989,6 +3448,15 @@ dirmngr_status (ctrl_t ctrl, const char *keyword, ...)
   va_list arg_ptr;
   assuan_context_t ctx;
 
+  if (ctrl->server_local && ctrl->server_local->inflight
+      && !strcmp (keyword, "SOURCE"))
+    {
+      va_start (arg_ptr, keyword);
+      inflight_note_source (ctrl->server_local->inflight,
+                            va_arg (arg_ptr, const char *));
+      va_end (arg_ptr);
+    }
+
   va_start (arg_ptr, keyword);
 
   if (ctrl->server_local && (ctx = ctrl->server_local->assuan_ctx))
@@ -3064,6 +3532,17 @@ dirmngr_status_printf (ctrl_t ctrl, const char *keyword,
   if (!ctrl || !ctrl->server_local || !(ctx = ctrl->server_local->assuan_ctx))
     return 0;
 
+  if (ctrl->server_local->inflight && !strcmp (keyword, "SOURCE"))
+    {
+      char *buf;
+
+      va_start (arg_ptr, format);
+      buf = es_vbsprintf (format, arg_ptr);
+      va_end (arg_ptr);
+      inflight_note_source (ctrl->server_local->inflight, buf);
+      es_free (buf);
+    }
+
   va_start (arg_ptr, format);
   err = vprint_assuan_status (ctx, keyword, format, arg_ptr);
   va_end (arg_ptr);
@@ -0,0 +1,774 @@
+/* t-bench.c - Load benchmark for dirmngr
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* This program starts a mock HKP and HTTP server on the loopback
+ * interface, connects a number of concurrent clients to a dirmngr
+ * and lets them run requests against that server.  At the end the
+ * throughput and the latency percentiles for each command are
+ * printed.  The mock server can delay its responses to simulate a
+ * slow network.  Example:
+ *
+ *   ./t-bench --dirmngr ./dirmngr --clients 20 --requests 200 \
+ *             --latency 50 --commands ks_get,ks_fetch
+ *
+ * Without --distinct all clients ask for the same data so that the
+ * caches and the request coalescing of dirmngr are measured.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <npth.h>
+#include <assuan.h>
+
+#include "../common/util.h"
+#include "../common/sysutils.h"
+#include "../common/asshelp.h"
+
+#define PGM "t-bench"
+
+ASSUAN_SYSTEM_NPTH_IMPL;
+
+static int verbose;
+static int debug;
+
+static unsigned int opt_clients = 4;
+static unsigned int opt_requests = 100;
+static unsigned int opt_latency;
+static unsigned int opt_keysize = 4096;
+static int opt_distinct;
+static int opt_keep;
+static const char *opt_dirmngr;
+static const char *opt_crlfile;
+
+/* The port of the mock server.  */
+static unsigned short server_port;
+
+/* The number of requests received by the mock server.  */
+static unsigned int server_requests;
+
+/* The data returned by the mock server.  */
+static char *key_data;
+static size_t key_datalen;
+static char *crl_data;
+static size_t crl_datalen;
+
+/* The benchmarked commands.  */
+enum bench_cmds
+  {
+    CMD_KS_GET,
+    CMD_KS_SEARCH,
+    CMD_KS_FETCH,
+    CMD_LOADCRL,
+    CMD_GETINFO,
+    N_CMDS
+  };
+
+static struct
+{
+  const char *name;
+  int enabled;
+  unsigned int errors;
+  unsigned long *lat;   /* The latencies in microseconds.  */
+  size_t nlat;          /* The number of used items in LAT.  */
+  size_t latsize;       /* The allocated size of LAT.  */
+} cmdtbl[N_CMDS] =
+  {
+    { "ks_get" },
+    { "ks_search" },
+    { "ks_fetch" },
+    { "loadcrl" },
+    { "getinfo" }
+  };
+
+
+
+/* Return the current time in microseconds.  */
+static unsigned long long
+now_usec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* Write LENGTH bytes of BUFFER to the socket FD.  */
+static int
+write_all (int fd, const void *buffer, size_t length)
+{
+  const char *p = buffer;
+  ssize_t n;
+
+  while (length)
+    {
+      n = npth_write (fd, p, length);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* Send an HTTP response with STATUS and the body DATA of DATALEN
+ * bytes to the socket FD.  */
+static int
+send_response (int fd, int keep_alive, const char *status,
+               const char *ctype, const void *data, size_t datalen)
+{
+  char header[256];
+
+  snprintf (header, sizeof header,
+            "HTTP/1.0 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            status, ctype, (unsigned long)datalen,
+            keep_alive? "keep-alive":"close");
+  if (write_all (fd, header, strlen (header)))
+    return -1;
+  return datalen? write_all (fd, data, datalen) : 0;
+}
+
+
+/* The thread serving one connection to the mock server.  ARG is the
+ * socket.  */
+static void *
+server_conn_thread (void *arg)
+{
+  int fd = (int)(long)arg;
+  char buffer[4096];
+  size_t buflen = 0;
+  size_t hdrlen;
+  ssize_t n;
+  char *end, *path, *p;
+  int keep_alive, rc;
+  static const char index_data[] =
+    "info:1:1\n"
+    "pub:0123456789ABCDEF0123456789ABCDEF01234567:1:3072:1600000000::\n"
+    "uid:Bench User <bench@example.org>:1600000000::\n";
+
+  for (;;)
+    {
+      /* Read the request header.  */
+      buffer[buflen] = 0;
+      while (!(end = strstr (buffer, "\r\n\r\n")))
+        {
+          if (buflen == sizeof buffer - 1)
+            goto leave;  /* Header too long.  */
+          n = npth_read (fd, buffer + buflen, sizeof buffer - 1 - buflen);
+          if (n <= 0)
+            goto leave;
+          buflen += n;
+          buffer[buflen] = 0;
+        }
+      hdrlen = end + 4 - buffer;
+      *end = 0;
+      server_requests++;
+
+      keep_alive = !!ascii_memistr (buffer, strlen (buffer),
+                                    "Connection: keep-alive");
+
+      /* Get the path from the request line.  */
+      path = strchr (buffer, ' ');
+      if (!path)
+        goto leave;
+      path++;
+      if ((p = strchr (path, ' ')))
+        *p = 0;
+      if (debug)
+        log_debug ("mock server: request '%s'\n", path);
+
+      if (opt_latency)
+        npth_usleep (opt_latency * 1000);
+
+      if (!strncmp (path, "/pks/lookup?", 12) && strstr (path, "op=get"))
+        rc = send_response (fd, keep_alive, "200 OK", "application/pgp-keys",
+                            key_data, key_datalen);
+      else if (!strncmp (path, "/pks/lookup?", 12)
+               && strstr (path, "op=index"))
+        rc = send_response (fd, keep_alive, "200 OK", "text/plain",
+                            index_data, strlen (index_data));
+      else if (!strncmp (path, "/.well-known/openpgpkey/", 24))
+        rc = send_response (fd, keep_alive, "200 OK",
+                            "application/octet-stream",
+                            key_data, key_datalen);
+      else if (!strcmp (path, "/crl") && crl_data)
+        rc = send_response (fd, keep_alive, "200 OK", "application/pkix-crl",
+                            crl_data, crl_datalen);
+      else
+        rc = send_response (fd, keep_alive, "404 Not Found", "text/plain",
+                            NULL, 0);
+      if (rc || !keep_alive)
+        break;
+
+      /* Keep what the client already sent for the next request.  */
+      memmove (buffer, buffer + hdrlen, buflen - hdrlen);
+      buflen -= hdrlen;
+    }
+
+ leave:
+  close (fd);
+  return NULL;
+}
+
+
+/* The thread accepting connections to the mock server.  ARG is the
+ * listening socket.  */
+static void *
+server_thread (void *arg)
+{
+  int lfd = (int)(long)arg;
+  int fd, rc;
+  npth_attr_t tattr;
+  npth_t thread;
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  for (;;)
+    {
+      fd = npth_accept (lfd, NULL, NULL);
+      if (fd == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          log_error ("mock server: accept failed: %s\n", strerror (errno));
+          break;
+        }
+      rc = npth_create (&thread, &tattr, server_conn_thread, (void*)(long)fd);
+      if (rc)
+        {
+          log_error ("mock server: error spawning thread: %s\n",
+                     strerror (rc));
+          close (fd);
+        }
+    }
+  npth_attr_destroy (&tattr);
+  return NULL;
+}
+
+
+/* Start the mock server on an ephemeral port of the loopback
+ * interface and store the port at SERVER_PORT.  */
+static void
+start_server (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  npth_attr_t tattr;
+  npth_t thread;
+  int fd, rc;
+  int one = 1;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("bind failed: %s\n", strerror (errno));
+  if (listen (fd, 64))
+    log_fatal ("listen failed: %s\n", strerror (errno));
+  addrlen = sizeof addr;
+  if (getsockname (fd, (struct sockaddr *)&addr, &addrlen))
+    log_fatal ("getsockname failed: %s\n", strerror (errno));
+  server_port = ntohs (addr.sin_port);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  rc = npth_create (&thread, &tattr, server_thread, (void*)(long)fd);
+  if (rc)
+    log_fatal ("error spawning the mock server: %s\n", strerror (rc));
+  npth_setname_np (thread, "mock-server");
+  npth_attr_destroy (&tattr);
+
+  if (verbose)
+    log_info ("mock server listening on 127.0.0.1:%hu\n", server_port);
+}
+
+
+/* Create an armored dummy key of about OPT_KEYSIZE bytes.  The
+ * content does not matter because dirmngr does not parse it.  */
+static void
+make_key_data (void)
+{
+  static const char head[] = "-----BEGIN PGP PUBLIC KEY BLOCK-----\n\n";
+  static const char tail[] = "=AAAA\n-----END PGP PUBLIC KEY BLOCK-----\n";
+  size_t nlines = (opt_keysize + 64) / 65;
+  char *p;
+
+  key_datalen = strlen (head) + nlines * 65 + strlen (tail);
+  key_data = xmalloc (key_datalen + 1);
+  p = stpcpy (key_data, head);
+  for (; nlines; nlines--)
+    {
+      memset (p, 'A', 64);
+      p[64] = '\n';
+      p += 65;
+    }
+  strcpy (p, tail);
+}
+
+
+/* Read the CRL returned by the mock server from FNAME.  */
+static void
+read_crl_file (const char *fname)
+{
+  FILE *fp;
+  long n;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    log_fatal ("can't open '%s': %s\n", fname, strerror (errno));
+  if (fseek (fp, 0, SEEK_END) || (n = ftell (fp)) < 0
+      || fseek (fp, 0, SEEK_SET))
+    log_fatal ("can't get the size of '%s': %s\n", fname, strerror (errno));
+  crl_datalen = n;
+  crl_data = xmalloc (crl_datalen + 1);
+  if (fread (crl_data, crl_datalen, 1, fp) != 1)
+    log_fatal ("error reading '%s': %s\n", fname, strerror (errno));
+  fclose (fp);
+}
+
+
+/* Record the latency USEC of a request for command CMD.  */
+static void
+record_latency (int cmd, unsigned long usec, gpg_error_t err)
+{
+  if (err)
+    {
+      if (verbose > 1)
+        log_info ("%s failed: %s\n", cmdtbl[cmd].name, gpg_strerror (err));
+      cmdtbl[cmd].errors++;
+    }
+
+  if (cmdtbl[cmd].nlat == cmdtbl[cmd].latsize)
+    {
+      cmdtbl[cmd].latsize += 256;
+      cmdtbl[cmd].lat = xrealloc (cmdtbl[cmd].lat,
+                                  cmdtbl[cmd].latsize * sizeof *cmdtbl[cmd].lat);
+    }
+  cmdtbl[cmd].lat[cmdtbl[cmd].nlat++] = usec;
+}
+
+
+/* Build the request line for command CMD into LINE.  SEQ is used to
+ * make the request distinct.  */
+static void
+build_request (char *line, size_t linesize, int cmd, unsigned int seq)
+{
+  switch (cmd)
+    {
+    case CMD_KS_GET:
+      snprintf (line, linesize,
+                "KS_GET 0x0123456789ABCDEF0123456789ABCDEF%08X", seq);
+      break;
+    case CMD_KS_SEARCH:
+      snprintf (line, linesize, "KS_SEARCH bench%u@example.org", seq);
+      break;
+    case CMD_KS_FETCH:
+      snprintf (line, linesize,
+                "KS_FETCH http://127.0.0.1:%hu/.well-known/openpgpkey/hu/%08x",
+                server_port, seq);
+      break;
+    case CMD_LOADCRL:
+      snprintf (line, linesize,
+                "LOADCRL --url http://127.0.0.1:%hu/crl", server_port);
+      break;
+    default:
+      snprintf (line, linesize, "GETINFO version");
+      break;
+    }
+}
+
+
+/* Data callback for assuan_transact which throws away the data.  */
+static gpg_error_t
+discard_data_cb (void *opaque, const void *buffer, size_t length)
+{
+  (void)opaque;
+  (void)buffer;
+  (void)length;
+  return 0;
+}
+
+
+/* Connect to the dirmngr and return the context at R_CTX.  */
+static gpg_error_t
+connect_dirmngr (assuan_context_t *r_ctx)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+
+  err = start_new_dirmngr (r_ctx, GPG_ERR_SOURCE_DEFAULT, opt_dirmngr,
+                           1, verbose, debug, NULL, NULL);
+  if (err)
+    return err;
+
+  snprintf (line, sizeof line,
+            "KEYSERVER --clear hkp://127.0.0.1:%hu", server_port);
+  err = assuan_transact (*r_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      assuan_release (*r_ctx);
+      *r_ctx = NULL;
+    }
+  return err;
+}
+
+
+/* The thread of one client.  ARG is the number of the client.  */
+static void *
+client_thread (void *arg)
+{
+  unsigned int clientno = (unsigned int)(long)arg;
+  assuan_context_t ctx;
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  unsigned long long start;
+  unsigned int i;
+  int cmd;
+
+  err = connect_dirmngr (&ctx);
+  if (err)
+    {
+      log_error ("client %u: error connecting the dirmngr: %s\n",
+                 clientno, gpg_strerror (err));
+      return NULL;
+    }
+
+  cmd = clientno % N_CMDS;
+  for (i = 0; i < opt_requests; i++, cmd = (cmd + 1) % N_CMDS)
+    {
+      while (!cmdtbl[cmd].enabled)
+        cmd = (cmd + 1) % N_CMDS;
+      build_request (line, sizeof line, cmd,
+                     opt_distinct? clientno * opt_requests + i : 0);
+      start = now_usec ();
+      err = assuan_transact (ctx, line, discard_data_cb, NULL,
+                             NULL, NULL, NULL, NULL);
+      record_latency (cmd, (unsigned long)(now_usec () - start), err);
+    }
+
+  assuan_release (ctx);
+  return NULL;
+}
+
+
+static int
+compare_ulong (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+
+  return x < y? -1 : x > y? 1 : 0;
+}
+
+
+/* Print the results for a run which took ELAPSED microseconds.  */
+static void
+print_report (unsigned long long elapsed)
+{
+  double seconds = elapsed / 1e6;
+  size_t n, total = 0;
+  int cmd;
+
+  printf ("%-10s %8s %7s %10s %10s %10s %10s\n",
+          "command", "requests", "errors", "req/s",
+          "p50[ms]", "p99[ms]", "max[ms]");
+  for (cmd = 0; cmd < N_CMDS; cmd++)
+    {
+      if (!(n = cmdtbl[cmd].nlat))
+        continue;
+      total += n;
+      qsort (cmdtbl[cmd].lat, n, sizeof *cmdtbl[cmd].lat, compare_ulong);
+      printf ("%-10s %8lu %7u %10.1f %10.2f %10.2f %10.2f\n",
+              cmdtbl[cmd].name, (unsigned long)n, cmdtbl[cmd].errors,
+              n / seconds,
+              cmdtbl[cmd].lat[(n - 1) * 50 / 100] / 1000.0,
+              cmdtbl[cmd].lat[(n - 1) * 99 / 100] / 1000.0,
+              cmdtbl[cmd].lat[n - 1] / 1000.0);
+    }
+  printf ("%-10s %8lu %7s %10.1f\n",
+          "total", (unsigned long)total, "", total / seconds);
+  printf ("elapsed: %.2fs  clients: %u  latency: %ums  server requests: %u\n",
+          seconds, opt_clients, opt_latency, server_requests);
+}
+
+
+/* Enable the commands given in the comma delimited list STRING.  */
+static void
+parse_commands (const char *string)
+{
+  char *buffer, *p, *name;
+  int cmd;
+
+  buffer = xstrdup (string);
+  for (name = buffer; name; name = p)
+    {
+      if ((p = strchr (name, ',')))
+        *p++ = 0;
+      for (cmd = 0; cmd < N_CMDS; cmd++)
+        if (!strcmp (cmdtbl[cmd].name, name))
+          break;
+      if (cmd == N_CMDS)
+        {
+          fprintf (stderr, PGM ": unknown command '%s'\n", name);
+          exit (1);
+        }
+      cmdtbl[cmd].enabled = 1;
+    }
+  xfree (buffer);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  int last_argc = -1;
+  gpg_error_t err;
+  assuan_context_t ctx;
+  const char *homedir = NULL;
+  const char *commands = "ks_get,ks_search,ks_fetch";
+  char tmpdir[] = "/tmp/" PGM "-XXXXXX";
+  npth_attr_t tattr;
+  npth_t *threads;
+  unsigned long long start;
+  unsigned int i;
+  int rc;
+
+  gpgrt_init ();
+  log_set_prefix (PGM, GPGRT_LOG_WITH_PREFIX);
+  if (argc)
+    { argc--; argv++; }
+  while (argc && last_argc != argc )
+    {
+      last_argc = argc;
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      else if (!strcmp (*argv, "--help"))
+        {
+          fputs ("usage: " PGM " [options]\n"
+                 "Options:\n"
+                 "  --verbose         print progress info\n"
+                 "  --debug           flyswatter\n"
+                 "  --dirmngr PGM     use the dirmngr program PGM\n"
+                 "  --homedir DIR     use DIR instead of a new temp dir\n"
+                 "  --keep            do not terminate the dirmngr\n"
+                 "  --clients N       run N concurrent clients (4)\n"
+                 "  --requests N      send N requests per client (100)\n"
+                 "  --latency MS      delay responses of the server by MS\n"
+                 "  --keysize N       return keys of about N bytes (4096)\n"
+                 "  --distinct        make each request distinct\n"
+                 "  --crl-file FILE   return the CRL from FILE\n"
+                 "  --commands LIST   comma delimited list of commands:\n"
+                 "                    ks_get, ks_search, ks_fetch, loadcrl,"
+                 " getinfo\n",
+                 stdout);
+          exit (0);
+        }
+      else if (!strcmp (*argv, "--verbose"))
+        {
+          verbose++;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose += 2;
+          debug++;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--keep"))
+        {
+          opt_keep = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--distinct"))
+        {
+          opt_distinct = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--dirmngr"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_dirmngr = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--homedir"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              homedir = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--crl-file"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_crlfile = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--commands"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              commands = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--clients"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_clients = strtoul (*argv, NULL, 10);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--requests"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_requests = strtoul (*argv, NULL, 10);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--latency"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_latency = strtoul (*argv, NULL, 10);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--keysize"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_keysize = strtoul (*argv, NULL, 10);
+              argc--; argv++;
+            }
+        }
+      else if (!strncmp (*argv, "--", 2))
+        {
+          fprintf (stderr, PGM ": unknown option '%s'\n", *argv);
+          exit (1);
+        }
+    }
+  if (argc)
+    {
+      fprintf (stderr, PGM ": no arguments expected\n");
+      exit (1);
+    }
+  if (!opt_clients)
+    opt_clients = 1;
+
+  parse_commands (commands);
+  if (cmdtbl[CMD_LOADCRL].enabled)
+    {
+      if (!opt_crlfile)
+        {
+          fprintf (stderr, PGM ": command loadcrl requires --crl-file\n");
+          exit (1);
+        }
+      read_crl_file (opt_crlfile);
+    }
+  make_key_data ();
+
+  npth_init ();
+  assuan_set_gpg_err_source (GPG_ERR_SOURCE_DEFAULT);
+  assuan_set_system_hooks (ASSUAN_SYSTEM_NPTH);
+  assuan_sock_init ();
+
+  /* Use a fresh home directory so that the caches of the dirmngr
+   * start empty and a running dirmngr is not disturbed.  */
+  if (!homedir)
+    {
+      homedir = gnupg_mkdtemp (tmpdir);
+      if (!homedir)
+        log_fatal ("error creating temporary directory: %s\n",
+                   strerror (errno));
+      if (verbose)
+        log_info ("using home directory '%s'\n", homedir);
+    }
+  gnupg_set_homedir (homedir);
+
+  start_server ();
+
+  /* Connect once to start the dirmngr before the clients race for
+   * it.  This context is later used to terminate the dirmngr.  */
+  err = connect_dirmngr (&ctx);
+  if (err)
+    log_fatal ("error connecting the dirmngr: %s\n", gpg_strerror (err));
+
+  threads = xcalloc (opt_clients, sizeof *threads);
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  start = now_usec ();
+  for (i = 0; i < opt_clients; i++)
+    {
+      rc = npth_create (&threads[i], &tattr, client_thread, (void*)(long)i);
+      if (rc)
+        log_fatal ("error spawning client %u: %s\n", i, strerror (rc));
+    }
+  npth_attr_destroy (&tattr);
+  for (i = 0; i < opt_clients; i++)
+    npth_join (threads[i], NULL);
+
+  print_report (now_usec () - start);
+
+  if (!opt_keep)
+    assuan_transact (ctx, "KILLDIRMNGR", NULL, NULL, NULL, NULL, NULL, NULL);
+  assuan_release (ctx);
+  xfree (threads);
+  return 0;
+}
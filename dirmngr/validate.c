@@ -30,6 +30,7 @@
 #include "dirmngr.h"
 #include "certcache.h"
 #include "crlcache.h"
+#include "ocsp.h"
 #include "validate.h"
 #include "misc.h"
 
@@ -61,6 +62,36 @@ struct chain_item_s
 typedef struct chain_item_s *chain_item_t;
 
 
+/* The number of slots in the cache of validated chains and the
+ * maximum time in seconds a cached result is used.  */
+#define VALIDATE_CACHE_SIZE 1024
+#define VALIDATE_CACHE_TTL  (30*60)
+
+/* The flags which affect the result of a validation.  */
+#define VALIDATE_CACHE_FLAGS (VALIDATE_FLAG_MASK_TRUST | VALIDATE_FLAG_CRL \
+                              | VALIDATE_FLAG_RECURSIVE | VALIDATE_FLAG_OCSP \
+                              | VALIDATE_FLAG_TLS | VALIDATE_FLAG_NOCRLCHECK)
+
+/* An entry of the cache of successfully validated chains.  The cache
+ * is indexed by the first bytes of the target certificate's
+ * fingerprint; a new entry simply replaces an older one in the same
+ * slot.  */
+struct validate_cache_s
+{
+  unsigned char fpr[20];    /* Fingerprint of the target certificate.  */
+  unsigned int flags;       /* The VALIDATE_CACHE_FLAGS used.  */
+  unsigned int generation;  /* The value of VALIDATE_CACHE_GENERATION.  */
+  time_t expires;           /* The entry may not be used after this time. */
+  ksba_isotime_t exptime;   /* The nearest expiration time of the chain.  */
+};
+static struct validate_cache_s validate_cache[VALIDATE_CACHE_SIZE];
+
+/* Changing the trust anchors or the revocation data invalidates all
+ * entries by bumping this value.  Starts at 1 so that unused slots
+ * never match.  */
+static unsigned int validate_cache_generation = 1;
+
+
 /* A couple of constants with Object Identifiers.  */
 static const char oid_kp_serverAuth[]     = "1.3.6.1.5.5.7.3.1";
 static const char oid_kp_clientAuth[]     = "1.3.6.1.5.5.7.3.2";
@@ -99,6 +130,76 @@ check_header_constants (void)
 }
 
 
+/* Return the slot of the cache of validated chains for the
+ * fingerprint FPR.  */
+static struct validate_cache_s *
+validate_cache_slot (const unsigned char *fpr)
+{
+  return validate_cache + (((fpr[0] << 8) | fpr[1]) % VALIDATE_CACHE_SIZE);
+}
+
+
+/* Look up a cached validation of the chain for the certificate with
+ * fingerprint FPR using FLAGS.  On success return true and store the
+ * nearest expiration time of the chain at R_EXPTIME if that is not
+ * NULL.  */
+static int
+validate_cache_get (const unsigned char *fpr, unsigned int flags,
+                    ksba_isotime_t r_exptime)
+{
+  struct validate_cache_s *vc = validate_cache_slot (fpr);
+
+  if (vc->generation != validate_cache_generation
+      || vc->flags != (flags & VALIDATE_CACHE_FLAGS)
+      || memcmp (vc->fpr, fpr, 20))
+    return 0;
+  if (vc->expires <= gnupg_get_time ())
+    {
+      vc->generation = 0;
+      return 0;
+    }
+  if (r_exptime)
+    gnupg_copy_time (r_exptime, vc->exptime);
+  return 1;
+}
+
+
+/* Store the successful validation of the chain for the certificate
+ * with fingerprint FPR using FLAGS.  EXPTIME is the nearest
+ * expiration time of the chain.  */
+static void
+validate_cache_put (const unsigned char *fpr, unsigned int flags,
+                    const ksba_isotime_t exptime)
+{
+  struct validate_cache_s *vc = validate_cache_slot (fpr);
+  time_t expires, notafter;
+
+  expires = gnupg_get_time () + VALIDATE_CACHE_TTL;
+  if (*exptime)
+    {
+      notafter = isotime2epoch (exptime);
+      if (notafter != (time_t)(-1) && notafter < expires)
+        expires = notafter;
+    }
+
+  memcpy (vc->fpr, fpr, 20);
+  vc->flags = (flags & VALIDATE_CACHE_FLAGS);
+  vc->generation = validate_cache_generation;
+  vc->expires = expires;
+  gnupg_copy_time (vc->exptime, exptime);
+}
+
+
+/* Invalidate all cached validations.  This needs to be called
+ * whenever the trust anchors or the revocation data change.  */
+void
+validate_cache_invalidate (void)
+{
+  if (!++validate_cache_generation)
+    validate_cache_generation = 1;
+}
+
+
 /* Check whether CERT contains critical extensions we don't know
    about.  */
 static gpg_error_t
@@ -266,6 +367,27 @@ check_revocations (ctrl_t ctrl, chain_item_t chain)
     }
   ctrl->check_revocations_nest_level++;
 
+  /* With OCSP allowed ask the responders for the status of all
+   * certificates below the root with one request per responder.  The
+   * results are put into the OCSP cache and used below.  This is not
+   * done for the nested checks of CRL issuers and OCSP signers.  */
+  if (opt.allow_ocsp && ctrl->check_revocations_nest_level == 1
+      && chain->next && chain->next->next)
+    {
+      ksba_cert_t *certs;
+      int ncerts;
+
+      for (ncerts=0, ci=chain->next; ci; ci = ci->next)
+        ncerts++;
+      certs = xtrycalloc (ncerts, sizeof *certs);
+      if (certs)
+        {
+          for (ncerts=0, ci=chain->next; ci; ci = ci->next)
+            certs[ncerts++] = ci->cert;
+          ocsp_prefetch (ctrl, certs, ncerts);
+          xfree (certs);
+        }
+    }
 
   for (ci=chain; ci; ci = ci->next)
     {
@@ -283,14 +405,25 @@ check_revocations (ctrl_t ctrl, chain_item_t chain)
           continue;
         }
 
-      if (opt.verbose)
-        cert_log_name (_("checking CRL for"), ci->cert);
-      err = crl_cache_cert_isvalid (ctrl, ci->cert, 0);
-      if (gpg_err_code (err) == GPG_ERR_NO_CRL_KNOWN)
+      /* A current OCSP status from the cache is as good as a CRL.  */
+      err = (opt.allow_ocsp? ocsp_cache_cert_isvalid (ci->cert)
+             /**/          : gpg_error (GPG_ERR_NO_DATA));
+      if (gpg_err_code (err) != GPG_ERR_NO_DATA)
         {
-          err = crl_cache_reload_crl (ctrl, ci->cert);
-          if (!err)
-            err = crl_cache_cert_isvalid (ctrl, ci->cert, 0);
+          if (opt.verbose)
+            cert_log_name ("using cached OCSP status for", ci->cert);
+        }
+      else
+        {
+          if (opt.verbose)
+            cert_log_name (_("checking CRL for"), ci->cert);
+          err = crl_cache_cert_isvalid (ctrl, ci->cert, 0);
+          if (gpg_err_code (err) == GPG_ERR_NO_CRL_KNOWN)
+            {
+              err = crl_cache_reload_crl (ctrl, ci->cert);
+              if (!err)
+                err = crl_cache_cert_isvalid (ctrl, ci->cert, 0);
+            }
         }
       switch (gpg_err_code (err))
         {
@@ -415,6 +548,7 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
   int any_expired = 0;
   int any_no_policy_match = 0;
   chain_item_t chain;
+  unsigned char fpr[20];
 
   check_header_constants ();
 
@@ -434,31 +568,17 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
   if ((flags & VALIDATE_FLAG_CRL) && (err = check_cert_use_crl (cert)))
     return err;
 
-  /* If we already validated the certificate not too long ago, we can
-     avoid the excessive computations and lookups unless the caller
-     asked for the expiration time.  */
-  if (!r_exptime)
+  /* If we already validated the chain not too long ago and neither
+     the trust anchors nor the revocation data changed since then, we
+     can avoid the excessive computations and lookups.  */
+  cert_compute_fpr (cert, fpr);
+  if (validate_cache_get (fpr, flags, r_exptime))
     {
-      size_t buflen;
-      time_t validated_at;
-
-      err = ksba_cert_get_user_data (cert, "validated_at",
-                                     &validated_at, sizeof (validated_at),
-                                     &buflen);
-      if (err || buflen != sizeof (validated_at) || !validated_at)
-        err = 0; /* Not available or other error. */
-      else
-        {
-          /* If the validation is not older than 30 minutes we are ready. */
-          if (validated_at < gnupg_get_time () + (30*60))
-            {
-              if (opt.verbose)
-                log_info ("certificate is good (cached)\n");
-              /* Note, that we can't jump to leave here as this would
-                 falsely updated the validation timestamp.  */
-              return 0;
-            }
-        }
+      if (opt.verbose)
+        log_info ("certificate is good (cached)\n");
+      /* Note, that we can't jump to leave here as this would
+         falsely update the cache entry.  */
+      return 0;
     }
 
   /* Get the current time. */
@@ -785,8 +905,9 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
        * last item             - the target certificate.
        *
        * Now for each certificate in the chain check whether it has
-       * been included in a CRL and thus be revoked.  We don't do OCSP
-       * here because this does not seem to make much sense.  This
+       * been included in a CRL and thus be revoked.  We don't send
+       * OCSP requests here because this does not seem to make much
+       * sense but use a cached OCSP status if available.  This
        * might become a recursive process and we should better cache
        * our validity results to avoid double work.  Far worse a
        * catch-22 may happen for an improper setup hierarchy and we
@@ -808,26 +929,12 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
  leave:
   if (!err && !(r_trust_anchor && *r_trust_anchor))
     {
-      /* With no error we can update the validation cache.  We do this
-       * for all certificates in the chain.  Note that we can't use
-       * the cache if the caller requested to check the trustiness of
-       * the root certificate himself.  Adding such a feature would
-       * require us to also store the fingerprint of root
-       * certificate.  */
-      chain_item_t citem;
-      time_t validated_at = gnupg_get_time ();
-
-      for (citem = chain; citem; citem = citem->next)
-        {
-          err = ksba_cert_set_user_data (citem->cert, "validated_at",
-                                         &validated_at, sizeof (validated_at));
-          if (err)
-            {
-              log_error ("set_user_data(validated_at) failed: %s\n",
-                         gpg_strerror (err));
-              err = 0;
-            }
-        }
+      /* With no error we can update the validation cache.  Note that
+       * we can't use the cache if the caller requested to check the
+       * trustiness of the root certificate himself.  Adding such a
+       * feature would require us to also store the fingerprint of
+       * root certificate.  */
+      validate_cache_put (fpr, flags, exptime);
     }
 
   if (r_exptime)
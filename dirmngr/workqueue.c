@@ -22,10 +22,18 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 
 
+/* The number of priority classes.  */
+#define WQ_PRIO_COUNT 3
+
+/* The maximum number of threads running global tasks concurrently.  */
+#define WQ_MAX_WORKERS 3
+
+
 /* An object for one item in the workqueue.  */
 struct wqitem_s
 {
@@ -34,10 +42,16 @@ struct wqitem_s
   /* This flag is set if the task requires network access.  */
   unsigned int need_network:1;
 
+  /* The priority class of the task.  */
+  unsigned int prio:2;
+
   /* The id of the session which created this task.  If this is 0 the
    * task is not associated with a specific session.  */
   unsigned int session_id;
 
+  /* The time the task was added.  */
+  time_t added;
+
   /* The function to perform the backgrount task.  */
   wqtask_t func;
 
@@ -47,9 +61,40 @@ struct wqitem_s
 typedef struct wqitem_s *wqitem_t;
 
 
-/* The workque is a simple linked list.  */
+/* The workque is a simple linked list.  Tasks are appended so that
+ * within one priority class they are run in the order they were
+ * added.  */
 static wqitem_t workqueue;
 
+/* The number of worker threads currently running global tasks.  */
+static unsigned int active_workers;
+
+/* Statistics for each priority class.  */
+static struct
+{
+  unsigned int depth;      /* Number of tasks in the queue.  */
+  unsigned int max_depth;  /* Maximum of DEPTH.  */
+  unsigned int added;      /* Number of tasks added.  */
+  unsigned int merged;     /* Number of duplicates not added.  */
+  unsigned int run;        /* Number of tasks run.  */
+  unsigned long waited;    /* Sum of the seconds tasks waited.  */
+  unsigned int max_wait;   /* Longest wait in seconds.  */
+} wqstats[WQ_PRIO_COUNT];
+
+
+/* Return a name for the priority class PRIO.  */
+static const char *
+prio_name (unsigned int prio)
+{
+  switch (prio)
+    {
+    case WQ_PRIO_INTERACTIVE:  return "interactive";
+    case WQ_PRIO_PREFETCH:     return "prefetch";
+    case WQ_PRIO_HOUSEKEEPING: return "housekeeping";
+    default:                   return "?";
+    }
+}
+
 
 /* Dump the queue using Assuan status comments.  */
 void
@@ -57,7 +102,8 @@ workqueue_dump_queue (ctrl_t ctrl)
 {
   wqitem_t saved_workqueue;
   wqitem_t item;
-  unsigned int count;
+  unsigned int count, prio;
+  time_t now = gnupg_get_time ();
 
   /* Temporay detach the entiere workqueue so that other threads don't
    * get into our way.  */
@@ -68,9 +114,24 @@ workqueue_dump_queue (ctrl_t ctrl)
     count++;
 
   dirmngr_status_helpf (ctrl, "wq: number of entries: %u", count);
+  dirmngr_status_helpf (ctrl, "wq: active workers: %u of %u",
+                        active_workers, WQ_MAX_WORKERS);
+  for (prio = 0; prio < WQ_PRIO_COUNT; prio++)
+    dirmngr_status_helpf (ctrl, "wq: %-12s depth=%u max=%u added=%u"
+                          " merged=%u run=%u avgwait=%lus maxwait=%us",
+                          prio_name (prio),
+                          wqstats[prio].depth, wqstats[prio].max_depth,
+                          wqstats[prio].added, wqstats[prio].merged,
+                          wqstats[prio].run,
+                          (wqstats[prio].run
+                           ? wqstats[prio].waited / wqstats[prio].run : 0),
+                          wqstats[prio].max_wait);
   for (item = saved_workqueue; item; item = item->next)
-    dirmngr_status_helpf (ctrl, "wq: sess=%u net=%d %s(\"%.100s%s\")",
+    dirmngr_status_helpf (ctrl, "wq: sess=%u net=%d prio=%s age=%lus"
+                          " %s(\"%.100s%s\")",
                           item->session_id, item->need_network,
+                          prio_name (item->prio),
+                          (unsigned long)(now - item->added),
                           item->func? item->func (NULL, NULL): "nop",
                           item->args, strlen (item->args) > 100? "[...]":"");
 
@@ -88,13 +149,31 @@ workqueue_dump_queue (ctrl_t ctrl)
 
 
 /* Append the task (FUNC,ARGS) to the work queue.  FUNC shall return
- * its name when called with (NULL, NULL).  */
+ * its name when called with (NULL, NULL).  PRIO is the priority
+ * class of the task.  If the same task is already queued for the same
+ * session only its priority is raised if needed.  */
 gpg_error_t
 workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
-                    int need_network)
+                    int need_network, enum wq_priority prio)
 {
   wqitem_t item, wi;
 
+  log_assert (prio < WQ_PRIO_COUNT);
+
+  for (wi = workqueue; wi; wi = wi->next)
+    if (wi->func == func && wi->session_id == session_id
+        && !strcmp (wi->args, args))
+      {
+        if (prio < wi->prio)
+          {
+            wqstats[wi->prio].depth--;
+            wi->prio = prio;
+            wqstats[prio].depth++;
+          }
+        wqstats[prio].merged++;
+        return 0;
+      }
+
   item = xtrycalloc (1, sizeof *item + strlen (args));
   if (!item)
     return gpg_error_from_syserror ();
@@ -102,6 +181,8 @@ workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
   item->func = func;
   item->session_id = session_id;
   item->need_network = !!need_network;
+  item->prio = prio;
+  item->added = gnupg_get_time ();
 
   if (!(wi=workqueue))
     workqueue = item;
@@ -111,17 +192,42 @@ workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
         wi = wi->next;
       wi->next = item;
     }
+
+  wqstats[prio].added++;
+  if (++wqstats[prio].depth > wqstats[prio].max_depth)
+    wqstats[prio].max_depth = wqstats[prio].depth;
   return 0;
 }
 
 
+/* Detach ITEM with the predecessor PREV from the workqueue.  */
+static void
+detach_item (wqitem_t item, wqitem_t prev)
+{
+  if (!prev)
+    workqueue = item->next;
+  else
+    prev->next = item->next;
+  item->next = NULL;
+  wqstats[item->prio].depth--;
+}
+
+
 /* Run the task described by ITEM.  ITEM must have been detached from
  * the workqueue; its ownership is transferred to this function.  */
 static void
 run_a_task (ctrl_t ctrl, wqitem_t item)
 {
+  unsigned int waited;
+
   log_assert (!item->next);
 
+  waited = (unsigned int)(gnupg_get_time () - item->added);
+  wqstats[item->prio].run++;
+  wqstats[item->prio].waited += waited;
+  if (waited > wqstats[item->prio].max_wait)
+    wqstats[item->prio].max_wait = waited;
+
   if (opt.verbose)
     log_info ("session %u: running %s(\"%s%s\")\n",
               item->session_id,
@@ -134,69 +240,145 @@ run_a_task (ctrl_t ctrl, wqitem_t item)
 }
 
 
+/* Detach and return the global task to be run next or return NULL if
+ * there is none.  If WITH_NETWORK is not set tasks which require the
+ * network are not considered.  */
+static wqitem_t
+next_global_task (int with_network)
+{
+  wqitem_t item, prev, best, bestprev;
+
+  best = bestprev = NULL;
+  for (prev = NULL, item = workqueue; item; prev = item, item = item->next)
+    if (!item->session_id
+        && (!item->need_network || with_network)
+        && (!best || item->prio < best->prio))
+      {
+        best = item;
+        bestprev = prev;
+        if (best->prio == WQ_PRIO_INTERACTIVE)
+          break;
+      }
+  if (best)
+    detach_item (best, bestprev);
+  return best;
+}
+
+
+/* Run all global tasks using CTRL.  */
+static void
+run_global_tasks (ctrl_t ctrl, int with_network)
+{
+  wqitem_t item;
+
+  while ((item = next_global_task (with_network)))
+    run_a_task (ctrl, item);
+}
+
+
+/* A worker thread to run global tasks.  ARG is non-NULL to also run
+ * tasks requiring the network.  */
+static void *
+worker_thread (void *arg)
+{
+  struct server_control_s ctrlbuf;
+
+  memset (&ctrlbuf, 0, sizeof ctrlbuf);
+  dirmngr_init_default_ctrl (&ctrlbuf);
+
+  run_global_tasks (&ctrlbuf, !!arg);
+
+  dirmngr_deinit_default_ctrl (&ctrlbuf);
+  active_workers--;
+  return NULL;
+}
+
+
 /* Run tasks not associated with a session.  This is called from the
  * ticker every few minutes.  If WITH_NETWORK is not set tasks which
- * require the network are not run.  */
+ * require the network are not run.  The tasks are run by up to
+ * WQ_MAX_WORKERS threads so that a slow network task does not delay
+ * the others; this function does not wait for them.  CTRL is only
+ * used if no thread can be started.  */
 void
 workqueue_run_global_tasks (ctrl_t ctrl, int with_network)
 {
-  wqitem_t item, prev;
+  npth_attr_t tattr;
+  npth_t thread;
+  wqitem_t item;
+  unsigned int count;
+  int err;
 
   with_network = !!with_network;
 
+  for (count=0, item = workqueue; item; item = item->next)
+    if (!item->session_id && (!item->need_network || with_network))
+      count++;
+  if (!count)
+    return;
+
   if (opt.verbose)
-    log_info ("running scheduled tasks%s\n", with_network?" (with network)":"");
+    log_info ("running %u scheduled tasks%s\n",
+              count, with_network?" (with network)":"");
 
-  for (;;)
+  if (count <= active_workers)
+    return;  /* The running workers will take care of them.  */
+  count -= active_workers;
+
+  err = npth_attr_init (&tattr);
+  if (err)
     {
-      prev = NULL;
-      for (item = workqueue; item; prev = item, item = item->next)
-        if (!item->session_id
-            && (!item->need_network || (item->need_network && with_network)))
+      log_error ("error preparing worker thread: %s\n", strerror (err));
+      run_global_tasks (ctrl, with_network);
+      return;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  for (; count && active_workers < WQ_MAX_WORKERS; count--)
+    {
+      err = npth_create (&thread, &tattr, worker_thread,
+                         with_network? (void*)1 : NULL);
+      if (err)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (err));
           break;
-      if (!item)
-        break;  /* No more tasks to run.  */
-
-      /* Detach that item from the workqueue.  */
-      if (!prev)
-        workqueue = item->next;
-      else
-        prev->next = item->next;
-      item->next = NULL;
-
-      /* Run the task.  */
-      run_a_task (ctrl, item);
+        }
+      npth_setname_np (thread, "wq-worker");
+      active_workers++;
     }
+  npth_attr_destroy (&tattr);
+
+  if (!active_workers)
+    run_global_tasks (ctrl, with_network);
 }
 
 
 /* Run tasks scheduled for running after a session.  Those tasks are
- * identified by the SESSION_ID.  */
+ * identified by the SESSION_ID.  Interactive tasks are run first.  */
 void
 workqueue_run_post_session_tasks (unsigned int session_id)
 {
   struct server_control_s ctrlbuf;
   ctrl_t ctrl = NULL;
-  wqitem_t item, prev;
+  wqitem_t item, prev, best, bestprev;
 
   if (!session_id)
     return;
 
   for (;;)
     {
-      prev = NULL;
-      for (item = workqueue; item; prev = item, item = item->next)
-        if (item->session_id == session_id)
-          break;
-      if (!item)
+      best = bestprev = NULL;
+      for (prev = NULL, item = workqueue; item; prev = item, item = item->next)
+        if (item->session_id == session_id
+            && (!best || item->prio < best->prio))
+          {
+            best = item;
+            bestprev = prev;
+          }
+      if (!best)
         break;  /* No more tasks for this session.  */
 
       /* Detach that item from the workqueue.  */
-      if (!prev)
-        workqueue = item->next;
-      else
-        prev->next = item->next;
-      item->next = NULL;
+      detach_item (best, bestprev);
 
       /* Create a CTRL object the first time we need it.  */
       if (!ctrl)
@@ -207,7 +389,7 @@ workqueue_run_post_session_tasks (unsigned int session_id)
         }
 
       /* Run the task.  */
-      run_a_task (ctrl, item);
+      run_a_task (ctrl, best);
     }
 
   dirmngr_deinit_default_ctrl (ctrl);
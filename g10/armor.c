@@ -37,6 +37,9 @@
 
 #define MAX_LINELEN 20000
 
+/* The maximum number of bytes decoded at once by radix64_read_bulk.  */
+#define RADIX64_BULK_SIZE 16384
+
 static const byte bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                                "abcdefghijklmnopqrstuvwxyz"
                                "0123456789+/";
@@ -802,6 +805,75 @@ invalid_crc(void)
 }
 
 
+/* Fast path for radix64_read: Decode complete lines directly from
+ * the input buffer of A into BUF which has room for SIZE bytes.  Only
+ * lines consisting of a multiple of four valid radix64 characters
+ * followed by LF or CR,LF are decoded; everything else, in particular
+ * the pad characters and the CRC, is left to the line based code.
+ * Returns the number of bytes stored at BUF.  */
+static size_t
+radix64_read_bulk (armor_filter_context_t *afx, IOBUF a,
+                   byte *buf, size_t size)
+{
+  size_t want, pos, n, linelen, i;
+  byte *p, *s, *eol;
+  u32 b;
+  int len;
+
+  want = (size / 3) * 4 + (size / 48 + 1) * 2;
+  if (want > RADIX64_BULK_SIZE)
+    want = RADIX64_BULK_SIZE;
+  if (afx->buffer_size < want)
+    {
+      p = xtryrealloc (afx->buffer, want);
+      if (!p)
+        return 0;
+      afx->buffer = p;
+      afx->buffer_size = want;
+    }
+  afx->buffer_pos = afx->buffer_len = 0;
+
+  p = afx->buffer;
+  len = iobuf_peek (a, p, want);
+  if (len <= 0)
+    return 0;
+
+  for (pos = n = 0; (eol = memchr (p + pos, '\n', len - pos)); )
+    {
+      s = p + pos;
+      linelen = eol - s;
+      if (linelen && s[linelen - 1] == '\r')
+        linelen--;
+      if (!linelen || (linelen % 4) || n + linelen / 4 * 3 > size)
+        break;
+
+      /* Any invalid character sets all bits of B.  The output is
+       * only accounted for if the entire line is valid.  */
+      for (i = 0; i < linelen; i += 4)
+        {
+          b  = asctobin[3][s[i + 0]];
+          b |= asctobin[2][s[i + 1]];
+          b |= asctobin[1][s[i + 2]];
+          b |= asctobin[0][s[i + 3]];
+          if (b == 0xffffffffUL)
+            break;
+          buf[n + i / 4 * 3 + 0] = b >> (2 * 8);
+          buf[n + i / 4 * 3 + 1] = b >> (1 * 8);
+          buf[n + i / 4 * 3 + 2] = b >> (0 * 8);
+        }
+      if (i < linelen)
+        break;
+
+      n += linelen / 4 * 3;
+      pos = eol - p + 1;
+    }
+
+  if (pos)
+    iobuf_read (a, NULL, pos);
+  return n;
+}
+
+
 static int
 radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	      byte *buf, size_t size )
@@ -823,6 +895,13 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	    c = afx->buffer[afx->buffer_pos++];
 	else { /* read the next line */
 	    unsigned maxlen = MAX_LINELEN;
+	    size_t nbulk;
+
+	    /* Try to decode as many plain lines as possible at once.  */
+	    if( !idx && (nbulk = radix64_read_bulk (afx, a, buf+n, size-n)) ) {
+		n += nbulk;
+		continue;
+	    }
 	    afx->buffer_pos = 0;
 	    afx->buffer_len = iobuf_read_line( a, &afx->buffer,
 					       &afx->buffer_size, &maxlen );
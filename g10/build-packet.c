@@ -1651,9 +1651,11 @@ do_signature( IOBUF out, int ctb, PKT_signature *sig )
   iobuf_put(a, sig->digest_start[0] );
   iobuf_put(a, sig->digest_start[1] );
   n = pubkey_get_nsig( sig->pubkey_algo );
-  if ( !n )
+  if (sig->rawdata)
+    rc = iobuf_write (a, sig->rawdata, sig->rawdatalen);
+  else if ( !n )
     write_fake_data( a, sig->data[0] );
-  for (i=0; i < n && !rc ; i++ )
+  for (i=0; i < n && !rc && !sig->rawdata; i++ )
     rc = gpg_mpi_write (a, sig->data[i], NULL);
 
   if (!rc)
@@ -25,11 +25,15 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#ifdef HAVE_MEMFD_CREATE
+# include <sys/mman.h>
+#endif
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
 
 #include "gpg.h"
+#include <npth.h>
 #include <assuan.h>
 #include "../common/util.h"
 #include "../common/membuf.h"
@@ -49,6 +53,14 @@
 static assuan_context_t agent_ctx = NULL;
 static int did_early_card_test;
 
+/* Set to 1 if the agent's PKSIGN takes the key, the description and
+ * the hash as options, to -1 if not, and 0 if not yet known.  */
+static int pksign_with_options;
+
+/* Set if the agent accepts bulk data for IMPORT_KEY and EXPORT_KEY
+ * via passed fds.  */
+static int agent_bulk_data_fd;
+
 struct confirm_parm_s
 {
   char *desc;
@@ -257,6 +269,83 @@ warn_version_mismatch (assuan_context_t ctx, const char *servername, int mode)
 }
 
 
+/* Send the initial options to the new agent connection CTX.  */
+static gpg_error_t
+init_agent_connection (assuan_context_t ctx)
+{
+  gpg_error_t rc = 0;
+
+  /* Tell the agent that we support Pinentry notifications.
+     No error checking so that it will work also with older
+     agents.  */
+  assuan_transact (ctx, "OPTION allow-pinentry-notify",
+                   NULL, NULL, NULL, NULL, NULL, NULL);
+  /* Tell the agent about what version we are aware.  This is
+     here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
+  assuan_transact (ctx, "OPTION agent-awareness=2.1.0",
+                   NULL, NULL, NULL, NULL, NULL, NULL);
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+  /* Ask the agent to take bulk data via a passed fd.  Older agents
+     don't know this option and we then use inquiries.  */
+  if (!assuan_transact (ctx, "OPTION bulk-data-fd=1",
+                        NULL, NULL, NULL, NULL, NULL, NULL))
+    agent_bulk_data_fd = 1;
+#endif
+  /* Pass on the pinentry mode.  */
+  if (opt.pinentry_mode)
+    {
+      char *tmp = xasprintf ("OPTION pinentry-mode=%s",
+                             str_pinentry_mode (opt.pinentry_mode));
+      rc = assuan_transact (ctx, tmp,
+                       NULL, NULL, NULL, NULL, NULL, NULL);
+      xfree (tmp);
+      if (rc)
+        {
+          log_error ("setting pinentry mode '%s' failed: %s\n",
+                     str_pinentry_mode (opt.pinentry_mode),
+                     gpg_strerror (rc));
+          write_status_error ("set_pinentry_mode", rc);
+        }
+    }
+
+  /* Pass on the request origin.  */
+  if (opt.request_origin)
+    {
+      char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
+                             str_request_origin (opt.request_origin));
+      rc = assuan_transact (ctx, tmp,
+                       NULL, NULL, NULL, NULL, NULL, NULL);
+      xfree (tmp);
+      if (rc)
+        {
+          log_error ("setting request origin '%s' failed: %s\n",
+                     str_request_origin (opt.request_origin),
+                     gpg_strerror (rc));
+          write_status_error ("set_request_origin", rc);
+        }
+    }
+
+  /* In DE_VS mode under Windows we require that the JENT RNG
+   * is active.  */
+#ifdef HAVE_W32_SYSTEM
+  if (!rc && opt.compliance == CO_DE_VS)
+    {
+      if (assuan_transact (ctx, "GETINFO jent_active",
+                           NULL, NULL, NULL, NULL, NULL, NULL))
+        {
+          rc = gpg_error (GPG_ERR_FORBIDDEN);
+          log_error (_("%s is not compliant with %s mode\n"),
+                     GPG_AGENT_NAME,
+                     gnupg_compliance_option_string (opt.compliance));
+          write_status_error ("random-compliance", rc);
+        }
+    }
+#endif /*HAVE_W32_SYSTEM*/
+
+  return rc;
+}
+
+
 #define FLAG_FOR_CARD_SUPPRESS_ERRORS 2
 
 /* Try to connect to the agent via socket or fork it off and work by
@@ -293,68 +382,7 @@ start_agent (ctrl_t ctrl, int flag_for_card)
         }
       else if (!rc
                && !(rc = warn_version_mismatch (agent_ctx, GPG_AGENT_NAME, 0)))
-        {
-          /* Tell the agent that we support Pinentry notifications.
-             No error checking so that it will work also with older
-             agents.  */
-          assuan_transact (agent_ctx, "OPTION allow-pinentry-notify",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Tell the agent about what version we are aware.  This is
-             here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
-          assuan_transact (agent_ctx, "OPTION agent-awareness=2.1.0",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Pass on the pinentry mode.  */
-          if (opt.pinentry_mode)
-            {
-              char *tmp = xasprintf ("OPTION pinentry-mode=%s",
-                                     str_pinentry_mode (opt.pinentry_mode));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting pinentry mode '%s' failed: %s\n",
-                             str_pinentry_mode (opt.pinentry_mode),
-                             gpg_strerror (rc));
-                  write_status_error ("set_pinentry_mode", rc);
-                }
-            }
-
-          /* Pass on the request origin.  */
-          if (opt.request_origin)
-            {
-              char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
-                                     str_request_origin (opt.request_origin));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting request origin '%s' failed: %s\n",
-                             str_request_origin (opt.request_origin),
-                             gpg_strerror (rc));
-                  write_status_error ("set_request_origin", rc);
-                }
-            }
-
-          /* In DE_VS mode under Windows we require that the JENT RNG
-           * is active.  */
-#ifdef HAVE_W32_SYSTEM
-          if (!rc && opt.compliance == CO_DE_VS)
-            {
-              if (assuan_transact (agent_ctx, "GETINFO jent_active",
-                                   NULL, NULL, NULL, NULL, NULL, NULL))
-                {
-                  rc = gpg_error (GPG_ERR_FORBIDDEN);
-                  log_error (_("%s is not compliant with %s mode\n"),
-                             GPG_AGENT_NAME,
-                             gnupg_compliance_option_string (opt.compliance));
-                  write_status_error ("random-compliance", rc);
-                }
-            }
-#endif /*HAVE_W32_SYSTEM*/
-
-        }
+        rc = init_agent_connection (agent_ctx);
     }
 
   if (!rc && flag_for_card && !did_early_card_test)
@@ -1684,6 +1712,72 @@ agent_clear_passphrase (const char *cache_id)
 }
 
 
+/* Retrieve the secret stored under KEY in the agent's cache.  On
+ * success a malloced string is stored at R_VALUE.  GPG_ERR_NO_DATA
+ * is returned if no value is cached for KEY.  */
+gpg_error_t
+agent_get_secret (const char *key, char **r_value)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  membuf_t data;
+  char *buf;
+  struct default_inq_parm_s dfltparm;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+
+  *r_value = NULL;
+  err = start_agent (NULL, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  init_membuf_secure (&data, 64);
+  snprintf (line, DIM(line), "GET_SECRET %s", key);
+  err = assuan_transact (agent_ctx, line,
+                         put_membuf_cb, &data,
+                         default_inq_cb, &dfltparm,
+                         NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, NULL));
+      return err;
+    }
+  put_membuf (&data, "", 1);
+  buf = get_membuf (&data, NULL);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  *r_value = buf;
+  return 0;
+}
+
+
+/* Store VALUE under KEY in the agent's cache for TTL seconds.  VALUE
+ * may not contain spaces or percent signs.  */
+gpg_error_t
+agent_put_secret (const char *key, int ttl, const char *value)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  struct default_inq_parm_s dfltparm;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+
+  err = start_agent (NULL, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  snprintf (line, DIM(line), "PUT_SECRET %s %d %s", key, ttl, value);
+  err = assuan_transact (agent_ctx, line,
+                         NULL, NULL,
+                         default_inq_cb, &dfltparm,
+                         NULL, NULL);
+  wipememory (line, sizeof line);
+  return err;
+}
+
+
 /* Ask the agent to pop up a confirmation dialog with the text DESC
    and an okay and cancel button. */
 gpg_error_t
@@ -2115,18 +2209,17 @@ agent_readkey (ctrl_t ctrl, int fromcard, const char *hexkeygrip,
 
 
 
-/* Call the agent to do a sign operation using the key identified by
-   the hex string KEYGRIP.  DESC is a description of the key to be
-   displayed if the agent needs to ask for the PIN.  DIGEST and
-   DIGESTLEN is the hash value to sign and DIGESTALGO the algorithm id
-   used to compute the digest.  If CACHE_NONCE is used the agent is
-   advised to first try a passphrase associated with that nonce. */
-gpg_error_t
-agent_pksign (ctrl_t ctrl, const char *cache_nonce,
-              const char *keygrip, const char *desc,
-              u32 *keyid, u32 *mainkeyid, int pubkey_algo,
-              unsigned char *digest, size_t digestlen, int digestalgo,
-              gcry_sexp_t *r_sigval)
+/* The core of agent_pksign which uses the agent connection CTX and
+ * the inquiry callback INQ_CB.  The caller must have probed
+ * PKSIGN_WITH_OPTIONS.  */
+static gpg_error_t
+pksign_on_ctx (ctrl_t ctrl, assuan_context_t ctx,
+               gpg_error_t (*inq_cb) (void *, const char *),
+               const char *cache_nonce,
+               const char *keygrip, const char *desc,
+               u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+               unsigned char *digest, size_t digestlen, int digestalgo,
+               gcry_sexp_t *r_sigval)
 {
   gpg_error_t err;
   char line[ASSUAN_LINELENGTH];
@@ -2135,55 +2228,79 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce,
 
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
+  dfltparm.ctx = ctx;
   dfltparm.keyinfo.keyid       = keyid;
   dfltparm.keyinfo.mainkeyid   = mainkeyid;
   dfltparm.keyinfo.pubkey_algo = pubkey_algo;
 
   *r_sigval = NULL;
-  err = start_agent (ctrl, 0);
-  if (err)
-    return err;
-  dfltparm.ctx = agent_ctx;
-
   if (digestlen*2 + 50 > DIM(line))
     return gpg_error (GPG_ERR_GENERAL);
 
-  err = assuan_transact (agent_ctx, "RESET",
-                         NULL, NULL, NULL, NULL, NULL, NULL);
-  if (err)
-    return err;
+  if (pksign_with_options > 0)
+    {
+      /* A single request does it unless the description is too long
+       * for the line.  */
+      if (desc && (strlen (desc) + digestlen*2 + 150
+                   + (cache_nonce? strlen (cache_nonce) : 0)) > DIM(line))
+        {
+          snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+          err = assuan_transact (ctx, line,
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+          if (err)
+            return err;
+          desc = NULL;
+        }
+      snprintf (line, DIM(line), "PKSIGN --keygrip=%s --hash-algo=%d --digest=",
+                keygrip, digestalgo);
+      bin2hex (digest, digestlen, line + strlen (line));
+      snprintf (line + strlen (line), DIM(line) - strlen (line), "%s%s%s%s",
+                desc? " --desc=":"",
+                desc? desc:"",
+                cache_nonce? " -- ":"",
+                cache_nonce? cache_nonce:"");
+    }
+  else
+    {
+      err = assuan_transact (ctx, "RESET",
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
 
-  snprintf (line, DIM(line), "SIGKEY %s", keygrip);
-  err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
-  if (err)
-    return err;
+      snprintf (line, DIM(line), "SIGKEY %s", keygrip);
+      err = assuan_transact (ctx, line,
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
 
-  if (desc)
-    {
-      snprintf (line, DIM(line), "SETKEYDESC %s", desc);
-      err = assuan_transact (agent_ctx, line,
-                            NULL, NULL, NULL, NULL, NULL, NULL);
+      if (desc)
+        {
+          snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+          err = assuan_transact (ctx, line,
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+          if (err)
+            return err;
+        }
+
+      snprintf (line, sizeof line, "SETHASH %d ", digestalgo);
+      bin2hex (digest, digestlen, line + strlen (line));
+      err = assuan_transact (ctx, line,
+                             NULL, NULL, NULL, NULL, NULL, NULL);
       if (err)
         return err;
-    }
 
-  snprintf (line, sizeof line, "SETHASH %d ", digestalgo);
-  bin2hex (digest, digestlen, line + strlen (line));
-  err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
-  if (err)
-    return err;
+      snprintf (line, sizeof line, "PKSIGN%s%s",
+                cache_nonce? " -- ":"",
+                cache_nonce? cache_nonce:"");
+    }
 
   init_membuf (&data, 1024);
 
-  snprintf (line, sizeof line, "PKSIGN%s%s",
-            cache_nonce? " -- ":"",
-            cache_nonce? cache_nonce:"");
-
   if (DBG_CLOCK)
     log_clock ("enter signing");
-  err = assuan_transact (agent_ctx, line,
+  err = assuan_transact (ctx, line,
                          put_membuf_cb, &data,
-                         default_inq_cb, &dfltparm,
+                         inq_cb, &dfltparm,
                          NULL, NULL);
   if (DBG_CLOCK)
     log_clock ("leave signing");
@@ -2208,6 +2325,264 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce,
 }
 
 
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+/* Create a memory file with the DATALEN bytes at DATA, pass it to
+ * the agent and set it using COMMAND, which is either "INPUT FD" or
+ * "OUTPUT FD".  Returns our fd for the memory file or -1 on error in
+ * which case the caller falls back to inquiries and data lines.  */
+static int
+make_bulk_fd (assuan_context_t ctx, const void *data, size_t datalen,
+              const char *command)
+{
+  const unsigned char *p = data;
+  int fd;
+  ssize_t n;
+
+  fd = memfd_create ("gpg-bulk-data", MFD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  while (datalen)
+    {
+      n = write (fd, p, datalen);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          close (fd);
+          return -1;
+        }
+      p += n;
+      datalen -= n;
+    }
+  if (lseek (fd, 0, SEEK_SET)
+      || assuan_sendfd (ctx, INT2FD (fd))
+      || assuan_transact (ctx, command, NULL, NULL, NULL, NULL, NULL, NULL))
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/* Append the content of the memory file FD to MB.  */
+static gpg_error_t
+read_bulk_fd (int fd, membuf_t *mb)
+{
+  gpg_error_t err = 0;
+  char buffer[1024];
+  ssize_t n;
+
+  if (lseek (fd, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+  for (;;)
+    {
+      n = read (fd, buffer, sizeof buffer);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        err = gpg_error_from_syserror ();
+      if (n <= 0)
+        break;
+      put_membuf (mb, buffer, n);
+    }
+  wipememory (buffer, sizeof buffer);
+  return err;
+}
+#endif /*HAVE_MEMFD_CREATE && !HAVE_W32_SYSTEM*/
+
+
+/* Call the agent to do a sign operation using the key identified by
+   the hex string KEYGRIP.  DESC is a description of the key to be
+   displayed if the agent needs to ask for the PIN.  DIGEST and
+   DIGESTLEN is the hash value to sign and DIGESTALGO the algorithm id
+   used to compute the digest.  If CACHE_NONCE is used the agent is
+   advised to first try a passphrase associated with that nonce. */
+gpg_error_t
+agent_pksign (ctrl_t ctrl, const char *cache_nonce,
+              const char *keygrip, const char *desc,
+              u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+              unsigned char *digest, size_t digestlen, int digestalgo,
+              gcry_sexp_t *r_sigval)
+{
+  gpg_error_t err;
+
+  *r_sigval = NULL;
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  if (!pksign_with_options)
+    pksign_with_options = assuan_transact (agent_ctx,
+                                   "GETINFO cmd_has_option PKSIGN keygrip",
+                                   NULL, NULL, NULL, NULL, NULL, NULL)? -1:1;
+
+  return pksign_on_ctx (ctrl, agent_ctx, default_inq_cb,
+                        cache_nonce, keygrip, desc,
+                        keyid, mainkeyid, pubkey_algo,
+                        digest, digestlen, digestalgo, r_sigval);
+}
+
+
+/* The signing requests of agent_pksign_many.  */
+static struct
+{
+  ctrl_t ctrl;
+  struct agent_pksign_req_s *reqs;
+  int nreqs;
+  int next_req;           /* Index of the next request for a worker.  */
+  npth_mutex_t lock;      /* Protects NEXT_REQ.  */
+  npth_mutex_t inq_lock;  /* Serializes the inquiry callbacks.  */
+} pksign_pool;
+
+
+/* The inquiry callback for pksign_worker.  default_inq_cb may prompt
+ * for a passphrase, write status lines, and look up keys; none of
+ * this may be done by several threads at the same time.  */
+static gpg_error_t
+pksign_inq_cb (void *opaque, const char *line)
+{
+  gpg_error_t err;
+
+  npth_mutex_lock (&pksign_pool.inq_lock);
+  err = default_inq_cb (opaque, line);
+  npth_mutex_unlock (&pksign_pool.inq_lock);
+  return err;
+}
+
+
+/* The worker thread for agent_pksign_many.  ARG is the agent
+ * connection to use; it is not shared with other workers.  */
+static void *
+pksign_worker (void *arg)
+{
+  assuan_context_t ctx = arg;
+  struct agent_pksign_req_s *req;
+
+  for (;;)
+    {
+      npth_mutex_lock (&pksign_pool.lock);
+      req = NULL;
+      if (pksign_pool.next_req < pksign_pool.nreqs)
+        req = pksign_pool.reqs + pksign_pool.next_req++;
+      npth_mutex_unlock (&pksign_pool.lock);
+      if (!req)
+        break;
+
+      req->err = pksign_on_ctx (pksign_pool.ctrl, ctx, pksign_inq_cb,
+                                req->cache_nonce, req->keygrip,
+                                req->desc, req->keyid, req->mainkeyid,
+                                req->pubkey_algo, req->digest,
+                                req->digestlen, req->digestalgo,
+                                &req->sigval);
+    }
+
+  return NULL;
+}
+
+
+/* Run the NREQS signing requests at REQS using up to NCONNS
+ * connections to the agent at the same time.  The connections in
+ * addition to the standard one are opened here and closed again
+ * before returning.  The result of each request is stored in its ERR
+ * and SIGVAL fields.  An error is only returned if the standard
+ * connection can't be used.  */
+gpg_error_t
+agent_pksign_many (ctrl_t ctrl, struct agent_pksign_req_s *reqs, int nreqs,
+                   int nconns)
+{
+  gpg_error_t err;
+  assuan_context_t ctxs[AGENT_PKSIGN_MAX_CONNS];
+  npth_t threads[AGENT_PKSIGN_MAX_CONNS];
+  npth_attr_t tattr;
+  int nctxs, nstarted, i, rc;
+
+  for (i = 0; i < nreqs; i++)
+    {
+      reqs[i].sigval = NULL;
+      reqs[i].err = gpg_error (GPG_ERR_INTERNAL);
+    }
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  if (!pksign_with_options)
+    pksign_with_options = assuan_transact (agent_ctx,
+                                   "GETINFO cmd_has_option PKSIGN keygrip",
+                                   NULL, NULL, NULL, NULL, NULL, NULL)? -1:1;
+
+  if (nconns > AGENT_PKSIGN_MAX_CONNS)
+    nconns = AGENT_PKSIGN_MAX_CONNS;
+  if (nconns > nreqs)
+    nconns = nreqs;
+
+  /* The standard connection is used by the main thread; the
+   * additional connections are only used for this batch.  */
+  for (nctxs = 0; nctxs + 1 < nconns; nctxs++)
+    {
+      rc = start_new_gpg_agent (&ctxs[nctxs],
+                                GPG_ERR_SOURCE_DEFAULT,
+                                opt.agent_program,
+                                opt.lc_ctype, opt.lc_messages,
+                                opt.session_env,
+                                0, opt.verbose, DBG_IPC,
+                                NULL, NULL);
+      if (!rc)
+        {
+          rc = init_agent_connection (ctxs[nctxs]);
+          if (rc)
+            assuan_release (ctxs[nctxs]);
+        }
+      if (rc)
+        {
+          if (opt.verbose)
+            log_info ("error opening another connection to %s: %s\n",
+                      GPG_AGENT_NAME, gpg_strerror (rc));
+          break;
+        }
+    }
+
+  npth_mutex_init (&pksign_pool.lock, NULL);
+  npth_mutex_init (&pksign_pool.inq_lock, NULL);
+  pksign_pool.ctrl = ctrl;
+  pksign_pool.reqs = reqs;
+  pksign_pool.nreqs = nreqs;
+  pksign_pool.next_req = 0;
+  nstarted = 0;
+  if (nctxs && !npth_attr_init (&tattr))
+    {
+      for (i = 0; i < nctxs; i++)
+        {
+          rc = npth_create (&threads[i], &tattr, pksign_worker, ctxs[i]);
+          if (rc)
+            {
+              log_error ("error spawning signing thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  /* The main thread helps using the standard connection and also
+   * does all the work if no thread could be started.  */
+  pksign_worker (agent_ctx);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&pksign_pool.lock);
+  npth_mutex_destroy (&pksign_pool.inq_lock);
+  pksign_pool.ctrl = NULL;
+  pksign_pool.reqs = NULL;
+  pksign_pool.nreqs = 0;
+
+  for (i = 0; i < nctxs; i++)
+    assuan_release (ctxs[i]);
+
+  return 0;
+}
+
+
 
 /* Handle a CIPHERTEXT inquiry.  Note, we only send the data,
    assuan_transact takes care of flushing and writing the END. */
@@ -2372,10 +2747,14 @@ agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
 
 /* Retrieve a key encryption key from the agent.  With FOREXPORT true
    the key shall be used for export, with false for import.  On success
-   the new key is stored at R_KEY and its length at R_KEKLEN.  */
+   the new key is stored at R_KEY and its length at R_KEKLEN.  The
+   import key is only retrieved once for our connection; the agent
+   keeps it until the next KEYWRAP_KEY --import.  */
 gpg_error_t
 agent_keywrap_key (ctrl_t ctrl, int forexport, void **r_kek, size_t *r_keklen)
 {
+  static unsigned char *import_kek;  /* Cached import key.  */
+  static size_t import_keklen;
   gpg_error_t err;
   membuf_t data;
   size_t len;
@@ -2392,6 +2771,17 @@ agent_keywrap_key (ctrl_t ctrl, int forexport, void **r_kek, size_t *r_keklen)
     return err;
   dfltparm.ctx = agent_ctx;
 
+  if (!forexport && import_kek)
+    {
+      buf = xtrymalloc_secure (import_keklen);
+      if (!buf)
+        return gpg_error_from_syserror ();
+      memcpy (buf, import_kek, import_keklen);
+      *r_kek = buf;
+      *r_keklen = import_keklen;
+      return 0;
+    }
+
   snprintf (line, DIM(line), "KEYWRAP_KEY %s",
             forexport? "--export":"--import");
 
@@ -2408,6 +2798,15 @@ agent_keywrap_key (ctrl_t ctrl, int forexport, void **r_kek, size_t *r_keklen)
   buf = get_membuf (&data, &len);
   if (!buf)
     return gpg_error_from_syserror ();
+  if (!forexport)
+    {
+      import_kek = xtrymalloc_secure (len);
+      if (import_kek)
+        {
+          memcpy (import_kek, buf, len);
+          import_keklen = len;
+        }
+    }
   *r_kek = buf;
   *r_keklen = len;
   return 0;
@@ -2469,6 +2868,17 @@ agent_import_key (ctrl_t ctrl, const char *desc, char **cache_nonce_addr,
   parm.key    = key;
   parm.keylen = keylen;
 
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+  /* If the agent is able to read the key data from our fd, it won't
+   * inquire it.  */
+  if (agent_bulk_data_fd)
+    {
+      int fd = make_bulk_fd (agent_ctx, key, keylen, "INPUT FD");
+      if (fd != -1)
+        close (fd);
+    }
+#endif
+
   snprintf (line, sizeof line, "IMPORT_KEY%s%s%s%s",
             unattended? " --unattended":"",
             force? " --force":"",
@@ -2506,6 +2916,9 @@ agent_export_key (ctrl_t ctrl, const char *hexkeygrip, const char *desc,
   unsigned char *buf;
   char line[ASSUAN_LINELENGTH];
   struct default_inq_parm_s dfltparm;
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+  int fd = -1;
+#endif
 
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
@@ -2535,6 +2948,11 @@ agent_export_key (ctrl_t ctrl, const char *hexkeygrip, const char *desc,
             cache_nonce_addr && *cache_nonce_addr? *cache_nonce_addr:"",
             hexkeygrip);
 
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+  if (agent_bulk_data_fd)
+    fd = make_bulk_fd (agent_ctx, NULL, 0, "OUTPUT FD");
+#endif
+
   init_membuf_secure (&data, 1024);
   cn_parm.cache_nonce_addr = cache_nonce_addr;
   cn_parm.passwd_nonce_addr = NULL;
@@ -2542,6 +2960,15 @@ agent_export_key (ctrl_t ctrl, const char *hexkeygrip, const char *desc,
                          put_membuf_cb, &data,
                          default_inq_cb, &dfltparm,
                          cache_nonce_status_cb, &cn_parm);
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_W32_SYSTEM)
+  if (fd != -1)
+    {
+      /* The agent wrote the key to our fd.  */
+      if (!err && !get_membuf_len (&data))
+        err = read_bulk_fd (fd, &data);
+      close (fd);
+    }
+#endif
   if (err)
     {
       xfree (get_membuf (&data, &len));
@@ -143,6 +143,12 @@ gpg_error_t agent_get_passphrase (const char *cache_id,
 /* Send the CLEAR_PASSPHRASE command to the agent.  */
 gpg_error_t agent_clear_passphrase (const char *cache_id);
 
+/* Send the GET_SECRET command to the agent.  */
+gpg_error_t agent_get_secret (const char *key, char **r_value);
+
+/* Send the PUT_SECRET command to the agent.  */
+gpg_error_t agent_put_secret (const char *key, int ttl, const char *value);
+
 /* Present the prompt DESC and ask the user to confirm.  */
 gpg_error_t gpg_agent_get_confirmation (const char *desc);
 
@@ -181,6 +187,28 @@ gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           int digestalgo,
                           gcry_sexp_t *r_sigval);
 
+/* A signing request for agent_pksign_many.  */
+struct agent_pksign_req_s
+{
+  const char *cache_nonce;
+  const char *keygrip;
+  const char *desc;
+  u32 *keyid;
+  u32 *mainkeyid;
+  int pubkey_algo;
+  unsigned char *digest;
+  size_t digestlen;
+  int digestalgo;
+  gcry_sexp_t sigval;   /* Result: The signature.  */
+  gpg_error_t err;      /* Result: The error code.  */
+};
+#define AGENT_PKSIGN_MAX_CONNS 16
+
+/* Create several signatures using parallel connections.  */
+gpg_error_t agent_pksign_many (ctrl_t ctrl,
+                               struct agent_pksign_req_s *reqs, int nreqs,
+                               int nconns);
+
 /* Decrypt a ciphertext.  */
 gpg_error_t agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
                              u32 *keyid, u32 *mainkeyid, int pubkey_algo,
@@ -25,6 +25,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
 #ifdef HAVE_LOCALE_H
 # include <locale.h>
 #endif
@@ -120,13 +123,46 @@ struct dirmngr_local_s
 };
 
 
+/* The result of a command run ahead by gpg_dirmngr_race.  Note that
+   gpg.h has a pointer to a list of these objects in the CTRL.  */
+struct dirmngr_race_s
+{
+  struct dirmngr_race_s *next;
+  char *ksuri;        /* The override keyserver or NULL.  */
+  gpg_error_t err;    /* The result of the command.  */
+  estream_t memfp;    /* The returned data.  */
+  char *source;       /* The value of the SOURCE status or NULL.  */
+  char line[1];       /* The command.  */
+};
+
+
 
+/* Release the list of race results R.  */
+static void
+release_race_results (struct dirmngr_race_s *r)
+{
+  struct dirmngr_race_s *rnext;
+
+  for (; r; r = rnext)
+    {
+      rnext = r->next;
+      es_fclose (r->memfp);
+      xfree (r->ksuri);
+      xfree (r->source);
+      xfree (r);
+    }
+}
+
+
 /* Deinitialize all session data of dirmngr pertaining to CTRL.  */
 void
 gpg_dirmngr_deinit_session_data (ctrl_t ctrl)
 {
   dirmngr_local_t dml;
 
+  release_race_results (ctrl->dirmngr_race);
+  ctrl->dirmngr_race = NULL;
+
   while ((dml = ctrl->dirmngr_local))
     {
       ctrl->dirmngr_local = dml->next;
@@ -363,6 +399,56 @@ close_context (ctrl_t ctrl, assuan_context_t ctx)
 }
 
 
+/* Release the context CTX instead of returning it to the pool.  This
+   is used if an operation on CTX has been abandoned so that the state
+   of the connection is not known.  If CTX is NULL, the function does
+   nothing.  */
+static void
+drop_context (ctrl_t ctrl, assuan_context_t ctx)
+{
+  dirmngr_local_t dml, *dmlp;
+
+  if (!ctx)
+    return;
+
+  for (dmlp = &ctrl->dirmngr_local; (dml = *dmlp); dmlp = &dml->next)
+    {
+      if (dml->ctx == ctx)
+        {
+          *dmlp = dml->next;
+          assuan_release (dml->ctx);
+          xfree (dml);
+          return;
+        }
+    }
+  log_fatal ("dropping unknown dirmngr ctx %p\n", ctx);
+}
+
+
+/* If the command LINE to be sent with the override keyserver
+   KEYSERVER has been run ahead by gpg_dirmngr_race, remove its result
+   from the list and return it.  Returns NULL if there is no such
+   result.  */
+static struct dirmngr_race_s *
+take_race_result (ctrl_t ctrl, const char *line, keyserver_spec_t keyserver)
+{
+  struct dirmngr_race_s *r, **rp;
+  const char *uri = keyserver? keyserver->uri : NULL;
+
+  for (rp = &ctrl->dirmngr_race; (r = *rp); rp = &r->next)
+    {
+      if (!strcmp (r->line, line)
+          && (uri? (r->ksuri && !strcmp (r->ksuri, uri)) : !r->ksuri))
+        {
+          *rp = r->next;
+          r->next = NULL;
+          return r;
+        }
+    }
+  return NULL;
+}
+
+
 /* Clear the set_keyservers_done flag on context CTX.  */
 static void
 clear_context_flags (ctrl_t ctrl, assuan_context_t ctx)
@@ -581,9 +667,13 @@ ks_search_data_cb (void *opaque, const void *data, size_t datalen)
    the decoded data line as third argument.  The callback function may
    modify the data line and it is guaranteed that this data line is a
    complete line with a terminating 0 character but without the
-   linefeed.  NULL is passed to the callback to indicate EOF.  */
+   linefeed.  NULL is passed to the callback to indicate EOF.  If
+   LIMIT is not 0 dirmngr is asked to stop after LIMIT keys.  If the
+   callback returns GPG_ERR_TRUNCATED the search is stopped and the
+   callback is called with EOF as if the result had ended there.  */
 gpg_error_t
 gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
+                       unsigned int limit,
                        gpg_error_t (*cb)(void*, int, char *), void *cb_value)
 {
   gpg_error_t err;
@@ -604,7 +694,11 @@ gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
         close_context (ctrl, ctx);
         return err;
       }
-    snprintf (line, sizeof line, "KS_SEARCH -- %s", escsearchstr);
+    if (limit)
+      snprintf (line, sizeof line, "KS_SEARCH --limit=%u -- %s",
+                limit, escsearchstr);
+    else
+      snprintf (line, sizeof line, "KS_SEARCH -- %s", escsearchstr);
     xfree (escsearchstr);
   }
 
@@ -617,6 +711,16 @@ gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
 
   err = assuan_transact (ctx, line, ks_search_data_cb, &parm,
                         NULL, NULL, ks_status_cb, &stparm);
+  if (err && parm.lasterr)
+    {
+      /* The callback has stopped the search while dirmngr is still
+       * sending data.  We can't reuse the connection but closing it
+       * makes dirmngr stop reading from the keyserver.  */
+      drop_context (ctrl, ctx);
+      ctx = NULL;
+      if (gpg_err_code (err) == GPG_ERR_TRUNCATED)
+        err = 0;
+    }
   if (!err)
     err = cb (cb_value, 0, NULL);  /* Send EOF.  */
   else if (parm.stparm->source)
@@ -682,6 +786,7 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
   assuan_context_t ctx;
   struct ks_status_parm_s stparm;
   struct ks_get_parm_s parm;
+  struct dirmngr_race_s *race;
   char *line = NULL;
   size_t linelen;
   membuf_t mb;
@@ -740,14 +845,27 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
       goto leave;
     }
 
-  parm.memfp = es_fopenmem (0, "rwb");
-  if (!parm.memfp)
+  race = take_race_result (ctrl, line, override_keyserver);
+  if (race)
     {
-      err = gpg_error_from_syserror ();
-      goto leave;
+      err = race->err;
+      parm.memfp = race->memfp;
+      race->memfp = NULL;
+      stparm.source = race->source;
+      race->source = NULL;
+      release_race_results (race);
+    }
+  else
+    {
+      parm.memfp = es_fopenmem (0, "rwb");
+      if (!parm.memfp)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = assuan_transact (ctx, line, ks_get_data_cb, &parm,
+                             NULL, NULL, ks_status_cb, &stparm);
     }
-  err = assuan_transact (ctx, line, ks_get_data_cb, &parm,
-                         NULL, NULL, ks_status_cb, &stparm);
   if (err)
     goto leave;
 
@@ -1367,6 +1485,7 @@ gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
   assuan_context_t ctx;
   struct ks_status_parm_s stparm = { NULL };
   struct dns_cert_parm_s parm = { NULL };
+  struct dirmngr_race_s *race;
   char *line = NULL;
 
   if (r_key)
@@ -1391,14 +1510,27 @@ gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
       goto leave;
     }
 
-  parm.memfp = es_fopenmem (MAX_WKD_RESULT_LENGTH, "rwb");
-  if (!parm.memfp)
+  race = take_race_result (ctrl, line, NULL);
+  if (race)
     {
-      err = gpg_error_from_syserror ();
-      goto leave;
+      err = race->err;
+      parm.memfp = race->memfp;
+      race->memfp = NULL;
+      stparm.source = race->source;
+      race->source = NULL;
+      release_race_results (race);
+    }
+  else
+    {
+      parm.memfp = es_fopenmem (MAX_WKD_RESULT_LENGTH, "rwb");
+      if (!parm.memfp)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = assuan_transact (ctx, line, dns_cert_data_cb, &parm,
+                             NULL, NULL, ks_status_cb, &stparm);
     }
-  err = assuan_transact (ctx, line, dns_cert_data_cb, &parm,
-                         NULL, NULL, ks_status_cb, &stparm);
   if (gpg_err_code (err) == GPG_ERR_ENOSPC)
     err = gpg_error (GPG_ERR_TOO_LARGE);
   if (err)
@@ -1426,3 +1558,267 @@ gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
   close_context (ctrl, ctx);
   return err;
 }
+
+
+
+/* State of a command run by gpg_dirmngr_race.  */
+struct race_slot_s
+{
+  assuan_context_t ctx;   /* The connection or NULL if not running.  */
+  struct dirmngr_race_s *result;  /* The result or NULL if not started.  */
+  struct ks_status_parm_s stparm;
+  size_t datalen;         /* The number of data bytes received.  */
+  int done;               /* The command has finished.  */
+};
+
+
+/* Process the lines available for the command of SLOT.  */
+static void
+race_read (ctrl_t ctrl, struct race_slot_s *slot)
+{
+  gpg_error_t err;
+  char *line;
+  size_t linelen, n;
+
+  do
+    {
+      err = assuan_read_line (slot->ctx, &line, &linelen);
+      if (err)
+        break;
+
+      if (linelen >= 2 && line[0] == 'D' && line[1] == ' ')
+        {
+          n = percent_unescape_inplace (line + 2, 0);
+          if (es_write (slot->result->memfp, line + 2, n, NULL))
+            {
+              err = gpg_error_from_syserror ();
+              if (gpg_err_code (err) == GPG_ERR_ENOSPC)
+                err = gpg_error (GPG_ERR_TOO_LARGE);
+            }
+          else
+            slot->datalen += n;
+        }
+      else if (linelen >= 2 && line[0] == 'S' && line[1] == ' ')
+        err = ks_status_cb (&slot->stparm, line + 2);
+      else if (linelen >= 2 && line[0] == 'O' && line[1] == 'K'
+               && (linelen == 2 || line[2] == ' '))
+        {
+          slot->result->err = 0;
+          slot->done = 1;
+          close_context (ctrl, slot->ctx);
+          slot->ctx = NULL;
+          return;
+        }
+      else if (linelen >= 3 && !strncmp (line, "ERR", 3)
+               && (linelen == 3 || line[3] == ' '))
+        {
+          err = strtoul (line+3, NULL, 10);
+          slot->result->err = err? err : gpg_error (GPG_ERR_ASS_INV_RESPONSE);
+          slot->done = 1;
+          close_context (ctrl, slot->ctx);
+          slot->ctx = NULL;
+          return;
+        }
+      else if (linelen >= 7 && !strncmp (line, "INQUIRE", 7))
+        err = gpg_error (GPG_ERR_ASS_NO_INQUIRE_CB);
+      /* Comment and END lines are ignored.  */
+    }
+  while (!err && assuan_pending_line (slot->ctx));
+
+  if (err)
+    {
+      slot->result->err = err;
+      slot->done = 1;
+      drop_context (ctrl, slot->ctx);
+      slot->ctx = NULL;
+    }
+}
+
+
+/* Return true if SLOT has successfully retrieved some data.  */
+static int
+race_success (struct race_slot_s *slot)
+{
+  return slot->done && slot->result && !slot->result->err && slot->datalen;
+}
+
+
+/* Run the key lookups described by REQS concurrently over separate
+ * connections to the dirmngr.  If ALL is not set, REQS is ordered by
+ * priority and the function returns as soon as a lookup has
+ * succeeded and all lookups with a higher priority have failed.
+ * Lookups which are then still running are canceled.  If ALL is set
+ * the function waits for all lookups.  The results are kept until
+ * gpg_dirmngr_race_end is called and used by gpg_dirmngr_wkd_get and
+ * gpg_dirmngr_ks_get instead of running the same lookup again.
+ * Errors are not returned because the caller does the lookups
+ * anyway.  */
+void
+gpg_dirmngr_race (ctrl_t ctrl, struct dirmngr_race_req_s *reqs, int nreqs,
+                  int all)
+{
+#ifndef HAVE_W32_SYSTEM
+  gpg_error_t err;
+  struct race_slot_s *slots;
+  struct dirmngr_race_s *r;
+  char *line;
+  assuan_fd_t fd;
+  fd_set rfds;
+  int i, nfd;
+
+  gpg_dirmngr_race_end (ctrl);
+
+  slots = xtrycalloc (nreqs, sizeof *slots);
+  if (!slots)
+    return;
+
+  /* Send all commands.  These are the same as those sent by
+   * gpg_dirmngr_wkd_get and gpg_dirmngr_ks_get.  */
+  for (i=0; i < nreqs; i++)
+    {
+      line = es_bsprintf ("%s%s -- %s",
+                          reqs[i].wkd? "WKD_GET" : "KS_GET",
+                          reqs[i].quick? " --quick" : "",
+                          reqs[i].pattern);
+      if (!line)
+        goto leave;
+      if (strlen (line) + 2 >= ASSUAN_LINELENGTH)
+        {
+          es_free (line);
+          continue;
+        }
+      r = xtrycalloc (1, sizeof *r + strlen (line));
+      if (!r)
+        {
+          es_free (line);
+          goto leave;
+        }
+      strcpy (r->line, line);
+      es_free (line);
+      slots[i].result = r;
+      if (reqs[i].keyserver)
+        {
+          r->ksuri = xtrystrdup (reqs[i].keyserver->uri);
+          if (!r->ksuri)
+            goto leave;
+        }
+      r->memfp = es_fopenmem (reqs[i].wkd? MAX_WKD_RESULT_LENGTH : 0, "rwb");
+      if (!r->memfp)
+        goto leave;
+
+      err = open_context (ctrl, &slots[i].ctx);
+      if (!err && reqs[i].keyserver)
+        {
+          clear_context_flags (ctrl, slots[i].ctx);
+          line = xtryasprintf ("KEYSERVER --clear %s", r->ksuri);
+          if (!line)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              err = assuan_transact (slots[i].ctx, line, NULL, NULL, NULL,
+                                     NULL, NULL, NULL);
+              xfree (line);
+            }
+        }
+      if (!err)
+        err = assuan_write_line (slots[i].ctx, r->line);
+      if (err)
+        {
+          r->err = err;
+          slots[i].done = 1;
+          drop_context (ctrl, slots[i].ctx);
+          slots[i].ctx = NULL;
+        }
+      else if (DBG_LOOKUP)
+        log_debug ("racing '%s'\n", r->line);
+    }
+
+  /* Wait until the best possible result is available.  */
+  for (;;)
+    {
+      for (i=0; i < nreqs; i++)
+        if (slots[i].result
+            && (!slots[i].done || (!all && race_success (slots+i))))
+          break;
+      if (i == nreqs || slots[i].done)
+        break;
+
+      FD_ZERO (&rfds);
+      nfd = -1;
+      for (i=0; i < nreqs; i++)
+        {
+          if (!slots[i].ctx)
+            continue;
+          if (assuan_get_active_fds (slots[i].ctx, 0, &fd, 1) < 1)
+            {
+              slots[i].result->err = gpg_error (GPG_ERR_INTERNAL);
+              slots[i].done = 1;
+              drop_context (ctrl, slots[i].ctx);
+              slots[i].ctx = NULL;
+              continue;
+            }
+          FD_SET (FD2INT (fd), &rfds);
+          if ((int)FD2INT (fd) > nfd)
+            nfd = FD2INT (fd);
+        }
+      if (nfd == -1)
+        continue;
+
+      if (select (nfd+1, &rfds, NULL, NULL, NULL) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          log_error ("%s: select failed: %s\n", __func__, strerror (errno));
+          break;
+        }
+      for (i=0; i < nreqs; i++)
+        if (slots[i].ctx
+            && assuan_get_active_fds (slots[i].ctx, 0, &fd, 1) > 0
+            && FD_ISSET (FD2INT (fd), &rfds))
+          race_read (ctrl, slots+i);
+    }
+
+ leave:
+  /* Keep the results of finished commands and cancel the others.  */
+  for (i=0; slots && i < nreqs; i++)
+    {
+      r = slots[i].result;
+      if (!r)
+        continue;
+      if (slots[i].ctx)
+        {
+          if (DBG_LOOKUP)
+            log_debug ("canceling '%s'\n", r->line);
+          drop_context (ctrl, slots[i].ctx);
+          release_race_results (r);
+        }
+      else if (!slots[i].done)
+        release_race_results (r);
+      else
+        {
+          es_rewind (r->memfp);
+          r->source = slots[i].stparm.source;
+          slots[i].stparm.source = NULL;
+          r->next = ctrl->dirmngr_race;
+          ctrl->dirmngr_race = r;
+        }
+      xfree (slots[i].stparm.source);
+    }
+  xfree (slots);
+#else /*HAVE_W32_SYSTEM*/
+  /* The Assuan file descriptors can't be waited on with select.  */
+  (void)ctrl;
+  (void)reqs;
+  (void)nreqs;
+  (void)all;
+#endif /*HAVE_W32_SYSTEM*/
+}
+
+
+/* Release the results kept by gpg_dirmngr_race.  */
+void
+gpg_dirmngr_race_end (ctrl_t ctrl)
+{
+  release_race_results (ctrl->dirmngr_race);
+  ctrl->dirmngr_race = NULL;
+}
@@ -23,6 +23,7 @@ void gpg_dirmngr_deinit_session_data (ctrl_t ctrl);
 
 gpg_error_t gpg_dirmngr_ks_list (ctrl_t ctrl, char **r_keyserver);
 gpg_error_t gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
+                                   unsigned int limit,
                                    gpg_error_t (*cb)(void*, int, char *),
                                    void *cb_value);
 gpg_error_t gpg_dirmngr_ks_get (ctrl_t ctrl, char *pattern[],
@@ -43,5 +44,18 @@ gpg_error_t gpg_dirmngr_get_pka (ctrl_t ctrl, const char *userid,
 gpg_error_t gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
                                  estream_t *r_key, char **r_url);
 
+/* A lookup to be run by gpg_dirmngr_race.  */
+struct dirmngr_race_req_s
+{
+  int wkd;                     /* Use WKD_GET instead of KS_GET.  */
+  int quick;                   /* Advise the dirmngr to be quick.  */
+  const char *pattern;         /* The mbox for WKD_GET or the pattern.  */
+  keyserver_spec_t keyserver;  /* The override keyserver or NULL.  */
+};
+
+void gpg_dirmngr_race (ctrl_t ctrl, struct dirmngr_race_req_s *reqs,
+                       int nreqs, int all);
+void gpg_dirmngr_race_end (ctrl_t ctrl);
+
 
 #endif /*GNUPG_G10_CALL_DIRMNGR_H*/
@@ -41,6 +41,7 @@
 #include "../common/exechelp.h"
 #include "../common/status.h"
 #include "keydb.h"
+#include "../common/tracepoint.h"
 
 #include "keydb-private.h"  /* For struct keydb_handle_s */
 
@@ -734,6 +735,30 @@ keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb)
 }
 
 
+/* Return the image of the keyblock last found by keydb_search as a
+ * memory stream at R_IMAGE without parsing it.  Returns
+ * GPG_ERR_NOT_SUPPORTED if no image is available; the caller may then
+ * use keydb_get_keyblock.  Only one of these functions may be used
+ * for a found keyblock.  */
+gpg_error_t
+keydb_get_keyblock_image (KEYDB_HANDLE hd, iobuf_t *r_image)
+{
+  *r_image = NULL;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  if (!hd->use_keyboxd)
+    return internal_keydb_get_keyblock_image (hd, r_image);
+
+  if (!hd->kbl->search_result)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  *r_image = hd->kbl->search_result;
+  hd->kbl->search_result = NULL;
+  return 0;
+}
+
+
 /* Update the keyblock KB (i.e., extract the fingerprint and find the
  * corresponding keyblock in the keyring).
  *
@@ -893,6 +918,99 @@ search_status_cb (void *opaque, const char *line)
 }
 
 
+/* Format the search pattern for DESC into BUFFER of size BUFSIZE.
+ * This is the argument to the SEARCH command and may be the empty
+ * string for KEYDB_SEARCH_MODE_FIRST.  */
+static gpg_error_t
+format_search_pattern (char *buffer, size_t bufsize,
+                       KEYDB_SEARCH_DESC *desc)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_EXACT:
+      snprintf (buffer, bufsize, "=%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBSTR:
+      snprintf (buffer, bufsize, "*%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAIL:
+      snprintf (buffer, bufsize, "<%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILSUB:
+      snprintf (buffer, bufsize, "@%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILEND:
+      snprintf (buffer, bufsize, ".%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_WORDS:
+      snprintf (buffer, bufsize, "+%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+      snprintf (buffer, bufsize, "0x%08lX",
+                (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      snprintf (buffer, bufsize, "0x%08lX%08lX",
+                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_FPR:
+      {
+        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
+        log_assert (desc->fprlen <= MAX_FINGERPRINT_LEN);
+        bin2hex (desc->u.fpr, desc->fprlen, hexfpr);
+        snprintf (buffer, bufsize, "0x%s", hexfpr);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER:
+      snprintf (buffer, bufsize, "#/%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER_SN:
+    case KEYDB_SEARCH_MODE_SN:
+      snprintf (buffer, bufsize, "#%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBJECT:
+      snprintf (buffer, bufsize, "/%s", desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      {
+        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
+        bin2hex (desc->u.grip, KEYGRIP_LEN, hexgrip);
+        snprintf (buffer, bufsize, "&%s", hexgrip);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_UBID:
+      {
+        unsigned char hexubid[20 * 2 + 1];
+        bin2hex (desc->u.grip, 20, hexubid);
+        snprintf (buffer, bufsize, "^%s", hexubid);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_FIRST:
+      *buffer = 0;
+      break;
+
+    default:
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  return 0;
+}
+
+
 /* Search the database for keys matching the search description.  If
  * the DB contains any legacy keys, these are silently ignored.
  *
@@ -928,6 +1046,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 
   if (DBG_CLOCK)
     log_clock ("%s enter", __func__);
+  TRACEPOINT2 (keydb_search_begin, ndesc, ndesc? desc[0].mode : 0);
 
   if (DBG_LOOKUP)
     {
@@ -980,95 +1099,44 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       goto leave;
     }
 
-  /* FIXME: Implement --multi */
-  switch (desc->mode)
-    {
-    case KEYDB_SEARCH_MODE_EXACT:
-      snprintf (line, sizeof line, "SEARCH =%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBSTR:
-      snprintf (line, sizeof line, "SEARCH *%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAIL:
-      snprintf (line, sizeof line, "SEARCH <%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILSUB:
-      snprintf (line, sizeof line, "SEARCH @%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILEND:
-      snprintf (line, sizeof line, "SEARCH .%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_WORDS:
-      snprintf (line, sizeof line, "SEARCH +%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SHORT_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX",
-                (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_LONG_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX%08lX",
-                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_FPR:
+  /* A search for the first key matches any key; thus we can ignore
+   * the other descriptions in this case.  */
+  for (i = 0; i < ndesc; i++)
+    if (desc[i].mode == KEYDB_SEARCH_MODE_FIRST)
       {
-        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
-        log_assert (desc[0].fprlen <= MAX_FINGERPRINT_LEN);
-        bin2hex (desc[0].u.fpr, desc[0].fprlen, hexfpr);
-        snprintf (line, sizeof line, "SEARCH 0x%s", hexfpr);
+        desc += i;
+        ndesc = 1;
+        break;
       }
-      break;
-
-    case KEYDB_SEARCH_MODE_ISSUER:
-      snprintf (line, sizeof line, "SEARCH #/%s", desc[0].u.name);
-      break;
 
-    case KEYDB_SEARCH_MODE_ISSUER_SN:
-    case KEYDB_SEARCH_MODE_SN:
-      snprintf (line, sizeof line, "SEARCH #%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBJECT:
-      snprintf (line, sizeof line, "SEARCH /%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_KEYGRIP:
-      {
-        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
-        bin2hex (desc[0].u.grip, KEYGRIP_LEN, hexgrip);
-        snprintf (line, sizeof line, "SEARCH &%s", hexgrip);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_UBID:
-      {
-        unsigned char hexubid[20 * 2 + 1];
-        bin2hex (desc[0].u.grip, 20, hexubid);
-        snprintf (line, sizeof line, "SEARCH ^%s", hexubid);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_FIRST:
-      snprintf (line, sizeof line, "SEARCH");
-      break;
-
-    case KEYDB_SEARCH_MODE_NEXT:
+  if (desc->mode == KEYDB_SEARCH_MODE_NEXT)
+    {
       log_debug ("%s: mode next - we should not get to here!\n", __func__);
       snprintf (line, sizeof line, "NEXT");
-      break;
+      goto do_search;
+    }
 
-    default:
-      err = gpg_error (GPG_ERR_INV_ARG);
-      goto leave;
+  /* Send all but the last description with --more so that the
+   * keyboxd ORs them together.  Note that the keyboxd does not tell
+   * us which description matched and thus DESCINDEX is always 0.  */
+  for (i = 0; i < ndesc - 1; i++)
+    {
+      strcpy (line, "SEARCH --more ");
+      err = format_search_pattern (line + 14, sizeof line - 14, desc + i);
+      if (!err)
+        err = assuan_transact (hd->kbl->ctx, line,
+                               NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        goto leave;
     }
 
+  strcpy (line, "SEARCH ");
+  err = format_search_pattern (line + 7, sizeof line - 7, desc + ndesc - 1);
+  if (err)
+    goto leave;
+  if (!line[7])
+    line[6] = 0;  /* Avoid a trailing space.  */
+
  do_search:
   hd->last_ubid_valid = 0;
   if (hd->kbl->datastream.fp)
@@ -1139,7 +1207,366 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   /*   log_printhex (hd->last_ubid, 20, "found UBID:"); */
 
  leave:
+  TRACEPOINT1 (keydb_search_end, err);
   if (DBG_CLOCK)
     log_clock ("%s leave (%sfound)", __func__, err? "not ":"");
   return err;
 }
+
+
+/* Search the database for all keys matching any of the NDESC search
+ * descriptions in DESC using a single batched request.  In contrast
+ * to keydb_search the descriptions are not OR'd but each one is
+ * processed on its own; for each found keyblock the callback CB is
+ * called with OPAQUE, the index of the matching description and the
+ * keyblock, which is then owned by the callback.  If CB returns an
+ * error the search is stopped and that error returned.  Descriptions
+ * which do not match any key are silently skipped.  After this
+ * function a keydb_search_reset is implied.  */
+gpg_error_t
+keydb_search_multi (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                    gpg_error_t (*cb)(void *opaque, size_t descidx,
+                                      kbnode_t keyblock),
+                    void *opaque)
+{
+  gpg_error_t err;
+  size_t i, n, patlen;
+  char pattern[ASSUAN_LINELENGTH];
+  char pats[ASSUAN_LINELENGTH - 30];
+  char line[ASSUAN_LINELENGTH];
+  char *escaped;
+  membuf_t data;
+  unsigned char *buffer = NULL;
+  const unsigned char *p;
+  size_t len;
+  unsigned int idx, pubkey_type;
+  size_t bloblen;
+  iobuf_t iobuf;
+  kbnode_t keyblock;
+
+  if (!hd || !cb)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  if (DBG_CLOCK)
+    log_clock ("%s enter", __func__);
+
+  for (i = 0; i < ndesc; i++)
+    if (desc[i].mode == KEYDB_SEARCH_MODE_FIRST
+        || desc[i].mode == KEYDB_SEARCH_MODE_NEXT)
+      {
+        err = gpg_error (GPG_ERR_INV_ARG);
+        goto leave;
+      }
+
+  if (!hd->use_keyboxd)
+    {
+      /* Without a keyboxd we simply do one search after the other.  */
+      for (i = 0; i < ndesc; i++)
+        {
+          err = keydb_search_reset (hd);
+          while (!err && !(err = keydb_search (hd, desc + i, 1, NULL)))
+            {
+              err = keydb_get_keyblock (hd, &keyblock);
+              if (!err)
+                err = cb (opaque, i, keyblock);
+            }
+          if (gpg_err_code (err) == GPG_ERR_NOT_FOUND
+              || gpg_err_code (err) == GPG_ERR_EOF)
+            err = 0;
+          if (err)
+            break;
+        }
+      keydb_search_reset (hd);
+      goto leave;
+    }
+
+  /* Clear the result objects and the server's search state.  */
+  if (hd->kbl->search_result)
+    {
+      iobuf_close (hd->kbl->search_result);
+      hd->kbl->search_result = NULL;
+    }
+  if (hd->kbl->datastream.found_keyblock)
+    {
+      release_kbnode (hd->kbl->datastream.found_keyblock);
+      hd->kbl->datastream.found_keyblock = NULL;
+    }
+  hd->kbl->need_search_reset = 1;
+  hd->last_ubid_valid = 0;
+
+  if (!ndesc)
+    {
+      err = 0;
+      goto leave;
+    }
+
+  /* Pack as many patterns as possible into one line and send all
+   * lines except for the last with --more.  */
+  *pats = 0;
+  n = 0;
+  for (i = 0; i < ndesc; i++)
+    {
+      err = format_search_pattern (pattern, sizeof pattern, desc + i);
+      if (err)
+        goto leave;
+      escaped = percent_plus_escape (pattern);
+      if (!escaped)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      patlen = strlen (escaped);
+      if (patlen + 1 >= sizeof pats)
+        {
+          xfree (escaped);
+          err = gpg_error (GPG_ERR_TOO_LARGE);
+          goto leave;
+        }
+      if (n && n + 1 + patlen >= sizeof pats)
+        {
+          snprintf (line, sizeof line, "SEARCH --multi --more %s", pats);
+          err = assuan_transact (hd->kbl->ctx, line,
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+          if (err)
+            {
+              xfree (escaped);
+              goto leave;
+            }
+          *pats = 0;
+          n = 0;
+        }
+      if (n)
+        pats[n++] = ' ';
+      strcpy (pats + n, escaped);
+      n += patlen;
+      xfree (escaped);
+    }
+
+  /* The keyboxd always returns the records via data lines.  */
+  snprintf (line, sizeof line, "SEARCH --multi %s", pats);
+  init_membuf (&data, 8192);
+  err = assuan_transact (hd->kbl->ctx, line,
+                         put_membuf_cb, &data,
+                         NULL, NULL,
+                         NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, &len));
+      goto leave;
+    }
+  buffer = get_membuf (&data, &len);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Each record is prefixed with the index of the description, the
+   * pubkey type and the length of the blob.  */
+  for (p = buffer; len; p += bloblen, len -= bloblen)
+    {
+      if (len < 12)
+        {
+          err = gpg_error (GPG_ERR_INV_RESPONSE);
+          goto leave;
+        }
+      idx = buf32_to_uint (p);
+      pubkey_type = buf32_to_uint (p+4);
+      bloblen = buf32_to_size_t (p+8);
+      p += 12;
+      len -= 12;
+      if (idx >= ndesc || bloblen > len)
+        {
+          err = gpg_error (GPG_ERR_INV_RESPONSE);
+          goto leave;
+        }
+      if (pubkey_type != PUBKEY_TYPE_OPGP)
+        continue;  /* Silently ignore other key types.  */
+
+      iobuf = iobuf_temp_with_content ((const char *)p, bloblen);
+      err = keydb_get_keyblock_do_parse (iobuf, 0, 0, &keyblock);
+      iobuf_close (iobuf);
+      if (!err)
+        err = cb (opaque, idx, keyblock);
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  xfree (buffer);
+  if (DBG_CLOCK)
+    log_clock ("%s leave%s", __func__, err? " (failed)":"");
+  return err;
+}
+
+
+/* An asynchronous keydb_search_multi.  */
+struct keydb_multi_search_s
+{
+  KEYDB_HANDLE hd;           /* The handle used by the thread.  */
+  KEYDB_SEARCH_DESC *desc;   /* A copy of the descriptions.  */
+  size_t ndesc;
+  npth_t thread;
+  int thread_started;
+  gpg_error_t err;           /* The result of keydb_search_multi.  */
+  struct multi_search_result_s
+  {
+    struct multi_search_result_s *next;
+    size_t descidx;
+    kbnode_t keyblock;
+  } *results, **results_tail;
+};
+
+
+/* Callback for keydb_search_multi used by multi_search_thread.  */
+static gpg_error_t
+multi_search_collect_cb (void *opaque, size_t descidx, kbnode_t keyblock)
+{
+  keydb_multi_search_t ms = opaque;
+  struct multi_search_result_s *r;
+
+  r = xtrymalloc (sizeof *r);
+  if (!r)
+    {
+      release_kbnode (keyblock);
+      return gpg_error_from_syserror ();
+    }
+  r->next = NULL;
+  r->descidx = descidx;
+  r->keyblock = keyblock;
+  *ms->results_tail = r;
+  ms->results_tail = &r->next;
+  return 0;
+}
+
+
+/* The thread running the search for keydb_search_multi_start.  */
+static void *
+multi_search_thread (void *arg)
+{
+  keydb_multi_search_t ms = arg;
+
+  ms->err = keydb_search_multi (ms->hd, ms->desc, ms->ndesc,
+                                multi_search_collect_cb, ms);
+  return NULL;
+}
+
+
+/* Start a keydb_search_multi for the NDESC search descriptions in
+ * DESC and return at R_MS a handle to get the result with
+ * keydb_search_multi_finish.  With the keyboxd the search runs in its
+ * own thread using its own connection so that the caller can do
+ * other work, including other keydb operations, while the keyboxd
+ * looks up the keys.  Without the keyboxd the search is done only by
+ * keydb_search_multi_finish.  DESC is copied and may be released by
+ * the caller after this function returns.  */
+gpg_error_t
+keydb_search_multi_start (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                          keydb_multi_search_t *r_ms)
+{
+  gpg_error_t err;
+  keydb_multi_search_t ms;
+  npth_attr_t tattr;
+  int rc;
+
+  *r_ms = NULL;
+
+  ms = xtrycalloc (1, sizeof *ms);
+  if (!ms)
+    return gpg_error_from_syserror ();
+  ms->results_tail = &ms->results;
+  ms->ndesc = ndesc;
+  if (ndesc)
+    {
+      ms->desc = xtrymalloc (ndesc * sizeof *desc);
+      if (!ms->desc)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      memcpy (ms->desc, desc, ndesc * sizeof *desc);
+    }
+
+  ms->hd = keydb_new (ctrl);
+  if (!ms->hd)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (ms->hd->use_keyboxd && ndesc)
+    {
+      rc = npth_attr_init (&tattr);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          goto leave;
+        }
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      rc = npth_create (&ms->thread, &tattr, multi_search_thread, ms);
+      npth_attr_destroy (&tattr);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          goto leave;
+        }
+      npth_setname_np (ms->thread, "keydb-search-multi");
+      ms->thread_started = 1;
+    }
+  err = 0;
+
+ leave:
+  if (err)
+    {
+      keydb_release (ms->hd);
+      xfree (ms->desc);
+      xfree (ms);
+    }
+  else
+    *r_ms = ms;
+  return err;
+}
+
+
+/* Wait for the search MS started by keydb_search_multi_start and
+ * pass the found keyblocks to CB as described for keydb_search_multi.
+ * If CB is NULL the result is discarded.  MS is released in all
+ * cases; passing NULL is a no-op.  */
+gpg_error_t
+keydb_search_multi_finish (keydb_multi_search_t ms,
+                           gpg_error_t (*cb)(void *opaque, size_t descidx,
+                                             kbnode_t keyblock),
+                           void *opaque)
+{
+  gpg_error_t err;
+  struct multi_search_result_s *r;
+
+  if (!ms)
+    return 0;
+
+  if (ms->thread_started)
+    {
+      npth_join (ms->thread, NULL);
+      err = ms->err;
+    }
+  else if (cb)
+    err = keydb_search_multi (ms->hd, ms->desc, ms->ndesc,
+                              multi_search_collect_cb, ms);
+  else
+    err = 0;
+
+  while ((r = ms->results))
+    {
+      ms->results = r->next;
+      if (!err && cb)
+        err = cb (opaque, r->descidx, r->keyblock);
+      else
+        release_kbnode (r->keyblock);
+      xfree (r);
+    }
+
+  keydb_release (ms->hd);
+  xfree (ms->desc);
+  xfree (ms);
+  return err;
+}
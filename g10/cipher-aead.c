@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/status.h"
@@ -39,6 +40,50 @@
 #define AEAD_ENC_BUFFER_SIZE (64*1024)
 
 
+/* The states of a parallel encryption job.  */
+enum aead_job_states
+  {
+    AEAD_JOB_FREE = 0,  /* Unused or being filled by the filter.  */
+    AEAD_JOB_PENDING,   /* Waiting for a worker.                 */
+    AEAD_JOB_BUSY,      /* A worker is encrypting it.            */
+    AEAD_JOB_DONE       /* Encrypted; waiting to be written.     */
+  };
+
+/* A job is a complete chunk to be encrypted by a worker thread.  */
+struct aead_job_s
+{
+  enum aead_job_states state;
+
+  /* Each job has its own cipher handle with the nonce and the
+   * additional data already set.  */
+  gcry_cipher_hd_t cipher_hd;
+
+  /* The chunk; allocated with CHUNKSIZE bytes on first use.  */
+  char *buffer;
+  size_t buflen;
+
+  /* The authentication tag and the error of the worker.  */
+  unsigned char tag[16];
+  gpg_error_t err;
+};
+
+/* The worker pool used with --aead-threads.  The jobs form a ring
+ * which is filled and written out only by the filter; thus the
+ * chunks are written in their original order.  */
+struct aead_pool_s
+{
+  npth_mutex_t lock;     /* Protects the fields below.  */
+  npth_cond_t cond;      /* Signaled on each job state change.  */
+  int shutdown;          /* Tell the workers to terminate.  */
+  int nthreads;          /* Number of started workers.  */
+  npth_t *threads;
+  int head;              /* Index of the oldest job not yet written.  */
+  int nqueued;           /* Number of jobs submitted but not written.  */
+  int njobs;
+  struct aead_job_s jobs[1];
+};
+
+
 /* Wrapper around iobuf_write to make sure that a proper error code is
  * always returned.  */
 static gpg_error_t
@@ -55,12 +100,13 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
+/* Set the nonce and the additional data for the current chunk on the
+ * cipher handle HD.  If FINAL is set the final AEAD chunk is
+ * processed.  This also reset the encryption machinery so that the
+ * handle can be used for a new chunk.  */
 static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+set_nonce_and_ad_hd (cipher_filter_context_t *cfx, gcry_cipher_hd_t hd,
+                     int final)
 {
   gpg_error_t err;
   unsigned char nonce[16];
@@ -94,7 +140,7 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
 
   if (DBG_CRYPTO)
     log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -124,7 +170,186 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Same as set_nonce_and_ad_hd for the filter's own cipher handle.  */
+static gpg_error_t
+set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+{
+  return set_nonce_and_ad_hd (cfx, cfx->cipher_hd, final);
+}
+
+
+/* The worker thread for parallel encryption.  */
+static void *
+aead_worker (void *arg)
+{
+  struct aead_pool_s *pool = arg;
+  struct aead_job_s *job;
+  int i;
+
+  npth_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      /* Take the oldest pending job.  */
+      job = NULL;
+      for (i = 0; i < pool->nqueued && !job; i++)
+        {
+          job = pool->jobs + (pool->head + i) % pool->njobs;
+          if (job->state != AEAD_JOB_PENDING)
+            job = NULL;
+        }
+      if (!job)
+        {
+          if (pool->shutdown)
+            break;
+          npth_cond_wait (&pool->cond, &pool->lock);
+          continue;
+        }
+      job->state = AEAD_JOB_BUSY;
+      npth_mutex_unlock (&pool->lock);
+
+      /* The cipher handle is owned by this job and thus we can run
+       * this in parallel to other threads.  See do_flush for the
+       * remark on encrypting an empty buffer.  */
+      npth_unprotect ();
+      gcry_cipher_final (job->cipher_hd);
+      job->err = gcry_cipher_encrypt (job->cipher_hd,
+                                      job->buffer, job->buflen, NULL, 0);
+      if (!job->err)
+        job->err = gcry_cipher_gettag (job->cipher_hd, job->tag, 16);
+      npth_protect ();
+
+      npth_mutex_lock (&pool->lock);
+      job->state = AEAD_JOB_DONE;
+      npth_cond_broadcast (&pool->cond);
+    }
+  npth_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+
+/* Stop the workers of the pool and release it.  */
+static void
+release_pool (cipher_filter_context_t *cfx)
+{
+  struct aead_pool_s *pool = cfx->pool;
+  int i;
+
+  if (!pool)
+    return;
+
+  npth_mutex_lock (&pool->lock);
+  pool->shutdown = 1;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+  for (i = 0; i < pool->nthreads; i++)
+    npth_join (pool->threads[i], NULL);
+  xfree (pool->threads);
+
+  for (i = 0; i < pool->njobs; i++)
+    {
+      gcry_cipher_close (pool->jobs[i].cipher_hd);
+      if (pool->jobs[i].buffer)
+        {
+          wipememory (pool->jobs[i].buffer, cfx->chunksize);
+          xfree (pool->jobs[i].buffer);
+        }
+    }
+  npth_cond_destroy (&pool->cond);
+  npth_mutex_destroy (&pool->lock);
+  xfree (pool);
+  cfx->pool = NULL;
+}
+
+
+/* Create the worker pool for --aead-threads.  If the chunks are too
+ * large for parallel processing or no threads are requested
+ * CFX->POOL is left at NULL.  */
+static gpg_error_t
+create_pool (cipher_filter_context_t *cfx, enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  struct aead_pool_s *pool;
+  npth_attr_t tattr;
+  int njobs, i, rc;
+
+  if (opt.aead_threads < 1)
+    return 0;
+
+  /* We use one job more than threads so that we can fill a chunk
+   * while all threads are busy.  */
+  njobs = (opt.aead_threads > AEAD_MAX_THREADS? AEAD_MAX_THREADS
+           /* */                                : opt.aead_threads) + 1;
+  if (njobs > AEAD_MAX_PARALLEL_MEM / cfx->chunksize)
+    njobs = AEAD_MAX_PARALLEL_MEM / cfx->chunksize;
+  if (njobs < 2)
+    {
+      log_info ("chunk size too large for --aead-threads - ignored\n");
+      return 0;
+    }
+
+  pool = xtrycalloc (1, sizeof *pool + (njobs - 1) * sizeof *pool->jobs);
+  if (!pool)
+    return gpg_error_from_syserror ();
+  pool->njobs = njobs;
+  pool->threads = xtrycalloc (njobs - 1, sizeof *pool->threads);
+  if (!pool->threads)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (pool);
+      return err;
+    }
+  npth_mutex_init (&pool->lock, NULL);
+  npth_cond_init (&pool->cond, NULL);
+  cfx->pool = pool;
+
+  for (i = 0; i < njobs; i++)
+    {
+      err = openpgp_cipher_open (&pool->jobs[i].cipher_hd,
+                                 cfx->dek->algo, ciphermode,
+                                 GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (pool->jobs[i].cipher_hd,
+                                  cfx->dek->key, cfx->dek->keylen);
+      if (err)
+        goto leave;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  for (i = 0; i < njobs - 1; i++)
+    {
+      rc = npth_create (&pool->threads[i], &tattr, aead_worker, pool);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          npth_attr_destroy (&tattr);
+          goto leave;
+        }
+      pool->nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER)
+    log_debug ("aead: using %d threads and %d jobs\n",
+               pool->nthreads, pool->njobs);
+
+ leave:
+  if (err)
+    {
+      log_error ("error creating AEAD worker threads: %s\n",
+                 gpg_strerror (err));
+      release_pool (cfx);
+    }
+  return err;
 }
 
 
@@ -200,6 +425,10 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  err = create_pool (cfx, ciphermode);
+  if (err)
+    goto leave;
+
   cfx->wrote_header = 1;
 
  leave:
@@ -253,6 +482,149 @@ write_final_chunk (cipher_filter_context_t *cfx, iobuf_t a)
 }
 
 
+/* Write the oldest job of the pool to stream A.  If WAIT is not set
+ * and the job has not yet been encrypted nothing is done and
+ * GPG_ERR_EAGAIN is returned.  */
+static gpg_error_t
+pool_write_head (cipher_filter_context_t *cfx, iobuf_t a, int wait)
+{
+  struct aead_pool_s *pool = cfx->pool;
+  struct aead_job_s *job;
+  gpg_error_t err;
+
+  log_assert (pool->nqueued);
+  job = pool->jobs + pool->head;
+
+  npth_mutex_lock (&pool->lock);
+  while (job->state != AEAD_JOB_DONE)
+    {
+      if (!wait)
+        {
+          npth_mutex_unlock (&pool->lock);
+          return gpg_error (GPG_ERR_EAGAIN);
+        }
+      npth_cond_wait (&pool->cond, &pool->lock);
+    }
+  pool->head = (pool->head + 1) % pool->njobs;
+  pool->nqueued--;
+  npth_mutex_unlock (&pool->lock);
+
+  err = job->err;
+  if (!err)
+    err = my_iobuf_write (a, job->buffer, job->buflen);
+  if (!err)
+    {
+      if (DBG_FILTER)
+        log_debug ("writing tag: chunklen=%zu\n", job->buflen);
+      err = my_iobuf_write (a, job->tag, 16);
+    }
+  job->buflen = 0;
+  job->state = AEAD_JOB_FREE;
+  return err;
+}
+
+
+/* Return the job of the pool to be filled next.  If all jobs are in
+ * use the oldest is first written to stream A.  */
+static gpg_error_t
+pool_get_job (cipher_filter_context_t *cfx, iobuf_t a,
+              struct aead_job_s **r_job)
+{
+  struct aead_pool_s *pool = cfx->pool;
+  struct aead_job_s *job;
+  gpg_error_t err;
+
+  if (pool->nqueued == pool->njobs)
+    {
+      err = pool_write_head (cfx, a, 1);
+      if (err)
+        return err;
+    }
+
+  job = pool->jobs + (pool->head + pool->nqueued) % pool->njobs;
+  if (!job->buffer)
+    {
+      job->buffer = xtrymalloc (cfx->chunksize);
+      if (!job->buffer)
+        return gpg_error_from_syserror ();
+    }
+  *r_job = job;
+  return 0;
+}
+
+
+/* Hand the filled JOB over to the workers.  Already encrypted jobs
+ * are then written to stream A.  */
+static gpg_error_t
+pool_submit (cipher_filter_context_t *cfx, iobuf_t a, struct aead_job_s *job)
+{
+  struct aead_pool_s *pool = cfx->pool;
+  gpg_error_t err;
+
+  if (DBG_FILTER)
+    log_debug ("submitting chunk %ju (%zu bytes)\n",
+               (uintmax_t)cfx->chunkindex, job->buflen);
+  err = set_nonce_and_ad_hd (cfx, job->cipher_hd, 0);
+  if (err)
+    return err;
+  cfx->chunkindex++;
+  cfx->total += job->buflen;
+
+  npth_mutex_lock (&pool->lock);
+  job->err = 0;
+  job->state = AEAD_JOB_PENDING;
+  pool->nqueued++;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+
+  while (pool->nqueued)
+    {
+      err = pool_write_head (cfx, a, 0);
+      if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+        return 0;
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* The flush sub-function of cipher_filter_aead for --aead-threads.
+ * Complete chunks are collected and encrypted by the workers.  */
+static gpg_error_t
+do_flush_parallel (cipher_filter_context_t *cfx, iobuf_t a,
+                   byte *buf, size_t size)
+{
+  gpg_error_t err;
+  struct aead_job_s *job;
+  size_t n;
+
+  while (size)
+    {
+      err = pool_get_job (cfx, a, &job);
+      if (err)
+        return err;
+
+      n = cfx->chunksize - job->buflen;
+      if (n > size)
+        n = size;
+      memcpy (job->buffer + job->buflen, buf, n);
+      job->buflen += n;
+      buf  += n;
+      size -= n;
+
+      if (job->buflen == cfx->chunksize)
+        {
+          err = pool_submit (cfx, a, job);
+          if (err)
+            return err;
+        }
+    }
+
+  return 0;
+}
+
+
 /* The core of the flush sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
@@ -261,6 +633,9 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
   int finalize = 0;
   size_t n;
 
+  if (cfx->pool)
+    return do_flush_parallel (cfx, a, buf, size);
+
   /* Put the data into a buffer, flush and encrypt as needed.  */
   if (DBG_FILTER)
     log_debug ("flushing %zu bytes (cur buflen=%zu)\n", size, cfx->buflen);
@@ -318,8 +693,10 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
            * be called after gcry_cipher_final and before
            * gcry_cipher_gettag - at least with libgcrypt 1.8 and OCB
            * mode.  */
+          pipeline_unprotect ();
           err = gcry_cipher_encrypt (cfx->cipher_hd, cfx->buffer, cfx->buflen,
                                      NULL, 0);
+          pipeline_protect ();
           if (err)
             goto leave;
           if (finalize && DBG_FILTER)
@@ -362,7 +739,30 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   if (DBG_FILTER)
     log_debug ("do_free: buflen=%zu\n", cfx->buflen);
 
-  if (cfx->buflen)
+  if (cfx->pool)
+    {
+      struct aead_pool_s *pool = cfx->pool;
+      struct aead_job_s *job;
+
+      /* Submit the last chunk and write out all jobs.  */
+      if (pool->nqueued < pool->njobs)
+        {
+          job = pool->jobs + (pool->head + pool->nqueued) % pool->njobs;
+          if (job->buflen)
+            {
+              err = pool_submit (cfx, a, job);
+              if (err)
+                goto leave;
+            }
+        }
+      while (pool->nqueued)
+        {
+          err = pool_write_head (cfx, a, 1);
+          if (err)
+            goto leave;
+        }
+    }
+  else if (cfx->buflen)
     {
       if (DBG_FILTER)
         log_debug ("encrypting last %zu bytes of the last chunk\n",cfx->buflen);
@@ -405,6 +805,7 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   err = write_final_chunk (cfx, a);
 
  leave:
+  release_pool (cfx);
   xfree (cfx->buffer);
   cfx->buffer = NULL;
   gcry_cipher_close (cfx->cipher_hd);
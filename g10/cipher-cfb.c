@@ -135,9 +135,11 @@ cipher_filter_cfb (void *opaque, int control,
       log_assert (a);
       if (!cfx->wrote_header)
         write_header (cfx, a);
+      pipeline_unprotect ();
       if (cfx->mdc_hash)
         gcry_md_write (cfx->mdc_hash, buf, size);
       gcry_cipher_encrypt (cfx->cipher_hd, buf, size, NULL, 0);
+      pipeline_protect ();
       if (cfx->short_blklen_warn)
         {
           cfx->short_blklen_count += size;
@@ -150,7 +152,7 @@ cipher_filter_cfb (void *opaque, int control,
             }
         }
 
-      rc = iobuf_write (a, buf, size);
+      rc = iobuf_write_inplace (a, buf, size);
     }
   else if (control == IOBUFCTRL_FREE)
     {
@@ -73,7 +73,9 @@ do_compress(compress_filter_context_t *zfx, bz_stream *bzs, int flush, IOBUF a)
       if( DBG_FILTER )
 	log_debug("enter bzCompress: avail_in=%u, avail_out=%u, flush=%d\n",
 		  (unsigned)bzs->avail_in, (unsigned)bzs->avail_out, flush );
+      pipeline_unprotect ();
       zrc = BZ2_bzCompress( bzs, flush );
+      pipeline_protect ();
       if( zrc == BZ_STREAM_END && flush == BZ_FINISH )
 	;
       else if( zrc != BZ_RUN_OK && zrc != BZ_FINISH_OK )
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <npth.h>
 #ifdef HAVE_ZIP
 # include <zlib.h>
 # if defined(__riscos__) && defined(USE_ZLIBRISCOS)
@@ -57,6 +58,89 @@ int compress_filter_bz2( void *opaque, int control,
 			 IOBUF a, byte *buf, size_t *ret_len);
 
 #ifdef HAVE_ZIP
+
+/* The size of the blocks compressed by one thread with
+ * --compress-threads.  */
+#define COMPRESS_BLOCK_SIZE (128*1024)
+
+/* The maximum number of threads for --compress-threads.  */
+#define COMPRESS_MAX_THREADS 64
+
+/* The states of a compression job.  */
+enum compress_job_states
+  {
+    COMPRESS_JOB_FREE = 0,  /* Unused or being filled by the filter.  */
+    COMPRESS_JOB_PENDING,   /* Waiting for a worker.                  */
+    COMPRESS_JOB_BUSY,      /* A worker is compressing it.            */
+    COMPRESS_JOB_DONE       /* Compressed; waiting to be written.     */
+  };
+
+/* A job is a block of plaintext compressed as a part of the deflate
+ * stream.  It is primed with the tail of the previous block as
+ * dictionary and, unless it is the final block, ends with a sync
+ * flush so that the outputs of all jobs can be concatenated.  */
+struct compress_job_s
+{
+  enum compress_job_states state;
+  int final;
+
+  byte *inbuf;          /* COMPRESS_BLOCK_SIZE bytes.  */
+  size_t inlen;
+  byte *dict;           /* The dictionary of DICTLEN bytes.  */
+  size_t dictlen;
+  byte *outbuf;         /* OUTSIZE bytes.  */
+  size_t outsize;
+  size_t outlen;
+
+  uLong adler;          /* The Adler-32 of INBUF.  */
+  int zrc;              /* The zlib error of the worker or Z_OK.  */
+};
+
+/* The worker pool for --compress-threads.  The jobs form a ring which
+ * is filled and written out only by the filter.  */
+struct compress_pool_s
+{
+  npth_mutex_t lock;     /* Protects the fields below.  */
+  npth_cond_t cond;      /* Signaled on each job state change.  */
+  int shutdown;          /* Tell the workers to terminate.  */
+  int nthreads;          /* Number of started workers.  */
+  npth_t *threads;
+  int head;              /* Index of the oldest job not yet written.  */
+  int nqueued;           /* Number of jobs submitted but not written.  */
+  int njobs;
+
+  int level;             /* The compression level.  */
+  int wbits;             /* The window size as power of 2.  */
+  int zlib;              /* Write the zlib header and trailer.  */
+  int header_written;
+  uLong adler;           /* The Adler-32 of all written blocks.  */
+
+  /* The end of the last submitted block.  */
+  byte window[32768];
+  size_t windowlen;
+
+  struct compress_job_s jobs[1];
+};
+
+
+/* Return the compression level for zlib.  */
+static int
+get_compress_level (void)
+{
+    int level;
+
+    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
+	level = opt.compress_level;
+    else if( opt.compress_level == -1 )
+	level = Z_DEFAULT_COMPRESSION;
+    else {
+	log_error("invalid compression level; using default level\n");
+	level = Z_DEFAULT_COMPRESSION;
+    }
+    return level;
+}
+
+
 static void
 init_compress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -70,14 +154,7 @@ init_compress( compress_filter_context_t *zfx, z_stream *zs )
         zlib_initialized = riscos_load_module("ZLib", zlib_path, 1);
 #endif
 
-    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
-	level = opt.compress_level;
-    else if( opt.compress_level == -1 )
-	level = Z_DEFAULT_COMPRESSION;
-    else {
-	log_error("invalid compression level; using default level\n");
-	level = Z_DEFAULT_COMPRESSION;
-    }
+    level = get_compress_level ();
 
     if( (rc = zfx->algo == 1? deflateInit2( zs, level, Z_DEFLATED,
 					    -13, 8, Z_DEFAULT_STRATEGY)
@@ -106,7 +183,9 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
 	if( DBG_FILTER )
 	    log_debug("enter deflate: avail_in=%u, avail_out=%u, flush=%d\n",
 		    (unsigned)zs->avail_in, (unsigned)zs->avail_out, flush );
+	pipeline_unprotect ();
 	zrc = deflate( zs, flush );
+	pipeline_protect ();
 	if( zrc == Z_STREAM_END && flush == Z_FINISH )
 	    ;
 	else if( zrc != Z_OK ) {
@@ -122,7 +201,7 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
 		(unsigned)zs->avail_in, (unsigned)zs->avail_out,
 					       (unsigned)n, zrc );
 
-	if( (rc=iobuf_write( a, zfx->outbuf, n )) ) {
+	if( (rc=iobuf_write_inplace( a, zfx->outbuf, n )) ) {
 	    log_debug("deflate: iobuf_write failed\n");
 	    return rc;
 	}
@@ -130,6 +209,363 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+/* Compress the block of JOB.  This is run by a worker without
+ * holding the nPth lock and may thus only access JOB.  */
+static int
+compress_block (struct compress_pool_s *pool, struct compress_job_s *job)
+{
+  z_stream zs;
+  int zrc;
+
+  memset (&zs, 0, sizeof zs);
+  zrc = deflateInit2 (&zs, pool->level, Z_DEFLATED, -pool->wbits,
+                      8, Z_DEFAULT_STRATEGY);
+  if (zrc != Z_OK)
+    return zrc;
+  if (job->dictlen)
+    zrc = deflateSetDictionary (&zs, BYTEF_CAST (job->dict), job->dictlen);
+  if (zrc == Z_OK)
+    {
+      zs.next_in = BYTEF_CAST (job->inbuf);
+      zs.avail_in = job->inlen;
+      zs.next_out = BYTEF_CAST (job->outbuf);
+      zs.avail_out = job->outsize;
+      zrc = deflate (&zs, job->final? Z_FINISH : Z_SYNC_FLUSH);
+      if (job->final)
+        zrc = zrc == Z_STREAM_END? Z_OK : Z_BUF_ERROR;
+      else if (zrc == Z_OK && (zs.avail_in || !zs.avail_out))
+        zrc = Z_BUF_ERROR;  /* OUTSIZE was too small.  */
+      job->outlen = job->outsize - zs.avail_out;
+    }
+  deflateEnd (&zs);
+
+  job->adler = adler32 (adler32 (0L, Z_NULL, 0),
+                        BYTEF_CAST (job->inbuf), job->inlen);
+  return zrc;
+}
+
+
+/* The worker thread for --compress-threads.  */
+static void *
+compress_worker (void *arg)
+{
+  struct compress_pool_s *pool = arg;
+  struct compress_job_s *job;
+  int i;
+
+  npth_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      /* Take the oldest pending job.  */
+      job = NULL;
+      for (i = 0; i < pool->nqueued && !job; i++)
+        {
+          job = pool->jobs + (pool->head + i) % pool->njobs;
+          if (job->state != COMPRESS_JOB_PENDING)
+            job = NULL;
+        }
+      if (!job)
+        {
+          if (pool->shutdown)
+            break;
+          npth_cond_wait (&pool->cond, &pool->lock);
+          continue;
+        }
+      job->state = COMPRESS_JOB_BUSY;
+      npth_mutex_unlock (&pool->lock);
+
+      npth_unprotect ();
+      job->zrc = compress_block (pool, job);
+      npth_protect ();
+
+      npth_mutex_lock (&pool->lock);
+      job->state = COMPRESS_JOB_DONE;
+      npth_cond_broadcast (&pool->cond);
+    }
+  npth_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+
+/* Stop the workers of POOL and release it.  */
+static void
+release_compress_pool (struct compress_pool_s *pool)
+{
+  int i;
+
+  if (!pool)
+    return;
+
+  npth_mutex_lock (&pool->lock);
+  pool->shutdown = 1;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+  for (i = 0; i < pool->nthreads; i++)
+    npth_join (pool->threads[i], NULL);
+  xfree (pool->threads);
+
+  for (i = 0; i < pool->njobs; i++)
+    {
+      xfree (pool->jobs[i].inbuf);
+      xfree (pool->jobs[i].dict);
+      xfree (pool->jobs[i].outbuf);
+    }
+  wipememory (pool->window, sizeof pool->window);
+  npth_cond_destroy (&pool->cond);
+  npth_mutex_destroy (&pool->lock);
+  xfree (pool);
+}
+
+
+/* Create a worker pool for --compress-threads.  Returns NULL on
+ * error.  */
+static struct compress_pool_s *
+create_compress_pool (compress_filter_context_t *zfx)
+{
+  struct compress_pool_s *pool;
+  npth_attr_t tattr;
+  int njobs, i, rc;
+
+  njobs = (opt.compress_threads > COMPRESS_MAX_THREADS?
+           COMPRESS_MAX_THREADS : opt.compress_threads) + 1;
+  pool = xtrycalloc (1, sizeof *pool + (njobs - 1) * sizeof *pool->jobs);
+  if (!pool)
+    goto leave;
+  pool->njobs = njobs;
+  pool->level = get_compress_level ();
+  /* See init_compress for the window sizes.  */
+  pool->zlib = zfx->algo != COMPRESS_ALGO_ZIP;
+  pool->wbits = pool->zlib? MAX_WBITS : 13;
+  pool->adler = adler32 (0L, Z_NULL, 0);
+  npth_mutex_init (&pool->lock, NULL);
+  npth_cond_init (&pool->cond, NULL);
+
+  for (i = 0; i < njobs; i++)
+    {
+      struct compress_job_s *job = pool->jobs + i;
+
+      job->outsize = compressBound (COMPRESS_BLOCK_SIZE) + 16;
+      job->inbuf = xtrymalloc (COMPRESS_BLOCK_SIZE);
+      job->dict = xtrymalloc (sizeof pool->window);
+      job->outbuf = xtrymalloc (job->outsize);
+      if (!job->inbuf || !job->dict || !job->outbuf)
+        goto leave;
+    }
+
+  pool->threads = xtrycalloc (njobs - 1, sizeof *pool->threads);
+  if (!pool->threads)
+    goto leave;
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      gpg_err_set_errno (rc);
+      goto leave;
+    }
+  for (i = 0; i < njobs - 1; i++)
+    {
+      rc = npth_create (&pool->threads[i], &tattr, compress_worker, pool);
+      if (rc)
+        {
+          gpg_err_set_errno (rc);
+          npth_attr_destroy (&tattr);
+          goto leave;
+        }
+      pool->nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER)
+    log_debug ("compress: using %d threads\n", pool->nthreads);
+  return pool;
+
+ leave:
+  log_info ("error creating compression threads: %s - using one thread\n",
+            gpg_strerror (gpg_error_from_syserror ()));
+  release_compress_pool (pool);
+  return NULL;
+}
+
+
+/* Write the oldest job of POOL to A.  If WAIT is not set and the job
+ * has not yet been compressed nothing is done and -1 is returned.  */
+static int
+write_compress_job (struct compress_pool_s *pool, IOBUF a, int wait)
+{
+  struct compress_job_s *job;
+  byte header[2];
+  int rc;
+
+  log_assert (pool->nqueued);
+  job = pool->jobs + pool->head;
+
+  npth_mutex_lock (&pool->lock);
+  while (job->state != COMPRESS_JOB_DONE)
+    {
+      if (!wait)
+        {
+          npth_mutex_unlock (&pool->lock);
+          return -1;
+        }
+      npth_cond_wait (&pool->cond, &pool->lock);
+    }
+  pool->head = (pool->head + 1) % pool->njobs;
+  pool->nqueued--;
+  npth_mutex_unlock (&pool->lock);
+
+  if (job->zrc != Z_OK)
+    log_fatal ("zlib deflate problem: rc=%d\n", job->zrc);
+
+  if (pool->zlib && !pool->header_written)
+    {
+      /* This is the header deflateInit would have written.  */
+      unsigned int hdr, level_flags;
+
+      if (pool->level == Z_DEFAULT_COMPRESSION || pool->level == 6)
+        level_flags = 2;
+      else if (pool->level < 2)
+        level_flags = 0;
+      else if (pool->level < 6)
+        level_flags = 1;
+      else
+        level_flags = 3;
+      hdr = ((Z_DEFLATED + ((pool->wbits - 8) << 4)) << 8) | (level_flags << 6);
+      hdr += 31 - (hdr % 31);
+      header[0] = hdr >> 8;
+      header[1] = hdr;
+      if ((rc = iobuf_write (a, header, 2)))
+        return rc;
+    }
+  pool->header_written = 1;
+
+  rc = iobuf_write_inplace (a, job->outbuf, job->outlen);
+  if (rc)
+    return rc;
+  pool->adler = adler32_combine (pool->adler, job->adler, job->inlen);
+
+  if (pool->zlib && job->final)
+    {
+      byte trailer[4];
+
+      trailer[0] = pool->adler >> 24;
+      trailer[1] = pool->adler >> 16;
+      trailer[2] = pool->adler >>  8;
+      trailer[3] = pool->adler;
+      if ((rc = iobuf_write (a, trailer, 4)))
+        return rc;
+    }
+
+  job->inlen = 0;
+  job->state = COMPRESS_JOB_FREE;
+  return 0;
+}
+
+
+/* Submit the job currently being filled.  */
+static int
+submit_compress_job (struct compress_pool_s *pool, IOBUF a, int final)
+{
+  struct compress_job_s *job;
+  size_t n;
+  int rc;
+
+  job = pool->jobs + (pool->head + pool->nqueued) % pool->njobs;
+  job->final = final;
+
+  /* Prime the block with the end of the previous block and remember
+   * the end of this block for the next.  */
+  job->dictlen = pool->windowlen;
+  memcpy (job->dict, pool->window, pool->windowlen);
+  n = (size_t)1 << pool->wbits;
+  if (n > sizeof pool->window)
+    n = sizeof pool->window;
+  if (job->inlen >= n)
+    {
+      memcpy (pool->window, job->inbuf + job->inlen - n, n);
+      pool->windowlen = n;
+    }
+  else if (job->inlen)
+    {
+      size_t keep = n - job->inlen;
+
+      if (keep > pool->windowlen)
+        keep = pool->windowlen;
+      memmove (pool->window, pool->window + pool->windowlen - keep, keep);
+      memcpy (pool->window + keep, job->inbuf, job->inlen);
+      pool->windowlen = keep + job->inlen;
+    }
+
+  npth_mutex_lock (&pool->lock);
+  job->zrc = Z_OK;
+  job->state = COMPRESS_JOB_PENDING;
+  pool->nqueued++;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+
+  /* Write out what is ready.  */
+  while (pool->nqueued)
+    {
+      rc = write_compress_job (pool, a, 0);
+      if (rc == -1)
+        break;
+      if (rc)
+        return rc;
+    }
+  return 0;
+}
+
+
+/* The flush function of the compress filter for --compress-threads.
+ * If FINISH is set the rest of the data is compressed and the stream
+ * is terminated.  */
+static int
+do_compress_threaded (struct compress_pool_s *pool, const byte *buf,
+                      size_t size, int finish, IOBUF a)
+{
+  struct compress_job_s *job;
+  size_t n;
+  int rc;
+
+  while (size || finish)
+    {
+      if (pool->nqueued == pool->njobs)
+        {
+          rc = write_compress_job (pool, a, 1);
+          if (rc)
+            return rc;
+        }
+      job = pool->jobs + (pool->head + pool->nqueued) % pool->njobs;
+
+      n = COMPRESS_BLOCK_SIZE - job->inlen;
+      if (n > size)
+        n = size;
+      memcpy (job->inbuf + job->inlen, buf, n);
+      job->inlen += n;
+      buf += n;
+      size -= n;
+
+      if (!size && finish)
+        {
+          rc = submit_compress_job (pool, a, 1);
+          if (rc)
+            return rc;
+          while (pool->nqueued)
+            if ((rc = write_compress_job (pool, a, 1)))
+              return rc;
+          break;
+        }
+      if (job->inlen == COMPRESS_BLOCK_SIZE)
+        {
+          rc = submit_compress_job (pool, a, 0);
+          if (rc)
+            return rc;
+        }
+    }
+
+  return 0;
+}
+
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -258,14 +694,23 @@ compress_filter( void *opaque, int control,
 	    pkt.pkt.compressed = &cd;
 	    if( build_packet( a, &pkt ))
 		log_bug("build_packet(PKT_COMPRESSED) failed\n");
-	    zs = zfx->opaque = xmalloc_clear( sizeof *zs );
-	    init_compress( zfx, zs );
-	    zfx->status = 2;
+	    if (opt.compress_threads > 0
+                && (zfx->opaque = create_compress_pool (zfx)))
+	      zfx->status = 3;
+	    else {
+	      zs = zfx->opaque = xmalloc_clear( sizeof *zs );
+	      init_compress( zfx, zs );
+	      zfx->status = 2;
+	    }
 	}
 
-	zs->next_in = BYTEF_CAST (buf);
-	zs->avail_in = size;
-	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	if (zfx->status == 3)
+	  rc = do_compress_threaded (zfx->opaque, buf, size, 0, a);
+	else {
+	  zs->next_in = BYTEF_CAST (buf);
+	  zs->avail_in = size;
+	  rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	}
     }
     else if( control == IOBUFCTRL_FREE ) {
 	if( zfx->status == 1 ) {
@@ -283,6 +728,11 @@ compress_filter( void *opaque, int control,
 	    zfx->opaque = NULL;
 	    xfree(zfx->outbuf); zfx->outbuf = NULL;
 	}
+	else if( zfx->status == 3 ) {
+	    rc = do_compress_threaded (zfx->opaque, NULL, 0, 1, a);
+	    release_compress_pool (zfx->opaque);
+	    zfx->opaque = NULL;
+	}
         if (zfx->release)
           zfx->release (zfx);
     }
@@ -357,15 +807,25 @@ push_compress_filter2(IOBUF out,compress_filter_context_t *zfx,
 #ifdef HAVE_ZIP
     case COMPRESS_ALGO_ZIP:
     case COMPRESS_ALGO_ZLIB:
-      iobuf_push_filter2(out,compress_filter,zfx,rel);
-      err = 0;
+      if (opt.pipeline)
+        err = push_pipeline_filter (out, compress_filter, zfx, rel);
+      else
+        {
+          iobuf_push_filter2(out,compress_filter,zfx,rel);
+          err = 0;
+        }
       break;
 #endif
 
 #ifdef HAVE_BZIP2
     case COMPRESS_ALGO_BZIP2:
-      iobuf_push_filter2(out,compress_filter_bz2,zfx,rel);
-      err = 0;
+      if (opt.pipeline)
+        err = push_pipeline_filter (out, compress_filter_bz2, zfx, rel);
+      else
+        {
+          iobuf_push_filter2(out,compress_filter_bz2,zfx,rel);
+          err = 0;
+        }
       break;
 #endif
 
@@ -141,6 +141,27 @@ write_status ( int no )
 }
 
 
+/* Write the string S to the status stream with CRs and LFs C-style
+ * escaped.  Runs of other characters are written with one call.  */
+static void
+write_status_escaped (const char *s)
+{
+  size_t n;
+
+  for (;;)
+    {
+      n = strcspn (s, "\r\n");
+      if (n)
+        es_write (statusfp, s, n, NULL);
+      s += n;
+      if (!*s)
+        break;
+      es_fputs (*s == '\n'? "\\n" : "\\r", statusfp);
+      s++;
+    }
+}
+
+
 /* Write a status line with code NO followed by the string TEXT and
  * directly followed by the remaining strings up to a NULL.  Embedded
  * CR and LFs in the strings (but not in TEXT) are C-style escaped.*/
@@ -161,17 +182,7 @@ write_status_strings (int no, const char *text, ...)
       va_start (arg_ptr, text);
       s = text;
       do
-        {
-          for (; *s; s++)
-            {
-              if (*s == '\n')
-                es_fputs ("\\n", statusfp);
-              else if (*s == '\r')
-                es_fputs ("\\r", statusfp);
-              else
-                es_fputc (*(const byte *)s, statusfp);
-            }
-        }
+        write_status_escaped (s);
       while ((s = va_arg (arg_ptr, const char*)));
       va_end (arg_ptr);
     }
@@ -211,21 +222,7 @@ write_status_printf (int no, const char *format, ...)
                    gpg_strerror (gpg_err_code_from_syserror ()));
       else
         {
-          if (strpbrk (buf, "\r\n"))
-            {
-              const byte *s;
-              for (s=buf; *s; s++)
-                {
-                  if (*s == '\n')
-                    es_fputs ("\\n", statusfp);
-                  else if (*s == '\r')
-                    es_fputs ("\\r", statusfp);
-                  else
-                    es_fputc (*s, statusfp);
-                }
-            }
-          else
-            es_fputs (buf, statusfp);
+          write_status_escaped (buf);
           gpgrt_free (buf);
         }
 
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -39,6 +40,69 @@ static int mdc_decode_filter ( void *opaque, int control, IOBUF a,
 static int decode_filter ( void *opaque, int control, IOBUF a,
 					byte *buf, size_t *ret_len);
 
+
+/* The states of a parallel decryption job.  */
+enum aead_job_states
+  {
+    AEAD_JOB_FREE = 0,  /* Unused.                                */
+    AEAD_JOB_PENDING,   /* Waiting for a worker.                  */
+    AEAD_JOB_BUSY,      /* A worker is decrypting it.             */
+    AEAD_JOB_DONE       /* Decrypted; waiting to be returned.     */
+  };
+
+/* A job is a complete chunk with its tag read ahead for decryption
+ * and authentication by a worker thread.  */
+struct aead_job_s
+{
+  enum aead_job_states state;
+
+  /* Each job has its own cipher handle with the nonce and the
+   * additional data already set.  */
+  gcry_cipher_hd_t cipher_hd;
+
+  /* The chunk followed by its tag; allocated on first use with
+   * CHUNKSIZE+32 bytes (see aead_read_job).  */
+  byte *buffer;
+  size_t datalen;      /* Length of the chunk.               */
+  size_t pos;          /* Number of bytes already returned.  */
+
+  unsigned int chunk : 1;  /* The job has a data chunk.         */
+  unsigned int final : 1;  /* The job is the last one.          */
+  unsigned int valid : 1;  /* The tags have been checked.       */
+
+  /* The final tag if FINAL is set.  */
+  byte finaltag[16];
+
+  /* The error of the worker.  */
+  gpg_error_t err;
+};
+
+/* The worker pool used with --aead-threads.  The jobs form a ring
+ * which is filled and returned only by the filter; thus the chunks
+ * are returned in their original order and only after the tag has
+ * been checked.  */
+struct aead_pool_s
+{
+  npth_mutex_t lock;     /* Protects the fields below.  */
+  npth_cond_t cond;      /* Signaled on each job state change.  */
+  int shutdown;          /* Tell the workers to terminate.  */
+  int nthreads;          /* Number of started workers.  */
+  npth_t *threads;
+  int head;              /* Index of the oldest job not yet returned.  */
+  int nqueued;           /* Number of jobs read but not returned.  */
+  int njobs;
+
+  unsigned int eof : 1;  /* The last job has been read.    */
+  unsigned int done : 1; /* All jobs have been returned.   */
+
+  /* Bytes read ahead for the next job.  */
+  byte carry[16];
+  size_t carrylen;
+
+  struct aead_job_s jobs[1];
+};
+
+
 /* Our context object.  */
 struct decode_filter_context_s
 {
@@ -94,10 +158,16 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* The worker pool for --aead-threads or NULL.  */
+  struct aead_pool_s *pool;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
 
+static void aead_release_pool (decode_filter_ctx_t dfx);
+
+
 /* Helper to release the decode context.  */
 static void
 release_dfx_context (decode_filter_ctx_t dfx)
@@ -108,6 +178,7 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      aead_release_pool (dfx);
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -117,12 +188,13 @@ release_dfx_context (decode_filter_ctx_t dfx)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  This
- * also reset the decryption machinery * so that the handle can be
- * used for a new chunk.  If FINAL is set the final AEAD chunk is
- * processed.  */
+/* Set the nonce and the additional data for the current chunk on the
+ * cipher handle HD.  This also reset the decryption machinery * so
+ * that the handle can be used for a new chunk.  If FINAL is set the
+ * final AEAD chunk is processed.  */
 static gpg_error_t
-aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+aead_set_nonce_and_ad_hd (decode_filter_ctx_t dfx, gcry_cipher_hd_t hd,
+                          int final)
 {
   gpg_error_t err;
   unsigned char ad[21];
@@ -155,7 +227,7 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
 
   if (DBG_CRYPTO)
     log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -185,7 +257,15 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Same as aead_set_nonce_and_ad_hd for the context's cipher handle.  */
+static gpg_error_t
+aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+{
+  return aead_set_nonce_and_ad_hd (dfx, dfx->cipher_hd, final);
 }
 
 
@@ -211,6 +291,184 @@ aead_checktag (decode_filter_ctx_t dfx, int final, const void *tagbuf)
 }
 
 
+/* The worker thread for parallel decryption.  */
+static void *
+aead_worker (void *arg)
+{
+  struct aead_pool_s *pool = arg;
+  struct aead_job_s *job;
+  int i;
+
+  npth_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      /* Take the oldest pending job.  */
+      job = NULL;
+      for (i = 0; i < pool->nqueued && !job; i++)
+        {
+          job = pool->jobs + (pool->head + i) % pool->njobs;
+          if (job->state != AEAD_JOB_PENDING)
+            job = NULL;
+        }
+      if (!job)
+        {
+          if (pool->shutdown)
+            break;
+          npth_cond_wait (&pool->cond, &pool->lock);
+          continue;
+        }
+      job->state = AEAD_JOB_BUSY;
+      npth_mutex_unlock (&pool->lock);
+
+      /* The cipher handle is owned by this job and thus we can run
+       * this in parallel to other threads.  */
+      npth_unprotect ();
+      gcry_cipher_final (job->cipher_hd);
+      job->err = gcry_cipher_decrypt (job->cipher_hd,
+                                      job->buffer, job->datalen, NULL, 0);
+      if (!job->err)
+        job->err = gcry_cipher_checktag (job->cipher_hd,
+                                         job->buffer + job->datalen, 16);
+      npth_protect ();
+
+      npth_mutex_lock (&pool->lock);
+      job->state = AEAD_JOB_DONE;
+      npth_cond_broadcast (&pool->cond);
+    }
+  npth_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+
+/* Stop the workers of the pool and release it.  */
+static void
+aead_release_pool (decode_filter_ctx_t dfx)
+{
+  struct aead_pool_s *pool = dfx->pool;
+  int i;
+
+  if (!pool)
+    return;
+
+  npth_mutex_lock (&pool->lock);
+  pool->shutdown = 1;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+  for (i = 0; i < pool->nthreads; i++)
+    npth_join (pool->threads[i], NULL);
+  xfree (pool->threads);
+
+  for (i = 0; i < pool->njobs; i++)
+    {
+      gcry_cipher_close (pool->jobs[i].cipher_hd);
+      if (pool->jobs[i].buffer)
+        {
+          wipememory (pool->jobs[i].buffer, dfx->chunksize + 32);
+          xfree (pool->jobs[i].buffer);
+        }
+    }
+  npth_cond_destroy (&pool->cond);
+  npth_mutex_destroy (&pool->lock);
+  xfree (pool);
+  dfx->pool = NULL;
+}
+
+
+/* Create the worker pool for --aead-threads.  If the chunks are too
+ * large for parallel processing or no threads are requested
+ * DFX->POOL is left at NULL.  */
+static gpg_error_t
+aead_create_pool (decode_filter_ctx_t dfx, enum gcry_cipher_modes ciphermode,
+                  DEK *dek)
+{
+  gpg_error_t err;
+  struct aead_pool_s *pool;
+  npth_attr_t tattr;
+  int njobs, i, rc;
+
+  if (opt.aead_threads < 1)
+    return 0;
+
+  /* We use one job more than threads so that we can return a chunk
+   * while all threads are busy.  */
+  njobs = (opt.aead_threads > AEAD_MAX_THREADS? AEAD_MAX_THREADS
+           /* */                                : opt.aead_threads) + 1;
+  if (dfx->chunksize > AEAD_MAX_PARALLEL_MEM)
+    njobs = 0;
+  else if (njobs > AEAD_MAX_PARALLEL_MEM / dfx->chunksize)
+    njobs = AEAD_MAX_PARALLEL_MEM / dfx->chunksize;
+  if (njobs < 2)
+    {
+      log_info ("chunk size too large for --aead-threads - ignored\n");
+      return 0;
+    }
+
+  pool = xtrycalloc (1, sizeof *pool + (njobs - 1) * sizeof *pool->jobs);
+  if (!pool)
+    return gpg_error_from_syserror ();
+  pool->njobs = njobs;
+  pool->threads = xtrycalloc (njobs - 1, sizeof *pool->threads);
+  if (!pool->threads)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (pool);
+      return err;
+    }
+  npth_mutex_init (&pool->lock, NULL);
+  npth_cond_init (&pool->cond, NULL);
+  dfx->pool = pool;
+
+  for (i = 0; i < njobs; i++)
+    {
+      err = openpgp_cipher_open (&pool->jobs[i].cipher_hd,
+                                 dfx->cipher_algo, ciphermode,
+                                 GCRY_CIPHER_SECURE);
+      if (!err)
+        {
+          err = gcry_cipher_setkey (pool->jobs[i].cipher_hd,
+                                    dek->key, dek->keylen);
+          if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+            err = 0;  /* Already warned.  */
+        }
+      if (err)
+        goto leave;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  for (i = 0; i < njobs - 1; i++)
+    {
+      rc = npth_create (&pool->threads[i], &tattr, aead_worker, pool);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          npth_attr_destroy (&tattr);
+          goto leave;
+        }
+      pool->nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER)
+    log_debug ("aead: using %d threads and %d jobs\n",
+               pool->nthreads, pool->njobs);
+
+ leave:
+  if (err)
+    {
+      log_error ("error creating AEAD worker threads: %s\n",
+                 gpg_strerror (err));
+      aead_release_pool (dfx);
+    }
+  return err;
+}
+
+
 /****************
  * Decrypt the data, specified by ED with the key DEK.
  */
@@ -368,6 +626,9 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
           goto leave;
         }
 
+      rc = aead_create_pool (dfx, ciphermode, dek);
+      if (rc)
+        goto leave;
     }
   else /* CFB encryption.  */
     {
@@ -842,6 +1103,195 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 }
 
 
+/* Read the next job of the pool from stream A and hand it over to
+ * the workers.  To detect the last chunk we read 16 bytes more than
+ * a chunk and its tag; these bytes are carried over to the next
+ * job.  */
+static gpg_error_t
+aead_read_job (decode_filter_ctx_t dfx, iobuf_t a)
+{
+  struct aead_pool_s *pool = dfx->pool;
+  struct aead_job_s *job;
+  gpg_error_t err;
+  size_t len;
+
+  log_assert (!pool->eof && pool->nqueued < pool->njobs);
+  job = pool->jobs + (pool->head + pool->nqueued) % pool->njobs;
+  if (!job->buffer)
+    {
+      job->buffer = xtrymalloc (dfx->chunksize + 32);
+      if (!job->buffer)
+        return gpg_error_from_syserror ();
+    }
+
+  memcpy (job->buffer, pool->carry, pool->carrylen);
+  len = fill_buffer (dfx, a, job->buffer, dfx->chunksize + 32,
+                     pool->carrylen);
+  pool->carrylen = 0;
+  job->pos = 0;
+  job->chunk = 1;
+  job->final = 0;
+  job->valid = 0;
+
+  if (!dfx->eof_seen)
+    {
+      job->datalen = dfx->chunksize;
+      pool->carrylen = 16;
+      memcpy (pool->carry, job->buffer + dfx->chunksize + 16, 16);
+    }
+  else
+    {
+      /* The buffer ends with the last chunk's tag and the final tag.
+       * Like aead_underflow we take a lone 32 byte rest after a
+       * complete chunk as the final tag followed by garbage.  */
+      pool->eof = 1;
+      job->final = 1;
+      if (len == 16 || len == 32)
+        {
+          job->chunk = 0;
+          job->datalen = 0;
+          memcpy (job->finaltag, job->buffer, 16);
+        }
+      else if (len < 32)
+        return gpg_error (GPG_ERR_TRUNCATED);
+      else
+        {
+          job->datalen = len - 32;
+          memcpy (job->finaltag, job->buffer + len - 16, 16);
+        }
+    }
+
+  if (DBG_FILTER)
+    log_debug ("aead: read chunk %ju (%zu bytes)%s\n",
+               dfx->chunkindex, job->datalen, job->final? " final":"");
+
+  if (job->chunk)
+    {
+      err = aead_set_nonce_and_ad_hd (dfx, job->cipher_hd, 0);
+      if (err)
+        return err;
+      dfx->chunkindex++;
+      dfx->total += job->datalen;
+    }
+
+  npth_mutex_lock (&pool->lock);
+  job->err = 0;
+  job->state = job->chunk? AEAD_JOB_PENDING : AEAD_JOB_DONE;
+  pool->nqueued++;
+  npth_cond_broadcast (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+
+  return 0;
+}
+
+
+/* The underflow function of the aead_decode_filter for
+ * --aead-threads.  Plaintext is only returned after the tag of its
+ * chunk (and for the last chunk also the final tag) has been
+ * checked.  */
+static gpg_error_t
+aead_underflow_parallel (decode_filter_ctx_t dfx, iobuf_t a,
+                         byte *buf, size_t *ret_len)
+{
+  struct aead_pool_s *pool = dfx->pool;
+  const size_t size = *ret_len; /* The allocated size of BUF.  */
+  gpg_error_t err = 0;
+  size_t totallen = 0; /* The number of bytes to return.  */
+  struct aead_job_s *job;
+  size_t n;
+
+  while (totallen < size)
+    {
+      /* Keep the workers busy.  */
+      while (!pool->eof && pool->nqueued < pool->njobs)
+        {
+          err = aead_read_job (dfx, a);
+          if (err)
+            goto leave;
+        }
+      if (!pool->nqueued)
+        {
+          pool->done = 1;
+          err = gpg_error (GPG_ERR_EOF);
+          break;
+        }
+
+      job = pool->jobs + pool->head;
+      npth_mutex_lock (&pool->lock);
+      while (job->state != AEAD_JOB_DONE)
+        npth_cond_wait (&pool->cond, &pool->lock);
+      npth_mutex_unlock (&pool->lock);
+
+      if (!job->valid)
+        {
+          if (job->err)
+            {
+              err = job->err;
+              log_error ("gcry_cipher_checktag failed: %s\n",
+                         gpg_strerror (err));
+              goto leave;
+            }
+          if (job->final)
+            {
+              /* Check the final chunk before we return the last
+               * chunk.  DFX->TOTAL is final because all chunks have
+               * been read.  */
+              err = aead_set_nonce_and_ad (dfx, 1);
+              if (err)
+                goto leave;
+              gcry_cipher_final (dfx->cipher_hd);
+              /* Decrypt an empty string (using BUF as a dummy).  */
+              err = gcry_cipher_decrypt (dfx->cipher_hd, buf, 0, NULL, 0);
+              if (err)
+                {
+                  log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                             gpg_strerror (err));
+                  goto leave;
+                }
+              err = aead_checktag (dfx, 1, job->finaltag);
+              if (err)
+                goto leave;
+            }
+          job->valid = 1;
+        }
+
+      n = job->datalen - job->pos;
+      if (n > size - totallen)
+        n = size - totallen;
+      memcpy (buf + totallen, job->buffer + job->pos, n);
+      job->pos += n;
+      totallen += n;
+
+      if (job->pos == job->datalen)
+        {
+          npth_mutex_lock (&pool->lock);
+          job->state = AEAD_JOB_FREE;
+          pool->head = (pool->head + 1) % pool->njobs;
+          pool->nqueued--;
+          npth_mutex_unlock (&pool->lock);
+        }
+    }
+
+ leave:
+  if (DBG_FILTER)
+    log_debug ("aead_underflow_parallel: returning %zu (%s)\n",
+               totallen, gpg_strerror (err));
+
+  /* See aead_underflow.  */
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    err = gpg_error (GPG_ERR_BAD_SIGNATURE);
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      memset (buf, 0, size);
+      totallen = 0;
+    }
+
+  *ret_len = totallen;
+
+  return err;
+}
+
+
 /* The IOBUF filter used to decrypt AEAD encrypted data.  */
 static int
 aead_decode_filter (void *opaque, int control, IOBUF a,
@@ -850,7 +1300,8 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW
+       && (dfx->pool? dfx->pool->done : dfx->eof_seen) )
     {
       *ret_len = 0;
       rc = -1;
@@ -859,7 +1310,10 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
     {
       log_assert (a);
 
-      rc = aead_underflow (dfx, a, buf, ret_len);
+      if (dfx->pool)
+        rc = aead_underflow_parallel (dfx, a, buf, ret_len);
+      else
+        rc = aead_underflow (dfx, a, buf, ret_len);
       if (gpg_err_code (rc) == GPG_ERR_EOF)
         rc = -1; /* We need to use the old convention in the filter.  */
 
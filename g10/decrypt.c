@@ -280,3 +280,114 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
   set_next_passphrase(NULL);
   release_progress_context (pfx);
 }
+
+
+/* Read a framed sequence of messages from stdin and decrypt or
+ * verify each of them.  A frame consists of the length of the message
+ * in decimal, a LF, and the message itself.  For each message an
+ * output frame in the same format with the plaintext is written to
+ * stdout; if processing failed "ERR <code>" and a LF is written
+ * instead and no plaintext is released.  The status lines of each
+ * message are enclosed in FILE_START and FILE_DONE.  In contrast to
+ * invoking gpg for each message the keydb, trustdb and agent
+ * connections are kept open for all messages.  */
+gpg_error_t
+decrypt_message_stream (ctrl_t ctrl)
+{
+  gpg_error_t err = 0;
+  char line[32];
+  char numbuf[20];
+  char *endp;
+  unsigned long msglen;
+  unsigned int msgno = 0;
+  char *buffer;
+  size_t nread;
+  void *plain;
+  size_t plainlen;
+  IOBUF fp;
+  armor_filter_context_t *afx;
+
+  if (opt.outfile || opt.outfp)
+    {
+      log_error(_("--output doesn't work for this command\n"));
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+
+  while (es_fgets (line, sizeof line, es_stdin))
+    {
+      msgno++;
+      if (!*line || line[strlen (line)-1] != '\n'
+          || !digitp (line)
+          || (errno = 0, msglen = strtoul (line, &endp, 10), errno)
+          || *endp != '\n')
+        {
+          log_error ("message %u: invalid frame header\n", msgno);
+          return gpg_error (GPG_ERR_INV_DATA);
+        }
+
+      buffer = xtrymalloc (msglen? msglen : 1);
+      if (!buffer)
+        return gpg_error_from_syserror ();
+      if (es_read (es_stdin, buffer, msglen, &nread) || nread != msglen)
+        {
+          err = gpg_error (GPG_ERR_EOF);
+          log_error ("message %u: truncated frame\n", msgno);
+          xfree (buffer);
+          return err;
+        }
+
+      snprintf (numbuf, sizeof numbuf, "%u", msgno);
+      print_file_status (STATUS_FILE_START, numbuf, 3);
+
+      fp = iobuf_temp_with_content (buffer, msglen);
+      wipememory (buffer, msglen);
+      xfree (buffer);
+      afx = NULL;
+      if (!opt.no_armor && use_armor_filter (fp))
+        {
+          afx = new_armor_context ();
+          push_armor_filter (afx, fp);
+        }
+
+      opt.outfp = es_fopenmem (0, "w+b");
+      if (!opt.outfp)
+        err = gpg_error_from_syserror ();
+      else
+        err = proc_packets (ctrl, NULL, fp);
+      iobuf_close (fp);
+      release_armor_context (afx);
+
+      plain = NULL;
+      plainlen = 0;
+      if (opt.outfp && es_fclose_snatch (opt.outfp, &plain, &plainlen)
+          && !err)
+        err = gpg_error_from_syserror ();
+      opt.outfp = NULL;
+
+      if (err)
+        {
+          log_error ("message %u: decryption failed: %s\n",
+                     msgno, gpg_strerror (err));
+          write_status_error ("batch-stream", err);
+          es_fprintf (es_stdout, "ERR %u\n", err);
+        }
+      else
+        {
+          es_fprintf (es_stdout, "%lu\n", (unsigned long)plainlen);
+          es_write (es_stdout, plain, plainlen, NULL);
+        }
+      if (plain)
+        wipememory (plain, plainlen);
+      es_free (plain);
+      es_fflush (es_stdout);
+
+      /* Note that we emit file_done even after an error. */
+      write_status (STATUS_FILE_DONE);
+      reset_literals_seen ();
+      err = 0;
+    }
+
+  if (es_ferror (es_stdin))
+    err = gpg_error_from_syserror ();
+  return err;
+}
@@ -306,13 +306,19 @@ do_delete_key (ctrl_t ctrl, const char *username, int secret, int force,
 
       /* Note that the ownertrust being cleared will trigger a
 	 revalidation_mark().  This makes sense - only deleting keys
-	 that have ownertrust set should trigger this. */
+	 that have ownertrust set should trigger this.  Otherwise
+	 only the keys certified by the deleted key need to be
+	 revalidated.  */
 
-      if (!secret && pk && !opt.dry_run && thiskeyonly != 2
-          && clear_ownertrusts (ctrl, pk))
+      if (!secret && pk && !opt.dry_run && thiskeyonly != 2)
         {
-          if (opt.verbose)
-            log_info (_("ownertrust information cleared\n"));
+          if (clear_ownertrusts (ctrl, pk))
+            {
+              if (opt.verbose)
+                log_info (_("ownertrust information cleared\n"));
+            }
+          else
+            revalidation_mark_key (ctrl, pk);
         }
     }
 
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "options.h"
@@ -49,6 +50,22 @@ static int write_pubkey_enc_from_list (ctrl_t ctrl,
  * Encrypt FILENAME with only the symmetric cipher.  Take input from
  * stdin if FILENAME is NULL.  If --force-aead is used we use an SKESK.
  */
+/* Push the cipher filter with context CFX onto OUT.  With --pipeline
+ * the filter runs on its own thread.  */
+static gpg_error_t
+push_cipher_filter (iobuf_t out, cipher_filter_context_t *cfx)
+{
+  int (*f) (void *opaque, int control,
+            iobuf_t chain, byte *buf, size_t *ret_len);
+
+  f = cfx->dek->use_aead? cipher_filter_aead : cipher_filter_cfb;
+  if (opt.pipeline)
+    return push_pipeline_filter (out, f, cfx, 0);
+  iobuf_push_filter (out, f, cfx);
+  return 0;
+}
+
+
 int
 encrypt_symmetric (const char *filename)
 {
@@ -478,13 +495,10 @@ encrypt_simple (const char *filename, int mode, int use_seskey)
 
   /* Register the cipher filter. */
   if (mode)
-    iobuf_push_filter (out,
-                       cfx.dek->use_aead? cipher_filter_aead
-                       /**/             : cipher_filter_cfb,
-                       &cfx );
+    rc = push_cipher_filter (out, &cfx);
 
   /* Register the compress filter. */
-  if ( do_compress )
+  if (!rc && do_compress)
     {
       if (cfx.dek && (cfx.dek->use_mdc || cfx.dek->use_aead))
         zfx.new_ctb = 1;
@@ -492,7 +506,9 @@ encrypt_simple (const char *filename, int mode, int use_seskey)
     }
 
   /* Do the work. */
-  if (!opt.no_literal)
+  if (rc)
+    ;
+  else if (!opt.no_literal)
     {
       if ( (rc = build_packet( out, &pkt )) )
         log_error("build_packet failed: %s\n", gpg_strerror (rc) );
@@ -883,10 +899,9 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
     cfx.datalen = filesize && !do_compress ? filesize : 0;
 
   /* Register the cipher filter. */
-  iobuf_push_filter (out,
-                     cfx.dek->use_aead? cipher_filter_aead
-                     /**/             : cipher_filter_cfb,
-                     &cfx);
+  rc = push_cipher_filter (out, &cfx);
+  if (rc)
+    goto leave;
 
   /* Register the compress filter. */
   if (do_compress)
@@ -1067,17 +1082,13 @@ encrypt_filter (void *opaque, int control,
 }
 
 
-/*
- * Write a pubkey-enc packet for the public key PK to OUT.
- */
-int
-write_pubkey_enc (ctrl_t ctrl,
-                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+/* Create a pubkey-enc packet for the public key PK and store the
+ * encoded session key to be encrypted at R_FRAME.  */
+static PKT_pubkey_enc *
+begin_pubkey_enc (PKT_public_key *pk, int throw_keyid, DEK *dek,
+                  gcry_mpi_t *r_frame)
 {
-  PACKET pkt;
   PKT_pubkey_enc *enc;
-  int rc;
-  gcry_mpi_t frame;
 
   print_pubkey_algo_note ( pk->pubkey_algo );
   enc = xmalloc_clear ( sizeof *enc );
@@ -1097,10 +1108,20 @@ write_pubkey_enc (ctrl_t ctrl,
    * for Elgamal).  We don't need frame anymore because we have
    * everything now in enc->data which is the passed to
    * build_packet().  */
-  frame = encode_session_key (pk->pubkey_algo, dek,
-                              pubkey_nbits (pk->pubkey_algo, pk->pkey));
-  rc = pk_encrypt (pk->pubkey_algo, enc->data, frame, pk, pk->pkey);
-  gcry_mpi_release (frame);
+  *r_frame = encode_session_key (pk->pubkey_algo, dek,
+                                 pubkey_nbits (pk->pubkey_algo, pk->pkey));
+  return enc;
+}
+
+
+/* Write the pubkey-enc packet ENC to OUT and release it.  RC is the
+ * result of the public key encryption.  */
+static int
+end_pubkey_enc (ctrl_t ctrl, PKT_pubkey_enc *enc, DEK *dek, int rc,
+                iobuf_t out)
+{
+  PACKET pkt;
+
   if (rc)
     log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (rc) );
   else
@@ -1131,11 +1152,131 @@ write_pubkey_enc (ctrl_t ctrl,
 
 
 /*
- * Write pubkey-enc packets from the list of PKs to OUT.
+ * Write a pubkey-enc packet for the public key PK to OUT.
+ */
+int
+write_pubkey_enc (ctrl_t ctrl,
+                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+{
+  PKT_pubkey_enc *enc;
+  gcry_mpi_t frame;
+  int rc;
+
+  enc = begin_pubkey_enc (pk, throw_keyid, dek, &frame);
+  rc = pk_encrypt (pk->pubkey_algo, enc->data, frame, pk, pk->pkey);
+  gcry_mpi_release (frame);
+  return end_pubkey_enc (ctrl, enc, dek, rc, out);
+}
+
+
+/* A public key encryption run by write_pubkey_enc_from_list on a
+ * worker thread.  */
+struct pubkey_enc_job_s
+{
+  PKT_public_key *pk;
+  PKT_pubkey_enc *enc;
+  gcry_mpi_t frame;
+  int rc;
+};
+
+/* The jobs of write_pubkey_enc_from_list.  */
+static struct
+{
+  struct pubkey_enc_job_s *jobs;
+  int njobs;
+  int next_job;       /* Index of the next job for a worker.  */
+  npth_mutex_t lock;  /* Protects NEXT_JOB.  */
+} pubkey_enc_pool;
+
+
+/* The worker thread for write_pubkey_enc_from_list.  */
+static void *
+pubkey_enc_worker (void *arg)
+{
+  struct pubkey_enc_job_s *job;
+
+  (void)arg;
+
+  for (;;)
+    {
+      npth_mutex_lock (&pubkey_enc_pool.lock);
+      job = NULL;
+      if (pubkey_enc_pool.next_job < pubkey_enc_pool.njobs)
+        job = pubkey_enc_pool.jobs + pubkey_enc_pool.next_job++;
+      npth_mutex_unlock (&pubkey_enc_pool.lock);
+      if (!job)
+        break;
+
+      /* The job only touches its own data; the fingerprint required
+       * for ECDH has already been computed.  */
+      npth_unprotect ();
+      job->rc = pk_encrypt (job->pk->pubkey_algo, job->enc->data,
+                            job->frame, job->pk, job->pk->pkey);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Run the public key encryptions of the NJOBS jobs at JOBS using up
+ * to NTHREADS threads.  */
+static void
+run_pubkey_enc_jobs (struct pubkey_enc_job_s *jobs, int njobs, int nthreads)
+{
+  npth_t threads[PUBKEY_ENC_MAX_THREADS];
+  npth_attr_t tattr;
+  int nstarted, i, rc;
+
+  if (nthreads > PUBKEY_ENC_MAX_THREADS)
+    nthreads = PUBKEY_ENC_MAX_THREADS;
+  if (nthreads > njobs)
+    nthreads = njobs;
+
+  npth_mutex_init (&pubkey_enc_pool.lock, NULL);
+  pubkey_enc_pool.jobs = jobs;
+  pubkey_enc_pool.njobs = njobs;
+  pubkey_enc_pool.next_job = 0;
+  nstarted = 0;
+  if (nthreads > 1 && !npth_attr_init (&tattr))
+    {
+      for (i = 0; i < nthreads; i++)
+        {
+          rc = npth_create (&threads[i], &tattr, pubkey_enc_worker, NULL);
+          if (rc)
+            {
+              log_error ("error spawning encryption thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  /* The main thread helps and also does all the work if no thread
+   * could be started.  */
+  pubkey_enc_worker (NULL);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&pubkey_enc_pool.lock);
+  pubkey_enc_pool.jobs = NULL;
+  pubkey_enc_pool.njobs = 0;
+}
+
+
+/*
+ * Write pubkey-enc packets from the list of PKs to OUT.  With
+ * --pubkey-enc-threads the public key operations are done in
+ * parallel; the packets are still written in the order of the list.
  */
 static int
 write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
 {
+  struct pubkey_enc_job_s *jobs;
+  PK_LIST pkl;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  int njobs, i, rc, rc2;
+
   if (opt.throw_keyids && (PGP7 || PGP8))
     {
       log_info(_("option '%s' may not be used in %s mode\n"),
@@ -1144,16 +1285,50 @@ write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
       compliance_failure();
     }
 
-  for ( ; pk_list; pk_list = pk_list->next )
+  for (njobs = 0, pkl = pk_list; pkl; pkl = pkl->next)
+    njobs++;
+
+  if (opt.pubkey_enc_threads < 2 || njobs < 2
+      || !(jobs = xtrycalloc (njobs, sizeof *jobs)))
     {
-      PKT_public_key *pk = pk_list->pk;
-      int throw_keyid = (opt.throw_keyids || (pk_list->flags&1));
-      int rc = write_pubkey_enc (ctrl, pk, throw_keyid, dek, out);
-      if (rc)
-        return rc;
+      for ( ; pk_list; pk_list = pk_list->next )
+        {
+          PKT_public_key *pk = pk_list->pk;
+          int throw_keyid = (opt.throw_keyids || (pk_list->flags&1));
+          rc = write_pubkey_enc (ctrl, pk, throw_keyid, dek, out);
+          if (rc)
+            return rc;
+        }
+      return 0;
     }
 
-  return 0;
+  for (i = 0, pkl = pk_list; pkl; i++, pkl = pkl->next)
+    {
+      jobs[i].pk = pkl->pk;
+      jobs[i].enc = begin_pubkey_enc (pkl->pk,
+                                      (opt.throw_keyids || (pkl->flags&1)),
+                                      dek, &jobs[i].frame);
+      /* Make sure the fingerprint is cached in PK.  */
+      fingerprint_from_pk (pkl->pk, fpr, NULL);
+    }
+
+  run_pubkey_enc_jobs (jobs, njobs, opt.pubkey_enc_threads);
+
+  rc = 0;
+  for (i = 0; i < njobs; i++)
+    {
+      gcry_mpi_release (jobs[i].frame);
+      if (rc)
+        free_pubkey_enc (jobs[i].enc);  /* Error - just release.  */
+      else
+        {
+          rc2 = end_pubkey_enc (ctrl, jobs[i].enc, dek, jobs[i].rc, out);
+          if (rc2)
+            rc = rc2;
+        }
+    }
+  xfree (jobs);
+  return rc;
 }
 
 void
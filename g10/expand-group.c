@@ -19,70 +19,262 @@
  */
 
 #include <config.h>
+#include <ctype.h>
 
 #include "gpg.h"
 #include "options.h"
 #include "keydb.h"
+#include "main.h"
+
+
+/* The number of buckets in the group index.  Must be a power of 2.  */
+#define GROUP_TABLE_SIZE 1024
+
+/* An index into OPT.GROUPLIST by the group name so that we don't
+ * need to scan the list for each recipient.  The items are chained
+ * via their HNEXT field.  The list itself is kept for --list-config
+ * and --no-groups.  */
+static struct groupitem *group_table[GROUP_TABLE_SIZE];
+
+
+/* Return the bucket of the group NAME.  Group names are compared
+ * using strcasecmp and thus we need to fold the case here the same
+ * way.  */
+static unsigned int
+group_hash (const char *name)
+{
+  const unsigned char *s = (const unsigned char *)name;
+  unsigned int hash = 0;
+
+  for (; *s; s++)
+    hash = hash * 31 + tolower (*s);
+  return hash & (GROUP_TABLE_SIZE - 1);
+}
+
+
+/* Return the group with NAME or NULL if there is no such group.  */
+struct groupitem *
+find_group (const char *name)
+{
+  struct groupitem *item;
+
+  for (item = group_table[group_hash (name)]; item; item = item->hnext)
+    /* need strcasecmp() here, as this should be localized */
+    if (!strcasecmp (item->name, name))
+      return item;
+  return NULL;
+}
+
+
+/* Return the group with NAME.  If it does not yet exist a new empty
+ * group is created; NAME must then stay valid for the lifetime of
+ * the process.  */
+struct groupitem *
+new_group (char *name)
+{
+  struct groupitem *item;
+  unsigned int hash;
+
+  item = find_group (name);
+  if (item)
+    return item;
+
+  hash = group_hash (name);
+  item = xmalloc (sizeof *item);
+  item->name = name;
+  item->values = NULL;
+  item->next = opt.grouplist;
+  opt.grouplist = item;
+  item->hnext = group_table[hash];
+  group_table[hash] = item;
+  return item;
+}
+
+
+/* Remove the group NAME.  */
+void
+remove_group (const char *name)
+{
+  struct groupitem *item, **itemp;
+
+  for (itemp = &group_table[group_hash (name)]; (item = *itemp);
+       itemp = &item->hnext)
+    if (!strcasecmp (item->name, name))
+      break;
+  if (!item)
+    return;
+  *itemp = item->hnext;
+
+  for (itemp = &opt.grouplist; *itemp != item; itemp = &(*itemp)->next)
+    ;
+  *itemp = item->next;
+
+  free_strlist (item->values);
+  xfree (item);
+}
+
+
+/* Remove all groups.  */
+void
+release_groups (void)
+{
+  struct groupitem *item;
+
+  while ((item = opt.grouplist))
+    {
+      opt.grouplist = item->next;
+      free_strlist (item->values);
+      xfree (item);
+    }
+  memset (group_table, 0, sizeof group_table);
+}
+
 
 int
 expand_id (const char *id, strlist_t *into, unsigned int flags)
 {
-  struct groupitem *groups;
-  int count=0;
+  struct groupitem *group;
+  strlist_t each, sl;
+  int count = 0;
 
-  for (groups = opt.grouplist; groups; groups=groups->next)
+  group = find_group (id);
+  if (group)
     {
-      /* need strcasecmp() here, as this should be localized */
-      if (strcasecmp (groups->name,id) == 0)
-	 {
-	   strlist_t each,sl;
-
-	   /* This maintains the current utf8-ness */
-	   for (each = groups->values; each; each=each->next)
-	     {
-	       sl = add_to_strlist (into, each->d);
-	       sl->flags = flags;
-	       count++;
-	     }
-
-	   break;
-	 }
+      /* This maintains the current utf8-ness */
+      for (each = group->values; each; each=each->next)
+        {
+          sl = add_to_strlist (into, each->d);
+          sl->flags = flags;
+          count++;
+        }
     }
 
   return count;
 }
 
+
+/* A set of the items already put into the output of expand_group.
+ * This is an open addressing hash table with SIZE slots, USED of
+ * them are in use.  */
+struct seen_set_s
+{
+  size_t size;
+  size_t used;
+  strlist_t *slots;
+  int disabled;  /* Set after an allocation failure.  */
+};
+
+
+static size_t
+seen_hash (strlist_t sl)
+{
+  const unsigned char *s = (const unsigned char *)sl->d;
+  size_t hash = sl->flags;
+
+  for (; *s; s++)
+    hash = hash * 31 + *s;
+  return hash;
+}
+
+
+/* Insert the item SL into SEEN.  Returns true if an item with the
+ * same string and flags is already in SEEN.  If we run out of core
+ * SEEN stops tracking items and we return false from then on; this
+ * merely keeps the duplicates.  */
+static int
+seen_set_insert (struct seen_set_s *seen, strlist_t sl)
+{
+  size_t idx, i;
+
+  if (seen->disabled)
+    return 0;
+
+  if (seen->used * 2 >= seen->size)
+    {
+      struct seen_set_s tmp;
+
+      tmp.size = seen->size? seen->size * 2 : 64;
+      tmp.used = 0;
+      tmp.disabled = 0;
+      tmp.slots = xtrycalloc (tmp.size, sizeof *tmp.slots);
+      if (!tmp.slots)
+        {
+          xfree (seen->slots);
+          seen->slots = NULL;
+          seen->disabled = 1;
+          return 0;
+        }
+      for (i = 0; i < seen->size; i++)
+        if (seen->slots[i])
+          seen_set_insert (&tmp, seen->slots[i]);
+      xfree (seen->slots);
+      *seen = tmp;
+    }
+
+  for (idx = seen_hash (sl) & (seen->size - 1); seen->slots[idx];
+       idx = (idx + 1) & (seen->size - 1))
+    if (seen->slots[idx]->flags == sl->flags
+        && !strcmp (seen->slots[idx]->d, sl->d))
+      return 1;
+  seen->slots[idx] = sl;
+  seen->used++;
+  return 0;
+}
+
+
+/* Prepend STRING with FLAGS to OUTPUT unless it is already there.  */
+static void
+add_unique (strlist_t *output, struct seen_set_s *seen,
+            const char *string, unsigned int flags)
+{
+  strlist_t sl;
+
+  sl = add_to_strlist (output, string);
+  sl->flags = flags;
+  if (seen_set_insert (seen, sl))
+    {
+      *output = sl->next;
+      sl->next = NULL;
+      free_strlist (sl);
+    }
+}
+
+
 /* For simplicity, and to avoid potential loops, we only expand once -
  * you can't make an alias that points to an alias.  If PREPEND_INPUT
  * is true each item from INPUT is prepended to the new list; if it is
  * false the original item from INPUT is only added if no group
- * existed for it. */
+ * existed for it.  Members of several of the given groups are only
+ * put once into the new list.  */
 strlist_t
 expand_group (strlist_t input, int prepend_input)
 {
+  struct seen_set_s seen = { 0 };
   strlist_t output = NULL;
-  strlist_t sl, rover;
+  strlist_t rover, each;
+  struct groupitem *group;
 
   for (rover = input; rover; rover = rover->next)
     {
       if ((rover->flags & PK_LIST_FROM_FILE))
         continue;
-      if (!expand_id (rover->d, &output, rover->flags))
+      group = find_group (rover->d);
+      if (group && group->values)
+        {
+          /* This maintains the current utf8-ness */
+          for (each = group->values; each; each = each->next)
+            add_unique (&output, &seen, each->d, rover->flags);
+        }
+      else if (!prepend_input)
         {
           /* Didn't find any groups, so use the existing string unless
            * we will anyway add it due to the prepend flag.  */
-          if (!prepend_input)
-            {
-              sl = add_to_strlist (&output, rover->d);
-              sl->flags = rover->flags;
-            }
+          add_unique (&output, &seen, rover->d, rover->flags);
         }
       if (prepend_input)
-        {
-          sl = add_to_strlist (&output, rover->d);
-          sl->flags = rover->flags;
-        }
+        add_unique (&output, &seen, rover->d, rover->flags);
     }
 
+  xfree (seen.slots);
   return output;
 }
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "options.h"
@@ -62,6 +63,35 @@ struct export_stats_s
 };
 
 
+/* The number of keyblocks exported together with option "parallel".  */
+#define EXPORT_PARALLEL_BATCH 64
+
+/* A keyblock serialized by a worker thread.  */
+struct export_job_s
+{
+  kbnode_t keyblock;
+  u32 keyid[2];
+  size_t descindex;
+  iobuf_t out;                  /* Memory stream for the packets.  */
+  gpg_error_t err;
+  int any;
+  struct export_stats_s stats;
+};
+
+/* A batch of keyblocks exported with option "parallel".  */
+struct export_batch_s
+{
+  npth_mutex_t lock;
+  ctrl_t ctrl;
+  unsigned int options;
+  KEYDB_SEARCH_DESC *desc;
+  size_t ndesc;
+  int njobs;
+  int next;                     /* Index of the next job for a worker.  */
+  struct export_job_s jobs[EXPORT_PARALLEL_BATCH];
+};
+
+
 /* A global variable to store the selector created from
  * --export-filter keep-uid=EXPR.
  * --export-filter drop-subkey=EXPR.
@@ -75,7 +105,7 @@ static recsel_expr_t export_drop_subkey;
 
 
 /* Local prototypes.  */
-static int do_export (ctrl_t ctrl, strlist_t users, int secret,
+static int do_export (ctrl_t ctrl, int out_fd, strlist_t users, int secret,
                       unsigned int options, export_stats_t stats);
 static int do_export_stream (ctrl_t ctrl, iobuf_t out,
                              strlist_t users, int secret,
@@ -120,6 +150,9 @@ parse_export_options(char *str,unsigned int *options,int noisy)
       {"export-pka", EXPORT_PKA_FORMAT, NULL, NULL },
       {"export-dane", EXPORT_DANE_FORMAT, NULL, NULL },
 
+      {"parallel", EXPORT_PARALLEL, NULL,
+       N_("use several threads to export many keys")},
+
       {"backup", EXPORT_BACKUP, NULL,
        N_("use the GnuPG key backup format")},
       {"export-backup", EXPORT_BACKUP, NULL, NULL },
@@ -250,7 +283,51 @@ int
 export_pubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                 export_stats_t stats)
 {
-  return do_export (ctrl, users, 0, options, stats);
+  return do_export (ctrl, -1, users, 0, options, stats);
+}
+
+
+/* Same as export_pubkeys but write to the file descriptor OUT_FD,
+ * which is not closed.  This is used by the server mode.  */
+int
+export_pubkeys_fd (ctrl_t ctrl, int out_fd, strlist_t users,
+                   unsigned int options, export_stats_t stats)
+{
+  return do_export (ctrl, out_fd, users, 0, options, stats);
+}
+
+
+/* Same as export_pubkeys but write to the stream OUT_FP, which is not
+ * closed.  The output is armored if ARMOR is set; opt.armor is not
+ * used.  This is used by the server mode.  */
+int
+export_pubkeys_stream (ctrl_t ctrl, estream_t out_fp, strlist_t users,
+                       int armor, unsigned int options,
+                       export_stats_t stats)
+{
+  iobuf_t out;
+  int any, rc;
+  armor_filter_context_t *afx = NULL;
+
+  out = iobuf_esopen (out_fp, "w", 1, 0);
+  if (!out)
+    return gpg_error_from_syserror ();
+
+  if (armor && !(options & (EXPORT_PKA_FORMAT|EXPORT_DANE_FORMAT)))
+    {
+      afx = new_armor_context ();
+      afx->what = 1;
+      push_armor_filter (afx, out);
+    }
+
+  rc = do_export_stream (ctrl, out, users, 0, NULL, options, stats, &any);
+
+  if (rc || !any)
+    iobuf_cancel (out);
+  else
+    iobuf_close (out);
+  release_armor_context (afx);
+  return rc;
 }
 
 
@@ -267,7 +344,7 @@ int
 export_seckeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                 export_stats_t stats)
 {
-  return do_export (ctrl, users, 1, options, stats);
+  return do_export (ctrl, -1, users, 1, options, stats);
 }
 
 
@@ -286,7 +363,7 @@ int
 export_secsubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                    export_stats_t stats)
 {
-  return do_export (ctrl, users, 2, options, stats);
+  return do_export (ctrl, -1, users, 2, options, stats);
 }
 
 
@@ -350,10 +427,11 @@ export_pubkey_buffer (ctrl_t ctrl, const char *keyspec, unsigned int options,
    Secret is false public keys will be exported.  With secret true
    secret keys will be exported; in this case 1 means the entire
    secret keyblock and 2 only the subkeys.  OPTIONS are the export
-   options to apply.  */
+   options to apply.  If OUT_FD is not -1 the output is written to
+   that file descriptor instead of stdout or the --output file.  */
 static int
-do_export (ctrl_t ctrl, strlist_t users, int secret, unsigned int options,
-           export_stats_t stats)
+do_export (ctrl_t ctrl, int out_fd, strlist_t users, int secret,
+           unsigned int options, export_stats_t stats)
 {
   IOBUF out = NULL;
   int any, rc;
@@ -362,7 +440,7 @@ do_export (ctrl_t ctrl, strlist_t users, int secret, unsigned int options,
 
   memset( &zfx, 0, sizeof zfx);
 
-  rc = open_outfile (-1, NULL, 0, !!secret, &out );
+  rc = open_outfile (out_fd, NULL, 0, !!secret, &out );
   if (rc)
     return rc;
 
@@ -1823,7 +1901,10 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
           if (!err && node->pkt->pkttype == PKT_PUBLIC_KEY)
             {
               stats->exported++;
-              print_status_exported (node->pkt->pkt.public_key);
+              /* With option "parallel" we run on a worker thread and
+               * the status is printed by flush_export_batch.  */
+              if (!(options & EXPORT_PARALLEL))
+                print_status_exported (node->pkt->pkt.public_key);
             }
         }
 
@@ -1847,6 +1928,268 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
 }
 
 
+/* Clean KEYBLOCK and apply the export filters as requested by
+ * OPTIONS.  */
+static void
+clean_and_filter_keyblock (ctrl_t ctrl, kbnode_t *keyblock,
+                           unsigned int options)
+{
+  /* Always do the cleaning on the public key part if requested.
+   * A designated revocation is never stripped, even with
+   * export-minimal set.  */
+  if ((options & EXPORT_CLEAN))
+    {
+      merge_keys_and_selfsig (ctrl, *keyblock);
+      clean_all_uids (ctrl, *keyblock, opt.verbose,
+                      (options&EXPORT_MINIMAL), NULL, NULL);
+      clean_all_subkeys (ctrl, *keyblock, opt.verbose,
+                         (options&EXPORT_MINIMAL)? KEY_CLEAN_ALL
+                         /**/                    : KEY_CLEAN_AUTHENCR,
+                         NULL, NULL);
+      commit_kbnode (keyblock);
+    }
+
+  if (export_keep_uid)
+    {
+      commit_kbnode (keyblock);
+      apply_keep_uid_filter (ctrl, *keyblock, export_keep_uid);
+      commit_kbnode (keyblock);
+    }
+
+  if (export_drop_subkey)
+    {
+      commit_kbnode (keyblock);
+      apply_drop_subkey_filter (ctrl, *keyblock, export_drop_subkey);
+      commit_kbnode (keyblock);
+    }
+}
+
+
+/* Return true if the stored images of keyblocks can be exported
+ * without parsing them.  This is the case if no export filter would
+ * remove anything but ring trust and comment packets.  */
+static int
+raw_export_possible (int secret, unsigned int options,
+                     KEYDB_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t i;
+
+  if (secret || export_keep_uid || export_drop_subkey)
+    return 0;
+  if ((options & (EXPORT_CLEAN | EXPORT_DROP_UIDS
+                  | EXPORT_PKA_FORMAT | EXPORT_DANE_FORMAT)))
+    return 0;
+  if ((options & (EXPORT_LOCAL_SIGS | EXPORT_ATTRIBUTES
+                  | EXPORT_SENSITIVE_REVKEYS))
+      != (EXPORT_LOCAL_SIGS | EXPORT_ATTRIBUTES | EXPORT_SENSITIVE_REVKEYS))
+    return 0;
+  for (i = 0; i < ndesc; i++)
+    if (desc[i].exact)
+      return 0;
+  return 1;
+}
+
+
+/* Write the stored keyblock IMAGE to OUT.  Comment packets and, if
+ * not doing a backup, ring trust packets are skipped.  Nothing is
+ * written if IMAGE is not a valid keyblock.  */
+static gpg_error_t
+export_keyblock_image (iobuf_t image, iobuf_t out, unsigned int options,
+                       export_stats_t stats, int *any)
+{
+  gpg_error_t err;
+  const byte *buf = iobuf_get_temp_buffer (image);
+  size_t len = iobuf_get_temp_length (image);
+  size_t off, n, firstlen;
+  int pkttype;
+  iobuf_t inp;
+  struct parse_packet_ctx_s parsectx;
+  PACKET pkt;
+
+  /* Make sure that we can walk the entire image.  */
+  firstlen = 0;
+  for (off = 0; off < len; off += n)
+    {
+      n = packet_length_from_header (buf + off, len - off, &pkttype);
+      if (!n || n > len - off || (!off && pkttype != PKT_PUBLIC_KEY))
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      if (!off)
+        firstlen = n;
+    }
+  if (!firstlen)
+    return gpg_error (GPG_ERR_INV_KEYRING);
+
+  for (off = 0; off < len; off += n)
+    {
+      n = packet_length_from_header (buf + off, len - off, &pkttype);
+      if (pkttype == PKT_COMMENT || pkttype == PKT_OLD_COMMENT
+          || (pkttype == PKT_RING_TRUST && !(options & EXPORT_BACKUP)))
+        continue;
+      err = iobuf_write (out, buf + off, n);
+      if (err)
+        {
+          log_error ("error writing keyblock: %s\n", gpg_strerror (err));
+          return err;
+        }
+    }
+  stats->exported++;
+  *any = 1;
+
+  /* For the status line we need to parse the primary key.  */
+  if (is_status_enabled ())
+    {
+      inp = iobuf_temp_with_content (buf, firstlen);
+      init_parse_packet (&parsectx, inp);
+      init_packet (&pkt);
+      if (!parse_packet (&parsectx, &pkt) && pkt.pkttype == PKT_PUBLIC_KEY)
+        print_status_exported (pkt.pkt.public_key);
+      free_packet (&pkt, &parsectx);
+      deinit_parse_packet (&parsectx);
+      iobuf_close (inp);
+    }
+
+  return 0;
+}
+
+
+/* Check the signatures of the keyblocks in BATCH as needed for
+ * export-clean using the threads configured by --sig-check-threads.
+ * The results are stored in the cache flags of the signatures and
+ * thus found there by the cleaning functions.  */
+static void
+precheck_export_batch (struct export_batch_s *batch)
+{
+  kbnode_t node;
+  int i;
+
+  sig_check_defer_begin ();
+  for (i = 0; i < batch->njobs; i++)
+    for (node = batch->jobs[i].keyblock->next; node; node = node->next)
+      if (node->pkt->pkttype == PKT_SIGNATURE
+          && !node->pkt->pkt.signature->flags.checked)
+        check_key_signature (batch->ctrl, batch->jobs[i].keyblock,
+                             node, NULL);
+  sig_check_defer_end (opt.sig_check_threads);
+}
+
+
+/* The worker thread for flush_export_batch.  */
+static void *
+export_batch_worker (void *arg)
+{
+  struct export_batch_s *batch = arg;
+  struct export_job_s *job;
+
+  for (;;)
+    {
+      npth_mutex_lock (&batch->lock);
+      job = batch->next < batch->njobs? batch->jobs + batch->next++ : NULL;
+      npth_mutex_unlock (&batch->lock);
+      if (!job)
+        break;
+
+      /* Exporting a public keyblock only builds packets from the
+       * keyblock into the memory stream which are both owned by the
+       * job.  */
+      npth_unprotect ();
+      job->err = do_export_one_keyblock (batch->ctrl, job->keyblock,
+                                         job->keyid, job->out, 0,
+                                         batch->options, &job->stats,
+                                         &job->any, batch->desc,
+                                         batch->ndesc, job->descindex, NULL);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Clean and serialize the keyblocks of BATCH in parallel and write
+ * them to OUT in the order they were added.  */
+static gpg_error_t
+flush_export_batch (struct export_batch_s *batch, iobuf_t out,
+                    export_stats_t stats, int *any)
+{
+  gpg_error_t err = 0;
+  struct export_job_s *job;
+  npth_t threads[SIG_CHECK_MAX_THREADS];
+  npth_attr_t tattr;
+  int nthreads, nstarted, i, rc;
+
+  if (!batch->njobs)
+    return 0;
+
+  if ((batch->options & EXPORT_CLEAN)
+      && opt.sig_check_threads > 0 && !opt.no_sig_cache)
+    precheck_export_batch (batch);
+  for (i = 0; i < batch->njobs; i++)
+    {
+      clean_and_filter_keyblock (batch->ctrl, &batch->jobs[i].keyblock,
+                                 batch->options);
+      batch->jobs[i].out = iobuf_temp ();
+    }
+
+  nthreads = opt.sig_check_threads;
+  if (nthreads > SIG_CHECK_MAX_THREADS)
+    nthreads = SIG_CHECK_MAX_THREADS;
+  if (nthreads > batch->njobs)
+    nthreads = batch->njobs;
+
+  npth_mutex_init (&batch->lock, NULL);
+  batch->next = 0;
+  nstarted = 0;
+  if (nthreads > 1 && !npth_attr_init (&tattr))
+    {
+      /* The main thread is the first worker.  */
+      for (i = 1; i < nthreads; i++)
+        {
+          rc = npth_create (&threads[nstarted], &tattr,
+                            export_batch_worker, batch);
+          if (rc)
+            {
+              log_error ("error spawning export thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  export_batch_worker (batch);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&batch->lock);
+
+  for (i = 0; i < batch->njobs; i++)
+    {
+      job = batch->jobs + i;
+      if (!err)
+        err = job->err;
+      if (!err)
+        {
+          iobuf_flush_temp (job->out);
+          err = iobuf_write (out, iobuf_get_temp_buffer (job->out),
+                             iobuf_get_temp_length (job->out));
+          if (err)
+            log_error ("error writing keyblock: %s\n", gpg_strerror (err));
+        }
+      if (!err && job->stats.exported)
+        {
+          stats->exported += job->stats.exported;
+          print_status_exported (job->keyblock->pkt->pkt.public_key);
+        }
+      if (!err && job->any)
+        *any = 1;
+      iobuf_close (job->out);
+      release_kbnode (job->keyblock);
+      memset (job, 0, sizeof *job);
+    }
+  batch->njobs = 0;
+
+  return err;
+}
+
+
 /* Export the keys identified by the list of strings in USERS to the
    stream OUT.  If SECRET is false public keys will be exported.  With
    secret true secret keys will be exported; in this case 1 means the
@@ -1872,6 +2215,10 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
   gcry_cipher_hd_t cipherhd = NULL;
   struct export_stats_s dummystats;
   iobuf_t out_help = NULL;
+  struct export_batch_s *batch = NULL;
+  struct export_job_s *job;
+  int raw = 0;
+  int i;
 
   if (!stats)
     stats = &dummystats;
@@ -1921,6 +2268,24 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
          this we need an extra flag to enable this feature.  */
     }
 
+  /* Option "parallel" is only used for public keys written to OUT.  */
+  if (secret || keyblock_out || out_help)
+    options &= ~EXPORT_PARALLEL;
+  if ((options & EXPORT_PARALLEL))
+    {
+      batch = xtrycalloc (1, sizeof *batch);
+      if (!batch)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      batch->ctrl = ctrl;
+      batch->options = options;
+      batch->desc = desc;
+      batch->ndesc = ndesc;
+      raw = raw_export_possible (secret, options, desc, ndesc);
+    }
+
 #ifdef ENABLE_SELINUX_HACKS
   if (secret)
     {
@@ -1969,6 +2334,38 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
       if (err)
         break;
 
+      /* Copy the stored image if possible.  */
+      if (raw)
+        {
+          iobuf_t image;
+
+          err = keydb_get_keyblock_image (kdbhd, &image);
+          if (!err)
+            {
+              stats->count++;
+              err = flush_export_batch (batch, out, stats, any);
+              if (!err)
+                {
+                  err = export_keyblock_image (image, out, options,
+                                               stats, any);
+                  if (gpg_err_code (err) == GPG_ERR_INV_KEYRING)
+                    log_error (_("error reading keyblock: %s\n"),
+                               gpg_strerror (err));
+                }
+              iobuf_close (image);
+              if (err)
+                goto leave;
+              continue;
+            }
+          if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+            {
+              log_error (_("error reading keyblock: %s\n"),
+                         gpg_strerror (err));
+              goto leave;
+            }
+          /* No image available - parse the keyblock.  */
+        }
+
       /* Read the keyblock. */
       release_kbnode (keyblock);
       keyblock = NULL;
@@ -2018,34 +2415,26 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
           stats->secret_count++;
         }
 
-      /* Always do the cleaning on the public key part if requested.
-       * A designated revocation is never stripped, even with
-       * export-minimal set.  */
-      if ((options & EXPORT_CLEAN))
+      /* With option "parallel" the keyblock is cleaned, filtered and
+       * written together with the other keyblocks of a batch.  */
+      if (batch)
         {
-          merge_keys_and_selfsig (ctrl, keyblock);
-          clean_all_uids (ctrl, keyblock, opt.verbose,
-                          (options&EXPORT_MINIMAL), NULL, NULL);
-          clean_all_subkeys (ctrl, keyblock, opt.verbose,
-                             (options&EXPORT_MINIMAL)? KEY_CLEAN_ALL
-                             /**/                    : KEY_CLEAN_AUTHENCR,
-                             NULL, NULL);
-          commit_kbnode (&keyblock);
-        }
-
-      if (export_keep_uid)
-        {
-          commit_kbnode (&keyblock);
-          apply_keep_uid_filter (ctrl, keyblock, export_keep_uid);
-          commit_kbnode (&keyblock);
+          job = batch->jobs + batch->njobs++;
+          job->keyblock = keyblock;
+          keyblock = NULL;
+          job->keyid[0] = keyid[0];
+          job->keyid[1] = keyid[1];
+          job->descindex = descindex;
+          if (batch->njobs == EXPORT_PARALLEL_BATCH)
+            {
+              err = flush_export_batch (batch, out, stats, any);
+              if (err)
+                break;
+            }
+          continue;
         }
 
-      if (export_drop_subkey)
-        {
-          commit_kbnode (&keyblock);
-          apply_drop_subkey_filter (ctrl, keyblock, export_drop_subkey);
-          commit_kbnode (&keyblock);
-        }
+      clean_and_filter_keyblock (ctrl, &keyblock, options);
 
       /* And write it. */
       err = do_export_one_keyblock (ctrl, keyblock, keyid,
@@ -2086,8 +2475,16 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
     }
   if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
     err = 0;
+  if (!err && batch)
+    err = flush_export_batch (batch, out, stats, any);
 
  leave:
+  if (batch)
+    {
+      for (i = 0; i < batch->njobs; i++)
+        release_kbnode (batch->jobs[i].keyblock);
+      xfree (batch);
+    }
   iobuf_cancel (out_help);
   gcry_cipher_close (cipherhd);
   xfree(desc);
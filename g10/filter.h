@@ -73,7 +73,7 @@ typedef struct {
 
 struct compress_filter_context_s {
     int status;
-    void *opaque;   /* (used for z_stream) */
+    void *opaque;   /* (used for z_stream or the thread pool) */
     byte *inbuf;
     unsigned inbufsize;
     byte *outbuf;
@@ -86,6 +86,13 @@ struct compress_filter_context_s {
 typedef struct compress_filter_context_s compress_filter_context_t;
 
 
+/* The maximum number of bytes buffered for parallel AEAD processing.
+ * This limits the number of jobs for large chunks.  */
+#define AEAD_MAX_PARALLEL_MEM (1024*1024*1024)
+
+/* The maximum number of worker threads for --aead-threads.  */
+#define AEAD_MAX_THREADS 64
+
 typedef struct
 {
   /* Object with the key and algo */
@@ -132,6 +139,9 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* The worker pool for --aead-threads or NULL.  */
+  struct aead_pool_s *pool;
+
 } cipher_filter_context_t;
 
 
@@ -177,6 +187,15 @@ gpg_error_t push_compress_filter (iobuf_t out, compress_filter_context_t *zfx,
 gpg_error_t push_compress_filter2 (iobuf_t out,compress_filter_context_t *zfx,
                                    int algo, int rel);
 
+/*-- pipeline.c --*/
+gpg_error_t push_pipeline_filter (iobuf_t a,
+                                  int (*f) (void *opaque, int control,
+                                            iobuf_t chain, byte *buf,
+                                            size_t *len),
+                                  void *ov, int rel_ov);
+void pipeline_unprotect (void);
+void pipeline_protect (void);
+
 /*-- cipher.c --*/
 int cipher_filter_cfb (void *opaque, int control,
                        iobuf_t chain, byte *buf, size_t *ret_len);
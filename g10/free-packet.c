@@ -25,6 +25,7 @@
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/init.h"
 #include "packet.h"
 #include "../common/iobuf.h"
 #include "options.h"
@@ -44,6 +45,132 @@ my_mpi_copy (gcry_mpi_t a)
 }
 
 
+/* Released PACKET, PKT_signature and PKT_public_key objects are kept
+ * in pools for reuse because loading large keyblocks is otherwise
+ * dominated by malloc and free.  The pools are not thread-safe; a
+ * parser running on a worker thread must set the no_pool flag of its
+ * context.  */
+#define PACKET_POOL_MAX 4096
+
+struct pool_item_s
+{
+  struct pool_item_s *next;
+};
+
+struct packet_pool_s
+{
+  struct pool_item_s *items;
+  unsigned int count;
+};
+
+static struct packet_pool_s packet_pool;
+static struct packet_pool_s signature_pool;
+static struct packet_pool_s public_key_pool;
+static int pool_cleanup_registered;
+
+
+static void
+release_pool (struct packet_pool_s *pool)
+{
+  struct pool_item_s *item;
+
+  while ((item = pool->items))
+    {
+      pool->items = item->next;
+      xfree (item);
+    }
+  pool->count = 0;
+}
+
+
+static void
+release_packet_pools (void)
+{
+  release_pool (&packet_pool);
+  release_pool (&signature_pool);
+  release_pool (&public_key_pool);
+}
+
+
+/* Return a cleared object of SIZE bytes from POOL or NULL with ERRNO
+ * set on error.  */
+static void *
+pool_get (struct packet_pool_s *pool, size_t size)
+{
+  struct pool_item_s *item;
+
+  item = pool->items;
+  if (!item)
+    return xtrycalloc (1, size);
+  pool->items = item->next;
+  pool->count--;
+  memset (item, 0, size);
+  return item;
+}
+
+
+/* Put the object P back into POOL.  */
+static void
+pool_put (struct packet_pool_s *pool, void *p)
+{
+  struct pool_item_s *item = p;
+
+  if (!item)
+    return;
+  if (pool->count >= PACKET_POOL_MAX)
+    {
+      xfree (item);
+      return;
+    }
+  if (!pool_cleanup_registered)
+    {
+      pool_cleanup_registered = 1;
+      register_mem_cleanup_func (release_packet_pools);
+    }
+  item->next = pool->items;
+  pool->items = item;
+  pool->count++;
+}
+
+
+/* Return a new cleared PACKET or NULL with ERRNO set on error.
+ * Release it with release_packet_struct.  */
+PACKET *
+alloc_packet (void)
+{
+  return pool_get (&packet_pool, sizeof (PACKET));
+}
+
+
+/* Release the PACKET structure PKT but not the packet it carries;
+ * use free_packet for the latter.  Passing NULL is allowed.  */
+void
+release_packet_struct (PACKET *pkt)
+{
+  pool_put (&packet_pool, pkt);
+}
+
+
+/* Return a new cleared signature or NULL with ERRNO set on error.  */
+PKT_signature *
+alloc_signature (int no_pool)
+{
+  if (no_pool)
+    return xtrycalloc (1, sizeof (PKT_signature));
+  return pool_get (&signature_pool, sizeof (PKT_signature));
+}
+
+
+/* Return a new cleared public key or NULL with ERRNO set on error.  */
+PKT_public_key *
+alloc_public_key (int no_pool)
+{
+  if (no_pool)
+    return xtrycalloc (1, sizeof (PKT_public_key));
+  return pool_get (&public_key_pool, sizeof (PKT_public_key));
+}
+
+
 void
 free_symkey_enc( PKT_symkey_enc *enc )
 {
@@ -72,6 +199,7 @@ free_seckey_enc( PKT_signature *sig )
     mpi_release(sig->data[0]);
   for(i=0; i < n; i++ )
     mpi_release( sig->data[i] );
+  xfree (sig->rawdata);
 
   xfree(sig->revkey);
   xfree(sig->hashed);
@@ -84,7 +212,7 @@ free_seckey_enc( PKT_signature *sig )
     }
   xfree (sig->signers_uid);
 
-  xfree(sig);
+  pool_put (&signature_pool, sig);
 }
 
 
@@ -104,6 +232,7 @@ release_public_key_parts (PKT_public_key *pk)
       mpi_release (pk->pkey[i]);
       pk->pkey[i] = NULL;
     }
+  pk->flags.keygrip_valid = 0;
   if (pk->seckey_info)
     {
       xfree (pk->seckey_info);
@@ -143,7 +272,7 @@ free_public_key (PKT_public_key *pk)
   if (pk)
     {
       release_public_key_parts (pk);
-      xfree(pk);
+      pool_put (&public_key_pool, pk);
     }
 }
 
@@ -264,6 +393,11 @@ copy_signature( PKT_signature *d, PKT_signature *s )
 	for(i=0; i < n; i++ )
 	    d->data[i] = my_mpi_copy( s->data[i] );
     }
+    if (s->rawdata)
+      {
+        d->rawdata = xmalloc (s->rawdatalen);
+        memcpy (d->rawdata, s->rawdata, s->rawdatalen);
+      }
     d->pka_info = s->pka_info? cp_pka_info (s->pka_info) : NULL;
     d->hashed = cp_subpktarea (s->hashed);
     d->unhashed = cp_subpktarea (s->unhashed);
@@ -291,6 +425,37 @@ scopy_user_id (PKT_user_id *s)
 }
 
 
+/* Return a deep copy of the user ID or attribute S.  */
+PKT_user_id *
+copy_user_id (PKT_user_id *s)
+{
+  PKT_user_id *d;
+
+  d = xmalloc (sizeof *d + s->len);
+  memcpy (d, s, sizeof *d + s->len);
+  d->ref = 1;
+  d->attribs = NULL;
+  d->numattribs = 0;
+  if (s->attrib_data)
+    {
+      d->attrib_data = xmalloc (s->attrib_len);
+      memcpy (d->attrib_data, s->attrib_data, s->attrib_len);
+      parse_attribute_subpkts (d);
+    }
+  if (s->namehash)
+    {
+      d->namehash = xmalloc (20);
+      memcpy (d->namehash, s->namehash, 20);
+    }
+  d->prefs = copy_prefs (s->prefs);
+  if (s->updateurl)
+    d->updateurl = xstrdup (s->updateurl);
+  if (s->mbox)
+    d->mbox = xstrdup (s->mbox);
+  return d;
+}
+
+
 
 void
 free_comment( PKT_comment *rem )
@@ -532,6 +697,15 @@ cmp_signatures( PKT_signature *a, PKT_signature *b )
     n = pubkey_get_nsig( a->pubkey_algo );
     if( !n )
 	return -1; /* can't compare due to unknown algorithm */
+    if (a->rawdata && b->rawdata)
+      {
+        if (a->rawdatalen != b->rawdatalen
+            || memcmp (a->rawdata, b->rawdata, a->rawdatalen))
+          return -1;
+        return 0;
+      }
+    if (sig_decode_data (a) || sig_decode_data (b))
+      return -1;
     for(i=0; i < n; i++ ) {
 	if( mpi_cmp( a->data[i] , b->data[i] ) )
 	    return -1;
@@ -36,18 +36,12 @@
 #include "../common/i18n.h"
 #include "keyserver-internal.h"
 #include "call-agent.h"
+#include "call-dirmngr.h"
 #include "objcache.h"
 #include "../common/host2net.h"
 #include "../common/mbox-util.h"
 #include "../common/status.h"
 
-#define MAX_PK_CACHE_ENTRIES   PK_UID_CACHE_SIZE
-#define MAX_UID_CACHE_ENTRIES  PK_UID_CACHE_SIZE
-
-#if MAX_PK_CACHE_ENTRIES < 2
-#error We need the cache for key creation
-#endif
-
 /* Flags values returned by the lookup code.  Note that the values are
  * directly used by the KEY_CONSIDERED status line.  */
 #define LOOKUP_NOT_SELECTED        (1<<0)
@@ -119,23 +113,12 @@ typedef struct keyid_list
 } *keyid_list_t;
 
 
-#if MAX_PK_CACHE_ENTRIES
-typedef struct pk_cache_entry
-{
-  struct pk_cache_entry *next;
-  u32 keyid[2];
-  PKT_public_key *pk;
-} *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
-static int pk_cache_entries;	/* Number of entries in pk cache.  */
+/* Set if the public key cache has been disabled.  */
 static int pk_cache_disabled;
-#endif
-
-#if MAX_UID_CACHE_ENTRIES < 5
-#error we really need the userid cache
-#endif
 
 static void merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock);
+static void merge_selfsigs_cached (ctrl_t ctrl, KEYDB_HANDLE hd,
+                                   kbnode_t *keyblock);
 static int lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
 		   kbnode_t *ret_keyblock, kbnode_t *ret_found_key);
 static kbnode_t finish_lookup (kbnode_t keyblock,
@@ -173,14 +156,11 @@ print_stats ()
  * instance.
  *
  * This cache is filled by get_pubkey and is read by get_pubkey and
- * get_pubkey_fast.  */
+ * get_pubkey_fast.  It is part of the object cache (objcache.c) which
+ * also maps keys to their user ids.  */
 void
 cache_public_key (PKT_public_key * pk)
 {
-#if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
-  u32 keyid[2];
-
   if (pk_cache_disabled)
     return;
 
@@ -193,50 +173,8 @@ cache_public_key (PKT_public_key * pk)
       || pk->pubkey_algo == PUBKEY_ALGO_EDDSA
       || pk->pubkey_algo == PUBKEY_ALGO_ECDH
       || is_RSA (pk->pubkey_algo))
-    {
-      keyid_from_pk (pk, keyid);
-    }
-  else
-    return; /* Don't know how to get the keyid.  */
-
-  for (ce = pk_cache; ce; ce = ce->next)
-    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-      {
-	if (DBG_CACHE)
-	  log_debug ("cache_public_key: already in cache\n");
-	return;
-      }
-
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
-    {
-      int n;
-
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce && ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      log_assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
-    }
-  pk_cache_entries++;
-  ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
-  ce->pk = copy_public_key (NULL, pk);
-  ce->keyid[0] = keyid[0];
-  ce->keyid[1] = keyid[1];
-#endif
+    cache_put_pubkey (pk);
+  /* else: Don't know how to get the keyid.  */
 }
 
 
@@ -262,21 +200,8 @@ user_id_not_found_utf8 (void)
 void
 getkey_disable_caches ()
 {
-#if MAX_PK_CACHE_ENTRIES
-  {
-    pk_cache_entry_t ce, ce2;
-
-    for (ce = pk_cache; ce; ce = ce2)
-      {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
-      }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
-  }
-#endif
+  cache_drop_pubkeys ();
+  pk_cache_disabled = 1;
   /* fixme: disable user id cache ? */
 }
 
@@ -353,25 +278,13 @@ get_pubkey (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
   int internal = 0;
   int rc = 0;
 
-#if MAX_PK_CACHE_ENTRIES
-  if (pk)
-    {
-      /* Try to get it from the cache.  We don't do this when pk is
-         NULL as it does not guarantee that the user IDs are
-         cached. */
-      pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    /* XXX: We don't check PK->REQ_USAGE here, but if we don't
-	       read from the cache, we do check it!  */
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
-    }
-#endif
+  /* Try to get it from the cache.  We don't do this when pk is NULL
+     as it does not guarantee that the user IDs are cached.  XXX: We
+     don't check PK->REQ_USAGE here, but if we don't read from the
+     cache, we do check it!  */
+  if (pk && cache_get_pubkey (keyid, 0, pk))
+    return 0;
+
   /* More init stuff.  */
   if (!pk)
     {
@@ -456,25 +369,10 @@ get_pubkey_fast (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
   u32 pkid[2];
 
   log_assert (pk);
-#if MAX_PK_CACHE_ENTRIES
-  {
-    /* Try to get it from the cache */
-    pk_cache_entry_t ce;
 
-    for (ce = pk_cache; ce; ce = ce->next)
-      {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1]
-	    /* Only consider primary keys.  */
-	    && ce->pk->keyid[0] == ce->pk->main_keyid[0]
-	    && ce->pk->keyid[1] == ce->pk->main_keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
-      }
-  }
-#endif
+  /* Try to get it from the cache.  Only consider primary keys.  */
+  if (cache_get_pubkey (keyid, 1, pk))
+    return 0;
 
   hd = keydb_new (ctrl);
   if (!hd)
@@ -851,6 +749,57 @@ key_byname (ctrl_t ctrl, GETKEY_CTX *retctx, strlist_t namelist,
 }
 
 
+/* Start the network lookups for NAME of the auto-key-locate list
+ * beginning at AKL concurrently.  The first of them is AKL itself.
+ * The results are then picked up by the regular lookups in
+ * get_pubkey_byname.  */
+static void
+race_akl_lookups (ctrl_t ctrl, const char *name, struct akl *akl)
+{
+  struct dirmngr_race_req_s *reqs;
+  struct akl *a;
+  char *mbox, *pattern;
+  int n;
+
+  for (n=0, a=akl; a; a = a->next)
+    n++;
+  reqs = xtrycalloc (n, sizeof *reqs);
+  mbox = mailbox_from_userid (name, 0);
+  pattern = strconcat ("=", name, NULL);
+  if (!reqs || !mbox || !pattern)
+    goto leave;
+
+  /* The patterns are those used by keyserver_import_wkd and
+   * keyserver_import_name.  */
+  for (n=0, a=akl; a; a = a->next)
+    {
+      if (a->type == AKL_WKD)
+        {
+          reqs[n].wkd = 1;
+          reqs[n++].pattern = mbox;
+        }
+      else if (a->type == AKL_KEYSERVER)
+        {
+          if (keyserver_any_configured (ctrl))
+            reqs[n++].pattern = pattern;
+        }
+      else if (a->type == AKL_SPEC)
+        {
+          reqs[n].keyserver = keyserver_match (a->spec);
+          reqs[n++].pattern = pattern;
+        }
+    }
+
+  if (n > 1)
+    gpg_dirmngr_race (ctrl, reqs, n, 0);
+
+ leave:
+  xfree (pattern);
+  xfree (mbox);
+  xfree (reqs);
+}
+
+
 /* Find a public key identified by NAME.
  *
  * If name appears to be a valid RFC822 mailbox (i.e., email address)
@@ -919,6 +868,7 @@ get_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
   int nodefault = 0;
   int anylocalfirst = 0;
   int mechanism_type = AKL_NODEFAULT;
+  int raced = 0;
 
   /* If RETCTX is not NULL, then RET_KDBHD must be NULL.  */
   log_assert (retctx == NULL || ret_kdbhd == NULL);
@@ -1021,6 +971,16 @@ get_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
 	  const char *mechanism_string = "?";
 
           mechanism_type = akl->type;
+          if (opt.akl_race && !raced
+              && (mechanism_type == AKL_WKD
+                  || mechanism_type == AKL_KEYSERVER
+                  || mechanism_type == AKL_SPEC))
+            {
+              /* Start this and all following network lookups now.  */
+              race_akl_lookups (ctrl, name, akl);
+              raced = 1;
+            }
+
 	  switch (mechanism_type)
 	    {
 	    case AKL_NODEFAULT:
@@ -1181,6 +1141,8 @@ get_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
 		      name, mechanism_string,
 		      no_fingerprint ? _("No fingerprint") : gpg_strerror (rc));
 	}
+      if (raced)
+        gpg_dirmngr_race_end (ctrl);
     }
 
   if (rc && retctx)
@@ -1586,6 +1548,204 @@ get_pubkey_fromfile (ctrl_t ctrl, PKT_public_key *pk, const char *fname)
 }
 
 
+/* The state of a batched public key lookup.  */
+struct pubkeys_batch_s
+{
+  ctrl_t ctrl;
+  size_t nnames;
+  size_t *map;             /* Maps the description to the name index.  */
+  keydb_multi_search_t ms; /* The running search or NULL.  */
+
+  /* Used by pubkeys_batch_cb.  */
+  unsigned int req_usage;
+  PKT_public_key **pks;
+  kbnode_t *keyblocks;
+};
+
+
+/* Callback for keydb_search_multi_finish used by
+ * get_pubkeys_batch_finish.  */
+static gpg_error_t
+pubkeys_batch_cb (void *opaque, size_t descidx, kbnode_t keyblock)
+{
+  pubkeys_batch_t parm = opaque;
+  size_t idx = parm->map[descidx];
+  kbnode_t found_key;
+  unsigned int infoflags;
+  PKT_public_key *pk;
+
+  /* Like lookup we take the first keyblock with a suitable key.  */
+  if (parm->pks[idx])
+    {
+      release_kbnode (keyblock);
+      return 0;
+    }
+
+  merge_selfsigs (parm->ctrl, keyblock);
+  found_key = finish_lookup (keyblock, parm->req_usage, 0, 0, &infoflags);
+  print_status_key_considered (keyblock, infoflags);
+  if (!found_key)
+    {
+      release_kbnode (keyblock);
+      return 0;
+    }
+
+  pk = xtrycalloc (1, sizeof *pk);
+  if (!pk)
+    {
+      release_kbnode (keyblock);
+      return gpg_error_from_syserror ();
+    }
+  pk->req_usage = parm->req_usage;
+  pk_from_block (pk, keyblock, found_key);
+  parm->pks[idx] = pk;
+  parm->keyblocks[idx] = keyblock;
+  return 0;
+}
+
+
+/* Start a batched lookup of the public keys for the NNAMES user ids
+ * in NAMES and store a handle for it at R_BATCH.  Only names
+ * specifying a fingerprint or a long key ID without the '!' suffix
+ * are looked up.  With the keyboxd the lookup runs in the background
+ * so that the caller can do other work before it collects the keys
+ * with get_pubkeys_batch_finish, which must always be called.  NAMES
+ * is not used after this function returns.  */
+gpg_error_t
+get_pubkeys_batch_start (ctrl_t ctrl, const char **names, size_t nnames,
+                         pubkeys_batch_t *r_batch)
+{
+  gpg_error_t err;
+  pubkeys_batch_t batch;
+  KEYDB_SEARCH_DESC *desc = NULL;
+  size_t i, ndesc;
+
+  *r_batch = NULL;
+
+  batch = xtrycalloc (1, sizeof *batch);
+  if (!batch)
+    return gpg_error_from_syserror ();
+  batch->ctrl = ctrl;
+  batch->nnames = nnames;
+
+  desc = xtrycalloc (nnames, sizeof *desc);
+  batch->map = xtrycalloc (nnames, sizeof *batch->map);
+  if (!desc || !batch->map)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Note that get_pubkey_byname does not use the auto key locate
+   * mechanism for these kind of names.  */
+  for (ndesc = i = 0; i < nnames; i++)
+    {
+      if (classify_user_id (names[i], desc + ndesc, 1))
+        continue;
+      if (desc[ndesc].exact
+          || (desc[ndesc].mode != KEYDB_SEARCH_MODE_FPR
+              && desc[ndesc].mode != KEYDB_SEARCH_MODE_LONG_KID))
+        continue;
+      batch->map[ndesc++] = i;
+    }
+
+  if (ndesc)
+    err = keydb_search_multi_start (ctrl, desc, ndesc, &batch->ms);
+  else
+    err = 0;
+
+ leave:
+  xfree (desc);
+  if (err)
+    {
+      xfree (batch->map);
+      xfree (batch);
+    }
+  else
+    *r_batch = batch;
+  return err;
+}
+
+
+/* Finish the lookup BATCH started by get_pubkeys_batch_start.  For
+ * each name which has a key usable for REQ_USAGE the key is stored at
+ * R_PKS[i] and its merged keyblock at R_KEYBLOCKS[i]; the caller must
+ * release them.  All other entries are set to NULL and the caller
+ * should resolve those names as usual, for example with
+ * get_best_pubkey_byname, which then also yields the proper error
+ * code.  On error all entries are NULL.  If R_PKS is NULL the result
+ * is discarded.  BATCH is released in all cases.  */
+gpg_error_t
+get_pubkeys_batch_finish (pubkeys_batch_t batch, unsigned int req_usage,
+                          PKT_public_key **r_pks, kbnode_t *r_keyblocks)
+{
+  gpg_error_t err;
+  size_t i;
+
+  if (!batch)
+    return 0;
+
+  if (!r_pks)
+    {
+      err = keydb_search_multi_finish (batch->ms, NULL, NULL);
+      goto leave;
+    }
+
+  for (i = 0; i < batch->nnames; i++)
+    {
+      r_pks[i] = NULL;
+      r_keyblocks[i] = NULL;
+    }
+
+  batch->req_usage = req_usage;
+  batch->pks = r_pks;
+  batch->keyblocks = r_keyblocks;
+  err = keydb_search_multi_finish (batch->ms, pubkeys_batch_cb, batch);
+  if (err)
+    {
+      for (i = 0; i < batch->nnames; i++)
+        {
+          free_public_key (r_pks[i]);
+          r_pks[i] = NULL;
+          release_kbnode (r_keyblocks[i]);
+          r_keyblocks[i] = NULL;
+        }
+    }
+
+ leave:
+  xfree (batch->map);
+  xfree (batch);
+  return err;
+}
+
+
+/* Look up the public keys for the NNAMES user ids in NAMES using a
+ * single batched search of the local keydb.  This is the synchronous
+ * version of get_pubkeys_batch_start and get_pubkeys_batch_finish;
+ * see there for details.  */
+gpg_error_t
+get_pubkeys_batch (ctrl_t ctrl, const char **names, size_t nnames,
+                   unsigned int req_usage,
+                   PKT_public_key **r_pks, kbnode_t *r_keyblocks)
+{
+  gpg_error_t err;
+  pubkeys_batch_t batch;
+  size_t i;
+
+  err = get_pubkeys_batch_start (ctrl, names, nnames, &batch);
+  if (err)
+    {
+      for (i = 0; i < nnames; i++)
+        {
+          r_pks[i] = NULL;
+          r_keyblocks[i] = NULL;
+        }
+      return err;
+    }
+  return get_pubkeys_batch_finish (batch, req_usage, r_pks, r_keyblocks);
+}
+
+
 /* Lookup a key with the specified fingerprint.
  *
  * If PK is not NULL, the public key of the first result is returned
@@ -1826,7 +1986,7 @@ parse_def_secret_key (ctrl_t ctrl)
           continue;
         }
 
-      merge_selfsigs (ctrl, kb);
+      merge_selfsigs_cached (ctrl, hd, &kb);
 
       err = gpg_error (GPG_ERR_NO_SECKEY);
       node = kb;
@@ -2984,7 +3144,7 @@ buf_to_sig (const byte * buf, size_t len)
   IOBUF iobuf = iobuf_temp_with_content (buf, len);
   int save_mode = set_packet_list_mode (0);
 
-  if (parse_signature (iobuf, PKT_SIGNATURE, len, sig) != 0)
+  if (parse_signature (iobuf, PKT_SIGNATURE, len, sig, 0) != 0)
     {
       free_seckey_enc (sig);
       sig = NULL;
@@ -3311,6 +3471,30 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
 }
 
 
+/* Same as merge_selfsigs for a *KEYBLOCK just returned by
+ * keydb_get_keyblock for HD but use the cached result of an earlier
+ * merge of the same keyblock image.  *KEYBLOCK may be replaced.  */
+static void
+merge_selfsigs_cached (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t *keyblock)
+{
+  kbnode_t merged;
+
+  if ((*keyblock)->pkt->pkttype == PKT_PUBLIC_KEY)
+    {
+      merged = keydb_get_merged_keyblock (hd, *keyblock);
+      if (merged)
+        {
+          release_kbnode (*keyblock);
+          *keyblock = merged;
+          return;
+        }
+    }
+
+  merge_selfsigs (ctrl, *keyblock);
+  keydb_put_merged_keyblock (hd, *keyblock);
+}
+
+
 
 /* See whether the key satisfies any additional requirements specified
  * in CTX.  If so, return the node of an appropriate key or subkey.
@@ -3694,7 +3878,7 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
 
       /* Warning: node flag bits 0 and 1 should be preserved by
        * merge_selfsigs.  */
-      merge_selfsigs (ctrl, keyblock);
+      merge_selfsigs_cached (ctrl, ctx->kr_handle, &keyblock);
       found_key = finish_lookup (keyblock, ctx->req_usage, ctx->exact,
                                  want_secret, &infoflags);
       print_status_key_considered (keyblock, infoflags);
@@ -3808,6 +3992,158 @@ get_seckey_default_or_card (ctrl_t ctrl, PKT_public_key *pk,
  ***********  User ID printing helpers *******
  *********************************************/
 
+/* The sorted array with the key IDs of the signers which
+ * cache_signer_user_ids did not find.  */
+static u32 *missing_signers;
+static size_t n_missing_signers;
+
+/* Parameter for cache_signer_user_ids_cb.  */
+struct signer_user_ids_parm_s
+{
+  ctrl_t ctrl;
+  char *found;  /* Flag array indexed by the search description.  */
+};
+
+
+/* qsort and bsearch compare function for key IDs.  */
+static int
+compare_keyids (const void *arg_a, const void *arg_b)
+{
+  const u32 *a = arg_a;
+  const u32 *b = arg_b;
+
+  if (a[0] != b[0])
+    return a[0] < b[0]? -1 : 1;
+  if (a[1] != b[1])
+    return a[1] < b[1]? -1 : 1;
+  return 0;
+}
+
+
+/* Return true if cache_signer_user_ids did not find KEYID.  */
+static int
+is_missing_signer (u32 *keyid)
+{
+  return (n_missing_signers
+          && bsearch (keyid, missing_signers, n_missing_signers,
+                      2 * sizeof *missing_signers, compare_keyids));
+}
+
+
+/* Callback for keydb_search_multi used by cache_signer_user_ids.  */
+static gpg_error_t
+cache_signer_user_ids_cb (void *opaque, size_t descidx, kbnode_t keyblock)
+{
+  struct signer_user_ids_parm_s *parm = opaque;
+
+  parm->found[descidx] = 1;
+  merge_selfsigs (parm->ctrl, keyblock);
+  cache_put_keyblock (keyblock);
+  release_kbnode (keyblock);
+  return 0;
+}
+
+
+/* Put the user ids of the signers of all signatures in KEYBLOCK into
+ * the cache.  The keys not yet cached are looked up with one batched
+ * keydb search instead of one search per signature in get_user_id.
+ * The signers which are not found are remembered so that get_user_id
+ * does not search for them either.  This information is only valid
+ * as long as the keyring is not changed; thus the caller needs to
+ * call this function with KEYBLOCK set to NULL when done with
+ * printing KEYBLOCK.  */
+void
+cache_signer_user_ids (ctrl_t ctrl, kbnode_t keyblock)
+{
+  struct signer_user_ids_parm_s parm;
+  KEYDB_SEARCH_DESC *desc = NULL;
+  KEYDB_HANDLE hd = NULL;
+  kbnode_t node;
+  u32 *kids = NULL;
+  u32 *keyid;
+  char *name;
+  unsigned int namelen;
+  size_t i, n;
+
+  memset (&parm, 0, sizeof parm);
+
+  xfree (missing_signers);
+  missing_signers = NULL;
+  n_missing_signers = 0;
+
+  for (n=0, node = keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_SIGNATURE)
+      n++;
+  if (!n)
+    return;
+  kids = xtrycalloc (n, 2 * sizeof *kids);
+  if (!kids)
+    return;
+
+  for (n=0, node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      keyid = node->pkt->pkt.signature->keyid;
+      name = cache_get_uid_bykid (keyid, &namelen);
+      if (name)
+        {
+          xfree (name);
+          continue;
+        }
+      kids[2*n] = keyid[0];
+      kids[2*n+1] = keyid[1];
+      n++;
+    }
+  if (!n)
+    goto leave;
+
+  /* Remove duplicates.  */
+  qsort (kids, n, 2 * sizeof *kids, compare_keyids);
+  for (i = 1, keyid = kids; i < n; i++)
+    if (compare_keyids (keyid, kids + 2*i))
+      {
+        keyid += 2;
+        keyid[0] = kids[2*i];
+        keyid[1] = kids[2*i+1];
+      }
+  n = (keyid - kids) / 2 + 1;
+
+  desc = xtrycalloc (n, sizeof *desc);
+  parm.found = xtrycalloc (n, 1);
+  hd = keydb_new (ctrl);
+  if (!desc || !parm.found || !hd)
+    goto leave;
+  for (i = 0; i < n; i++)
+    {
+      desc[i].mode = KEYDB_SEARCH_MODE_LONG_KID;
+      desc[i].u.kid[0] = kids[2*i];
+      desc[i].u.kid[1] = kids[2*i+1];
+    }
+  parm.ctrl = ctrl;
+  if (keydb_search_multi (hd, desc, n, cache_signer_user_ids_cb, &parm))
+    goto leave;
+
+  /* Keep the key IDs not found.  This keeps the sort order.  */
+  for (i = 0, keyid = kids; i < n; i++)
+    if (!parm.found[i])
+      {
+        keyid[0] = kids[2*i];
+        keyid[1] = kids[2*i+1];
+        keyid += 2;
+      }
+  n_missing_signers = (keyid - kids) / 2;
+  missing_signers = kids;
+  kids = NULL;
+
+ leave:
+  keydb_release (hd);
+  xfree (parm.found);
+  xfree (desc);
+  xfree (kids);
+}
+
+
 /* Return a string with a printable representation of the user_id.
  * this string must be freed by xfree.  If R_NOUID is not NULL it is
  * set to true if a user id was not found; otherwise to false.  */
@@ -3821,7 +4157,7 @@ get_user_id_string (ctrl_t ctrl, u32 * keyid, int mode)
   log_assert (mode != 2);
 
   name = cache_get_uid_bykid (keyid, &namelen);
-  if (!name)
+  if (!name && !is_missing_signer (keyid))
     {
       /* Get it so that the cache will be filled.  */
       if (!get_pubkey (ctrl, NULL, keyid))
@@ -3878,7 +4214,7 @@ get_user_id (ctrl_t ctrl, u32 *keyid, size_t *rn, int *r_nouid)
     *r_nouid = 0;
 
   name = cache_get_uid_bykid (keyid, &namelen);
-  if (!name)
+  if (!name && !is_missing_signer (keyid))
     {
       /* Get it so that the cache will be filled.  */
       if (!get_pubkey (ctrl, NULL, keyid))
@@ -4026,6 +4362,13 @@ parse_auto_key_locate (const char *options_arg)
           xfree (akl);
           free_akl (opt.auto_key_locate);
           opt.auto_key_locate = NULL;
+          opt.akl_race = 0;
+          continue;
+        }
+      else if (ascii_strcasecmp (tok, "race") == 0)
+        {
+          xfree (akl);
+          opt.akl_race = 1;
           continue;
         }
       else if (ascii_strcasecmp (tok, "nodefault") == 0)
@@ -108,6 +108,15 @@ enum cmd_and_opt_values
     oMaxOutput,
     oInputSizeHint,
     oChunkSize,
+    oAeadThreads,
+    oPipeline,
+    oCompressThreads,
+    oSigCheckThreads,
+    oImportMaxSigs,
+    oPubkeyEncThreads,
+    oSignThreads,
+    oDetachedMulti,
+    oSigCacheFile,
     oSigNotation,
     oCertNotation,
     oShowNotation,
@@ -116,6 +125,7 @@ enum cmd_and_opt_values
     aEncrFiles,
     aEncrSym,
     aDecryptFiles,
+    aBatchStream,
     aClearsign,
     aStore,
     aQuickKeygen,
@@ -269,6 +279,7 @@ enum cmd_and_opt_values
     oQuickRandom,
     oNoVerbose,
     oTrustDBName,
+    oTrustDBCacheSize,
     oNoSecmemWarn,
     oRequireSecmem,
     oNoRequireSecmem,
@@ -356,6 +367,7 @@ enum cmd_and_opt_values
     oShowSessionKey,
     oOverrideSessionKey,
     oOverrideSessionKeyFD,
+    oSessionKeyCacheTTL,
     oNoRandomSeedFile,
     oAutoKeyRetrieve,
     oNoAutoKeyRetrieve,
@@ -372,6 +384,7 @@ enum cmd_and_opt_values
     oNoSigCache,
     oAutoCheckTrustDB,
     oNoAutoCheckTrustDB,
+    oBackgroundCheckTrustDB,
     oPreservePermissions,
     oDefaultPreferenceList,
     oDefaultKeyserverURL,
@@ -450,6 +463,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_c (aStore, "store",     "@"),
   ARGPARSE_c (aDecrypt, "decrypt",   N_("decrypt data (default)")),
   ARGPARSE_c (aDecryptFiles, "decrypt-files", "@"),
+  ARGPARSE_c (aBatchStream, "batch-stream", "@"),
   ARGPARSE_c (aVerify, "verify"   , N_("verify a signature")),
   ARGPARSE_c (aVerifyFiles, "verify-files" , "@" ),
   ARGPARSE_c (aListKeys, "list-keys", N_("list keys")),
@@ -604,6 +618,14 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_p_u (oMaxOutput, "max-output", "@"),
   ARGPARSE_s_s (oInputSizeHint, "input-size-hint", "@"),
   ARGPARSE_s_i (oChunkSize, "chunk-size", "@"),
+  ARGPARSE_s_i (oAeadThreads, "aead-threads", "@"),
+  ARGPARSE_s_n (oPipeline, "pipeline", "@"),
+  ARGPARSE_s_i (oCompressThreads, "compress-threads", "@"),
+  ARGPARSE_s_i (oSigCheckThreads, "sig-check-threads", "@"),
+  ARGPARSE_s_u (oImportMaxSigs, "import-max-sigs", "@"),
+  ARGPARSE_s_i (oPubkeyEncThreads, "pubkey-enc-threads", "@"),
+  ARGPARSE_s_i (oSignThreads, "sign-threads", "@"),
+  ARGPARSE_s_n (oDetachedMulti, "detached-multi", "@"),
 
   ARGPARSE_s_n (oVerbose, "verbose", N_("verbose")),
   ARGPARSE_s_n (oQuiet,	  "quiet",   "@"),
@@ -729,8 +751,10 @@ static ARGPARSE_OPTS opts[] = {
 
 #ifndef NO_TRUST_MODELS
   ARGPARSE_s_s (oTrustDBName, "trustdb-name", "@"),
+  ARGPARSE_s_i (oTrustDBCacheSize, "trustdb-cache-size", "@"),
   ARGPARSE_s_n (oAutoCheckTrustDB, "auto-check-trustdb", "@"),
   ARGPARSE_s_n (oNoAutoCheckTrustDB, "no-auto-check-trustdb", "@"),
+  ARGPARSE_s_n (oBackgroundCheckTrustDB, "background-check-trustdb", "@"),
   ARGPARSE_s_s (oForceOwnertrust, "force-ownertrust", "@"),
 #endif
 
@@ -824,10 +848,12 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oShowSessionKey, "show-session-key", "@"),
   ARGPARSE_s_s (oOverrideSessionKey, "override-session-key", "@"),
   ARGPARSE_s_i (oOverrideSessionKeyFD, "override-session-key-fd", "@"),
+  ARGPARSE_s_i (oSessionKeyCacheTTL, "session-key-cache-ttl", "@"),
   ARGPARSE_s_n (oNoRandomSeedFile,  "no-random-seed-file", "@"),
   ARGPARSE_s_n (oAutoKeyRetrieve, "auto-key-retrieve", "@"),
   ARGPARSE_s_n (oNoAutoKeyRetrieve, "no-auto-key-retrieve", "@"),
   ARGPARSE_s_n (oNoSigCache,         "no-sig-cache", "@"),
+  ARGPARSE_s_s (oSigCacheFile,       "sig-cache-file", "@"),
   ARGPARSE_s_n (oMergeOnly,	  "merge-only", "@" ),
   ARGPARSE_s_n (oAllowSecretKeyImport, "allow-secret-key-import", "@"),
   ARGPARSE_s_n (oTryAllSecrets,  "try-all-secrets", "@"),
@@ -960,6 +986,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_CLOCK_VALUE  , "clock"   },
     { DBG_LOOKUP_VALUE , "lookup"  },
     { DBG_EXTPROG_VALUE, "extprog" },
+    { DBG_TIMING_VALUE , "timing"  },
     { 0, NULL }
   };
 
@@ -1440,19 +1467,8 @@ add_group(char *string)
 
   trim_trailing_ws(name,strlen(name));
 
-  /* Does this group already exist? */
-  for(item=opt.grouplist;item;item=item->next)
-    if(strcasecmp(item->name,name)==0)
-      break;
-
-  if(!item)
-    {
-      item=xmalloc(sizeof(struct groupitem));
-      item->name=name;
-      item->next=opt.grouplist;
-      item->values=NULL;
-      opt.grouplist=item;
-    }
+  /* Get the existing group or create a new one.  */
+  item = new_group (name);
 
   /* Break apart the values */
   while ((value= strsep(&string," \t")))
@@ -1466,24 +1482,8 @@ add_group(char *string)
 static void
 rm_group(char *name)
 {
-  struct groupitem *item,*last=NULL;
-
   trim_trailing_ws(name,strlen(name));
-
-  for(item=opt.grouplist;item;last=item,item=item->next)
-    {
-      if(strcasecmp(item->name,name)==0)
-	{
-	  if(last)
-	    last->next=item->next;
-	  else
-	    opt.grouplist=item->next;
-
-	  free_strlist(item->values);
-	  xfree(item);
-	  break;
-	}
-    }
+  remove_group (name);
 }
 
 
@@ -1738,7 +1738,7 @@ print_algo_names(int (*checker)(int),const char *(*mapper)(int))
    it, and pubkey, cipher, hash, and compress as they may be useful
    for frontends. */
 static void
-list_config(char *items)
+list_config (ctrl_t ctrl, char *items)
 {
   int show_all = !items;
   char *name = NULL;
@@ -1873,6 +1873,16 @@ list_config(char *items)
 	  any=1;
 	}
 
+#ifdef USE_TOFU
+      /* This opens the TOFU database and is thus only printed if
+       * requested.  */
+      if (name && !ascii_strcasecmp (name, "tofu"))
+	{
+	  tofu_list_config (ctrl);
+	  any=1;
+	}
+#endif /*USE_TOFU*/
+
       /* Curve OIDs are rarely useful and thus only printed if requested.  */
       if (name && !ascii_strcasecmp (name,"curveoid"))
 	{
@@ -2356,6 +2366,7 @@ main (int argc, char **argv)
     const char *debug_level = NULL;
 #ifndef NO_TRUST_MODELS
     const char *trustdb_name = NULL;
+    const char *sig_cache_file = NULL;
 #endif /*!NO_TRUST_MODELS*/
     char *def_cipher_string = NULL;
     char *def_aead_string = NULL;
@@ -2370,6 +2381,7 @@ main (int argc, char **argv)
     char *pers_compress_list = NULL;
     int eyes_only=0;
     int multifile=0;
+    int batch_stream=0;
     int pwfd = -1;
     int ovrseskeyfd = -1;
     int fpr_maybe_cmd = 0; /* --fingerprint maybe a command.  */
@@ -2393,6 +2405,7 @@ main (int argc, char **argv)
        when adding any stuff between here and the call to
        secmem_init() somewhere after the option parsing. */
     early_system_init ();
+    gnupg_timing_mark ("start");
     gnupg_reopen_std (GPG_NAME);
     trap_unaligned ();
     gnupg_rl_initialize ();
@@ -2403,6 +2416,7 @@ main (int argc, char **argv)
     /* Make sure that our subsystems are ready.  */
     i18n_init();
     init_common_subsystems (&argc, &argv);
+    gnupg_timing_mark ("init");
 
     /* Use our own logging handler for Libcgrypt.  */
     setup_libgcrypt_logging ();
@@ -2440,6 +2454,7 @@ main (int argc, char **argv)
     opt.completes_needed = 1;
     opt.marginals_needed = 3;
     opt.max_cert_depth = 5;
+    opt.trustdb_cache_size = 16;
     opt.escape_from = 1;
     opt.flags.require_cross_cert = 1;
     opt.import_options = IMPORT_REPAIR_KEYS;
@@ -2566,6 +2581,7 @@ main (int argc, char **argv)
 
     /* By this point we have a homedir, and cannot change it. */
     check_permissions (gnupg_homedir (), 0);
+    gnupg_timing_mark ("homedir");
 
   next_pass:
     if( configname ) {
@@ -2702,6 +2718,12 @@ main (int argc, char **argv)
 	  case aDecryptFiles: multifile=1; /* fall through */
 	  case aDecrypt: set_cmd( &cmd, aDecrypt); break;
 
+	  case aBatchStream:
+            batch_stream = 1;
+            opt.batch = 1;
+            set_cmd (&cmd, aDecrypt);
+            break;
+
 	  case aEncrFiles: multifile=1; /* fall through */
 	  case aEncr: set_cmd( &cmd, aEncr); break;
 
@@ -2730,6 +2752,32 @@ main (int argc, char **argv)
             opt.chunk_size = pargs.r.ret_int;
             break;
 
+          case oAeadThreads:
+            opt.aead_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+            break;
+
+          case oPipeline: opt.pipeline = 1; break;
+
+          case oDetachedMulti: opt.detached_multi = 1; break;
+
+          case oCompressThreads:
+            opt.compress_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+            break;
+
+          case oSigCheckThreads:
+            opt.sig_check_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+            break;
+
+          case oImportMaxSigs: opt.import_max_sigs = pargs.r.ret_ulong; break;
+
+          case oPubkeyEncThreads:
+            opt.pubkey_enc_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+            break;
+
+          case oSignThreads:
+            opt.sign_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+            break;
+
 	  case oQuiet: opt.quiet = 1; break;
 	  case oNoTTY: tty_no_terminal(1); break;
 	  case oDryRun: opt.dry_run = 1; break;
@@ -2904,6 +2952,9 @@ main (int argc, char **argv)
 
 #ifndef NO_TRUST_MODELS
 	  case oTrustDBName: trustdb_name = pargs.r.ret_str; break;
+	  case oTrustDBCacheSize:
+            opt.trustdb_cache_size = pargs.r.ret_int;
+            break;
 
 #endif /*!NO_TRUST_MODELS*/
 	  case oDefaultKey:
@@ -3440,6 +3491,7 @@ main (int argc, char **argv)
             }
             break;
           case oNoSigCache: opt.no_sig_cache = 1; break;
+          case oSigCacheFile: sig_cache_file = pargs.r.ret_str; break;
 	  case oAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid = 1; break;
 	  case oNoAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid=0; break;
 	  case oAllowFreeformUID: opt.allow_freeform_uid = 1; break;
@@ -3472,6 +3524,9 @@ main (int argc, char **argv)
 	  case oOverrideSessionKeyFD:
                 ovrseskeyfd = translate_sys2libc_fd_int (pargs.r.ret_int, 0);
 		break;
+	  case oSessionKeyCacheTTL:
+            opt.session_key_cache_ttl = pargs.r.ret_int;
+            break;
 	  case oMergeOnly:
 	        deprecated_warning(configname,configlineno,"--merge-only",
 				   "--import-options ","merge-only");
@@ -3488,6 +3543,7 @@ main (int argc, char **argv)
           case oNoExpensiveTrustChecks: opt.no_expensive_trust_checks=1; break;
           case oAutoCheckTrustDB: opt.no_auto_check_trustdb=0; break;
           case oNoAutoCheckTrustDB: opt.no_auto_check_trustdb=1; break;
+          case oBackgroundCheckTrustDB: opt.background_check_trustdb=1; break;
           case oPreservePermissions: opt.preserve_permissions=1; break;
           case oDefaultPreferenceList:
 	    opt.def_preference_list = pargs.r.ret_str;
@@ -3548,15 +3604,7 @@ main (int argc, char **argv)
 
 	  case oGroup: add_group(pargs.r.ret_str); break;
 	  case oUnGroup: rm_group(pargs.r.ret_str); break;
-	  case oNoGroups:
-	    while(opt.grouplist)
-	      {
-		struct groupitem *iter=opt.grouplist;
-		free_strlist(iter->values);
-		opt.grouplist=opt.grouplist->next;
-		xfree(iter);
-	      }
-	    break;
+	  case oNoGroups: release_groups (); break;
 
 	  case oStrict:
 	  case oNoStrict:
@@ -3847,6 +3895,7 @@ main (int argc, char **argv)
       }
 
     set_debug (debug_level);
+    gnupg_timing_mark ("options");
     if (DBG_CLOCK)
       log_clock ("start");
 
@@ -3970,7 +4019,7 @@ main (int argc, char **argv)
 	switch(cmd)
 	  {
 	  case aSign:
-	    cmdname="--sign";
+	    cmdname= detached_sig? NULL : "--sign";
 	    break;
 	  case aSignEncr:
 	    cmdname="--sign --encrypt";
@@ -4160,6 +4209,7 @@ main (int argc, char **argv)
           keydb_add_resource (sl->d, sl->flags);
       }
     FREE_STRLIST(nrings);
+    gnupg_timing_mark ("keydb");
 
     /* In loopback mode, never ask for the password multiple times.  */
     if (opt.pinentry_mode == PINENTRY_MODE_LOOPBACK)
@@ -4185,6 +4235,9 @@ main (int argc, char **argv)
     ctrl = xcalloc (1, sizeof *ctrl);
     gpg_init_default_ctrl (ctrl);
 
+    if (sig_cache_file)
+      sig_cache_set_file (sig_cache_file);
+
 #ifndef NO_TRUST_MODELS
     switch (cmd)
       {
@@ -4219,6 +4272,7 @@ main (int argc, char **argv)
       log_error (_("failed to initialize the TrustDB: %s\n"),
                  gpg_strerror (rc));
 #endif /*!NO_TRUST_MODELS*/
+    gnupg_timing_mark ("trustdb");
 
     switch (cmd)
       {
@@ -4347,6 +4401,12 @@ main (int argc, char **argv)
 	break;
 
       case aSign: /* sign the given file */
+	if (detached_sig && multifile)
+	  {
+	    if ((rc = sign_files (ctrl, argc, argv, locusr)))
+	      write_status_failure ("sign", rc);
+	    break;
+	  }
 	sl = NULL;
 	if( detached_sig ) { /* sign all files */
 	    for( ; argc; argc--, argv++ )
@@ -4455,7 +4515,14 @@ main (int argc, char **argv)
 	break;
 
       case aDecrypt:
-        if (multifile)
+        if (batch_stream)
+          {
+            if (argc)
+              wrong_args ("--batch-stream");
+            if ((rc = decrypt_message_stream (ctrl)))
+              log_error ("batch-stream failed: %s\n", gpg_strerror (rc));
+          }
+        else if (multifile)
 	  decrypt_messages (ctrl, argc, argv);
 	else
 	  {
@@ -5092,7 +5159,7 @@ main (int argc, char **argv)
       case aListConfig:
 	{
 	  char *str=collapse_args(argc,argv);
-	  list_config(str);
+	  list_config (ctrl, str);
 	  xfree(str);
 	}
 	break;
@@ -5275,13 +5342,20 @@ g10_exit( int rc )
     write_status_failure ("gpg-exit", gpg_error (GPG_ERR_GENERAL));
 
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
+  sig_cache_flush ();
+#ifdef USE_TOFU
+  tofu_flush_batch ();
+#endif
   if (DBG_CLOCK)
     log_clock ("stop");
+  if (DBG_TIMING)
+    gnupg_timing_dump ();
 
   if ( (opt.debug & DBG_MEMSTAT_VALUE) )
     {
       keydb_dump_stats ();
       sig_check_dump_stats ();
+      sig_cache_dump_stats ();
       objcache_dump_stats ();
       gcry_control (GCRYCTL_DUMP_MEMORY_STATS);
       gcry_control (GCRYCTL_DUMP_RANDOM_STATS);
@@ -99,6 +99,9 @@ struct server_control_s
   /* Local data for call-dirmngr.c  */
   dirmngr_local_t dirmngr_local;
 
+  /* Results of lookups run ahead by call-dirmngr.c  */
+  struct dirmngr_race_s *dirmngr_race;
+
   /* Local data for call-keyboxd.c  */
   keyboxd_local_t keyboxd_local;
 
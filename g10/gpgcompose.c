@@ -26,6 +26,7 @@
 #include "main.h"
 #include "options.h"
 #include "call-agent.h"
+#include "pkglue.h"
 
 static int do_debug;
 #define debug(fmt, ...) \
@@ -498,6 +499,8 @@ static int signature (const char *option, int argc, char *argv[],
                       void *cookie);
 static int copy (const char *option, int argc, char *argv[],
                  void *cookie);
+static int synthetic_keyring (const char *option, int argc, char *argv[],
+                              void *cookie);
 
 static struct option major_options[] = {
   { "--user-id", user_id, "Create a user id packet." },
@@ -520,6 +523,8 @@ static struct option major_options[] = {
   { "--signature", signature, "Create a signature packet." },
   { "--onepass-sig", NULL, "Create a one-pass signature packet." },
   { "--copy", copy, "Copy the specified file." },
+  { "--synthetic-keyring", synthetic_keyring,
+    "Create a keyring of generated keys which certify each other." },
   { NULL, NULL,
     "To get more information about a given command, use:\n\n"
     "  $ gpgcompose --command --help to list a command's options."},
@@ -3003,6 +3008,569 @@ copy (const char *option, int argc, char *argv[], void *cookie)
   return processed;
 }
 
+/* Synthetic keyrings.  All key material and all random choices are
+   derived from a seed so that the same options always yield the same
+   keyring.  */
+struct synth_cert
+{
+  struct synth_cert *next;
+  /* Index of the certifying key.  */
+  unsigned int signer;
+  /* Index of the certified user id.  */
+  unsigned int uid;
+  u32 timestamp;
+};
+
+struct synth_key
+{
+  PKT_public_key *pk;
+  /* The Ed25519 secret key.  */
+  byte d[32];
+  PKT_user_id **uids;
+  /* The certifications made on this key.  */
+  struct synth_cert *certs;
+  /* The number of certifications this key received.  */
+  unsigned int indegree;
+};
+
+enum synth_model
+  {
+    SYNTH_NONE,
+    SYNTH_CHAIN,
+    SYNTH_RANDOM,
+    SYNTH_PREFERENTIAL
+  };
+
+struct synthinfo
+{
+  unsigned int nkeys;
+  unsigned int nuids;
+  unsigned int degree;
+  enum synth_model model;
+  const char *seed;
+  u32 timestamp;
+
+  /* The state of the deterministic random number generator: The
+     output is SHA-256 (SEED || COUNTER) for COUNTER = 0, 1, ....  */
+  u32 counter;
+  byte pool[32];
+  int poolpos;
+};
+
+/* Fill BUFFER with LENGTH deterministic random bytes.  */
+static void
+synth_random (struct synthinfo *si, byte *buffer, size_t length)
+{
+  gcry_md_hd_t md;
+
+  while (length)
+    {
+      if (si->poolpos == 0 || si->poolpos == sizeof si->pool)
+        {
+          byte counter[4];
+
+          if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+            BUG ();
+          gcry_md_write (md, si->seed, strlen (si->seed));
+          counter[0] = si->counter >> 24;
+          counter[1] = si->counter >> 16;
+          counter[2] = si->counter >>  8;
+          counter[3] = si->counter;
+          gcry_md_write (md, counter, 4);
+          memcpy (si->pool, gcry_md_read (md, GCRY_MD_SHA256),
+                  sizeof si->pool);
+          gcry_md_close (md);
+          si->counter ++;
+          si->poolpos = 0;
+        }
+
+      *buffer++ = si->pool[si->poolpos++];
+      length --;
+    }
+}
+
+/* Return a deterministic random number in the range [0, N).  */
+static unsigned int
+synth_random_below (struct synthinfo *si, unsigned int n)
+{
+  byte buf[4];
+
+  synth_random (si, buf, 4);
+  return (((u32)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]) % n;
+}
+
+/* Create an Ed25519 primary key from the secret key KEY->D.  */
+static void
+synth_make_key (struct synth_key *key, u32 timestamp)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_key;
+  gcry_ctx_t ctx;
+  gcry_mpi_t q;
+  const byte *p;
+  unsigned int nbits;
+  byte buf[33];
+  PKT_public_key *pk;
+
+  err = gcry_sexp_build (&s_key, NULL,
+                         "(private-key(ecc(curve Ed25519)(flags eddsa)"
+                         "(d %b)))", (int)sizeof key->d, key->d);
+  if (! err)
+    err = gcry_mpi_ec_new (&ctx, s_key, NULL);
+  if (err)
+    log_fatal ("Creating synthetic key: %s\n", gpg_strerror (err));
+  gcry_sexp_release (s_key);
+
+  q = gcry_mpi_ec_get_mpi ("q@eddsa", ctx, 1);
+  if (! q)
+    log_fatal ("Creating synthetic key: %s\n", "no public key");
+  p = gcry_mpi_get_opaque (q, &nbits);
+  log_assert (p && nbits == 256);
+  /* OpenPGP uses the native point format.  */
+  buf[0] = 0x40;
+  memcpy (buf + 1, p, 32);
+  gcry_mpi_release (q);
+  gcry_ctx_release (ctx);
+
+  pk = xmalloc_clear (sizeof (*pk));
+  pk->version = 4;
+  pk->timestamp = timestamp;
+  pk->pubkey_algo = PUBKEY_ALGO_EDDSA;
+  pk->pubkey_usage = PUBKEY_USAGE_CERT | PUBKEY_USAGE_SIG;
+  err = openpgp_oid_from_str (openpgp_curve_to_oid ("Ed25519", NULL),
+                              &pk->pkey[0]);
+  if (err)
+    log_fatal ("Creating synthetic key: %s\n", gpg_strerror (err));
+  if (gcry_mpi_scan (&pk->pkey[1], GCRYMPI_FMT_USG, buf, sizeof buf, NULL))
+    BUG ();
+  key->pk = pk;
+}
+
+/* Create a certification of class SIGCLASS by SIGNER on the user id
+   UID of TARGET and write it to OUT.  If PRIMARY is set the
+   signature marks UID as the primary user id.  */
+static void
+synth_certify (iobuf_t out, struct synth_key *target, PKT_user_id *uid,
+               struct synth_key *signer, int sigclass, u32 timestamp,
+               int primary)
+{
+  gpg_error_t err;
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+  gcry_sexp_t s_key, s_hash, s_sigval;
+  const byte *dp;
+  byte buf[6];
+  size_t n;
+  PACKET pkt;
+
+  sig = xmalloc_clear (sizeof (*sig));
+  sig->version = 4;
+  sig->sig_class = sigclass;
+  sig->pubkey_algo = PUBKEY_ALGO_EDDSA;
+  sig->digest_algo = DIGEST_ALGO_SHA256;
+  sig->timestamp = timestamp;
+  sig->flags.exportable = 1;
+  sig->flags.revocable = 1;
+  keyid_from_pk (signer->pk, sig->keyid);
+
+  build_sig_subpkt_from_sig (sig, signer->pk);
+  if (signer == target)
+    {
+      keygen_add_key_flags (sig, target->pk);
+      if (primary)
+        {
+          buf[0] = 1;
+          build_sig_subpkt (sig, SIGSUBPKT_PRIMARY_UID, buf, 1);
+        }
+    }
+
+  /* Hash the key, the user id and the signature as described in RFC
+     4880, section 5.2.4.  */
+  if (gcry_md_open (&md, sig->digest_algo, 0))
+    BUG ();
+  hash_public_key (md, target->pk);
+  buf[0] = 0xb4;
+  buf[1] = uid->len >> 24;
+  buf[2] = uid->len >> 16;
+  buf[3] = uid->len >>  8;
+  buf[4] = uid->len;
+  gcry_md_write (md, buf, 5);
+  gcry_md_write (md, uid->name, uid->len);
+  gcry_md_putc (md, sig->version);
+  gcry_md_putc (md, sig->sig_class);
+  gcry_md_putc (md, sig->pubkey_algo);
+  gcry_md_putc (md, sig->digest_algo);
+  n = sig->hashed->len;
+  gcry_md_putc (md, n >> 8);
+  gcry_md_putc (md, n);
+  gcry_md_write (md, sig->hashed->data, n);
+  n += 6;
+  buf[0] = sig->version;
+  buf[1] = 0xff;
+  buf[2] = n >> 24;
+  buf[3] = n >> 16;
+  buf[4] = n >>  8;
+  buf[5] = n;
+  gcry_md_write (md, buf, 6);
+  gcry_md_final (md);
+
+  dp = gcry_md_read (md, sig->digest_algo);
+  sig->digest_start[0] = dp[0];
+  sig->digest_start[1] = dp[1];
+
+  err = gcry_sexp_build (&s_key, NULL,
+                         "(private-key(ecc(curve Ed25519)(flags eddsa)"
+                         "(q %m)(d %b)))",
+                         signer->pk->pkey[1],
+                         (int)sizeof signer->d, signer->d);
+  if (! err)
+    err = gcry_sexp_build (&s_hash, NULL,
+                           "(data(flags eddsa)(hash-algo sha512)"
+                           "(value %b))",
+                           (int)gcry_md_get_algo_dlen (sig->digest_algo),
+                           dp);
+  gcry_md_close (md);
+  if (! err)
+    err = gcry_pk_sign (&s_sigval, s_hash, s_key);
+  if (err)
+    log_fatal ("Generating signature: %s\n", gpg_strerror (err));
+  sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
+  sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
+  gcry_sexp_release (s_sigval);
+  gcry_sexp_release (s_hash);
+  gcry_sexp_release (s_key);
+
+  memset (&pkt, 0, sizeof (pkt));
+  pkt.pkttype = PKT_SIGNATURE;
+  pkt.pkt.signature = sig;
+  err = build_packet (out, &pkt);
+  if (err)
+    log_fatal ("serializing signature packet: %s\n", gpg_strerror (err));
+  free_seckey_enc (sig);
+}
+
+/* Let key I certify the key TARGET at a random user id unless it
+   already did so.  Returns true if the certification was added.  */
+static int
+synth_add_cert (struct synthinfo *si, struct synth_key *keys,
+                unsigned int i, unsigned int target)
+{
+  struct synth_cert *cert;
+  u32 created;
+
+  if (i == target)
+    return 0;
+  for (cert = keys[target].certs; cert; cert = cert->next)
+    if (cert->signer == i)
+      return 0;
+
+  created = keys[i].pk->timestamp;
+  if (keys[target].pk->timestamp > created)
+    created = keys[target].pk->timestamp;
+
+  cert = xmalloc_clear (sizeof (*cert));
+  cert->signer = i;
+  cert->uid = synth_random_below (si, si->nuids);
+  /* Certifications are made within a year after both keys exist.  */
+  cert->timestamp = created + 1 + synth_random_below (si, 365 * 86400);
+  cert->next = keys[target].certs;
+  keys[target].certs = cert;
+  keys[target].indegree ++;
+  return 1;
+}
+
+/* Build the certification graph.  */
+static void
+synth_make_graph (struct synthinfo *si, struct synth_key *keys)
+{
+  unsigned int i, j, tries;
+  unsigned int *urn = NULL;
+  size_t nurn = 0;
+
+  if (si->model == SYNTH_PREFERENTIAL)
+    /* Each key is in the urn once plus once for each certification
+       it received.  Drawing from the urn thus selects a key with a
+       probability proportional to its popularity, which results in
+       the heavy tailed distribution of real web of trusts.  */
+    urn = xcalloc (si->nkeys + (size_t)si->nkeys * si->degree,
+                   sizeof *urn);
+
+  for (i = 0; i < si->nkeys; i ++)
+    {
+      switch (si->model)
+        {
+        case SYNTH_NONE:
+          break;
+
+        case SYNTH_CHAIN:
+          if (i + 1 < si->nkeys)
+            synth_add_cert (si, keys, i, i + 1);
+          break;
+
+        case SYNTH_RANDOM:
+          for (j = tries = 0;
+               j < si->degree && j < si->nkeys - 1 && tries < 4 * si->degree;
+               tries ++)
+            if (synth_add_cert (si, keys, i,
+                                synth_random_below (si, si->nkeys)))
+              j ++;
+          break;
+
+        case SYNTH_PREFERENTIAL:
+          /* Key I certifies keys that already exist.  */
+          for (j = tries = 0;
+               j < si->degree && j < i && tries < 4 * si->degree;
+               tries ++)
+            {
+              unsigned int target = urn[synth_random_below (si, nurn)];
+
+              if (synth_add_cert (si, keys, i, target))
+                {
+                  urn[nurn++] = target;
+                  j ++;
+                }
+            }
+          urn[nurn++] = i;
+          break;
+        }
+    }
+
+  xfree (urn);
+}
+
+static int
+synth_uint (const char *option, int argc, char *argv[], unsigned int *r_value,
+            unsigned int min, unsigned int max)
+{
+  char *tail;
+  unsigned long v;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s N\n", option);
+
+  errno = 0;
+  v = strtoul (argv[0], &tail, 0);
+  if (errno || (tail && *tail) || !(min <= v && v <= max))
+    log_fatal ("Invalid value passed to %s (%s).  Expected %u-%u\n",
+               option, argv[0], min, max);
+
+  *r_value = v;
+
+  return 1;
+}
+
+static int
+synth_keys (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  return synth_uint (option, argc, argv, &si->nkeys, 1, 10000000);
+}
+
+static int
+synth_user_ids (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  return synth_uint (option, argc, argv, &si->nuids, 1, 100);
+}
+
+static int
+synth_degree (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  return synth_uint (option, argc, argv, &si->degree, 0, 1000);
+}
+
+static int
+synth_certifications (const char *option, int argc, char *argv[],
+                      void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s MODEL\n", option);
+
+  if (strcmp (argv[0], "none") == 0)
+    si->model = SYNTH_NONE;
+  else if (strcmp (argv[0], "chain") == 0)
+    si->model = SYNTH_CHAIN;
+  else if (strcmp (argv[0], "random") == 0)
+    si->model = SYNTH_RANDOM;
+  else if (strcmp (argv[0], "preferential") == 0)
+    si->model = SYNTH_PREFERENTIAL;
+  else
+    log_fatal ("Invalid value passed to %s (%s).  Expected one of"
+               " none, chain, random, preferential\n", option, argv[0]);
+
+  return 1;
+}
+
+static int
+synth_seed (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s SEED\n", option);
+
+  si->seed = argv[0];
+
+  return 1;
+}
+
+static int
+synth_timestamp (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+  char *tail = NULL;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s TIMESTAMP\n", option);
+
+  errno = 0;
+  si->timestamp = parse_timestamp (argv[0], &tail);
+  if (errno || (tail && *tail))
+    log_fatal ("Invalid value passed to %s (%s)\n", option, argv[0]);
+
+  return 1;
+}
+
+static struct option synth_options[] = {
+  { "--keys", synth_keys,
+    "The number of keys to create (default: 10)." },
+  { "--user-ids", synth_user_ids,
+    "The number of user ids of each key (default: 1).  The user ids of "
+    "key I are \"Synthetic Key I <keyI@example.org>\" and, for J > 0, "
+    "\"Synthetic Key I <keyI.J@example.org>\"." },
+  { "--certifications", synth_certifications,
+    "How keys certify each other.  Valid values are "
+    "none, "
+    "chain (each key certifies the next one), "
+    "random (each key certifies --degree keys chosen uniformly), and "
+    "preferential (each key certifies --degree older keys chosen with a "
+    "probability proportional to the number of certifications they "
+    "already have, which gives a few well connected keys and many "
+    "barely connected ones).  The default is preferential." },
+  { "--degree", synth_degree,
+    "The number of certifications each key makes (default: 3)." },
+  { "--seed", synth_seed,
+    "The seed from which all key material and all random choices are "
+    "derived (default: \"gpgcompose\")." },
+  { "--timestamp", synth_timestamp,
+    "The creation time of the first key; each further key is created "
+    "one minute later.  " TIMESTAMP_HELP },
+  { NULL, NULL,
+    "The keys are Ed25519 primary keys without subkeys.  The output is "
+    "the same for the same options.\n\n"
+    "Example:\n\n"
+    "  $ gpgcompose --synthetic-keyring --keys 1000 --user-ids 2 \\\n"
+    "  > keys.gpg && " GPG_NAME " --import keys.gpg" }
+};
+
+static int
+synthetic_keyring (const char *option, int argc, char *argv[], void *cookie)
+{
+  iobuf_t out = cookie;
+  gpg_error_t err;
+  struct synthinfo si;
+  struct synth_key *keys;
+  struct synth_cert *cert, *next;
+  PACKET pkt;
+  int processed;
+  unsigned int i, j;
+
+  memset (&si, 0, sizeof (si));
+  si.nkeys = 10;
+  si.nuids = 1;
+  si.degree = 3;
+  si.model = SYNTH_PREFERENTIAL;
+  si.seed = "gpgcompose";
+  si.timestamp = 1577836800;  /* 2020-01-01.  */
+
+  processed = process_options (option,
+                               major_options,
+                               synth_options, &si,
+                               global_options, NULL,
+                               argc, argv);
+
+  keys = xcalloc (si.nkeys, sizeof *keys);
+  for (i = 0; i < si.nkeys; i ++)
+    {
+      synth_random (&si, keys[i].d, sizeof keys[i].d);
+      synth_make_key (&keys[i], si.timestamp + i * 60);
+
+      keys[i].uids = xcalloc (si.nuids, sizeof *keys[i].uids);
+      for (j = 0; j < si.nuids; j ++)
+        {
+          char *name;
+
+          if (j)
+            name = xasprintf ("Synthetic Key %u <key%u.%u@example.org>",
+                              i, i, j);
+          else
+            name = xasprintf ("Synthetic Key %u <key%u@example.org>", i, i);
+          keys[i].uids[j] = xmalloc_clear (sizeof (PKT_user_id)
+                                           + strlen (name));
+          keys[i].uids[j]->len = strlen (name);
+          strcpy (keys[i].uids[j]->name, name);
+          keys[i].uids[j]->ref = 1;
+          xfree (name);
+        }
+    }
+
+  synth_make_graph (&si, keys);
+
+  memset (&pkt, 0, sizeof (pkt));
+  for (i = 0; i < si.nkeys; i ++)
+    {
+      pkt.pkttype = PKT_PUBLIC_KEY;
+      pkt.pkt.public_key = keys[i].pk;
+      err = build_packet (out, &pkt);
+      if (err)
+        log_fatal ("serializing public key packet: %s\n",
+                   gpg_strerror (err));
+
+      for (j = 0; j < si.nuids; j ++)
+        {
+          pkt.pkttype = PKT_USER_ID;
+          pkt.pkt.user_id = keys[i].uids[j];
+          err = build_packet (out, &pkt);
+          if (err)
+            log_fatal ("serializing user id packet: %s\n",
+                       gpg_strerror (err));
+
+          synth_certify (out, &keys[i], keys[i].uids[j], &keys[i], 0x13,
+                         keys[i].pk->timestamp, j == 0);
+          for (cert = keys[i].certs; cert; cert = cert->next)
+            if (cert->uid == j)
+              synth_certify (out, &keys[i], keys[i].uids[j],
+                             &keys[cert->signer], 0x10, cert->timestamp, 0);
+        }
+
+      debug ("Wrote synthetic key %u with %u certifications\n",
+             i, keys[i].indegree);
+    }
+
+  for (i = 0; i < si.nkeys; i ++)
+    {
+      for (cert = keys[i].certs; cert; cert = next)
+        {
+          next = cert->next;
+          xfree (cert);
+        }
+      for (j = 0; j < si.nuids; j ++)
+        free_user_id (keys[i].uids[j]);
+      xfree (keys[i].uids);
+      free_public_key (keys[i].pk);
+      wipememory (keys[i].d, sizeof keys[i].d);
+    }
+  xfree (keys);
+
+  return processed;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "options.h"
@@ -62,6 +63,57 @@ struct import_stats_s
   ulong n_sigs_cleaned;
   ulong n_uids_cleaned;
   ulong v3keys;   /* Number of V3 keys seen.  */
+  ulong bulk_changes; /* Changes not yet marked in the trustdb.  */
+};
+
+
+/* The number of keyblocks read ahead with import option "bulk".  */
+#define IMPORT_BULK_BATCH 64
+
+/* The read ahead queue of import option "bulk".  */
+struct bulk_queue_s
+{
+  kbnode_t blocks[IMPORT_BULK_BATCH];
+  int v3keys[IMPORT_BULK_BATCH];
+  int nblocks;            /* Number of keyblocks in BLOCKS.  */
+  int next;               /* Index of the next keyblock to return.  */
+  int rc;                 /* The return code of the last read_block.  */
+  int rc_v3keys;          /* and its V3 key count.  */
+  int carry_v3keys;       /* V3 keys of frames without a keyblock.  */
+  int framing;            /* Input is split into frames.  */
+  int in_batch;           /* Set if we called keydb_begin_batch.  */
+  u32 start_time;         /* Start of the import.  */
+};
+
+/* A packet parsed by a worker thread and the return code of
+ * parse_packet.  */
+struct parsed_packet_s
+{
+  PACKET pkt;
+  int rc;
+};
+
+/* The raw packets of one keyblock of the input and the result of
+ * parsing them.  */
+struct bulk_frame_s
+{
+  iobuf_t inp;            /* A memory stream with the packets.  */
+  int has_key;            /* The frame starts with a primary key.  */
+  struct parsed_packet_s *parsed;
+  int nparsed;
+  int allocated;
+  int next;               /* Index of the next packet for read_block.  */
+  gpg_error_t err;        /* Error while storing the packets.  */
+};
+
+/* The parsing jobs for the worker threads.  */
+struct frame_jobs_s
+{
+  npth_mutex_t lock;
+  struct bulk_frame_s *frames;
+  int nframes;
+  int next;               /* Index of the next frame to parse.  */
+  int skip_meta;
 };
 
 
@@ -102,7 +154,8 @@ static int import (ctrl_t ctrl,
 		   unsigned char **fpr, size_t *fpr_len, unsigned int options,
 		   import_screener_t screener, void *screener_arg,
                    int origin, const char *url);
-static int read_block (IOBUF a, unsigned int options,
+static int read_block (IOBUF a, struct bulk_frame_s *frame,
+                       unsigned int options,
                        PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys);
 static void revocation_present (ctrl_t ctrl, kbnode_t keyblock);
 static gpg_error_t import_one (ctrl_t ctrl,
@@ -196,6 +249,9 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"self-sigs-only", IMPORT_SELF_SIGS_ONLY, NULL,
        N_("ignore key-signatures which are not self-signatures")},
 
+      {"bulk", IMPORT_BULK, NULL,
+       N_("speed up the import of many keys")},
+
       {"import-export", IMPORT_EXPORT, NULL,
        N_("run import filters and export key immediately")},
 
@@ -365,7 +421,8 @@ read_key_from_file (ctrl_t ctrl, const char *fname, kbnode_t *r_keyblock)
   }
 
   /* Read the first non-v3 keyblock.  */
-  while (!(err = read_block (inp, 0, &pending_pkt, &keyblock, &v3keys)))
+  while (!(err = read_block (inp, NULL, 0, &pending_pkt,
+                             &keyblock, &v3keys)))
     {
       if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
         break;
@@ -508,6 +565,13 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 	}
     }
 
+  /* With import option "bulk" the trustdb is marked only once.  */
+  if (stats->bulk_changes)
+    {
+      revalidation_mark (ctrl);
+      stats->bulk_changes = 0;
+    }
+
   if (!stats_handle)
     {
       if ((options & (IMPORT_SHOW | IMPORT_DRY_RUN))
@@ -567,6 +631,425 @@ import_keys_es_stream (ctrl_t ctrl, estream_t fp,
 }
 
 
+/* Mark the trustdb for revalidation after the keyblock of PK has
+ * been changed by the import.  With import option "bulk" the change
+ * is only counted in STATS and import_keys_internal marks the trustdb
+ * once for all keys.  */
+static void
+import_revalidation_mark (ctrl_t ctrl, PKT_public_key *pk,
+                          unsigned int options, struct import_stats_s *stats)
+{
+  if ((options & IMPORT_BULK))
+    stats->bulk_changes++;
+  else
+    revalidation_mark_key (ctrl, pk);
+}
+
+
+/* Check the self-signatures of the NBLOCKS keyblocks in BLOCKS using
+ * the threads configured by --sig-check-threads.  The results are
+ * stored in the cache flags of the signatures and thus chk_self_sigs
+ * later finds them there.  */
+static void
+bulk_check_self_sigs (ctrl_t ctrl, kbnode_t *blocks, int nblocks)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 keyid[2];
+  int i;
+
+  sig_check_defer_begin ();
+  for (i=0; i < nblocks; i++)
+    {
+      if (blocks[i]->pkt->pkttype != PKT_PUBLIC_KEY)
+        continue;
+      keyid_from_pk (blocks[i]->pkt->pkt.public_key, keyid);
+      for (node=blocks[i]->next; node; node = node->next)
+        {
+          if (node->pkt->pkttype != PKT_SIGNATURE)
+            continue;
+          sig = node->pkt->pkt.signature;
+          if (sig->flags.checked
+              || keyid[0] != sig->keyid[0] || keyid[1] != sig->keyid[1])
+            continue;
+          check_key_signature (ctrl, blocks[i], node, NULL);
+        }
+    }
+  sig_check_defer_end (opt.sig_check_threads);
+}
+
+
+/* Read the raw packets of the next keyblock from A into the frame F.
+ * A frame ends before the next primary key packet; a frame without a
+ * primary key ends after a signature so that it holds at most one
+ * revocation certificate.  Returns true if the input can't be framed
+ * any further, either due to EOF or due to a packet which read_block
+ * needs to see.  */
+static int
+read_frame (IOBUF a, struct bulk_frame_s *f)
+{
+  membuf_t mb;
+  byte hdr[6];
+  byte *buf = NULL;
+  size_t len, nread;
+  int n, pkttype, stop;
+  void *image;
+
+  init_membuf (&mb, 4096);
+  nread = 0;
+  stop = 0;
+  for (;;)
+    {
+      n = iobuf_peek (a, hdr, sizeof hdr);
+      if (n <= 0)
+        {
+          stop = 1;  /* EOF.  */
+          break;
+        }
+      len = packet_length_from_header (hdr, n, &pkttype);
+      if (!len || pkttype == PKT_COMPRESSED)
+        {
+          stop = 1;
+          break;
+        }
+      if (pkttype == PKT_PUBLIC_KEY || pkttype == PKT_SECRET_KEY)
+        {
+          if (nread)
+            break;
+          f->has_key = 1;
+        }
+
+      xfree (buf);
+      buf = xtrymalloc (len);
+      if (!buf)
+        {
+          f->err = gpg_error_from_syserror ();
+          stop = 1;
+          break;
+        }
+      n = iobuf_read (a, buf, len);
+      if (n < 0)
+        n = 0;
+      put_membuf (&mb, buf, n);
+      nread += n;
+      if (n != (int)len)
+        {
+          stop = 1;  /* Truncated; read_block will complain.  */
+          break;
+        }
+      if (!f->has_key && pkttype == PKT_SIGNATURE)
+        break;
+    }
+  xfree (buf);
+
+  image = get_membuf (&mb, &len);
+  if (!image)
+    {
+      if (!f->err)
+        f->err = gpg_error_from_syserror ();
+    }
+  else if (len)
+    f->inp = iobuf_temp_with_content (image, len);
+  xfree (image);
+  return stop;
+}
+
+
+/* Parse all packets of frame F.  This is called by the worker
+ * threads without holding the nPth lock and must thus only use
+ * thread safe functions.  */
+static void
+parse_frame (struct bulk_frame_s *f, int skip_meta)
+{
+  struct parse_packet_ctx_s parsectx;
+  struct parsed_packet_s *tmp;
+  int rc;
+
+  if (f->err)
+    return;
+
+  init_parse_packet (&parsectx, f->inp);
+  parsectx.skip_meta = skip_meta;
+  parsectx.no_pool = 1;
+  for (;;)
+    {
+      if (f->nparsed == f->allocated)
+        {
+          tmp = xtryrealloc (f->parsed, (f->allocated + 16) * sizeof *tmp);
+          if (!tmp)
+            {
+              f->err = gpg_error_from_syserror ();
+              break;
+            }
+          f->parsed = tmp;
+          f->allocated += 16;
+        }
+      init_packet (&f->parsed[f->nparsed].pkt);
+      rc = parse_packet (&parsectx, &f->parsed[f->nparsed].pkt);
+      if (rc == -1)
+        break;
+      f->parsed[f->nparsed++].rc = rc;
+      /* Stop at errors which also stop read_block.  */
+      if (rc && gpg_err_code (rc) != GPG_ERR_LEGACY_KEY
+          && gpg_err_code (rc) != GPG_ERR_UNKNOWN_PACKET
+          && gpg_err_code (rc) != GPG_ERR_INV_PACKET)
+        break;
+    }
+  /* The packets are owned by F; thus we do not deinit PARSECTX which
+   * only holds a shallow copy of the last packet.  */
+}
+
+
+/* The worker thread for parse_frames.  */
+static void *
+parse_frame_worker (void *arg)
+{
+  struct frame_jobs_s *jobs = arg;
+  struct bulk_frame_s *f;
+
+  for (;;)
+    {
+      npth_mutex_lock (&jobs->lock);
+      f = jobs->next < jobs->nframes? jobs->frames + jobs->next++ : NULL;
+      npth_mutex_unlock (&jobs->lock);
+      if (!f)
+        break;
+
+      /* The frame and its memory stream are only used by us.  */
+      npth_unprotect ();
+      parse_frame (f, jobs->skip_meta);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Parse the NFRAMES frames at FRAMES using the threads configured by
+ * --sig-check-threads.  */
+static void
+parse_frames (struct bulk_frame_s *frames, int nframes, int skip_meta)
+{
+  struct frame_jobs_s jobs;
+  npth_t threads[SIG_CHECK_MAX_THREADS];
+  npth_attr_t tattr;
+  int nthreads, nstarted, i, rc;
+
+  nthreads = opt.sig_check_threads;
+  if (nthreads > SIG_CHECK_MAX_THREADS)
+    nthreads = SIG_CHECK_MAX_THREADS;
+  if (nthreads > nframes)
+    nthreads = nframes;
+
+  npth_mutex_init (&jobs.lock, NULL);
+  jobs.frames = frames;
+  jobs.nframes = nframes;
+  jobs.next = 0;
+  jobs.skip_meta = skip_meta;
+  nstarted = 0;
+  if (nthreads > 1 && !npth_attr_init (&tattr))
+    {
+      /* The main thread is the first worker.  */
+      for (i = 1; i < nthreads; i++)
+        {
+          rc = npth_create (&threads[nstarted], &tattr,
+                            parse_frame_worker, &jobs);
+          if (rc)
+            {
+              log_error ("error spawning parser thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  parse_frame_worker (&jobs);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&jobs.lock);
+}
+
+
+/* Move the next packet parsed by parse_frame from F to PKT and
+ * return its parse_packet return code.  Returns -1 if there are no
+ * more packets.  */
+static int
+next_frame_packet (struct bulk_frame_s *f, PACKET *pkt)
+{
+  if (f->next == f->nparsed)
+    return -1;
+  *pkt = f->parsed[f->next].pkt;
+  init_packet (&f->parsed[f->next].pkt);
+  return f->parsed[f->next++].rc;
+}
+
+
+/* Release the memory stream and the remaining packets of F.  */
+static void
+release_frame (struct bulk_frame_s *f)
+{
+  for (; f->next < f->nparsed; f->next++)
+    free_packet (&f->parsed[f->next].pkt, NULL);
+  xfree (f->parsed);
+  iobuf_close (f->inp);
+}
+
+
+/* Fill the queue Q with the keyblocks of up to IMPORT_BULK_BATCH
+ * frames read from A.  The frames are parsed in parallel and the
+ * keyblocks are then built in input order by read_block.  */
+static void
+read_bulk_frames (IOBUF a, unsigned int options, struct bulk_queue_s *q)
+{
+  struct bulk_frame_s frames[IMPORT_BULK_BATCH];
+  PACKET *pending_pkt = NULL;
+  int nframes, i, rc, v3keys;
+
+  memset (frames, 0, sizeof frames);
+  for (nframes = 0; nframes < IMPORT_BULK_BATCH && q->framing; )
+    {
+      if (read_frame (a, frames + nframes))
+        q->framing = 0;
+      if (frames[nframes].inp || frames[nframes].err)
+        nframes++;
+    }
+
+  parse_frames (frames, nframes, !(options & IMPORT_RESTORE));
+
+  for (i = 0; i < nframes; i++)
+    {
+      if (!q->rc)
+        {
+          if (frames[i].err)
+            {
+              log_error ("read_block: read error: %s\n",
+                         gpg_strerror (frames[i].err));
+              rc = GPG_ERR_INV_KEYRING;
+              v3keys = 0;
+            }
+          else
+            rc = read_block (NULL, frames + i, options, &pending_pkt,
+                             &q->blocks[q->nblocks], &v3keys);
+          if (!rc)
+            {
+              q->v3keys[q->nblocks++] = q->carry_v3keys + v3keys;
+              q->carry_v3keys = 0;
+            }
+          else if (rc == -1)
+            q->carry_v3keys += v3keys;
+          else
+            {
+              q->rc = rc;
+              q->rc_v3keys = v3keys;
+            }
+          /* A frame holds at most one keyblock.  */
+          if (pending_pkt)
+            {
+              free_packet (pending_pkt, NULL);
+              xfree (pending_pkt);
+              pending_pkt = NULL;
+            }
+        }
+      release_frame (frames + i);
+    }
+}
+
+
+/* The version of read_block used with import option "bulk".  It
+ * reads up to IMPORT_BULK_BATCH keyblocks ahead, checks their
+ * self-signatures in parallel and keeps the key database locked
+ * while the caller imports them.  With more than one thread
+ * configured by --sig-check-threads the input is first split into
+ * frames of raw packets which are parsed in parallel.  */
+static int
+read_bulk_block (ctrl_t ctrl, IOBUF a, unsigned int options,
+                 PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys,
+                 struct bulk_queue_s *q, struct import_stats_s *stats)
+{
+  char buf[50];
+
+  if (q->next == q->nblocks)
+    {
+      if (q->in_batch)
+        {
+          keydb_end_batch ();
+          q->in_batch = 0;
+        }
+      if (q->nblocks && q->rc)
+        goto leave;
+
+      if (!q->start_time)
+        {
+          q->start_time = make_timestamp ();
+          q->framing = (opt.sig_check_threads > 1);
+        }
+      snprintf (buf, sizeof buf, "import ? %lu 0", stats->count);
+      write_status_text (STATUS_PROGRESS, buf);
+
+      q->nblocks = q->next = 0;
+      while (!q->nblocks && !q->rc)
+        {
+          if (q->framing)
+            read_bulk_frames (a, options, q);
+          else
+            {
+              while (q->nblocks < IMPORT_BULK_BATCH
+                     && !(q->rc = read_block (a, NULL, options, pending_pkt,
+                                              &q->blocks[q->nblocks],
+                                              &q->rc_v3keys)))
+                {
+                  q->v3keys[q->nblocks++] = q->carry_v3keys + q->rc_v3keys;
+                  q->carry_v3keys = 0;
+                }
+            }
+        }
+      if (!q->nblocks)
+        goto leave;
+
+      if (opt.sig_check_threads > 0 && !opt.no_sig_cache)
+        bulk_check_self_sigs (ctrl, q->blocks, q->nblocks);
+      if (!(opt.dry_run || (options & IMPORT_DRY_RUN))
+          && !keydb_begin_batch (ctrl))
+        q->in_batch = 1;
+    }
+
+  *ret_root = q->blocks[q->next];
+  *r_v3keys = q->v3keys[q->next];
+  q->blocks[q->next++] = NULL;
+  return 0;
+
+ leave:
+  *r_v3keys = q->carry_v3keys + q->rc_v3keys;
+  q->carry_v3keys = q->rc_v3keys = 0;
+  return q->rc;
+}
+
+
+/* Release the read ahead queue Q and report the throughput.  */
+static void
+release_bulk_queue (struct bulk_queue_s *q, struct import_stats_s *stats)
+{
+  char buf[50];
+  u32 secs;
+
+  if (q->in_batch)
+    keydb_end_batch ();
+  for (; q->next < q->nblocks; q->next++)
+    release_kbnode (q->blocks[q->next]);
+
+  snprintf (buf, sizeof buf, "import X %lu %lu", stats->count, stats->count);
+  write_status_text (STATUS_PROGRESS, buf);
+  if (opt.verbose && q->start_time)
+    {
+      secs = make_timestamp () - q->start_time;
+      log_info ("%lu keys processed in %lu seconds (%lu keys/s)\n",
+                stats->count, (ulong)secs,
+                secs? stats->count / secs : stats->count);
+    }
+}
+
+
 static int
 import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
 	unsigned char **fpr,size_t *fpr_len, unsigned int options,
@@ -578,10 +1061,12 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
                                 grasp the return semantics of
                                 read_block. */
   kbnode_t secattic = NULL;  /* Kludge for PGP desktop percularity */
+  struct bulk_queue_s bulkq;
   int rc = 0;
   int v3keys;
 
   getkey_disable_caches ();
+  memset (&bulkq, 0, sizeof bulkq);
 
   if (!opt.no_armor) /* Armored reading is not disabled.  */
     {
@@ -593,7 +1078,11 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       release_armor_context (afx);
     }
 
-  while (!(rc = read_block (inp, options, &pending_pkt, &keyblock, &v3keys)))
+  while (!(rc = ((options & IMPORT_BULK)
+                 ? read_bulk_block (ctrl, inp, options, &pending_pkt,
+                                    &keyblock, &v3keys, &bulkq, stats)
+                 : read_block (inp, NULL, options, &pending_pkt,
+                               &keyblock, &v3keys))))
     {
       stats->v3keys += v3keys;
       if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
@@ -691,6 +1180,8 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
   else if (rc && gpg_err_code (rc) != GPG_ERR_INV_KEYRING)
     log_error (_("error reading '%s': %s\n"), fname, gpg_strerror (rc));
 
+  if ((options & IMPORT_BULK))
+    release_bulk_queue (&bulkq, stats);
   release_kbnode (secattic);
 
   /* When read_block loop was stopped by error, we have PENDING_PKT left.  */
@@ -732,7 +1223,8 @@ import_old_secring (ctrl_t ctrl, const char *fname)
 
   getkey_disable_caches();
   stats = import_new_stats_handle ();
-  while (!(err = read_block (inp, 0, &pending_pkt, &keyblock, &v3keys)))
+  while (!(err = read_block (inp, NULL, 0, &pending_pkt,
+                             &keyblock, &v3keys)))
     {
       if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
         {
@@ -857,7 +1349,7 @@ valid_keyblock_packet (int pkttype)
  * integer at R_V3KEY counts the number of unsupported v3 keyblocks.
  */
 static int
-read_block( IOBUF a, unsigned int options,
+read_block( IOBUF a, struct bulk_frame_s *frame, unsigned int options,
             PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys)
 {
   int rc;
@@ -869,6 +1361,7 @@ read_block( IOBUF a, unsigned int options,
   u32 keyid[2];
   int got_keyid = 0;
   unsigned int dropped_nonselfsigs = 0;
+  unsigned int nsigs = 0;  /* Non-self-sigs after the last uid or key.  */
 
   *r_v3keys = 0;
 
@@ -885,6 +1378,8 @@ read_block( IOBUF a, unsigned int options,
   else
     in_cert = 0;
 
+  if (frame)
+    a = frame->inp;
   pkt = xmalloc (sizeof *pkt);
   init_packet (pkt);
   init_parse_packet (&parsectx, a);
@@ -892,7 +1387,8 @@ read_block( IOBUF a, unsigned int options,
     parsectx.skip_meta = 1;
   in_v3key = 0;
   skip_sigs = 0;
-  while ((rc=parse_packet (&parsectx, pkt)) != -1)
+  while ((rc = (frame? next_frame_packet (frame, pkt)
+                : parse_packet (&parsectx, pkt))) != -1)
     {
       if (rc && (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY
                  && (pkt->pkttype == PKT_PUBLIC_KEY
@@ -998,7 +1494,7 @@ read_block( IOBUF a, unsigned int options,
         case PKT_SIGNATURE:
           if (!in_cert)
             goto x_default;
-          if (!(options & IMPORT_SELF_SIGS_ONLY))
+          if (!(options & IMPORT_SELF_SIGS_ONLY) && !opt.import_max_sigs)
             goto x_default;
           log_assert (got_keyid);
 	  if (pkt->pkt.signature->keyid[0] == keyid[0]
@@ -1015,14 +1511,28 @@ read_block( IOBUF a, unsigned int options,
                * way to drop non-self-signatures.  */
               goto x_default;
             }
+          /* Drop the signatures exceeding --import-max-sigs while
+           * streaming so that flooded keys never make it into the
+           * kbnode list.  */
+          if (!(options & IMPORT_SELF_SIGS_ONLY)
+              && ++nsigs <= opt.import_max_sigs)
+            goto x_default;
           /* Skip this signature.  */
           dropped_nonselfsigs++;
           free_packet (pkt, &parsectx);
           init_packet(pkt);
           break;
 
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SECRET_SUBKEY:
+          nsigs = 0;
+          goto x_default;
+
         case PKT_PUBLIC_KEY:
         case PKT_SECRET_KEY:
+          nsigs = 0;
           if (!got_keyid)
             {
               keyid_from_pk (pkt->pkt.public_key, keyid);
@@ -1068,7 +1578,8 @@ read_block( IOBUF a, unsigned int options,
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
   xfree( pkt );
-  if (!rc && dropped_nonselfsigs && opt.verbose)
+  if (!rc && dropped_nonselfsigs
+      && (opt.verbose || !(options & IMPORT_SELF_SIGS_ONLY)))
     log_info ("key %s: number of dropped non-self-signatures: %u\n",
               keystr (keyid), dropped_nonselfsigs);
 
@@ -2094,7 +2605,7 @@ import_one_real (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, pk, options, stats);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2187,7 +2698,7 @@ import_one_real (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, pk, options, stats);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -3464,7 +3975,7 @@ import_revoke_cert (ctrl_t ctrl, kbnode_t node, unsigned int options,
       if (get_ownertrust (ctrl, pk) == TRUST_ULTIMATE)
         clear_ownertrusts (ctrl, pk);
 
-      revalidation_mark (ctrl);
+      import_revalidation_mark (ctrl, pk, options, stats);
     }
   stats->n_revoc++;
 
@@ -3928,6 +4439,162 @@ remove_all_non_self_sigs (kbnode_t *keyblock, u32 *keyid)
 }
 
 
+/* A hash set of signature or user ID nodes used for merging.  */
+struct node_set_s
+{
+  unsigned int nbuckets;     /* A power of 2.  */
+  unsigned int *buckets;     /* Index + 1 into ENTRIES or 0.  */
+  unsigned int nentries;
+  unsigned int size;         /* Allocated number of ENTRIES.  */
+  struct {
+    kbnode_t node;
+    u32 hash;
+    unsigned int next;       /* Index + 1 of the next entry or 0.  */
+  } *entries;
+};
+
+
+/* Return a hash value for the signature SIG.  Signatures considered
+ * equal by cmp_signatures have the same signer and, because the
+ * signature value covers them, the same creation time and digest
+ * prefix.  */
+static u32
+sig_hash_value (PKT_signature *sig)
+{
+  u32 h;
+
+  h = sig->keyid[0] ^ sig->keyid[1] ^ sig->pubkey_algo;
+  h = h * 0x9e3779b1 ^ sig->timestamp;
+  h = h * 0x9e3779b1 ^ (sig->digest_start[0] << 8 | sig->digest_start[1]);
+  return h ^ (h >> 16);
+}
+
+
+/* Return a hash value for the user ID or attribute UID.  */
+static u32
+uid_hash_value (PKT_user_id *uid)
+{
+  const unsigned char *p;
+  size_t n;
+  u32 h = 2166136261;  /* FNV-1a */
+
+  if (uid->attrib_data)
+    {
+      p = uid->attrib_data;
+      n = uid->attrib_len;
+      h ^= 1;
+    }
+  else
+    {
+      p = (const unsigned char *)uid->name;
+      n = uid->len;
+    }
+  for (; n; n--, p++)
+    h = (h ^ *p) * 16777619;
+  return h;
+}
+
+
+/* Return the hash value for NODE which is either a signature or a
+ * user ID.  */
+static u32
+node_hash_value (kbnode_t node)
+{
+  if (node->pkt->pkttype == PKT_SIGNATURE)
+    return sig_hash_value (node->pkt->pkt.signature);
+  return uid_hash_value (node->pkt->pkt.user_id);
+}
+
+
+/* Return 0 if the signatures or user IDs A and B are equal.  */
+static int
+node_cmp (kbnode_t a, kbnode_t b)
+{
+  if (a->pkt->pkttype != b->pkt->pkttype)
+    return 1;
+  if (a->pkt->pkttype == PKT_SIGNATURE)
+    return cmp_signatures (a->pkt->pkt.signature, b->pkt->pkt.signature);
+  return cmp_user_ids (a->pkt->pkt.user_id, b->pkt->pkt.user_id);
+}
+
+
+/* Initialize SET for up to SIZE nodes.  */
+static gpg_error_t
+node_set_init (struct node_set_s *set, unsigned int size)
+{
+  memset (set, 0, sizeof *set);
+  for (set->nbuckets = 16; set->nbuckets < size; set->nbuckets <<= 1)
+    ;
+  set->size = size? size : 1;
+  set->buckets = xtrycalloc (set->nbuckets, sizeof *set->buckets);
+  set->entries = xtrycalloc (set->size, sizeof *set->entries);
+  if (!set->buckets || !set->entries)
+    {
+      xfree (set->buckets);
+      xfree (set->entries);
+      return gpg_error_from_syserror ();
+    }
+  return 0;
+}
+
+
+static void
+node_set_release (struct node_set_s *set)
+{
+  xfree (set->buckets);
+  xfree (set->entries);
+}
+
+
+/* Return the first node added to SET which equals NODE or NULL.  */
+static kbnode_t
+node_set_find (struct node_set_s *set, kbnode_t node)
+{
+  u32 h = node_hash_value (node);
+  unsigned int i;
+  kbnode_t found = NULL;
+
+  /* Entries are prepended to the buckets; thus we need to go to the
+   * end to return the first one.  */
+  for (i = set->buckets[h & (set->nbuckets - 1)]; i;
+       i = set->entries[i-1].next)
+    if (set->entries[i-1].hash == h
+        && !node_cmp (node, set->entries[i-1].node))
+      found = set->entries[i-1].node;
+  return found;
+}
+
+
+/* Add NODE to SET.  The caller must make sure that SET was
+ * initialized with a sufficient size.  */
+static void
+node_set_add (struct node_set_s *set, kbnode_t node)
+{
+  u32 h = node_hash_value (node);
+  unsigned int idx = h & (set->nbuckets - 1);
+
+  log_assert (set->nentries < set->size);
+  set->entries[set->nentries].node = node;
+  set->entries[set->nentries].hash = h;
+  set->entries[set->nentries].next = set->buckets[idx];
+  set->buckets[idx] = ++set->nentries;
+}
+
+
+/* Return the number of nodes of type PKTTYPE in the list starting at
+ * NODE up to the next node of type STOPTYPE.  */
+static unsigned int
+count_nodes (kbnode_t node, int pkttype, int stoptype)
+{
+  unsigned int count = 0;
+
+  for (; node && node->pkt->pkttype != stoptype; node = node->next)
+    if (node->pkt->pkttype == pkttype)
+      count++;
+  return count;
+}
+
+
 /*
  * It may happen that the imported keyblock has duplicated user IDs.
  * We check this here and collapse those user IDs together with their
@@ -3937,99 +4604,96 @@ remove_all_non_self_sigs (kbnode_t *keyblock, u32 *keyid)
 int
 collapse_uids (kbnode_t *keyblock)
 {
-  kbnode_t uid1;
+  gpg_error_t err;
+  kbnode_t node, prev, uid1, uid2, last, sig;
+  struct node_set_s uids, sigs;
+  unsigned int count;
   int any=0;
 
-  for(uid1=*keyblock;uid1;uid1=uid1->next)
+  err = node_set_init (&uids, count_nodes (*keyblock, PKT_USER_ID, 0));
+  if (err)
     {
-      kbnode_t uid2;
+      log_error ("error collapsing user IDs: %s\n", gpg_strerror (err));
+      return 0;
+    }
 
-      if(is_deleted_kbnode(uid1))
+  for (prev=NULL, node=*keyblock; node; prev=node, node=node->next)
+    {
+      if(is_deleted_kbnode(node))
 	continue;
 
-      if(uid1->pkt->pkttype!=PKT_USER_ID)
+      if(node->pkt->pkttype!=PKT_USER_ID)
 	continue;
 
-      for(uid2=uid1->next;uid2;uid2=uid2->next)
-	{
-	  if(is_deleted_kbnode(uid2))
-	    continue;
-
-	  if(uid2->pkt->pkttype!=PKT_USER_ID)
-	    continue;
-
-	  if(cmp_user_ids(uid1->pkt->pkt.user_id,
-			  uid2->pkt->pkt.user_id)==0)
-	    {
-	      /* We have a duplicated uid */
-	      kbnode_t sig1,last;
-
-	      any=1;
-
-	      /* Now take uid2's signatures, and attach them to
-		 uid1 */
-	      for(last=uid2;last->next;last=last->next)
-		{
-		  if(is_deleted_kbnode(last))
-		    continue;
-
-		  if(last->next->pkt->pkttype==PKT_USER_ID
-		     || last->next->pkt->pkttype==PKT_PUBLIC_SUBKEY
-		     || last->next->pkt->pkttype==PKT_SECRET_SUBKEY)
-		    break;
-		}
+      uid1 = node_set_find (&uids, node);
+      if (!uid1)
+        {
+          node_set_add (&uids, node);
+          continue;
+        }
 
-	      /* Snip out uid2 */
-	      (find_prev_kbnode(*keyblock,uid2,0))->next=last->next;
+      /* We have a duplicated uid */
+      uid2 = node;
+      any=1;
 
-	      /* Now put uid2 in place as part of uid1 */
-	      last->next=uid1->next;
-	      uid1->next=uid2;
-	      delete_kbnode(uid2);
+      /* Now take uid2's signatures, and attach them to uid1 */
+      for(last=uid2;last->next;last=last->next)
+        {
+          if(is_deleted_kbnode(last))
+            continue;
 
-	      /* Now dedupe uid1 */
-	      for(sig1=uid1->next;sig1;sig1=sig1->next)
-		{
-		  kbnode_t sig2;
+          if(last->next->pkt->pkttype==PKT_USER_ID
+             || last->next->pkt->pkttype==PKT_PUBLIC_SUBKEY
+             || last->next->pkt->pkttype==PKT_SECRET_SUBKEY)
+            break;
+        }
 
-		  if(is_deleted_kbnode(sig1))
-		    continue;
+      /* Snip out uid2 and continue after it */
+      prev->next=last->next;
+      node=prev;
 
-		  if(sig1->pkt->pkttype==PKT_USER_ID
-		     || sig1->pkt->pkttype==PKT_PUBLIC_SUBKEY
-		     || sig1->pkt->pkttype==PKT_SECRET_SUBKEY)
-		    break;
+      /* Now put uid2 in place as part of uid1 */
+      last->next=uid1->next;
+      uid1->next=uid2;
+      delete_kbnode(uid2);
 
-		  if(sig1->pkt->pkttype!=PKT_SIGNATURE)
-		    continue;
+      /* Now dedupe uid1 */
+      count = 0;
+      for(sig=uid1->next;sig;sig=sig->next)
+        {
+          if(is_deleted_kbnode(sig))
+            continue;
+          if(sig->pkt->pkttype==PKT_USER_ID
+             || sig->pkt->pkttype==PKT_PUBLIC_SUBKEY
+             || sig->pkt->pkttype==PKT_SECRET_SUBKEY)
+            break;
+          count++;
+        }
+      if (node_set_init (&sigs, count))
+        continue;  /* Keep the duplicates.  */
 
-		  for(sig2=sig1->next,last=sig1;sig2;last=sig2,sig2=sig2->next)
-		    {
-		      if(is_deleted_kbnode(sig2))
-			continue;
+      for(sig=uid1->next;sig;sig=sig->next)
+        {
+          if(is_deleted_kbnode(sig))
+            continue;
 
-		      if(sig2->pkt->pkttype==PKT_USER_ID
-			 || sig2->pkt->pkttype==PKT_PUBLIC_SUBKEY
-			 || sig2->pkt->pkttype==PKT_SECRET_SUBKEY)
-			break;
+          if(sig->pkt->pkttype==PKT_USER_ID
+             || sig->pkt->pkttype==PKT_PUBLIC_SUBKEY
+             || sig->pkt->pkttype==PKT_SECRET_SUBKEY)
+            break;
 
-		      if(sig2->pkt->pkttype!=PKT_SIGNATURE)
-			continue;
+          if(sig->pkt->pkttype!=PKT_SIGNATURE)
+            continue;
 
-		      if(cmp_signatures(sig1->pkt->pkt.signature,
-					sig2->pkt->pkt.signature)==0)
-			{
-			  /* We have a match, so delete the second
-			     signature */
-			  delete_kbnode(sig2);
-			  sig2=last;
-			}
-		    }
-		}
-	    }
-	}
+          if (node_set_find (&sigs, sig))
+            delete_kbnode(sig); /* We have a match, so delete it */
+          else
+            node_set_add (&sigs, sig);
+        }
+      node_set_release (&sigs);
     }
 
+  node_set_release (&uids);
   commit_kbnode(keyblock);
 
   if(any && !opt.quiet)
@@ -4155,6 +4819,7 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
 {
   kbnode_t onode, node;
   int rc, found;
+  struct node_set_s uids;
 
   /* 1st: handle revocation certificates */
   for (node=keyblock->next; node; node=node->next )
@@ -4233,46 +4898,59 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
     }
 
   /* 3rd: try to merge new certificates in */
+  rc = node_set_init (&uids, count_nodes (keyblock, PKT_USER_ID, 0));
+  if (rc)
+    return rc;
+  for (node=keyblock->next; node; node=node->next)
+    if (node->pkt->pkttype == PKT_USER_ID && !node_set_find (&uids, node))
+      node_set_add (&uids, node);
   for (onode=keyblock_orig->next; onode; onode=onode->next)
     {
       if (!(onode->flag & NODE_FLAG_A) && onode->pkt->pkttype == PKT_USER_ID)
         {
           /* find the user id in the imported keyblock */
-          for (node=keyblock->next; node; node=node->next)
-            if (node->pkt->pkttype == PKT_USER_ID
-                && !cmp_user_ids( onode->pkt->pkt.user_id,
-                                  node->pkt->pkt.user_id ) )
-              break;
+          node = node_set_find (&uids, onode);
           if (node ) /* found: merge */
             {
               rc = merge_sigs (onode, node, n_sigs);
               if (rc )
-                return rc;
+                {
+                  node_set_release (&uids);
+                  return rc;
+                }
 	    }
 	}
     }
+  node_set_release (&uids);
 
   /* 4th: add new user-ids */
+  rc = node_set_init (&uids, (count_nodes (keyblock_orig, PKT_USER_ID, 0)
+                              + count_nodes (keyblock, PKT_USER_ID, 0)));
+  if (rc)
+    return rc;
+  for (onode=keyblock_orig->next; onode; onode=onode->next )
+    if (onode->pkt->pkttype == PKT_USER_ID && !node_set_find (&uids, onode))
+      node_set_add (&uids, onode);
   for (node=keyblock->next; node; node=node->next)
     {
       if (node->pkt->pkttype == PKT_USER_ID)
         {
           /* do we have this in the original keyblock */
-          for (onode=keyblock_orig->next; onode; onode=onode->next )
-            if (onode->pkt->pkttype == PKT_USER_ID
-                && !cmp_user_ids( onode->pkt->pkt.user_id,
-                                  node->pkt->pkt.user_id ) )
-              break;
-          if (!onode ) /* this is a new user id: append */
+          if (!node_set_find (&uids, node)) /* this is a new user id: append */
             {
               rc = append_new_uid (options, keyblock_orig, node,
                                    curtime, origin, url, n_sigs);
               if (rc )
-                return rc;
+                {
+                  node_set_release (&uids);
+                  return rc;
+                }
+              node_set_add (&uids, node);
               ++*n_uids;
 	    }
 	}
     }
+  node_set_release (&uids);
 
   /* 5th: add new subkeys */
   for (node=keyblock->next; node; node=node->next)
@@ -4411,12 +5089,32 @@ append_new_uid (unsigned int options,
 static int
 merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 {
-  kbnode_t n, n2;
-  int found = 0;
+  gpg_error_t err;
+  kbnode_t n, n2, last;
+  struct node_set_s set;
 
   log_assert (dst->pkt->pkttype == PKT_USER_ID);
   log_assert (src->pkt->pkttype == PKT_USER_ID);
 
+  /* Flooded keys may carry a huge number of signatures; thus we use
+   * a hash set instead of comparing each new signature with all
+   * existing ones.  */
+  err = node_set_init (&set,
+                       count_nodes (dst->next, PKT_SIGNATURE, PKT_USER_ID)
+                       + count_nodes (src->next, PKT_SIGNATURE, PKT_USER_ID));
+  if (err)
+    return err;
+  for (n=dst->next; n && n->pkt->pkttype != PKT_USER_ID; n = n->next)
+    if (n->pkt->pkttype == PKT_SIGNATURE)
+      node_set_add (&set, n);
+
+  /* New signatures are inserted after the signatures directly
+   * following DST; this is what insert_kbnode would do.  */
+  for (last = dst;
+       last->next && last->next->pkt->pkttype == PKT_SIGNATURE;
+       last = last->next)
+    ;
+
   for (n=src->next; n && n->pkt->pkttype != PKT_USER_ID; n = n->next)
     {
       if (n->pkt->pkttype != PKT_SIGNATURE )
@@ -4425,26 +5123,23 @@ merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
           || IS_SUBKEY_REV (n->pkt->pkt.signature) )
         continue; /* skip signatures which are only valid on subkeys */
 
-      found = 0;
-      for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
-        if (!cmp_signatures(n->pkt->pkt.signature,n2->pkt->pkt.signature))
-          {
-            found++;
-            break;
-          }
-      if (!found )
+      if (!node_set_find (&set, n))
         {
           /* This signature is new or newer, append N to DST.
            * We add a clone to the original keyblock, because this
            * one is released first */
           n2 = clone_kbnode(n);
-          insert_kbnode( dst, n2, PKT_SIGNATURE );
+          n2->next = last->next;
+          last->next = n2;
+          last = n2;
+          node_set_add (&set, n2);
           n2->flag |= NODE_FLAG_A;
           n->flag |= NODE_FLAG_A;
           ++*n_sigs;
 	}
     }
 
+  node_set_release (&set);
   return 0;
 }
 
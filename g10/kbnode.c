@@ -31,40 +31,72 @@
 
 #define USE_UNUSED_NODES 1
 
+/* Nodes are allocated in slabs of that many nodes.  */
+#define KBNODE_SLAB_NODES 256
+
+struct kbnode_slab_s
+{
+  struct kbnode_slab_s *next;
+  struct kbnode_struct nodes[KBNODE_SLAB_NODES];
+};
+
 static int cleanup_registered;
 static KBNODE unused_nodes;
+static struct kbnode_slab_s *node_slabs;
 
 static void
 release_unused_nodes (void)
 {
 #if USE_UNUSED_NODES
-  while (unused_nodes)
+  while (node_slabs)
     {
-      kbnode_t next = unused_nodes->next;
-      xfree (unused_nodes);
-      unused_nodes = next;
+      struct kbnode_slab_s *next = node_slabs->next;
+      xfree (node_slabs);
+      node_slabs = next;
     }
+  unused_nodes = NULL;
 #endif /*USE_UNUSED_NODES*/
 }
 
 
+#if USE_UNUSED_NODES
+/* Add a new slab of nodes to the list of unused nodes.  */
+static void
+add_node_slab (void)
+{
+  struct kbnode_slab_s *slab;
+  int i;
+
+  slab = xmalloc (sizeof *slab);
+  slab->next = node_slabs;
+  node_slabs = slab;
+  for (i = 0; i < KBNODE_SLAB_NODES; i++)
+    {
+      slab->nodes[i].next = unused_nodes;
+      unused_nodes = slab->nodes + i;
+    }
+}
+#endif /*USE_UNUSED_NODES*/
+
+
 static kbnode_t
 alloc_node (void)
 {
   kbnode_t n;
 
-  n = unused_nodes;
-  if (n)
-    unused_nodes = n->next;
-  else
+  if (!cleanup_registered)
     {
-      if (!cleanup_registered)
-        {
-          cleanup_registered = 1;
-          register_mem_cleanup_func (release_unused_nodes);
-        }
-      n = xmalloc (sizeof *n);
+      cleanup_registered = 1;
+      register_mem_cleanup_func (release_unused_nodes);
     }
+#if USE_UNUSED_NODES
+  if (!unused_nodes)
+    add_node_slab ();
+  n = unused_nodes;
+  unused_nodes = n->next;
+#else
+  n = xmalloc (sizeof *n);
+#endif
   n->next = NULL;
   n->pkt = NULL;
   n->flag = 0;
@@ -118,7 +150,7 @@ release_kbnode( KBNODE n )
 	n2 = n->next;
 	if( !is_cloned_kbnode(n) ) {
             free_packet (n->pkt, NULL);
-            xfree( n->pkt );
+            release_packet_struct (n->pkt);
 	}
 	free_node( n );
 	n = n2;
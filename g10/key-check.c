@@ -89,6 +89,11 @@ sig_comparison (const void *av, const void *bv)
   if (ndataa != ndatab)
     return (ndataa < ndatab)? -1 : 1;
 
+  /* Signatures with invalid values are never identical.  */
+  if (sig_decode_data ((PKT_signature *)a)
+      || sig_decode_data ((PKT_signature *)b))
+    return a < b? -1 : 1;
+
   for (i = 0; i < ndataa; i ++)
     {
       int c = gcry_mpi_cmp (a->data[i], b->data[i]);
@@ -575,7 +580,7 @@ key_check_all_keysigs (ctrl_t ctrl, int mode, kbnode_t kb,
 				     has_selfsig, 0, only_selfsigs);
           }
 
-          if (dump_sig_params)
+          if (dump_sig_params && !sig_decode_data (sig))
             {
               int i;
 
@@ -35,6 +35,39 @@
 #include "key-clean.h"
 
 
+/* Return true if the key which issued SIG is known to be missing.
+ * This is a cheap test done before check_key_signature so that
+ * flooded keys with many signatures from unknown keys do not need a
+ * full check for each signature.  HD is a handle which may be
+ * reused for all signatures of a keyblock; it is created on the first
+ * call.  KIDS is an array with NKIDS key ids of the keyblock itself
+ * which are never considered missing.  */
+static int
+signer_is_missing (ctrl_t ctrl, KEYDB_HANDLE *hd, PKT_signature *sig,
+                   u32 (*kids)[2], int nkids)
+{
+  int i;
+
+  if (!opt.no_sig_cache && sig->flags.checked)
+    return 0;  /* Let check_key_signature use the cached result.  */
+
+  for (i=0; i < nkids; i++)
+    if (kids[i][0] == sig->keyid[0] && kids[i][1] == sig->keyid[1])
+      return 0;
+
+  if (!*hd)
+    {
+      *hd = keydb_new (ctrl);
+      if (!*hd)
+        return 0;
+    }
+  else
+    keydb_search_reset (*hd);
+
+  return gpg_err_code (keydb_search_kid (*hd, sig->keyid)) == GPG_ERR_NOT_FOUND;
+}
+
+
 /*
  * Mark the signature of the given UID which are used to certify it.
  * To do this, we first revmove all signatures which are not valid and
@@ -51,6 +84,33 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
 {
   kbnode_t node;
   PKT_signature *sig;
+  KEYDB_HANDLE hd = NULL;
+  u32 (*kids)[2] = NULL;
+  int nkids = 0;
+
+  /* Collect the key ids of the keyblock; signatures by them are
+   * never skipped by signer_is_missing.  */
+  for (node=keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+        || node->pkt->pkttype == PKT_SECRET_KEY
+        || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+      nkids++;
+  if (nkids)
+    kids = xtrycalloc (nkids, sizeof *kids);
+  if (kids)
+    {
+      nkids = 0;
+      for (node=keyblock; node; node = node->next)
+        if (node->pkt->pkttype == PKT_PUBLIC_KEY
+            || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+            || node->pkt->pkttype == PKT_SECRET_KEY
+            || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+          {
+            keyid_from_pk (node->pkt->pkt.public_key, kids[nkids]);
+            nkids++;
+          }
+    }
 
   /* First check all signatures.  */
   for (node=uidnode->next; node; node = node->next)
@@ -76,6 +136,11 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
 		     invalid signature */
       if (klist && !is_in_klist (klist, sig))
         continue;  /* no need to check it then */
+      if (kids && signer_is_missing (ctrl, &hd, sig, kids, nkids))
+        {
+          node->flag |= 1<<12;
+          continue;
+        }
       if ((rc=check_key_signature (ctrl, keyblock, node, NULL)))
 	{
 	  /* we ignore anything that won't verify, but tag the
@@ -89,6 +154,8 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
   /* Reset the remaining flags. */
   for (; node; node = node->next)
     node->flag &= ~(1<<8 | 1<<9 | 1<<10 | 1<<11 | 1<<12);
+  keydb_release (hd);
+  xfree (kids);
 
   /* kbnode flag usage: bit 9 is here set for signatures to consider,
    * bit 10 will be set by the loop to keep track of keyIDs already
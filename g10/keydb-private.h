@@ -86,6 +86,12 @@ struct keydb_handle_s
   /* Flag set if this handles pertains to call-keyboxd.c.  */
   int use_keyboxd;
 
+  /* Various flags.  */
+  unsigned int last_ubid_valid:1;
+
+  /* The UBID of the last returned keyblock.  */
+  unsigned char last_ubid[20];
+
   /* BEGIN USE_KEYBOXD */
   /* (These fields are only valid if USE_KEYBOXD is set.) */
 
@@ -96,12 +102,6 @@ struct keydb_handle_s
    * into the CTRL->keybox_local list.) */
   keyboxd_local_t kbl;
 
-  /* Various flags.  */
-  unsigned int last_ubid_valid:1;
-
-  /* The UBID of the last returned keyblock.  */
-  unsigned char last_ubid[20];
-
   /* END USE_KEYBOXD */
 
   /* BEGIN !USE_KEYBOXD */
@@ -162,6 +162,8 @@ void internal_keydb_deinit (KEYDB_HANDLE hd);
 gpg_error_t internal_keydb_lock (KEYDB_HANDLE hd);
 
 gpg_error_t internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
+gpg_error_t internal_keydb_get_keyblock_image (KEYDB_HANDLE hd,
+                                               iobuf_t *r_image);
 gpg_error_t internal_keydb_update_keyblock (ctrl_t ctrl,
                                             KEYDB_HANDLE hd, kbnode_t kb);
 gpg_error_t internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb);
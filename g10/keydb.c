@@ -41,6 +41,9 @@
 
 static int active_handles;
 
+/* The handle holding the locks of a batch of updates or NULL.  */
+static KEYDB_HANDLE batch_hd;
+
 
 static struct resource_item all_resources[MAX_KEYDB_RESOURCES];
 static int used_resources;
@@ -101,6 +104,85 @@ struct
 } keydb_stats;
 
 
+
+/* Parsing a keyblock is expensive and operations like --check-sigs
+   or a walk of the web of trust parse the same keyblocks over and
+   over.  Thus we keep a process wide cache of parsed keyblocks.  The
+   cache is keyed by the UBID, i.e. the SHA-1 hash of the keyblock
+   image; thus an entry can only be used for exactly the same image.
+   Callers get a copy of the cached keyblock.  The size of the cache
+   is limited by the number of entries and the total length of the
+   images; the least recently used entries are evicted first.  As with
+   the kid not found cache the whole cache is flushed whenever a key
+   is inserted, updated, or deleted.  */
+
+#define KEYBLOCK_LRU_BUCKETS    256
+#define KEYBLOCK_LRU_MAX_ITEMS  512
+#define KEYBLOCK_LRU_MAX_BYTES  (8*1024*1024)
+
+struct keyblock_lru_item
+{
+  struct keyblock_lru_item *next;   /* Next item in the bucket.  */
+  struct keyblock_lru_item *newer;  /* Links of the LRU list.  */
+  struct keyblock_lru_item *older;
+  kbnode_t keyblock;                /* The parsed keyblock.  */
+  size_t imagelen;                  /* The length of its image.  */
+  byte ubid[20];
+};
+
+static struct keyblock_lru_item *keyblock_lru[KEYBLOCK_LRU_BUCKETS];
+static struct keyblock_lru_item *keyblock_lru_newest;
+static struct keyblock_lru_item *keyblock_lru_oldest;
+
+struct
+{
+  unsigned int count;     /* The current number of cached keyblocks.  */
+  unsigned long bytes;    /* The total length of their images.        */
+  unsigned int hits;      /* Number of keyblocks taken from the cache. */
+  unsigned int misses;    /* Number of keyblocks not in the cache.    */
+  unsigned int evictions; /* Number of evicted keyblocks.             */
+  unsigned int flushes;   /* The number of flushes.                   */
+} keyblock_lru_stats;
+
+
+/* The results of merge_selfsigs are also cached.  merge_selfsigs
+   verifies the self-signatures of a keyblock and computes the
+   validity, expiration and usage of its keys from them; the cache
+   thus stores copies of merged keyblocks keyed by the UBID of the
+   image they were parsed from.  This works in keyboxd mode as well
+   because the keyboxd returns the UBID with each keyblock.  The
+   result also depends on other keys (designated revokers), so the
+   cache is flushed along with the keyblock cache; it is also flushed
+   if it has grown too large.  Finally the result depends on the
+   current time because keys, user IDs and signatures expire or may
+   have been created in the future.  Thus we store the time of the
+   merge and the first date in the keyblock after that time; an entry
+   is not used if the current time is before the former or not before
+   the latter.  */
+
+#define MERGED_CACHE_BUCKETS    256
+#define MERGED_CACHE_MAX_ITEMS  512
+
+struct merged_cache_item
+{
+  struct merged_cache_item *next;
+  kbnode_t keyblock;                /* The merged keyblock.  */
+  u32 merged_at;                    /* The time of the merge.  */
+  u32 valid_until;                  /* The next relevant date or 0.  */
+  byte ubid[20];
+};
+
+static struct merged_cache_item *merged_cache[MERGED_CACHE_BUCKETS];
+
+struct
+{
+  unsigned int count;     /* The current number of cached keyblocks.  */
+  unsigned int hits;      /* Number of keyblocks taken from the cache. */
+  unsigned int misses;    /* Number of keyblocks not in the cache.    */
+  unsigned int flushes;   /* The number of flushes.                   */
+} merged_cache_stats;
+
+
 static int lock_all (KEYDB_HANDLE hd);
 static void unlock_all (KEYDB_HANDLE hd);
 
@@ -189,6 +271,153 @@ kid_not_found_flush (void)
 }
 
 
+/* Remove ITEM from the keyblock cache and release it.  */
+static void
+keyblock_lru_remove (struct keyblock_lru_item *item)
+{
+  struct keyblock_lru_item **pp;
+
+  for (pp = &keyblock_lru[item->ubid[0] % KEYBLOCK_LRU_BUCKETS];
+       *pp != item; pp = &(*pp)->next)
+    ;
+  *pp = item->next;
+
+  if (item->newer)
+    item->newer->older = item->older;
+  else
+    keyblock_lru_newest = item->older;
+  if (item->older)
+    item->older->newer = item->newer;
+  else
+    keyblock_lru_oldest = item->newer;
+
+  keyblock_lru_stats.count--;
+  keyblock_lru_stats.bytes -= item->imagelen;
+  release_kbnode (item->keyblock);
+  xfree (item);
+}
+
+
+/* Flush the cache of merged keyblocks.  */
+static void
+merged_cache_flush (void)
+{
+  struct merged_cache_item *item, *next;
+  int i;
+
+  if (!merged_cache_stats.count)
+    return;
+
+  for (i = 0; i < MERGED_CACHE_BUCKETS; i++)
+    {
+      for (item = merged_cache[i]; item; item = next)
+        {
+          next = item->next;
+          release_kbnode (item->keyblock);
+          xfree (item);
+        }
+      merged_cache[i] = NULL;
+    }
+  merged_cache_stats.count = 0;
+  merged_cache_stats.flushes++;
+}
+
+
+/* Flush the keyblock cache.  */
+static void
+keyblock_lru_flush (void)
+{
+  merged_cache_flush ();
+
+  if (DBG_CACHE)
+    log_debug ("keydb: keyblock_lru_flush\n");
+
+  if (!keyblock_lru_stats.count)
+    return;
+
+  while (keyblock_lru_oldest)
+    keyblock_lru_remove (keyblock_lru_oldest);
+  keyblock_lru_stats.flushes++;
+}
+
+
+/* Return the cached keyblock with UBID or NULL.  The entry is marked
+ * as the most recently used one.  */
+static kbnode_t
+keyblock_lru_get (const byte *ubid)
+{
+  struct keyblock_lru_item *item;
+
+  for (item = keyblock_lru[ubid[0] % KEYBLOCK_LRU_BUCKETS];
+       item; item = item->next)
+    if (!memcmp (item->ubid, ubid, 20))
+      break;
+  if (!item)
+    return NULL;
+
+  if (item->newer)
+    {
+      /* Move to the head of the LRU list.  */
+      item->newer->older = item->older;
+      if (item->older)
+        item->older->newer = item->newer;
+      else
+        keyblock_lru_oldest = item->newer;
+      item->newer = NULL;
+      item->older = keyblock_lru_newest;
+      keyblock_lru_newest->newer = item;
+      keyblock_lru_newest = item;
+    }
+  return item->keyblock;
+}
+
+
+/* Store KEYBLOCK with UBID and an image length of IMAGELEN in the
+ * keyblock cache.  The cache takes ownership of KEYBLOCK.  */
+static void
+keyblock_lru_put (const byte *ubid, kbnode_t keyblock, size_t imagelen)
+{
+  struct keyblock_lru_item *item;
+
+  if (imagelen > KEYBLOCK_LRU_MAX_BYTES / 8)
+    {
+      /* Don't let a single huge key evict everything else.  */
+      release_kbnode (keyblock);
+      return;
+    }
+
+  while (keyblock_lru_oldest
+         && (keyblock_lru_stats.count >= KEYBLOCK_LRU_MAX_ITEMS
+             || keyblock_lru_stats.bytes + imagelen > KEYBLOCK_LRU_MAX_BYTES))
+    {
+      keyblock_lru_remove (keyblock_lru_oldest);
+      keyblock_lru_stats.evictions++;
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    {
+      release_kbnode (keyblock);
+      return;
+    }
+  memcpy (item->ubid, ubid, 20);
+  item->keyblock = keyblock;
+  item->imagelen = imagelen;
+
+  item->next = keyblock_lru[ubid[0] % KEYBLOCK_LRU_BUCKETS];
+  keyblock_lru[ubid[0] % KEYBLOCK_LRU_BUCKETS] = item;
+  item->older = keyblock_lru_newest;
+  if (keyblock_lru_newest)
+    keyblock_lru_newest->newer = item;
+  else
+    keyblock_lru_oldest = item;
+  keyblock_lru_newest = item;
+
+  keyblock_lru_stats.count++;
+  keyblock_lru_stats.bytes += imagelen;
+}
+
+
 static void
 keyblock_cache_clear (struct keydb_handle_s *hd)
 {
@@ -810,6 +1039,19 @@ keydb_dump_stats (void)
             kid_not_found_stats.count,
             kid_not_found_stats.peak,
             kid_not_found_stats.flushes);
+  log_info ("keyblock_cache: count=%u bytes=%lu hits=%u misses=%u"
+            " evictions=%u flushes=%u\n",
+            keyblock_lru_stats.count,
+            keyblock_lru_stats.bytes,
+            keyblock_lru_stats.hits,
+            keyblock_lru_stats.misses,
+            keyblock_lru_stats.evictions,
+            keyblock_lru_stats.flushes);
+  log_info ("merged_cache: count=%u hits=%u misses=%u flushes=%u\n",
+            merged_cache_stats.count,
+            merged_cache_stats.hits,
+            merged_cache_stats.misses,
+            merged_cache_stats.flushes);
 }
 
 
@@ -921,6 +1163,42 @@ internal_keydb_lock (KEYDB_HANDLE hd)
 }
 
 
+/* Start a batch of updates.  Until keydb_end_batch is called the
+ * locks on the files are not released by other handles; thus a
+ * series of inserts and updates takes the locks only once.  This is
+ * a no-op if the keyboxd is used.  */
+gpg_error_t
+keydb_begin_batch (ctrl_t ctrl)
+{
+  gpg_error_t err;
+
+  if (opt.use_keyboxd || batch_hd)
+    return 0;
+
+  batch_hd = keydb_new (ctrl);
+  if (!batch_hd)
+    return gpg_error_from_syserror ();
+  err = internal_keydb_lock (batch_hd);
+  if (err)
+    {
+      keydb_release (batch_hd);
+      batch_hd = NULL;
+    }
+  return err;
+}
+
+
+/* Finish a batch of updates and release the locks.  */
+void
+keydb_end_batch (void)
+{
+  KEYDB_HANDLE hd = batch_hd;
+
+  batch_hd = NULL;
+  keydb_release (hd);
+}
+
+
 /* Set a flag on the handle to suppress use of cached results.  This
  * is required for updating a keyring and for key listings.  Fixme:
  * Using a new parameter for keydb_new might be a better solution.  */
@@ -1040,6 +1318,13 @@ unlock_all (KEYDB_HANDLE hd)
   if (!hd->locked || hd->keep_lock)
     return;
 
+  /* The locks are shared and held by the batch.  */
+  if (batch_hd && hd != batch_hd)
+    {
+      hd->locked = 0;
+      return;
+    }
+
   for (i=hd->used-1; i >= 0; i--)
     {
       switch (hd->active[i].type)
@@ -1150,11 +1435,12 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
 
   *r_keyblock = NULL;
 
-  pkt = xtrymalloc (sizeof *pkt);
+  pkt = alloc_packet ();
   if (!pkt)
     return gpg_error_from_syserror ();
   init_packet (pkt);
   init_parse_packet (&parsectx, iobuf);
+  parsectx.lazy_sig_data = 1;
   save_mode = set_packet_list_mode (0);
   in_cert = 0;
   tail = NULL;
@@ -1246,7 +1532,7 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
       else
         *tail = node;
       tail = &node->next;
-      pkt = xtrymalloc (sizeof *pkt);
+      pkt = alloc_packet ();
       if (!pkt)
         {
           err = gpg_error_from_syserror ();
@@ -1268,7 +1554,112 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
     }
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
-  xfree (pkt);
+  release_packet_struct (pkt);
+  return err;
+}
+
+
+/* Return a copy of KEYBLOCK as stored in the keyblock cache or NULL
+ * if KEYBLOCK has packets which can't be copied.  The flag bits for
+ * the PK_NO-th key and the UID_NO-th user id are set the same way as
+ * parse_keyblock_image does.  The expired flag of the signatures is
+ * computed anew.  */
+static kbnode_t
+copy_keyblock (kbnode_t keyblock, int pk_no, int uid_no)
+{
+  kbnode_t result = NULL;
+  kbnode_t n, node, *tail;
+  PACKET *pkt;
+  int pk_count, uid_count;
+
+  for (n = keyblock; n; n = n->next)
+    if (n->pkt->pkttype != PKT_PUBLIC_KEY
+        && n->pkt->pkttype != PKT_PUBLIC_SUBKEY
+        && n->pkt->pkttype != PKT_USER_ID
+        && n->pkt->pkttype != PKT_ATTRIBUTE
+        && n->pkt->pkttype != PKT_SIGNATURE)
+      return NULL;
+
+  tail = &result;
+  pk_count = uid_count = 0;
+  for (n = keyblock; n; n = n->next)
+    {
+      pkt = xmalloc (sizeof *pkt);
+      init_packet (pkt);
+      pkt->pkttype = n->pkt->pkttype;
+      node = new_kbnode (pkt);
+      switch (pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          pkt->pkt.public_key = copy_public_key (NULL,
+                                                 n->pkt->pkt.public_key);
+          if (++pk_count == pk_no)
+            node->flag |= 1;
+          break;
+
+        case PKT_USER_ID:
+          pkt->pkt.user_id = copy_user_id (n->pkt->pkt.user_id);
+          if (++uid_count == uid_no)
+            node->flag |= 2;
+          break;
+
+        case PKT_ATTRIBUTE:
+          pkt->pkt.user_id = copy_user_id (n->pkt->pkt.user_id);
+          break;
+
+        default: /* PKT_SIGNATURE */
+          pkt->pkt.signature = copy_signature (NULL, n->pkt->pkt.signature);
+          /* The parser sets this flag using the time of parsing.  */
+          pkt->pkt.signature->flags.expired
+            = (pkt->pkt.signature->expiredate
+               && pkt->pkt.signature->expiredate <= make_timestamp ());
+          break;
+        }
+      *tail = node;
+      tail = &node->next;
+    }
+
+  return result;
+}
+
+
+/* Same as parse_keyblock_image but use the keyblock cache unless
+ * caching has been disabled for HD.  IOBUF must be a temporary
+ * iobuf.  */
+static gpg_error_t
+parse_keyblock_image_cached (KEYDB_HANDLE hd, iobuf_t iobuf,
+                             int pk_no, int uid_no, kbnode_t *r_keyblock)
+{
+  gpg_error_t err;
+  byte ubid[20];
+  kbnode_t keyblock;
+  size_t imagelen;
+
+  if (hd->no_caching)
+    return parse_keyblock_image (iobuf, pk_no, uid_no, r_keyblock);
+
+  imagelen = iobuf_get_temp_length (iobuf);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, ubid,
+                       iobuf_get_temp_buffer (iobuf), imagelen);
+  memcpy (hd->last_ubid, ubid, 20);
+  hd->last_ubid_valid = 1;
+  keyblock = keyblock_lru_get (ubid);
+  if (keyblock)
+    {
+      keyblock_lru_stats.hits++;
+      *r_keyblock = copy_keyblock (keyblock, pk_no, uid_no);
+      return 0;
+    }
+
+  keyblock_lru_stats.misses++;
+  err = parse_keyblock_image (iobuf, pk_no, uid_no, r_keyblock);
+  if (!err)
+    {
+      keyblock = copy_keyblock (*r_keyblock, 0, 0);
+      if (keyblock)
+        keyblock_lru_put (ubid, keyblock, imagelen);
+    }
   return err;
 }
 
@@ -1290,6 +1681,7 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 
   log_assert (!hd->use_keyboxd);
 
+  hd->last_ubid_valid = 0;
   if (hd->keyblock_cache.state == KEYBLOCK_CACHE_FILLED)
     {
       err = iobuf_seek (hd->keyblock_cache.iobuf, 0);
@@ -1300,10 +1692,10 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 	}
       else
 	{
-	  err = parse_keyblock_image (hd->keyblock_cache.iobuf,
-				      hd->keyblock_cache.pk_no,
-				      hd->keyblock_cache.uid_no,
-				      ret_kb);
+	  err = parse_keyblock_image_cached (hd, hd->keyblock_cache.iobuf,
+                                             hd->keyblock_cache.pk_no,
+                                             hd->keyblock_cache.uid_no,
+                                             ret_kb);
 	  if (err)
 	    keyblock_cache_clear (hd);
 	  if (DBG_CLOCK)
@@ -1332,7 +1724,8 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
                                    &iobuf, &pk_no, &uid_no);
         if (!err)
           {
-            err = parse_keyblock_image (iobuf, pk_no, uid_no, ret_kb);
+            err = parse_keyblock_image_cached (hd, iobuf, pk_no, uid_no,
+                                               ret_kb);
             if (!err && hd->keyblock_cache.state == KEYBLOCK_CACHE_PREPARED)
               {
                 hd->keyblock_cache.state     = KEYBLOCK_CACHE_FILLED;
@@ -1359,6 +1752,161 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 }
 
 
+/* Return the stored image of the keyblock last found by keydb_search
+ * as a memory stream at R_IMAGE.  Returns GPG_ERR_NOT_SUPPORTED for
+ * keyrings which do not store images.  keydb_get_keyblock_image
+ * diverts to here in the non-keyboxd mode.  */
+gpg_error_t
+internal_keydb_get_keyblock_image (KEYDB_HANDLE hd, iobuf_t *r_image)
+{
+  gpg_error_t err;
+  int pk_no, uid_no;
+
+  log_assert (!hd->use_keyboxd);
+
+  *r_image = NULL;
+  if (hd->found < 0 || hd->found >= hd->used)
+    return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
+  if (hd->active[hd->found].type != KEYDB_RESOURCE_TYPE_KEYBOX)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = keybox_get_keyblock (hd->active[hd->found].u.kb,
+                             r_image, &pk_no, &uid_no);
+  if (!err)
+    keydb_stats.get_keyblocks++;
+  return err;
+}
+
+
+/* Return the first creation or expiration date of a key, user ID or
+ * signature in KEYBLOCK which is after NOW or 0 if there is none.  */
+static u32
+next_keyblock_date (kbnode_t keyblock, u32 now)
+{
+  kbnode_t n;
+  u32 dates[2];
+  u32 result = 0;
+  int i;
+
+  for (n = keyblock; n; n = n->next)
+    {
+      switch (n->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          dates[0] = n->pkt->pkt.public_key->timestamp;
+          dates[1] = n->pkt->pkt.public_key->expiredate;
+          break;
+        case PKT_USER_ID:
+          dates[0] = n->pkt->pkt.user_id->created;
+          dates[1] = n->pkt->pkt.user_id->expiredate;
+          break;
+        case PKT_SIGNATURE:
+          dates[0] = n->pkt->pkt.signature->timestamp;
+          dates[1] = n->pkt->pkt.signature->expiredate;
+          break;
+        default:
+          continue;
+        }
+      for (i = 0; i < DIM (dates); i++)
+        if (dates[i] > now && (!result || dates[i] < result))
+          result = dates[i];
+    }
+
+  return result;
+}
+
+
+/* Return a copy of the keyblock KEYBLOCK, which has just been
+ * returned by keydb_get_keyblock for HD, as already processed by
+ * merge_selfsigs or NULL if no such keyblock is cached.  The kbnode
+ * flags are taken from KEYBLOCK.  */
+kbnode_t
+keydb_get_merged_keyblock (KEYDB_HANDLE hd, kbnode_t keyblock)
+{
+  struct merged_cache_item *item, **itemp;
+  kbnode_t result, n, m;
+  u32 now;
+
+  if (!hd || !hd->last_ubid_valid)
+    return NULL;
+
+  for (itemp = &merged_cache[hd->last_ubid[0] % MERGED_CACHE_BUCKETS];
+       (item = *itemp); itemp = &item->next)
+    if (!memcmp (item->ubid, hd->last_ubid, 20))
+      break;
+  now = make_timestamp ();
+  if (item && (now < item->merged_at
+               || (item->valid_until && now >= item->valid_until)))
+    {
+      /* The time has changed in a way which may change the result of
+       * merge_selfsigs; drop the entry so that it is replaced.  */
+      *itemp = item->next;
+      release_kbnode (item->keyblock);
+      xfree (item);
+      merged_cache_stats.count--;
+      item = NULL;
+    }
+  if (!item)
+    {
+      merged_cache_stats.misses++;
+      return NULL;
+    }
+
+  result = copy_keyblock (item->keyblock, 0, 0);
+  if (!result)
+    return NULL;
+  for (n = keyblock, m = result; n && m; n = n->next, m = m->next)
+    m->flag = n->flag;
+  if (n || m)
+    {
+      /* Not the same structure - should not happen.  */
+      release_kbnode (result);
+      return NULL;
+    }
+
+  merged_cache_stats.hits++;
+  return result;
+}
+
+
+/* Store a copy of KEYBLOCK, which has been returned by
+ * keydb_get_keyblock for HD and then processed by merge_selfsigs, in
+ * the cache of merged keyblocks.  */
+void
+keydb_put_merged_keyblock (KEYDB_HANDLE hd, kbnode_t keyblock)
+{
+  struct merged_cache_item *item;
+  kbnode_t copy;
+
+  if (!hd || !hd->last_ubid_valid)
+    return;
+
+  if (merged_cache_stats.count >= MERGED_CACHE_MAX_ITEMS)
+    merged_cache_flush ();
+
+  copy = copy_keyblock (keyblock, 0, 0);
+  if (!copy)
+    return;
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    {
+      release_kbnode (copy);
+      return;
+    }
+  memcpy (item->ubid, hd->last_ubid, 20);
+  item->keyblock = copy;
+  item->merged_at = make_timestamp ();
+  item->valid_until = next_keyblock_date (keyblock, item->merged_at);
+  item->next = merged_cache[item->ubid[0] % MERGED_CACHE_BUCKETS];
+  merged_cache[item->ubid[0] % MERGED_CACHE_BUCKETS] = item;
+  merged_cache_stats.count++;
+
+  /* Store it only once.  */
+  hd->last_ubid_valid = 0;
+}
+
+
 /* Build a keyblock image from KEYBLOCK.  Returns 0 on success and
  * only then stores a new iobuf object at R_IOBUF.  */
 static gpg_error_t
@@ -1429,6 +1977,7 @@ internal_keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   pk = kb->pkt->pkt.public_key;
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
   keyblock_cache_clear (hd);
 
   if (opt.dry_run)
@@ -1509,6 +2058,7 @@ internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   log_assert (!hd->use_keyboxd);
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
   keyblock_cache_clear (hd);
 
   if (opt.dry_run)
@@ -1572,6 +2122,7 @@ internal_keydb_delete_keyblock (KEYDB_HANDLE hd)
   log_assert (!hd->use_keyboxd);
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
   keyblock_cache_clear (hd);
 
   if (hd->found < 0 || hd->found >= hd->used)
@@ -184,9 +184,22 @@ void keydb_release (KEYDB_HANDLE hd);
 /* Take a lock if we are not using the keyboxd.  */
 gpg_error_t keydb_lock (KEYDB_HANDLE hd);
 
+/* Keep the locks during a batch of updates.  */
+gpg_error_t keydb_begin_batch (ctrl_t ctrl);
+void keydb_end_batch (void);
+
 /* Return the keyblock last found by keydb_search.  */
 gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb);
 
+/* Return the stored image of that keyblock.  */
+gpg_error_t keydb_get_keyblock_image (KEYDB_HANDLE hd, iobuf_t *r_image);
+
+/* Return a copy of that keyblock as processed by merge_selfsigs.  */
+kbnode_t keydb_get_merged_keyblock (KEYDB_HANDLE hd, kbnode_t keyblock);
+
+/* Remember the result of merge_selfsigs for that keyblock.  */
+void keydb_put_merged_keyblock (KEYDB_HANDLE hd, kbnode_t keyblock);
+
 /* Update the keyblock KB.  */
 gpg_error_t keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb);
 
@@ -203,6 +216,25 @@ gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
 gpg_error_t keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                           size_t ndesc, size_t *descindex);
 
+/* Search for all keys matching each of the search descriptions.  */
+gpg_error_t keydb_search_multi (KEYDB_HANDLE hd,
+                                KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                                gpg_error_t (*cb)(void *opaque,
+                                                  size_t descidx,
+                                                  kbnode_t keyblock),
+                                void *opaque);
+
+/* An asynchronous keydb_search_multi.  */
+typedef struct keydb_multi_search_s *keydb_multi_search_t;
+gpg_error_t keydb_search_multi_start (ctrl_t ctrl,
+                                      KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                                      keydb_multi_search_t *r_ms);
+gpg_error_t keydb_search_multi_finish (keydb_multi_search_t ms,
+                                       gpg_error_t (*cb)(void *opaque,
+                                                         size_t descidx,
+                                                         kbnode_t keyblock),
+                                       void *opaque);
+
 
 
 /*-- keydb.c --*/
@@ -266,6 +298,10 @@ void show_revocation_reason (ctrl_t ctrl, PKT_public_key *pk, int mode );
 int  check_signatures_trust (ctrl_t ctrl, PKT_signature *sig);
 
 void release_pk_list (PK_LIST pk_list);
+struct groupitem *find_group (const char *name);
+struct groupitem *new_group (char *name);
+void remove_group (const char *name);
+void release_groups (void);
 int expand_id (const char *id, strlist_t *into, unsigned int flags);
 strlist_t expand_group (strlist_t input, int prepend_input);
 int  build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list);
@@ -385,6 +421,22 @@ gpg_error_t get_best_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
 gpg_error_t get_pubkey_fromfile (ctrl_t ctrl,
                                  PKT_public_key *pk, const char *fname);
 
+/* Look up the keys for several names given by fingerprint or key id
+ * with one search.  */
+gpg_error_t get_pubkeys_batch (ctrl_t ctrl, const char **names, size_t nnames,
+                               unsigned int req_usage,
+                               PKT_public_key **r_pks, kbnode_t *r_keyblocks);
+
+/* The same but split into starting and finishing the search.  */
+typedef struct pubkeys_batch_s *pubkeys_batch_t;
+gpg_error_t get_pubkeys_batch_start (ctrl_t ctrl,
+                                     const char **names, size_t nnames,
+                                     pubkeys_batch_t *r_batch);
+gpg_error_t get_pubkeys_batch_finish (pubkeys_batch_t batch,
+                                      unsigned int req_usage,
+                                      PKT_public_key **r_pks,
+                                      kbnode_t *r_keyblocks);
+
 /* Return the public key with the key id KEYID iff the secret key is
  * available and store it at PK.  */
 gpg_error_t get_seckey (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid);
@@ -455,6 +507,7 @@ void setup_main_keyids (kbnode_t keyblock);
    data structures.  */
 void merge_keys_and_selfsig (ctrl_t ctrl, kbnode_t keyblock);
 
+void cache_signer_user_ids (ctrl_t ctrl, kbnode_t keyblock);
 char *get_user_id_string_native (ctrl_t ctrl, u32 *keyid);
 char *get_long_user_id_string (ctrl_t ctrl, u32 *keyid);
 char *get_user_id (ctrl_t ctrl, u32 *keyid, size_t *rn, int *r_nouid);
@@ -544,6 +597,8 @@ const char *colon_datestr_from_pk (PKT_public_key *pk);
 const char *colon_datestr_from_sig (PKT_signature *sig);
 const char *colon_expirestr_from_sig (PKT_signature *sig);
 byte *fingerprint_from_pk( PKT_public_key *pk, byte *buf, size_t *ret_len );
+void fingerprint_from_packet (PKT_public_key *pk,
+                              const byte *body, size_t bodylen);
 char *hexfingerprint (PKT_public_key *pk, char *buffer, size_t buflen);
 char *format_hexfingerprint (const char *fingerprint,
                              char *buffer, size_t buflen);
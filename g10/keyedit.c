@@ -2218,7 +2218,7 @@ keyedit_menu (ctrl_t ctrl, const char *username, strlist_t locusr,
 
 	  if (update_trust)
 	    {
-	      revalidation_mark (ctrl);
+	      revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
 	      update_trust = 0;
 	    }
 	  goto leave;
@@ -2390,7 +2390,7 @@ keyedit_quick_adduid (ctrl_t ctrl, const char *username, const char *newuid)
         }
 
       if (update_trust)
-        revalidation_mark (ctrl);
+        revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
 
  leave:
@@ -2463,7 +2463,7 @@ keyedit_quick_revuid (ctrl_t ctrl, const char *username, const char *uidtorev)
               goto leave;
             }
 
-          revalidation_mark (ctrl);
+          revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
           goto leave;
         }
     }
@@ -2533,7 +2533,7 @@ keyedit_quick_set_primary (ctrl_t ctrl, const char *username,
           log_error (_("update failed: %s\n"), gpg_strerror (err));
           goto leave;
         }
-      revalidation_mark (ctrl);
+      revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
   else
     err = gpg_error (GPG_ERR_GENERAL);
@@ -2751,7 +2751,7 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
     log_info (_("Key not changed so no update needed.\n"));
 
   if (update_trust)
-    revalidation_mark (ctrl);
+    revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
 
 
  leave:
@@ -2962,7 +2962,7 @@ keyedit_quick_set_expire (ctrl_t ctrl, const char *fpr, const char *expirestr,
           goto leave;
         }
       if (update_trust)
-        revalidation_mark (ctrl);
+        revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
   else
     log_info (_("Key not changed so no update needed.\n"));
@@ -4205,6 +4205,7 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
     const char *err = NULL;
     struct para_data_s *para, *r;
     int i;
+    int in_batch = 0;
     struct output_control_s outctrl;
 
     memset( &outctrl, 0, sizeof( outctrl ) );
@@ -4226,6 +4227,11 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
     }
     iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
 
+    /* Take the keyring locks only once for all keys to be created
+     * instead of once per key.  */
+    if (!opt.dry_run && !keydb_begin_batch (ctrl))
+      in_batch = 1;
+
     lnr = 0;
     err = NULL;
     para = NULL;
@@ -4380,6 +4386,8 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
     release_parameter_list( para );
     iobuf_close (fp);
     release_armor_context (outctrl.pub.afx);
+    if (in_batch)
+      keydb_end_batch ();
 }
 
 
@@ -506,20 +506,11 @@ keystr_from_desc(KEYDB_SEARCH_DESC *desc)
 }
 
 
-/* Compute the fingerprint and keyid and store it in PK.  */
+/* Store the fingerprint DP of length LEN and the keyid taken from it
+ * in PK.  */
 static void
-compute_fingerprint (PKT_public_key *pk)
+set_fingerprint (PKT_public_key *pk, const byte *dp, size_t len)
 {
-  const byte *dp;
-  gcry_md_hd_t md;
-  size_t len;
-
-  if (gcry_md_open (&md, pk->version == 5 ? GCRY_MD_SHA256 : GCRY_MD_SHA1, 0))
-    BUG ();
-  hash_public_key (md, pk);
-  gcry_md_final (md);
-  dp = gcry_md_read (md, 0);
-  len = gcry_md_get_algo_dlen (gcry_md_get_algo (md));
   log_assert (len <= MAX_FINGERPRINT_LEN);
   memcpy (pk->fpr, dp, len);
   pk->fprlen = len;
@@ -533,10 +524,107 @@ compute_fingerprint (PKT_public_key *pk)
       pk->keyid[0] = buf32_to_u32 (dp+12);
       pk->keyid[1] = buf32_to_u32 (dp+16);
     }
+}
+
+
+/* Compute the fingerprint and keyid and store it in PK.  */
+static void
+compute_fingerprint (PKT_public_key *pk)
+{
+  gcry_md_hd_t md;
+
+  if (gcry_md_open (&md, pk->version == 5 ? GCRY_MD_SHA256 : GCRY_MD_SHA1, 0))
+    BUG ();
+  hash_public_key (md, pk);
+  gcry_md_final (md);
+  set_fingerprint (pk, gcry_md_read (md, 0),
+                   gcry_md_get_algo_dlen (gcry_md_get_algo (md)));
   gcry_md_close( md);
 }
 
 
+/* Compute the fingerprint and keyid of the just parsed PK from the
+ * BODYLEN bytes at BODY of its public key packet.  This avoids the
+ * serialization of the key parameters done by hash_public_key.  The
+ * fingerprint is only set if BODY is exactly what hash_public_key
+ * would hash; for example a non-minimal MPI encoding makes us leave
+ * PK alone so that the fingerprint is later computed as usual.  */
+void
+fingerprint_from_packet (PKT_public_key *pk, const byte *body, size_t bodylen)
+{
+  int npkey = pubkey_get_npkey (pk->pubkey_algo);
+  int is_v5 = pk->version == 5;
+  gcry_md_hd_t md;
+  const void *p;
+  unsigned int nbits;
+  size_t off, n;
+  int i;
+
+  off = is_v5? 10 : 6;
+  if ((pk->version != 4 && !is_v5) || bodylen < off || *body != pk->version)
+    return;
+  if (is_v5 && buf32_to_ulong (body + 6) != bodylen - 10)
+    return;
+
+  if (!npkey)
+    {
+      if (!pk->pkey[0] || !gcry_mpi_get_flag (pk->pkey[0], GCRYMPI_FLAG_OPAQUE))
+        return;
+      gcry_mpi_get_opaque (pk->pkey[0], &nbits);
+      off += (nbits+7)/8;
+    }
+  else
+    {
+      for (i=0; i < npkey; i++)
+        {
+          if (!pk->pkey[i])
+            return;
+          if (gcry_mpi_get_flag (pk->pkey[i], GCRYMPI_FLAG_OPAQUE))
+            {
+              p = gcry_mpi_get_opaque (pk->pkey[i], &nbits);
+              n = (nbits+7)/8;
+              if (!p || n > bodylen - off || memcmp (body + off, p, n))
+                return;
+            }
+          else
+            {
+              /* The value has been read verbatim; thus only the bit
+               * count in front of it may differ.  */
+              nbits = gcry_mpi_get_nbits (pk->pkey[i]);
+              n = 2 + (nbits+7)/8;
+              if (n > bodylen - off || buf16_to_uint (body + off) != nbits)
+                return;
+            }
+          off += n;
+        }
+    }
+  if (off != bodylen)
+    return;
+
+  if (gcry_md_open (&md, is_v5? GCRY_MD_SHA256 : GCRY_MD_SHA1, 0))
+    return;
+  if (is_v5)
+    {
+      gcry_md_putc (md, 0x9a);
+      gcry_md_putc (md, bodylen >> 24);
+      gcry_md_putc (md, bodylen >> 16);
+      gcry_md_putc (md, bodylen >>  8);
+      gcry_md_putc (md, bodylen      );
+    }
+  else
+    {
+      gcry_md_putc (md, 0x99);
+      gcry_md_putc (md, bodylen >> 8);
+      gcry_md_putc (md, bodylen     );
+    }
+  gcry_md_write (md, body, bodylen);
+  gcry_md_final (md);
+  set_fingerprint (pk, gcry_md_read (md, 0),
+                   gcry_md_get_algo_dlen (gcry_md_get_algo (md)));
+  gcry_md_close (md);
+}
+
+
 /*
  * Get the keyid from the public key PK and store it at KEYID unless
  * this is NULL.  Returns the 32 bit short keyid.
@@ -945,6 +1033,12 @@ keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
   gpg_error_t err;
   gcry_sexp_t s_pkey;
 
+  if (pk->flags.keygrip_valid)
+    {
+      memcpy (array, pk->keygrip, KEYGRIP_LEN);
+      return 0;
+    }
+
   if (DBG_PACKET)
     log_debug ("get_keygrip for public key\n");
 
@@ -1017,7 +1111,8 @@ keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
     {
       if (DBG_PACKET)
         log_printhex (array, 20, "keygrip=");
-      /* FIXME: Save the keygrip in PK.  */
+      memcpy (pk->keygrip, array, KEYGRIP_LEN);
+      pk->flags.keygrip_valid = 1;
     }
   gcry_sexp_release (s_pkey);
 
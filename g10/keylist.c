@@ -27,6 +27,7 @@
 #ifdef HAVE_DOSISH_SYSTEM
 # include <fcntl.h>		/* for setmode() */
 #endif
+#include <npth.h>
 
 #include "gpg.h"
 #include "options.h"
@@ -510,6 +511,177 @@ print_signature_stats (struct keylist_context *s)
 /* List all keys.  If SECRET is true only secret keys are listed.  If
    MARK_SECRET is true secret keys are indicated in a public key
    listing.  */
+
+
+/* The number of keyblocks read ahead by the prefetch thread.  */
+#define LIST_PREFETCH_SLOTS 64
+
+/* The context of the thread reading the keyblocks for list_all.  The
+ * keyblocks are passed in their original order through a ring buffer
+ * so that reading the next keyblocks from the keydb overlaps with the
+ * merging and formatting of the current one.  */
+struct list_prefetch_s
+{
+  KEYDB_HANDLE hd;
+  int secret;
+
+  npth_t thread;
+  npth_mutex_t lock;   /* Protects the fields below.  */
+  npth_cond_t cond;    /* Signaled on each change.  */
+  int stop;            /* The consumer is not interested anymore.  */
+  int done;            /* The thread has finished.  */
+  gpg_error_t err;     /* The error which terminated the thread.  */
+  const char *errfnc;  /* The name of the function returning ERR.  */
+  int head;            /* Index of the oldest used slot.  */
+  int count;           /* Number of used slots.  */
+  struct {
+    kbnode_t keyblock;
+    const char *resname;
+  } slots[LIST_PREFETCH_SLOTS];
+};
+
+
+/* The prefetch thread.  The keydb handle has already been positioned
+ * on the first keyblock.  */
+static void *
+list_prefetch_thread (void *arg)
+{
+  struct list_prefetch_s *pf = arg;
+  gpg_error_t err;
+  kbnode_t keyblock;
+  const char *errfnc = NULL;
+  int idx;
+
+  do
+    {
+      if (pf->secret)
+        glo_ctrl.silence_parse_warnings++;
+      err = keydb_get_keyblock (pf->hd, &keyblock);
+      if (pf->secret)
+        glo_ctrl.silence_parse_warnings--;
+      if (err)
+        {
+          if (gpg_err_code (err) == GPG_ERR_LEGACY_KEY)
+            continue;  /* Skip legacy keys.  */
+          errfnc = "keydb_get_keyblock";
+          break;
+        }
+
+      npth_mutex_lock (&pf->lock);
+      while (pf->count == LIST_PREFETCH_SLOTS && !pf->stop)
+        npth_cond_wait (&pf->cond, &pf->lock);
+      if (pf->stop)
+        {
+          npth_mutex_unlock (&pf->lock);
+          release_kbnode (keyblock);
+          err = 0;
+          break;
+        }
+      idx = (pf->head + pf->count) % LIST_PREFETCH_SLOTS;
+      pf->slots[idx].keyblock = keyblock;
+      pf->slots[idx].resname = keydb_get_resource_name (pf->hd);
+      pf->count++;
+      npth_cond_broadcast (&pf->cond);
+      npth_mutex_unlock (&pf->lock);
+    }
+  while (!(err = keydb_search_next (pf->hd)));
+
+  if (err && !errfnc)
+    errfnc = "keydb_search_next";
+
+  npth_mutex_lock (&pf->lock);
+  pf->err = err;
+  pf->errfnc = errfnc;
+  pf->done = 1;
+  npth_cond_broadcast (&pf->cond);
+  npth_mutex_unlock (&pf->lock);
+  return NULL;
+}
+
+
+/* Start the prefetch thread PF.  */
+static gpg_error_t
+list_prefetch_start (struct list_prefetch_s *pf)
+{
+  gpg_error_t err;
+  npth_attr_t tattr;
+  int rc;
+
+  npth_mutex_init (&pf->lock, NULL);
+  npth_cond_init (&pf->cond, NULL);
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  rc = npth_create (&pf->thread, &tattr, list_prefetch_thread, pf);
+  npth_attr_destroy (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_setname_np (pf->thread, "list-prefetch");
+  err = 0;
+
+ leave:
+  if (err)
+    {
+      npth_cond_destroy (&pf->cond);
+      npth_mutex_destroy (&pf->lock);
+    }
+  return err;
+}
+
+
+/* Return the next keyblock of PF and its resource name at R_RESNAME.
+ * Returns NULL at the end of the list; PF->ERR and PF->ERRFNC then
+ * tell why the thread stopped.  */
+static kbnode_t
+list_prefetch_next (struct list_prefetch_s *pf, const char **r_resname)
+{
+  kbnode_t keyblock = NULL;
+
+  npth_mutex_lock (&pf->lock);
+  while (!pf->count && !pf->done)
+    npth_cond_wait (&pf->cond, &pf->lock);
+  if (pf->count)
+    {
+      keyblock = pf->slots[pf->head].keyblock;
+      *r_resname = pf->slots[pf->head].resname;
+      pf->slots[pf->head].keyblock = NULL;
+      pf->head = (pf->head + 1) % LIST_PREFETCH_SLOTS;
+      pf->count--;
+      npth_cond_broadcast (&pf->cond);
+    }
+  npth_mutex_unlock (&pf->lock);
+  return keyblock;
+}
+
+
+/* Stop the thread of PF and release the keyblocks not yet taken.  */
+static void
+list_prefetch_stop (struct list_prefetch_s *pf)
+{
+  npth_mutex_lock (&pf->lock);
+  pf->stop = 1;
+  npth_cond_broadcast (&pf->cond);
+  npth_mutex_unlock (&pf->lock);
+  npth_join (pf->thread, NULL);
+
+  for (; pf->count; pf->count--)
+    {
+      release_kbnode (pf->slots[pf->head].keyblock);
+      pf->head = (pf->head + 1) % LIST_PREFETCH_SLOTS;
+    }
+  npth_cond_destroy (&pf->cond);
+  npth_mutex_destroy (&pf->lock);
+}
+
+
 static void
 list_all (ctrl_t ctrl, int secret, int mark_secret)
 {
@@ -519,6 +691,7 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
   int any_secret;
   const char *lastresname, *resname;
   struct keylist_context listctx;
+  struct list_prefetch_s *pf = NULL;
 
   memset (&listctx, 0, sizeof (listctx));
   if (opt.check_sigs)
@@ -536,21 +709,55 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
       goto leave;
     }
 
+  /* Read the keyblocks on a separate thread.  If that is not possible
+   * we fall back to reading them here.  */
+  pf = xtrycalloc (1, sizeof *pf);
+  if (pf)
+    {
+      pf->hd = hd;
+      pf->secret = secret;
+      if (list_prefetch_start (pf))
+        {
+          xfree (pf);
+          pf = NULL;
+        }
+    }
+
   lastresname = NULL;
   do
     {
-      if (secret)
-        glo_ctrl.silence_parse_warnings++;
-      rc = keydb_get_keyblock (hd, &keyblock);
-      if (secret)
-        glo_ctrl.silence_parse_warnings--;
-      if (rc)
-	{
-          if (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
-            continue;  /* Skip legacy keys.  */
-	  log_error ("keydb_get_keyblock failed: %s\n", gpg_strerror (rc));
-	  goto leave;
-	}
+      if (pf)
+        {
+          keyblock = list_prefetch_next (pf, &resname);
+          if (!keyblock)
+            {
+              rc = pf->err;
+              if (rc && !strcmp (pf->errfnc, "keydb_get_keyblock"))
+                {
+                  log_error ("keydb_get_keyblock failed: %s\n",
+                             gpg_strerror (rc));
+                  goto leave;
+                }
+              break;
+            }
+        }
+      else
+        {
+          if (secret)
+            glo_ctrl.silence_parse_warnings++;
+          rc = keydb_get_keyblock (hd, &keyblock);
+          if (secret)
+            glo_ctrl.silence_parse_warnings--;
+          if (rc)
+            {
+              if (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
+                continue;  /* Skip legacy keys.  */
+              log_error ("keydb_get_keyblock failed: %s\n",
+                         gpg_strerror (rc));
+              goto leave;
+            }
+          resname = keydb_get_resource_name (hd);
+        }
 
       if (secret || mark_secret)
         any_secret = !agent_probe_any_secret_key (NULL, keyblock);
@@ -563,7 +770,6 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
         {
           if (!opt.with_colons && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
             {
-              resname = keydb_get_resource_name (hd);
               if (lastresname != resname)
                 {
                   int i;
@@ -582,10 +788,16 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
       release_kbnode (keyblock);
       keyblock = NULL;
     }
-  while (!(rc = keydb_search_next (hd)));
+  while (pf || !(rc = keydb_search_next (hd)));
   es_fflush (es_stdout);
   if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
     log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
+  if (pf)
+    {
+      list_prefetch_stop (pf);
+      xfree (pf);
+      pf = NULL;
+    }
   if (keydb_get_skipped_counter (hd))
     log_info (ngettext("Warning: %lu key skipped due to its large size\n",
                        "Warning: %lu keys skipped due to their large sizes\n",
@@ -596,6 +808,11 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
     print_signature_stats (&listctx);
 
  leave:
+  if (pf)
+    {
+      list_prefetch_stop (pf);
+      xfree (pf);
+    }
   keylist_context_release (&listctx);
   release_kbnode (keyblock);
   keydb_release (hd);
@@ -1386,6 +1603,17 @@ print_compliance_flags (PKT_public_key *pk,
 }
 
 
+/* Print a colon record of type TYPE with HEXSTR in field 10.  */
+static void
+print_colon_hexrecord (const char *type, const char *hexstr)
+{
+  es_fputs (type, es_stdout);
+  es_fputs (":::::::::", es_stdout);
+  es_fputs (hexstr, es_stdout);
+  es_fputs (":\n", es_stdout);
+}
+
+
 /* List a key in colon mode.  If SECRET is true this is a secret key
    record (i.e. requested via --list-secret-key).  If HAS_SECRET a
    secret key is available even if SECRET is not set.  */
@@ -1410,6 +1638,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
   unsigned int keylength;
   char *curve = NULL;
   const char *curvename = NULL;
+  char hexnamehash[2*20+1];
 
   /* Get the keyid from the keyblock.  */
   node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
@@ -1515,7 +1744,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
   print_revokers (es_stdout, pk);
   print_fingerprint (ctrl, NULL, pk, 0);
   if (hexgrip)
-    es_fprintf (es_stdout, "grp:::::::::%s:\n", hexgrip);
+    print_colon_hexrecord ("grp", hexgrip);
   if (opt.with_key_data)
     print_key_data (pk);
 
@@ -1550,10 +1779,9 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 
 	  namehash_from_uid (uid);
 
-	  for (i = 0; i < 20; i++)
-	    es_fprintf (es_stdout, "%02X", uid->namehash[i]);
-
-	  es_fprintf (es_stdout, "::");
+	  bin2hex (uid->namehash, 20, hexnamehash);
+	  es_fputs (hexnamehash, es_stdout);
+	  es_fputs ("::", es_stdout);
 
 	  if (uid->attrib_data)
 	    es_fprintf (es_stdout, "%u %lu", uid->numattribs, uid->attrib_len);
@@ -1656,7 +1884,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 	  es_putc ('\n', es_stdout);
           print_fingerprint (ctrl, NULL, pk2, 0);
           if (hexgrip)
-            es_fprintf (es_stdout, "grp:::::::::%s:\n", hexgrip);
+            print_colon_hexrecord ("grp", hexgrip);
           if (opt.with_key_data)
             print_key_data (pk2);
 	}
@@ -1878,8 +2106,16 @@ list_keyblock (ctrl_t ctrl,
                KBNODE keyblock, int secret, int has_secret, int fpr,
                struct keylist_context *listctx)
 {
+  int batch_uids;
+
   reorder_keyblock (keyblock);
 
+  /* Look up the user ids of all signers at once.  */
+  batch_uids = (opt.list_sigs && !opt.fast_list_mode
+                && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX));
+  if (batch_uids)
+    cache_signer_user_ids (ctrl, keyblock);
+
   if (opt.with_colons)
     list_keyblock_colon (ctrl, keyblock, secret, has_secret);
   else if ((opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
@@ -1891,6 +2127,9 @@ list_keyblock (ctrl_t ctrl,
   else
     list_keyblock_print (ctrl, keyblock, secret, fpr, listctx);
 
+  if (batch_uids)
+    cache_signer_user_ids (ctrl, NULL);
+
   if (secret)
     es_fflush (es_stdout);
 }
@@ -2035,7 +2274,10 @@ print_fingerprint (ctrl_t ctrl, estream_t override_fp,
   hexfingerprint (pk, hexfpr, sizeof hexfpr);
   if (with_colons && !mode)
     {
-      es_fprintf (fp, "fpr:::::::::%s:", hexfpr);
+      es_fputs ("fpr:::::::::", fp);
+      es_fputs (hexfpr, fp);
+      es_fputs (":\n", fp);
+      return;
     }
   else if (compact && !opt.fingerprint && !opt.with_fingerprint)
     {
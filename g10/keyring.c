@@ -26,9 +26,14 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/host2net.h"
+#include "../common/membuf.h"
 #include "keyring.h"
 #include "packet.h"
 #include "keydb.h"
@@ -38,6 +43,15 @@
 #include "../kbx/keybox.h"
 
 
+/* The offset table of a keyring.  See below.  */
+struct keyring_offtbl_s
+{
+  byte *mem;         /* The image of the table file.  */
+  size_t memlen;
+  int mapped;        /* MEM is a mapping of the file.  */
+  size_t nrecords;   /* Number of records following the header.  */
+};
+
 typedef struct keyring_resource *KR_RESOURCE;
 struct keyring_resource
 {
@@ -46,6 +60,8 @@ struct keyring_resource
   dotlock_t lockhd;
   int is_locked;
   int did_full_scan;
+  struct keyring_offtbl_s *offtbl; /* NULL or the offset table.  */
+  int offtbl_tried;  /* We tried to load or build the offset table.  */
   char fname[1];
 };
 typedef struct keyring_resource const * CONST_KR_RESOURCE;
@@ -177,6 +193,376 @@ key_present_hash_update_from_kb (key_present_hash_t tbl, KBNODE node)
     }
 }
 
+
+
+/* The offset table of a keyring maps the key IDs of all primary keys
+   and subkeys to the offsets of their keyblocks so that a search by
+   key ID or fingerprint can start right at the keyblock.  It is
+   stored in a file with the name of the keyring and the suffix
+   ".idx" and used as long as the size, modification time and inode
+   of the keyring match the values recorded in its header.  The
+   table is only a hint: The usual matching code still runs on the
+   keyblock.  Thus a key ID collision can at worst cost us a scan of
+   the rest of the keyring.  All integers are stored in network byte
+   order.
+
+   - b7   Magic "GPGkrOT"
+   - byte Version number (1)
+   - u64  Size of the keyring file
+   - u64  Modification time of the keyring file
+   - u64  Inode number of the keyring file
+   - NRECORDS times, sorted by key ID and offset:
+     - u32  High 32 bits of the key ID
+     - u32  Low 32 bits of the key ID
+     - u64  Offset of the keyblock
+
+   Because the records are sorted, a plain memcmp gives their order.
+   The table is built with one scan of the keyring the first time it
+   is needed in a process and no valid file exists.  Changes to the
+   keyring, including our own, invalidate the table; it is built again
+   by the next process.  */
+#define OFFTBL_MAGIC        "GPGkrOT\x01"
+#define OFFTBL_HEADER_SIZE  32
+#define OFFTBL_RECORD_SIZE  16
+
+
+static void
+put_u64 (byte *p, uint64_t a)
+{
+  int i;
+
+  for (i=7; i >= 0; i--, a >>= 8)
+    p[i] = a;
+}
+
+
+static uint64_t
+get_u64 (const byte *p)
+{
+  return ((uint64_t)buf32_to_u32 (p) << 32) | buf32_to_u32 (p + 4);
+}
+
+
+/* Store the values of the stat buffer ST as recorded in the header
+ * at the 24 bytes at BUF.  */
+static void
+offtbl_put_stat (byte *buf, const struct stat *st)
+{
+  put_u64 (buf, st->st_size);
+  put_u64 (buf + 8, st->st_mtime);
+  put_u64 (buf + 16, st->st_ino);
+}
+
+
+static void
+offtbl_release (struct keyring_offtbl_s *tbl)
+{
+  if (!tbl)
+    return;
+#ifdef HAVE_MMAP
+  if (tbl->mapped)
+    munmap (tbl->mem, tbl->memlen);
+  else
+#endif
+    xfree (tbl->mem);
+  xfree (tbl);
+}
+
+
+/* Load the offset table file of KR.  Returns NULL if there is none or
+ * it does not match the keyring with the stat values at STATBUF.  */
+static struct keyring_offtbl_s *
+offtbl_load (KR_RESOURCE kr, const byte *statbuf)
+{
+  struct keyring_offtbl_s *tbl = NULL;
+  char *fname;
+  estream_t fp = NULL;
+  struct stat st;
+  size_t nread;
+
+  fname = xtryasprintf ("%s" EXTSEP_S "idx", kr->fname);
+  if (!fname)
+    return NULL;
+  fp = es_fopen (fname, "rb");
+  if (!fp || fstat (es_fileno (fp), &st)
+      || st.st_size < OFFTBL_HEADER_SIZE || (size_t)st.st_size != st.st_size
+      || (st.st_size - OFFTBL_HEADER_SIZE) % OFFTBL_RECORD_SIZE)
+    goto leave;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    goto leave;
+  tbl->memlen = st.st_size;
+  tbl->nrecords = (tbl->memlen - OFFTBL_HEADER_SIZE) / OFFTBL_RECORD_SIZE;
+#ifdef HAVE_MMAP
+  tbl->mem = mmap (NULL, tbl->memlen, PROT_READ, MAP_SHARED,
+                   es_fileno (fp), 0);
+  if (tbl->mem == MAP_FAILED)
+    tbl->mem = NULL;
+  else
+    tbl->mapped = 1;
+#endif
+  if (!tbl->mem)
+    {
+      tbl->mem = xtrymalloc (tbl->memlen);
+      if (!tbl->mem
+          || es_read (fp, tbl->mem, tbl->memlen, &nread)
+          || nread != tbl->memlen)
+        {
+          offtbl_release (tbl);
+          tbl = NULL;
+          goto leave;
+        }
+    }
+
+  if (memcmp (tbl->mem, OFFTBL_MAGIC, 8) || memcmp (tbl->mem + 8, statbuf, 24))
+    {
+      if (DBG_LOOKUP)
+        log_debug ("%s: offset table '%s' is stale\n", __func__, fname);
+      offtbl_release (tbl);
+      tbl = NULL;
+    }
+  else if (DBG_LOOKUP)
+    log_debug ("%s: loaded offset table '%s' (%zu records)\n",
+               __func__, fname, tbl->nrecords);
+
+ leave:
+  es_fclose (fp);
+  xfree (fname);
+  return tbl;
+}
+
+
+/* Write the offset table TBL of KR.  Errors are not fatal because
+ * the table is then simply built again by the next process.  */
+static void
+offtbl_write (KR_RESOURCE kr, struct keyring_offtbl_s *tbl)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname;
+  estream_t fp;
+
+  fname = xtryasprintf ("%s" EXTSEP_S "idx", kr->fname);
+  tmpfname = fname? xtryasprintf ("%s" EXTSEP_S "tmp", fname) : NULL;
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_fwrite (tbl->mem, tbl->memlen, 1, fp) != 1)
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  if (err && opt.verbose)
+    log_info (_("error writing '%s': %s\n"),
+              fname? fname : kr->fname, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+static int
+offtbl_cmp_records (const void *a, const void *b)
+{
+  return memcmp (a, b, OFFTBL_RECORD_SIZE);
+}
+
+
+/* Scan the keyring KR with the stat values at STATBUF and return a new
+ * offset table for it.  The table is also written to disk.  Returns
+ * NULL on error or if the keyring was modified while we scanned it.  */
+static struct keyring_offtbl_s *
+offtbl_build (KR_RESOURCE kr, const byte *statbuf)
+{
+  struct keyring_offtbl_s *tbl = NULL;
+  PACKET pkt;
+  struct parse_packet_ctx_s parsectx;
+  membuf_t mb;
+  IOBUF a;
+  int rc, save_mode;
+  off_t offset, main_offset = 0;
+  struct stat st;
+  byte rec[OFFTBL_RECORD_SIZE];
+  byte sb[24];
+  u32 kid[2];
+  byte *mem;
+  size_t memlen;
+
+  a = iobuf_open (kr->fname);
+  if (!a)
+    return NULL;
+
+  init_membuf (&mb, 4096);
+  put_membuf (&mb, OFFTBL_MAGIC, 8);
+  put_membuf (&mb, statbuf, 24);
+
+  init_packet (&pkt);
+  init_parse_packet (&parsectx, a);
+  save_mode = set_packet_list_mode (0);
+  while (!(rc = search_packet (&parsectx, &pkt, &offset, 0)))
+    {
+      if (pkt.pkttype == PKT_PUBLIC_KEY || pkt.pkttype == PKT_SECRET_KEY)
+        main_offset = offset;
+      if (pkt.pkttype == PKT_PUBLIC_KEY || pkt.pkttype == PKT_PUBLIC_SUBKEY
+          || pkt.pkttype == PKT_SECRET_KEY || pkt.pkttype == PKT_SECRET_SUBKEY)
+        {
+          keyid_from_pk (pkt.pkt.public_key, kid);
+          ulongtobuf (rec, kid[0]);
+          ulongtobuf (rec + 4, kid[1]);
+          put_u64 (rec + 8, main_offset);
+          put_membuf (&mb, rec, sizeof rec);
+        }
+      free_packet (&pkt, &parsectx);
+    }
+  free_packet (&pkt, &parsectx);
+  deinit_parse_packet (&parsectx);
+  set_packet_list_mode (save_mode);
+  iobuf_close (a);
+  iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, (char*)kr->fname);
+
+  mem = get_membuf (&mb, &memlen);
+  if (!mem)
+    return NULL;
+  /* Legacy keys and other errors would make the search behave
+   * differently; thus we do not build a table in that case.  */
+  if (rc != -1 || stat (kr->fname, &st))
+    goto leave;
+  offtbl_put_stat (sb, &st);
+  if (memcmp (sb, statbuf, 24))
+    goto leave;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    goto leave;
+  tbl->mem = mem;
+  tbl->memlen = memlen;
+  tbl->nrecords = (memlen - OFFTBL_HEADER_SIZE) / OFFTBL_RECORD_SIZE;
+  mem = NULL;
+  qsort (tbl->mem + OFFTBL_HEADER_SIZE, tbl->nrecords, OFFTBL_RECORD_SIZE,
+         offtbl_cmp_records);
+  if (DBG_LOOKUP)
+    log_debug ("%s: built offset table for '%s' (%zu records)\n",
+               __func__, kr->fname, tbl->nrecords);
+  offtbl_write (kr, tbl);
+
+ leave:
+  xfree (mem);
+  return tbl;
+}
+
+
+/* Return the valid offset table for the keyring KR or NULL.  */
+static struct keyring_offtbl_s *
+offtbl_get (KR_RESOURCE kr)
+{
+  struct stat st;
+  byte sb[24];
+
+  if (stat (kr->fname, &st))
+    return NULL;
+  offtbl_put_stat (sb, &st);
+
+  if (kr->offtbl && memcmp (kr->offtbl->mem + 8, sb, 24))
+    {
+      if (DBG_LOOKUP)
+        log_debug ("%s: '%s' changed; dropping offset table\n",
+                   __func__, kr->fname);
+      offtbl_release (kr->offtbl);
+      kr->offtbl = NULL;
+    }
+  else if (!kr->offtbl && !kr->offtbl_tried)
+    {
+      kr->offtbl_tried = 1;
+      kr->offtbl = offtbl_load (kr, sb);
+      if (!kr->offtbl)
+        kr->offtbl = offtbl_build (kr, sb);
+    }
+
+  return kr->offtbl;
+}
+
+
+/* Return true if TBL has a record for KID with an offset not less
+ * than MINOFF and store the offset of the first of them at R_OFFSET.  */
+static int
+offtbl_lookup (struct keyring_offtbl_s *tbl, u32 *kid, off_t minoff,
+               off_t *r_offset)
+{
+  const byte *records = tbl->mem + OFFTBL_HEADER_SIZE;
+  byte key[OFFTBL_RECORD_SIZE];
+  size_t lo, hi, mid;
+
+  ulongtobuf (key, kid[0]);
+  ulongtobuf (key + 4, kid[1]);
+  put_u64 (key + 8, minoff);
+
+  /* Find the first record not less than KEY.  */
+  lo = 0;
+  hi = tbl->nrecords;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (memcmp (records + mid * OFFTBL_RECORD_SIZE, key, sizeof key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == tbl->nrecords
+      || memcmp (records + lo * OFFTBL_RECORD_SIZE, key, 8))
+    return 0;
+  *r_offset = get_u64 (records + lo * OFFTBL_RECORD_SIZE + 8);
+  return 1;
+}
+
+
+/* Get the key ID of a search description for use with the offset
+ * table.  Returns false if DESC can't be used with the table.  */
+static int
+offtbl_kid_from_desc (KEYDB_SEARCH_DESC *desc, u32 *kid)
+{
+  if (desc->mode == KEYDB_SEARCH_MODE_LONG_KID)
+    {
+      kid[0] = desc->u.kid[0];
+      kid[1] = desc->u.kid[1];
+    }
+  else if (desc->mode == KEYDB_SEARCH_MODE_FPR && desc->fprlen == 20)
+    {
+      kid[0] = buf32_to_u32 (desc->u.fpr + 12);
+      kid[1] = buf32_to_u32 (desc->u.fpr + 16);
+    }
+  else if (desc->mode == KEYDB_SEARCH_MODE_FPR && desc->fprlen == 32)
+    {
+      kid[0] = buf32_to_u32 (desc->u.fpr);
+      kid[1] = buf32_to_u32 (desc->u.fpr + 4);
+    }
+  else
+    return 0;
+  return 1;
+}
+
+
 /*
  * Register a filename for plain keyring files.  ptr is set to a
  * pointer to be used to create a handles etc, or the already-issued
@@ -210,6 +596,8 @@ keyring_register_filename (const char *fname, int read_only, void **ptr)
     kr->lockhd = NULL;
     kr->is_locked = 0;
     kr->did_full_scan = 0;
+    kr->offtbl = NULL;
+    kr->offtbl_tried = 0;
     /* keep a list of all issued pointers */
     kr->next = kr_resources;
     kr_resources = kr;
@@ -312,7 +700,7 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
             if (!keyring_is_writable(kr))
                 continue;
             if (!kr->lockhd) {
-                kr->lockhd = dotlock_create (kr->fname, 0);
+                kr->lockhd = dotlock_create (kr->fname, DOTLOCK_WAIT_QUEUE);
                 if (!kr->lockhd) {
                     log_info ("can't allocate lock for '%s'\n", kr->fname );
                     rc = GPG_ERR_GENERAL;
@@ -409,6 +797,7 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
     pkt = xmalloc (sizeof *pkt);
     init_packet (pkt);
     init_parse_packet (&parsectx, a);
+    parsectx.lazy_sig_data = 1;
     hd->found.n_packets = 0;
     lastnode = NULL;
     save_mode = set_packet_list_mode(0);
@@ -976,6 +1365,9 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   PKT_user_id *uid = NULL;
   PKT_public_key *pk = NULL;
   u32 aki[2];
+  KR_RESOURCE kr;
+  struct keyring_offtbl_s *offtbl;
+  off_t tbloff;
 
   /* figure out what information we need */
   need_uid = need_words = need_keyid = need_fpr = any_skip = 0;
@@ -1027,6 +1419,33 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       return rc;
     }
 
+  /* Use the offset table to skip to the first keyblock which may
+   * match a key ID or fingerprint search.  */
+  for (kr=kr_resources; kr && kr != hd->current.kr; kr = kr->next)
+    ;
+  if (kr && ndesc == 1 && offtbl_kid_from_desc (desc, aki)
+      && (offtbl = offtbl_get (kr)))
+    {
+      offset = iobuf_tell (hd->current.iobuf);
+      if (!offtbl_lookup (offtbl, aki, offset, &tbloff))
+        {
+          if (DBG_LOOKUP)
+            log_debug ("%s: offset table says not present\n", __func__);
+          hd->found.kr = NULL;
+          hd->current.eof = 1;
+          return -1;
+        }
+      if (DBG_LOOKUP)
+        log_debug ("%s: offset table says keyblock at offset %lld\n",
+                   __func__, (long long)tbloff);
+      if (tbloff > offset && iobuf_seek (hd->current.iobuf, tbloff))
+        {
+          log_error ("can't seek '%s'\n", hd->current.kr->fname);
+          hd->current.error = gpg_error (GPG_ERR_KEYRING_OPEN);
+          return hd->current.error;
+        }
+    }
+
   use_key_present_hash = !!key_present_hash;
   if (!use_key_present_hash)
     {
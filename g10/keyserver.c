@@ -72,6 +72,7 @@ struct search_line_handler_parm_s
                      it is too small, it will grow safely.  */
   int validcount; /* Enable the "Key x-y of z" messages. */
   int nkeys;      /* Number of processed records.  */
+  unsigned int npubs;  /* Number of received "pub" lines.  */
   int any_lines;  /* At least one line has been processed.  */
   unsigned int numlines;  /* Counter for displayed lines.  */
   int eof_seen;   /* EOF encountered.  */
@@ -88,6 +89,8 @@ static struct parse_options keyserver_opts[]=
     {"max-cert-size",0,NULL,NULL},  /* MUST be the first in this array! */
     {"http-proxy", KEYSERVER_HTTP_PROXY, NULL, /* MUST be the second!  */
      N_("override proxy options set for dirmngr")},
+    {"max-results",0,NULL,  /* MUST be the third!  */
+     N_("limit the number of keys shown by a search")},
 
     {"include-revoked",0,NULL,N_("include revoked keys in search results")},
     {"include-subkeys",0,NULL,N_("include subkeys when searching by key ID")},
@@ -118,6 +121,9 @@ static gpg_error_t keyserver_put (ctrl_t ctrl, strlist_t keyspecs);
 
 static size_t max_cert_size=DEFAULT_MAX_CERT_SIZE;
 
+/* The maximum number of keys in a search result or 0 for no limit.  */
+static unsigned int max_search_results;
+
 
 static void
 warn_kshelper_option(char *option, int noisy)
@@ -146,9 +152,11 @@ parse_keyserver_options(char *options)
   int ret=1;
   char *tok;
   char *max_cert=NULL;
+  char *max_results=NULL;
 
   keyserver_opts[0].value=&max_cert;
   keyserver_opts[1].value=&opt.keyserver_options.http_proxy;
+  keyserver_opts[2].value=&max_results;
 
   while((tok=optsep(&options)))
     {
@@ -177,6 +185,9 @@ parse_keyserver_options(char *options)
 	max_cert_size=DEFAULT_MAX_CERT_SIZE;
     }
 
+  if(max_results)
+    max_search_results=strtoul(max_results,(char **)NULL,10);
+
   return ret;
 }
 
@@ -823,6 +834,15 @@ search_line_handler (void *opaque, int special, char *line)
       line = NULL;
     }
 
+  /* Stop at the first key beyond the limit; the callback is then
+   * called again with EOF to show the keys we have.  */
+  if (line && max_search_results && !ascii_strncasecmp (line, "pub:", 4)
+      && parm->npubs++ >= max_search_results)
+    {
+      log_info (_("showing only the first %u keys\n"), max_search_results);
+      return gpg_error (GPG_ERR_TRUNCATED);
+    }
+
   /* Print the received line.  */
   if (opt.with_colons && line)
     {
@@ -1508,7 +1528,8 @@ keyserver_search (ctrl_t ctrl, strlist_t tokens)
   if (searchstr)
     parm.searchstr_disp = utf8_to_native (searchstr, strlen (searchstr), 0);
 
-  err = gpg_dirmngr_ks_search (ctrl, searchstr, search_line_handler, &parm);
+  err = gpg_dirmngr_ks_search (ctrl, searchstr, max_search_results,
+                               search_line_handler, &parm);
 
   if (parm.not_found || gpg_err_code (err) == GPG_ERR_NO_DATA)
     {
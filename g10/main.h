@@ -79,6 +79,7 @@ struct groupitem
   char *name;
   strlist_t values;
   struct groupitem *next;
+  struct groupitem *hnext;  /* Next item in the same hash bucket.  */
 };
 
 struct weakhash
@@ -258,16 +259,32 @@ int encrypt_filter (void *opaque, int control,
 
 int write_pubkey_enc (ctrl_t ctrl, PKT_public_key *pk, int throw_keyid,
                       DEK *dek, iobuf_t out);
+#define PUBKEY_ENC_MAX_THREADS 64
 
 /*-- sign.c --*/
 int sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	       int do_encrypt, strlist_t remusr, const char *outfile );
+int sign_fd (ctrl_t ctrl, int inp_fd, int detached, strlist_t locusr,
+             int out_fd);
+int sign_files (ctrl_t ctrl, int nfiles, char **files, strlist_t locusr);
 int clearsign_file (ctrl_t ctrl,
                     const char *fname, strlist_t locusr, const char *outfile);
 int sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr);
 
 /*-- sig-check.c --*/
+#define SIG_CHECK_MAX_THREADS 64
 void sig_check_dump_stats (void);
+void sig_check_defer_begin (void);
+void sig_check_defer_end (int nthreads);
+
+/*-- sig-cache.c --*/
+#define SIG_CACHE_KEYLEN 32
+void sig_cache_set_file (const char *fname);
+int  sig_cache_lookup (PKT_public_key *pk, PKT_signature *sig,
+                       gcry_md_hd_t digest, byte *key, int *r_rc);
+void sig_cache_store (const byte *key, int rc);
+void sig_cache_flush (void);
+void sig_cache_dump_stats (void);
 
 /* SIG is a revocation signature.  Check if any of PK's designated
    revokers generated it.  If so, return 0.  Note: this function
@@ -419,6 +436,11 @@ int exact_subkey_match_p (KEYDB_SEARCH_DESC *desc, kbnode_t node);
 
 int export_pubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                     export_stats_t stats);
+int export_pubkeys_fd (ctrl_t ctrl, int out_fd, strlist_t users,
+                       unsigned int options, export_stats_t stats);
+int export_pubkeys_stream (ctrl_t ctrl, estream_t out_fp, strlist_t users,
+                           int armor, unsigned int options,
+                           export_stats_t stats);
 int export_seckeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                     export_stats_t stats);
 int export_secsubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
@@ -491,6 +513,7 @@ int gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp);
 int decrypt_message (ctrl_t ctrl, const char *filename );
 gpg_error_t decrypt_message_fd (ctrl_t ctrl, int input_fd, int output_fd);
 void decrypt_messages (ctrl_t ctrl, int nfiles, char *files[]);
+gpg_error_t decrypt_message_stream (ctrl_t ctrl);
 
 /*-- plaintext.c --*/
 int hash_datafiles( gcry_md_hd_t md, gcry_md_hd_t md2,
@@ -45,6 +45,11 @@
    value, a much lower should actually be sufficient.  */
 #define MAX_NESTING_DEPTH 32
 
+/* The maximum number of missing signer keys which are retrieved
+   concurrently.  The keys of further signatures are retrieved one
+   after the other.  */
+#define MAX_PREFETCH_KEYS 16
+
 
 /*
  * Object to hold the processing context.
@@ -82,6 +87,7 @@ struct mainproc_context
   DEK *dek;
   int last_was_session_key;
   kbnode_t list;    /* The current list of packets. */
+  kbnode_t list_tail; /* Last node of LIST or NULL if not known.  */
   iobuf_t iobuf;    /* Used to get the filename etc. */
   int trustletter;  /* Temporary usage in list_node. */
   ulong symkeys;    /* Number of symmetrically encrypted session keys.  */
@@ -102,6 +108,21 @@ struct mainproc_context
 static int literals_seen;
 
 
+/* A cache of hash contexts of the signed data of detached signatures.
+ * If enabled, the data is hashed only once for each distinct set of
+ * digest algorithms and text mode and all further signatures use a
+ * copy of the cached contexts.  */
+struct md_cache_item_s
+{
+  struct md_cache_item_s *next;
+  int textmode;
+  gcry_md_hd_t md;
+  gcry_md_hd_t md2;  /* Or NULL.  */
+};
+static struct md_cache_item_s *md_cache;
+static int md_cache_enabled;
+
+
 /*** Local prototypes.  ***/
 static int do_proc_packets (CTX c, iobuf_t a);
 static void list_node (CTX c, kbnode_t node);
@@ -119,6 +140,117 @@ reset_literals_seen(void)
 }
 
 
+/* Enable the cache of hash contexts for detached signatures.  This
+ * must only be used when all signatures are verified against the same
+ * data files.  */
+void
+enable_detached_md_cache (void)
+{
+  md_cache_enabled = 1;
+}
+
+
+/* Release and disable the cache of hash contexts.  */
+void
+release_detached_md_cache (void)
+{
+  struct md_cache_item_s *item;
+
+  while ((item = md_cache))
+    {
+      md_cache = item->next;
+      gcry_md_close (item->md);
+      gcry_md_close (item->md2);
+      xfree (item);
+    }
+  md_cache_enabled = 0;
+}
+
+
+/* Return true if all OpenPGP digest algorithms enabled in WANT are
+ * also enabled in HAVE.  */
+static int
+md_covers_algos (gcry_md_hd_t have, gcry_md_hd_t want)
+{
+  int algo, galgo;
+
+  for (algo = DIGEST_ALGO_MD5; algo <= DIGEST_ALGO_SHA224; algo++)
+    {
+      galgo = map_md_openpgp_to_gcry (algo);
+      if (galgo && gcry_md_is_enabled (want, galgo)
+          && !gcry_md_is_enabled (have, galgo))
+        return 0;
+    }
+  return 1;
+}
+
+
+/* Hash the signed data of a detached signature into the contexts of
+ * C->MFX.  If the cache is enabled a copy of cached contexts is used
+ * instead or the new contexts are added to the cache.  */
+static gpg_error_t
+hash_detached_data (CTX c, int textmode)
+{
+  gpg_error_t err;
+  struct md_cache_item_s *item;
+  gcry_md_hd_t md, md2;
+
+  if (md_cache_enabled)
+    {
+      for (item = md_cache; item; item = item->next)
+        if (item->textmode == textmode
+            && !item->md2 == !c->mfx.md2
+            && md_covers_algos (item->md, c->mfx.md))
+          break;
+      if (item)
+        {
+          err = gcry_md_copy (&md, item->md);
+          if (err)
+            return err;
+          md2 = NULL;
+          if (item->md2 && (err = gcry_md_copy (&md2, item->md2)))
+            {
+              gcry_md_close (md);
+              return err;
+            }
+          free_md_filter_context (&c->mfx);
+          c->mfx.md = md;
+          c->mfx.md2 = md2;
+          if (opt.verbose)
+            log_info (_("using cached hash of the signed data\n"));
+          return 0;
+        }
+    }
+
+  if (c->signed_data.used && c->signed_data.data_fd != -1)
+    err = hash_datafile_by_fd (c->mfx.md, c->mfx.md2,
+                               c->signed_data.data_fd, textmode);
+  else
+    err = hash_datafiles (c->mfx.md, c->mfx.md2,
+                          c->signed_data.data_names,
+                          c->sigfilename, textmode);
+  if (err || !md_cache_enabled)
+    return err;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return gpg_error_from_syserror ();
+  item->textmode = textmode;
+  err = gcry_md_copy (&item->md, c->mfx.md);
+  if (!err && c->mfx.md2)
+    err = gcry_md_copy (&item->md2, c->mfx.md2);
+  if (err)
+    {
+      gcry_md_close (item->md);
+      xfree (item);
+      return err;
+    }
+  item->next = md_cache;
+  md_cache = item;
+  return 0;
+}
+
+
 static void
 release_list( CTX c )
 {
@@ -135,6 +267,7 @@ release_list( CTX c )
     }
   c->pkenc_list = NULL;
   c->list = NULL;
+  c->list_tail = NULL;
   c->any.data = 0;
   c->any.uncompress_failed = 0;
   c->last_was_session_key = 0;
@@ -144,16 +277,36 @@ release_list( CTX c )
 }
 
 
-static int
-add_onepass_sig (CTX c, PACKET *pkt)
+/* Append NODE to the list of packets in C.  Unlike add_kbnode this
+ * keeps track of the last node so that messages with many signatures
+ * or large key blocks do not need to walk the entire list for each
+ * new packet.  */
+static void
+append_to_list (CTX c, kbnode_t node)
 {
-  kbnode_t node;
+  kbnode_t tail;
+
+  if (!c->list)
+    {
+      c->list = c->list_tail = node;
+      return;
+    }
+
+  /* In case some other code appended nodes, skip forward.  */
+  for (tail = c->list_tail? c->list_tail : c->list; tail->next;
+       tail = tail->next)
+    ;
+  tail->next = node;
+  for (; node->next; node = node->next)
+    ;
+  c->list_tail = node;
+}
 
-  if (c->list) /* Add another packet. */
-    add_kbnode (c->list, new_kbnode (pkt));
-  else /* Insert the first one.  */
-    c->list = node = new_kbnode (pkt);
 
+static int
+add_onepass_sig (CTX c, PACKET *pkt)
+{
+  append_to_list (c, new_kbnode (pkt));
   return 1;
 }
 
@@ -168,11 +321,7 @@ add_gpg_control (CTX c, PACKET *pkt)
       release_list(c);
     }
 
-  if (c->list)  /* Add another packet.  */
-    add_kbnode (c->list, new_kbnode (pkt));
-  else /* Insert the first one. */
-    c->list = new_kbnode (pkt);
-
+  append_to_list (c, new_kbnode (pkt));
   return 1;
 }
 
@@ -185,7 +334,7 @@ add_user_id (CTX c, PACKET *pkt)
       log_error ("orphaned user ID\n");
       return 0;
     }
-  add_kbnode (c->list, new_kbnode (pkt));
+  append_to_list (c, new_kbnode (pkt));
   return 1;
 }
 
@@ -198,7 +347,7 @@ add_subkey (CTX c, PACKET *pkt)
       log_error ("subkey w/o mainkey\n");
       return 0;
     }
-  add_kbnode (c->list, new_kbnode (pkt));
+  append_to_list (c, new_kbnode (pkt));
   return 1;
 }
 
@@ -211,7 +360,7 @@ add_ring_trust (CTX c, PACKET *pkt)
       log_error ("ring trust w/o key\n");
       return 0;
     }
-  add_kbnode (c->list, new_kbnode (pkt));
+  append_to_list (c, new_kbnode (pkt));
   return 1;
 }
 
@@ -219,8 +368,6 @@ add_ring_trust (CTX c, PACKET *pkt)
 static int
 add_signature (CTX c, PACKET *pkt)
 {
-  kbnode_t node;
-
   c->any.sig_seen = 1;
   if (pkt->pkttype == PKT_SIGNATURE && !c->list)
     {
@@ -230,8 +377,7 @@ add_signature (CTX c, PACKET *pkt)
        * of prepending the signature to the data is
        * that it is not possible to make a signature from data read
        * from stdin.	(GPG is able to read PGP stuff anyway.) */
-      node = new_kbnode (pkt);
-      c->list = node;
+      append_to_list (c, new_kbnode (pkt));
       return 1;
     }
   else if (!c->list)
@@ -240,8 +386,7 @@ add_signature (CTX c, PACKET *pkt)
     BUG();    /* so nicht */
 
   /* Add a new signature node item at the end. */
-  node = new_kbnode (pkt);
-  add_kbnode (c->list, node);
+  append_to_list (c, new_kbnode (pkt));
 
   return 1;
 }
@@ -984,10 +1129,7 @@ proc_plaintext( CTX c, PACKET *pkt )
   n = new_kbnode (create_gpg_control (CTRLPKT_PLAINTEXT_MARK,
                                       extrahash, extrahashlen));
   xfree (extrahash);
-  if (c->list)
-    add_kbnode (c->list, n);
-  else
-    c->list = n;
+  append_to_list (c, n);
 }
 
 
@@ -1617,7 +1759,7 @@ do_proc_packets (CTX c, iobuf_t a)
             case PKT_PUBLIC_KEY:
             case PKT_SECRET_KEY:
               release_list (c);
-              c->list = new_kbnode (pkt);
+              append_to_list (c, new_kbnode (pkt));
               newpkt = 1;
               break;
             case PKT_PUBLIC_SUBKEY:
@@ -1775,6 +1917,107 @@ akl_has_wkd_method (void)
 }
 
 
+/* Start the auto-key-retrieve lookups for the missing keys of the
+ * signatures at and after NODE concurrently.  For each key only the
+ * first method check_sig_and_print would try is started and only if
+ * that is the WKD or the keyserver method; thus no lookup is done
+ * which would not have been done without this.  check_sig_and_print
+ * then uses these results instead of waiting for one lookup after the
+ * other.  The results need to be released with
+ * gpg_dirmngr_race_end.  */
+static void
+prefetch_signer_keys (CTX c, kbnode_t node)
+{
+  struct dirmngr_race_req_s reqs[MAX_PREFETCH_KEYS];
+  char *pattern;
+  PKT_signature *sig;
+  pka_info_t *pka;
+  kbnode_t n1;
+  const byte *p;
+  size_t n;
+  int nreqs = 0;
+  int nkeys = 0;
+  int use_wkd;
+  int use_ks = -1;  /* Not yet known.  */
+  int i;
+
+  if (!(opt.keyserver_options.options & KEYSERVER_AUTO_KEY_RETRIEVE))
+    return;
+
+  use_wkd = (!opt.flags.disable_signer_uid && akl_has_wkd_method ());
+
+  for (n1 = node; n1 && nkeys < MAX_PREFETCH_KEYS;
+       n1 = find_next_kbnode (n1, PKT_SIGNATURE))
+    {
+      if (n1->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = n1->pkt->pkt.signature;
+      if (!get_pubkey (c->ctrl, NULL, sig->keyid))
+        continue;  /* We already have the key.  */
+      nkeys++;
+
+      /* Use the same order as check_sig_and_print.  A preferred
+       * keyserver comes first; we leave this to check_sig_and_print.  */
+      if ((opt.keyserver_options.options & KEYSERVER_HONOR_KEYSERVER_URL)
+          && parse_sig_subpkt (sig, 1, SIGSUBPKT_PREF_KS, NULL))
+        continue;
+
+      if (use_wkd && sig->signers_uid
+          && (pattern = mailbox_from_userid (sig->signers_uid, 0)))
+        {
+          reqs[nreqs].wkd = 1;
+          reqs[nreqs].quick = 1;
+          reqs[nreqs].keyserver = NULL;
+          reqs[nreqs++].pattern = pattern;
+          continue;
+        }
+
+      /* Ditto for PKA.  */
+      if ((opt.keyserver_options.options & KEYSERVER_HONOR_PKA_RECORD)
+          && (pka = get_pka_address (sig)))
+        {
+          xfree (pka);
+          continue;
+        }
+
+      p = issuer_fpr_raw (sig, &n);
+      if (p && use_ks == -1)
+        use_ks = keyserver_any_configured (c->ctrl);
+      if (p && use_ks && (pattern = xtrymalloc (2 + 2*n + 1)))
+        {
+          strcpy (pattern, "0x");
+          bin2hex (p, n, pattern+2);
+          reqs[nreqs].wkd = 0;
+          reqs[nreqs].quick = 1;
+          reqs[nreqs].keyserver = opt.keyserver;
+          reqs[nreqs++].pattern = pattern;
+        }
+    }
+
+  /* Several signatures may have been made by the same key.  */
+  for (i=0; i < nreqs; i++)
+    {
+      int j;
+
+      for (j=0; j < i; j++)
+        if (reqs[j].wkd == reqs[i].wkd
+            && !strcmp (reqs[j].pattern, reqs[i].pattern))
+          break;
+      if (j < i)
+        {
+          xfree ((char*)reqs[i].pattern);
+          reqs[i--] = reqs[--nreqs];
+        }
+    }
+
+  if (nreqs > 1)
+    gpg_dirmngr_race (c->ctrl, reqs, nreqs, 1);
+
+  for (i=0; i < nreqs; i++)
+    xfree ((char*)reqs[i].pattern);
+}
+
+
 /* Return the ISSUER fingerprint buffer and its length at R_LEN.
  * Returns NULL if not available.  The returned buffer is valid as
  * long as SIG is not modified.  */
@@ -2565,15 +2808,7 @@ proc_tree (CTX c, kbnode_t node)
           /* Ask for file and hash it. */
           if (c->sigs_only)
             {
-              if (c->signed_data.used && c->signed_data.data_fd != -1)
-                rc = hash_datafile_by_fd (c->mfx.md, NULL,
-                                          c->signed_data.data_fd,
-                                          use_textmode);
-              else
-                rc = hash_datafiles (c->mfx.md, NULL,
-                                     c->signed_data.data_names,
-                                     c->sigfilename,
-                                     use_textmode);
+              rc = hash_detached_data (c, use_textmode);
 	    }
           else
             {
@@ -2595,8 +2830,10 @@ proc_tree (CTX c, kbnode_t node)
           return;
         }
 
+      prefetch_signer_keys (c, node);
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
+      gpg_dirmngr_race_end (c->ctrl);
 
     }
   else if (node->pkt->pkttype == PKT_GPG_CONTROL
@@ -2614,8 +2851,10 @@ proc_tree (CTX c, kbnode_t node)
           return;
         }
 
+      prefetch_signer_keys (c, node);
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
+      gpg_dirmngr_race_end (c->ctrl);
 
     }
   else if (node->pkt->pkttype == PKT_SIGNATURE)
@@ -2708,15 +2947,7 @@ proc_tree (CTX c, kbnode_t node)
 
           if (c->sigs_only)
             {
-              if (c->signed_data.used && c->signed_data.data_fd != -1)
-                rc = hash_datafile_by_fd (c->mfx.md, c->mfx.md2,
-                                          c->signed_data.data_fd,
-                                          (sig->sig_class == 0x01));
-              else
-                rc = hash_datafiles (c->mfx.md, c->mfx.md2,
-                                     c->signed_data.data_names,
-                                     c->sigfilename,
-                                     (sig->sig_class == 0x01));
+              rc = hash_detached_data (c, (sig->sig_class == 0x01));
 	    }
           else
             {
@@ -2742,8 +2973,10 @@ proc_tree (CTX c, kbnode_t node)
 
       if (multiple_ok)
         {
+          prefetch_signer_keys (c, node);
           for (n1 = node; n1; (n1 = find_next_kbnode(n1, PKT_SIGNATURE)))
 	    check_sig_and_print (c, n1);
+          gpg_dirmngr_race_end (c->ctrl);
         }
       else
         check_sig_and_print (c, node);
@@ -36,7 +36,8 @@
 #define MAX_UID_ITEMS_PER_BUCKET  20
 
 #define NO_OF_KEY_ITEM_BUCKETS    383
-#define MAX_KEY_ITEMS_PER_BUCKET  20
+#define MAX_KEY_ITEMS_PER_BUCKET  (PK_UID_CACHE_SIZE / NO_OF_KEY_ITEM_BUCKETS \
+                                   + 10)
 
 
 /* An object to store a user id.  This describes an item in the linked
@@ -59,7 +60,8 @@ static unsigned int uid_table_dropped;/* # of items dropped.  */
 
 /* An object to store properties of a key.  Note that this can be used
  * for a primary or a subkey.  The key is linked to a user if that
- * exists.  */
+ * exists.  A copy of the public key as returned by get_pubkey may be
+ * stored as well.  */
 typedef struct key_item_s
 {
   struct key_item_s *next;
@@ -68,6 +70,7 @@ typedef struct key_item_s
   char fpr[MAX_FINGERPRINT_LEN];
   u32 keyid[2];
   uid_item_t ui;          /* NULL of a ref'ed user id item.      */
+  PKT_public_key *pk;     /* NULL or a copy of the public key.   */
 } *key_item_t;
 
 static key_item_t *key_table; /* Hash table with the keys.      */
@@ -77,6 +80,15 @@ static unsigned int key_table_added;  /* # of items added.   */
 static unsigned int key_table_dropped;/* # of items dropped.  */
 static key_item_t key_item_attic;     /* List of freed items.  */
 
+/* Lookup statistics.  */
+static struct
+{
+  unsigned int pk_hits;
+  unsigned int pk_misses;
+  unsigned int uid_hits;
+  unsigned int uid_misses;
+} lookup_stats;
+
 
 
 /* Dump stats.  */
@@ -143,6 +155,17 @@ objcache_dump_stats (void)
             count, uid_table_added, uid_table_dropped,
             empty, minlen > 0? minlen : 0, maxlen,
             uid_table_size, uid_table_max);
+
+  count = 0;
+  for (idx = 0; idx < key_table_size; idx++)
+    for (ki = key_table[idx]; ki; ki = ki->next)
+      if (ki->pk)
+        count++;
+  log_info ("objcache: pks=%u hits=%u/%u uid hits=%u/%u\n",
+            count, lookup_stats.pk_hits,
+            lookup_stats.pk_hits + lookup_stats.pk_misses,
+            lookup_stats.uid_hits,
+            lookup_stats.uid_hits + lookup_stats.uid_misses);
 }
 
 
@@ -330,6 +353,8 @@ key_item_free (key_item_t ki)
     return;
   uid_item_unref (ki->ui);
   ki->ui = NULL;
+  free_public_key (ki->pk);
+  ki->pk = NULL;
   ki->next = key_item_attic;
   key_item_attic = ki;
 }
@@ -398,7 +423,8 @@ compare_key_items (const void *arg_a, const void *arg_b)
 
 /* Put PK into the KEY_TABLE and return a key item.  The reference
  * count for that item is incremented.  If UI is given it is put into
- * the entry.  NULL is return on an allocation error.  */
+ * the entry unless it already has a user id.  NULL is return on an
+ * allocation error.  */
 static key_item_t
 key_table_put (PKT_public_key *pk, uid_item_t ui)
 {
@@ -417,7 +443,12 @@ key_table_put (PKT_public_key *pk, uid_item_t ui)
   hash = key_table_hasher (keyid);
   for (ki = key_table[hash], count=0; ki; ki = ki->next, count++)
     if (ki->fprlen == fprlen && !memcmp (ki->fpr, fpr, fprlen))
-      return ki;  /* Found  */
+      {
+        /* Found.  */
+        if (!ki->ui)
+          ki->ui = uid_item_ref (ui);
+        return ki;
+      }
 
   /* If the bucket is full remove a couple of items. */
   if (count >= key_table_max)
@@ -506,7 +537,12 @@ key_table_put (PKT_public_key *pk, uid_item_t ui)
        * Thus we need to check again.  */
       for (ki = key_table[hash]; ki; ki = ki->next)
         if (ki->fprlen == fprlen && !memcmp (ki->fpr, fpr, fprlen))
-          return ki;  /* Found  */
+          {
+            /* Found.  */
+            if (!ki->ui)
+              ki->ui = uid_item_ref (ui);
+            return ki;
+          }
     }
 
   /* We now know that there is an item in the attic.  */
@@ -519,6 +555,7 @@ key_table_put (PKT_public_key *pk, uid_item_t ui)
   ki->keyid[0] = keyid[0];
   ki->keyid[1] = keyid[1];
   ki->ui = uid_item_ref (ui);
+  ki->pk = NULL;
   ki->usecount = 0;
   ki->next = key_table[hash];
   key_table[hash] = ki;
@@ -566,10 +603,15 @@ cache_put_keyblock (kbnode_t keyblock)
 	{
           if (!ui)
             {
+              key_item_t ki;
+
               /* Initially we just test for an entry to avoid the need
                * to create a user id item for a put.  Only if we miss
-               * key in the cache we create a user id and restart.  */
-              if (!key_table_get (k->pkt->pkt.public_key, NULL))
+               * key in the cache (or its user id, because it has been
+               * entered by cache_put_pubkey) we create a user id and
+               * restart.  */
+              ki = key_table_get (k->pkt->pkt.public_key, NULL);
+              if (!ki || !ki->ui)
                 {
                   const char *uid;
                   size_t uidlen;
@@ -621,11 +663,12 @@ cache_get_uid_bykid (u32 *keyid, unsigned int *r_length)
     *r_length = 0;
 
   ki = key_table_get (NULL, keyid);
-  if (!ki)
-    return NULL; /* Not found or duplicate keyid.  */
-
-  if (!ki->ui)
-    p = NULL;  /* No user id known for key.  */
+  if (!ki || !ki->ui)
+    {
+      /* Not found, duplicate keyid, or no user id known for key.  */
+      lookup_stats.uid_misses++;
+      return NULL;
+    }
   else
     {
       p = xtrymalloc (ki->ui->namelen + 1);
@@ -635,6 +678,7 @@ cache_get_uid_bykid (u32 *keyid, unsigned int *r_length)
           if (r_length)
             *r_length = ki->ui->namelen;
           ki->usecount++;
+          lookup_stats.uid_hits++;
         }
     }
 
@@ -668,11 +712,12 @@ cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length)
     if (ki->fprlen == fprlen && !memcmp (ki->fpr, fpr, fprlen))
       break; /* Found */
 
-  if (!ki)
-    return NULL; /* Not found.  */
-
-  if (!ki->ui)
-    p = NULL;  /* No user id known for key.  */
+  if (!ki || !ki->ui)
+    {
+      /* Not found or no user id known for key.  */
+      lookup_stats.uid_misses++;
+      return NULL;
+    }
   else
     {
       p = xtrymalloc (ki->ui->namelen + 1);
@@ -682,8 +727,74 @@ cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length)
           if (r_length)
             *r_length = ki->ui->namelen;
           ki->usecount++;
+          lookup_stats.uid_hits++;
         }
     }
 
   return p;
 }
+
+
+/* Store a copy of the public key PK as returned by get_pubkey.  An
+ * already stored key is not replaced.  */
+void
+cache_put_pubkey (PKT_public_key *pk)
+{
+  key_item_t ki;
+
+  ki = key_table_put (pk, NULL);
+  if (!ki)
+    {
+      log_info ("Note: failed to cache a key: %s\n",
+                gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+  if (ki->pk)
+    {
+      if (DBG_CACHE)
+        log_debug ("cache_put_pubkey: already in cache\n");
+      return;
+    }
+  ki->pk = copy_public_key (NULL, pk);
+}
+
+
+/* Copy the public key with KEYID stored by cache_put_pubkey to PK.
+ * If PRIMARY_ONLY is set only primary keys are considered.  Returns
+ * true on success.  */
+int
+cache_get_pubkey (u32 *keyid, int primary_only, PKT_public_key *pk)
+{
+  key_item_t ki;
+
+  ki = key_table_get (NULL, keyid);
+  if (!ki || !ki->pk
+      || (primary_only
+          && (ki->pk->keyid[0] != ki->pk->main_keyid[0]
+              || ki->pk->keyid[1] != ki->pk->main_keyid[1])))
+    {
+      lookup_stats.pk_misses++;
+      return 0;
+    }
+
+  copy_public_key (pk, ki->pk);
+  ki->usecount++;
+  lookup_stats.pk_hits++;
+  return 1;
+}
+
+
+/* Remove all public keys stored by cache_put_pubkey.  */
+void
+cache_drop_pubkeys (void)
+{
+  unsigned int idx;
+  key_item_t ki;
+
+  for (idx = 0; idx < key_table_size; idx++)
+    for (ki = key_table[idx]; ki; ki = ki->next)
+      {
+        free_public_key (ki->pk);
+        ki->pk = NULL;
+      }
+}
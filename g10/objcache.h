@@ -25,5 +25,8 @@ void objcache_dump_stats (void);
 void cache_put_keyblock (kbnode_t keyblock);
 char *cache_get_uid_bykid (u32 *keyid, unsigned int *r_length);
 char *cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length);
+void cache_put_pubkey (PKT_public_key *pk);
+int cache_get_pubkey (u32 *keyid, int primary_only, PKT_public_key *pk);
+void cache_drop_pubkeys (void);
 
 #endif /*GNUPG_G10_OBJCACHE_H*/
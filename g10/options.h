@@ -65,6 +65,34 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* The number of worker threads for AEAD encryption; 0 for none.  */
+  int aead_threads;
+
+  /* Run the compress and cipher filters on their own threads.  */
+  int pipeline;
+
+  /* The number of worker threads for zlib compression; 0 for none.  */
+  int compress_threads;
+
+  /* The number of threads to check certifications during a trustdb
+   * check; 0 for none.  */
+  int sig_check_threads;
+
+  /* The maximum number of non-self-signatures imported per user ID
+   * or subkey; 0 for no limit.  */
+  unsigned int import_max_sigs;
+
+  /* The number of threads to encrypt the session key to the
+   * recipients; 0 for none.  */
+  int pubkey_enc_threads;
+
+  /* The number of parallel agent connections used to sign with
+   * several keys; 0 for none.  */
+  int sign_threads;
+
+  /* Verify detached signatures over one data file with --verify-files.  */
+  int detached_multi;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -166,6 +194,7 @@ struct
   int not_dash_escaped;
   int escape_from;
   int lock_once;
+  int trustdb_cache_size;  /* Size of the trustdb page cache in MiB.  */
   keyserver_spec_t keyserver;  /* The list of configured keyservers.  */
   struct
   {
@@ -212,12 +241,14 @@ struct
   int command_fd;
   const char *override_session_key;
   int show_session_key;
+  int session_key_cache_ttl; /* Cache session keys in gpg-agent.  */
 
   const char *gpg_agent_info;
   int try_all_secrets;
   int no_expensive_trust_checks;
   int no_sig_cache;
   int no_auto_check_trustdb;
+  int background_check_trustdb; /* Run the auto check detached.  */
   int preserve_permissions;
   int no_homedir_creation;
   struct groupitem *grouplist;
@@ -277,6 +308,9 @@ struct
     struct akl *next;
   } *auto_key_locate;
 
+  /* Run the network lookups of the auto-key-locate list concurrently.  */
+  int akl_race;
+
   /* The value of --key-origin.  See parse_key_origin().  */
   int key_origin;
   char *key_origin_url;
@@ -325,6 +359,7 @@ struct {
 #define DBG_CLOCK_VALUE   4096
 #define DBG_LOOKUP_VALUE  8192	/* debug the key lookup */
 #define DBG_EXTPROG_VALUE 16384 /* debug external program calls */
+#define DBG_TIMING_VALUE  32768 /* print startup timings */
 
 /* Tests for the debugging flags.  */
 #define DBG_PACKET (opt.debug & DBG_PACKET_VALUE)
@@ -338,6 +373,7 @@ struct {
 #define DBG_CLOCK   (opt.debug & DBG_CLOCK_VALUE)
 #define DBG_LOOKUP  (opt.debug & DBG_LOOKUP_VALUE)
 #define DBG_EXTPROG (opt.debug & DBG_EXTPROG_VALUE)
+#define DBG_TIMING  (opt.debug & DBG_TIMING_VALUE)
 
 /* FIXME: We need to check why we did not put this into opt. */
 #define DBG_MEMORY    memory_debug_mode
@@ -374,6 +410,7 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define IMPORT_DRY_RUN                   (1<<12)
 #define IMPORT_DROP_UIDS                 (1<<13)
 #define IMPORT_SELF_SIGS_ONLY            (1<<14)
+#define IMPORT_BULK                      (1<<15)
 
 #define EXPORT_LOCAL_SIGS                (1<<0)
 #define EXPORT_ATTRIBUTES                (1<<1)
@@ -384,6 +421,7 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define EXPORT_PKA_FORMAT                (1<<6)
 #define EXPORT_DANE_FORMAT               (1<<7)
 #define EXPORT_BACKUP                    (1<<10)
+#define EXPORT_PARALLEL                  (1<<11)
 #define EXPORT_DROP_UIDS                 (1<<13)
 
 #define LIST_SHOW_PHOTOS                 (1<<0)
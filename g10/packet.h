@@ -265,6 +265,10 @@ typedef struct
   byte digest_start[2];
   /* The signature.  (Serialized.)  */
   gcry_mpi_t  data[PUBKEY_MAX_NSIG];
+  /* If not NULL the still undecoded signature values; DATA is then
+   * not yet set.  Use sig_decode_data before accessing DATA.  */
+  byte *rawdata;
+  size_t rawdatalen;
   /* The message digest and its length (in bytes).  Note the maximum
      digest length is 512 bits (64 bytes).  If DIGEST_LEN is 0, then
      the digest's value has not been saved here.  */
@@ -428,7 +432,11 @@ typedef struct
     unsigned int backsig:2;       /* 0=none, 1=bad, 2=good.  */
     unsigned int serialno_valid:1;/* SERIALNO below is valid.  */
     unsigned int exact:1;         /* Found via exact (!) search.  */
+    unsigned int keygrip_valid:1; /* KEYGRIP below is valid.  */
   } flags;
+  /* The keygrip of the key.  Only valid if FLAGS.KEYGRIP_VALID is set.
+     Never access this value directly; use keygrip_from_pk.  */
+  byte    keygrip[KEYGRIP_LEN];
   PKT_user_id *user_id;   /* If != NULL: found by that uid. */
   struct revocation_key *revkey;
   int     numrevkeys;
@@ -634,6 +642,8 @@ typedef struct notation *notation_t;
 
 /*-- mainproc.c --*/
 void reset_literals_seen(void);
+void enable_detached_md_cache (void);
+void release_detached_md_cache (void);
 int proc_packets (ctrl_t ctrl, void *ctx, iobuf_t a );
 int proc_signature_packets (ctrl_t ctrl, void *ctx, iobuf_t a,
 			    strlist_t signedfiles, const char *sigfile );
@@ -668,6 +678,8 @@ struct parse_packet_ctx_s
   struct packet_struct last_pkt; /* The last parsed packet.  */
   int free_last_pkt; /* Indicates that LAST_PKT must be freed.  */
   int skip_meta;     /* Skip ring trust packets.  */
+  int no_pool;       /* Do not use the packet pools (worker threads).  */
+  int lazy_sig_data; /* Decode the values of signatures on demand.  */
   unsigned int n_parsed_packets;	/* Number of parsed packets.  */
 };
 typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
@@ -678,6 +690,8 @@ typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
     (a)->last_pkt.pkt.generic= NULL;\
     (a)->free_last_pkt = 0;         \
     (a)->skip_meta = 0;             \
+    (a)->no_pool = 0;               \
+    (a)->lazy_sig_data = 0;         \
     (a)->n_parsed_packets = 0;      \
   } while (0)
 
@@ -761,6 +775,9 @@ int copy_some_packets (iobuf_t inp, iobuf_t out, off_t stopoff);
 int skip_some_packets (iobuf_t inp, unsigned int n);
 #endif
 
+/* Return the length of a packet from its header at HDR.  */
+size_t packet_length_from_header (const byte *hdr, size_t n, int *r_pkttype);
+
 /* Parse a signature packet and store it in *SIG.
 
    The signature packet is read from INP.  The OpenPGP header (the tag
@@ -771,9 +788,15 @@ int skip_some_packets (iobuf_t inp, unsigned int n);
    the upper bound on the amount of data read from INP.  If the packet
    is shorter than PKTLEN, the data at the end will be silently
    skipped.  If an error occurs, an error code will be returned.  -1
-   means the EOF was encountered.  0 means parsing was successful.  */
+   means the EOF was encountered.  0 means parsing was successful.
+   If LAZY is set the signature values are only stored and decoded
+   by sig_decode_data.  */
 int parse_signature( iobuf_t inp, int pkttype, unsigned long pktlen,
-		     PKT_signature *sig );
+		     PKT_signature *sig, int lazy );
+
+/* Decode the signature values of SIG if they have been stored by a
+   lazy parse_signature.  Returns 0 if SIG->DATA is valid.  */
+gpg_error_t sig_decode_data (PKT_signature *sig);
 
 /* Given a signature packet, either:
  *
@@ -881,6 +904,10 @@ struct notation *sig_to_notation(PKT_signature *sig);
 void free_notation(struct notation *notation);
 
 /*-- free-packet.c --*/
+PACKET *alloc_packet (void);
+void release_packet_struct (PACKET *pkt);
+PKT_signature *alloc_signature (int no_pool);
+PKT_public_key *alloc_public_key (int no_pool);
 void free_symkey_enc( PKT_symkey_enc *enc );
 void free_pubkey_enc( PKT_pubkey_enc *enc );
 void free_seckey_enc( PKT_signature *enc );
@@ -894,6 +921,7 @@ prefitem_t *copy_prefs (const prefitem_t *prefs);
 PKT_public_key *copy_public_key( PKT_public_key *d, PKT_public_key *s );
 PKT_signature *copy_signature( PKT_signature *d, PKT_signature *s );
 PKT_user_id *scopy_user_id (PKT_user_id *sd );
+PKT_user_id *copy_user_id (PKT_user_id *s);
 int cmp_public_keys( PKT_public_key *a, PKT_public_key *b );
 int cmp_signatures( PKT_signature *a, PKT_signature *b );
 int cmp_user_ids( PKT_user_id *a, PKT_user_id *b );
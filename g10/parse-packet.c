@@ -36,6 +36,7 @@
 #include "../common/i18n.h"
 #include "../common/host2net.h"
 #include "../common/mbox-util.h"
+#include "../common/tracepoint.h"
 
 
 static int mpi_print_mode;
@@ -188,6 +189,54 @@ mpi_read (iobuf_t inp, unsigned int *ret_nread, int secure)
 }
 
 
+/* Decode the signature values of SIG stored by a lazy
+ * parse_signature.  On error the raw values are kept so that the
+ * signature can still be written back.  */
+gpg_error_t
+sig_decode_data (PKT_signature *sig)
+{
+  const byte *p;
+  size_t len, n;
+  unsigned int nbits;
+  int i, ndata;
+
+  if (!sig->rawdata)
+    return 0;
+
+  ndata = pubkey_get_nsig (sig->pubkey_algo);
+  p = sig->rawdata;
+  len = sig->rawdatalen;
+  for (i = 0; i < ndata; i++)
+    {
+      if (len < 2)
+        goto bad;
+      nbits = buf16_to_uint (p);
+      if (nbits > MAX_EXTERN_MPI_BITS)
+        goto bad;
+      n = 2 + (nbits + 7) / 8;
+      if (n > len
+          || gcry_mpi_scan (&sig->data[i], GCRYMPI_FMT_PGP, p, n, NULL))
+        goto bad;
+      p += n;
+      len -= n;
+    }
+
+  xfree (sig->rawdata);
+  sig->rawdata = NULL;
+  sig->rawdatalen = 0;
+  return 0;
+
+ bad:
+  for (i = 0; i < ndata; i++)
+    {
+      gcry_mpi_release (sig->data[i]);
+      sig->data[i] = NULL;
+    }
+  log_error ("signature packet: invalid signature values\n");
+  return gpg_error (GPG_ERR_INV_PACKET);
+}
+
+
 /* Register STRING as a known critical notation name.  */
 void
 register_known_notation (const char *string)
@@ -526,6 +575,69 @@ skip_some_packets (iobuf_t inp, unsigned int n)
 #endif /*!DEBUG_PARSE_PACKET*/
 
 
+/* Return the length of the packet with the header in the N bytes at
+ * HDR and store its type at R_PKTTYPE.  The length includes the
+ * header.  Returns 0 if the length can't be determined without
+ * parsing the packet; for example when using partial length encoding
+ * or if the packet is too long for a keyblock.  */
+size_t
+packet_length_from_header (const byte *hdr, size_t n, int *r_pkttype)
+{
+  size_t hdrlen, pktlen;
+  int c, lenbytes, i;
+
+  c = hdr[0];
+  if (!(c & 0x80))
+    return 0;  /* Invalid CTB.  */
+
+  if ((c & 0x40))  /* New format.  */
+    {
+      *r_pkttype = c & 0x3f;
+      if (n < 2)
+        return 0;
+      c = hdr[1];
+      if (c < 192)
+        {
+          hdrlen = 2;
+          pktlen = c;
+        }
+      else if (c < 224)
+        {
+          if (n < 3)
+            return 0;
+          hdrlen = 3;
+          pktlen = ((c - 192) << 8) + hdr[2] + 192;
+        }
+      else if (c == 255)
+        {
+          if (n < 6)
+            return 0;
+          hdrlen = 6;
+          pktlen = buf32_to_size_t (hdr+2);
+        }
+      else
+        return 0;  /* Partial length.  */
+    }
+  else  /* Old format.  */
+    {
+      *r_pkttype = (c >> 2) & 0xf;
+      if ((c & 3) == 3)
+        return 0;  /* Indeterminate length.  */
+      lenbytes = 1 << (c & 3);
+      hdrlen = 1 + lenbytes;
+      if (n < hdrlen)
+        return 0;
+      for (pktlen = 0, i = 1; i <= lenbytes; i++)
+        pktlen = (pktlen << 8) | hdr[i];
+    }
+
+  if (pktlen > MAX_ATTR_PACKET_LENGTH)
+    return 0;
+  return hdrlen + pktlen;
+}
+
+
+
 /* Parse a packet and save it in *PKT.
 
    If OUT is not NULL and the packet is valid (its type is not 0),
@@ -799,6 +911,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
 
   /* Count it.  */
   ctx->n_parsed_packets++;
+  TRACEPOINT2 (parse_packet_begin, pkttype, pktlen);
 
   pkt->pkttype = pkttype;
   rc = GPG_ERR_UNKNOWN_PACKET;	/* default error */
@@ -808,8 +921,42 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
     case PKT_PUBLIC_SUBKEY:
     case PKT_SECRET_KEY:
     case PKT_SECRET_SUBKEY:
-      pkt->pkt.public_key = xmalloc_clear (sizeof *pkt->pkt.public_key);
-      rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+      pkt->pkt.public_key = alloc_public_key (ctx->no_pool);
+      if (!pkt->pkt.public_key)
+        {
+          rc = gpg_error_from_syserror ();
+          break;
+        }
+      if ((pkttype == PKT_PUBLIC_KEY || pkttype == PKT_PUBLIC_SUBKEY)
+          && !partial && pktlen && pktlen <= MAX_KEY_PACKET_LENGTH)
+        {
+          /* The body of a public key packet is what the fingerprint
+           * is computed over.  Thus we parse from a copy of it and
+           * hash that to set the fingerprint right away.  */
+          byte *body;
+          iobuf_t a;
+
+          body = xtrymalloc (pktlen);
+          if (!body)
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+          if (iobuf_read (inp, body, pktlen) != pktlen)
+            {
+              xfree (body);
+              rc = gpg_error (GPG_ERR_INV_PACKET);
+              break;
+            }
+          a = iobuf_temp_with_content (body, pktlen);
+          rc = parse_key (a, pkttype, pktlen, hdr, hdrlen, pkt);
+          iobuf_close (a);
+          if (!rc)
+            fingerprint_from_packet (pkt->pkt.public_key, body, pktlen);
+          xfree (body);
+        }
+      else
+        rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
       break;
     case PKT_SYMKEY_ENC:
       rc = parse_symkeyenc (inp, pkttype, pktlen, pkt);
@@ -818,8 +965,14 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
       rc = parse_pubkeyenc (inp, pkttype, pktlen, pkt);
       break;
     case PKT_SIGNATURE:
-      pkt->pkt.signature = xmalloc_clear (sizeof *pkt->pkt.signature);
-      rc = parse_signature (inp, pkttype, pktlen, pkt->pkt.signature);
+      pkt->pkt.signature = alloc_signature (ctx->no_pool);
+      if (!pkt->pkt.signature)
+        {
+          rc = gpg_error_from_syserror ();
+          break;
+        }
+      rc = parse_signature (inp, pkttype, pktlen, pkt->pkt.signature,
+                            ctx->lazy_sig_data);
       break;
     case PKT_ONEPASS_SIG:
       pkt->pkt.onepass_sig = xmalloc_clear (sizeof *pkt->pkt.onepass_sig);
@@ -870,6 +1023,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
       skip_packet (inp, pkttype, pktlen, partial);
       break;
     }
+  TRACEPOINT2 (parse_packet_end, pkttype, rc);
 
   /* Store a shallow copy of certain packets in the context.  */
   free_packet (NULL, ctx);
@@ -1959,7 +2113,7 @@ parse_revkeys (PKT_signature * sig)
 
 int
 parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
-		 PKT_signature * sig)
+		 PKT_signature * sig, int lazy)
 {
   int md5_len = 0;
   unsigned n;
@@ -2241,6 +2395,18 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  pktlen = 0;
 	}
     }
+  else if (lazy && !list_mode && pktlen
+           && pktlen <= (ndata * MAX_EXTERN_MPI_BITS / 8 + 2 * ndata))
+    {
+      /* Store the raw values; most users of a keyblock never need
+       * them.  */
+      sig->rawdata = read_rest (inp, pktlen);
+      if (!sig->rawdata)
+        rc = GPG_ERR_INV_PACKET;
+      else
+        sig->rawdatalen = pktlen;
+      pktlen = 0;
+    }
   else
     {
       for (i = 0; i < ndata; i++)
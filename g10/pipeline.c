@@ -0,0 +1,337 @@
+/* pipeline.c - Run output filters on their own threads
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* A pipeline filter wraps an output filter.  Its flush function only
+ * copies the data into a bounded ring of buffers; a thread takes the
+ * buffers from the ring and feeds them to the wrapped filter, which
+ * writes its output to the next filter as usual.  Thus several
+ * filters of a chain, for example the compress and the cipher
+ * filter, work on different data at the same time.
+ *
+ * With nPth only one thread runs at a time unless a thread leaves
+ * the protected state.  Filters may thus call pipeline_unprotect and
+ * pipeline_protect around pure computations on their own state
+ * (e.g. deflate or gcry_cipher_encrypt); these functions do nothing
+ * unless called by a pipeline thread.
+ *
+ * Note that after data has been written to a pipeline filter the
+ * filters below it must not be accessed by the caller until the
+ * pipeline filter has been released.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/iobuf.h"
+#include "filter.h"
+#include "options.h"
+
+
+/* The number of buffers in the ring.  */
+#define PIPELINE_SLOTS 4
+
+
+/* The context of a pipeline filter.  */
+struct pipeline_filter_s
+{
+  /* The wrapped filter, its context and whether we own the context.  */
+  int (*filter) (void *opaque, int control,
+                 iobuf_t chain, byte *buf, size_t *len);
+  void *filter_ov;
+  int filter_ov_owner;
+
+  /* The chain used by the thread.  */
+  iobuf_t chain;
+
+  npth_t thread;
+  int started;
+
+  npth_mutex_t lock;     /* Protects the fields below.  */
+  npth_cond_t cond;      /* Signaled on each change.  */
+  int shutdown;          /* No more data will be added.  */
+  gpg_error_t err;       /* The first error of the wrapped filter.  */
+  int head;              /* Index of the oldest used slot.  */
+  int count;             /* Number of used slots.  */
+  struct {
+    byte *buf;
+    size_t size;         /* Allocated size of BUF.  */
+    size_t len;          /* Used length of BUF.  */
+  } slots[PIPELINE_SLOTS];
+};
+typedef struct pipeline_filter_s *pipeline_filter_t;
+
+
+/* Key used to mark pipeline threads.  */
+static npth_key_t pipeline_key;
+static int pipeline_key_valid;
+
+
+/* Leave the protected state if called by a pipeline thread.  The
+ * caller may then only work on its own data.  */
+void
+pipeline_unprotect (void)
+{
+  if (pipeline_key_valid && npth_getspecific (pipeline_key))
+    npth_unprotect ();
+}
+
+
+/* Counterpart to pipeline_unprotect.  */
+void
+pipeline_protect (void)
+{
+  if (pipeline_key_valid && npth_getspecific (pipeline_key))
+    npth_protect ();
+}
+
+
+/* The thread feeding the ring's buffers to the wrapped filter.  */
+static void *
+pipeline_thread (void *arg)
+{
+  pipeline_filter_t pfx = arg;
+  gpg_error_t err;
+  size_t len;
+  int idx;
+
+  npth_setspecific (pipeline_key, pfx);
+
+  npth_mutex_lock (&pfx->lock);
+  for (;;)
+    {
+      if (!pfx->count)
+        {
+          if (pfx->shutdown)
+            break;
+          npth_cond_wait (&pfx->cond, &pfx->lock);
+          continue;
+        }
+      idx = pfx->head;
+      npth_mutex_unlock (&pfx->lock);
+
+      /* The slot stays in use until we are done with it.  */
+      len = pfx->slots[idx].len;
+      err = 0;
+      if (!pfx->err)
+        {
+          err = pfx->filter (pfx->filter_ov, IOBUFCTRL_FLUSH, pfx->chain,
+                             pfx->slots[idx].buf, &len);
+          if (!err && len != pfx->slots[idx].len)
+            {
+              log_error ("pipeline: filter did not write all\n");
+              err = gpg_error (GPG_ERR_INTERNAL);
+            }
+        }
+
+      npth_mutex_lock (&pfx->lock);
+      if (err && !pfx->err)
+        pfx->err = err;
+      pfx->head = (pfx->head + 1) % PIPELINE_SLOTS;
+      pfx->count--;
+      npth_cond_broadcast (&pfx->cond);
+    }
+  npth_mutex_unlock (&pfx->lock);
+
+  return NULL;
+}
+
+
+/* Start the thread of PFX.  */
+static gpg_error_t
+start_thread (pipeline_filter_t pfx)
+{
+  gpg_error_t err;
+  npth_attr_t tattr;
+  int rc;
+
+  if (!pipeline_key_valid)
+    {
+      rc = npth_key_create (&pipeline_key, NULL);
+      if (rc)
+        return gpg_error_from_errno (rc);
+      pipeline_key_valid = 1;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    return gpg_error_from_errno (rc);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  rc = npth_create (&pfx->thread, &tattr, pipeline_thread, pfx);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      log_error ("error spawning pipeline thread: %s\n", gpg_strerror (err));
+      npth_attr_destroy (&tattr);
+      return err;
+    }
+  npth_setname_np (pfx->thread, "pipeline");
+  npth_attr_destroy (&tattr);
+  pfx->started = 1;
+  return 0;
+}
+
+
+/* Put the LEN bytes at BUF into the ring of PFX.  */
+static gpg_error_t
+pipeline_flush (pipeline_filter_t pfx, iobuf_t chain,
+                const byte *buf, size_t len)
+{
+  gpg_error_t err;
+  int idx;
+
+  if (!pfx->started)
+    {
+      pfx->chain = chain;
+      err = start_thread (pfx);
+      if (err)
+        return err;
+    }
+  log_assert (pfx->chain == chain);
+
+  npth_mutex_lock (&pfx->lock);
+  while (pfx->count == PIPELINE_SLOTS && !pfx->err)
+    npth_cond_wait (&pfx->cond, &pfx->lock);
+  err = pfx->err;
+  idx = (pfx->head + pfx->count) % PIPELINE_SLOTS;
+  npth_mutex_unlock (&pfx->lock);
+  if (err)
+    return err;
+
+  /* The free slot is not accessed by the thread.  */
+  if (pfx->slots[idx].size < len)
+    {
+      xfree (pfx->slots[idx].buf);
+      pfx->slots[idx].buf = xtrymalloc (len);
+      if (!pfx->slots[idx].buf)
+        {
+          pfx->slots[idx].size = 0;
+          return gpg_error_from_syserror ();
+        }
+      pfx->slots[idx].size = len;
+    }
+  memcpy (pfx->slots[idx].buf, buf, len);
+  pfx->slots[idx].len = len;
+
+  npth_mutex_lock (&pfx->lock);
+  pfx->count++;
+  npth_cond_broadcast (&pfx->cond);
+  npth_mutex_unlock (&pfx->lock);
+
+  return 0;
+}
+
+
+/* Wait until the thread of PFX has processed all data and terminate
+ * it.  Returns the first error of the wrapped filter.  */
+static gpg_error_t
+stop_thread (pipeline_filter_t pfx)
+{
+  if (!pfx->started)
+    return 0;
+
+  npth_mutex_lock (&pfx->lock);
+  pfx->shutdown = 1;
+  npth_cond_broadcast (&pfx->cond);
+  npth_mutex_unlock (&pfx->lock);
+  npth_join (pfx->thread, NULL);
+  pfx->started = 0;
+
+  return pfx->err;
+}
+
+
+/* The iobuf filter function of a pipeline filter.  */
+static int
+pipeline_filter (void *opaque, int control,
+                 iobuf_t chain, byte *buf, size_t *ret_len)
+{
+  pipeline_filter_t pfx = opaque;
+  gpg_error_t err = 0;
+  int rc, i;
+
+  if (control == IOBUFCTRL_FLUSH)
+    {
+      err = pipeline_flush (pfx, chain, buf, *ret_len);
+    }
+  else if (control == IOBUFCTRL_FREE || control == IOBUFCTRL_CANCEL)
+    {
+      err = stop_thread (pfx);
+      rc = pfx->filter (pfx->filter_ov, control, chain, buf, ret_len);
+      if (!err)
+        err = rc;
+      if (control == IOBUFCTRL_FREE)
+        {
+          if (pfx->filter_ov_owner)
+            xfree (pfx->filter_ov);
+          for (i = 0; i < PIPELINE_SLOTS; i++)
+            xfree (pfx->slots[i].buf);
+          npth_cond_destroy (&pfx->cond);
+          npth_mutex_destroy (&pfx->lock);
+          /* PFX itself is released by iobuf.  */
+        }
+    }
+  else /* IOBUFCTRL_INIT, IOBUFCTRL_DESC and everything else.  */
+    {
+      err = pfx->filter (pfx->filter_ov, control, chain, buf, ret_len);
+    }
+
+  return err;
+}
+
+
+/* Push the output filter F with context OV onto the pipeline A and
+ * run it on its own thread.  If REL_OV is set OV is released
+ * together with the filter.  Input pipelines get F pushed
+ * directly.  */
+gpg_error_t
+push_pipeline_filter (iobuf_t a,
+                      int (*f) (void *opaque, int control,
+                                iobuf_t chain, byte *buf, size_t *len),
+                      void *ov, int rel_ov)
+{
+  pipeline_filter_t pfx;
+  int rc;
+
+  if (a->use != IOBUF_OUTPUT && a->use != IOBUF_OUTPUT_TEMP)
+    return iobuf_push_filter2 (a, f, ov, rel_ov);
+
+  pfx = xtrycalloc (1, sizeof *pfx);
+  if (!pfx)
+    return gpg_error_from_syserror ();
+  pfx->filter = f;
+  pfx->filter_ov = ov;
+  pfx->filter_ov_owner = rel_ov;
+  npth_mutex_init (&pfx->lock, NULL);
+  npth_cond_init (&pfx->cond, NULL);
+
+  rc = iobuf_push_filter2 (a, pipeline_filter, pfx, 1);
+  if (rc)
+    {
+      npth_cond_destroy (&pfx->cond);
+      npth_mutex_destroy (&pfx->lock);
+      xfree (pfx);
+    }
+  return rc;
+}
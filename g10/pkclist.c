@@ -759,6 +759,13 @@ default_recipient (ctrl_t ctrl)
 }
 
 
+static gpg_error_t check_and_add_key (ctrl_t ctrl, const char *name,
+                                      unsigned int use, int mark_hidden,
+                                      int from_file, PKT_public_key *pk,
+                                      kbnode_t keyblock,
+                                      pk_list_t *pk_list_addr);
+
+
 /* Helper for build_pk_list to find and check one key.  This helper is
  * also used directly in server mode by the RECIPIENTS command.  On
  * success the new key is added to PK_LIST_ADDR.  NAME is the user id
@@ -805,6 +812,21 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
       return rc;
     }
 
+  return check_and_add_key (ctrl, name, use, mark_hidden, from_file,
+                            pk, keyblock, pk_list_addr);
+}
+
+
+/* The second part of find_and_check_key: Check the key PK found for
+ * NAME along with its KEYBLOCK and add it to PK_LIST_ADDR.  PK and
+ * KEYBLOCK are consumed.  */
+static gpg_error_t
+check_and_add_key (ctrl_t ctrl, const char *name, unsigned int use,
+                   int mark_hidden, int from_file, PKT_public_key *pk,
+                   kbnode_t keyblock, pk_list_t *pk_list_addr)
+{
+  int rc;
+
   rc = openpgp_pk_test_algo2 (pk->pubkey_algo, use);
   if (rc)
     {
@@ -901,6 +923,13 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
   strlist_t rov,remusr;
   char *def_rec = NULL;
   char pkstrbuf[PUBKEY_STRING_SIZE];
+  const char **names = NULL;
+  PKT_public_key **batch_pks = NULL;
+  kbnode_t *batch_keyblocks = NULL;
+  kbnode_t keyblock = NULL;
+  pubkeys_batch_t batch = NULL;
+  size_t nnames = 0;
+  size_t idx;
 
   /* Try to expand groups if any have been defined. */
   if (opt.grouplist)
@@ -908,6 +937,29 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
   else
     remusr = rcpts;
 
+  /* With many recipients start a single search for all those given
+   * by fingerprint or key id right away.  With the keyboxd this runs
+   * in the background while we process the encrypt-to keys.  */
+  for (rov = remusr; rov; rov = rov->next)
+    if (!(rov->flags & (PK_LIST_ENCRYPT_TO|PK_LIST_FROM_FILE)))
+      nnames++;
+  if (nnames > 1)
+    {
+      names = xtrycalloc (nnames, sizeof *names);
+      if (!names)
+        {
+          rc = gpg_error_from_syserror ();
+          goto fail;
+        }
+      for (idx = 0, rov = remusr; rov; rov = rov->next)
+        if (!(rov->flags & (PK_LIST_ENCRYPT_TO|PK_LIST_FROM_FILE)))
+          names[idx++] = rov->d;
+      rc = get_pubkeys_batch_start (ctrl, names, nnames, &batch);
+      if (rc && DBG_LOOKUP)
+        log_debug ("get_pubkeys_batch failed: %s\n", gpg_strerror (rc));
+      rc = 0;
+    }
+
   /* XXX: Change this function to use get_pubkeys instead of
      get_pubkey_byname to detect ambiguous key specifications and warn
      about duplicate keyblocks.  For ambiguous key specifications on
@@ -1243,17 +1295,52 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
     }
   else
     {
-      /* General case: Check all keys. */
+      /* General case: Check all keys.  First collect the keys from
+       * the batched search started above; on error we simply resolve
+       * them one by one.  */
+      if (batch)
+        {
+          batch_pks = xtrycalloc (nnames, sizeof *batch_pks);
+          batch_keyblocks = xtrycalloc (nnames, sizeof *batch_keyblocks);
+          if (!batch_pks || !batch_keyblocks)
+            {
+              rc = gpg_error_from_syserror ();
+              goto fail;
+            }
+          rc = get_pubkeys_batch_finish (batch, PUBKEY_USAGE_ENC,
+                                         batch_pks, batch_keyblocks);
+          batch = NULL;
+          if (rc && DBG_LOOKUP)
+            log_debug ("get_pubkeys_batch failed: %s\n", gpg_strerror (rc));
+          rc = 0;
+        }
+
       any_recipients = 0;
-      for (; remusr; remusr = remusr->next )
+      for (idx = 0; remusr; remusr = remusr->next )
         {
           if ( (remusr->flags & PK_LIST_ENCRYPT_TO) )
             continue; /* encrypt-to keys are already handled. */
 
-          rc = find_and_check_key (ctrl, remusr->d, PUBKEY_USAGE_ENC,
-                                   !!(remusr->flags&PK_LIST_HIDDEN),
-                                   !!(remusr->flags&PK_LIST_FROM_FILE),
-                                   &pk_list);
+          if (batch_pks && !(remusr->flags & PK_LIST_FROM_FILE))
+            {
+              pk = batch_pks[idx];
+              keyblock = batch_keyblocks[idx];
+              batch_pks[idx] = NULL;
+              batch_keyblocks[idx] = NULL;
+              idx++;
+            }
+          if (pk)
+            {
+              rc = check_and_add_key (ctrl, remusr->d, PUBKEY_USAGE_ENC,
+                                      !!(remusr->flags&PK_LIST_HIDDEN), 0,
+                                      pk, keyblock, &pk_list);
+              pk = NULL;
+            }
+          else
+            rc = find_and_check_key (ctrl, remusr->d, PUBKEY_USAGE_ENC,
+                                     !!(remusr->flags&PK_LIST_HIDDEN),
+                                     !!(remusr->flags&PK_LIST_FROM_FILE),
+                                     &pk_list);
           if (rc)
             goto fail;
           any_recipients = 1;
@@ -1292,6 +1379,19 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
 
  fail:
 
+  get_pubkeys_batch_finish (batch, 0, NULL, NULL);
+  if (batch_pks && batch_keyblocks)
+    {
+      for (idx = 0; idx < nnames; idx++)
+        {
+          free_public_key (batch_pks[idx]);
+          release_kbnode (batch_keyblocks[idx]);
+        }
+    }
+  xfree (batch_pks);
+  xfree (batch_keyblocks);
+  xfree (names);
+
   if ( rc )
     release_pk_list( pk_list );
   else
@@ -24,9 +24,13 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifdef HAVE_DOSISH_SYSTEM
 # include <fcntl.h> /* for setmode() */
 #endif
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -221,6 +225,22 @@ get_output_file (const byte *embedded_name, int embedded_namelen,
   return 0;
 }
 
+
+/* Return the size of the buffer used to read binary literal data.
+ * iobuf_read lets the filters write directly into the caller's
+ * buffer if the request is at least as large as the iobuf buffer.
+ * Using that size allows the decryption and decompression filters to
+ * produce the plaintext right in our buffer instead of copying it
+ * through the buffers of the iobuf chain.  */
+static size_t
+literal_buffer_size (void)
+{
+  size_t size = iobuf_set_buffer_size (0) * 1024;
+
+  return size < 32768? 32768 : size;
+}
+
+
 /* Handle a plaintext packet.  If MFX is not NULL, update the MDs
  * Note: We should have used the filter stuff here, but we have to add
  * some easy mimic to set a read limit, so we calculate only the bytes
@@ -330,10 +350,11 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else  /* Binary mode.  */
 	{
-	  byte *buffer = xmalloc (32768);
+	  size_t bufsize = literal_buffer_size ();
+	  byte *buffer = xmalloc (bufsize);
 	  while (pt->len)
 	    {
-	      int len = pt->len > 32768 ? 32768 : pt->len;
+	      int len = pt->len > bufsize ? bufsize : pt->len;
 	      len = iobuf_read (pt->buf, buffer, len);
 	      if (len == -1)
 		{
@@ -405,10 +426,11 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else
 	{			/* binary mode */
+	  size_t bufsize = literal_buffer_size ();
 	  byte *buffer;
 	  int eof_seen = 0;
 
-          buffer = xtrymalloc (32768);
+          buffer = xtrymalloc (bufsize);
           if (!buffer)
             {
               err = gpg_error_from_syserror ();
@@ -417,16 +439,16 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 
 	  while (!eof_seen)
 	    {
-	      /* Why do we check for len < 32768:
+	      /* Why do we check for len < bufsize:
 	       * If we won't, we would practically read 2 EOFs but
 	       * the first one has already popped the block_filter
 	       * off and therefore we don't catch the boundary.
 	       * So, always assume EOF if iobuf_read returns less bytes
 	       * then requested */
-	      int len = iobuf_read (pt->buf, buffer, 32768);
+	      int len = iobuf_read (pt->buf, buffer, bufsize);
 	      if (len == -1)
 		break;
-	      if (len < 32768)
+	      if (len < bufsize)
 		eof_seen = 1;
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
@@ -545,11 +567,94 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 }
 
 
+/* Files of at least this size are hashed using mmap.  */
+#define HASH_MMAP_THRESHOLD (1024*1024)
+
+/* The size of the window mapped at once.  */
+#define HASH_MMAP_WINDOW (64*1024*1024)
+
+
+/* Hash the regular file underlying FP into MD using mmap.  This is
+ * only done if nothing has been read from FP and no filters are
+ * pushed onto it.  Returns true if the entire file has been hashed;
+ * otherwise the caller needs to hash the remaining data from FP.  */
+static int
+hash_mapped_file (gcry_md_hd_t md, IOBUF fp)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  off_t off;
+  size_t len;
+  void *addr;
+  int fd;
+
+  if (fp->chain || iobuf_tell (fp) || (fd = iobuf_get_fd (fp)) == -1)
+    return 0;
+  if (fstat (fd, &st) || !S_ISREG (st.st_mode)
+      || st.st_size < HASH_MMAP_THRESHOLD)
+    return 0;
+
+  for (off = 0; off < st.st_size; off += len)
+    {
+      len = HASH_MMAP_WINDOW;
+      if (st.st_size - off < len)
+        len = st.st_size - off;
+      addr = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, off);
+      if (addr == MAP_FAILED)
+        {
+          /* Let the caller read the rest.  */
+          if (off && iobuf_seek (fp, off))
+            log_fatal ("can't seek in the signed data: %s\n",
+                       strerror (errno));
+          return 0;
+        }
+#ifdef MADV_SEQUENTIAL
+      madvise (addr, len, MADV_SEQUENTIAL);
+#endif
+      gcry_md_write (md, addr, len);
+      munmap (addr, len);
+    }
+  return 1;
+#else
+  (void)md;
+  (void)fp;
+  return 0;
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Hash LEN bytes at BUF into MD2 and convert single CRs and LFs to
+ * CR,LF.  LC is the last character of the previous block, or -1.
+ * Returns the last character of BUF.  */
+static int
+hash_crlf_block (gcry_md_hd_t md2, const byte *buf, size_t len, int lc)
+{
+  size_t i, start;
+
+  for (start = i = 0; i < len; lc = buf[i], i++)
+    {
+      if (buf[i] == '\n'? (lc != '\r') : (lc == '\r'))
+        {
+          /* Insert the missing part of the CR,LF.  */
+          gcry_md_write (md2, buf + start, i - start);
+          gcry_md_putc (md2, buf[i] == '\n'? '\r' : '\n');
+          start = i;
+        }
+    }
+  gcry_md_write (md2, buf + start, len - start);
+  return lc;
+}
+
+
 static void
 do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
 {
   text_filter_context_t tfx;
-  int c;
+  byte buffer[32768];
+  int n;
+
+  if (!textmode && !md2 && md && hash_mapped_file (md, fp))
+    return;
 
   if (textmode)
     {
@@ -560,34 +665,19 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
     {				/* work around a strange behaviour in pgp2 */
       /* It seems that at least PGP5 converts a single CR to a CR,LF too */
       int lc = -1;
-      while ((c = iobuf_get (fp)) != -1)
+      while ((n = iobuf_read (fp, buffer, sizeof buffer)) != -1)
 	{
-	  if (c == '\n' && lc == '\r')
-	    gcry_md_putc (md2, c);
-	  else if (c == '\n')
-	    {
-	      gcry_md_putc (md2, '\r');
-	      gcry_md_putc (md2, c);
-	    }
-	  else if (c != '\n' && lc == '\r')
-	    {
-	      gcry_md_putc (md2, '\n');
-	      gcry_md_putc (md2, c);
-	    }
-	  else
-	    gcry_md_putc (md2, c);
-
+	  lc = hash_crlf_block (md2, buffer, n, lc);
 	  if (md)
-	    gcry_md_putc (md, c);
-	  lc = c;
+	    gcry_md_write (md, buffer, n);
 	}
     }
   else
     {
-      while ((c = iobuf_get (fp)) != -1)
+      while ((n = iobuf_read (fp, buffer, sizeof buffer)) != -1)
 	{
 	  if (md)
-	    gcry_md_putc (md, c);
+	    gcry_md_write (md, buffer, n);
 	}
     }
 }
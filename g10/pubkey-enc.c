@@ -67,6 +67,156 @@ is_algo_in_prefs (kbnode_t keyblock, preftype_t type, int algo)
 }
 
 
+/* Return true if the encrypted session key ENC can't have been
+ * encrypted to the key SK because the size of the values does not
+ * match the key.  This is used to skip private key operations which
+ * are bound to fail when trying keys for an anonymous recipient.  */
+static int
+enc_size_mismatch (struct pubkey_enc_list *enc, PKT_public_key *sk)
+{
+  unsigned int nbits, ebits;
+
+  switch (sk->pubkey_algo)
+    {
+    case PUBKEY_ALGO_RSA:
+    case PUBKEY_ALGO_RSA_E:
+      /* The ciphertext is less than the modulus.  */
+      if (!enc->data[0] || !sk->pkey[0])
+        return 0;
+      return (gcry_mpi_get_nbits (enc->data[0])
+              > gcry_mpi_get_nbits (sk->pkey[0]));
+
+    case PUBKEY_ALGO_ELGAMAL:
+    case PUBKEY_ALGO_ELGAMAL_E:
+      /* Both values are less than the prime.  */
+      if (!enc->data[0] || !enc->data[1] || !sk->pkey[0])
+        return 0;
+      nbits = gcry_mpi_get_nbits (sk->pkey[0]);
+      return (gcry_mpi_get_nbits (enc->data[0]) > nbits
+              || gcry_mpi_get_nbits (enc->data[1]) > nbits);
+
+    case PUBKEY_ALGO_ECDH:
+      /* The ephemeral key is a point on the same curve.  We only
+       * compare uncompressed points (prefix 0x04, thus a bit length
+       * of 8*n-5) because other encodings may legitimately differ in
+       * size for the same curve.  */
+      if (!enc->data[0] || !sk->pkey[1])
+        return 0;
+      ebits = gcry_mpi_get_nbits (enc->data[0]);
+      nbits = gcry_mpi_get_nbits (sk->pkey[1]);
+      return (ebits % 8 == 3 && nbits % 8 == 3 && ebits != nbits);
+
+    default:
+      return 0;
+    }
+}
+
+
+/* Return the id under which the session key for the PKESK packets in
+ * LIST is cached by gpg-agent or NULL on error.  The id is a hash
+ * over the algorithms, key ids and encrypted values of all packets.
+ * The caller must free the returned string.  */
+static char *
+session_key_cache_id (struct pubkey_enc_list *list)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  struct pubkey_enc_list *k;
+  byte buf[9];
+  byte *p;
+  size_t n;
+  unsigned int nbits;
+  int i;
+  char *result;
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256, 0);
+  if (err)
+    return NULL;
+
+  for (k = list; k; k = k->next)
+    {
+      buf[0] = k->pubkey_algo;
+      for (i = 0; i < 4; i++)
+        {
+          buf[1+i] = k->keyid[0] >> (24 - 8*i);
+          buf[5+i] = k->keyid[1] >> (24 - 8*i);
+        }
+      gcry_md_write (md, buf, 9);
+      for (i = 0; i < DIM (k->data); i++)
+        {
+          if (!k->data[i])
+            continue;
+          if (gcry_mpi_get_flag (k->data[i], GCRYMPI_FLAG_OPAQUE))
+            {
+              p = gcry_mpi_get_opaque (k->data[i], &nbits);
+              if (p)
+                gcry_md_write (md, p, (nbits+7)/8);
+            }
+          else if (!gcry_mpi_aprint (GCRYMPI_FMT_USG, &p, &n, k->data[i]))
+            {
+              gcry_md_write (md, p, n);
+              gcry_free (p);
+            }
+          else
+            {
+              gcry_md_close (md);
+              return NULL;
+            }
+        }
+    }
+
+  result = xtrymalloc (7 + 64 + 1);
+  if (result)
+    {
+      strcpy (result, "gpg-sk:");
+      bin2hex (gcry_md_read (md, 0), 32, result + 7);
+    }
+  gcry_md_close (md);
+  return result;
+}
+
+
+/* Look up the session key cached under CACHEID in gpg-agent and store
+ * it at DEK.  Returns true on success.  */
+static int
+get_cached_session_key (const char *cacheid, DEK *dek)
+{
+  char *value;
+  gpg_error_t err;
+
+  if (agent_get_secret (cacheid, &value))
+    return 0;
+  err = get_override_session_key (dek, value);
+  wipememory (value, strlen (value));
+  xfree (value);
+  if (err || openpgp_cipher_test_algo (dek->algo)
+      || dek->keylen != openpgp_cipher_get_algo_keylen (dek->algo))
+    {
+      memset (dek, 0, sizeof *dek);
+      return 0;
+    }
+  if (opt.verbose)
+    log_info (_("using cached session key\n"));
+  return 1;
+}
+
+
+/* Store the session key DEK in gpg-agent's cache under CACHEID.  */
+static void
+put_cached_session_key (const char *cacheid, DEK *dek)
+{
+  char value[16 + 2 * DIM (dek->key)];
+  gpg_error_t err;
+
+  snprintf (value, sizeof value, "%d:", dek->algo);
+  bin2hex (dek->key, dek->keylen, value + strlen (value));
+  err = agent_put_secret (cacheid, opt.session_key_cache_ttl, value);
+  wipememory (value, sizeof value);
+  if (err)
+    log_info ("error caching the session key: %s\n", gpg_strerror (err));
+}
+
+
 /*
  * Get the session key from a pubkey enc packet and return it in DEK,
  * which should have been allocated in secure memory by the caller.
@@ -80,10 +230,21 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
   u32 keyid[2];
   int search_for_secret_keys = 1;
   struct pubkey_enc_list *k;
+  char *cacheid = NULL;
 
   if (DBG_CLOCK)
     log_clock ("get_session_key enter");
 
+  if (opt.session_key_cache_ttl > 0)
+    {
+      cacheid = session_key_cache_id (list);
+      if (cacheid && get_cached_session_key (cacheid, dek))
+        {
+          err = 0;
+          goto leave;
+        }
+    }
+
   while (search_for_secret_keys)
     {
       sk = xmalloc_clear (sizeof *sk);
@@ -138,6 +299,9 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
               if (opt.skip_hidden_recipients)
                 continue;
 
+              if (enc_size_mismatch (k, sk))
+                continue;
+
               if (!opt.quiet)
                 log_info (_("anonymous recipient; trying secret key %s ...\n"),
                           keystr (keyid));
@@ -176,6 +340,11 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
           err = k->result;
     }
 
+  if (!err && cacheid)
+    put_cached_session_key (cacheid, dek);
+
+ leave:
+  xfree (cacheid);
   if (DBG_CLOCK)
     log_clock ("get_session_key leave");
   return err;
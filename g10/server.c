@@ -40,6 +40,19 @@
 #define set_error(e,t) assuan_set_error (ctx, gpg_error (e), (t))
 
 
+/* Prototypes.  */
+static gpgrt_ssize_t data_line_cookie_write (void *cookie,
+                                             const void *buffer, size_t size);
+static int data_line_cookie_close (void *cookie);
+static es_cookie_io_functions_t data_line_cookie_functions =
+  {
+    NULL,
+    data_line_cookie_write,
+    NULL,
+    data_line_cookie_close
+  };
+
+
 /* Data used to associate an Assuan context with local server data.  */
 struct server_local_s
 {
@@ -51,6 +64,9 @@ struct server_local_s
   /* List of prepared recipients.  */
   pk_list_t recplist;
 
+  /* List of the user ids of the signers.  */
+  strlist_t signers;
+
   /* Set if pinentry notifications should be passed back to the
      client. */
   int allow_pinentry_notify;
@@ -58,6 +74,37 @@ struct server_local_s
 
 
 
+/* A write handler used by es_fopencookie to write assuan data
+   lines.  */
+static gpgrt_ssize_t
+data_line_cookie_write (void *cookie, const void *buffer, size_t size)
+{
+  assuan_context_t ctx = cookie;
+
+  if (assuan_send_data (ctx, buffer, size))
+    {
+      gpg_err_set_errno (EIO);
+      return -1;
+    }
+
+  return (gpgrt_ssize_t)size;
+}
+
+static int
+data_line_cookie_close (void *cookie)
+{
+  assuan_context_t ctx = cookie;
+
+  if (assuan_send_data (ctx, NULL, 0))
+    {
+      gpg_err_set_errno (EIO);
+      return -1;
+    }
+
+  return 0;
+}
+
+
 /* Helper to close the message fd if it is open. */
 static void
 close_message_fd (ctrl_t ctrl)
@@ -126,6 +173,8 @@ reset_notify (assuan_context_t ctx, char *line)
 
   release_pk_list (ctrl->server_local->recplist);
   ctrl->server_local->recplist = NULL;
+  free_strlist (ctrl->server_local->signers);
+  ctrl->server_local->signers = NULL;
 
   close_message_fd (ctrl);
   assuan_close_input_fd (ctx);
@@ -234,9 +283,32 @@ cmd_recipient (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_signer (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t sl = NULL;
+  SK_LIST sk_list = NULL;
+
+  line = skip_options (line);
+  if (!*line)
+    return set_error (GPG_ERR_ASS_PARAMETER, "no user id given");
+
+  if (!add_to_strlist_try (&sl, line))
+    return gpg_error_from_syserror ();
+
+  /* Check the key now so that the client knows about problems before
+   * it sends any data.  build_sk_list emits the INV_SGNR status.  */
+  err = build_sk_list (ctrl, sl, &sk_list, PUBKEY_USAGE_SIG);
+  release_sk_list (sk_list);
+  if (err)
+    {
+      free_strlist (sl);
+      log_error ("command '%s' failed: %s\n", "SIGNER", gpg_strerror (err));
+      return err;
+    }
+
+  sl->next = ctrl->server_local->signers;
+  ctrl->server_local->signers = sl;
+  return 0;
 }
 
 
@@ -428,9 +500,31 @@ cmd_verify (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_sign (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int inp_fd, out_fd;
+  int detached;
+
+  detached = has_option (line, "--detached");
+
+  inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+  if (inp_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+  out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (out_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+
+  /* Without a SIGNER the default key is used.  */
+  err = sign_fd (ctrl, inp_fd, detached, ctrl->server_local->signers, out_fd);
+
+  /* Close and reset the fds. */
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGN", gpg_strerror (err));
+  return err;
 }
 
 
@@ -442,29 +536,126 @@ cmd_sign (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_import (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  gnupg_fd_t fd = assuan_get_input_fd (ctx);
+  es_syshd_t syshd;
+  estream_t fp;
+  import_stats_t stats;
+
   (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (fd == GNUPG_INVALID_FD)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+
+#ifdef HAVE_W32_SYSTEM
+  syshd.type = ES_SYSHD_HANDLE;
+  syshd.u.handle = fd;
+#else
+  syshd.type = ES_SYSHD_FD;
+  syshd.u.fd = fd;
+#endif
+  fp = es_sysopen_nc (&syshd, "rb");
+  if (!fp)
+    {
+      err = set_error (gpg_err_code_from_syserror (), "fdopen() failed");
+      goto leave;
+    }
+
+  stats = import_new_stats_handle ();
+  err = import_keys_es_stream (ctrl, fp, stats, NULL, NULL,
+                               opt.import_options, NULL, NULL,
+                               KEYORG_UNKNOWN, NULL);
+  import_print_stats (stats);
+  import_release_stats_handle (stats);
+  es_fclose (fp);
+
+ leave:
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "IMPORT", gpg_strerror (err));
+  return err;
 }
 
 
 
-/*  EXPORT [--data [--armor|--base64]] [--] pattern
+/*  EXPORT [--data [--armor]] [--] pattern
 
    Similar to the --export command line command, this command exports
    public keys matching PATTERN.  The output is send to the output fd
    unless the --data option has been used in which case the output
-   gets send inline using regular data lines.  The options "--armor"
-   and "--base" ospecify an output format if "--data" has been used.
-   Recall that in general the output format is set with the OUTPUT
-   command.
+   gets send inline using regular data lines.  The option "--armor"
+   requests armored output if "--data" has been used.  Recall that in
+   general the output format is set with the OUTPUT command.
  */
 static gpg_error_t
 cmd_export (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int out_fd;
+  strlist_t list = NULL;
+  char *p;
+  int use_data, armor;
+  estream_t stream;
+
+  use_data = has_option (line, "--data");
+  armor = has_option (line, "--armor");
+  line = skip_options (line);
+
+  out_fd = -1;
+  if (!use_data)
+    {
+      out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+      if (out_fd == -1)
+        return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+    }
+
+  /* Break the line down into an strlist_t. */
+  for (p=line; *p; line = p)
+    {
+      while (*p && *p != ' ')
+        p++;
+      if (*p)
+        *p++ = 0;
+      if (*line)
+        {
+          if (!add_to_strlist_try (&list, line))
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+        }
+    }
+
+  if (use_data)
+    {
+      stream = es_fopencookie (ctx, "w", data_line_cookie_functions);
+      if (!stream)
+        {
+          err = set_error (GPG_ERR_ASS_GENERAL,
+                           "error setting up a data stream");
+          goto leave;
+        }
+      err = export_pubkeys_stream (ctrl, stream, list, armor,
+                                   opt.export_options, NULL);
+      es_fclose (stream);
+    }
+  else
+    err = export_pubkeys_fd (ctrl, out_fd, list, opt.export_options, NULL);
+
+ leave:
+  free_strlist (list);
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "EXPORT", gpg_strerror (err));
+  return err;
 }
 
 
@@ -753,6 +944,7 @@ gpg_server (ctrl_t ctrl)
   if (ctrl->server_local)
     {
       release_pk_list (ctrl->server_local->recplist);
+      free_strlist (ctrl->server_local->signers);
 
       xfree (ctrl->server_local);
       ctrl->server_local = NULL;
@@ -0,0 +1,409 @@
+/* sig-cache.c - Persistent cache of signature verification results
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The cache stores the outcome of the public key operation of a
+ * signature check.  The lookup key is a SHA-256 hash over the
+ * fingerprint of the signing key, the digest of the signed material
+ * including the signature's hashed data, and the signature values.
+ * Thus an entry can only match if the very same key has signed the
+ * very same data with the very same signature and the result never
+ * needs to be invalidated.
+ *
+ * The file consists of records of SIG_CACHE_KEYLEN bytes of record
+ * key and one byte with the result ('G' for a good and 'B' for a bad
+ * signature).  The record key is a SHA-256 hash over the lookup key
+ * and the result so that a record with a modified result byte does
+ * not match anymore.  The first record is a magic string of the same
+ * length ending in a LF.  New records are appended with a single
+ * write so that several processes may update the file at the same
+ * time; a magic record written twice that way is simply skipped.  A
+ * truncated trailing record is ignored.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "packet.h"
+#include "keydb.h"
+#include "main.h"
+#include "../common/i18n.h"
+#include "options.h"
+#include "../common/membuf.h"
+#include "../common/host2net.h"
+
+
+#define SIG_CACHE_RECLEN   (SIG_CACHE_KEYLEN + 1)
+#define SIG_CACHE_MAGIC    "GnuPG signature cache, version 1\n"
+
+/* Write the pending records after that many bytes.  */
+#define SIG_CACHE_PENDING_MAX (2000 * SIG_CACHE_RECLEN)
+
+
+/* An entry of the hash table.  */
+struct sig_cache_entry_s
+{
+  byte key[SIG_CACHE_KEYLEN];
+  byte result;  /* 0 for an unused entry, 'G' or 'B'.  */
+};
+
+
+/* The hash table using open addressing.  */
+static struct sig_cache_entry_s *table;
+static size_t table_size;   /* A power of 2.  */
+static size_t table_used;
+
+/* The name of the cache file or NULL.  */
+static char *cache_fname;
+
+/* Set if we tried to load the file.  */
+static int cache_loaded;
+
+/* Records not yet written to the file.  */
+static membuf_t pending;
+static int pending_valid;
+
+/* Statistics.  */
+static struct
+{
+  unsigned int hits;
+  unsigned int stores;
+} stats;
+
+
+/* Return the entry for KEY; this is an unused entry if KEY is not in
+ * the table.  */
+static struct sig_cache_entry_s *
+find_entry (const byte *key)
+{
+  size_t idx;
+
+  idx = buf32_to_u32 (key) & (table_size - 1);
+  while (table[idx].result && memcmp (table[idx].key, key, SIG_CACHE_KEYLEN))
+    idx = (idx + 1) & (table_size - 1);
+  return table + idx;
+}
+
+
+/* Add KEY with RESULT to the hash table.  Returns false on memory
+ * shortage.  */
+static int
+add_entry (const byte *key, byte result)
+{
+  struct sig_cache_entry_s *old, *e;
+  size_t oldsize, i;
+
+  if ((table_used + 1) * 2 > table_size)
+    {
+      old = table;
+      oldsize = table_size;
+      table_size = oldsize? oldsize * 2 : 1024;
+      table = xtrycalloc (table_size, sizeof *table);
+      if (!table)
+        {
+          table = old;
+          table_size = oldsize;
+          return 0;
+        }
+      for (i = 0; i < oldsize; i++)
+        if (old[i].result)
+          *find_entry (old[i].key) = old[i];
+      xfree (old);
+    }
+
+  e = find_entry (key);
+  if (!e->result)
+    table_used++;
+  memcpy (e->key, key, SIG_CACHE_KEYLEN);
+  e->result = result;
+  return 1;
+}
+
+
+/* Read the cache file.  Errors are not fatal; the cache is then
+ * simply empty.  */
+static void
+load_cache (void)
+{
+  estream_t fp;
+  byte rec[SIG_CACHE_RECLEN];
+  size_t nread;
+
+  cache_loaded = 1;
+  fp = es_fopen (cache_fname, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"),
+                  cache_fname, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  if (es_read (fp, rec, sizeof rec, &nread) || nread != sizeof rec
+      || memcmp (rec, SIG_CACHE_MAGIC, sizeof rec))
+    {
+      log_info (_("signature cache '%s' is invalid - ignored\n"),
+                cache_fname);
+      es_fclose (fp);
+      return;
+    }
+
+  while (!es_read (fp, rec, sizeof rec, &nread) && nread == sizeof rec)
+    {
+      if (rec[SIG_CACHE_KEYLEN] != 'G' && rec[SIG_CACHE_KEYLEN] != 'B')
+        continue;
+      if (!add_entry (rec, rec[SIG_CACHE_KEYLEN]))
+        break;
+    }
+  es_fclose (fp);
+
+  if (DBG_CACHE)
+    log_debug ("sig-cache: loaded %zu entries from '%s'\n",
+               table_used, cache_fname);
+}
+
+
+/* Set the name of the cache file to FNAME and thereby enable the
+ * cache.  Relative names without a directory part are taken to be in
+ * the home directory.  Pending records are written to the old file
+ * and the new file is read on the next lookup.  */
+void
+sig_cache_set_file (const char *fname)
+{
+  if (cache_fname)
+    sig_cache_flush ();
+  xfree (table);
+  table = NULL;
+  table_size = table_used = 0;
+  cache_loaded = 0;
+
+  xfree (cache_fname);
+  if (*fname != DIRSEP_C && !strchr (fname, DIRSEP_C))
+    cache_fname = make_filename (gnupg_homedir (), fname, NULL);
+  else
+    cache_fname = make_filename (fname, NULL);
+}
+
+
+/* Compute the lookup KEY of the signature SIG made by PK over the
+ * finalized DIGEST.  Returns false if no key can be computed.  */
+static int
+make_key (PKT_public_key *pk, PKT_signature *sig, gcry_md_hd_t digest,
+          byte *key)
+{
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const byte *dgst;
+  const void *p;
+  unsigned int nbits;
+  byte *buf;
+  size_t n;
+  int i, nsig;
+
+  dgst = gcry_md_read (digest, sig->digest_algo);
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  if (!dgst || !nsig || gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    return 0;
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  gcry_md_putc (md, fprlen);
+  gcry_md_write (md, fpr, fprlen);
+  gcry_md_putc (md, sig->digest_algo);
+  gcry_md_write (md, dgst, gcry_md_get_algo_dlen (sig->digest_algo));
+  gcry_md_putc (md, sig->pubkey_algo);
+  for (i = 0; i < nsig; i++)
+    {
+      if (!sig->data[i])
+        goto fail;
+      if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+          if (!p)
+            goto fail;
+          n = (nbits + 7) / 8;
+          gcry_md_putc (md, 1);
+          gcry_md_putc (md, n >> 8);
+          gcry_md_putc (md, n);
+          gcry_md_write (md, p, n);
+        }
+      else
+        {
+          if (gcry_mpi_aprint (GCRYMPI_FMT_PGP, &buf, &n, sig->data[i]))
+            goto fail;
+          gcry_md_putc (md, 2);
+          gcry_md_write (md, buf, n);
+          gcry_free (buf);
+        }
+    }
+
+  memcpy (key, gcry_md_read (md, GCRY_MD_SHA256), SIG_CACHE_KEYLEN);
+  gcry_md_close (md);
+  return 1;
+
+ fail:
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Compute the record key for the lookup KEY and RESULT.  */
+static void
+make_record_key (const byte *key, byte result, byte *reckey)
+{
+  byte buf[SIG_CACHE_KEYLEN + 1];
+
+  memcpy (buf, key, SIG_CACHE_KEYLEN);
+  buf[SIG_CACHE_KEYLEN] = result;
+  gcry_md_hash_buffer (GCRY_MD_SHA256, reckey, buf, sizeof buf);
+}
+
+
+/* Look up the result of the check of signature SIG made by PK over
+ * the finalized DIGEST.  Returns true and stores the result at R_RC
+ * if it is in the cache.  KEY receives the lookup key for use by
+ * sig_cache_store; it is zeroed if the cache can't be used.  */
+int
+sig_cache_lookup (PKT_public_key *pk, PKT_signature *sig,
+                  gcry_md_hd_t digest, byte *key, int *r_rc)
+{
+  static const byte results[2] = { 'G', 'B' };
+  struct sig_cache_entry_s *e;
+  byte reckey[SIG_CACHE_KEYLEN];
+  int i;
+
+  memset (key, 0, SIG_CACHE_KEYLEN);
+  if (!cache_fname || opt.no_sig_cache)
+    return 0;
+  if (!cache_loaded)
+    load_cache ();
+
+  if (!make_key (pk, sig, digest, key))
+    {
+      memset (key, 0, SIG_CACHE_KEYLEN);
+      return 0;
+    }
+  if (!table_size)
+    return 0;
+
+  for (i = 0; i < DIM (results); i++)
+    {
+      make_record_key (key, results[i], reckey);
+      e = find_entry (reckey);
+      if (e->result == results[i])
+        {
+          stats.hits++;
+          *r_rc = e->result == 'G'? 0 : gpg_error (GPG_ERR_BAD_SIGNATURE);
+          return 1;
+        }
+    }
+  return 0;
+}
+
+
+/* Store the result RC of a public key operation under KEY as
+ * returned by sig_cache_lookup.  Only good and bad signatures are
+ * stored.  */
+void
+sig_cache_store (const byte *key, int rc)
+{
+  static const byte nullkey[SIG_CACHE_KEYLEN];
+  byte reckey[SIG_CACHE_KEYLEN];
+  byte result;
+
+  if (!cache_fname || !memcmp (key, nullkey, SIG_CACHE_KEYLEN))
+    return;
+  if (!rc)
+    result = 'G';
+  else if (gpg_err_code (rc) == GPG_ERR_BAD_SIGNATURE)
+    result = 'B';
+  else
+    return;
+
+  make_record_key (key, result, reckey);
+  if (!add_entry (reckey, result))
+    return;
+  stats.stores++;
+
+  if (!pending_valid)
+    {
+      init_membuf (&pending, SIG_CACHE_PENDING_MAX + SIG_CACHE_RECLEN);
+      pending_valid = 1;
+    }
+  put_membuf (&pending, reckey, SIG_CACHE_KEYLEN);
+  put_membuf (&pending, &result, 1);
+  if (get_membuf_len (&pending) >= SIG_CACHE_PENDING_MAX)
+    sig_cache_flush ();
+}
+
+
+/* Append the pending records to the cache file.  */
+void
+sig_cache_flush (void)
+{
+  estream_t fp;
+  void *buf;
+  size_t len;
+  int is_new;
+
+  if (!pending_valid)
+    return;
+  buf = get_membuf (&pending, &len);
+  pending_valid = 0;
+  if (!buf)
+    return;
+  if (!len)
+    {
+      xfree (buf);
+      return;
+    }
+
+  /* Unbuffered so that each write is one system call with O_APPEND
+   * semantics.  */
+  fp = es_fopen (cache_fname, "ab,mode=-rw-------");
+  if (!fp || es_setvbuf (fp, NULL, _IONBF, 0))
+    {
+      log_info (_("error writing signature cache '%s': %s\n"),
+                cache_fname, gpg_strerror (gpg_error_from_syserror ()));
+      es_fclose (fp);
+      xfree (buf);
+      return;
+    }
+
+  is_new = (!es_fseek (fp, 0, SEEK_END) && !es_ftello (fp));
+  if ((is_new && es_fwrite (SIG_CACHE_MAGIC, SIG_CACHE_RECLEN, 1, fp) != 1)
+      || es_fwrite (buf, len, 1, fp) != 1
+      || es_fclose (fp))
+    log_info (_("error writing signature cache '%s': %s\n"),
+              cache_fname, gpg_strerror (gpg_error_from_syserror ()));
+  xfree (buf);
+}
+
+
+void
+sig_cache_dump_stats (void)
+{
+  if (cache_fname)
+    log_info ("sig-cache: %u hits, %u stored, %zu entries\n",
+              stats.hits, stats.stores, table_used);
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -34,6 +35,7 @@
 #include "options.h"
 #include "pkglue.h"
 #include "../common/compliance.h"
+#include "../common/tracepoint.h"
 
 static int check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 				gcry_md_hd_t digest,
@@ -47,6 +49,30 @@ static int check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
                                        size_t extrahashlen);
 
 
+/* A public key operation deferred by sig_check_defer_begin.  */
+struct deferred_check_s
+{
+  struct deferred_check_s *next;
+  PKT_signature *sig;
+  u32 keyid[2];             /* Key ID of the signing key.  */
+  int pubkey_algo;
+  gcry_mpi_t pkey[PUBKEY_MAX_NPKEY];
+  gcry_mpi_t result;        /* The encoded digest.  */
+  byte cachekey[SIG_CACHE_KEYLEN];
+  int rc;
+};
+
+/* The list of deferred checks and the state of the worker pool.  */
+static struct
+{
+  int active;
+  struct deferred_check_s *list;
+  struct deferred_check_s **tail;
+  struct deferred_check_s *next_job;  /* Next job for a worker.  */
+  npth_mutex_t lock;                  /* Protects NEXT_JOB.  */
+} deferred;
+
+
 /* Statistics for signature verification.  */
 struct
 {
@@ -187,8 +213,10 @@ check_signature2 (ctrl_t ctrl,
       if (r_expiredate)
         *r_expiredate = pk->expiredate;
 
+      TRACEPOINT2 (sig_check_begin, sig->pubkey_algo, sig->digest_algo);
       rc = check_signature_end (pk, sig, digest, extrahash, extrahashlen,
                                 r_expired, r_revoked, NULL);
+      TRACEPOINT1 (sig_check_end, rc);
 
       /* Check the backsig.  This is a back signature (0x19) from
        * the subkey on the primary key.  The idea here is that it
@@ -453,6 +481,36 @@ check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 }
 
 
+/* Queue the verification of SIG by PK over the encoded digest RESULT
+ * with the persistent cache key CACHEKEY.  On success the function
+ * takes ownership of RESULT and returns true.  */
+static int
+defer_check (PKT_public_key *pk, PKT_signature *sig, gcry_mpi_t result,
+             const byte *cachekey)
+{
+  struct deferred_check_s *dc;
+  int i, npkey;
+
+  npkey = pubkey_get_npkey (pk->pubkey_algo);
+  if (!npkey || npkey > PUBKEY_MAX_NPKEY)
+    return 0;
+  dc = xtrycalloc (1, sizeof *dc);
+  if (!dc)
+    return 0;
+
+  dc->sig = sig;
+  keyid_from_pk (pk, dc->keyid);
+  dc->pubkey_algo = pk->pubkey_algo;
+  for (i = 0; i < npkey; i++)
+    dc->pkey[i] = gcry_mpi_copy (pk->pkey[i]);
+  dc->result = result;
+  memcpy (dc->cachekey, cachekey, SIG_CACHE_KEYLEN);
+  *deferred.tail = dc;
+  deferred.tail = &dc->next;
+  return 1;
+}
+
+
 /* This function is similar to check_signature_end, but it only checks
  * whether the signature was generated by PK.  It does not check
  * expiration, revocation, etc.  */
@@ -464,6 +522,7 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
   gcry_mpi_t result = NULL;
   int rc = 0;
   const struct weakhash *weak;
+  byte cachekey[SIG_CACHE_KEYLEN];
 
   if (!opt.flags.allow_weak_digest_algos)
     {
@@ -585,17 +644,29 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
     }
     gcry_md_final( digest );
 
+    /* The signature values may not yet be decoded.  */
+    rc = sig_decode_data (sig);
+    if (rc)
+      return rc;
+
     /* Convert the digest to an MPI.  */
     result = encode_md_value (pk, digest, sig->digest_algo );
     if (!result)
         return GPG_ERR_GENERAL;
 
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
+    /* Verify the signature unless the persistent cache knows the
+     * result.  */
+    if (!sig_cache_lookup (pk, sig, digest, cachekey, &rc))
+      {
+        if (deferred.active && defer_check (pk, sig, result, cachekey))
+          return gpg_error (GPG_ERR_EAGAIN);
+        if (DBG_CLOCK && sig->sig_class <= 0x01)
+          log_clock ("enter pk_verify");
+        rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
+        if (DBG_CLOCK && sig->sig_class <= 0x01)
+          log_clock ("leave pk_verify");
+        sig_cache_store (cachekey, rc);
+      }
     gcry_mpi_release (result);
 
   if (!rc && sig->flags.unknown_critical)
@@ -665,6 +736,118 @@ cache_sig_result ( PKT_signature *sig, int result )
 }
 
 
+/* Start deferring the public key operations of signature checks.
+ * Until sig_check_defer_end is called the checks which need such an
+ * operation return GPG_ERR_EAGAIN.  This should only be used to
+ * fill the cache flags of signatures ahead of their regular check.  */
+void
+sig_check_defer_begin (void)
+{
+  log_assert (!deferred.active);
+  deferred.active = 1;
+  deferred.list = NULL;
+  deferred.tail = &deferred.list;
+}
+
+
+/* The worker thread for sig_check_defer_end.  */
+static void *
+deferred_check_worker (void *arg)
+{
+  struct deferred_check_s *dc;
+
+  (void)arg;
+
+  for (;;)
+    {
+      npth_mutex_lock (&deferred.lock);
+      dc = deferred.next_job;
+      if (dc)
+        deferred.next_job = dc->next;
+      npth_mutex_unlock (&deferred.lock);
+      if (!dc)
+        break;
+
+      /* The job owns all its data.  */
+      npth_unprotect ();
+      dc->rc = pk_verify (dc->pubkey_algo, dc->result,
+                          dc->sig->data, dc->pkey);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Run the public key operations deferred since sig_check_defer_begin
+ * using up to NTHREADS threads and store the results in the cache
+ * flags of the signatures.  The results are merged in the order of
+ * the checks.  */
+void
+sig_check_defer_end (int nthreads)
+{
+  struct deferred_check_s *dc, *dcnext;
+  npth_t threads[SIG_CHECK_MAX_THREADS];
+  npth_attr_t tattr;
+  int njobs, nstarted, i, rc;
+
+  log_assert (deferred.active);
+  deferred.active = 0;
+
+  for (njobs = 0, dc = deferred.list; dc; dc = dc->next)
+    njobs++;
+  if (nthreads > SIG_CHECK_MAX_THREADS)
+    nthreads = SIG_CHECK_MAX_THREADS;
+  if (nthreads > njobs)
+    nthreads = njobs;
+
+  npth_mutex_init (&deferred.lock, NULL);
+  deferred.next_job = deferred.list;
+  nstarted = 0;
+  if (nthreads > 1 && !npth_attr_init (&tattr))
+    {
+      for (i = 0; i < nthreads; i++)
+        {
+          rc = npth_create (&threads[i], &tattr, deferred_check_worker, NULL);
+          if (rc)
+            {
+              log_error ("error spawning signature check thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  /* The main thread helps and also does all the work if no thread
+   * could be started.  */
+  deferred_check_worker (NULL);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&deferred.lock);
+
+  for (dc = deferred.list; dc; dc = dcnext)
+    {
+      dcnext = dc->next;
+      sig_cache_store (dc->cachekey, dc->rc);
+      if (!dc->rc && dc->sig->flags.unknown_critical)
+        {
+          log_info (_("assuming bad signature from key %s"
+                      " due to an unknown critical bit\n"),
+                    keystr (dc->keyid));
+          dc->rc = GPG_ERR_BAD_SIGNATURE;
+        }
+      cache_sig_result (dc->sig, dc->rc);
+      gcry_mpi_release (dc->result);
+      for (i = 0; i < PUBKEY_MAX_NPKEY; i++)
+        gcry_mpi_release (dc->pkey[i]);
+      xfree (dc);
+    }
+  deferred.list = NULL;
+  deferred.tail = NULL;
+}
+
+
 /* SIG is a key revocation signature.  Check if this signature was
  * generated by any of the public key PK's designated revokers.
  *
@@ -314,17 +314,18 @@ hash_sigversion_to_magic (gcry_md_hd_t md, const PKT_signature *sig,
 }
 
 
-/* Perform the sign operation.  If CACHE_NONCE is given the agent is
- * advised to use that cached passphrase for the key.  SIGNHINTS has
- * hints so that we can do some additional checks. */
-static int
-do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
-	 gcry_md_hd_t md, int mdalgo,
-         const char *cache_nonce, unsigned int signhints)
+/* Check that PKSK may be used to sign the finalized hash MD with
+ * MDALGO and prepare SIG for the signature.  On success the digest
+ * to be signed is stored at R_DP and the used algorithm at
+ * R_MDALGO.  SIGNHINTS has hints so that we can do some additional
+ * checks.  */
+static gpg_error_t
+prepare_sign (PKT_public_key *pksk, PKT_signature *sig,
+              gcry_md_hd_t md, int mdalgo, unsigned int signhints,
+              byte **r_dp, int *r_mdalgo)
 {
   gpg_error_t err;
   byte *dp;
-  char *hexgrip;
 
   if (pksk->timestamp > sig->timestamp )
     {
@@ -395,42 +396,41 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
   sig->data[0] = NULL;
   mpi_release (sig->data[1]);
   sig->data[1] = NULL;
+  *r_dp = dp;
+  *r_mdalgo = mdalgo;
+  err = 0;
 
+ leave:
+  return err;
+}
 
-  err = hexkeygrip_from_pk (pksk, &hexgrip);
-  if (!err)
-    {
-      char *desc;
-      gcry_sexp_t s_sigval;
-
-      desc = gpg_format_keydesc (ctrl, pksk, FORMAT_KEYDESC_NORMAL, 1);
-      err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
-                          pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
-                          dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
-                          &s_sigval);
-      xfree (desc);
-
-      if (err)
-        ;
-      else if (pksk->pubkey_algo == GCRY_PK_RSA
-               || pksk->pubkey_algo == GCRY_PK_RSA_S)
-        sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-      else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
-        }
-      else
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-        }
 
-      gcry_sexp_release (s_sigval);
+/* Store the signature S_SIGVAL as returned by the agent for PKSK in
+ * SIG.  */
+static void
+store_sigval (PKT_public_key *pksk, PKT_signature *sig, gcry_sexp_t s_sigval)
+{
+  if (pksk->pubkey_algo == GCRY_PK_RSA
+      || pksk->pubkey_algo == GCRY_PK_RSA_S)
+    sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+  else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
+    {
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
     }
-  xfree (hexgrip);
+  else
+    {
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+    }
+}
 
- leave:
+
+/* Print the result ERR of the sign operation for PKSK and SIG.  */
+static void
+sign_result_note (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
+                  gpg_error_t err)
+{
   if (err)
     log_error (_("signing failed: %s\n"), gpg_strerror (err));
   else
@@ -445,6 +445,42 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
           xfree (ustr);
 	}
     }
+}
+
+
+/* Perform the sign operation.  If CACHE_NONCE is given the agent is
+ * advised to use that cached passphrase for the key.  SIGNHINTS has
+ * hints so that we can do some additional checks. */
+static int
+do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
+	 gcry_md_hd_t md, int mdalgo,
+         const char *cache_nonce, unsigned int signhints)
+{
+  gpg_error_t err;
+  byte *dp;
+  char *hexgrip = NULL;
+
+  err = prepare_sign (pksk, sig, md, mdalgo, signhints, &dp, &mdalgo);
+  if (!err)
+    err = hexkeygrip_from_pk (pksk, &hexgrip);
+  if (!err)
+    {
+      char *desc;
+      gcry_sexp_t s_sigval;
+
+      desc = gpg_format_keydesc (ctrl, pksk, FORMAT_KEYDESC_NORMAL, 1);
+      err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
+                          pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
+                          dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
+                          &s_sigval);
+      xfree (desc);
+      if (!err)
+        store_sigval (pksk, sig, s_sigval);
+      gcry_sexp_release (s_sigval);
+    }
+  xfree (hexgrip);
+
+  sign_result_note (ctrl, pksk, sig, err);
   return err;
 }
 
@@ -810,10 +846,200 @@ write_plaintext_packet (iobuf_t out, iobuf_t inp,
 }
 
 
+/* Create a new signature packet for PK and return it at R_SIG.  The
+ * finalized hash over the data in HASH, the signature's hashed part
+ * and EXTRAHASH is returned at R_MD.  */
+static gpg_error_t
+build_data_sig (ctrl_t ctrl, PKT_public_key *pk, gcry_md_hd_t hash,
+                pt_extra_hash_data_t extrahash,
+                int sigclass, u32 timestamp, u32 duration,
+                PKT_signature **r_sig, gcry_md_hd_t *r_md)
+{
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+
+  sig = xtrycalloc (1, sizeof *sig);
+  if (!sig)
+    return gpg_error_from_syserror ();
+
+  if (pk->version >= 5)
+    sig->version = 5;  /* Required for v5 keys.  */
+  else
+    sig->version = 4;  /* Required.  */
+
+  keyid_from_pk (pk, sig->keyid);
+  sig->digest_algo = hash_for (pk);
+  sig->pubkey_algo = pk->pubkey_algo;
+  if (timestamp)
+    sig->timestamp = timestamp;
+  else
+    sig->timestamp = make_timestamp();
+  if (duration)
+    sig->expiredate = sig->timestamp + duration;
+  sig->sig_class = sigclass;
+
+  if (gcry_md_copy (&md, hash))
+    BUG ();
+
+  build_sig_subpkt_from_sig (sig, pk);
+  mk_notation_policy_etc (ctrl, sig, NULL, pk);
+  hash_sigversion_to_magic (md, sig, extrahash);
+  gcry_md_final (md);
+
+  *r_sig = sig;
+  *r_md = md;
+  return 0;
+}
+
+
+/* Write the signature packet SIG made with PK to OUT.  SIG is
+ * released.  */
+static gpg_error_t
+write_data_sig (IOBUF out, PKT_public_key *pk, PKT_signature *sig,
+                int status_letter)
+{
+  gpg_error_t rc;
+  PACKET pkt;
+
+  init_packet (&pkt);
+  pkt.pkttype = PKT_SIGNATURE;
+  pkt.pkt.signature = sig;
+  rc = build_packet (out, &pkt);
+  if (!rc && is_status_enabled())
+    print_status_sig_created (pk, sig, status_letter);
+  free_packet (&pkt, NULL);
+  if (rc)
+    log_error ("build signature packet failed: %s\n", gpg_strerror (rc));
+  return rc;
+}
+
+
+/* A signature created by write_signature_packets_parallel.  */
+struct parallel_sig_s
+{
+  PKT_public_key *pk;
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+  char *hexgrip;
+  char *desc;
+  gpg_error_t err;
+};
+
+
+/* The --sign-threads variant of write_signature_packets for the
+ * NSIGNERS keys in SK_LIST.  The signatures for all keys are requested
+ * from the agent at the same time; the packets are still written in
+ * the order of SK_LIST.  */
+static int
+write_signature_packets_parallel (ctrl_t ctrl, SK_LIST sk_list, int nsigners,
+                                  IOBUF out, gcry_md_hd_t hash,
+                                  pt_extra_hash_data_t extrahash,
+                                  int sigclass, u32 timestamp, u32 duration,
+                                  int status_letter, const char *cache_nonce)
+{
+  gpg_error_t rc = 0;
+  struct parallel_sig_s *items;
+  struct agent_pksign_req_s *reqs;
+  SK_LIST sk_rover;
+  int i, mdalgo;
+  byte *dp;
+
+  items = xtrycalloc (nsigners, sizeof *items);
+  reqs = xtrycalloc (nsigners, sizeof *reqs);
+  if (!items || !reqs)
+    {
+      rc = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Build all signature packets and collect the requests.  */
+  for (sk_rover = sk_list, i = 0; sk_rover; sk_rover = sk_rover->next, i++)
+    {
+      struct parallel_sig_s *item = items + i;
+
+      item->pk = sk_rover->pk;
+      rc = build_data_sig (ctrl, item->pk, hash, extrahash,
+                           sigclass, timestamp, duration,
+                           &item->sig, &item->md);
+      if (rc)
+        goto leave;
+
+      item->err = prepare_sign (item->pk, item->sig, item->md,
+                                hash_for (item->pk), 0, &dp, &mdalgo);
+      if (!item->err)
+        item->err = hexkeygrip_from_pk (item->pk, &item->hexgrip);
+      if (item->err)
+        {
+          sign_result_note (ctrl, item->pk, item->sig, item->err);
+          rc = item->err;
+          goto leave;
+        }
+      item->desc = gpg_format_keydesc (ctrl, item->pk,
+                                       FORMAT_KEYDESC_NORMAL, 1);
+      reqs[i].cache_nonce = cache_nonce;
+      reqs[i].keygrip     = item->hexgrip;
+      reqs[i].desc        = item->desc;
+      reqs[i].keyid       = item->pk->keyid;
+      reqs[i].mainkeyid   = item->pk->main_keyid;
+      reqs[i].pubkey_algo = item->pk->pubkey_algo;
+      reqs[i].digest      = dp;
+      reqs[i].digestlen   = gcry_md_get_algo_dlen (mdalgo);
+      reqs[i].digestalgo  = mdalgo;
+    }
+
+  rc = agent_pksign_many (NULL/*ctrl*/, reqs, nsigners, opt.sign_threads);
+  if (rc)
+    goto leave;
+
+  /* Store the signatures and write the packets in order.  */
+  for (i = 0; i < nsigners; i++)
+    {
+      struct parallel_sig_s *item = items + i;
+
+      item->err = reqs[i].err;
+      if (!item->err)
+        store_sigval (item->pk, item->sig, reqs[i].sigval);
+      sign_result_note (ctrl, item->pk, item->sig, item->err);
+      if (item->err)
+        {
+          rc = item->err;
+          goto leave;
+        }
+      rc = write_data_sig (out, item->pk, item->sig, status_letter);
+      item->sig = NULL;
+      if (rc)
+        goto leave;
+    }
+
+ leave:
+  if (items)
+    {
+      for (i = 0; i < nsigners; i++)
+        {
+          if (items[i].sig)
+            free_seckey_enc (items[i].sig);
+          gcry_md_close (items[i].md);
+          xfree (items[i].hexgrip);
+          xfree (items[i].desc);
+        }
+      xfree (items);
+    }
+  if (reqs)
+    {
+      for (i = 0; i < nsigners; i++)
+        gcry_sexp_release (reqs[i].sigval);
+      xfree (reqs);
+    }
+  return rc;
+}
+
+
 /*
  * Write the signatures from the SK_LIST to OUT. HASH must be a
  * non-finalized hash which will not be changes here.  EXTRAHASH is
  * either NULL or the extra data tro be hashed into v5 signatures.
+ * With --sign-threads and more than one signer the signatures are
+ * requested from the agent in parallel.
  */
 static int
 write_signature_packets (ctrl_t ctrl,
@@ -823,6 +1049,15 @@ write_signature_packets (ctrl_t ctrl,
 			 int status_letter, const char *cache_nonce)
 {
   SK_LIST sk_rover;
+  int nsigners;
+
+  for (nsigners = 0, sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
+    nsigners++;
+  if (opt.sign_threads > 1 && nsigners > 1)
+    return write_signature_packets_parallel (ctrl, sk_list, nsigners, out,
+                                             hash, extrahash, sigclass,
+                                             timestamp, duration,
+                                             status_letter, cache_nonce);
 
   /* Loop over the certificates with secret keys. */
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
@@ -835,52 +1070,15 @@ write_signature_packets (ctrl_t ctrl,
       pk = sk_rover->pk;
 
       /* Build the signature packet.  */
-      sig = xtrycalloc (1, sizeof *sig);
-      if (!sig)
-        return gpg_error_from_syserror ();
-
-      if (pk->version >= 5)
-        sig->version = 5;  /* Required for v5 keys.  */
-      else
-        sig->version = 4;  /* Required.  */
-
-      keyid_from_pk (pk, sig->keyid);
-      sig->digest_algo = hash_for (pk);
-      sig->pubkey_algo = pk->pubkey_algo;
-      if (timestamp)
-        sig->timestamp = timestamp;
-      else
-        sig->timestamp = make_timestamp();
-      if (duration)
-        sig->expiredate = sig->timestamp + duration;
-      sig->sig_class = sigclass;
-
-      if (gcry_md_copy (&md, hash))
-        BUG ();
-
-      build_sig_subpkt_from_sig (sig, pk);
-      mk_notation_policy_etc (ctrl, sig, NULL, pk);
-      hash_sigversion_to_magic (md, sig, extrahash);
-      gcry_md_final (md);
+      rc = build_data_sig (ctrl, pk, hash, extrahash,
+                           sigclass, timestamp, duration, &sig, &md);
+      if (rc)
+        return rc;
 
       rc = do_sign (ctrl, pk, sig, md, hash_for (pk), cache_nonce, 0);
       gcry_md_close (md);
       if (!rc)
-        {
-          /* Write the packet.  */
-          PACKET pkt;
-
-          init_packet (&pkt);
-          pkt.pkttype = PKT_SIGNATURE;
-          pkt.pkt.signature = sig;
-          rc = build_packet (out, &pkt);
-          if (!rc && is_status_enabled())
-            print_status_sig_created (pk, sig, status_letter);
-          free_packet (&pkt, NULL);
-          if (rc)
-            log_error ("build signature packet failed: %s\n",
-                       gpg_strerror (rc));
-	}
+        rc = write_data_sig (out, pk, sig, status_letter);
       else
         free_seckey_enc (sig);
 
@@ -903,10 +1101,16 @@ write_signature_packets (ctrl_t ctrl,
  * If OUTFILE is not NULL; this file is used for output and the function
  * does not ask for overwrite permission; output is then always
  * uncompressed, non-armored and in binary mode.
+ * If INP_FD is not -1 the input is read from that file descriptor
+ * instead of FILENAMES, and if OUT_FD is not -1 the output is written
+ * to that file descriptor; this is used by the server mode.
+ * If SK_LIST_ARG is not NULL it is used as the list of signing keys
+ * instead of building one from LOCUSR; the caller keeps ownership.
  */
-int
-sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
-	   int encryptflag, strlist_t remusr, const char *outfile )
+static int
+do_sign_file (ctrl_t ctrl, strlist_t filenames, int inp_fd, int detached,
+              strlist_t locusr, int encryptflag, strlist_t remusr,
+              const char *outfile, int out_fd, SK_LIST sk_list_arg)
 {
   const char *fname;
   armor_filter_context_t *afx;
@@ -956,7 +1160,9 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 
   /* Note: In the old non-agent version the following call used to
    * unprotect the secret key.  This is now done on demand by the agent.  */
-  if ((rc = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_SIG )))
+  if (sk_list_arg)
+    sk_list = sk_list_arg;
+  else if ((rc = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_SIG )))
     goto leave;
 
   if (encryptflag
@@ -966,6 +1172,17 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
   /* Prepare iobufs. */
   if (multifile)    /* have list of filenames */
     inp = NULL;     /* we do it later */
+  else if (inp_fd != -1)
+    {
+      inp = iobuf_fdopen_nc (inp_fd, "rb");
+      if (!inp)
+        {
+          rc = gpg_error_from_syserror ();
+          log_error (_("can't open '%s': %s\n"), "[fd]", gpg_strerror (rc));
+          goto leave;
+        }
+      handle_progress (pfx, inp, NULL);
+    }
   else
     {
       inp = iobuf_open(fname);
@@ -1004,7 +1221,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
       else if (opt.verbose)
         log_info (_("writing to '%s'\n"), outfile);
     }
-  else if ((rc = open_outfile (-1, fname,
+  else if ((rc = open_outfile (out_fd, fname,
                                opt.armor? 1 : detached? 2 : 0, 0, &out)))
     {
       goto leave;
@@ -1251,7 +1468,8 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     }
   iobuf_close (inp);
   gcry_md_close (mfx.md);
-  release_sk_list (sk_list);
+  if (sk_list != sk_list_arg)
+    release_sk_list (sk_list);
   release_pk_list (pk_list);
   recipient_digest_algo = 0;
   release_progress_context (pfx);
@@ -1261,6 +1479,102 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 }
 
 
+int
+sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
+	   int encryptflag, strlist_t remusr, const char *outfile )
+{
+  return do_sign_file (ctrl, filenames, -1, detached, locusr,
+                       encryptflag, remusr, outfile, -1, NULL);
+}
+
+
+/* Helper for sign_files to create one detached signature for FNAME
+ * using the keys from SK_LIST.  */
+static int
+sign_one_detached (ctrl_t ctrl, const char *fname, SK_LIST sk_list)
+{
+  strlist_t sl;
+  int rc;
+
+  sl = xmalloc_clear (sizeof *sl + strlen (fname));
+  strcpy (sl->d, fname);
+  print_file_status (STATUS_FILE_START, fname, 4);
+  rc = do_sign_file (ctrl, sl, -1, 1, NULL, 0, NULL, NULL, -1, sk_list);
+  if (rc)
+    log_error ("signing '%s' failed: %s\n",
+               print_fname_stdin (fname), gpg_strerror (rc));
+  write_status (STATUS_FILE_DONE);
+  free_strlist (sl);
+  return rc;
+}
+
+
+/* Create a separate detached signature for each of the NFILES files
+ * in FILES, or, if NFILES is 0, for each file name read line by line
+ * from stdin.  This is used for --detach-sign --multifile.  The list
+ * of signing keys is built only once so that the key lookup is not
+ * repeated for each file; the agent unlocks the key on the first
+ * signature and takes the passphrase from its cache for the others.
+ * Returns the error of the last failed signature or 0.  */
+int
+sign_files (ctrl_t ctrl, int nfiles, char **files, strlist_t locusr)
+{
+  SK_LIST sk_list = NULL;
+  int rc, anyerr = 0;
+
+  if (opt.outfile)
+    {
+      log_error (_("--output doesn't work for this command\n"));
+      return gpg_error (GPG_ERR_CONFLICT);
+    }
+
+  rc = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_SIG);
+  if (rc)
+    return rc;
+
+  if (!nfiles)
+    {
+      char line[2048];
+      unsigned int lno = 0;
+
+      while (fgets (line, DIM(line), stdin))
+        {
+          lno++;
+          if (!*line || line[strlen(line)-1] != '\n')
+            {
+              log_error ("input line %u too long or missing LF\n", lno);
+              anyerr = gpg_error (GPG_ERR_LINE_TOO_LONG);
+              break;
+            }
+          line[strlen(line)-1] = '\0';
+          if ((rc = sign_one_detached (ctrl, line, sk_list)))
+            anyerr = rc;
+        }
+    }
+  else
+    {
+      for (; nfiles; nfiles--, files++)
+        if ((rc = sign_one_detached (ctrl, *files, sk_list)))
+          anyerr = rc;
+    }
+
+  release_sk_list (sk_list);
+  return anyerr;
+}
+
+
+/* Sign the data read from INP_FD with the keys from LOCUSR (or the
+ * default key) and write the signed data or, if DETACHED is set, a
+ * detached signature to OUT_FD.  Neither file descriptor is closed.
+ * This is used by the server mode.  */
+int
+sign_fd (ctrl_t ctrl, int inp_fd, int detached, strlist_t locusr, int out_fd)
+{
+  return do_sign_file (ctrl, NULL, inp_fd, detached, locusr, 0, NULL,
+                       NULL, out_fd, NULL);
+}
+
+
 /*
  * Make a clear signature.  Note that opt.armor is not needed.
  */
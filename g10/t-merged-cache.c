@@ -0,0 +1,79 @@
+/* t-merged-cache.c - Tests for the cache of merged keyblocks.
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "test.c"
+
+#include "keydb.h"
+#include "main.h"
+
+
+/* Look up the key with KEYID at time NOW and return whether its
+ * primary key has expired.  */
+static int
+expired_at (ctrl_t ctrl, u32 *keyid, time_t now)
+{
+  kbnode_t kb;
+  int result;
+
+  gnupg_set_time (now, 1);
+  kb = get_pubkeyblock (ctrl, keyid);
+  if (!kb)
+    ABORT ("Failed to get keyblock for E4474478");
+  result = kb->pkt->pkt.public_key->has_expired;
+  release_kbnode (kb);
+  return result;
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  ctrl_t ctrl;
+  char *fname;
+  int rc;
+  /* t-merged-cache.kbx contains a single key created 2020-01-01
+   * which expires on 2021-01-01.  */
+  u32 keyid[2] = { 0x66438FEB, 0xE4474478 };
+
+  (void) argc;
+  (void) argv;
+
+  ctrl = xcalloc (1, sizeof *ctrl);
+  fname = prepend_srcdir ("t-merged-cache.kbx");
+  rc = keydb_add_resource (fname, 0);
+  test_free (fname);
+  if (rc)
+    ABORT ("Failed to open keyring.");
+
+  /* We want to test the merged keyblock cache and not the pk cache.  */
+  getkey_disable_caches ();
+
+  TEST_P ("not yet expired", !expired_at (ctrl, keyid, 1590000000));
+  TEST_P ("cached, not yet expired", !expired_at (ctrl, keyid, 1600000000));
+
+  /* The cached result must not be used after the expiration date.  */
+  TEST_P ("expired", expired_at (ctrl, keyid, 1620000000));
+  TEST_P ("cached, expired", expired_at (ctrl, keyid, 1630000000));
+
+  /* Nor if we go back in time.  */
+  TEST_P ("back in time", !expired_at (ctrl, keyid, 1590000000));
+
+  gnupg_set_time ((time_t)-1, 0);
+  xfree (ctrl);
+}
@@ -0,0 +1,168 @@
+/* t-sig-cache.c - Tests for sig-cache.c.
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "test.c"
+
+#include "keydb.h"
+#include "main.h"
+
+#define CACHE_FNAME "./t-sig-cache.tmp"
+#define RECLEN      (SIG_CACHE_KEYLEN + 1)
+
+
+/* Return the length of the cache file or -1 if it does not exist.
+ * If RECNO is not 0 and the file has such a record, replace the
+ * result byte of that record by NEWRESULT.  */
+static long
+tamper_cache (int recno, int newresult)
+{
+  FILE *fp;
+  long len;
+
+  fp = fopen (CACHE_FNAME, "r+b");
+  if (!fp)
+    return -1;
+  fseek (fp, 0, SEEK_END);
+  len = ftell (fp);
+  if (recno && (recno + 1) * RECLEN <= len)
+    {
+      fseek (fp, recno * RECLEN + SIG_CACHE_KEYLEN, SEEK_SET);
+      putc (newresult, fp);
+    }
+  fclose (fp);
+  return len;
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  int rc, res;
+  ctrl_t ctrl;
+  KEYDB_HANDLE hd;
+  KEYDB_SEARCH_DESC desc;
+  KBNODE kb, node;
+  PKT_public_key *pk = NULL;
+  PKT_signature *sig1 = NULL, *sig2 = NULL;
+  gcry_md_hd_t md;
+  byte key1[SIG_CACHE_KEYLEN], key2[SIG_CACHE_KEYLEN];
+  char *fname;
+  FILE *fp;
+
+  (void) argc;
+  (void) argv;
+
+  ctrl = xcalloc (1, sizeof *ctrl);
+  fname = prepend_srcdir ("t-keydb-keyring.kbx");
+  rc = keydb_add_resource (fname, 0);
+  test_free (fname);
+  if (rc)
+    ABORT ("Failed to open keyring.");
+
+  hd = keydb_new (ctrl);
+  if (!hd)
+    ABORT ("");
+  rc = classify_user_id ("2689 5E25 E844 6D44 A26D  8FAF 2F79 98F3 DBFC 6AD9",
+                         &desc, 0);
+  if (rc)
+    ABORT ("Failed to convert fingerprint for DBFC6AD9");
+  rc = keydb_search (hd, &desc, 1, NULL);
+  if (rc)
+    ABORT ("Failed to lookup key associated with DBFC6AD9");
+  rc = keydb_get_keyblock (hd, &kb);
+  if (rc)
+    ABORT ("Failed to get keyblock for DBFC6AD9");
+
+  /* We only need two signatures and their signing key; the
+   * signatures are not actually verified.  */
+  for (node = kb; node; node = node->next)
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY)
+      pk = node->pkt->pkt.public_key;
+    else if (node->pkt->pkttype == PKT_SIGNATURE && !sig1)
+      sig1 = node->pkt->pkt.signature;
+    else if (node->pkt->pkttype == PKT_SIGNATURE && !sig2)
+      sig2 = node->pkt->pkt.signature;
+  if (!pk || !sig1 || !sig2)
+    ABORT ("Unexpected keyblock for DBFC6AD9");
+  if (sig1->digest_algo != sig2->digest_algo)
+    ABORT ("Signatures use different digest algorithms");
+
+  if (gcry_md_open (&md, sig1->digest_algo, 0))
+    ABORT ("Failed to create digest");
+  gcry_md_write (md, "signed data", 11);
+  gcry_md_final (md);
+
+  remove (CACHE_FNAME);
+  sig_cache_set_file (CACHE_FNAME);
+
+  /* An empty cache has no entries.  */
+  TEST_P ("empty cache", !sig_cache_lookup (pk, sig1, md, key1, &res));
+  TEST_P ("empty cache", !sig_cache_lookup (pk, sig2, md, key2, &res));
+  TEST_P ("distinct keys", memcmp (key1, key2, SIG_CACHE_KEYLEN));
+  sig_cache_store (key1, 0);
+  sig_cache_store (key2, gpg_error (GPG_ERR_BAD_SIGNATURE));
+
+  res = -1;
+  TEST_P ("good entry", sig_cache_lookup (pk, sig1, md, key1, &res));
+  TEST ("good entry", res, 0);
+  res = -1;
+  TEST_P ("bad entry", sig_cache_lookup (pk, sig2, md, key2, &res));
+  TEST ("bad entry", gpg_err_code (res), GPG_ERR_BAD_SIGNATURE);
+
+  /* Other errors are not stored.  */
+  sig_cache_store (key1, gpg_error (GPG_ERR_GENERAL));
+  res = -1;
+  TEST_P ("no error entry", sig_cache_lookup (pk, sig1, md, key1, &res));
+  TEST ("no error entry", res, 0);
+
+  /* Write the cache and read it again.  */
+  sig_cache_flush ();
+  TEST ("cache file", tamper_cache (0, 0), 3 * RECLEN);
+  sig_cache_set_file (CACHE_FNAME);
+  res = -1;
+  TEST_P ("reloaded good entry", sig_cache_lookup (pk, sig1, md, key1, &res));
+  TEST ("reloaded good entry", res, 0);
+  res = -1;
+  TEST_P ("reloaded bad entry", sig_cache_lookup (pk, sig2, md, key2, &res));
+  TEST ("reloaded bad entry", gpg_err_code (res), GPG_ERR_BAD_SIGNATURE);
+
+  /* Turn the bad signature into a good one.  This must not be
+   * accepted.  */
+  tamper_cache (2, 'G');
+  sig_cache_set_file (CACHE_FNAME);
+  TEST_P ("tampered entry", !sig_cache_lookup (pk, sig2, md, key2, &res));
+  res = -1;
+  TEST_P ("untampered entry", sig_cache_lookup (pk, sig1, md, key1, &res));
+  TEST ("untampered entry", res, 0);
+
+  /* A file with a wrong magic is ignored.  */
+  fp = fopen (CACHE_FNAME, "r+b");
+  if (!fp)
+    ABORT ("Failed to open cache file");
+  putc ('X', fp);
+  fclose (fp);
+  sig_cache_set_file (CACHE_FNAME);
+  TEST_P ("invalid file", !sig_cache_lookup (pk, sig1, md, key1, &res));
+
+  remove (CACHE_FNAME);
+  gcry_md_close (md);
+  release_kbnode (kb);
+  keydb_release (hd);
+  xfree (ctrl);
+}
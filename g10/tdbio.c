@@ -57,14 +57,29 @@
 #endif
 
 /*
- * Yes, this is a very simple implementation. We should really
- * use a page aligned buffer and read complete pages.
- * To implement a simple trannsaction system, this is sufficient.
+ * There are two caches: The record cache holds records written but
+ * not yet flushed to the file; this is used to implement a simple
+ * transaction system.  The page cache holds clean pages read from
+ * the file.  Reads are served from the record cache, then from the
+ * page cache and only then from the file.
+ *
+ * A transaction is committed by first writing all its records to the
+ * write-ahead log (WAL) file "<trustdb>.wal" and syncing that file.
+ * Only then are the records written to the trustdb itself.  The WAL
+ * is removed after the trustdb has been synced; if the WAL is found
+ * while taking the lock the commit has been interrupted.  The WAL is
+ * then replayed if it is complete and still matches the trustdb or
+ * discarded otherwise.  The WAL consists of a header of WAL_HDRLEN
+ * bytes with the magic, a version byte, the number of records and the
+ * generation of the trustdb the transaction is based on, the records
+ * each prefixed by its 4 byte record number, and a SHA-1 checksum
+ * over all that.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct
 {
   CACHE_CTRL next;
+  CACHE_CTRL hnext;  /* Next entry in the hash bucket.  */
   struct {
     unsigned used:1;
     unsigned dirty:1;
@@ -77,14 +92,61 @@ struct cache_ctrl_struct
    transaction this may not be sufficient and thus we may increase it
    then up to the HARD limit.  */
 #define MAX_CACHE_ENTRIES_SOFT	200
-#define MAX_CACHE_ENTRIES_HARD	10000
+#define MAX_CACHE_ENTRIES_HARD	100000
 
 
 /* The cache is controlled by these variables.  */
 static CACHE_CTRL cache_list;
 static int cache_entries;
+static int cache_allocated;  /* Number of items in CACHE_LIST.  */
 static int cache_is_dirty;
 
+/* The used entries of the record cache hashed by record number.  */
+#define CACHE_HASH_SIZE 1024  /* Must be a power of 2.  */
+static CACHE_CTRL cache_hash[CACHE_HASH_SIZE];
+
+
+/* A page of the page cache.  A page holds PAGE_RECORDS records so
+ * that no record crosses a page boundary.  */
+#define PAGE_RECORDS 102  /* 4080 bytes.  */
+typedef struct page_ctrl_struct *PAGE_CTRL;
+struct page_ctrl_struct
+{
+  PAGE_CTRL hnext;       /* Next page in the hash bucket.  */
+  ulong pageno;
+  unsigned int nrecs;    /* Number of valid records; 0 = unused slot. */
+  char data[PAGE_RECORDS * TRUST_RECORD_LEN];
+};
+
+/* The page cache is controlled by these variables.  */
+#define PAGE_HASH_SIZE 4096  /* Must be a power of 2.  */
+static PAGE_CTRL page_hash[PAGE_HASH_SIZE];
+static PAGE_CTRL page_slots;          /* Array with MAX_PAGES slots.  */
+static unsigned int max_pages;
+static unsigned int next_victim;      /* Slot to be replaced next.  */
+static int page_cache_initialized;
+
+/* The state of the file as used to detect changes by other
+ * processes.  The generation counter from the version record is
+ * bumped by us and other gpg versions supporting it; the size and
+ * the modification time detect changes by older versions.  */
+struct db_state_s
+{
+  off_t size;
+  time_t mtime;
+  unsigned long mtime_ns;  /* Nanoseconds if supported or 0.  */
+  ulong generation;
+};
+
+/* The state of the file when we released the lock.  */
+static struct db_state_s page_cache_state;
+
+/* The offset of the generation counter in the version record.  */
+#define VER_GENERATION_OFF 20
+
+/* Set if we wrote to the file since we took the lock.  */
+static int db_written;
+
 
 /* An object to pass information to cmp_krec_fpr. */
 struct cmp_krec_fpr_struct
@@ -102,8 +164,15 @@ struct cmp_xdir_struct
 };
 
 
-/* The name of the trustdb file.  */
+/* The name of the trustdb file and of its WAL.  */
 static char *db_name;
+static char *wal_name;
+
+#define WAL_SUFFIX  ".wal"
+#define WAL_MAGIC   "gTdbWAL"
+#define WAL_VERSION 2
+#define WAL_HDRLEN  16
+#define WAL_RECLEN  (4 + TRUST_RECORD_LEN)
 
 /* The handle for locking the trustdb file and a counter to record how
  * often this lock has been taken.  That counter is required because
@@ -115,11 +184,24 @@ static unsigned int is_locked;
 static int  db_fd = -1;
 
 /* A flag indicating that a transaction is active.  */
-/* static int in_transaction;   Not yet used. */
+static int in_transaction;
+
+/* While in a transaction the record number for the next appended
+ * record or 0 if not yet known.  */
+static ulong tx_next_recnum;
+
+/* The state of the file at the start of the transaction.  Used to
+ * detect updates by other processes.  */
+static struct db_state_s tx_state;
 
 
 
 static void open_db (void);
+static void recover_wal (void);
+static int commit_transaction (void);
+static void check_page_cache (void);
+static void mark_page_cache (void);
+static void bump_generation (void);
 static void create_hashtable (ctrl_t ctrl, TRUSTREC *vr, int type);
 
 
@@ -139,7 +221,7 @@ take_write_lock (void)
   int rc;
 
   if (!lockhandle)
-    lockhandle = dotlock_create (db_name, 0);
+    lockhandle = dotlock_create (db_name, DOTLOCK_WAIT_QUEUE);
   if (!lockhandle)
     log_fatal ( _("can't create lock for '%s'\n"), db_name );
 
@@ -147,6 +229,8 @@ take_write_lock (void)
     {
       if (dotlock_take (lockhandle, -1) )
         log_fatal ( _("can't lock '%s'\n"), db_name );
+      recover_wal ();
+      check_page_cache ();
       rc = 0;
     }
   else
@@ -178,16 +262,287 @@ release_write_lock (void)
   if (--is_locked)
     return;
 
+  if (db_written)
+    bump_generation ();
+  mark_page_cache ();
   if (dotlock_release (lockhandle))
     log_error ("Oops, tdbio:release_write_locked failed\n");
 }
 
 
 
+/*************************************
+ ************* page cache ************
+ *************************************/
+
+/* Return the cached page PAGENO or NULL.  */
+static PAGE_CTRL
+find_page (ulong pageno)
+{
+  PAGE_CTRL p;
+
+  for (p = page_hash[pageno & (PAGE_HASH_SIZE - 1)]; p; p = p->hnext)
+    if (p->pageno == pageno)
+      return p;
+  return NULL;
+}
+
+
+/* Remove page P from the page cache.  */
+static void
+drop_page (PAGE_CTRL p)
+{
+  PAGE_CTRL *pp;
+
+  for (pp = &page_hash[p->pageno & (PAGE_HASH_SIZE - 1)]; *pp;
+       pp = &(*pp)->hnext)
+    if (*pp == p)
+      {
+        *pp = p->hnext;
+        break;
+      }
+  p->nrecs = 0;
+}
+
+
+/* Drop all pages from the page cache.  */
+static void
+invalidate_page_cache (void)
+{
+  unsigned int i;
+
+  memset (page_hash, 0, sizeof page_hash);
+  for (i = 0; i < max_pages; i++)
+    page_slots[i].nrecs = 0;
+}
+
+
+/* Allocate the page cache according to --trustdb-cache-size.  */
+static void
+init_page_cache (void)
+{
+  page_cache_initialized = 1;
+  if (opt.trustdb_cache_size <= 0)
+    return;
+
+  max_pages = ((size_t)opt.trustdb_cache_size * 1024 * 1024
+               / sizeof (struct page_ctrl_struct));
+  if (!max_pages)
+    max_pages = 1;
+  page_slots = xtrycalloc (max_pages, sizeof *page_slots);
+  if (!page_slots)
+    {
+      log_info ("tdbio: no memory for the page cache - disabled\n");
+      max_pages = 0;
+    }
+}
+
+
+/*
+ * Get the record RECNO from the page cache and return a pointer into
+ * that cache.  The page containing the record is read on a cache
+ * miss.  NULL is returned if the page cache is not available or the
+ * record could not be read; the caller should then read the record
+ * directly to get the error.
+ */
+static const char *
+get_record_from_pages (ulong recno)
+{
+  ulong pageno = recno / PAGE_RECORDS;
+  unsigned int idx = recno % PAGE_RECORDS;
+  PAGE_CTRL p;
+  int n;
+
+  if (!page_cache_initialized)
+    init_page_cache ();
+  if (!max_pages)
+    return NULL;
+
+  p = find_page (pageno);
+  if (!p)
+    {
+      p = page_slots + next_victim;
+      next_victim = (next_victim + 1) % max_pages;
+      if (p->nrecs)
+        drop_page (p);
+
+      if (lseek (db_fd, (off_t)pageno * sizeof p->data, SEEK_SET) == -1)
+        return NULL;
+      n = read (db_fd, p->data, sizeof p->data);
+      if (n < TRUST_RECORD_LEN)
+        return NULL;
+      p->pageno = pageno;
+      p->nrecs = n / TRUST_RECORD_LEN;
+      p->hnext = page_hash[pageno & (PAGE_HASH_SIZE - 1)];
+      page_hash[pageno & (PAGE_HASH_SIZE - 1)] = p;
+    }
+
+  if (idx >= p->nrecs)
+    return NULL;
+  return p->data + idx * TRUST_RECORD_LEN;
+}
+
+
+/*
+ * Update the page cache after DATA has been written to record RECNO.
+ */
+static void
+update_page_cache (ulong recno, const void *data)
+{
+  unsigned int idx = recno % PAGE_RECORDS;
+  PAGE_CTRL p;
+
+  if (!max_pages || !(p = find_page (recno / PAGE_RECORDS)))
+    return;
+
+  if (idx < p->nrecs)
+    memcpy (p->data + idx * TRUST_RECORD_LEN, data, TRUST_RECORD_LEN);
+  else if (idx == p->nrecs)
+    {
+      /* Appended to the file.  */
+      memcpy (p->data + idx * TRUST_RECORD_LEN, data, TRUST_RECORD_LEN);
+      p->nrecs++;
+    }
+  else
+    drop_page (p);
+}
+
+
+/* Read the raw version record directly from the file into BUF.
+ * Returns 0 on success.  */
+static int
+read_version_record (byte *buf)
+{
+  if (lseek (db_fd, 0, SEEK_SET) == -1
+      || read (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN
+      || buf[0] != RECTYPE_VER)
+    return -1;
+  return 0;
+}
+
+
+/* Store the current state of the file at STATE.  Returns 0 on
+ * success.  */
+static int
+get_db_state (struct db_state_s *state)
+{
+  struct stat st;
+  byte buf[TRUST_RECORD_LEN];
+
+  memset (state, 0, sizeof *state);
+  if (db_fd == -1 || fstat (db_fd, &st))
+    return -1;
+  state->size = st.st_size;
+  state->mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  state->mtime_ns = st.st_mtim.tv_nsec;
+#endif
+  if (!read_version_record (buf))
+    state->generation = buf32_to_ulong (buf + VER_GENERATION_OFF);
+  return 0;
+}
+
+
+/* Return true if the states A and B are the same.  */
+static int
+same_db_state (const struct db_state_s *a, const struct db_state_s *b)
+{
+  return (a->size == b->size
+          && a->mtime == b->mtime
+          && a->mtime_ns == b->mtime_ns
+          && a->generation == b->generation);
+}
+
+
+/* Increment the generation counter in the version record.  This is
+ * called with the lock held after we wrote to the file so that other
+ * processes notice the change even if the size and the (coarse)
+ * modification time did not change.  The copies of the version
+ * record in our caches are updated as well.  */
+static void
+bump_generation (void)
+{
+  byte buf[TRUST_RECORD_LEN];
+  ulong generation;
+  CACHE_CTRL r;
+
+  db_written = 0;
+  if (read_version_record (buf))
+    return;
+  generation = buf32_to_ulong (buf + VER_GENERATION_OFF) + 1;
+  if (!generation)
+    generation = 1;  /* 0 means not maintained.  */
+  ulongtobuf (buf + VER_GENERATION_OFF, generation);
+  if (lseek (db_fd, 0, SEEK_SET) == -1
+      || write (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN)
+    {
+      log_error (_("error writing '%s': %s\n"), db_name, strerror (errno));
+      return;
+    }
+  update_page_cache (0, buf);
+  for (r = cache_hash[0]; r; r = r->hnext)
+    if (r->flags.used && !r->recno)
+      ulongtobuf (r->data + VER_GENERATION_OFF, generation);
+}
+
+
+/* Remember the state of the file so that check_page_cache can detect
+ * changes by other processes.  */
+static void
+mark_page_cache (void)
+{
+  if (max_pages)
+    get_db_state (&page_cache_state);
+}
+
+
+/* Drop the page cache if the file has been changed by another process
+ * since mark_page_cache has been called.  */
+static void
+check_page_cache (void)
+{
+  struct db_state_s state;
+
+  if (!max_pages || db_fd == -1)
+    return;
+  if (get_db_state (&state) || !same_db_state (&state, &page_cache_state))
+    invalidate_page_cache ();
+}
+
+
+
 /*************************************
  ************* record cache **********
  *************************************/
 
+/* Add the used entry R to the hash table.  */
+static void
+hash_cache_item (CACHE_CTRL r)
+{
+  unsigned int idx = r->recno & (CACHE_HASH_SIZE - 1);
+
+  r->hnext = cache_hash[idx];
+  cache_hash[idx] = r;
+}
+
+
+/* Mark the entry R as unused and remove it from the hash table.  */
+static void
+unuse_cache_item (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_hash[r->recno & (CACHE_HASH_SIZE - 1)]; *rp;
+       rp = &(*rp)->hnext)
+    if (*rp == r)
+      {
+        *rp = r->hnext;
+        break;
+      }
+  r->flags.used = 0;
+}
+
+
 /*
  * Get the data from the record cache and return a pointer into that
  * cache.  Caller should copy the returned data.  NULL is returned on
@@ -198,7 +553,7 @@ get_record_from_cache (ulong recno)
 {
   CACHE_CTRL r;
 
-  for (r = cache_list; r; r = r->next)
+  for (r = cache_hash[recno & (CACHE_HASH_SIZE - 1)]; r; r = r->hnext)
     {
       if (r->flags.used && r->recno == recno)
         return r->data;
@@ -233,7 +588,9 @@ write_cache_item (CACHE_CTRL r)
                  r->recno, n, strerror (errno) );
       return err;
     }
+  update_page_cache (r->recno, r->data);
   r->flags.dirty = 0;
+  db_written = 1;
   return 0;
 }
 
@@ -250,16 +607,12 @@ put_record_into_cache (ulong recno, const char *data)
   CACHE_CTRL r, unused;
   int dirty_count = 0;
   int clean_count = 0;
+  int rc;
 
   /* See whether we already cached this one.  */
-  for (unused = NULL, r = cache_list; r; r = r->next)
+  for (r = cache_hash[recno & (CACHE_HASH_SIZE - 1)]; r; r = r->hnext)
     {
-      if (!r->flags.used)
-        {
-          if (!unused)
-            unused = r;
-	}
-      else if (r->recno == recno)
+      if (r->flags.used && r->recno == recno)
         {
           if (!r->flags.dirty)
             {
@@ -273,13 +626,29 @@ put_record_into_cache (ulong recno, const char *data)
           memcpy (r->data, data, TRUST_RECORD_LEN);
           return 0;
 	}
-      if (r->flags.used)
+    }
+
+  /* In a large transaction there are no unused entries and we need
+   * to grow the cache anyway; skip the scan then.  */
+  unused = NULL;
+  if (!in_transaction || cache_entries < cache_allocated
+      || cache_entries < MAX_CACHE_ENTRIES_SOFT)
+    {
+      for (r = cache_list; r; r = r->next)
         {
-          if (r->flags.dirty)
-            dirty_count++;
+          if (!r->flags.used)
+            {
+              if (!unused)
+                unused = r;
+            }
           else
-            clean_count++;
-	}
+            {
+              if (r->flags.dirty)
+                dirty_count++;
+              else
+                clean_count++;
+            }
+        }
     }
 
   /* Not in the cache: add a new entry. */
@@ -289,6 +658,7 @@ put_record_into_cache (ulong recno, const char *data)
       r = unused;
       r->flags.used = 1;
       r->recno = recno;
+      hash_cache_item (r);
       memcpy (r->data, data, TRUST_RECORD_LEN);
       r->flags.dirty = 1;
       cache_is_dirty = 1;
@@ -303,12 +673,14 @@ put_record_into_cache (ulong recno, const char *data)
       r = xmalloc (sizeof *r);
       r->flags.used = 1;
       r->recno = recno;
+      hash_cache_item (r);
       memcpy (r->data, data, TRUST_RECORD_LEN);
       r->flags.dirty = 1;
       r->next = cache_list;
       cache_list = r;
       cache_is_dirty = 1;
       cache_entries++;
+      cache_allocated++;
       return 0;
     }
 
@@ -328,7 +700,7 @@ put_record_into_cache (ulong recno, const char *data)
             {
               if (!unused)
                 unused = r;
-              r->flags.used = 0;
+              unuse_cache_item (r);
               cache_entries--;
               if (!--n)
                 break;
@@ -340,6 +712,7 @@ put_record_into_cache (ulong recno, const char *data)
       r = unused;
       r->flags.used = 1;
       r->recno = recno;
+      hash_cache_item (r);
       memcpy (r->data, data, TRUST_RECORD_LEN);
       r->flags.dirty = 1;
       cache_is_dirty = 1;
@@ -348,7 +721,6 @@ put_record_into_cache (ulong recno, const char *data)
     }
 
   /* No clean entries: We have to flush some dirty entries.  */
-#if 0 /* Transactions are not yet used.  */
   if (in_transaction)
     {
       /* But we can't do this while in a transaction.  Thus we
@@ -360,19 +732,25 @@ put_record_into_cache (ulong recno, const char *data)
           r = xmalloc (sizeof *r);
           r->flags.used = 1;
           r->recno = recno;
+          hash_cache_item (r);
           memcpy (r->data, data, TRUST_RECORD_LEN);
           r->flags.dirty = 1;
           r->next = cache_list;
           cache_list = r;
           cache_is_dirty = 1;
           cache_entries++;
+          cache_allocated++;
           return 0;
 	}
-      /* Hard limit for the cache size reached.  */
-      log_info (_("trustdb transaction too large\n"));
-      return GPG_ERR_RESOURCE_LIMIT;
+      /* Hard limit for the cache size reached.  Commit what we have
+       * and go on with an empty cache.  */
+      if (opt.debug)
+        log_debug ("trustdb transaction too large - committing\n");
+      rc = commit_transaction ();
+      if (rc)
+        return rc;
+      return put_record_into_cache (recno, data);
     }
-#endif
 
   if (dirty_count)
     {
@@ -388,14 +766,12 @@ put_record_into_cache (ulong recno, const char *data)
         {
           if (r->flags.used && r->flags.dirty)
             {
-              int rc;
-
               rc = write_cache_item (r);
               if (rc)
                 return rc;
               if (!unused)
                 unused = r;
-              r->flags.used = 0;
+              unuse_cache_item (r);
               cache_entries--;
               if (!--n)
                 break;
@@ -408,6 +784,7 @@ put_record_into_cache (ulong recno, const char *data)
       r = unused;
       r->flags.used = 1;
       r->recno = recno;
+      hash_cache_item (r);
       memcpy (r->data, data, TRUST_RECORD_LEN);
       r->flags.dirty = 1;
       cache_is_dirty = 1;
@@ -429,7 +806,8 @@ tdbio_is_dirty()
 
 
 /*
- * Flush the cache.  This cannot be used while in a transaction.
+ * Flush the cache.  While in a transaction this does nothing; the
+ * records are then written by tdbio_end_transaction.
  */
 int
 tdbio_sync()
@@ -439,10 +817,8 @@ tdbio_sync()
 
     if( db_fd == -1 )
 	open_db();
-#if 0 /* Transactions are not yet used.  */
     if( in_transaction )
-	log_bug("tdbio: syncing while in transaction\n");
-#endif
+	return 0;
 
     if( !cache_is_dirty )
 	return 0;
@@ -465,17 +841,275 @@ tdbio_sync()
 }
 
 
-#if 0  /* Not yet used.  */
+/* Release all entries of the record cache.  The cache must be
+ * clean.  */
+static void
+release_cache (void)
+{
+  CACHE_CTRL r, r2;
+
+  for (r = cache_list; r; r = r2)
+    {
+      r2 = r->next;
+      xfree (r);
+    }
+  cache_list = NULL;
+  cache_entries = 0;
+  cache_allocated = 0;
+  memset (cache_hash, 0, sizeof cache_hash);
+}
+
+
+/* Remember the state of the file as the base of the transaction.  */
+static void
+mark_transaction (void)
+{
+  if (get_db_state (&tx_state))
+    log_fatal ("trustdb: fstat failed: %s\n", strerror (errno));
+  tx_next_recnum = 0;
+}
+
+
+/* Check the WAL of LEN bytes at BUF and return the number of records
+ * or -1 if it is not complete.  */
+static long
+check_wal (const byte *buf, size_t len)
+{
+  byte dgst[20];
+  ulong nrecs;
+
+  if (len < WAL_HDRLEN + 20
+      || memcmp (buf, WAL_MAGIC, 7) || buf[7] != WAL_VERSION)
+    return -1;
+  nrecs = buf32_to_ulong (buf + 8);
+  if (nrecs > (len - WAL_HDRLEN - 20) / WAL_RECLEN
+      || len != WAL_HDRLEN + nrecs * WAL_RECLEN + 20)
+    return -1;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, dgst, buf, len - 20);
+  if (memcmp (dgst, buf + len - 20, 20))
+    return -1;
+  return nrecs;
+}
+
+
+/*
+ * Apply the WAL to the trustdb, sync the trustdb and remove the WAL.
+ * An incomplete WAL is just removed.  A WAL for another generation
+ * of the trustdb is also removed; the trustdb has then been updated
+ * by a process which did not know about the WAL and replaying it
+ * would revert that update.  This must be called with the lock held.
+ * On a fatal error the function terminates the process.
+ */
+static void
+recover_wal (void)
+{
+  struct stat st;
+  struct db_state_s state;
+  byte *buf, *p;
+  char rec[TRUST_RECORD_LEN];
+  size_t len, n;
+  ssize_t nread;
+  ulong recno;
+  long nrecs, napplied;
+  int fd;
+
+  if (db_fd == -1 || !wal_name)
+    return;
+
+  fd = open (wal_name, O_RDONLY | MY_O_BINARY);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        log_fatal (_("can't open '%s': %s\n"), wal_name, strerror (errno));
+      return;
+    }
+  if (fstat (fd, &st))
+    log_fatal ("trustdb: fstat failed: %s\n", strerror (errno));
+  len = st.st_size;
+  buf = xmalloc (len + 1);
+  for (n = 0; n < len; n += nread)
+    {
+      nread = read (fd, buf + n, len - n);
+      if (nread <= 0)
+        break;
+    }
+  close (fd);
+
+  nrecs = n == len? check_wal (buf, len) : -1;
+  if (nrecs == -1)
+    {
+      /* The commit did not finish and thus the trustdb has not been
+       * touched.  */
+      if (!opt.quiet)
+        log_info (_("trustdb: discarding incomplete transaction log\n"));
+    }
+  else if (get_db_state (&state)
+           || state.generation != buf32_to_ulong (buf + 12))
+    {
+      log_info (_("trustdb: discarding stale transaction log\n"));
+    }
+  else
+    {
+      /* Write only the records which differ so that the file is not
+       * touched if the WAL has already been applied.  */
+      napplied = 0;
+      for (p = buf + WAL_HDRLEN; nrecs; nrecs--, p += WAL_RECLEN)
+        {
+          recno = buf32_to_ulong (p);
+          if (lseek (db_fd, recno * TRUST_RECORD_LEN, SEEK_SET) == -1)
+            log_fatal (_("trustdb: lseek failed: %s\n"), strerror (errno));
+          if (read (db_fd, rec, TRUST_RECORD_LEN) == TRUST_RECORD_LEN
+              && !memcmp (rec, p + 4, TRUST_RECORD_LEN))
+            continue;
+          if (lseek (db_fd, recno * TRUST_RECORD_LEN, SEEK_SET) == -1)
+            log_fatal (_("trustdb: lseek failed: %s\n"), strerror (errno));
+          nread = write (db_fd, p + 4, TRUST_RECORD_LEN);
+          if (nread != TRUST_RECORD_LEN)
+            log_fatal (_("trustdb rec %lu: write failed (n=%d): %s\n"),
+                       recno, (int)nread, strerror (errno));
+          napplied++;
+          db_written = 1;
+        }
+      if (fsync (db_fd))
+        log_fatal (_("error writing '%s': %s\n"), db_name, strerror (errno));
+      if (napplied)
+        {
+          invalidate_page_cache ();
+          if (!opt.quiet)
+            log_info (_("trustdb: completed an interrupted transaction\n"));
+        }
+    }
+  xfree (buf);
+
+  if (gnupg_remove (wal_name) && errno != ENOENT)
+    log_fatal (_("can't remove '%s': %s\n"), wal_name, strerror (errno));
+}
+
+
+/*
+ * Write the dirty records to the WAL, sync it, write the records to
+ * the trustdb, sync that and remove the WAL.  Fails with
+ * GPG_ERR_CONFLICT if the file has been updated by another process
+ * since the start of the transaction; the caller should then cancel
+ * the transaction.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+commit_transaction (void)
+{
+  gpg_error_t err = 0;
+  CACHE_CTRL r;
+  struct db_state_s state;
+  byte *buf, *p;
+  size_t nrecs, len;
+  ssize_t n;
+  int fd;
+
+  if (!cache_is_dirty)
+    return 0;
+
+  /* The lock is only held for the commit.  */
+  take_write_lock ();
+  if (get_db_state (&state) || !same_db_state (&state, &tx_state))
+    {
+      log_info (_("trustdb has been changed by another process\n"));
+      err = gpg_error (GPG_ERR_CONFLICT);
+      goto leave;
+    }
+
+  for (nrecs = 0, r = cache_list; r; r = r->next)
+    if (r->flags.used && r->flags.dirty)
+      nrecs++;
+  len = WAL_HDRLEN + nrecs * WAL_RECLEN + 20;
+  buf = xtrymalloc (len);
+  if (!buf)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (buf, WAL_MAGIC, 7);
+  buf[7] = WAL_VERSION;
+  ulongtobuf (buf + 8, nrecs);
+  ulongtobuf (buf + 12, state.generation);
+  for (p = buf + WAL_HDRLEN, r = cache_list; r; r = r->next)
+    if (r->flags.used && r->flags.dirty)
+      {
+        ulongtobuf (p, r->recno);
+        memcpy (p + 4, r->data, TRUST_RECORD_LEN);
+        p += WAL_RECLEN;
+      }
+  gcry_md_hash_buffer (GCRY_MD_SHA1, p, buf, len - 20);
+
+  gnupg_block_all_signals ();
+  fd = open (wal_name, O_WRONLY | O_CREAT | O_TRUNC | MY_O_BINARY,
+             S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    n = -1;
+  else
+    {
+      n = write (fd, buf, len);
+      if (n == (ssize_t)len && fsync (fd))
+        n = -1;
+      if (close (fd))
+        n = -1;
+    }
+  xfree (buf);
+  if (n != (ssize_t)len)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), wal_name, gpg_strerror (err));
+      gnupg_remove (wal_name);
+      gnupg_unblock_all_signals ();
+      goto leave;
+    }
+
+  /* The transaction is now committed.  If writing the trustdb fails
+   * the next writer completes it from the WAL.  */
+  for (r = cache_list; r; r = r->next)
+    if (r->flags.used && r->flags.dirty)
+      {
+        err = write_cache_item (r);
+        if (err)
+          break;
+      }
+  if (!err && fsync (db_fd))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), db_name, gpg_strerror (err));
+    }
+  if (err)
+    {
+      /* Do not bump the generation so that the WAL stays valid.  */
+      db_written = 0;
+      gnupg_unblock_all_signals ();
+      goto leave;
+    }
+  if (gnupg_remove (wal_name) && errno != ENOENT)
+    log_error (_("can't remove '%s': %s\n"), wal_name, strerror (errno));
+  bump_generation ();
+  gnupg_unblock_all_signals ();
+
+  cache_is_dirty = 0;
+  release_cache ();
+  mark_transaction ();
+
+ leave:
+  release_write_lock ();
+  return err;
+}
+
+
 /*
  * Simple transactions system:
  * Everything between begin_transaction and end/cancel_transaction
- * is not immediately written but at the time of end_transaction.
- *
- * NOTE: The transaction code is disabled in the 1.2 branch, as it is
- * not yet used.
+ * is not immediately written but at the time of end_transaction.  The
+ * write lock is only taken for the commit.  A transaction is not
+ * guaranteed to be atomic if it exceeds MAX_CACHE_ENTRIES_HARD
+ * records; it is then committed in several steps.
  */
 int
-tdbio_begin_transaction ()  /* Not yet used.  */
+tdbio_begin_transaction ()
 {
   int rc;
 
@@ -485,28 +1119,27 @@ tdbio_begin_transaction ()  /* Not yet used.  */
   rc = tdbio_sync();
   if (rc)
     return rc;
+  mark_transaction ();
   in_transaction = 1;
   return 0;
 }
 
 int
-tdbio_end_transaction ()  /* Not yet used.  */
+tdbio_end_transaction ()
 {
   int rc;
 
   if (!in_transaction)
     log_bug ("tdbio: no active transaction\n");
-  take_write_lock ();
-  gnupg_block_all_signals ();
+  rc = commit_transaction ();
+  if (rc)
+    tdbio_cancel_transaction ();
   in_transaction = 0;
-  rc = tdbio_sync();
-  gnupg_unblock_all_signals();
-  release_write_lock ();
   return rc;
 }
 
 int
-tdbio_cancel_transaction () /* Not yet used.  */
+tdbio_cancel_transaction ()
 {
   CACHE_CTRL r;
 
@@ -521,7 +1154,7 @@ tdbio_cancel_transaction () /* Not yet used.  */
         {
           if (r->flags.used && r->flags.dirty)
             {
-              r->flags.used = 0;
+              unuse_cache_item (r);
               cache_entries--;
 	    }
 	}
@@ -531,7 +1164,6 @@ tdbio_cancel_transaction () /* Not yet used.  */
   in_transaction = 0;
   return 0;
 }
-#endif  /* Not yet used.  */
 
 
 
@@ -545,6 +1177,8 @@ cleanup (void)
 {
   if (is_locked)
     {
+      if (db_written)
+        bump_generation ();
       if (!dotlock_release (lockhandle))
         is_locked = 0;
     }
@@ -676,6 +1310,8 @@ tdbio_set_dbname (ctrl_t ctrl, const char *new_dbname,
 
   xfree (db_name);
   db_name = fname;
+  xfree (wal_name);
+  wal_name = xstrconcat (fname, WAL_SUFFIX, NULL);
 
   /* Quick check for (likely) case where there already is a
    * trustdb.gpg.  This check is not required in theory, but it helps
@@ -755,6 +1391,9 @@ tdbio_set_dbname (ctrl_t ctrl, const char *new_dbname,
       if (db_fd == -1)
         log_fatal (_("can't open '%s': %s\n"), db_name, strerror (errno));
 
+      /* A WAL left over from an old trustdb does not apply.  */
+      gnupg_remove (wal_name);
+
       rc = create_version_record (ctrl);
       if (rc)
         log_fatal (_("%s: failed to create version record: %s"),
@@ -828,6 +1467,14 @@ open_db ()
 #endif /*!HAVE_W32CE_SYSTEM*/
   register_secured_file (db_name);
 
+  /* Complete or discard an interrupted commit.  */
+  if (!access (wal_name, F_OK) && !access (db_name, W_OK))
+    {
+      if (take_write_lock ())
+        recover_wal ();
+      release_write_lock ();
+    }
+
   /* Read the version record. */
   if (tdbio_read_record (0, &rec, RECTYPE_VER ) )
     log_fatal( _("%s: invalid trustdb\n"), db_name );
@@ -1522,6 +2169,8 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
     open_db ();
 
   buf = get_record_from_cache( recnum );
+  if (!buf)
+    buf = get_record_from_pages (recnum);
   if (!buf)
     {
       if (lseek (db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET) == -1)
@@ -1580,6 +2229,7 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
           p += 4;
           rec->r.ver.nextcheck = buf32_to_ulong(p);
           p += 4;
+          rec->r.ver.generation = buf32_to_ulong(p);
           p += 4;
           p += 4;
           rec->r.ver.firstfree = buf32_to_ulong(p);
@@ -1693,7 +2343,7 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
       p += 2;
       ulongtobuf(p, rec->r.ver.created); p += 4;
       ulongtobuf(p, rec->r.ver.nextcheck); p += 4;
-      p += 4;
+      ulongtobuf(p, rec->r.ver.generation); p += 4;
       p += 4;
       ulongtobuf(p, rec->r.ver.firstfree ); p += 4;
       p += 4;
@@ -1831,6 +2481,27 @@ tdbio_new_recnum (ctrl_t ctrl)
         log_fatal (_("%s: failed to zero a record: %s\n"),
                    db_name, gpg_strerror (rc));
     }
+  else if (in_transaction)
+    {
+      /* Append a new record to the cache only; it is written to the
+       * file by the commit.  */
+      if (!tx_next_recnum)
+        {
+          offset = lseek (db_fd, 0, SEEK_END);
+          if (offset == (off_t)(-1))
+            log_fatal ("trustdb: lseek to end failed: %s\n",
+                       strerror (errno));
+          tx_next_recnum = offset / TRUST_RECORD_LEN;
+        }
+      recnum = tx_next_recnum++;
+      log_assert (recnum);
+      memset (&rec, 0, sizeof rec);
+      rec.recnum = recnum;
+      rc = tdbio_write_record (ctrl, &rec);
+      if (rc)
+        log_fatal (_("%s: failed to append a record: %s\n"),
+                   db_name, gpg_strerror (rc));
+    }
   else /* Not found - append a new record.  */
     {
       offset = lseek (db_fd, 0, SEEK_END);
@@ -1861,6 +2532,8 @@ tdbio_new_recnum (ctrl_t ctrl)
               log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
                          recnum, n, gpg_strerror (rc));
 	    }
+          else
+            update_page_cache (recnum, &rec);
 	}
 
       if (rc)
@@ -57,7 +57,7 @@ struct trust_record {
 	    byte  min_cert_level;
 	    ulong created;   /* timestamp of trustdb creation  */
 	    ulong nextcheck; /* timestamp of next scheduled check */
-	    ulong reserved;
+	    ulong generation; /* counter of modifications */
 	    ulong reserved2;
 	    ulong firstfree;
 	    ulong reserved3;
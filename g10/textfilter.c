@@ -42,22 +42,46 @@
 			  /* to make sure that a warning is displayed while */
 			  /* creating a message */
 
+/* The number of bytes looked at by peek_lines.  This must be less
+ * than MAX_LINELEN so that the lines found are never truncated.  */
+#define BULK_SIZE 8192
+
+
 static unsigned
 len_without_trailing_chars( byte *line, unsigned len, const char *trimchars )
 {
-    byte *p, *mark;
-    unsigned n;
+    /* Note that strchr also matches the terminating Nul; this is how
+     * Nuls have always been handled here.  */
+    while( len && strchr( trimchars, line[len-1] ) )
+	len--;
+    return len;
+}
 
-    for(mark=NULL, p=line, n=0; n < len; n++, p++ ) {
-	if( strchr( trimchars, *p ) ) {
-	    if( !mark )
-		mark = p;
-	}
-	else
-	    mark = NULL;
+
+/* Peek at up to BULK_SIZE bytes of the input A and store them in the
+ * buffer at *BUFFER of size *BUFSIZE, which is enlarged as needed.
+ * Returns the number of bytes up to and including the last LF or 0 if
+ * that data holds no complete line.  The caller needs to skip the
+ * bytes it has processed.  */
+static unsigned
+peek_lines (IOBUF a, byte **buffer, unsigned *bufsize)
+{
+  byte *p;
+  int n;
+
+  if (*bufsize < BULK_SIZE)
+    {
+      p = xtryrealloc (*buffer, BULK_SIZE);
+      if (!p)
+        return 0;
+      *buffer = p;
+      *bufsize = BULK_SIZE;
     }
 
-    return mark? (mark - line) : len;
+  n = iobuf_peek (a, *buffer, BULK_SIZE);
+  while (n > 0 && (*buffer)[n-1] != '\n')
+    n--;
+  return n > 0? n : 0;
 }
 
 
@@ -67,18 +91,46 @@ standard( text_filter_context_t *tfx, IOBUF a,
 {
     int rc=0;
     size_t len = 0;
-    unsigned maxlen;
+    unsigned maxlen, nbulk, pos, n, t;
+    byte *p;
 
     log_assert( size > 10 );
     size -= 2;	/* reserve 2 bytes to append CR,LF */
     while( !rc && len < size ) {
 	int lf_seen;
 
-	while( len < size && tfx->buffer_pos < tfx->buffer_len )
-	    buf[len++] = tfx->buffer[tfx->buffer_pos++];
+	if( tfx->buffer_pos < tfx->buffer_len ) {
+	    n = tfx->buffer_len - tfx->buffer_pos;
+	    if( n > size - len )
+		n = size - len;
+	    memcpy( buf + len, tfx->buffer + tfx->buffer_pos, n );
+	    len += n;
+	    tfx->buffer_pos += n;
+	}
 	if( len >= size )
 	    continue;
 
+	/* Canonicalize complete lines directly into BUF; this is the
+	   same as the code below does for each line.  */
+	nbulk = peek_lines( a, &tfx->buffer, &tfx->buffer_size );
+	tfx->buffer_pos = tfx->buffer_len = 0;
+	for( pos = 0; pos < nbulk; pos += n ) {
+	    p = tfx->buffer + pos;
+	    n = (byte*)memchr( p, '\n', nbulk - pos ) - p + 1;
+	    if( len + n + 1 > size )
+		break;
+	    t = len_without_trailing_chars( p, n, opt.rfc2440_text?
+					    " \t\r\n" : "\r\n" );
+	    memcpy( buf + len, p, t );
+	    len += t;
+	    buf[len++] = '\r';
+	    buf[len++] = '\n';
+	}
+	if( pos ) {
+	    iobuf_read( a, NULL, pos );
+	    continue;
+	}
+
 	/* read the next line */
 	maxlen = MAX_LINELEN;
 	tfx->buffer_pos = 0;
@@ -154,6 +206,60 @@ text_filter( void *opaque, int control,
 }
 
 
+/* Hash and write the line of N bytes at BUFFER for
+ * copy_clearsig_text.  */
+static void
+copy_clearsig_line (IOBUF out, gcry_md_hd_t md, byte *buffer, unsigned n,
+                    int escape_dash, int escape_from, int *pending_lf)
+{
+    /* update the message digest */
+    if( escape_dash ) {
+	if( *pending_lf ) {
+	    gcry_md_putc ( md, '\r' );
+	    gcry_md_putc ( md, '\n' );
+	}
+	gcry_md_write ( md, buffer,
+			len_without_trailing_chars (buffer, n, " \t\r\n"));
+    }
+    else
+	gcry_md_write ( md, buffer, n );
+    *pending_lf = buffer[n-1] == '\n';
+
+    /* write the output */
+    if(    ( escape_dash && *buffer == '-')
+	|| ( escape_from && n > 4 && !memcmp(buffer, "From ", 5 ) ) ) {
+	iobuf_put( out, '-' );
+	iobuf_put( out, ' ' );
+    }
+
+#if  0 /*defined(HAVE_DOSISH_SYSTEM)*/
+    /* We don't use this anymore because my interpretation of rfc2440 7.1
+     * is that there is no conversion needed.  If one decides to
+     * clearsign a unix file on a DOS box he will get a mixed line endings.
+     * If at some point it turns out, that a conversion is a nice feature
+     * we can make an option out of it.
+     */
+    /* make sure the lines do end in CR,LF */
+    if( n > 1 && ( (buffer[n-2] == '\r' && buffer[n-1] == '\n' )
+			|| (buffer[n-2] == '\n' && buffer[n-1] == '\r'))) {
+	iobuf_write( out, buffer, n-2 );
+	iobuf_put( out, '\r');
+	iobuf_put( out, '\n');
+    }
+    else if( n && buffer[n-1] == '\n' ) {
+	iobuf_write( out, buffer, n-1 );
+	iobuf_put( out, '\r');
+	iobuf_put( out, '\n');
+    }
+    else
+	iobuf_write( out, buffer, n );
+
+#else
+    iobuf_write( out, buffer, n );
+#endif
+}
+
+
 /****************
  * Copy data from INP to OUT and do some escaping if requested.
  * md is updated as required by rfc2440
@@ -164,8 +270,8 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
 {
     unsigned int maxlen;
     byte *buffer = NULL;    /* malloced buffer */
-    unsigned int bufsize;   /* and size of this buffer */
-    unsigned int n;
+    unsigned int bufsize = 0; /* and size of this buffer */
+    unsigned int n, nbulk, pos;
     int truncated = 0;
     int pending_lf = 0;
 
@@ -175,6 +281,19 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
     write_status_begin_signing (md);
 
     for(;;) {
+	/* Process complete lines without reading them one by one.  */
+	nbulk = peek_lines( inp, &buffer, &bufsize );
+	for( pos = 0; pos < nbulk; pos += n ) {
+	    n = (byte*)memchr( buffer + pos, '\n', nbulk - pos )
+		- (buffer + pos) + 1;
+	    copy_clearsig_line( out, md, buffer + pos, n,
+				escape_dash, escape_from, &pending_lf );
+	}
+	if( nbulk ) {
+	    iobuf_read( inp, NULL, nbulk );
+	    continue;
+	}
+
 	maxlen = MAX_LINELEN;
 	n = iobuf_read_line( inp, &buffer, &bufsize, &maxlen );
 	if( !maxlen )
@@ -183,51 +302,8 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
 	if( !n )
 	    break; /* read_line has returned eof */
 
-	/* update the message digest */
-	if( escape_dash ) {
-	    if( pending_lf ) {
-		gcry_md_putc ( md, '\r' );
-		gcry_md_putc ( md, '\n' );
-	    }
-	    gcry_md_write ( md, buffer,
-                            len_without_trailing_chars (buffer, n, " \t\r\n"));
-	}
-	else
-            gcry_md_write ( md, buffer, n );
-	pending_lf = buffer[n-1] == '\n';
-
-	/* write the output */
-	if(    ( escape_dash && *buffer == '-')
-	    || ( escape_from && n > 4 && !memcmp(buffer, "From ", 5 ) ) ) {
-	    iobuf_put( out, '-' );
-	    iobuf_put( out, ' ' );
-	}
-
-#if  0 /*defined(HAVE_DOSISH_SYSTEM)*/
-	/* We don't use this anymore because my interpretation of rfc2440 7.1
-	 * is that there is no conversion needed.  If one decides to
-	 * clearsign a unix file on a DOS box he will get a mixed line endings.
-	 * If at some point it turns out, that a conversion is a nice feature
-	 * we can make an option out of it.
-	 */
-	/* make sure the lines do end in CR,LF */
-	if( n > 1 && ( (buffer[n-2] == '\r' && buffer[n-1] == '\n' )
-			    || (buffer[n-2] == '\n' && buffer[n-1] == '\r'))) {
-	    iobuf_write( out, buffer, n-2 );
-	    iobuf_put( out, '\r');
-	    iobuf_put( out, '\n');
-	}
-	else if( n && buffer[n-1] == '\n' ) {
-	    iobuf_write( out, buffer, n-1 );
-	    iobuf_put( out, '\r');
-	    iobuf_put( out, '\n');
-	}
-	else
-	    iobuf_write( out, buffer, n );
-
-#else
-	iobuf_write( out, buffer, n );
-#endif
+	copy_clearsig_line( out, md, buffer, n,
+			    escape_dash, escape_from, &pending_lf );
     }
 
     /* at eof */
@@ -29,6 +29,7 @@
 #include <stdarg.h>
 #include <sqlite3.h>
 #include <time.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/types.h"
@@ -56,6 +57,20 @@
 #define FULL_TRUST_THRESHOLD  21
 
 
+/* The number of buckets of the policy cache and the maximum number
+ * of cached bindings.  */
+#define POLICY_CACHE_SIZE      1024
+#define POLICY_CACHE_MAX_ITEMS 65536
+
+/* An entry of the policy cache.  */
+struct policy_cache_item_s
+{
+  struct policy_cache_item_s *next;
+  enum tofu_policy effective_policy;
+  char key[1];  /* The fingerprint, a space and the mail address.  */
+};
+
+
 /* A struct with data pertaining to the tofu DB.  There is one such
    struct per session and it is cached in session's ctrl structure.
    To initialize this or get the current singleton, call opendbs().
@@ -82,14 +97,72 @@ struct tofu_dbs_s
     sqlite3_stmt *register_already_seen;
     sqlite3_stmt *register_signature;
     sqlite3_stmt *register_encryption;
+    sqlite3_stmt *policy_cache_data_version;
   } s;
 
   int in_batch_transaction;
   int in_transaction;
   time_t batch_update_started;
+
+  /* Set if the registrations are coalesced into an automatic batch
+   * transaction, the number of registrations in it and its start.  */
+  int auto_batch;
+  unsigned int auto_batch_count;
+  time_t auto_batch_started;
+
+  /* The cache of effective policies, see policy_cache_get.  It is
+   * valid for the data_version POLICY_CACHE_VERSION of the DB.  If
+   * POLICY_CACHE_CHECKED is set the version has been checked during
+   * the open batch transaction.  */
+  struct policy_cache_item_s *policy_cache[POLICY_CACHE_SIZE];
+  unsigned int policy_cache_count;
+  long policy_cache_version;
+  int policy_cache_checked;
 };
 
 
+/* Commit the automatic batch transaction after that many
+ * registrations or seconds.  */
+#define AUTO_BATCH_MAX_COUNT 256
+#define AUTO_BATCH_MAX_SECS  1
+
+/* The session with the automatic batch transaction for
+ * tofu_flush_batch.  */
+static ctrl_t auto_batch_ctrl;
+
+/* Remove all entries from the policy cache of DBS.  This needs to be
+ * called after each update of the bindings table by us; updates by
+ * other processes are detected by the data_version.  */
+static void
+policy_cache_clear (tofu_dbs_t dbs)
+{
+  struct policy_cache_item_s *item, *next;
+  int i;
+
+  for (i = 0; i < POLICY_CACHE_SIZE; i++)
+    {
+      for (item = dbs->policy_cache[i]; item; item = next)
+        {
+          next = item->next;
+          xfree (item);
+        }
+      dbs->policy_cache[i] = NULL;
+    }
+  dbs->policy_cache_count = 0;
+}
+
+
+/* Statistics for --list-config and the debug output.  */
+static struct
+{
+  unsigned int signatures;   /* Number of registered signatures.  */
+  unsigned int encryptions;  /* Number of registered encryptions.  */
+  unsigned int commits;      /* Number of batch commits.  */
+  unsigned long usec;        /* Total time spent registering.  */
+  unsigned long max_usec;    /* Longest registration.  */
+} tofu_stats;
+
+
 #define STRINGIFY(s) STRINGIFY2(s)
 #define STRINGIFY2(s) #s
 
@@ -192,7 +265,7 @@ begin_transaction (ctrl_t ctrl, int only_batch)
 
       /* If we are in a batch update, then batch updates better have
          been enabled.  */
-      log_assert (ctrl->tofu.batch_updated_wanted);
+      log_assert (ctrl->tofu.batch_updated_wanted || dbs->auto_batch);
 
       /* Check if another process wants to run.  (We just ignore any
        * stat failure.  A waiter might have to wait a bit longer, but
@@ -284,7 +357,8 @@ end_transaction (ctrl_t ctrl, int only_batch)
         log_assert (dbs->in_transaction == 0);
 
       if (/* Batch mode disabled?  */
-          (!ctrl->tofu.batch_updated_wanted || only_batch == 2)
+          ((!ctrl->tofu.batch_updated_wanted && !dbs->auto_batch)
+           || only_batch == 2)
           /* But, we still have an open batch transaction?  */
           && dbs->in_batch_transaction)
         {
@@ -292,6 +366,9 @@ end_transaction (ctrl_t ctrl, int only_batch)
            * batch mode.  */
           dbs->in_batch_transaction = 0;
           dbs->in_transaction = 0;
+          dbs->auto_batch_count = 0;
+          dbs->policy_cache_checked = 0;
+          tofu_stats.commits++;
 
           rc = gpgsql_stepx (dbs->db, &dbs->s.savepoint_batch_commit,
                              NULL, NULL, &err,
@@ -341,6 +418,9 @@ rollback_transaction (ctrl_t ctrl)
   log_assert (dbs);
   log_assert (dbs->in_transaction > 0);
 
+  /* The cache may hold results based on the undone changes.  */
+  policy_cache_clear (dbs);
+
   /* Be careful to not undo any progress made by closed transactions in
      batch mode.  */
   rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
@@ -395,6 +475,70 @@ tofu_resume_batch_transaction (ctrl_t ctrl)
 }
 
 
+/* Coalesce the registrations into an automatic batch transaction.
+ * The batch is committed every AUTO_BATCH_MAX_COUNT registrations or
+ * AUTO_BATCH_MAX_SECS seconds, when another process wants the lock
+ * (see begin_transaction), and when the database is closed.  Thus a
+ * crash may lose the registrations of the last second.  */
+static void
+auto_batch_update (ctrl_t ctrl)
+{
+  tofu_dbs_t dbs = ctrl->tofu.dbs;
+
+  if (dbs->in_transaction)
+    return;
+
+  if (dbs->auto_batch && dbs->in_batch_transaction
+      && (dbs->auto_batch_count >= AUTO_BATCH_MAX_COUNT
+          || (gnupg_get_time () - dbs->auto_batch_started
+              >= AUTO_BATCH_MAX_SECS)))
+    end_transaction (ctrl, 2);
+
+  if (!dbs->auto_batch_count++)
+    dbs->auto_batch_started = gnupg_get_time ();
+  dbs->auto_batch = 1;
+  auto_batch_ctrl = ctrl;
+}
+
+
+/* Commit the automatic batch transaction.  This is called on exit
+ * because the process may terminate without closing the database.  */
+void
+tofu_flush_batch (void)
+{
+  ctrl_t ctrl = auto_batch_ctrl;
+
+  auto_batch_ctrl = NULL;
+  if (ctrl && ctrl->tofu.dbs && !ctrl->tofu.dbs->in_transaction)
+    end_transaction (ctrl, 2);
+}
+
+
+/* Return the current time in microseconds.  */
+static unsigned long long
+stats_clock (void)
+{
+  struct timespec ts;
+
+  if (npth_clock_gettime (&ts))
+    return 0;
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Account for a registration which started at START.  */
+static void
+stats_update (unsigned long long start)
+{
+  unsigned long usec;
+
+  usec = stats_clock () - start;
+  tofu_stats.usec += usec;
+  if (usec > tofu_stats.max_usec)
+    tofu_stats.max_usec = usec;
+}
+
+
 
 /* Wrapper around strtol which prints a warning in case of a
  * conversion error.  On success the converted value is stored at
@@ -834,9 +978,7 @@ initdb (sqlite3 *db)
       rc = sqlite3_exec (db,
                          "create table if not exists encryptions"
                          " (binding INTEGER NOT NULL,"
-                         "  time INTEGER);"
-                         "create index if not exists encryptions_binding"
-                         " on encryptions (binding);\n",
+                         "  time INTEGER);",
                          NULL, NULL, &err);
       if (rc)
         {
@@ -845,6 +987,25 @@ initdb (sqlite3 *db)
           sqlite3_free (err);
         }
     }
+  if (! rc)
+    {
+      /* The statistics queries select the time of all signatures
+       * and encryptions of a binding.  With these indexes they do
+       * not need to read the table rows.  The index on (binding,
+       * time) replaces the old index on encryptions (binding).  */
+      rc = sqlite3_exec (db,
+                         "create index if not exists signatures_binding_time"
+                         " on signatures (binding, time);"
+                         "create index if not exists encryptions_binding_time"
+                         " on encryptions (binding, time);"
+                         "drop index if exists encryptions_binding;",
+                         NULL, NULL, &err);
+      if (rc)
+        {
+	  log_error ("error creating TOFU indexes: %s\n", err);
+          sqlite3_free (err);
+        }
+    }
   if (! rc)
     {
       /* The effective policy for a binding.  If a key is ultimately
@@ -973,6 +1134,21 @@ opendbs (ctrl_t ctrl)
           db = NULL;
         }
 
+      /* With a write-ahead log readers are not blocked by the batch
+       * transaction and a commit needs to sync only the log.  */
+      if (db)
+        {
+          char *err = NULL;
+
+          if (sqlite3_exec (db, "pragma journal_mode = wal;"
+                            " pragma synchronous = normal;",
+                            NULL, NULL, &err))
+            {
+              log_info ("TOFU: error setting the journal mode: %s\n", err);
+              sqlite3_free (err);
+            }
+        }
+
       if (db)
         {
           ctrl->tofu.dbs = xmalloc_clear (sizeof *ctrl->tofu.dbs);
@@ -1003,6 +1179,14 @@ tofu_closedbs (ctrl_t ctrl)
   log_assert (dbs->in_transaction == 0);
 
   end_transaction (ctrl, 2);
+  if (auto_batch_ctrl == ctrl)
+    auto_batch_ctrl = NULL;
+  policy_cache_clear (dbs);
+  if (DBG_TRUST || DBG_CLOCK)
+    log_debug ("TOFU: %u signatures and %u encryptions registered"
+               " in %lu us (max %lu us), %u commits\n",
+               tofu_stats.signatures, tofu_stats.encryptions,
+               tofu_stats.usec, tofu_stats.max_usec, tofu_stats.commits);
 
   /* Arghh, that is a surprising use of the struct.  */
   for (statements = (void *) &dbs->s;
@@ -1010,6 +1194,11 @@ tofu_closedbs (ctrl_t ctrl)
        statements ++)
     sqlite3_finalize (*statements);
 
+  /* Let SQLite update the statistics used by the query planner if
+   * the tables changed enough to warrant it.  This is usually a
+   * no-op.  */
+  sqlite3_exec (dbs->db, "pragma optimize;", NULL, NULL, NULL);
+
   sqlite3_close (dbs->db);
   xfree (dbs->want_lock_file);
   xfree (dbs);
@@ -1042,6 +1231,93 @@ get_single_long_cb2 (void *cookie, int argc, char **argv, char **azColName,
   return get_single_long_cb (cookie, argc, argv, azColName);
 }
 
+
+/* Return the bucket of the policy cache for KEY.  */
+static unsigned int
+policy_cache_hash (const char *key)
+{
+  unsigned int h = 0;
+
+  for (; *key; key++)
+    h = h * 31 + *(const unsigned char *)key;
+  return h % POLICY_CACHE_SIZE;
+}
+
+
+/* Clear the policy cache of DBS if another process has changed the
+ * DB.  While we hold the batch transaction no other process can
+ * change it and thus one check per batch suffices.  */
+static void
+policy_cache_validate (tofu_dbs_t dbs)
+{
+  long version = -1;
+  char *err = NULL;
+
+  if (dbs->in_batch_transaction && dbs->policy_cache_checked)
+    return;
+
+  if (gpgsql_stepx (dbs->db, &dbs->s.policy_cache_data_version,
+                    get_single_long_cb2, &version, &err,
+                    "pragma data_version;", GPGSQL_ARG_END))
+    {
+      sqlite3_free (err);
+      version = -1;
+    }
+  if (version == -1 || version != dbs->policy_cache_version)
+    policy_cache_clear (dbs);
+  dbs->policy_cache_version = version;
+  dbs->policy_cache_checked = dbs->in_batch_transaction && version != -1;
+}
+
+
+/* Return the cached effective policy of the binding <FINGERPRINT,
+ * EMAIL> or TOFU_POLICY_NONE if it is not cached.  Only bindings
+ * without a conflict are cached; their effective policy is stored in
+ * the DB and get_policy would just return that.  Thus a hit saves
+ * the queries of get_policy.  */
+static enum tofu_policy
+policy_cache_get (tofu_dbs_t dbs, const char *fingerprint, const char *email)
+{
+  struct policy_cache_item_s *item;
+  char *key;
+
+  policy_cache_validate (dbs);
+  if (!dbs->policy_cache_count)
+    return TOFU_POLICY_NONE;
+
+  key = xstrconcat (fingerprint, " ", email, NULL);
+  for (item = dbs->policy_cache[policy_cache_hash (key)]; item;
+       item = item->next)
+    if (!strcmp (item->key, key))
+      break;
+  xfree (key);
+  return item? item->effective_policy : TOFU_POLICY_NONE;
+}
+
+
+/* Add the binding <FINGERPRINT, EMAIL> with EFFECTIVE_POLICY to the
+ * policy cache.  */
+static void
+policy_cache_put (tofu_dbs_t dbs, const char *fingerprint, const char *email,
+                  enum tofu_policy effective_policy)
+{
+  struct policy_cache_item_s *item;
+  unsigned int idx;
+
+  if (dbs->policy_cache_count >= POLICY_CACHE_MAX_ITEMS)
+    policy_cache_clear (dbs);
+
+  item = xtrymalloc (sizeof *item + strlen (fingerprint) + strlen (email) + 1);
+  if (!item)
+    return;
+  strcpy (stpcpy (stpcpy (item->key, fingerprint), " "), email);
+  item->effective_policy = effective_policy;
+  idx = policy_cache_hash (item->key);
+  item->next = dbs->policy_cache[idx];
+  dbs->policy_cache[idx] = item;
+  dbs->policy_cache_count++;
+}
+
 /* Record (or update) a trust policy about a (possibly new)
    binding.
 
@@ -1064,6 +1340,8 @@ record_binding (tofu_dbs_t dbs, const char *fingerprint, const char *email,
 	 || policy == TOFU_POLICY_ASK))
     log_bug ("%s: Bad value for policy (%d)!\n", __func__, policy);
 
+  policy_cache_clear (dbs);
+
 
   if (DBG_TRUST || show_old)
     {
@@ -2338,6 +2616,14 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
   strlist_t conflict_set = NULL;
   int conflict_set_count;
 
+  effective_policy_orig = policy_cache_get (dbs, fingerprint, email);
+  if (effective_policy_orig != TOFU_POLICY_NONE)
+    {
+      if (conflict_setp)
+        *conflict_setp = NULL;
+      return effective_policy_orig;
+    }
+
   /* Check if the <FINGERPRINT, EMAIL> binding is known
      (TOFU_POLICY_NONE cannot appear in the DB.  Thus, if POLICY is
      still TOFU_POLICY_NONE after executing the query, then the
@@ -2637,6 +2923,11 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
     xfree (conflict);
   free_strlist (results);
 
+  /* Bindings with a conflict are not cached; see above.  */
+  if (effective_policy != _tofu_GET_POLICY_ERROR
+      && effective_policy != TOFU_POLICY_ASK)
+    policy_cache_put (dbs, fingerprint, email, effective_policy);
+
   return effective_policy;
 }
 
@@ -2837,6 +3128,7 @@ get_trust (ctrl_t ctrl, PKT_public_key *pk,
         log_debug ("Set %s to conflict with %s\n",
                    iter->d, fingerprint);
     }
+  policy_cache_clear (dbs);
 
  out:
   if (in_transaction)
@@ -3331,6 +3623,7 @@ tofu_register_signature (ctrl_t ctrl,
   char *sqlerr = NULL;
   char *sig_digest = NULL;
   unsigned long c;
+  unsigned long long start;
 
   dbs = opendbs (ctrl);
   if (! dbs)
@@ -3341,6 +3634,10 @@ tofu_register_signature (ctrl_t ctrl,
       return rc;
     }
 
+  start = stats_clock ();
+  tofu_stats.signatures++;
+  auto_batch_update (ctrl);
+
   /* We do a query and then an insert.  Make sure they are atomic
      by wrapping them in a transaction.  */
   rc = begin_transaction (ctrl, 0);
@@ -3476,6 +3773,7 @@ tofu_register_signature (ctrl_t ctrl,
 
   xfree (fingerprint);
   xfree (sig_digest);
+  stats_update (start);
 
   return rc;
 }
@@ -3494,6 +3792,7 @@ tofu_register_encryption (ctrl_t ctrl,
   strlist_t user_id;
   char *sqlerr = NULL;
   int in_batch = 0;
+  unsigned long long start;
 
   dbs = opendbs (ctrl);
   if (! dbs)
@@ -3504,6 +3803,10 @@ tofu_register_encryption (ctrl_t ctrl,
       return rc;
     }
 
+  start = stats_clock ();
+  tofu_stats.encryptions++;
+  auto_batch_update (ctrl);
+
   if (/* We need the key block to find the primary key.  */
       ! pk_is_primary (pk)
       /* We need the key block to find all user ids.  */
@@ -3618,6 +3921,7 @@ tofu_register_encryption (ctrl_t ctrl,
   if (free_user_id_list)
     free_strlist (user_id_list);
   xfree (fingerprint);
+  stats_update (start);
 
   return rc;
 }
@@ -4030,8 +4334,51 @@ tofu_notice_key_changed (ctrl_t ctrl, kbnode_t kb)
                      GPGSQL_ARG_STRING, fingerprint,
                      GPGSQL_ARG_END);
   xfree (fingerprint);
+  policy_cache_clear (dbs);
 
   if (rc == _tofu_GET_POLICY_ERROR)
     return gpg_error (GPG_ERR_GENERAL);
   return 0;
 }
+
+
+/* Print the TOFU line of --list-config: the number of bindings, of
+ * recorded signatures and of recorded encryptions, the journal mode
+ * and the time in microseconds these queries took.  Nothing is
+ * printed if there is no TOFU database.  */
+void
+tofu_list_config (ctrl_t ctrl)
+{
+  char *filename;
+  tofu_dbs_t dbs;
+  unsigned long nbindings = 0, nsigs = 0, nencs = 0;
+  strlist_t mode = NULL;
+  unsigned long long start;
+  int exists;
+
+  filename = make_filename (gnupg_homedir (), "tofu.db", NULL);
+  exists = !access (filename, F_OK);
+  xfree (filename);
+  if (!exists)
+    return;
+
+  start = stats_clock ();
+  dbs = opendbs (ctrl);
+  if (!dbs)
+    return;
+
+  if (sqlite3_exec (dbs->db, "select count (*) from bindings;",
+                    get_single_unsigned_long_cb, &nbindings, NULL)
+      || sqlite3_exec (dbs->db, "select count (*) from signatures;",
+                       get_single_unsigned_long_cb, &nsigs, NULL)
+      || sqlite3_exec (dbs->db, "select count (*) from encryptions;",
+                       get_single_unsigned_long_cb, &nencs, NULL)
+      || sqlite3_exec (dbs->db, "pragma journal_mode;",
+                       strings_collect_cb, &mode, NULL))
+    log_error (_("error reading TOFU database: %s\n"),
+               sqlite3_errmsg (dbs->db));
+
+  es_printf ("cfg:tofu:%lu:%lu:%lu:%s:%llu:\n", nbindings, nsigs, nencs,
+             mode? mode->d : "", stats_clock () - start);
+  free_strlist (mode);
+}
@@ -134,6 +134,12 @@ void tofu_end_batch_update (ctrl_t ctrl);
 /* Release all of the resources associated with a DB meta-handle.  */
 void tofu_closedbs (ctrl_t ctrl);
 
+/* Commit the registrations not yet written to the DB.  */
+void tofu_flush_batch (void);
+
+/* Print the "tofu" line of --list-config.  */
+void tofu_list_config (ctrl_t ctrl);
+
 /* Whenever a key is modified (e.g., a user id is added or revoked, a
  * new signature, etc.), this function should be called to cause TOFU
  * to update its world view.  */
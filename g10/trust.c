@@ -304,6 +304,19 @@ revalidation_mark (ctrl_t ctrl)
 }
 
 
+/* Same as revalidation_mark but used if only the keyblock with the
+ * primary key PK has changed.  */
+void
+revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_revalidation_mark_key (ctrl, pk);
+#else
+  (void)pk;
+#endif
+}
+
+
 void
 check_trustdb_stale (ctrl_t ctrl)
 {
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifndef DISABLE_REGEX
 #include <sys/types.h>
@@ -38,6 +39,8 @@
 #include "main.h"
 #include "../common/mbox-util.h"
 #include "../common/i18n.h"
+#include "../common/host2net.h"
+#include "../common/exechelp.h"
 #include "tdbio.h"
 #include "trustdb.h"
 #include "tofu.h"
@@ -103,6 +106,10 @@ release_key_items (struct key_item *k)
 
 #define KEY_HASH_TABLE_SIZE 1024
 
+/* The number of keyblocks whose certifications are checked together
+ * with --sig-check-threads.  */
+#define VALIDATE_BATCH_SIZE 64
+
 /*
  * For fast keylook up we need a hash table.  Each byte of a KeyID
  * should be distributed equally over the 256 possible values (except
@@ -181,6 +188,646 @@ release_key_array ( struct key_array *keys )
     }
 }
 
+
+/*********************************************
+ **********  Validation state  ***************
+ *********************************************/
+
+/* To avoid a walk of the entire web of trust after only a few keys
+ * have changed, the result of the last walk is kept in a file next
+ * to the trustdb.  It records the parameters of the walk, the
+ * ultimately trusted keys, for each depth the keys used as
+ * introducers along with their effective trust values, and all
+ * certification edges between keys.  Changed keys are appended to
+ * the file by tdb_revalidation_mark_key.  The next check then only
+ * needs to revalidate the keys reachable from the changed keys;
+ * validity and introducers of all other keys can't have changed.
+ * Anything else requiring a revalidation (for example a changed
+ * ownertrust) removes the file and thus forces a complete walk.
+ *
+ * The file format is:
+ *
+ *   - b4   Magic 'gWoT'
+ *   - byte Version number (1)
+ *   - byte Trust model
+ *   - byte Max cert depth
+ *   - byte RFU
+ *   - u16  Completes needed
+ *   - u16  Marginals needed
+ *   - u32  Time of the next expiration or 0xffffffff
+ *   - u32  Number of ultimately trusted keys
+ *   - u32  Number of introducers
+ *   - u32  Number of certification edges
+ *   - u32  RFU
+ *   - For each ultimately trusted key:
+ *     - b8   Key ID
+ *   - For each introducer:
+ *     - b8   Key ID
+ *     - byte Depth at which the key is an introducer
+ *     - byte Ownertrust
+ *     - byte Minimum ownertrust
+ *     - byte Trust depth
+ *     - byte Trust value
+ *     - byte RFU
+ *     - u16  Length of the trust regexp
+ *     - bN   Trust regexp
+ *   - For each edge:
+ *     - b8   Key ID of the signer
+ *     - b8   Key ID of the signed key
+ *   - Any number of change records:
+ *     - byte 'C'
+ *     - b8   Key ID of the changed primary key
+ *
+ * All integers are stored in network byte order.
+ */
+
+#define WOT_STATE_MAGIC   "gWoT"
+#define WOT_STATE_VERSION 1
+#define WOT_STATE_HDRLEN  32
+#define WOT_STATE_SUFFIX  ".wot"
+
+struct wot_edge
+{
+  u32 signer[2];
+  u32 signee[2];
+};
+
+struct wot_intro
+{
+  u32 kid[2];
+  byte depth;
+  byte ownertrust;
+  byte min_ownertrust;
+  byte trust_depth;
+  byte trust_value;
+  char *trust_regexp;
+};
+
+struct wot_state
+{
+  u32 next_expire;
+  u32 *utks;                 /* NUTKS key IDs.  */
+  size_t nutks;
+  struct wot_intro *intros;
+  size_t nintros, maxintros;
+  struct wot_edge *edges;
+  size_t nedges, maxedges;
+  u32 *changed;              /* NCHANGED key IDs.  */
+  size_t nchanged, maxchanged;
+};
+typedef struct wot_state *wot_state_t;
+
+
+/* Set while validate_keys is running.  */
+static int validation_active;
+
+
+static char *
+wot_state_fname (void)
+{
+  return xstrconcat (tdbio_get_dbname (), WOT_STATE_SUFFIX, NULL);
+}
+
+
+static void
+release_wot_state (wot_state_t st)
+{
+  size_t n;
+
+  if (!st)
+    return;
+  xfree (st->utks);
+  for (n=0; n < st->nintros; n++)
+    xfree (st->intros[n].trust_regexp);
+  xfree (st->intros);
+  xfree (st->edges);
+  xfree (st->changed);
+  xfree (st);
+}
+
+
+static void
+wot_add_edge (wot_state_t st, u32 *signer, u32 *signee)
+{
+  if (st->nedges == st->maxedges)
+    {
+      st->maxedges += 4096;
+      st->edges = xrealloc (st->edges, st->maxedges * sizeof *st->edges);
+    }
+  st->edges[st->nedges].signer[0] = signer[0];
+  st->edges[st->nedges].signer[1] = signer[1];
+  st->edges[st->nedges].signee[0] = signee[0];
+  st->edges[st->nedges].signee[1] = signee[1];
+  st->nedges++;
+}
+
+
+/* Record the certification edges into KEYBLOCK.  */
+static void
+wot_add_keyblock_edges (wot_state_t st, kbnode_t keyblock)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 kid[2];
+  size_t first, n;
+  int in_uid = 0;
+
+  keyid_from_pk (keyblock->pkt->pkt.public_key, kid);
+  first = st->nedges;
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        in_uid = 1;
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        break;
+      else if (in_uid && node->pkt->pkttype == PKT_SIGNATURE)
+        {
+          sig = node->pkt->pkt.signature;
+          if (!IS_UID_SIG (sig)
+              || (sig->keyid[0] == kid[0] && sig->keyid[1] == kid[1]))
+            continue;
+          for (n = first; n < st->nedges; n++)
+            if (st->edges[n].signer[0] == sig->keyid[0]
+                && st->edges[n].signer[1] == sig->keyid[1])
+              break;
+          if (n == st->nedges)
+            wot_add_edge (st, sig->keyid, kid);
+        }
+    }
+}
+
+
+/* Record K as an introducer at DEPTH with the minimum ownertrust
+ * MIN.  */
+static void
+wot_add_intro (wot_state_t st, struct key_item *k, int depth, int min)
+{
+  struct wot_intro *intro;
+
+  if (st->nintros == st->maxintros)
+    {
+      st->maxintros += 256;
+      st->intros = xrealloc (st->intros, st->maxintros * sizeof *st->intros);
+    }
+  intro = st->intros + st->nintros++;
+  intro->kid[0] = k->kid[0];
+  intro->kid[1] = k->kid[1];
+  intro->depth = depth;
+  intro->ownertrust = k->ownertrust;
+  intro->min_ownertrust = min;
+  intro->trust_depth = k->trust_depth;
+  intro->trust_value = k->trust_value;
+  intro->trust_regexp = k->trust_regexp? xstrdup (k->trust_regexp) : NULL;
+}
+
+
+/* Prepend the introducers for DEPTH from ST which are not in the hash
+ * table SKIP to KLIST and return the new list.  */
+static struct key_item *
+wot_prepend_intros (wot_state_t st, int depth, KeyHashTable skip,
+                    struct key_item *klist)
+{
+  struct wot_intro *intro;
+  struct key_item *k;
+  size_t n;
+
+  for (n=0; n < st->nintros; n++)
+    {
+      intro = st->intros + n;
+      if (intro->depth != depth || test_key_hash_table (skip, intro->kid))
+        continue;
+      k = new_key_item ();
+      k->kid[0] = intro->kid[0];
+      k->kid[1] = intro->kid[1];
+      k->ownertrust = intro->ownertrust;
+      k->min_ownertrust = intro->min_ownertrust;
+      k->trust_depth = intro->trust_depth;
+      k->trust_value = intro->trust_value;
+      if (intro->trust_regexp)
+        k->trust_regexp = xstrdup (intro->trust_regexp);
+      k->next = klist;
+      klist = k;
+    }
+  return klist;
+}
+
+
+/* Return a new state object for the current walk.  */
+static wot_state_t
+new_wot_state (void)
+{
+  wot_state_t st;
+  struct key_item *k;
+  size_t n;
+
+  st = xmalloc_clear (sizeof *st);
+  for (n=0, k=utk_list; k; k = k->next)
+    n++;
+  st->utks = xmalloc ((n? n:1) * 2 * sizeof *st->utks);
+  for (k=utk_list; k; k = k->next, st->nutks++)
+    {
+      st->utks[2*st->nutks]   = k->kid[0];
+      st->utks[2*st->nutks+1] = k->kid[1];
+    }
+  return st;
+}
+
+
+static gpg_error_t
+wot_read_kid (estream_t fp, u32 *kid)
+{
+  byte buf[8];
+  size_t nread;
+
+  if (es_read (fp, buf, 8, &nread) || nread != 8)
+    return gpg_error (GPG_ERR_INV_OBJ);
+  kid[0] = buf32_to_u32 (buf);
+  kid[1] = buf32_to_u32 (buf+4);
+  return 0;
+}
+
+
+/* Read the state file.  Returns an error if it does not exist, is
+ * corrupt, or does not match the current parameters.  */
+static gpg_error_t
+read_wot_state (wot_state_t *r_st)
+{
+  gpg_error_t err;
+  char *fname;
+  estream_t fp;
+  wot_state_t st = NULL;
+  byte hdr[WOT_STATE_HDRLEN];
+  byte buf[8];
+  size_t n, nread, nintros, nedges;
+  struct wot_intro *intro;
+
+  *r_st = NULL;
+  fname = wot_state_fname ();
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  err = gpg_error (GPG_ERR_INV_OBJ);
+  if (es_read (fp, hdr, sizeof hdr, &nread) || nread != sizeof hdr
+      || memcmp (hdr, WOT_STATE_MAGIC, 4) || hdr[4] != WOT_STATE_VERSION)
+    goto leave;
+  if (hdr[5] != opt.trust_model || hdr[6] != opt.max_cert_depth
+      || buf16_to_uint (hdr+8) != opt.completes_needed
+      || buf16_to_uint (hdr+10) != opt.marginals_needed)
+    {
+      err = gpg_error (GPG_ERR_FALSE);
+      goto leave;
+    }
+
+  st = xmalloc_clear (sizeof *st);
+  st->next_expire = buf32_to_u32 (hdr+12);
+  st->nutks = buf32_to_size_t (hdr+16);
+  nintros = buf32_to_size_t (hdr+20);
+  nedges = buf32_to_size_t (hdr+24);
+  if (st->nutks > 0x10000 || nintros > 0x1000000 || nedges > 0x10000000)
+    goto leave;
+
+  st->utks = xtrymalloc ((st->nutks? st->nutks:1) * 2 * sizeof *st->utks);
+  st->intros = xtrycalloc (nintros? nintros:1, sizeof *st->intros);
+  st->edges = xtrymalloc ((nedges? nedges:1) * sizeof *st->edges);
+  if (!st->utks || !st->intros || !st->edges)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  st->maxintros = nintros? nintros:1;
+  st->maxedges = nedges? nedges:1;
+
+  for (n=0; n < st->nutks; n++)
+    if (wot_read_kid (fp, st->utks + 2*n))
+      goto leave;
+
+  for (; st->nintros < nintros; st->nintros++)
+    {
+      intro = st->intros + st->nintros;
+      if (wot_read_kid (fp, intro->kid)
+          || es_read (fp, buf, 8, &nread) || nread != 8)
+        goto leave;
+      intro->depth = buf[0];
+      intro->ownertrust = buf[1];
+      intro->min_ownertrust = buf[2];
+      intro->trust_depth = buf[3];
+      intro->trust_value = buf[4];
+      n = buf16_to_uint (buf+6);
+      if (n)
+        {
+          intro->trust_regexp = xtrymalloc (n+1);
+          if (!intro->trust_regexp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          if (es_read (fp, intro->trust_regexp, n, &nread) || nread != n)
+            goto leave;
+          intro->trust_regexp[n] = 0;
+        }
+    }
+
+  for (; st->nedges < nedges; st->nedges++)
+    if (wot_read_kid (fp, st->edges[st->nedges].signer)
+        || wot_read_kid (fp, st->edges[st->nedges].signee))
+      goto leave;
+
+  /* The change records.  A truncated last record is ignored.  */
+  while (!es_read (fp, buf, 1, &nread) && nread == 1)
+    {
+      if (*buf != 'C')
+        goto leave;
+      if (st->nchanged == st->maxchanged)
+        {
+          st->maxchanged += 64;
+          st->changed = xrealloc (st->changed,
+                                  st->maxchanged * 2 * sizeof *st->changed);
+        }
+      if (wot_read_kid (fp, st->changed + 2*st->nchanged))
+        break;
+      st->nchanged++;
+    }
+
+  *r_st = st;
+  st = NULL;
+  err = 0;
+
+ leave:
+  if (err && gpg_err_code (err) != GPG_ERR_ENOENT && DBG_TRUST)
+    log_debug ("can't use validation state '%s': %s\n",
+               fname, gpg_strerror (err));
+  release_wot_state (st);
+  es_fclose (fp);
+  xfree (fname);
+  return err;
+}
+
+
+static void
+wot_put_u32 (byte *p, u32 a)
+{
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >>  8;
+  p[3] = a;
+}
+
+
+static int
+wot_write_kid (estream_t fp, const u32 *kid)
+{
+  byte buf[8];
+
+  wot_put_u32 (buf, kid[0]);
+  wot_put_u32 (buf+4, kid[1]);
+  return es_fwrite (buf, 8, 1, fp) != 1;
+}
+
+
+/* Write the state ST to the state file.  */
+static gpg_error_t
+write_wot_state (wot_state_t st)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname;
+  estream_t fp;
+  byte hdr[WOT_STATE_HDRLEN];
+  byte buf[8];
+  struct wot_intro *intro;
+  size_t n, len;
+  int failed = 0;
+
+  fname = wot_state_fname ();
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpfname, "wb,mode=-rw-------");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, WOT_STATE_MAGIC, 4);
+  hdr[4] = WOT_STATE_VERSION;
+  hdr[5] = opt.trust_model;
+  hdr[6] = opt.max_cert_depth;
+  hdr[8] = opt.completes_needed >> 8;
+  hdr[9] = opt.completes_needed;
+  hdr[10] = opt.marginals_needed >> 8;
+  hdr[11] = opt.marginals_needed;
+  wot_put_u32 (hdr+12, st->next_expire);
+  wot_put_u32 (hdr+16, st->nutks);
+  wot_put_u32 (hdr+20, st->nintros);
+  wot_put_u32 (hdr+24, st->nedges);
+  failed |= es_fwrite (hdr, sizeof hdr, 1, fp) != 1;
+
+  for (n=0; n < st->nutks; n++)
+    failed |= wot_write_kid (fp, st->utks + 2*n);
+
+  for (n=0; n < st->nintros; n++)
+    {
+      intro = st->intros + n;
+      len = intro->trust_regexp? strlen (intro->trust_regexp) : 0;
+      if (len > 0xffff)
+        len = 0xffff;
+      failed |= wot_write_kid (fp, intro->kid);
+      buf[0] = intro->depth;
+      buf[1] = intro->ownertrust;
+      buf[2] = intro->min_ownertrust;
+      buf[3] = intro->trust_depth;
+      buf[4] = intro->trust_value;
+      buf[5] = 0;
+      buf[6] = len >> 8;
+      buf[7] = len;
+      failed |= es_fwrite (buf, 8, 1, fp) != 1;
+      if (len)
+        failed |= es_fwrite (intro->trust_regexp, len, 1, fp) != 1;
+    }
+
+  for (n=0; n < st->nedges; n++)
+    {
+      failed |= wot_write_kid (fp, st->edges[n].signer);
+      failed |= wot_write_kid (fp, st->edges[n].signee);
+    }
+
+  if (failed)
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  if (err)
+    log_info (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (fname);
+  return err;
+}
+
+
+/* Remove the state file so that the next check does a full walk.  */
+static void
+remove_wot_state (void)
+{
+  char *fname;
+
+  fname = wot_state_fname ();
+  if (gnupg_remove (fname) && errno != ENOENT)
+    log_info (_("can't remove '%s': %s\n"),
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  xfree (fname);
+}
+
+
+/* Append a change record for the key KID to an existing state
+ * file.  */
+static void
+wot_note_change (u32 *kid)
+{
+  char *fname;
+  estream_t fp;
+  byte rec[9];
+
+  fname = wot_state_fname ();
+  if (access (fname, F_OK))
+    {
+      xfree (fname);
+      return;  /* No state - the next check is a complete walk.  */
+    }
+
+  /* Unbuffered so that the record is appended with one write.  */
+  rec[0] = 'C';
+  wot_put_u32 (rec+1, kid[0]);
+  wot_put_u32 (rec+5, kid[1]);
+  fp = es_fopen (fname, "ab,mode=-rw-------");
+  if (!fp || es_setvbuf (fp, NULL, _IONBF, 0)
+      || es_fwrite (rec, sizeof rec, 1, fp) != 1)
+    {
+      log_info (_("error writing '%s': %s\n"),
+                fname, gpg_strerror (gpg_error_from_syserror ()));
+      es_fclose (fp);
+      remove_wot_state ();
+    }
+  else if (es_fclose (fp))
+    remove_wot_state ();
+  xfree (fname);
+}
+
+
+/* Return true if the state ST may be used for an incremental check
+ * at CURTIME.  */
+static int
+wot_state_usable (wot_state_t st, u32 curtime)
+{
+  struct key_item *k;
+  size_t n, nutks;
+
+  if (!st->nchanged)
+    return 0;  /* Probably a scheduled check.  */
+  if (st->next_expire <= curtime)
+    return 0;  /* Some validities may have expired.  */
+
+  for (nutks=0, k=utk_list; k; k = k->next, nutks++)
+    {
+      for (n=0; n < st->nutks; n++)
+        if (st->utks[2*n] == k->kid[0] && st->utks[2*n+1] == k->kid[1])
+          break;
+      if (n == st->nutks)
+        return 0;
+    }
+  return nutks == st->nutks;
+}
+
+
+static int
+cmp_wot_edge (const void *a_arg, const void *b_arg)
+{
+  const struct wot_edge *a = a_arg;
+  const struct wot_edge *b = b_arg;
+
+  if (a->signer[0] != b->signer[0])
+    return a->signer[0] < b->signer[0]? -1 : 1;
+  if (a->signer[1] != b->signer[1])
+    return a->signer[1] < b->signer[1]? -1 : 1;
+  return 0;
+}
+
+
+/* Return all keys reachable from the changed keys of ST via
+ * certification edges as an array of key IDs and store their number
+ * at R_NKIDS.  The keys are also added to DOWNSTREAM.  */
+static u32 *
+wot_downstream_keys (wot_state_t st, KeyHashTable downstream,
+                     size_t *r_nkids)
+{
+  struct wot_edge key, *e, *end;
+  u32 *kids;
+  size_t nkids, maxkids, n, lo, hi, mid;
+
+  qsort (st->edges, st->nedges, sizeof *st->edges, cmp_wot_edge);
+
+  maxkids = st->nchanged + 64;
+  kids = xmalloc (maxkids * 2 * sizeof *kids);
+  nkids = 0;
+  for (n=0; n < st->nchanged; n++)
+    if (!test_key_hash_table (downstream, st->changed + 2*n))
+      {
+        add_key_hash_table (downstream, st->changed + 2*n);
+        kids[2*nkids]   = st->changed[2*n];
+        kids[2*nkids+1] = st->changed[2*n+1];
+        nkids++;
+      }
+
+  /* Breadth first; KIDS is also the queue.  */
+  end = st->edges + st->nedges;
+  for (n=0; n < nkids; n++)
+    {
+      key.signer[0] = kids[2*n];
+      key.signer[1] = kids[2*n+1];
+      for (lo=0, hi=st->nedges; lo < hi; )
+        {
+          mid = lo + (hi - lo) / 2;
+          if (cmp_wot_edge (st->edges + mid, &key) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (e = st->edges + lo; e < end && !cmp_wot_edge (e, &key); e++)
+        {
+          if (test_key_hash_table (downstream, e->signee))
+            continue;
+          add_key_hash_table (downstream, e->signee);
+          if (nkids == maxkids)
+            {
+              maxkids += 1024;
+              kids = xrealloc (kids, maxkids * 2 * sizeof *kids);
+            }
+          kids[2*nkids]   = e->signee[0];
+          kids[2*nkids+1] = e->signee[1];
+          nkids++;
+        }
+    }
+
+  *r_nkids = nkids;
+  return kids;
+}
+
 
 /*********************************************
  **********  Initialization  *****************
@@ -585,6 +1232,10 @@ tdb_revalidation_mark (ctrl_t ctrl)
   if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
     return;
 
+  /* Changes while validating are part of the validation.  */
+  if (!validation_active)
+    remove_wot_state ();
+
   /* We simply set the time for the next check to 1 (far back in 1970)
      so that a --update-trustdb will be scheduled.  */
   if (tdbio_write_nextcheck (ctrl, 1))
@@ -592,12 +1243,75 @@ tdb_revalidation_mark (ctrl_t ctrl)
   pending_check_trustdb = 1;
 }
 
+
+/* Same as tdb_revalidation_mark but used if only the keyblock of the
+ * primary key PK has changed.  This allows the next check to
+ * revalidate only the keys depending on PK.  */
+void
+tdb_revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+  u32 kid[2];
+
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
+    return;
+
+  keyid_from_pk (pk, kid);
+  wot_note_change (kid);
+
+  if (tdbio_write_nextcheck (ctrl, 1))
+    do_sync ();
+  pending_check_trustdb = 1;
+}
+
 int
 trustdb_pending_check(void)
 {
   return pending_check_trustdb;
 }
 
+
+/* Start a detached gpg process to check the trustdb.  This is used
+ * with --background-check-trustdb instead of checking the trustdb in
+ * this process.  Several revalidation marks in one run thus lead to
+ * only one check and the spawned process does nothing if another one
+ * has already updated the trustdb.  */
+static void
+spawn_trustdb_check (void)
+{
+  static int spawned;
+  const char *argv[10];
+  int i = 0;
+  gpg_error_t err;
+
+  if (spawned)
+    return;
+  spawned = 1;
+
+  argv[i++] = "--batch";
+  argv[i++] = "--quiet";
+  argv[i++] = "--homedir";
+  argv[i++] = gnupg_homedir ();
+  if (trustdb_args.dbname)
+    {
+      argv[i++] = "--trustdb-name";
+      argv[i++] = trustdb_args.dbname;
+    }
+  argv[i++] = "--trust-model";
+  argv[i++] = trust_model_string (opt.trust_model);
+  argv[i++] = "--check-trustdb";
+  argv[i] = NULL;
+
+  err = gnupg_spawn_process_detached (gnupg_module_name
+                                      (GNUPG_MODULE_NAME_GPG),
+                                      argv, NULL);
+  if (err)
+    log_error ("error starting the trustdb check: %s\n", gpg_strerror (err));
+  else if (opt.verbose)
+    log_info ("checking the trustdb in the background\n");
+}
+
+
 /* If the trustdb is dirty, and we're interactive, update it.
    Otherwise, check it unless no-auto-check-trustdb is set. */
 void
@@ -607,7 +1321,11 @@ tdb_check_or_update (ctrl_t ctrl)
     {
       if (opt.interactive)
 	update_trustdb (ctrl);
-      else if (!opt.no_auto_check_trustdb)
+      else if (opt.no_auto_check_trustdb)
+        ;
+      else if (opt.background_check_trustdb)
+        spawn_trustdb_check ();
+      else
 	check_trustdb (ctrl);
     }
 }
@@ -1020,6 +1738,11 @@ tdb_check_trustdb_stale (ctrl_t ctrl)
               if (!opt.quiet)
                 log_info (_("please do a --check-trustdb\n"));
             }
+          else if (opt.background_check_trustdb)
+            {
+              pending_check_trustdb = 1;
+              spawn_trustdb_check ();
+            }
           else
             {
               if (!opt.quiet)
@@ -1803,26 +2526,179 @@ search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
 }
 
 
+/*
+ * Helper for validate_key_list and validate_key_ids to process the
+ * public keyblock KEYBLOCK which has already been prepared by
+ * merge_keys_and_selfsig.  If it is signed by keys from KLIST it is
+ * appended to the array KEYS with NKEYS used and MAXKEYS allocated
+ * items, and true is returned; the caller must then not release
+ * KEYBLOCK.
+ */
+static int
+validate_key_list_item (ctrl_t ctrl, kbnode_t keyblock,
+                        KeyHashTable full_trust, struct key_item *klist,
+                        u32 curtime, u32 *next_expire,
+                        struct key_array **keys,
+                        size_t *nkeys, size_t *maxkeys)
+{
+  PKT_public_key *pk;
+  KBNODE node;
+
+  clear_kbnode_flags (keyblock);
+  pk = keyblock->pkt->pkt.public_key;
+  if (pk->has_expired || pk->flags.revoked)
+    {
+      /* it does not make sense to look further at those keys */
+      mark_keyblock_seen (full_trust, keyblock);
+      return 0;
+    }
+
+  if (!validate_one_keyblock (ctrl, keyblock, klist, curtime, next_expire))
+    return 0;
+
+  if (pk->expiredate && pk->expiredate >= curtime
+      && pk->expiredate < *next_expire)
+    *next_expire = pk->expiredate;
+
+  if (*nkeys == *maxkeys)
+    {
+      *maxkeys += 1000;
+      *keys = xrealloc (*keys, (*maxkeys+1) * sizeof **keys);
+    }
+  (*keys)[(*nkeys)++].keyblock = keyblock;
+
+  /* Optimization - if all uids are fully trusted, then we
+     never need to consider this key as a candidate again. */
+
+  for (node=keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+      break;
+
+  if(node==NULL)
+    mark_keyblock_seen (full_trust, keyblock);
+
+  return 1;
+}
+
+
+/*
+ * Check the certifications on the NBATCH keyblocks in BATCH which
+ * validate_one_keyblock will look at using --sig-check-threads
+ * threads.  The results end up in the signature cache flags and are
+ * thus picked up by the regular signature checks.
+ */
+static void
+precheck_certifications (ctrl_t ctrl, kbnode_t *batch, int nbatch,
+                         struct key_item *klist)
+{
+  KBNODE node;
+  PKT_public_key *pk;
+  PKT_signature *sig;
+  u32 main_kid[2];
+  int i, usable_uid;
+
+  sig_check_defer_begin ();
+  for (i=0; i < nbatch; i++)
+    {
+      pk = batch[i]->pkt->pkt.public_key;
+      if (pk->has_expired || pk->flags.revoked)
+        continue;
+      keyid_from_pk (pk, main_kid);
+      usable_uid = 0;
+      for (node=batch[i]->next; node; node = node->next)
+        {
+          if (node->pkt->pkttype == PKT_USER_ID)
+            usable_uid = (!node->pkt->pkt.user_id->flags.revoked
+                          && !node->pkt->pkt.user_id->flags.expired);
+          else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            break;
+          else if (usable_uid && node->pkt->pkttype == PKT_SIGNATURE)
+            {
+              /* Same selection as in mark_usable_uid_certs.  */
+              sig = node->pkt->pkt.signature;
+              if (sig->flags.checked
+                  || (sig->keyid[0] == main_kid[0]
+                      && sig->keyid[1] == main_kid[1])
+                  || (!IS_UID_SIG (sig) && !IS_UID_REV (sig))
+                  || (sig->sig_class >= 0x11 && sig->sig_class <= 0x13
+                      && sig->sig_class - 0x10 < opt.min_cert_level)
+                  || !is_in_klist (klist, sig))
+                continue;
+              check_key_signature (ctrl, batch[i], node, NULL);
+            }
+        }
+    }
+  sig_check_defer_end (opt.sig_check_threads);
+}
+
+
+/*
+ * Process the NBATCH keyblocks in BATCH in order using
+ * validate_key_list_item and release those not taken.  Keyblocks
+ * which have been marked in FULL_TRUST in the meantime are skipped,
+ * as they would have been by the search.
+ */
+static void
+validate_key_batch (ctrl_t ctrl, kbnode_t *batch, int nbatch,
+                    KeyHashTable full_trust, struct key_item *klist,
+                    u32 curtime, u32 *next_expire, struct key_array **keys,
+                    size_t *nkeys, size_t *maxkeys)
+{
+  u32 kid[2];
+  int i;
+
+  if (nbatch > 1)
+    precheck_certifications (ctrl, batch, nbatch, klist);
+
+  for (i=0; i < nbatch; i++)
+    {
+      keyid_from_pk (batch[i]->pkt->pkt.public_key, kid);
+      if (test_key_hash_table (full_trust, kid)
+          || !validate_key_list_item (ctrl, batch[i], full_trust, klist,
+                                      curtime, next_expire,
+                                      keys, nkeys, maxkeys))
+        release_kbnode (batch[i]);
+      batch[i] = NULL;
+    }
+}
+
+
+/* Return the number of keyblocks to process in one batch.  */
+static int
+validate_batch_size (void)
+{
+  if (opt.sig_check_threads < 1 || opt.no_sig_cache)
+    return 1;
+  return VALIDATE_BATCH_SIZE;
+}
+
+
 /*
  * Scan all keys and return a key_array of all suitable keys from
  * kllist.  The caller has to pass keydb handle so that we don't use
  * to create our own.  Returns either a key_array or NULL in case of
  * an error.  No results found are indicated by an empty array.
- * Caller hast to release the returned array.
+ * Caller hast to release the returned array.  If EDGES is not NULL
+ * the certification edges of all scanned keys are recorded there.
  */
 static struct key_array *
 validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
-                   struct key_item *klist, u32 curtime, u32 *next_expire)
+                   struct key_item *klist, u32 curtime, u32 *next_expire,
+                   wot_state_t edges)
 {
   KBNODE keyblock = NULL;
   struct key_array *keys = NULL;
   size_t nkeys, maxkeys;
   int rc;
   KEYDB_SEARCH_DESC desc;
+  kbnode_t batch[VALIDATE_BATCH_SIZE];
+  int nbatch, batchsize;
 
   maxkeys = 1000;
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
   nkeys = 0;
+  nbatch = 0;
+  batchsize = validate_batch_size ();
 
   rc = keydb_search_reset (hd);
   if (rc)
@@ -1851,8 +2727,6 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
   do
     {
-      PKT_public_key *pk;
-
       rc = keydb_get_keyblock (hd, &keyblock);
       if (rc)
         {
@@ -1869,45 +2743,19 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
           continue;
         }
 
+      if (edges)
+        wot_add_keyblock_edges (edges, keyblock);
+
       /* prepare the keyblock for further processing */
       merge_keys_and_selfsig (ctrl, keyblock);
-      clear_kbnode_flags (keyblock);
-      pk = keyblock->pkt->pkt.public_key;
-      if (pk->has_expired || pk->flags.revoked)
+      batch[nbatch++] = keyblock;
+      keyblock = NULL;
+      if (nbatch == batchsize)
         {
-          /* it does not make sense to look further at those keys */
-          mark_keyblock_seen (full_trust, keyblock);
+          validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                              curtime, next_expire, &keys, &nkeys, &maxkeys);
+          nbatch = 0;
         }
-      else if (validate_one_keyblock (ctrl, keyblock, klist,
-                                      curtime, next_expire))
-        {
-	  KBNODE node;
-
-          if (pk->expiredate && pk->expiredate >= curtime
-              && pk->expiredate < *next_expire)
-            *next_expire = pk->expiredate;
-
-          if (nkeys == maxkeys) {
-            maxkeys += 1000;
-            keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
-          }
-          keys[nkeys++].keyblock = keyblock;
-
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
-
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
-
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
-
-          keyblock = NULL;
-        }
-
-      release_kbnode (keyblock);
-      keyblock = NULL;
     }
   while (!(rc = keydb_search (hd, &desc, 1, NULL)));
 
@@ -1917,15 +2765,184 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       goto die;
     }
 
+  validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                      curtime, next_expire, &keys, &nkeys, &maxkeys);
   keys[nkeys].keyblock = NULL;
   return keys;
 
  die:
+  while (nbatch)
+    release_kbnode (batch[--nbatch]);
   keys[nkeys].keyblock = NULL;
   release_key_array (keys);
   return NULL;
 }
 
+/*
+ * Return the next public keyblock with the primary key ID KID from HD
+ * at R_KEYBLOCK.  If FIRST is set the search is started anew.
+ * Returns GPG_ERR_NOT_FOUND if there are no more such keyblocks.
+ */
+static gpg_error_t
+next_keyblock_by_kid (KEYDB_HANDLE hd, u32 *kid, int first,
+                      kbnode_t *r_keyblock)
+{
+  gpg_error_t err;
+  KEYDB_SEARCH_DESC desc;
+  kbnode_t keyblock;
+  u32 pkid[2];
+
+  *r_keyblock = NULL;
+  if (first)
+    {
+      err = keydb_search_reset (hd);
+      if (err)
+        return err;
+    }
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+  desc.u.kid[0] = kid[0];
+  desc.u.kid[1] = kid[1];
+  for (;;)
+    {
+      err = keydb_search (hd, &desc, 1, NULL);
+      if (err)
+        return err;
+      err = keydb_get_keyblock (hd, &keyblock);
+      if (err)
+        return err;
+      if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+        {
+          /* The search may also have matched a subkey.  */
+          keyid_from_pk (keyblock->pkt->pkt.public_key, pkid);
+          if (pkid[0] == kid[0] && pkid[1] == kid[1])
+            {
+              *r_keyblock = keyblock;
+              return 0;
+            }
+        }
+      release_kbnode (keyblock);
+    }
+}
+
+
+/*
+ * Same as validate_key_list but only look at the NKIDS keys with the
+ * key IDs from the array KIDS.
+ */
+static struct key_array *
+validate_key_ids (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
+                  struct key_item *klist, u32 *kids, size_t nkids,
+                  u32 curtime, u32 *next_expire)
+{
+  gpg_error_t err;
+  KBNODE keyblock;
+  struct key_array *keys;
+  size_t nkeys, maxkeys, n;
+  kbnode_t batch[VALIDATE_BATCH_SIZE];
+  int nbatch, batchsize;
+
+  maxkeys = 1000;
+  keys = xmalloc ((maxkeys+1) * sizeof *keys);
+  nkeys = 0;
+  nbatch = 0;
+  batchsize = validate_batch_size ();
+
+  for (n=0; n < nkids; n++)
+    {
+      if (test_key_hash_table (full_trust, kids + 2*n))
+        continue;
+      for (err = next_keyblock_by_kid (hd, kids + 2*n, 1, &keyblock);
+           !err;
+           err = next_keyblock_by_kid (hd, kids + 2*n, 0, &keyblock))
+        {
+          merge_keys_and_selfsig (ctrl, keyblock);
+          batch[nbatch++] = keyblock;
+          if (nbatch == batchsize)
+            {
+              validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                                  curtime, next_expire,
+                                  &keys, &nkeys, &maxkeys);
+              nbatch = 0;
+            }
+        }
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        {
+          log_error ("keydb_search failed: %s\n", gpg_strerror (err));
+          while (nbatch)
+            release_kbnode (batch[--nbatch]);
+          keys[nkeys].keyblock = NULL;
+          release_key_array (keys);
+          return NULL;
+        }
+    }
+
+  validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                      curtime, next_expire, &keys, &nkeys, &maxkeys);
+  keys[nkeys].keyblock = NULL;
+  return keys;
+}
+
+
+/*
+ * Reset the trust records of the keys with the NKIDS key IDs from the
+ * array KIDS the same way reset_trust_records does for all keys.  The
+ * certification edges of keys found in the hash table CHANGED are
+ * added to ST.  Caller must sync.
+ */
+static gpg_error_t
+reset_key_trust_records (ctrl_t ctrl, KEYDB_HANDLE hd, u32 *kids, size_t nkids,
+                         KeyHashTable changed, wot_state_t st)
+{
+  gpg_error_t err;
+  KBNODE keyblock;
+  TRUSTREC trec, vrec;
+  ulong recno;
+  size_t n;
+
+  for (n=0; n < nkids; n++)
+    {
+      for (err = next_keyblock_by_kid (hd, kids + 2*n, 1, &keyblock);
+           !err;
+           err = next_keyblock_by_kid (hd, kids + 2*n, 0, &keyblock))
+        {
+          if (test_key_hash_table (changed, kids + 2*n))
+            wot_add_keyblock_edges (st, keyblock);
+
+          err = read_trust_record (ctrl, keyblock->pkt->pkt.public_key, &trec);
+          release_kbnode (keyblock);
+          if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+            continue;
+          if (err)
+            return err;
+
+          if (trec.r.trust.min_ownertrust)
+            {
+              trec.r.trust.min_ownertrust = 0;
+              write_record (ctrl, &trec);
+            }
+          for (recno = trec.r.trust.validlist; recno;
+               recno = vrec.r.valid.next)
+            {
+              read_record (recno, &vrec, RECTYPE_VALID);
+              if ((vrec.r.valid.validity & TRUST_MASK)
+                  || vrec.r.valid.marginal_count || vrec.r.valid.full_count)
+                {
+                  vrec.r.valid.validity &= ~TRUST_MASK;
+                  vrec.r.valid.marginal_count = vrec.r.valid.full_count = 0;
+                  write_record (ctrl, &vrec);
+                }
+            }
+        }
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        return err;
+    }
+
+  return 0;
+}
+
+
 /* Caller must sync */
 static void
 reset_trust_records (ctrl_t ctrl)
@@ -1993,6 +3010,12 @@ reset_trust_records (ctrl_t ctrl)
  *           End Loop
  *         Ready
  *
+ * If only some keyblocks have changed since the last run and the
+ * state of that run is available (see read_wot_state), Step 4 only
+ * looks at the changed keys and the keys reachable from them via
+ * certifications, and the klist of each depth is completed with the
+ * unaffected keys from the last run.  This yields the same result
+ * as a complete walk.
  */
 static int
 validate_keys (ctrl_t ctrl, int interactive)
@@ -2008,26 +3031,82 @@ validate_keys (ctrl_t ctrl, int interactive)
   int depth;
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
+  KeyHashTable changed = NULL, downstream = NULL;
+  wot_state_t wot = NULL;    /* The state of the last run.  */
+  wot_state_t newwot = NULL; /* The state of this run.  */
+  u32 *dkids = NULL;
+  size_t ndkids = 0;
+  size_t n;
   u32 start_time, next_expire;
 
-  /* Make sure we have all sigs cached.  TODO: This is going to
-     require some architectural re-thinking, as it is agonizingly slow.
-     Perhaps combine this with reset_trust_records(), or only check
-     the caches on keys that are actually involved in the web of
-     trust. */
-  keydb_rebuild_caches (ctrl, 0);
+  start_time = make_timestamp ();
+  next_expire = 0xffffffff; /* set next expire to the year 2106 */
 
   kdb = keydb_new (ctrl);
   if (!kdb)
     return gpg_error_from_syserror ();
 
-  start_time = make_timestamp ();
-  next_expire = 0xffffffff; /* set next expire to the year 2106 */
+  /* All updates of this run are committed at once.  */
+  rc = tdbio_begin_transaction ();
+  if (rc)
+    {
+      keydb_release (kdb);
+      return rc;
+    }
+
+  if (!interactive && utk_list
+      && opt.trust_model != TM_TOFU
+      && !read_wot_state (&wot)
+      && !wot_state_usable (wot, start_time))
+    {
+      release_wot_state (wot);
+      wot = NULL;
+    }
+
+  if (wot)
+    {
+      changed = new_key_hash_table ();
+      for (n=0; n < wot->nchanged; n++)
+        add_key_hash_table (changed, wot->changed + 2*n);
+      downstream = new_key_hash_table ();
+      dkids = wot_downstream_keys (wot, downstream, &ndkids);
+      next_expire = wot->next_expire;
+      if (!opt.quiet)
+        log_info (_("revalidating %lu keys\n"), (ulong)ndkids);
+    }
+  else
+    {
+      /* Make sure we have all sigs cached.  TODO: This is going to
+         require some architectural re-thinking, as it is agonizingly
+         slow.  Perhaps combine this with reset_trust_records(), or
+         only check the caches on keys that are actually involved in
+         the web of trust. */
+      keydb_rebuild_caches (ctrl, 0);
+    }
+
+  validation_active = 1;
   stored = new_key_hash_table ();
   used = new_key_hash_table ();
   full_trust = new_key_hash_table ();
 
-  reset_trust_records (ctrl);
+  if (wot)
+    {
+      /* Keep the edges into unchanged keys; the edges into the
+       * changed keys are read again.  */
+      newwot = new_wot_state ();
+      for (n=0; n < wot->nedges; n++)
+        if (!test_key_hash_table (changed, wot->edges[n].signee))
+          wot_add_edge (newwot, wot->edges[n].signer, wot->edges[n].signee);
+      rc = reset_key_trust_records (ctrl, kdb, dkids, ndkids, changed, newwot);
+      if (rc)
+        {
+          log_error ("resetting the trust records failed: %s\n",
+                     gpg_strerror (rc));
+          goto leave;
+        }
+    }
+  else
+    reset_trust_records (ctrl);
 
   /* Fixme: Instead of always building a UTK list, we could just build it
    * here when needed */
@@ -2076,6 +3155,8 @@ validate_keys (ctrl_t ctrl, int interactive)
     goto leave;
 
   klist = utk_list;
+  if (!newwot)
+    newwot = new_wot_state ();
 
   if (!opt.quiet)
     log_info ("marginals needed: %d  completes needed: %d  trust model: %s\n",
@@ -2143,11 +3224,19 @@ validate_keys (ctrl_t ctrl, int interactive)
             ot_ultimate++;
 
 	  valids++;
+
+          if (depth)
+            wot_add_intro (newwot, k, depth, min);
         }
 
       /* Find all keys which are signed by a key in kdlist */
-      keys = validate_key_list (ctrl, kdb, full_trust, klist,
-				start_time, &next_expire);
+      if (wot)
+        keys = validate_key_ids (ctrl, kdb, full_trust, klist,
+                                 dkids, ndkids, start_time, &next_expire);
+      else
+        keys = validate_key_list (ctrl, kdb, full_trust, klist,
+                                  start_time, &next_expire,
+                                  depth? NULL : newwot);
       if (!keys)
         {
           log_error ("validate_key_list failed\n");
@@ -2218,11 +3307,15 @@ validate_keys (ctrl_t ctrl, int interactive)
 	}
       release_key_array (keys);
       keys = NULL;
+      /* Add the unaffected keys of the last run.  */
+      if (wot)
+        klist = wot_prepend_intros (wot, depth+1, downstream, klist);
       if (!klist)
         break; /* no need to dive in deeper */
     }
 
  leave:
+  validation_active = 0;
   keydb_release (kdb);
   release_key_array (keys);
   if (klist != utk_list)
@@ -2230,6 +3323,10 @@ validate_keys (ctrl_t ctrl, int interactive)
   release_key_hash_table (full_trust);
   release_key_hash_table (used);
   release_key_hash_table (stored);
+  release_key_hash_table (changed);
+  release_key_hash_table (downstream);
+  xfree (dkids);
+  release_wot_state (wot);
   if (!rc && !quit) /* mark trustDB as checked */
     {
       int rc2;
@@ -2253,8 +3350,29 @@ validate_keys (ctrl_t ctrl, int interactive)
 	}
 
       do_sync ();
-      pending_check_trustdb = 0;
+      rc = tdbio_end_transaction ();
+      if (!rc)
+        {
+          pending_check_trustdb = 0;
+          if (newwot)
+            {
+              newwot->next_expire = next_expire;
+              write_wot_state (newwot);
+            }
+          else
+            remove_wot_state ();
+        }
     }
+  else if (quit)
+    {
+      /* Keep the ownertrust values entered so far.  */
+      tdbio_end_transaction ();
+    }
+  else
+    tdbio_cancel_transaction ();
+  if (rc || quit)
+    remove_wot_state ();
+  release_wot_state (newwot);
 
   return rc;
 }
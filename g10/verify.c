@@ -183,6 +183,81 @@ verify_one_file (ctrl_t ctrl, const char *name )
     return rc;
 }
 
+/* Verify the detached signature in the file SIGFILE over the data
+ * files DATAFILES.  */
+static int
+verify_one_detached (ctrl_t ctrl, const char *sigfile, strlist_t datafiles)
+{
+    IOBUF fp;
+    armor_filter_context_t *afx = NULL;
+    progress_filter_context_t *pfx = new_progress_context ();
+    int rc;
+
+    print_file_status( STATUS_FILE_START, sigfile, 1 );
+    fp = iobuf_open(sigfile);
+    if (fp && is_secured_file (iobuf_get_fd (fp)))
+      {
+        iobuf_close (fp);
+        fp = NULL;
+        gpg_err_set_errno (EPERM);
+      }
+    if( !fp ) {
+        rc = gpg_error_from_syserror ();
+	log_error(_("can't open '%s': %s\n"),
+                  print_fname_stdin(sigfile), gpg_strerror (rc));
+	print_file_status( STATUS_FILE_ERROR, sigfile, 1 );
+        goto leave;
+    }
+    handle_progress (pfx, fp, sigfile);
+
+    if( !opt.no_armor && use_armor_filter( fp ) ) {
+        afx = new_armor_context ();
+        push_armor_filter (afx, fp);
+    }
+
+    rc = proc_signature_packets (ctrl, NULL, fp, datafiles, sigfile );
+    iobuf_close(fp);
+    write_status( STATUS_FILE_DONE );
+
+    reset_literals_seen();
+
+ leave:
+    release_armor_context (afx);
+    release_progress_context (pfx);
+    return rc;
+}
+
+
+/* Verify the detached signatures in the files FILES[1] to
+ * FILES[NFILES-1] over the data in FILES[0].  The data is hashed only
+ * once for each distinct set of digest algorithms.  */
+static int
+verify_detached_multi (ctrl_t ctrl, int nfiles, char **files)
+{
+    strlist_t sl = NULL;
+    int i;
+
+    if( nfiles < 2 ) {
+	log_error (_("option '%s' requires a data file and"
+                     " at least one signature file\n"), "--detached-multi");
+	return gpg_error (GPG_ERR_INV_ARG);
+    }
+    if( !strcmp (files[0], "-") ) {
+        /* The data may need to be read more than once.  */
+	log_error (_("option '%s' can't read the data from stdin\n"),
+                   "--detached-multi");
+	return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+    add_to_strlist (&sl, files[0]);
+    enable_detached_md_cache ();
+    for(i=1; i < nfiles; i++ )
+        verify_one_detached (ctrl, files[i], sl);
+    release_detached_md_cache ();
+    free_strlist (sl);
+    return 0;
+}
+
 /****************
  * Verify each file given in the files array or read the names of the
  * files from stdin.
@@ -193,6 +268,9 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 {
     int i;
 
+    if( opt.detached_multi )
+        return verify_detached_multi (ctrl, nfiles, files);
+
     if( !nfiles ) { /* read the filenames from stdin */
 	char line[2048];
 	unsigned int lno = 0;
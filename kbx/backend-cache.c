@@ -38,12 +38,16 @@
 #include "keybox-defs.h"
 
 
-/* Standard values for the number of buckets and the threshold we use
- * to flush items.  */
-#define NO_OF_KEY_ITEM_BUCKETS          383
-#define KEY_ITEMS_PER_BUCKET_THRESHOLD  40
-#define NO_OF_BLOB_BUCKETS              383
-#define BLOBS_PER_BUCKET_THRESHOLD      20
+/* Initial number of buckets of the hash tables and the average number
+ * of items per bucket at which we grow a table.  */
+#define INITIAL_KEY_ITEM_BUCKETS  383
+#define INITIAL_BLOB_BUCKETS      383
+#define MAX_ITEMS_PER_BUCKET      4
+
+/* The number of buckets of the table with the not-found marks for
+ * mail addresses and the maximum number of such marks.  */
+#define NEGMAIL_BUCKETS           383
+#define NEGMAIL_MAX_ITEMS         4096
 
 
 /* Our definition of the backend handle.  */
@@ -58,9 +62,11 @@ struct backend_handle_s
 typedef struct blob_s
 {
   struct blob_s *next;
+  struct blob_s *lru_prev;    /* Links for the LRU list.  */
+  struct blob_s *lru_next;
+  unsigned long lastuse;      /* Value of USE_TICK at the last use.  */
   enum pubkey_types pktype;
   unsigned int refcount;
-  unsigned int usecount;
   unsigned int datalen;
   unsigned char *data;        /* The actual data of length DATALEN.  */
   unsigned char ubid[20];
@@ -69,10 +75,12 @@ typedef struct blob_s
 
 static blob_t *blob_table;                /* Hash table with the blobs.   */
 static size_t blob_table_size;            /* Number of allocated buckets. */
-static unsigned int blob_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int blob_table_count;     /* Number of items in the table.*/
 static unsigned int blob_table_added;     /* Number of items added.       */
 static unsigned int blob_table_dropped;   /* Number of items dropped.     */
 static blob_t blob_attic;                 /* List of freed blobs.         */
+static blob_t blob_lru_head;              /* Most recently used blob.     */
+static blob_t blob_lru_tail;              /* Least recently used blob.    */
 
 
 /* A list item to blob data.  This is so that a next operation on a
@@ -106,47 +114,122 @@ static bloblist_t bloblist_attic;  /* List of freed items.  */
 typedef struct key_item_s
 {
   struct key_item_s *next;
+  struct key_item_s *lru_prev;  /* Links for the LRU list.  */
+  struct key_item_s *lru_next;
+  unsigned long lastuse;        /* Value of USE_TICK at the last use.  */
   bloblist_t  blist;       /* List of blobs or NULL for not-found.  */
-  unsigned int usecount;
+  unsigned int nblist;     /* Number of items in BLIST.  */
   unsigned int refcount;   /* Reference counter for this item.  */
+  time_t created;          /* Creation time of a not-found mark.  */
   u32 kid_h;               /* Upper 4 bytes of the keyid.  */
   u32 kid_l;               /* Lower 4 bytes of the keyid.  */
 } *key_item_t;
 
 static key_item_t *key_table;            /* Hash table with the keys.    */
 static size_t key_table_size;            /* Number of allocated buckets. */
-static unsigned int key_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int key_table_count;     /* Number of items in the table.*/
 static unsigned int key_table_added;     /* Number of items added.       */
 static unsigned int key_table_dropped;   /* Number of items dropped.     */
 static key_item_t key_item_attic;        /* List of freed items.         */
+static key_item_t key_lru_head;          /* Most recently used item.     */
+static key_item_t key_lru_tail;          /* Least recently used item.    */
 
 
+/* A not-found mark for a mail address search.  These marks are not
+ * accounted in the memory budget but limited by NEGMAIL_MAX_ITEMS.
+ * Because we don't know the addresses of a stored key without a
+ * closer look at its user ids, all of them are flushed on a store.  */
+typedef struct negmail_s
+{
+  struct negmail_s *next;
+  time_t created;          /* Time the mark was set.  */
+  char mail[1];            /* The address as given in the search.  */
+} *negmail_t;
 
-
-/* The hash function we use for the key_table.  Must not call a system
- * function.  */
+static negmail_t negmail_table[NEGMAIL_BUCKETS];
+static unsigned int negmail_count;
+
+
+/* The number of bytes used by the items in both tables, a counter to
+ * order the uses of items and the cache statistics.  */
+static size_t cache_memory_used;
+static unsigned long use_tick;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+
+
+
+/* The memory accounted for a blob or a key item.  */
+#define BLOB_COST(b)    (sizeof (struct blob_s) + (b)->datalen)
+#define KEY_ITEM_COST(k) (sizeof (struct key_item_s) \
+                          + (k)->nblist * sizeof (struct bloblist_s))
+
+
+/* Return the memory budget in bytes.  */
+static size_t
+cache_memory_limit (void)
+{
+  return opt.cache_size? opt.cache_size : DEFAULT_CACHE_SIZE;
+}
+
+
+/* The hash function we use for the blob_table.  Must not call a
+ * system function.  */
 static inline unsigned int
 blob_table_hasher (const unsigned char *ubid)
 {
-  return (ubid[0] << 16 | ubid[1]) % blob_table_size;
+  return buf32_to_u32 (ubid) % blob_table_size;
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the blob table.  The table grows as
+ * needed.  */
 static gpg_error_t
 blob_table_init (void)
 {
   if (blob_table)
     return 0;
-  blob_table_size = NO_OF_BLOB_BUCKETS;
-  blob_table_threshold  = BLOBS_PER_BUCKET_THRESHOLD;
+  blob_table_size = INITIAL_BLOB_BUCKETS;
   blob_table = xtrycalloc (blob_table_size, sizeof *blob_table);
   if (!blob_table)
     return gpg_error_from_syserror ();
   return 0;
 }
 
+
+/* Double the size of the blob table if the average chain gets too
+ * long.  Failing to grow is not an error; we just keep on using the
+ * current table.  */
+static void
+blob_table_maybe_grow (void)
+{
+  blob_t *newtbl, b, b_next;
+  size_t newsize, idx;
+  unsigned int hash;
+
+  if (blob_table_count < blob_table_size * MAX_ITEMS_PER_BUCKET)
+    return;
+
+  newsize = 2 * blob_table_size + 1;
+  newtbl = xtrycalloc (newsize, sizeof *newtbl);
+  if (!newtbl)
+    return;
+  for (idx=0; idx < blob_table_size; idx++)
+    for (b = blob_table[idx]; b; b = b_next)
+      {
+        b_next = b->next;
+        hash = buf32_to_u32 (b->ubid) % newsize;
+        b->next = newtbl[hash];
+        newtbl[hash] = b;
+      }
+  xfree (blob_table);
+  blob_table = newtbl;
+  blob_table_size = newsize;
+  if (DBG_CACHE)
+    log_debug ("cache: blob table resized to %zu buckets\n", newsize);
+}
+
+
 /* Free a blob.  This is done by moving it to the attic list.  */
 static void
 blob_unref (blob_t blob)
@@ -167,41 +250,80 @@ blob_unref (blob_t blob)
 }
 
 
+/* Mark BLOB as the most recently used one.  */
+static void
+blob_touch (blob_t b)
+{
+  b->lastuse = ++use_tick;
+  if (b == blob_lru_head)
+    return;
+
+  /* Unlink.  */
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  if (b == blob_lru_tail)
+    blob_lru_tail = b->lru_prev;
+
+  /* Put at the head.  */
+  b->lru_prev = NULL;
+  b->lru_next = blob_lru_head;
+  if (blob_lru_head)
+    blob_lru_head->lru_prev = b;
+  blob_lru_head = b;
+  if (!blob_lru_tail)
+    blob_lru_tail = b;
+}
+
+
+/* Remove the blob B from the table and the LRU list and drop the
+ * table's reference.  */
+static void
+blob_table_remove (blob_t b)
+{
+  blob_t *bp;
+
+  for (bp = &blob_table[blob_table_hasher (b->ubid)]; *bp; bp = &(*bp)->next)
+    if (*bp == b)
+      {
+        *bp = b->next;
+        break;
+      }
+  b->next = NULL;
+
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    blob_lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    blob_lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = NULL;
+
+  cache_memory_used -= BLOB_COST (b);
+  blob_table_count--;
+  blob_table_dropped++;
+  blob_unref (b);
+}
+
+
 /* Given the hash value and the ubid, find the blob in the bucket.
- * Returns NULL if not found or the blob item if found.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  */
+ * Returns NULL if not found or the blob item if found.  */
 static blob_t
-find_blob (unsigned int hash, const unsigned char *ubid,
-           unsigned int *r_count)
+find_blob (unsigned int hash, const unsigned char *ubid)
 {
   blob_t b;
-  unsigned int count = 0;
 
-  for (b = blob_table[hash]; b; b = b->next, count++)
+  for (b = blob_table[hash]; b; b = b->next)
     if (!memcmp (b->ubid, ubid, 20))
       break;
-  if (r_count)
-    *r_count = count;
   return b;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_blobs (const void *arg_a, const void *arg_b)
-{
-  const blob_t a = *(const blob_t *)arg_a;
-  const blob_t b = *(const blob_t *)arg_b;
-
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
-  else
-    return 1;
-}
+static void evict_items (size_t needed);
 
 
 /* Put the blob (BLOBDATA, BLOBDATALEN) into the cache using UBID as
@@ -210,98 +332,28 @@ static void
 blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
                 const void *blobdata, unsigned int blobdatalen)
 {
-  unsigned int hash;
   blob_t b;
-  unsigned int count, n;
+  unsigned int n;
   void *blobdatacopy = NULL;
 
-  hash = blob_table_hasher (ubid);
- find_again:
-  b = find_blob (hash, ubid, &count);
-  if (b)
-    {
-      xfree (blobdatacopy);
-      return;  /* Already got this blob.  */
-    }
+  if (find_blob (blob_table_hasher (ubid), ubid))
+    return;  /* Already got this blob.  */
 
-  /* Create a copy of the blob if not yet done.  */
-  if (!blobdatacopy)
-    {
-      blobdatacopy = xtrymalloc (blobdatalen);
-      if (!blobdatacopy)
-        {
-          log_info ("Note: malloc failed while copying blob to the cache: %s\n",
-                    gpg_strerror (gpg_error_from_syserror ()));
-          return;  /* Out of core - ignore.  */
-        }
-      memcpy (blobdatacopy, blobdata, blobdatalen);
-    }
+  if (sizeof *b + blobdatalen > cache_memory_limit ())
+    return;  /* Too large for the cache.  */
 
-  /* If the bucket is full remove a couple of items. */
-  if (count >= blob_table_threshold)
-    {
-      blob_t list_head, *list_tailp, b_next;
-      blob_t *array;
-      int narray, idx;
-
-      /* Unlink from the global list so that other threads don't
-       * disturb us.  If another thread adds or removes something only
-       * one will be the winner.  Bad luck for the dropped cache items
-       * but after all it is just a cache.  */
-      list_head = blob_table[hash];
-      blob_table[hash] = NULL;
-
-      /* Put all items into an array for sorting.  */
-      array = xtrycalloc (count, sizeof *array);
-      if (!array)
-        {
-          /* That's bad; give up all  items of the bucket.  */
-          log_info ("Note: malloc failed while purging blobs from the "
-                    "cache: %s\n", gpg_strerror (gpg_error_from_syserror ()));
-          goto leave_drop;
-        }
-      narray = 0;
-      for (b = list_head; b; b = b_next)
-        {
-          b_next = b->next;
-          array[narray++] = b;
-          b->next = NULL;
-        }
-      log_assert (narray == count);
+  /* Make room for the new item.  */
+  evict_items (sizeof *b + blobdatalen);
+  blob_table_maybe_grow ();
 
-      /* Sort the array and put half of it onto a new list.  */
-      qsort (array, narray, sizeof *array, compare_blobs);
-      list_head = NULL;
-      list_tailp = &list_head;
-      for (idx=0; idx < narray/2; idx++)
-        {
-          *list_tailp = array[idx];
-          list_tailp = &array[idx]->next;
-        }
-
-      /* Put the new list into the bucket.  */
-      b = blob_table[hash];
-      blob_table[hash] = list_head;
-      list_head = b;
-
-      /* Free the remaining items and the array.  */
-      for (; idx < narray; idx++)
-        {
-          blob_unref (array[idx]);
-          blob_table_dropped++;
-        }
-      xfree (array);
-
-    leave_drop:
-      /* Free any items added in the meantime by other threads.  This
-       * is also used in case of a malloc problem (which won't update
-       * the counters, though). */
-      for ( ; list_head; list_head = b_next)
-        {
-          b_next = list_head->next;
-          blob_unref (list_head);
-        }
+  blobdatacopy = xtrymalloc (blobdatalen);
+  if (!blobdatacopy)
+    {
+      log_info ("Note: malloc failed while copying blob to the cache: %s\n",
+                gpg_strerror (gpg_error_from_syserror ()));
+      return;  /* Out of core - ignore.  */
     }
+  memcpy (blobdatacopy, blobdata, blobdatalen);
 
   /* Add an item to the bucket.  We allocate a whole block of items
    * for cache performance reasons.  */
@@ -324,26 +376,25 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
           b->next = blob_attic;
           blob_attic = b;
         }
-
-      /* During the malloc another thread might have changed the
-       * bucket.  Thus we need to start over.  */
-      goto find_again;
     }
 
   /* We now know that there is an item in the attic.  Put it into the
-   * chain.  Note that we may not use any system call here. */
+   * chain and at the head of the LRU list.  */
   b = blob_attic;
   blob_attic = b->next;
-  b->next = NULL;
   b->pktype = pktype;
   b->data = blobdatacopy;
   b->datalen = blobdatalen;
   memcpy (b->ubid, ubid, 20);
-  b->usecount = 1;
   b->refcount = 1;
-  b->next = blob_table[hash];
-  blob_table[hash] = b;
+  b->lru_prev = b->lru_next = NULL;
+  blob_touch (b);
+  n = blob_table_hasher (ubid);
+  b->next = blob_table[n];
+  blob_table[n] = b;
+  blob_table_count++;
   blob_table_added++;
+  cache_memory_used += BLOB_COST (b);
 }
 
 
@@ -352,14 +403,12 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
 static blob_t
 blob_table_get (const unsigned char *ubid)
 {
-  unsigned int hash;
   blob_t b;
 
-  hash = blob_table_hasher (ubid);
-  b = find_blob (hash, ubid, NULL);
+  b = find_blob (blob_table_hasher (ubid), ubid);
   if (b)
     {
-      b->usecount++;
+      blob_touch (b);
       b->refcount++;
       return b;  /* Found  */
     }
@@ -368,7 +417,7 @@ blob_table_get (const unsigned char *ubid)
 }
 
 
-
+
 /* The hash function we use for the key_table.  Must not call a system
  * function.  */
 static inline unsigned int
@@ -378,21 +427,54 @@ key_table_hasher (u32 kid_l)
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the key table.  The table grows as
+ * needed.  */
 static gpg_error_t
 key_table_init (void)
 {
   if (key_table)
     return 0;
-  key_table_size = NO_OF_KEY_ITEM_BUCKETS;
-  key_table_threshold  = KEY_ITEMS_PER_BUCKET_THRESHOLD;
+  key_table_size = INITIAL_KEY_ITEM_BUCKETS;
   key_table = xtrycalloc (key_table_size, sizeof *key_table);
   if (!key_table)
     return gpg_error_from_syserror ();
   return 0;
 }
 
+
+/* Double the size of the key table if the average chain gets too
+ * long.  Failing to grow is not an error; we just keep on using the
+ * current table.  */
+static void
+key_table_maybe_grow (void)
+{
+  key_item_t *newtbl, ki, ki_next;
+  size_t newsize, idx;
+  unsigned int hash;
+
+  if (key_table_count < key_table_size * MAX_ITEMS_PER_BUCKET)
+    return;
+
+  newsize = 2 * key_table_size + 1;
+  newtbl = xtrycalloc (newsize, sizeof *newtbl);
+  if (!newtbl)
+    return;
+  for (idx=0; idx < key_table_size; idx++)
+    for (ki = key_table[idx]; ki; ki = ki_next)
+      {
+        ki_next = ki->next;
+        hash = ki->kid_l % newsize;
+        ki->next = newtbl[hash];
+        newtbl[hash] = ki;
+      }
+  xfree (key_table);
+  key_table = newtbl;
+  key_table_size = newsize;
+  if (DBG_CACHE)
+    log_debug ("cache: key table resized to %zu buckets\n", newsize);
+}
+
+
 /* Free a key_item.  This is done by moving it to the attic list.  */
 static void
 key_item_unref (key_item_t ki)
@@ -406,6 +488,7 @@ key_item_unref (key_item_t ki)
     {
       bl = ki->blist;
       ki->blist = NULL;
+      ki->nblist = 0;
       ki->next = key_item_attic;
       key_item_attic = ki;
 
@@ -420,41 +503,96 @@ key_item_unref (key_item_t ki)
 }
 
 
-/* Given the hash value and the search info, find the key item in the
- * bucket.  Return NULL if not found or the key item if fount.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  Note that FPR may only be NULL
- * if FPRLEN is 0. */
-static key_item_t
-find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l,
-               unsigned int *r_count)
+/* Mark the key item KI as the most recently used one.  */
+static void
+key_item_touch (key_item_t ki)
 {
-  key_item_t ki = key_table[hash];
-  unsigned int count = 0;
+  ki->lastuse = ++use_tick;
+  if (ki == key_lru_head)
+    return;
 
-  for (; ki; ki = ki->next, count++)
-    if (ki->kid_h == kid_h && ki->kid_l == kid_l)
-      break;
-  if (r_count)
-    *r_count = count;
-  return ki;
+  /* Unlink.  */
+  if (ki->lru_prev)
+    ki->lru_prev->lru_next = ki->lru_next;
+  if (ki->lru_next)
+    ki->lru_next->lru_prev = ki->lru_prev;
+  if (ki == key_lru_tail)
+    key_lru_tail = ki->lru_prev;
+
+  /* Put at the head.  */
+  ki->lru_prev = NULL;
+  ki->lru_next = key_lru_head;
+  if (key_lru_head)
+    key_lru_head->lru_prev = ki;
+  key_lru_head = ki;
+  if (!key_lru_tail)
+    key_lru_tail = ki;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_key_items (const void *arg_a, const void *arg_b)
+/* Remove the key item KI from the table and the LRU list and drop the
+ * table's reference.  */
+static void
+key_table_remove (key_item_t ki)
 {
-  const key_item_t a = *(const key_item_t *)arg_a;
-  const key_item_t b = *(const key_item_t *)arg_b;
+  key_item_t *kip;
+
+  for (kip = &key_table[key_table_hasher (ki->kid_l)]; *kip;
+       kip = &(*kip)->next)
+    if (*kip == ki)
+      {
+        *kip = ki->next;
+        break;
+      }
+  ki->next = NULL;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
+  if (ki->lru_prev)
+    ki->lru_prev->lru_next = ki->lru_next;
   else
-    return 1;
+    key_lru_head = ki->lru_next;
+  if (ki->lru_next)
+    ki->lru_next->lru_prev = ki->lru_prev;
+  else
+    key_lru_tail = ki->lru_prev;
+  ki->lru_prev = ki->lru_next = NULL;
+
+  cache_memory_used -= KEY_ITEM_COST (ki);
+  key_table_count--;
+  key_table_dropped++;
+  key_item_unref (ki);
+}
+
+
+/* Evict the least recently used items from both tables until NEEDED
+ * more bytes fit into the memory budget.  */
+static void
+evict_items (size_t needed)
+{
+  size_t limit = cache_memory_limit ();
+
+  while (cache_memory_used + needed > limit
+         && (blob_lru_tail || key_lru_tail))
+    {
+      if (blob_lru_tail
+          && (!key_lru_tail || blob_lru_tail->lastuse <= key_lru_tail->lastuse))
+        blob_table_remove (blob_lru_tail);
+      else
+        key_table_remove (key_lru_tail);
+    }
+}
+
+
+/* Given the hash value and the search info, find the key item in the
+ * bucket.  Return NULL if not found or the key item if fount.  */
+static key_item_t
+find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l)
+{
+  key_item_t ki = key_table[hash];
+
+  for (; ki; ki = ki->next)
+    if (ki->kid_h == kid_h && ki->kid_l == kid_l)
+      break;
+  return ki;
 }
 
 
@@ -518,9 +656,7 @@ alloc_more_bloblist_items (void)
 
 
 /* Helper for key_table_put.  This function assumes that
- * bloblist_attaci is not NULL.  Returns a new bloblist item.  Be
- * aware that no system calls may be done - even not log
- * functions!  */
+ * bloblist_attaci is not NULL.  Returns a new bloblist item.  */
 static bloblist_t
 new_bloblist_item (const unsigned char *fpr, unsigned int fprlen,
                    const unsigned char *ubid, int subkey)
@@ -545,85 +681,6 @@ new_bloblist_item (const unsigned char *fpr, unsigned int fprlen,
 }
 
 
-/* If the list of key item in the bucken HASH is full remove a couple
- * of them.  On error a diagnostic is printed and an error code
- * return.  Note that the error code GPG_ERR_TRUE is returned if any
- * flush and thus system calls were done.
- */
-static gpg_error_t
-maybe_flush_some_key_buckets (unsigned int hash, unsigned int count)
-{
-  gpg_error_t err;
-  key_item_t ki, list_head, *list_tailp, ki_next;
-  key_item_t *array;
-  int narray, idx;
-
-  if (count < key_table_threshold)
-    return 0;  /* Nothing to do.  */
-
-  /* Unlink from the global list so that other threads don't disturb
-   * us.  If another thread adds or removes something only one will be
-   * the winner.  Bad luck for the dropped cache items but after all
-   * it is just a cache.  */
-  list_head = key_table[hash];
-  key_table[hash] = NULL;
-
-  /* Put all items into an array for sorting.  */
-  array = xtrycalloc (count, sizeof *array);
-  if (!array)
-    {
-      /* That's bad; give up all items of the bucket.  */
-      err = gpg_error_from_syserror ();
-      log_info ("Note: malloc failed while purging from the cache: %s\n",
-                gpg_strerror (err));
-      goto leave;
-    }
-  narray = 0;
-  for (ki = list_head; ki; ki = ki_next)
-    {
-      ki_next = ki->next;
-      array[narray++] = ki;
-      ki->next = NULL;
-    }
-  log_assert (narray == count);
-
-  /* Sort the array and put half of it onto a new list.  */
-  qsort (array, narray, sizeof *array, compare_key_items);
-  list_head = NULL;
-  list_tailp = &list_head;
-  for (idx=0; idx < narray/2; idx++)
-    {
-      *list_tailp = array[idx];
-      list_tailp = &array[idx]->next;
-    }
-
-  /* Put the new list into the bucket.  */
-  ki = key_table[hash];
-  key_table[hash] = list_head;
-  list_head = ki;
-
-  /* Free the remaining items and the array.  */
-  for (; idx < narray; idx++)
-    {
-      key_item_unref (array[idx]);
-      key_table_dropped++;
-    }
-  xfree (array);
-  err = gpg_error (GPG_ERR_TRUE);
-
- leave:
-  /* Free any items added in the meantime by other threads.  This is
-   * also used in case of a malloc problem (which won't update the
-   * counters, though). */
-  for ( ; list_head; list_head = ki_next)
-    {
-      ki_next = list_head->next;
-      key_item_unref (list_head);
-    }
-  return err;
-}
-
-
 /* Thsi is the core of
  *   key_table_put,
  *   key_table_put_no_fpr,
@@ -637,14 +694,19 @@ do_key_table_put (u32 kid_h, u32 kid_l,
   unsigned int hash;
   key_item_t ki;
   bloblist_t bl, bl_tail;
-  unsigned int count;
-  int do_find_again;
   int mark_not_found = !fpr;
 
+  /* Make sure that the attics are not empty so that we do not need to
+   * care about allocation failures below.  */
+  if (mark_not_found && !opt.negative_cache_ttl)
+    return;  /* Not-found caching has been disabled.  */
+  if (!bloblist_attic && alloc_more_bloblist_items ())
+    return;  /* Out of core - ignore.  */
+  if (!key_item_attic && alloc_more_key_items ())
+    return;  /* Out of core - ignore.  */
+
   hash = key_table_hasher (kid_l);
- find_again:
-  do_find_again = 0;
-  ki = find_in_chain (hash, kid_h, kid_l, &count);
+  ki = find_in_chain (hash, kid_h, kid_l);
   if (ki)
     {
       if (mark_not_found)
@@ -659,68 +721,65 @@ do_key_table_put (u32 kid_h, u32 kid_l,
       if (bl)
         return;  /* Already in the bloblist for the keyid  */
 
-      /* Append to the list.  */
-      if (!bloblist_attic)
+      /* Make room for the new list item.  We hold a reference so
+       * that KI can't go away; it is most recently used and thus only
+       * evicted if it is the last item.  */
+      key_item_touch (ki);
+      ki->refcount++;
+      evict_items (sizeof *bl);
+      if (find_in_chain (hash, kid_h, kid_l) == ki)
         {
-          if (alloc_more_bloblist_items ())
-            return;  /* Out of core - ignore.  */
-          goto find_again; /* Need to start over due to the malloc.  */
+          /* Append to the list.  */
+          for (bl_tail = NULL, bl = ki->blist; bl;
+               bl_tail = bl, bl = bl->next)
+            ;
+          bl = new_bloblist_item (fpr, fprlen, ubid, subkey);
+          if (bl_tail)
+            bl_tail->next = bl;
+          else
+            ki->blist = bl;
+          ki->nblist++;
+          cache_memory_used += sizeof *bl;
         }
-      for (bl_tail = NULL, bl = ki->blist; bl; bl_tail = bl, bl = bl->next)
-        ;
-      bl = new_bloblist_item (fpr, fprlen, ubid, subkey);
-      if (bl_tail)
-        bl_tail->next = bl;
-      else
-        ki->blist = bl;
+      key_item_unref (ki);
 
       return;
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (maybe_flush_some_key_buckets (hash, count))
-    {
-      /* During the fucntion call another thread might have changed
-       * the bucket.  Thus we need to start over.  */
-      do_find_again = 1;
-    }
-
-  if (!key_item_attic)
-    {
-      if (alloc_more_key_items ())
-        return;  /* Out of core - ignore.  */
-      do_find_again = 1;
-    }
-
-  if (!bloblist_attic)
-    {
-      if (alloc_more_bloblist_items ())
-        return;  /* Out of core - ignore.  */
-      do_find_again = 1;
-    }
-
-  if (do_find_again)
-    goto find_again;
+  /* Make room for the new item.  */
+  evict_items (sizeof *ki + (mark_not_found? 0 : sizeof *bl));
+  key_table_maybe_grow ();
+  hash = key_table_hasher (kid_l);
 
-  /* We now know that there are items in the attics.  Put them into
-   * the chain.  Note that we may not use any system call here. */
+  /* Take the items from the attics and put them into the chain and at
+   * the head of the LRU list.  */
   ki = key_item_attic;
   key_item_attic = ki->next;
   ki->next = NULL;
 
   if (mark_not_found)
-    ki->blist = NULL;
+    {
+      ki->blist = NULL;
+      ki->nblist = 0;
+    }
   else
-    ki->blist = new_bloblist_item (fpr, fprlen, ubid, subkey);
+    {
+      ki->blist = new_bloblist_item (fpr, fprlen, ubid, subkey);
+      ki->nblist = 1;
+    }
 
   ki->kid_h = kid_h;
   ki->kid_l = kid_l;
-  ki->usecount = 1;
+  ki->created = mark_not_found? gnupg_get_time () : 0;
   ki->refcount = 1;
+  ki->lru_prev = ki->lru_next = NULL;
+  key_item_touch (ki);
 
   ki->next = key_table[hash];
   key_table[hash] = ki;
+  key_table_count++;
   key_table_added++;
+  cache_memory_used += KEY_ITEM_COST (ki);
 }
 
 
@@ -789,14 +848,12 @@ key_table_put_no_kid (u32 kid_h, u32 kid_l)
 static key_item_t
 key_table_get (u32 kid_h, u32 kid_l)
 {
-  unsigned int hash;
   key_item_t ki;
 
-  hash = key_table_hasher (kid_l);
-  ki = find_in_chain (hash, kid_h, kid_l, NULL);
+  ki = find_in_chain (key_table_hasher (kid_l), kid_h, kid_l);
   if (ki)
     {
-      ki->usecount++;
+      key_item_touch (ki);
       ki->refcount++;
       return ki;  /* Found  */
     }
@@ -843,6 +900,117 @@ query_by_fpr (const unsigned char *fpr, unsigned int fprlen)
 }
 
 
+/* Return true if the not-found mark KI is still valid.  An expired
+ * mark is removed from the table; the caller's reference is not
+ * touched.  */
+static int
+not_found_mark_valid (key_item_t ki)
+{
+  if (gnupg_get_time () - ki->created < (time_t)opt.negative_cache_ttl)
+    return 1;
+
+  if (DBG_CACHE)
+    log_debug ("cache: not-found mark for %08lX%08lX expired\n",
+               (unsigned long)ki->kid_h, (unsigned long)ki->kid_l);
+  key_table_remove (ki);
+  return 0;
+}
+
+
+/* Remove the key items for the keyid taken from the fingerprint
+ * (FPR,FPRLEN).  This drops the not-found marks as well as the lists
+ * of blobs which may refer to an older version of the key.  */
+static void
+key_table_drop_fpr (const unsigned char *fpr, unsigned int fprlen)
+{
+  key_item_t ki;
+
+  ki = query_by_fpr (fpr, fprlen);
+  if (!ki)
+    return;
+  key_table_remove (ki);
+  key_item_unref (ki);
+}
+
+
+/* Return a hash value for the mail address MAIL.  */
+static unsigned int
+negmail_hasher (const char *mail)
+{
+  unsigned int hash = 0;
+
+  for (; *mail; mail++)
+    hash = hash * 31 + ascii_tolower (*mail);
+  return hash % NEGMAIL_BUCKETS;
+}
+
+
+/* Remove all not-found marks for mail addresses.  */
+static void
+negmail_flush (void)
+{
+  negmail_t nm, nm2;
+  int i;
+
+  for (i=0; i < NEGMAIL_BUCKETS; i++)
+    {
+      for (nm = negmail_table[i]; nm; nm = nm2)
+        {
+          nm2 = nm->next;
+          xfree (nm);
+        }
+      negmail_table[i] = NULL;
+    }
+  negmail_count = 0;
+}
+
+
+/* Return true if a valid not-found mark exists for MAIL.  Expired
+ * marks are removed.  */
+static int
+negmail_get (const char *mail)
+{
+  negmail_t nm, *nmp;
+
+  for (nmp = &negmail_table[negmail_hasher (mail)]; (nm = *nmp);
+       nmp = &nm->next)
+    if (!ascii_strcasecmp (nm->mail, mail))
+      {
+        if (gnupg_get_time () - nm->created < (time_t)opt.negative_cache_ttl)
+          return 1;
+        *nmp = nm->next;
+        xfree (nm);
+        negmail_count--;
+        return 0;
+      }
+  return 0;
+}
+
+
+/* Put a not-found mark for MAIL into the table.  */
+static void
+negmail_put (const char *mail)
+{
+  negmail_t nm;
+  unsigned int hash;
+
+  if (!opt.negative_cache_ttl || negmail_get (mail))
+    return;
+  if (negmail_count >= NEGMAIL_MAX_ITEMS)
+    negmail_flush ();
+
+  nm = xtrymalloc (sizeof *nm + strlen (mail));
+  if (!nm)
+    return;  /* Out of core - ignore.  */
+  strcpy (nm->mail, mail);
+  nm->created = gnupg_get_time ();
+  hash = negmail_hasher (mail);
+  nm->next = negmail_table[hash];
+  negmail_table[hash] = nm;
+  negmail_count++;
+}
+
+
 
 
 
@@ -913,8 +1081,9 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
   unsigned int n;
   blob_t b;
   key_item_t ki;
-  bloblist_t bl;
-  int not_found = 0;
+  bloblist_t bl = NULL;
+  unsigned int i;
+  unsigned int n_not_found = 0;
   int descidx = 0;
   int found_bykid = 0;
 
@@ -938,6 +1107,8 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
       goto leave;
     }
 
+  /* A not-found answer is only correct if all descriptions are
+   * marked as not-found; thus we count them.  */
   for (ki = NULL, n=0; n < ndesc && !ki; n++)
     {
       descidx = n;
@@ -947,10 +1118,9 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
           ki = query_by_kid (desc[n].u.kid[0], desc[n].u.kid[1]);
           if (ki && ki->blist)
             {
-              not_found = 0;
               /* Note that in a bloblist all keyids are the same.  */
-              for (n=0, bl = ki->blist; bl; bl = bl->next)
-                if (n++ == reqpart->cache_seqno.kid)
+              for (i=0, bl = ki->blist; bl; bl = bl->next)
+                if (i++ == reqpart->cache_seqno.kid)
                   break;
               if (!bl)
                 {
@@ -964,19 +1134,23 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
                 }
             }
           else if (ki)
-            not_found = 1;
+            {
+              if (not_found_mark_valid (ki))
+                n_not_found++;
+              key_item_unref (ki);
+              ki = NULL;
+            }
           break;
 
         case KEYDB_SEARCH_MODE_FPR:
           ki = query_by_fpr (desc[n].u.fpr, desc[n].fprlen);
           if (ki && ki->blist)
             {
-              not_found = 0;
-              for (n=0, bl = ki->blist; bl; bl = bl->next)
+              for (i=0, bl = ki->blist; bl; bl = bl->next)
                 if (bl->fprlen
                     && bl->fprlen == desc[n].fprlen
                     && !memcmp (bl->fpr, desc[n].u.fpr, desc[n].fprlen)
-                    && n++ == reqpart->cache_seqno.fpr)
+                    && i++ == reqpart->cache_seqno.fpr)
                   break;
               if (!bl)
                 {
@@ -987,7 +1161,17 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
                 reqpart->cache_seqno.fpr++;
             }
           else if (ki)
-            not_found = 1;
+            {
+              if (not_found_mark_valid (ki))
+                n_not_found++;
+              key_item_unref (ki);
+              ki = NULL;
+            }
+          break;
+
+        case KEYDB_SEARCH_MODE_MAIL:
+          if (negmail_get (desc[n].u.name))
+            n_not_found++;
           break;
 
         /* case KEYDB_SEARCH_MODE_KEYGRIP: */
@@ -1021,12 +1205,7 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
         }
     }
 
-  if (not_found)
-    {
-      err = gpg_error (GPG_ERR_NOT_FOUND);
-      key_item_unref (ki);
-    }
-  else if (ki)
+  if (ki)
     {
       if (bl && bl->ubid_valid)
         {
@@ -1064,10 +1243,24 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
         err = gpg_error (GPG_ERR_NOT_FOUND);
       key_item_unref (ki);
     }
+  else if (ndesc && n_not_found == ndesc)
+    {
+      /* Answered from the not-found marks.  Note that
+       * be_cache_not_found sets them only for a search without any
+       * result and store removes them; thus a continued search
+       * can't end up here.  */
+      err = gpg_error (GPG_ERR_NOT_FOUND);
+    }
   else
     err = gpg_error (GPG_ERR_EOF);
 
  leave:
+  if (!desc)
+    ;
+  else if (gpg_err_code (err) == GPG_ERR_EOF)
+    cache_misses++;
+  else if (!err || gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    cache_hits++;
   return err;
 }
 
@@ -1173,7 +1366,7 @@ be_cache_not_found (ctrl_t ctrl, enum pubkey_types pubkey_type,
 
   for (n=0; n < ndesc; n++)
     {
-      switch (desc->mode)
+      switch (desc[n].mode)
         {
         case KEYDB_SEARCH_MODE_LONG_KID:
           key_table_put_no_kid (desc[n].u.kid[0], desc[n].u.kid[1]);
@@ -1183,8 +1376,80 @@ be_cache_not_found (ctrl_t ctrl, enum pubkey_types pubkey_type,
           key_table_put_no_fpr (desc[n].u.fpr, desc[n].fprlen);
           break;
 
+        case KEYDB_SEARCH_MODE_MAIL:
+          negmail_put (desc[n].u.name);
+          break;
+
         default:
           break;
         }
     }
 }
+
+
+/* Remove all cache entries which may be affected by the store of the
+ * key (BLOB,BLOBLEN) of PUBKEY_TYPE.  This must be called after each
+ * insert or update.  */
+void
+be_cache_invalidate (ctrl_t ctrl, const void *blob, unsigned int bloblen,
+                     enum pubkey_types pubkey_type)
+{
+  gpg_error_t err;
+  struct _keybox_openpgp_info info;
+  struct _keybox_openpgp_key_info *kinfo;
+
+  (void)ctrl;
+
+  negmail_flush ();
+
+  if (pubkey_type != PUBKEY_TYPE_OPGP || !key_table)
+    return;
+
+  err = _keybox_parse_openpgp (blob, bloblen, NULL, &info);
+  if (err)
+    {
+      log_info ("cache: error parsing OpenPGP blob: %s\n",
+                gpg_strerror (err));
+      return;
+    }
+
+  kinfo = &info.primary;
+  key_table_drop_fpr (kinfo->fpr, kinfo->fprlen);
+  if (info.nsubkeys)
+    for (kinfo = &info.subkeys; kinfo; kinfo = kinfo->next)
+      key_table_drop_fpr (kinfo->fpr, kinfo->fprlen);
+
+  _keybox_destroy_openpgp_info (&info);
+}
+
+
+/* Store the UBIDs of up to MAXUBIDS of the most recently used OpenPGP
+ * blobs at UBIDS, which must have room for 20 * MAXUBIDS bytes.  The
+ * most recently used one is stored first.  Returns the number of
+ * stored UBIDs.  */
+unsigned int
+be_cache_get_recent_ubids (unsigned char *ubids, unsigned int maxubids)
+{
+  blob_t b;
+  unsigned int n = 0;
+
+  for (b = blob_lru_head; b && n < maxubids; b = b->lru_next)
+    if (b->pktype == PUBKEY_TYPE_OPGP)
+      memcpy (ubids + 20 * n++, b->ubid, 20);
+  return n;
+}
+
+
+/* Return a malloced string with the statistics of the cache.  The
+ * string consists of the space separated numbers of hits, misses,
+ * evicted items, cached blobs, cached key items, bytes used and the
+ * memory budget in bytes.  Returns NULL on malloc failure.  */
+char *
+be_cache_get_stats (void)
+{
+  return xtryasprintf ("%lu %lu %u %u %u %zu %zu",
+                       cache_hits, cache_misses,
+                       blob_table_dropped + key_table_dropped,
+                       blob_table_count, key_table_count,
+                       cache_memory_used, cache_memory_limit ());
+}
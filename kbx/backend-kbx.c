@@ -192,6 +192,23 @@ be_kbx_add_resource (ctrl_t ctrl, backend_handle_t *r_hd,
   if (err)
     goto leave;
 
+  /* keyboxd owns the keybox; thus we can use an index to speed up
+   * lookups by fingerprint, keyid and keygrip and we can update the
+   * file in place.  */
+  if (!readonly)
+    {
+      keybox_enable_inplace_update (token);
+      err = keybox_enable_index (token, (opt.index_trigrams
+                                         ? KEYBOX_INDEX_TRIGRAMS : 0));
+      if (err)
+        {
+          if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+            log_info ("can't use an index for '%s': %s\n",
+                      filename, gpg_strerror (err));
+          err = 0;
+        }
+    }
+
   hd->backend_id = be_new_backend_id ();
   hd->token = token;
 
@@ -233,6 +250,7 @@ be_kbx_init_request_part (backend_handle_t backend_hd, db_request_part_t part)
   part->kbx_hd = keybox_new_openpgp (backend_hd->token, 0);
   if (!part->kbx_hd)
     return gpg_error_from_syserror ();
+  keybox_set_mmap (part->kbx_hd, 1);
   return 0;
 }
 
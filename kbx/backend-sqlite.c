@@ -0,0 +1,1336 @@
+/* backend-sqlite.c - SQLite based backend for keyboxd
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The database has these tables:
+ *
+ * pubkey      - One row per keyblock or certificate.  The UBID is
+ *               the SHA-1 hash over the blob.  The issuer and the
+ *               serial number are only used for X.509.
+ * fingerprint - One row for the primary key and for each subkey
+ *               with the fingerprint, the keyid and the keygrip.
+ * userid      - One row per user ID with the mail address extracted
+ *               from the user ID.  For X.509 the subject and the
+ *               alternative names are stored here.
+ * useridfts   - An optional FTS5 table using the trigram tokenizer
+ *               to speed up substring searches in the userid table.
+ *               Its rowids are the same as those of the userid table.
+ *
+ * The fingerprint and userid rows reference the pubkey row using its
+ * rowid.  The order of the keys is the order of the pubkey rowids;
+ * a search is resumed by remembering the last returned rowid.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "keyboxd.h"
+#include "../common/i18n.h"
+#include "../common/mbox-util.h"
+#include "../common/membuf.h"
+#include "../common/host2net.h"
+#include "backend.h"
+#include "keybox-defs.h"
+
+
+/* The version of the database schema.  */
+#define DB_SCHEMA_VERSION "1"
+
+
+/* Our definition of the backend handle.  */
+struct backend_handle_s
+{
+  enum database_types db_type; /* Always DB_TYPE_SQLITE.  */
+  unsigned int backend_id;     /* Always the id of the backend.  */
+
+  sqlite3 *db;                 /* The database connection.  */
+  unsigned int readonly:1;     /* The database is opened read-only.  */
+  unsigned int have_fts:1;     /* The useridfts table is available.  */
+  unsigned int in_batch:1;     /* A transaction for a batch is open.  */
+
+  char filename[1];
+};
+
+
+/* The SQL statements to create the tables.  */
+static const char *table_definitions[] =
+  {
+   "CREATE TABLE IF NOT EXISTS config ("
+   "  name   TEXT NOT NULL UNIQUE,"
+   "  value  TEXT NOT NULL)",
+
+   "CREATE TABLE IF NOT EXISTS pubkey ("
+   "  ubid    BLOB NOT NULL UNIQUE,"
+   "  type    INTEGER NOT NULL,"
+   "  keyblob BLOB NOT NULL,"
+   "  issuer  TEXT,"
+   "  sn      BLOB)",
+   "CREATE INDEX IF NOT EXISTS pubkeyidx0 ON pubkey (issuer)",
+   "CREATE INDEX IF NOT EXISTS pubkeyidx1 ON pubkey (sn)",
+
+   "CREATE TABLE IF NOT EXISTS fingerprint ("
+   "  fpr     BLOB NOT NULL,"
+   "  kidh    INTEGER NOT NULL,"
+   "  kidl    INTEGER NOT NULL,"
+   "  keygrip BLOB,"
+   "  subkey  INTEGER NOT NULL,"
+   "  pkid    INTEGER NOT NULL)",
+   "CREATE INDEX IF NOT EXISTS fingerprintidx0 ON fingerprint (fpr)",
+   "CREATE INDEX IF NOT EXISTS fingerprintidx1 ON fingerprint (kidl)",
+   "CREATE INDEX IF NOT EXISTS fingerprintidx2 ON fingerprint (keygrip)",
+   "CREATE INDEX IF NOT EXISTS fingerprintidx3 ON fingerprint (pkid)",
+
+   "CREATE TABLE IF NOT EXISTS userid ("
+   "  uid      TEXT NOT NULL,"
+   "  addrspec TEXT,"
+   "  pkid     INTEGER NOT NULL)",
+   "CREATE INDEX IF NOT EXISTS useridx0 ON userid (uid)",
+   "CREATE INDEX IF NOT EXISTS useridx1 ON userid (addrspec)",
+   "CREATE INDEX IF NOT EXISTS useridx2 ON userid (pkid)",
+
+   NULL
+  };
+
+
+/* A parameter to be bound to a search statement.  */
+struct sqlparm_s
+{
+  const void *data;   /* Text or blob; NULL for an integer.  */
+  int len;            /* Length of the text or blob.  */
+  int is_text;        /* DATA is a text.  */
+  sqlite3_int64 ival; /* The integer value.  */
+  char *freeme;       /* DATA is allocated.  */
+};
+
+
+
+/* Print a diagnostic for the SQLite error RES which happened during
+ * WHAT and return a matching error code.  */
+static gpg_error_t
+sqlite_error (backend_handle_t hd, int res, const char *what)
+{
+  log_error ("error %s '%s': %s\n", what, hd->filename,
+             hd->db? sqlite3_errmsg (hd->db) : sqlite3_errstr (res));
+  switch (res & 0xff)
+    {
+    case SQLITE_NOMEM:    return gpg_error (GPG_ERR_ENOMEM);
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:   return gpg_error (GPG_ERR_EAGAIN);
+    case SQLITE_READONLY: return gpg_error (GPG_ERR_EACCES);
+    case SQLITE_CANTOPEN: return gpg_error (GPG_ERR_ENOENT);
+    case SQLITE_CORRUPT:
+    case SQLITE_NOTADB:   return gpg_error (GPG_ERR_INV_OBJ);
+    case SQLITE_FULL:     return gpg_error (GPG_ERR_ENOSPC);
+    default:              return gpg_error (GPG_ERR_GENERAL);
+    }
+}
+
+
+/* Run the SQL statement SQL which does not return data.  */
+static gpg_error_t
+run_sql (backend_handle_t hd, const char *sql)
+{
+  int res;
+
+  res = sqlite3_exec (hd->db, sql, NULL, NULL, NULL);
+  if (res != SQLITE_OK)
+    return sqlite_error (hd, res, "running SQL statement on");
+  return 0;
+}
+
+
+/* Prepare SQL and store the statement at R_STMT.  */
+static gpg_error_t
+prepare_sql (backend_handle_t hd, const char *sql, sqlite3_stmt **r_stmt)
+{
+  int res;
+
+  res = sqlite3_prepare_v2 (hd->db, sql, -1, r_stmt, NULL);
+  if (res != SQLITE_OK)
+    {
+      *r_stmt = NULL;
+      return sqlite_error (hd, res, "preparing SQL statement for");
+    }
+  return 0;
+}
+
+
+/* Step through STMT which does not return data and reset it for
+ * another use.  */
+static gpg_error_t
+step_and_reset (backend_handle_t hd, sqlite3_stmt *stmt)
+{
+  int res;
+
+  res = sqlite3_step (stmt);
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+  if (res != SQLITE_DONE)
+    return sqlite_error (hd, res, "updating");
+  return 0;
+}
+
+
+/* Create the tables if they do not yet exist and check whether the
+ * full text search table can be used.  */
+static gpg_error_t
+init_tables (backend_handle_t hd)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt = NULL;
+  int i, res, fts_exists = 0;
+
+  if (hd->readonly)
+    goto check_fts;
+
+  err = run_sql (hd, "BEGIN IMMEDIATE");
+  if (err)
+    return err;
+  for (i=0; table_definitions[i]; i++)
+    {
+      err = run_sql (hd, table_definitions[i]);
+      if (err)
+        goto leave;
+    }
+  err = run_sql (hd, "INSERT OR IGNORE INTO config (name, value)"
+                 " VALUES ('schema', '" DB_SCHEMA_VERSION "')");
+  if (err)
+    goto leave;
+
+  /* The FTS5 trigram tokenizer has been introduced with SQLite 3.34;
+   * if that is not available we fall back to a table scan.  If the
+   * table has just been created we need to populate it from a
+   * database which has been used without it.  */
+  err = prepare_sql (hd, "SELECT 1 FROM sqlite_master"
+                     " WHERE type = 'table' AND name = 'useridfts'", &stmt);
+  if (err)
+    goto leave;
+  fts_exists = (sqlite3_step (stmt) == SQLITE_ROW);
+  sqlite3_finalize (stmt);
+  stmt = NULL;
+  if (!fts_exists)
+    {
+      res = sqlite3_exec (hd->db,
+                          "CREATE VIRTUAL TABLE useridfts USING fts5"
+                          " (uid, addrspec, tokenize = 'trigram')",
+                          NULL, NULL, NULL);
+      if (res == SQLITE_OK)
+        {
+          err = run_sql (hd, "INSERT INTO useridfts (rowid, uid, addrspec)"
+                         " SELECT rowid, uid, addrspec FROM userid");
+          if (err)
+            goto leave;
+        }
+      else if (opt.verbose)
+        log_info ("full text search not available for '%s': %s\n",
+                  hd->filename, sqlite3_errmsg (hd->db));
+    }
+
+  err = run_sql (hd, "COMMIT");
+
+ leave:
+  if (err)
+    {
+      sqlite3_exec (hd->db, "ROLLBACK", NULL, NULL, NULL);
+      return err;
+    }
+
+ check_fts:
+  res = sqlite3_prepare_v2 (hd->db, "SELECT rowid FROM useridfts LIMIT 0",
+                            -1, &stmt, NULL);
+  hd->have_fts = (res == SQLITE_OK);
+  sqlite3_finalize (stmt);
+  if (!hd->have_fts && fts_exists)
+    {
+      /* The table exists but this SQLite version can't use it.
+       * Writing would leave it out of sync.  */
+      log_error ("full text search table of '%s' is not usable\n",
+                 hd->filename);
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+  return 0;
+}
+
+
+
+/* Install a new resource and return a handle for that backend.  */
+gpg_error_t
+be_sqlite_add_resource (ctrl_t ctrl, backend_handle_t *r_hd,
+                        const char *filename, int readonly)
+{
+  gpg_error_t err;
+  backend_handle_t hd;
+  int res, created = 0;
+
+  (void)ctrl;
+
+  *r_hd = NULL;
+  hd = xtrycalloc (1, sizeof *hd + strlen (filename));
+  if (!hd)
+    return gpg_error_from_syserror ();
+  hd->db_type = DB_TYPE_SQLITE;
+  hd->readonly = !!readonly;
+  strcpy (hd->filename, filename);
+
+  if (access (filename, F_OK))
+    {
+      estream_t fp;
+
+      if (readonly)
+        {
+          err = gpg_error (GPG_ERR_ENOENT);
+          goto leave;
+        }
+      /* Create an empty file so that we can control the permissions;
+       * SQLite takes an empty file as a new database.  */
+      fp = es_fopen (filename, "wb,mode=-rw-------");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error (_("error creating database '%s': %s\n"),
+                     filename, gpg_strerror (err));
+          goto leave;
+        }
+      es_fclose (fp);
+      created = 1;
+    }
+
+  res = sqlite3_open_v2 (filename, &hd->db,
+                         readonly? SQLITE_OPEN_READONLY
+                         /**/    : SQLITE_OPEN_READWRITE,
+                         NULL);
+  if (res != SQLITE_OK)
+    {
+      err = sqlite_error (hd, res, "opening database");
+      goto leave;
+    }
+  sqlite3_busy_timeout (hd->db, 10000);
+
+  if (!readonly)
+    {
+      /* The write-ahead log avoids rewriting the database for each
+       * update and lets other processes read while we write.  */
+      err = run_sql (hd, "PRAGMA journal_mode = WAL");
+      if (err)
+        goto leave;
+    }
+
+  err = init_tables (hd);
+  if (err)
+    goto leave;
+
+  if (created && !opt.quiet)
+    log_info (_("database '%s' created\n"), filename);
+
+  hd->backend_id = be_new_backend_id ();
+
+  *r_hd = hd;
+  hd = NULL;
+
+ leave:
+  if (hd)
+    {
+      if (hd->db)
+        sqlite3_close (hd->db);
+      xfree (hd);
+    }
+  return err;
+}
+
+
+/* Release the backend handle HD and all its resources.  HD is not
+ * valid after a call to this function.  */
+void
+be_sqlite_release_resource (ctrl_t ctrl, backend_handle_t hd)
+{
+  (void)ctrl;
+
+  if (!hd)
+    return;
+  hd->db_type = DB_TYPE_NONE;
+  if (hd->db)
+    sqlite3_close (hd->db);
+
+  xfree (hd);
+}
+
+
+
+/* Return a malloced copy of STRING with the characters used as
+ * wildcards by LIKE escaped with a backslash.  PREFIX and SUFFIX are
+ * a '%' or an empty string.  */
+static char *
+make_like_pattern (const char *prefix, const char *string, size_t len,
+                   const char *suffix)
+{
+  char *buffer, *p;
+
+  buffer = xtrymalloc (2 * len + 3);
+  if (!buffer)
+    return NULL;
+  p = stpcpy (buffer, prefix);
+  for (; len; len--, string++)
+    {
+      if (*string == '%' || *string == '_' || *string == '\\')
+        *p++ = '\\';
+      *p++ = *string;
+    }
+  strcpy (p, suffix);
+  return buffer;
+}
+
+
+/* Return a malloced FTS5 query to search for the phrase STRING in
+ * COLUMN.  */
+static char *
+make_fts_query (const char *column, const char *string, size_t len)
+{
+  char *buffer, *p;
+
+  buffer = xtrymalloc (strlen (column) + 2 * len + 6);
+  if (!buffer)
+    return NULL;
+  p = stpcpy (stpcpy (buffer, column), " : \"");
+  for (; len; len--, string++)
+    {
+      if (*string == '"')
+        *p++ = '"';
+      *p++ = *string;
+    }
+  strcpy (p, "\"");
+  return buffer;
+}
+
+
+/* Convert the serial number of DESC to binary and store it in PARM.  */
+static gpg_error_t
+sn_from_desc (KEYDB_SEARCH_DESC *desc, struct sqlparm_s *parm)
+{
+  const unsigned char *s;
+  unsigned char *sn;
+  size_t n, snlen;
+
+  if (desc->snlen != -1)
+    {
+      parm->data = desc->sn;
+      parm->len = desc->snlen;
+      return 0;
+    }
+
+  for (s = desc->sn, n = 0; *s && *s != '/'; s++)
+    n++;
+  snlen = (n + 1) / 2;
+  sn = xtrymalloc (snlen + 1);
+  if (!sn)
+    return gpg_error_from_syserror ();
+  s = desc->sn;
+  if ((n & 1))
+    {
+      sn[0] = xtoi_1 (s);
+      s++;
+      n = 1;
+    }
+  else
+    n = 0;
+  for (; n < snlen; n++, s += 2)
+    sn[n] = xtoi_2 (s);
+  parm->data = parm->freeme = (char*)sn;
+  parm->len = snlen;
+  return 0;
+}
+
+
+/* Append the SQL condition for DESC to MB and the parameters used by
+ * the condition to PARMS at R_NPARMS.  PARMS must have space for two
+ * more items.  */
+static gpg_error_t
+append_condition (backend_handle_t hd, membuf_t *mb,
+                  KEYDB_SEARCH_DESC *desc,
+                  struct sqlparm_s *parms, int *r_nparms)
+{
+  gpg_error_t err;
+  struct sqlparm_s *parm = parms + *r_nparms;
+  const char *name, *column = NULL;
+  size_t namelen;
+  char *addr;
+
+  memset (parm, 0, 2 * sizeof *parm);
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_EXACT:
+    case KEYDB_SEARCH_MODE_SUBJECT:
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM userid"
+                      " WHERE uid = ?)");
+      parm->data = desc->u.name;
+      parm->len = strlen (desc->u.name);
+      parm->is_text = 1;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_MAIL:
+      /* Strip the angle brackets as done by the keybox code.  */
+      name = desc->u.name;
+      if (*name == '<')
+        name++;
+      namelen = strlen (name);
+      if (namelen && name[namelen-1] == '>')
+        namelen--;
+      addr = xtrymalloc (namelen + 1);
+      if (!addr)
+        return gpg_error_from_syserror ();
+      memcpy (addr, name, namelen);
+      addr[namelen] = 0;
+      ascii_strlwr (addr);
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM userid"
+                      " WHERE addrspec = ?)");
+      parm->data = parm->freeme = addr;
+      parm->len = namelen;
+      parm->is_text = 1;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILSUB:
+      column = "addrspec";
+      /* Fall through.  */
+    case KEYDB_SEARCH_MODE_SUBSTR:
+      if (!column)
+        column = "uid";
+      name = desc->u.name;
+      namelen = strlen (name);
+      if (!namelen)
+        {
+          put_membuf_str (mb, "0");
+          break;
+        }
+      /* The LIKE operator compares case-insensitive for ASCII which
+       * is the same as done by the keybox code.  The trigram index
+       * requires at least three characters.  */
+      if (hd->have_fts && namelen >= 3)
+        {
+          put_membuf_printf (mb, "p.rowid IN (SELECT u.pkid FROM userid u"
+                             " WHERE u.rowid IN (SELECT rowid FROM useridfts"
+                             " WHERE useridfts MATCH ?)"
+                             " AND u.%s LIKE ? ESCAPE '\\')", column);
+          parm->data = parm->freeme = make_fts_query (column, name, namelen);
+          if (!parm->data)
+            return gpg_error_from_syserror ();
+          parm->len = strlen (parm->data);
+          parm->is_text = 1;
+          parm++;
+          *r_nparms += 1;
+        }
+      else
+        put_membuf_printf (mb, "p.rowid IN (SELECT pkid FROM userid"
+                           " WHERE %s LIKE ? ESCAPE '\\')", column);
+      parm->data = parm->freeme = make_like_pattern ("%", name, namelen, "%");
+      if (!parm->data)
+        return gpg_error_from_syserror ();
+      parm->len = strlen (parm->data);
+      parm->is_text = 1;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILEND:
+      name = desc->u.name;
+      namelen = strlen (name);
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM userid"
+                      " WHERE addrspec LIKE ? ESCAPE '\\')");
+      parm->data = parm->freeme = make_like_pattern ("%", name, namelen, "");
+      if (!parm->data)
+        return gpg_error_from_syserror ();
+      parm->len = strlen (parm->data);
+      parm->is_text = 1;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_WORDS:
+      /* Not implemented by the keybox code either.  */
+      put_membuf_str (mb, "0");
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER:
+      put_membuf_str (mb, "p.issuer = ?");
+      parm->data = desc->u.name;
+      parm->len = strlen (desc->u.name);
+      parm->is_text = 1;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER_SN:
+      put_membuf_str (mb, "(p.issuer = ? AND p.sn = ?)");
+      parm->data = desc->u.name;
+      parm->len = strlen (desc->u.name);
+      parm->is_text = 1;
+      *r_nparms += 1;
+      err = sn_from_desc (desc, parm + 1);
+      if (err)
+        return err;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_SN:
+      put_membuf_str (mb, "p.sn = ?");
+      err = sn_from_desc (desc, parm);
+      if (err)
+        return err;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM fingerprint"
+                      " WHERE kidl = ?)");
+      parm->ival = desc->u.kid[1];
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM fingerprint"
+                      " WHERE kidl = ? AND kidh = ?)");
+      parm[0].ival = desc->u.kid[1];
+      parm[1].ival = desc->u.kid[0];
+      *r_nparms += 2;
+      break;
+
+    case KEYDB_SEARCH_MODE_FPR:
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM fingerprint"
+                      " WHERE fpr = ?)");
+      parm->data = desc->u.fpr;
+      parm->len = desc->fprlen;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      put_membuf_str (mb, "p.rowid IN (SELECT pkid FROM fingerprint"
+                      " WHERE keygrip = ?)");
+      parm->data = desc->u.grip;
+      parm->len = KEYGRIP_LEN;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_UBID:
+      put_membuf_str (mb, "p.ubid = ?");
+      parm->data = desc->u.ubid;
+      parm->len = 20;
+      *r_nparms += 1;
+      break;
+
+    case KEYDB_SEARCH_MODE_FIRST:
+    case KEYDB_SEARCH_MODE_NEXT:
+      put_membuf_str (mb, "1");
+      break;
+
+    default:
+      return gpg_error (GPG_ERR_INV_VALUE);
+    }
+
+  return 0;
+}
+
+
+/* Bind the NPARMS parameters PARMS to STMT starting at index 2.  */
+static gpg_error_t
+bind_parms (backend_handle_t hd, sqlite3_stmt *stmt,
+            struct sqlparm_s *parms, int nparms)
+{
+  int i, res;
+
+  for (i=0; i < nparms; i++)
+    {
+      if (!parms[i].data)
+        res = sqlite3_bind_int64 (stmt, i + 2, parms[i].ival);
+      else if (parms[i].is_text)
+        res = sqlite3_bind_text (stmt, i + 2, parms[i].data, parms[i].len,
+                                 SQLITE_STATIC);
+      else
+        res = sqlite3_bind_blob (stmt, i + 2, parms[i].data, parms[i].len,
+                                 SQLITE_STATIC);
+      if (res != SQLITE_OK)
+        return sqlite_error (hd, res, "binding search parameter for");
+    }
+  return 0;
+}
+
+
+/* Search for the keys described by (DESC,NDESC) and return them to
+ * the caller.  BACKEND_HD is the handle for this backend and REQUEST
+ * is the current database request object.  If DESC is NULL the
+ * search is reset.  */
+gpg_error_t
+be_sqlite_search (ctrl_t ctrl, backend_handle_t backend_hd,
+                  db_request_t request,
+                  KEYDB_SEARCH_DESC *desc, unsigned int ndesc)
+{
+  gpg_error_t err;
+  db_request_part_t part;
+  membuf_t mb;
+  char *sql = NULL;
+  struct sqlparm_s *parms = NULL;
+  int nparms = 0;
+  unsigned int n;
+  sqlite3_stmt *stmt = NULL;
+  int res;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+  log_assert (request);
+
+  /* Find the specific request part or allocate it.  */
+  err = be_find_request_part (backend_hd, request, &part);
+  if (err)
+    goto leave;
+
+  if (!desc)
+    {
+      part->sqlite_rowid = 0;
+      goto leave;
+    }
+
+  parms = xtrycalloc (2 * ndesc + 1, sizeof *parms);
+  if (!parms)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Like the keybox backend we only return OpenPGP keys.  */
+  init_membuf (&mb, 512);
+  put_membuf_str (&mb, "SELECT p.rowid, p.ubid, p.type, p.keyblob"
+                  " FROM pubkey p WHERE p.rowid > ?1 AND p.type = ");
+  put_membuf_printf (&mb, "%d AND (", PUBKEY_TYPE_OPGP);
+  for (n=0; n < ndesc; n++)
+    {
+      if (n)
+        put_membuf_str (&mb, " OR ");
+      err = append_condition (backend_hd, &mb, desc + n, parms, &nparms);
+      if (err)
+        break;
+    }
+  put_membuf_str (&mb, ") ORDER BY p.rowid LIMIT 1");
+  put_membuf (&mb, "", 1);
+  sql = get_membuf (&mb, NULL);
+  if (err)
+    goto leave;
+  if (!sql)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  err = prepare_sql (backend_hd, sql, &stmt);
+  if (err)
+    goto leave;
+  res = sqlite3_bind_int64 (stmt, 1, part->sqlite_rowid);
+  if (res != SQLITE_OK)
+    {
+      err = sqlite_error (backend_hd, res, "binding search parameter for");
+      goto leave;
+    }
+  err = bind_parms (backend_hd, stmt, parms, nparms);
+  if (err)
+    goto leave;
+
+  res = sqlite3_step (stmt);
+  if (res == SQLITE_DONE)
+    err = gpg_error (GPG_ERR_EOF);
+  else if (res != SQLITE_ROW)
+    err = sqlite_error (backend_hd, res, "searching");
+  else if (sqlite3_column_bytes (stmt, 1) != 20)
+    {
+      log_error ("invalid UBID in database '%s'\n", backend_hd->filename);
+      err = gpg_error (GPG_ERR_INV_OBJ);
+    }
+  else
+    {
+      /* Successful search operation.  */
+      const unsigned char *ubid;
+      const void *buffer;
+      size_t buflen;
+      enum pubkey_types pubkey_type;
+
+      part->sqlite_rowid = sqlite3_column_int64 (stmt, 0);
+      ubid = sqlite3_column_blob (stmt, 1);
+      pubkey_type = sqlite3_column_int (stmt, 2);
+      buffer = sqlite3_column_blob (stmt, 3);
+      buflen = sqlite3_column_bytes (stmt, 3);
+      err = be_return_pubkey (ctrl, buffer, buflen, pubkey_type, ubid);
+      if (!err)
+        be_cache_pubkey (ctrl, ubid, buffer, buflen, pubkey_type);
+    }
+
+ leave:
+  sqlite3_finalize (stmt);
+  if (parms)
+    {
+      for (n=0; n < nparms; n++)
+        xfree (parms[n].freeme);
+      xfree (parms);
+    }
+  xfree (sql);
+  return err;
+}
+
+
+/* Seek in the database to the given UBID (if UBID is not NULL) or to
+ * the key with the fingerprint specified by (FPR,FPRLEN).
+ * BACKEND_HD is the handle for this backend and REQUEST is the
+ * current database request object.  The next search operation starts
+ * right after that key.  */
+gpg_error_t
+be_sqlite_seek (ctrl_t ctrl, backend_handle_t backend_hd,
+                db_request_t request, const unsigned char *ubid,
+                const unsigned char *fpr, unsigned int fprlen)
+{
+  gpg_error_t err;
+  db_request_part_t part;
+  sqlite3_stmt *stmt = NULL;
+  int res;
+
+  (void)ctrl;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+  log_assert (request);
+
+  /* Find the specific request part or allocate it.  */
+  err = be_find_request_part (backend_hd, request, &part);
+  if (err)
+    goto leave;
+
+  if (ubid)
+    err = prepare_sql (backend_hd,
+                       "SELECT rowid FROM pubkey WHERE ubid = ?", &stmt);
+  else
+    err = prepare_sql (backend_hd,
+                       "SELECT pkid FROM fingerprint WHERE fpr = ?"
+                       " ORDER BY subkey LIMIT 1", &stmt);
+  if (err)
+    goto leave;
+  if (ubid)
+    res = sqlite3_bind_blob (stmt, 1, ubid, 20, SQLITE_STATIC);
+  else
+    res = sqlite3_bind_blob (stmt, 1, fpr, fprlen, SQLITE_STATIC);
+  if (res != SQLITE_OK)
+    {
+      err = sqlite_error (backend_hd, res, "binding search parameter for");
+      goto leave;
+    }
+
+  res = sqlite3_step (stmt);
+  if (res == SQLITE_ROW)
+    part->sqlite_rowid = sqlite3_column_int64 (stmt, 0);
+  else if (res == SQLITE_DONE)
+    err = gpg_error (GPG_ERR_EOF);
+  else
+    err = sqlite_error (backend_hd, res, "searching");
+
+ leave:
+  sqlite3_finalize (stmt);
+  return err;
+}
+
+
+
+/* Extract the mail address from the OpenPGP user id (UID,UIDLEN)
+ * the same way the keybox code does it and store it as a malloced
+ * lowercase string at R_ADDR.  If there is no mail address NULL is
+ * stored.  */
+static gpg_error_t
+addrspec_from_uid (const char *uid, size_t uidlen, char **r_addr)
+{
+  const char *s, *addr = NULL;
+  size_t len = 0;
+
+  *r_addr = NULL;
+  s = memchr (uid, '<', uidlen);
+  if (s)
+    {
+      addr = s + 1;
+      s = memchr (addr, '>', uidlen - (addr - uid));
+      if (!s || s == addr)
+        return 0;  /* Not a proper mail address.  */
+      len = s - addr;
+    }
+  else if (is_valid_mailbox_mem (uid, uidlen))
+    {
+      addr = uid;
+      len = uidlen;
+    }
+  else
+    return 0;
+
+  *r_addr = xtrymalloc (len + 1);
+  if (!*r_addr)
+    return gpg_error_from_syserror ();
+  memcpy (*r_addr, addr, len);
+  (*r_addr)[len] = 0;
+  ascii_strlwr (*r_addr);
+  return 0;
+}
+
+
+/* The statements used to store the metadata of a key.  */
+struct store_stmts_s
+{
+  sqlite3_stmt *fpr;
+  sqlite3_stmt *uid;
+  sqlite3_stmt *fts;
+};
+
+
+/* Store the fingerprint FPR along with the keyid and the keygrip
+ * GRIP (which may be NULL) for the pubkey PKID.  */
+static gpg_error_t
+store_fingerprint (backend_handle_t hd, struct store_stmts_s *st,
+                   sqlite3_int64 pkid, int subkey,
+                   const unsigned char *fpr, int fprlen,
+                   const unsigned char *keyid, const unsigned char *grip)
+{
+  sqlite3_bind_blob (st->fpr, 1, fpr, fprlen, SQLITE_STATIC);
+  sqlite3_bind_int64 (st->fpr, 2, buf32_to_u32 (keyid));
+  sqlite3_bind_int64 (st->fpr, 3, buf32_to_u32 (keyid+4));
+  if (grip)
+    sqlite3_bind_blob (st->fpr, 4, grip, KEYGRIP_LEN, SQLITE_STATIC);
+  sqlite3_bind_int (st->fpr, 5, subkey);
+  sqlite3_bind_int64 (st->fpr, 6, pkid);
+  return step_and_reset (hd, st->fpr);
+}
+
+
+/* Store the user id (UID,UIDLEN) with the mail address ADDR (which
+ * may be NULL) for the pubkey PKID.  */
+static gpg_error_t
+store_userid (backend_handle_t hd, struct store_stmts_s *st,
+              sqlite3_int64 pkid, const char *uid, size_t uidlen,
+              const char *addr)
+{
+  gpg_error_t err;
+  sqlite3_int64 rowid;
+
+  sqlite3_bind_text (st->uid, 1, uid, uidlen, SQLITE_STATIC);
+  if (addr)
+    sqlite3_bind_text (st->uid, 2, addr, -1, SQLITE_STATIC);
+  sqlite3_bind_int64 (st->uid, 3, pkid);
+  err = step_and_reset (hd, st->uid);
+  if (err || !st->fts)
+    return err;
+
+  rowid = sqlite3_last_insert_rowid (hd->db);
+  sqlite3_bind_int64 (st->fts, 1, rowid);
+  sqlite3_bind_text (st->fts, 2, uid, uidlen, SQLITE_STATIC);
+  if (addr)
+    sqlite3_bind_text (st->fts, 3, addr, -1, SQLITE_STATIC);
+  return step_and_reset (hd, st->fts);
+}
+
+
+/* Store the metadata of the OpenPGP keyblock (BLOB,BLOBLEN) for the
+ * pubkey PKID.  */
+static gpg_error_t
+store_openpgp_meta (backend_handle_t hd, struct store_stmts_s *st,
+                    sqlite3_int64 pkid, const void *blob, size_t bloblen)
+{
+  gpg_error_t err;
+  struct _keybox_openpgp_info info;
+  struct _keybox_openpgp_key_info *k;
+  struct _keybox_openpgp_uid_info *u;
+  int subkey;
+  char *addr;
+
+  err = _keybox_parse_openpgp (blob, bloblen, NULL, &info);
+  if (err)
+    {
+      log_info ("error parsing OpenPGP blob: %s\n", gpg_strerror (err));
+      return gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+    }
+
+  err = store_fingerprint (hd, st, pkid, 0, info.primary.fpr,
+                           info.primary.fprlen, info.primary.keyid,
+                           info.primary.grip);
+  if (!err && info.nsubkeys)
+    for (k = &info.subkeys, subkey = 1; k && !err; k = k->next, subkey++)
+      err = store_fingerprint (hd, st, pkid, subkey, k->fpr, k->fprlen,
+                               k->keyid, k->grip);
+
+  if (!err && info.nuids)
+    for (u = &info.uids; u && !err; u = u->next)
+      {
+        const char *uid = (const char *)blob + u->off;
+
+        err = addrspec_from_uid (uid, u->len, &addr);
+        if (!err)
+          err = store_userid (hd, st, pkid, uid, u->len, addr);
+        xfree (addr);
+      }
+
+  _keybox_destroy_openpgp_info (&info);
+  return err;
+}
+
+
+/* Parse the X.509 certificate (BLOB,BLOBLEN) and return the issuer
+ * and the serial number.  The caller must release the certificate
+ * object stored at R_CERT.  */
+static gpg_error_t
+parse_x509 (const void *blob, size_t bloblen, ksba_cert_t *r_cert,
+            char **r_issuer, ksba_sexp_t *r_serial,
+            const unsigned char **r_sn, size_t *r_snlen)
+{
+  gpg_error_t err;
+  ksba_cert_t cert;
+  ksba_sexp_t serial;
+  const unsigned char *s;
+  size_t n, len;
+
+  *r_cert = NULL;
+  *r_issuer = NULL;
+  *r_serial = NULL;
+  *r_sn = NULL;
+  *r_snlen = 0;
+
+  err = ksba_cert_new (&cert);
+  if (err)
+    return err;
+  err = ksba_cert_init_from_mem (cert, blob, bloblen);
+  if (err)
+    {
+      ksba_cert_release (cert);
+      return err;
+    }
+  *r_cert = cert;
+  *r_issuer = ksba_cert_get_issuer (cert, 0);
+
+  serial = ksba_cert_get_serial (cert);
+  if (serial)
+    {
+      /* The serial is a canonical S-expression "(N:...)".  */
+      s = serial;
+      n = gcry_sexp_canon_len (s, 0, NULL, NULL);
+      if (n < 2)
+        {
+          ksba_free (serial);
+          return gpg_error (GPG_ERR_INV_CERT_OBJ);
+        }
+      s++; n--;
+      for (len=0; n && *s && *s != ':' && digitp (s); n--, s++)
+        len = len*10 + atoi_1 (s);
+      if (*s != ':' || len >= n)
+        {
+          ksba_free (serial);
+          return gpg_error (GPG_ERR_INV_CERT_OBJ);
+        }
+      *r_serial = serial;
+      *r_sn = s + 1;
+      *r_snlen = len;
+    }
+
+  return 0;
+}
+
+
+/* Store the metadata of the X.509 certificate CERT given as
+ * (BLOB,BLOBLEN) for the pubkey PKID.  */
+static gpg_error_t
+store_x509_meta (backend_handle_t hd, struct store_stmts_s *st,
+                 sqlite3_int64 pkid, ksba_cert_t cert,
+                 const void *blob, size_t bloblen)
+{
+  gpg_error_t err;
+  unsigned char fpr[20];
+  unsigned char grip[KEYGRIP_LEN];
+  int have_grip;
+  char *name, *addr;
+  size_t len;
+  int idx;
+
+  /* As in the keybox the keyid is taken from the fingerprint.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, fpr, blob, bloblen);
+  have_grip = !_keybox_x509_get_grip (blob, bloblen, grip);
+  err = store_fingerprint (hd, st, pkid, 0, fpr, 20, fpr + 12,
+                           have_grip? grip : NULL);
+
+  for (idx=0; !err && (name = ksba_cert_get_subject (cert, idx)); idx++)
+    {
+      addr = NULL;
+      len = strlen (name);
+      if (idx && len > 2 && *name == '<' && name[len-1] == '>')
+        {
+          addr = xtrymalloc (len - 1);
+          if (!addr)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (addr, name + 1, len - 2);
+              addr[len-2] = 0;
+              ascii_strlwr (addr);
+            }
+        }
+      if (!err)
+        err = store_userid (hd, st, pkid, name, len, addr);
+      xfree (addr);
+      ksba_free (name);
+    }
+
+  return err;
+}
+
+
+/* Delete the metadata of the pubkey PKID.  */
+static gpg_error_t
+delete_meta (backend_handle_t hd, sqlite3_int64 pkid)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt = NULL;
+  static const char *sqls[] =
+    {
+     "DELETE FROM useridfts WHERE rowid IN"
+     " (SELECT rowid FROM userid WHERE pkid = ?)",
+     "DELETE FROM userid WHERE pkid = ?",
+     "DELETE FROM fingerprint WHERE pkid = ?",
+     NULL
+    };
+  int i;
+
+  for (i = hd->have_fts? 0 : 1; sqls[i]; i++)
+    {
+      err = prepare_sql (hd, sqls[i], &stmt);
+      if (err)
+        return err;
+      sqlite3_bind_int64 (stmt, 1, pkid);
+      err = step_and_reset (hd, stmt);
+      sqlite3_finalize (stmt);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Insert or update (BLOB,BLOBLEN) of type PKTYPE.  If UPDATE is set
+ * the key with the same primary fingerprint is replaced.  All
+ * changes are done in a single transaction.  */
+static gpg_error_t
+store_blob (backend_handle_t hd, enum pubkey_types pktype,
+            const void *blob, size_t bloblen, int update)
+{
+  gpg_error_t err;
+  struct store_stmts_s st = { NULL, NULL, NULL };
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 pkid = 0;
+  unsigned char ubid[20];
+  char fpr[32];
+  unsigned int fprlen;
+  enum pubkey_types dummy;
+  ksba_cert_t cert = NULL;
+  char *issuer = NULL;
+  ksba_sexp_t serial = NULL;
+  const unsigned char *sn = NULL;
+  size_t snlen = 0;
+  int res, in_transaction = 0;
+
+  if (hd->readonly)
+    return gpg_error (GPG_ERR_EACCES);
+
+  if (pktype == PUBKEY_TYPE_X509)
+    {
+      err = parse_x509 (blob, bloblen, &cert, &issuer, &serial, &sn, &snlen);
+      if (err)
+        goto leave;
+    }
+  else if (pktype != PUBKEY_TYPE_OPGP)
+    {
+      err = gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+      goto leave;
+    }
+
+  gcry_md_hash_buffer (GCRY_MD_SHA1, ubid, blob, bloblen);
+
+  /* Within a batch a savepoint lets us undo just this store.  */
+  err = run_sql (hd, hd->in_batch? "SAVEPOINT store" : "BEGIN IMMEDIATE");
+  if (err)
+    goto leave;
+  in_transaction = 1;
+
+  if (update)
+    {
+      err = be_fingerprint_from_blob (blob, bloblen, &dummy, fpr, &fprlen);
+      if (err)
+        goto leave;
+      err = prepare_sql (hd, "SELECT pkid FROM fingerprint WHERE fpr = ?"
+                         " ORDER BY subkey LIMIT 1", &stmt);
+      if (err)
+        goto leave;
+      sqlite3_bind_blob (stmt, 1, fpr, fprlen, SQLITE_STATIC);
+      res = sqlite3_step (stmt);
+      if (res == SQLITE_ROW)
+        pkid = sqlite3_column_int64 (stmt, 0);
+      else if (res == SQLITE_DONE)
+        err = gpg_error (GPG_ERR_NOT_FOUND);
+      else
+        err = sqlite_error (hd, res, "searching");
+      sqlite3_finalize (stmt);
+      stmt = NULL;
+      if (err)
+        goto leave;
+
+      err = delete_meta (hd, pkid);
+      if (err)
+        goto leave;
+      /* Update in place to keep the order of the keys.  */
+      err = prepare_sql (hd, "UPDATE pubkey SET ubid = ?, type = ?,"
+                         " keyblob = ?, issuer = ?, sn = ?"
+                         " WHERE rowid = ?", &stmt);
+    }
+  else
+    err = prepare_sql (hd, "INSERT INTO pubkey (ubid, type, keyblob,"
+                       " issuer, sn) VALUES (?, ?, ?, ?, ?)", &stmt);
+  if (err)
+    goto leave;
+  sqlite3_bind_blob (stmt, 1, ubid, 20, SQLITE_STATIC);
+  sqlite3_bind_int (stmt, 2, pktype);
+  sqlite3_bind_blob (stmt, 3, blob, bloblen, SQLITE_STATIC);
+  if (issuer)
+    sqlite3_bind_text (stmt, 4, issuer, -1, SQLITE_STATIC);
+  if (sn)
+    sqlite3_bind_blob (stmt, 5, sn, snlen, SQLITE_STATIC);
+  if (update)
+    sqlite3_bind_int64 (stmt, 6, pkid);
+  err = step_and_reset (hd, stmt);
+  if (err)
+    goto leave;
+  if (!update)
+    pkid = sqlite3_last_insert_rowid (hd->db);
+
+  err = prepare_sql (hd, "INSERT INTO fingerprint (fpr, kidh, kidl, keygrip,"
+                     " subkey, pkid) VALUES (?, ?, ?, ?, ?, ?)", &st.fpr);
+  if (!err)
+    err = prepare_sql (hd, "INSERT INTO userid (uid, addrspec, pkid)"
+                       " VALUES (?, ?, ?)", &st.uid);
+  if (!err && hd->have_fts)
+    err = prepare_sql (hd, "INSERT INTO useridfts (rowid, uid, addrspec)"
+                       " VALUES (?, ?, ?)", &st.fts);
+  if (err)
+    goto leave;
+
+  if (pktype == PUBKEY_TYPE_X509)
+    err = store_x509_meta (hd, &st, pkid, cert, blob, bloblen);
+  else
+    err = store_openpgp_meta (hd, &st, pkid, blob, bloblen);
+  if (err)
+    goto leave;
+
+  err = run_sql (hd, hd->in_batch? "RELEASE store" : "COMMIT");
+  if (!err)
+    in_transaction = 0;
+
+ leave:
+  if (in_transaction && hd->in_batch)
+    sqlite3_exec (hd->db, "ROLLBACK TO store; RELEASE store",
+                  NULL, NULL, NULL);
+  else if (in_transaction)
+    sqlite3_exec (hd->db, "ROLLBACK", NULL, NULL, NULL);
+  sqlite3_finalize (stmt);
+  sqlite3_finalize (st.fpr);
+  sqlite3_finalize (st.uid);
+  sqlite3_finalize (st.fts);
+  ksba_free (issuer);
+  ksba_free (serial);
+  ksba_cert_release (cert);
+  return err;
+}
+
+
+/* Start a batch of stores.  All following inserts and updates up to
+ * be_sqlite_end_batch are done in one transaction so that they are
+ * committed and synced to disk only once.  A failed store is rolled
+ * back without affecting the others.  */
+gpg_error_t
+be_sqlite_begin_batch (backend_handle_t backend_hd)
+{
+  gpg_error_t err;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+  log_assert (!backend_hd->in_batch);
+
+  if (backend_hd->readonly)
+    return gpg_error (GPG_ERR_EACCES);
+
+  err = run_sql (backend_hd, "BEGIN IMMEDIATE");
+  if (!err)
+    backend_hd->in_batch = 1;
+  return err;
+}
+
+
+/* Commit the batch started by be_sqlite_begin_batch.  On error
+ * nothing of the batch is stored.  This is a nop if no batch has
+ * been started.  */
+gpg_error_t
+be_sqlite_end_batch (backend_handle_t backend_hd)
+{
+  gpg_error_t err;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+
+  if (!backend_hd->in_batch)
+    return 0;
+  backend_hd->in_batch = 0;
+
+  err = run_sql (backend_hd, "COMMIT");
+  if (err)
+    sqlite3_exec (backend_hd->db, "ROLLBACK", NULL, NULL, NULL);
+  return err;
+}
+
+
+/* Insert (BLOB,BLOBLEN) into the database.  BACKEND_HD is the handle
+ * for this backend and REQUEST is the current database request
+ * object.  */
+gpg_error_t
+be_sqlite_insert (ctrl_t ctrl, backend_handle_t backend_hd,
+                  db_request_t request, enum pubkey_types pktype,
+                  const void *blob, size_t bloblen)
+{
+  (void)ctrl;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+  log_assert (request);
+
+  return store_blob (backend_hd, pktype, blob, bloblen, 0);
+}
+
+
+/* Update (BLOB,BLOBLEN) in the database.  BACKEND_HD is the handle
+ * for this backend and REQUEST is the current database request
+ * object.  The key to update is located using the primary
+ * fingerprint of the blob.  */
+gpg_error_t
+be_sqlite_update (ctrl_t ctrl, backend_handle_t backend_hd,
+                  db_request_t request, enum pubkey_types pktype,
+                  const void *blob, size_t bloblen)
+{
+  (void)ctrl;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
+  log_assert (request);
+
+  return store_blob (backend_hd, pktype, blob, bloblen, 1);
+}
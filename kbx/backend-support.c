@@ -28,6 +28,7 @@
 #include "../common/i18n.h"
 #include "../common/asshelp.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 #include "backend.h"
 #include "keybox-defs.h"
 
@@ -51,6 +52,7 @@ strdbtype (enum database_types t)
     case DB_TYPE_NONE: return "none";
     case DB_TYPE_CACHE:return "cache";
     case DB_TYPE_KBX:  return "keybox";
+    case DB_TYPE_SQLITE: return "sqlite";
     }
   return "?";
 }
@@ -87,6 +89,11 @@ be_generic_release_backend (ctrl_t ctrl, backend_handle_t hd)
     case DB_TYPE_KBX:
       be_kbx_release_resource (ctrl, hd);
       break;
+#ifdef USE_SQLITE
+    case DB_TYPE_SQLITE:
+      be_sqlite_release_resource (ctrl, hd);
+      break;
+#endif
     default:
       log_error ("%s: faulty backend handle of type %d given\n",
                  __func__, hd->db_type);
@@ -164,6 +171,20 @@ be_return_pubkey (ctrl_t ctrl, const void *buffer, size_t buflen,
 
   if (ctrl->no_data_return)
     err = 0;
+  else if (ctrl->multi_search)
+    {
+      /* Prefix the blob with the index of the search description,
+       * the pubkey type and the length of the blob so that the
+       * client is able to split the concatenated data lines.  */
+      unsigned char hdr[12];
+
+      ulongtobuf (hdr, ctrl->multi_search_idx);
+      ulongtobuf (hdr+4, pubkey_type);
+      ulongtobuf (hdr+8, buflen);
+      err = kbxd_write_data_line (ctrl, hdr, 12);
+      if (!err)
+        err = kbxd_write_data_line (ctrl, buffer, buflen);
+    }
   else
     err = kbxd_write_data_line(ctrl, buffer, buflen);
 
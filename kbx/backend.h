@@ -32,7 +32,8 @@ enum database_types
   {
    DB_TYPE_NONE,   /* No database at all (unitialized etc.).  */
    DB_TYPE_CACHE,  /* The cache backend (backend-cache.c).    */
-   DB_TYPE_KBX     /* Keybox type database (backend-kbx.c).   */
+   DB_TYPE_KBX,    /* Keybox type database (backend-kbx.c).   */
+   DB_TYPE_SQLITE  /* SQLite type database (backend-sqlite.c).*/
   };
 
 
@@ -63,6 +64,10 @@ struct db_request_part_s
     unsigned int grip;
     unsigned int ubid;
   } cache_seqno;
+
+  /* For the SQLITE backend the rowid of the last found key; the next
+   * search continues after that key.  */
+  long long sqlite_rowid;
 };
 typedef struct db_request_part_s *db_request_part_t;
 
@@ -123,6 +128,11 @@ void be_cache_pubkey (ctrl_t ctrl, const unsigned char *ubid,
                       enum pubkey_types pubkey_type);
 void be_cache_not_found (ctrl_t ctrl, enum pubkey_types pubkey_type,
                          KEYDB_SEARCH_DESC *desc, unsigned int ndesc);
+void be_cache_invalidate (ctrl_t ctrl, const void *blob, unsigned int bloblen,
+                          enum pubkey_types pubkey_type);
+char *be_cache_get_stats (void);
+unsigned int be_cache_get_recent_ubids (unsigned char *ubids,
+                                       unsigned int maxubids);
 
 
 /*-- backend-kbx.c --*/
@@ -147,4 +157,25 @@ gpg_error_t be_kbx_update (ctrl_t ctrl, backend_handle_t backend_hd,
                            const void *blob, size_t bloblen);
 
 
+/*-- backend-sqlite.c --*/
+gpg_error_t be_sqlite_add_resource (ctrl_t ctrl, backend_handle_t *r_hd,
+                                    const char *filename, int readonly);
+void be_sqlite_release_resource (ctrl_t ctrl, backend_handle_t hd);
+
+gpg_error_t be_sqlite_search (ctrl_t ctrl, backend_handle_t hd,
+                              db_request_t request,
+                              KEYDB_SEARCH_DESC *desc, unsigned int ndesc);
+gpg_error_t be_sqlite_seek (ctrl_t ctrl, backend_handle_t backend_hd,
+                            db_request_t request, const unsigned char *ubid,
+                            const unsigned char *fpr, unsigned int fprlen);
+gpg_error_t be_sqlite_begin_batch (backend_handle_t backend_hd);
+gpg_error_t be_sqlite_end_batch (backend_handle_t backend_hd);
+gpg_error_t be_sqlite_insert (ctrl_t ctrl, backend_handle_t backend_hd,
+                              db_request_t request, enum pubkey_types pktype,
+                              const void *blob, size_t bloblen);
+gpg_error_t be_sqlite_update (ctrl_t ctrl, backend_handle_t backend_hd,
+                              db_request_t request, enum pubkey_types pktype,
+                              const void *blob, size_t bloblen);
+
+
 #endif /*KBX_BACKEND_H*/
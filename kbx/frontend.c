@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <npth.h>
 
 #include "keyboxd.h"
 #include <assuan.h>
@@ -30,6 +32,7 @@
 #include "../common/userids.h"
 #include "backend.h"
 #include "frontend.h"
+#include "replicate.h"
 
 
 /* An object to describe a single database.  */
@@ -45,15 +48,50 @@ typedef struct db_desc_s *db_desc_t;
 static db_desc_t databases;
 static unsigned int no_of_databases;
 
+/* The lock protecting the databases.  Searches take a read lock and
+ * may thus run concurrently; a store requires the write lock.  Note
+ * that a search may pass control to other threads while it sends
+ * data back to the client.  We can't use static initialization, as
+ * that is not available through w32-pth.  */
+static npth_rwlock_t database_lock;
+static int database_lock_initialized;
+
 
 
 
+/* Helper to initialize the database lock on first use.  */
+static void
+init_database_lock (void)
+{
+  int res;
+
+  if (database_lock_initialized)
+    return;
+
+  res = npth_rwlock_init (&database_lock, NULL);
+  if (res)
+    log_fatal ("can't initialize the database lock: %s\n", strerror (res));
+  database_lock_initialized = 1;
+}
+
+
 /* Take a lock for reading the databases.  */
 static void
 take_read_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  init_database_lock ();
+  res = npth_rwlock_tryrdlock (&database_lock);
+  if (res == EBUSY)
+    {
+      ctrl->stats.lock_waits++;
+      res = npth_rwlock_rdlock (&database_lock);
+    }
+  if (res)
+    log_fatal ("can't acquire read lock on the databases: %s\n",
+               strerror (res));
+  ctrl->db_lock = 1;
 }
 
 
@@ -61,8 +99,19 @@ take_read_lock (ctrl_t ctrl)
 static void
 take_read_write_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  init_database_lock ();
+  res = npth_rwlock_trywrlock (&database_lock);
+  if (res == EBUSY)
+    {
+      ctrl->stats.lock_waits++;
+      res = npth_rwlock_wrlock (&database_lock);
+    }
+  if (res)
+    log_fatal ("can't acquire write lock on the databases: %s\n",
+               strerror (res));
+  ctrl->db_lock = 2;
 }
 
 
@@ -71,8 +120,15 @@ take_read_write_lock (ctrl_t ctrl)
 static void
 release_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  if (!ctrl->db_lock)
+    return;
+
+  res = npth_rwlock_unlock (&database_lock);
+  if (res)
+    log_fatal ("can't release lock on the databases: %s\n", strerror (res));
+  ctrl->db_lock = 0;
 }
 
 
@@ -122,6 +178,8 @@ kbxd_add_resource  (ctrl_t ctrl, const char *filename_arg, int readonly)
     ; /* We already know it.  */
   else if (n > 4 && !strcmp (filename + n - 4, ".kbx"))
     db_type = DB_TYPE_KBX;
+  else if (n > 3 && !strcmp (filename + n - 3, ".db"))
+    db_type = DB_TYPE_SQLITE;
   else
     {
       log_error (_("can't use file '%s': %s\n"), filename, _("unknown suffix"));
@@ -142,6 +200,16 @@ kbxd_add_resource  (ctrl_t ctrl, const char *filename_arg, int readonly)
     case DB_TYPE_KBX:
       err = be_kbx_add_resource (ctrl, &handle, filename, readonly);
       break;
+
+    case DB_TYPE_SQLITE:
+#ifdef USE_SQLITE
+      err = be_sqlite_add_resource (ctrl, &handle, filename, readonly);
+#else
+      log_error (_("can't use file '%s': %s\n"), filename,
+                 _("SQLite support not available"));
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif
+      break;
     }
   if (err)
     goto leave;
@@ -246,6 +314,8 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
     }
 
   take_read_lock (ctrl);
+  if (desc)
+    ctrl->stats.searches++;
 
   /* Allocate a handle object if none exists for this context.  */
   if (!ctrl->opgp_req)
@@ -281,6 +351,15 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
             case DB_TYPE_KBX:
               err = be_kbx_search (ctrl, db->backend_handle, request, NULL, 0);
               break;
+
+            case DB_TYPE_SQLITE:
+#ifdef USE_SQLITE
+              err = be_sqlite_search (ctrl, db->backend_handle, request,
+                                      NULL, 0);
+#else
+              err = 0;
+#endif
+              break;
             }
           if (err)
             {
@@ -309,9 +388,11 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
   if (!(dbidx < no_of_databases))
     {
       /* All databases have been searched.  Put the non-found mark
-       * into the cache for all descriptors.
+       * into the cache for all descriptors unless this was the end
+       * of a search which found something.
        * FIXME: We need to see which pubkey type we need to insert.  */
-      be_cache_not_found (ctrl, PUBKEY_TYPE_UNKNOWN, desc, ndesc);
+      if (!request->any_found)
+        be_cache_not_found (ctrl, PUBKEY_TYPE_UNKNOWN, desc, ndesc);
       err = gpg_error (GPG_ERR_NOT_FOUND);
       goto leave;
     }
@@ -352,6 +433,29 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
       if (start_at_ubid && gpg_err_code (err) == GPG_ERR_EOF)
         be_cache_mark_final (ctrl, request);
       break;
+
+    case DB_TYPE_SQLITE:
+#ifdef USE_SQLITE
+      if (start_at_ubid)
+        {
+          /* We need to set the startpoint for the search.  */
+          err = be_sqlite_seek (ctrl, db->backend_handle, request,
+                                request->last_cached_ubid, NULL, 0);
+          if (err)
+            {
+              log_debug ("%s: seeking %s to an UBID failed: %s\n",
+                         __func__, strdbtype (db->db_type), gpg_strerror (err));
+              break;
+            }
+        }
+      err = be_sqlite_search (ctrl, db->backend_handle, request,
+                              desc, ndesc);
+      if (start_at_ubid && gpg_err_code (err) == GPG_ERR_EOF)
+        be_cache_mark_final (ctrl, request);
+#else
+      err = gpg_error (GPG_ERR_INTERNAL);
+#endif
+      break;
     }
 
   if (DBG_LOOKUP)
@@ -378,6 +482,8 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
 
 
  leave:
+  if (!err && desc)
+    ctrl->stats.found++;
   release_lock (ctrl);
   if (DBG_CLOCK)
     log_clock ("%s: leave (%s)", __func__, err? "not found" : "found");
@@ -386,54 +492,43 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
 
 
 
-/* Store; that is insert or update the key (BLOB,BLOBLEN).  If
- * ONLY_UPDATE is set the key must exist.  */
-gpg_error_t
-kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen, int only_update)
+/* Store the key (BLOB,BLOBLEN) for CTRL into the database DB.  This
+ * is the worker for kbxd_store; the caller must hold the write
+ * lock.  */
+static gpg_error_t
+store_one (ctrl_t ctrl, db_desc_t db,
+           const void *blob, size_t bloblen, int only_update)
 {
   gpg_error_t err;
   db_request_t request;
-  unsigned int dbidx;
-  db_desc_t db;
   char fpr[32];
   unsigned int fprlen;
   enum pubkey_types pktype;
   int insert = 0;
 
-  if (DBG_CLOCK)
-    log_clock ("%s: enter", __func__);
-
-  take_read_write_lock (ctrl);
+  ctrl->stats.stores++;
 
   /* Allocate a handle object if none exists for this context.  */
   if (!ctrl->opgp_req)
     {
       ctrl->opgp_req = xtrycalloc (1, sizeof *ctrl->opgp_req);
       if (!ctrl->opgp_req)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
+        return gpg_error_from_syserror ();
     }
   request = ctrl->opgp_req;
 
   /* Check whether to insert or update.  */
   err = be_fingerprint_from_blob (blob, bloblen, &pktype, fpr, &fprlen);
   if (err)
-    goto leave;
-
-  /* FIXME: We force the use of the KBX backend.  */
-  for (dbidx=0; dbidx < no_of_databases; dbidx++)
-    if (databases[dbidx].db_type == DB_TYPE_KBX)
-      break;
-  if (!(dbidx < no_of_databases))
-    {
-      err = gpg_error (GPG_ERR_NOT_INITIALIZED);
-      goto leave;
-    }
-  db = databases + dbidx;
+    return err;
 
-  err = be_kbx_seek (ctrl, db->backend_handle, request, NULL, fpr, fprlen);
+#ifdef USE_SQLITE
+  if (db->db_type == DB_TYPE_SQLITE)
+    err = be_sqlite_seek (ctrl, db->backend_handle, request,
+                          NULL, fpr, fprlen);
+  else
+#endif
+    err = be_kbx_seek (ctrl, db->backend_handle, request, NULL, fpr, fprlen);
   if (!err)
     ; /* Found - need to update.  */
   else if (gpg_err_code (err) == GPG_ERR_EOF)
@@ -442,25 +537,368 @@ kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen, int only_update)
     {
       log_debug ("%s: searching fingerprint failed: %s\n",
                  __func__, gpg_strerror (err));
-      goto leave;
+      return err;
     }
 
   if (insert)
     {
-      err = be_kbx_insert (ctrl, db->backend_handle, request,
-                           pktype, blob, bloblen);
+#ifdef USE_SQLITE
+      if (db->db_type == DB_TYPE_SQLITE)
+        err = be_sqlite_insert (ctrl, db->backend_handle, request,
+                                pktype, blob, bloblen);
+      else
+#endif
+        err = be_kbx_insert (ctrl, db->backend_handle, request,
+                             pktype, blob, bloblen);
     }
   else if (only_update)
     err = gpg_error (GPG_ERR_DUP_KEY);
   else /* Update.  */
     {
-      err = be_kbx_update (ctrl, db->backend_handle, request,
-                           pktype, blob, bloblen);
+#ifdef USE_SQLITE
+      if (db->db_type == DB_TYPE_SQLITE)
+        err = be_sqlite_update (ctrl, db->backend_handle, request,
+                                pktype, blob, bloblen);
+      else
+#endif
+        err = be_kbx_update (ctrl, db->backend_handle, request,
+                             pktype, blob, bloblen);
     }
 
+  /* Drop cached not-found marks and older versions of the key.  */
+  if (!err)
+    be_cache_invalidate (ctrl, blob, bloblen, pktype);
+
+  return err;
+}
+
+
+/* A store request waiting to be committed.  */
+struct store_item_s
+{
+  struct store_item_s *next;
+  ctrl_t ctrl;
+  const void *blob;
+  size_t bloblen;
+  int only_update;
+  int done;           /* The request has been processed.  */
+  gpg_error_t err;    /* The result of the request.  */
+};
+
+/* The queue of store requests, the lock and condition variable
+ * protecting it and a flag telling that a thread is committing a
+ * batch of requests.  */
+static struct store_item_s *store_queue;
+static struct store_item_s **store_queue_tail = &store_queue;
+static npth_mutex_t store_queue_lock;
+static npth_cond_t store_queue_cond;
+static int store_queue_initialized;
+static int store_committing;
+
+
+/* Process the list of store requests ITEMS in one go.  With an SQLite
+ * database all of them are stored in one transaction so that there
+ * is only one commit to disk.  CTRL is the control object of the
+ * committing thread.  */
+static void
+commit_store_batch (ctrl_t ctrl, struct store_item_s *items)
+{
+  gpg_error_t err;
+  struct store_item_s *item;
+  unsigned int dbidx;
+  db_desc_t db;
+  int batch = 0;
+
+  take_read_write_lock (ctrl);
+
+  /* We store into the first KBX or SQLITE backend.  */
+  for (dbidx=0; dbidx < no_of_databases; dbidx++)
+    if (databases[dbidx].db_type == DB_TYPE_KBX
+        || databases[dbidx].db_type == DB_TYPE_SQLITE)
+      break;
+  if (!(dbidx < no_of_databases))
+    {
+      err = gpg_error (GPG_ERR_NOT_INITIALIZED);
+      goto leave;
+    }
+  db = databases + dbidx;
+
+#ifdef USE_SQLITE
+  if (db->db_type == DB_TYPE_SQLITE && items->next)
+    {
+      err = be_sqlite_begin_batch (db->backend_handle);
+      if (err)
+        goto leave;
+      batch = 1;
+    }
+#endif
+
+  for (item = items; item; item = item->next)
+    item->err = store_one (item->ctrl, db, item->blob, item->bloblen,
+                           item->only_update);
+  err = 0;
+
+#ifdef USE_SQLITE
+  if (batch)
+    err = be_sqlite_end_batch (db->backend_handle);
+#else
+  (void)batch;
+#endif
+  if (DBG_CLOCK && items->next)
+    log_clock ("%s: committed a batch", __func__);
+
  leave:
+  if (err)
+    for (item = items; item; item = item->next)
+      if (!item->err)
+        item->err = err;
+  for (item = items; item; item = item->next)
+    if (!item->err)
+      kbxd_changelog_append (item->blob, item->bloblen);
   release_lock (ctrl);
+}
+
+
+/* Store; that is insert or update the key (BLOB,BLOBLEN).  If
+ * ONLY_UPDATE is set the key must exist.
+ *
+ * Requests arriving while another thread commits a batch are queued.
+ * When that commit is done one of the waiting threads takes all
+ * queued requests and commits them as the next batch.  Thus under
+ * load the stores of many clients share one transaction while a
+ * single store is not delayed.  */
+gpg_error_t
+kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen, int only_update)
+{
+  struct store_item_s item;
+  struct store_item_s *items;
+  int res;
+
+  if (DBG_CLOCK)
+    log_clock ("%s: enter", __func__);
+
+  if (!store_queue_initialized)
+    {
+      res = npth_mutex_init (&store_queue_lock, NULL);
+      if (!res)
+        res = npth_cond_init (&store_queue_cond, NULL);
+      if (res)
+        log_fatal ("can't initialize the store queue: %s\n", strerror (res));
+      store_queue_initialized = 1;
+    }
+
+  memset (&item, 0, sizeof item);
+  item.ctrl = ctrl;
+  item.blob = blob;
+  item.bloblen = bloblen;
+  item.only_update = only_update;
+
+  npth_mutex_lock (&store_queue_lock);
+  *store_queue_tail = &item;
+  store_queue_tail = &item.next;
+  while (!item.done && store_committing)
+    npth_cond_wait (&store_queue_cond, &store_queue_lock);
+  if (!item.done)
+    {
+      /* We are the next to commit; take all queued requests which
+       * includes our own.  */
+      store_committing = 1;
+      items = store_queue;
+      store_queue = NULL;
+      store_queue_tail = &store_queue;
+      npth_mutex_unlock (&store_queue_lock);
+
+      commit_store_batch (ctrl, items);
+
+      npth_mutex_lock (&store_queue_lock);
+      /* Note that ITEMS may not be accessed after DONE has been set
+       * because the waiting thread may then release it.  */
+      while (items)
+        {
+          struct store_item_s *next = items->next;
+
+          items->done = 1;
+          items = next;
+        }
+      store_committing = 0;
+      npth_cond_broadcast (&store_queue_cond);
+    }
+  npth_mutex_unlock (&store_queue_lock);
+
   if (DBG_CLOCK)
     log_clock ("%s: leave", __func__);
+  return item.err;
+}
+
+
+/* Return a malloced string with the statistics of the cache backend.
+ * See be_cache_get_stats for the format.  */
+char *
+kbxd_get_cache_stats (ctrl_t ctrl)
+{
+  char *result;
+
+  take_read_lock (ctrl);
+  result = be_cache_get_stats ();
+  release_lock (ctrl);
+  return result;
+}
+
+
+/* The name of the file in the public keys directory with the UBIDs
+ * of the recently used keys and the maximum number of UBIDs we
+ * store.  */
+#define HOTKEYS_FILE "hotkeys.lst"
+#define MAX_HOTKEYS  512
+
+
+/* Write the UBIDs of the most recently used keys of the cache to the
+ * hotkeys file so that kbxd_preload_hotkeys can fill the cache with
+ * them after a restart.  */
+gpg_error_t
+kbxd_save_hotkeys (void)
+{
+  gpg_error_t err;
+  unsigned char *ubids;
+  unsigned int n, nubids;
+  char hexubid[41];
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  estream_t fp = NULL;
+
+  /* Take a snapshot first because writing the file may pass control
+   * to other threads.  */
+  ubids = xtrymalloc (20 * MAX_HOTKEYS);
+  if (!ubids)
+    return gpg_error_from_syserror ();
+  nubids = be_cache_get_recent_ubids (ubids, MAX_HOTKEYS);
+  if (!nubids)
+    {
+      err = 0;
+      goto leave;
+    }
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             HOTKEYS_FILE, NULL);
+  if (!fname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  tmpfname = xtryasprintf ("%s" EXTSEP_S "tmp", fname);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  fp = es_fopen (tmpfname, "w,mode=-rw-------");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't create '%s': %s\n"), tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  es_fputs ("# UBIDs of the recently used keys; most recent first.\n", fp);
+  for (n = 0; n < nubids; n++)
+    {
+      bin2hex (ubids + 20 * n, 20, hexubid);
+      es_fprintf (fp, "%s\n", hexubid);
+    }
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  fp = NULL;
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      log_error (_("renaming '%s' to '%s' failed: %s\n"),
+                 tmpfname, fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  es_fclose (fp);
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (ubids);
   return err;
 }
+
+
+/* Read the hotkeys file written by kbxd_save_hotkeys and load the
+ * listed keys into the cache.  This is done by searching for each
+ * UBID without returning the data.  CTRL is a control object not
+ * used for a connection.  */
+void
+kbxd_preload_hotkeys (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  char *fname;
+  estream_t fp;
+  char line[256];
+  unsigned char *ubids = NULL;
+  unsigned int nubids = 0;
+  unsigned int nloaded = 0;
+  KEYDB_SEARCH_DESC desc;
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             HOTKEYS_FILE, NULL);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      goto leave;
+    }
+
+  ubids = xtrymalloc (20 * MAX_HOTKEYS);
+  if (!ubids)
+    goto leave;
+  while (nubids < MAX_HOTKEYS && es_fgets (line, sizeof line, fp))
+    {
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      if (hex2bin (line, ubids + 20 * nubids, 20) != 40 || line[40])
+        {
+          log_info ("%s: invalid line ignored\n", fname);
+          continue;
+        }
+      nubids++;
+    }
+  es_fclose (fp);
+
+  /* The file lists the most recently used key first; we load it last
+   * so that the order in the cache's LRU list is retained.  */
+  ctrl->no_data_return = 1;
+  while (nubids--)
+    {
+      memset (&desc, 0, sizeof desc);
+      desc.mode = KEYDB_SEARCH_MODE_UBID;
+      memcpy (desc.u.ubid, ubids + 20 * nubids, 20);
+      err = kbxd_search (ctrl, &desc, 1, 1);
+      if (!err)
+        nloaded++;
+      else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        {
+          log_info ("preloading a key failed: %s\n", gpg_strerror (err));
+          break;
+        }
+    }
+  ctrl->no_data_return = 0;
+  if (opt.verbose)
+    log_info ("%u recently used keys preloaded into the cache\n", nloaded);
+
+ leave:
+  xfree (ubids);
+  xfree (fname);
+}
@@ -33,6 +33,9 @@ gpg_error_t kbxd_search (ctrl_t ctrl,
                          int reset);
 gpg_error_t kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
                         int only_update);
+char *kbxd_get_cache_stats (ctrl_t ctrl);
+gpg_error_t kbxd_save_hotkeys (void);
+void kbxd_preload_hotkeys (ctrl_t ctrl);
 
 
 #endif /*KBX_FRONTEND_H*/
@@ -37,6 +37,7 @@
 #include "../common/asshelp.h"
 #include "../common/host2net.h"
 #include "frontend.h"
+#include "replicate.h"
 
 
 
@@ -163,8 +164,12 @@ kbxd_write_data_line (ctrl_t ctrl, const void *buffer_arg, size_t size)
   if (!ctx) /* Oops - no assuan context.  */
     return gpg_error (GPG_ERR_NOT_PROCESSED);
 
-  /* Write toa file descriptor if enabled.  */
-  if (ctrl && ctrl->server_local && ctrl->server_local->outstream)
+  ctrl->stats.data_bytes += size;
+
+  /* Write toa file descriptor if enabled.  With SEARCH --multi the
+   * records are always send as data lines.  */
+  if (ctrl && ctrl->server_local && ctrl->server_local->outstream
+      && !ctrl->multi_search)
     {
       unsigned char lenbuf[4];
 
@@ -276,27 +281,171 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 
+/* Append DESC to the list of search descriptions used for the next
+ * search.  */
+static gpg_error_t
+append_search_desc (ctrl_t ctrl, KEYBOX_SEARCH_DESC *desc)
+{
+  unsigned int n, k;
+
+  if (!ctrl->server_local->multi_search_desc_size)
+    {
+      n = 10;
+      ctrl->server_local->multi_search_desc
+        = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_desc);
+      if (!ctrl->server_local->multi_search_desc)
+        return gpg_error_from_syserror ();
+      ctrl->server_local->multi_search_desc_size = n;
+    }
+
+  if (ctrl->server_local->multi_search_desc_len
+      == ctrl->server_local->multi_search_desc_size)
+    {
+      KEYBOX_SEARCH_DESC *newdesc;
+      n = ctrl->server_local->multi_search_desc_size + 10;
+      newdesc = xtrycalloc (n, sizeof *newdesc);
+      if (!newdesc)
+        return gpg_error_from_syserror ();
+      for (k=0; k < ctrl->server_local->multi_search_desc_size; k++)
+        newdesc[k] = ctrl->server_local->multi_search_desc[k];
+      xfree (ctrl->server_local->multi_search_desc);
+      ctrl->server_local->multi_search_desc = newdesc;
+      ctrl->server_local->multi_search_desc_size = n;
+    }
+  /* Actually store.  */
+  ctrl->server_local->multi_search_desc
+    [ctrl->server_local->multi_search_desc_len++] = *desc;
+
+  return 0;
+}
+
+
+/* Parse the space separated and percent-plus escaped patterns given
+ * to SEARCH --multi and append them to the list of search
+ * descriptions.  LINE is modified.  */
+static gpg_error_t
+parse_multi_patterns (assuan_context_t ctx, ctrl_t ctrl, char *line)
+{
+  gpg_error_t err;
+  KEYBOX_SEARCH_DESC desc;
+  char *p;
+
+  if (!*line)
+    return set_error (GPG_ERR_INV_ARG, "--multi but no pattern");
+
+  while (*line)
+    {
+      for (p = line; *p && !spacep (p); p++)
+        ;
+      if (*p)
+        *p++ = 0;
+      while (spacep (p))
+        p++;
+
+      percent_plus_unescape_inplace (line, 0);
+      err = classify_user_id (line, &desc, 0);
+      if (err)
+        return err;
+      err = append_search_desc (ctrl, &desc);
+      if (err)
+        return err;
+
+      line = p;
+    }
+
+  return 0;
+}
+
+
+/* Run the search for SEARCH --multi.  Each of the stored search
+ * descriptions is processed on its own and all matches are returned;
+ * the records are tagged with the index of the description.  */
+static gpg_error_t
+do_multi_search (ctrl_t ctrl)
+{
+  gpg_error_t err = 0;
+  KEYBOX_SEARCH_DESC *desc;
+  unsigned int k;
+
+  ctrl->multi_search = 1;
+  for (k=0; !err && k < ctrl->server_local->multi_search_desc_len; k++)
+    {
+      desc = ctrl->server_local->multi_search_desc + k;
+      ctrl->multi_search_idx = k;
+      err = kbxd_search (ctrl, desc, 1, 1);
+      while (!err)
+        {
+          if (desc->mode == KEYDB_SEARCH_MODE_FIRST)
+            desc->mode = KEYDB_SEARCH_MODE_NEXT;
+          err = kbxd_search (ctrl, desc, 1, 0);
+        }
+      if (gpg_err_code (err) == GPG_ERR_NOT_FOUND
+          || gpg_err_code (err) == GPG_ERR_EOF)
+        err = 0;
+    }
+  ctrl->multi_search = 0;
+  ctrl->multi_search_idx = 0;
+
+  return err;
+}
+
+
 static const char hlp_search[] =
   "SEARCH [--no-data] [[--more] PATTERN]\n"
+  "SEARCH --multi [--no-data] [--more] PATTERNS\n"
   "\n"
   "Search for the keys identified by PATTERN.  With --more more\n"
   "patterns to be used for the search are expected with the next\n"
   "command.  With --no-data only the search status is returned but\n"
-  "not the actual data.  See also \"NEXT\".";
+  "not the actual data.  See also \"NEXT\".\n"
+  "\n"
+  "With --multi a batch of lookups is done in one go: PATTERNS is a\n"
+  "space separated list of percent-plus escaped patterns and --more\n"
+  "may be used to send further patterns with the next commands.  All\n"
+  "keys matching any of the patterns are returned using data lines;\n"
+  "each key is prefixed by three 4 byte big endian integers with the\n"
+  "index of the pattern, the pubkey type and the length of the key.\n"
+  "A PUBKEY_INFO status line is emitted for each key.  \"NEXT\" may\n"
+  "not be used after --multi.";
 static gpg_error_t
 cmd_search (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  int opt_more, opt_no_data;
+  int opt_more, opt_no_data, opt_multi;
   gpg_error_t err;
-  unsigned int n, k;
 
   opt_no_data = has_option (line, "--no-data");
   opt_more = has_option (line, "--more");
+  opt_multi = has_option (line, "--multi");
   line = skip_options (line);
 
   ctrl->server_local->search_any_found = 0;
 
+  if (opt_multi)
+    {
+      if (!ctrl->server_local->search_expecting_more)
+        ctrl->server_local->multi_search_desc_len = 0;
+      err = parse_multi_patterns (ctx, ctrl, line);
+      if (err)
+        goto leave;
+      if (opt_more)
+        {
+          ctrl->server_local->search_expecting_more = 1;
+          goto leave;
+        }
+      ctrl->server_local->search_expecting_more = 0;
+
+      ctrl->server_local->inhibit_data_logging = 1;
+      ctrl->server_local->inhibit_data_logging_now = 0;
+      ctrl->server_local->inhibit_data_logging_count = 0;
+      ctrl->no_data_return = opt_no_data;
+      err = do_multi_search (ctrl);
+      /* The descriptions have been used up; thus NEXT is not
+       * possible and we clear them right away.  */
+      ctrl->server_local->multi_search_desc_len = 0;
+      goto leave;
+    }
+
   if (!*line)
     {
       if (opt_more)
@@ -329,40 +478,9 @@ cmd_search (assuan_context_t ctx, char *line)
     {
       /* More pattern are expected - store the current one and return
        * success.  */
-      if (!ctrl->server_local->multi_search_desc_size)
-        {
-          n = 10;
-          ctrl->server_local->multi_search_desc
-            = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_desc);
-          if (!ctrl->server_local->multi_search_desc)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          ctrl->server_local->multi_search_desc_size = n;
-        }
-
-      if (ctrl->server_local->multi_search_desc_len
-          == ctrl->server_local->multi_search_desc_size)
-        {
-          KEYBOX_SEARCH_DESC *desc;
-          n = ctrl->server_local->multi_search_desc_size + 10;
-          desc = xtrycalloc (n, sizeof *desc);
-          if (!desc)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          for (k=0; k < ctrl->server_local->multi_search_desc_size; k++)
-            desc[k] = ctrl->server_local->multi_search_desc[k];
-          xfree (ctrl->server_local->multi_search_desc);
-          ctrl->server_local->multi_search_desc = desc;
-          ctrl->server_local->multi_search_desc_size = n;
-        }
-      /* Actually store.  */
-      ctrl->server_local->multi_search_desc
-        [ctrl->server_local->multi_search_desc_len++]
-        = ctrl->server_local->search_desc;
+      err = append_search_desc (ctrl, &ctrl->server_local->search_desc);
+      if (err)
+        goto leave;
 
       if (opt_more)
         {
@@ -396,7 +514,10 @@ cmd_search (assuan_context_t ctx, char *line)
 
  leave:
   if (err)
-    ctrl->server_local->multi_search_desc_len = 0;
+    {
+      ctrl->server_local->multi_search_desc_len = 0;
+      ctrl->server_local->search_expecting_more = 0;
+    }
   ctrl->no_data_return = 0;
   ctrl->server_local->inhibit_data_logging = 0;
   return leave_cmd (ctx, err);
@@ -490,6 +611,12 @@ cmd_store (assuan_context_t ctx, char *line)
       goto leave;
     }
 
+  if (opt.replicate_from)
+    {
+      err = set_error (GPG_ERR_NOT_SUPPORTED, "read-only replica");
+      goto leave;
+    }
+
   /* Ask for the key material.  */
   err = assuan_inquire (ctx, "BLOB", &value, &valuelen, 0);
   if (err)
@@ -514,6 +641,57 @@ cmd_store (assuan_context_t ctx, char *line)
 
 
 
+
+static const char hlp_changes[] =
+  "CHANGES <id> <offset>\n"
+  "\n"
+  "Return the records of the change log starting at OFFSET.  ID is\n"
+  "the identifier of the change log as returned by a previous CHANGES\n"
+  "command or \"-\".  If it is not the identifier of the current\n"
+  "change log the records are returned from the first one.  A status\n"
+  "line\n"
+  "  CHANGELOG <id> <offset>\n"
+  "gives the identifier and the offset of the returned records.  Each\n"
+  "record is made up of a 4 byte length and a key as stored with\n"
+  "STORE.  No data is returned if there are no more records.  An\n"
+  "OFFSET which is not the start of a record is rejected.  This\n"
+  "command is used by replicas and requires option --change-log.";
+static gpg_error_t
+cmd_changes (assuan_context_t ctx, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  char *p;
+  unsigned long long offset;
+  const char *id;
+  void *data = NULL;
+  size_t datalen;
+
+  line = skip_options (line);
+  p = strchr (line, ' ');
+  if (!p)
+    {
+      err = PARM_ERROR ("change log ID and offset expected");
+      goto leave;
+    }
+  *p++ = 0;
+  offset = strtoull (p, NULL, 10);
+
+  err = kbxd_changelog_read (line, offset, &id, &offset, &data, &datalen);
+  if (err)
+    goto leave;
+
+  err = status_printf (ctrl, "CHANGELOG", "%s %llu", id, offset);
+  if (!err && datalen)
+    err = assuan_send_data (ctx, data, datalen);
+
+ leave:
+  xfree (data);
+  return leave_cmd (ctx, err);
+}
+
+
+
 
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
@@ -525,6 +703,10 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
+  "stats       - Return the counters of this connection as\n"
+  "              SEARCHES FOUND STORES DATABYTES LOCKWAITS\n"
+  "cache_stats - Return the statistics of the cache as\n"
+  "              HITS MISSES EVICTIONS BLOBS KEYS BYTES BUDGET\n"
   "getenv NAME - Return value of envvar NAME\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
@@ -555,6 +737,35 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       snprintf (numbuf, sizeof numbuf, "%u", ctrl->server_local->session_id);
       err = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "stats"))
+    {
+      char *s;
+
+      s = xtryasprintf ("%lu %lu %lu %lu %lu",
+                        ctrl->stats.searches, ctrl->stats.found,
+                        ctrl->stats.stores, ctrl->stats.data_bytes,
+                        ctrl->stats.lock_waits);
+      if (!s)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, s, strlen (s));
+          xfree (s);
+        }
+    }
+  else if (!strcmp (line, "cache_stats"))
+    {
+      char *s;
+
+      s = kbxd_get_cache_stats (ctrl);
+      if (!s)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, s, strlen (s));
+          xfree (s);
+        }
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -634,6 +845,7 @@ register_commands (assuan_context_t ctx)
     { "SEARCH",     cmd_search,     hlp_search },
     { "NEXT",       cmd_next,       hlp_next   },
     { "STORE",      cmd_store,      hlp_store  },
+    { "CHANGES",    cmd_changes,    hlp_changes },
     { "GETINFO",    cmd_getinfo,    hlp_getinfo },
     { "OUTPUT",     NULL,           hlp_output },
     { "KILLKEYBOXD",cmd_killkeyboxd,hlp_killkeyboxd },
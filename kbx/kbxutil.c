@@ -24,9 +24,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/mman.h>
+#endif
+#include <npth.h>
 
 #include <gpg-error.h>
 #include "../common/logging.h"
@@ -36,6 +41,8 @@
 #include "../common/i18n.h"
 #include "keybox-defs.h"
 #include "../common/init.h"
+#include "../common/host2net.h"
+#include "../common/sysutils.h"
 #include <gcrypt.h>
 
 
@@ -55,6 +62,8 @@ enum cmd_and_opt_values {
   aImportOpenPGP,
   aFindDups,
   aCut,
+  aCompact,
+  aCheck,
 
   oDebug,
   oDebugAll,
@@ -62,6 +71,8 @@ enum cmd_and_opt_values {
   oNoArmor,
   oFrom,
   oTo,
+  oJobs,
+  oRebuildIndex,
 
   aTest
 };
@@ -77,11 +88,15 @@ static ARGPARSE_OPTS opts[] = {
   { aImportOpenPGP, "import-openpgp", 0, "import OpenPGP keyblocks"},
   { aFindDups,    "find-dups",   0, "find duplicates" },
   { aCut,         "cut",         0, "export records" },
+  { aCompact,     "compact",     0, "remove deleted records" },
+  { aCheck,       "check",       0, "check the integrity of keybox files" },
 
   { 301, NULL, 0, N_("@\nOptions:\n ") },
 
   { oFrom, "from", 4, "|N|first record to export" },
   { oTo,   "to",   4, "|N|last record to export" },
+  { oJobs, "jobs", 1, "|N|use N threads for --check and --stats" },
+  { oRebuildIndex, "rebuild-index", 0, "also write the index with --check" },
 /*   { oArmor, "armor",     0, N_("create ascii armored output")}, */
 /*   { oArmor, "armour",     0, "@" }, */
 /*   { oOutput, "output",    2, N_("use as output file")}, */
@@ -458,6 +473,436 @@ import_openpgp (const char *filename, int dryrun)
 }
 
 
+/* Rewrite the keybox FILENAME without deleted blobs and without the
+ * free space left behind by in-place updates.  The file must not be
+ * in use by keyboxd.  */
+static void
+compact_file (const char *filename, int dryrun)
+{
+  gpg_error_t err;
+  void *token;
+  KEYBOX_HANDLE hd;
+
+  if (dryrun)
+    {
+      _keybox_dump_file (filename, 1, stdout);
+      return;
+    }
+
+  err = keybox_register_file (filename, 0, &token);
+  if (err)
+    {
+      log_error ("%s: can't register keybox: %s\n",
+                 filename, gpg_strerror (err));
+      return;
+    }
+  hd = keybox_new_x509 (token, 0);
+  if (!hd)
+    {
+      log_error ("%s: can't open keybox: %s\n",
+                 filename, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  err = keybox_lock (hd, 1, 0);
+  if (!err)
+    {
+      err = keybox_compact (hd);
+      keybox_lock (hd, 0, 0);
+    }
+  if (err)
+    log_error ("%s: compacting failed: %s\n", filename, gpg_strerror (err));
+  keybox_release (hd);
+}
+
+
+/* The maximum number of threads used to check a file.  */
+#define MAX_CHECK_JOBS 64
+
+/* The number of bad blobs reported per part of a file.  */
+#define MAX_REPORTED_BAD 16
+
+/* A part of a keybox file which is checked by one thread.  */
+struct check_part_s
+{
+  const unsigned char *image;  /* The start of the part in the mapping.  */
+  size_t length;               /* The length of the part.  */
+  off_t offset;                /* The file offset of the part.  */
+  unsigned long recno;         /* The record number of the first blob.  */
+  int stats_only;              /* Don't verify the blobs.  */
+  keybox_index_entries_t entries;  /* Collect index entries if not NULL. */
+  npth_t thread;
+  int started;
+
+  /* The results.  */
+  gpg_error_t err;
+  struct keybox_stats_s stats;
+  unsigned long nbad;          /* The number of bad blobs.  */
+  struct {
+    unsigned long recno;
+    off_t offset;
+    const char *reason;
+  } bad[MAX_REPORTED_BAD];
+};
+
+
+/* Return the default number of threads for --check.  */
+static int
+default_check_jobs (void)
+{
+  long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1)
+    n = 1;
+  else if (n > MAX_CHECK_JOBS)
+    n = MAX_CHECK_JOBS;
+  return n;
+}
+
+
+/* Check all blobs of PART.  The blob lengths have already been
+ * validated while splitting the file.  This does not print anything
+ * so that it can run outside of the nPth protected state.  */
+static void
+check_part (struct check_part_s *part)
+{
+  gpg_error_t err;
+  KEYBOXBLOB blob;
+  const char *reason;
+  unsigned long recno = part->recno;
+  size_t pos, n;
+  off_t off;
+
+  for (pos = 0; pos < part->length; pos += n, recno++)
+    {
+      n = buf32_to_size_t (part->image + pos);
+      off = part->offset + pos;
+      if (!part->image[pos+4])
+        {
+          /* Same as _keybox_read_blob we count deleted blobs without
+           * looking at them.  */
+          part->stats.total_blob_count++;
+          part->stats.empty_blob_count++;
+          continue;
+        }
+      if (n > IMAGELEN_LIMIT)
+        {
+          part->stats.skipped_long_blobs++;
+          continue;
+        }
+
+      err = _keybox_new_blob_view (&blob, part->image + pos, n, off);
+      if (err)
+        {
+          part->err = err;
+          return;
+        }
+      _keybox_update_stats (blob, &part->stats);
+      reason = part->stats_only? NULL : _keybox_check_blob (blob);
+      if (reason)
+        {
+          if (part->nbad < MAX_REPORTED_BAD)
+            {
+              part->bad[part->nbad].recno = recno;
+              part->bad[part->nbad].offset = off;
+              part->bad[part->nbad].reason = reason;
+            }
+          part->nbad++;
+        }
+      else if (part->entries)
+        err = _keybox_index_add_blob_entries (part->entries, blob, off);
+      _keybox_release_blob (blob);
+      if (err)
+        {
+          part->err = err;
+          return;
+        }
+    }
+}
+
+
+/* The thread checking one part.  The work is pure computation on
+ * the mapping and the part itself; thus we leave the protected state
+ * to let the threads run in parallel.  */
+static void *
+check_part_thread (void *arg)
+{
+  struct check_part_s *part = arg;
+
+  npth_unprotect ();
+  check_part (part);
+  npth_protect ();
+  return NULL;
+}
+
+
+/* Split the keybox image (IMAGE,LENGTH) at blob boundaries into at
+ * most NPARTS parts of about the same size and store them at PARTS.
+ * Returns the number of parts.  If the file is truncated or has an
+ * invalid blob length the parts end at that blob and its offset is
+ * stored at R_BADOFF; else -1 is stored there.  */
+static int
+split_keybox_image (const unsigned char *image, size_t length,
+                    struct check_part_s *parts, int nparts, off_t *r_badoff)
+{
+  size_t pos, start, n, target;
+  unsigned long recno, startrecno;
+  int count = 0;
+
+  *r_badoff = -1;
+  target = length / nparts + 1;
+  pos = start = 0;
+  recno = startrecno = 0;
+  while (pos < length)
+    {
+      if (length - pos < 5
+          || (n = buf32_to_size_t (image + pos)) < 5
+          || n > length - pos)
+        {
+          *r_badoff = pos;
+          break;
+        }
+      pos += n;
+      recno++;
+      if (pos - start >= target && count < nparts - 1)
+        {
+          parts[count].image = image + start;
+          parts[count].length = pos - start;
+          parts[count].offset = start;
+          parts[count].recno = startrecno;
+          count++;
+          start = pos;
+          startrecno = recno;
+        }
+    }
+  if (pos > start)
+    {
+      parts[count].image = image + start;
+      parts[count].length = pos - start;
+      parts[count].offset = start;
+      parts[count].recno = startrecno;
+      count++;
+    }
+  return count;
+}
+
+
+/* Read the entire file FD of LENGTH into memory.  This is used if
+ * the file can't be mapped.  */
+static unsigned char *
+read_keybox_image (int fd, size_t length)
+{
+  unsigned char *buffer;
+  size_t nread;
+  ssize_t n;
+
+  buffer = xtrymalloc (length? length : 1);
+  if (!buffer)
+    return NULL;
+  for (nread = 0; nread < length; nread += n)
+    {
+      n = read (fd, buffer + nread, length - nread);
+      if (n < 0 && errno == EINTR)
+        n = 0;
+      else if (n <= 0)
+        {
+          if (!n)
+            gpg_err_set_errno (EIO);
+          xfree (buffer);
+          return NULL;
+        }
+    }
+  return buffer;
+}
+
+
+/* Check the keybox FILENAME using NJOBS threads and print statistics
+ * if STATS_ONLY is set.  Unless STATS_ONLY is set the structure and
+ * the checksum of each blob are verified.  If REBUILD_INDEX is set
+ * and no problems were found the sidecar index of the keybox is
+ * written from the same pass.  */
+static void
+check_file (const char *filename, int stats_only, int njobs,
+            int rebuild_index)
+{
+  gpg_error_t err;
+  int fd;
+  struct stat st;
+  unsigned char *image = NULL;
+  int mapped = 0;
+  size_t length;
+  struct check_part_s *parts = NULL;
+  int nparts = 0;
+  int oflag, i, j, rc;
+  off_t badoff;
+  npth_attr_t tattr;
+  struct keybox_stats_s stats;
+  keybox_index_entries_t entries = NULL;
+  unsigned long nbad = 0;
+
+  memset (&stats, 0, sizeof stats);
+
+  oflag = O_RDONLY;
+#ifdef O_BINARY
+  oflag |= O_BINARY;
+#endif
+  fd = open (filename, oflag);
+  if (fd == -1 || fstat (fd, &st))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("%s: can't open keybox: %s\n", filename, gpg_strerror (err));
+      goto leave;
+    }
+  length = st.st_size;
+  if ((off_t)length != st.st_size)
+    {
+      log_error ("%s: keybox too large\n", filename);
+      goto leave;
+    }
+
+#ifndef HAVE_W32_SYSTEM
+  if (length)
+    {
+      image = mmap (NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (image == MAP_FAILED)
+        image = NULL;
+      else
+        mapped = 1;
+    }
+#endif
+  if (!image)
+    {
+      image = read_keybox_image (fd, length);
+      if (!image)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("%s: error reading keybox: %s\n",
+                     filename, gpg_strerror (err));
+          goto leave;
+        }
+    }
+
+  if (njobs < 1)
+    njobs = default_check_jobs ();
+  else if (njobs > MAX_CHECK_JOBS)
+    njobs = MAX_CHECK_JOBS;
+  parts = xtrycalloc (njobs, sizeof *parts);
+  if (!parts)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("%s: %s\n", filename, gpg_strerror (err));
+      goto leave;
+    }
+
+  nparts = split_keybox_image (image, length, parts, njobs, &badoff);
+  if (badoff != -1)
+    log_error ("%s: invalid blob length at offset %llu\n",
+               filename, (unsigned long long)badoff);
+  if (rebuild_index && badoff != -1)
+    {
+      log_info ("%s: not writing the index due to errors\n", filename);
+      rebuild_index = 0;
+    }
+
+  for (i=0; i < nparts; i++)
+    {
+      parts[i].stats_only = stats_only;
+      if (rebuild_index && !(parts[i].entries = _keybox_index_new_entries ()))
+        {
+          parts[i].err = gpg_error_from_syserror ();
+          break;
+        }
+    }
+
+  if (nparts == 1)
+    check_part (parts);
+  else
+    {
+      npth_attr_init (&tattr);
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      for (i=0; i < nparts; i++)
+        {
+          rc = npth_create (&parts[i].thread, &tattr,
+                            check_part_thread, parts + i);
+          if (rc)
+            {
+              /* Do this part ourselves.  */
+              check_part (parts + i);
+              continue;
+            }
+          npth_setname_np (parts[i].thread, "check");
+          parts[i].started = 1;
+        }
+      npth_attr_destroy (&tattr);
+      for (i=0; i < nparts; i++)
+        if (parts[i].started)
+          npth_join (parts[i].thread, NULL);
+    }
+
+  /* Report in file order.  */
+  err = 0;
+  for (i=0; i < nparts; i++)
+    {
+      _keybox_add_stats (&stats, &parts[i].stats);
+      for (j=0; j < parts[i].nbad && j < MAX_REPORTED_BAD; j++)
+        log_error ("%s: record %lu at offset %llu: %s\n",
+                   filename, parts[i].bad[j].recno,
+                   (unsigned long long)parts[i].bad[j].offset,
+                   parts[i].bad[j].reason);
+      if (parts[i].nbad > MAX_REPORTED_BAD)
+        log_error ("%s: %lu more bad records near offset %llu\n",
+                   filename, parts[i].nbad - MAX_REPORTED_BAD,
+                   (unsigned long long)parts[i].offset);
+      nbad += parts[i].nbad;
+      if (parts[i].err && !err)
+        err = parts[i].err;
+    }
+  if (err)
+    log_error ("%s: error checking keybox: %s\n",
+               filename, gpg_strerror (err));
+
+  if (stats_only)
+    _keybox_print_stats (&stats, stdout);
+  else
+    log_info ("%s: %lu records checked, %lu bad\n",
+              filename, stats.total_blob_count + stats.skipped_long_blobs,
+              nbad);
+
+  if (rebuild_index && !err && !nbad)
+    {
+      entries = _keybox_index_new_entries ();
+      if (!entries)
+        err = gpg_error_from_syserror ();
+      for (i=0; !err && i < nparts; i++)
+        err = _keybox_index_merge_entries (entries, parts[i].entries);
+      if (!err)
+        err = _keybox_index_write_entries (filename, &st, entries);
+      if (err)
+        log_error ("%s: error writing the index: %s\n",
+                   filename, gpg_strerror (err));
+    }
+  else if (rebuild_index)
+    log_info ("%s: not writing the index due to errors\n", filename);
+
+ leave:
+  _keybox_index_release_entries (entries);
+  for (i=0; i < nparts; i++)
+    _keybox_index_release_entries (parts[i].entries);
+  xfree (parts);
+#ifndef HAVE_W32_SYSTEM
+  if (mapped)
+    munmap (image, length);
+  else
+#endif
+    xfree (image);
+  if (fd != -1)
+    close (fd);
+}
+
+
 
 
 int
@@ -467,6 +912,8 @@ main( int argc, char **argv )
   enum cmd_and_opt_values cmd = 0;
   unsigned long from = 0, to = ULONG_MAX;
   int dry_run = 0;
+  int njobs = 0;
+  int rebuild_index = 0;
 
   early_system_init ();
   set_strusage( my_strusage );
@@ -510,6 +957,8 @@ main( int argc, char **argv )
         case aImportOpenPGP:
         case aFindDups:
         case aCut:
+        case aCompact:
+        case aCheck:
           cmd = pargs.r_opt;
           break;
 
@@ -517,6 +966,8 @@ main( int argc, char **argv )
         case oTo: to = pargs.r.ret_ulong; break;
 
         case oDryRun: dry_run = 1; break;
+        case oJobs: njobs = pargs.r.ret_int; break;
+        case oRebuildIndex: rebuild_index = 1; break;
 
         default:
           pargs.err = 2;
@@ -531,6 +982,12 @@ main( int argc, char **argv )
   if (log_get_errorcount(0) )
     myexit(2);
 
+  if (cmd == aStats || cmd == aCheck)
+    {
+      npth_init ();
+      gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+    }
+
   if (!cmd)
     { /* Default is to list a KBX file */
       if (!argc)
@@ -548,7 +1005,17 @@ main( int argc, char **argv )
       else
         {
           for (; argc; argc--, argv++)
-            _keybox_dump_file (*argv, 1, stdout);
+            check_file (*argv, 1, njobs, 0);
+        }
+    }
+  else if (cmd == aCheck)
+    {
+      if (!argc)
+        log_error ("no keybox file given\n");
+      else
+        {
+          for (; argc; argc--, argv++)
+            check_file (*argv, 0, njobs, rebuild_index);
         }
     }
   else if (cmd == aFindDups )
@@ -571,6 +1038,16 @@ main( int argc, char **argv )
             _keybox_dump_cut_records (*argv, from, to, stdout);
         }
     }
+  else if (cmd == aCompact)
+    {
+      if (!argc)
+        log_error ("no keybox file given\n");
+      else
+        {
+          for (; argc; argc--, argv++)
+            compact_file (*argv, dry_run);
+        }
+    }
   else if (cmd == aImportOpenPGP)
     {
       if (!argc)
@@ -214,12 +214,6 @@ struct keyboxblob_uid {
   byte   validity;
 };
 
-struct keyid_list {
-    struct keyid_list *next;
-    int seqno;
-    byte kid[8];
-};
-
 struct fixup_list {
     struct fixup_list *next;
     u32 off;
@@ -231,6 +225,7 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int is_view;  /* BLOB points into a file mapping and is not owned.  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -245,13 +240,13 @@ struct keyboxblob {
   struct fixup_list *fixups;
   int fixup_out_of_core;
 
-  struct keyid_list *temp_kids;
   struct membuf bufbuf; /* temporary store for the blob */
   struct membuf *buf;
 };
 
 
 
+#ifdef KEYBOX_WITH_X509
 /* A simple implementation of a dynamic buffer.  Use init_membuf() to
    create a buffer, put_membuf to append bytes and get_membuf to
    release and return the buffer.  Allocation errors are detected but
@@ -363,6 +358,7 @@ add_fixup (KEYBOXBLOB blob, u32 off, u32 val)
       blob->fixups = fl;
     }
 }
+#endif /*KEYBOX_WITH_X509*/
 
 
 
@@ -371,131 +367,145 @@ add_fixup (KEYBOXBLOB blob, u32 off, u32 val)
 */
 
 
-/* We must store the keyid at some place because we can't calculate
-   the offset yet. This is only used for v3 keyIDs.  Function returns
-   an index value for later fixup or -1 for out of core.  The value
-   must be a non-zero value. */
-static int
-pgp_temp_store_kid (KEYBOXBLOB blob, struct _keybox_openpgp_key_info *kinfo)
+/* Return the key info following KINFO in INFO or NULL.  The first
+ * key is the primary key.  */
+static struct _keybox_openpgp_key_info *
+pgp_next_key_info (keybox_openpgp_info_t info,
+                   struct _keybox_openpgp_key_info *kinfo)
 {
-  struct keyid_list *k, *r;
-
-  k = xtrymalloc (sizeof *k);
-  if (!k)
-    return -1;
-  memcpy (k->kid, kinfo->keyid, 8);
-  k->seqno = 0;
-  k->next = blob->temp_kids;
-  blob->temp_kids = k;
-  for (r=k; r; r = r->next)
-    k->seqno++;
-
-  return k->seqno;
+  if (kinfo == &info->primary)
+    return info->nsubkeys? &info->subkeys : NULL;
+  return kinfo->next;
 }
 
 
-/* Helper for pgp_create_key_part.  */
-static gpg_error_t
-pgp_create_key_part_single (KEYBOXBLOB blob, int n,
-                            struct _keybox_openpgp_key_info *kinfo)
+static unsigned char *
+store16 (unsigned char *p, u16 a)
 {
-  size_t fprlen;
-  int off;
-
-  fprlen = kinfo->fprlen;
-  memcpy (blob->keys[n].fpr, kinfo->fpr, fprlen);
-  blob->keys[n].fprlen = fprlen;
-  if (fprlen < 20) /* v3 fpr - shift right and fill with zeroes. */
-    {
-      memmove (blob->keys[n].fpr + 20 - fprlen, blob->keys[n].fpr, fprlen);
-      memset (blob->keys[n].fpr, 0, 20 - fprlen);
-      off = pgp_temp_store_kid (blob, kinfo);
-      if (off == -1)
-        return gpg_error_from_syserror ();
-      blob->keys[n].off_kid = off;
-    }
-  else
-    blob->keys[n].off_kid = 0; /* Will be fixed up later */
-  blob->keys[n].flags = 0;
-  return 0;
+  p[0] = a >> 8;
+  p[1] = a;
+  return p + 2;
 }
 
-
-static gpg_error_t
-pgp_create_key_part (KEYBOXBLOB blob, keybox_openpgp_info_t info)
+static unsigned char *
+store32 (unsigned char *p, u32 a)
 {
-  gpg_error_t err;
-  int n = 0;
-  struct _keybox_openpgp_key_info *kinfo;
-
-  err = pgp_create_key_part_single (blob, n++, &info->primary);
-  if (err)
-    return err;
-  if (info->nsubkeys)
-    for (kinfo = &info->subkeys; kinfo; kinfo = kinfo->next)
-      if ((err=pgp_create_key_part_single (blob, n++, kinfo)))
-        return err;
-
-  assert (n == blob->nkeys);
-  return 0;
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >>  8;
+  p[3] = a;
+  return p + 4;
 }
 
 
+/* Write the OpenPGP blob for INFO and the keyblock IMAGE of length
+ * IMAGELEN into BUFFER which must have exactly the size computed by
+ * _keybox_create_openpgp_blob.  This writes the same data as the
+ * generic code used for X.509 but in one pass: All offsets are known
+ * in advance and thus no fixups are required.  */
 static void
-pgp_create_uid_part (KEYBOXBLOB blob, keybox_openpgp_info_t info)
+pgp_write_blob (unsigned char *buffer, size_t length,
+                keybox_openpgp_info_t info,
+                const unsigned char *image, size_t imagelen,
+                int as_ephemeral, int want_fpr32, size_t kidoff)
 {
-  int n = 0;
+  struct _keybox_openpgp_key_info *kinfo;
   struct _keybox_openpgp_uid_info *u;
-
-  if (info->nuids)
+  unsigned char *p = buffer;
+  unsigned char *keyinfo;
+  size_t kbstart = length - 40 - imagelen;
+  size_t kidstart = kidoff;
+  size_t fprlen;
+  unsigned int i;
+
+  p = store32 (p, length);
+  *p++ = KEYBOX_BLOBTYPE_PGP;
+  *p++ = want_fpr32? 2:1;              /* Blob type version.  */
+  p = store16 (p, as_ephemeral? 6:4);  /* Blob flags.  */
+  p = store32 (p, kbstart);
+  p = store32 (p, imagelen);
+
+  p = store16 (p, 1 + info->nsubkeys);
+  p = store16 (p, want_fpr32? (32 + 2 + 2 + 20) : (20 + 4 + 2 + 2));
+  for (kinfo = &info->primary; kinfo; kinfo = pgp_next_key_info (info, kinfo))
     {
-      for (u = &info->uids; u; u = u->next)
+      keyinfo = p;
+      fprlen = kinfo->fprlen;
+      if (want_fpr32)
+        {
+          /* A 20 byte fingerprint is right filled with zeroes.  */
+          memset (p, 0, 32);
+          memcpy (p, kinfo->fpr, fprlen);
+          p += 32;
+          p = store16 (p, fprlen == 32? 0x80 : 0);  /* Key flags.  */
+          p = store16 (p, 0);                        /* Reserved.  */
+          /* FIXME: Put the real grip here instead of the filler.  */
+          memset (p, 0, 20);
+          p += 20;
+        }
+      else
         {
-          blob->uids[n].off = u->off;
-          blob->uids[n].len = u->len;
-          blob->uids[n].flags = 0;
-          blob->uids[n].validity = 0;
-          n++;
+          log_assert (fprlen <= 20);
+          /* A v3 fingerprint is left filled with zeroes.  */
+          memset (p, 0, 20 - fprlen);
+          memcpy (p + 20 - fprlen, kinfo->fpr, fprlen);
+          p += 20;
+          if (fprlen < 20)
+            {
+              /* The keyid of a v3 key goes into the space after the
+               * header.  */
+              p = store32 (p, kidoff);
+              memcpy (buffer + kidoff, kinfo->keyid, 8);
+              kidoff += 8;
+            }
+          else  /* The keyid is the low part of the fingerprint.  */
+            p = store32 (p, (keyinfo - buffer) + 12);
+          p = store16 (p, 0);  /* Key flags.  */
+          p = store16 (p, 0);  /* Reserved.  */
         }
     }
 
-  assert (n == blob->nuids);
-}
-
-
-static void
-pgp_create_sig_part (KEYBOXBLOB blob, u32 *sigstatus)
-{
-  int n;
-
-  for (n=0; n < blob->nsigs; n++)
-    {
-      blob->sigs[n] = sigstatus? sigstatus[n+1] : 0;
-    }
-}
+  p = store16 (p, 0);  /* No serial number.  */
 
+  p = store16 (p, info->nuids);
+  p = store16 (p, 4 + 4 + 2 + 1 + 1);  /* Size of uid info.  */
+  if (info->nuids)
+    for (u = &info->uids; u; u = u->next)
+      {
+        p = store32 (p, kbstart + u->off);
+        p = store32 (p, u->len);
+        p = store16 (p, 0);  /* Flags.  */
+        *p++ = 0;            /* Validity.  */
+        *p++ = 0;            /* Reserved.  */
+      }
 
-static int
-pgp_create_blob_keyblock (KEYBOXBLOB blob,
-                          const unsigned char *image, size_t imagelen)
-{
-  struct membuf *a = blob->buf;
-  int n;
-  u32 kbstart = a->len;
+  p = store16 (p, info->nsigs);
+  p = store16 (p, 4);  /* Size of sig info.  */
+  for (i=0; i < info->nsigs; i++)
+    p = store32 (p, 0);
 
-  add_fixup (blob, 8, kbstart);
+  *p++ = 0;            /* Assigned ownertrust.  */
+  *p++ = 0;            /* Validity of all user IDs.  */
+  p = store16 (p, 0);  /* Reserved.  */
+  p = store32 (p, 0);  /* Time of next recheck.  */
+  p = store32 (p, 0);  /* Newest timestamp (none).  */
+  p = store32 (p, make_timestamp ());  /* Creation time.  */
+  p = store32 (p, 0);  /* Size of reserved space.  */
+  /* The v3 keyids have already been written.  */
+  log_assert (p == buffer + kidstart && kidoff == kbstart);
 
-  for (n = 0; n < blob->nuids; n++)
-    add_fixup (blob, blob->uids[n].off_addr, kbstart + blob->uids[n].off);
+  memcpy (buffer + kbstart, image, imagelen);
 
-  put_membuf (a, image, imagelen);
+  /* Compute and store the UBID.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, buffer + length - 40, image, imagelen);
 
-  add_fixup (blob, 12, a->len - kbstart);
-  return 0;
+  /* Compute and store the SHA-1 checksum. */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, buffer + length - 20,
+                       buffer, length - 40);
 }
 
 
-
+
 #ifdef KEYBOX_WITH_X509
 /*
    X.509 specific stuff
@@ -522,38 +532,6 @@ x509_create_blob_cert (KEYBOXBLOB blob, ksba_cert_t cert)
   return 0;
 }
 
-#endif /*KEYBOX_WITH_X509*/
-
-/* Write a stored keyID out to the buffer */
-static void
-write_stored_kid (KEYBOXBLOB blob, int seqno)
-{
-  struct keyid_list *r;
-
-  for ( r = blob->temp_kids; r; r = r->next )
-    {
-      if (r->seqno == seqno )
-        {
-          put_membuf (blob->buf, r->kid, 8);
-          return;
-	}
-    }
-  never_reached ();
-}
-
-/* Release a list of key IDs */
-static void
-release_kid_list (struct keyid_list *kl)
-{
-  struct keyid_list *r, *r2;
-
-  for ( r = kl; r; r = r2 )
-    {
-      r2 = r->next;
-      xfree (r);
-    }
-}
-
 
 /* Create a new blob header.  If WANT_FPR32 is set a version 2 blob is
  * created.  */
@@ -634,31 +612,8 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral,
   put32 ( a, 0 );  /* size of reserved space */
   /* reserved space (which is currently of size 0) */
 
-  /* space where we write keyIDs and other stuff so that the
-     pointers can actually point to somewhere */
-  if (blobtype == KEYBOX_BLOBTYPE_PGP && !want_fpr32)
-    {
-      /* For version 1 blobs, we need to store the keyids for all v3
-       * keys because those key IDs are not part of the fingerprint.
-       * While we are doing that, we fixup all the keyID offsets.  For
-       * version 2 blobs (which can't carry v3 keys) we compute the
-       * keyids in the fly because they are just stripped down
-       * fingerprints.  */
-      for (i=0; i < blob->nkeys; i++ )
-        {
-          if (blob->keys[i].off_kid)
-            { /* this is a v3 one */
-              add_fixup (blob, blob->keys[i].off_kid_addr, a->len);
-              write_stored_kid (blob, blob->keys[i].off_kid);
-            }
-          else
-            { /* the better v4 key IDs - just store an offset 8 bytes back */
-              add_fixup (blob, blob->keys[i].off_kid_addr,
-                         blob->keys[i].off_kid_addr - 8);
-            }
-        }
-    }
-
+  /* space where we write the names so that the pointers can
+     actually point to somewhere */
   if (blobtype == KEYBOX_BLOBTYPE_X509)
     {
       /* We don't want to point to ASN.1 encoded UserIDs (DNs) but to
@@ -748,6 +703,7 @@ create_blob_finish (KEYBOXBLOB blob)
 
   return 0;
 }
+#endif /*KEYBOX_WITH_X509*/
 
 
 
@@ -758,93 +714,58 @@ _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
                              size_t imagelen,
                              int as_ephemeral)
 {
-  gpg_error_t err;
   KEYBOXBLOB blob;
+  struct _keybox_openpgp_key_info *kinfo;
   int need_fpr32 = 0;
+  unsigned int nkeys = 0;
+  unsigned int nv3keys = 0;
+  size_t kidoff, length;
 
   *r_blob = NULL;
 
-
   /* Check whether we need a blob with 32 bit fingerprints. We could
    * use this always but for backward compatiblity we do this only for
    * v5 keys.  */
-  if (info->primary.version == 5)
-    need_fpr32 = 1;
-  else
+  for (kinfo = &info->primary; kinfo; kinfo = pgp_next_key_info (info, kinfo))
     {
-      struct _keybox_openpgp_key_info *kinfo;
-      for (kinfo = &info->subkeys; kinfo; kinfo = kinfo->next)
-        if (kinfo->version == 5)
-          {
-            need_fpr32 = 1;
-            break;
-          }
+      nkeys++;
+      if (kinfo->version == 5)
+        need_fpr32 = 1;
+      if (kinfo->fprlen < 20)
+        nv3keys++;
     }
+  log_assert (nkeys == 1 + info->nsubkeys);
+
+  /* Compute the size of the blob.  For version 1 blobs the keyids of
+   * v3 keys are stored after the header; version 2 blobs can't carry
+   * v3 keys.  */
+  kidoff = (4 + 1 + 1 + 2 + 4 + 4
+            + 2 + 2 + nkeys * (need_fpr32? (32 + 2 + 2 + 20) : (20 + 4 + 2 + 2))
+            + 2
+            + 2 + 2 + info->nuids * (4 + 4 + 2 + 1 + 1)
+            + 2 + 2 + info->nsigs * 4
+            + 1 + 1 + 2 + 4 + 4 + 4 + 4);
+  length = kidoff + (need_fpr32? 0 : nv3keys * 8) + imagelen + 20 + 20;
+  if (length > 0xffffffff)
+    return gpg_error (GPG_ERR_TOO_LARGE);
 
   blob = xtrycalloc (1, sizeof *blob);
   if (!blob)
     return gpg_error_from_syserror ();
-
-  blob->nkeys = 1 + info->nsubkeys;
-  blob->keys = xtrycalloc (blob->nkeys, sizeof *blob->keys );
-  if (!blob->keys)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
-    }
-
-  blob->nuids = info->nuids;
-  if (blob->nuids)
-    {
-      blob->uids = xtrycalloc (blob->nuids, sizeof *blob->uids );
-      if (!blob->uids)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-    }
-
-  blob->nsigs = info->nsigs;
-  if (blob->nsigs)
+  blob->blob = xtrymalloc (length);
+  if (!blob->blob)
     {
-      blob->sigs = xtrycalloc (blob->nsigs, sizeof *blob->sigs );
-      if (!blob->sigs)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
+      gpg_error_t err = gpg_error_from_syserror ();
+      xfree (blob);
+      return err;
     }
+  blob->bloblen = length;
 
-  err = pgp_create_key_part (blob, info);
-  if (err)
-    goto leave;
-  pgp_create_uid_part (blob, info);
-  pgp_create_sig_part (blob, NULL);
-
-  init_membuf (&blob->bufbuf, 1024);
-  blob->buf = &blob->bufbuf;
-  err = create_blob_header (blob, KEYBOX_BLOBTYPE_PGP,
-                            as_ephemeral, need_fpr32);
-  if (err)
-    goto leave;
-  err = pgp_create_blob_keyblock (blob, image, imagelen);
-  if (err)
-    goto leave;
-  err = create_blob_trailer (blob);
-  if (err)
-    goto leave;
-  err = create_blob_finish (blob);
-  if (err)
-    goto leave;
+  pgp_write_blob (blob->blob, length, info, image, imagelen,
+                  as_ephemeral, need_fpr32, kidoff);
 
- leave:
-  release_kid_list (blob->temp_kids);
-  blob->temp_kids = NULL;
-  if (err)
-    _keybox_release_blob (blob);
-  else
-    *r_blob = blob;
-  return err;
+  *r_blob = blob;
+  return 0;
 }
 
 
@@ -1026,8 +947,6 @@ _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
 
 
  leave:
-  release_kid_list (blob->temp_kids);
-  blob->temp_kids = NULL;
   if (names)
     {
       for (i=0; i < blob->nuids; i++)
@@ -1068,24 +987,65 @@ _keybox_new_blob (KEYBOXBLOB *r_blob,
 }
 
 
+/* Create a blob object which does not own IMAGE but merely points
+ * to it.  This is used for blobs parsed in place from a mapped
+ * keybox file; IMAGE must stay valid as long as the blob is used or
+ * until _keybox_own_blob_image has been called.  */
+gpg_error_t
+_keybox_new_blob_view (KEYBOXBLOB *r_blob,
+                       const unsigned char *image, size_t imagelen,
+                       off_t off)
+{
+  gpg_error_t err;
+
+  err = _keybox_new_blob (r_blob, (unsigned char *)image, imagelen, off);
+  if (!err)
+    (*r_blob)->is_view = 1;
+  return err;
+}
+
+
+/* Make sure that BLOB has its own copy of the image.  This needs to
+ * be called for a blob view which shall outlive the mapping.  */
+gpg_error_t
+_keybox_own_blob_image (KEYBOXBLOB blob)
+{
+  unsigned char *image;
+
+  if (!blob || !blob->is_view)
+    return 0;
+
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  blob->blob = image;
+  blob->is_view = 0;
+  return 0;
+}
+
+
 void
 _keybox_release_blob (KEYBOXBLOB blob)
 {
   int i;
   if (!blob)
     return;
+#ifdef KEYBOX_WITH_X509
   if (blob->buf)
     {
       size_t len;
       xfree (get_membuf (blob->buf, &len));
     }
+#endif /*KEYBOX_WITH_X509*/
   xfree (blob->keys );
   xfree (blob->serialbuf);
   for (i=0; i < blob->nuids; i++)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->is_view)
+    xfree (blob->blob );
   xfree (blob );
 }
 
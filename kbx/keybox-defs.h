@@ -32,15 +32,20 @@
         map_assuan_err_with_source (GPG_ERR_SOURCE_DEFAULT, (a))
 
 #include <sys/types.h> /* off_t */
+#include <sys/stat.h>  /* struct stat */
 
 #include "../common/util.h"
 #include "keybox.h"
 
 
+/* Blobs larger than this are skipped by the readers.  */
+#define IMAGELEN_LIMIT (5*1024*1024)
+
 typedef struct keyboxblob *KEYBOXBLOB;
 
 
 typedef struct keybox_name *KB_NAME;
+struct keybox_index_s;
 struct keybox_name
 {
   /* Link to the next resources, so that we can walk all
@@ -65,6 +70,13 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* The sidecar index or NULL if not used (keybox-index.c).  */
+  struct keybox_index_s *index;
+
+  /* If true updates are done in place instead of copying the file;
+   * see keybox_enable_inplace_update.  */
+  int inplace_update;
+
   /* The name of the resource file. */
   char fname[1];
 };
@@ -91,6 +103,15 @@ struct keybox_handle {
     char *name;
     char *pattern;
   } word_match;
+  /* State of the memory mapped read path (see keybox_set_mmap).  While
+   * ADDR is set, POS is the read position and the file position of FP
+   * is not used.  */
+  struct {
+    int enabled;
+    unsigned char *addr;
+    size_t len;
+    off_t pos;
+  } map;
 };
 
 
@@ -157,6 +178,10 @@ int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
 int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
+gpg_error_t _keybox_new_blob_view (KEYBOXBLOB *r_blob,
+                                   const unsigned char *image,
+                                   size_t imagelen, off_t off);
+gpg_error_t _keybox_own_blob_image (KEYBOXBLOB blob);
 void _keybox_release_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
@@ -171,13 +196,45 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
+int _keybox_read_mapped_blob (KEYBOXBLOB *r_blob, KEYBOX_HANDLE hd,
+                              int *skipped_deleted);
+gpg_error_t _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
 
+/*-- keybox-index.c --*/
+gpg_error_t _keybox_index_enable (KB_NAME kb, unsigned int flags);
+gpg_error_t _keybox_index_lookup (KB_NAME kb,
+                                  KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                                  off_t startoff,
+                                  off_t **r_offtbl, size_t *r_noffs);
+void _keybox_index_begin_update (KB_NAME kb);
+void _keybox_index_insert_blob (KB_NAME kb, KEYBOXBLOB blob, off_t off);
+void _keybox_index_remove_blob (KB_NAME kb, off_t off, off_t delta);
+void _keybox_index_end_update (KB_NAME kb);
+void _keybox_index_invalidate (KB_NAME kb);
+typedef struct index_entry_list_s *keybox_index_entries_t;
+keybox_index_entries_t _keybox_index_new_entries (void);
+void _keybox_index_release_entries (keybox_index_entries_t l);
+gpg_error_t _keybox_index_add_blob_entries (keybox_index_entries_t l,
+                                            KEYBOXBLOB blob, off_t off);
+gpg_error_t _keybox_index_merge_entries (keybox_index_entries_t dst,
+                                         keybox_index_entries_t src);
+gpg_error_t _keybox_index_write_entries (const char *kbxfname,
+                                         const struct stat *st,
+                                         keybox_index_entries_t l);
+
 /*-- keybox-search.c --*/
+#ifdef KEYBOX_WITH_X509
+gpg_error_t _keybox_x509_get_grip (const unsigned char *image, size_t imagelen,
+                                   unsigned char *r_grip);
+#endif /*KEYBOX_WITH_X509*/
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
                                           int what,
                                           size_t *flag_off, size_t *flag_size);
+int _keybox_locate_mail (const unsigned char *buffer, size_t *r_off,
+                         size_t *r_len, int x509);
 
 static inline int
 blob_get_type (KEYBOXBLOB blob)
@@ -194,7 +251,29 @@ blob_get_type (KEYBOXBLOB blob)
 
 
 /*-- keybox-dump.c --*/
+/* Statistics of a keybox file.  */
+struct keybox_stats_s
+{
+  unsigned long too_short_blobs;
+  unsigned long too_large_blobs;
+  unsigned long total_blob_count;
+  unsigned long empty_blob_count;
+  unsigned long header_blob_count;
+  unsigned long pgp_blob_count;
+  unsigned long x509_blob_count;
+  unsigned long unknown_blob_count;
+  unsigned long non_flagged;
+  unsigned long secret_flagged;
+  unsigned long ephemeral_flagged;
+  unsigned long skipped_long_blobs;
+};
+
 int _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp);
+int _keybox_update_stats (KEYBOXBLOB blob, struct keybox_stats_s *s);
+void _keybox_add_stats (struct keybox_stats_s *dst,
+                        const struct keybox_stats_s *src);
+void _keybox_print_stats (const struct keybox_stats_s *s, FILE *fp);
+const char *_keybox_check_blob (KEYBOXBLOB blob);
 int _keybox_dump_file (const char *filename, int stats_only, FILE *outfp);
 int _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp);
 int _keybox_dump_cut_records (const char *filename, unsigned long from,
@@ -98,28 +98,53 @@ print_ubib (const byte *buffer, size_t length, FILE *fp)
 }
 
 
+/* Verify the checksum of the blob (BUFFER,LENGTH) with UNHASHED
+ * bytes after the image.  Returns 1 if it is valid, 0 if it is bad,
+ * -1 if UNHASHED is too short and -2 if the blob is too short.  The
+ * length of the checksum is stored at R_HASHLEN.  */
+static int
+verify_checksum (const byte *buffer, size_t length, size_t unhashed,
+                 int *r_hashlen)
+{
+  unsigned char digest[20];
+
+  *r_hashlen = 0;
+  if (unhashed && unhashed < 20)
+    return -1;
+  if (!unhashed)
+    {
+      unhashed = 16;
+      *r_hashlen = 16;
+    }
+  else
+    *r_hashlen = 20;
+  if (length < 5+unhashed)
+    return -2;
+
+  if (*r_hashlen == 16) /* Compatibility method.  */
+    gcry_md_hash_buffer (GCRY_MD_MD5, digest, buffer, length - 16);
+  else
+    gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, length - unhashed);
+  return !memcmp (buffer + length - *r_hashlen, digest, *r_hashlen);
+}
+
+
 static int
 print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
 {
   const byte *p;
   int i;
   int hashlen;
-  unsigned char digest[20];
+  int rc;
 
   fprintf (fp, "Checksum: ");
-  if (unhashed && unhashed < 20)
+  rc = verify_checksum (buffer, length, unhashed, &hashlen);
+  if (rc == -1)
     {
       fputs ("[specified unhashed sized too short]\n", fp);
       return 0;
     }
-  if (!unhashed)
-    {
-      unhashed = 16;
-      hashlen = 16;
-    }
-  else
-    hashlen = 20;
-  if (length < 5+unhashed)
+  if (rc == -2)
     {
       fputs ("[blob too short for a checksum]\n", fp);
       return 0;
@@ -129,22 +154,10 @@ print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
   for (i=0; i < hashlen; p++, i++)
     fprintf (fp, "%02x", *p);
 
-  if (hashlen == 16) /* Compatibility method.  */
-    {
-      gcry_md_hash_buffer (GCRY_MD_MD5, digest, buffer, length - 16);
-      if (!memcmp (buffer + length - 16, digest, 16))
-        fputs (" [valid]\n", fp);
-      else
-        fputs (" [bad]\n", fp);
-    }
+  if (rc)
+    fputs (" [valid]\n", fp);
   else
-    {
-      gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, length - unhashed);
-      if (!memcmp (buffer + length - hashlen, digest, hashlen))
-        fputs (" [valid]\n", fp);
-      else
-        fputs (" [bad]\n", fp);
-    }
+    fputs (" [bad]\n", fp);
   return 0;
 }
 
@@ -520,24 +533,117 @@ hash_blob_rawdata (KEYBOXBLOB blob, unsigned char *digest)
 }
 
 
-struct file_stats_s
+/* Check the structure and the checksum of BLOB.  Returns NULL if the
+ * blob is valid or a string describing the problem.  This does not
+ * print anything and may thus be called by several threads at
+ * once.  */
+const char *
+_keybox_check_blob (KEYBOXBLOB blob)
 {
-  unsigned long too_short_blobs;
-  unsigned long too_large_blobs;
-  unsigned long total_blob_count;
-  unsigned long empty_blob_count;
-  unsigned long header_blob_count;
-  unsigned long pgp_blob_count;
-  unsigned long x509_blob_count;
-  unsigned long unknown_blob_count;
-  unsigned long non_flagged;
-  unsigned long secret_flagged;
-  unsigned long ephemeral_flagged;
-  unsigned long skipped_long_blobs;
-};
+  const byte *buffer;
+  size_t length, pos;
+  ulong n, nkeys, keyinfolen, nuids, uidinfolen, nsigs, siginfolen;
+  ulong rawdata_off, rawdata_len, uidoff, uidlen;
+  unsigned char digest[20];
+  int type, hashlen, rc;
 
-static int
-update_stats (KEYBOXBLOB blob, struct file_stats_s *s)
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 32)
+    return "blob too short";
+
+  n = get32 (buffer);
+  if (n > length)
+    return "blob larger than its length";
+  length = n;
+
+  type = buffer[4];
+  switch (type)
+    {
+    case KEYBOX_BLOBTYPE_EMPTY:
+      return NULL;
+    case KEYBOX_BLOBTYPE_HEADER:
+      if (memcmp (buffer+8, "KBXf", 4))
+        return "invalid magic number";
+      return NULL;
+    case KEYBOX_BLOBTYPE_PGP:
+    case KEYBOX_BLOBTYPE_X509:
+      break;
+    default:
+      return "unknown blob type";
+    }
+
+  if (length < 40)
+    return "blob too short";
+
+  rawdata_off = get32 (buffer + 8);
+  rawdata_len = get32 (buffer + 12);
+  if ((uint64_t)rawdata_off + (uint64_t)rawdata_len + 4 > (uint64_t)length)
+    return "raw data larger than blob";
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (!nkeys)
+    return "no keys";
+  if (nkeys > 1 && type == KEYBOX_BLOBTYPE_X509)
+    return "more than one key in an X.509 blob";
+  if (keyinfolen < (buffer[5] == 2? 56 : 28))
+    return "key info too short";
+  pos = 20 + (uint64_t)nkeys * keyinfolen;
+  if ((uint64_t)pos + 2 > (uint64_t)length)
+    return "key table larger than blob";
+
+  n = get16 (buffer + pos);  /* Serial number.  */
+  pos += 2 + n;
+  if ((uint64_t)pos + 4 > (uint64_t)length)
+    return "serial number larger than blob";
+
+  nuids = get16 (buffer + pos);
+  uidinfolen = get16 (buffer + pos + 2);
+  pos += 4;
+  if (nuids && uidinfolen < 12)
+    return "user ID info too short";
+  if ((uint64_t)pos + (uint64_t)nuids * uidinfolen + 4 > (uint64_t)length)
+    return "user ID table larger than blob";
+  for (n=0; n < nuids; n++, pos += uidinfolen)
+    {
+      uidoff = get32 (buffer + pos);
+      uidlen = get32 (buffer + pos + 4);
+      if ((uint64_t)uidoff + (uint64_t)uidlen > (uint64_t)length)
+        return "user ID larger than blob";
+    }
+
+  nsigs = get16 (buffer + pos);
+  siginfolen = get16 (buffer + pos + 2);
+  pos += 4;
+  if (nsigs && siginfolen < 4)
+    return "signature info too short";
+  if ((uint64_t)pos + (uint64_t)nsigs * siginfolen + 20 > (uint64_t)length)
+    return "signature table larger than blob";
+
+  if ((get16 (buffer + 6) & 4))
+    {
+      gcry_md_hash_buffer (GCRY_MD_SHA1, digest,
+                           buffer + rawdata_off, rawdata_len);
+      if (memcmp (digest, buffer + length - 40, 20))
+        return "UBIB does not match the image";
+    }
+
+  rc = verify_checksum (buffer, length, length - rawdata_off - rawdata_len,
+                        &hashlen);
+  if (rc == -1)
+    return "unhashed part too short";
+  if (rc == -2)
+    return "blob too short for a checksum";
+  if (!rc)
+    return "bad checksum";
+
+  return NULL;
+}
+
+
+/* Update the statistics S with BLOB.  */
+int
+_keybox_update_stats (KEYBOXBLOB blob, struct keybox_stats_s *s)
 {
   const unsigned char *buffer;
   size_t length;
@@ -600,6 +706,62 @@ update_stats (KEYBOXBLOB blob, struct file_stats_s *s)
 
 
 
+/* Add the statistics SRC to DST.  */
+void
+_keybox_add_stats (struct keybox_stats_s *dst,
+                   const struct keybox_stats_s *src)
+{
+  dst->too_short_blobs    += src->too_short_blobs;
+  dst->too_large_blobs    += src->too_large_blobs;
+  dst->total_blob_count   += src->total_blob_count;
+  dst->empty_blob_count   += src->empty_blob_count;
+  dst->header_blob_count  += src->header_blob_count;
+  dst->pgp_blob_count     += src->pgp_blob_count;
+  dst->x509_blob_count    += src->x509_blob_count;
+  dst->unknown_blob_count += src->unknown_blob_count;
+  dst->non_flagged        += src->non_flagged;
+  dst->secret_flagged     += src->secret_flagged;
+  dst->ephemeral_flagged  += src->ephemeral_flagged;
+  dst->skipped_long_blobs += src->skipped_long_blobs;
+}
+
+
+/* Print the statistics S to FP.  */
+void
+_keybox_print_stats (const struct keybox_stats_s *s, FILE *fp)
+{
+  fprintf (fp,
+           "Total number of blobs: %8lu\n"
+           "               header: %8lu\n"
+           "                empty: %8lu\n"
+           "              openpgp: %8lu\n"
+           "                 x509: %8lu\n"
+           "          non flagged: %8lu\n"
+           "       secret flagged: %8lu\n"
+           "    ephemeral flagged: %8lu\n",
+           s->total_blob_count,
+           s->header_blob_count,
+           s->empty_blob_count,
+           s->pgp_blob_count,
+           s->x509_blob_count,
+           s->non_flagged,
+           s->secret_flagged,
+           s->ephemeral_flagged);
+  if (s->skipped_long_blobs)
+    fprintf (fp, "   skipped long blobs: %8lu\n",
+             s->skipped_long_blobs);
+  if (s->unknown_blob_count)
+    fprintf (fp, "   unknown blob types: %8lu\n",
+             s->unknown_blob_count);
+  if (s->too_short_blobs)
+    fprintf (fp, "      too short blobs: %8lu (error)\n",
+             s->too_short_blobs);
+  if (s->too_large_blobs)
+    fprintf (fp, "      too large blobs: %8lu (error)\n",
+             s->too_large_blobs);
+}
+
+
 static FILE *
 open_file (const char **filename, FILE *outfp)
 {
@@ -630,7 +792,7 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
   KEYBOXBLOB blob;
   int rc;
   unsigned long count = 0;
-  struct file_stats_s stats;
+  struct keybox_stats_s stats;
   int skipped_deleted;
 
   memset (&stats, 0, sizeof stats);
@@ -663,7 +825,7 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
         {
           stats.total_blob_count += skipped_deleted;
           stats.empty_blob_count += skipped_deleted;
-          update_stats (blob, &stats);
+          _keybox_update_stats (blob, &stats);
         }
       else
         {
@@ -683,37 +845,7 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
     fclose (fp);
 
   if (stats_only)
-    {
-      fprintf (outfp,
-               "Total number of blobs: %8lu\n"
-               "               header: %8lu\n"
-               "                empty: %8lu\n"
-               "              openpgp: %8lu\n"
-               "                 x509: %8lu\n"
-               "          non flagged: %8lu\n"
-               "       secret flagged: %8lu\n"
-               "    ephemeral flagged: %8lu\n",
-               stats.total_blob_count,
-               stats.header_blob_count,
-               stats.empty_blob_count,
-               stats.pgp_blob_count,
-               stats.x509_blob_count,
-               stats.non_flagged,
-               stats.secret_flagged,
-               stats.ephemeral_flagged);
-        if (stats.skipped_long_blobs)
-          fprintf (outfp, "   skipped long blobs: %8lu\n",
-                   stats.skipped_long_blobs);
-        if (stats.unknown_blob_count)
-          fprintf (outfp, "   unknown blob types: %8lu\n",
-                   stats.unknown_blob_count);
-        if (stats.too_short_blobs)
-          fprintf (outfp, "      too short blobs: %8lu (error)\n",
-                   stats.too_short_blobs);
-        if (stats.too_large_blobs)
-          fprintf (outfp, "      too large blobs: %8lu (error)\n",
-                   stats.too_large_blobs);
-    }
+    _keybox_print_stats (&stats, outfp);
 
   return rc;
 }
@@ -23,11 +23,14 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
-
-
-#define IMAGELEN_LIMIT (5*1024*1024)
+#include "../common/host2net.h"
 
 
 #if !defined(HAVE_FTELLO) && !defined(ftello)
@@ -128,6 +131,157 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 }
 
 
+/* Make sure that the file opened at HD->FP is mapped into memory and
+ * that the mapping covers the entire file.  This is a no-op if the
+ * mmap read path has not been enabled for HD.  If the file can't be
+ * mapped we silently fall back to stdio.  */
+gpg_error_t
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  void *addr;
+
+  if (!hd->map.enabled || !hd->fp)
+    return 0;
+
+  if (fstat (fileno (hd->fp), &st))
+    return gpg_error_from_syserror ();
+
+  if (hd->map.addr && st.st_size == (off_t)hd->map.len)
+    return 0;  /* Mapping is up to date.  */
+
+  if (!st.st_size || (size_t)st.st_size != st.st_size)
+    {
+      /* Empty file or too large for the address space.  */
+      _keybox_unmap_file (hd);
+      return 0;
+    }
+
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (addr == MAP_FAILED)
+    {
+      _keybox_unmap_file (hd);
+      return 0;
+    }
+
+  if (hd->map.addr)
+    munmap (hd->map.addr, hd->map.len);
+  else
+    {
+      hd->map.pos = ftello (hd->fp);
+      if (hd->map.pos == (off_t)-1)
+        {
+          gpg_error_t err = gpg_error_from_syserror ();
+          munmap (addr, st.st_size);
+          return err;
+        }
+    }
+  hd->map.addr = addr;
+  hd->map.len = st.st_size;
+#else
+  (void)hd;
+#endif /*!HAVE_MMAP*/
+  return 0;
+}
+
+
+/* Release the mapping of HD.  If the file is still open its position
+ * is set to the current read position.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  if (!hd->map.addr)
+    return;
+
+  munmap (hd->map.addr, hd->map.len);
+  hd->map.addr = NULL;
+  hd->map.len = 0;
+  if (hd->fp && fseeko (hd->fp, hd->map.pos, SEEK_SET))
+    {
+      /* Close so that the next search will open the file again.  */
+      fclose (hd->fp);
+      hd->fp = NULL;
+    }
+#else
+  (void)hd;
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Same as _keybox_read_blob but parse the blob in place from the
+ * mapping of HD.  The returned blob is a view into the mapping and
+ * must not be used after the mapping has been released.  */
+int
+_keybox_read_mapped_blob (KEYBOXBLOB *r_blob, KEYBOX_HANDLE hd,
+                          int *skipped_deleted)
+{
+  const unsigned char *image;
+  size_t imagelen;
+  off_t off;
+  gpg_error_t err;
+
+  if (skipped_deleted)
+    *skipped_deleted = 0;
+ again:
+  if (r_blob)
+    *r_blob = NULL;
+  off = hd->map.pos;
+  if (off >= (off_t)hd->map.len)
+    {
+      /* Check whether the file has grown in the meantime.  */
+      size_t oldlen = hd->map.len;
+
+      err = _keybox_map_file (hd);
+      if (err)
+        return err;
+      if (!hd->map.addr)
+        {
+          /* Mapping is gone; fall back to stdio.  */
+          if (!hd->fp)
+            return gpg_error (GPG_ERR_INV_STATE);
+          return _keybox_read_blob (r_blob, hd->fp, skipped_deleted);
+        }
+      if (hd->map.len == oldlen || off >= (off_t)hd->map.len)
+        return -1; /* eof */
+    }
+
+  if (hd->map.len - off < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  image = hd->map.addr + off;
+  imagelen = buf32_to_size_t (image);
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  if (!image[4])
+    {
+      /* Special treatment for empty blobs. */
+      hd->map.pos += imagelen;
+      if (skipped_deleted)
+        *skipped_deleted = 1;
+      goto again;
+    }
+
+  if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+    {
+      /* Skip so that the caller may choose to ignore this record.  */
+      hd->map.pos += imagelen;
+      return gpg_error (GPG_ERR_TOO_LARGE);
+    }
+
+  if (imagelen > hd->map.len - off)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  hd->map.pos += imagelen;
+  if (!r_blob)
+    return 0;  /* This blob shall be skipped.  */
+
+  return _keybox_new_blob_view (r_blob, image, imagelen, off);
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
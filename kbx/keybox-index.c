@@ -0,0 +1,1498 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+* The keybox index format
+
+   The index is stored in a file with the name of the keybox and the
+   suffix ".idx".  It is a plain open addressing hash table which maps
+   key IDs and keygrips to the file offsets of blobs.  It is only a
+   hint: Each candidate offset is verified by reading the blob and
+   running the usual matching code on it.  Thus a collision or a
+   stale entry can at worst cost us an extra read.  All integers are
+   stored in network byte order.  Mail addresses are also put into
+   the table so that exact mail searches don't need to scan the
+   keybox.  For X.509 certificates the subject and issuer DNs and
+   the issuer DN together with the serial number are also included;
+   gpgsm uses these to find the issuer certificate while building a
+   chain.
+
+   - b4   Magic 'KBXi'
+   - byte Version number (1)
+   - byte RFU
+   - u16  Flags
+          bit 0 - Keygrips of all blobs are included.
+          bit 1 - Mail addresses are included.
+          bit 2 - X.509 subjects and issuers are included.
+   - u32  Number of slots (a power of 2)
+   - u32  Number of used slots (including deleted ones)
+   - u32  High 32 bits of the keybox file size
+   - u32  Low 32 bits of the keybox file size
+   - u32  Modification time of the keybox file
+   - u32  Low 32 bits of the inode number of the keybox file
+   - b20  SHA-1 checksum of the keybox header blob
+   - b12  RFU
+   - NSLOTS times:
+     - u32  Tag.  For keys this is the low 32 bits of the key ID;
+            for keygrips the first 4 bytes of the grip; for mail
+            addresses a hash of the lowercased addr-spec; for
+            subjects and issuers a hash of the DN string; for
+            issuer/serial pairs a hash of the issuer DN string and
+            the binary serial number.
+     - byte Kind
+            0    = Empty slot.
+            1    = Key
+            2    = Keygrip
+            3    = Mail address
+            4    = Subject DN
+            5    = Issuer DN
+            6    = Issuer DN and serial number
+            0xff = Deleted slot.
+     - b3   RFU
+     - u32  High 32 bits of the blob offset
+     - u32  Low 32 bits of the blob offset
+
+   The size, time and inode fields are compared with the current
+   values of the keybox file on each search; if they don't match the
+   index is rebuilt.  While an update of the index is in progress the
+   size fields are set to zero so that an interrupted update also
+   leads to a rebuild.
+
+   For substring searches an optional in-core table of trigram
+   signatures is kept.  The signature of a blob is a 256 bit Bloom
+   filter over the trigrams of all its lowercased user IDs; a blob
+   needs only be visited if its signature contains all trigrams of
+   the search string.  The table is built on the first substring
+   search and then updated along with the index.
+*/
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/mman.h>
+#endif
+
+#include "keybox-defs.h"
+#include <gcrypt.h>
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+
+#define get32(a) buf32_to_u32 ((a))
+#define get16(a) buf16_to_ulong ((a))
+
+#define EXTSEP_S "."
+
+#define INDEX_HEADER_SIZE  64
+#define INDEX_SLOT_SIZE    16
+#define INDEX_MIN_SLOTS    1024
+
+#define INDEX_FLAG_GRIPS   1
+#define INDEX_FLAG_MAILS   2
+#define INDEX_FLAG_X509    4
+
+#define SLOT_EMPTY    0
+#define SLOT_KEY      1
+#define SLOT_GRIP     2
+#define SLOT_MAIL     3
+#define SLOT_SUBJECT  4
+#define SLOT_ISSUER   5
+#define SLOT_ISSUER_SN 6
+#define SLOT_DELETED  0xff
+
+#define slot_kind_used(a) ((a) >= SLOT_KEY && (a) <= SLOT_ISSUER_SN)
+
+#define SIG_SIZE  32  /* Length of a trigram signature in bytes.  */
+
+
+/* The trigram signature of a blob.  */
+struct index_sig_s
+{
+  off_t off;
+  unsigned char bits[SIG_SIZE];
+};
+
+
+/* The in-core object describing an index.  */
+struct keybox_index_s
+{
+  int fd;                /* The file descriptor or -1.  */
+  unsigned char *mem;    /* The mapped file or NULL.  */
+  size_t memlen;         /* The length of the mapping.  */
+  u32 nslots;            /* Cached number of slots.  */
+  unsigned int stale:1;  /* The index needs to be rebuilt.  */
+  unsigned int broken:1; /* Don't try to use the index again.  */
+  unsigned int want_sigs:1;  /* Use trigram signatures.  */
+  unsigned int sigs_valid:1; /* SIGS matches the keybox.  */
+  struct index_sig_s *sigs;  /* The trigram signatures.  */
+  size_t nsigs;              /* Number of used items in SIGS.  */
+  size_t sigssize;           /* Allocated items of SIGS.  */
+  char fname[1];         /* The name of the index file.  */
+};
+
+
+/* An entry as collected while building an index.  */
+struct index_entry_s
+{
+  u32 tag;
+  int kind;
+  off_t off;
+};
+
+struct index_entry_list_s
+{
+  struct index_entry_s *items;
+  size_t nitems;
+  size_t size;
+  int no_grips;   /* At least one grip could not be computed.  */
+};
+
+
+static inline void
+put32 (unsigned char *p, u32 a)
+{
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >>  8;
+  p[3] = a;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* Return the slot with index IDX of the index MEM.  */
+static inline unsigned char *
+slot_at (unsigned char *mem, u32 idx)
+{
+  return mem + INDEX_HEADER_SIZE + (size_t)idx * INDEX_SLOT_SIZE;
+}
+
+static inline off_t
+slot_offset (const unsigned char *slot)
+{
+  return (off_t)(((uint64_t)get32 (slot+8) << 32) | get32 (slot+12));
+}
+
+static inline void
+set_slot_offset (unsigned char *slot, off_t off)
+{
+  put32 (slot+8,  (u32)((uint64_t)off >> 32));
+  put32 (slot+12, (u32)((uint64_t)off & 0xffffffff));
+}
+
+
+/* Store the keybox file's stat info ST and the header checksum HASH
+ * into the index header at MEM.  If ST is NULL the fields are set to
+ * zero which marks the index as invalid.  */
+static void
+set_header_stat (unsigned char *mem, const struct stat *st,
+                 const unsigned char *hash)
+{
+  if (st)
+    {
+      put32 (mem+16, (u32)((uint64_t)st->st_size >> 32));
+      put32 (mem+20, (u32)((uint64_t)st->st_size & 0xffffffff));
+      put32 (mem+24, (u32)st->st_mtime);
+      put32 (mem+28, (u32)st->st_ino);
+    }
+  else
+    memset (mem+16, 0, 16);
+  if (hash)
+    memcpy (mem+32, hash, 20);
+}
+
+
+/* Return true if the stat info ST matches the one stored in the index
+ * header at MEM.  */
+static int
+header_stat_matches (const unsigned char *mem, const struct stat *st)
+{
+  return (get32 (mem+16) == (u32)((uint64_t)st->st_size >> 32)
+          && get32 (mem+20) == (u32)((uint64_t)st->st_size & 0xffffffff)
+          && get32 (mem+24) == (u32)st->st_mtime
+          && get32 (mem+28) == (u32)st->st_ino);
+}
+
+
+/* Compute the SHA-1 checksum of the header blob of the keybox file
+ * FNAME and store it at R_HASH.  */
+static gpg_error_t
+hash_keybox_header (const char *fname, unsigned char *r_hash)
+{
+  gpg_error_t err;
+  FILE *fp;
+  unsigned char buffer[32];
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  if (fread (buffer, sizeof buffer, 1, fp) != 1)
+    err = gpg_error (GPG_ERR_TOO_SHORT);
+  else if (buffer[4] != KEYBOX_BLOBTYPE_HEADER)
+    err = gpg_error (GPG_ERR_INV_OBJ);
+  else
+    {
+      gcry_md_hash_buffer (GCRY_MD_SHA1, r_hash, buffer, sizeof buffer);
+      err = 0;
+    }
+  fclose (fp);
+  return err;
+}
+
+
+/* Return the tag for a key with the fingerprint FPR of length
+ * FPRLEN.  This is the low 32 bits of the key ID.  */
+static u32
+tag_from_fpr (const unsigned char *fpr, unsigned int fprlen)
+{
+  if (fprlen == 32)
+    return get32 (fpr + 4);
+  return get32 (fpr + 16);
+}
+
+
+/* Return the tag for the mail address MAIL of length MAILLEN.  This
+ * is the FNV-1a hash of the lowercased address.  */
+static u32
+tag_from_mail (const unsigned char *mail, size_t maillen)
+{
+  u32 hash = 2166136261;
+
+  for (; maillen; mail++, maillen--)
+    hash = (hash ^ ascii_tolower (*mail)) * 16777619;
+  return hash;
+}
+
+
+/* Return the tag for the DN string {NAME,NAMELEN} continuing the
+ * hash HASH; the initial value for HASH is 2166136261.  Unlike mail
+ * addresses DNs are compared verbatim and thus this is a plain
+ * FNV-1a hash.  The same function is used to append the serial
+ * number for issuer/serial tags.  */
+static u32
+tag_from_dn (u32 hash, const unsigned char *name, size_t namelen)
+{
+  for (; namelen; name++, namelen--)
+    hash = (hash ^ *name) * 16777619;
+  return hash;
+}
+
+
+/* Compute the tag and the kind for the search description DESC.
+ * Returns false if the description can't be looked up in the
+ * index.  */
+static int
+tag_from_desc (KEYBOX_SEARCH_DESC *desc, u32 *r_tag, int *r_kind)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      *r_tag = desc->u.kid[1];
+      *r_kind = SLOT_KEY;
+      return 1;
+
+    case KEYDB_SEARCH_MODE_FPR:
+      if (desc->fprlen != 20 && desc->fprlen != 32)
+        return 0;
+      *r_tag = tag_from_fpr (desc->u.fpr, desc->fprlen);
+      *r_kind = SLOT_KEY;
+      return 1;
+
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      *r_tag = get32 (desc->u.grip);
+      *r_kind = SLOT_GRIP;
+      return 1;
+
+    case KEYDB_SEARCH_MODE_MAIL:
+      {
+        const char *s = desc->u.name;
+        size_t n;
+
+        /* Strip the angle brackets the same way has_mail does.  */
+        if (!s)
+          return 0;
+        if (*s == '<')
+          s++;
+        n = strlen (s);
+        if (n && s[n-1] == '>')
+          n--;
+        if (!n)
+          return 0;
+        *r_tag = tag_from_mail ((const unsigned char *)s, n);
+        *r_kind = SLOT_MAIL;
+      }
+      return 1;
+
+    case KEYDB_SEARCH_MODE_SUBJECT:
+    case KEYDB_SEARCH_MODE_ISSUER:
+      if (!desc->u.name)
+        return 0;
+      *r_tag = tag_from_dn (2166136261,
+                            (const unsigned char *)desc->u.name,
+                            strlen (desc->u.name));
+      *r_kind = (desc->mode == KEYDB_SEARCH_MODE_SUBJECT
+                 ? SLOT_SUBJECT : SLOT_ISSUER);
+      return 1;
+
+    case KEYDB_SEARCH_MODE_ISSUER_SN:
+      if (!desc->u.name || !desc->sn)
+        return 0;
+      *r_tag = tag_from_dn (2166136261,
+                            (const unsigned char *)desc->u.name,
+                            strlen (desc->u.name));
+      if (desc->snlen == -1)
+        {
+          /* A hex string; convert it the same way keybox_search
+           * does.  */
+          const char *s = (const char *)desc->sn;
+          unsigned char c;
+          size_t i;
+
+          for (i=0; s[i] && s[i] != '/'; i++)
+            ;
+          if ((i & 1))
+            {
+              c = xtoi_1 (s);
+              *r_tag = tag_from_dn (*r_tag, &c, 1);
+              s++;
+            }
+          for (; *s && *s != '/'; s += 2)
+            {
+              c = xtoi_2 (s);
+              *r_tag = tag_from_dn (*r_tag, &c, 1);
+            }
+        }
+      else
+        *r_tag = tag_from_dn (*r_tag, desc->sn, desc->snlen);
+      *r_kind = SLOT_ISSUER_SN;
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+
+/* Add the trigrams of the string {S,N} to the signature SIG.  */
+static void
+add_trigrams (unsigned char *sig, const unsigned char *s, size_t n)
+{
+  u32 trigram;
+  unsigned int bit;
+
+  for (; n >= 3; s++, n--)
+    {
+      trigram = ((ascii_tolower (s[0]) << 16)
+                 | (ascii_tolower (s[1]) << 8)
+                 | ascii_tolower (s[2]));
+      bit = (u32)(trigram * 2654435761u) >> 24;
+      sig[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+
+/* Compute the trigram signature SIG for the substring search DESC.
+ * Returns false if DESC can't be looked up by a signature.  */
+static int
+sig_from_desc (KEYBOX_SEARCH_DESC *desc, unsigned char *sig)
+{
+  const char *s;
+  size_t n;
+
+  if (desc->mode != KEYDB_SEARCH_MODE_SUBSTR
+      && desc->mode != KEYDB_SEARCH_MODE_MAILSUB)
+    return 0;
+  s = desc->u.name;
+  if (!s)
+    return 0;
+  n = strlen (s);
+  if (desc->mode == KEYDB_SEARCH_MODE_MAILSUB)
+    {
+      if (*s == '<')
+        {
+          s++;
+          n--;
+        }
+      if (n && s[n-1] == '>')
+        n--;
+    }
+  if (n < 3)
+    return 0;  /* Too short for a trigram.  */
+
+  memset (sig, 0, SIG_SIZE);
+  add_trigrams (sig, (const unsigned char *)s, n);
+  return 1;
+}
+
+
+/* Locate the user ID table in the blob {BUFFER,LENGTH}.  On success
+ * the offset of the table, the number of user IDs and the length of
+ * an entry are stored at R_POS, R_NUIDS, and R_UIDINFOLEN.  */
+static int
+find_uid_table (const unsigned char *buffer, size_t length,
+                size_t *r_pos, size_t *r_nuids, size_t *r_uidinfolen)
+{
+  size_t nkeys, keyinfolen, nserial, pos;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  pos = 20 + keyinfolen * nkeys;
+  if ((uint64_t)pos + 2 > (uint64_t)length)
+    return 0;
+  nserial = get16 (buffer + pos);
+  pos += 2 + nserial;
+  if (pos + 4 > length)
+    return 0;
+  *r_nuids = get16 (buffer + pos);
+  *r_uidinfolen = get16 (buffer + pos + 2);
+  pos += 4;
+  if (*r_uidinfolen < 12
+      || (uint64_t)pos + (uint64_t)*r_uidinfolen * *r_nuids > length)
+    return 0;
+  *r_pos = pos;
+  return 1;
+}
+
+
+/* Compute the trigram signature of BLOB and store it at SIG.
+ * Returns false if BLOB has no user IDs.  */
+static int
+compute_blob_sig (KEYBOXBLOB blob, unsigned char *sig)
+{
+  const unsigned char *buffer;
+  size_t length, pos, nuids, uidinfolen, idx, off, len;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0;
+  if (buffer[4] != KEYBOX_BLOBTYPE_PGP && buffer[4] != KEYBOX_BLOBTYPE_X509)
+    return 0;
+  if (!find_uid_table (buffer, length, &pos, &nuids, &uidinfolen))
+    return 0;
+
+  memset (sig, 0, SIG_SIZE);
+  for (idx=0; idx < nuids; idx++, pos += uidinfolen)
+    {
+      off = get32 (buffer + pos);
+      len = get32 (buffer + pos + 4);
+      if ((uint64_t)off + (uint64_t)len > (uint64_t)length)
+        return 0;
+      add_trigrams (sig, buffer + off, len);
+    }
+  return 1;
+}
+
+
+/* Add the signature for BLOB at file offset OFF to INDEX.  */
+static gpg_error_t
+add_blob_sig (struct keybox_index_s *index, KEYBOXBLOB blob, off_t off)
+{
+  unsigned char sig[SIG_SIZE];
+
+  if (!compute_blob_sig (blob, sig))
+    return 0;  /* Nothing to search in this blob.  */
+
+  if (index->nsigs == index->sigssize)
+    {
+      struct index_sig_s *tmp;
+      size_t newsize = index->sigssize? 2 * index->sigssize : 1024;
+
+      tmp = xtryrealloc (index->sigs, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      index->sigs = tmp;
+      index->sigssize = newsize;
+    }
+  index->sigs[index->nsigs].off = off;
+  memcpy (index->sigs[index->nsigs].bits, sig, SIG_SIZE);
+  index->nsigs++;
+  return 0;
+}
+
+
+/* Append an entry to the list L.  */
+static gpg_error_t
+add_entry (struct index_entry_list_s *l, u32 tag, int kind, off_t off)
+{
+  if (l->nitems == l->size)
+    {
+      struct index_entry_s *tmp;
+      size_t newsize = l->size? 2 * l->size : 1024;
+
+      tmp = xtryrealloc (l->items, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      l->items = tmp;
+      l->size = newsize;
+    }
+  l->items[l->nitems].tag = tag;
+  l->items[l->nitems].kind = kind;
+  l->items[l->nitems].off = off;
+  l->nitems++;
+  return 0;
+}
+
+
+/* Add all index entries for BLOB at file offset OFF to the list
+ * L.  */
+static gpg_error_t
+collect_blob_entries (KEYBOXBLOB blob, off_t off,
+                      struct index_entry_list_s *l)
+{
+  gpg_error_t err;
+  const unsigned char *buffer;
+  size_t length, nkeys, keyinfolen, pos;
+  size_t nuids, uidinfolen, uidoff, uidlen;
+  size_t cert_off, cert_len, snpos, nserial;
+  int idx, blobtype, fpr32, fprlen;
+  u32 tag;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0; /* Too short - ignore.  */
+  blobtype = buffer[4];
+  if (blobtype != KEYBOX_BLOBTYPE_PGP && blobtype != KEYBOX_BLOBTYPE_X509)
+    return 0;
+  fpr32 = buffer[5] == 2;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (keyinfolen < (fpr32? 56:28))
+    return 0; /* Invalid blob.  */
+  if (20 + (uint64_t)keyinfolen * nkeys > (uint64_t)length)
+    return 0; /* Out of bounds.  */
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      pos = 20 + idx * keyinfolen;
+      if (fpr32)
+        fprlen = (get16 (buffer + pos + 32) & 0x80)? 32 : 20;
+      else
+        fprlen = 20;
+      err = add_entry (l, tag_from_fpr (buffer + pos, fprlen), SLOT_KEY, off);
+      if (err)
+        return err;
+    }
+
+  /* Add the mail addresses.  For X.509 index 0 is the issuer.  */
+  if (find_uid_table (buffer, length, &pos, &nuids, &uidinfolen))
+    {
+      for (idx = (blobtype == KEYBOX_BLOBTYPE_X509); idx < nuids; idx++)
+        {
+          uidoff = get32 (buffer + pos + idx * uidinfolen);
+          uidlen = get32 (buffer + pos + idx * uidinfolen + 4);
+          if ((uint64_t)uidoff + (uint64_t)uidlen > (uint64_t)length)
+            break;
+          if (!_keybox_locate_mail (buffer, &uidoff, &uidlen,
+                                    blobtype == KEYBOX_BLOBTYPE_X509))
+            continue;
+          err = add_entry (l, tag_from_mail (buffer + uidoff, uidlen),
+                           SLOT_MAIL, off);
+          if (err)
+            return err;
+        }
+    }
+
+  /* Add the subject, the issuer and the issuer/serial pair of a
+   * certificate.  Only the first subject name is considered because
+   * has_subject does the same.  find_uid_table has already checked
+   * that the serial number, which directly follows the key table, is
+   * within the blob.  */
+  if (blobtype == KEYBOX_BLOBTYPE_X509
+      && find_uid_table (buffer, length, &pos, &nuids, &uidinfolen)
+      && nuids >= 2)
+    {
+      for (idx=0; idx < 2; idx++)
+        {
+          uidoff = get32 (buffer + pos + idx * uidinfolen);
+          uidlen = get32 (buffer + pos + idx * uidinfolen + 4);
+          if ((uint64_t)uidoff + (uint64_t)uidlen > (uint64_t)length)
+            break;
+          if (!uidlen)
+            continue;
+          tag = tag_from_dn (2166136261, buffer + uidoff, uidlen);
+          err = add_entry (l, tag, idx? SLOT_SUBJECT : SLOT_ISSUER, off);
+          if (!err && !idx)
+            {
+              snpos = 20 + keyinfolen * nkeys;
+              nserial = get16 (buffer + snpos);
+              err = add_entry (l, tag_from_dn (tag, buffer + snpos + 2,
+                                               nserial),
+                               SLOT_ISSUER_SN, off);
+            }
+          if (err)
+            return err;
+        }
+    }
+
+  /* The keygrips are not stored in the blob; thus we need to parse
+   * the keyblock or certificate.  */
+  cert_off = get32 (buffer + 8);
+  cert_len = get32 (buffer + 12);
+  if ((uint64_t)cert_off + (uint64_t)cert_len > (uint64_t)length)
+    return 0; /* Out of bounds.  */
+
+  if (blobtype == KEYBOX_BLOBTYPE_PGP)
+    {
+      struct _keybox_openpgp_info info;
+      struct _keybox_openpgp_key_info *k;
+
+      if (_keybox_parse_openpgp (buffer + cert_off, cert_len, NULL, &info))
+        return 0; /* Parse error - the search would not find it either. */
+      err = add_entry (l, get32 (info.primary.grip), SLOT_GRIP, off);
+      if (!err && info.nsubkeys)
+        for (k = &info.subkeys; k && !err; k = k->next)
+          err = add_entry (l, get32 (k->grip), SLOT_GRIP, off);
+      _keybox_destroy_openpgp_info (&info);
+      if (err)
+        return err;
+    }
+  else
+    {
+#ifdef KEYBOX_WITH_X509
+      unsigned char grip[20];
+
+      if (!_keybox_x509_get_grip (buffer + cert_off, cert_len, grip))
+        {
+          err = add_entry (l, get32 (grip), SLOT_GRIP, off);
+          if (err)
+            return err;
+        }
+#else
+      l->no_grips = 1;
+#endif
+    }
+
+  return 0;
+}
+
+
+/* Put the entry (TAG,KIND,OFF) into the table with NSLOTS at MEM.
+ * There must be at least one unused slot.  */
+static void
+put_slot (unsigned char *mem, u32 nslots, u32 tag, int kind, off_t off)
+{
+  u32 idx;
+  unsigned char *slot;
+
+  for (idx = tag & (nslots - 1); ; idx = (idx + 1) & (nslots - 1))
+    {
+      slot = slot_at (mem, idx);
+      if (slot[4] == SLOT_EMPTY || slot[4] == SLOT_DELETED)
+        break;
+    }
+  put32 (slot, tag);
+  slot[4] = kind;
+  slot[5] = slot[6] = slot[7] = 0;
+  set_slot_offset (slot, off);
+}
+
+
+/* Create the index file FNAME from the entries in L using at least
+ * NSLOTS slots.  ST and HASH describe the state of the keybox file.
+ * The file is written to a temporary file which is then renamed.  */
+static gpg_error_t
+write_index_file (const char *fname,
+                  struct index_entry_list_s *l, u32 nslots,
+                  const struct stat *st, const unsigned char *hash)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  unsigned char *mem;
+  size_t memlen, n;
+  FILE *fp;
+
+  if (nslots < INDEX_MIN_SLOTS)
+    nslots = INDEX_MIN_SLOTS;
+  while (nslots < 2 * l->nitems)
+    {
+      if (nslots >= 0x40000000)
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      nslots *= 2;
+    }
+
+  memlen = INDEX_HEADER_SIZE + (size_t)nslots * INDEX_SLOT_SIZE;
+  mem = xtrycalloc (1, memlen);
+  if (!mem)
+    return gpg_error_from_syserror ();
+
+  memcpy (mem, "KBXi", 4);
+  mem[4] = 1;  /* Version.  */
+  mem[7] |= INDEX_FLAG_MAILS | INDEX_FLAG_X509;
+  if (!l->no_grips)
+    mem[7] |= INDEX_FLAG_GRIPS;
+  put32 (mem+8, nslots);
+  put32 (mem+12, l->nitems);
+  set_header_stat (mem, st, hash);
+  for (n=0; n < l->nitems; n++)
+    put_slot (mem, nslots, l->items[n].tag, l->items[n].kind, l->items[n].off);
+
+  tmpfname = xtryasprintf ("%s" EXTSEP_S "tmp", fname);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (mem);
+      return err;
+    }
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (mem, memlen, 1, fp) != 1)
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  xfree (tmpfname);
+  xfree (mem);
+  return err;
+}
+
+
+/* Release the mapping of INDEX.  */
+static void
+unmap_index (struct keybox_index_s *index)
+{
+  if (index->mem)
+    {
+      munmap (index->mem, index->memlen);
+      index->mem = NULL;
+      index->memlen = 0;
+    }
+  if (index->fd != -1)
+    {
+      close (index->fd);
+      index->fd = -1;
+    }
+  index->nslots = 0;
+}
+
+
+/* Map the index file of INDEX into memory and check its header.  */
+static gpg_error_t
+map_index (struct keybox_index_s *index)
+{
+  gpg_error_t err;
+  struct stat st;
+  void *mem;
+
+  unmap_index (index);
+
+  index->fd = open (index->fname, O_RDWR);
+  if (index->fd == -1)
+    return gpg_error_from_syserror ();
+  if (fstat (index->fd, &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (st.st_size < INDEX_HEADER_SIZE)
+    {
+      err = gpg_error (GPG_ERR_TOO_SHORT);
+      goto leave;
+    }
+
+  mem = mmap (NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+              index->fd, 0);
+  if (mem == MAP_FAILED)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  index->mem = mem;
+  index->memlen = st.st_size;
+
+  index->nslots = get32 (index->mem + 8);
+  if (memcmp (index->mem, "KBXi", 4) || index->mem[4] != 1
+      || !index->nslots || (index->nslots & (index->nslots - 1))
+      || (INDEX_HEADER_SIZE + (uint64_t)index->nslots * INDEX_SLOT_SIZE
+          != (uint64_t)index->memlen))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+
+  err = 0;
+
+ leave:
+  if (err)
+    unmap_index (index);
+  return err;
+}
+
+
+/* Scan the keybox of KB and write a new index file.  */
+static gpg_error_t
+build_index (KB_NAME kb)
+{
+  gpg_error_t err;
+  struct keybox_index_s *index = kb->index;
+  struct index_entry_list_s list;
+  struct stat st;
+  unsigned char hash[20];
+  KEYBOXBLOB blob = NULL;
+  FILE *fp;
+  int rc;
+
+  memset (&list, 0, sizeof list);
+  unmap_index (index);
+  index->nsigs = 0;
+  index->sigs_valid = 0;
+
+  fp = fopen (kb->fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  if (fstat (fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      return err;
+    }
+
+  while (!(rc = _keybox_read_blob (&blob, fp, NULL))
+         || (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+             && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX))
+    {
+      if (!rc)
+        {
+          err = collect_blob_entries (blob, _keybox_get_blob_fileoffset (blob),
+                                      &list);
+          _keybox_release_blob (blob);
+          blob = NULL;
+          if (err)
+            goto leave;
+        }
+    }
+  if (rc != -1)
+    {
+      err = rc;
+      goto leave;
+    }
+  fclose (fp);
+  fp = NULL;
+
+  err = hash_keybox_header (kb->fname, hash);
+  if (err)
+    goto leave;
+
+  err = write_index_file (index->fname, &list, 0, &st, hash);
+  if (err)
+    goto leave;
+
+  err = map_index (index);
+  if (err)
+    goto leave;
+
+  index->stale = 0;
+
+ leave:
+  if (fp)
+    fclose (fp);
+  xfree (list.items);
+  return err;
+}
+
+
+/* Scan the keybox of KB and build the table of trigram signatures.  */
+static gpg_error_t
+build_sigs (KB_NAME kb)
+{
+  gpg_error_t err = 0;
+  struct keybox_index_s *index = kb->index;
+  KEYBOXBLOB blob = NULL;
+  FILE *fp;
+  int rc;
+
+  index->nsigs = 0;
+  index->sigs_valid = 0;
+
+  fp = fopen (kb->fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  while (!(rc = _keybox_read_blob (&blob, fp, NULL))
+         || (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+             && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX))
+    {
+      if (!rc)
+        {
+          err = add_blob_sig (index, blob, _keybox_get_blob_fileoffset (blob));
+          _keybox_release_blob (blob);
+          blob = NULL;
+          if (err)
+            break;
+        }
+    }
+  if (!err && rc != -1)
+    err = rc;
+  fclose (fp);
+
+  if (!err)
+    index->sigs_valid = 1;
+  return err;
+}
+
+
+/* Grow the index of KB so that at least NEEDED new entries can be
+ * inserted.  The existing entries are rehashed which also gets rid
+ * of deleted slots.  */
+static gpg_error_t
+grow_index (KB_NAME kb, size_t needed)
+{
+  gpg_error_t err;
+  struct keybox_index_s *index = kb->index;
+  struct index_entry_list_s list;
+  unsigned char *slot;
+  unsigned char hash[20];
+  struct stat st;
+  u32 idx, nslots;
+
+  memset (&list, 0, sizeof list);
+  for (idx=0; idx < index->nslots; idx++)
+    {
+      slot = slot_at (index->mem, idx);
+      if (slot_kind_used (slot[4]))
+        {
+          err = add_entry (&list, get32 (slot), slot[4], slot_offset (slot));
+          if (err)
+            goto leave;
+        }
+    }
+  list.no_grips = !(index->mem[7] & INDEX_FLAG_GRIPS);
+
+  /* The stat info is updated by the caller after the keybox file
+   * has been written; thus we mark the new index as not yet valid.  */
+  memcpy (hash, index->mem + 32, 20);
+  memset (&st, 0, sizeof st);
+  nslots = index->nslots;
+  if (2 * (list.nitems + needed) > nslots)
+    nslots *= 2;
+  while (2 * (list.nitems + needed) > nslots)
+    nslots *= 2;
+
+  err = write_index_file (index->fname, &list, nslots, &st, hash);
+  if (!err)
+    err = map_index (index);
+
+ leave:
+  xfree (list.items);
+  return err;
+}
+
+
+/* Make sure that the index of KB is mapped and matches the keybox
+ * file.  Rebuild it if needed.  */
+static gpg_error_t
+ensure_index (KB_NAME kb)
+{
+  gpg_error_t err;
+  struct keybox_index_s *index = kb->index;
+  struct stat st;
+  unsigned char hash[20];
+
+  if (index->broken)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (stat (kb->fname, &st))
+    return gpg_error_from_syserror ();
+
+  if (!index->mem && !index->stale)
+    {
+      /* First use: Check the existing index file.  */
+      if (map_index (index)
+          || !(index->mem[7] & INDEX_FLAG_MAILS)
+          || !(index->mem[7] & INDEX_FLAG_X509)
+          || hash_keybox_header (kb->fname, hash)
+          || memcmp (index->mem + 32, hash, 20))
+        index->stale = 1;
+    }
+
+  if (index->stale || !index->mem || !header_stat_matches (index->mem, &st))
+    {
+      err = build_index (kb);
+      if (err)
+        {
+          log_info ("error creating keybox index '%s': %s\n",
+                    index->fname, gpg_strerror (err));
+          index->broken = 1;
+          unmap_index (index);
+          return gpg_error (GPG_ERR_NOT_SUPPORTED);
+        }
+    }
+
+  return 0;
+}
+
+
+/* Return true if the signature SIG contains all bits of the search
+ * signature WANT.  */
+static int
+sig_matches (const unsigned char *sig, const unsigned char *want)
+{
+  int i;
+
+  for (i=0; i < SIG_SIZE; i++)
+    if ((sig[i] & want[i]) != want[i])
+      return 0;
+  return 1;
+}
+
+
+/* Append OFF to the array at R_OFFTBL which has R_NOFFS used and
+ * R_SIZE allocated items.  */
+static gpg_error_t
+append_offset (off_t **r_offtbl, size_t *r_noffs, size_t *r_size, off_t off)
+{
+  if (*r_noffs == *r_size)
+    {
+      off_t *tmp;
+      size_t newsize = *r_size? 2 * *r_size : 16;
+
+      tmp = xtryrealloc (*r_offtbl, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      *r_offtbl = tmp;
+      *r_size = newsize;
+    }
+  (*r_offtbl)[(*r_noffs)++] = off;
+  return 0;
+}
+
+
+/* qsort helper to sort an array of file offsets.  */
+static int
+compare_offsets (const void *a_arg, const void *b_arg)
+{
+  off_t a = *(const off_t *)a_arg;
+  off_t b = *(const off_t *)b_arg;
+
+  return a < b? -1 : a > b? 1 : 0;
+}
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Enable the use of an index for the keybox KB.  FLAGS are the
+ * KEYBOX_INDEX_* flags.  */
+gpg_error_t
+_keybox_index_enable (KB_NAME kb, unsigned int flags)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+  (void)flags;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#else
+  struct keybox_index_s *index;
+
+  if (kb->index)
+    {
+      if ((flags & KEYBOX_INDEX_TRIGRAMS))
+        kb->index->want_sigs = 1;
+      return 0;  /* Already enabled.  */
+    }
+
+  index = xtrycalloc (1, sizeof *index + strlen (kb->fname) + 4);
+  if (!index)
+    return gpg_error_from_syserror ();
+  strcpy (stpcpy (index->fname, kb->fname), EXTSEP_S "idx");
+  index->fd = -1;
+  index->want_sigs = !!(flags & KEYBOX_INDEX_TRIGRAMS);
+  kb->index = index;
+  return 0;
+#endif
+}
+
+
+/* Lookup the search descriptions (DESC,NDESC) in the index of KB.  On
+ * success a sorted array of candidate blob offsets not less than
+ * STARTOFF is stored at R_OFFTBL and its length at R_NOFFS; the
+ * caller must release the array.  Returns GPG_ERR_NOT_SUPPORTED if
+ * the index can't be used for this search.  */
+gpg_error_t
+_keybox_index_lookup (KB_NAME kb, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                      off_t startoff, off_t **r_offtbl, size_t *r_noffs)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+  (void)desc;
+  (void)ndesc;
+  (void)startoff;
+  *r_offtbl = NULL;
+  *r_noffs = 0;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#else
+  gpg_error_t err;
+  struct keybox_index_s *index = kb->index;
+  off_t *offtbl = NULL;
+  size_t noffs, size, n, i;
+  unsigned char *slot;
+  unsigned char sig[SIG_SIZE];
+  u32 tag, idx;
+  int kind;
+
+  *r_offtbl = NULL;
+  *r_noffs = 0;
+
+  if (!index || !ndesc)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  for (n=0; n < ndesc; n++)
+    if (!tag_from_desc (desc + n, &tag, &kind)
+        && !(index->want_sigs && sig_from_desc (desc + n, sig)))
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = ensure_index (kb);
+  if (err)
+    return err;
+
+  noffs = size = 0;
+  for (n=0; n < ndesc; n++)
+    {
+      if (!tag_from_desc (desc + n, &tag, &kind))
+        {
+          /* A substring search; use the trigram signatures.  */
+          if (!index->sigs_valid && build_sigs (kb))
+            {
+              err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+              goto leave;
+            }
+          sig_from_desc (desc + n, sig);
+          for (i=0; i < index->nsigs; i++)
+            {
+              if (index->sigs[i].off < startoff
+                  || !sig_matches (index->sigs[i].bits, sig))
+                continue;
+              err = append_offset (&offtbl, &noffs, &size,
+                                   index->sigs[i].off);
+              if (err)
+                goto leave;
+            }
+          continue;
+        }
+
+      if (kind == SLOT_GRIP && !(index->mem[7] & INDEX_FLAG_GRIPS))
+        {
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          goto leave;
+        }
+      for (idx = tag & (index->nslots - 1), i = 0;
+           i < index->nslots;
+           idx = (idx + 1) & (index->nslots - 1), i++)
+        {
+          slot = slot_at (index->mem, idx);
+          if (slot[4] == SLOT_EMPTY)
+            break;
+          if (slot[4] != kind || get32 (slot) != tag
+              || slot_offset (slot) < startoff)
+            continue;
+          err = append_offset (&offtbl, &noffs, &size, slot_offset (slot));
+          if (err)
+            goto leave;
+        }
+    }
+
+  if (noffs > 1)
+    {
+      /* Sort and remove duplicates so that the blobs are visited in
+       * the same order as with a sequential scan.  */
+      qsort (offtbl, noffs, sizeof *offtbl, compare_offsets);
+      for (n=1, i=1; i < noffs; i++)
+        if (offtbl[i] != offtbl[n-1])
+          offtbl[n++] = offtbl[i];
+      noffs = n;
+    }
+
+  *r_offtbl = offtbl;
+  *r_noffs = noffs;
+  offtbl = NULL;
+
+ leave:
+  xfree (offtbl);
+  return err;
+#endif
+}
+
+
+/* Prepare the index of KB for an update of the keybox file.  This
+ * must be called before the file is changed.  If the index does not
+ * match the current file it is marked for a rebuild; otherwise it is
+ * marked as being updated.  */
+void
+_keybox_index_begin_update (KB_NAME kb)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+#else
+  struct keybox_index_s *index = kb->index;
+  struct stat st;
+
+  if (!index || index->broken || index->stale || !index->mem)
+    return;
+  if (stat (kb->fname, &st) || !header_stat_matches (index->mem, &st))
+    index->stale = 1;
+  else
+    set_header_stat (index->mem, NULL, NULL);
+#endif
+}
+
+
+/* Add the entries of the new BLOB at file offset OFF to the index
+ * of KB. */
+void
+_keybox_index_insert_blob (KB_NAME kb, KEYBOXBLOB blob, off_t off)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+  (void)blob;
+  (void)off;
+#else
+  struct keybox_index_s *index = kb->index;
+  struct index_entry_list_s list;
+  size_t n;
+
+  if (!index || index->broken || index->stale || !index->mem)
+    return;
+
+  memset (&list, 0, sizeof list);
+  if (collect_blob_entries (blob, off, &list))
+    goto failed;
+  if (list.no_grips)
+    index->mem[7] &= ~INDEX_FLAG_GRIPS;
+
+  if (2 * (get32 (index->mem + 12) + list.nitems) > index->nslots)
+    {
+      if (grow_index (kb, list.nitems))
+        goto failed;
+    }
+
+  for (n=0; n < list.nitems; n++)
+    put_slot (index->mem, index->nslots,
+              list.items[n].tag, list.items[n].kind, list.items[n].off);
+  put32 (index->mem + 12, get32 (index->mem + 12) + list.nitems);
+  xfree (list.items);
+  if (index->sigs_valid && add_blob_sig (index, blob, off))
+    index->sigs_valid = 0;
+  return;
+
+ failed:
+  xfree (list.items);
+  index->stale = 1;
+#endif
+}
+
+
+/* Remove all entries for the blob at OFF from the index of KB.  If
+ * DELTA is not zero the offsets of all blobs after OFF are adjusted
+ * by DELTA; this is used if a blob has been replaced by one of a
+ * different length.  */
+void
+_keybox_index_remove_blob (KB_NAME kb, off_t off, off_t delta)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+  (void)off;
+  (void)delta;
+#else
+  struct keybox_index_s *index = kb->index;
+  unsigned char *slot;
+  off_t slotoff;
+  u32 idx;
+
+  if (!index || index->broken || index->stale || !index->mem)
+    return;
+
+  for (idx=0; idx < index->nslots; idx++)
+    {
+      slot = slot_at (index->mem, idx);
+      if (!slot_kind_used (slot[4]))
+        continue;
+      slotoff = slot_offset (slot);
+      if (slotoff == off)
+        slot[4] = SLOT_DELETED;
+      else if (delta && slotoff > off)
+        set_slot_offset (slot, slotoff + delta);
+    }
+
+  if (index->sigs_valid)
+    {
+      size_t n = 0;
+
+      while (n < index->nsigs)
+        {
+          if (index->sigs[n].off == off)
+            {
+              /* The order of the table does not matter.  */
+              index->sigs[n] = index->sigs[--index->nsigs];
+              continue;
+            }
+          if (delta && index->sigs[n].off > off)
+            index->sigs[n].off += delta;
+          n++;
+        }
+    }
+#endif
+}
+
+
+/* Finish an update of the keybox of KB by storing the new state of
+ * the keybox file in the index.  If the index could not be updated
+ * it will be rebuilt with the next lookup.  */
+void
+_keybox_index_end_update (KB_NAME kb)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kb;
+#else
+  struct keybox_index_s *index = kb->index;
+  unsigned char hash[20];
+  struct stat st;
+
+  if (!index || index->broken || !index->mem)
+    return;
+  if (!index->stale
+      && !stat (kb->fname, &st)
+      && !hash_keybox_header (kb->fname, hash))
+    set_header_stat (index->mem, &st, hash);
+  else
+    index->stale = 1;
+#endif
+}
+
+
+/* Mark the index of KB as invalid.  This is used after operations
+ * which change the layout of the entire file.  */
+void
+_keybox_index_invalidate (KB_NAME kb)
+{
+  if (kb->index)
+    kb->index->stale = 1;
+}
+
+
+
+/* The following functions allow to build the index of a keybox file
+ * from blobs which are parsed elsewhere; for example by several
+ * threads each working on a part of the file.  Create a new and
+ * empty list of index entries.  Returns NULL on error.  */
+keybox_index_entries_t
+_keybox_index_new_entries (void)
+{
+  return xtrycalloc (1, sizeof (struct index_entry_list_s));
+}
+
+
+/* Release the list of index entries L.  */
+void
+_keybox_index_release_entries (keybox_index_entries_t l)
+{
+  if (!l)
+    return;
+  xfree (l->items);
+  xfree (l);
+}
+
+
+/* Add the index entries for BLOB at file offset OFF to the list L.  */
+gpg_error_t
+_keybox_index_add_blob_entries (keybox_index_entries_t l,
+                                KEYBOXBLOB blob, off_t off)
+{
+  return collect_blob_entries (blob, off, l);
+}
+
+
+/* Append all entries of the list SRC to the list DST.  */
+gpg_error_t
+_keybox_index_merge_entries (keybox_index_entries_t dst,
+                             keybox_index_entries_t src)
+{
+  struct index_entry_s *tmp;
+  size_t newsize;
+
+  if (dst->nitems + src->nitems > dst->size)
+    {
+      newsize = dst->nitems + src->nitems;
+      tmp = xtryrealloc (dst->items, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      dst->items = tmp;
+      dst->size = newsize;
+    }
+  memcpy (dst->items + dst->nitems, src->items,
+          src->nitems * sizeof *src->items);
+  dst->nitems += src->nitems;
+  if (src->no_grips)
+    dst->no_grips = 1;
+  return 0;
+}
+
+
+/* Write the index for the keybox file KBXFNAME from the entries in
+ * L.  ST is the stat information of the keybox file taken before its
+ * blobs were read.  */
+gpg_error_t
+_keybox_index_write_entries (const char *kbxfname, const struct stat *st,
+                             keybox_index_entries_t l)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)kbxfname;
+  (void)st;
+  (void)l;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#else
+  gpg_error_t err;
+  unsigned char hash[20];
+  char *fname;
+
+  err = hash_keybox_header (kbxfname, hash);
+  if (err)
+    return err;
+
+  fname = xtryasprintf ("%s" EXTSEP_S "idx", kbxfname);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  err = write_index_file (fname, l, 0, st, hash);
+  xfree (fname);
+  return err;
+#endif
+}
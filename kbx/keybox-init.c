@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "keybox-defs.h"
 #include "../common/mischelp.h"
@@ -63,6 +64,8 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  kr->index = NULL;
+  kr->inplace_update = 0;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -84,6 +87,44 @@ keybox_is_writable (void *token)
 }
 
 
+/* Enable the use of a sidecar index file for the resource identified
+ * by TOKEN.  The index maps fingerprints, key IDs, keygrips, mail
+ * addresses and the subject and issuer DNs of certificates to blob
+ * offsets and is created or rebuilt as needed.
+ * With the flag KEYBOX_INDEX_TRIGRAMS substring searches are sped up
+ * using an in-core table of trigram signatures.  Because it is
+ * only kept up to date by our own update functions this should only
+ * be used by a process which owns the keybox, i.e. keyboxd.  */
+gpg_error_t
+keybox_enable_index (void *token, unsigned int flags)
+{
+  KB_NAME r = token;
+
+  if (!r)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  return _keybox_index_enable (r, flags);
+}
+
+
+/* Switch the resource identified by TOKEN to in-place updates.  New
+ * blobs are then appended to the file and an updated blob is written
+ * over the old one if it fits; otherwise the old blob is marked as
+ * deleted.  The space of deleted blobs is reclaimed only by
+ * keybox_compress or keybox_compact.  Other processes reading the
+ * file may see a partly updated file and thus this should only be
+ * used by a process which owns the keybox, i.e. keyboxd.  */
+gpg_error_t
+keybox_enable_inplace_update (void *token)
+{
+  KB_NAME r = token;
+
+  if (!r)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  r->inplace_update = 1;
+  return 0;
+}
+
+
 
 static KEYBOX_HANDLE
 do_keybox_new (KB_NAME resource, int secret, int for_openpgp)
@@ -177,6 +218,7 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -235,6 +277,53 @@ keybox_set_ephemeral (KEYBOX_HANDLE hd, int yes)
 }
 
 
+/* Enable or disable the memory mapped read path for HD.  If enabled,
+ * searches parse the blobs in place from a read-only mapping of the
+ * file instead of reading each blob into a new buffer.  The mapping
+ * is renewed when the file grows or has been replaced.  On systems
+ * without mmap this is silently ignored.  */
+gpg_error_t
+keybox_set_mmap (KEYBOX_HANDLE hd, int yes)
+{
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  hd->map.enabled = !!yes;
+  if (!hd->map.enabled)
+    _keybox_unmap_file (hd);
+  return 0;
+}
+
+
+/* Close the file of HD if the keybox has been replaced on disk since
+ * it was opened; the next search will then open the new file.  This
+ * is useful for handles which are kept open for a long time.  */
+void
+keybox_refresh_file (KEYBOX_HANDLE hd)
+{
+#ifndef HAVE_W32_SYSTEM
+  struct stat st_fp, st_name;
+
+  if (!hd || !hd->fp)
+    return;
+
+  if (fstat (fileno (hd->fp), &st_fp)
+      || stat (hd->kb->fname, &st_name)
+      || st_fp.st_dev != st_name.st_dev
+      || st_fp.st_ino != st_name.st_ino)
+    {
+      _keybox_unmap_file (hd);
+      if (hd->fp)
+        {
+          fclose (hd->fp);
+          hd->fp = NULL;
+        }
+    }
+#else
+  (void)hd;  /* An open file can't be replaced on Windows.  */
+#endif
+}
+
+
 /* Close the file of the resource identified by HD.  For consistent
    results this function closes the files of all handles pointing to
    the resource identified by HD.  */
@@ -250,6 +339,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
@@ -277,7 +367,7 @@ keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout)
   /* Make sure the lock handle has been created.  */
   if (!kb->lockhd)
     {
-      kb->lockhd = dotlock_create (kb->fname, 0);
+      kb->lockhd = dotlock_create (kb->fname, DOTLOCK_WAIT_QUEUE);
       if (!kb->lockhd)
         {
           err = gpg_error_from_syserror ();
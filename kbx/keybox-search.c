@@ -29,6 +29,7 @@
 #include <gcrypt.h>
 #include "../common/host2net.h"
 #include "../common/mbox-util.h"
+#include "../common/tracepoint.h"
 
 #define xtoi_1(p)   (*(p) <= '9'? (*(p)- '0'): \
                      *(p) <= 'F'? (*(p)-'A'+10):(*(p)-'a'+10))
@@ -238,41 +239,59 @@ blob_cmp_sn (KEYBOXBLOB blob, const unsigned char *sn, int snlen)
 }
 
 
+/* Return the 4 bytes at P as an integer in native byte order.  This
+ * is used for a quick pre-comparison of fingerprints; a memcpy is
+ * used because P is not necessarily aligned.  */
+static inline u32
+load_fpr_word (const unsigned char *p)
+{
+  u32 w;
+
+  memcpy (&w, p, 4);
+  return w;
+}
+
+
 /* Returns 0 if not found or the number of the key which was found.
    For X.509 this is always 1, for OpenPGP this is 1 for the primary
    key and 2 and more for the subkeys.  */
 static int
 blob_cmp_fpr (KEYBOXBLOB blob, const unsigned char *fpr, unsigned int fprlen)
 {
-  const unsigned char *buffer;
+  const unsigned char *buffer, *p;
   size_t length;
-  size_t pos, off;
   size_t nkeys, keyinfolen;
   int idx, fpr32, storedfprlen;
+  u32 fprword;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
     return 0; /* blob too short */
   fpr32 = buffer[5] == 2;
+  if (!fpr32 && fprlen != 20)
+    return 0; /* Only 20 byte fingerprints are stored.  */
 
   /*keys*/
   nkeys = get16 (buffer + 16);
   keyinfolen = get16 (buffer + 18 );
   if (keyinfolen < (fpr32?56:28))
     return 0; /* invalid blob */
-  pos = 20;
-  if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+  if (20 + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
     return 0; /* out of bounds */
 
-  for (idx=0; idx < nkeys; idx++)
+  /* Most keys already differ in the first 4 bytes; thus we compare
+   * them as one word before we look at the length and the rest.  */
+  fprword = load_fpr_word (fpr);
+  for (idx=0, p = buffer + 20; idx < nkeys; idx++, p += keyinfolen)
     {
-      off = pos + idx*keyinfolen;
+      if (load_fpr_word (p) != fprword)
+        continue;
       if (fpr32)
-        storedfprlen = (get16 (buffer + off + 32) & 0x80)? 32:20;
+        storedfprlen = (get16 (p + 32) & 0x80)? 32:20;
       else
         storedfprlen = 20;
       if (storedfprlen == fprlen
-          && !memcmp (buffer + off, fpr, storedfprlen))
+          && !memcmp (p + 4, fpr + 4, storedfprlen - 4))
         return idx+1; /* found */
     }
   return 0; /* not found */
@@ -284,11 +303,11 @@ static int
 blob_cmp_fpr_part (KEYBOXBLOB blob, const unsigned char *fpr,
                    int fproff, int fprlen)
 {
-  const unsigned char *buffer;
+  const unsigned char *buffer, *p;
   size_t length;
-  size_t pos, off;
   size_t nkeys, keyinfolen;
   int idx, fpr32, storedfprlen;
+  u32 fprword;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
@@ -300,21 +319,26 @@ blob_cmp_fpr_part (KEYBOXBLOB blob, const unsigned char *fpr,
   keyinfolen = get16 (buffer + 18 );
   if (keyinfolen < (fpr32?56:28))
     return 0; /* invalid blob */
-  pos = 20;
-  if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+  if (20 + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
     return 0; /* out of bounds */
 
   if (fpr32)
     fproff = 0; /* keyid are the high-order bits.  */
-  for (idx=0; idx < nkeys; idx++)
+  if (!fpr32 && fproff + fprlen != 20)
+    return 0; /* Only 20 byte fingerprints are stored.  */
+
+  /* The key ID part is at least 4 bytes; see blob_cmp_fpr.  */
+  fprword = load_fpr_word (fpr);
+  for (idx=0, p = buffer + 20 + fproff; idx < nkeys; idx++, p += keyinfolen)
     {
-      off = pos + idx*keyinfolen;
+      if (load_fpr_word (p) != fprword)
+        continue;
       if (fpr32)
-        storedfprlen = (get16 (buffer + off + 32) & 0x80)? 32:20;
+        storedfprlen = (get16 (p - fproff + 32) & 0x80)? 32:20;
       else
         storedfprlen = 20;
       if (storedfprlen == fproff + fprlen
-          && !memcmp (buffer + off + fproff, fpr, fprlen))
+          && !memcmp (p + 4, fpr + 4, fprlen - 4))
         return idx+1; /* found */
     }
   return 0; /* not found */
@@ -412,6 +436,64 @@ blob_cmp_name (KEYBOXBLOB blob, int idx,
 }
 
 
+/* Locate the mail address in the user ID {BUFFER+*R_OFF,*R_LEN} and
+   update R_OFF and R_LEN to describe only the mail address.  Returns
+   false if the user ID does not have a mail address.  The X509 flag
+   indicates that the user ID is from an X.509 blob.  */
+int
+_keybox_locate_mail (const unsigned char *buffer, size_t *r_off,
+                     size_t *r_len, int x509)
+{
+  size_t off = *r_off;
+  size_t len = *r_len;
+  size_t mypos, mylen;
+
+  if (x509)
+    {
+      if (len < 2 || buffer[off] != '<')
+        return 0; /* empty name or trailing 0 not stored */
+      len--; /* one back */
+      if ( len < 3 || buffer[off+len] != '>')
+        return 0; /* not a proper email address */
+      off++;
+      len--;
+    }
+  else /* OpenPGP.  */
+    {
+      /* We need to forward to the mailbox part.  */
+      mypos = off;
+      mylen = len;
+      for ( ; len && buffer[off] != '<'; len--, off++)
+        ;
+      if (len < 2 || buffer[off] != '<')
+        {
+          /* Mailbox not explicitly given or too short.  Restore
+             OFF and LEN and check whether the entire string
+             resembles a mailbox without the angle brackets.  */
+          off = mypos;
+          len = mylen;
+          if (!is_valid_mailbox_mem (buffer+off, len))
+            return 0; /* Not a mail address. */
+        }
+      else /* Seems to be standard user id with mail address.  */
+        {
+          off++; /* Point to first char of the mail address.  */
+          len--;
+          /* Search closing '>'.  */
+          for (mypos=off; len && buffer[mypos] != '>'; len--, mypos++)
+            ;
+          if (!len || buffer[mypos] != '>' || off == mypos)
+            return 0; /* Not a proper mail address.  */
+          len = mypos - off;
+        }
+    }
+
+  *r_off = off;
+  *r_len = len;
+  return 1;
+}
+
+
 /* Compare all email addresses of the subject.  With SUBSTR given as
    True a substring search is done in the mail address.  The X509 flag
    indicated whether the search is done on an X.509 blob.  */
@@ -463,53 +545,14 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
   for (idx=!!x509 ;idx < nuids; idx++)
     {
       size_t mypos = pos;
-      size_t mylen;
 
       mypos += idx*uidinfolen;
       off = get32 (buffer+mypos);
       len = get32 (buffer+mypos+4);
       if ((uint64_t)off+(uint64_t)len > (uint64_t)length)
         return 0; /* error: better stop here - out of bounds */
-      if (x509)
-        {
-          if (len < 2 || buffer[off] != '<')
-            continue; /* empty name or trailing 0 not stored */
-          len--; /* one back */
-          if ( len < 3 || buffer[off+len] != '>')
-            continue; /* not a proper email address */
-          off++;
-          len--;
-        }
-      else /* OpenPGP.  */
-        {
-          /* We need to forward to the mailbox part.  */
-          mypos = off;
-          mylen = len;
-          for ( ; len && buffer[off] != '<'; len--, off++)
-            ;
-          if (len < 2 || buffer[off] != '<')
-            {
-              /* Mailbox not explicitly given or too short.  Restore
-                 OFF and LEN and check whether the entire string
-                 resembles a mailbox without the angle brackets.  */
-              off = mypos;
-              len = mylen;
-              if (!is_valid_mailbox_mem (buffer+off, len))
-                continue; /* Not a mail address. */
-            }
-          else /* Seems to be standard user id with mail address.  */
-            {
-              off++; /* Point to first char of the mail address.  */
-              len--;
-              /* Search closing '>'.  */
-              for (mypos=off; len && buffer[mypos] != '>'; len--, mypos++)
-                ;
-              if (!len || buffer[mypos] != '>' || off == mypos)
-                continue; /* Not a proper mail address.  */
-              len = mypos - off;
-            }
-
-        }
+      if (!_keybox_locate_mail (buffer, &off, &len, x509))
+        continue;
 
       if (substr)
         {
@@ -579,6 +622,58 @@ blob_openpgp_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 
 
 #ifdef KEYBOX_WITH_X509
+/* Compute the keygrip of the DER encoded certificate (IMAGE,IMAGELEN)
+ * and store it at R_GRIP which must have space for 20 bytes.  */
+gpg_error_t
+_keybox_x509_get_grip (const unsigned char *image, size_t imagelen,
+                       unsigned char *r_grip)
+{
+  gpg_error_t err;
+  ksba_reader_t reader = NULL;
+  ksba_cert_t cert = NULL;
+  ksba_sexp_t p = NULL;
+  gcry_sexp_t s_pkey;
+  size_t n;
+
+  err = ksba_reader_new (&reader);
+  if (err)
+    return err;
+  err = ksba_reader_set_mem (reader, image, imagelen);
+  if (err)
+    goto leave;
+  err = ksba_cert_new (&cert);
+  if (err)
+    goto leave;
+  err = ksba_cert_read_der (cert, reader);
+  if (err)
+    goto leave;
+  p = ksba_cert_get_public_key (cert);
+  if (!p)
+    {
+      err = gpg_error (GPG_ERR_INV_CERT_OBJ);
+      goto leave;
+    }
+  n = gcry_sexp_canon_len (p, 0, NULL, NULL);
+  if (!n)
+    {
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  err = gcry_sexp_sscan (&s_pkey, NULL, (char*)p, n);
+  if (err)
+    goto leave;
+  if (!gcry_pk_get_keygrip (s_pkey, r_grip))
+    err = gpg_error (GPG_ERR_PUBKEY_ALGO); /* Can't calculate keygrip. */
+  gcry_sexp_release (s_pkey);
+
+ leave:
+  xfree (p);
+  ksba_cert_release (cert);
+  ksba_reader_release (reader);
+  return err;
+}
+
+
 /* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
    We don't have the keygrips as meta data, thus we need to parse the
    certificate. Fixme: We might want to return proper error codes
@@ -586,17 +681,10 @@ blob_openpgp_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 static int
 blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 {
-  int rc;
   const unsigned char *buffer;
   size_t length;
   size_t cert_off, cert_len;
-  ksba_reader_t reader = NULL;
-  ksba_cert_t cert = NULL;
-  ksba_sexp_t p = NULL;
-  gcry_sexp_t s_pkey;
   unsigned char array[20];
-  unsigned char *rcp;
-  size_t n;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
@@ -606,44 +694,9 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   if ((uint64_t)cert_off+(uint64_t)cert_len > (uint64_t)length)
     return 0; /* Too short.  */
 
-  rc = ksba_reader_new (&reader);
-  if (rc)
-    return 0; /* Problem with ksba. */
-  rc = ksba_reader_set_mem (reader, buffer+cert_off, cert_len);
-  if (rc)
-    goto failed;
-  rc = ksba_cert_new (&cert);
-  if (rc)
-    goto failed;
-  rc = ksba_cert_read_der (cert, reader);
-  if (rc)
-    goto failed;
-  p = ksba_cert_get_public_key (cert);
-  if (!p)
-    goto failed;
-  n = gcry_sexp_canon_len (p, 0, NULL, NULL);
-  if (!n)
-    goto failed;
-  rc = gcry_sexp_sscan (&s_pkey, NULL, (char*)p, n);
-  if (rc)
-    {
-      gcry_sexp_release (s_pkey);
-      goto failed;
-    }
-  rcp = gcry_pk_get_keygrip (s_pkey, array);
-  gcry_sexp_release (s_pkey);
-  if (!rcp)
-    goto failed; /* Can't calculate keygrip. */
-
-  xfree (p);
-  ksba_cert_release (cert);
-  ksba_reader_release (reader);
+  if (_keybox_x509_get_grip (buffer+cert_off, cert_len, array))
+    return 0;
   return !memcmp (array, grip, 20);
- failed:
-  xfree (p);
-  ksba_cert_release (cert);
-  ksba_reader_release (reader);
-  return 0;
 }
 #endif /*KEYBOX_WITH_X509*/
 
@@ -835,6 +888,147 @@ release_sn_array (struct sn_array_s *array, size_t size)
 }
 
 
+/* Check whether BLOB matches one of the search descriptions
+ * (DESC,NDESC).  WANT_BLOBTYPE, ANY_SKIP and SN_ARRAY are as computed
+ * by keybox_search.  Returns true on a match in which case the index
+ * of the matching description is stored at R_DESCINDEX (if not NULL)
+ * and the number of the matching key or user id at R_PK_NO or
+ * R_UID_NO.  On an invalid search mode true is returned and an error
+ * code stored at R_RC.  */
+static int
+blob_matches (KEYBOX_HANDLE hd, KEYBOXBLOB blob,
+              KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+              keybox_blobtype_t want_blobtype, int any_skip,
+              struct sn_array_s *sn_array, size_t *r_descindex,
+              int *r_pk_no, int *r_uid_no, gpg_error_t *r_rc)
+{
+  size_t n;
+  unsigned int blobflags;
+  int blobtype;
+  int pk_no, uid_no;
+
+  blobtype = blob_get_type (blob);
+  if (blobtype == KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+  if (want_blobtype && blobtype != want_blobtype)
+    return 0;
+
+  blobflags = blob_get_blob_flags (blob);
+  if (!hd->ephemeral && (blobflags & 2))
+    return 0; /* Not in ephemeral mode but blob is flagged ephemeral.  */
+
+  pk_no = *r_pk_no;
+  uid_no = *r_uid_no;
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_NONE:
+          never_reached ();
+          break;
+        case KEYDB_SEARCH_MODE_EXACT:
+          uid_no = has_username (blob, desc[n].u.name, 0);
+          if (uid_no)
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          uid_no = has_mail (blob, desc[n].u.name, 0);
+          if (uid_no)
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_MAILSUB:
+          uid_no = has_mail (blob, desc[n].u.name, 1);
+          if (uid_no)
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_SUBSTR:
+          uid_no =  has_username (blob, desc[n].u.name, 1);
+          if (uid_no)
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_MAILEND:
+        case KEYDB_SEARCH_MODE_WORDS:
+          /* not yet implemented */
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER:
+          if (has_issuer (blob, desc[n].u.name))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER_SN:
+          if (has_issuer_sn (blob, desc[n].u.name,
+                             sn_array? sn_array[n].sn : desc[n].sn,
+                             sn_array? sn_array[n].snlen : desc[n].snlen))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_SN:
+          if (has_sn (blob, sn_array? sn_array[n].sn : desc[n].sn,
+                            sn_array? sn_array[n].snlen : desc[n].snlen))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_SUBJECT:
+          if (has_subject (blob, desc[n].u.name))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          pk_no = has_short_kid (blob, desc[n].u.kid[1]);
+          if (pk_no)
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          pk_no = has_long_kid (blob, desc[n].u.kid[0], desc[n].u.kid[1]);
+          if (pk_no)
+            goto found;
+          break;
+
+        case KEYDB_SEARCH_MODE_FPR:
+          pk_no = has_fingerprint (blob, desc[n].u.fpr, desc[n].fprlen);
+          if (pk_no)
+            goto found;
+          break;
+
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          if (has_keygrip (blob, desc[n].u.grip))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_UBID:
+          if (has_ubid (blob, desc[n].u.ubid))
+            goto found;
+          break;
+        case KEYDB_SEARCH_MODE_FIRST:
+          goto found;
+          break;
+        case KEYDB_SEARCH_MODE_NEXT:
+          goto found;
+          break;
+        default:
+          *r_rc = gpg_error (GPG_ERR_INV_VALUE);
+          goto found;
+        }
+    }
+  *r_pk_no = pk_no;
+  *r_uid_no = uid_no;
+  return 0;
+
+ found:
+  *r_pk_no = pk_no;
+  *r_uid_no = uid_no;
+  /* Record which DESC we matched on.  Note this value is only
+     meaningful if this function returns with no errors. */
+  if(r_descindex)
+    *r_descindex = n;
+  for (n=any_skip?0:ndesc; n < ndesc; n++)
+    {
+      u32 kid[2];
+
+      if (desc[n].skipfnc
+          && blob_get_first_keyid (blob, kid)
+          && desc[n].skipfnc (desc[n].skipfncvalue, kid, uid_no))
+        break;
+    }
+  return n == ndesc;
+}
+
+
 /* Helper to open the file.  */
 static gpg_error_t
 open_file (KEYBOX_HANDLE hd)
@@ -851,6 +1045,32 @@ open_file (KEYBOX_HANDLE hd)
 }
 
 
+/* Read the next blob from HD either from the mapping or using
+ * stdio.  */
+static int
+read_blob (KEYBOX_HANDLE hd, KEYBOXBLOB *r_blob)
+{
+  if (hd->map.addr)
+    return _keybox_read_mapped_blob (r_blob, hd, NULL);
+  return _keybox_read_blob (r_blob, hd->fp, NULL);
+}
+
+
+/* Set the read position of HD to OFF.  */
+static gpg_error_t
+seek_blob (KEYBOX_HANDLE hd, off_t off)
+{
+  if (hd->map.addr)
+    {
+      hd->map.pos = off;
+      return 0;
+    }
+  if (fseeko (hd->fp, off, SEEK_SET))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
 
 /*
 
@@ -870,7 +1090,9 @@ keybox_search_reset (KEYBOX_HANDLE hd)
       hd->found.blob = NULL;
     }
 
-  if (hd->fp)
+  if (hd->map.addr)
+    hd->map.pos = 0;
+  else if (hd->fp)
     {
       if (fseeko (hd->fp, 0, SEEK_SET))
         {
@@ -988,6 +1210,15 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* Map the file or update the mapping in case the file has changed
+   * its size.  */
+  rc = _keybox_map_file (hd);
+  if (rc)
+    {
+      xfree (sn_array);
+      return (hd->error = rc);
+    }
+
   /* Kludge: We need to convert an SN given as hexstring to its binary
      representation - in some cases we are not able to store it in the
      search descriptor, because due to the way we use it, it is not
@@ -1048,15 +1279,67 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
-
+  TRACEPOINT2 (keybox_search_begin, ndesc, ndesc? desc[0].mode : 0);
   pk_no = uid_no = 0;
-  for (;;)
+
+  /* If the keybox has an index and all descriptions can be looked up
+   * in that index, we only need to visit the candidate blobs.  */
+  if (hd->kb->index)
     {
-      unsigned int blobflags;
-      int blobtype;
+      off_t *offtbl;
+      size_t noffs, i;
 
+      rc = _keybox_index_lookup (hd->kb, desc, ndesc, keybox_offset (hd),
+                                 &offtbl, &noffs);
+      if (!rc)
+        {
+          rc = -1;  /* Return EOF if nothing matched.  */
+          for (i=0; i < noffs; i++)
+            {
+              _keybox_release_blob (blob); blob = NULL;
+              rc = seek_blob (hd, offtbl[i]);
+              if (rc)
+                break;
+              rc = read_blob (hd, &blob);
+              if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+                  && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+                {
+                  ++*r_skipped;
+                  rc = -1;
+                  continue; /* Skip too large records.  */
+                }
+              if (rc)
+                break;
+              rc = -1;
+              if (_keybox_get_blob_fileoffset (blob) != offtbl[i])
+                continue; /* Blob has been deleted.  */
+              if (blob_matches (hd, blob, desc, ndesc, want_blobtype,
+                                any_skip, sn_array, r_descindex,
+                                &pk_no, &uid_no, &rc))
+                {
+                  if (rc == -1)
+                    rc = 0;
+                  break;
+                }
+            }
+          xfree (offtbl);
+          goto leave;
+        }
+      else if (gpg_err_code (rc) != GPG_ERR_NOT_SUPPORTED)
+        {
+          _keybox_release_blob (blob);
+          if (sn_array)
+            release_sn_array (sn_array, ndesc);
+          TRACEPOINT1 (keybox_search_end, rc);
+          return (hd->error = rc);
+        }
+      rc = 0;
+    }
+
+  for (;;)
+    {
       _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      rc = read_blob (hd, &blob);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
@@ -1067,121 +1350,16 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (rc)
         break;
 
-      blobtype = blob_get_type (blob);
-      if (blobtype == KEYBOX_BLOBTYPE_HEADER)
-        continue;
-      if (want_blobtype && blobtype != want_blobtype)
-        continue;
-
-      blobflags = blob_get_blob_flags (blob);
-      if (!hd->ephemeral && (blobflags & 2))
-        continue; /* Not in ephemeral mode but blob is flagged ephemeral.  */
-
-      for (n=0; n < ndesc; n++)
-        {
-          switch (desc[n].mode)
-            {
-            case KEYDB_SEARCH_MODE_NONE:
-              never_reached ();
-              break;
-            case KEYDB_SEARCH_MODE_EXACT:
-              uid_no = has_username (blob, desc[n].u.name, 0);
-              if (uid_no)
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_MAIL:
-              uid_no = has_mail (blob, desc[n].u.name, 0);
-              if (uid_no)
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_MAILSUB:
-              uid_no = has_mail (blob, desc[n].u.name, 1);
-              if (uid_no)
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_SUBSTR:
-              uid_no =  has_username (blob, desc[n].u.name, 1);
-              if (uid_no)
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_MAILEND:
-            case KEYDB_SEARCH_MODE_WORDS:
-              /* not yet implemented */
-              break;
-            case KEYDB_SEARCH_MODE_ISSUER:
-              if (has_issuer (blob, desc[n].u.name))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_ISSUER_SN:
-              if (has_issuer_sn (blob, desc[n].u.name,
-                                 sn_array? sn_array[n].sn : desc[n].sn,
-                                 sn_array? sn_array[n].snlen : desc[n].snlen))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_SN:
-              if (has_sn (blob, sn_array? sn_array[n].sn : desc[n].sn,
-                                sn_array? sn_array[n].snlen : desc[n].snlen))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_SUBJECT:
-              if (has_subject (blob, desc[n].u.name))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_SHORT_KID:
-              pk_no = has_short_kid (blob, desc[n].u.kid[1]);
-              if (pk_no)
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_LONG_KID:
-              pk_no = has_long_kid (blob, desc[n].u.kid[0], desc[n].u.kid[1]);
-              if (pk_no)
-                goto found;
-              break;
-
-            case KEYDB_SEARCH_MODE_FPR:
-              pk_no = has_fingerprint (blob, desc[n].u.fpr, desc[n].fprlen);
-              if (pk_no)
-                goto found;
-              break;
-
-            case KEYDB_SEARCH_MODE_KEYGRIP:
-              if (has_keygrip (blob, desc[n].u.grip))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_UBID:
-              if (has_ubid (blob, desc[n].u.ubid))
-                goto found;
-              break;
-            case KEYDB_SEARCH_MODE_FIRST:
-              goto found;
-              break;
-            case KEYDB_SEARCH_MODE_NEXT:
-              goto found;
-              break;
-            default:
-              rc = gpg_error (GPG_ERR_INV_VALUE);
-              goto found;
-            }
-	}
-      continue;
-    found:
-      /* Record which DESC we matched on.  Note this value is only
-	 meaningful if this function returns with no errors. */
-      if(r_descindex)
-	*r_descindex = n;
-      for (n=any_skip?0:ndesc; n < ndesc; n++)
-        {
-          u32 kid[2];
-
-          if (desc[n].skipfnc
-              && blob_get_first_keyid (blob, kid)
-	      && desc[n].skipfnc (desc[n].skipfncvalue, kid, uid_no))
-		break;
-        }
-      if (n == ndesc)
+      if (blob_matches (hd, blob, desc, ndesc, want_blobtype, any_skip,
+                        sn_array, r_descindex, &pk_no, &uid_no, &rc))
         break; /* got it */
     }
 
+ leave:
+  /* The found blob may be used after the mapping has been released,
+   * thus we need to copy it.  */
+  if (!rc)
+    rc = _keybox_own_blob_image (blob);
   if (!rc)
     {
       hd->found.blob = blob;
@@ -1202,6 +1380,7 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
   if (sn_array)
     release_sn_array (sn_array, ndesc);
 
+  TRACEPOINT1 (keybox_search_end, rc);
   return rc;
 }
 
@@ -1317,6 +1496,39 @@ keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
 }
 
 
+/* Store the UBID of the last found blob at R_UBID which must provide
+ * space for 20 bytes.  For X.509 the UBID is the SHA-1
+ * fingerprint of the certificate.  */
+gpg_error_t
+keybox_get_ubid (KEYBOX_HANDLE hd, unsigned char *r_ubid)
+{
+  const unsigned char *buffer;
+  size_t length;
+  size_t image_off, image_len;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  if (!hd->found.blob)
+    return gpg_error (GPG_ERR_NOTHING_FOUND);
+
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (length < 40)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  if ((get16 (buffer + 6) & 4))
+    memcpy (r_ubid, buffer + length - 40, 20);
+  else
+    {
+      image_off = get32 (buffer+8);
+      image_len = get32 (buffer+12);
+      if ((uint64_t)image_off+(uint64_t)image_len > (uint64_t)length)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      gcry_md_hash_buffer (GCRY_MD_SHA1, r_ubid, buffer+image_off, image_len);
+    }
+  return 0;
+}
+
+
 #ifdef KEYBOX_WITH_X509
 /*
   Return the last found cert.  Caller must free it.
@@ -1407,6 +1619,8 @@ keybox_offset (KEYBOX_HANDLE hd)
 {
   if (!hd->fp)
     return 0;
+  if (hd->map.addr)
+    return hd->map.pos;
   return ftello (hd->fp);
 }
 
@@ -1432,6 +1646,12 @@ keybox_seek (KEYBOX_HANDLE hd, off_t offset)
         return err;
     }
 
+  if (hd->map.addr)
+    {
+      hd->map.pos = offset;
+      return 0;
+    }
+
   err = fseeko (hd->fp, offset, SEEK_SET);
   hd->error = gpg_error_from_errno (err);
 
@@ -156,10 +156,13 @@ rename_tmp_file (const char *bakfname, const char *tmpfname,
 
 /* Perform insert/delete/update operation.  MODE is one of
    FILECOPY_INSERT, FILECOPY_DELETE, FILECOPY_UPDATE.  FOR_OPENPGP
-   indicates that this is called due to an OpenPGP keyblock change.  */
+   indicates that this is called due to an OpenPGP keyblock change.
+   If R_BLOB_OFFSET is not NULL the file offset of the written blob is
+   stored there.  */
 static int
 blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
-               int secret, int for_openpgp, off_t start_offset)
+               int secret, int for_openpgp, off_t start_offset,
+               off_t *r_blob_offset)
 {
   FILE *fp, *newfp;
   int rc=0;
@@ -189,6 +192,8 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
           return rc;
         }
 
+      if (r_blob_offset)
+        *r_blob_offset = ftello (newfp);
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
         {
@@ -300,6 +305,8 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
   /* Do an insert or update. */
   if ( mode == FILECOPY_INSERT || mode == FILECOPY_UPDATE )
     {
+      if (r_blob_offset)
+        *r_blob_offset = ftello (newfp);
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
         {
@@ -353,6 +360,224 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
 }
 
 
+/* Write N bytes from BUFFER at file offset OFF of FP.  */
+static gpg_error_t
+write_at (FILE *fp, off_t off, const void *buffer, size_t n)
+{
+  if (fseeko (fp, off, SEEK_SET))
+    return gpg_error_from_syserror ();
+  if (n && fwrite (buffer, n, 1, fp) != 1)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Append BLOB to the keybox file FNAME without copying the file.  If
+ * FOR_OPENPGP is set the OpenPGP flag of the header blob is set.  The
+ * file offset of the new blob is stored at R_BLOB_OFFSET.  */
+static gpg_error_t
+blob_append (const char *fname, KEYBOXBLOB blob, int secret, int for_openpgp,
+             off_t *r_blob_offset)
+{
+  gpg_error_t err;
+  FILE *fp;
+  unsigned char header[8];
+
+  fp = fopen (fname, "r+b");
+  if (!fp && errno == ENOENT)
+    return blob_filecopy (FILECOPY_INSERT, fname, blob, secret, for_openpgp,
+                          0, r_blob_offset);
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  err = 0;
+  if (for_openpgp
+      && fread (header, sizeof header, 1, fp) == 1
+      && header[4] == KEYBOX_BLOBTYPE_HEADER
+      && !(header[7] & 0x02))
+    {
+      header[7] |= 0x02; /* OpenPGP data may be available.  */
+      err = write_at (fp, 7, header+7, 1);
+    }
+  if (!err && fseeko (fp, 0, SEEK_END))
+    err = gpg_error_from_syserror ();
+  if (!err)
+    {
+      *r_blob_offset = ftello (fp);
+      if (*r_blob_offset == (off_t)-1)
+        err = gpg_error_from_syserror ();
+      else
+        err = _keybox_write_blob (blob, fp);
+    }
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Return true if a blob of NEWLEN bytes can be written over a blob
+ * of OLDLEN bytes.  Remaining space must be large enough to hold an
+ * empty blob.  */
+static int
+blob_fits (size_t oldlen, size_t newlen)
+{
+  return newlen == oldlen || (newlen < oldlen && oldlen - newlen >= 5);
+}
+
+
+/* Replace the blob of OLDLEN bytes at file offset OFF of the keybox
+ * file FNAME by BLOB, which must fit into that space; the remaining
+ * space is turned into an empty blob.  The old blob is marked as
+ * empty before the new one is written so that an interrupted update
+ * loses the key but never leaves a partly written blob behind.  */
+static gpg_error_t
+blob_overwrite (const char *fname, KEYBOXBLOB blob, off_t off, size_t oldlen)
+{
+  gpg_error_t err;
+  FILE *fp;
+  const unsigned char *image;
+  size_t newlen;
+  unsigned char tmp[5];
+
+  image = _keybox_get_blob_image (blob, &newlen);
+  if (newlen < 5 || !blob_fits (oldlen, newlen))
+    return gpg_error (GPG_ERR_BUG);
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  tmp[0] = KEYBOX_BLOBTYPE_EMPTY;
+  err = write_at (fp, off + 4, tmp, 1);
+  if (!err && fflush (fp))
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = write_at (fp, off + 5, image + 5, newlen - 5);
+  if (!err && newlen < oldlen)
+    {
+      size_t n = oldlen - newlen;
+
+      tmp[0] = n >> 24;
+      tmp[1] = n >> 16;
+      tmp[2] = n >>  8;
+      tmp[3] = n;
+      tmp[4] = KEYBOX_BLOBTYPE_EMPTY;
+      err = write_at (fp, off + newlen, tmp, 5);
+    }
+  if (!err && fflush (fp))
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = write_at (fp, off, image, 5);
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Mark the blob at file offset OFF of the keybox file FNAME as
+ * deleted.  */
+static gpg_error_t
+blob_mark_deleted (const char *fname, off_t off)
+{
+  gpg_error_t err;
+  FILE *fp;
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fseeko (fp, off + 4, SEEK_SET))
+    err = gpg_error_from_syserror ();
+  else if (putc (0, fp) == EOF)
+    err = gpg_error_from_syserror ();
+  else
+    err = 0;
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Insert BLOB into the keybox of HD and update the index.  */
+static gpg_error_t
+insert_blob (KEYBOX_HANDLE hd, KEYBOXBLOB blob, int for_openpgp)
+{
+  gpg_error_t err;
+  off_t off;
+
+  _keybox_index_begin_update (hd->kb);
+  if (hd->kb->inplace_update)
+    err = blob_append (hd->kb->fname, blob, hd->secret, for_openpgp, &off);
+  else
+    err = blob_filecopy (FILECOPY_INSERT, hd->kb->fname, blob, hd->secret,
+                         for_openpgp, 0, &off);
+  if (!err)
+    _keybox_index_insert_blob (hd->kb, blob, off);
+  else
+    _keybox_index_invalidate (hd->kb);
+  _keybox_index_end_update (hd->kb);
+  return err;
+}
+
+
+/* Replace the blob of OLDLEN bytes at file offset OFF of the keybox
+ * of HD by BLOB and update the index.  With in-place updates a blob
+ * which does not fit into the old space is appended to the file and
+ * the old blob is marked as deleted.  */
+static gpg_error_t
+update_blob (KEYBOX_HANDLE hd, KEYBOXBLOB blob, int for_openpgp,
+             off_t off, size_t oldlen)
+{
+  gpg_error_t err;
+  const char *fname = hd->kb->fname;
+  off_t newoff;
+  size_t newlen;
+
+  _keybox_get_blob_image (blob, &newlen);
+  _keybox_index_begin_update (hd->kb);
+  if (!hd->kb->inplace_update)
+    {
+      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret,
+                           for_openpgp, off, NULL);
+      if (!err)
+        {
+          _keybox_index_remove_blob (hd->kb, off,
+                                     (off_t)newlen - (off_t)oldlen);
+          _keybox_index_insert_blob (hd->kb, blob, off);
+        }
+    }
+  else if (blob_fits (oldlen, newlen))
+    {
+      err = blob_overwrite (fname, blob, off, oldlen);
+      if (!err)
+        {
+          _keybox_index_remove_blob (hd->kb, off, 0);
+          _keybox_index_insert_blob (hd->kb, blob, off);
+        }
+    }
+  else
+    {
+      /* Append first so that an interrupted update leaves a
+       * duplicate instead of no key at all.  */
+      err = blob_append (fname, blob, hd->secret, for_openpgp, &newoff);
+      if (!err)
+        err = blob_mark_deleted (fname, off);
+      if (!err)
+        {
+          _keybox_index_remove_blob (hd->kb, off, 0);
+          _keybox_index_insert_blob (hd->kb, blob, newoff);
+        }
+    }
+  if (err)
+    _keybox_index_invalidate (hd->kb);
+  _keybox_index_end_update (hd->kb);
+  return err;
+}
+
+
 /* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD. */
 gpg_error_t
 keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
@@ -386,12 +611,8 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      err = insert_blob (hd, blob, 1);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return err;
 }
@@ -405,6 +626,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   gpg_error_t err;
   const char *fname;
   off_t off;
+  size_t oldlen;
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
@@ -422,6 +644,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &oldlen);
 
   /* Close the file so that we do no mess up the position for a
      next search.  */
@@ -439,7 +662,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   /* Update the keyblock.  */
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      err = update_blob (hd, blob, 1, off, oldlen);
       _keybox_release_blob (blob);
     }
   return err;
@@ -472,12 +695,8 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      rc = insert_blob (hd, blob, 0);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return rc;
 }
@@ -535,9 +754,14 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   off += flag_pos;
 
   _keybox_close_file (hd);
+  _keybox_index_begin_update (hd->kb);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
-    return gpg_error_from_syserror ();
+    {
+      ec = gpg_err_code_from_syserror ();
+      _keybox_index_end_update (hd->kb);
+      return gpg_error (ec);
+    }
 
   ec = 0;
   if (fseeko (fp, off, SEEK_SET))
@@ -570,6 +794,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
       if (!ec)
         ec = gpg_err_code_from_syserror ();
     }
+  _keybox_index_end_update (hd->kb);
 
   return gpg_error (ec);
 }
@@ -581,7 +806,6 @@ keybox_delete (KEYBOX_HANDLE hd)
 {
   off_t off;
   const char *fname;
-  FILE *fp;
   int rc;
 
   if (!hd)
@@ -597,34 +821,22 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
-
   _keybox_close_file (hd);
-  fp = fopen (hd->kb->fname, "r+b");
-  if (!fp)
-    return gpg_error_from_syserror ();
-
-  if (fseeko (fp, off, SEEK_SET))
-    rc = gpg_error_from_syserror ();
-  else if (putc (0, fp) == EOF)
-    rc = gpg_error_from_syserror ();
-  else
-    rc = 0;
-
-  if (fclose (fp))
-    {
-      if (!rc)
-        rc = gpg_error_from_syserror ();
-    }
+  _keybox_index_begin_update (hd->kb);
+  rc = blob_mark_deleted (fname, off);
+  if (!rc)
+    _keybox_index_remove_blob (hd->kb, off, 0);
+  _keybox_index_end_update (hd->kb);
 
   return rc;
 }
 
 
-/* Compress the keybox file.  This should be run with the file
-   locked. */
-int
-keybox_compress (KEYBOX_HANDLE hd)
+/* Compress the keybox file.  Unless FORCE is set this is only done
+   if the last maintenance run is older than 3 hours.  This should be
+   run with the file locked. */
+static int
+do_compress (KEYBOX_HANDLE hd, int force)
 {
   int read_rc, rc;
   const char *fname;
@@ -665,7 +877,7 @@ keybox_compress (KEYBOX_HANDLE hd)
 
   /* A quick test to see if we need to compress the file at all.  We
      schedule a compress run after 3 hours. */
-  if ( !_keybox_read_blob (&blob, fp, NULL) )
+  if ( !force && !_keybox_read_blob (&blob, fp, NULL) )
     {
       const unsigned char *buffer;
       size_t length;
@@ -791,7 +1003,31 @@ keybox_compress (KEYBOX_HANDLE hd)
   else
     rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
 
+  /* The maintenance time stamp in the header has been updated and
+   * blobs may have moved; thus the index needs to be rebuilt.  */
+  if (!rc && any_changes)
+    _keybox_index_invalidate (hd->kb);
+
   xfree(bakfname);
   xfree(tmpfname);
   return rc;
 }
+
+
+/* Compress the keybox file if the last maintenance run is older than
+   3 hours.  This should be run with the file locked. */
+int
+keybox_compress (KEYBOX_HANDLE hd)
+{
+  return do_compress (hd, 0);
+}
+
+
+/* Compress the keybox file now.  This reclaims the space of deleted
+   blobs and of blobs left behind by in-place updates.  This should be
+   run with the file locked. */
+int
+keybox_compact (KEYBOX_HANDLE hd)
+{
+  return do_compress (hd, 1);
+}
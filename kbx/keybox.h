@@ -62,11 +62,16 @@ typedef enum
     KEYBOX_BLOBTYPE_X509   = 3
   } keybox_blobtype_t;
 
+/* Flags for keybox_enable_index.  */
+#define KEYBOX_INDEX_TRIGRAMS  1  /* Also speed up substring searches.  */
+
 
 /*-- keybox-init.c --*/
 gpg_error_t keybox_register_file (const char *fname, int secret,
                                   void **r_token);
 int keybox_is_writable (void *token);
+gpg_error_t keybox_enable_index (void *token, unsigned int flags);
+gpg_error_t keybox_enable_inplace_update (void *token);
 
 KEYBOX_HANDLE keybox_new_openpgp (void *token, int secret);
 KEYBOX_HANDLE keybox_new_x509 (void *token, int secret);
@@ -75,6 +80,8 @@ void keybox_push_found_state (KEYBOX_HANDLE hd);
 void keybox_pop_found_state (KEYBOX_HANDLE hd);
 const char *keybox_get_resource_name (KEYBOX_HANDLE hd);
 int keybox_set_ephemeral (KEYBOX_HANDLE hd, int yes);
+gpg_error_t keybox_set_mmap (KEYBOX_HANDLE hd, int yes);
+void keybox_refresh_file (KEYBOX_HANDLE hd);
 
 gpg_error_t keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout);
 
@@ -90,6 +97,7 @@ gpg_error_t keybox_get_data (KEYBOX_HANDLE hd,
                              enum pubkey_types *r_pubkey_type);
 gpg_error_t keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
                                  int *r_uid_no, int *r_pk_no);
+gpg_error_t keybox_get_ubid (KEYBOX_HANDLE hd, unsigned char *r_ubid);
 #ifdef KEYBOX_WITH_X509
 int keybox_get_cert (KEYBOX_HANDLE hd, ksba_cert_t *ret_cert);
 #endif /*KEYBOX_WITH_X509*/
@@ -120,6 +128,7 @@ int keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value);
 
 int keybox_delete (KEYBOX_HANDLE hd);
 int keybox_compress (KEYBOX_HANDLE hd);
+int keybox_compact (KEYBOX_HANDLE hd);
 
 
 /*--  --*/
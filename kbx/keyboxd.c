@@ -54,9 +54,11 @@
 #include "../common/sysutils.h"
 #include "../common/asshelp.h"
 #include "../common/init.h"
+#include "../common/asynclog.h"
 #include "../common/gc-opt-flags.h"
 #include "../common/exechelp.h"
 #include "frontend.h"
+#include "replicate.h"
 
 
 /* Urrgs: Put this into a separate header - but it needs assuan.h first.  */
@@ -88,6 +90,12 @@ enum cmd_and_opt_values
     oFakedSystemTime,
     oListenBacklog,
     oDisableCheckOwnSocket,
+    oCacheSize,
+    oNegativeCacheTTL,
+    oDatabase,
+    oIndexTrigrams,
+    oChangeLog,
+    oReplicateFrom,
 
     oDummy
   };
@@ -118,6 +126,18 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oHomedir,    "homedir",      "@"),
 
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_u (oCacheSize, "cache-size",
+                N_("|N|use up to N bytes for the key cache")),
+  ARGPARSE_s_u (oNegativeCacheTTL, "negative-cache-ttl",
+                N_("|N|remember not found keys for N seconds")),
+  ARGPARSE_s_s (oDatabase, "database",
+                N_("|NAME|use the key database NAME")),
+  ARGPARSE_s_n (oIndexTrigrams, "index-trigrams",
+                N_("speed up substring searches")),
+  ARGPARSE_s_n (oChangeLog, "change-log",
+                N_("keep a change log for replicas")),
+  ARGPARSE_s_s (oReplicateFrom, "replicate-from",
+                N_("|SOCKET|replicate the keys of the keyboxd at SOCKET")),
 
   ARGPARSE_end () /* End of list */
 };
@@ -135,6 +155,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_IPC_VALUE    , "ipc"     },
     { DBG_CLOCK_VALUE  , "clock"   },
     { DBG_LOOKUP_VALUE , "lookup"  },
+    { DBG_TIMING_VALUE , "timing"  },
     { 77, NULL } /* 77 := Do not exit on "help" or "?".  */
   };
 
@@ -143,7 +164,9 @@ static struct debug_flags_s debug_flags [] =
  * seconds.  Thus we use 4 seconds on all platforms except for
  * Windowsce.  CHECK_OWN_SOCKET_INTERVAL defines how often we check
  * our own socket in standard socket mode.  If that value is 0 we
- * don't check at all.  All values are in seconds. */
+ * don't check at all.  SAVE_HOTKEYS_INTERVAL defines how often we
+ * write the list of recently used keys.  All values are in
+ * seconds. */
 #if defined(HAVE_W32CE_SYSTEM)
 # define TIMERTICK_INTERVAL         (60)
 # define CHECK_OWN_SOCKET_INTERVAL   (0)  /* Never */
@@ -151,6 +174,7 @@ static struct debug_flags_s debug_flags [] =
 # define TIMERTICK_INTERVAL          (4)
 # define CHECK_OWN_SOCKET_INTERVAL  (60)
 #endif
+#define SAVE_HOTKEYS_INTERVAL      (600)
 
 /* The list of open file descriptors at startup.  Note that this list
  * has been allocated using the standard malloc.  */
@@ -179,6 +203,10 @@ static int inhibit_socket_removal;
 /* Name of the communication socket used for client requests.  */
 static char *socket_name;
 
+/* Name of the key database or NULL for the default.  The suffix of
+ * the name selects the backend.  */
+static char *database_name;
+
 /* We need to keep track of the server's nonces (these are dummies for
  * POSIX systems). */
 static assuan_sock_nonce_t socket_nonce;
@@ -252,6 +280,8 @@ static void kbxd_deinit_default_ctrl (ctrl_t ctrl);
 
 static void handle_connections (gnupg_fd_t listen_fd);
 static void check_own_socket (void);
+static void start_preload_hotkeys (void);
+static void start_replication (void);
 static int check_for_running_kbxd (int silent);
 
 /* Pth wrapper function definitions. */
@@ -374,6 +404,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.quiet = 0;
       opt.verbose = 0;
       opt.debug = 0;
+      opt.cache_size = DEFAULT_CACHE_SIZE;
+      opt.negative_cache_ttl = DEFAULT_NEGATIVE_CACHE_TTL;
       disable_check_own_socket = 0;
       return 1;
     }
@@ -394,7 +426,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          asynclog_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -402,6 +434,11 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
 
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
 
+    case oCacheSize: opt.cache_size = pargs->r.ret_ulong; break;
+    case oNegativeCacheTTL:
+      opt.negative_cache_ttl = pargs->r.ret_ulong;
+      break;
+
     default:
       return 0; /* not handled */
     }
@@ -466,6 +503,7 @@ main (int argc, char **argv )
   struct assuan_malloc_hooks malloc_hooks;
 
   early_system_init ();
+  gnupg_timing_mark ("start");
 
   /* Before we do anything else we save the list of currently open
    * file descriptors and the signal mask.  This info is required to
@@ -485,6 +523,7 @@ main (int argc, char **argv )
   /* Make sure that our subsystems are ready.  */
   i18n_init ();
   init_common_subsystems (&argc, &argv);
+  gnupg_timing_mark ("init");
   gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
 
   malloc_hooks.malloc = gcry_malloc;
@@ -590,6 +629,16 @@ main (int argc, char **argv )
         case oHomedir: gnupg_set_homedir (pargs.r.ret_str); break;
         case oNoDetach: nodetach = 1; break;
         case oLogFile: logfile = pargs.r.ret_str; break;
+        case oDatabase:
+          xfree (database_name);
+          database_name = xstrdup (pargs.r.ret_str);
+          break;
+        case oIndexTrigrams: opt.index_trigrams = 1; break;
+        case oChangeLog: opt.change_log = 1; break;
+        case oReplicateFrom:
+          xfree (opt.replicate_from);
+          opt.replicate_from = xstrdup (pargs.r.ret_str);
+          break;
         case oServer: pipe_server = 1; break;
         case oDaemon: is_daemon = 1; break;
         case oFakedSystemTime:
@@ -663,6 +712,7 @@ main (int argc, char **argv )
     }
 
   set_debug ();
+  gnupg_timing_mark ("options");
 
   if (atexit (cleanup))
     {
@@ -736,7 +786,8 @@ main (int argc, char **argv )
         }
       kbxd_init_default_ctrl (ctrl);
 
-      kbxd_add_resource (ctrl, "pubring.kbx", 0);
+      kbxd_add_resource (ctrl, database_name? database_name : "pubring.kbx",
+                         0);
 
       kbxd_start_command_handler (ctrl, GNUPG_INVALID_FD, 0);
       kbxd_deinit_default_ctrl (ctrl);
@@ -870,12 +921,20 @@ main (int argc, char **argv )
             kbxd_exit (1);
           }
         kbxd_init_default_ctrl (ctrl);
-        kbxd_add_resource (ctrl, "pubring.kbx", 0);
+        kbxd_add_resource (ctrl, database_name? database_name : "pubring.kbx",
+                           0);
         kbxd_deinit_default_ctrl (ctrl);
         xfree (ctrl);
       }
+      if (opt.change_log)
+        kbxd_changelog_open ();
 
       log_info ("%s %s started\n", strusage(11), strusage(13) );
+      if (DBG_TIMING)
+        gnupg_timing_dump ();
+      start_preload_hotkeys ();
+      if (opt.replicate_from)
+        start_replication ();
       handle_connections (fd);
       assuan_sock_close (fd);
     }
@@ -1286,10 +1345,13 @@ static void
 handle_tick (void)
 {
   static time_t last_minute;
+  static time_t last_hotkeys_save;
   struct stat statbuf;
 
   if (!last_minute)
     last_minute = time (NULL);
+  if (!last_hotkeys_save)
+    last_hotkeys_save = time (NULL);
 
   /* Code to be run from time to time.  */
 #if CHECK_OWN_SOCKET_INTERVAL > 0
@@ -1300,6 +1362,12 @@ handle_tick (void)
     }
 #endif
 
+  if (last_hotkeys_save + SAVE_HOTKEYS_INTERVAL <= time (NULL))
+    {
+      kbxd_save_hotkeys ();
+      last_hotkeys_save = time (NULL);
+    }
+
 
   /* Check whether the homedir is still available.  */
   if (!shutdown_pending
@@ -1485,6 +1553,10 @@ handle_connections (gnupg_fd_t listen_fd)
     log_fatal ("error allocating thread attributes: %s\n", strerror (ret));
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  /* Write the log from now on by a separate thread so that a slow
+   * log consumer does not block the connections.  */
+  asynclog_start (current_logfile);
+
 #ifndef HAVE_W32_SYSTEM
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -1691,6 +1763,7 @@ handle_connections (gnupg_fd_t listen_fd)
     close (sock_inotify_fd);
   if (home_inotify_fd != -1)
     close (home_inotify_fd);
+  kbxd_save_hotkeys ();
   cleanup ();
   log_info (_("%s %s stopped\n"), strusage(11), strusage(13));
   npth_attr_destroy (&tattr);
@@ -1809,6 +1882,97 @@ check_own_socket (void)
 
 
 
+/* The thread filling the cache with the keys listed in the hotkeys
+ * file.  */
+static void *
+preload_hotkeys_thread (void *arg)
+{
+  ctrl_t ctrl;
+
+  (void)arg;
+
+  ctrl = xtrycalloc (1, sizeof *ctrl);
+  if (!ctrl)
+    {
+      log_error ("error allocating control data: %s\n", strerror (errno));
+      return NULL;
+    }
+  kbxd_init_default_ctrl (ctrl);
+  kbxd_preload_hotkeys (ctrl);
+  kbxd_deinit_default_ctrl (ctrl);
+  xfree (ctrl);
+  return NULL;
+}
+
+
+/* Start a thread to fill the cache with the recently used keys of a
+ * previous run so that the first requests after a restart do not
+ * all need to go to the database.  */
+static void
+start_preload_hotkeys (void)
+{
+  npth_t thread;
+  npth_attr_t tattr;
+  int err;
+
+  err = npth_attr_init (&tattr);
+  if (err)
+    return;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  err = npth_create (&thread, &tattr, preload_hotkeys_thread, NULL);
+  if (err)
+    log_error ("error spawning preload_hotkeys_thread: %s\n", strerror (err));
+  npth_attr_destroy (&tattr);
+}
+
+
+/* The thread of a replica which periodically fetches the changes
+ * from the primary.  */
+static void *
+replicate_thread (void *arg)
+{
+  ctrl_t ctrl;
+
+  (void)arg;
+
+  ctrl = xtrycalloc (1, sizeof *ctrl);
+  if (!ctrl)
+    {
+      log_error ("error allocating control data: %s\n", strerror (errno));
+      return NULL;
+    }
+  kbxd_init_default_ctrl (ctrl);
+  while (!shutdown_pending)
+    {
+      kbxd_replicate (ctrl);
+      npth_sleep (REPLICATE_INTERVAL);
+    }
+  kbxd_deinit_default_ctrl (ctrl);
+  xfree (ctrl);
+  return NULL;
+}
+
+
+/* Start the thread which keeps a replica up to date.  */
+static void
+start_replication (void)
+{
+  npth_t thread;
+  npth_attr_t tattr;
+  int err;
+
+  err = npth_attr_init (&tattr);
+  if (err)
+    return;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  err = npth_create (&thread, &tattr, replicate_thread, NULL);
+  if (err)
+    log_error ("error spawning replicate_thread: %s\n", strerror (err));
+  npth_attr_destroy (&tattr);
+}
+
+
+
 /* Figure out whether a keyboxd is available and running.  Prints an
  * error if not.  If SILENT is true, no messages are printed.  Returns
  * 0 if the agent is running. */
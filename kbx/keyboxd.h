@@ -44,8 +44,30 @@ struct
   /* True if we are running detached from the tty. */
   int running_detached;
 
+  /* The memory budget of the cache backend in bytes.  */
+  unsigned long cache_size;
+
+  /* Use trigram signatures to speed up substring searches.  */
+  int index_trigrams;
+
+  /* Seconds a not-found result is kept in the cache; 0 disables
+   * caching of not-found results.  */
+  unsigned long negative_cache_ttl;
+
+  /* Append stored keys to the change log for replicas.  */
+  int change_log;
+
+  /* The socket of the primary keyboxd if we are a replica.  */
+  char *replicate_from;
+
 } opt;
 
+/* The default for opt.cache_size.  */
+#define DEFAULT_CACHE_SIZE (32*1024*1024)
+
+/* The default for opt.negative_cache_ttl.  */
+#define DEFAULT_NEGATIVE_CACHE_TTL 600
+
 
 /* Bit values for the --debug option.  */
 #define DBG_MPI_VALUE	  2	/* debug mpi details */
@@ -57,6 +79,7 @@ struct
 #define DBG_IPC_VALUE     1024  /* Enable Assuan debugging.  */
 #define DBG_CLOCK_VALUE   4096  /* debug timings (required build option).  */
 #define DBG_LOOKUP_VALUE  8192	/* debug the key lookup */
+#define DBG_TIMING_VALUE  32768 /* print startup timings */
 
 /* Test macros for the debug option.  */
 #define DBG_CRYPTO  (opt.debug & DBG_CRYPTO_VALUE)
@@ -66,6 +89,7 @@ struct
 #define DBG_IPC     (opt.debug & DBG_IPC_VALUE)
 #define DBG_CLOCK   (opt.debug & DBG_CLOCK_VALUE)
 #define DBG_LOOKUP  (opt.debug & DBG_LOOKUP_VALUE)
+#define DBG_TIMING  (opt.debug & DBG_TIMING_VALUE)
 
 
 /* Declaration of a database request object.  This is used for all
@@ -112,6 +136,24 @@ struct server_control_s
 
   /* Flags for the current request.  */
   unsigned int no_data_return : 1;  /* Used by SEARCH and NEXT.  */
+  unsigned int multi_search : 1;    /* Used by SEARCH --multi.  */
+
+  /* With MULTI_SEARCH set the index of the search description
+   * currently processed.  It is prefixed to each returned blob.  */
+  unsigned int multi_search_idx;
+
+  /* The database lock held by this session: 0 for none, 1 for a read
+   * lock and 2 for a write lock (frontend.c).  */
+  int db_lock;
+
+  /* Throughput counters of this connection (see GETINFO stats).  */
+  struct {
+    unsigned long searches;    /* Number of search operations.  */
+    unsigned long found;       /* Number of returned keys.  */
+    unsigned long stores;      /* Number of store operations.  */
+    unsigned long data_bytes;  /* Number of returned data bytes.  */
+    unsigned long lock_waits;  /* Times we had to wait for the lock.  */
+  } stats;
 };
 
 
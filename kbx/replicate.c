@@ -0,0 +1,602 @@
+/* replicate.c - Change log and replication for keyboxd
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* A keyboxd started with --change-log appends each key it stores to
+ * the file CHANGELOG_FILE in the public keys directory.  That file
+ * starts with an 8 byte magic and a random identifier, followed by
+ * records made up of a 4 byte big endian length and the key as it
+ * was given to STORE.  The CHANGES command returns these records.
+ *
+ * A keyboxd started with --replicate-from connects every
+ * REPLICATE_INTERVAL seconds to the socket of such a primary, fetches
+ * the records it has not yet seen and stores them into its own
+ * database.  The identifier of the change log and the offset of the
+ * next record are kept in REPLICA_STATE_FILE so that a restarted
+ * replica continues where it stopped.  If the primary starts a new
+ * change log the replica reads that one from its first record.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "keyboxd.h"
+#include <assuan.h>
+#include "../common/i18n.h"
+#include "../common/host2net.h"
+#include "../common/membuf.h"
+#include "frontend.h"
+#include "replicate.h"
+
+
+/* The name of the change log in the public keys directory, its magic
+ * and the length of its header.  */
+#define CHANGELOG_FILE      "changes.log"
+#define CHANGELOG_MAGIC     "KBXCHLOG"
+#define CHANGELOG_IDLEN     16
+#define CHANGELOG_HDRLEN    (8 + CHANGELOG_IDLEN)
+
+/* Records larger than this are considered a sign of a damaged log.  */
+#define MAX_RECORD_SIZE     (16 * 1024 * 1024)
+
+/* The CHANGES command returns no more than this many bytes unless a
+ * single record is larger.  */
+#define MAX_CHANGES_SIZE    (1024 * 1024)
+
+/* The name of the file with the replication state of a replica.  */
+#define REPLICA_STATE_FILE  "replica.state"
+
+
+/* The change log opened for appending, its name and its identifier as
+ * a hex string.  */
+static estream_t changelog_fp;
+static char *changelog_fname;
+static char changelog_id[2 * CHANGELOG_IDLEN + 1];
+
+/* Offsets of record boundaries of the change log recently returned
+ * by kbxd_changelog_read.  A replica usually continues at such an
+ * offset which then does not need to be verified.  */
+#define KNOWN_OFFSETS 16
+static unsigned long long known_offsets[KNOWN_OFFSETS];
+static unsigned int known_offsets_idx;
+
+/* The replication state of a replica.  */
+static int replica_state_loaded;
+static char replica_id[2 * CHANGELOG_IDLEN + 1];
+static unsigned long long replica_offset;
+static int replica_connect_failed;
+
+
+
+/* Check the change log at FNAME.  On success its identifier is
+ * stored at ID.  Returns true if the file is usable.  */
+static int
+check_changelog (const char *fname, char *id)
+{
+  estream_t fp;
+  unsigned char buf[CHANGELOG_HDRLEN];
+  size_t nread;
+  unsigned long long size, off;
+  unsigned long len;
+  int okay = 0;
+
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    return 0;
+
+  if (es_read (fp, buf, CHANGELOG_HDRLEN, &nread) || nread != CHANGELOG_HDRLEN
+      || memcmp (buf, CHANGELOG_MAGIC, 8)
+      || es_fseek (fp, 0, SEEK_END))
+    goto leave;
+  size = es_ftello (fp);
+  bin2hex (buf + 8, CHANGELOG_IDLEN, id);
+
+  /* Make sure that the last record is complete so that appending
+   * keeps the file parsable.  */
+  for (off = CHANGELOG_HDRLEN; off < size; off += 4 + len)
+    {
+      if (es_fseeko (fp, (gpgrt_off_t)off, SEEK_SET)
+          || es_read (fp, buf, 4, &nread) || nread != 4)
+        goto leave;
+      len = buf32_to_ulong (buf);
+      if (!len || len > MAX_RECORD_SIZE || off + 4 + len > size)
+        goto leave;
+    }
+  okay = 1;
+
+ leave:
+  es_fclose (fp);
+  return okay;
+}
+
+
+/* Open the change log for appending.  A new change log with a new
+ * identifier is created if there is none or if it is damaged.  */
+gpg_error_t
+kbxd_changelog_open (void)
+{
+  gpg_error_t err;
+  unsigned char hdr[CHANGELOG_HDRLEN];
+  char *bakfname;
+  estream_t fp;
+
+  if (changelog_fp)
+    return 0;
+
+  xfree (changelog_fname);
+  changelog_fname = make_filename_try (gnupg_homedir (),
+                                       GNUPG_PUBLIC_KEYS_DIR,
+                                       CHANGELOG_FILE, NULL);
+  if (!changelog_fname)
+    return gpg_error_from_syserror ();
+
+  if (!check_changelog (changelog_fname, changelog_id))
+    {
+      if (!access (changelog_fname, F_OK))
+        {
+          log_error ("change log '%s' is damaged - starting a new one\n",
+                     changelog_fname);
+          bakfname = strconcat (changelog_fname, ".bak", NULL);
+          if (bakfname)
+            gnupg_rename_file (changelog_fname, bakfname, NULL);
+          xfree (bakfname);
+        }
+
+      memcpy (hdr, CHANGELOG_MAGIC, 8);
+      gcry_create_nonce (hdr + 8, CHANGELOG_IDLEN);
+      fp = es_fopen (changelog_fname, "wb,mode=-rw-r--r--");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error (_("can't create '%s': %s\n"),
+                     changelog_fname, gpg_strerror (err));
+          return err;
+        }
+      if (es_write (fp, hdr, CHANGELOG_HDRLEN, NULL) || es_fclose (fp))
+        {
+          err = gpg_error_from_syserror ();
+          log_error (_("error writing '%s': %s\n"),
+                     changelog_fname, gpg_strerror (err));
+          return err;
+        }
+      bin2hex (hdr + 8, CHANGELOG_IDLEN, changelog_id);
+    }
+
+  changelog_fp = es_fopen (changelog_fname, "ab");
+  if (!changelog_fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"),
+                 changelog_fname, gpg_strerror (err));
+      return err;
+    }
+
+  if (opt.verbose)
+    log_info ("using change log '%s' (%s)\n", changelog_fname, changelog_id);
+  return 0;
+}
+
+
+/* Append the key (BLOB,BLOBLEN) to the change log.  This is called
+ * with the write lock held for each key which has been stored.  */
+void
+kbxd_changelog_append (const void *blob, size_t bloblen)
+{
+  unsigned char lenbuf[4];
+
+  if (!changelog_fp)
+    return;
+
+  ulongtobuf (lenbuf, (unsigned long)bloblen);
+  if (es_write (changelog_fp, lenbuf, 4, NULL)
+      || es_write (changelog_fp, blob, bloblen, NULL)
+      || es_fflush (changelog_fp))
+    {
+      log_error (_("error writing '%s': %s\n"), changelog_fname,
+                 gpg_strerror (gpg_error_from_syserror ()));
+      log_error ("change log disabled\n");
+      es_fclose (changelog_fp);
+      changelog_fp = NULL;
+    }
+}
+
+
+/* Return true if OFFSET is the offset of a record in the change log
+ * FP of SIZE bytes or the end of the last record.  */
+static int
+is_record_boundary (estream_t fp, unsigned long long size,
+                    unsigned long long offset)
+{
+  unsigned char lenbuf[4];
+  unsigned long long off;
+  unsigned long len;
+  size_t nread;
+  int i;
+
+  if (offset == CHANGELOG_HDRLEN)
+    return 1;
+  for (i = 0; i < KNOWN_OFFSETS; i++)
+    if (known_offsets[i] == offset)
+      return 1;
+
+  for (off = CHANGELOG_HDRLEN; off < offset; off += 4 + len)
+    {
+      if (es_fseeko (fp, (gpgrt_off_t)off, SEEK_SET)
+          || es_read (fp, lenbuf, 4, &nread) || nread != 4)
+        return 0;
+      len = buf32_to_ulong (lenbuf);
+      if (!len || len > MAX_RECORD_SIZE || off + 4 + len > size)
+        return 0;
+    }
+  return off == offset;
+}
+
+
+/* Return the complete records of the change log starting at OFFSET
+ * but not more than about MAX_CHANGES_SIZE bytes.  If ID is not the
+ * identifier of the current change log, the records starting at the
+ * first record are returned.  The identifier and the offset of the
+ * returned records are stored at R_ID and R_OFFSET; the records are
+ * stored as a malloced buffer at R_DATA.  No data is returned if
+ * there are no more records.  GPG_ERR_INV_VALUE is returned if
+ * OFFSET is not the offset of a record.  */
+gpg_error_t
+kbxd_changelog_read (const char *id, unsigned long long offset,
+                     const char **r_id, unsigned long long *r_offset,
+                     void **r_data, size_t *r_datalen)
+{
+  gpg_error_t err;
+  estream_t fp;
+  unsigned char lenbuf[4];
+  unsigned long long size, end;
+  unsigned long len;
+  size_t nread;
+  char *data = NULL;
+
+  *r_data = NULL;
+  *r_datalen = 0;
+
+  if (!changelog_fp)
+    return gpg_error (GPG_ERR_NOT_ENABLED);
+
+  fp = es_fopen (changelog_fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  if (es_fseek (fp, 0, SEEK_END))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  size = es_ftello (fp);
+
+  if (strcmp (id, changelog_id) || offset < CHANGELOG_HDRLEN || offset > size)
+    offset = CHANGELOG_HDRLEN;
+  else if (!is_record_boundary (fp, size, offset))
+    {
+      err = gpg_error (GPG_ERR_INV_VALUE);
+      goto leave;
+    }
+
+  /* Find the end of the last complete record we return.  A record
+   * may be incomplete while it is being appended.  */
+  for (end = offset; end < size && end - offset < MAX_CHANGES_SIZE;
+       end += 4 + len)
+    {
+      if (es_fseeko (fp, (gpgrt_off_t)end, SEEK_SET)
+          || es_read (fp, lenbuf, 4, &nread) || nread != 4)
+        break;
+      len = buf32_to_ulong (lenbuf);
+      if (!len || len > MAX_RECORD_SIZE)
+        {
+          log_error ("change log '%s' is damaged at offset %llu\n",
+                     changelog_fname, end);
+          err = gpg_error (GPG_ERR_INV_VALUE);
+          goto leave;
+        }
+      if (end + 4 + len > size)
+        break;
+    }
+
+  if (end > offset)
+    {
+      data = xtrymalloc (end - offset);
+      if (!data)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (es_fseeko (fp, (gpgrt_off_t)offset, SEEK_SET)
+          || es_read (fp, data, end - offset, &nread))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (nread != end - offset)
+        {
+          err = gpg_error (GPG_ERR_TRUNCATED);
+          goto leave;
+        }
+    }
+
+  known_offsets[known_offsets_idx] = end;
+  known_offsets_idx = (known_offsets_idx + 1) % KNOWN_OFFSETS;
+
+  *r_id = changelog_id;
+  *r_offset = offset;
+  *r_data = data;
+  *r_datalen = end - offset;
+  data = NULL;
+  err = 0;
+
+ leave:
+  xfree (data);
+  es_fclose (fp);
+  return err;
+}
+
+
+
+/* Read the replication state of a replica.  */
+static void
+load_replica_state (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[256];
+  char *p;
+
+  replica_state_loaded = 1;
+  *replica_id = 0;
+  replica_offset = 0;
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             REPLICA_STATE_FILE, NULL);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+  while (es_fgets (line, sizeof line, fp))
+    {
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      p = strchr (line, ' ');
+      if (!p || p - line != 2 * CHANGELOG_IDLEN)
+        {
+          log_info ("%s: invalid line ignored\n", fname);
+          continue;
+        }
+      *p++ = 0;
+      strcpy (replica_id, line);
+      replica_offset = strtoull (p, NULL, 10);
+    }
+  es_fclose (fp);
+  xfree (fname);
+}
+
+
+/* Write the replication state of a replica.  */
+static void
+save_replica_state (void)
+{
+  gpg_error_t err;
+  char *fname;
+  char *tmpfname = NULL;
+  estream_t fp;
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             REPLICA_STATE_FILE, NULL);
+  if (fname)
+    tmpfname = xtryasprintf ("%s" EXTSEP_S "tmp", fname);
+  if (!tmpfname)
+    {
+      xfree (fname);
+      return;
+    }
+
+  fp = es_fopen (tmpfname, "w,mode=-rw-------");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't create '%s': %s\n"), tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  es_fputs ("# Change log ID and offset of the next record.\n", fp);
+  es_fprintf (fp, "%s %llu\n", replica_id, replica_offset);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      log_error (_("renaming '%s' to '%s' failed: %s\n"),
+                 tmpfname, fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+/* Parameter for changes_status_cb.  */
+struct changes_parm_s
+{
+  int got_status;
+  char id[2 * CHANGELOG_IDLEN + 1];
+  unsigned long long offset;
+};
+
+
+/* Status callback for the CHANGES command.  */
+static gpg_error_t
+changes_status_cb (void *opaque, const char *line)
+{
+  struct changes_parm_s *parm = opaque;
+  const char *s;
+  char *endp;
+
+  if ((s = has_leading_keyword (line, "CHANGELOG")))
+    {
+      endp = strchr (s, ' ');
+      if (!endp || endp - s != 2 * CHANGELOG_IDLEN)
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      memcpy (parm->id, s, 2 * CHANGELOG_IDLEN);
+      parm->id[2 * CHANGELOG_IDLEN] = 0;
+      parm->offset = strtoull (endp + 1, NULL, 10);
+      parm->got_status = 1;
+    }
+  return 0;
+}
+
+
+/* Store the records (DATA,DATALEN) received from the primary.
+ * Returns the number of bytes processed.  */
+static size_t
+apply_changes (ctrl_t ctrl, const unsigned char *data, size_t datalen,
+               unsigned int *r_count)
+{
+  gpg_error_t err;
+  size_t off;
+  unsigned long len;
+
+  *r_count = 0;
+  for (off = 0; datalen - off >= 4; off += 4 + len)
+    {
+      len = buf32_to_ulong (data + off);
+      if (!len || len > datalen - off - 4)
+        {
+          log_error ("invalid record in the change log of the primary\n");
+          break;
+        }
+      err = kbxd_store (ctrl, data + off + 4, len, 0);
+      if (gpg_err_code (err) == GPG_ERR_WRONG_BLOB_TYPE)
+        log_info ("skipping invalid key from the primary\n");
+      else if (err)
+        {
+          log_error ("error storing a key from the primary: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+      else
+        (*r_count)++;
+    }
+  return off;
+}
+
+
+/* Fetch the new records from the primary given by --replicate-from
+ * and store them.  This is called periodically by the replication
+ * thread.  CTRL is a control object not used for a connection.  */
+void
+kbxd_replicate (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  assuan_context_t ctx = NULL;
+  struct changes_parm_s parm;
+  membuf_t mb;
+  unsigned char *data = NULL;
+  size_t datalen, processed;
+  unsigned int count, total = 0;
+  char line[ASSUAN_LINELENGTH];
+
+  if (!opt.replicate_from)
+    return;
+  if (!replica_state_loaded)
+    load_replica_state ();
+
+  err = assuan_new (&ctx);
+  if (err)
+    {
+      log_error ("error allocating assuan context: %s\n", gpg_strerror (err));
+      return;
+    }
+  err = assuan_socket_connect (ctx, opt.replicate_from, ASSUAN_INVALID_PID, 0);
+  if (err)
+    {
+      if (!replica_connect_failed)
+        log_error ("can't connect to the primary at '%s': %s\n",
+                   opt.replicate_from, gpg_strerror (err));
+      replica_connect_failed = 1;
+      goto leave;
+    }
+  if (replica_connect_failed)
+    log_info ("connection to the primary at '%s' established\n",
+              opt.replicate_from);
+  replica_connect_failed = 0;
+
+  do
+    {
+      memset (&parm, 0, sizeof parm);
+      init_membuf (&mb, 65536);
+      snprintf (line, sizeof line, "CHANGES %s %llu",
+                *replica_id? replica_id : "-", replica_offset);
+      err = assuan_transact (ctx, line, put_membuf_cb, &mb,
+                             NULL, NULL, changes_status_cb, &parm);
+      xfree (data);
+      data = get_membuf (&mb, &datalen);
+      if (!err && !data)
+        err = gpg_error_from_syserror ();
+      if (!err && !parm.got_status)
+        err = gpg_error (GPG_ERR_INV_RESPONSE);
+      if (err)
+        {
+          log_error ("fetching changes from the primary failed: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+
+      if (strcmp (parm.id, replica_id))
+        log_info ("replicating change log %s of the primary\n", parm.id);
+
+      processed = apply_changes (ctrl, data, datalen, &count);
+      total += count;
+      if (processed || strcmp (parm.id, replica_id))
+        {
+          strcpy (replica_id, parm.id);
+          replica_offset = parm.offset + processed;
+          save_replica_state ();
+        }
+      if (processed < datalen)
+        break;  /* Try again at the next interval.  */
+    }
+  while (datalen);
+
+  if (total && opt.verbose)
+    log_info ("%u keys replicated from the primary\n", total);
+
+ leave:
+  xfree (data);
+  assuan_release (ctx);
+}
@@ -0,0 +1,37 @@
+/* replicate.h - Definitions for the keyboxd replication
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef KBX_REPLICATE_H
+#define KBX_REPLICATE_H
+
+/* The number of seconds between two polls of a replica.  */
+#define REPLICATE_INTERVAL 30
+
+
+gpg_error_t kbxd_changelog_open (void);
+void kbxd_changelog_append (const void *blob, size_t bloblen);
+gpg_error_t kbxd_changelog_read (const char *id, unsigned long long offset,
+                                 const char **r_id,
+                                 unsigned long long *r_offset,
+                                 void **r_data, size_t *r_datalen);
+void kbxd_replicate (ctrl_t ctrl);
+
+
+#endif /*KBX_REPLICATE_H*/
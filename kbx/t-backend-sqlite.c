@@ -0,0 +1,394 @@
+/* t-backend-sqlite.c - Tests for backend-sqlite.c
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "keyboxd.h"
+#include "../common/host2net.h"
+#include "backend.h"
+
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                      exit (1);                                  \
+                   } while(0)
+
+/* The keyblocks are taken from the keybox used by the keydb tests.  */
+#define SRCNAME  "t-keydb-keyring.kbx"
+#define DBNAME   "t-backend-sqlite.db"
+
+#define OFF_KEY1 32
+#define OFF_KEY2 3271
+
+/* Key 1 has three user IDs and four subkeys; key 2 has one of
+ * each.  */
+static const char fpr1[] = "80615870F5BAD690333686D0F2AD85AC1E42B367";
+static const char fpr2[] = "26895E25E8446D44A26D8FAF2F7998F3DBFC6AD9";
+static const char fpr3[] = "0123456789ABCDEF0123456789ABCDEF01234567";
+static const char mail1[] = "werner@eifzilla.de";
+static const u32 subkid1[2] = { 0xDF7B7722, 0xC193565B };
+static const u32 lastsubkid1[2] = { 0x1E0FE11D, 0x664D7444 };
+
+static int verbose;
+
+/* The data returned by the last search.  */
+static membuf_t returned;
+
+
+/* Stub for the function in kbxserver.c.  Collect the returned
+ * data.  */
+gpg_error_t
+kbxd_write_data_line (ctrl_t ctrl, const void *buffer_arg, size_t size)
+{
+  (void)ctrl;
+
+  put_membuf (&returned, buffer_arg, size);
+  return 0;
+}
+
+
+/* Read the file FNAME into a new buffer and store its length at
+ * R_LEN.  */
+static unsigned char *
+read_file (const char *fname, size_t *r_len)
+{
+  FILE *fp;
+  unsigned char *buf;
+  size_t len;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+  fseek (fp, 0, SEEK_END);
+  len = ftell (fp);
+  fseek (fp, 0, SEEK_SET);
+  buf = xmalloc (len);
+  if (len && fread (buf, len, 1, fp) != 1)
+    {
+      fprintf (stderr, "error reading '%s'\n", fname);
+      exit (1);
+    }
+  fclose (fp);
+  *r_len = len;
+  return buf;
+}
+
+
+/* Return the keyblock stored in the blob at offset OFF of the keybox
+ * image KBX.  */
+static const unsigned char *
+get_keyblock (const unsigned char *kbx, size_t kbxlen, size_t off,
+              size_t *r_len)
+{
+  size_t kboff, kblen;
+
+  if (off + 16 > kbxlen)
+    fail (0);
+  kboff = buf32_to_size_t (kbx + off + 8);
+  kblen = buf32_to_size_t (kbx + off + 12);
+  if (off + kboff + kblen > kbxlen)
+    fail (0);
+  *r_len = kblen;
+  return kbx + off + kboff;
+}
+
+
+/* Return the offset of the last subkey packet in the keyblock
+ * (KB,KBLEN).  */
+static size_t
+last_subkey_offset (const unsigned char *kb, size_t kblen)
+{
+  size_t off = 0, last = 0, hdrlen, len;
+  int ctb, tag;
+
+  while (off < kblen)
+    {
+      ctb = kb[off];
+      if (!(ctb & 0x80))
+        fail (0);
+      if ((ctb & 0x40))
+        {
+          tag = ctb & 0x3f;
+          if (kb[off+1] < 192)
+            {
+              hdrlen = 2;
+              len = kb[off+1];
+            }
+          else if (kb[off+1] < 224)
+            {
+              hdrlen = 3;
+              len = ((kb[off+1] - 192) << 8) + kb[off+2] + 192;
+            }
+          else if (kb[off+1] == 255)
+            {
+              hdrlen = 6;
+              len = buf32_to_size_t (kb + off + 2);
+            }
+          else
+            fail (0);
+        }
+      else
+        {
+          tag = (ctb >> 2) & 0xf;
+          switch ((ctb & 3))
+            {
+            case 0: hdrlen = 2; len = kb[off+1]; break;
+            case 1: hdrlen = 3; len = buf16_to_ulong (kb + off + 1); break;
+            case 2: hdrlen = 5; len = buf32_to_size_t (kb + off + 1); break;
+            default: fail (0);
+            }
+        }
+      if (tag == 14)
+        last = off;
+      off += hdrlen + len;
+    }
+  if (off != kblen || !last)
+    fail (0);
+  return last;
+}
+
+
+/* Start a new search for DESC in HD and return the found keyblock in
+ * RETURNED.  */
+static gpg_error_t
+search (ctrl_t ctrl, backend_handle_t hd, db_request_t req,
+        KEYDB_SEARCH_DESC *desc)
+{
+  gpg_error_t err;
+
+  err = be_sqlite_search (ctrl, hd, req, NULL, 0);
+  if (err)
+    return err;
+  xfree (get_membuf (&returned, NULL));
+  init_membuf (&returned, 4096);
+  return be_sqlite_search (ctrl, hd, req, desc, 1);
+}
+
+
+/* Search for the fingerprint FPR and return true if the key
+ * (KB,KBLEN) was found.  If KB is NULL return true if any key was
+ * found.  */
+static int
+found_fpr (ctrl_t ctrl, backend_handle_t hd, db_request_t req,
+           const char *fpr, const void *kb, size_t kblen)
+{
+  KEYDB_SEARCH_DESC desc;
+  gpg_error_t err;
+  const void *p;
+  size_t n;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FPR;
+  desc.fprlen = 20;
+  if (hex2bin (fpr, desc.u.fpr, 20) < 0)
+    fail (0);
+
+  err = search (ctrl, hd, req, &desc);
+  if (gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    fail (0);
+  p = peek_membuf (&returned, &n);
+  return !kb || (n == kblen && !memcmp (p, kb, kblen));
+}
+
+
+/* Search for the long key ID KID.  See found_fpr for the return
+ * value.  */
+static int
+found_kid (ctrl_t ctrl, backend_handle_t hd, db_request_t req,
+           const u32 *kid, const void *kb, size_t kblen)
+{
+  KEYDB_SEARCH_DESC desc;
+  gpg_error_t err;
+  const void *p;
+  size_t n;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+  desc.u.kid[0] = kid[0];
+  desc.u.kid[1] = kid[1];
+
+  err = search (ctrl, hd, req, &desc);
+  if (gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    fail (0);
+  p = peek_membuf (&returned, &n);
+  return !kb || (n == kblen && !memcmp (p, kb, kblen));
+}
+
+
+/* Search for the mail address MAIL.  See found_fpr for the return
+ * value.  */
+static int
+found_mail (ctrl_t ctrl, backend_handle_t hd, db_request_t req,
+            const char *mail, const void *kb, size_t kblen)
+{
+  KEYDB_SEARCH_DESC desc;
+  gpg_error_t err;
+  const void *p;
+  size_t n;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_MAIL;
+  desc.u.name = mail;
+
+  err = search (ctrl, hd, req, &desc);
+  if (gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    fail (0);
+  p = peek_membuf (&returned, &n);
+  return !kb || (n == kblen && !memcmp (p, kb, kblen));
+}
+
+
+static void
+test_sqlite (const char *srcdir)
+{
+  gpg_error_t err;
+  struct server_control_s ctrlbuf;
+  ctrl_t ctrl = &ctrlbuf;
+  backend_handle_t cachehd, hd;
+  db_request_t req;
+  char *fname;
+  unsigned char *kbx;
+  size_t kbxlen;
+  const unsigned char *kb1, *kb2;
+  size_t kb1len, kb2len, kb1shortlen;
+
+  memset (ctrl, 0, sizeof *ctrl);
+  init_membuf (&returned, 4096);
+  req = xcalloc (1, sizeof *req);
+
+  fname = xstrconcat (srcdir, "/g10/" SRCNAME, NULL);
+  kbx = read_file (fname, &kbxlen);
+  xfree (fname);
+  kb1 = get_keyblock (kbx, kbxlen, OFF_KEY1, &kb1len);
+  kb2 = get_keyblock (kbx, kbxlen, OFF_KEY2, &kb2len);
+  kb1shortlen = last_subkey_offset (kb1, kb1len);
+
+  /* The backend puts found keys into the cache.  */
+  err = be_cache_add_resource (ctrl, &cachehd);
+  if (err)
+    fail (1);
+
+  /* Store both keys in a new database.  */
+  remove (DBNAME);
+  err = be_sqlite_add_resource (ctrl, &hd, DBNAME, 0);
+  if (err)
+    fail (2);
+  if (be_sqlite_insert (ctrl, hd, req, PUBKEY_TYPE_OPGP, kb1, kb1len))
+    fail (3);
+  if (be_sqlite_insert (ctrl, hd, req, PUBKEY_TYPE_OPGP, kb2, kb2len))
+    fail (4);
+  /* The same keyblock can't be stored twice.  */
+  if (!be_sqlite_insert (ctrl, hd, req, PUBKEY_TYPE_OPGP, kb1, kb1len))
+    fail (5);
+
+  if (!found_fpr (ctrl, hd, req, fpr1, kb1, kb1len))
+    fail (6);
+  if (!found_fpr (ctrl, hd, req, fpr2, kb2, kb2len))
+    fail (7);
+  if (found_fpr (ctrl, hd, req, fpr3, NULL, 0))
+    fail (8);
+  if (!found_kid (ctrl, hd, req, subkid1, kb1, kb1len))
+    fail (9);
+  if (!found_kid (ctrl, hd, req, lastsubkid1, kb1, kb1len))
+    fail (10);
+  if (!found_mail (ctrl, hd, req, mail1, kb1, kb1len))
+    fail (11);
+
+  /* There is no delete operation; a key is removed from the search
+   * tables by an update.  Replace key 1 by a version without its
+   * last subkey and check that the rows of that subkey are gone.  */
+  if (be_sqlite_update (ctrl, hd, req, PUBKEY_TYPE_OPGP, kb1, kb1shortlen))
+    fail (20);
+  if (found_kid (ctrl, hd, req, lastsubkid1, NULL, 0))
+    fail (21);
+  if (!found_kid (ctrl, hd, req, subkid1, kb1, kb1shortlen))
+    fail (22);
+  if (!found_fpr (ctrl, hd, req, fpr1, kb1, kb1shortlen))
+    fail (23);
+  if (!found_mail (ctrl, hd, req, mail1, kb1, kb1shortlen))
+    fail (24);
+  be_sqlite_release_resource (ctrl, hd);
+  be_release_request (req);
+  req = xcalloc (1, sizeof *req);
+
+  /* Reopen the database read-only and check that everything has been
+   * written to disk.  */
+  err = be_sqlite_add_resource (ctrl, &hd, DBNAME, 1);
+  if (err)
+    fail (30);
+  if (!found_fpr (ctrl, hd, req, fpr1, kb1, kb1shortlen))
+    fail (31);
+  if (!found_fpr (ctrl, hd, req, fpr2, kb2, kb2len))
+    fail (32);
+  if (found_kid (ctrl, hd, req, lastsubkid1, NULL, 0))
+    fail (33);
+  if (gpg_err_code (be_sqlite_insert (ctrl, hd, req, PUBKEY_TYPE_OPGP,
+                                      kb1, kb1len)) != GPG_ERR_EACCES)
+    fail (34);
+  be_sqlite_release_resource (ctrl, hd);
+  be_release_request (req);
+
+  if (verbose)
+    printf ("database '%s' checked\n", DBNAME);
+
+  be_cache_release_resource (ctrl, cachehd);
+  xfree (get_membuf (&returned, NULL));
+  xfree (kbx);
+  remove (DBNAME);
+  remove (DBNAME "-wal");
+  remove (DBNAME "-shm");
+}
+
+
+int
+main (int argc, char **argv)
+{
+  const char *srcdir;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (GCRYPT_VERSION))
+    {
+      fprintf (stderr, "libgcrypt is too old\n");
+      return 1;
+    }
+  opt.quiet = !verbose;
+
+  srcdir = getenv ("abs_top_srcdir");
+  if (!srcdir)
+    srcdir = "..";
+
+  test_sqlite (srcdir);
+
+  return 0;
+}
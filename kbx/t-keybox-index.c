@@ -0,0 +1,319 @@
+/* t-keybox-index.c - Tests for keybox-index.c
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include "../common/host2net.h"
+
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                      exit (1);                                  \
+                   } while(0)
+
+/* The test keybox is shared with the keydb tests.  It has a header
+ * blob followed by the blobs for these two keys.  */
+#define SRCNAME  "t-keydb-keyring.kbx"
+#define KBXNAME  "t-keybox-index.kbx"
+#define IDXNAME  "t-keybox-index.kbx.idx"
+
+#define OFF_KEY1 32
+#define OFF_KEY2 3271
+
+static const char fpr1[] = "80615870F5BAD690333686D0F2AD85AC1E42B367";
+static const char fpr2[] = "26895E25E8446D44A26D8FAF2F7998F3DBFC6AD9";
+static const char fpr3[] = "0123456789ABCDEF0123456789ABCDEF01234567";
+
+static int verbose;
+
+
+/* Read the file FNAME into a new buffer and store its length at
+ * R_LEN.  */
+static unsigned char *
+read_file (const char *fname, size_t *r_len)
+{
+  FILE *fp;
+  unsigned char *buf;
+  size_t len;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+  fseek (fp, 0, SEEK_END);
+  len = ftell (fp);
+  fseek (fp, 0, SEEK_SET);
+  buf = xmalloc (len);
+  if (len && fread (buf, len, 1, fp) != 1)
+    {
+      fprintf (stderr, "error reading '%s'\n", fname);
+      exit (1);
+    }
+  fclose (fp);
+  *r_len = len;
+  return buf;
+}
+
+
+/* Write the two buffers A and B to FNAME using a temporary file so
+ * that FNAME gets a new inode.  */
+static void
+write_file (const char *fname, const void *a, size_t alen,
+            const void *b, size_t blen)
+{
+  FILE *fp;
+
+  fp = fopen (KBXNAME ".tmp", "wb");
+  if (!fp
+      || (alen && fwrite (a, alen, 1, fp) != 1)
+      || (blen && fwrite (b, blen, 1, fp) != 1)
+      || fclose (fp))
+    {
+      fprintf (stderr, "error writing '%s': %s\n",
+               KBXNAME ".tmp", strerror (errno));
+      exit (1);
+    }
+  if (rename (KBXNAME ".tmp", fname))
+    {
+      fprintf (stderr, "error renaming to '%s': %s\n",
+               fname, strerror (errno));
+      exit (1);
+    }
+}
+
+
+/* Search for the fingerprint FPR and return the offset of the found
+ * blob or -1 if it was not found.  */
+static off_t
+search_fpr (KEYBOX_HANDLE hd, const char *fpr)
+{
+  KEYBOX_SEARCH_DESC desc;
+  unsigned long skipped = 0;
+  gpg_error_t err;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FPR;
+  desc.fprlen = 20;
+  if (hex2bin (fpr, desc.u.fpr, 20) < 0)
+    fail (0);
+
+  keybox_search_reset (hd);
+  err = keybox_search (hd, &desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, &skipped);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    return -1;
+  if (err)
+    {
+      fprintf (stderr, "search for %s failed: %s\n", fpr, gpg_strerror (err));
+      exit (1);
+    }
+  return _keybox_get_blob_fileoffset (hd->found.blob);
+}
+
+
+/* Search for the long key ID taken from FPR and return the offset of
+ * the found blob or -1 if it was not found.  */
+static off_t
+search_kid (KEYBOX_HANDLE hd, const char *fpr)
+{
+  KEYBOX_SEARCH_DESC desc;
+  unsigned char buf[20];
+  unsigned long skipped = 0;
+  gpg_error_t err;
+
+  if (hex2bin (fpr, buf, 20) < 0)
+    fail (0);
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+  desc.u.kid[0] = buf32_to_u32 (buf+12);
+  desc.u.kid[1] = buf32_to_u32 (buf+16);
+
+  keybox_search_reset (hd);
+  err = keybox_search (hd, &desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, &skipped);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    return -1;
+  if (err)
+    {
+      fprintf (stderr, "search for %s failed: %s\n", fpr, gpg_strerror (err));
+      exit (1);
+    }
+  return _keybox_get_blob_fileoffset (hd->found.blob);
+}
+
+
+/* Parse the index file and check that it describes the current
+ * keybox file and has key entries exactly for the blobs at the
+ * offsets OFFTBL.  */
+static void
+check_index_file (const off_t *offtbl, int noffs)
+{
+  unsigned char *idx;
+  size_t idxlen;
+  struct stat st;
+  unsigned long nslots, used, n;
+  int i, found[2];
+  const unsigned char *slot;
+  off_t off;
+
+  if (stat (KBXNAME, &st))
+    fail (1);
+  idx = read_file (IDXNAME, &idxlen);
+  if (idxlen < 64)
+    fail (2);
+  if (memcmp (idx, "KBXi", 4) || idx[4] != 1)
+    fail (3);
+  nslots = buf32_to_ulong (idx+8);
+  if (!nslots || (nslots & (nslots - 1)))
+    fail (4);
+  if (idxlen != 64 + 16 * nslots)
+    fail (5);
+  /* The stored stat info must match the keybox file.  */
+  if (buf32_to_u32 (idx+16) != (u32)((uint64_t)st.st_size >> 32)
+      || buf32_to_u32 (idx+20) != (u32)((uint64_t)st.st_size & 0xffffffff)
+      || buf32_to_u32 (idx+24) != (u32)st.st_mtime
+      || buf32_to_u32 (idx+28) != (u32)st.st_ino)
+    fail (6);
+
+  memset (found, 0, sizeof found);
+  used = 0;
+  for (n=0; n < nslots; n++)
+    {
+      slot = idx + 64 + 16 * n;
+      if (slot[4])
+        used++;
+      if (slot[4] != 1)  /* Key entry.  */
+        continue;
+      off = (off_t)(((uint64_t)buf32_to_u32 (slot+8) << 32)
+                    | buf32_to_u32 (slot+12));
+      for (i=0; i < noffs; i++)
+        if (off == offtbl[i])
+          break;
+      if (i == noffs)
+        fail (7);  /* Entry for a blob which does not exist.  */
+      found[i] = 1;
+    }
+  for (i=0; i < noffs; i++)
+    if (!found[i])
+      fail (8);
+  if (used != buf32_to_ulong (idx+12))
+    fail (9);
+
+  xfree (idx);
+}
+
+
+static void
+test_index (const char *srcdir)
+{
+  gpg_error_t err;
+  char *fname;
+  unsigned char *kbx;
+  size_t kbxlen;
+  void *token;
+  KEYBOX_HANDLE hd;
+  off_t offtbl[2];
+
+  fname = xstrconcat (srcdir, "/g10/" SRCNAME, NULL);
+  kbx = read_file (fname, &kbxlen);
+  xfree (fname);
+  if (kbxlen <= OFF_KEY2)
+    fail (10);
+  remove (IDXNAME);
+  write_file (KBXNAME, kbx, kbxlen, NULL, 0);
+
+  err = keybox_register_file (KBXNAME, 0, &token);
+  if (err)
+    fail (11);
+  err = keybox_enable_index (token, 0);
+  if (err)
+    fail (12);
+
+  /* The first lookup builds the index.  */
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (13);
+  if (search_fpr (hd, fpr1) != OFF_KEY1)
+    fail (14);
+  if (search_fpr (hd, fpr2) != OFF_KEY2)
+    fail (15);
+  if (search_kid (hd, fpr2) != OFF_KEY2)
+    fail (16);
+  if (search_fpr (hd, fpr3) != -1)
+    fail (17);
+  offtbl[0] = OFF_KEY1;
+  offtbl[1] = OFF_KEY2;
+  check_index_file (offtbl, 2);
+  keybox_release (hd);
+
+  /* Replace the keybox behind our back by one without the first key.
+   * The index must notice this and be rebuilt; a stale index would
+   * not find the second key at its new offset.  */
+  write_file (KBXNAME, kbx, OFF_KEY1, kbx + OFF_KEY2, kbxlen - OFF_KEY2);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (20);
+  if (search_fpr (hd, fpr1) != -1)
+    fail (21);
+  if (search_fpr (hd, fpr2) != OFF_KEY1)
+    fail (22);
+  if (search_kid (hd, fpr2) != OFF_KEY1)
+    fail (23);
+  offtbl[0] = OFF_KEY1;
+  check_index_file (offtbl, 1);
+  keybox_release (hd);
+
+  if (verbose)
+    printf ("index of '%s' checked\n", KBXNAME);
+
+  xfree (kbx);
+  remove (KBXNAME);
+  remove (IDXNAME);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  const char *srcdir;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (GCRYPT_VERSION))
+    {
+      fprintf (stderr, "libgcrypt is too old\n");
+      return 1;
+    }
+
+  srcdir = getenv ("abs_top_srcdir");
+  if (!srcdir)
+    srcdir = "..";
+
+  test_index (srcdir);
+
+  return 0;
+}
@@ -48,6 +48,8 @@
 #endif /*GNUPG_MAJOR_VERSION*/
 
 #include "../common/host2net.h"
+#include "../common/timing.h"
+#include "../common/tracepoint.h"
 
 #include "iso7816.h"
 #include "apdu.h"
@@ -61,7 +63,7 @@ struct dev_list {
   int idx_max;
 };
 
-#define MAX_READER 4 /* Number of readers we support concurrently. */
+#define MAX_READER 16 /* Number of readers we support concurrently. */
 
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -114,6 +116,8 @@ struct reader_table_s {
     ccid_driver_t handle;
   } ccid;
   struct {
+    HANDLE context;  /* Context used for this card; PC/SC Lite
+                        serializes all calls on one context.  */
     HANDLE card;
     pcsc_dword_t protocol;
     pcsc_dword_t verify_ioctl;
@@ -134,6 +138,10 @@ struct reader_table_s {
                                               supports variable length pinpad
                                               input.  */
   unsigned int require_get_status:1;
+  int extlen;               /* Extended length capability of the
+                               card: 0 = unknown, -1 = not supported,
+                               >0 = max. response length.  */
+  struct apdu_stats_s stats; /* Statistics about the APDUs sent.  */
   unsigned char atr[33];
   size_t atrlen;           /* A zero length indicates that the ATR has
                               not yet been read; i.e. the card is not
@@ -209,6 +217,8 @@ static npth_mutex_t reader_table_lock;
 #endif
 
 /* Some PC/SC error codes.  */
+#define PCSC_INFINITE                  0xFFFFFFFF
+
 #define PCSC_E_CANCELLED               0x80100002
 #define PCSC_E_CANT_DISPOSE            0x8010000E
 #define PCSC_E_INSUFFICIENT_BUFFER     0x80100008
@@ -346,6 +356,7 @@ long (* DLSTDCALL pcsc_control) (HANDLE card,
                                  void *recv_buffer,
                                  pcsc_dword_t recv_len,
                                  pcsc_dword_t *bytes_returned);
+long (* DLSTDCALL pcsc_cancel) (HANDLE context);
 
 
 /*  Prototypes.  */
@@ -359,6 +370,7 @@ static int pcsc_pinpad_verify (int slot, int class, int ins, int p0, int p1,
                                pininfo_t *pininfo);
 static int pcsc_pinpad_modify (int slot, int class, int ins, int p0, int p1,
                                pininfo_t *pininfo);
+static int pcsc_watcher_notify (void);
 
 
 
@@ -458,11 +470,14 @@ new_reader_slot (void)
   reader_table[reader].is_spr532 = 0;
   reader_table[reader].pinpad_varlen_supported = 0;
   reader_table[reader].require_get_status = 1;
+  reader_table[reader].extlen = 0;
+  memset (&reader_table[reader].stats, 0, sizeof reader_table[reader].stats);
   reader_table[reader].pcsc.verify_ioctl = 0;
   reader_table[reader].pcsc.modify_ioctl = 0;
   reader_table[reader].pcsc.pinmin = -1;
   reader_table[reader].pcsc.pinmax = -1;
   reader_table[reader].pcsc.current_state = PCSC_STATE_UNAWARE;
+  reader_table[reader].pcsc.context = 0;
 
   return reader;
 }
@@ -750,9 +765,15 @@ pcsc_send_apdu (int slot, unsigned char *apdu, size_t apdulen,
       send_pci.protocol = PCSC_PROTOCOL_T0;
   send_pci.pci_len = sizeof send_pci;
   recv_len = *buflen;
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
   err = pcsc_transmit (reader_table[slot].pcsc.card,
                        &send_pci, apdu, apdulen,
                        NULL, buffer, &recv_len);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
   *buflen = recv_len;
   if (err)
     log_error ("pcsc_transmit failed: %s (0x%lx)\n",
@@ -782,8 +803,14 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 {
   long err;
 
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
   err = pcsc_control (reader_table[slot].pcsc.card, ioctl_code,
                       cntlbuf, len, buffer, buflen? *buflen:0, buflen);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
   if (err)
     {
       log_error ("pcsc_control failed: %s (0x%lx)\n",
@@ -798,7 +825,18 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 static int
 close_pcsc_reader (int slot)
 {
-  (void)slot;
+  /* SLOT may be -1 to only drop the reference to the global context.  */
+  if (slot >= 0 && reader_table[slot].pcsc.context)
+    {
+      pcsc_release_context (reader_table[slot].pcsc.context);
+      reader_table[slot].pcsc.context = 0;
+    }
+  if (slot >= 0)
+    {
+      /* Make sure the watcher does not wait on this reader anymore.  */
+      reader_table[slot].get_status_reader = NULL;
+      pcsc_watcher_notify ();
+    }
   if (--pcsc.count == 0)
     {
       int i;
@@ -826,12 +864,33 @@ connect_pcsc_card (int slot)
   reader_table[slot].atrlen = 0;
   reader_table[slot].is_t0 = 0;
 
-  err = pcsc_connect (pcsc.context,
+  /* Each reader gets its own context so that APDUs to different
+     readers are not serialized by the PC/SC daemon.  */
+  if (!reader_table[slot].pcsc.context)
+    {
+      err = pcsc_establish_context (PCSC_SCOPE_SYSTEM, NULL, NULL,
+                                    &reader_table[slot].pcsc.context);
+      if (err)
+        {
+          log_error ("pcsc_establish_context failed: %s (0x%lx)\n",
+                     pcsc_error_string (err), err);
+          reader_table[slot].pcsc.context = 0;
+          return pcsc_error_to_sw (err);
+        }
+    }
+
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
+  err = pcsc_connect (reader_table[slot].pcsc.context,
                       reader_table[slot].rdrname,
                       PCSC_SHARE_EXCLUSIVE,
                       PCSC_PROTOCOL_T0|PCSC_PROTOCOL_T1,
                       &reader_table[slot].pcsc.card,
                       &reader_table[slot].pcsc.protocol);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
   if (err)
     {
       reader_table[slot].pcsc.card = 0;
@@ -1113,6 +1172,7 @@ pcsc_init (void)
       pcsc_transmit          = dlsym (handle, "SCardTransmit");
       pcsc_set_timeout       = dlsym (handle, "SCardSetTimeout");
       pcsc_control           = dlsym (handle, "SCardControl");
+      pcsc_cancel            = dlsym (handle, "SCardCancel");
 
       if (!pcsc_establish_context
           || !pcsc_release_context
@@ -1163,6 +1223,147 @@ pcsc_init (void)
   return 0;
 }
 
+/* State of the thread waiting for status changes of the PC/SC
+   readers.  The thread uses its own context because PC/SC Lite
+   serializes calls per context.  */
+static struct {
+  int running;     /* The thread is running.  */
+  int dirty;       /* The set of readers has changed.  */
+  HANDLE context;  /* Context used by the thread.  */
+} pcsc_watcher;
+
+
+#ifdef USE_NPTH
+/* The thread waiting for PC/SC status changes.  Instead of having the
+   ticker poll each reader, we block in SCardGetStatusChange and kick
+   the main loop if something changed.  */
+static void *
+pcsc_watcher_thread (void *arg)
+{
+  struct pcsc_readerstate_s rdrstates[MAX_READER];
+  char *names[MAX_READER];
+  int nrdr = 0;
+  int slot, i, changed;
+  long err;
+
+  (void)arg;
+
+  memset (names, 0, sizeof names);
+  for (;;)
+    {
+      if (pcsc_watcher.dirty)
+        {
+          /* Rebuild the list of readers from the reader table.  We
+             copy the names because a reader might be closed while we
+             are waiting.  */
+          pcsc_watcher.dirty = 0;
+          for (i=0; i < nrdr; i++)
+            xfree (names[i]);
+          nrdr = 0;
+          memset (rdrstates, 0, sizeof rdrstates);
+          for (slot = 0; slot < MAX_READER; slot++)
+            if (reader_table[slot].used && reader_table[slot].rdrname
+                && reader_table[slot].get_status_reader == pcsc_get_status)
+              {
+                names[nrdr] = xtrystrdup (reader_table[slot].rdrname);
+                if (!names[nrdr])
+                  continue;
+                rdrstates[nrdr].reader = names[nrdr];
+                rdrstates[nrdr].current_state = PCSC_STATE_UNAWARE;
+                nrdr++;
+              }
+        }
+      if (!nrdr)
+        break;
+
+      npth_unprotect ();
+      err = pcsc_get_status_change (pcsc_watcher.context, PCSC_INFINITE,
+                                    rdrstates, nrdr);
+      npth_protect ();
+      if (err == PCSC_E_CANCELLED || err == PCSC_E_TIMEOUT)
+        continue;
+      if (err)
+        {
+          /* Fall back to a slow poll.  */
+          log_error ("pcsc_get_status_change failed: %s (0x%lx)\n",
+                     pcsc_error_string (err), err);
+          scd_kick_the_loop ();
+          npth_sleep (1);
+          pcsc_watcher.dirty = 1;
+          continue;
+        }
+
+      changed = 0;
+      for (i=0; i < nrdr; i++)
+        if ((rdrstates[i].event_state & PCSC_STATE_CHANGED))
+          {
+            rdrstates[i].current_state = (rdrstates[i].event_state
+                                          & ~PCSC_STATE_CHANGED);
+            changed = 1;
+          }
+      if (changed)
+        scd_kick_the_loop ();
+    }
+
+  for (i=0; i < nrdr; i++)
+    xfree (names[i]);
+  pcsc_watcher.running = 0;
+  return NULL;
+}
+#endif /*USE_NPTH*/
+
+
+/* Tell the watcher thread that the set of readers has changed and
+   start it if needed.  Returns true if status changes are reported
+   by the watcher so that no polling is required.  */
+static int
+pcsc_watcher_notify (void)
+{
+#ifdef USE_NPTH
+  npth_t thread;
+  npth_attr_t tattr;
+  long err;
+
+  if (!pcsc_cancel)
+    return 0;
+
+  pcsc_watcher.dirty = 1;
+  if (pcsc_watcher.running)
+    {
+      pcsc_cancel (pcsc_watcher.context);
+      return 1;
+    }
+
+  if (!pcsc_watcher.context)
+    {
+      err = pcsc_establish_context (PCSC_SCOPE_SYSTEM, NULL, NULL,
+                                    &pcsc_watcher.context);
+      if (err)
+        {
+          log_error ("pcsc_establish_context failed: %s (0x%lx)\n",
+                     pcsc_error_string (err), err);
+          pcsc_watcher.context = 0;
+          return 0;
+        }
+    }
+
+  if (npth_attr_init (&tattr))
+    return 0;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  pcsc_watcher.running = 1;
+  if (npth_create (&thread, &tattr, pcsc_watcher_thread, NULL))
+    {
+      log_error ("error spawning the PC/SC watcher: %s\n", strerror (errno));
+      pcsc_watcher.running = 0;
+    }
+  npth_attr_destroy (&tattr);
+  return pcsc_watcher.running;
+#else
+  return 0;
+#endif
+}
+
+
 /* Open the PC/SC reader.  Returns -1 on error or a slot number for
    the reader.  */
 static int
@@ -1178,7 +1379,7 @@ open_pcsc_reader (const char *rdrname)
   if (!reader_table[slot].rdrname)
     {
       log_error ("error allocating memory for reader name\n");
-      close_pcsc_reader (0);
+      close_pcsc_reader (slot);
       reader_table[slot].used = 0;
       unlock_slot (slot);
       return -1;
@@ -1195,6 +1396,10 @@ open_pcsc_reader (const char *rdrname)
   reader_table[slot].send_apdu_reader = pcsc_send_apdu;
   reader_table[slot].dump_status_reader = dump_pcsc_reader_status;
 
+  /* With the watcher thread running we don't need to poll.  */
+  if (pcsc_watcher_notify ())
+    reader_table[slot].require_get_status = 0;
+
   pcsc.count++;
   dump_reader_status (slot);
   unlock_slot (slot);
@@ -1414,7 +1619,14 @@ pcsc_pinpad_modify (int slot, int class, int ins, int p0, int p1,
 static void
 dump_ccid_reader_status (int slot)
 {
+  struct ccid_stats_s st;
+
   log_info ("reader slot %d: using ccid driver\n", slot);
+  ccid_get_stats (reader_table[slot].ccid.handle, &st);
+  log_info ("reader slot %d: %lu bulk-out (%llu bytes), %lu bulk-in"
+            " (%llu bytes), %llu.%03llu ms\n", slot,
+            st.nout, st.bytes_out, st.nin, st.bytes_in,
+            st.usec / 1000, st.usec % 1000);
 }
 
 static int
@@ -1976,7 +2188,7 @@ apdu_dev_list_start (const char *portstr, struct dev_list **l_p)
               err = gpg_error_from_syserror ();
 
               log_error ("error allocating memory for reader list\n");
-              close_pcsc_reader (0);
+              close_pcsc_reader (-1);
               npth_mutex_unlock (&reader_table_lock);
               return err;
             }
@@ -2350,6 +2562,10 @@ apdu_connect (int slot)
         }
     }
 
+  /* A new card might have been inserted; forget what we learned
+     about the previous one.  */
+  reader_table[slot].extlen = 0;
+
   /* We need to call apdu_get_status_internal, so that the last-status
      machinery gets setup properly even if a card is inserted while
      scdaemon is fired up and apdu_get_status has not yet been called.
@@ -2487,6 +2703,7 @@ apdu_reset (int slot)
 
   if (reader_table[slot].reset_reader)
     sw = reader_table[slot].reset_reader (slot);
+  reader_table[slot].extlen = 0;
 
   unlock_slot (slot);
   if (DBG_READER)
@@ -2673,6 +2890,43 @@ apdu_pinpad_modify (int slot, int class, int ins, int p0, int p1,
 }
 
 
+/* Update the statistics of SLOT for an APDU which took USEC
+   microseconds.  RC is the return code of the reader function and
+   BUFFER with BUFLEN the response including the status word.  With
+   "--debug trace" a line for each APDU is logged.  */
+static void
+record_apdu (int slot, const unsigned char *apdu, size_t apdulen, int rc,
+             const unsigned char *buffer, size_t buflen, unsigned long usec)
+{
+  struct apdu_stats_s *st = &reader_table[slot].stats;
+  unsigned int sw;
+
+  if (rc)
+    sw = rc;
+  else if (buflen >= 2)
+    sw = (buffer[buflen-2] << 8) | buffer[buflen-1];
+  else
+    sw = 0;
+
+  st->count++;
+  st->usec += usec;
+  if (usec > st->max_usec)
+    st->max_usec = usec;
+  st->nout += apdulen;
+  if (!rc)
+    st->nin += buflen;
+  if (sw != SW_SUCCESS && (sw & 0xff00) != SW_MORE_DATA)
+    st->errors++;
+  st->last_sw = sw;
+
+  if (DBG_TRACE)
+    log_debug ("apdu-trace: slot=%d ins=%02X sw=%04X out=%zu in=%zu"
+               " time=%lu.%03lums\n",
+               slot, apdulen > 1? apdu[1] : 0, sw, apdulen, rc? 0 : buflen,
+               usec / 1000, usec % 1000);
+}
+
+
 /* Dispatcher for the actual send_apdu function. Note, that this
    function should be called in locked state. */
 static int
@@ -2683,10 +2937,22 @@ send_apdu (int slot, unsigned char *apdu, size_t apdulen,
     return SW_HOST_NO_DRIVER;
 
   if (reader_table[slot].send_apdu_reader)
-    return reader_table[slot].send_apdu_reader (slot,
+    {
+      unsigned long long start;
+      int rc;
+
+      start = gnupg_timing_now ();
+      TRACEPOINT3 (apdu_send_begin, slot,
+                   apdulen > 1? apdu[1] : 0, apdulen);
+      rc = reader_table[slot].send_apdu_reader (slot,
                                                 apdu, apdulen,
                                                 buffer, buflen,
                                                 pininfo);
+      TRACEPOINT2 (apdu_send_end, slot, rc);
+      record_apdu (slot, apdu, apdulen, rc, buffer, buflen? *buflen : 0,
+                   (unsigned long)(gnupg_timing_now () - start));
+      return rc;
+    }
   else
     return SW_HOST_NOT_SUPPORTED;
 }
@@ -2978,6 +3244,17 @@ send_le (int slot, int class, int ins, int p0, int p1,
           apdu[apdulen++] = 0xC0;
           apdu[apdulen++] = 0;
           apdu[apdulen++] = 0;
+          if (!len && use_extended_length && result_buffer_size > 258)
+            {
+              /* The card has 256 or more bytes pending and we are
+                 allowed to use extended length: Fetch as much as
+                 fits into our result buffer to save round trips.  */
+              len = result_buffer_size - 2;
+              if (len > 65535)
+                len = 65535;
+              apdu[apdulen++] = 0;  /* Z byte: Extended length marker.  */
+              apdu[apdulen++] = ((len >> 8) & 0xff);
+            }
           apdu[apdulen++] = len;
           assert (apdulen <= apdu_buffer_size);
           memset (apdu+apdulen, 0, apdu_buffer_size - apdulen);
@@ -3351,6 +3628,57 @@ apdu_get_reader_name (int slot)
   return reader_table[slot].rdrname;
 }
 
+
+/* Return the cached extended length capability of the card in SLOT:
+   0 if not yet known, -1 if extended length APDUs are not supported
+   and the maximum response length otherwise.  */
+int
+apdu_get_extended_length (int slot)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return -1;
+  if (reader_table[slot].is_t0)
+    return -1;
+  return reader_table[slot].extlen;
+}
+
+
+/* Store the extended length capability VALUE as described for
+   apdu_get_extended_length for the card in SLOT.  The value is
+   cleared on the next reset or connect.  */
+void
+apdu_set_extended_length (int slot, int value)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return;
+  if (value > 65536)
+    value = 65536;
+  reader_table[slot].extlen = value;
+}
+
+
+/* Return the number of APDUs sent to the reader in SLOT.  This is
+   used to account the APDUs used by a high level operation.  */
+unsigned long
+apdu_get_apdu_count (int slot)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return 0;
+  return reader_table[slot].stats.count;
+}
+
+
+/* Copy the APDU statistics of the reader in SLOT to R_STATS.  Returns
+   0 on success or -1 if SLOT is not in use.  */
+int
+apdu_get_stats (int slot, struct apdu_stats_s *r_stats)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return -1;
+  *r_stats = reader_table[slot].stats;
+  return 0;
+}
+
 gpg_error_t
 apdu_init (void)
 {
@@ -142,5 +142,21 @@ int apdu_send_direct (int slot, size_t extended_length,
                       int handle_more, unsigned int *r_sw,
                       unsigned char **retbuf, size_t *retbuflen);
 const char *apdu_get_reader_name (int slot);
+int apdu_get_extended_length (int slot);
+void apdu_set_extended_length (int slot, int value);
+unsigned long apdu_get_apdu_count (int slot);
+
+/* Statistics about the APDUs sent to a reader.  */
+struct apdu_stats_s
+{
+  unsigned long count;        /* Number of APDUs sent.  */
+  unsigned long errors;       /* Number of APDUs not returning success.  */
+  unsigned long long usec;    /* Total time spent in microseconds.  */
+  unsigned long max_usec;     /* Time of the slowest APDU.  */
+  unsigned long long nout;    /* Number of bytes sent to the card.  */
+  unsigned long long nin;     /* Number of bytes received from the card.  */
+  unsigned int last_sw;       /* Status word of the last APDU.  */
+};
+int apdu_get_stats (int slot, struct apdu_stats_s *r_stats);
 
 #endif /*APDU_H*/
@@ -78,6 +78,7 @@ typedef enum
 struct card_ctx_s;
 struct app_ctx_s;
 struct app_local_s;  /* Defined by all app-*.c.  */
+struct card_cache_item_s;  /* Defined in app.c.  */
 
 
 typedef struct card_ctx_s *card_t;
@@ -113,9 +114,25 @@ struct card_ctx_s {
    * put the active app at the head of the list.  */
   app_t app;
 
+  /* Cache for certificates and public keys read from the card.  */
+  struct card_cache_item_s *cache;
+
+  /* Index of the keygrips seen on this card.  */
+  struct keygrip_index_item_s *keygrip_index;
+
+  /* The APDU counter of the slot when the card was locked.  */
+  unsigned long apdu_count_at_lock;
+
+  /* The time the card was locked and the name of the high level
+   * operation running under that lock; used for the statistics.  */
+  unsigned long long usec_at_lock;
+  const char *trace_op;
+
   /* Various flags.  */
   unsigned int reset_requested:1;
   unsigned int periodical_check_needed:1;
+  unsigned int cache_dirty:1;  /* The cache has not been saved.  */
+  unsigned int cache_loaded:1; /* The stored cache has been loaded.  */
 };
 
 
@@ -237,17 +254,23 @@ gpg_error_t check_application_conflict (card_t card, const char *name,
                                         const unsigned char *serialno_bin,
                                         size_t serialno_bin_len);
 gpg_error_t card_reset (card_t card, ctrl_t ctrl, int send_reset);
+void app_flush_card_cache (card_t card, ctrl_t ctrl);
 gpg_error_t select_application (ctrl_t ctrl, const char *name, card_t *r_app,
                                 int scan, const unsigned char *serialno_bin,
                                 size_t serialno_bin_len);
 gpg_error_t select_additional_application (ctrl_t ctrl, const char *name);
 char *get_supported_applications (void);
+char *app_get_stats (void);
 
 card_t card_ref (card_t card);
 void   card_unref (card_t card);
 void   card_unref_locked (card_t card);
 
 gpg_error_t app_munge_serialno (card_t card);
+int app_get_cached_file (app_t app, const char *id,
+                         unsigned char **r_data, size_t *r_datalen);
+void app_put_cached_file (app_t app, const char *id,
+                          const unsigned char *data, size_t datalen);
 gpg_error_t app_write_learn_status (card_t card, ctrl_t ctrl,
                                     unsigned int flags);
 gpg_error_t app_readcert (card_t card, ctrl_t ctrl, const char *certid,
@@ -301,6 +324,7 @@ gpg_error_t app_change_pin (card_t card, ctrl_t ctrl,
 gpg_error_t app_check_pin (card_t card, ctrl_t ctrl, const char *keyidstr,
                            gpg_error_t (*pincb)(void*, const char *, char **),
                            void *pincb_arg);
+void app_note_keygrip (ctrl_t ctrl, const char *keygrip_str);
 card_t app_do_with_keygrip (ctrl_t ctrl, int action, const char *keygrip_str);
 
 
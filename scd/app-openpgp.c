@@ -174,6 +174,12 @@ struct app_local_s {
 
   unsigned char status_indicator; /* The card status indicator.  */
 
+  /* The digital signature counter as read from the card and updated
+   * after each successful signing operation.  Only valid if
+   * SIG_COUNTER_VALID is set.  */
+  unsigned long sig_counter;
+  unsigned int sig_counter_valid:1;
+
   unsigned int manufacturer:16;   /* Manufacturer ID from the s/n.  */
 
   /* Keep track of the ISO card capabilities.  */
@@ -441,6 +447,7 @@ flush_cache (app_t app)
           xfree (c);
         }
       app->app_local->cache = NULL;
+      app->app_local->sig_counter_valid = 0;
     }
 }
 
@@ -812,6 +819,7 @@ store_fpr (app_t app, int keynumber, u32 timestamp, unsigned char *fpr,
 
   tag = (app->appversion > 0x0007? 0xC7 : 0xC6) + keynumber;
   flush_cache_item (app, 0xC5);
+  app->app_local->sig_counter_valid = 0; /* Reset by a new key.  */
   tag2 = 0xCE + keynumber;
   flush_cache_item (app, 0xCD);
 
@@ -4219,11 +4227,18 @@ get_sig_counter (app_t app)
   size_t valuelen;
   unsigned long ul;
 
+  /* The counter is only changed by our own signing operations; thus
+   * we need to read it only once.  */
+  if (app->app_local->sig_counter_valid)
+    return app->app_local->sig_counter;
+
   relptr = get_one_do (app, 0x0093, &value, &valuelen, NULL);
   if (!relptr)
     return 0;
   ul = convert_sig_counter_value (value, valuelen);
   xfree (relptr);
+  app->app_local->sig_counter = ul;
+  app->app_local->sig_counter_valid = 1;
   return ul;
 }
 
@@ -4544,6 +4559,10 @@ do_sign (app_t app, const char *keyidstr, int hashalgo,
     }
   rc = iso7816_compute_ds (app_get_slot (app), exmode, data, datalen, le_value,
                            outdata, outdatalen);
+  if (rc)
+    app->app_local->sig_counter_valid = 0;
+  else
+    app->app_local->sig_counter++;
   if (gpg_err_code (rc) == GPG_ERR_TIMEOUT)
     clear_chv_status (app, 1);
   else if (!rc && app->force_chv1)
@@ -303,6 +303,10 @@ struct app_local_s
   unsigned char *serialno;
   size_t serialnolen;
 
+  /* The SHA-1 hash of EF(TokenInfo) as hex string or empty if not
+     known.  Used to identify the cached directory files.  */
+  char tokeninfo_hash[41];
+
   /* Information on all certificates. */
   cdf_object_t certificate_info;
   /* Information on all trusted certificates. */
@@ -426,6 +430,36 @@ select_and_read_binary (int slot, unsigned short efid, const char *efid_desc,
 }
 
 
+/* Read the directory file with EFID for APP.  This is the same as
+   select_and_read_binary but uses the card's object cache with the
+   hash of the TokenInfo as part of the key.  Thus a directory is read
+   from the card only once; with the persistent card cache even
+   across re-insertions.  */
+static gpg_error_t
+read_directory_file (app_t app, unsigned short efid, const char *efid_desc,
+                     unsigned char **buffer, size_t *buflen)
+{
+  gpg_error_t err;
+  char id[41+12];
+
+  if (!*app->app_local->tokeninfo_hash)
+    return select_and_read_binary (app_get_slot (app), efid, efid_desc,
+                                   buffer, buflen);
+
+  snprintf (id, sizeof id, "%.40s-%04X.%04X",
+            app->app_local->tokeninfo_hash,
+            (unsigned int)(app->app_local->home_df & 0xffff), efid);
+  if (app_get_cached_file (app, id, buffer, buflen))
+    return 0;
+
+  err = select_and_read_binary (app_get_slot (app), efid, efid_desc,
+                                buffer, buflen);
+  if (!err)
+    app_put_cached_file (app, id, *buffer, *buflen);
+  return err;
+}
+
+
 /* This function calls select file to read a file using a complete
    path which may or may not start at the master file (MF). */
 static gpg_error_t
@@ -612,8 +646,7 @@ read_ef_odf (app_t app, unsigned short odf_fid)
   unsigned short value;
   size_t offset;
 
-  err = select_and_read_binary (app_get_slot (app), odf_fid, "ODF",
-                                &buffer, &buflen);
+  err = read_directory_file (app, odf_fid, "ODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -827,8 +860,7 @@ read_ef_prkdf (app_t app, unsigned short fid, prkdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No private keys. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "PrKDF",
-                                &buffer, &buflen);
+  err = read_directory_file (app, fid, "PrKDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1284,8 +1316,7 @@ read_ef_cdf (app_t app, unsigned short fid, cdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No certificates. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "CDF",
-                                &buffer, &buflen);
+  err = read_directory_file (app, fid, "CDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1558,8 +1589,7 @@ read_ef_aodf (app_t app, unsigned short fid, aodf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No authentication objects. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "AODF",
-                                &buffer, &buflen);
+  err = read_directory_file (app, fid, "AODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -2225,6 +2255,13 @@ read_ef_tokeninfo (app_t app)
   if (err)
     return err;
 
+  {
+    unsigned char digest[20];
+
+    gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, buflen);
+    bin2hex (digest, 20, app->app_local->tokeninfo_hash);
+  }
+
   p = buffer;
   n = buflen;
 
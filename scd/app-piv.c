@@ -286,7 +286,8 @@ get_cached_data (app_t app, int tag,
           }
     }
 
-  err = iso7816_get_data_odd (app_get_slot (app), 0, tag, &p, &len);
+  err = iso7816_get_data_odd (app_get_slot (app), ISO7816_EXTLEN_AUTO,
+                              tag, &p, &len);
   if (err)
     return err;
 
@@ -29,11 +29,16 @@
 #include "iso7816.h"
 #include "apdu.h"
 #include "../common/tlv.h"
+#include "../common/membuf.h"
+#include "../common/timing.h"
+#include "../common/sysutils.h"
 
 
-/* Forward declaration of internal function.  */
+/* Forward declaration of internal functions.  */
 static gpg_error_t
 select_additional_application_internal (card_t card, apptype_t req_apptype);
+static void invalidate_card_cache (card_t card);
+static void load_card_cache (card_t card);
 
 /* Lock to protect the list of cards and its associated
  * applications.  */
@@ -43,6 +48,18 @@ static npth_mutex_t card_list_lock;
  * (described by app_t) on the same physical token. */
 static card_t card_top;
 
+/* Statistics for the high level operations.  They are updated when
+ * the card is unlocked and can be retrieved with GETINFO.  */
+#define MAX_OP_STATS 16
+static struct
+{
+  const char *name;         /* Name of the operation or NULL.  */
+  unsigned long count;      /* Number of calls.  */
+  unsigned long long usec;  /* Total time spent in microseconds.  */
+  unsigned long max_usec;   /* Time of the slowest call.  */
+  unsigned long apdus;      /* Total number of APDUs sent.  */
+} op_stats[MAX_OP_STATS];
+
 
 /* The list of application names and their select function.  If no
  * specific application is selected the first available application on
@@ -234,17 +251,84 @@ lock_card (card_t card, ctrl_t ctrl)
 
   apdu_set_progress_cb (card->slot, print_progress_line, ctrl);
   apdu_set_prompt_cb (card->slot, popup_prompt, ctrl);
+  card->apdu_count_at_lock = apdu_get_apdu_count (card->slot);
+  card->usec_at_lock = gnupg_timing_now ();
+  card->trace_op = NULL;
+
+  return 0;
+}
+
+
+/* Same as lock_card but return GPG_ERR_EBUSY instead of waiting if
+ * the card is in use.  */
+static gpg_error_t
+trylock_card (card_t card, ctrl_t ctrl)
+{
+  int res;
+
+  res = npth_mutex_trylock (&card->lock);
+  if (res == EBUSY)
+    return gpg_error (GPG_ERR_EBUSY);
+  if (res)
+    {
+      gpg_error_t err = gpg_error_from_errno (res);
+      log_error ("failed to acquire CARD lock for %p: %s\n",
+                 card, gpg_strerror (err));
+      return err;
+    }
+
+  apdu_set_progress_cb (card->slot, print_progress_line, ctrl);
+  apdu_set_prompt_cb (card->slot, popup_prompt, ctrl);
+  card->apdu_count_at_lock = apdu_get_apdu_count (card->slot);
+  card->usec_at_lock = gnupg_timing_now ();
+  card->trace_op = NULL;
 
   return 0;
 }
 
 
+/* Account a call of the operation NAME which took USEC microseconds
+ * and sent APDUS APDUs.  NAME must be a string constant.  */
+static void
+record_op (const char *name, unsigned long usec, unsigned long apdus)
+{
+  int i;
+
+  for (i=0; i < MAX_OP_STATS; i++)
+    if (!op_stats[i].name || !strcmp (op_stats[i].name, name))
+      break;
+  if (i == MAX_OP_STATS)
+    return;  /* Table full - ignore.  */
+
+  op_stats[i].name = name;
+  op_stats[i].count++;
+  op_stats[i].usec += usec;
+  if (usec > op_stats[i].max_usec)
+    op_stats[i].max_usec = usec;
+  op_stats[i].apdus += apdus;
+
+  if (DBG_TRACE)
+    log_debug ("op-trace: %s apdus=%lu time=%lu.%03lums\n",
+               name, apdus, usec / 1000, usec % 1000);
+}
+
+
 /* Release a lock on a card.  See lock_reader(). */
 static void
 unlock_card (card_t card)
 {
   apdu_set_progress_cb (card->slot, NULL, NULL);
   apdu_set_prompt_cb (card->slot, NULL, NULL);
+  if (DBG_CARD_IO)
+    log_debug ("slot %d: %lu APDUs sent while locked\n", card->slot,
+               apdu_get_apdu_count (card->slot) - card->apdu_count_at_lock);
+  if (card->trace_op)
+    {
+      record_op (card->trace_op,
+                 (unsigned long)(gnupg_timing_now () - card->usec_at_lock),
+                 apdu_get_apdu_count (card->slot) - card->apdu_count_at_lock);
+      card->trace_op = NULL;
+    }
 
   if (npth_mutex_unlock (&card->lock))
     {
@@ -255,6 +339,446 @@ unlock_card (card_t card)
 }
 
 
+/* An item of the per-card cache of objects read from the card.  KIND
+ * is 'C' for a certificate, 'K' for a public key, and 'F' for a file
+ * stored by an app.  */
+struct card_cache_item_s
+{
+  struct card_cache_item_s *next;
+  apptype_t apptype;
+  int kind;
+  unsigned char *data;
+  size_t datalen;
+  char id[1];
+};
+
+
+/* An item of the per-card index mapping keygrips to the app holding
+ * the key.  */
+struct keygrip_index_item_s
+{
+  struct keygrip_index_item_s *next;
+  apptype_t apptype;
+  char keygrip[41];
+};
+
+
+/* Remove all items from the keygrip index of CARD.  */
+static void
+flush_keygrip_index (card_t card)
+{
+  struct keygrip_index_item_s *item, *next;
+
+  for (item = card->keygrip_index; item; item = next)
+    {
+      next = item->next;
+      xfree (item);
+    }
+  card->keygrip_index = NULL;
+}
+
+
+/* Return the index item for KEYGRIP_STR on CARD or NULL.  */
+static struct keygrip_index_item_s *
+find_keygrip_index (card_t card, const char *keygrip_str)
+{
+  struct keygrip_index_item_s *item;
+
+  load_card_cache (card);
+  for (item = card->keygrip_index; item; item = item->next)
+    if (!ascii_strcasecmp (item->keygrip, keygrip_str))
+      return item;
+  return NULL;
+}
+
+
+/* Record in the index of CARD that the key KEYGRIP_STR is held by the
+ * app APPTYPE.  */
+static void
+put_keygrip_index (card_t card, apptype_t apptype, const char *keygrip_str)
+{
+  struct keygrip_index_item_s *item;
+
+  if (strlen (keygrip_str) != 40)
+    return;
+  item = find_keygrip_index (card, keygrip_str);
+  if (item)
+    {
+      item->apptype = apptype;
+      return;
+    }
+  item = xtrymalloc (sizeof *item);
+  if (!item)
+    return;  /* Out of core - the index is only an optimization.  */
+  item->apptype = apptype;
+  strcpy (item->keygrip, keygrip_str);
+  item->next = card->keygrip_index;
+  card->keygrip_index = item;
+  card->cache_dirty = 1;
+}
+
+
+/* Remove all objects from the cache of CARD.  This must be called
+ * with the card locked whenever the card content may have changed.  */
+static void
+flush_card_cache (card_t card)
+{
+  struct card_cache_item_s *item, *next;
+
+  if (card->cache && DBG_CACHE)
+    log_debug ("slot %d: flushing card cache\n", card->slot);
+  for (item = card->cache; item; item = next)
+    {
+      next = item->next;
+      xfree (item->data);
+      xfree (item);
+    }
+  card->cache = NULL;
+  flush_keygrip_index (card);
+}
+
+
+/* Look up the object ID of KIND for the app APPTYPE of CARD.  On
+ * success a copy of the object is stored at R_DATA and R_DATALEN and
+ * true is returned.  */
+static int
+get_from_card_cache (card_t card, apptype_t apptype, int kind,
+                     const char *id,
+                     unsigned char **r_data, size_t *r_datalen)
+{
+  struct card_cache_item_s *item;
+
+  load_card_cache (card);
+  for (item = card->cache; item; item = item->next)
+    if (item->kind == kind && item->apptype == apptype
+        && !strcmp (item->id, id))
+      {
+        *r_data = xtrymalloc (item->datalen);
+        if (!*r_data)
+          return 0;
+        memcpy (*r_data, item->data, item->datalen);
+        *r_datalen = item->datalen;
+        if (DBG_CACHE)
+          log_debug ("slot %d app %s: %s '%s' taken from cache\n",
+                     card->slot, strapptype (apptype),
+                     kind == 'C'? "cert" : kind == 'K'? "key" : "file", id);
+        return 1;
+      }
+  return 0;
+}
+
+
+/* Public version of flush_card_cache for callers which modify the
+ * card without going through this module.  */
+void
+app_flush_card_cache (card_t card, ctrl_t ctrl)
+{
+  if (!card || lock_card (card, ctrl))
+    return;
+  invalidate_card_cache (card);
+  unlock_card (card);
+}
+
+
+/* Store a copy of DATA as object ID of KIND for the app APPTYPE of
+ * CARD.  Errors are ignored; the object is then simply not cached.  */
+static void
+put_into_card_cache (card_t card, apptype_t apptype, int kind,
+                     const char *id,
+                     const unsigned char *data, size_t datalen)
+{
+  struct card_cache_item_s *item;
+
+  for (item = card->cache; item; item = item->next)
+    if (item->kind == kind && item->apptype == apptype
+        && !strcmp (item->id, id))
+      return;  /* Already cached.  */
+
+  item = xtrymalloc (sizeof *item + strlen (id));
+  if (!item)
+    return;
+  item->data = xtrymalloc (datalen? datalen : 1);
+  if (!item->data)
+    {
+      xfree (item);
+      return;
+    }
+  memcpy (item->data, data, datalen);
+  item->datalen = datalen;
+  item->apptype = apptype;
+  item->kind = kind;
+  strcpy (item->id, id);
+  item->next = card->cache;
+  card->cache = item;
+  card->cache_dirty = 1;
+}
+
+
+/* Public version of get_from_card_cache for files cached by APP.
+ * The card must be locked.  */
+int
+app_get_cached_file (app_t app, const char *id,
+                     unsigned char **r_data, size_t *r_datalen)
+{
+  return get_from_card_cache (app->card, app->apptype, 'F', id,
+                              r_data, r_datalen);
+}
+
+
+/* Public version of put_into_card_cache for files cached by APP.
+ * The card must be locked.  */
+void
+app_put_cached_file (app_t app, const char *id,
+                     const unsigned char *data, size_t datalen)
+{
+  put_into_card_cache (app->card, app->apptype, 'F', id, data, datalen);
+}
+
+
+/* Return the name of the file used to store the cache of CARD or NULL
+ * if the cache shall not be stored.  */
+static char *
+card_cache_filename (card_t card)
+{
+  char *hexsn, *fname;
+
+  if (!opt.persistent_card_cache || !card->serialno || !card->serialnolen)
+    return NULL;
+  hexsn = bin2hex (card->serialno, card->serialnolen, NULL);
+  if (!hexsn)
+    return NULL;
+  fname = make_filename_try (gnupg_homedir (), "scd-cache.d", hexsn, NULL);
+  xfree (hexsn);
+  return fname;
+}
+
+
+/* Compute a stamp identifying the state of CARD and store it as a
+ * hex string at STAMP.  The stamp covers the ATR and the serial
+ * number; other properties are not yet known when the cache is
+ * loaded during the app selection.  */
+static void
+card_cache_stamp (card_t card, char stamp[41])
+{
+  unsigned char digest[20];
+  unsigned char *atr;
+  size_t atrlen;
+  gcry_buffer_t iov[2];
+
+  atr = apdu_get_atr (card->slot, &atrlen);
+  memset (iov, 0, sizeof iov);
+  iov[0].data = atr;
+  iov[0].len = atr? atrlen : 0;
+  iov[1].data = card->serialno;
+  iov[1].len = card->serialnolen;
+  gcry_md_hash_buffers (GCRY_MD_SHA1, 0, digest, iov, DIM (iov));
+  xfree (atr);
+  bin2hex (digest, 20, stamp);
+}
+
+
+/* Write the cache of CARD to its file.  The file has a header line
+ * with the stamp and one line per object:
+ *
+ *   <app> C <certid> <hexdata>
+ *   <app> K <keyid> <hexdata>
+ *   <app> F <fileid> <hexdata>
+ *   <app> G <keygrip> -
+ */
+static void
+save_card_cache (card_t card)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname = NULL;
+  char *dname = NULL;
+  estream_t fp = NULL;
+  char stamp[41];
+  struct card_cache_item_s *item;
+  struct keygrip_index_item_s *kitem;
+  size_t n;
+
+  fname = card_cache_filename (card);
+  if (!fname)
+    return;
+
+  dname = make_filename_try (gnupg_homedir (), "scd-cache.d", NULL);
+  if (!dname)
+    goto leave;
+  gnupg_mkdir (dname, "-rwx");  /* Ignore errors; e.g. EEXIST.  */
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    goto leave;
+  fp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error creating '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+
+  card_cache_stamp (card, stamp);
+  es_fprintf (fp, "# scdaemon card cache\nstamp %s\n", stamp);
+  for (item = card->cache; item; item = item->next)
+    {
+      es_fprintf (fp, "%s %c %s ",
+                  strapptype (item->apptype), item->kind, item->id);
+      for (n=0; n < item->datalen; n++)
+        es_fprintf (fp, "%02X", item->data[n]);
+      es_putc ('\n', fp);
+    }
+  for (kitem = card->keygrip_index; kitem; kitem = kitem->next)
+    es_fprintf (fp, "%s G %s -\n", strapptype (kitem->apptype),
+                kitem->keygrip);
+
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      fp = NULL;
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  fp = NULL;
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    log_error ("error renaming '%s': %s\n", tmpfname, gpg_strerror (err));
+  else
+    {
+      card->cache_dirty = 0;
+      if (DBG_CACHE)
+        log_debug ("slot %d: card cache saved\n", card->slot);
+    }
+
+ leave:
+  es_fclose (fp);
+  xfree (tmpfname);
+  xfree (dname);
+  xfree (fname);
+}
+
+
+/* Fill the cache of CARD from its file but only if the stamp still
+ * matches.  This is done on the first access to the cache after the
+ * serial number is known.  */
+static void
+load_card_cache (card_t card)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  gpg_err_code_t ec;
+  char stamp[41];
+  char *fields[4];
+  int lnr = 0;
+  apptype_t apptype;
+  unsigned char *data;
+  size_t datalen;
+  int okay = 0;
+  int was_dirty = card->cache_dirty;
+
+  if (card->cache_loaded || !card->serialno)
+    return;
+  card->cache_loaded = 1;
+  fname = card_cache_filename (card);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      xfree (fname);
+      return;
+    }
+
+  card_cache_stamp (card, stamp);
+  for (;;)
+    {
+      maxlen = 2 * 65536 + 1024;
+      if (es_read_line (fp, &line, &linesize, &maxlen) <= 0)
+        break;
+      lnr++;
+      if (!maxlen)
+        {
+          log_info ("%s:%d: line too long - ignoring cache\n", fname, lnr);
+          goto leave;
+        }
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      if (split_fields (line, fields, DIM (fields)) != DIM (fields))
+        {
+          log_info ("%s:%d: invalid line - ignoring cache\n", fname, lnr);
+          goto leave;
+        }
+      if (!strcmp (fields[0], "stamp"))
+        {
+          if (strcmp (fields[1], stamp))
+            {
+              if (DBG_CACHE)
+                log_debug ("slot %d: card cache is stale\n", card->slot);
+              goto leave;
+            }
+          okay = 1;
+          continue;
+        }
+      if (!okay)
+        goto leave;  /* No stamp.  */
+
+      apptype = apptype_from_name (fields[0]);
+      if (!apptype)
+        continue;
+      if (*fields[1] == 'G')
+        put_keygrip_index (card, apptype, fields[2]);
+      else if (*fields[1] == 'C' || *fields[1] == 'K' || *fields[1] == 'F')
+        {
+          datalen = strlen (fields[3]);
+          if (!datalen || (datalen & 1))
+            continue;
+          datalen /= 2;
+          data = xtrymalloc (datalen);
+          if (!data)
+            continue;
+          if (hex2bin (fields[3], data, datalen) >= 0)
+            put_into_card_cache (card, apptype, *fields[1], fields[2],
+                                 data, datalen);
+          xfree (data);
+        }
+    }
+  ec = es_ferror (fp)? gpg_err_code_from_syserror () : 0;
+  if (ec)
+    log_error ("error reading '%s': %s\n", fname, gpg_strerror (ec));
+  else if (okay && DBG_CACHE)
+    log_debug ("slot %d: card cache loaded\n", card->slot);
+
+ leave:
+  card->cache_dirty = was_dirty;
+  es_fclose (fp);
+  xfree (line);
+  xfree (fname);
+}
+
+
+/* Flush the cache of CARD after its content has been modified and
+ * remove the stored copy.  */
+static void
+invalidate_card_cache (card_t card)
+{
+  char *fname;
+
+  flush_card_cache (card);
+  card->cache_dirty = 0;
+  card->cache_loaded = 1;
+  fname = card_cache_filename (card);
+  if (fname)
+    {
+      gnupg_remove (fname);
+      xfree (fname);
+    }
+}
+
+
 /* This function may be called to print information pertaining to the
  * current state of this module to the log. */
 void
@@ -362,6 +886,7 @@ card_reset (card_t card, ctrl_t ctrl, int send_reset)
       int sw;
 
       lock_card (card, ctrl);
+      flush_card_cache (card);
       sw = apdu_reset (card->slot);
       if (sw)
         err = gpg_error (GPG_ERR_CARD_RESET);
@@ -930,6 +1455,45 @@ get_supported_applications (void)
 }
 
 
+/* Return a string with the statistics about the APDUs of all readers
+ * and the high level operations.  Each line is either
+ *
+ *   reader:SLOT:COUNT:ERRORS:USEC:MAXUSEC:BYTESOUT:BYTESIN:LASTSW
+ *
+ * or
+ *
+ *   op:NAME:COUNT:USEC:MAXUSEC:APDUS
+ *
+ * with the times given in microseconds.  Returns NULL on error.  */
+char *
+app_get_stats (void)
+{
+  membuf_t mb;
+  card_t c;
+  struct apdu_stats_s st;
+  int i;
+
+  init_membuf (&mb, 256);
+
+  npth_mutex_lock (&card_list_lock);
+  for (c = card_top; c; c = c->next)
+    if (!apdu_get_stats (c->slot, &st))
+      put_membuf_printf (&mb, "reader:%d:%lu:%lu:%llu:%lu:%llu:%llu:%04X\n",
+                         c->slot, st.count, st.errors, st.usec, st.max_usec,
+                         st.nout, st.nin, st.last_sw);
+  npth_mutex_unlock (&card_list_lock);
+
+  for (i=0; i < MAX_OP_STATS && op_stats[i].name; i++)
+    put_membuf_printf (&mb, "op:%s:%lu:%llu:%lu:%lu\n",
+                       op_stats[i].name, op_stats[i].count,
+                       op_stats[i].usec, op_stats[i].max_usec,
+                       op_stats[i].apdus);
+
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
 /* Deallocate the application.  */
 static void
 deallocate_card (card_t card)
@@ -963,6 +1527,9 @@ deallocate_card (card_t card)
       xfree (a);
     }
 
+  if (card->cache_dirty)
+    save_card_cache (card);
+  flush_card_cache (card);
   xfree (card->serialno);
   unlock_card (card);
   xfree (card);
@@ -1133,13 +1700,24 @@ maybe_switch_app (ctrl_t ctrl, card_t card, const char *keyref)
         }
       else if (strlen (keyref) == 40)
         {
-          /* This looks like a keygrip.  Iterate over all apps to find
-           * the corresponding app.  */
+          /* This looks like a keygrip.  Use the index or iterate over
+           * all apps to find the corresponding app.  */
+          struct keygrip_index_item_s *item;
+
+          item = find_keygrip_index (card, keyref);
           for (app = card->app; app; app_prev = app, app = app->next)
-            if (app->fnc.with_keygrip
-                && !app->fnc.with_keygrip (app, ctrl,
-                                           KEYGRIP_ACTION_LOOKUP, keyref))
-              break;
+            if (item)
+              {
+                if (app->apptype == item->apptype)
+                  break;
+              }
+            else if (app->fnc.with_keygrip
+                     && !app->fnc.with_keygrip (app, ctrl,
+                                                KEYGRIP_ACTION_LOOKUP, keyref))
+              {
+                put_keygrip_index (card, app->apptype, keyref);
+                break;
+              }
           if (!app_prev && ctrl->current_apptype == card->app->apptype)
             return 0;   /* Already the first app - no need to switch.  */
         }
@@ -1230,6 +1808,7 @@ app_write_learn_status (card_t card, ctrl_t ctrl, unsigned int flags)
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "learn";
 
   /* Always make sure that the current app for this connection has
    * been selected and is at the top of the list.  */
@@ -1290,17 +1869,22 @@ app_readcert (card_t card, ctrl_t ctrl, const char *certid,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "readcert";
 
   if ((err = maybe_switch_app (ctrl, card, certid)))
     ;
   else if (!card->app->fnc.readcert)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if (get_from_card_cache (card, card->app->apptype, 'C', certid, cert, certlen))
+    ;
   else
     {
       if (DBG_APP)
         log_debug ("slot %d app %s: calling readcert(%s)\n",
                    card->slot, xstrapptype (card->app), certid);
       err = card->app->fnc.readcert (card->app, certid, cert, certlen);
+      if (!err)
+        put_into_card_cache (card, card->app->apptype, 'C', certid, *cert, *certlen);
     }
 
   unlock_card (card);
@@ -1332,17 +1916,25 @@ app_readkey (card_t card, ctrl_t ctrl, const char *keyid, unsigned int flags,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "readkey";
 
   if ((err = maybe_switch_app (ctrl, card, keyid)))
     ;
   else if (!card->app->fnc.readkey)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if (!flags && pk && pklen
+           && get_from_card_cache (card, card->app->apptype, 'K', keyid, pk, pklen))
+    ;
   else
     {
       if (DBG_APP)
         log_debug ("slot %d app %s: calling readkey(%s)\n",
                    card->slot, xstrapptype (card->app), keyid);
       err = card->app->fnc.readkey (card->app, ctrl, keyid, flags, pk, pklen);
+      /* With the INFO flag status lines are emitted; we can't cache
+       * those but the key itself is still fine.  */
+      if (!err && pk && *pk && pklen)
+        put_into_card_cache (card, card->app->apptype, 'K', keyid, *pk, *pklen);
     }
 
   unlock_card (card);
@@ -1361,6 +1953,7 @@ app_getattr (card_t card, ctrl_t ctrl, const char *name)
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "getattr";
 
   if ((err = maybe_switch_app (ctrl, card, NULL)))
     ;
@@ -1414,6 +2007,7 @@ app_setattr (card_t card, ctrl_t ctrl, const char *name,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "setattr";
 
   if ((err = maybe_switch_app (ctrl, card, NULL)))
     ;
@@ -1424,6 +2018,7 @@ app_setattr (card_t card, ctrl_t ctrl, const char *name,
       if (DBG_APP)
         log_debug ("slot %d app %s: calling setattr(%s)\n",
                    card->slot, xstrapptype (card->app), name);
+      invalidate_card_cache (card);
       err = card->app->fnc.setattr (card->app, name, pincb, pincb_arg,
                                     value, valuelen);
     }
@@ -1450,6 +2045,7 @@ app_sign (card_t card, ctrl_t ctrl, const char *keyidstr, int hashalgo,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "sign";
 
   if ((err = maybe_switch_app (ctrl, card, keyidstr)))
     ;
@@ -1491,6 +2087,7 @@ app_auth (card_t card, ctrl_t ctrl, const char *keyidstr,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "auth";
 
   if ((err = maybe_switch_app (ctrl, card, keyidstr)))
     ;
@@ -1534,6 +2131,7 @@ app_decipher (card_t card, ctrl_t ctrl, const char *keyidstr,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "decipher";
 
   if ((err = maybe_switch_app (ctrl, card, keyidstr)))
     ;
@@ -1573,6 +2171,7 @@ app_writecert (card_t card, ctrl_t ctrl,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "writecert";
 
   if ((err = maybe_switch_app (ctrl, card, certidstr)))
     ;
@@ -1583,6 +2182,7 @@ app_writecert (card_t card, ctrl_t ctrl,
       if (DBG_APP)
         log_debug ("slot %d app %s: calling writecert(%s)\n",
                    card->slot, xstrapptype (card->app), certidstr);
+      invalidate_card_cache (card);
       err = card->app->fnc.writecert (card->app, ctrl, certidstr,
                                       pincb, pincb_arg, data, datalen);
     }
@@ -1609,6 +2209,7 @@ app_writekey (card_t card, ctrl_t ctrl,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "writekey";
 
   if ((err = maybe_switch_app (ctrl, card, keyidstr)))
     ;
@@ -1619,6 +2220,7 @@ app_writekey (card_t card, ctrl_t ctrl,
       if (DBG_APP)
         log_debug ("slot %d app %s: calling writekey(%s)\n",
                    card->slot, xstrapptype (card->app), keyidstr);
+      invalidate_card_cache (card);
       err = card->app->fnc.writekey (card->app, ctrl, keyidstr, flags,
                                      pincb, pincb_arg, keydata, keydatalen);
     }
@@ -1644,6 +2246,7 @@ app_genkey (card_t card, ctrl_t ctrl, const char *keynostr,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "genkey";
 
   if ((err = maybe_switch_app (ctrl, card, keynostr)))
     ;
@@ -1654,6 +2257,7 @@ app_genkey (card_t card, ctrl_t ctrl, const char *keynostr,
       if (DBG_APP)
         log_debug ("slot %d app %s: calling genkey(%s)\n",
                    card->slot, xstrapptype (card->app), keynostr);
+      invalidate_card_cache (card);
       err = card->app->fnc.genkey (card->app, ctrl, keynostr, keytype, flags,
                                    createtime, pincb, pincb_arg);
     }
@@ -1679,6 +2283,7 @@ app_get_challenge (card_t card, ctrl_t ctrl,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "getchallenge";
 
   if (!card->ref_count)
     err = gpg_error (GPG_ERR_CARD_NOT_INITIALIZED);
@@ -1704,6 +2309,7 @@ app_change_pin (card_t card, ctrl_t ctrl, const char *chvnostr,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "passwd";
 
   if ((err = maybe_switch_app (ctrl, card, NULL)))
     ;
@@ -1740,6 +2346,7 @@ app_check_pin (card_t card, ctrl_t ctrl, const char *keyidstr,
   err = lock_card (card, ctrl);
   if (err)
     return err;
+  card->trace_op = "checkpin";
 
   if ((err = maybe_switch_app (ctrl, card, NULL)))
     ;
@@ -1832,8 +2439,15 @@ scd_update_reader_status_file (void)
       int sw;
       unsigned int status;
 
-      lock_card (card, NULL);
+      /* Don't wait for a card which is busy with an operation; the
+       * operation itself notices a removal and we don't want to
+       * block the other cards and the card list in the meantime.  */
       card_next = card->next;
+      if (trylock_card (card, NULL))
+        {
+          periodical_check_needed = 1;
+          continue;
+        }
 
       if (card->reset_requested)
         status = 0;
@@ -1959,6 +2573,18 @@ app_send_card_list (ctrl_t ctrl)
 }
 
 
+/* Record that the key KEYGRIP_STR is held by the card and app
+ * currently enumerated by app_do_with_keygrip.  This is called by
+ * send_keyinfo so that a listing of all keys fills the index.  */
+void
+app_note_keygrip (ctrl_t ctrl, const char *keygrip_str)
+{
+  if (ctrl->keyinfo_card && keygrip_str)
+    put_keygrip_index (ctrl->keyinfo_card, ctrl->keyinfo_apptype,
+                       keygrip_str);
+}
+
+
 /* Execute an action for each app.  ACTION can be one of:
  *
  * - KEYGRIP_ACTION_SEND_DATA
@@ -1988,9 +2614,42 @@ app_do_with_keygrip (ctrl_t ctrl, int action, const char *keygrip_str)
   int locked = 0;
   card_t c;
   app_t a;
+  struct keygrip_index_item_s *item;
 
   npth_mutex_lock (&card_list_lock);
 
+  /* First try the index.  For a lookup no APDU is required at all;
+   * for the other actions only the app holding the key is asked.  */
+  if (keygrip_str)
+    {
+      for (c = card_top; c; c = c->next)
+        if ((item = find_keygrip_index (c, keygrip_str)))
+          break;
+      if (c)
+        {
+          for (a = c->app; a; a = a->next)
+            if (a->apptype == item->apptype)
+              break;
+          if (a && action == KEYGRIP_ACTION_LOOKUP)
+            goto leave_the_loop;
+          if (a && a->fnc.with_keygrip)
+            {
+              if (lock_card (c, ctrl))
+                {
+                  c = NULL;
+                  goto leave_the_loop;
+                }
+              locked = 1;
+              if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str))
+                goto leave_the_loop;
+              unlock_card (c);
+              locked = 0;
+            }
+          /* Stale index item - do a full scan.  */
+          flush_keygrip_index (c);
+        }
+    }
+
   for (c = card_top; c; c = c->next)
     {
       if (lock_card (c, ctrl))
@@ -2005,8 +2664,16 @@ app_do_with_keygrip (ctrl_t ctrl, int action, const char *keygrip_str)
             if (DBG_APP)
               log_debug ("slot %d app %s: calling with_keygrip(action=%d)\n",
                          c->slot, xstrapptype (a), action);
+            ctrl->keyinfo_card = c;
+            ctrl->keyinfo_apptype = a->apptype;
             if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str))
-              goto leave_the_loop;
+              {
+                ctrl->keyinfo_card = NULL;
+                if (keygrip_str)
+                  put_keygrip_index (c, a->apptype, keygrip_str);
+                goto leave_the_loop;
+              }
+            ctrl->keyinfo_card = NULL;
           }
       unlock_card (c);
       locked = 0;
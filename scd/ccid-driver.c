@@ -106,7 +106,7 @@
         commnd + lc + le = 4 + 3 + 0
    Receiving: 2048 for cardholder certificate
 */
-#define CCID_MAX_BUF (2048+7+10)
+#define CCID_MAX_BUF (4096+7+10)
 
 /* CCID command timeout.  */
 #define CCID_CMD_TIMEOUT (5*1000)
@@ -116,6 +116,7 @@
  * use the latter when GNUPG_MAJOR_VERSION is defined.  */
 #if defined(GNUPG_MAJOR_VERSION)
 #  include "scdaemon.h"
+#  include "../common/timing.h"
 
 # define DEBUGOUT(t)         do { if (debug_level) \
                                   log_debug (DRVNAME t); } while (0)
@@ -161,6 +162,8 @@
 # define DEBUGOUT_LF()        do { if (debug_level) \
                      putc ('\n', stderr); } while (0)
 
+# define gnupg_timing_now()   0ULL  /* No timing available.  */
+
 #endif /* This source is not used by scdaemon. */
 
 
@@ -246,6 +249,8 @@ struct ccid_driver_s
 
   unsigned char intr_buf[64];
   struct libusb_transfer *transfer;
+
+  struct ccid_stats_s stats;  /* Statistics about the transfers.  */
 };
 
 
@@ -257,6 +262,7 @@ static int debug_level;     /* Flag to control the debug output.
                                3 = Level 2 + USB/I/O tracing of SlotStatus.
                               */
 static int ccid_usb_thread_is_alive;
+static int hotplug_registered; /* A libusb hotplug callback is active.  */
 
 
 static unsigned int compute_edc (const unsigned char *data, size_t datalen,
@@ -1259,7 +1265,10 @@ ccid_vendor_specific_init (ccid_driver_t handle)
 }
 
 
-#define MAX_DEVICE 4 /* See MAX_READER in apdu.c.  */
+#define MAX_DEVICE 16 /* See MAX_READER in apdu.c.  */
+
+/* The open readers; used to map hotplug events to handles.  */
+static ccid_driver_t open_handles[MAX_DEVICE];
 
 struct ccid_dev_table {
   int n;                        /* Index to ccid_usb_dev_list */
@@ -1517,6 +1526,34 @@ ccid_setup_intr  (ccid_driver_t handle)
 }
 
 
+/* Called by libusb from the USB thread if a device has been
+   removed.  We mark the handle so that the next status check reports
+   the removal without any I/O and kick the main loop.  */
+static int LIBUSB_CALL
+hotplug_cb (libusb_context *ctx, libusb_device *dev,
+            libusb_hotplug_event event, void *user_data)
+{
+  int i;
+
+  (void)ctx;
+  (void)event;
+  (void)user_data;
+
+  for (i=0; i < MAX_DEVICE; i++)
+    if (open_handles[i] && open_handles[i]->idev
+        && libusb_get_device (open_handles[i]->idev) == dev)
+      {
+        DEBUGOUT ("CCID: device removed (hotplug)\n");
+        open_handles[i]->powered_off = 1;
+#if defined(GNUPG_MAJOR_VERSION)
+        scd_kick_the_loop ();
+#endif
+      }
+
+  return 0; /* Keep the callback registered.  */
+}
+
+
 static void *
 ccid_usb_thread (void *arg)
 {
@@ -1577,6 +1614,14 @@ ccid_open_usb_reader (const char *spec_reader_name,
       npth_attr_t tattr;
       int err;
 
+      if (!hotplug_registered
+          && libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG)
+          && !libusb_hotplug_register_callback
+              (NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+               LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+               LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, NULL, NULL))
+        hotplug_registered = 1;
+
       err = npth_attr_init (&tattr);
       if (err)
         {
@@ -1668,10 +1713,19 @@ ccid_open_usb_reader (const char *spec_reader_name,
     }
   else
     {
+      int i;
+
       if (rdrname_p)
         *rdrname_p = rid;
       else
         free (rid);
+
+      for (i=0; i < MAX_DEVICE; i++)
+        if (!open_handles[i])
+          {
+            open_handles[i] = *handle;
+            break;
+          }
     }
 
   return rc;
@@ -1718,11 +1772,13 @@ ccid_require_get_status (ccid_driver_t handle)
      watches multiple devices, there is no way to know which device is
      removed.
 
-     Once, we will have a good programming interface of libusb, we can
-     list tokens (with no interrupt transfer support, but always with
-     card inserted) here to return 0, so that scdaemon can submit
-     minimum packet on wire.
+     With hotplug support libusb tells us about the removal of the
+     device, thus tokens which always have a card inserted (and have
+     no interrupt transfer support) don't need to be polled.
   */
+  if (hotplug_registered && handle->id_vendor == VENDOR_FSIJ)
+    return 0;
+
   return 1;
 }
 
@@ -1754,6 +1810,11 @@ static void
 do_close_reader (ccid_driver_t handle)
 {
   int rc;
+  int i;
+
+  for (i=0; i < MAX_DEVICE; i++)
+    if (open_handles[i] == handle)
+      open_handles[i] = NULL;
 
   if (!handle->powered_off)
     send_power_off (handle);
@@ -1829,6 +1890,17 @@ ccid_close_reader (ccid_driver_t handle)
 }
 
 
+/* Store the transfer statistics of HANDLE at R_STATS.  */
+void
+ccid_get_stats (ccid_driver_t handle, struct ccid_stats_s *r_stats)
+{
+  if (handle)
+    *r_stats = handle->stats;
+  else
+    memset (r_stats, 0, sizeof *r_stats);
+}
+
+
 /* Return False if a card is present and powered. */
 int
 ccid_check_card_presence (ccid_driver_t handle)
@@ -1846,6 +1918,7 @@ bulk_out (ccid_driver_t handle, unsigned char *msg, size_t msglen,
 {
   int rc;
   int transferred;
+  unsigned long long start;
 
   /* No need to continue and clutter the log with USB write error
      messages after we got the first ENODEV.  */
@@ -1904,6 +1977,7 @@ bulk_out (ccid_driver_t handle, unsigned char *msg, size_t msglen,
         }
     }
 
+  start = gnupg_timing_now ();
 #ifdef USE_NPTH
   npth_unprotect ();
 #endif
@@ -1913,6 +1987,10 @@ bulk_out (ccid_driver_t handle, unsigned char *msg, size_t msglen,
 #ifdef USE_NPTH
   npth_protect ();
 #endif
+  handle->stats.usec += gnupg_timing_now () - start;
+  handle->stats.nout++;
+  if (!rc)
+    handle->stats.bytes_out += transferred;
   if (rc == 0 && transferred == msglen)
     return 0;
 
@@ -1946,12 +2024,14 @@ bulk_in (ccid_driver_t handle, unsigned char *buffer, size_t length,
   int msglen;
   int notified = 0;
   int bwi = 1;
+  unsigned long long start;
 
   /* Fixme: The next line for the current Valgrind without support
      for USB IOCTLs. */
   memset (buffer, 0, length);
  retry:
 
+  start = gnupg_timing_now ();
 #ifdef USE_NPTH
   npth_unprotect ();
 #endif
@@ -1960,6 +2040,10 @@ bulk_in (ccid_driver_t handle, unsigned char *buffer, size_t length,
 #ifdef USE_NPTH
   npth_protect ();
 #endif
+  handle->stats.usec += gnupg_timing_now () - start;
+  handle->stats.nin++;
+  if (!rc && msglen > 0)
+    handle->stats.bytes_in += msglen;
   if (rc)
     {
       DEBUGOUT_1 ("usb_bulk_read error: %s\n", libusb_error_name (rc));
@@ -2753,15 +2837,27 @@ ccid_get_atr (ccid_driver_t handle,
   handle->t1_ns = 0;
   handle->t1_nr = 0;
 
-  /* Send an S-Block with our maximum IFSD to the CCID.  */
+  /* Send an S-Block with our maximum IFSD to the CCID.  The IFSD is
+     limited to 254 by ISO 7816-3 and a block with the prologue and
+     a CRC must fit into one CCID message.  The larger the IFSD, the
+     fewer blocks are needed for long responses.  */
   if (!handle->apdu_level && !handle->auto_ifsd)
     {
+      int ifsd = handle->max_ifsd? handle->max_ifsd : 32;
+
+      if (ifsd > 254)
+        ifsd = 254;
+      if (handle->max_ccid_msglen && ifsd > handle->max_ccid_msglen - 10 - 5)
+        ifsd = handle->max_ccid_msglen - 10 - 5;
+      if (ifsd < 1)
+        ifsd = 32;
+
       tpdu = msg+10;
       /* NAD: DAD=1, SAD=0 */
       tpdu[0] = handle->nonnull_nad? ((1 << 4) | 0): 0;
       tpdu[1] = (0xc0 | 0 | 1); /* S-block request: change IFSD */
       tpdu[2] = 1;
-      tpdu[3] = handle->max_ifsd? handle->max_ifsd : 32;
+      tpdu[3] = ifsd;
       tpdulen = 4;
       edc = compute_edc (tpdu, tpdulen, use_crc);
       if (use_crc)
@@ -2867,17 +2963,26 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
   unsigned char seqno;
   int bwi = 0;
   unsigned char chain = 0;
+  size_t max_part_len;
 
-  if (apdu_len == 0 || apdu_len > sizeof (msg) - 10)
+  /* The APDU is sent in chunks of at most the reader's message size,
+     thus we only need to limit it to the largest extended length
+     APDU.  */
+  if (apdu_len == 0 || apdu_len > 4+3+65535+3)
     return CCID_DRIVER_ERR_INV_VALUE; /* Invalid length. */
 
+  max_part_len = handle->max_ccid_msglen;
+  if (max_part_len > sizeof msg)
+    max_part_len = sizeof msg;
+  max_part_len -= 10;
+
   apdu_p = apdu_buf;
   while (1)
     {
       apdu_part_len = apdu_len;
-      if (apdu_part_len > handle->max_ccid_msglen - 10)
+      if (apdu_part_len > max_part_len)
         {
-          apdu_part_len = handle->max_ccid_msglen - 10;
+          apdu_part_len = max_part_len;
           chain |= 0x01;
         }
 
@@ -147,5 +147,16 @@ int ccid_transceive_escape (ccid_driver_t handle,
                             size_t *nresp);
 int ccid_require_get_status (ccid_driver_t handle);
 
+/* Statistics about the USB transfers of a reader.  */
+struct ccid_stats_s
+{
+  unsigned long nout;            /* Number of bulk-out transfers.  */
+  unsigned long nin;             /* Number of bulk-in transfers.  */
+  unsigned long long bytes_out;  /* Bytes sent to the reader.  */
+  unsigned long long bytes_in;   /* Bytes received from the reader.  */
+  unsigned long long usec;       /* Time spent in the transfers.  */
+};
+void ccid_get_stats (ccid_driver_t handle, struct ccid_stats_s *r_stats);
+
 
 #endif /*CCID_DRIVER_H*/
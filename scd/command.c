@@ -1580,6 +1580,8 @@ static const char hlp_getinfo[] =
   "                first field is the name.\n"
   "  card_list   - Return a list of serial numbers of active cards,\n"
   "                using a status response.\n"
+  "  apdu_stats  - Return statistics about the APDUs sent to each reader\n"
+  "                and the time spent in the high level operations.\n"
   "  cmd_has_option CMD OPT\n"
   "                  - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
@@ -1690,6 +1692,15 @@ cmd_getinfo (assuan_context_t ctx, char *line)
 
       rc = app_send_card_list (ctrl);
     }
+  else if (!strcmp (line, "apdu_stats"))
+    {
+      char *s = app_get_stats ();
+      if (s)
+        rc = assuan_send_data (ctx, s, strlen (s));
+      else
+        rc = gpg_error_from_syserror ();
+      xfree (s);
+    }
   else
     rc = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
   return rc;
@@ -1857,6 +1868,8 @@ cmd_apdu (assuan_context_t ctx, char *line)
       unsigned char *result = NULL;
       size_t resultlen;
 
+      /* We don't know what the APDU does to the card.  */
+      app_flush_card_cache (card, ctrl);
       rc = apdu_send_direct (card->slot, exlen,
                              apdu, apdulen, handle_more,
                              NULL, &result, &resultlen);
@@ -1963,6 +1976,7 @@ send_keyinfo (ctrl_t ctrl, int data, const char *keygrip_str,
   if (!string)
     return;
 
+  app_note_keygrip (ctrl, keygrip_str);
   if (!data)
     assuan_write_status (ctx, "KEYINFO", string);
   else
@@ -46,6 +46,10 @@
 #define CMD_READ_BINARY 0xB0
 #define CMD_READ_RECORD 0xB2
 
+/* The Le used for extended length reads when the card does not tell
+   us a limit.  Not 65535 in case it is used as some special flag.  */
+#define EXTLEN_READ_SIZE 65534
+
 static gpg_error_t
 map_sw (int sw)
 {
@@ -405,9 +409,61 @@ iso7816_reset_retry_counter (int slot, int chvno,
 
 
 
+/* Send an APDU which expects a possibly large response of up to
+   WANTED bytes (0 for as much as possible).  Extended length is used
+   if the card in SLOT supports it; if that is not yet known we try
+   it once and fall back to a short APDU.  The outcome is cached by
+   the APDU layer until the card is reset.  Returns the status word;
+   the caller must release RETBUF even on error.  */
+static int
+send_le_auto (int slot, int class, int ins, int p0, int p1,
+              int lc, const char *data, size_t wanted,
+              unsigned char **retbuf, size_t *retbuflen)
+{
+  int sw;
+  int extlen, le;
+
+  *retbuf = NULL;
+  *retbuflen = 0;
+
+  extlen = apdu_get_extended_length (slot);
+  if (extlen != -1)
+    {
+      le = extlen > 0? extlen : EXTLEN_READ_SIZE;
+      if (wanted && wanted < (size_t)le)
+        le = wanted;
+      sw = apdu_send_le (slot, extlen > 0? extlen : EXTLEN_READ_SIZE,
+                         class, ins, p0, p1, lc, data, le,
+                         retbuf, retbuflen);
+      if (sw == SW_SUCCESS || sw == SW_EOF_REACHED)
+        {
+          if (!extlen)
+            apdu_set_extended_length (slot, EXTLEN_READ_SIZE);
+          return sw;
+        }
+      if (extlen)
+        return sw;
+
+      /* The probe failed; try again with a short APDU.  */
+      xfree (*retbuf);
+      *retbuf = NULL;
+      *retbuflen = 0;
+    }
+
+  sw = apdu_send_le (slot, 0, class, ins, p0, p1, lc, data,
+                     (wanted && wanted < 256)? wanted : 256,
+                     retbuf, retbuflen);
+  if (!extlen && (sw == SW_SUCCESS || sw == SW_EOF_REACHED))
+    apdu_set_extended_length (slot, -1);
+  return sw;
+}
+
+
 /* Perform a GET DATA command requesting TAG and storing the result in
    a newly allocated buffer at the address passed by RESULT.  Return
-   the length of this data at the address of RESULTLEN. */
+   the length of this data at the address of RESULTLEN.  If
+   EXTENDED_MODE is ISO7816_EXTLEN_AUTO extended length is used if
+   the card supports it. */
 gpg_error_t
 iso7816_get_data (int slot, int extended_mode, int tag,
                   unsigned char **result, size_t *resultlen)
@@ -427,9 +483,14 @@ iso7816_get_data (int slot, int extended_mode, int tag,
   else
     le = 256;
 
-  sw = apdu_send_le (slot, extended_mode, 0x00, CMD_GET_DATA,
-                     ((tag >> 8) & 0xff), (tag & 0xff), -1, NULL, le,
-                     result, resultlen);
+  if (extended_mode == ISO7816_EXTLEN_AUTO)
+    sw = send_le_auto (slot, 0x00, CMD_GET_DATA,
+                       ((tag >> 8) & 0xff), (tag & 0xff), -1, NULL, 0,
+                       result, resultlen);
+  else
+    sw = apdu_send_le (slot, extended_mode, 0x00, CMD_GET_DATA,
+                       ((tag >> 8) & 0xff), (tag & 0xff), -1, NULL, le,
+                       result, resultlen);
   if (sw != SW_SUCCESS)
     {
       /* Make sure that pending buffers are released. */
@@ -446,7 +507,8 @@ iso7816_get_data (int slot, int extended_mode, int tag,
 /* Perform a GET DATA command requesting TAG and storing the result in
  * a newly allocated buffer at the address passed by RESULT.  Return
  * the length of this data at the address of RESULTLEN.  This variant
- * is needed for long (3 octet) tags. */
+ * is needed for long (3 octet) tags.  See iso7816_get_data for
+ * EXTENDED_MODE. */
 gpg_error_t
 iso7816_get_data_odd (int slot, int extended_mode, unsigned int tag,
                       unsigned char **result, size_t *resultlen)
@@ -491,9 +553,14 @@ iso7816_get_data_odd (int slot, int extended_mode, unsigned int tag,
       datalen = 5;
     }
 
-  sw = apdu_send_le (slot, extended_mode, 0x00, CMD_GET_DATA + 1,
-                     0x3f, 0xff, datalen, data, le,
-                     result, resultlen);
+  if (extended_mode == ISO7816_EXTLEN_AUTO)
+    sw = send_le_auto (slot, 0x00, CMD_GET_DATA + 1,
+                       0x3f, 0xff, datalen, data, 0,
+                       result, resultlen);
+  else
+    sw = apdu_send_le (slot, extended_mode, 0x00, CMD_GET_DATA + 1,
+                       0x3f, 0xff, datalen, data, le,
+                       result, resultlen);
   if (sw != SW_SUCCESS)
     {
       /* Make sure that pending buffers are released. */
@@ -823,7 +890,8 @@ iso7816_get_challenge (int slot, int length, unsigned char *buffer)
 /* Perform a READ BINARY command requesting a maximum of NMAX bytes
    from OFFSET.  With NMAX = 0 the entire file is read. The result is
    stored in a newly allocated buffer at the address passed by RESULT.
-   Returns the length of this data at the address of RESULTLEN. */
+   Returns the length of this data at the address of RESULTLEN.
+   Extended length is used if the card supports it.  */
 gpg_error_t
 iso7816_read_binary (int slot, size_t offset, size_t nmax,
                      unsigned char **result, size_t *resultlen)
@@ -849,7 +917,7 @@ iso7816_read_binary (int slot, size_t offset, size_t nmax,
       buffer = NULL;
       bufferlen = 0;
       n = read_all? 0 : nmax;
-      sw = apdu_send_le (slot, 0, 0x00, CMD_READ_BINARY,
+      sw = send_le_auto (slot, 0x00, CMD_READ_BINARY,
                          ((offset>>8) & 0xff), (offset & 0xff) , -1, NULL,
                          n, &buffer, &bufferlen);
       if ( SW_EXACT_LENGTH_P(sw) )
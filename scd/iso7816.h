@@ -29,6 +29,10 @@
 #define ISO7816_CHANGE_REFERENCE_DATA 0x24
 #define ISO7816_RESET_RETRY_COUNTER   0x2C
 
+/* Special value for the EXTENDED_MODE argument of the GET DATA
+   functions: Use extended length if the card supports it.  */
+#define ISO7816_EXTLEN_AUTO 0x10000
+
 
 /* Information to be passed to pinpad equipped readers.  See
    ccid-driver.c for details. */
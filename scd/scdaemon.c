@@ -99,7 +99,9 @@ enum cmd_and_opt_values
   oDisableApplication,
   oApplicationPriority,
   oEnablePinpadVarlen,
-  oListenBacklog
+  oPersistentCardCache,
+  oListenBacklog,
+  oAutoExpandSecmem
 };
 
 
@@ -158,8 +160,11 @@ static ARGPARSE_OPTS opts[] = {
                 N_("|LIST|Change the application priority to LIST")),
   ARGPARSE_s_n (oEnablePinpadVarlen, "enable-pinpad-varlen",
                 N_("use variable length input for pinpad")),
+  ARGPARSE_s_n (oPersistentCardCache, "persistent-card-cache",
+                N_("keep the objects read from a card on disk")),
   ARGPARSE_s_s (oHomedir,    "homedir",      "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_op_u (oAutoExpandSecmem, "auto-expand-secmem", "@"),
 
   ARGPARSE_end ()
 };
@@ -177,6 +182,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_IPC_VALUE    , "ipc"     },
     { DBG_CARD_IO_VALUE, "cardio"  },
     { DBG_READER_VALUE , "reader"  },
+    { DBG_TRACE_VALUE  , "trace"   },
     { DBG_APP_VALUE    , "app"     },
     { 0, NULL }
   };
@@ -615,6 +621,7 @@ main (int argc, char **argv )
         case oDenyAdmin: opt.allow_admin = 0; break;
 
         case oCardTimeout: opt.card_timeout = pargs.r.ret_ulong; break;
+        case oPersistentCardCache: opt.persistent_card_cache = 1; break;
 
         case oDisableApplication:
           add_to_strlist (&opt.disabled_applications, pargs.r.ret_str);
@@ -630,6 +637,12 @@ main (int argc, char **argv )
           listen_backlog = pargs.r.ret_int;
           break;
 
+        case oAutoExpandSecmem:
+          /* See gpg-agent.c for the use of the numeric value.  */
+          gcry_control (78 /*GCRYCTL_AUTO_EXPAND_SECMEM*/,
+                        (unsigned int)pargs.r.ret_ulong,  0);
+          break;
+
         default:
           pargs.err = configfp? ARGPARSE_PRINT_WARNING:ARGPARSE_PRINT_ERROR;
           break;
@@ -1037,6 +1050,7 @@ handle_signal (int signo)
          logging system.  */
       /* pth_ctrl (PTH_CTRL_DUMPSTATE, log_get_stream ()); */
       app_dump_state ();
+      gcry_control (GCRYCTL_DUMP_SECMEM_STATS);
       break;
 
     case SIGUSR2:
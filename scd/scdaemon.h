@@ -64,6 +64,7 @@ struct
   strlist_t disabled_applications;  /* Card applications we do not
                                        want to use. */
   unsigned long card_timeout; /* Disconnect after N seconds of inactivity.  */
+  int persistent_card_cache;  /* Keep the card objects in files.  */
 } opt;
 
 
@@ -77,6 +78,7 @@ struct
 #define DBG_IPC_VALUE     1024
 #define DBG_CARD_IO_VALUE 2048
 #define DBG_READER_VALUE  4096  /* Trace reader related functions.  */
+#define DBG_TRACE_VALUE   8192  /* Log the timing of each APDU.  */
 
 #define DBG_APP     (opt.debug & DBG_APP_VALUE)
 #define DBG_CRYPTO  (opt.debug & DBG_CRYPTO_VALUE)
@@ -86,6 +88,7 @@ struct
 #define DBG_IPC     (opt.debug & DBG_IPC_VALUE)
 #define DBG_CARD_IO (opt.debug & DBG_CARD_IO_VALUE)
 #define DBG_READER  (opt.debug & DBG_READER_VALUE)
+#define DBG_TRACE   (opt.debug & DBG_TRACE_VALUE)
 
 struct server_local_s;
 struct card_ctx_s;
@@ -113,6 +116,11 @@ struct server_control_s
    * apps.  */
   apptype_t current_apptype;
 
+  /* The card and app for which app_do_with_keygrip is currently
+   * listing the keys.  Used to build the keygrip index.  */
+  struct card_ctx_s *keyinfo_card;
+  apptype_t keyinfo_apptype;
+
   /* Helper to store the value we are going to sign */
   struct
   {
@@ -43,6 +43,10 @@
 
 static assuan_context_t agent_ctx = NULL;
 
+/* Set to 1 if the agent's PKSIGN takes the key, the description and
+ * the hash as options, to -1 if not, and 0 if not yet known.  */
+static int pksign_with_options;
+
 
 struct cipher_parm_s
 {
@@ -280,34 +284,68 @@ gpgsm_agent_pksign (ctrl_t ctrl, const char *keygrip, const char *desc,
   if (digestlen*2 + 50 > DIM(line))
     return gpg_error (GPG_ERR_GENERAL);
 
-  rc = assuan_transact (agent_ctx, "RESET", NULL, NULL, NULL, NULL, NULL, NULL);
-  if (rc)
-    return rc;
+  if (!pksign_with_options)
+    pksign_with_options = assuan_transact (agent_ctx,
+                                   "GETINFO cmd_has_option PKSIGN keygrip",
+                                   NULL, NULL, NULL, NULL, NULL, NULL)? -1:1;
 
-  snprintf (line, DIM(line), "SIGKEY %s", keygrip);
-  rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
-  if (rc)
-    return rc;
-
-  if (desc)
+  if (pksign_with_options > 0)
     {
-      snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+      /* A single request does it unless the description is too long
+       * for the line.  */
+      if (desc && strlen (desc) + digestlen*2 + 150 > DIM(line))
+        {
+          snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+          rc = assuan_transact (agent_ctx, line,
+                                NULL, NULL, NULL, NULL, NULL, NULL);
+          if (rc)
+            return rc;
+          desc = NULL;
+        }
+      snprintf (line, DIM(line), "PKSIGN --keygrip=%s --hash-algo=%d --digest=",
+                keygrip, digestalgo);
+      p = line + strlen (line);
+      for (i=0; i < digestlen ; i++, p += 2 )
+        sprintf (p, "%02X", digest[i]);
+      if (desc)
+        snprintf (p, DIM(line) - (p - line), " --desc=%s", desc);
+    }
+  else
+    {
+      rc = assuan_transact (agent_ctx, "RESET",
+                            NULL, NULL, NULL, NULL, NULL, NULL);
+      if (rc)
+        return rc;
+
+      snprintf (line, DIM(line), "SIGKEY %s", keygrip);
       rc = assuan_transact (agent_ctx, line,
                             NULL, NULL, NULL, NULL, NULL, NULL);
       if (rc)
         return rc;
-    }
 
-  sprintf (line, "SETHASH %d ", digestalgo);
-  p = line + strlen (line);
-  for (i=0; i < digestlen ; i++, p += 2 )
-    sprintf (p, "%02X", digest[i]);
-  rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
-  if (rc)
-    return rc;
+      if (desc)
+        {
+          snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+          rc = assuan_transact (agent_ctx, line,
+                                NULL, NULL, NULL, NULL, NULL, NULL);
+          if (rc)
+            return rc;
+        }
+
+      sprintf (line, "SETHASH %d ", digestalgo);
+      p = line + strlen (line);
+      for (i=0; i < digestlen ; i++, p += 2 )
+        sprintf (p, "%02X", digest[i]);
+      rc = assuan_transact (agent_ctx, line,
+                            NULL, NULL, NULL, NULL, NULL, NULL);
+      if (rc)
+        return rc;
+
+      strcpy (line, "PKSIGN");
+    }
 
   init_membuf (&data, 1024);
-  rc = assuan_transact (agent_ctx, "PKSIGN",
+  rc = assuan_transact (agent_ctx, line,
                         put_membuf_cb, &data, default_inq_cb, &inq_parm,
                         NULL, NULL);
   if (rc)
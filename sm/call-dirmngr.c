@@ -52,6 +52,10 @@ static assuan_context_t dirmngr_ctx = NULL;
 static assuan_context_t dirmngr2_ctx = NULL;
 
 static int dirmngr_ctx_locked;
+
+/* Counters for GETINFO stats.  */
+static unsigned long dirmngr_uses;
+static unsigned long dirmngr_connects;
 static int dirmngr2_ctx_locked;
 
 struct inq_certificate_parm_s {
@@ -67,6 +71,23 @@ struct isvalid_status_parm_s {
   unsigned char fpr[20];
 };
 
+struct isvalid_chain_item_s {
+  gpg_error_t err;
+  int seen;
+  unsigned char fpr[20];
+};
+
+struct isvalid_chain_parm_s {
+  struct inq_certificate_parm_s inq; /* For other inquiries.  */
+  const void *pem;                   /* The chain as PEM.  */
+  size_t pemlen;
+  int ncheck;
+  int nresults;
+  struct isvalid_chain_item_s *items;
+  int seen;                /* ONLY_VALID_IF_CERT_VALID for the next */
+  unsigned char fpr[20];   /* item.  */
+};
+
 
 struct lookup_parm_s {
   ctrl_t ctrl;
@@ -273,6 +294,7 @@ start_dirmngr_ext (ctrl_t ctrl, assuan_context_t *ctx_r)
   if (err)
     return err;
 
+  dirmngr_connects++;
   *ctx_r = ctx;
   return 0;
 }
@@ -286,6 +308,7 @@ start_dirmngr (ctrl_t ctrl)
   assert (! dirmngr_ctx_locked);
   dirmngr_ctx_locked = 1;
 
+  dirmngr_uses++;
   err = start_dirmngr_ext (ctrl, &dirmngr_ctx);
   /* We do not check ERR but the existence of a context because the
      error might come from a failed command send to the dirmngr.
@@ -308,6 +331,16 @@ release_dirmngr (ctrl_t ctrl)
 }
 
 
+/* Store the number of times the Dirmngr has been used at R_USES and
+   the number of connections made for this at R_CONNECTS.  */
+void
+gpgsm_dirmngr_get_stats (unsigned long *r_uses, unsigned long *r_connects)
+{
+  *r_uses = dirmngr_uses;
+  *r_connects = dirmngr_connects;
+}
+
+
 static int
 start_dirmngr2 (ctrl_t ctrl)
 {
@@ -316,6 +349,7 @@ start_dirmngr2 (ctrl_t ctrl)
   assert (! dirmngr2_ctx_locked);
   dirmngr2_ctx_locked = 1;
 
+  dirmngr_uses++;
   err = start_dirmngr_ext (ctrl, &dirmngr2_ctx);
   if (!dirmngr2_ctx)
     dirmngr2_ctx_locked = 0;
@@ -483,6 +517,79 @@ isvalid_status_cb (void *opaque, const char *line)
 
 
 
+/* Check the certificate with the fingerprint FPR which dirmngr used
+   for a CRL or an OCSP response.  Returns 0 if that certificate is
+   valid or GPG_ERR_INV_CRL.  */
+static gpg_error_t
+check_responder_cert (ctrl_t ctrl, const unsigned char *fpr)
+{
+  gpg_error_t rc = 0;
+  ksba_cert_t rspcert = NULL;
+
+  if (get_cached_cert (dirmngr_ctx, fpr, &rspcert))
+    {
+      /* Ooops: Something went wrong getting the certificate from
+         the dirmngr.  Try our own cert store now.  */
+      KEYDB_HANDLE kh;
+
+      kh = keydb_new ();
+      if (!kh)
+        rc = gpg_error (GPG_ERR_ENOMEM);
+      if (!rc)
+        rc = keydb_search_fpr (ctrl, kh, fpr);
+      if (!rc)
+        rc = keydb_get_cert (kh, &rspcert);
+      if (rc)
+        {
+          log_error ("unable to find the certificate used "
+                     "by the dirmngr: %s\n", gpg_strerror (rc));
+          rc = gpg_error (GPG_ERR_INV_CRL);
+        }
+      keydb_release (kh);
+    }
+
+  if (!rc)
+    {
+      rc = gpgsm_cert_use_ocsp_p (rspcert);
+      if (rc)
+        rc = gpg_error (GPG_ERR_INV_CRL);
+      else
+        {
+          /* Note the no_dirmngr flag: This avoids checking this
+             certificate over and over again. */
+          rc = gpgsm_validate_chain (ctrl, rspcert, "", NULL, 0, NULL,
+                                     VALIDATE_FLAG_NO_DIRMNGR, NULL);
+          if (rc)
+            {
+              log_error ("invalid certificate used for CRL/OCSP: %s\n",
+                         gpg_strerror (rc));
+              rc = gpg_error (GPG_ERR_INV_CRL);
+            }
+        }
+    }
+  ksba_cert_release (rspcert);
+  return rc;
+}
+
+
+/* Send the options for the ISVALID commands to the dirmngr.  It is
+ * sufficient to send them only once because we have one connection
+ * per process only.  */
+static void
+send_isvalid_options (void)
+{
+  static int did_options;
+
+  if (!did_options)
+    {
+      if (opt.force_crl_refresh)
+        assuan_transact (dirmngr_ctx, "OPTION force-crl-refresh=1",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+      did_options = 1;
+    }
+}
+
+
 /* Call the directory manager to check whether the certificate is valid
    Returns 0 for valid or usually one of the errors:
 
@@ -499,7 +606,6 @@ int
 gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                        ksba_cert_t cert, ksba_cert_t issuer_cert, int use_ocsp)
 {
-  static int did_options;
   int rc;
   char *certid, *certfpr;
   char line[ASSUAN_LINELENGTH];
@@ -536,15 +642,7 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
   stparm.seen = 0;
   memset (stparm.fpr, 0, 20);
 
-  /* It is sufficient to send the options only once because we have
-   * one connection per process only.  */
-  if (!did_options)
-    {
-      if (opt.force_crl_refresh)
-        assuan_transact (dirmngr_ctx, "OPTION force-crl-refresh=1",
-                         NULL, NULL, NULL, NULL, NULL, NULL);
-      did_options = 1;
-    }
+  send_isvalid_options ();
   snprintf (line, DIM(line), "ISVALID%s%s %s%s%s",
             use_ocsp == 2 || opt.no_crl_check ? " --only-ocsp":"",
             use_ocsp == 2? " --force-default-responder":"",
@@ -569,55 +667,194 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
           rc = gpg_error (GPG_ERR_INV_CRL);
         }
       else
+        rc = check_responder_cert (ctrl, stparm.fpr);
+    }
+  release_dirmngr (ctrl);
+  return rc;
+}
+
+
+/* Inquiry callback for gpgsm_dirmngr_isvalid_chain.  */
+static gpg_error_t
+inq_certlist (void *opaque, const char *line)
+{
+  struct isvalid_chain_parm_s *parm = opaque;
+
+  if (!has_leading_keyword (line, "CERTLIST"))
+    return inq_certificate (&parm->inq, line);
+
+  return assuan_send_data (parm->inq.ctx, parm->pem, parm->pemlen);
+}
+
+
+/* Status callback for gpgsm_dirmngr_isvalid_chain.  */
+static gpg_error_t
+isvalid_chain_status_cb (void *opaque, const char *line)
+{
+  struct isvalid_chain_parm_s *parm = opaque;
+  struct isvalid_chain_item_s *item;
+  const char *s;
+
+  if ((s = has_leading_keyword (line, "PROGRESS")))
+    {
+      if (parm->inq.ctrl)
         {
-          ksba_cert_t rspcert = NULL;
+          line = s;
+          if (gpgsm_status (parm->inq.ctrl, STATUS_PROGRESS, line))
+            return gpg_error (GPG_ERR_ASS_CANCELED);
+        }
+    }
+  else if ((s = has_leading_keyword (line, "ONLY_VALID_IF_CERT_VALID")))
+    {
+      parm->seen++;
+      if (!*s || !unhexify_fpr (s, parm->fpr))
+        parm->seen++; /* Bump it to indicate an error. */
+    }
+  else if ((s = has_leading_keyword (line, "ISVALID")))
+    {
+      /* The results are returned in order.  */
+      if (atoi (s) != parm->nresults || parm->nresults >= parm->ncheck)
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      while (*s && !spacep (s))
+        s++;
+      while (spacep (s))
+        s++;
+      if (!digitp (s))
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      item = parm->items + parm->nresults++;
+      item->err = strtoul (s, NULL, 10);
+      item->seen = parm->seen;
+      memcpy (item->fpr, parm->fpr, 20);
+      parm->seen = 0;
+    }
+  return 0;
+}
 
-          if (get_cached_cert (dirmngr_ctx, stparm.fpr, &rspcert))
-            {
-              /* Ooops: Something went wrong getting the certificate
-                 from the dirmngr.  Try our own cert store now.  */
-              KEYDB_HANDLE kh;
-
-              kh = keydb_new ();
-              if (!kh)
-                rc = gpg_error (GPG_ERR_ENOMEM);
-              if (!rc)
-                rc = keydb_search_fpr (ctrl, kh, stparm.fpr);
-              if (!rc)
-                rc = keydb_get_cert (kh, &rspcert);
-              if (rc)
-                {
-                  log_error ("unable to find the certificate used "
-                             "by the dirmngr: %s\n", gpg_strerror (rc));
-                  rc = gpg_error (GPG_ERR_INV_CRL);
-                }
-              keydb_release (kh);
-            }
 
-          if (!rc)
-            {
-              rc = gpgsm_cert_use_ocsp_p (rspcert);
-              if (rc)
-                rc = gpg_error (GPG_ERR_INV_CRL);
-              else
-                {
-                  /* Note the no_dirmngr flag: This avoids checking
-                     this certificate over and over again. */
-                  rc = gpgsm_validate_chain (ctrl, rspcert, "", NULL, 0, NULL,
-                                             VALIDATE_FLAG_NO_DIRMNGR, NULL);
-                  if (rc)
-                    {
-                      log_error ("invalid certificate used for CRL/OCSP: %s\n",
-                                 gpg_strerror (rc));
-                      rc = gpg_error (GPG_ERR_INV_CRL);
-                    }
-                }
-            }
-          ksba_cert_release (rspcert);
+/* Call the directory manager to check the certificates CHAIN[0] to
+   CHAIN[NCHECK-1] in one round trip.  CHAIN has NCHAIN items with
+   CHAIN[i+1] being the issuer of CHAIN[i]; NCHECK may only be equal
+   to NCHAIN if the last certificate is self-signed.  USE_OCSP is as
+   for gpgsm_dirmngr_isvalid.  On success the result of the check for
+   CHAIN[i] is stored at R_ERRS[i].  If the dirmngr does not support
+   this command GPG_ERR_NOT_SUPPORTED is returned and the caller needs
+   to use gpgsm_dirmngr_isvalid for each certificate.  */
+gpg_error_t
+gpgsm_dirmngr_isvalid_chain (ctrl_t ctrl, ksba_cert_t *chain, int nchain,
+                             int ncheck, int use_ocsp, gpg_error_t *r_errs)
+{
+  static int not_supported;
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  struct isvalid_chain_parm_s parm;
+  struct b64state b64state;
+  estream_t fp;
+  void *pem = NULL;
+  size_t pemlen;
+  const unsigned char *der;
+  size_t derlen;
+  int i;
+
+  if (not_supported)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (ncheck < 1 || ncheck > nchain)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  for (i=0; i < nchain; i++)
+    {
+      der = ksba_cert_get_image (chain[i], &derlen);
+      if (!der)
+        {
+          es_fclose (fp);
+          return gpg_error (GPG_ERR_INV_CERT_OBJ);
+        }
+      err = b64enc_start_es (&b64state, fp, "CERTIFICATE");
+      if (!err)
+        err = b64enc_write (&b64state, der, derlen);
+      if (!err)
+        err = b64enc_finish (&b64state);
+      if (err)
+        {
+          es_fclose (fp);
+          return err;
+        }
+    }
+  if (es_fclose_snatch (fp, &pem, &pemlen))
+    return gpg_error_from_syserror ();
+
+  err = start_dirmngr (ctrl);
+  if (err)
+    {
+      es_free (pem);
+      return err;
+    }
+
+  if (opt.verbose > 1)
+    log_info ("asking dirmngr about a chain of %d certificates%s\n",
+              ncheck, use_ocsp? " (using OCSP)":"");
+
+  memset (&parm, 0, sizeof parm);
+  parm.inq.ctx = dirmngr_ctx;
+  parm.inq.ctrl = ctrl;
+  parm.pem = pem;
+  parm.pemlen = pemlen;
+  parm.ncheck = ncheck;
+  parm.items = xtrycalloc (ncheck, sizeof *parm.items);
+  if (!parm.items)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  send_isvalid_options ();
+  snprintf (line, DIM(line), "ISVALIDCHAIN%s%s%s %d",
+            use_ocsp? " --ocsp":"",
+            use_ocsp == 2 || opt.no_crl_check ? " --only-ocsp":"",
+            use_ocsp == 2? " --force-default-responder":"",
+            ncheck);
+
+  err = assuan_transact (dirmngr_ctx, line, NULL, NULL,
+                         inq_certlist, &parm,
+                         isvalid_chain_status_cb, &parm);
+  if (opt.verbose > 1)
+    log_info ("response of dirmngr: %s\n", err? gpg_strerror (err): "okay");
+  if (gpg_err_code (err) == GPG_ERR_ASS_UNKNOWN_CMD)
+    {
+      /* An old dirmngr; don't try again.  */
+      not_supported = 1;
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+  if (!err && parm.nresults != ncheck)
+    {
+      log_error ("communication problem with dirmngr detected\n");
+      err = gpg_error (GPG_ERR_INV_RESPONSE);
+    }
+  if (err)
+    goto leave;
+
+  for (i=0; i < ncheck; i++)
+    {
+      r_errs[i] = parm.items[i].err;
+      if (r_errs[i] || !parm.items[i].seen)
+        ;
+      else if (parm.items[i].seen != 1)
+        {
+          log_error ("communication problem with dirmngr detected\n");
+          r_errs[i] = gpg_error (GPG_ERR_INV_CRL);
         }
+      else /* Need to also check the certificate validity. */
+        r_errs[i] = check_responder_cert (ctrl, parm.items[i].fpr);
     }
+
+ leave:
+  xfree (parm.items);
+  es_free (pem);
   release_dirmngr (ctrl);
-  return rc;
+  return err;
 }
 
 
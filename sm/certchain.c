@@ -54,10 +54,71 @@ struct chain_item_s
   struct chain_item_s *next;
   ksba_cert_t cert;      /* The certificate.  */
   int is_root;           /* The certificate is the root certificate.  */
+  int check_isvalid;     /* Ask the dirmngr about this certificate.  */
+  int chainlen;          /* The path length constraint of this CA or -1.  */
 };
 typedef struct chain_item_s *chain_item_t;
 
 
+/* The number of hash buckets of a chain memo.  */
+#define CHAIN_MEMO_BUCKETS 256
+
+/* A CA certificate whose chain up to the root has been validated
+ * during a listing.  */
+struct chain_memo_item_s
+{
+  struct chain_memo_item_s *next;
+  unsigned char fpr[20];    /* SHA-1 fingerprint of the certificate.  */
+  unsigned int flags;       /* The VALIDATE_FLAG_* bits used.  */
+  int chainlen;             /* The path length constraint or -1.  */
+  int maxdepth;             /* The largest depth at which this
+                             * certificate may show up in a chain.  */
+  ksba_isotime_t exptime;   /* Expiration time of the partial chain.  */
+  int is_qualified;         /* -1 = unknown, 0 = no, 1 = yes.  */
+  struct rootca_flags_s rootca_flags;
+};
+
+/* The memo for gpgsm_begin_chain_memo.  A listing with validation
+ * checks the same intermediate and root certificates for every leaf;
+ * with the memo the traversal stops at the first already validated
+ * CA certificate.  */
+struct chain_memo_s
+{
+  struct chain_memo_item_s *buckets[CHAIN_MEMO_BUCKETS];
+};
+
+
+/* The number of entries in the cache of validated chains.  */
+#define CHAIN_CACHE_SIZE 64
+
+/* The number of seconds a cached validation result is used.  */
+#define CHAIN_CACHE_TTL  600
+
+/* An entry in the cache of successfully validated chains.  The cache
+ * is useful when verifying many signatures of the same signer; in
+ * particular with a long running --server process.  */
+struct chain_cache_s
+{
+  time_t expires;           /* 0 for an unused entry.  */
+  unsigned char fpr[20];    /* SHA-1 fingerprint of the target cert.  */
+  unsigned int flags;       /* The requested VALIDATE_FLAG_* bits.  */
+  unsigned int mode;        /* The CHAIN_CACHE_MODE_* bits.  */
+  ksba_isotime_t checktime; /* The checktime for the chain model.  */
+  ksba_isotime_t exptime;   /* The returned expiration time.  */
+  unsigned int retflags;    /* The returned flags.  */
+  int is_qualified;         /* -1 = unknown, 0 = no, 1 = yes.  */
+};
+static struct chain_cache_s chain_cache[CHAIN_CACHE_SIZE];
+
+/* The index of the entry to be replaced next.  */
+static unsigned int chain_cache_next;
+
+/* Bits describing the settings affecting the CRL checks.  */
+#define CHAIN_CACHE_MODE_OCSP      1
+#define CHAIN_CACHE_MODE_OFFLINE   2
+#define CHAIN_CACHE_MODE_NO_CRL    4
+
+
 static int is_root_cert (ksba_cert_t cert,
                          const char *issuerdn, const char *subjectdn);
 static int get_regtp_ca_info (ctrl_t ctrl, ksba_cert_t cert, int *chainlen);
@@ -970,26 +1031,13 @@ gpgsm_is_root_cert (ksba_cert_t cert)
 }
 
 
-/* This is a helper for gpgsm_validate_chain. */
+/* Helper for is_cert_still_valid and check_chain_isvalid to act upon
+   the result ERR of the dirmngr's check of SUBJECT_CERT.  */
 static gpg_error_t
-is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
-                     ksba_cert_t subject_cert, ksba_cert_t issuer_cert,
-                     int *any_revoked, int *any_no_crl, int *any_crl_too_old)
+isvalid_result (gpg_error_t err, int lm, estream_t fp,
+                ctrl_t ctrl, ksba_cert_t subject_cert,
+                int *any_revoked, int *any_no_crl, int *any_crl_too_old)
 {
-  gpg_error_t err;
-
-  if (ctrl->offline || (opt.no_crl_check && !ctrl->use_ocsp))
-    {
-      audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK,
-                    gpg_error (GPG_ERR_NOT_ENABLED));
-      return 0;
-    }
-
-  err = gpgsm_dirmngr_isvalid (ctrl,
-                               subject_cert, issuer_cert,
-                               force_ocsp? 2 : !!ctrl->use_ocsp);
-  audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, err);
-
   if (err)
     {
       if (!lm)
@@ -1034,6 +1082,114 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
 }
 
 
+/* This is a helper for gpgsm_validate_chain. */
+static gpg_error_t
+is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
+                     ksba_cert_t subject_cert, ksba_cert_t issuer_cert,
+                     int *any_revoked, int *any_no_crl, int *any_crl_too_old)
+{
+  gpg_error_t err;
+
+  if (ctrl->offline || (opt.no_crl_check && !ctrl->use_ocsp))
+    {
+      audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK,
+                    gpg_error (GPG_ERR_NOT_ENABLED));
+      return 0;
+    }
+
+  err = gpgsm_dirmngr_isvalid (ctrl,
+                               subject_cert, issuer_cert,
+                               force_ocsp? 2 : !!ctrl->use_ocsp);
+  audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, err);
+  return isvalid_result (err, lm, fp, ctrl, subject_cert,
+                         any_revoked, any_no_crl, any_crl_too_old);
+}
+
+
+/* Helper for do_validate_chain to ask the dirmngr about all
+   certificates of CHAIN which are marked with CHECK_ISVALID.  Note
+   that CHAIN is in reverse order; i.e. its last item is the target
+   certificate.  As long as the marked certificates form an unbroken
+   sequence starting at the target certificate they are sent to the
+   dirmngr with just one request.  */
+static gpg_error_t
+check_chain_isvalid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
+                     chain_item_t chain,
+                     int *any_revoked, int *any_no_crl, int *any_crl_too_old)
+{
+  gpg_error_t err = 0;
+  gpg_error_t rc;
+  chain_item_t ci;
+  chain_item_t *items = NULL;
+  ksba_cert_t *certs = NULL;
+  gpg_error_t *errs = NULL;
+  int ncerts, ncheck, i;
+
+  for (ncerts=0, ci=chain; ci; ci = ci->next)
+    ncerts++;
+  if (!ncerts)
+    return 0;
+
+  items = xtrycalloc (ncerts, sizeof *items);
+  certs = xtrycalloc (ncerts, sizeof *certs);
+  errs = xtrycalloc (ncerts, sizeof *errs);
+  if (!items || !certs || !errs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=ncerts, ci=chain; ci; ci = ci->next)
+    {
+      items[--i] = ci;
+      certs[i] = ci->cert;
+    }
+
+  for (ncheck=0; ncheck < ncerts && items[ncheck]->check_isvalid; ncheck++)
+    ;
+  if (ctrl->offline || (opt.no_crl_check && !ctrl->use_ocsp))
+    ncheck = 0;  /* is_cert_still_valid takes care of this.  */
+
+  if (ncheck)
+    {
+      err = gpgsm_dirmngr_isvalid_chain (ctrl, certs, ncerts, ncheck,
+                                         force_ocsp? 2 : !!ctrl->use_ocsp,
+                                         errs);
+      if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+        ncheck = 0;  /* Old dirmngr - check them one by one.  */
+      else
+        {
+          for (i=0; i < ncheck; i++)
+            {
+              /* If the request failed as a whole, report that error
+               * for each certificate like a single ISVALID would.  */
+              rc = err? err : errs[i];
+              audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, rc);
+              rc = isvalid_result (rc, lm, fp, ctrl, certs[i],
+                                   any_revoked, any_no_crl, any_crl_too_old);
+              if (rc)
+                {
+                  err = rc;
+                  goto leave;
+                }
+            }
+        }
+      err = 0;
+    }
+
+  for (i=ncheck; i < ncerts && !err; i++)
+    if (items[i]->check_isvalid)
+      err = is_cert_still_valid (ctrl, force_ocsp, lm, fp, certs[i],
+                                 i+1 < ncerts? certs[i+1] : certs[i],
+                                 any_revoked, any_no_crl, any_crl_too_old);
+
+ leave:
+  xfree (errs);
+  xfree (certs);
+  xfree (items);
+  return err;
+}
+
+
 /* Helper for gpgsm_validate_chain to check the validity period of
    SUBJECT_CERT.  The caller needs to pass EXPTIME which will be
    updated to the nearest expiration time seen.  A DEPTH of 0 indicates
@@ -1203,6 +1359,112 @@ check_validity_period_cm (ksba_isotime_t current_time,
 
 
 
+/* Return the memo item for the certificate with the fingerprint FPR
+ * validated using FLAGS or NULL if there is none.  */
+static struct chain_memo_item_s *
+chain_memo_lookup (struct chain_memo_s *memo, const unsigned char *fpr,
+                   unsigned int flags)
+{
+  struct chain_memo_item_s *mi;
+
+  for (mi = memo->buckets[fpr[0]]; mi; mi = mi->next)
+    if (mi->flags == flags && !memcmp (mi->fpr, fpr, 20))
+      return mi;
+  return NULL;
+}
+
+
+/* Put the CA certificates of the successfully validated CHAIN into
+ * the memo of CTRL.  BASE is the memo item where the traversal
+ * stopped or NULL if it reached the root.  The target certificate
+ * itself is not stored because its path length constraint has not
+ * been looked at.  */
+static void
+chain_memo_put (ctrl_t ctrl, chain_item_t chain,
+                struct chain_memo_item_s *base, int maxdepth,
+                unsigned int flags, int is_qualified,
+                const struct rootca_flags_s *rootca_flags)
+{
+  struct chain_memo_item_s *parent = base;
+  struct chain_memo_item_s *mi;
+  unsigned char fpr[20];
+  ksba_isotime_t not_after;
+  chain_item_t ci;
+
+  /* The list starts with the top certificate.  */
+  for (ci = chain; ci && ci->next; ci = ci->next)
+    {
+      if (!gpgsm_get_fingerprint (ci->cert, GCRY_MD_SHA1, fpr, NULL))
+        return;
+      mi = chain_memo_lookup (ctrl->chain_memo, fpr, flags);
+      if (mi)
+        {
+          parent = mi;
+          continue;
+        }
+      if (ksba_cert_get_validity (ci->cert, 1, not_after))
+        return;
+
+      mi = xtrycalloc (1, sizeof *mi);
+      if (!mi)
+        return;  /* The memo is only an optimization.  */
+      memcpy (mi->fpr, fpr, 20);
+      mi->flags = flags;
+      mi->chainlen = ci->chainlen;
+      if (!parent)
+        mi->maxdepth = maxdepth;
+      else
+        {
+          mi->maxdepth = parent->maxdepth - 1;
+          if (parent->chainlen >= 0 && parent->chainlen < mi->maxdepth)
+            mi->maxdepth = parent->chainlen;
+        }
+      gnupg_copy_time (mi->exptime, not_after);
+      if (parent && *parent->exptime
+          && (!*mi->exptime || strcmp (parent->exptime, mi->exptime) < 0))
+        gnupg_copy_time (mi->exptime, parent->exptime);
+      mi->is_qualified = is_qualified;
+      mi->rootca_flags = *rootca_flags;
+      mi->next = ctrl->chain_memo->buckets[fpr[0]];
+      ctrl->chain_memo->buckets[fpr[0]] = mi;
+      parent = mi;
+    }
+}
+
+
+/* Start memorizing validated CA certificates for CTRL.  This is used
+ * while listing many certificates with validation.  */
+gpg_error_t
+gpgsm_begin_chain_memo (ctrl_t ctrl)
+{
+  gpgsm_end_chain_memo (ctrl);
+  ctrl->chain_memo = xtrycalloc (1, sizeof *ctrl->chain_memo);
+  if (!ctrl->chain_memo)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Release the memo started by gpgsm_begin_chain_memo.  */
+void
+gpgsm_end_chain_memo (ctrl_t ctrl)
+{
+  struct chain_memo_item_s *mi, *mi_next;
+  int i;
+
+  if (!ctrl->chain_memo)
+    return;
+  for (i = 0; i < CHAIN_MEMO_BUCKETS; i++)
+    for (mi = ctrl->chain_memo->buckets[i]; mi; mi = mi_next)
+      {
+        mi_next = mi->next;
+        xfree (mi);
+      }
+  xfree (ctrl->chain_memo);
+  ctrl->chain_memo = NULL;
+}
+
+
 /* Ask the user whether he wants to mark the certificate CERT trusted.
    Returns true if the CERT is the trusted.  We also check whether the
    agent is at all enabled to allow marktrusted and don't call it in
@@ -1293,6 +1555,9 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
                             from a qualified root certificate.
                             -1 = unknown, 0 = no, 1 = yes. */
   chain_item_t chain = NULL; /* A list of all certificates in the chain.  */
+  int issuer_chainlen = -1;
+  struct chain_memo_item_s *memo_base = NULL;
+  int use_memo = 0;
 
 
   gnupg_get_isotime (current_time);
@@ -1333,6 +1598,10 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
   if (DBG_X509 && !listmode)
     gpgsm_dump_cert ("target", cert);
 
+  /* The memo is not used with the chain model because the check time
+     changes along the chain.  */
+  use_memo = (ctrl->chain_memo && !(flags & VALIDATE_FLAG_CHAIN_MODEL));
+
   subject_cert = cert;
   ksba_cert_ref (subject_cert);
   maxdepth = 50;
@@ -1355,6 +1624,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
           }
         ksba_cert_ref (subject_cert);
         ci->cert = subject_cert;
+        ci->chainlen = issuer_chainlen;
         ci->next = chain;
         chain = ci;
       }
@@ -1544,14 +1814,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
           else if (opt.no_trusted_cert_crl_check || rootca_flags->relax)
             ;
           else
-            rc = is_cert_still_valid (ctrl,
-                                      (flags & VALIDATE_FLAG_CHAIN_MODEL),
-                                      listmode, listfp,
-                                      subject_cert, subject_cert,
-                                      &any_revoked, &any_no_crl,
-                                      &any_crl_too_old);
-          if (rc)
-            goto leave;
+            chain->check_isvalid = 1;
 
           break;  /* Okay: a self-signed certificate is an end-point. */
         } /* End is_root.  */
@@ -1701,6 +1964,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
             rc = gpg_error (GPG_ERR_BAD_CERT_CHAIN);
             goto leave;
           }
+        issuer_chainlen = chainlen;
       }
 
       /* Is the certificate allowed to sign other certificates. */
@@ -1728,13 +1992,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
                            || (!istrusted_rc && rootca_flags->relax)))
         rc = 0;
       else
-        rc = is_cert_still_valid (ctrl,
-                                  (flags & VALIDATE_FLAG_CHAIN_MODEL),
-                                  listmode, listfp,
-                                  subject_cert, issuer_cert,
-                                  &any_revoked, &any_no_crl, &any_crl_too_old);
-      if (rc)
-        goto leave;
+        chain->check_isvalid = 1;  /* Done after the traversal.  */
 
 
       if (opt.verbose && !listmode)
@@ -1755,6 +2013,30 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
             }
         }
 
+      /* If the chain above the issuer has already been validated
+         during this listing we are done.  */
+      if (use_memo)
+        {
+          unsigned char fpr[20];
+          struct chain_memo_item_s *mi;
+
+          if (gpgsm_get_fingerprint (issuer_cert, GCRY_MD_SHA1, fpr, NULL)
+              && (mi = chain_memo_lookup (ctrl->chain_memo, fpr, flags))
+              && depth + 1 <= mi->maxdepth)
+            {
+              if (DBG_X509)
+                log_debug ("issuer certificate already validated\n");
+              if (*mi->exptime
+                  && (!*exptime || strcmp (mi->exptime, exptime) < 0))
+                gnupg_copy_time (exptime, mi->exptime);
+              if (mi->is_qualified != -1)
+                is_qualified = mi->is_qualified;
+              *rootca_flags = mi->rootca_flags;
+              memo_base = mi;
+              break;
+            }
+        }
+
       /* For the next round the current issuer becomes the new subject.  */
       keydb_search_reset (kh);
       ksba_cert_release (subject_cert);
@@ -1763,6 +2045,15 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
       depth++;
     } /* End chain traversal. */
 
+  /* Now check for revocations of all certificates we marked above.
+     Doing this for the entire chain at once saves round trips to the
+     dirmngr.  */
+  rc = check_chain_isvalid (ctrl, (flags & VALIDATE_FLAG_CHAIN_MODEL),
+                            listmode, listfp, chain,
+                            &any_revoked, &any_no_crl, &any_crl_too_old);
+  if (rc)
+    goto leave;
+
   if (!listmode && !opt.quiet)
     {
       if (opt.no_policy_check)
@@ -1788,12 +2079,17 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
         rc = gpg_error (GPG_ERR_NO_POLICY_MATCH);
     }
 
+  if (!rc && use_memo)
+    chain_memo_put (ctrl, chain, memo_base, maxdepth, flags, is_qualified,
+                    rootca_flags);
+
  leave:
   /* If we have traversed a complete chain up to the root we will
      reset the ephemeral flag for all these certificates.  This is done
      regardless of any error because those errors may only be
-     transient. */
-  if (chain && chain->is_root)
+     transient.  A chain ending at a memorized certificate has been
+     completed by an earlier traversal. */
+  if (chain && (chain->is_root || memo_base))
     {
       gpg_error_t err;
       chain_item_t ci;
@@ -1873,6 +2169,87 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
 }
 
 
+/* Return the CHAIN_CACHE_MODE_* bits for the current settings.  */
+static unsigned int
+chain_cache_mode (ctrl_t ctrl)
+{
+  return ((ctrl->use_ocsp? CHAIN_CACHE_MODE_OCSP : 0)
+          | (ctrl->offline? CHAIN_CACHE_MODE_OFFLINE : 0)
+          | (opt.no_crl_check? CHAIN_CACHE_MODE_NO_CRL : 0));
+}
+
+
+/* Return the cache entry for a successful validation of the target
+ * certificate with the fingerprint FPR or NULL if there is none.  */
+static struct chain_cache_s *
+chain_cache_lookup (ctrl_t ctrl, const unsigned char *fpr,
+                    const char *checktime, unsigned int flags)
+{
+  unsigned int mode = chain_cache_mode (ctrl);
+  time_t now = gnupg_get_time ();
+  int i;
+
+  for (i = 0; i < CHAIN_CACHE_SIZE; i++)
+    {
+      struct chain_cache_s *ce = chain_cache + i;
+
+      if (!ce->expires || ce->expires <= now)
+        continue;
+      if (ce->flags == flags && ce->mode == mode
+          && !memcmp (ce->fpr, fpr, 20)
+          && (!(flags & VALIDATE_FLAG_CHAIN_MODEL)
+              || !strcmp (ce->checktime, checktime)))
+        return ce;
+    }
+  return NULL;
+}
+
+
+/* Store a successful validation of CERT with the fingerprint FPR.
+ * EXPTIME is the expiration time of the chain.  The entry expires
+ * after CHAIN_CACHE_TTL seconds but not later than the chain.  */
+static void
+chain_cache_put (ctrl_t ctrl, ksba_cert_t cert, const unsigned char *fpr,
+                 const char *checktime, unsigned int flags,
+                 const ksba_isotime_t exptime, unsigned int retflags)
+{
+  struct chain_cache_s *ce;
+  time_t now = gnupg_get_time ();
+  time_t expires;
+  char buf[1];
+  size_t buflen;
+
+  expires = now + CHAIN_CACHE_TTL;
+  if (*exptime)
+    {
+      time_t t = isotime2epoch (exptime);
+
+      if (t == (time_t)(-1) || t <= now)
+        return;
+      if (t < expires)
+        expires = t;
+    }
+
+  ce = chain_cache + chain_cache_next;
+  chain_cache_next = (chain_cache_next + 1) % CHAIN_CACHE_SIZE;
+
+  memcpy (ce->fpr, fpr, 20);
+  ce->flags = flags;
+  ce->mode = chain_cache_mode (ctrl);
+  if ((flags & VALIDATE_FLAG_CHAIN_MODEL))
+    gnupg_copy_time (ce->checktime, checktime);
+  else
+    *ce->checktime = 0;
+  gnupg_copy_time (ce->exptime, exptime);
+  ce->retflags = retflags;
+  ce->is_qualified = -1;
+  if (!ksba_cert_get_user_data (cert, "is_qualified", buf, sizeof buf,
+                                &buflen) && buflen)
+    ce->is_qualified = !!*buf;
+  ce->expires = expires;
+}
+
+
 /* Validate a certificate chain.  For a description see
    do_validate_chain.  This function is a wrapper to handle a root
    certificate with the chain_model flag set.  If RETFLAGS is not
@@ -1894,6 +2271,11 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
   int rc;
   struct rootca_flags_s rootca_flags;
   unsigned int dummy_retflags;
+  unsigned char fpr[20];
+  int use_cache;
+  unsigned int cacheflags;
+  struct chain_cache_s *ce;
+  ksba_isotime_t exptime;
 
   if (!retflags)
     retflags = &dummy_retflags;
@@ -1909,10 +2291,35 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
      RETFLAGS.  */
   *retflags = (flags & VALIDATE_FLAG_CHAIN_MODEL);
 
+  /* Look for a cached validation.  We do not use the cache for
+   * listings or if an audit log is requested because both want to see
+   * the details of the chain.  */
+  use_cache = (!listmode && !ctrl->audit && !opt.no_chain_validation
+               && gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL));
+  cacheflags = flags;
+  if (use_cache
+      && (ce = chain_cache_lookup (ctrl, fpr, checktime, cacheflags)))
+    {
+      if (DBG_X509)
+        log_debug ("using cached chain validation\n");
+      if (ce->is_qualified != -1)
+        {
+          char buf[1];
+
+          buf[0] = ce->is_qualified;
+          ksba_cert_set_user_data (cert, "is_qualified", buf, 1);
+        }
+      if (r_exptime)
+        gnupg_copy_time (r_exptime, ce->exptime);
+      *retflags = ce->retflags;
+      rc = 0;
+      goto leave;
+    }
+
   memset (&rootca_flags, 0, sizeof rootca_flags);
 
   rc = do_validate_chain (ctrl, cert, checktime,
-                          r_exptime, listmode, listfp, flags,
+                          exptime, listmode, listfp, flags,
                           &rootca_flags);
   if (!rc && (flags & VALIDATE_FLAG_STEED))
     {
@@ -1924,12 +2331,19 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
     {
       do_list (0, listmode, listfp, _("switching to chain model"));
       rc = do_validate_chain (ctrl, cert, checktime,
-                              r_exptime, listmode, listfp,
+                              exptime, listmode, listfp,
                               (flags |= VALIDATE_FLAG_CHAIN_MODEL),
                               &rootca_flags);
       *retflags |= VALIDATE_FLAG_CHAIN_MODEL;
     }
 
+  if (r_exptime)
+    gnupg_copy_time (r_exptime, exptime);
+  if (!rc && use_cache)
+    chain_cache_put (ctrl, cert, fpr, checktime, cacheflags,
+                     exptime, *retflags);
+
+ leave:
   if (opt.verbose)
     do_list (0, listmode, listfp, _("validation model used: %s"),
              (*retflags & VALIDATE_FLAG_STEED)?
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "gpgsm.h"
 #include <gcrypt.h>
@@ -35,6 +36,9 @@
 #include "../common/i18n.h"
 #include "../common/compliance.h"
 
+/* The maximum number of threads for --pubkey-enc-threads.  */
+#define DEK_MAX_THREADS 64
+
 
 struct dek_s {
   const char *algoid;
@@ -165,17 +169,20 @@ encode_session_key (DEK dek, gcry_sexp_t * r_data)
 }
 
 
-/* Encrypt the DEK under the key contained in CERT and return it as a
-   canonical S-Exp in encval. */
+/* Prepare the encryption of the DEK under the key contained in CERT
+   by storing the public key at R_PKEY and the encoded session key at
+   R_DATA. */
 static int
-encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
+prepare_encrypt_dek (const DEK dek, ksba_cert_t cert,
+                     gcry_sexp_t *r_pkey, gcry_sexp_t *r_data)
 {
-  gcry_sexp_t s_ciph, s_data, s_pkey;
+  gcry_sexp_t s_data, s_pkey;
   int rc;
   ksba_sexp_t buf;
   size_t len;
 
-  *encval = NULL;
+  *r_pkey = NULL;
+  *r_data = NULL;
 
   /* get the key from the cert */
   buf = ksba_cert_get_public_key (cert);
@@ -204,9 +211,30 @@ encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
   if (rc)
     {
       log_error ("encode_session_key failed: %s\n", gpg_strerror (rc));
+      gcry_sexp_release (s_pkey);
       return rc;
     }
 
+  *r_pkey = s_pkey;
+  *r_data = s_data;
+  return 0;
+}
+
+
+/* Encrypt the DEK under the key contained in CERT and return it as a
+   canonical S-Exp in encval. */
+static int
+encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
+{
+  gcry_sexp_t s_ciph, s_data, s_pkey;
+  int rc;
+
+  *encval = NULL;
+
+  rc = prepare_encrypt_dek (dek, cert, &s_pkey, &s_data);
+  if (rc)
+    return rc;
+
   /* pass it to libgcrypt */
   rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
   gcry_sexp_release (s_data);
@@ -222,7 +250,160 @@ encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
 }
 
 
-
+/* A session key encryption run on a worker thread.  */
+struct dek_job_s
+{
+  gcry_sexp_t s_pkey;
+  gcry_sexp_t s_data;
+  gcry_sexp_t s_ciph;
+  int rc;
+};
+
+/* The jobs of encrypt_dek_list.  */
+static struct
+{
+  struct dek_job_s *jobs;
+  int njobs;
+  int next_job;       /* Index of the next job for a worker.  */
+  npth_mutex_t lock;  /* Protects NEXT_JOB.  */
+} dek_pool;
+
+
+/* The worker thread for encrypt_dek_list.  */
+static void *
+dek_worker (void *arg)
+{
+  struct dek_job_s *job;
+
+  (void)arg;
+
+  for (;;)
+    {
+      npth_mutex_lock (&dek_pool.lock);
+      job = NULL;
+      if (dek_pool.next_job < dek_pool.njobs)
+        job = dek_pool.jobs + dek_pool.next_job++;
+      npth_mutex_unlock (&dek_pool.lock);
+      if (!job)
+        break;
+
+      npth_unprotect ();
+      job->rc = gcry_pk_encrypt (&job->s_ciph, job->s_data, job->s_pkey);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Encrypt the DEK for each of the NCERTS certificates at CERTS using
+   up to NTHREADS threads.  On success an array with the canonical
+   S-Exps is stored at R_ENCVALS; on error the index of the failed
+   certificate is stored at R_FAILED.  */
+static int
+encrypt_dek_list (const DEK dek, ksba_cert_t *certs, int ncerts,
+                  int nthreads, unsigned char ***r_encvals, int *r_failed)
+{
+  npth_t threads[DEK_MAX_THREADS];
+  npth_attr_t tattr;
+  struct dek_job_s *jobs;
+  unsigned char **encvals = NULL;
+  int nstarted, i;
+  int rc;
+
+  *r_encvals = NULL;
+  *r_failed = -1;
+
+  jobs = xtrycalloc (ncerts, sizeof *jobs);
+  if (!jobs)
+    return gpg_error_from_syserror ();
+
+  /* Everything touching libksba or the log is done here.  */
+  for (i = 0; i < ncerts; i++)
+    {
+      rc = prepare_encrypt_dek (dek, certs[i], &jobs[i].s_pkey,
+                                &jobs[i].s_data);
+      if (rc)
+        {
+          *r_failed = i;
+          goto leave;
+        }
+    }
+
+  if (nthreads > DEK_MAX_THREADS)
+    nthreads = DEK_MAX_THREADS;
+  if (nthreads > ncerts)
+    nthreads = ncerts;
+
+  npth_mutex_init (&dek_pool.lock, NULL);
+  dek_pool.jobs = jobs;
+  dek_pool.njobs = ncerts;
+  dek_pool.next_job = 0;
+  nstarted = 0;
+  if (nthreads > 1 && !npth_attr_init (&tattr))
+    {
+      for (i = 0; i < nthreads; i++)
+        {
+          rc = npth_create (&threads[i], &tattr, dek_worker, NULL);
+          if (rc)
+            {
+              log_error ("error spawning encryption thread: %s\n",
+                         gpg_strerror (gpg_error_from_errno (rc)));
+              break;
+            }
+          nstarted++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  /* The main thread helps and also does all the work if no thread
+     could be started.  */
+  dek_worker (NULL);
+  for (i = 0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&dek_pool.lock);
+  dek_pool.jobs = NULL;
+  dek_pool.njobs = 0;
+
+  encvals = xtrycalloc (ncerts, sizeof *encvals);
+  if (!encvals)
+    {
+      rc = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i = 0; i < ncerts; i++)
+    {
+      rc = jobs[i].rc;
+      if (!rc)
+        rc = make_canon_sexp (jobs[i].s_ciph, &encvals[i], NULL);
+      if (rc)
+        {
+          *r_failed = i;
+          goto leave;
+        }
+    }
+  *r_encvals = encvals;
+  encvals = NULL;
+  rc = 0;
+
+ leave:
+  if (encvals)
+    {
+      for (i = 0; i < ncerts; i++)
+        xfree (encvals[i]);
+      xfree (encvals);
+    }
+  for (i = 0; i < ncerts; i++)
+    {
+      gcry_sexp_release (jobs[i].s_pkey);
+      gcry_sexp_release (jobs[i].s_data);
+      gcry_sexp_release (jobs[i].s_ciph);
+    }
+  xfree (jobs);
+  return rc;
+}
+
+
+
 /* do the actual encryption */
 static int
 encrypt_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
@@ -310,6 +491,8 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   struct encrypt_cb_parm_s encparm;
   DEK dek = NULL;
   int recpno;
+  int ncerts = 0;
+  unsigned char **encvals = NULL;
   estream_t data_fp = NULL;
   certlist_t cl;
   int count;
@@ -470,11 +653,9 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   compliant = gnupg_cipher_is_compliant (CO_DE_VS, dek->algo,
                                          GCRY_CIPHER_MODE_CBC);
 
-  /* Gather certificates of recipients, encrypt the session key for
-     each and store them in the CMS object */
-  for (recpno = 0, cl = recplist; cl; recpno++, cl = cl->next)
+  /* Check the certificates of the recipients.  */
+  for (ncerts = 0, cl = recplist; cl; ncerts++, cl = cl->next)
     {
-      unsigned char *encval;
       unsigned int nbits;
       int pk_algo;
 
@@ -497,15 +678,63 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
       if (compliant
           && !gnupg_pk_is_compliant (CO_DE_VS, pk_algo, NULL, nbits, NULL))
         compliant = 0;
+    }
 
-      rc = encrypt_dek (dek, cl->cert, &encval);
+  /* With several recipients the public key operations may be run in
+     parallel; the CMS object is filled in the order of the list.  */
+  if (opt.pubkey_enc_threads > 1 && ncerts > 1)
+    {
+      ksba_cert_t *certs;
+      int failed;
+
+      certs = xtrycalloc (ncerts, sizeof *certs);
+      if (!certs)
+        {
+          rc = out_of_core ();
+          goto leave;
+        }
+      for (recpno = 0, cl = recplist; cl; recpno++, cl = cl->next)
+        certs[recpno] = cl->cert;
+      rc = encrypt_dek_list (dek, certs, ncerts, opt.pubkey_enc_threads,
+                             &encvals, &failed);
+      xfree (certs);
       if (rc)
         {
-          audit_log_cert (ctrl->audit, AUDIT_ENCRYPTED_TO, cl->cert, rc);
+          if (failed >= 0)
+            {
+              for (recpno = 0, cl = recplist; recpno < failed;
+                   recpno++, cl = cl->next)
+                ;
+              audit_log_cert (ctrl->audit, AUDIT_ENCRYPTED_TO, cl->cert, rc);
+            }
           log_error ("encryption failed for recipient no. %d: %s\n",
-                     recpno, gpg_strerror (rc));
+                     failed, gpg_strerror (rc));
           goto leave;
         }
+    }
+
+  /* Gather certificates of recipients, encrypt the session key for
+     each and store them in the CMS object */
+  for (recpno = 0, cl = recplist; cl; recpno++, cl = cl->next)
+    {
+      unsigned char *encval;
+
+      if (encvals)
+        {
+          encval = encvals[recpno];
+          encvals[recpno] = NULL;
+        }
+      else
+        {
+          rc = encrypt_dek (dek, cl->cert, &encval);
+          if (rc)
+            {
+              audit_log_cert (ctrl->audit, AUDIT_ENCRYPTED_TO, cl->cert, rc);
+              log_error ("encryption failed for recipient no. %d: %s\n",
+                         recpno, gpg_strerror (rc));
+              goto leave;
+            }
+        }
 
       err = ksba_cms_add_recipient (cms, cl->cert);
       if (err)
@@ -566,6 +795,12 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   log_info ("encrypted data created\n");
 
  leave:
+  if (encvals)
+    {
+      for (recpno = 0; recpno < ncerts; recpno++)
+        xfree (encvals[recpno]);
+      xfree (encvals);
+    }
   ksba_cms_release (cms);
   gnupg_ksba_destroy_writer (b64writer);
   ksba_reader_release (reader);
@@ -160,7 +160,8 @@ gpgsm_get_short_fingerprint (ksba_cert_t cert, unsigned long *r_high)
 /* Return the so called KEYGRIP which is the SHA-1 hash of the public
    key parameters expressed as an canoncial encoded S-Exp.  ARRAY must
    be 20 bytes long.  Returns ARRAY or a newly allocated buffer if ARRAY was
-   given as NULL.  May return NULL on error.  */
+   given as NULL.  May return NULL on error.  The keygrip is cached
+   with the certificate object like the SHA-1 fingerprint.  */
 unsigned char *
 gpgsm_get_keygrip (ksba_cert_t cert, unsigned char *array)
 {
@@ -168,6 +169,20 @@ gpgsm_get_keygrip (ksba_cert_t cert, unsigned char *array)
   int rc;
   ksba_sexp_t p;
   size_t n;
+  unsigned char grip[20];
+
+  if (!ksba_cert_get_user_data (cert, "keygrip", grip, sizeof grip, &n)
+      && n == 20)
+    {
+      if (!array)
+        {
+          array = xtrymalloc (20);
+          if (!array)
+            return NULL;
+        }
+      memcpy (array, grip, 20);
+      return array;
+    }
 
   p = ksba_cert_get_public_key (cert);
   if (!p)
@@ -198,6 +213,7 @@ gpgsm_get_keygrip (ksba_cert_t cert, unsigned char *array)
   if (DBG_X509)
     log_printhex (array, 20, "keygrip=");
 
+  ksba_cert_set_user_data (cert, "keygrip", array, 20);
   return array;
 }
 
@@ -219,7 +235,8 @@ gpgsm_get_keygrip_hexstring (ksba_cert_t cert)
 
 
 /* Return the PK algorithm used by CERT as well as the length in bits
-   of the public key at NBITS. */
+   of the public key at NBITS.  The result is cached with the
+   certificate object. */
 int
 gpgsm_get_key_algo_info (ksba_cert_t cert, unsigned int *nbits)
 {
@@ -230,10 +247,22 @@ gpgsm_get_key_algo_info (ksba_cert_t cert, unsigned int *nbits)
   gcry_sexp_t l1, l2;
   const char *name;
   char namebuf[128];
+  unsigned char cached[8];
+  int algo;
+  unsigned int keybits;
 
   if (nbits)
     *nbits = 0;
 
+  if (!ksba_cert_get_user_data (cert, "key-algo-info",
+                                cached, sizeof cached, &n)
+      && n == 8)
+    {
+      if (nbits)
+        *nbits = buf32_to_uint (cached + 4);
+      return (int)buf32_to_uint (cached);
+    }
+
   p = ksba_cert_get_public_key (cert);
   if (!p)
     return 0;
@@ -248,8 +277,9 @@ gpgsm_get_key_algo_info (ksba_cert_t cert, unsigned int *nbits)
   if (rc)
     return 0;
 
+  keybits = gcry_pk_get_nbits (s_pkey);
   if (nbits)
-    *nbits = gcry_pk_get_nbits (s_pkey);
+    *nbits = keybits;
 
   /* Breaking the algorithm out of the S-exp is a bit of a challenge ... */
   l1 = gcry_sexp_find_token (s_pkey, "public-key", 0);
@@ -273,7 +303,18 @@ gpgsm_get_key_algo_info (ksba_cert_t cert, unsigned int *nbits)
     *namebuf = 0;
   gcry_sexp_release (l1);
   gcry_sexp_release (s_pkey);
-  return gcry_pk_map_name (namebuf);
+  algo = gcry_pk_map_name (namebuf);
+
+  cached[0] = algo >> 24;
+  cached[1] = algo >> 16;
+  cached[2] = algo >>  8;
+  cached[3] = algo;
+  cached[4] = keybits >> 24;
+  cached[5] = keybits >> 16;
+  cached[6] = keybits >>  8;
+  cached[7] = keybits;
+  ksba_cert_set_user_data (cert, "key-algo-info", cached, sizeof cached);
+  return algo;
 }
 
 
@@ -31,6 +31,7 @@
 #include "gpgsm.h"
 #include <gcrypt.h>
 #include <assuan.h> /* malloc hooks */
+#include <npth.h>
 
 #include "passphrase.h"
 #include "../common/shareddefs.h"
@@ -136,6 +137,7 @@ enum cmd_and_opt_values {
   oP12Charset,
 
   oCompliance,
+  oPubkeyEncThreads,
 
   oDisableCRLChecks,
   oEnableCRLChecks,
@@ -366,6 +368,7 @@ static ARGPARSE_OPTS opts[] = {
 
   /* Hidden options. */
   ARGPARSE_s_s (oCompliance, "compliance",   "@"),
+  ARGPARSE_s_i (oPubkeyEncThreads, "pubkey-enc-threads", "@"),
   ARGPARSE_s_n (oNoVerbose, "no-verbose", "@"),
   ARGPARSE_s_n (oEnableSpecialFilenames, "enable-special-filenames", "@"),
   ARGPARSE_s_n (oNoSecmemWarn, "no-secmem-warning", "@"),
@@ -432,6 +435,7 @@ static struct debug_flags_s debug_flags [] =
     { DBG_IPC_VALUE    , "ipc"     },
     { DBG_CLOCK_VALUE  , "clock"   },
     { DBG_LOOKUP_VALUE , "lookup"  },
+    { DBG_TIMING_VALUE , "timing"  },
     { 0, NULL }
   };
 
@@ -961,6 +965,7 @@ main ( int argc, char **argv)
   /*mtrace();*/
 
   early_system_init ();
+  gnupg_timing_mark ("start");
   gnupg_reopen_std (GPGSM_NAME);
   /* trap_unaligned ();*/
   gnupg_rl_initialize ();
@@ -975,6 +980,7 @@ main ( int argc, char **argv)
   /* Make sure that our subsystems are ready.  */
   i18n_init ();
   init_common_subsystems (&argc, &argv);
+  gnupg_timing_mark ("init");
 
   /* Check that the libraries are suitable.  Do it here because the
      option parse may need services of the library */
@@ -1044,11 +1050,17 @@ main ( int argc, char **argv)
 
   ksba_set_malloc_hooks (gcry_malloc, gcry_realloc, gcry_free );
 
+  /* Init threading which is used to encrypt to several recipients
+     in parallel.  */
+  npth_init ();
+  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+
   malloc_hooks.malloc = gcry_malloc;
   malloc_hooks.realloc = gcry_realloc;
   malloc_hooks.free = gcry_free;
   assuan_set_malloc_hooks (&malloc_hooks);
   assuan_set_gpg_err_source (GPG_ERR_SOURCE_DEFAULT);
+  assuan_set_system_hooks (ASSUAN_SYSTEM_NPTH);
   setup_libassuan_logging (&opt.debug, NULL);
 
   /* Setup a default control structure for command line mode */
@@ -1508,6 +1520,10 @@ main ( int argc, char **argv)
 
         case oNoAutostart: opt.autostart = 0; break;
 
+        case oPubkeyEncThreads:
+          opt.pubkey_enc_threads = pargs.r.ret_int < 0? 0 : pargs.r.ret_int;
+          break;
+
         case oCompliance:
           {
             struct gnupg_compliance_option compliance_options[] =
@@ -1620,6 +1636,7 @@ main ( int argc, char **argv)
   gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
 
   set_debug ();
+  gnupg_timing_mark ("options");
 
   /* Although we always use gpgsm_exit, we better install a regular
      exit handler so that at least the secure memory gets wiped
@@ -1762,6 +1779,7 @@ main ( int argc, char **argv)
   for (sl = nrings; sl; sl = sl->next)
     keydb_add_resource (&ctrl, sl->d, 0, NULL);
   FREE_STRLIST(nrings);
+  gnupg_timing_mark ("keydb");
 
 
   /* Prepare the audit log feature for certain commands.  */
@@ -1948,7 +1966,7 @@ main ( int argc, char **argv)
         estream_t fp = NULL;
 
         set_binary (stdin);
-        if (argc == 2 && opt.outfile)
+        if (argc >= 2 && opt.outfile)
           log_info ("option --output ignored for a detached signature\n");
         else if (opt.outfile)
           fp = open_es_fwrite (opt.outfile);
@@ -1959,8 +1977,18 @@ main ( int argc, char **argv)
           gpgsm_verify (&ctrl, open_read (*argv), -1, fp); /* std signature */
         else if (argc == 2) /* detached signature (sig, detached) */
           gpgsm_verify (&ctrl, open_read (*argv), open_read (argv[1]), NULL);
-        else
-          wrong_args ("--verify [signature [detached_data]]");
+        else /* detached signatures (sig..., detached) */
+          {
+            int data_fd = open_read (argv[argc-1]);
+
+            /* Hash the data only once for all signatures.  */
+            ctrl.keep_data_hash = 1;
+            for (; argc > 1; argc--, argv++)
+              gpgsm_verify (&ctrl, open_read (*argv), data_fd, NULL);
+            ctrl.keep_data_hash = 0;
+            gcry_md_close (ctrl.data_hash);
+            ctrl.data_hash = NULL;
+          }
 
         es_fclose (fp);
       }
@@ -2201,6 +2229,8 @@ void
 gpgsm_exit (int rc)
 {
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
+  if (DBG_TIMING)
+    gnupg_timing_dump ();
   if (opt.debug & DBG_MEMSTAT_VALUE)
     {
       gcry_control( GCRYCTL_DUMP_MEMORY_STATS );
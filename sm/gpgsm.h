@@ -154,6 +154,10 @@ struct
   /* Enable creation of authenticode signatures.  */
   int authenticode;
 
+  /* Number of threads used to encrypt the session key for several
+   * recipients; 0 or 1 disables this.  */
+  int pubkey_enc_threads;
+
   /* A list of extra attributes put into a signed data object.  For a
    * signed each attribute each string has the format:
    *   <oid>:s:<hex_or_filename>
@@ -178,6 +182,7 @@ struct
 #define DBG_IPC_VALUE     1024  /* debug assuan communication */
 #define DBG_CLOCK_VALUE   4096
 #define DBG_LOOKUP_VALUE  8192	/* debug the key lookup */
+#define DBG_TIMING_VALUE  32768 /* print startup timings */
 
 #define DBG_X509    (opt.debug & DBG_X509_VALUE)
 #define DBG_CRYPTO  (opt.debug & DBG_CRYPTO_VALUE)
@@ -187,6 +192,7 @@ struct
 #define DBG_IPC     (opt.debug & DBG_IPC_VALUE)
 #define DBG_CLOCK   (opt.debug & DBG_CLOCK_VALUE)
 #define DBG_LOOKUP  (opt.debug & DBG_LOOKUP_VALUE)
+#define DBG_TIMING  (opt.debug & DBG_TIMING_VALUE)
 
 /* Forward declaration for an object defined in server.c */
 struct server_local_s;
@@ -228,6 +234,13 @@ struct server_control_s
                            1 := chain model,
                            2 := STEED model. */
   int offline;        /* If true gpgsm won't do any network access.  */
+
+  int keep_data_hash; /* Keep the hash of the detached data for the
+                         next signature over the same data.  */
+  gcry_md_hd_t data_hash; /* NULL or the kept hash.  */
+
+  /* NULL or the CA certificates already validated during a listing.  */
+  struct chain_memo_s *chain_memo;
 };
 
 
@@ -335,6 +348,8 @@ int gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert,
                           ksba_isotime_t r_exptime,
                           int listmode, estream_t listfp,
                           unsigned int flags, unsigned int *retflags);
+gpg_error_t gpgsm_begin_chain_memo (ctrl_t ctrl);
+void gpgsm_end_chain_memo (ctrl_t ctrl);
 int gpgsm_basic_cert_check (ctrl_t ctrl, ksba_cert_t cert);
 
 /*-- certlist.c --*/
@@ -442,10 +457,16 @@ gpg_error_t gpgsm_agent_export_key (ctrl_t ctrl, const char *keygrip,
 int gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                            ksba_cert_t cert, ksba_cert_t issuer_cert,
                            int use_ocsp);
+gpg_error_t gpgsm_dirmngr_isvalid_chain (ctrl_t ctrl,
+                                         ksba_cert_t *chain, int nchain,
+                                         int ncheck, int use_ocsp,
+                                         gpg_error_t *r_errs);
 int gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
                           void (*cb)(void*, ksba_cert_t), void *cb_value);
 int gpgsm_dirmngr_run_command (ctrl_t ctrl, const char *command,
                                int argc, char **argv);
+void gpgsm_dirmngr_get_stats (unsigned long *r_uses,
+                              unsigned long *r_connects);
 
 
 /*-- misc.c --*/
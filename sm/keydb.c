@@ -73,8 +73,30 @@ struct keydb_handle {
 };
 
 
+/* The number of released handles kept for reuse.  A long running
+ * server would otherwise open the keybox files again for each
+ * command.  */
+#define HANDLE_POOL_SIZE 4
+static KEYDB_HANDLE handle_pool[HANDLE_POOL_SIZE];
+static int handle_pool_used;
+
+/* A cache of parsed certificates indexed by their SHA-1 fingerprint
+ * which is the UBID of the keybox blob.  */
+#define CERT_CACHE_SIZE 256
+static struct
+{
+  unsigned char fpr[20];
+  ksba_cert_t cert;         /* NULL for an unused slot.  */
+} cert_cache[CERT_CACHE_SIZE];
+
+/* Counters for GETINFO stats.  */
+static struct keydb_stats_s keydb_stats;
+
+
 static int lock_all (KEYDB_HANDLE hd);
 static void unlock_all (KEYDB_HANDLE hd);
+static void release_handle (KEYDB_HANDLE hd);
+static void flush_handle_pool (void);
 
 
 static void
@@ -391,12 +413,47 @@ keydb_add_resource (ctrl_t ctrl, const char *url, int force, int *auto_created)
                                "add_keyblock_resource", err);
     }
   else
-    any_registered = 1;
+    {
+      any_registered = 1;
+      /* Pooled handles don't know about the new resource.  */
+      flush_handle_pool ();
+    }
   xfree (filename);
   return err;
 }
 
 
+/* Release the keybox handles of HD and HD itself.  */
+static void
+release_handle (KEYDB_HANDLE hd)
+{
+  int i;
+
+  for (i=0; i < hd->used; i++)
+    {
+      switch (hd->active[i].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          keybox_release (hd->active[i].u.kr);
+          break;
+        }
+    }
+
+  xfree (hd);
+}
+
+
+/* Release all handles kept for reuse.  */
+static void
+flush_handle_pool (void)
+{
+  while (handle_pool_used)
+    release_handle (handle_pool[--handle_pool_used]);
+}
+
+
 KEYDB_HANDLE
 keydb_new (void)
 {
@@ -406,6 +463,18 @@ keydb_new (void)
   if (DBG_CLOCK)
     log_clock ("%s: enter\n", __func__);
 
+  keydb_stats.handles++;
+  if (handle_pool_used)
+    {
+      /* Reuse a released handle; its files are still open.  */
+      hd = handle_pool[--handle_pool_used];
+      for (i=0; i < hd->used; i++)
+        if (hd->active[i].type == KEYDB_RESOURCE_TYPE_KEYBOX)
+          keybox_refresh_file (hd->active[i].u.kr);
+      keydb_stats.reused++;
+      goto leave;
+    }
+
   hd = xcalloc (1, sizeof *hd);
   hd->found = -1;
   hd->saved_found = -1;
@@ -432,6 +501,7 @@ keydb_new (void)
     }
   hd->used = j;
 
+ leave:
   active_handles++;
   if (DBG_CLOCK)
     log_clock ("%s: leave (hd=%p)\n", __func__, hd);
@@ -441,8 +511,6 @@ keydb_new (void)
 void
 keydb_release (KEYDB_HANDLE hd)
 {
-  int i;
-
   if (!hd)
     return;
 
@@ -454,19 +522,19 @@ keydb_release (KEYDB_HANDLE hd)
 
   hd->keep_lock = 0;
   unlock_all (hd);
-  for (i=0; i < hd->used; i++)
+
+  /* Keep the handle for reuse after resetting it to the state of a
+   * new one.  */
+  if (!hd->locked && handle_pool_used < HANDLE_POOL_SIZE)
     {
-      switch (hd->active[i].type)
-        {
-        case KEYDB_RESOURCE_TYPE_NONE:
-          break;
-        case KEYDB_RESOURCE_TYPE_KEYBOX:
-          keybox_release (hd->active[i].u.kr);
-          break;
-        }
+      keydb_set_ephemeral (hd, 0);
+      keydb_search_reset (hd);
+      hd->saved_found = -1;
+      handle_pool[handle_pool_used++] = hd;
     }
+  else
+    release_handle (hd);
 
-  xfree (hd);
   if (DBG_CLOCK)
     log_clock ("%s: leave\n", __func__);
 }
@@ -714,7 +782,34 @@ keydb_get_cert (KEYDB_HANDLE hd, ksba_cert_t *r_cert)
       rc = gpg_error (GPG_ERR_GENERAL); /* oops */
       break;
     case KEYDB_RESOURCE_TYPE_KEYBOX:
-      rc = keybox_get_cert (hd->active[hd->found].u.kr, r_cert);
+      {
+        KEYBOX_HANDLE kr = hd->active[hd->found].u.kr;
+        unsigned char fpr[20];
+        int slot = -1;
+
+        if (!keybox_get_ubid (kr, fpr))
+          {
+            slot = ((fpr[0] << 8) | fpr[1]) % CERT_CACHE_SIZE;
+            if (cert_cache[slot].cert
+                && !memcmp (cert_cache[slot].fpr, fpr, 20))
+              {
+                ksba_cert_ref (cert_cache[slot].cert);
+                *r_cert = cert_cache[slot].cert;
+                keydb_stats.cert_hits++;
+                rc = 0;
+                break;
+              }
+          }
+        rc = keybox_get_cert (kr, r_cert);
+        keydb_stats.certs++;
+        if (!rc && slot != -1)
+          {
+            ksba_cert_release (cert_cache[slot].cert);
+            ksba_cert_ref (*r_cert);
+            cert_cache[slot].cert = *r_cert;
+            memcpy (cert_cache[slot].fpr, fpr, 20);
+          }
+      }
       break;
     }
 
@@ -725,6 +820,15 @@ keydb_get_cert (KEYDB_HANDLE hd, ksba_cert_t *r_cert)
 }
 
 
+/* Store the counters of the handle pool and the certificate cache at
+   STATS.  */
+void
+keydb_get_stats (struct keydb_stats_s *stats)
+{
+  *stats = keydb_stats;
+}
+
+
 /* Return a flag of the last found object. WHICH is the flag requested;
    it should be one of the KEYBOX_FLAG_ values.  If the operation is
    successful, the flag value will be stored at the address given by
@@ -29,6 +29,16 @@ typedef struct keydb_handle *KEYDB_HANDLE;
 /* Flag value used with KEYBOX_FLAG_VALIDITY. */
 #define VALIDITY_REVOKED (1<<5)
 
+/* Counters returned by keydb_get_stats.  */
+struct keydb_stats_s
+{
+  unsigned long handles;    /* Number of keydb_new calls.  */
+  unsigned long reused;     /* ... of which reused a released handle.  */
+  unsigned long certs;      /* Number of certificates parsed.  */
+  unsigned long cert_hits;  /* Number of certificates taken from the
+                               cache instead.  */
+};
+
 
 /*-- keydb.c --*/
 gpg_error_t keydb_add_resource (ctrl_t ctrl, const char *url,
@@ -46,6 +56,7 @@ gpg_error_t keydb_set_flags (KEYDB_HANDLE hd, int which, int idx,
 void keydb_push_found_state (KEYDB_HANDLE hd);
 void keydb_pop_found_state (KEYDB_HANDLE hd);
 int keydb_get_cert (KEYDB_HANDLE hd, ksba_cert_t *r_cert);
+void keydb_get_stats (struct keydb_stats_s *stats);
 gpg_error_t keydb_insert_cert (KEYDB_HANDLE hd, ksba_cert_t cert);
 gpg_error_t keydb_update_cert (KEYDB_HANDLE hd, ksba_cert_t cert);
 
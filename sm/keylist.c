@@ -1435,6 +1435,15 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
       goto leave;
     }
 
+  /* Validate the CA certificates shared by the listed certificates
+     only once.  */
+  if (ctrl->with_validation)
+    {
+      rc = gpgsm_begin_chain_memo (ctrl);
+      if (rc)
+        goto leave;
+    }
+
   if (!names)
     ndesc = 1;
   else
@@ -1588,6 +1597,7 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
     log_error ("keydb_search failed: %s\n", gpg_strerror (rc));
 
  leave:
+  gpgsm_end_chain_memo (ctrl);
   ksba_cert_release (cert);
   ksba_cert_release (lastcert);
   xfree (desc);
@@ -498,10 +498,11 @@ set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
 }
 
 
-static void
-crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
-             int iter, const void *iv, size_t ivlen,
-             const char *pw, int cipher_algo, int encrypt)
+/* Return a new cipher context for CIPHER_ALGO with the key and IV
+   derived from the password PW or NULL on error.  */
+static gcry_cipher_hd_t
+open_pbe_cipher (char *salt, size_t saltlen, int iter,
+                 const void *iv, size_t ivlen, const char *pw, int cipher_algo)
 {
   gcry_cipher_hd_t chd;
   int rc;
@@ -510,17 +511,34 @@ crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
   if (rc)
     {
       log_error ( "gcry_cipher_open failed: %s\n", gpg_strerror(rc));
-      wipememory (buffer, length);
-      return;
+      return NULL;
     }
 
   if (cipher_algo == GCRY_CIPHER_AES128
       ? set_key_iv_pbes2 (chd, salt, saltlen, iter, iv, ivlen, pw, cipher_algo)
       : set_key_iv (chd, salt, saltlen, iter, pw,
                     cipher_algo == GCRY_CIPHER_RFC2268_40? 5:24))
+    {
+      gcry_cipher_close (chd);
+      return NULL;
+    }
+  return chd;
+}
+
+
+static void
+crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
+             int iter, const void *iv, size_t ivlen,
+             const char *pw, int cipher_algo, int encrypt)
+{
+  gcry_cipher_hd_t chd;
+  int rc;
+
+  chd = open_pbe_cipher (salt, saltlen, iter, iv, ivlen, pw, cipher_algo);
+  if (!chd)
     {
       wipememory (buffer, length);
-      goto leave;
+      return;
     }
 
   rc = encrypt? gcry_cipher_encrypt (chd, buffer, length, NULL, 0)
@@ -546,13 +564,18 @@ crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
    function called with the plaintext and used to check whether the
    decryption succeeded; i.e. that a correct passphrase has been
    given.  That function shall return true if the decryption has likely
-   succeeded. */
+   succeeded.  If R_CHD is not NULL, LENGTH may be a prefix of the
+   FULLLENGTH bytes of the ciphertext; on success the cipher context
+   to decrypt the remaining data is then stored there.  Encodings
+   which result in an already tried passphrase are skipped because
+   they would only repeat the key derivation.  */
 static void
 decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
-               char *salt, size_t saltlen,
+               size_t fulllength, char *salt, size_t saltlen,
                int iter, const void *iv, size_t ivlen,
                const char *pw, int cipher_algo,
-               int (*check_fnc) (const void *, size_t))
+               int (*check_fnc) (const void *, size_t, size_t),
+               gcry_cipher_hd_t *r_chd)
 {
   static const char * const charsets[] = {
     "",   /* No conversion - use the UTF-8 passphrase direct.  */
@@ -576,6 +599,13 @@ decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
   int charsetidx = 0;
   char *convertedpw = NULL;   /* Malloced and converted password or NULL.  */
   size_t convertedpwsize = 0; /* Allocated length.  */
+  char *triedpw = NULL;       /* The converted passwords already tried.  */
+  int ntried = 0;
+  gcry_cipher_hd_t chd;
+  int i;
+
+  if (r_chd)
+    *r_chd = NULL;
 
   for (charsetidx=0; charsets[charsetidx]; charsetidx++)
     {
@@ -594,7 +624,9 @@ decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
                  then.  */
               convertedpwsize = strlen (pw) + 1;
               convertedpw = gcry_malloc_secure (convertedpwsize);
-              if (!convertedpw)
+              triedpw = gcry_malloc_secure (DIM (charsets)
+                                            * convertedpwsize);
+              if (!convertedpw || !triedpw)
                 {
                   log_info ("out of secure memory while"
                             " converting passphrase\n");
@@ -618,27 +650,63 @@ decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
             }
           *outptr = 0;
           jnlib_iconv_close (cd);
+
+          /* For example an ASCII passphrase is the same in most
+             charsets.  */
+          if (!strcmp (convertedpw, pw))
+            continue;
+          for (i=0; i < ntried; i++)
+            if (!strcmp (convertedpw, triedpw + i * convertedpwsize))
+              break;
+          if (i < ntried)
+            continue;
+          strcpy (triedpw + ntried++ * convertedpwsize, convertedpw);
+
           log_info ("decryption failed; trying charset '%s'\n",
                     charsets[charsetidx]);
         }
       memcpy (plaintext, ciphertext, length);
-      crypt_block (plaintext, length, salt, saltlen, iter, iv, ivlen,
-                   convertedpw? convertedpw:pw, cipher_algo, 0);
-      if (check_fnc (plaintext, length))
-        break; /* Decryption succeeded. */
+      chd = open_pbe_cipher (salt, saltlen, iter, iv, ivlen,
+                             convertedpw? convertedpw:pw, cipher_algo);
+      if (!chd)
+        wipememory (plaintext, length);
+      else if (gcry_cipher_decrypt (chd, plaintext, length, NULL, 0))
+        {
+          wipememory (plaintext, length);
+          gcry_cipher_close (chd);
+          chd = NULL;
+        }
+      if (chd && check_fnc (plaintext, length, fulllength))
+        {
+          /* Decryption succeeded. */
+          if (r_chd)
+            *r_chd = chd;
+          else
+            gcry_cipher_close (chd);
+          break;
+        }
+      if (chd)
+        gcry_cipher_close (chd);
     }
   gcry_free (convertedpw);
+  gcry_free (triedpw);
 }
 
 
 /* Return true if the decryption of an bag_encrypted_data object has
-   likely succeeded.  */
+   likely succeeded.  PLAINTEXT may be the first LENGTH bytes of the
+   FULLLENGTH bytes of data.  */
 static int
-bag_decrypted_data_p (const void *plaintext, size_t length)
+bag_decrypted_data_p (const void *plaintext, size_t length,
+                      size_t fulllength)
 {
   struct tag_info ti;
   const unsigned char *p = plaintext;
-  size_t n = length;
+  size_t n = fulllength;
+
+  /* Make sure that we only look at the decrypted headers.  */
+  if (length < 32 && length != fulllength)
+    return 0;
 
   /*   { */
   /* #  warning debug code is enabled */
@@ -658,6 +726,88 @@ bag_decrypted_data_p (const void *plaintext, size_t length)
   return 1;
 }
 
+/* The initial size of the decryption window used by
+   parse_bag_encrypted_data.  Must be a multiple of the block
+   lengths.  */
+#define PLAIN_WINDOW_SIZE 4096
+
+/* A window into the decrypted content of a bag_encrypted_data
+   object.  */
+struct plain_window_s
+{
+  gcry_cipher_hd_t chd;         /* The context to decrypt the rest.  */
+  size_t blklen;                /* The block length of the cipher.  */
+  const unsigned char *cipher;  /* The not yet decrypted data.  */
+  size_t cipherleft;            /* Its length.  */
+  unsigned char *buffer;        /* The window (secure memory).  */
+  size_t size;                  /* Allocated size of BUFFER.  */
+  size_t avail;                 /* Decrypted bytes in BUFFER.  */
+};
+
+
+/* Make sure that the next NEED bytes at *R_P are available in WINDOW.
+   N is the number of plaintext bytes left at *R_P.  If the window is
+   moved, *R_P is updated and *R_P_START and *R_STARTOFFSET are
+   adjusted so that error messages still show the right offset.  */
+static int
+fill_plain_window (struct plain_window_s *window,
+                   const unsigned char **r_p, const unsigned char **r_p_start,
+                   int *r_startoffset, size_t need, size_t n)
+{
+  size_t have, chunk;
+  unsigned char *newbuf;
+  int rc;
+
+  if (need > n)
+    need = n;
+  have = window->buffer + window->avail - *r_p;
+  if (have >= need)
+    return 0;
+
+  /* Move the unprocessed rest to the begin of the buffer.  */
+  *r_startoffset += *r_p - *r_p_start;
+  memmove (window->buffer, *r_p, have);
+  window->avail = have;
+  *r_p = *r_p_start = window->buffer;
+
+  if (need + window->blklen > window->size)
+    {
+      size_t newsize = need + window->blklen;
+
+      newsize = (newsize + PLAIN_WINDOW_SIZE - 1) / PLAIN_WINDOW_SIZE;
+      newsize *= PLAIN_WINDOW_SIZE;
+      newbuf = gcry_realloc (window->buffer, newsize);
+      if (!newbuf)
+        {
+          log_error ("error allocating decryption buffer\n");
+          return -1;
+        }
+      window->buffer = newbuf;
+      window->size = newsize;
+      *r_p = *r_p_start = window->buffer;
+    }
+
+  chunk = window->size - window->avail;
+  chunk -= chunk % window->blklen;
+  if (chunk > window->cipherleft)
+    chunk = window->cipherleft;
+  if (have + chunk < need)
+    return -1;  /* Can't happen because NEED is at most N.  */
+  memcpy (window->buffer + window->avail, window->cipher, chunk);
+  rc = gcry_cipher_decrypt (window->chd, window->buffer + window->avail,
+                            chunk, NULL, 0);
+  if (rc)
+    {
+      log_error ("en/de-crytion failed: %s\n", gpg_strerror (rc));
+      return -1;
+    }
+  window->cipher += chunk;
+  window->cipherleft -= chunk;
+  window->avail += chunk;
+  return 0;
+}
+
+
 /* Note: If R_RESULT is passed as NULL, a key object as already be
    processed and thus we need to skip it here. */
 static int
@@ -684,7 +834,9 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
   int is_pbes2 = 0;
   gcry_mpi_t *result = NULL;
   int result_count;
+  struct plain_window_s window;
 
+  memset (&window, 0, sizeof window);
   if (r_result)
     *r_result = NULL;
   where = "start";
@@ -872,20 +1024,34 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
   log_info ("%lu bytes of %s encrypted text\n",ti.length,
             is_pbes2?"AES128":is_3des?"3DES":"RC2");
 
-  plain = gcry_malloc_secure (ti.length);
+  /* The data is decrypted piecewise into a window which holds at
+     least one complete bag.  */
+  window.blklen = is_pbes2? 16:8;
+  window.size = ti.length < PLAIN_WINDOW_SIZE? ti.length : PLAIN_WINDOW_SIZE;
+  plain = gcry_malloc_secure (window.size);
   if (!plain)
     {
       log_error ("error allocating decryption buffer\n");
       goto bailout;
     }
-  decrypt_block (p, plain, ti.length, salt, saltlen, iter,
+  window.buffer = plain;
+  decrypt_block (p, plain, window.size, ti.length, salt, saltlen, iter,
                  iv, is_pbes2?16:0, pw,
                  is_pbes2 ? GCRY_CIPHER_AES128 :
                  is_3des  ? GCRY_CIPHER_3DES : GCRY_CIPHER_RFC2268_40,
-                 bag_decrypted_data_p);
+                 bag_decrypted_data_p, &window.chd);
+  window.avail = window.size;
+  window.cipher = p + window.size;
+  window.cipherleft = ti.length - window.size;
   n = ti.length;
   startoffset = 0;
   p_start = p = plain;
+  if (!window.chd)
+    {
+      where = "outer.outer.seq";
+      bad_pass = 1;
+      goto bailout;
+    }
 
   where = "outer.outer.seq";
   if (parse_tag (&p, &n, &ti))
@@ -914,6 +1080,10 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
       where = "certbag.nextcert";
       if (ti.class || ti.tag != TAG_SEQUENCE)
         goto bailout;
+      /* Get the entire bag and the header of the next one.  */
+      if (fill_plain_window (&window, &p, &p_start, &startoffset,
+                             ti.ndef? n : ti.length + 16, n))
+        goto bailout;
 
       where = "certbag.objectidentifier";
       if (parse_tag (&p, &n, &ti))
@@ -1114,7 +1284,9 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
 
   if (r_consumed)
     *r_consumed = consumed;
-  gcry_free (plain);
+  if (window.chd)
+    gcry_cipher_close (window.chd);
+  gcry_free (window.buffer);
   gcry_free (cram_buffer);
   if (r_result)
     *r_result = result;
@@ -1131,7 +1303,9 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
     }
   if (r_consumed)
     *r_consumed = consumed;
-  gcry_free (plain);
+  if (window.chd)
+    gcry_cipher_close (window.chd);
+  gcry_free (window.buffer);
   gcry_free (cram_buffer);
   log_error ("encryptedData error at \"%s\", offset %u\n",
              where, (unsigned int)((p - p_start)+startoffset));
@@ -1150,12 +1324,14 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
 /* Return true if the decryption of a bag_data object has likely
    succeeded.  */
 static int
-bag_data_p (const void *plaintext, size_t length)
+bag_data_p (const void *plaintext, size_t length, size_t fulllength)
 {
   struct tag_info ti;
   const unsigned char *p = plaintext;
   size_t n = length;
 
+  (void)fulllength;
+
 /*   { */
 /* #  warning debug code is enabled */
 /*     FILE *fp = fopen ("tmp-3des-plain-key.der", "wb"); */
@@ -1386,10 +1562,10 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
       goto bailout;
     }
   consumed += p - p_start + ti.length;
-  decrypt_block (p, plain, ti.length, salt, saltlen, iter,
+  decrypt_block (p, plain, ti.length, ti.length, salt, saltlen, iter,
                  iv, is_pbes2? 16:0, pw,
                  is_pbes2? GCRY_CIPHER_AES128 : GCRY_CIPHER_3DES,
-                 bag_data_p);
+                 bag_data_p, NULL);
   n = ti.length;
   startoffset = 0;
   p_start = p = plain;
@@ -24,53 +24,54 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "gpgsm.h"
 #include "../common/i18n.h"
 #include <ksba.h>
 
 
-/* We open the file only once and keep the open file pointer as well
-   as the name of the file here.  Note that, a listname not equal to
-   NULL indicates that this module has been initialized and if the
-   LISTFP is also NULL, no list of qualified signatures exists. */
+/* The list of qualified certificates is read only once into a hash
+   table keyed by the first byte of the fingerprint.  The table is
+   reloaded if the modification time or the size of the file
+   changes.  Note, that a listname not equal to NULL indicates that
+   this module has been initialized.  */
+#define QUALIFIED_TABLE_SIZE 256
+
+struct qualified_item_s
+{
+  struct qualified_item_s *next;
+  unsigned char fpr[20];
+  char country[3];
+};
+typedef struct qualified_item_s *qualified_item_t;
+
 static char *listname;
-static FILE *listfp;
+static qualified_item_t qualified_table[QUALIFIED_TABLE_SIZE];
+static int list_exists;        /* True if the list file exists.  */
+static time_t list_mtime;      /* Stat info of the loaded list.  */
+static off_t list_size;
+static gpg_error_t list_error; /* Error encountered while loading.  */
 
 
-/* Read the trustlist and return entry by entry.  KEY must point to a
-   buffer of at least 41 characters. COUNTRY shall be a buffer of at
-   least 3 characters to receive the country code of that qualified
-   signature (i.e. "de" for German and "be" for Belgium).
+/* Read the trustlist from LISTFP and return entry by entry.  KEY must
+   point to a buffer of at least 41 characters. COUNTRY shall be a
+   buffer of at least 3 characters to receive the country code of that
+   qualified signature (i.e. "de" for German and "be" for Belgium).
 
    Reading a valid entry returns 0, EOF is indicated by GPG_ERR_EOF
    and any other error condition is indicated by the appropriate error
    code. */
 static gpg_error_t
-read_list (char *key, char *country, int *lnr)
+read_list (FILE *listfp, char *key, char *country, int *lnr)
 {
-  gpg_error_t err;
   int c, i, j;
   char *p, line[256];
 
   *key = 0;
   *country = 0;
 
-  if (!listname)
-    {
-      listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
-      listfp = fopen (listname, "r");
-      if (!listfp && errno != ENOENT)
-        {
-          err = gpg_error_from_syserror ();
-          log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
-          return err;
-        }
-    }
-
-  if (!listfp)
-    return gpg_error (GPG_ERR_EOF);
-
   do
     {
       if (!fgets (line, DIM(line)-1, listfp) )
@@ -128,6 +129,96 @@ read_list (char *key, char *country, int *lnr)
 }
 
 
+/* Release all items of the qualified table.  */
+static void
+release_table (void)
+{
+  qualified_item_t item, next;
+  int i;
+
+  for (i=0; i < QUALIFIED_TABLE_SIZE; i++)
+    {
+      for (item = qualified_table[i]; item; item = next)
+        {
+          next = item->next;
+          xfree (item);
+        }
+      qualified_table[i] = NULL;
+    }
+}
+
+
+/* Make sure the table reflects the current content of the list of
+   qualified certificates.  Returns an error only for fatal
+   conditions; errors in the list itself are stored in LIST_ERROR. */
+static gpg_error_t
+load_list (void)
+{
+  gpg_error_t err;
+  struct stat st;
+  FILE *listfp;
+  char key[41];
+  char country[3];
+  int lnr = 0;
+  qualified_item_t item;
+
+  if (!listname)
+    listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
+  else if (list_exists)
+    {
+      if (!stat (listname, &st)
+          && st.st_mtime == list_mtime && st.st_size == list_size)
+        return 0;  /* Table is up to date.  */
+    }
+  else if (stat (listname, &st) && errno == ENOENT)
+    return 0;  /* Still no list.  */
+
+  release_table ();
+  list_exists = 0;
+  list_error = 0;
+
+  listfp = fopen (listname, "r");
+  if (!listfp)
+    {
+      if (errno == ENOENT)
+        return 0;
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
+      return err;
+    }
+  if (fstat (fileno (listfp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't stat '%s': %s\n"), listname, gpg_strerror (err));
+      fclose (listfp);
+      return err;
+    }
+  list_exists = 1;
+  list_mtime = st.st_mtime;
+  list_size = st.st_size;
+
+  /* As with the old linear scan we stop at the first error, so that
+     entries after a bad line are not considered.  */
+  while (!(err = read_list (listfp, key, country, &lnr)))
+    {
+      item = xtrymalloc (sizeof *item);
+      if (!item)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      hex2bin (key, item->fpr, 20);
+      strcpy (item->country, country);
+      item->next = qualified_table[item->fpr[0]];
+      qualified_table[item->fpr[0]] = item;
+    }
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    list_error = err;
+  fclose (listfp);
+  return 0;
+}
+
+
 
 
 /* Check whether the certificate CERT is included in the list of
@@ -146,39 +237,31 @@ gpg_error_t
 gpgsm_is_in_qualified_list (ctrl_t ctrl, ksba_cert_t cert, char *country)
 {
   gpg_error_t err;
-  char *fpr;
-  char key[41];
-  char mycountry[3];
-  int lnr = 0;
+  unsigned char fpr[20];
+  qualified_item_t item;
 
   (void)ctrl;
 
   if (country)
     *country = 0;
 
-  fpr = gpgsm_get_fingerprint_hexstring (cert, GCRY_MD_SHA1);
-  if (!fpr)
-    return gpg_error (GPG_ERR_GENERAL);
+  err = load_list ();
+  if (err)
+    return err;
 
-  if (listfp)
-    {
-      /* W32ce has no rewind, thus we use the equivalent code.  */
-      fseek (listfp, 0, SEEK_SET);
-      clearerr (listfp);
-    }
-  while (!(err = read_list (key, mycountry, &lnr)))
+  gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+  for (item = qualified_table[fpr[0]]; item; item = item->next)
+    if (!memcmp (item->fpr, fpr, 20))
+      break;
+
+  if (item)
     {
-      if (!strcmp (key, fpr))
-        break;
+      if (country)
+        strcpy (country, item->country);
+      return 0;
     }
-  if (gpg_err_code (err) == GPG_ERR_EOF)
-    err = gpg_error (GPG_ERR_NOT_FOUND);
-
-  if (!err && country)
-    strcpy (country, mycountry);
 
-  xfree (fpr);
-  return err;
+  return list_error? list_error : gpg_error (GPG_ERR_NOT_FOUND);
 }
 
 
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #include "gpgsm.h"
+#include "keydb.h"
 #include <assuan.h>
 #include "../common/sysutils.h"
 #include "../common/server-help.h"
@@ -1112,7 +1113,9 @@ static const char hlp_getinfo[] =
   "  agent-check - Return success if the agent is running.\n"
   "  cmd_has_option CMD OPT\n"
   "              - Returns OK if the command CMD implements the option OPT.\n"
-  "  offline     - Returns OK if the connection is in offline mode.";
+  "  offline     - Returns OK if the connection is in offline mode.\n"
+  "  stats       - Return the counters of the caches kept by the server as\n"
+  "                HANDLES REUSED CERTS CERTHITS DMUSES DMCONNECTS";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -1171,6 +1174,26 @@ cmd_getinfo (assuan_context_t ctx, char *line)
     {
       rc = ctrl->offline? 0 : gpg_error (GPG_ERR_FALSE);
     }
+  else if (!strcmp (line, "stats"))
+    {
+      struct keydb_stats_s stats;
+      unsigned long dmuses, dmconnects;
+      char *s;
+
+      keydb_get_stats (&stats);
+      gpgsm_dirmngr_get_stats (&dmuses, &dmconnects);
+      s = xtryasprintf ("%lu %lu %lu %lu %lu %lu",
+                        stats.handles, stats.reused,
+                        stats.certs, stats.cert_hits,
+                        dmuses, dmconnects);
+      if (!s)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, s, strlen (s));
+          xfree (s);
+        }
+    }
   else
     rc = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
 
@@ -26,6 +26,11 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpgsm.h"
 #include <gcrypt.h>
@@ -49,41 +54,163 @@ strtimestamp_r (ksba_isotime_t atime)
 
 
 
-/* Hash the data for a detached signature.  Returns 0 on success.  */
+/* Files of at least this size are hashed using mmap.  */
+#define HASH_MMAP_THRESHOLD (1024*1024)
+
+/* The size of the window mapped at once.  */
+#define HASH_MMAP_WINDOW (64*1024*1024)
+
+
+/* Hash the regular file FD into MD using mmap.  Returns true if the
+ * entire file has been hashed; otherwise the caller needs to read it
+ * from the current file position.  */
+static int
+hash_mapped_file (int fd, gcry_md_hd_t md)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  off_t start, off;
+  size_t len;
+  void *addr;
+
+  if (fstat (fd, &st) || !S_ISREG (st.st_mode)
+      || st.st_size < HASH_MMAP_THRESHOLD)
+    return 0;
+  start = lseek (fd, 0, SEEK_CUR);
+  if (start != 0)
+    return 0;  /* Not at the start or not seekable.  */
+
+  for (off = 0; off < st.st_size; off += len)
+    {
+      len = HASH_MMAP_WINDOW;
+      if (st.st_size - off < len)
+        len = st.st_size - off;
+      addr = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, off);
+      if (addr == MAP_FAILED)
+        {
+          /* Let the caller read the rest.  */
+          if (lseek (fd, off, SEEK_SET) == (off_t)(-1))
+            log_fatal ("can't seek in the signed data: %s\n",
+                       strerror (errno));
+          return 0;
+        }
+#ifdef MADV_SEQUENTIAL
+      madvise (addr, len, MADV_SEQUENTIAL);
+#endif
+      gcry_md_write (md, addr, len);
+      munmap (addr, len);
+    }
+  if (lseek (fd, 0, SEEK_END) == (off_t)(-1))
+    log_fatal ("can't seek in the signed data: %s\n", strerror (errno));
+  return 1;
+#else
+  (void)fd;
+  (void)md;
+  return 0;
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Return true if all digest algorithms used by CMS are enabled in
+ * MD.  */
+static int
+md_has_cms_algos (gcry_md_hd_t md, ksba_cms_t cms)
+{
+  const char *algoid;
+  int i, algo;
+
+  for (i=0; (algoid=ksba_cms_get_digest_algo_list (cms, i)); i++)
+    if ((algo = gcry_md_map_name (algoid)) && !gcry_md_is_enabled (md, algo))
+      return 0;
+  if (opt.extra_digest_algo && !gcry_md_is_enabled (md, opt.extra_digest_algo))
+    return 0;
+  return 1;
+}
+
+
+/* Hash the data for a detached signature.  All algorithms enabled in
+ * *R_MD are computed in the same pass over the data.  If
+ * CTRL->KEEP_DATA_HASH is set a copy of the hash context is kept so
+ * that further signatures for the same data don't need to read it
+ * again; in that case *R_MD is replaced by a copy of the kept
+ * context.  Returns 0 on success.  */
 static gpg_error_t
-hash_data (int fd, gcry_md_hd_t md)
+hash_data (ctrl_t ctrl, int fd, ksba_cms_t cms, gcry_md_hd_t *r_md)
 {
   gpg_error_t err = 0;
   estream_t fp;
-  char buffer[4096];
+  char *buffer;
   int nread;
 
-  fp = es_fdopen_nc (fd, "rb");
-  if (!fp)
+  if (ctrl->data_hash)
     {
-      err = gpg_error_from_syserror ();
-      log_error ("fdopen(%d) failed: %s\n", fd, gpg_strerror (err));
-      return err;
+      gcry_md_hd_t md;
+
+      if (md_has_cms_algos (ctrl->data_hash, cms))
+        {
+          err = gcry_md_copy (&md, ctrl->data_hash);
+          if (err)
+            return err;
+          gcry_md_close (*r_md);
+          *r_md = md;
+          return 0;
+        }
+
+      /* Other algorithms are required; thus hash again.  */
+      gcry_md_close (ctrl->data_hash);
+      ctrl->data_hash = NULL;
+      if (lseek (fd, 0, SEEK_SET) == (off_t)(-1))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("can't rewind the signed data: %s\n",
+                     gpg_strerror (err));
+          return err;
+        }
     }
 
-  do
+  if (!hash_mapped_file (fd, *r_md))
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
-      gcry_md_write (md, buffer, nread);
+      fp = es_fdopen_nc (fd, "rb");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("fdopen(%d) failed: %s\n", fd, gpg_strerror (err));
+          return err;
+        }
+
+      buffer = xtrymalloc (32768);
+      if (!buffer)
+        {
+          err = gpg_error_from_syserror ();
+          es_fclose (fp);
+          return err;
+        }
+      do
+        {
+          nread = es_fread (buffer, 1, 32768, fp);
+          gcry_md_write (*r_md, buffer, nread);
+        }
+      while (nread);
+      if (es_ferror (fp))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("read error on fd %d: %s\n", fd, gpg_strerror (err));
+        }
+      xfree (buffer);
+      es_fclose (fp);
     }
-  while (nread);
-  if (es_ferror (fp))
+
+  if (!err && ctrl->keep_data_hash)
     {
-      err = gpg_error_from_syserror ();
-      log_error ("read error on fd %d: %s\n", fd, gpg_strerror (err));
+      if (gcry_md_copy (&ctrl->data_hash, *r_md))
+        ctrl->data_hash = NULL;  /* Not fatal; we can hash again.  */
     }
-  es_fclose (fp);
   return err;
 }
 
 
 
-
+
 /* Perform a verify operation.  To verify detached signatures, DATA_FD
    must be different than -1.  With OUT_FP given and a non-detached
    signature, the signed material is written to that stream.  */
@@ -238,7 +365,7 @@ gpgsm_verify (ctrl_t ctrl, int in_fd, int data_fd, estream_t out_fp)
                 }
               else
                 audit_log_ok (ctrl->audit, AUDIT_DATA_HASHING,
-                              hash_data (data_fd, data_md));
+                              hash_data (ctrl, data_fd, cms, &data_md));
             }
           else
             {
@@ -44,6 +44,7 @@
 #include "../../common/util.h"
 #include "../../common/exechelp.h"
 #include "../../common/sysutils.h"
+#include "../../common/timing.h"
 
 #include "private.h"
 #include "ffi.h"
@@ -532,6 +533,30 @@ do_get_time (scheme *sc, pointer args)
   FFI_RETURN_INT (sc, gnupg_get_time ());
 }
 
+/* Return a monotonic time in milliseconds.  */
+static pointer
+do_get_monotonic_msec (scheme *sc, pointer args)
+{
+  FFI_PROLOG ();
+  FFI_ARGS_DONE_OR_RETURN (sc, args);
+  FFI_RETURN_INT (sc, (long)(gnupg_timing_now () / 1000));
+}
+
+/* Return the number of online processors.  */
+static pointer
+do_get_nprocessors (scheme *sc, pointer args)
+{
+  FFI_PROLOG ();
+  long n = 1;
+  FFI_ARGS_DONE_OR_RETURN (sc, args);
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+#endif
+  FFI_RETURN_INT (sc, n);
+}
+
 static pointer
 do_getpid (scheme *sc, pointer args)
 {
@@ -1382,6 +1407,8 @@ ffi_init (scheme *sc, const char *argv0, const char *scriptname,
   ffi_define_function (sc, rmdir);
   ffi_define_function (sc, get_isotime);
   ffi_define_function (sc, get_time);
+  ffi_define_function (sc, get_monotonic_msec);
+  ffi_define_function (sc, get_nprocessors);
   ffi_define_function (sc, getpid);
 
   /* Random numbers.  */
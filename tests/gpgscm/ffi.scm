@@ -49,3 +49,9 @@
 
 ;; Get the current time in seconds since the epoch.
 (ffi-define (get-time))
+
+;; Get a monotonic time in milliseconds.
+(ffi-define (get-monotonic-msec))
+
+;; Get the number of online processors.
+(ffi-define (get-nprocessors))
@@ -115,6 +115,14 @@ int tracing;
 #ifndef CELL_MINRECOVER
 #define CELL_MINRECOVER    (CELL_SEGSIZE >> 2)
 #endif
+
+/* After a garbage collector run, grow the heap so that at least this
+ * percentage of it is free.  This keeps the number of collections
+ * proportional to the number of allocations instead of to the size of
+ * the live heap.  Larger values trade memory for fewer collections.  */
+#ifndef CELL_FREE_PERCENT
+#define CELL_FREE_PERCENT  50
+#endif
 struct cell_segment *cell_segments;
 
 /* We use 4 registers. */
@@ -1691,6 +1691,8 @@ E6:   /* up.  Undo the link switching from steps E4 and E5. */
 static void gc(scheme *sc, pointer a, pointer b) {
   pointer p;
   struct cell_segment *s;
+  long ncells;
+  long grow;
   int i;
 
   assert (gc_enabled (sc));
@@ -1732,12 +1734,14 @@ static void gc(scheme *sc, pointer a, pointer b) {
   clrmark(sc->NIL);
   sc->fcells = 0;
   sc->free_cell = sc->NIL;
+  ncells = 0;
   /* free-list is kept sorted by address so as to maintain consecutive
      ranges, if possible, for use with vectors. Here we scan the cells
      (which are also kept sorted by address) downwards to build the
      free-list in sorted order.
   */
   for (s = sc->cell_segments; s; s = s->next) {
+    ncells += s->cells_len;
     p = s->cells + s->cells_len;
     while (--p >= s->cells) {
       if ((typeflag(p) & 1) == 0)
@@ -1766,9 +1770,14 @@ static void gc(scheme *sc, pointer a, pointer b) {
     putstr(sc,msg);
   }
 
-  /* if only a few recovered, get more to avoid fruitless gc's */
-  if (sc->fcells < CELL_MINRECOVER
-       && alloc_cellseg(sc, 1) == 0)
+  /* If only a few cells were recovered, get more to avoid fruitless
+   * gc's.  The number of new segments is chosen so that afterwards
+   * CELL_FREE_PERCENT of the heap is free.  */
+  grow = (CELL_FREE_PERCENT * ncells - 100 * sc->fcells)
+    / ((100 - CELL_FREE_PERCENT) * (long) CELL_SEGSIZE);
+  if (sc->fcells < CELL_MINRECOVER && grow < 1)
+    grow = 1;
+  if (grow > 0 && alloc_cellseg(sc, (int) grow) == 0)
        sc->no_memory = 1;
 }
 
@@ -825,15 +825,19 @@
 		(cdr tests'))))))
 
 ;; Run tests either in sequence or in parallel, depending on the
-;; number of tests and the command line flags.
+;; number of tests, the number of processors and the command line
+;; flags.  Unless --sequential is given, one test per processor is run
+;; in parallel; --parallel=N requests N parallel jobs.
 (define (run-tests tests)
-  (let ((parallel (flag "--parallel" *args*))
-	(default-parallel-jobs 32))
-    (if (and parallel (> (length tests) 1))
-	(run-tests-parallel tests (if (and (pair? parallel)
-					   (string->number (car parallel)))
-				      (string->number (car parallel))
-				      default-parallel-jobs))
+  (let* ((parallel (flag "--parallel" *args*))
+	 (jobs (if (and (pair? parallel)
+			(string->number (car parallel)))
+		   (string->number (car parallel))
+		   (get-nprocessors))))
+    (if (and (not (flag "--sequential" *args*))
+	     (> jobs 1)
+	     (> (length tests) 1))
+	(run-tests-parallel tests jobs)
 	(run-tests-sequential tests))))
 
 ;; Load all tests from the given path.
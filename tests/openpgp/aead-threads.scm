@@ -0,0 +1,62 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-legacy-environment)
+
+(define passphrase "Hier spricht HAL")
+
+;; Small chunks make sure that several chunks are in flight.  The
+;; faked time fixes the timestamp of the literal data packet.
+(define args `(--yes --passphrase-fd "0"
+		     --faked-system-time "1072911600!"
+		     --force-aead --chunk-size 10
+		     --compress-algo none
+		     -c))
+
+;; Decrypt FILENAME, check that the plaintext matches SOURCE, and
+;; return the status lines.
+(define (decrypt filename source)
+  (lettmp (sink)
+    (let ((status (call-popen `(,@GPG --yes --status-fd=1 --passphrase-fd "0"
+				      --output ,sink --decrypt ,filename)
+			      passphrase)))
+      (if (not (file=? sink source))
+	  (fail "decrypted" filename "does not match" source))
+      (string-split-newlines status))))
+
+(for-each-p
+ "Checking parallel AEAD encryption"
+ (lambda (algo)
+   (for-each-p
+    ""
+    (lambda (source)
+      (tr:do
+       (tr:open source)
+       (tr:gpg passphrase `(,@args --aead-algo ,algo))
+       (tr:write-to "serial.gpg"))
+      (tr:do
+       (tr:open source)
+       (tr:gpg passphrase `(,@args --aead-algo ,algo --aead-threads 4))
+       (tr:write-to "threaded.gpg"))
+      (if (not (equal? (decrypt "serial.gpg" source)
+		       (decrypt "threaded.gpg" source)))
+	  (fail "status with --aead-threads differs for" source)))
+    '("plain-1" "data-500" "data-80000")))
+ '("ocb" "eax"))
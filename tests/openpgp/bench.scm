@@ -0,0 +1,347 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Benchmarks for gpg.  This is not part of the test suite but run by
+;; "make bench".  The workload is deterministic: the data files are
+;; created from a fixed seed and the generated keyring has a fixed
+;; number of keys with fixed user IDs.  The results are written as
+;; JSON to the file given by BENCH_OUTPUT (default: bench.json in the
+;; build directory) so that they can be compared between versions.
+;;
+;; These environment variables control the workload:
+;;
+;;   BENCH_SIZES       Comma separated data sizes in bytes.
+;;   BENCH_CIPHERS     Comma separated cipher algorithms.
+;;   BENCH_AEAD        Comma separated AEAD algorithms or "none".
+;;   BENCH_COMPRESS    Comma separated compression algorithms.
+;;   BENCH_ITERATIONS  Number of runs of each operation.
+;;   BENCH_KEYS        Number of keys in the generated keyring.
+;;   BENCH_LOOKUPS     Number of key lookups per backend.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-legacy-environment)
+
+(define (bench-param name default)
+  (let ((value (getenv name)))
+    (if (string=? value "") default value)))
+
+(define (bench-number name default)
+  (string->number (bench-param name (number->string default))))
+
+(define (bench-list name default)
+  (string-split (bench-param name default) #\,))
+
+(define sizes (map string->number (bench-list "BENCH_SIZES"
+					      "1024,65536,1048576")))
+(define ciphers (bench-list "BENCH_CIPHERS" "AES128,AES256"))
+(define aead-algos (bench-list "BENCH_AEAD" "none,ocb"))
+(define compress-algos (bench-list "BENCH_COMPRESS" "none,zip"))
+(define iterations (bench-number "BENCH_ITERATIONS" 5))
+(define nkeys (bench-number "BENCH_KEYS" 100))
+(define nlookups (bench-number "BENCH_LOOKUPS" 20))
+(define output (bench-param "BENCH_OUTPUT"
+			    (path-join (getenv "objdir") "bench.json")))
+
+;;
+;; Timing and result recording.
+;;
+
+;; Run THUNK N times and return the elapsed time in milliseconds.
+;; The result is at least 1 to avoid divisions by zero.
+(define (time-runs n thunk)
+  (let ((start (get-monotonic-msec)))
+    (let loop ((i 0))
+      (if (< i n)
+	  (begin (thunk) (loop (+ i 1)))))
+    (max 1 (- (get-monotonic-msec) start))))
+
+(define results '())
+
+;; Record the result VALUE in UNIT for the benchmark NAME.  PARAMS is
+;; an alist with strings describing the workload.
+(define (record! name params value unit)
+  (info name (stringify params) (number->string value) unit)
+  (set! results (cons (list name params value unit) results)))
+
+(define (join separator strings)
+  (if (null? strings)
+      ""
+      (apply string-append
+	     (car strings)
+	     (map (lambda (s) (string-append separator s)) (cdr strings)))))
+
+(define (json-string s)
+  (string-append "\"" s "\""))
+
+(define (result->json result)
+  (string-append
+   "  {\"name\": " (json-string (car result))
+   ", \"params\": {"
+   (join ", " (map (lambda (p)
+		     (string-append (json-string (car p)) ": "
+				    (json-string (cdr p))))
+		   (cadr result)))
+   "}, \"value\": " (number->string (caddr result))
+   ", \"unit\": " (json-string (cadddr result)) "}"))
+
+(define (write-results filename)
+  (catch #f (unlink filename))
+  (call-with-output-file filename
+    (lambda (port)
+      (display "[\n" port)
+      (display (join ",\n" (map result->json (reverse results))) port)
+      (display "\n]\n" port)))
+  (info "Results written to" filename))
+
+;;
+;; The data files.
+;;
+
+(define (data-name kind size)
+  (string-append "bench-" kind "-" (number->string size)))
+
+;; Random data is not compressible; text data is.
+(define (make-bench-data size)
+  (srandom 42)
+  (make-test-data (data-name "random" size) size)
+  (call-with-binary-output-file
+   (data-name "text" size)
+   (lambda (port)
+     (let ((line "The quick brown fox jumps over the lazy dog 0123456789.\n"))
+       (let loop ((n size))
+	 (if (> n 0)
+	     (begin
+	       (display (if (< n (string-length line))
+			    (substring line 0 n)
+			    line)
+			port)
+	       (loop (- n (string-length line))))))))))
+
+(for-each make-bench-data sizes)
+
+;;
+;; Encryption and decryption.
+;;
+
+(define (aead-args aead)
+  (if (string=? aead "none")
+      '()
+      `(--force-aead --aead-algo ,aead)))
+
+(info "Benchmarking encryption and decryption")
+(for-each
+ (lambda (size)
+   (for-each
+    (lambda (kind)
+      (for-each
+       (lambda (cipher)
+	 (for-each
+	  (lambda (aead)
+	    (for-each
+	     (lambda (compress)
+	       (let ((params `(("size" . ,(number->string size))
+			       ("data" . ,kind)
+			       ("cipher" . ,cipher)
+			       ("aead" . ,aead)
+			       ("compress" . ,compress)))
+		     (source (data-name kind size)))
+		 (let ((ms (time-runs
+			    iterations
+			    (lambda ()
+			      (call-check
+			       `(,@GPG --yes --output bench.gpg
+				       --recipient ,usrname2
+				       --cipher-algo ,cipher
+				       ,@(aead-args aead)
+				       --compress-algo ,compress
+				       --encrypt ,source))))))
+		   (record! "encrypt" params
+			    (/ (* size iterations) ms 1.024) "KiB/s"))
+		 (let ((ms (time-runs
+			    iterations
+			    (lambda ()
+			      (call-check
+			       `(,@GPG --yes --output bench.out
+				       --decrypt bench.gpg))))))
+		   (record! "decrypt" params
+			    (/ (* size iterations) ms 1.024) "KiB/s"))
+		 (if (not (file=? source "bench.out"))
+		     (fail "decrypted data differs from" source))))
+	     compress-algos))
+	  aead-algos))
+       ciphers))
+    '("random" "text")))
+ sizes)
+
+;;
+;; Compression and decompression without encryption.
+;;
+
+(info "Benchmarking compression and decompression")
+(for-each
+ (lambda (size)
+   (for-each
+    (lambda (compress)
+      (let ((params `(("size" . ,(number->string size))
+		      ("data" . "text")
+		      ("compress" . ,compress)))
+	    (source (data-name "text" size)))
+	(let ((ms (time-runs
+		   iterations
+		   (lambda ()
+		     (call-check
+		      `(,@GPG --yes --output bench.gpg
+			      --compress-algo ,compress
+			      --store ,source))))))
+	  (record! "compress" params
+		   (/ (* size iterations) ms 1.024) "KiB/s"))
+	(let ((ms (time-runs
+		   iterations
+		   (lambda ()
+		     (call-check
+		      `(,@GPG --yes --output bench.out
+			      --decrypt bench.gpg))))))
+	  (record! "decompress" params
+		   (/ (* size iterations) ms 1.024) "KiB/s"))
+	(if (not (file=? source "bench.out"))
+	    (fail "decompressed data differs from" source))))
+    compress-algos))
+ sizes)
+
+;;
+;; Signing and verification.
+;;
+
+(info "Benchmarking signing and verification")
+(let ((source (data-name "text" (car sizes)))
+      (params `(("size" . ,(number->string (car sizes))))))
+  (let ((ms (time-runs
+	     iterations
+	     (lambda ()
+	       (call-check `(,@GPG --yes --output bench.sig
+				   --local-user ,usrname1
+				   --detach-sign ,source))))))
+    (record! "sign" params (/ (* iterations 1000) ms) "ops/s"))
+  (let ((ms (time-runs
+	     iterations
+	     (lambda ()
+	       (call-check `(,@GPG --verify bench.sig ,source))))))
+    (record! "verify" params (/ (* iterations 1000) ms) "ops/s")))
+
+;;
+;; Keyring of NKEYS generated keys.
+;;
+
+(define (bench-uid i)
+  (string-append "Bench Key " (number->string i)
+		 " <bench" (number->string i) "@example.org>"))
+
+(info "Generating" (number->string nkeys) "keys")
+(let ((ms (time-runs
+	   1
+	   (lambda ()
+	     (let loop ((i 0))
+	       (if (< i nkeys)
+		   (begin
+		     (call-check `(,@GPG --passphrase "" --pinentry-mode loopback
+					 --quick-generate-key ,(bench-uid i)
+					 future-default default never))
+		     (loop (+ i 1)))))))))
+  (record! "keygen" `(("keys" . ,(number->string nkeys)))
+	   (/ (* nkeys 1000) ms) "keys/s"))
+
+;;
+;; Export and import.
+;;
+
+(info "Benchmarking export and import")
+(let ((params `(("keys" . ,(number->string nkeys)))))
+  (let ((ms (time-runs
+	     1
+	     (lambda ()
+	       (call-check `(,@GPG --yes --output bench-keys.gpg
+				   --export "@example.org"))))))
+    (record! "export" params (/ (* nkeys 1000) ms) "keys/s"))
+  (let ((ms (time-runs
+	     1
+	     (lambda ()
+	       (call-check `(,@GPG --yes --output bench-seckeys.gpg
+				   --passphrase "" --pinentry-mode loopback
+				   --export-secret-keys "@example.org"))))))
+    (record! "export-secret" params (/ (* nkeys 1000) ms) "keys/s"))
+  ;; Importing into a keyring file instead of the standard keybox also
+  ;; creates the second backend for the lookups below.
+  (let ((ms (time-runs
+	     1
+	     (lambda ()
+	       (call-check `(,@GPG --no-default-keyring
+				   --keyring ,(path-join (getcwd) "bench-ring.gpg")
+				   --import bench-keys.gpg))))))
+    (record! "import" params (/ (* nkeys 1000) ms) "keys/s")))
+
+;;
+;; Key lookups.
+;;
+
+(define (lookup-uids)
+  (srandom 42)
+  (let loop ((i 0) (acc '()))
+    (if (< i nlookups)
+	(loop (+ i 1)
+	      (cons (string-append "<bench" (number->string (random nkeys))
+				   "@example.org>")
+		    acc))
+	acc)))
+
+(info "Benchmarking key lookups")
+(for-each
+ (lambda (backend)
+   (let* ((uids (lookup-uids))
+	  (ms (time-runs
+	       1
+	       (lambda ()
+		 (for-each
+		  (lambda (uid)
+		    (call-check `(,@GPG ,@(cadr backend)
+					--with-colons --list-keys ,uid)))
+		  uids)))))
+     (record! "lookup" `(("backend" . ,(car backend))
+			 ("keys" . ,(number->string nkeys)))
+	      (/ ms nlookups 1.0) "ms")))
+ `(("keybox" ())
+   ("keyring" (--no-default-keyring
+	       --keyring ,(path-join (getcwd) "bench-ring.gpg")))))
+
+;;
+;; Trust database.
+;;
+
+(info "Benchmarking the trust database")
+(let ((fpr (:fpr (assoc "fpr" (gpg-with-colons
+				`(--list-keys ,(bench-uid 0)))))))
+  (call-popen `(,@GPG --import-ownertrust)
+	      (string-append fpr ":6:\n"))
+  (let ((ms (time-runs
+	     1
+	     (lambda ()
+	       (call-check `(,@GPG --trust-model pgp --check-trustdb))))))
+    (record! "check-trustdb" `(("keys" . ,(number->string nkeys)))
+	     ms "ms")))
+
+(write-results output)
@@ -0,0 +1,69 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+(load (in-srcdir "tests" "openpgp" "trust-pgp" "common.scm"))
+
+(display "Checking incremental trustdb checks...\n")
+
+(initscenario "scenario1")
+
+;; Make Grace's key valid through three marginally trusted keys as
+;; in trust-pgp-1.  Changing the ownertrust forces a complete walk
+;; which saves the state for the incremental checks below.
+(setownertrust BOBBY FULLTRUST)
+(setownertrust CAROL MARGINALTRUST)
+(setownertrust DAVID MARGINALTRUST)
+(setownertrust FRANK MARGINALTRUST)
+(updatetrustdb)
+(checktrust GRACE "f")
+
+;; Return the validity of all keys and user ids.
+(define (validities)
+  (filter (lambda (line)
+	    (member (:type line) '(pub uid fpr)))
+	  (gpg-with-colons '(--list-keys))))
+
+;; Run a trustdb check after keyblocks have changed and make sure it
+;; was an incremental one.  Then run a complete check and make sure
+;; both yield the same validities.
+(define (check-incremental what)
+  (info "Checking after" what)
+  (let ((result (call-with-io `(,@GPG --check-trustdb --yes) "")))
+    (if (not (= 0 (:retcode result)))
+	(fail "incremental trustdb check failed:" (:stderr result)))
+    (if (not (string-contains? (:stderr result) "revalidating"))
+	(fail "trustdb check was not incremental:" (:stderr result))))
+  (let ((incremental (validities)))
+    ;; Without recorded changes the check is a complete walk.
+    (updatetrustdb)
+    (let ((complete (validities)))
+      (if (not (equal? incremental complete))
+	  (fail "incremental check yields" incremental
+		"but a complete check yields" complete)))))
+
+;; Remove one of Grace's three marginally trusted signers.
+(call-check `(,@GPG --output frank.gpg --export ,FRANK))
+(call-check `(,@GPG --batch --yes --delete-keys ,FRANK))
+(check-incremental "deleting a signer")
+(checktrust GRACE "m")
+
+;; And bring it back.
+(call-check `(,@GPG --import frank.gpg))
+(check-incremental "importing a signer")
+(checktrust GRACE "f")
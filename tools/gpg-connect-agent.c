@@ -67,7 +67,8 @@ enum cmd_and_opt_values
     oDirmngr,
     oKeyboxd,
     oUIServer,
-    oNoAutostart
+    oNoAutostart,
+    oPipeline
 
   };
 
@@ -94,6 +95,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oRun,  "run",
                 N_("|FILE|run commands from FILE on startup")),
   ARGPARSE_s_n (oSubst, "subst",     N_("run /subst on startup")),
+  ARGPARSE_s_i (oPipeline, "pipeline",
+                N_("|N|send up to N commands before reading responses")),
 
   ARGPARSE_s_n (oNoAutostart, "no-autostart", "@"),
   ARGPARSE_s_n (oNoVerbose, "no-verbose", "@"),
@@ -127,9 +130,26 @@ struct
   unsigned int connect_flags;    /* Flags used for connecting. */
   int enable_varsubst;  /* Set if variable substitution is enabled.  */
   int trim_leading_spaces;
+  int pipeline;         /* Max. number of outstanding commands or 0.  */
 } opt;
 
 
+/* State of the --pipeline mode.  The send times and the withhash
+   flags of the outstanding commands are kept in ring buffers of size
+   OPT.PIPELINE.  */
+static struct
+{
+  int pending;                  /* Number of outstanding commands.  */
+  int head;                     /* Index of the oldest outstanding one.  */
+  unsigned long long *sent;     /* Send times of the commands.  */
+  char *withhash;               /* Withhash flags of the commands.  */
+  unsigned long long start;     /* Time the first command was sent.  */
+  unsigned long count;          /* Number of completed commands.  */
+  unsigned long long usec;      /* Sum of their latencies.  */
+  unsigned long long max_usec;  /* The largest latency.  */
+} pipeline;
+
+
 
 /* Definitions for /definq commands and a global linked list with all
    the definitions. */
@@ -189,6 +209,9 @@ static char *substitute_line_copy (const char *buffer);
 static int read_and_print_response (assuan_context_t ctx, int withhash,
                                     int *r_goterr);
 static assuan_context_t start_agent (void);
+static int read_pipelined_response (assuan_context_t ctx, int *r_goterr);
+static int flush_pipeline (assuan_context_t ctx);
+static void print_pipeline_stats (void);
 
 
 
@@ -1208,6 +1231,7 @@ main (int argc, char **argv)
         case oDirmngrProgram: opt.dirmngr_program = pargs.r.ret_str;  break;
         case oKeyboxdProgram: opt.keyboxd_program = pargs.r.ret_str;  break;
         case oNoAutostart:    opt.autostart = 0; break;
+        case oPipeline:  opt.pipeline = pargs.r.ret_int; break;
         case oHex:       opt.hex = 1; break;
         case oDecode:    opt.decode = 1; break;
         case oDirmngr:   opt.use_dirmngr = 1; break;
@@ -1281,6 +1305,14 @@ main (int argc, char **argv)
                 "--tcp-socket", "--raw-socket");
     }
 
+  if (opt.pipeline < 0)
+    opt.pipeline = 0;
+  if (opt.pipeline)
+    {
+      pipeline.sent = xcalloc (opt.pipeline, sizeof *pipeline.sent);
+      pipeline.withhash = xcalloc (opt.pipeline, 1);
+    }
+
   if (opt_run && !(script_fp = gpgrt_fopen (opt_run, "r")))
     {
       log_error ("cannot open run file '%s': %s\n",
@@ -1510,6 +1542,18 @@ main (int argc, char **argv)
           loopidx++;
         }
 
+      if (*line == '/' && pipeline.pending)
+        {
+          /* Control commands may depend on the previous responses.  */
+          rc = flush_pipeline (ctx);
+          if (rc && script_fp)
+            {
+              log_error ("stopping script execution\n");
+              gpgrt_fclose (script_fp);
+              script_fp = NULL;
+            }
+        }
+
       if (*line == '/')
         {
           /* Handle control commands. */
@@ -1868,7 +1912,20 @@ main (int argc, char **argv)
       if (*line == '#' || !*line)
         continue; /* Don't expect a response for a comment line. */
 
-      rc = read_and_print_response (ctx, help_cmd_p (line), &cmderr);
+      if (opt.pipeline)
+        {
+          int idx = (pipeline.head + pipeline.pending) % opt.pipeline;
+
+          pipeline.sent[idx] = gnupg_timing_now ();
+          pipeline.withhash[idx] = help_cmd_p (line);
+          if (!pipeline.count && !pipeline.pending)
+            pipeline.start = pipeline.sent[idx];
+          if (++pipeline.pending < opt.pipeline)
+            continue; /* Send the next command right away.  */
+          rc = read_pipelined_response (ctx, &cmderr);
+        }
+      else
+        rc = read_and_print_response (ctx, help_cmd_p (line), &cmderr);
       if (rc)
         log_info (_("receiving line failed: %s\n"), gpg_strerror (rc) );
       if ((rc || cmderr) && script_fp)
@@ -1886,6 +1943,11 @@ main (int argc, char **argv)
 	 early.  */
     }
 
+  if (pipeline.pending)
+    flush_pipeline (ctx);
+  if (opt.pipeline)
+    print_pipeline_stats ();
+
   if (opt.verbose)
     log_info ("closing connection to %s\n",
               opt.use_dirmngr? "dirmngr" :
@@ -1906,6 +1968,71 @@ main (int argc, char **argv)
 }
 
 
+/* Read the response for the oldest outstanding command in --pipeline
+ * mode and account for its latency.  Returns the same values as
+ * read_and_print_response.  */
+static int
+read_pipelined_response (assuan_context_t ctx, int *r_goterr)
+{
+  unsigned long long usec;
+  int rc;
+
+  log_assert (pipeline.pending);
+  rc = read_and_print_response (ctx, pipeline.withhash[pipeline.head],
+                                r_goterr);
+  usec = gnupg_timing_now () - pipeline.sent[pipeline.head];
+  pipeline.head = (pipeline.head + 1) % opt.pipeline;
+  pipeline.pending--;
+  pipeline.count++;
+  pipeline.usec += usec;
+  if (usec > pipeline.max_usec)
+    pipeline.max_usec = usec;
+  if (opt.verbose > 1)
+    log_info ("pipeline: response %lu after %llu us\n", pipeline.count, usec);
+  return rc;
+}
+
+
+/* Read the responses of all outstanding commands.  Returns an error
+ * code if the connection failed or a command returned an error.  */
+static int
+flush_pipeline (assuan_context_t ctx)
+{
+  int rc, cmderr;
+  int anyerr = 0;
+
+  while (pipeline.pending)
+    {
+      rc = read_pipelined_response (ctx, &cmderr);
+      if (rc)
+        {
+          log_info (_("receiving line failed: %s\n"), gpg_strerror (rc) );
+          pipeline.pending = 0;
+          return rc;
+        }
+      if (cmderr)
+        anyerr = 1;
+    }
+  return anyerr? gpg_error (GPG_ERR_GENERAL) : 0;
+}
+
+
+/* Print the statistics of the --pipeline mode.  */
+static void
+print_pipeline_stats (void)
+{
+  unsigned long long total;
+
+  if (!pipeline.count || opt.quiet)
+    return;
+  total = gnupg_timing_now () - pipeline.start;
+  log_info ("pipeline: %lu commands in %llu us"
+            " (latency avg %llu us, max %llu us)\n",
+            pipeline.count, total,
+            pipeline.usec / pipeline.count, pipeline.max_usec);
+}
+
+
 /* Handle an Inquire from the server.  Return False if it could not be
    handled; in this case the caller shll complete the operation.  LINE
    is the complete line as received from the server.  This function
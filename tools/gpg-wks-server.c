@@ -160,6 +160,7 @@ static gpg_error_t command_list_domains (void);
 static gpg_error_t command_revoke_key (const char *mailaddr);
 static gpg_error_t command_check_key (const char *mailaddr);
 static gpg_error_t command_cron (void);
+static gpg_error_t command_receive_files (int argc, char **argv);
 
 
 
@@ -365,9 +366,10 @@ main (int argc, char **argv)
   switch (cmd)
     {
     case aReceive:
-      if (argc)
-        wrong_args ("--receive");
-      err = wks_receive (es_stdin, command_receive_cb, NULL);
+      if (!argc)
+        err = wks_receive (es_stdin, command_receive_cb, NULL);
+      else
+        err = command_receive_files (argc, argv);
       break;
 
     case aCron:
@@ -426,6 +428,24 @@ main (int argc, char **argv)
 }
 
 
+/* Rename the freshly written file TMPFILE to FNAME.  On error
+ * TMPFILE is removed.  */
+static gpg_error_t
+publish_file (const char *tmpfile, const char *fname)
+{
+  gpg_error_t err;
+
+  err = gnupg_rename_file (tmpfile, fname, NULL);
+  if (err)
+    {
+      log_error ("renaming '%s' to '%s' failed: %s\n",
+                 tmpfile, fname, gpg_strerror (err));
+      gnupg_remove (tmpfile);
+    }
+  return err;
+}
+
+
 /* Take the key in KEYFILE and write it to OUTFILE in binary encoding.
  * If ADDRSPEC is given only matching user IDs are included in the
  * output.  */
@@ -437,6 +457,11 @@ copy_key_as_binary (const char *keyfile, const char *outfile,
   ccparray_t ccp;
   const char **argv = NULL;
   char *filterexp = NULL;
+  char *tmpfile;
+
+  /* Write to a temporary file and rename it so that a web server
+   * never sees a partially written key.  */
+  tmpfile = xstrconcat (outfile, ".tmp", NULL);
 
   if (addrspec)
     {
@@ -462,7 +487,7 @@ copy_key_as_binary (const char *keyfile, const char *outfile,
   ccparray_put (&ccp, "--always-trust");
   ccparray_put (&ccp, "--no-keyring");
   ccparray_put (&ccp, "--output");
-  ccparray_put (&ccp, outfile);
+  ccparray_put (&ccp, tmpfile);
   ccparray_put (&ccp, "--import-options=import-export");
   if (filterexp)
     {
@@ -485,10 +510,13 @@ copy_key_as_binary (const char *keyfile, const char *outfile,
   if (err)
     {
       log_error ("%s failed: %s\n", __func__, gpg_strerror (err));
+      gnupg_remove (tmpfile);
       goto leave;
     }
+  err = publish_file (tmpfile, outfile);
 
  leave:
+  xfree (tmpfile);
   xfree (filterexp);
   xfree (argv);
   return err;
@@ -503,6 +531,9 @@ copy_key_as_dane (const char *keyfile, const char *danefile)
   gpg_error_t err;
   ccparray_t ccp;
   const char **argv;
+  char *tmpfile;
+
+  tmpfile = xstrconcat (danefile, ".tmp", NULL);
 
   ccparray_init (&ccp, 0);
 
@@ -516,7 +547,7 @@ copy_key_as_dane (const char *keyfile, const char *danefile)
   ccparray_put (&ccp, "--always-trust");
   ccparray_put (&ccp, "--no-keyring");
   ccparray_put (&ccp, "--output");
-  ccparray_put (&ccp, danefile);
+  ccparray_put (&ccp, tmpfile);
   ccparray_put (&ccp, "--export-options=export-dane");
   ccparray_put (&ccp, "--import-options=import-export");
   ccparray_put (&ccp, "--import");
@@ -535,10 +566,13 @@ copy_key_as_dane (const char *keyfile, const char *danefile)
   if (err)
     {
       log_error ("%s failed: %s\n", __func__, gpg_strerror (err));
+      gnupg_remove (tmpfile);
       goto leave;
     }
+  err = publish_file (tmpfile, danefile);
 
  leave:
+  xfree (tmpfile);
   xfree (argv);
   return err;
 }
@@ -1600,6 +1634,41 @@ command_receive_cb (void *opaque, const char *mediatype,
 
 
 
+/* Process the mails stored in the ARGC files given by ARGV.  Errors
+ * are reported for each file but do not stop the processing of the
+ * other files.  Returns the first error.  */
+static gpg_error_t
+command_receive_files (int argc, char **argv)
+{
+  gpg_error_t err, firsterr = 0;
+  estream_t fp;
+
+  for (; argc; argc--, argv++)
+    {
+      if (opt.verbose)
+        log_info ("processing '%s'\n", *argv);
+      fp = es_fopen (*argv, "rb");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error opening '%s': %s\n", *argv, gpg_strerror (err));
+        }
+      else
+        {
+          err = wks_receive (fp, command_receive_cb, NULL);
+          if (err)
+            log_error ("error processing '%s': %s\n",
+                       *argv, gpg_strerror (err));
+          es_fclose (fp);
+        }
+      if (!firsterr)
+        firsterr = err;
+    }
+
+  return firsterr;
+}
+
+
 /* Return a list of all configured domains.  Each list element is the
  * top directory for the domain.  To figure out the actual domain
  * name strrchr(name, '/') can be used.  */
@@ -1703,6 +1772,12 @@ expire_one_domain (const char *top_dirname, const char *domain)
     {
       if (*dentry->d_name == '.')
         continue;
+      if (strlen (dentry->d_name) != 32)
+        {
+          log_info ("garbage file '%s/%s' ignored\n",
+                    dirname, dentry->d_name);
+          continue;
+        }
       xfree (fname);
       fname = make_filename_try (dirname, dentry->d_name, NULL);
       if (!fname)
@@ -1712,11 +1787,6 @@ expire_one_domain (const char *top_dirname, const char *domain)
                      __func__, gpg_strerror (err));
           goto leave;
         }
-      if (strlen (dentry->d_name) != 32)
-        {
-          log_info ("garbage file '%s' ignored\n", fname);
-          continue;
-        }
       if (stat (fname, &sb))
         {
           err = gpg_error_from_syserror ();
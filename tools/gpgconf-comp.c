@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
@@ -49,6 +50,7 @@
 #include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/status.h"
+#include "../common/membuf.h"
 
 #include "../common/gc-opt-flags.h"
 #include "gpgconf.h"
@@ -595,6 +597,10 @@ static gc_option_t gc_options_gpg_agent[] =
      GC_LEVEL_ADVANCED, "gnupg",
      N_("|N|set the Pinentry timeout to N seconds"),
      GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
+   { "pinentry-keep-alive", GC_OPT_FLAG_RUNTIME,
+     GC_LEVEL_EXPERT, "gnupg",
+     N_("|N|keep an idle Pinentry running for N seconds"),
+     GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
 
    GC_OPTION_NULL
  };
@@ -1252,23 +1258,27 @@ dirmngr_runtime_change (int killflag)
 }
 
 
-/* Launch the gpg-agent or the dirmngr if not already running.  */
-gpg_error_t
-gc_component_launch (int component)
+/* Print an error for the failed launch of COMPONENT.  */
+static void
+launcher_error (int component, gpg_error_t err)
+{
+  gc_error (0, 0, "error running '%s%s%s': %s",
+            gnupg_module_name (GNUPG_MODULE_NAME_CONNECT_AGENT),
+            component == GC_COMPONENT_DIRMNGR? " --dirmngr":"",
+            " NOP",
+            gpg_strerror (err));
+}
+
+
+/* Start the process to launch COMPONENT and store its pid at R_PID.
+ * This does not wait for the process.  */
+static gpg_error_t
+spawn_launcher (int component, pid_t *r_pid)
 {
   gpg_error_t err;
   const char *pgmname;
   const char *argv[5];
   int i;
-  pid_t pid;
-
-  if (component < 0)
-    {
-      err = gc_component_launch (GC_COMPONENT_GPG_AGENT);
-      if (!err)
-        err = gc_component_launch (GC_COMPONENT_DIRMNGR);
-      return err;
-    }
 
   if (!(component == GC_COMPONENT_GPG_AGENT
         || component == GC_COMPONENT_DIRMNGR))
@@ -1299,20 +1309,56 @@ gc_component_launch (int component)
   argv[i++] = "NOP";
   argv[i] = NULL;
 
-  err = gnupg_spawn_process_fd (pgmname, argv, -1, -1, -1, &pid);
-  if (!err)
-    err = gnupg_wait_process (pgmname, pid, 1, NULL);
+  err = gnupg_spawn_process_fd (pgmname, argv, -1, -1, -1, r_pid);
   if (err)
-    gc_error (0, 0, "error running '%s%s%s': %s",
-              pgmname,
-              component == GC_COMPONENT_DIRMNGR? " --dirmngr":"",
-              " NOP",
-              gpg_strerror (err));
+    launcher_error (component, err);
+  return err;
+}
+
+
+/* Wait for the launching process PID of COMPONENT started by
+ * spawn_launcher.  */
+static gpg_error_t
+wait_launcher (int component, pid_t pid)
+{
+  gpg_error_t err;
+
+  err = gnupg_wait_process (gnupg_module_name (GNUPG_MODULE_NAME_CONNECT_AGENT),
+                            pid, 1, NULL);
+  if (err)
+    launcher_error (component, err);
   gnupg_release_process (pid);
   return err;
 }
 
 
+/* Launch the gpg-agent or the dirmngr if not already running.  With
+ * COMPONENT -1 both are launched in parallel.  */
+gpg_error_t
+gc_component_launch (int component)
+{
+  gpg_error_t err, err2;
+  pid_t pid, pid2;
+
+  if (component < 0)
+    {
+      err = spawn_launcher (GC_COMPONENT_GPG_AGENT, &pid);
+      if (err)
+        return err;
+      err2 = spawn_launcher (GC_COMPONENT_DIRMNGR, &pid2);
+      err = wait_launcher (GC_COMPONENT_GPG_AGENT, pid);
+      if (!err2)
+        err2 = wait_launcher (GC_COMPONENT_DIRMNGR, pid2);
+      return err? err : err2;
+    }
+
+  err = spawn_launcher (component, &pid);
+  if (!err)
+    err = wait_launcher (component, pid);
+  return err;
+}
+
+
 /* Unconditionally restart COMPONENT.  */
 void
 gc_component_kill (int component)
@@ -2069,10 +2115,145 @@ get_config_filename (gc_component_t component, gc_backend_t backend)
 }
 
 
+/* Return a malloced string describing the state of the file FNAME.
+ * The string changes if the file is modified, replaced or removed;
+ * it ends with the file name.  */
+static char *
+file_stamp (const char *fname)
+{
+  struct stat sb;
+
+  if (stat (fname, &sb))
+    return xasprintf ("-:-:%s", fname);
+  return xasprintf ("%lu:%lu:%s",
+                    (unsigned long)sb.st_mtime, (unsigned long)sb.st_size,
+                    fname);
+}
+
+
+/* Return the name of the file used to cache the --gpgconf-list
+ * output of the program of BACKEND.  Caller must free.  */
+static char *
+options_cache_filename (gc_backend_t backend)
+{
+  return make_filename (gnupg_homedir (), GPGCONF_NAME "-cache.d",
+                        gc_backend[backend].program, NULL);
+}
+
+
+/* Check whether a valid cached --gpgconf-list output of the program
+ * PGMNAME of BACKEND exists and return a stream positioned at the
+ * cached output.  The cache is valid if it has been written by this
+ * version of gpgconf and neither the program nor its config file
+ * have been changed since then.  Returns NULL if the program needs
+ * to be run.  */
+static estream_t
+read_options_cache (gc_backend_t backend, const char *pgmname)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t length;
+  char *stamp = NULL;
+  char *p;
+  int lnr, okay = 0;
+
+  fname = options_cache_filename (backend);
+  fp = es_fopen (fname, "r");
+  xfree (fname);
+  if (!fp)
+    return NULL;
+
+  /* The first three lines are the version of gpgconf, the stamp of
+   * the program and the stamp of the config file.  */
+  for (lnr=0; lnr < 3; lnr++)
+    {
+      length = es_read_line (fp, &line, &line_len, NULL);
+      if (length <= 0 || line[length-1] != '\n')
+        break;
+      line[--length] = 0;
+      if (!lnr)
+        {
+          if (strcmp (line, VERSION))
+            break;
+          continue;
+        }
+      if (lnr == 1)
+        p = (char*)pgmname;
+      else if ((p = strchr (line, ':')) && (p = strchr (p+1, ':')))
+        p++;
+      else
+        break;
+      xfree (stamp);
+      stamp = file_stamp (p);
+      if (strcmp (line, stamp))
+        break;
+      if (lnr == 2)
+        okay = 1;
+    }
+
+  xfree (stamp);
+  xfree (line);
+  if (!okay)
+    {
+      es_fclose (fp);
+      fp = NULL;
+    }
+  return fp;
+}
+
+
+/* Store the --gpgconf-list output DATA of length DATALEN of the
+ * program PGMNAME of BACKEND in the cache.  CONFIG_FILENAME is the
+ * config file used by the program.  Errors are silently ignored.  */
+static void
+write_options_cache (gc_backend_t backend, const char *pgmname,
+                     const char *config_filename,
+                     const void *data, size_t datalen)
+{
+  char *fname, *tmpfname, *p;
+  char *stamp1, *stamp2;
+  estream_t fp;
+  int rc;
+
+  fname = options_cache_filename (backend);
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+
+  /* Create the directory; we don't care if it already exists.  */
+  p = strrchr (fname, '/');
+  log_assert (p);
+  *p = 0;
+  gnupg_mkdir (fname, "-rwx");
+  *p = '/';
+
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    goto leave;
+  stamp1 = file_stamp (pgmname);
+  stamp2 = file_stamp (config_filename);
+  es_fprintf (fp, "%s\n%s\n%s\n", VERSION, stamp1, stamp2);
+  xfree (stamp1);
+  xfree (stamp2);
+  es_write (fp, data, datalen, NULL);
+  rc = es_ferror (fp);
+  if (es_fclose (fp) || rc)
+    gnupg_remove (tmpfname);
+  else if (gnupg_rename_file (tmpfname, fname, NULL))
+    gnupg_remove (tmpfname);
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
 /* Retrieve the options for the component COMPONENT from backend
  * BACKEND, which we already know is a program-type backend.  With
  * ONLY_INSTALLED set components which are not installed are silently
- * ignored. */
+ * ignored.  The output of the program is cached in the home
+ * directory so that repeated invocations do not need to spawn it
+ * again.  */
 static void
 retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
                                int only_installed)
@@ -2082,12 +2263,14 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
   const char *argv[2];
   estream_t outfp;
   int exitcode;
-  pid_t pid;
+  pid_t pid = (pid_t)(-1);
   char *line = NULL;
   size_t line_len = 0;
   ssize_t length;
   estream_t config;
   char *config_filename;
+  membuf_t mb;
+  int cached;
 
   pgmname = (gc_backend[backend].module_name
              ? gnupg_module_name (gc_backend[backend].module_name)
@@ -2100,12 +2283,18 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
       return;  /* The component is not installed.  */
     }
 
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
+  outfp = read_options_cache (backend, pgmname);
+  cached = !!outfp;
+  if (!cached)
     {
-      gc_error (1, 0, "could not gather active options from '%s': %s",
-                pgmname, gpg_strerror (err));
+      err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
+                                 NULL, &outfp, NULL, &pid);
+      if (err)
+        {
+          gc_error (1, 0, "could not gather active options from '%s': %s",
+                    pgmname, gpg_strerror (err));
+        }
+      init_membuf (&mb, 1024);
     }
 
   while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
@@ -2115,6 +2304,9 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
       unsigned long flags = 0;
       char *default_value = NULL;
 
+      if (!cached)
+        put_membuf (&mb, line, length);
+
       /* Strip newline and carriage return, if present.  */
       while (length > 0
 	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
@@ -2182,16 +2374,29 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
   if (es_fclose (outfp))
     gc_error (1, errno, "error closing %s", pgmname);
 
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
-
+  if (!cached)
+    {
+      err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
+      if (err)
+        gc_error (1, 0, "running %s failed (exitcode=%d): %s",
+                  pgmname, exitcode, gpg_strerror (err));
+      gnupg_release_process (pid);
+    }
 
   /* At this point, we can parse the configuration file.  */
   config_filename = get_config_filename (component, backend);
 
+  if (!cached)
+    {
+      size_t datalen;
+      char *data = get_membuf (&mb, &datalen);
+
+      if (data)
+        write_options_cache (backend, pgmname, config_filename,
+                             data, datalen);
+      xfree (data);
+    }
+
   config = es_fopen (config_filename, "r");
   if (!config)
     {
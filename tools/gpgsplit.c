@@ -530,13 +530,33 @@ handle_bzip2(int algo,FILE *fpin,FILE *fpout)
 }
 #endif /* HAVE_BZIP2 */
 
+/* Copy N bytes from FPIN to FPOUT.  Returns 0 on success, -1 on a
+   read error or premature EOF and 2 on a write error.  */
+static int
+copy_bytes (FILE *fpin, FILE *fpout, unsigned long n)
+{
+  char buffer[8192];
+  size_t nbytes;
+
+  for (; n; n -= nbytes)
+    {
+      nbytes = n < sizeof buffer? n : sizeof buffer;
+      if (fread (buffer, nbytes, 1, fpin) != 1)
+        return -1;
+      if (fwrite (buffer, nbytes, 1, fpout) != 1)
+        return 2;
+    }
+  return 0;
+}
+
+
 /* hdr must point to a buffer large enough to hold all header bytes */
 static int
 write_part (FILE *fpin, unsigned long pktlen,
             int pkttype, int partial, unsigned char *hdr, size_t hdrlen)
 {
   FILE *fpout;
-  int c, first;
+  int c, first, rc;
   unsigned char *p;
   const char *outname = create_filename (pkttype);
 
@@ -663,13 +683,11 @@ write_part (FILE *fpin, unsigned long pktlen,
                     goto write_error;
                 }
               partlen = 1 << (c & 0x1f);
-              for (; partlen; partlen--)
-                {
-                  if ((c = getc (fpin)) == EOF)
-                    goto read_error;
-                  if ( putc (c, fpout) == EOF )
-                    goto write_error;
-                }
+              rc = copy_bytes (fpin, fpout, partlen);
+              if (rc == -1)
+                goto read_error;
+              else if (rc)
+                goto write_error;
             }
         }
       else if (partial == 2)
@@ -686,14 +704,11 @@ write_part (FILE *fpin, unsigned long pktlen,
             }
           if (!partlen)
             partial = 0; /* end of packet */
-          for (; partlen; partlen--)
-            {
-              c = getc (fpin);
-              if (c == EOF)
-                goto read_error;
-              if ( putc (c, fpout) == EOF )
-                goto write_error;
-            }
+          rc = copy_bytes (fpin, fpout, partlen);
+          if (rc == -1)
+            goto read_error;
+          else if (rc)
+            goto write_error;
         }
       else
         { /* compressed: read to end */
@@ -729,9 +744,12 @@ write_part (FILE *fpin, unsigned long pktlen,
             }
           else
             {
-              while ( (c=getc (fpin)) != EOF )
+              char buffer[8192];
+              size_t nread;
+
+              while ((nread = fread (buffer, 1, sizeof buffer, fpin)))
                 {
-                  if ( putc (c, fpout) == EOF )
+                  if (fwrite (buffer, nread, 1, fpout) != 1)
                     goto write_error;
                 }
             }
@@ -747,14 +765,11 @@ write_part (FILE *fpin, unsigned long pktlen,
     }
 
   /* standard packet or last segment of partial length encoded packet */
-  for (; pktlen; pktlen--)
-    {
-      c = getc (fpin);
-      if (c == EOF)
-        goto read_error;
-      if ( putc (c, fpout) == EOF )
-        goto write_error;
-    }
+  rc = copy_bytes (fpin, fpout, pktlen);
+  if (rc == -1)
+    goto read_error;
+  else if (rc)
+    goto write_error;
 
  ready:
   if ( !opt_no_split && fclose (fpout) )
@@ -878,6 +893,8 @@ split_packets (const char *fname)
       log_error ("can't open '%s': %s\n", fname, strerror (errno));
       return;
     }
+  /* Packets are copied in large blocks; use a matching read buffer.  */
+  setvbuf (fp, NULL, _IOFBF, 65536);
 
   while ( !(rc = do_split (fp)) )
     ;
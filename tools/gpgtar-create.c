@@ -41,6 +41,9 @@
 #include "../common/ccparray.h"
 #include "gpgtar.h"
 
+#ifdef HAVE_FSTATAT
+# include <fcntl.h>
+#endif
 #ifndef HAVE_LSTAT
 #define lstat(a,b) stat ((a), (b))
 #endif
@@ -54,6 +57,7 @@ struct scanctrl_s
   tar_header_t flist;
   tar_header_t *flist_tail;
   int nestlevel;
+  int dirfd;    /* Descriptor of the directory being scanned or -1.  */
 };
 
 
@@ -133,15 +137,29 @@ fillup_entry_w32 (tar_header_t hdr)
 
 
 /* Given a fresh header object HDR with only the name field set, try
-   to gather all available info.  This is the POSIX version.  */
+   to gather all available info.  This is the POSIX version.  If
+   DIRFD is not -1 it is the descriptor of the directory holding
+   ENTRYNAME; this allows to stat the entry without resolving the
+   full path again.  */
 #ifndef HAVE_W32_SYSTEM
 static gpg_error_t
-fillup_entry_posix (tar_header_t hdr)
+fillup_entry_posix (tar_header_t hdr, int dirfd, const char *entryname)
 {
   gpg_error_t err;
   struct stat sbuf;
+  int rc;
 
-  if (lstat (hdr->name, &sbuf))
+#ifdef HAVE_FSTATAT
+  if (dirfd != -1 && entryname)
+    rc = fstatat (dirfd, entryname, &sbuf, AT_SYMLINK_NOFOLLOW);
+  else
+#endif
+    {
+      (void)dirfd;
+      (void)entryname;
+      rc = lstat (hdr->name, &sbuf);
+    }
+  if (rc)
     {
       err = gpg_error_from_syserror ();
       log_error ("error stat-ing '%s': %s\n", hdr->name, gpg_strerror (err));
@@ -247,7 +265,7 @@ add_entry (const char *dname, const char *entryname, scanctrl_t scanctrl)
 #ifdef HAVE_DOSISH_SYSTEM
   err = fillup_entry_w32 (hdr);
 #else
-  err = fillup_entry_posix (hdr);
+  err = fillup_entry_posix (hdr, scanctrl->dirfd, entryname);
 #endif
   if (err)
     xfree (hdr);
@@ -263,10 +281,56 @@ add_entry (const char *dname, const char *entryname, scanctrl_t scanctrl)
 }
 
 
+/* Helper for sort_entries.  */
+static int
+compare_entries (const void *a, const void *b)
+{
+  const tar_header_t *hdra = a;
+  const tar_header_t *hdrb = b;
+
+  return strcmp ((*hdra)->name, (*hdrb)->name);
+}
+
+
+/* Sort the entries of the file list starting at START by name and
+   fix up the tail pointer of SCANCTRL.  This makes the order of the
+   archive members independent of the order in which the file system
+   returns the directory entries.  */
+static gpg_error_t
+sort_entries (tar_header_t *start, scanctrl_t scanctrl)
+{
+  tar_header_t hdr, *array;
+  size_t n, idx;
+
+  for (n=0, hdr = *start; hdr; hdr = hdr->next)
+    n++;
+  if (n < 2)
+    return 0;
+
+  array = xtrycalloc (n, sizeof *array);
+  if (!array)
+    return gpg_error_from_syserror ();
+  for (idx=0, hdr = *start; hdr; hdr = hdr->next)
+    array[idx++] = hdr;
+  qsort (array, n, sizeof *array, compare_entries);
+
+  for (idx=0; idx < n; idx++)
+    {
+      *start = array[idx];
+      start = &array[idx]->next;
+    }
+  *start = NULL;
+  scanctrl->flist_tail = start;
+  xfree (array);
+  return 0;
+}
+
+
 static gpg_error_t
 scan_directory (const char *dname, scanctrl_t scanctrl)
 {
   gpg_error_t err = 0;
+  tar_header_t *start_tail = scanctrl->flist_tail;
 
 #ifdef HAVE_W32_SYSTEM
   WIN32_FIND_DATAW fi;
@@ -356,6 +420,8 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
  leave:
   if (hd != INVALID_HANDLE_VALUE)
     FindClose (hd);
+  if (!err)
+    err = sort_entries (start_tail, scanctrl);
 
 #else /*!HAVE_W32_SYSTEM*/
   DIR *dir;
@@ -373,6 +439,9 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
       return err;
     }
 
+#ifdef HAVE_FSTATAT
+  scanctrl->dirfd = dirfd (dir);
+#endif
   while ((de = readdir (dir)))
     {
       if (!strcmp (de->d_name, "." ) || !strcmp (de->d_name, ".."))
@@ -384,7 +453,10 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
      }
 
  leave:
+  scanctrl->dirfd = -1;
   closedir (dir);
+  if (!err)
+    err = sort_entries (start_tail, scanctrl);
 #endif /*!HAVE_W32_SYSTEM*/
   return err;
 }
@@ -656,8 +728,10 @@ write_file (estream_t stream, tar_header_t hdr)
 {
   gpg_error_t err;
   char record[RECORDSIZE];
+  char *buffer = NULL;
   estream_t infp;
   size_t nread, nbytes;
+  unsigned long long remaining;
   int any;
 
   err = build_header (record, hdr);
@@ -691,14 +765,20 @@ write_file (estream_t stream, tar_header_t hdr)
 
   if (hdr->typeflag == TF_REGULAR)
     {
+      /* Copy the data in large chunks and pad only the last record
+       * of the file.  */
       hdr->nrecords = (hdr->size + RECORDSIZE-1)/RECORDSIZE;
+      buffer = xtrymalloc (COPYBUFSIZE);
+      if (!buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
       any = 0;
-      while (hdr->nrecords--)
+      for (remaining = hdr->size; remaining; remaining -= nbytes)
         {
-          nbytes = hdr->nrecords? RECORDSIZE : (hdr->size % RECORDSIZE);
-          if (!nbytes)
-            nbytes = RECORDSIZE;
-          nread = es_fread (record, 1, nbytes, infp);
+          nbytes = remaining < COPYBUFSIZE? (size_t)remaining : COPYBUFSIZE;
+          nread = es_fread (buffer, 1, nbytes, infp);
           if (nread != nbytes)
             {
               err = gpg_error_from_syserror ();
@@ -708,9 +788,26 @@ write_file (estream_t stream, tar_header_t hdr)
               goto leave;
             }
           any = 1;
-          err = write_record (stream, record);
-          if (err)
-            goto leave;
+          if (es_fwrite (buffer, 1, nbytes, stream) != nbytes)
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error writing '%s': %s\n",
+                         es_fname_get (stream), gpg_strerror (err));
+              goto leave;
+            }
+        }
+      nbytes = hdr->size % RECORDSIZE;
+      if (nbytes)
+        {
+          memset (record, 0, RECORDSIZE);
+          if (es_fwrite (record, 1, RECORDSIZE - nbytes, stream)
+              != RECORDSIZE - nbytes)
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error writing '%s': %s\n",
+                         es_fname_get (stream), gpg_strerror (err));
+              goto leave;
+            }
         }
       nread = es_fread (record, 1, 1, infp);
       if (nread)
@@ -718,6 +815,7 @@ write_file (estream_t stream, tar_header_t hdr)
     }
 
  leave:
+  xfree (buffer);
   if (err)
     es_fclose (infp);
   else if ((err = es_fclose (infp)))
@@ -761,6 +859,7 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
 
   memset (scanctrl, 0, sizeof *scanctrl);
   scanctrl->flist_tail = &scanctrl->flist;
+  scanctrl->dirfd = -1;
 
   if (opt.directory && gnupg_chdir (opt.directory))
     {
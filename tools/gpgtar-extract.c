@@ -39,8 +39,9 @@ extract_regular (estream_t stream, const char *dirname,
                  tarinfo_t info, tar_header_t hdr)
 {
   gpg_error_t err;
-  char record[RECORDSIZE];
-  size_t n, nbytes, nwritten;
+  char *buffer = NULL;
+  unsigned long long remaining, datalen;
+  size_t nbytes, nread, nwritten;
   char *fname;
   estream_t outfp = NULL;
 
@@ -65,31 +66,47 @@ extract_regular (estream_t stream, const char *dirname,
       goto leave;
     }
 
-  for (n=0; n < hdr->nrecords;)
+  /* Copy the data in large chunks; the padding of the last record
+   * is read but not written.  */
+  buffer = xtrymalloc (COPYBUFSIZE);
+  if (!buffer)
     {
-      err = read_record (stream, record);
-      if (err)
-        goto leave;
-      info->nblocks++;
-      n++;
-      if (n < hdr->nrecords || (hdr->size && !(hdr->size % RECORDSIZE)))
-        nbytes = RECORDSIZE;
-      else
-        nbytes = (hdr->size % RECORDSIZE);
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  datalen = hdr->size;
+  for (remaining = hdr->nrecords * RECORDSIZE; remaining; remaining -= nread)
+    {
+      nread = remaining < COPYBUFSIZE? (size_t)remaining : COPYBUFSIZE;
+      if (es_fread (buffer, 1, nread, stream) != nread)
+        {
+          err = gpg_error_from_syserror ();
+          if (es_ferror (stream))
+            log_error ("error reading '%s': %s\n",
+                       es_fname_get (stream), gpg_strerror (err));
+          else
+            log_error ("error reading '%s': premature EOF\n",
+                       es_fname_get (stream));
+          goto leave;
+        }
+      info->nblocks += nread / RECORDSIZE;
 
-      nwritten = es_fwrite (record, 1, nbytes, outfp);
+      nbytes = nread < datalen? nread : (size_t)datalen;
+      nwritten = es_fwrite (buffer, 1, nbytes, outfp);
       if (nwritten != nbytes)
         {
           err = gpg_error_from_syserror ();
           log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
           goto leave;
         }
+      datalen -= nbytes;
     }
   /* Fixme: Set permissions etc.  */
 
  leave:
   if (!err && opt.verbose)
     log_info ("extracted '%s'\n", fname);
+  xfree (buffer);
   es_fclose (outfp);
   if (err && fname && outfp)
     {
@@ -197,16 +214,11 @@ extract (estream_t stream, const char *dirname, tarinfo_t info,
     err = extract_directory (dirname, hdr);
   else
     {
-      char record[RECORDSIZE];
-
       log_info ("unsupported file type %d for '%s' - skipped\n",
                 (int)hdr->typeflag, hdr->name);
-      for (err = 0, n=0; !err && n < hdr->nrecords; n++)
-        {
-          err = read_record (stream, record);
-          if (!err)
-            info->nblocks++;
-        }
+      err = skip_records (stream, hdr->nrecords);
+      if (!err)
+        info->nblocks += hdr->nrecords;
     }
   return err;
 }
@@ -233,15 +233,9 @@ read_header (estream_t stream, tarinfo_t info, tar_header_t *r_header)
 static int
 skip_data (estream_t stream, tarinfo_t info, tar_header_t header)
 {
-  char record[RECORDSIZE];
-  unsigned long long n;
-
-  for (n=0; n < header->nrecords; n++)
-    {
-      if (read_record (stream, record))
-        return -1;
-      info->nblocks++;
-    }
+  if (skip_records (stream, header->nrecords))
+    return -1;
+  info->nblocks += header->nrecords;
 
   return 0;
 }
@@ -540,6 +540,34 @@ read_record (estream_t stream, void *record)
 }
 
 
+/* Skip NRECORDS records of STREAM.  If STREAM is seekable, as it is
+   for a plain archive file or the memory stream holding a decrypted
+   archive, this is done without reading the data.  Returns 0 on
+   success and an error code on failure; a diagnostic is printed as
+   well.  A truncated archive is not detected here but by the next
+   read.  */
+gpg_error_t
+skip_records (estream_t stream, unsigned long long nrecords)
+{
+  gpg_error_t err;
+  char record[RECORDSIZE];
+
+  if (!nrecords)
+    return 0;
+
+  if (nrecords < ((unsigned long long)1 << 52)
+      && !es_fseeko (stream, (gpgrt_off_t)(nrecords * RECORDSIZE), SEEK_CUR))
+    return 0;
+
+  /* Not seekable (e.g. a pipe) - read the records.  */
+  for (; nrecords; nrecords--)
+    if ((err = read_record (stream, record)))
+      return err;
+
+  return 0;
+}
+
+
 /* Write the RECORD of size RECORDSIZE to STREAM.  FILENAME is the
    name of the file used for diagnostics.  */
 gpg_error_t
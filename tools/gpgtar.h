@@ -57,6 +57,10 @@ typedef struct tarinfo_s *tarinfo_t;
    useless.  */
 #define RECORDSIZE 512
 
+/* The size of the buffer used to copy file data.  It must be a
+   multiple of RECORDSIZE.  */
+#define COPYBUFSIZE (2048 * RECORDSIZE)
+
 
 /* Description of the USTAR header format.  */
 struct ustar_raw_header
@@ -125,6 +129,7 @@ struct tar_header_s
 
 /*-- gpgtar.c --*/
 gpg_error_t read_record (estream_t stream, void *record);
+gpg_error_t skip_records (estream_t stream, unsigned long long nrecords);
 gpg_error_t write_record (estream_t stream, const void *record);
 
 /*-- gpgtar-create.c --*/